@@ -29,6 +29,9 @@ local_use_libcros := $(if $(BRILLO_USE_LIBCROS),$(BRILLO_USE_LIBCROS),0)
 local_use_mtd := $(if $(BRILLO_USE_MTD),$(BRILLO_USE_MTD),0)
 local_use_power_management := \
     $(if $(BRILLO_USE_POWER_MANAGEMENT),$(BRILLO_USE_POWER_MANAGEMENT),0)
+# "prefs_log" stores the non-volatile prefs in a single log file instead of a
+# file per key.
+local_use_prefs_log := $(if $(BRILLO_USE_PREFS_LOG),$(BRILLO_USE_PREFS_LOG),0)
 local_use_weave := $(if $(BRILLO_USE_WEAVE),$(BRILLO_USE_WEAVE),0)
 
 ue_common_cflags := \
@@ -38,6 +41,7 @@ ue_common_cflags := \
     -DUSE_LIBCROS=$(local_use_libcros) \
     -DUSE_MTD=$(local_use_mtd) \
     -DUSE_POWER_MANAGEMENT=$(local_use_power_management) \
+    -DUSE_PREFS_LOG=$(local_use_prefs_log) \
     -DUSE_WEAVE=$(local_use_weave) \
     -D_FILE_OFFSET_BITS=64 \
     -D_POSIX_C_SOURCE=199309L \
@@ -142,6 +146,8 @@ ue_libpayload_consumer_exported_static_libraries := \
     update_metadata-protos \
     libxz-host \
     libbz \
+    libz \
+    libzstd \
     $(ue_update_metadata_protos_exported_static_libraries)
 ue_libpayload_consumer_exported_shared_libraries := \
     libcrypto-host \
@@ -149,34 +155,60 @@ ue_libpayload_consumer_exported_shared_libraries := \
 
 ue_libpayload_consumer_src_files := \
     common/action_processor.cc \
+    common/async_log_sink.cc \
     common/boot_control_stub.cc \
     common/clock.cc \
     common/constants.cc \
     common/cpu_limiter.cc \
+    common/download_scheduler.cc \
     common/error_code_utils.cc \
+    common/gzip.cc \
     common/hash_calculator.cc \
     common/http_common.cc \
     common/http_fetcher.cc \
     common/file_fetcher.cc \
     common/hwid_override.cc \
+    common/memory_pressure_monitor.cc \
+    common/memory_tracker.cc \
     common/multi_range_http_fetcher.cc \
+    common/payload_staging_cache.cc \
     common/platform_constants_android.cc \
     common/prefs.cc \
+    common/resource_usage.cc \
+    common/staging_http_fetcher.cc \
     common/subprocess.cc \
     common/terminator.cc \
+    common/throughput_estimator.cc \
+    common/trace_log.cc \
     common/utils.cc \
+    common/write_behind_prefs.cc \
+    payload_consumer/async_file_descriptor.cc \
+    payload_consumer/bspatch_applier.cc \
     payload_consumer/bzip_extent_writer.cc \
+    payload_consumer/comparing_file_descriptor.cc \
     payload_consumer/delta_performer.cc \
     payload_consumer/download_action.cc \
     payload_consumer/extent_writer.cc \
     payload_consumer/file_descriptor.cc \
     payload_consumer/file_writer.cc \
     payload_consumer/filesystem_verifier_action.cc \
+    payload_consumer/hash_tree_builder.cc \
+    payload_consumer/imgpatch_applier.cc \
+    payload_consumer/inline_target_hasher.cc \
     payload_consumer/install_plan.cc \
+    payload_consumer/interruptible_file_descriptor.cc \
+    payload_consumer/operation_executor.cc \
+    payload_consumer/operation_stats.cc \
+    payload_consumer/packed_extents.cc \
     payload_consumer/payload_constants.cc \
     payload_consumer/payload_verifier.cc \
     payload_consumer/postinstall_runner_action.cc \
-    payload_consumer/xz_extent_writer.cc
+    payload_consumer/source_block_cache.cc \
+    payload_consumer/source_hash_precomputer.cc \
+    payload_consumer/target_trimmer.cc \
+    payload_consumer/throttled_file_descriptor.cc \
+    payload_consumer/xz_extent_writer.cc \
+    payload_consumer/zstd_extent_writer.cc
 
 ifeq ($(HOST_OS),linux)
 # Build for the host.
@@ -301,15 +333,18 @@ LOCAL_SHARED_LIBRARIES := \
     $(ue_libpayload_consumer_exported_shared_libraries:-host=) \
     $(ue_update_metadata_protos_exported_shared_libraries)
 LOCAL_SRC_FILES := \
+    bandwidth_manager.cc \
     boot_control_android.cc \
     certificate_checker.cc \
     common_service.cc \
     connection_manager.cc \
+    connection_warmer.cc \
     daemon.cc \
     dbus_service.cc \
     hardware_android.cc \
     image_properties_android.cc \
     libcros_proxy.cc \
+    libcurl_connection_cache.cc \
     libcurl_http_fetcher.cc \
     metrics.cc \
     metrics_utils.cc \
@@ -320,6 +355,7 @@ LOCAL_SRC_FILES := \
     payload_state.cc \
     proxy_resolver.cc \
     real_system_state.cc \
+    resource_governor.cc \
     shill_proxy.cc \
     update_attempter.cc \
     update_manager/boxed_value.cc \
@@ -327,6 +363,8 @@ LOCAL_SRC_FILES := \
     update_manager/default_policy.cc \
     update_manager/evaluation_context.cc \
     update_manager/policy.cc \
+    update_manager/policy_stats.cc \
+    update_manager/policy_trace.cc \
     update_manager/real_config_provider.cc \
     update_manager/real_device_policy_provider.cc \
     update_manager/real_random_provider.cc \
@@ -335,8 +373,11 @@ LOCAL_SRC_FILES := \
     update_manager/real_time_provider.cc \
     update_manager/real_updater_provider.cc \
     update_manager/state_factory.cc \
+    update_manager/timer_wheel.cc \
     update_manager/update_manager.cc \
     update_status_utils.cc \
+    url_probe_action.cc \
+    url_throughput_history.cc \
     utils_android.cc \
     weave_service_factory.cc
 ifeq ($(local_use_binder),1)
@@ -413,6 +454,7 @@ LOCAL_SRC_FILES += \
     daemon.cc \
     daemon_state_android.cc \
     hardware_android.cc \
+    libcurl_connection_cache.cc \
     libcurl_http_fetcher.cc \
     network_selector_android.cc \
     proxy_resolver.cc \
@@ -430,7 +472,6 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := update_engine
 LOCAL_MODULE_CLASS := EXECUTABLES
 LOCAL_REQUIRED_MODULES := \
-    bspatch \
     cacerts_google
 ifeq ($(local_use_weave),1)
 LOCAL_REQUIRED_MODULES += updater.json
@@ -475,8 +516,6 @@ LOCAL_MODULE := update_engine_sideload
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
 LOCAL_MODULE_CLASS := EXECUTABLES
-LOCAL_REQUIRED_MODULES := \
-    bspatch_recovery
 LOCAL_CPP_EXTENSION := .cc
 LOCAL_CLANG := true
 LOCAL_CFLAGS := \
@@ -558,6 +597,7 @@ LOCAL_SHARED_LIBRARIES := \
     libbrillo
 LOCAL_SRC_FILES := \
     client_library/client.cc \
+    client_library/throttled_status_update_handler.cc \
     update_status_utils.cc
 
 # We can only compile support for one IPC mechanism. If both "binder" and "dbus"
@@ -642,27 +682,40 @@ ue_libpayload_generator_exported_shared_libraries := \
 ue_libpayload_generator_src_files := \
     payload_generator/ab_generator.cc \
     payload_generator/annotated_operation.cc \
+    payload_generator/apply_report.cc \
     payload_generator/blob_file_writer.cc \
     payload_generator/block_mapping.cc \
+    payload_generator/bsdiff_generator.cc \
     payload_generator/bzip.cc \
+    payload_generator/compact_graph.cc \
     payload_generator/cycle_breaker.cc \
     payload_generator/delta_diff_generator.cc \
     payload_generator/delta_diff_utils.cc \
+    payload_generator/diff_cache.cc \
     payload_generator/ext2_filesystem.cc \
     payload_generator/extent_ranges.cc \
     payload_generator/extent_utils.cc \
     payload_generator/full_update_generator.cc \
+    payload_generator/generation_profile.cc \
     payload_generator/graph_types.cc \
     payload_generator/graph_utils.cc \
+    payload_generator/image_index_cache.cc \
+    payload_generator/imgdiff_generator.cc \
     payload_generator/inplace_generator.cc \
     payload_generator/mapfile_filesystem.cc \
+    payload_generator/mapped_image.cc \
+    payload_generator/partition_shard.cc \
     payload_generator/payload_file.cc \
     payload_generator/payload_generation_config.cc \
+    payload_generator/payload_merger.cc \
     payload_generator/payload_signer.cc \
     payload_generator/raw_filesystem.cc \
+    payload_generator/sparse_image.cc \
+    payload_generator/squashfs_filesystem.cc \
     payload_generator/tarjan.cc \
     payload_generator/topological_sort.cc \
-    payload_generator/xz_android.cc
+    payload_generator/xz_android.cc \
+    payload_generator/zstd.cc
 
 ifeq ($(HOST_OS),linux)
 # Build for the host.
@@ -899,65 +952,112 @@ LOCAL_SHARED_LIBRARIES := \
     $(ue_libupdate_engine_exported_shared_libraries:-host=) \
     $(ue_libpayload_generator_exported_shared_libraries:-host=)
 LOCAL_SRC_FILES := \
+    bandwidth_manager_unittest.cc \
     certificate_checker_unittest.cc \
+    client_library/throttled_status_update_handler.cc \
+    client_library/throttled_status_update_handler_unittest.cc \
     common/action_pipe_unittest.cc \
     common/action_processor_unittest.cc \
     common/action_unittest.cc \
+    common/async_log_sink_unittest.cc \
     common/cpu_limiter_unittest.cc \
+    common/download_scheduler_unittest.cc \
     common/fake_prefs.cc \
     common/file_fetcher_unittest.cc \
+    common/gzip_unittest.cc \
     common/hash_calculator_unittest.cc \
     common/http_fetcher_unittest.cc \
     common/hwid_override_unittest.cc \
+    common/memory_pressure_monitor_unittest.cc \
+    common/memory_tracker_unittest.cc \
     common/mock_http_fetcher.cc \
+    common/payload_staging_cache_unittest.cc \
     common/prefs_unittest.cc \
+    common/resource_usage_unittest.cc \
+    common/staging_http_fetcher_unittest.cc \
     common/subprocess_unittest.cc \
     common/terminator_unittest.cc \
+    common/throughput_estimator_unittest.cc \
+    common/trace_log_unittest.cc \
     common/test_utils.cc \
     common/utils_unittest.cc \
+    common/write_behind_prefs_unittest.cc \
     common_service_unittest.cc \
     connection_manager_unittest.cc \
+    connection_warmer_unittest.cc \
     fake_shill_proxy.cc \
     fake_system_state.cc \
+    libcurl_connection_cache_unittest.cc \
     metrics_utils_unittest.cc \
     omaha_request_action_unittest.cc \
     omaha_request_params_unittest.cc \
     omaha_response_handler_action_unittest.cc \
     p2p_manager_unittest.cc \
+    payload_consumer/async_file_descriptor_unittest.cc \
+    payload_consumer/bspatch_applier_unittest.cc \
     payload_consumer/bzip_extent_writer_unittest.cc \
+    payload_consumer/comparing_file_descriptor_unittest.cc \
     payload_consumer/delta_performer_integration_test.cc \
     payload_consumer/delta_performer_unittest.cc \
     payload_consumer/download_action_unittest.cc \
     payload_consumer/extent_writer_unittest.cc \
     payload_consumer/file_writer_unittest.cc \
     payload_consumer/filesystem_verifier_action_unittest.cc \
+    payload_consumer/hash_tree_builder_unittest.cc \
+    payload_consumer/imgpatch_applier_unittest.cc \
+    payload_consumer/inline_target_hasher_unittest.cc \
+    payload_consumer/interruptible_file_descriptor_unittest.cc \
+    payload_consumer/operation_executor_unittest.cc \
+    payload_consumer/operation_stats_unittest.cc \
+    payload_consumer/packed_extents_unittest.cc \
     payload_consumer/postinstall_runner_action_unittest.cc \
+    payload_consumer/source_block_cache_unittest.cc \
+    payload_consumer/source_hash_precomputer_unittest.cc \
+    payload_consumer/target_trimmer_unittest.cc \
+    payload_consumer/throttled_file_descriptor_unittest.cc \
     payload_consumer/xz_extent_writer_unittest.cc \
+    payload_consumer/zstd_extent_writer_unittest.cc \
     payload_generator/ab_generator_unittest.cc \
+    payload_generator/apply_report_unittest.cc \
     payload_generator/blob_file_writer_unittest.cc \
     payload_generator/block_mapping_unittest.cc \
+    payload_generator/bsdiff_generator_unittest.cc \
+    payload_generator/compact_graph_unittest.cc \
     payload_generator/cycle_breaker_unittest.cc \
     payload_generator/delta_diff_utils_unittest.cc \
+    payload_generator/diff_cache_unittest.cc \
     payload_generator/ext2_filesystem_unittest.cc \
     payload_generator/extent_ranges_unittest.cc \
     payload_generator/extent_utils_unittest.cc \
     payload_generator/fake_filesystem.cc \
     payload_generator/full_update_generator_unittest.cc \
+    payload_generator/generation_profile_unittest.cc \
     payload_generator/graph_utils_unittest.cc \
+    payload_generator/image_index_cache_unittest.cc \
+    payload_generator/imgdiff_generator_unittest.cc \
     payload_generator/inplace_generator_unittest.cc \
     payload_generator/mapfile_filesystem_unittest.cc \
+    payload_generator/mapped_image_unittest.cc \
+    payload_generator/partition_shard_unittest.cc \
     payload_generator/payload_file_unittest.cc \
     payload_generator/payload_generation_config_unittest.cc \
+    payload_generator/payload_merger_unittest.cc \
     payload_generator/payload_signer_unittest.cc \
+    payload_generator/sparse_image_unittest.cc \
+    payload_generator/squashfs_filesystem_unittest.cc \
     payload_generator/tarjan_unittest.cc \
     payload_generator/topological_sort_unittest.cc \
     payload_generator/zip_unittest.cc \
+    payload_generator/zstd_unittest.cc \
     payload_state_unittest.cc \
+    resource_governor_unittest.cc \
     update_attempter_unittest.cc \
     update_manager/boxed_value_unittest.cc \
     update_manager/chromeos_policy_unittest.cc \
     update_manager/evaluation_context_unittest.cc \
     update_manager/generic_variables_unittest.cc \
+    update_manager/policy_stats_unittest.cc \
+    update_manager/policy_trace_unittest.cc \
     update_manager/prng_unittest.cc \
     update_manager/real_config_provider_unittest.cc \
     update_manager/real_device_policy_provider_unittest.cc \
@@ -966,15 +1066,103 @@ LOCAL_SRC_FILES := \
     update_manager/real_system_provider_unittest.cc \
     update_manager/real_time_provider_unittest.cc \
     update_manager/real_updater_provider_unittest.cc \
+    update_manager/timer_wheel_unittest.cc \
     update_manager/umtest_utils.cc \
     update_manager/update_manager_unittest.cc \
     update_manager/variable_unittest.cc \
+    url_probe_action_unittest.cc \
+    url_throughput_history_unittest.cc \
     testrunner.cc
 ifeq ($(local_use_libcros),1)
 LOCAL_SRC_FILES += \
     chrome_browser_proxy_resolver_unittest.cc
 endif  # local_use_libcros == 1
 include $(BUILD_NATIVE_TEST)
+
+# update_engine_benchmarks (type: executable)
+# ========================================================
+# Microbenchmarks of the payload consumer.
+include $(CLEAR_VARS)
+LOCAL_MODULE := update_engine_benchmarks
+LOCAL_MODULE_TAGS := eng
+LOCAL_REQUIRED_MODULES := \
+    ue_unittest_key.pem \
+    ue_unittest_key.pub.pem
+LOCAL_MODULE_PATH := $(TARGET_OUT_DATA_NATIVE_TESTS)/update_engine_unittests
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(ue_common_cflags)
+LOCAL_CPPFLAGS := $(ue_common_cppflags)
+LOCAL_LDFLAGS := $(ue_common_ldflags)
+LOCAL_C_INCLUDES := $(ue_common_c_includes)
+LOCAL_STATIC_LIBRARIES := \
+    libpayload_consumer \
+    libpayload_generator \
+    $(ue_libpayload_consumer_exported_static_libraries:-host=) \
+    $(ue_libpayload_generator_exported_static_libraries:-host=)
+LOCAL_SHARED_LIBRARIES := \
+    $(ue_common_shared_libraries) \
+    $(ue_libpayload_consumer_exported_shared_libraries:-host=) \
+    $(ue_libpayload_generator_exported_shared_libraries:-host=)
+LOCAL_SRC_FILES := \
+    common/test_alloc_counter.cc \
+    payload_consumer/payload_consumer_benchmark.cc
+include $(BUILD_EXECUTABLE)
+
+# update_engine_apply_benchmark (type: executable)
+# ========================================================
+# End-to-end benchmark of the payload application.
+include $(CLEAR_VARS)
+LOCAL_MODULE := update_engine_apply_benchmark
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE_PATH := $(TARGET_OUT_DATA_NATIVE_TESTS)/update_engine_unittests
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(ue_common_cflags)
+LOCAL_CPPFLAGS := $(ue_common_cppflags)
+LOCAL_LDFLAGS := $(ue_common_ldflags)
+LOCAL_C_INCLUDES := $(ue_common_c_includes)
+LOCAL_STATIC_LIBRARIES := \
+    libpayload_consumer \
+    libpayload_generator \
+    $(ue_libpayload_consumer_exported_static_libraries:-host=) \
+    $(ue_libpayload_generator_exported_static_libraries:-host=)
+LOCAL_SHARED_LIBRARIES := \
+    $(ue_common_shared_libraries) \
+    $(ue_libpayload_consumer_exported_shared_libraries:-host=) \
+    $(ue_libpayload_generator_exported_shared_libraries:-host=)
+LOCAL_SRC_FILES := \
+    payload_consumer/payload_apply_benchmark.cc
+include $(BUILD_EXECUTABLE)
+
+# update_engine_policy_benchmark (type: executable)
+# ========================================================
+# Replay of the recorded policy evaluations of the Update Manager.
+include $(CLEAR_VARS)
+LOCAL_MODULE := update_engine_policy_benchmark
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE_PATH := $(TARGET_OUT_DATA_NATIVE_TESTS)/update_engine_unittests
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(ue_common_cflags)
+LOCAL_CPPFLAGS := $(ue_common_cppflags)
+LOCAL_LDFLAGS := $(ue_common_ldflags)
+LOCAL_C_INCLUDES := \
+    $(ue_common_c_includes) \
+    $(ue_libupdate_engine_exported_c_includes)
+LOCAL_STATIC_LIBRARIES := \
+    libupdate_engine \
+    $(ue_libupdate_engine_exported_static_libraries:-host=)
+LOCAL_SHARED_LIBRARIES := \
+    $(ue_common_shared_libraries) \
+    $(ue_libupdate_engine_exported_shared_libraries:-host=)
+LOCAL_SRC_FILES := \
+    common/test_alloc_counter.cc \
+    update_manager/policy_replay_benchmark.cc
+include $(BUILD_EXECUTABLE)
 endif  # BRILLO
 
 # Weave schema files
@@ -0,0 +1,182 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/bandwidth_manager.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+#include "update_engine/common/clock_interface.h"
+#include "update_engine/common/hardware_interface.h"
+#include "update_engine/connection_manager_interface.h"
+
+using base::Time;
+using base::TimeDelta;
+using brillo::MessageLoop;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// How often the rate is measured and the limit updated.
+const int kUpdateIntervalSeconds = 10;
+
+// The weight, in percent, of the last rate measured in the estimated capacity.
+const int64_t kCapacityWeightPercent = 30;
+
+// The local hours during which the device is most likely in use, and the
+// percentage of the capacity background downloads may use then.
+const int kActiveHoursStart = 8;
+const int kActiveHoursEnd = 22;
+const int64_t kActiveHoursPercent = 50;
+
+// The percentage of the capacity background downloads may use over a
+// cellular or tethered connection.
+const int64_t kMeteredPercent = 25;
+
+// Background downloads are never limited below this rate, which is well above
+// the low speed limits of the fetchers.
+const int64_t kMinRateBps = 64 * 1024;
+
+}  // namespace
+
+BandwidthManager::BandwidthManager(SystemState* system_state)
+    : system_state_(system_state) {}
+
+BandwidthManager::~BandwidthManager() {
+  Stop();
+}
+
+void BandwidthManager::Start(HttpFetcher* fetcher, bool interactive) {
+  if (update_rate_id_ != MessageLoop::kTaskIdNull) {
+    LOG(ERROR) << "The bandwidth manager is already running.";
+    Stop();
+  }
+  fetcher_ = fetcher;
+  interactive_ = interactive;
+  bytes_received_ = 0;
+  last_update_time_ = system_state_->clock()->GetMonotonicTime();
+  current_rate_bps_ = 0;
+  target_rate_bps_ = 0;
+  update_rate_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&BandwidthManager::UpdateRate, base::Unretained(this)),
+      TimeDelta::FromSeconds(kUpdateIntervalSeconds));
+}
+
+void BandwidthManager::Stop() {
+  if (update_rate_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(update_rate_id_);
+    update_rate_id_ = MessageLoop::kTaskIdNull;
+  }
+  // The fetcher may already be gone, and isn't reused anyway.
+  fetcher_ = nullptr;
+  current_rate_bps_ = 0;
+  target_rate_bps_ = 0;
+}
+
+void BandwidthManager::BytesReceived(uint64_t bytes) {
+  bytes_received_ += bytes;
+}
+
+void BandwidthManager::UpdateRate() {
+  update_rate_id_ = MessageLoop::kTaskIdNull;
+  if (!fetcher_)
+    return;
+
+  Time now = system_state_->clock()->GetMonotonicTime();
+  int64_t elapsed_ms = (now - last_update_time_).InMilliseconds();
+  if (elapsed_ms > 0) {
+    current_rate_bps_ = bytes_received_ * 1000 / elapsed_ms;
+    // Nothing is learnt about the link while the download is paused.
+    if (current_rate_bps_ > 0) {
+      if (target_rate_bps_ > 0 &&
+          current_rate_bps_ * 10 >= target_rate_bps_ * 9) {
+        // The download is held back by the limit, so the link is at least as
+        // fast as the rate measured.
+        estimated_capacity_bps_ =
+            std::max(estimated_capacity_bps_, current_rate_bps_);
+      } else if (estimated_capacity_bps_ == 0) {
+        estimated_capacity_bps_ = current_rate_bps_;
+      } else {
+        estimated_capacity_bps_ =
+            (estimated_capacity_bps_ * (100 - kCapacityWeightPercent) +
+             current_rate_bps_ * kCapacityWeightPercent) / 100;
+      }
+    }
+  }
+  bytes_received_ = 0;
+  last_update_time_ = now;
+
+  // Limits are applied right away, but are lifted by doubling the limit at
+  // every interval so the download doesn't flood the link all at once.
+  int64_t goal_rate_bps = ComputeGoalRate();
+  int64_t target_rate_bps = goal_rate_bps;
+  if (target_rate_bps_ > 0 &&
+      (goal_rate_bps == 0 || goal_rate_bps > target_rate_bps_)) {
+    target_rate_bps = target_rate_bps_ * 2;
+    if (goal_rate_bps == 0 ? target_rate_bps >= estimated_capacity_bps_
+                           : target_rate_bps >= goal_rate_bps) {
+      target_rate_bps = goal_rate_bps;
+    }
+  }
+  if (target_rate_bps != target_rate_bps_) {
+    LOG(INFO) << "Changing the download rate limit from " << target_rate_bps_
+              << " to " << target_rate_bps << " bytes/sec (0 for none), "
+              << "estimated capacity " << estimated_capacity_bps_
+              << " bytes/sec.";
+    target_rate_bps_ = target_rate_bps;
+    fetcher_->set_max_receive_speed(static_cast<int>(std::min<int64_t>(
+        target_rate_bps_, std::numeric_limits<int>::max())));
+  }
+
+  update_rate_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&BandwidthManager::UpdateRate, base::Unretained(this)),
+      TimeDelta::FromSeconds(kUpdateIntervalSeconds));
+}
+
+int64_t BandwidthManager::ComputeGoalRate() {
+  // The capacity is measured without any limit first.
+  if (interactive_ || estimated_capacity_bps_ == 0 ||
+      system_state_->hardware()->IsOnACPower()) {
+    return 0;
+  }
+
+  int64_t percent = 100;
+  NetworkConnectionType type;
+  NetworkTethering tethering;
+  if (system_state_->connection_manager()->GetConnectionProperties(
+          &type, &tethering) &&
+      (type == NetworkConnectionType::kCellular ||
+       tethering == NetworkTethering::kConfirmed ||
+       tethering == NetworkTethering::kSuspected)) {
+    percent = kMeteredPercent;
+  }
+  Time::Exploded exploded;
+  system_state_->clock()->GetWallclockTime().LocalExplode(&exploded);
+  if (exploded.hour >= kActiveHoursStart && exploded.hour < kActiveHoursEnd)
+    percent = percent * kActiveHoursPercent / 100;
+
+  if (percent >= 100)
+    return 0;
+  return std::max(kMinRateBps, estimated_capacity_bps_ * percent / 100);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_BANDWIDTH_MANAGER_H_
+#define UPDATE_ENGINE_BANDWIDTH_MANAGER_H_
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
+#include "update_engine/common/http_fetcher.h"
+#include "update_engine/system_state.h"
+
+namespace chromeos_update_engine {
+
+// Manages the rate of the payload download. It estimates the capacity of the
+// link from the rate observed and limits background downloads to a fraction of
+// it, depending on the connection type and the time of day, so they don't
+// compete with the traffic of the user. The limit is raised step by step when
+// the device goes on AC power. Interactive downloads are never limited.
+class BandwidthManager {
+ public:
+  explicit BandwidthManager(SystemState* system_state);
+  ~BandwidthManager();
+
+  // Starts managing the rate of |fetcher|, not owned, which must outlive the
+  // call to Stop().
+  void Start(HttpFetcher* fetcher, bool interactive);
+
+  // Stops updating the limit of the fetcher. The estimated capacity is kept
+  // for the next download.
+  void Stop();
+
+  // Sets whether the download is interactive, which lifts the limit from the
+  // next update of the rate, for the rest of the download.
+  void set_interactive(bool interactive) { interactive_ = interactive; }
+
+  // Accounts for |bytes| more received by the fetcher.
+  void BytesReceived(uint64_t bytes);
+
+  // The rate measured over the last interval, the current limit, 0 when the
+  // download isn't limited, and the estimated capacity of the link, all in
+  // bytes/sec.
+  int64_t current_rate_bps() const { return current_rate_bps_; }
+  int64_t target_rate_bps() const { return target_rate_bps_; }
+  int64_t estimated_capacity_bps() const { return estimated_capacity_bps_; }
+
+ private:
+  FRIEND_TEST(BandwidthManagerTest, ActiveHoursOnBatteryTest);
+  FRIEND_TEST(BandwidthManagerTest, CapacityEstimateTest);
+  FRIEND_TEST(BandwidthManagerTest, InteractiveTest);
+  FRIEND_TEST(BandwidthManagerTest, RampUpOnACPowerTest);
+
+  // Measures the rate over the last interval, updates the estimated capacity
+  // and the limit of the fetcher, and schedules the next update.
+  void UpdateRate();
+
+  // Returns the limit the rate should eventually have in the current
+  // conditions, or 0 for no limit.
+  int64_t ComputeGoalRate();
+
+  // Interface for the system state, e.g. the clock and connection manager.
+  SystemState* system_state_;
+
+  // The fetcher whose rate is managed, or nullptr when stopped.
+  HttpFetcher* fetcher_{nullptr};
+  bool interactive_{false};
+
+  // The bytes received since |last_update_time_|.
+  uint64_t bytes_received_{0};
+  base::Time last_update_time_;
+
+  int64_t current_rate_bps_{0};
+  int64_t target_rate_bps_{0};
+  int64_t estimated_capacity_bps_{0};
+
+  brillo::MessageLoop::TaskId update_rate_id_{brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(BandwidthManager);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_BANDWIDTH_MANAGER_H_
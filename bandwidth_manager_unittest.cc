@@ -0,0 +1,145 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/bandwidth_manager.h"
+
+#include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/fake_system_state.h"
+
+using base::Time;
+using base::TimeDelta;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgPointee;
+using testing::_;
+
+namespace chromeos_update_engine {
+
+class BandwidthManagerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    fake_system_state_.fake_clock()->SetMonotonicTime(Time::FromInternalValue(
+        1000000));
+    SetLocalHour(3);
+  }
+
+  void TearDown() override {
+    bandwidth_manager_.Stop();
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  void SetLocalHour(int hour) {
+    Time::Exploded exploded = {2016, 6, 0, 1, hour, 0, 0, 0};
+    fake_system_state_.fake_clock()->SetWallclockTime(
+        Time::FromLocalExploded(exploded));
+  }
+
+  void SetConnectionType(NetworkConnectionType type) {
+    ON_CALL(*fake_system_state_.mock_connection_manager(),
+            GetConnectionProperties(_, _))
+        .WillByDefault(DoAll(SetArgPointee<0>(type),
+                             SetArgPointee<1>(NetworkTethering::kNotDetected),
+                             Return(true)));
+  }
+
+  // Receives data at |rate_bps| for an interval, then updates the rate.
+  void ReceiveAtRate(int64_t rate_bps) {
+    FakeClock* clock = fake_system_state_.fake_clock();
+    clock->SetMonotonicTime(clock->GetMonotonicTime() +
+                            TimeDelta::FromSeconds(10));
+    bandwidth_manager_.BytesReceived(rate_bps * 10);
+    bandwidth_manager_.UpdateRate();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakeSystemState fake_system_state_;
+  MockHttpFetcher fetcher_{nullptr, 0, nullptr};
+  BandwidthManager bandwidth_manager_{&fake_system_state_};
+};
+
+TEST_F(BandwidthManagerTest, CapacityEstimateTest) {
+  bandwidth_manager_.Start(&fetcher_, false);
+  ReceiveAtRate(1000000);
+  EXPECT_EQ(1000000, bandwidth_manager_.current_rate_bps());
+  EXPECT_EQ(1000000, bandwidth_manager_.estimated_capacity_bps());
+  // The estimate follows the rate measured without a limit.
+  ReceiveAtRate(500000);
+  EXPECT_EQ(850000, bandwidth_manager_.estimated_capacity_bps());
+  // Intervals without data, e.g. while paused, don't change it.
+  ReceiveAtRate(0);
+  EXPECT_EQ(0, bandwidth_manager_.current_rate_bps());
+  EXPECT_EQ(850000, bandwidth_manager_.estimated_capacity_bps());
+  EXPECT_EQ(0, bandwidth_manager_.target_rate_bps());
+  EXPECT_EQ(0, fetcher_.max_receive_speed_bps());
+}
+
+TEST_F(BandwidthManagerTest, InteractiveTest) {
+  SetLocalHour(12);
+  SetConnectionType(NetworkConnectionType::kCellular);
+  bandwidth_manager_.Start(&fetcher_, true);
+  ReceiveAtRate(1000000);
+  ReceiveAtRate(1000000);
+  EXPECT_EQ(0, bandwidth_manager_.target_rate_bps());
+  EXPECT_EQ(0, fetcher_.max_receive_speed_bps());
+}
+
+TEST_F(BandwidthManagerTest, ActiveHoursOnBatteryTest) {
+  SetLocalHour(12);
+  SetConnectionType(NetworkConnectionType::kWifi);
+  bandwidth_manager_.Start(&fetcher_, false);
+  // The first interval measures the capacity, the limit is then half of it.
+  ReceiveAtRate(1000000);
+  EXPECT_EQ(500000, bandwidth_manager_.target_rate_bps());
+  EXPECT_EQ(500000, fetcher_.max_receive_speed_bps());
+
+  // Saturating the limit doesn't lower the capacity estimate.
+  ReceiveAtRate(500000);
+  EXPECT_EQ(1000000, bandwidth_manager_.estimated_capacity_bps());
+  EXPECT_EQ(500000, fetcher_.max_receive_speed_bps());
+
+  // Outside of the active hours the download isn't limited.
+  SetLocalHour(23);
+  ReceiveAtRate(500000);
+  EXPECT_EQ(0, fetcher_.max_receive_speed_bps());
+}
+
+TEST_F(BandwidthManagerTest, RampUpOnACPowerTest) {
+  SetConnectionType(NetworkConnectionType::kCellular);
+  bandwidth_manager_.Start(&fetcher_, false);
+  ReceiveAtRate(1000000);
+  EXPECT_EQ(250000, fetcher_.max_receive_speed_bps());
+
+  // The limit is doubled at every interval until it reaches the capacity.
+  fake_system_state_.fake_hardware()->SetIsOnACPower(true);
+  ReceiveAtRate(250000);
+  EXPECT_EQ(500000, fetcher_.max_receive_speed_bps());
+  ReceiveAtRate(500000);
+  EXPECT_EQ(0, fetcher_.max_receive_speed_bps());
+  EXPECT_EQ(0, bandwidth_manager_.target_rate_bps());
+
+  // A new limit is applied right away.
+  fake_system_state_.fake_hardware()->SetIsOnACPower(false);
+  ReceiveAtRate(1000000);
+  EXPECT_EQ(250000, fetcher_.max_receive_speed_bps());
+}
+
+}  // namespace chromeos_update_engine
@@ -59,6 +59,13 @@ void BinderUpdateEngineAndroidService::SendPayloadApplicationComplete(
   }
 }
 
+void BinderUpdateEngineAndroidService::SendPayloadPrecheckComplete(
+    ErrorCode error_code) {
+  for (auto& callback : callbacks_) {
+    callback->onPayloadPrecheckComplete(static_cast<int>(error_code));
+  }
+}
+
 Status BinderUpdateEngineAndroidService::bind(
     const android::sp<IUpdateEngineCallback>& callback, bool* return_value) {
   callbacks_.emplace_back(callback);
@@ -100,6 +107,26 @@ Status BinderUpdateEngineAndroidService::applyPayload(
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::precheckPayload(
+    const android::String16& url,
+    int64_t payload_offset,
+    int64_t payload_size,
+    const std::vector<android::String16>& header_kv_pairs) {
+  const std::string payload_url{android::String8{url}.string()};
+  std::vector<std::string> str_headers;
+  str_headers.reserve(header_kv_pairs.size());
+  for (const auto& header : header_kv_pairs) {
+    str_headers.emplace_back(android::String8{header}.string());
+  }
+
+  brillo::ErrorPtr error;
+  if (!service_delegate_->PrecheckPayload(
+          payload_url, payload_offset, payload_size, str_headers, &error)) {
+    return ErrorPtrToStatus(error);
+  }
+  return Status::ok();
+}
+
 Status BinderUpdateEngineAndroidService::suspend() {
   brillo::ErrorPtr error;
   if (!service_delegate_->SuspendUpdate(&error))
@@ -101,6 +101,10 @@ Status BinderUpdateEngineBrilloService::RebootIfNeeded() {
   return CallCommonHandler(&UpdateEngineService::RebootIfNeeded);
 }
 
+Status BinderUpdateEngineBrilloService::SetFastMode(bool fast_mode) {
+  return CallCommonHandler(&UpdateEngineService::SetFastMode, fast_mode);
+}
+
 Status BinderUpdateEngineBrilloService::SetChannel(
     const String16& target_channel, bool powerwash) {
   return CallCommonHandler(&UpdateEngineService::SetChannel,
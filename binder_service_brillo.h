@@ -64,6 +64,7 @@ class BinderUpdateEngineBrilloService : public android::brillo::BnUpdateEngine,
   android::binder::Status GetStatus(
       android::brillo::ParcelableUpdateEngineStatus* status);
   android::binder::Status RebootIfNeeded() override;
+  android::binder::Status SetFastMode(bool fast_mode) override;
   android::binder::Status SetChannel(const android::String16& target_channel,
                                      bool powerwash) override;
   android::binder::Status GetChannel(bool get_current_channel,
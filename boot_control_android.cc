@@ -74,6 +74,8 @@ bool BootControlAndroid::Init() {
 
   module_ = reinterpret_cast<boot_control_module_t*>(const_cast<hw_module_t*>(hw_module));
   module_->init(module_);
+  num_slots_ = module_->getNumberSlots(module_);
+  current_slot_ = module_->getCurrentSlot(module_);
 
   LOG(INFO) << "Loaded boot_control HAL "
             << "'" << hw_module->name << "' "
@@ -84,11 +86,11 @@ bool BootControlAndroid::Init() {
 }
 
 unsigned int BootControlAndroid::GetNumSlots() const {
-  return module_->getNumberSlots(module_);
+  return num_slots_;
 }
 
 BootControlInterface::Slot BootControlAndroid::GetCurrentSlot() const {
-  return module_->getCurrentSlot(module_);
+  return current_slot_;
 }
 
 bool BootControlAndroid::GetPartitionDevice(const string& partition_name,
@@ -113,14 +115,24 @@ bool BootControlAndroid::GetPartitionDevice(const string& partition_name,
   // of misc and then finding an entry in /dev matching the sysfs
   // entry.
 
-  base::FilePath misc_device;
-  if (!utils::DeviceForMountPoint("/misc", &misc_device))
-    return false;
+  base::AutoLock auto_lock(cache_lock_);
+  auto cached = partition_devices_.find(std::make_pair(partition_name, slot));
+  if (cached != partition_devices_.end()) {
+    *device = cached->second;
+    return true;
+  }
 
-  if (!utils::IsSymlink(misc_device.value().c_str())) {
-    LOG(ERROR) << "Device file " << misc_device.value() << " for /misc "
-               << "is not a symlink.";
-    return false;
+  if (by_name_dir_.empty()) {
+    base::FilePath misc_device;
+    if (!utils::DeviceForMountPoint("/misc", &misc_device))
+      return false;
+
+    if (!utils::IsSymlink(misc_device.value().c_str())) {
+      LOG(ERROR) << "Device file " << misc_device.value() << " for /misc "
+                 << "is not a symlink.";
+      return false;
+    }
+    by_name_dir_ = misc_device.DirName();
   }
 
   const char* suffix = module_->getSuffix(module_, slot);
@@ -130,27 +142,37 @@ bool BootControlAndroid::GetPartitionDevice(const string& partition_name,
     return false;
   }
 
-  base::FilePath path = misc_device.DirName().Append(partition_name + suffix);
+  base::FilePath path = by_name_dir_.Append(partition_name + suffix);
   if (!base::PathExists(path)) {
     LOG(ERROR) << "Device file " << path.value() << " does not exist.";
     return false;
   }
 
   *device = path.value();
+  partition_devices_[std::make_pair(partition_name, slot)] = *device;
   return true;
 }
 
 bool BootControlAndroid::IsSlotBootable(Slot slot) const {
+  base::AutoLock auto_lock(cache_lock_);
+  auto cached = slots_bootable_.find(slot);
+  if (cached != slots_bootable_.end())
+    return cached->second;
   int ret = module_->isSlotBootable(module_, slot);
   if (ret < 0) {
     LOG(ERROR) << "Unable to determine if slot " << SlotName(slot)
                << " is bootable: " << strerror(-ret);
     return false;
   }
+  slots_bootable_[slot] = ret == 1;
   return ret == 1;
 }
 
 bool BootControlAndroid::MarkSlotUnbootable(Slot slot) {
+  {
+    base::AutoLock auto_lock(cache_lock_);
+    slots_bootable_.erase(slot);
+  }
   int ret = module_->setSlotAsUnbootable(module_, slot);
   if (ret < 0) {
     LOG(ERROR) << "Unable to mark slot " << SlotName(slot)
@@ -161,6 +183,10 @@ bool BootControlAndroid::MarkSlotUnbootable(Slot slot) {
 }
 
 bool BootControlAndroid::SetActiveBootSlot(Slot slot) {
+  {
+    base::AutoLock auto_lock(cache_lock_);
+    slots_bootable_.clear();
+  }
   int ret = module_->setActiveBootSlot(module_, slot);
   if (ret < 0) {
     LOG(ERROR) << "Unable to set the active slot to slot " << SlotName(slot)
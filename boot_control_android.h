@@ -17,8 +17,12 @@
 #ifndef UPDATE_ENGINE_BOOT_CONTROL_ANDROID_H_
 #define UPDATE_ENGINE_BOOT_CONTROL_ANDROID_H_
 
+#include <map>
 #include <string>
+#include <utility>
 
+#include <base/files/file_path.h>
+#include <base/synchronization/lock.h>
 #include <hardware/boot_control.h>
 #include <hardware/hardware.h>
 
@@ -28,6 +32,11 @@ namespace chromeos_update_engine {
 
 // The Android implementation of the BootControlInterface. This implementation
 // uses the libhardware's boot_control HAL to access the bootloader.
+//
+// The number of slots and the current slot don't change until the next boot,
+// so they are read once by Init(). The partition devices and whether the slots
+// are bootable are cached when queried, the latter until a slot is marked
+// unbootable or active.
 class BootControlAndroid : public BootControlInterface {
  public:
   BootControlAndroid() = default;
@@ -53,6 +62,17 @@ class BootControlAndroid : public BootControlInterface {
   // this is essentially leaked on object destruction.
   boot_control_module_t* module_;
 
+  unsigned int num_slots_{0};
+  Slot current_slot_{kInvalidSlot};
+
+  // The cached values, which may be queried from several threads.
+  mutable base::Lock cache_lock_;
+  // The directory of the by-name links of the partitions, if found.
+  mutable base::FilePath by_name_dir_;
+  mutable std::map<std::pair<std::string, Slot>, std::string>
+      partition_devices_;
+  mutable std::map<Slot, bool> slots_bootable_;
+
   DISALLOW_COPY_AND_ASSIGN(BootControlAndroid);
 };
 
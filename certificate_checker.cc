@@ -164,10 +164,21 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
   string storage_key =
       base::StringPrintf("%s-%d-%d", kPrefsUpdateServerCertificate,
                          static_cast<int>(server_to_check), depth);
+  // The same certificate is seen again in every connection to the server, so
+  // skip the prefs entirely when it matches the one we know is stored.
+  auto cached_digest = stored_digests_.find(storage_key);
+  if (cached_digest != stored_digests_.end() &&
+      cached_digest->second == digest_string) {
+    NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
+    return true;
+  }
+
   string stored_digest;
   // If there's no stored certificate, we just store the current one and return.
   if (!prefs_->GetString(storage_key, &stored_digest)) {
-    if (!prefs_->SetString(storage_key, digest_string)) {
+    if (prefs_->SetString(storage_key, digest_string)) {
+      stored_digests_[storage_key] = digest_string;
+    } else {
       LOG(WARNING) << "Failed to store server certificate on storage key "
                    << storage_key;
     }
@@ -178,7 +189,10 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
   // Certificate changed, we store a report to UMA and store the most recent
   // certificate.
   if (stored_digest != digest_string) {
-    if (!prefs_->SetString(storage_key, digest_string)) {
+    if (prefs_->SetString(storage_key, digest_string)) {
+      stored_digests_[storage_key] = digest_string;
+    } else {
+      stored_digests_.erase(storage_key);
       LOG(WARNING) << "Failed to store server certificate on storage key "
                    << storage_key;
     }
@@ -189,6 +203,7 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
     return true;
   }
 
+  stored_digests_[storage_key] = digest_string;
   NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
   // Since we don't perform actual SSL verification, we return success.
   return true;
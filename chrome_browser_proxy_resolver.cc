@@ -31,6 +31,7 @@ namespace chromeos_update_engine {
 
 using base::StringTokenizer;
 using base::TimeDelta;
+using base::TimeTicks;
 using brillo::MessageLoop;
 using std::deque;
 using std::make_pair;
@@ -46,11 +47,16 @@ namespace {
 
 const int kTimeout = 5;  // seconds
 
+// How long the proxies resolved by Chrome for an origin are reused.
+const int kCacheTimeoutSeconds = 300;
+
 }  // namespace
 
 ChromeBrowserProxyResolver::ChromeBrowserProxyResolver(
     LibCrosProxy* libcros_proxy)
-    : libcros_proxy_(libcros_proxy), timeout_(kTimeout) {}
+    : libcros_proxy_(libcros_proxy),
+      timeout_(kTimeout),
+      cache_timeout_(TimeDelta::FromSeconds(kCacheTimeoutSeconds)) {}
 
 bool ChromeBrowserProxyResolver::Init() {
   libcros_proxy_->ue_proxy_resolved_interface()
@@ -68,11 +74,28 @@ ChromeBrowserProxyResolver::~ChromeBrowserProxyResolver() {
     MessageLoop::current()->CancelTask(timer.second);
     timer.second = MessageLoop::kTaskIdNull;
   }
+  if (cached_replies_task_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(cached_replies_task_);
 }
 
 bool ChromeBrowserProxyResolver::GetProxiesForUrl(const string& url,
                                                   ProxiesResolvedFn callback,
                                                   void* data) {
+  auto cached = cache_.find(GetUrlOrigin(url));
+  if (cached != cache_.end()) {
+    if (TimeTicks::Now() < cached->second.expiration) {
+      cached_replies_.push_back({callback, data, cached->second.proxies});
+      if (cached_replies_task_ == MessageLoop::kTaskIdNull) {
+        cached_replies_task_ = MessageLoop::current()->PostTask(
+            FROM_HERE,
+            base::Bind(&ChromeBrowserProxyResolver::ReturnCachedProxies,
+                       base::Unretained(this)));
+      }
+      return true;
+    }
+    cache_.erase(cached);
+  }
+
   int timeout = timeout_;
   brillo::ErrorPtr error;
   if (!libcros_proxy_->service_interface_proxy()->ResolveNetworkProxy(
@@ -95,6 +118,10 @@ bool ChromeBrowserProxyResolver::GetProxiesForUrl(const string& url,
   return true;
 }
 
+void ChromeBrowserProxyResolver::ClearCache() {
+  cache_.clear();
+}
+
 bool ChromeBrowserProxyResolver::DeleteUrlState(
     const string& source_url,
     bool delete_timer,
@@ -133,10 +160,14 @@ void ChromeBrowserProxyResolver::OnProxyResolvedSignal(
     const string& error_message) {
   pair<ProxiesResolvedFn, void*> callback;
   TEST_AND_RETURN(DeleteUrlState(source_url, true, &callback));
+  deque<string> proxies = ParseProxyString(proxy_info);
   if (!error_message.empty()) {
     LOG(WARNING) << "ProxyResolved error: " << error_message;
+  } else {
+    cache_[GetUrlOrigin(source_url)] = {proxies,
+                                        TimeTicks::Now() + cache_timeout_};
   }
-  (*callback.first)(ParseProxyString(proxy_info), callback.second);
+  (*callback.first)(proxies, callback.second);
 }
 
 void ChromeBrowserProxyResolver::HandleTimeout(string source_url) {
@@ -148,6 +179,21 @@ void ChromeBrowserProxyResolver::HandleTimeout(string source_url) {
   (*callback.first)(proxies, callback.second);
 }
 
+void ChromeBrowserProxyResolver::ReturnCachedProxies() {
+  cached_replies_task_ = MessageLoop::kTaskIdNull;
+  // The callbacks may request more proxies, which are replied to next time.
+  deque<CachedReply> replies;
+  replies.swap(cached_replies_);
+  for (const CachedReply& reply : replies)
+    (*reply.callback)(reply.proxies, reply.data);
+}
+
+string ChromeBrowserProxyResolver::GetUrlOrigin(const string& url) {
+  size_t host_pos = url.find("://");
+  host_pos = host_pos == string::npos ? 0 : host_pos + 3;
+  return base::ToLowerASCII(url.substr(0, url.find('/', host_pos)));
+}
+
 deque<string> ChromeBrowserProxyResolver::ParseProxyString(
     const string& input) {
   deque<string> ret;
@@ -24,6 +24,7 @@
 
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/libcros_proxy.h"
@@ -47,7 +48,12 @@ class ChromeBrowserProxyResolver : public ProxyResolver {
                         ProxiesResolvedFn callback,
                         void* data) override;
 
+  // Forgets the proxies resolved so far, for example because the network
+  // changed.
+  void ClearCache();
+
  private:
+  FRIEND_TEST(ChromeBrowserProxyResolverTest, CacheTest);
   FRIEND_TEST(ChromeBrowserProxyResolverTest, ParseTest);
   FRIEND_TEST(ChromeBrowserProxyResolverTest, SuccessTest);
   typedef std::multimap<std::string, std::pair<ProxiesResolvedFn, void*>>
@@ -68,6 +74,13 @@ class ChromeBrowserProxyResolver : public ProxyResolver {
   // Handle no reply:
   void HandleTimeout(std::string source_url);
 
+  // Passes the cached proxies in |cached_replies_| to their callbacks.
+  void ReturnCachedProxies();
+
+  // Returns the scheme, host and port part of the |url|, which the proxies
+  // are cached by.
+  static std::string GetUrlOrigin(const std::string& url);
+
   // Parses a string-encoded list of proxies and returns a deque
   // of individual proxies. The last one will always be kNoProxy.
   static std::deque<std::string> ParseProxyString(const std::string& input);
@@ -90,6 +103,26 @@ class ChromeBrowserProxyResolver : public ProxyResolver {
   int timeout_;
   TimeoutsMap timers_;
   CallbacksMap callbacks_;
+
+  // The proxies Chrome resolved for each origin, along with when they
+  // expire. The timeouts aren't cached so Chrome is asked again next time.
+  struct CachedProxies {
+    std::deque<std::string> proxies;
+    base::TimeTicks expiration;
+  };
+  std::map<std::string, CachedProxies> cache_;
+  base::TimeDelta cache_timeout_;
+
+  // The requests answered from |cache_|, which are replied to from the
+  // message loop like the others.
+  struct CachedReply {
+    ProxiesResolvedFn callback;
+    void* data;
+    std::deque<std::string> proxies;
+  };
+  std::deque<CachedReply> cached_replies_;
+  brillo::MessageLoop::TaskId cached_replies_task_{
+      brillo::MessageLoop::kTaskIdNull};
   DISALLOW_COPY_AND_ASSIGN(ChromeBrowserProxyResolver);
 };
 
@@ -208,4 +208,22 @@ TEST_F(ChromeBrowserProxyResolverTest, NoChromeTest) {
   RunTest(false, false);
 }
 
+TEST_F(ChromeBrowserProxyResolverTest, CacheTest) {
+  EXPECT_EQ("http://example.com",
+            ChromeBrowserProxyResolver::GetUrlOrigin("HTTP://Example.com/a"));
+  EXPECT_EQ("https://example.com:8080",
+            ChromeBrowserProxyResolver::GetUrlOrigin(
+                "https://example.com:8080/a/b?c"));
+
+  // Chrome is asked once only for the URLs on the same origin.
+  RunTest(true, true);
+  EXPECT_TRUE(resolver_.GetProxiesForUrl("http://example.com/other",
+                                         &CheckResponseResolved, nullptr));
+  MessageLoop::current()->Run();
+
+  // And again after the cache is cleared.
+  resolver_.ClearCache();
+  RunTest(false, true);
+}
+
 }  // namespace chromeos_update_engine
@@ -86,6 +86,10 @@ bool BinderUpdateEngineClient::SetP2PUpdatePermission(bool enabled) {
   return service_->SetP2PUpdatePermission(enabled).isOk();
 }
 
+bool BinderUpdateEngineClient::SetFastMode(bool fast_mode) {
+  return service_->SetFastMode(fast_mode).isOk();
+}
+
 bool BinderUpdateEngineClient::GetP2PUpdatePermission(bool* enabled) const {
   return service_->GetP2PUpdatePermission(enabled).isOk();
 }
@@ -60,6 +60,8 @@ class BinderUpdateEngineClient : public UpdateEngineClient {
   bool SetP2PUpdatePermission(bool enabled) override;
   bool GetP2PUpdatePermission(bool* enabled) const override;
 
+  bool SetFastMode(bool fast_mode) override;
+
   bool Rollback(bool powerwash) override;
 
   bool GetRollbackPartition(std::string* rollback_partition) const override;
@@ -85,6 +85,10 @@ bool DBusUpdateEngineClient::SetP2PUpdatePermission(bool enabled) {
   return proxy_->SetP2PUpdatePermission(enabled, nullptr);
 }
 
+bool DBusUpdateEngineClient::SetFastMode(bool fast_mode) {
+  return proxy_->SetFastMode(fast_mode, nullptr);
+}
+
 bool DBusUpdateEngineClient::GetP2PUpdatePermission(bool* enabled) const {
   return proxy_->GetP2PUpdatePermission(enabled, nullptr);
 }
@@ -53,6 +53,8 @@ class DBusUpdateEngineClient : public UpdateEngineClient {
   bool SetP2PUpdatePermission(bool enabled) override;
   bool GetP2PUpdatePermission(bool* enabled) const override;
 
+  bool SetFastMode(bool fast_mode) override;
+
   bool Rollback(bool powerwash) override;
 
   bool GetRollbackPartition(std::string* rollback_partition) const override;
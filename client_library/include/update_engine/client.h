@@ -75,6 +75,10 @@ class UpdateEngineClient {
   virtual bool SetP2PUpdatePermission(bool enabled) = 0;
   virtual bool GetP2PUpdatePermission(bool* enabled) const = 0;
 
+  // Turns the fast mode, which lifts the resource and download rate limits of
+  // the update, on or off for the update in progress or the next one.
+  virtual bool SetFastMode(bool fast_mode) = 0;
+
   // Attempt a rollback. Set 'powerwash' to reset the device while rolling
   // back.
   virtual bool Rollback(bool powerwash) = 0;
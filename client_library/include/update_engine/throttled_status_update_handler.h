@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_CLIENT_LIBRARY_INCLUDE_THROTTLED_STATUS_UPDATE_HANDLER_H_
+#define UPDATE_ENGINE_CLIENT_LIBRARY_INCLUDE_THROTTLED_STATUS_UPDATE_HANDLER_H_
+
+#include <cstdint>
+#include <string>
+
+// client.h needs to come first since status_update_handler.h includes it.
+#include "update_engine/client.h"
+#include "update_engine/status_update_handler.h"
+#include "update_engine/update_status.h"
+
+namespace update_engine {
+
+// A StatusUpdateHandler passing the status updates on to another |handler| at
+// the rate a client asks for. Register it with
+// UpdateEngineClient::RegisterStatusUpdateHandler() in place of |handler|.
+//
+// A status update is passed on right away when the operation, the new version
+// or its size changes, or when the progress moved by at least
+// |min_progress_delta| since the last update passed on. The other updates are
+// coalesced so that at most one is passed on every |min_interval_ms|
+// milliseconds, the latest one. Of course, only the status updates broadcast
+// by update_engine can be passed on. The coalesced updates are passed on from
+// the current brillo::MessageLoop.
+class ThrottledStatusUpdateHandler : public StatusUpdateHandler {
+ public:
+  ThrottledStatusUpdateHandler(StatusUpdateHandler* handler,
+                               double min_progress_delta,
+                               int64_t min_interval_ms);
+  ~ThrottledStatusUpdateHandler() override;
+
+  // StatusUpdateHandler overrides.
+  void IPCError(const std::string& error) override;
+  void HandleStatusUpdate(int64_t last_checked_time,
+                          double progress,
+                          UpdateStatus current_operation,
+                          const std::string& new_version,
+                          int64_t new_size) override;
+
+ private:
+  struct Status {
+    int64_t last_checked_time;
+    double progress;
+    UpdateStatus current_operation;
+    std::string new_version;
+    int64_t new_size;
+  };
+
+  // Passes the |status| on to |handler_|.
+  void SendStatus(const Status& status);
+
+  // Passes the coalesced |pending_status_| on to |handler_|.
+  void SendPendingStatus();
+
+  StatusUpdateHandler* handler_;
+  double min_progress_delta_;
+  int64_t min_interval_ms_;
+
+  // The last status passed on, if any, and when.
+  bool status_sent_{false};
+  Status sent_status_;
+  int64_t sent_time_us_{0};
+
+  // The status waiting for the |pending_task_| to pass it on, and the
+  // brillo::MessageLoop::TaskId of that task or 0 (kTaskIdNull) if none.
+  Status pending_status_;
+  uint64_t pending_task_{0};
+
+  ThrottledStatusUpdateHandler(const ThrottledStatusUpdateHandler&) = delete;
+  void operator=(const ThrottledStatusUpdateHandler&) = delete;
+};
+
+}  // namespace update_engine
+
+#endif  // UPDATE_ENGINE_CLIENT_LIBRARY_INCLUDE_THROTTLED_STATUS_UPDATE_HANDLER_H_
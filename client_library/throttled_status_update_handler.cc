@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/client_library/include/update_engine/throttled_status_update_handler.h"
+
+#include <cmath>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+using brillo::MessageLoop;
+using std::string;
+
+namespace update_engine {
+
+ThrottledStatusUpdateHandler::ThrottledStatusUpdateHandler(
+    StatusUpdateHandler* handler,
+    double min_progress_delta,
+    int64_t min_interval_ms)
+    : handler_(handler),
+      min_progress_delta_(min_progress_delta),
+      min_interval_ms_(min_interval_ms) {}
+
+ThrottledStatusUpdateHandler::~ThrottledStatusUpdateHandler() {
+  if (pending_task_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(pending_task_);
+}
+
+void ThrottledStatusUpdateHandler::IPCError(const string& error) {
+  handler_->IPCError(error);
+}
+
+void ThrottledStatusUpdateHandler::HandleStatusUpdate(
+    int64_t last_checked_time,
+    double progress,
+    UpdateStatus current_operation,
+    const string& new_version,
+    int64_t new_size) {
+  Status status{
+      last_checked_time, progress, current_operation, new_version, new_size};
+
+  if (!status_sent_ ||
+      status.last_checked_time != sent_status_.last_checked_time ||
+      status.current_operation != sent_status_.current_operation ||
+      status.new_version != sent_status_.new_version ||
+      status.new_size != sent_status_.new_size ||
+      std::fabs(status.progress - sent_status_.progress) >=
+          min_progress_delta_) {
+    SendStatus(status);
+    return;
+  }
+
+  TimeDelta wait = TimeDelta::FromMilliseconds(min_interval_ms_) -
+                   (TimeTicks::Now() -
+                    TimeTicks::FromInternalValue(sent_time_us_));
+  if (wait <= TimeDelta()) {
+    SendStatus(status);
+    return;
+  }
+  pending_status_ = status;
+  if (pending_task_ == MessageLoop::kTaskIdNull) {
+    pending_task_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&ThrottledStatusUpdateHandler::SendPendingStatus,
+                   base::Unretained(this)),
+        wait);
+  }
+}
+
+void ThrottledStatusUpdateHandler::SendStatus(const Status& status) {
+  if (pending_task_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(pending_task_);
+    pending_task_ = MessageLoop::kTaskIdNull;
+  }
+  status_sent_ = true;
+  sent_status_ = status;
+  sent_time_us_ = TimeTicks::Now().ToInternalValue();
+  handler_->HandleStatusUpdate(status.last_checked_time,
+                               status.progress,
+                               status.current_operation,
+                               status.new_version,
+                               status.new_size);
+}
+
+void ThrottledStatusUpdateHandler::SendPendingStatus() {
+  pending_task_ = MessageLoop::kTaskIdNull;
+  SendStatus(pending_status_);
+}
+
+}  // namespace update_engine
@@ -0,0 +1,120 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/client_library/include/update_engine/throttled_status_update_handler.h"
+
+#include <string>
+#include <vector>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace update_engine {
+
+namespace {
+
+// An hour, longer than any test runs, so the coalesced updates are only
+// passed on from the message loop.
+const int64_t kLongIntervalMs = 3600 * 1000;
+
+// A StatusUpdateHandler recording the status updates it gets.
+class RecordingStatusUpdateHandler : public StatusUpdateHandler {
+ public:
+  struct Update {
+    double progress;
+    UpdateStatus current_operation;
+  };
+
+  void IPCError(const string& error) override { errors.push_back(error); }
+
+  void HandleStatusUpdate(int64_t /* last_checked_time */,
+                          double progress,
+                          UpdateStatus current_operation,
+                          const string& /* new_version */,
+                          int64_t /* new_size */) override {
+    updates.push_back({progress, current_operation});
+  }
+
+  vector<Update> updates;
+  vector<string> errors;
+};
+
+}  // namespace
+
+class ThrottledStatusUpdateHandlerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  void SendUpdate(double progress, UpdateStatus current_operation) {
+    throttled_.HandleStatusUpdate(0, progress, current_operation, "1.2.3", 10);
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  RecordingStatusUpdateHandler handler_;
+  ThrottledStatusUpdateHandler throttled_{&handler_, 0.1, kLongIntervalMs};
+};
+
+TEST_F(ThrottledStatusUpdateHandlerTest, CoalescesSmallProgressTest) {
+  SendUpdate(0.0, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.01, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.02, UpdateStatus::DOWNLOADING);
+  // Only the first update went through, the others wait for the interval.
+  ASSERT_EQ(1U, handler_.updates.size());
+  EXPECT_TRUE(loop_.PendingTasks());
+
+  // The latest of the coalesced updates is passed on from the loop.
+  while (loop_.RunOnce(false)) {
+  }
+  ASSERT_EQ(2U, handler_.updates.size());
+  EXPECT_DOUBLE_EQ(0.02, handler_.updates[1].progress);
+}
+
+TEST_F(ThrottledStatusUpdateHandlerTest, PassesLargeProgressTest) {
+  SendUpdate(0.0, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.05, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.2, UpdateStatus::DOWNLOADING);
+  // The last update moved the progress far enough to go through right away
+  // and replaced the coalesced one.
+  ASSERT_EQ(2U, handler_.updates.size());
+  EXPECT_DOUBLE_EQ(0.2, handler_.updates[1].progress);
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(ThrottledStatusUpdateHandlerTest, PassesStateChangeTest) {
+  SendUpdate(0.0, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.01, UpdateStatus::DOWNLOADING);
+  SendUpdate(0.01, UpdateStatus::VERIFYING);
+  // The state change goes through immediately and drops the pending update.
+  ASSERT_EQ(2U, handler_.updates.size());
+  EXPECT_EQ(UpdateStatus::VERIFYING, handler_.updates[1].current_operation);
+  EXPECT_FALSE(loop_.PendingTasks());
+
+  while (loop_.RunOnce(false)) {
+  }
+  EXPECT_EQ(2U, handler_.updates.size());
+}
+
+TEST_F(ThrottledStatusUpdateHandlerTest, PassesIPCErrorTest) {
+  throttled_.IPCError("error");
+  EXPECT_EQ((vector<string>{"error"}), handler_.errors);
+}
+
+}  // namespace update_engine
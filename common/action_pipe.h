@@ -77,6 +77,16 @@ class ActionPipe {
     // different from the To object's InputObjectType.
   }
 
+  // Bonds one Action to two others with a new ActionPipe, so both receive the
+  // object passed out of |from|.
+  template<typename FromAction, typename ToAction, typename AlsoToAction>
+  static void Bond(FromAction* from, ToAction* to, AlsoToAction* also_to) {
+    std::shared_ptr<ActionPipe<ObjectType>> pipe(new ActionPipe<ObjectType>);
+    from->set_out_pipe(pipe);
+    to->set_in_pipe(pipe);
+    also_to->set_in_pipe(pipe);
+  }
+
  private:
   ObjectType contents_;
 
@@ -96,6 +106,21 @@ void BondActions(FromAction* from, ToAction* to) {
   ActionPipe<typename FromAction::OutputObjectType>::Bond(from, to);
 }
 
+// Utility function bonding one Action to two others taking the same input.
+template<typename FromAction, typename ToAction, typename AlsoToAction>
+void BondActions(FromAction* from, ToAction* to, AlsoToAction* also_to) {
+  static_assert(
+      std::is_same<typename FromAction::OutputObjectType,
+                   typename ToAction::InputObjectType>::value,
+      "FromAction::OutputObjectType doesn't match ToAction::InputObjectType");
+  static_assert(
+      std::is_same<typename FromAction::OutputObjectType,
+                   typename AlsoToAction::InputObjectType>::value,
+      "FromAction::OutputObjectType doesn't match "
+      "AlsoToAction::InputObjectType");
+  ActionPipe<typename FromAction::OutputObjectType>::Bond(from, to, also_to);
+}
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_COMMON_ACTION_PIPE_H_
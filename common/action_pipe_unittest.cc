@@ -57,4 +57,13 @@ TEST(ActionPipeTest, SimpleTest) {
   EXPECT_EQ("foo", b.in_pipe()->contents());
 }
 
+// This test bonds one Action to two others, which receive the same message.
+TEST(ActionPipeTest, FanOutTest) {
+  ActionPipeTestAction a, b, c;
+  BondActions(&a, &b, &c);
+  a.out_pipe()->set_contents("foo");
+  EXPECT_EQ("foo", b.in_pipe()->contents());
+  EXPECT_EQ("foo", c.in_pipe()->contents());
+}
+
 }  // namespace chromeos_update_engine
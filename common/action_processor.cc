@@ -16,12 +16,14 @@
 
 #include "update_engine/common/action_processor.h"
 
+#include <algorithm>
 #include <string>
 
 #include <base/logging.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/trace_log.h"
 
 using std::string;
 
@@ -35,52 +37,69 @@ ActionProcessor::~ActionProcessor() {
 }
 
 void ActionProcessor::EnqueueAction(AbstractAction* action) {
+  std::vector<AbstractAction*> dependencies;
+  if (last_enqueued_action_)
+    dependencies.push_back(last_enqueued_action_);
+  EnqueueActionWithDependencies(action, dependencies);
+}
+
+void ActionProcessor::EnqueueActionWithDependencies(
+    AbstractAction* action, const std::vector<AbstractAction*>& dependencies) {
   actions_.push_back(action);
   action->SetProcessor(this);
+  if (!dependencies.empty())
+    dependencies_[action] = dependencies;
+  last_enqueued_action_ = action;
+}
+
+bool ActionProcessor::IsActionRunning(const AbstractAction* action) const {
+  return std::find(running_actions_.begin(), running_actions_.end(), action) !=
+         running_actions_.end();
 }
 
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
-  if (!actions_.empty()) {
-    current_action_ = actions_.front();
-    LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-    actions_.pop_front();
-    current_action_->PerformAction();
-  }
+  if (!actions_.empty())
+    StartReadyActions();
 }
 
 void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
-  if (current_action_) {
-    current_action_->TerminateProcessing();
-    current_action_->SetProcessor(nullptr);
-  }
-  LOG(INFO) << "ActionProcessor: aborted "
-            << (current_action_ ? current_action_->Type() : "")
+  string types;
+  for (AbstractAction* action : running_actions_)
+    types += (types.empty() ? "" : ", ") + action->Type();
+  TerminateRunningActions();
+  LOG(INFO) << "ActionProcessor: aborted " << types
             << (suspended_ ? " while suspended" : "");
-  current_action_ = nullptr;
   suspended_ = false;
   // Delete all the actions before calling the delegate.
   for (auto action : actions_)
     action->SetProcessor(nullptr);
   actions_.clear();
+  dependencies_.clear();
+  last_enqueued_action_ = nullptr;
   if (delegate_)
     delegate_->ProcessingStopped(this);
 }
 
 void ActionProcessor::SuspendProcessing() {
-  // No current_action_ when not suspended means that the action processor was
+  // No running actions when not suspended means that the action processor was
   // never started or already finished.
-  if (suspended_ || !current_action_) {
+  if (suspended_ || running_actions_.empty()) {
     LOG(WARNING) << "Called SuspendProcessing while not processing.";
     return;
   }
   suspended_ = true;
 
-  // If there's a current action we should notify it that it should suspend, but
-  // the action can ignore that and terminate at any point.
-  LOG(INFO) << "ActionProcessor: suspending " << current_action_->Type();
-  current_action_->SuspendAction();
+  // If there are running actions we should notify them that they should
+  // suspend, but the actions can ignore that and terminate at any point.
+  std::vector<AbstractAction*> running_actions(running_actions_);
+  for (AbstractAction* action : running_actions) {
+    if (!IsActionRunning(action))
+      continue;
+    LOG(INFO) << "ActionProcessor: suspending " << action->Type();
+    action->SuspendAction();
+  }
 }
 
 void ActionProcessor::ResumeProcessing() {
@@ -89,11 +108,19 @@ void ActionProcessor::ResumeProcessing() {
     return;
   }
   suspended_ = false;
-  if (current_action_) {
-    // The current_action_ did not call ActionComplete while suspended, so we
-    // should notify it of the resume operation.
-    LOG(INFO) << "ActionProcessor: resuming " << current_action_->Type();
-    current_action_->ResumeAction();
+  if (!running_actions_.empty()) {
+    // The running actions did not call ActionComplete while suspended, so we
+    // should notify them of the resume operation. The ones that did complete
+    // may have left other actions ready to start.
+    std::vector<AbstractAction*> running_actions(running_actions_);
+    for (AbstractAction* action : running_actions) {
+      if (!IsActionRunning(action))
+        continue;
+      LOG(INFO) << "ActionProcessor: resuming " << action->Type();
+      action->ResumeAction();
+    }
+    if (!suspended_)
+      StartReadyActions();
   } else {
     // The last action called ActionComplete while suspended, so there is
     // already a log message with the type of the finished action. We simply
@@ -106,25 +133,34 @@ void ActionProcessor::ResumeProcessing() {
 
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      ErrorCode code) {
-  CHECK_EQ(actionptr, current_action_);
-  if (delegate_)
+  CHECK(IsActionRunning(actionptr));
+  if (delegate_) {
+    delegate_->ActionResourceUsage(
+        this, actionptr, start_usage_[actionptr], ResourceUsage::Now());
     delegate_->ActionCompleted(this, actionptr, code);
-  string old_type = current_action_->Type();
-  current_action_->ActionCompleted(code);
-  current_action_->SetProcessor(nullptr);
-  current_action_ = nullptr;
+  }
+  start_usage_.erase(actionptr);
+  string old_type = actionptr->Type();
+  TraceAsyncEnd("action", old_type, actionptr);
+  actionptr->ActionCompleted(code);
+  actionptr->SetProcessor(nullptr);
+  running_actions_.erase(std::find(
+      running_actions_.begin(), running_actions_.end(), actionptr));
+  bool last_action = actions_.empty() && running_actions_.empty();
   LOG(INFO) << "ActionProcessor: finished "
-            << (actions_.empty() ? "last action " : "") << old_type
+            << (last_action ? "last action " : "") << old_type
             << (suspended_ ? " while suspended" : "")
             << " with code " << utils::ErrorCodeToString(code);
-  if (!actions_.empty() && code != ErrorCode::kSuccess) {
+  if (!last_action && code != ErrorCode::kSuccess) {
     LOG(INFO) << "ActionProcessor: Aborting processing due to failure.";
+    TerminateRunningActions();
     actions_.clear();
+    dependencies_.clear();
   }
   if (suspended_) {
     // If an action finished while suspended we don't start the next action (or
     // terminate the processing) until the processor is resumed. This condition
-    // will be flagged by a nullptr current_action_ while suspended_ is true.
+    // will be flagged by no running actions while suspended_ is true.
     suspended_error_code_ = code;
     return;
   }
@@ -132,16 +168,62 @@ void ActionProcessor::ActionComplete(AbstractAction* actionptr,
 }
 
 void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
-  if (actions_.empty()) {
+  if (actions_.empty() && running_actions_.empty()) {
+    last_enqueued_action_ = nullptr;
     if (delegate_) {
       delegate_->ProcessingDone(this, code);
     }
     return;
   }
-  current_action_ = actions_.front();
-  actions_.pop_front();
-  LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-  current_action_->PerformAction();
+  StartReadyActions();
+}
+
+void ActionProcessor::StartReadyActions() {
+  // An action is ready when none of its dependencies is still queued or
+  // running, which means they all completed.
+  std::vector<AbstractAction*> ready_actions;
+  for (AbstractAction* action : actions_) {
+    bool ready = true;
+    for (AbstractAction* dependency : dependencies_[action]) {
+      if (IsActionRunning(dependency) ||
+          std::find(actions_.begin(), actions_.end(), dependency) !=
+              actions_.end()) {
+        ready = false;
+        break;
+      }
+    }
+    if (ready)
+      ready_actions.push_back(action);
+  }
+  CHECK(!ready_actions.empty() || !running_actions_.empty())
+      << "ActionProcessor: no action can start, check the dependencies.";
+
+  // Starting an action may complete it and start others right away, so only
+  // the ones still queued are started.
+  for (size_t i = 0; i < ready_actions.size(); i++) {
+    AbstractAction* action = ready_actions[i];
+    auto it = std::find(actions_.begin(), actions_.end(), action);
+    if (suspended_ || it == actions_.end())
+      continue;
+    actions_.erase(it);
+    dependencies_.erase(action);
+    running_actions_.push_back(action);
+    start_usage_[action] = ResourceUsage::Now();
+    LOG(INFO) << "ActionProcessor: starting " << action->Type();
+    TraceAsyncBegin("action", action->Type(), action);
+    action->PerformAction();
+  }
+}
+
+void ActionProcessor::TerminateRunningActions() {
+  while (!running_actions_.empty()) {
+    AbstractAction* action = running_actions_.front();
+    TraceAsyncEnd("action", action->Type(), action);
+    action->TerminateProcessing();
+    action->SetProcessor(nullptr);
+    running_actions_.erase(running_actions_.begin());
+  }
+  start_usage_.clear();
 }
 
 }  // namespace chromeos_update_engine
@@ -18,11 +18,14 @@
 #define UPDATE_ENGINE_COMMON_ACTION_PROCESSOR_H_
 
 #include <deque>
+#include <map>
+#include <vector>
 
 #include <base/macros.h>
 #include <brillo/errors/error.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/resource_usage.h"
 
 // The structure of these classes (Action, ActionPipe, ActionProcessor, etc.)
 // is based on the KSAction* classes from the Google Update Engine code at
@@ -33,6 +36,8 @@
 // See action.h for an overview of this class and other Action* classes.
 
 // An ActionProcessor keeps a queue of Actions and processes them in order.
+// Actions enqueued with their explicit dependencies instead only wait for
+// those, so independent actions run concurrently.
 
 namespace chromeos_update_engine {
 
@@ -56,11 +61,11 @@ class ActionProcessor {
   // to use it.
   void StopProcessing();
 
-  // Suspend the processing. If an Action is running, it will have the
-  // SuspendProcessing() called on it, and it should suspend operations until
-  // ResumeProcessing() is called on this class to continue. While suspended,
-  // no new actions will be started. Calling SuspendProcessing while the
-  // processing is suspended or not running this method performs no action.
+  // Suspend the processing. All the running Actions will have the
+  // SuspendProcessing() called on them, and they should suspend operations
+  // until ResumeProcessing() is called on this class to continue. While
+  // suspended, no new actions will be started. Calling SuspendProcessing while
+  // the processing is suspended or not running this method performs no action.
   void SuspendProcessing();
 
   // Resume the suspended processing. If the ActionProcessor is not suspended
@@ -69,22 +74,35 @@ class ActionProcessor {
 
   // Returns true iff the processing was started but not yet completed nor
   // stopped.
-  bool IsRunning() const { return current_action_ != nullptr || suspended_; }
+  bool IsRunning() const { return !running_actions_.empty() || suspended_; }
 
-  // Adds another Action to the end of the queue.
+  // Adds another Action to the end of the queue. It will be started once the
+  // Action enqueued before it, if any, completes.
   virtual void EnqueueAction(AbstractAction* action);
 
+  // Adds another Action to the queue, that will be started as soon as all the
+  // |dependencies| complete, possibly running concurrently with other Actions.
+  // The |dependencies| must have been enqueued before. Actions bonded with an
+  // ActionPipe must depend on each other so the value is set when the second
+  // one starts. A failure of any Action aborts all the others.
+  virtual void EnqueueActionWithDependencies(
+      AbstractAction* action, const std::vector<AbstractAction*>& dependencies);
+
   // Sets/gets the current delegate. Set to null to remove a delegate.
   ActionProcessorDelegate* delegate() const { return delegate_; }
   void set_delegate(ActionProcessorDelegate *delegate) {
     delegate_ = delegate;
   }
 
-  // Returns a pointer to the current Action that's processing.
+  // Returns a pointer to the current Action that's processing. If several are
+  // running concurrently, returns the one that was started first.
   AbstractAction* current_action() const {
-    return current_action_;
+    return running_actions_.empty() ? nullptr : running_actions_.front();
   }
 
+  // Returns whether |action| is currently processing.
+  bool IsActionRunning(const AbstractAction* action) const;
+
   // Called by an action to notify processor that it's done. Caller passes self.
   void ActionComplete(AbstractAction* actionptr, ErrorCode code);
 
@@ -94,12 +112,28 @@ class ActionProcessor {
   // processing will terminate.
   void StartNextActionOrFinish(ErrorCode code);
 
+  // Starts the queued actions whose dependencies all completed.
+  void StartReadyActions();
+
+  // Terminates all the running actions, which won't report back.
+  void TerminateRunningActions();
+
   // Actions that have not yet begun processing, in the order in which
   // they'll be processed.
   std::deque<AbstractAction*> actions_;
 
-  // A pointer to the currently processing Action, if any.
-  AbstractAction* current_action_{nullptr};
+  // The actions each of the queued actions waits for.
+  std::map<AbstractAction*, std::vector<AbstractAction*>> dependencies_;
+
+  // The last action enqueued since the processing last finished or stopped.
+  AbstractAction* last_enqueued_action_{nullptr};
+
+  // The currently processing Actions, if any, in the order they were started.
+  std::vector<AbstractAction*> running_actions_;
+
+  // The resource usage of the process when each of the running actions
+  // started.
+  std::map<AbstractAction*, ResourceUsage> start_usage_;
 
   // The ErrorCode reported by an action that was suspended but finished while
   // being suspended. This error code is stored here to be reported back to the
@@ -137,6 +171,14 @@ class ActionProcessorDelegate {
   virtual void ActionCompleted(ActionProcessor* processor,
                                AbstractAction* action,
                                ErrorCode code) {}
+
+  // Called before ActionCompleted() with the resource usage of the process
+  // when the |action| started and when it completed. Actions running
+  // concurrently share the usage of the process between them.
+  virtual void ActionResourceUsage(const ActionProcessor* processor,
+                                   const AbstractAction* action,
+                                   const ResourceUsage& start,
+                                   const ResourceUsage& end) {}
 };
 
 }  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/common/action.h"
+#include "update_engine/common/action_pipe.h"
 #include "update_engine/common/mock_action.h"
 
 using std::string;
@@ -47,9 +48,10 @@ class ActionProcessorTestAction : public Action<ActionProcessorTestAction> {
   ActionPipe<string>* out_pipe() { return out_pipe_.get(); }
   ActionProcessor* processor() { return processor_; }
   void PerformAction() {}
-  void CompleteAction() {
+  void CompleteAction() { CompleteActionWithCode(ErrorCode::kSuccess); }
+  void CompleteActionWithCode(ErrorCode code) {
     ASSERT_TRUE(processor());
-    processor()->ActionComplete(this, ErrorCode::kSuccess);
+    processor()->ActionComplete(this, code);
   }
   string Type() const { return "ActionProcessorTestAction"; }
 };
@@ -83,11 +85,23 @@ class MyActionProcessorDelegate : public ActionProcessorDelegate {
     action_completed_called_ = true;
     action_exit_code_ = code;
   }
+  virtual void ActionResourceUsage(const ActionProcessor* processor,
+                                   const AbstractAction* action,
+                                   const ResourceUsage& start,
+                                   const ResourceUsage& end) {
+    EXPECT_EQ(processor_, processor);
+    // Reported before ActionCompleted().
+    EXPECT_FALSE(action_completed_called_);
+    EXPECT_LE(start.time, end.time);
+    EXPECT_LE(start.cpu_time, end.cpu_time);
+    action_usage_called_ = true;
+  }
 
   const ActionProcessor* processor_;
   bool processing_done_called_;
   bool processing_stopped_called_;
   bool action_completed_called_;
+  bool action_usage_called_{false};
   ErrorCode action_exit_code_;
 };
 }  // namespace
@@ -134,6 +148,7 @@ TEST_F(ActionProcessorTest, DelegateTest) {
   action_.CompleteAction();
   EXPECT_TRUE(delegate_.processing_done_called_);
   EXPECT_TRUE(delegate_.action_completed_called_);
+  EXPECT_TRUE(delegate_.action_usage_called_);
 }
 
 TEST_F(ActionProcessorTest, StopProcessingTest) {
@@ -142,6 +157,7 @@ TEST_F(ActionProcessorTest, StopProcessingTest) {
   action_processor_.StopProcessing();
   EXPECT_TRUE(delegate_.processing_stopped_called_);
   EXPECT_FALSE(delegate_.action_completed_called_);
+  EXPECT_FALSE(delegate_.action_usage_called_);
   EXPECT_FALSE(action_processor_.IsRunning());
   EXPECT_EQ(nullptr, action_processor_.current_action());
 }
@@ -261,4 +277,97 @@ TEST_F(ActionProcessorTest, StoppedWhileSuspendedTest) {
   EXPECT_EQ(nullptr, action_processor_.current_action());
 }
 
+TEST_F(ActionProcessorTest, DependenciesTest) {
+  action_processor_.set_delegate(nullptr);
+
+  // |action1| and |action2| are independent, |action3| needs both.
+  ActionProcessorTestAction action1, action2, action3;
+  action_processor_.EnqueueActionWithDependencies(&action1, {});
+  action_processor_.EnqueueActionWithDependencies(&action2, {});
+  action_processor_.EnqueueActionWithDependencies(&action3,
+                                                  {&action1, &action2});
+  action_processor_.StartProcessing();
+  EXPECT_TRUE(action1.IsRunning());
+  EXPECT_TRUE(action2.IsRunning());
+  EXPECT_FALSE(action3.IsRunning());
+
+  action2.CompleteAction();
+  EXPECT_TRUE(action1.IsRunning());
+  EXPECT_FALSE(action3.IsRunning());
+
+  action1.CompleteAction();
+  EXPECT_TRUE(action3.IsRunning());
+  EXPECT_EQ(&action3, action_processor_.current_action());
+  action3.CompleteAction();
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, PipeAlongDependencyTest) {
+  action_processor_.set_delegate(nullptr);
+
+  ActionProcessorTestAction action1, action2, action3;
+  BondActions(&action1, &action3);
+  action_processor_.EnqueueActionWithDependencies(&action1, {});
+  action_processor_.EnqueueActionWithDependencies(&action2, {});
+  action_processor_.EnqueueActionWithDependencies(&action3, {&action1});
+  action_processor_.StartProcessing();
+
+  action1.SetOutputObject("value");
+  action1.CompleteAction();
+  ASSERT_TRUE(action3.IsRunning());
+  EXPECT_EQ("value", action3.GetInputObject());
+  // The independent |action2| is still running.
+  EXPECT_TRUE(action2.IsRunning());
+  action3.CompleteAction();
+  action2.CompleteAction();
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, FailureTerminatesConcurrentActionsTest) {
+  ActionProcessorTestAction action2;
+  action_processor_.EnqueueActionWithDependencies(&mock_action_, {});
+  action_processor_.EnqueueActionWithDependencies(&action_, {});
+  action_processor_.EnqueueActionWithDependencies(&action2, {&action_});
+
+  EXPECT_CALL(mock_action_, PerformAction());
+  action_processor_.StartProcessing();
+
+  EXPECT_CALL(mock_action_, TerminateProcessing());
+  action_.CompleteActionWithCode(ErrorCode::kError);
+  EXPECT_TRUE(delegate_.processing_done_called_);
+  EXPECT_EQ(ErrorCode::kError, delegate_.action_exit_code_);
+  EXPECT_FALSE(action_processor_.IsRunning());
+  EXPECT_FALSE(action2.IsRunning());
+  EXPECT_FALSE(mock_action_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, SuspendResumeConcurrentActionsTest) {
+  action_processor_.set_delegate(nullptr);
+  testing::StrictMock<MockAction> mock_action2;
+  EXPECT_CALL(mock_action2, Type()).Times(testing::AnyNumber());
+  action_processor_.EnqueueActionWithDependencies(&mock_action_, {});
+  action_processor_.EnqueueActionWithDependencies(&mock_action2, {});
+  action_processor_.EnqueueActionWithDependencies(&action_, {&mock_action_});
+
+  EXPECT_CALL(mock_action_, PerformAction());
+  EXPECT_CALL(mock_action2, PerformAction());
+  action_processor_.StartProcessing();
+
+  EXPECT_CALL(mock_action_, SuspendAction());
+  EXPECT_CALL(mock_action2, SuspendAction());
+  action_processor_.SuspendProcessing();
+
+  // |action_| isn't started while suspended.
+  action_processor_.ActionComplete(&mock_action_, ErrorCode::kSuccess);
+  EXPECT_FALSE(action_.IsRunning());
+
+  EXPECT_CALL(mock_action2, ResumeAction());
+  action_processor_.ResumeProcessing();
+  EXPECT_TRUE(action_.IsRunning());
+
+  action_processor_.ActionComplete(&mock_action2, ErrorCode::kSuccess);
+  action_.CompleteAction();
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,219 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/async_log_sink.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+// static
+AsyncLogSink* AsyncLogSink::current_ = nullptr;
+
+AsyncLogSink::AsyncLogSink(const string& log_file,
+                           size_t capacity,
+                           int max_messages_per_second)
+    : log_file_(log_file),
+      max_messages_per_second_(max_messages_per_second),
+      message_available_(&lock_),
+      messages_written_(&lock_),
+      buffer_(capacity) {
+  CHECK_GT(capacity, 0U);
+}
+
+AsyncLogSink::~AsyncLogSink() {
+  if (current_ != this)
+    return;
+  // Nothing can be logged through this sink anymore once the handler is
+  // restored, but the suppressed messages are still reported.
+  logging::SetLogMessageHandler(previous_handler_);
+  {
+    base::AutoLock auto_lock(lock_);
+    for (const auto& call_site : call_sites_) {
+      AppendSuppressedLocked(
+          call_site.first.first, call_site.first.second, call_site.second);
+    }
+    stopping_ = true;
+    message_available_.Signal();
+  }
+  writer_thread_->Join();
+  current_ = nullptr;
+  if (fd_ != STDERR_FILENO)
+    IGNORE_EINTR(close(fd_));
+}
+
+bool AsyncLogSink::Init() {
+  CHECK(current_ == nullptr);
+  if (log_file_.empty()) {
+    fd_ = STDERR_FILENO;
+  } else {
+    fd_ = HANDLE_EINTR(
+        open(log_file_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+             0644));
+    if (fd_ < 0) {
+      PLOG(ERROR) << "Unable to open the log file " << log_file_;
+      return false;
+    }
+  }
+  writer_thread_.reset(new base::DelegateSimpleThread(this, "async-log"));
+  writer_thread_->Start();
+  current_ = this;
+  previous_handler_ = logging::GetLogMessageHandler();
+  logging::SetLogMessageHandler(&AsyncLogSink::HandleLogMessage);
+  return true;
+}
+
+void AsyncLogSink::Flush() {
+  base::AutoLock auto_lock(lock_);
+  while (size_ > 0)
+    messages_written_.Wait();
+}
+
+uint64_t AsyncLogSink::dropped_messages() const {
+  base::AutoLock auto_lock(lock_);
+  return dropped_messages_;
+}
+
+uint64_t AsyncLogSink::suppressed_messages() const {
+  base::AutoLock auto_lock(lock_);
+  return suppressed_messages_;
+}
+
+void AsyncLogSink::Run() {
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    while (!stopping_ && size_ == 0 && unreported_dropped_messages_ == 0)
+      message_available_.Wait();
+    if (size_ == 0 && unreported_dropped_messages_ == 0)
+      return;
+
+    // The messages are written from the buffer without holding the lock. The
+    // new ones are only added after them, so the written range is left alone
+    // until it's released.
+    const size_t start = start_;
+    const size_t size = std::min(size_, buffer_.size() - start_);
+    string dropped;
+    if (unreported_dropped_messages_ > 0) {
+      dropped = base::StringPrintf(
+          "[async-log] %" PRIu64 " log messages dropped\n",
+          unreported_dropped_messages_);
+      unreported_dropped_messages_ = 0;
+    }
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      WriteToLog(buffer_.data() + start, size);
+      if (!dropped.empty())
+        WriteToLog(dropped.data(), dropped.size());
+    }
+    start_ = (start_ + size) % buffer_.size();
+    size_ -= size;
+    messages_written_.Broadcast();
+  }
+}
+
+// static
+bool AsyncLogSink::HandleLogMessage(int severity,
+                                    const char* file,
+                                    int line,
+                                    size_t message_start,
+                                    const string& str) {
+  // The handler could be called while the sink is being destroyed.
+  AsyncLogSink* sink = current_;
+  return sink && sink->AddMessage(severity, file, line, str);
+}
+
+bool AsyncLogSink::AddMessage(int severity,
+                              const char* file,
+                              int line,
+                              const string& str) {
+  if (severity >= logging::LOG_ERROR) {
+    // The errors are written right away, after the messages before them.
+    Flush();
+    return false;
+  }
+  base::AutoLock auto_lock(lock_);
+  if (CheckRateLocked(file, line))
+    AppendLocked(str.data(), str.size());
+  return true;
+}
+
+bool AsyncLogSink::CheckRateLocked(const char* file, int line) {
+  if (max_messages_per_second_ <= 0)
+    return true;
+  const int64_t second =
+      (base::TimeTicks::Now() - base::TimeTicks()).InSeconds();
+  CallSiteRate& rate = call_sites_[std::make_pair(file, line)];
+  if (rate.second != second) {
+    AppendSuppressedLocked(file, line, rate);
+    rate.second = second;
+    rate.num_messages = 0;
+    rate.num_suppressed = 0;
+  }
+  if (rate.num_messages >= max_messages_per_second_) {
+    rate.num_suppressed++;
+    suppressed_messages_++;
+    return false;
+  }
+  rate.num_messages++;
+  return true;
+}
+
+void AsyncLogSink::AppendSuppressedLocked(const char* file,
+                                          int line,
+                                          const CallSiteRate& rate) {
+  if (rate.num_suppressed == 0)
+    return;
+  const string summary = base::StringPrintf(
+      "[async-log] %" PRIu64 " messages from %s:%d suppressed\n",
+      rate.num_suppressed, file, line);
+  AppendLocked(summary.data(), summary.size());
+}
+
+void AsyncLogSink::AppendLocked(const char* data, size_t size) {
+  if (size > buffer_.size() - size_) {
+    dropped_messages_++;
+    unreported_dropped_messages_++;
+    return;
+  }
+  size_t end = (start_ + size_) % buffer_.size();
+  const size_t first_size = std::min(size, buffer_.size() - end);
+  std::copy(data, data + first_size, buffer_.begin() + end);
+  std::copy(data + first_size, data + size, buffer_.begin());
+  size_ += size;
+  message_available_.Signal();
+}
+
+void AsyncLogSink::WriteToLog(const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = HANDLE_EINTR(write(fd_, data, size));
+    if (written <= 0)
+      return;
+    data += written;
+    size -= written;
+  }
+}
+
+}  // namespace chromeos_update_engine
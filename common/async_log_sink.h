@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_ASYNC_LOG_SINK_H_
+#define UPDATE_ENGINE_COMMON_ASYNC_LOG_SINK_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+namespace chromeos_update_engine {
+
+// The default buffer size and rate limit of the AsyncLogSink.
+const size_t kAsyncLogSinkCapacity = 1024 * 1024;
+const int kAsyncLogSinkMaxMessagesPerSecond = 20;
+
+// An AsyncLogSink takes over the writes of the log messages below ERROR from
+// the logging library, so the threads logging don't wait for slow log
+// storage. The messages are copied to a ring buffer and written to the log file
+// by a writer thread. When the buffer is full, the new messages are dropped and
+// their number reported once there is room again. The ERROR and FATAL messages
+// are still written synchronously by the logging library, after the buffered
+// ones. The messages of the same call site above a rate are suppressed and
+// counted as well.
+class AsyncLogSink : public base::DelegateSimpleThread::Delegate {
+ public:
+  // The messages are appended to the |log_file|, or written to stderr if
+  // empty, which must be where the logging library writes them too. Up to
+  // |capacity| bytes of messages are buffered. Each call site logs at most
+  // |max_messages_per_second| messages per second, or any number if 0.
+  AsyncLogSink(const std::string& log_file,
+               size_t capacity,
+               int max_messages_per_second);
+
+  // Writes the buffered messages, stops the writer thread and restores the
+  // previous log message handler.
+  ~AsyncLogSink() override;
+
+  // Opens the log file, starts the writer thread and installs the log message
+  // handler passing the messages to this sink. Only one instance can be
+  // initialized at a time. Returns whether the file was opened.
+  bool Init();
+
+  // Blocks until all the messages buffered so far are written.
+  void Flush();
+
+  // The number of messages dropped because the buffer was full, and suppressed
+  // by the rate limit.
+  uint64_t dropped_messages() const;
+  uint64_t suppressed_messages() const;
+
+  // The loop of the writer thread, from base::DelegateSimpleThread::Delegate.
+  void Run() override;
+
+ private:
+  // The number of messages of a call site logged during a second.
+  struct CallSiteRate {
+    int64_t second{0};
+    int num_messages{0};
+    uint64_t num_suppressed{0};
+  };
+
+  // The logging::LogMessageHandlerFunction installed by Init().
+  static bool HandleLogMessage(int severity,
+                               const char* file,
+                               int line,
+                               size_t message_start,
+                               const std::string& str);
+
+  // Buffers the message |str| logged at |file|:|line|. Returns false if it
+  // must be written by the logging library instead.
+  bool AddMessage(int severity,
+                  const char* file,
+                  int line,
+                  const std::string& str);
+
+  // Returns whether the rate limit of the call site |file|:|line| allows
+  // another message, buffering the number of messages it suppressed during
+  // the last second first.
+  bool CheckRateLocked(const char* file, int line);
+
+  // Buffers the number of messages the |rate| of the call site |file|:|line|
+  // suppressed, if any.
+  void AppendSuppressedLocked(const char* file,
+                              int line,
+                              const CallSiteRate& rate);
+
+  // Copies the |size| bytes of |data| at the end of the ring buffer, or drops
+  // them if they don't fit.
+  void AppendLocked(const char* data, size_t size);
+
+  // Writes |size| bytes of |data| to the log file, ignoring the errors.
+  void WriteToLog(const char* data, size_t size);
+
+  // The initialized AsyncLogSink, if any.
+  static AsyncLogSink* current_;
+
+  const std::string log_file_;
+  const int max_messages_per_second_;
+  int fd_{-1};
+  logging::LogMessageHandlerFunction previous_handler_{nullptr};
+  std::unique_ptr<base::DelegateSimpleThread> writer_thread_;
+
+  // All of the following are protected by |lock_|.
+  mutable base::Lock lock_;
+  // Signaled when messages are buffered or the writer thread should stop.
+  base::ConditionVariable message_available_;
+  // Signaled every time the writer thread wrote some messages.
+  base::ConditionVariable messages_written_;
+  // The ring buffer, holding |size_| bytes from |start_|.
+  std::vector<char> buffer_;
+  size_t start_{0};
+  size_t size_{0};
+  bool stopping_{false};
+  uint64_t dropped_messages_{0};
+  uint64_t unreported_dropped_messages_{0};
+  uint64_t suppressed_messages_{0};
+  std::map<std::pair<const char*, int>, CallSiteRate> call_sites_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncLogSink);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_ASYNC_LOG_SINK_H_
@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/async_log_sink.h"
+
+#include <string>
+
+#include <base/logging.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class AsyncLogSinkTest : public ::testing::Test {
+ protected:
+  // Returns the number of times |text| appears in the log file.
+  size_t CountInLog(const string& text) {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(log_file_.path(), &contents));
+    size_t count = 0;
+    for (size_t pos = contents.find(text); pos != string::npos;
+         pos = contents.find(text, pos + text.size())) {
+      count++;
+    }
+    return count;
+  }
+
+  test_utils::ScopedTempFile log_file_{"AsyncLogSink-XXXXXX"};
+};
+
+TEST_F(AsyncLogSinkTest, WritesMessagesTest) {
+  {
+    AsyncLogSink sink(log_file_.path(), 4096, 0);
+    ASSERT_TRUE(sink.Init());
+    for (int i = 0; i < 5; i++)
+      LOG(INFO) << "async message " << i;
+    sink.Flush();
+    EXPECT_EQ(5U, CountInLog("async message"));
+    EXPECT_EQ(1U, CountInLog("async message 4"));
+  }
+  // The messages after the sink is destroyed aren't written to its file.
+  LOG(INFO) << "async message after";
+  EXPECT_EQ(0U, CountInLog("async message after"));
+}
+
+TEST_F(AsyncLogSinkTest, RateLimitTest) {
+  {
+    AsyncLogSink sink(log_file_.path(), 64 * 1024, 3);
+    ASSERT_TRUE(sink.Init());
+    // Unless the second changes right in the loop, 3 of them are written.
+    for (int i = 0; i < 10; i++)
+      LOG(INFO) << "repeated message";
+    EXPECT_GE(sink.suppressed_messages(), 4U);
+  }
+  // The suppressed messages are reported once the sink is destroyed.
+  EXPECT_LE(CountInLog("repeated message"), 6U);
+  EXPECT_GE(CountInLog("suppressed"), 1U);
+}
+
+TEST_F(AsyncLogSinkTest, DropsWhenFullTest) {
+  AsyncLogSink sink(log_file_.path(), 16, 0);
+  ASSERT_TRUE(sink.Init());
+  // Each message is larger than the whole buffer.
+  LOG(INFO) << "a message too large for the buffer";
+  sink.Flush();
+  EXPECT_EQ(1U, sink.dropped_messages());
+}
+
+}  // namespace chromeos_update_engine
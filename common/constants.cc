@@ -22,6 +22,8 @@ const char kPowerwashSafePrefsSubDirectory[] = "update_engine/prefs";
 
 const char kPrefsSubDirectory[] = "prefs";
 
+const char kStagingCacheSubDirectory[] = "staging";
+
 const char kStatefulPartition[] = "/mnt/stateful_partition";
 
 const char kPostinstallDefaultScript[] = "postinst";
@@ -30,6 +32,7 @@ const char kPostinstallDefaultScript[] = "postinst";
 const char kPrefsAttemptInProgress[] = "attempt-in-progress";
 const char kPrefsBackoffExpiryTime[] = "backoff-expiry-time";
 const char kPrefsBootId[] = "boot-id";
+const char kPrefsCandidateUrlOrder[] = "candidate-url-order";
 const char kPrefsCurrentBytesDownloaded[] = "current-bytes-downloaded";
 const char kPrefsCurrentResponseSignature[] = "current-response-signature";
 const char kPrefsCurrentUrlFailureCount[] = "current-url-failure-count";
@@ -52,14 +55,23 @@ const char kPrefsNumResponsesSeen[] = "num-responses-seen";
 const char kPrefsOmahaCohort[] = "omaha-cohort";
 const char kPrefsOmahaCohortHint[] = "omaha-cohort-hint";
 const char kPrefsOmahaCohortName[] = "omaha-cohort-name";
+const char kPrefsOmahaGzipRequestsUrl[] = "omaha-gzip-requests-url";
+const char kPrefsOmahaNoUpdateETag[] = "omaha-noupdate-etag";
+const char kPrefsOmahaNoUpdateMaxAge[] = "omaha-noupdate-max-age";
+const char kPrefsOmahaNoUpdatePollInterval[] = "omaha-noupdate-poll-interval";
+const char kPrefsOmahaNoUpdateRequestHash[] = "omaha-noupdate-request-hash";
+const char kPrefsOmahaNoUpdateTime[] = "omaha-noupdate-time";
 const char kPrefsP2PEnabled[] = "p2p-enabled";
 const char kPrefsP2PFirstAttemptTimestamp[] = "p2p-first-attempt-timestamp";
 const char kPrefsP2PNumAttempts[] = "p2p-num-attempts";
 const char kPrefsPayloadAttemptNumber[] = "payload-attempt-number";
+const char kPrefsPrecomputedSourceHashesPrefix[] =
+    "precomputed-source-hashes-";
 const char kPrefsPreviousVersion[] = "previous-version";
 const char kPrefsResumedUpdateFailures[] = "resumed-update-failures";
 const char kPrefsRollbackVersion[] = "rollback-version";
 const char kPrefsChannelOnSlotPrefix[] = "channel-on-slot-";
+const char kPrefsSourceHashOfPartitionPrefix[] = "source-hash-of-partition-";
 const char kPrefsSystemUpdatedMarker[] = "system-updated-marker";
 const char kPrefsTargetVersionAttempt[] = "target-version-attempt";
 const char kPrefsTargetVersionInstalledFrom[] = "target-version-installed-from";
@@ -74,15 +86,24 @@ const char kPrefsUpdateFirstSeenAt[] = "update-first-seen-at";
 const char kPrefsUpdateOverCellularPermission[] =
     "update-over-cellular-permission";
 const char kPrefsUpdateServerCertificate[] = "update-server-cert";
+const char kPrefsUpdateStateChainedPayload[] = "update-state-chained-payload";
 const char kPrefsUpdateStateNextDataLength[] = "update-state-next-data-length";
 const char kPrefsUpdateStateNextDataOffset[] = "update-state-next-data-offset";
 const char kPrefsUpdateStateNextOperation[] = "update-state-next-operation";
+const char kPrefsUpdateStateOperationsSegment[] =
+    "update-state-operations-segment";
 const char kPrefsUpdateStateSHA256Context[] = "update-state-sha-256-context";
 const char kPrefsUpdateStateSignatureBlob[] = "update-state-signature-blob";
 const char kPrefsUpdateStateSignedSHA256Context[] =
     "update-state-signed-sha-256-context";
+const char kPrefsUpdateStateStagedDataLength[] =
+    "update-state-staged-data-length";
+const char kPrefsUpdateStateStagedPath[] = "update-state-staged-path";
+const char kPrefsUpdateStateStagedSHA256Context[] =
+    "update-state-staged-sha-256-context";
 const char kPrefsUpdateTimestampStart[] = "update-timestamp-start";
 const char kPrefsUrlSwitchCount[] = "url-switch-count";
+const char kPrefsUrlThroughputHistory[] = "url-throughput-history";
 const char kPrefsWallClockWaitPeriod[] = "wall-clock-wait-period";
 
 const char kPayloadPropertyFileSize[] = "FILE_SIZE";
@@ -93,5 +114,11 @@ const char kPayloadPropertyAuthorization[] = "AUTHORIZATION";
 const char kPayloadPropertyUserAgent[] = "USER_AGENT";
 const char kPayloadPropertyPowerwash[] = "POWERWASH";
 const char kPayloadPropertyNetworkId[] = "NETWORK_ID";
+const char kPayloadPropertyParallelConnections[] = "PARALLEL_CONNECTIONS";
+const char kPayloadPropertyUseHttp2[] = "USE_HTTP2";
+const char kPayloadPropertyChainedPayloadPrefix[] = "CHAINED_PAYLOAD_";
+const char kPayloadPropertyStagingCacheSize[] = "STAGING_CACHE_SIZE";
+const char kPayloadPropertyComponentPayloadPrefix[] = "COMPONENT_PAYLOAD_";
+const char kPayloadPropertyMaxDownloadSpeed[] = "MAX_DOWNLOAD_SPEED";
 
 }  // namespace chromeos_update_engine
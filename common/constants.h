@@ -25,6 +25,10 @@ extern const char kPowerwashSafePrefsSubDirectory[];
 // The location where we store the AU preferences (state etc).
 extern const char kPrefsSubDirectory[];
 
+// The location, in the non-volatile directory, where the downloaded payload
+// data is staged.
+extern const char kStagingCacheSubDirectory[];
+
 // Path to the post install command, relative to the partition.
 extern const char kPostinstallDefaultScript[];
 
@@ -35,6 +39,7 @@ extern const char kStatefulPartition[];
 extern const char kPrefsAttemptInProgress[];
 extern const char kPrefsBackoffExpiryTime[];
 extern const char kPrefsBootId[];
+extern const char kPrefsCandidateUrlOrder[];
 extern const char kPrefsCurrentBytesDownloaded[];
 extern const char kPrefsCurrentResponseSignature[];
 extern const char kPrefsCurrentUrlFailureCount[];
@@ -54,14 +59,22 @@ extern const char kPrefsNumResponsesSeen[];
 extern const char kPrefsOmahaCohort[];
 extern const char kPrefsOmahaCohortHint[];
 extern const char kPrefsOmahaCohortName[];
+extern const char kPrefsOmahaGzipRequestsUrl[];
+extern const char kPrefsOmahaNoUpdateETag[];
+extern const char kPrefsOmahaNoUpdateMaxAge[];
+extern const char kPrefsOmahaNoUpdatePollInterval[];
+extern const char kPrefsOmahaNoUpdateRequestHash[];
+extern const char kPrefsOmahaNoUpdateTime[];
 extern const char kPrefsP2PEnabled[];
 extern const char kPrefsP2PFirstAttemptTimestamp[];
 extern const char kPrefsP2PNumAttempts[];
 extern const char kPrefsPayloadAttemptNumber[];
+extern const char kPrefsPrecomputedSourceHashesPrefix[];
 extern const char kPrefsPreviousVersion[];
 extern const char kPrefsResumedUpdateFailures[];
 extern const char kPrefsRollbackVersion[];
 extern const char kPrefsChannelOnSlotPrefix[];
+extern const char kPrefsSourceHashOfPartitionPrefix[];
 extern const char kPrefsSystemUpdatedMarker[];
 extern const char kPrefsTargetVersionAttempt[];
 extern const char kPrefsTargetVersionInstalledFrom[];
@@ -75,14 +88,20 @@ extern const char kPrefsUpdateDurationUptime[];
 extern const char kPrefsUpdateFirstSeenAt[];
 extern const char kPrefsUpdateOverCellularPermission[];
 extern const char kPrefsUpdateServerCertificate[];
+extern const char kPrefsUpdateStateChainedPayload[];
 extern const char kPrefsUpdateStateNextDataLength[];
 extern const char kPrefsUpdateStateNextDataOffset[];
 extern const char kPrefsUpdateStateNextOperation[];
+extern const char kPrefsUpdateStateOperationsSegment[];
 extern const char kPrefsUpdateStateSHA256Context[];
 extern const char kPrefsUpdateStateSignatureBlob[];
 extern const char kPrefsUpdateStateSignedSHA256Context[];
+extern const char kPrefsUpdateStateStagedDataLength[];
+extern const char kPrefsUpdateStateStagedPath[];
+extern const char kPrefsUpdateStateStagedSHA256Context[];
 extern const char kPrefsUpdateTimestampStart[];
 extern const char kPrefsUrlSwitchCount[];
+extern const char kPrefsUrlThroughputHistory[];
 extern const char kPrefsWallClockWaitPeriod[];
 
 // Keys used when storing and loading payload properties.
@@ -94,6 +113,12 @@ extern const char kPayloadPropertyAuthorization[];
 extern const char kPayloadPropertyUserAgent[];
 extern const char kPayloadPropertyPowerwash[];
 extern const char kPayloadPropertyNetworkId[];
+extern const char kPayloadPropertyParallelConnections[];
+extern const char kPayloadPropertyUseHttp2[];
+extern const char kPayloadPropertyChainedPayloadPrefix[];
+extern const char kPayloadPropertyStagingCacheSize[];
+extern const char kPayloadPropertyComponentPayloadPrefix[];
+extern const char kPayloadPropertyMaxDownloadSpeed[];
 
 // A download source is any combination of protocol and server (that's of
 // interest to us when looking at UMA metrics) using which we may download
@@ -16,9 +16,15 @@
 
 #include "update_engine/common/cpu_limiter.h"
 
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <string>
 
 #include <base/bind.h>
+#include <base/files/file_enumerator.h>
+#include <base/files/file_path.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/time/time.h>
@@ -31,6 +37,33 @@ namespace {
 // /etc/init/update-engine.conf.
 const char kCGroupSharesPath[] = "/sys/fs/cgroup/cpu/update-engine/cpu.shares";
 
+// The directory listing the threads of the process.
+const char kTasksPath[] = "/proc/self/task";
+
+// The ioprio_set() constants from linux/ioprio.h, which isn't part of the
+// exported kernel headers.
+const int kIoprioWhoProcess = 1;
+const int kIoprioClassShift = 13;
+const int kIoprioClassBestEffort = 2;
+const int kIoprioClassIdle = 3;
+
+// Returns the ioprio value of the |priority|.
+int IoPriorityValue(chromeos_update_engine::IoPriority priority) {
+  using chromeos_update_engine::IoPriority;
+  switch (priority) {
+    case IoPriority::kHigh:
+      return kIoprioClassBestEffort << kIoprioClassShift | 0;
+    case IoPriority::kNormal:
+      return kIoprioClassBestEffort << kIoprioClassShift | 4;
+    case IoPriority::kLow:
+      return kIoprioClassBestEffort << kIoprioClassShift | 7;
+    case IoPriority::kIdle:
+      return kIoprioClassIdle << kIoprioClassShift;
+  }
+  NOTREACHED();
+  return kIoprioClassBestEffort << kIoprioClassShift | 4;
+}
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -38,6 +71,7 @@ namespace chromeos_update_engine {
 CPULimiter::~CPULimiter() {
   // Set everything back to normal on destruction.
   CPULimiter::SetCpuShares(CpuShares::kNormal);
+  SetIoPriority(IoPriority::kNormal);
 }
 
 void CPULimiter::StartLimiter() {
@@ -80,6 +114,36 @@ bool CPULimiter::SetCpuShares(CpuShares shares) {
   return true;
 }
 
+bool CPULimiter::SetIoPriority(IoPriority priority) {
+  // Short-circuit to avoid re-setting the priority.
+  if (io_priority_ == priority)
+    return true;
+
+  int value = IoPriorityValue(priority);
+  LOG(INFO) << "Setting the I/O priority to " << value;
+  // The I/O priority is per thread, so it's set on every thread of the
+  // process.
+  bool success = true;
+  base::FileEnumerator tasks(
+      base::FilePath(kTasksPath), false, base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath task = tasks.Next(); !task.empty(); task = tasks.Next()) {
+    int tid;
+    if (!base::StringToInt(task.BaseName().value(), &tid))
+      continue;
+    // The thread may have exited since it was listed.
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, value) != 0 &&
+        errno != ESRCH) {
+      PLOG(ERROR) << "Failed to set the I/O priority of thread " << tid
+                  << " to " << value;
+      success = false;
+    }
+  }
+  if (!success)
+    return false;
+  io_priority_ = priority;
+  return true;
+}
+
 void CPULimiter::StopLimiterCallback() {
   SetCpuShares(CpuShares::kNormal);
   manage_shares_id_ = brillo::MessageLoop::kTaskIdNull;
@@ -30,6 +30,17 @@ enum class CpuShares : int {
   kLow = 2,
 };
 
+// The I/O priorities, as ioprio classes and levels. Normal is the level of the
+// best-effort class processes get by default, High and Low are the highest and
+// lowest levels of that class, and Idle only gets the disk when no other
+// process uses it.
+enum class IoPriority : int {
+  kHigh,
+  kNormal,
+  kLow,
+  kIdle,
+};
+
 // Sets the current process shares to |shares|. Returns true on
 // success, false otherwise.
 bool SetCpuShares(CpuShares shares);
@@ -49,6 +60,11 @@ class CPULimiter {
   // if the limiter is not running, the shares won't be reset to normal.
   bool SetCpuShares(CpuShares shares);
 
+  // Sets the I/O priority of all the threads of the process to |priority|. The
+  // threads started later inherit it from the thread starting them. Returns
+  // true on success, false otherwise.
+  bool SetIoPriority(IoPriority priority);
+
  private:
   // The cpu shares timeout source callback sets the current cpu shares to
   // normal.
@@ -57,6 +73,9 @@ class CPULimiter {
   // Current cpu shares.
   CpuShares shares_ = CpuShares::kNormal;
 
+  // Current I/O priority.
+  IoPriority io_priority_ = IoPriority::kNormal;
+
   // The cpu shares management timeout task id.
   brillo::MessageLoop::TaskId manage_shares_id_{
       brillo::MessageLoop::kTaskIdNull};
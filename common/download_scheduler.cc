@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_scheduler.h"
+
+#include <algorithm>
+
+namespace chromeos_update_engine {
+
+void DownloadScheduler::AddDownload(HttpFetcher* fetcher, uint64_t size) {
+  // A download of unknown size gets the share of a 1 byte one, until the
+  // others complete.
+  downloads_.push_back({fetcher, std::max<uint64_t>(size, 1)});
+  UpdateLimits();
+}
+
+void DownloadScheduler::RemoveDownload(HttpFetcher* fetcher) {
+  auto it = std::find_if(downloads_.begin(),
+                         downloads_.end(),
+                         [fetcher](const Download& download) {
+                           return download.fetcher == fetcher;
+                         });
+  if (it == downloads_.end())
+    return;
+  downloads_.erase(it);
+  UpdateLimits();
+}
+
+void DownloadScheduler::UpdateLimits() {
+  if (max_speed_bps_ <= 0)
+    return;
+  uint64_t total_size = 0;
+  for (const Download& download : downloads_)
+    total_size += download.size;
+  for (const Download& download : downloads_) {
+    // The shares are computed in floating point, since the sizes times the
+    // limit may not fit in 64 bits.
+    const double share = static_cast<double>(download.size) / total_size;
+    download.fetcher->set_max_receive_speed(
+        std::max(1, static_cast<int>(max_speed_bps_ * share)));
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_DOWNLOAD_SCHEDULER_H_
+#define UPDATE_ENGINE_COMMON_DOWNLOAD_SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// DownloadScheduler shares a download rate limit between the payloads
+// downloaded at the same time. Each running download gets a share of the limit
+// proportional to its size, so the downloads started together complete at
+// about the same time, and the shares of the others grow as downloads
+// complete. Without a limit, the downloads only share the link as the
+// connections do.
+class DownloadScheduler {
+ public:
+  // Shares the |max_speed_bps| bytes per second between the downloads, or
+  // doesn't limit them if zero.
+  explicit DownloadScheduler(int max_speed_bps)
+      : max_speed_bps_(max_speed_bps) {}
+
+  // Adds the download of |size| bytes through |fetcher|, which isn't owned and
+  // must stay valid until removed.
+  void AddDownload(HttpFetcher* fetcher, uint64_t size);
+
+  // Removes the download through |fetcher|, if any, giving its share of the
+  // limit to the others.
+  void RemoveDownload(HttpFetcher* fetcher);
+
+  // Removes all the downloads.
+  void Clear() { downloads_.clear(); }
+
+  size_t num_downloads() const { return downloads_.size(); }
+
+ private:
+  struct Download {
+    HttpFetcher* fetcher;
+    uint64_t size;
+  };
+
+  // Sets the share of the limit of every download on its fetcher.
+  void UpdateLimits();
+
+  const int max_speed_bps_;
+  std::vector<Download> downloads_;
+
+  DISALLOW_COPY_AND_ASSIGN(DownloadScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_DOWNLOAD_SCHEDULER_H_
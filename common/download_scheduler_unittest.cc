@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+class DownloadSchedulerTest : public ::testing::Test {
+ protected:
+  MockHttpFetcher small_fetcher_{"", 0, nullptr};
+  MockHttpFetcher large_fetcher_{"", 0, nullptr};
+};
+
+TEST_F(DownloadSchedulerTest, SharesBySizeTest) {
+  DownloadScheduler scheduler(1000);
+  scheduler.AddDownload(&small_fetcher_, 100);
+  EXPECT_EQ(1000, small_fetcher_.max_receive_speed_bps());
+
+  scheduler.AddDownload(&large_fetcher_, 300);
+  EXPECT_EQ(2U, scheduler.num_downloads());
+  EXPECT_EQ(250, small_fetcher_.max_receive_speed_bps());
+  EXPECT_EQ(750, large_fetcher_.max_receive_speed_bps());
+
+  // The remaining download gets the whole limit.
+  scheduler.RemoveDownload(&small_fetcher_);
+  EXPECT_EQ(1U, scheduler.num_downloads());
+  EXPECT_EQ(1000, large_fetcher_.max_receive_speed_bps());
+  scheduler.RemoveDownload(&small_fetcher_);
+  EXPECT_EQ(1U, scheduler.num_downloads());
+}
+
+TEST_F(DownloadSchedulerTest, MinimumShareTest) {
+  DownloadScheduler scheduler(10);
+  scheduler.AddDownload(&large_fetcher_, 1000000);
+  // A download of unknown size still gets some rate.
+  scheduler.AddDownload(&small_fetcher_, 0);
+  EXPECT_EQ(1, small_fetcher_.max_receive_speed_bps());
+  EXPECT_EQ(9, large_fetcher_.max_receive_speed_bps());
+}
+
+TEST_F(DownloadSchedulerTest, UnlimitedTest) {
+  DownloadScheduler scheduler(0);
+  scheduler.AddDownload(&small_fetcher_, 100);
+  scheduler.AddDownload(&large_fetcher_, 300);
+  EXPECT_EQ(0, small_fetcher_.max_receive_speed_bps());
+  EXPECT_EQ(0, large_fetcher_.max_receive_speed_bps());
+  scheduler.Clear();
+  EXPECT_EQ(0U, scheduler.num_downloads());
+}
+
+}  // namespace chromeos_update_engine
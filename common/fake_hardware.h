@@ -82,6 +82,8 @@ class FakeHardware : public HardwareInterface {
     return false;
   }
 
+  bool IsOnACPower() const override { return is_on_ac_power_; }
+
   // Setters
   void SetIsOfficialBuild(bool is_official_build) {
     is_official_build_ = is_official_build;
@@ -118,6 +120,10 @@ class FakeHardware : public HardwareInterface {
     powerwash_count_ = powerwash_count;
   }
 
+  void SetIsOnACPower(bool is_on_ac_power) {
+    is_on_ac_power_ = is_on_ac_power;
+  }
+
  private:
   bool is_official_build_;
   bool is_normal_boot_mode_;
@@ -128,6 +134,7 @@ class FakeHardware : public HardwareInterface {
   std::string ec_version_;
   int powerwash_count_;
   bool powerwash_scheduled_{false};
+  bool is_on_ac_power_{false};
 
   DISALLOW_COPY_AND_ASSIGN(FakeHardware);
 };
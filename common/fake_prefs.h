@@ -54,6 +54,10 @@ class FakePrefs : public PrefsInterface {
   void RemoveObserver(const std::string& key,
                       ObserverInterface* observer) override;
 
+  // Changes are applied right away, so transactions are no-ops.
+  void BeginTransaction() override {}
+  bool CommitTransaction() override { return true; }
+
  private:
   enum class PrefType {
     kString,
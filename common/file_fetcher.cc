@@ -16,6 +16,11 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <string>
 
@@ -23,6 +28,7 @@
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/streams/file_stream.h>
@@ -36,6 +42,10 @@ namespace {
 
 size_t kReadBufferSize = 16 * 1024;
 
+// The size of the views of the mapped file passed to the delegate at once in
+// the mmap mode.
+size_t kMappedChunkSize = 1024 * 1024;  // 1 MiB
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -68,6 +78,21 @@ void FileFetcher::BeginTransfer(const string& url) {
   }
 
   string file_path = url.substr(strlen("file://"));
+  if (use_mmap_) {
+    if (!MapFile(file_path)) {
+      http_response_code_ = kHttpResponseNotFound;
+      CleanUp();
+      if (delegate_)
+        delegate_->TransferComplete(this, false);
+      return;
+    }
+    http_response_code_ = kHttpResponseOk;
+    bytes_copied_ = 0;
+    transfer_in_progress_ = true;
+    ScheduleRead();
+    return;
+  }
+
   stream_ =
       brillo::FileStream::Open(base::FilePath(file_path),
                                brillo::Stream::AccessMode::READ,
@@ -99,7 +124,93 @@ void FileFetcher::TerminateTransfer() {
   }
 }
 
+bool FileFetcher::MapFile(const string& file_path) {
+  mapped_fd_ = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (mapped_fd_ < 0) {
+    PLOG(ERROR) << "Couldn't open " << file_path;
+    return false;
+  }
+  struct stat stbuf;
+  if (fstat(mapped_fd_, &stbuf) != 0) {
+    PLOG(ERROR) << "Couldn't stat " << file_path;
+    return false;
+  }
+
+  uint64_t end = stbuf.st_size;
+  if (data_length_ >= 0)
+    end = std::min(end, offset_ + static_cast<uint64_t>(data_length_));
+  if (offset_ >= end) {
+    // Nothing to map, the transfer completes right away.
+    return true;
+  }
+  // The mapping must start at a page boundary.
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  mapped_offset_ = offset_ - offset_ % page_size;
+  mapped_position_ = offset_ - mapped_offset_;
+  mapped_size_ = end - mapped_offset_;
+  void* data = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, mapped_fd_,
+                    mapped_offset_);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Couldn't map " << mapped_size_ << " bytes of "
+                << file_path;
+    mapped_size_ = 0;
+    return false;
+  }
+  mapped_data_ = static_cast<uint8_t*>(data);
+  PLOG_IF(WARNING, madvise(mapped_data_, mapped_size_, MADV_SEQUENTIAL) != 0)
+      << "Couldn't advise the kernel of the sequential access";
+  return true;
+}
+
+void FileFetcher::OnMappedDataCallback() {
+  mapped_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  if (transfer_paused_ || !transfer_in_progress_)
+    return;
+  if (mapped_position_ >= mapped_size_) {
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+    return;
+  }
+
+  const uint8_t* data = mapped_data_ + mapped_position_;
+  size_t length = std::min(kMappedChunkSize, mapped_size_ - mapped_position_);
+  mapped_position_ += length;
+  bytes_copied_ += length;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, data, length);
+  // The delegate may have terminated the transfer.
+  if (!transfer_in_progress_)
+    return;
+
+  // The delegate is done with the data passed so far, so drop the pages that
+  // are entirely behind the current position from the mapping and the page
+  // cache.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t release_end = mapped_position_ - mapped_position_ % page_size;
+  if (release_end > released_size_) {
+    madvise(mapped_data_ + released_size_, release_end - released_size_,
+            MADV_DONTNEED);
+    posix_fadvise(mapped_fd_, mapped_offset_ + released_size_,
+                  release_end - released_size_, POSIX_FADV_DONTNEED);
+    released_size_ = release_end;
+  }
+  ScheduleRead();
+}
+
 void FileFetcher::ScheduleRead() {
+  if (use_mmap_) {
+    if (transfer_paused_ || !transfer_in_progress_ ||
+        mapped_task_id_ != brillo::MessageLoop::kTaskIdNull) {
+      return;
+    }
+    mapped_task_id_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnMappedDataCallback,
+                   base::Unretained(this)));
+    return;
+  }
+
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
@@ -179,6 +290,23 @@ void FileFetcher::CleanUp() {
   ongoing_read_ = false;
   buffer_ = brillo::Blob();
 
+  if (mapped_task_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(mapped_task_id_);
+    mapped_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  if (mapped_data_) {
+    munmap(mapped_data_, mapped_size_);
+    mapped_data_ = nullptr;
+  }
+  if (mapped_fd_ >= 0) {
+    IGNORE_EINTR(close(mapped_fd_));
+    mapped_fd_ = -1;
+  }
+  mapped_size_ = 0;
+  mapped_offset_ = 0;
+  mapped_position_ = 0;
+  released_size_ = 0;
+
   transfer_in_progress_ = false;
   transfer_paused_ = false;
 }
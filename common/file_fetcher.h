@@ -74,6 +74,13 @@ class FileFetcher : public HttpFetcher {
   void set_connect_timeout(int connect_timeout_seconds) override {}
   void set_max_retry_count(int max_retry_count) override {}
 
+  // Maps the file in memory and passes views of the mapping to the delegate
+  // instead of reading it into a buffer first. The pages already passed to
+  // the delegate are dropped as the transfer advances, so only a small part
+  // of the file stays in the page cache. Must be called before
+  // BeginTransfer().
+  void set_use_mmap(bool use_mmap) { use_mmap_ = use_mmap; }
+
  private:
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
@@ -82,6 +89,14 @@ class FileFetcher : public HttpFetcher {
   // read is in process. This method can be called at any point.
   void ScheduleRead();
 
+  // Maps the requested range of the |file_path| for the mmap mode. Returns
+  // whether it succeeded.
+  bool MapFile(const std::string& file_path);
+
+  // Called from the main loop in the mmap mode to pass the next piece of the
+  // mapping to the delegate, or complete the transfer at the end of it.
+  void OnMappedDataCallback();
+
   // Called from the main loop when a single read from |stream_| succeeds or
   // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
   void OnReadDoneCallback(size_t bytes_read);
@@ -111,6 +126,20 @@ class FileFetcher : public HttpFetcher {
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
+  // The mmap mode state. |mapped_data_| maps |mapped_size_| bytes of the file
+  // starting at the page aligned |mapped_offset_|, and |mapped_position_| is
+  // the position of the next byte to pass to the delegate within it. The
+  // pages before |released_size_| were already dropped.
+  bool use_mmap_{false};
+  int mapped_fd_{-1};
+  uint8_t* mapped_data_{nullptr};
+  size_t mapped_size_{0};
+  off_t mapped_offset_{0};
+  size_t mapped_position_{0};
+  size_t released_size_{0};
+  brillo::MessageLoop::TaskId mapped_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   DISALLOW_COPY_AND_ASSIGN(FileFetcher);
 };
 
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/gzip.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The window bits selecting the gzip format for deflateInit2(), and the
+// automatic detection of the gzip and zlib formats for inflateInit2().
+const int kGzipWindowBits = MAX_WBITS + 16;
+const int kAutoDetectWindowBits = MAX_WBITS + 32;
+
+}  // namespace
+
+bool GzipCompress(const void* data, size_t size, brillo::Blob* out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(deflateInit2(&stream,
+                                     Z_DEFAULT_COMPRESSION,
+                                     Z_DEFLATED,
+                                     kGzipWindowBits,
+                                     8,
+                                     Z_DEFAULT_STRATEGY) == Z_OK);
+  out->resize(deflateBound(&stream, size));
+  stream.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+  stream.avail_in = size;
+  stream.next_out = out->data();
+  stream.avail_out = out->size();
+  // The bound makes the whole output fit in one call.
+  const int ret = deflate(&stream, Z_FINISH);
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+  TEST_AND_RETURN_FALSE(ret == Z_STREAM_END);
+  return true;
+}
+
+GzipDecompressor::~GzipDecompressor() {
+  if (initialized_)
+    inflateEnd(&stream_);
+}
+
+bool GzipDecompressor::Decompress(const void* data,
+                                  size_t size,
+                                  brillo::Blob* out) {
+  if (size == 0)
+    return true;
+  TEST_AND_RETURN_FALSE(!finished_);
+  if (!initialized_)
+    TEST_AND_RETURN_FALSE(InitStream(false));
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (!raw_ && stream_.total_out == 0)
+    header_.insert(header_.end(), bytes, bytes + size);
+  if (Inflate(bytes, size, out)) {
+    if (stream_.total_out > 0)
+      brillo::Blob().swap(header_);
+    return true;
+  }
+
+  // A body not starting with a gzip or zlib header may be a raw deflate
+  // stream, decompressed again from its beginning.
+  TEST_AND_RETURN_FALSE(!raw_ && stream_.total_out == 0);
+  brillo::Blob header;
+  header.swap(header_);
+  inflateEnd(&stream_);
+  initialized_ = false;
+  TEST_AND_RETURN_FALSE(InitStream(true));
+  return Inflate(header.data(), header.size(), out);
+}
+
+bool GzipDecompressor::InitStream(bool raw) {
+  memset(&stream_, 0, sizeof(stream_));
+  TEST_AND_RETURN_FALSE(
+      inflateInit2(&stream_, raw ? -MAX_WBITS : kAutoDetectWindowBits) ==
+      Z_OK);
+  initialized_ = true;
+  raw_ = raw;
+  return true;
+}
+
+bool GzipDecompressor::Inflate(const uint8_t* data,
+                               size_t size,
+                               brillo::Blob* out) {
+  stream_.next_in = const_cast<Bytef*>(data);
+  stream_.avail_in = size;
+  uint8_t buffer[16 * 1024];
+  // The output may need more than one buffer even after all the input was
+  // consumed.
+  do {
+    stream_.next_out = buffer;
+    stream_.avail_out = sizeof(buffer);
+    const int ret = inflate(&stream_, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      return false;
+    out->insert(
+        out->end(), buffer, buffer + sizeof(buffer) - stream_.avail_out);
+    finished_ = ret == Z_STREAM_END;
+    // No progress can be made without more input.
+    if (ret == Z_BUF_ERROR)
+      break;
+  } while (!finished_ && (stream_.avail_in > 0 || stream_.avail_out == 0));
+  // The body can't continue after the end of the stream.
+  return stream_.avail_in == 0;
+}
+
+}  // namespace chromeos_update_engine
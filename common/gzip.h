@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_GZIP_H_
+#define UPDATE_ENGINE_COMMON_GZIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Compresses the |size| bytes at |data| in the gzip format into |out|, as sent
+// with a "gzip" Content-Encoding.
+bool GzipCompress(const void* data, size_t size, brillo::Blob* out);
+
+// GzipDecompressor inflates a compressed HTTP body as it's received, for the
+// "gzip" and "deflate" Content-Encodings. The format is detected from the
+// first bytes, and the "deflate" bodies may be zlib streams or, as sent by
+// some servers, raw deflate streams.
+class GzipDecompressor {
+ public:
+  GzipDecompressor() = default;
+  ~GzipDecompressor();
+
+  // Appends the data decompressed from the next |size| bytes of the body at
+  // |data| to |out|. Returns false if the body is corrupted or continues past
+  // the end of the stream.
+  bool Decompress(const void* data, size_t size, brillo::Blob* out);
+
+  // Whether the end of the stream was decompressed, which must be the case
+  // once the whole body was received.
+  bool finished() const { return finished_; }
+
+ private:
+  // Initializes the |stream_| for a gzip or zlib stream, or a raw deflate
+  // stream if |raw|.
+  bool InitStream(bool raw);
+
+  // Inflates the |size| bytes at |data| with the |stream_| into |out|.
+  bool Inflate(const uint8_t* data, size_t size, brillo::Blob* out);
+
+  z_stream stream_;
+  bool initialized_{false};
+  bool raw_{false};
+  bool finished_{false};
+
+  // The body received before the first decompressed byte, decompressed again
+  // as a raw deflate stream if it isn't a gzip or zlib stream.
+  brillo::Blob header_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipDecompressor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_GZIP_H_
@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/gzip.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kBody[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><response protocol=\"3.0\">"
+    "<app appid=\"test-app-id\" status=\"ok\"><updatecheck status=\"noupdate\""
+    "/></app></response>";
+
+// Compresses the |data| with deflate() using the |window_bits|.
+brillo::Blob Deflate(const brillo::Blob& data, int window_bits) {
+  z_stream stream = {};
+  EXPECT_EQ(Z_OK,
+            deflateInit2(&stream,
+                         Z_DEFAULT_COMPRESSION,
+                         Z_DEFLATED,
+                         window_bits,
+                         8,
+                         Z_DEFAULT_STRATEGY));
+  brillo::Blob out(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<Bytef*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+}  // namespace
+
+class GzipTest : public ::testing::Test {
+ protected:
+  brillo::Blob body_{kBody, kBody + strlen(kBody)};
+};
+
+TEST_F(GzipTest, RoundTripTest) {
+  brillo::Blob compressed;
+  EXPECT_TRUE(GzipCompress(body_.data(), body_.size(), &compressed));
+  // The gzip magic.
+  ASSERT_LT(2U, compressed.size());
+  EXPECT_EQ(0x1f, compressed[0]);
+  EXPECT_EQ(0x8b, compressed[1]);
+
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  EXPECT_TRUE(decompressor.Decompress(
+      compressed.data(), compressed.size(), &decompressed));
+  EXPECT_TRUE(decompressor.finished());
+  EXPECT_EQ(body_, decompressed);
+}
+
+TEST_F(GzipTest, SplitBodyTest) {
+  brillo::Blob compressed;
+  EXPECT_TRUE(GzipCompress(body_.data(), body_.size(), &compressed));
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  // The body is received one byte at a time.
+  for (uint8_t byte : compressed) {
+    EXPECT_FALSE(decompressor.finished());
+    EXPECT_TRUE(decompressor.Decompress(&byte, 1, &decompressed));
+  }
+  EXPECT_TRUE(decompressor.finished());
+  EXPECT_EQ(body_, decompressed);
+}
+
+TEST_F(GzipTest, DeflateTest) {
+  // The "deflate" bodies may be zlib or raw deflate streams.
+  for (int window_bits : {MAX_WBITS, -MAX_WBITS}) {
+    brillo::Blob compressed = Deflate(body_, window_bits);
+    GzipDecompressor decompressor;
+    brillo::Blob decompressed;
+    EXPECT_TRUE(decompressor.Decompress(compressed.data(), 2, &decompressed));
+    EXPECT_TRUE(decompressor.Decompress(
+        compressed.data() + 2, compressed.size() - 2, &decompressed));
+    EXPECT_TRUE(decompressor.finished());
+    EXPECT_EQ(body_, decompressed);
+  }
+}
+
+TEST_F(GzipTest, InvalidBodyTest) {
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  const string garbage = "\xff\xff\xff\xff not compressed";
+  EXPECT_FALSE(
+      decompressor.Decompress(garbage.data(), garbage.size(), &decompressed));
+  EXPECT_FALSE(decompressor.finished());
+}
+
+TEST_F(GzipTest, TruncatedBodyTest) {
+  brillo::Blob compressed;
+  EXPECT_TRUE(GzipCompress(body_.data(), body_.size(), &compressed));
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  EXPECT_TRUE(decompressor.Decompress(
+      compressed.data(), compressed.size() - 4, &decompressed));
+  EXPECT_FALSE(decompressor.finished());
+}
+
+TEST_F(GzipTest, TrailingDataTest) {
+  brillo::Blob compressed;
+  EXPECT_TRUE(GzipCompress(body_.data(), body_.size(), &compressed));
+  compressed.push_back('x');
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  EXPECT_FALSE(decompressor.Decompress(
+      compressed.data(), compressed.size(), &decompressed));
+}
+
+}  // namespace chromeos_update_engine
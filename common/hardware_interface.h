@@ -81,6 +81,10 @@ class HardwareInterface {
   // powerwash cycles. In case of an error, such as no directory available,
   // returns false.
   virtual bool GetPowerwashSafeDirectory(base::FilePath* path) const = 0;
+
+  // Returns whether the device is powered by an external source, such as an
+  // AC adapter, rather than only by its battery.
+  virtual bool IsOnACPower() const = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -18,6 +18,8 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 #include <brillo/data_encoding.h>
@@ -25,9 +27,19 @@
 #include "update_engine/common/utils.h"
 
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The size of the chunks UpdateAll() passes to each calculator in turn. It's
+// small enough for a chunk to stay in the CPU cache while all the calculators
+// hash it.
+const size_t kUpdateAllChunkSize = 32 * 1024;  // 32 KiB
+
+}  // namespace
+
 HashCalculator::HashCalculator() : valid_(false) {
   valid_ = (SHA256_Init(&ctx_) == 1);
   LOG_IF(ERROR, !valid_) << "SHA256_Init failed";
@@ -44,6 +56,18 @@ bool HashCalculator::Update(const void* data, size_t length) {
   return true;
 }
 
+bool HashCalculator::UpdateAll(const vector<HashCalculator*>& calculators,
+                               const void* data,
+                               size_t length) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t offset = 0; offset < length; offset += kUpdateAllChunkSize) {
+    const size_t chunk = std::min(kUpdateAllChunkSize, length - offset);
+    for (HashCalculator* calculator : calculators)
+      TEST_AND_RETURN_FALSE(calculator->Update(bytes + offset, chunk));
+  }
+  return true;
+}
+
 off_t HashCalculator::UpdateFile(const string& name, off_t length) {
   int fd = HANDLE_EINTR(open(name.c_str(), O_RDONLY));
   if (fd < 0) {
@@ -44,6 +44,13 @@ class HashCalculator {
   // Returns true on success.
   bool Update(const void* data, size_t length);
 
+  // Updates each of the |calculators| with the same |length| bytes of |data|.
+  // The data is passed to all of them one small chunk at a time, so it's read
+  // from memory once instead of once per calculator. Returns true on success.
+  static bool UpdateAll(const std::vector<HashCalculator*>& calculators,
+                        const void* data,
+                        size_t length);
+
   // Updates the hash with up to |length| bytes of data from |file|. If |length|
   // is negative, reads in and updates with the whole file. Returns the number
   // of bytes that the hash was updated with, or -1 on error.
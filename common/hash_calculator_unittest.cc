@@ -84,6 +84,27 @@ TEST_F(HashCalculatorTest, ContextTest) {
   EXPECT_TRUE(raw_hash == calc_next.raw_hash());
 }
 
+TEST_F(HashCalculatorTest, UpdateAllTest) {
+  // Large enough to be split in several chunks.
+  brillo::Blob data(100 * 1024 + 7);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 31;
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(data, &expected_hash));
+
+  HashCalculator calc1, calc2;
+  EXPECT_TRUE(calc1.Update("hi", 2));
+  EXPECT_TRUE(HashCalculator::UpdateAll({&calc1, &calc2}, data.data(),
+                                        data.size()));
+  EXPECT_TRUE(calc1.Finalize());
+  EXPECT_TRUE(calc2.Finalize());
+  EXPECT_EQ(expected_hash, calc2.raw_hash());
+
+  brillo::Blob data_after_hi = {'h', 'i'};
+  data_after_hi.insert(data_after_hi.end(), data.begin(), data.end());
+  EXPECT_EQ(HashCalculator::HashOfData(data_after_hi), calc1.hash());
+}
+
 TEST_F(HashCalculatorTest, BigTest) {
   HashCalculator calc;
 
@@ -27,6 +27,7 @@
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/http_common.h"
+#include "update_engine/common/throughput_estimator.h"
 #include "update_engine/proxy_resolver.h"
 
 // This class is a simple wrapper around an HTTP library (libcurl). We can
@@ -128,11 +129,29 @@ class HttpFetcher {
   // Sets the number of allowed retries.
   virtual void set_max_retry_count(int max_retry_count) = 0;
 
+  // Limits the download rate to |max_speed_bps| bytes/sec, or removes the
+  // limit when 0. The new limit also applies to the transfer in progress.
+  virtual void set_max_receive_speed(int max_speed_bps) {}
+
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Sets |header_value| to the value of the |header_name| header of the last
+  // response received. Returns false if the response had no such header or
+  // if the fetcher doesn't keep the response headers.
+  virtual bool GetResponseHeader(const std::string& header_name,
+                                 std::string* header_value) const {
+    return false;
+  }
+
   ProxyResolver* proxy_resolver() const { return proxy_resolver_; }
 
+  // The network statistics of the current or last transfer, across its
+  // retries.
+  const TransferStats& transfer_stats() const {
+    return throughput_estimator_.stats();
+  }
+
  protected:
   // The URL we're actively fetching from
   std::string url_;
@@ -162,6 +181,9 @@ class HttpFetcher {
   // Callback for when we are resolving proxies
   std::unique_ptr<base::Closure> callback_;
 
+  // Measures the transfer; fed by the implementations as the data arrives.
+  ThroughputEstimator throughput_estimator_;
+
  private:
   // Callback from the proxy resolver
   void ProxiesResolved(const std::deque<std::string>& proxies);
@@ -70,6 +70,10 @@ const int kMediumLength        = 1000;
 const int kFlakyTruncateLength = 29000;
 const int kFlakySleepEvery     = 3;
 const int kFlakySleepSecs      = 10;
+const int kShapedBytesPerSec   = 1000000;
+const int kShapedLatencyMs     = 20;
+const int kShapedJitterMs      = 10;
+const int kShapedSlowStartMs   = 50;
 
 }  // namespace
 
@@ -305,6 +309,25 @@ class LibcurlHttpFetcherTest : public AnyHttpFetcherTest {
   }
 };
 
+class LibcurlSocketCallbacksHttpFetcherTest : public LibcurlHttpFetcherTest {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher(ProxyResolver* proxy_resolver) override {
+    LibcurlHttpFetcher* ret = static_cast<LibcurlHttpFetcher*>(
+        LibcurlHttpFetcherTest::NewLargeFetcher(proxy_resolver));
+    ret->set_socket_callbacks_enabled(true);
+    ret->set_receive_buffer_size(256 * 1024);
+    return ret;
+  }
+
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewSmallFetcher;
+  HttpFetcher* NewSmallFetcher(ProxyResolver* proxy_resolver) override {
+    return NewLargeFetcher(proxy_resolver);
+  }
+};
+
 class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
  public:
   // Necessary to unhide the definition in the base class.
@@ -367,6 +390,17 @@ class FileFetcherTest : public AnyHttpFetcherTest {
   test_utils::ScopedTempFile temp_file_{"ue_file_fetcher.XXXXXX"};
 };
 
+class MmapFileFetcherTest : public FileFetcherTest {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher(ProxyResolver* /* proxy_resolver */) override {
+    FileFetcher* fetcher = new FileFetcher();
+    fetcher->set_use_mmap(true);
+    return fetcher;
+  }
+};
+
 //
 // Infrastructure for type tests of HTTP fetcher.
 // See: http://code.google.com/p/googletest/wiki/AdvancedGuide#Typed_Tests
@@ -402,9 +436,11 @@ class HttpFetcherTest : public ::testing::Test {
 
 // Test case types list.
 typedef ::testing::Types<LibcurlHttpFetcherTest,
+                         LibcurlSocketCallbacksHttpFetcherTest,
                          MockHttpFetcherTest,
                          MultiRangeHttpFetcherTest,
-                         FileFetcherTest>
+                         FileFetcherTest,
+                         MmapFileFetcherTest>
     HttpFetcherTestTypes;
 TYPED_TEST_CASE(HttpFetcherTest, HttpFetcherTestTypes);
 
@@ -761,6 +797,40 @@ TYPED_TEST(HttpFetcherTest, FlakyTest) {
   }
 }
 
+TYPED_TEST(HttpFetcherTest, ShapedTest) {
+  if (this->test_.IsMock() || !this->test_.IsHttpSupported())
+    return;
+  {
+    // The connection is reset midway, and the transfer resumed from there.
+    FlakyHttpFetcherTestDelegate delegate;
+    unique_ptr<HttpFetcher> fetcher(this->test_.NewSmallFetcher());
+    fetcher->set_delegate(&delegate);
+
+    unique_ptr<HttpServer> server(this->test_.CreateServer());
+    ASSERT_TRUE(server->started_);
+
+    this->loop_.PostTask(FROM_HERE, base::Bind(
+        &StartTransfer,
+        fetcher.get(),
+        LocalServerUrlForPath(server->GetPort(),
+                              base::StringPrintf("/shaped/%d/%d/%d/%d/%d/%d",
+                                                 kBigLength,
+                                                 kShapedBytesPerSec,
+                                                 kShapedLatencyMs,
+                                                 kShapedJitterMs,
+                                                 kFlakyTruncateLength,
+                                                 kShapedSlowStartMs))));
+    this->loop_.Run();
+
+    // verify the data we get back
+    ASSERT_EQ(kBigLength, static_cast<int>(delegate.data.size()));
+    for (int i = 0; i < kBigLength; i += 10) {
+      // Assert so that we don't flood the screen w/ EXPECT errors on failure.
+      ASSERT_EQ(delegate.data.substr(i, 10), "abcdefghij");
+    }
+  }
+}
+
 namespace {
 // This delegate kills the server attached to it after receiving any bytes.
 // This can be used for testing what happens when you try to fetch data and
@@ -1080,6 +1150,54 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherSimpleTest) {
             kHttpResponsePartialContent);
 }
 
+namespace {
+// Replaces the ranges after the first one when receiving its first bytes.
+class ReplaceRangesTestDelegate : public MultiHttpFetcherTestDelegate {
+ public:
+  explicit ReplaceRangesTestDelegate(int expected_response_code)
+      : MultiHttpFetcherTestDelegate(expected_response_code) {}
+
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes, size_t length) override {
+    if (!replaced_) {
+      replaced_ = true;
+      EXPECT_TRUE(static_cast<MultiRangeHttpFetcher*>(fetcher)
+                      ->ReplaceRangesAfter(0, {{50, 10}, {81, 5}}));
+    }
+    MultiHttpFetcherTestDelegate::ReceivedBytes(fetcher, bytes, length);
+  }
+
+  bool replaced_{false};
+};
+}  // namespace
+
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherReplaceRangesTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  ReplaceRangesTestDelegate delegate(kHttpResponsePartialContent);
+  MultiRangeHttpFetcher* multi_fetcher =
+      static_cast<MultiRangeHttpFetcher*>(this->test_.NewLargeFetcher());
+  delegate.fetcher_.reset(multi_fetcher);
+  multi_fetcher->ClearRanges();
+  multi_fetcher->AddRange(0, 25);
+  multi_fetcher->AddRange(99);
+  this->test_.fake_hardware()->SetIsOfficialBuild(false);
+  multi_fetcher->set_delegate(&delegate);
+
+  this->loop_.PostTask(
+      FROM_HERE,
+      base::Bind(StartTransfer, multi_fetcher,
+                 this->test_.BigUrl(server->GetPort())));
+  this->loop_.Run();
+
+  EXPECT_TRUE(delegate.replaced_);
+  EXPECT_EQ("abcdefghijabcdefghijabcde" "abcdefghij" "bcdef", delegate.data);
+}
+
 TYPED_TEST(HttpFetcherTest, MultiHttpFetcherLengthLimitTest) {
   if (!this->test_.IsMulti())
     return;
@@ -1188,6 +1306,107 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherErrorIfOffsetUnrecoverableTest) {
             kHttpResponseUndefined);
 }
 
+namespace {
+// Adds |num_fetchers| parallel LibcurlHttpFetchers to the MultiRangeHttpFetcher
+// |fetcher_in|, using small segments so the ranges are split over all of them.
+HttpFetcher* AddParallelFetchers(HttpFetcher* fetcher_in,
+                                 FakeHardware* fake_hardware,
+                                 int num_fetchers) {
+  MultiRangeHttpFetcher* multi_fetcher =
+      static_cast<MultiRangeHttpFetcher*>(fetcher_in);
+  for (int i = 0; i < num_fetchers; i++) {
+    multi_fetcher->AddParallelFetcher(
+        new LibcurlHttpFetcher(multi_fetcher->proxy_resolver(), fake_hardware));
+  }
+  multi_fetcher->set_parallel_limits(1000, 5000);
+  // Speed up test execution.
+  multi_fetcher->set_idle_seconds(1);
+  multi_fetcher->set_retry_seconds(1);
+  return multi_fetcher;
+}
+}  // namespace
+
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherParallelTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  string big_data;
+  for (int i = 0; i < kBigLength; i++)
+    big_data.push_back('a' + i % 10);
+
+  // The whole data is passed as the expected prefix, so it must arrive in
+  // order even though the segments are fetched over three connections.
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, 25));
+  ranges.push_back(make_pair(99, kBigLength - 99));
+  MultiTest(AddParallelFetchers(this->test_.NewLargeFetcher(),
+                                this->test_.fake_hardware(),
+                                2),
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            big_data.substr(0, 25) + big_data.substr(99),
+            kBigLength - (99 - 25),
+            kHttpResponsePartialContent);
+}
+
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherParallelInsufficientTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(kBigLength - 2, 4));
+  MultiTest(AddParallelFetchers(this->test_.NewLargeFetcher(),
+                                this->test_.fake_hardware(),
+                                2),
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            "ij",
+            2,
+            kHttpResponseUndefined);
+}
+
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherParallelFailoverTest) {
+  if (!this->test_.IsMulti())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  string big_data;
+  for (int i = 0; i < kBigLength; i++)
+    big_data.push_back('a' + i % 10);
+
+  // The extra connection fetches from a URL failing every request, so it is
+  // dropped and all its segments come from the base connection.
+  MultiRangeHttpFetcher* multi_fetcher =
+      static_cast<MultiRangeHttpFetcher*>(this->test_.NewLargeFetcher());
+  multi_fetcher->AddParallelFetcher(
+      new LibcurlHttpFetcher(multi_fetcher->proxy_resolver(),
+                             this->test_.fake_hardware()),
+      LocalServerUrlForPath(server->GetPort(), "/error"));
+  multi_fetcher->set_parallel_limits(1000, 5000);
+  multi_fetcher->set_idle_seconds(1);
+  multi_fetcher->set_retry_seconds(1);
+
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, kBigLength));
+  MultiTest(multi_fetcher,
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            big_data,
+            kBigLength,
+            kHttpResponsePartialContent);
+}
+
 
 
 namespace {
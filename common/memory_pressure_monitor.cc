@@ -0,0 +1,199 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/common/memory_pressure_monitor.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+const char MemoryPressureMonitor::kPsiMemoryPath[] = "/proc/pressure/memory";
+const int MemoryPressureMonitor::kRestoreDelaySeconds = 30;
+const int MemoryPressureMonitor::kPsiPollSeconds = 5;
+const double MemoryPressureMonitor::kPsiPressureThreshold = 10.0;
+
+// static
+MemoryPressureMonitor* MemoryPressureMonitor::current_monitor_ = nullptr;
+
+MemoryPressureMonitor::~MemoryPressureMonitor() {
+  for (MessageLoop::TaskId task_id :
+       {memcg_task_id_, psi_task_id_, restore_task_id_}) {
+    if (task_id != MessageLoop::kTaskIdNull)
+      MessageLoop::current()->CancelTask(task_id);
+  }
+  if (memcg_event_fd_ >= 0)
+    IGNORE_EINTR(close(memcg_event_fd_));
+  if (current_monitor_ == this)
+    current_monitor_ = nullptr;
+}
+
+void MemoryPressureMonitor::Init(const string& memcg_dir,
+                                 const string& psi_path) {
+  CHECK(current_monitor_ == nullptr);
+  current_monitor_ = this;
+  if (WatchMemcgPressure(memcg_dir)) {
+    LOG(INFO) << "Watching the memory pressure events of " << memcg_dir;
+  } else if (utils::FileExists(psi_path.c_str())) {
+    LOG(INFO) << "Polling the memory pressure from " << psi_path
+              << " during the updates.";
+    psi_path_ = psi_path;
+  } else {
+    LOG(INFO) << "The memory pressure isn't reported, the caches won't be "
+              << "shrunk.";
+  }
+}
+
+void MemoryPressureMonitor::AddCache(ShrinkableCache* cache) {
+  caches_.insert(cache);
+  if (under_pressure_)
+    cache->ShrinkToMinimum();
+  if (!psi_path_.empty() && psi_task_id_ == MessageLoop::kTaskIdNull) {
+    psi_task_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&MemoryPressureMonitor::PollPsi, base::Unretained(this)),
+        base::TimeDelta::FromSeconds(kPsiPollSeconds));
+  }
+}
+
+void MemoryPressureMonitor::RemoveCache(ShrinkableCache* cache) {
+  // The PSI polling stops by itself once there are no caches left.
+  caches_.erase(cache);
+}
+
+void MemoryPressureMonitor::OnMemoryPressure() {
+  if (under_pressure_) {
+    pressure_reported_ = true;
+    return;
+  }
+  LOG(WARNING) << "Memory pressure reported, shrinking " << caches_.size()
+               << " caches.";
+  under_pressure_ = true;
+  pressure_reported_ = false;
+  for (ShrinkableCache* cache : caches_)
+    cache->ShrinkToMinimum();
+  restore_task_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&MemoryPressureMonitor::CheckPressureEnded,
+                 base::Unretained(this)),
+      base::TimeDelta::FromSeconds(kRestoreDelaySeconds));
+}
+
+bool MemoryPressureMonitor::WatchMemcgPressure(const string& memcg_dir) {
+  if (memcg_dir.empty())
+    return false;
+  const string level_path = memcg_dir + "/memory.pressure_level";
+  int level_fd = HANDLE_EINTR(open(level_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (level_fd < 0)
+    return false;
+  ScopedFdCloser level_fd_closer(&level_fd);
+  int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  TEST_AND_RETURN_FALSE_ERRNO(event_fd >= 0);
+  ScopedFdCloser event_fd_closer(&event_fd);
+
+  // The "medium" level is reported when the kernel starts swapping or
+  // evicting the page cache of the apps, before any of them is killed.
+  const string control =
+      base::StringPrintf("%d %d medium", event_fd, level_fd);
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile((memcg_dir + "/cgroup.event_control").c_str(),
+                       control.data(),
+                       control.size()));
+  memcg_task_id_ = MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE,
+      event_fd,
+      MessageLoop::WatchMode::kWatchRead,
+      true,
+      base::Bind(&MemoryPressureMonitor::OnMemcgEvent,
+                 base::Unretained(this)));
+  TEST_AND_RETURN_FALSE(memcg_task_id_ != MessageLoop::kTaskIdNull);
+  event_fd_closer.set_should_close(false);
+  memcg_event_fd_ = event_fd;
+  return true;
+}
+
+void MemoryPressureMonitor::OnMemcgEvent() {
+  uint64_t num_events = 0;
+  if (HANDLE_EINTR(read(memcg_event_fd_, &num_events, sizeof(num_events))) !=
+          sizeof(num_events) ||
+      num_events == 0) {
+    return;
+  }
+  OnMemoryPressure();
+}
+
+void MemoryPressureMonitor::PollPsi() {
+  psi_task_id_ = MessageLoop::kTaskIdNull;
+  if (caches_.empty())
+    return;
+  // The first line is "some avg10=<percent> avg60=... avg300=... total=...".
+  string psi;
+  double some_avg10 = 0;
+  if (utils::ReadFile(psi_path_, &psi) &&
+      sscanf(psi.c_str(), "some avg10=%lf", &some_avg10) == 1 &&
+      some_avg10 >= kPsiPressureThreshold) {
+    OnMemoryPressure();
+  }
+  psi_task_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&MemoryPressureMonitor::PollPsi, base::Unretained(this)),
+      base::TimeDelta::FromSeconds(kPsiPollSeconds));
+}
+
+void MemoryPressureMonitor::CheckPressureEnded() {
+  restore_task_id_ = MessageLoop::kTaskIdNull;
+  if (pressure_reported_) {
+    pressure_reported_ = false;
+    restore_task_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&MemoryPressureMonitor::CheckPressureEnded,
+                   base::Unretained(this)),
+        base::TimeDelta::FromSeconds(kRestoreDelaySeconds));
+    return;
+  }
+  LOG(INFO) << "The memory pressure ended, restoring " << caches_.size()
+            << " caches.";
+  under_pressure_ = false;
+  for (ShrinkableCache* cache : caches_)
+    cache->RestoreCapacity();
+}
+
+ShrinkableCacheRegistration::ShrinkableCacheRegistration(
+    ShrinkableCache* cache)
+    : cache_(cache), monitor_(MemoryPressureMonitor::current()) {
+  if (monitor_)
+    monitor_->AddCache(cache_);
+}
+
+ShrinkableCacheRegistration::~ShrinkableCacheRegistration() {
+  if (monitor_)
+    monitor_->RemoveCache(cache_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
+
+#include <set>
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
+
+namespace chromeos_update_engine {
+
+// A cache or a pool of buffers holding memory that can be given back when the
+// system runs low on memory, at the cost of reading or allocating it again.
+class ShrinkableCache {
+ public:
+  virtual ~ShrinkableCache() = default;
+
+  // Frees all the memory the cache can do without and keeps it at that
+  // minimum until RestoreCapacity() is called. It may be called again while
+  // the cache is shrunk, from the thread running the message loop.
+  virtual void ShrinkToMinimum() = 0;
+
+  // Lets the cache grow back to its configured size.
+  virtual void RestoreCapacity() = 0;
+};
+
+// MemoryPressureMonitor watches the memory pressure reported by the kernel and
+// shrinks the registered caches while it lasts, so an update doesn't get the
+// foreground apps killed by the low memory killer. The caches are restored
+// once no pressure was reported for kRestoreDelaySeconds.
+//
+// The pressure is reported by the "medium" level events of the memory cgroup
+// when available, which don't wake the daemon when there isn't any. Otherwise
+// the pressure stall information (PSI) of the memory is polled while caches
+// are registered, that is during an update.
+class MemoryPressureMonitor {
+ public:
+  // The memory pressure stall information of the kernel.
+  static const char kPsiMemoryPath[];
+
+  // The time after the last pressure event after which the caches are
+  // restored, and the period of the PSI polling.
+  static const int kRestoreDelaySeconds;
+  static const int kPsiPollSeconds;
+
+  // The share of the time in the last 10 seconds that some tasks stalled on
+  // memory above which the PSI is considered as pressure.
+  static const double kPsiPressureThreshold;
+
+  MemoryPressureMonitor() = default;
+  ~MemoryPressureMonitor();
+
+  // Makes this instance the one returned by current(), where the caches are
+  // registered, and starts watching the pressure events of the memory cgroup
+  // mounted at |memcg_dir|, or the PSI at |psi_path| if the cgroup doesn't
+  // report them. Only one instance can be initialized at a time, on the
+  // thread running the message loop.
+  void Init(const std::string& memcg_dir, const std::string& psi_path);
+
+  // Returns the initialized MemoryPressureMonitor, or nullptr if none.
+  static MemoryPressureMonitor* current() { return current_monitor_; }
+
+  // Adds or removes a |cache| to shrink under memory pressure. A cache added
+  // while under pressure is shrunk right away. Like the rest of this class,
+  // they must be called on the thread running the message loop.
+  void AddCache(ShrinkableCache* cache);
+  void RemoveCache(ShrinkableCache* cache);
+
+  // Shrinks all the caches, when the kernel reports memory pressure.
+  void OnMemoryPressure();
+
+  bool under_pressure() const { return under_pressure_; }
+
+ private:
+  // Registers an eventfd for the pressure events of the memory cgroup at
+  // |memcg_dir|. Returns whether it could.
+  bool WatchMemcgPressure(const std::string& memcg_dir);
+
+  // Drains the eventfd of the memory cgroup and handles its events.
+  void OnMemcgEvent();
+
+  // Reads the PSI of the memory and handles it as pressure if it's above the
+  // threshold, then schedules the next poll.
+  void PollPsi();
+
+  // Restores the caches if no pressure was reported since the previous call,
+  // or checks again later otherwise.
+  void CheckPressureEnded();
+
+  // The current MemoryPressureMonitor instance, if any.
+  static MemoryPressureMonitor* current_monitor_;
+
+  std::string psi_path_;
+  int memcg_event_fd_{-1};
+  brillo::MessageLoop::TaskId memcg_task_id_{brillo::MessageLoop::kTaskIdNull};
+  brillo::MessageLoop::TaskId psi_task_id_{brillo::MessageLoop::kTaskIdNull};
+  brillo::MessageLoop::TaskId restore_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  // The registered caches and whether they are shrunk, and whether pressure
+  // was reported since the last CheckPressureEnded().
+  std::set<ShrinkableCache*> caches_;
+  bool under_pressure_{false};
+  bool pressure_reported_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryPressureMonitor);
+};
+
+// Registers a cache with the current MemoryPressureMonitor, if any, for the
+// lifetime of this instance, which must end before the cache's.
+class ShrinkableCacheRegistration {
+ public:
+  explicit ShrinkableCacheRegistration(ShrinkableCache* cache);
+  ~ShrinkableCacheRegistration();
+
+ private:
+  ShrinkableCache* const cache_;
+
+  // The monitor the |cache_| is registered with, if any.
+  MemoryPressureMonitor* monitor_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShrinkableCacheRegistration);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
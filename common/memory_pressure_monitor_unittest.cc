@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/common/memory_pressure_monitor.h"
+
+#include <string>
+
+#include <base/test/simple_test_clock.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Counts the calls made to the cache and whether it's shrunk.
+class FakeShrinkableCache : public ShrinkableCache {
+ public:
+  void ShrinkToMinimum() override {
+    shrunk = true;
+    num_shrinks++;
+  }
+  void RestoreCapacity() override { shrunk = false; }
+
+  bool shrunk{false};
+  int num_shrinks{0};
+};
+
+}  // namespace
+
+class MemoryPressureMonitorTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override {
+    monitor_.reset();
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  // Runs the tasks due after |seconds|.
+  void AdvanceSeconds(int seconds) {
+    test_clock_.Advance(TimeDelta::FromSeconds(seconds));
+    while (loop_.RunOnce(false)) {
+    }
+  }
+
+  // Writes the PSI of the memory with the |some_avg10| percentage.
+  void WritePsi(const string& some_avg10) {
+    const string psi = "some avg10=" + some_avg10 +
+                       " avg60=0.00 avg300=0.00 total=0\n"
+                       "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    ASSERT_TRUE(
+        utils::WriteFile(psi_file_.path().c_str(), psi.data(), psi.size()));
+  }
+
+  base::SimpleTestClock test_clock_;
+  brillo::FakeMessageLoop loop_{&test_clock_};
+  test_utils::ScopedTempFile psi_file_{"MemoryPressureMonitor-psi-XXXXXX"};
+  std::unique_ptr<MemoryPressureMonitor> monitor_{new MemoryPressureMonitor()};
+};
+
+TEST_F(MemoryPressureMonitorTest, ShrinkAndRestoreTest) {
+  monitor_->Init("", "");
+  EXPECT_EQ(monitor_.get(), MemoryPressureMonitor::current());
+  FakeShrinkableCache cache;
+  FakeShrinkableCache removed_cache;
+  ShrinkableCacheRegistration registration(&cache);
+  { ShrinkableCacheRegistration removed_registration(&removed_cache); }
+
+  monitor_->OnMemoryPressure();
+  EXPECT_TRUE(monitor_->under_pressure());
+  EXPECT_TRUE(cache.shrunk);
+  EXPECT_FALSE(removed_cache.shrunk);
+  // The caches are only shrunk once while the pressure lasts.
+  monitor_->OnMemoryPressure();
+  EXPECT_EQ(1, cache.num_shrinks);
+
+  // The pressure was reported again since, so the caches stay shrunk.
+  AdvanceSeconds(MemoryPressureMonitor::kRestoreDelaySeconds);
+  EXPECT_TRUE(cache.shrunk);
+  AdvanceSeconds(MemoryPressureMonitor::kRestoreDelaySeconds);
+  EXPECT_FALSE(cache.shrunk);
+  EXPECT_FALSE(monitor_->under_pressure());
+}
+
+TEST_F(MemoryPressureMonitorTest, CacheAddedUnderPressureTest) {
+  monitor_->Init("", "");
+  monitor_->OnMemoryPressure();
+  FakeShrinkableCache cache;
+  ShrinkableCacheRegistration registration(&cache);
+  EXPECT_TRUE(cache.shrunk);
+  AdvanceSeconds(MemoryPressureMonitor::kRestoreDelaySeconds);
+  EXPECT_FALSE(cache.shrunk);
+}
+
+TEST_F(MemoryPressureMonitorTest, PsiPollingTest) {
+  WritePsi("0.50");
+  monitor_->Init("", psi_file_.path());
+  {
+    FakeShrinkableCache cache;
+    ShrinkableCacheRegistration registration(&cache);
+    AdvanceSeconds(MemoryPressureMonitor::kPsiPollSeconds);
+    EXPECT_FALSE(cache.shrunk);
+
+    WritePsi("25.00");
+    AdvanceSeconds(MemoryPressureMonitor::kPsiPollSeconds);
+    EXPECT_TRUE(cache.shrunk);
+
+    WritePsi("0.00");
+    AdvanceSeconds(MemoryPressureMonitor::kRestoreDelaySeconds);
+    EXPECT_FALSE(cache.shrunk);
+  }
+  // The polling stops once there are no caches left.
+  AdvanceSeconds(MemoryPressureMonitor::kPsiPollSeconds);
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(MemoryPressureMonitorTest, NoMonitorTest) {
+  // The caches aren't registered when there is no monitor.
+  EXPECT_EQ(nullptr, MemoryPressureMonitor::current());
+  FakeShrinkableCache cache;
+  ShrinkableCacheRegistration registration(&cache);
+  EXPECT_FALSE(cache.shrunk);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_tracker.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Raises the |peaks| of the |consumer| and of the total to their |usage|.
+void UpdatePeaks(const string& consumer,
+                 const map<string, int64_t>& usage,
+                 map<string, uint64_t>* peaks) {
+  for (const string& name : {consumer, string(MemoryTracker::kTotal)}) {
+    uint64_t bytes = std::max<int64_t>(usage.at(name), 0);
+    uint64_t& peak = (*peaks)[name];
+    peak = std::max(peak, bytes);
+  }
+}
+
+}  // namespace
+
+const char MemoryTracker::kTotal[] = "Total";
+
+// static
+MemoryTracker* MemoryTracker::current_tracker_ = nullptr;
+
+MemoryTracker::~MemoryTracker() {
+  if (current_tracker_ == this)
+    current_tracker_ = nullptr;
+}
+
+void MemoryTracker::Init() {
+  CHECK(current_tracker_ == nullptr);
+  current_tracker_ = this;
+}
+
+void MemoryTracker::AddUsage(const string& consumer, int64_t delta) {
+  base::AutoLock auto_lock(lock_);
+  usage_[consumer] += delta;
+  usage_[kTotal] += delta;
+  UpdatePeaks(consumer, usage_, &phase_peaks_);
+  UpdatePeaks(consumer, usage_, &attempt_peaks_);
+}
+
+void MemoryTracker::StartPhase(const string& phase) {
+  base::AutoLock auto_lock(lock_);
+  LogPhasePeaks();
+  phase_ = phase;
+  // The memory still held counts towards the peaks of the new phase.
+  phase_peaks_.clear();
+  for (const auto& consumer_usage : usage_)
+    phase_peaks_[consumer_usage.first] = std::max<int64_t>(
+        consumer_usage.second, 0);
+}
+
+map<string, uint64_t> MemoryTracker::FinishAttempt() {
+  base::AutoLock auto_lock(lock_);
+  map<string, uint64_t> peaks;
+  peaks.swap(attempt_peaks_);
+  for (const auto& consumer_usage : usage_)
+    attempt_peaks_[consumer_usage.first] = std::max<int64_t>(
+        consumer_usage.second, 0);
+  return peaks;
+}
+
+void MemoryTracker::LogPhasePeaks() {
+  if (phase_.empty() || phase_peaks_[kTotal] == 0)
+    return;
+  string peaks;
+  for (const auto& consumer_peak : phase_peaks_) {
+    if (consumer_peak.first == kTotal || consumer_peak.second == 0)
+      continue;
+    peaks += ", " + consumer_peak.first + " " +
+             std::to_string(consumer_peak.second / 1024) + " KiB";
+  }
+  LOG(INFO) << "Peak tracked memory in " << phase_ << ": "
+            << phase_peaks_[kTotal] / 1024 << " KiB" << peaks;
+}
+
+void TrackedMemory::Set(uint64_t bytes) {
+  if (!tracker_)
+    tracker_ = MemoryTracker::current();
+  if (!tracker_ || bytes == bytes_)
+    return;
+  tracker_->AddUsage(consumer_, static_cast<int64_t>(bytes) -
+                                    static_cast<int64_t>(bytes_));
+  bytes_ = bytes;
+}
+
+}  // namespace chromeos_update_engine
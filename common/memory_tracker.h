@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_TRACKER_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_TRACKER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+
+namespace chromeos_update_engine {
+
+// Accounts for the memory held by the biggest consumers during an update, such
+// as the payload buffers and the decompressors, and the peak each of them
+// reached in the current phase and in the whole attempt, so the phase where a
+// low-memory device ran out of memory can be found. It is thread-safe.
+class MemoryTracker {
+ public:
+  // The name of the sum of all the consumers in the peaks.
+  static const char kTotal[];
+
+  MemoryTracker() = default;
+  ~MemoryTracker();
+
+  // Makes this instance the one returned by current(), where the TrackedMemory
+  // instances charge their memory. Only one instance can be initialized at a
+  // time.
+  void Init();
+
+  // Returns the initialized MemoryTracker, or nullptr if none.
+  static MemoryTracker* current() { return current_tracker_; }
+
+  // Adds |delta| bytes, which can be negative, to the memory held by the
+  // |consumer|.
+  void AddUsage(const std::string& consumer, int64_t delta);
+
+  // Logs the peaks of the phase that ends, if any, and starts the |phase|.
+  void StartPhase(const std::string& phase);
+
+  // Returns the peak of each consumer and of kTotal since the previous call,
+  // or since this instance was created, and starts measuring a new attempt.
+  std::map<std::string, uint64_t> FinishAttempt();
+
+ private:
+  // Logs the peaks of the current phase.
+  void LogPhasePeaks();
+
+  // The current MemoryTracker instance, if any.
+  static MemoryTracker* current_tracker_;
+
+  mutable base::Lock lock_;
+  // The memory held by each consumer and their peaks in the current phase and
+  // attempt, all including kTotal, protected by |lock_|.
+  std::map<std::string, int64_t> usage_;
+  std::map<std::string, uint64_t> phase_peaks_;
+  std::map<std::string, uint64_t> attempt_peaks_;
+  std::string phase_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryTracker);
+};
+
+// The memory held by an instance of a consumer, charged to the current
+// MemoryTracker, if any, until it is destroyed. The MemoryTracker must outlive
+// it.
+class TrackedMemory {
+ public:
+  // The |consumer| must be a string literal.
+  explicit TrackedMemory(const char* consumer) : consumer_(consumer) {}
+  ~TrackedMemory() { Set(0); }
+
+  // Sets the bytes held by this instance.
+  void Set(uint64_t bytes);
+
+ private:
+  const char* const consumer_;
+
+  // The tracker the |bytes_| are charged to, if any.
+  MemoryTracker* tracker_{nullptr};
+  uint64_t bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(TrackedMemory);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_TRACKER_H_
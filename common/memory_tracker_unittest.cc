@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_tracker.h"
+
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class MemoryTrackerTest : public ::testing::Test {
+ protected:
+  MemoryTracker tracker_;
+};
+
+TEST_F(MemoryTrackerTest, NoCurrentTrackerTest) {
+  EXPECT_EQ(nullptr, MemoryTracker::current());
+  // Memory held outside of a tracked process is ignored.
+  {
+    TrackedMemory memory("Buffer");
+    memory.Set(100);
+  }
+  EXPECT_TRUE(tracker_.FinishAttempt().empty());
+}
+
+TEST_F(MemoryTrackerTest, PeaksTest) {
+  tracker_.Init();
+  EXPECT_EQ(&tracker_, MemoryTracker::current());
+  TrackedMemory buffer("Buffer");
+  {
+    // Two instances of the same consumer add up.
+    TrackedMemory decompressor1("Decompressor");
+    TrackedMemory decompressor2("Decompressor");
+    decompressor1.Set(300);
+    decompressor2.Set(200);
+    buffer.Set(100);
+  }
+  buffer.Set(1000);
+
+  map<string, uint64_t> peaks = tracker_.FinishAttempt();
+  EXPECT_EQ(1000U, peaks["Buffer"]);
+  EXPECT_EQ(500U, peaks["Decompressor"]);
+  EXPECT_EQ(1000U, peaks[MemoryTracker::kTotal]);
+
+  // The next attempt starts from the memory still held.
+  buffer.Set(10);
+  peaks = tracker_.FinishAttempt();
+  EXPECT_EQ(1000U, peaks["Buffer"]);
+  EXPECT_EQ(0U, peaks["Decompressor"]);
+  peaks = tracker_.FinishAttempt();
+  EXPECT_EQ(10U, peaks["Buffer"]);
+}
+
+}  // namespace chromeos_update_engine
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_COMMON_MOCK_ACTION_PROCESSOR_H_
 #define UPDATE_ENGINE_COMMON_MOCK_ACTION_PROCESSOR_H_
 
+#include <vector>
+
 #include <gmock/gmock.h>
 
 #include "update_engine/common/action.h"
@@ -27,6 +29,9 @@ class MockActionProcessor : public ActionProcessor {
  public:
   MOCK_METHOD0(StartProcessing, void());
   MOCK_METHOD1(EnqueueAction, void(AbstractAction* action));
+  MOCK_METHOD2(EnqueueActionWithDependencies,
+               void(AbstractAction* action,
+                    const std::vector<AbstractAction*>& dependencies));
 };
 
 }  // namespace chromeos_update_engine
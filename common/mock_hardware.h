@@ -57,6 +57,9 @@ class MockHardware : public HardwareInterface {
     ON_CALL(*this, GetPowerwashSafeDirectory(testing::_))
       .WillByDefault(testing::Invoke(&fake_,
             &FakeHardware::GetPowerwashSafeDirectory));
+    ON_CALL(*this, IsOnACPower())
+      .WillByDefault(testing::Invoke(&fake_,
+            &FakeHardware::IsOnACPower));
   }
 
   ~MockHardware() override = default;
@@ -71,6 +74,7 @@ class MockHardware : public HardwareInterface {
   MOCK_CONST_METHOD0(GetPowerwashCount, int());
   MOCK_CONST_METHOD1(GetNonVolatileDirectory, bool(base::FilePath*));
   MOCK_CONST_METHOD1(GetPowerwashSafeDirectory, bool(base::FilePath*));
+  MOCK_CONST_METHOD0(IsOnACPower, bool());
 
   // Returns a reference to the underlying FakeHardware.
   FakeHardware& fake() {
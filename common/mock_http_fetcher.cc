@@ -123,6 +123,25 @@ void MockHttpFetcher::SetHeader(const std::string& header_name,
   extra_headers_[base::ToLowerASCII(header_name)] = header_value;
 }
 
+std::string MockHttpFetcher::GetHeader(const std::string& header_name) const {
+  const auto it = extra_headers_.find(base::ToLowerASCII(header_name));
+  return it == extra_headers_.end() ? "" : it->second;
+}
+
+void MockHttpFetcher::SetResponseHeader(const std::string& header_name,
+                                        const std::string& header_value) {
+  response_headers_[base::ToLowerASCII(header_name)] = header_value;
+}
+
+bool MockHttpFetcher::GetResponseHeader(const std::string& header_name,
+                                        std::string* header_value) const {
+  const auto it = response_headers_.find(base::ToLowerASCII(header_name));
+  if (it == response_headers_.end())
+    return false;
+  *header_value = it->second;
+  return true;
+}
+
 void MockHttpFetcher::Pause() {
   CHECK(!paused_);
   paused_ = true;
@@ -76,6 +76,12 @@ class MockHttpFetcher : public HttpFetcher {
   void set_connect_timeout(int connect_timeout_seconds) override {}
   void set_max_retry_count(int max_retry_count) override {}
 
+  // Records the limit, the data is sent at the same rate anyway.
+  void set_max_receive_speed(int max_speed_bps) override {
+    max_receive_speed_bps_ = max_speed_bps;
+  }
+  int max_receive_speed_bps() const { return max_receive_speed_bps_; }
+
   // Dummy: no bytes were downloaded.
   size_t GetBytesDownloaded() override {
     return sent_size_;
@@ -91,6 +97,17 @@ class MockHttpFetcher : public HttpFetcher {
   void SetHeader(const std::string& header_name,
                  const std::string& header_value) override;
 
+  // Returns the value of the extra header |header_name|, or an empty string
+  // if it wasn't set.
+  std::string GetHeader(const std::string& header_name) const;
+
+  // Sets a header of the response returned by GetResponseHeader().
+  void SetResponseHeader(const std::string& header_name,
+                         const std::string& header_value);
+
+  bool GetResponseHeader(const std::string& header_name,
+                         std::string* header_value) const override;
+
   // Suspend the mock transfer.
   void Pause() override;
 
@@ -132,6 +149,9 @@ class MockHttpFetcher : public HttpFetcher {
   // The extra headers set.
   std::map<std::string, std::string> extra_headers_;
 
+  // The headers of the response.
+  std::map<std::string, std::string> response_headers_;
+
   // The TaskId of the timeout callback. After each chunk of data sent, we
   // time out for 0s just to make sure that run loop services other clients.
   brillo::MessageLoop::TaskId timeout_id_;
@@ -145,6 +165,9 @@ class MockHttpFetcher : public HttpFetcher {
   // Set to true if BeginTransfer should EXPECT fail.
   bool never_use_;
 
+  // The last limit passed to set_max_receive_speed().
+  int max_receive_speed_bps_{0};
+
   DISALLOW_COPY_AND_ASSIGN(MockHttpFetcher);
 };
 
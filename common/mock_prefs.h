@@ -44,6 +44,9 @@ class MockPrefs : public PrefsInterface {
   MOCK_METHOD2(AddObserver, void(const std::string& key, ObserverInterface*));
   MOCK_METHOD2(RemoveObserver,
                void(const std::string& key, ObserverInterface*));
+
+  MOCK_METHOD0(BeginTransaction, void());
+  MOCK_METHOD0(CommitTransaction, bool());
 };
 
 }  // namespace chromeos_update_engine
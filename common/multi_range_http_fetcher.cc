@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
 
 #include "update_engine/common/utils.h"
 
@@ -40,6 +41,9 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
     return;
   }
   url_ = url;
+  throughput_estimator_.TransferStarted(base::TimeTicks::Now());
+  if (!parallel_fetchers_.empty() && BeginParallelTransfer())
+    return;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
   LOG(INFO) << "starting first transfer";
@@ -58,11 +62,62 @@ void MultiRangeHttpFetcher::TerminateTransfer() {
   }
   terminating_ = true;
 
+  if (parallel_mode_) {
+    TerminateConnections();
+    MaybeEndParallelTransfer();
+    return;
+  }
   if (!pending_transfer_ended_) {
     base_fetcher_->TerminateTransfer();
   }
 }
 
+void MultiRangeHttpFetcher::Pause() {
+  if (!parallel_mode_) {
+    base_fetcher_->Pause();
+    return;
+  }
+  paused_ = true;
+  for (Connection& connection : connections_) {
+    if (connection.active && !connection.ending)
+      connection.fetcher->Pause();
+  }
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  if (!parallel_mode_) {
+    base_fetcher_->Unpause();
+    return;
+  }
+  paused_ = false;
+  for (Connection& connection : connections_) {
+    if (connection.active && !connection.ending)
+      connection.fetcher->Unpause();
+  }
+  StartSegments();
+}
+
+bool MultiRangeHttpFetcher::ReplaceRangesAfter(
+    size_t index, const std::vector<std::pair<off_t, size_t>>& ranges) {
+  if (!base_fetcher_active_ || parallel_mode_ || current_index_ != index)
+    return false;
+  ranges_.erase(ranges_.begin() + index + 1, ranges_.end());
+  for (const auto& range : ranges)
+    AddRange(range.first, range.second);
+  return true;
+}
+
+void MultiRangeHttpFetcher::AddParallelFetcher(HttpFetcher* fetcher) {
+  AddParallelFetcher(fetcher, "");
+}
+
+void MultiRangeHttpFetcher::AddParallelFetcher(HttpFetcher* fetcher,
+                                               const std::string& url) {
+  CHECK(!base_fetcher_active_) << "AddParallelFetcher but already active.";
+  parallel_fetchers_.emplace_back(fetcher);
+  parallel_urls_.push_back(url);
+}
+
 // State change: Stopped or Downloading -> Downloading
 void MultiRangeHttpFetcher::StartTransfer() {
   if (current_index_ >= ranges_.size()) {
@@ -88,6 +143,10 @@ void MultiRangeHttpFetcher::StartTransfer() {
 void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                                           const void* bytes,
                                           size_t length) {
+  if (parallel_mode_) {
+    ParallelReceivedBytes(FindConnection(fetcher), bytes, length);
+    return;
+  }
   CHECK_LT(current_index_, ranges_.size());
   CHECK_EQ(fetcher, base_fetcher_.get());
   CHECK(!pending_transfer_ended_);
@@ -98,6 +157,8 @@ void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                          range.length() - bytes_received_this_range_);
   }
   LOG_IF(WARNING, next_size <= 0) << "Asked to write length <= 0";
+  throughput_estimator_.BytesReceived(base::TimeTicks::Now(), next_size);
+  throughput_estimator_.BytesWasted(length - next_size);
   if (delegate_) {
     delegate_->ReceivedBytes(this, bytes, next_size);
   }
@@ -164,18 +225,348 @@ void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
 void MultiRangeHttpFetcher::TransferComplete(HttpFetcher* fetcher,
                                              bool successful) {
   LOG(INFO) << "Received transfer complete.";
+  if (parallel_mode_) {
+    ParallelTransferEnded(FindConnection(fetcher));
+    return;
+  }
   TransferEnded(fetcher, successful);
 }
 
 void MultiRangeHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
   LOG(INFO) << "Received transfer terminated.";
+  if (parallel_mode_) {
+    ParallelTransferEnded(FindConnection(fetcher));
+    return;
+  }
   TransferEnded(fetcher, false);
 }
 
 void MultiRangeHttpFetcher::Reset() {
+  throughput_estimator_.TransferEnded(base::TimeTicks::Now());
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
+  parallel_mode_ = parallel_failed_ = paused_ = false;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  // The segments and connections are kept until the next transfer begins, as
+  // the callbacks of the fetchers may still be unwinding.
+  buffered_segments_.clear();
+  UpdateBufferedMemory();
+}
+
+bool MultiRangeHttpFetcher::BeginParallelTransfer() {
+  for (const Range& range : ranges_) {
+    if (!range.HasLength()) {
+      LOG(INFO) << "Range " << range.ToString() << " has no length, fetching "
+                << "the ranges over a single connection.";
+      return false;
+    }
+  }
+
+  segments_.clear();
+  uint64_t stream_offset = 0;
+  for (const Range& range : ranges_) {
+    for (size_t pos = 0; pos < range.length(); pos += segment_size_) {
+      Segment segment;
+      segment.offset = range.offset() + pos;
+      segment.length = std::min(segment_size_, range.length() - pos);
+      segment.stream_offset = stream_offset;
+      segment.starts_range = pos == 0;
+      segment.bytes_received = 0;
+      segment.done = false;
+      segment.connection = kNoConnection;
+      segments_.push_back(segment);
+      stream_offset += segment.length;
+    }
+  }
+
+  connections_.clear();
+  connections_.push_back(
+      {base_fetcher_.get(), "", false, false, false, 0, 0, 0});
+  for (size_t i = 0; i < parallel_fetchers_.size(); i++) {
+    connections_.push_back({parallel_fetchers_[i].get(), parallel_urls_[i],
+                            false, false, false, 0, 0, 0});
+  }
+  for (Connection& connection : connections_)
+    connection.fetcher->set_delegate(this);
+
+  LOG(INFO) << "Fetching " << ranges_.size() << " ranges in "
+            << segments_.size() << " segments over " << connections_.size()
+            << " connections.";
+  base_fetcher_active_ = true;
+  parallel_mode_ = true;
+  next_segment_to_start_ = 0;
+  next_segment_to_deliver_ = 0;
+  bytes_delivered_ = 0;
+  total_bytes_received_ = 0;
+  if (delegate_)
+    delegate_->SeekToOffset(segments_[0].offset);
+  StartSegments();
+  return true;
+}
+
+void MultiRangeHttpFetcher::StartSegments() {
+  for (size_t i = 0; i < connections_.size(); i++) {
+    if (!parallel_mode_ || paused_ || parallel_failed_ || terminating_)
+      return;
+    Connection& connection = connections_[i];
+    if (connection.active || connection.dropped)
+      continue;
+    size_t index = PickSegment(i);
+    if (index == kNoConnection)
+      return;
+
+    Segment& segment = segments_[index];
+    size_t previous_connection = segment.connection;
+    segment.connection = i;
+    connection.active = true;
+    connection.segment = index;
+    connection.bytes_received = 0;
+    connection.total_bytes_received_at_start = total_bytes_received_;
+    connection.fetcher->SetOffset(segment.offset + segment.bytes_received);
+    connection.fetcher->SetLength(segment.length - segment.bytes_received);
+    connection.fetcher->BeginTransfer(ConnectionUrl(connection));
+
+    // The slow connection the rest of the segment was taken from is only
+    // terminated once the segment is assigned, as its callback may start
+    // other segments right away.
+    if (previous_connection != kNoConnection) {
+      Connection& slow_connection = connections_[previous_connection];
+      LOG(INFO) << "Moving the rest of the segment at " << segment.offset
+                << " from the slow connection to "
+                << ConnectionUrl(slow_connection) << " to the connection to "
+                << ConnectionUrl(connection) << ".";
+      if (slow_connection.active && !slow_connection.ending) {
+        slow_connection.ending = true;
+        slow_connection.fetcher->TerminateTransfer();
+      }
+    }
+  }
+}
+
+size_t MultiRangeHttpFetcher::PickSegment(size_t connection_index) {
+  // The segments left by a dropped connection come first, as the ones after
+  // them can't be delivered until they are done.
+  for (size_t index = next_segment_to_deliver_; index < next_segment_to_start_;
+       index++) {
+    const Segment& segment = segments_[index];
+    if (!segment.done && segment.connection == kNoConnection)
+      return index;
+  }
+
+  // Segments too far ahead would have to be held in memory until all the
+  // previous ones are passed to the delegate.
+  if (next_segment_to_start_ < segments_.size() &&
+      segments_[next_segment_to_start_].stream_offset <
+          bytes_delivered_ + max_buffered_bytes_) {
+    return next_segment_to_start_++;
+  }
+
+  // Nothing else to fetch, so instead of waiting for a slow connection holding
+  // up the delivery, fetches the rest of its segment.
+  if (next_segment_to_deliver_ < next_segment_to_start_) {
+    const Segment& segment = segments_[next_segment_to_deliver_];
+    if (!segment.done && segment.connection != kNoConnection &&
+        segment.connection != connection_index &&
+        IsSlow(connections_[segment.connection])) {
+      return next_segment_to_deliver_;
+    }
+  }
+  return kNoConnection;
+}
+
+bool MultiRangeHttpFetcher::IsSlow(const Connection& connection) const {
+  if (!connection.active || connection.ending)
+    return false;
+  size_t num_connections = 0;
+  for (const Connection& other : connections_) {
+    if (!other.dropped)
+      num_connections++;
+  }
+  // Waits for at least a segment worth of data before judging, so a
+  // connection isn't deemed slow right after its transfer started.
+  uint64_t bytes_since_start =
+      total_bytes_received_ - connection.total_bytes_received_at_start;
+  return bytes_since_start >= segment_size_ &&
+         2 * num_connections * connection.bytes_received < bytes_since_start;
+}
+
+bool MultiRangeHttpFetcher::HasAlternateUrl(
+    const Connection& connection) const {
+  for (const Connection& other : connections_) {
+    if (&other != &connection && !other.dropped &&
+        ConnectionUrl(other) != ConnectionUrl(connection)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const std::string& MultiRangeHttpFetcher::ConnectionUrl(
+    const Connection& connection) const {
+  return connection.url.empty() ? url_ : connection.url;
+}
+
+void MultiRangeHttpFetcher::ParallelReceivedBytes(Connection* connection,
+                                                  const void* bytes,
+                                                  size_t length) {
+  CHECK(connection->active);
+  // The data of a connection whose segment was moved to another one is
+  // dropped, as the other connection fetches it again.
+  if (connection->ending || terminating_ || parallel_failed_) {
+    if (connection->ending)
+      throughput_estimator_.BytesWasted(length);
+    return;
+  }
+  Segment& segment = segments_[connection->segment];
+  size_t next_size =
+      std::min(length, segment.length - segment.bytes_received);
+  throughput_estimator_.BytesReceived(base::TimeTicks::Now(), next_size);
+  throughput_estimator_.BytesWasted(length - next_size);
+  segment.bytes_received += next_size;
+  connection->bytes_received += next_size;
+  total_bytes_received_ += next_size;
+  segment.done = segment.bytes_received == segment.length;
+
+  if (connection->segment == next_segment_to_deliver_ &&
+      buffered_segments_.find(connection->segment) ==
+          buffered_segments_.end()) {
+    bytes_delivered_ += next_size;
+    if (delegate_ && next_size > 0)
+      delegate_->ReceivedBytes(this, bytes, next_size);
+  } else {
+    brillo::Blob& data = buffered_segments_[connection->segment];
+    const uint8_t* bytes_ptr = static_cast<const uint8_t*>(bytes);
+    data.insert(data.end(), bytes_ptr, bytes_ptr + next_size);
+    UpdateBufferedMemory();
+  }
+  // The delegate may have terminated the transfer.
+  if (!parallel_mode_ || terminating_)
+    return;
+
+  if (segment.done)
+    DeliverBufferedSegments();
+  if (!parallel_mode_ || terminating_)
+    return;
+  // Delivering the data may have let the next segments start, and the data
+  // received may show that another connection is slow.
+  StartSegments();
+
+  if (segment.done && !connection->ending) {
+    // As for the ranges, waits for the TransferTerminated callback of the
+    // fetcher before using it for another segment.
+    connection->ending = true;
+    connection->fetcher->TerminateTransfer();
+  }
+}
+
+void MultiRangeHttpFetcher::ParallelTransferEnded(Connection* connection) {
+  CHECK(connection->active) << "Transfer ended unexpectedly.";
+  connection->active = false;
+  connection->ending = false;
+  if (!terminating_ && !parallel_failed_) {
+    size_t index = connection - connections_.data();
+    Segment& segment = segments_[connection->segment];
+    if (segment.connection != index) {
+      // The rest of the segment was moved to another connection.
+      StartSegments();
+    } else if (segment.done) {
+      http_response_code_ = connection->fetcher->http_response_code();
+      StartSegments();
+    } else if (HasAlternateUrl(*connection)) {
+      LOG(WARNING) << "Didn't get enough bytes for the segment at "
+                   << segment.offset << " from " << ConnectionUrl(*connection)
+                   << ", fetching it from the other connections.";
+      connection->dropped = true;
+      segment.connection = kNoConnection;
+      StartSegments();
+    } else {
+      http_response_code_ = connection->fetcher->http_response_code();
+      LOG(INFO) << "Didn't get enough bytes for the segment at "
+                << segment.offset << ". Ending w/ failure.";
+      parallel_failed_ = true;
+      TerminateConnections();
+    }
+  }
+  MaybeEndParallelTransfer();
+}
+
+void MultiRangeHttpFetcher::DeliverBufferedSegments() {
+  while (next_segment_to_deliver_ < segments_.size()) {
+    auto it = buffered_segments_.find(next_segment_to_deliver_);
+    if (it != buffered_segments_.end()) {
+      brillo::Blob data = std::move(it->second);
+      buffered_segments_.erase(it);
+      UpdateBufferedMemory();
+      bytes_delivered_ += data.size();
+      if (delegate_ && !data.empty())
+        delegate_->ReceivedBytes(this, data.data(), data.size());
+      if (!parallel_mode_ || terminating_)
+        return;
+    }
+    if (!segments_[next_segment_to_deliver_].done)
+      return;
+    next_segment_to_deliver_++;
+    if (next_segment_to_deliver_ < segments_.size() &&
+        segments_[next_segment_to_deliver_].starts_range && delegate_) {
+      delegate_->SeekToOffset(segments_[next_segment_to_deliver_].offset);
+    }
+  }
+}
+
+void MultiRangeHttpFetcher::UpdateBufferedMemory() {
+  uint64_t bytes = 0;
+  for (const auto& segment : buffered_segments_)
+    bytes += segment.second.capacity();
+  buffered_memory_.Set(bytes);
+}
+
+void MultiRangeHttpFetcher::TerminateConnections() {
+  ending_connections_ = true;
+  for (Connection& connection : connections_) {
+    if (connection.active && !connection.ending) {
+      connection.ending = true;
+      connection.fetcher->TerminateTransfer();
+    }
+  }
+  ending_connections_ = false;
+}
+
+void MultiRangeHttpFetcher::MaybeEndParallelTransfer() {
+  if (!parallel_mode_ || ending_connections_)
+    return;
+  for (const Connection& connection : connections_) {
+    if (connection.active)
+      return;
+  }
+
+  if (terminating_) {
+    LOG(INFO) << "Terminating.";
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+  } else if (parallel_failed_) {
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+  } else if (next_segment_to_deliver_ == segments_.size()) {
+    LOG(INFO) << "Done w/ all transfers";
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+  }
+}
+
+MultiRangeHttpFetcher::Connection* MultiRangeHttpFetcher::FindConnection(
+    HttpFetcher* fetcher) {
+  for (Connection& connection : connections_) {
+    if (connection.fetcher == fetcher)
+      return &connection;
+  }
+  LOG(FATAL) << "Callback from an unknown fetcher.";
+  return nullptr;
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
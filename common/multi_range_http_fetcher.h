@@ -17,13 +17,18 @@
 #ifndef UPDATE_ENGINE_COMMON_MULTI_RANGE_HTTP_FETCHER_H_
 #define UPDATE_ENGINE_COMMON_MULTI_RANGE_HTTP_FETCHER_H_
 
+#include <algorithm>
 #include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/memory_tracker.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
 // specifies a vector of byte ranges. MultiRangeHttpFetcher will fetch bytes
@@ -33,6 +38,15 @@
 // for the last range specified to have unlimited length, tho it is legal for
 // other entries to have unlimited length.
 
+// Extra fetchers can be added with AddParallelFetcher(). When all the ranges
+// have a length, the ranges are then split in segments fetched over all the
+// fetchers at the same time, and the data is reordered so the delegate still
+// receives it sequentially. Each extra fetcher may fetch from its own URL, for
+// example a peer on the local network serving the same file. The rest of a
+// segment held up by a slow connection is moved to an idle one, and when a
+// connection fails while another one fetches from a different URL, it is
+// dropped and its segment is fetched by the other connections.
+
 // There are three states a MultiRangeHttpFetcher object will be in:
 // - Stopped (start state)
 // - Downloading
@@ -52,7 +66,17 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
         pending_transfer_ended_(false),
         terminating_(false),
         current_index_(0),
-        bytes_received_this_range_(0) {}
+        bytes_received_this_range_(0),
+        segment_size_(kDefaultSegmentSize),
+        max_buffered_bytes_(kDefaultMaxBufferedBytes),
+        parallel_mode_(false),
+        parallel_failed_(false),
+        paused_(false),
+        ending_connections_(false),
+        next_segment_to_start_(0),
+        next_segment_to_deliver_(0),
+        bytes_delivered_(0),
+        total_bytes_received_(0) {}
   ~MultiRangeHttpFetcher() override {}
 
   void ClearRanges() { ranges_.clear(); }
@@ -66,6 +90,36 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     ranges_.push_back(Range(offset));
   }
 
+  // Replaces the ranges after the one at |index| with the |ranges|, as offset
+  // and length, while the range at |index| is being fetched. Returns false,
+  // doing nothing, when fetching a different range or over several
+  // connections.
+  bool ReplaceRangesAfter(size_t index,
+                          const std::vector<std::pair<off_t, size_t>>& ranges);
+
+  // Adds a fetcher used as an extra connection, taking ownership of it. Like
+  // the base fetcher, it must support beginning a transfer after one has
+  // stopped. The settings passed to this object are forwarded to it. Must be
+  // called before BeginTransfer().
+  void AddParallelFetcher(HttpFetcher* fetcher);
+
+  // Same as above, but the connection fetches the data from |url| instead of
+  // the URL passed to BeginTransfer(). The data served at |url| must be the
+  // same.
+  void AddParallelFetcher(HttpFetcher* fetcher, const std::string& url);
+
+  // Sets the size of the segments the ranges are split in when fetching over
+  // several connections, and how far ahead of the data passed to the delegate
+  // a segment may start. This bounds the data held in memory waiting for the
+  // earlier segments to |max_buffered_bytes| + |segment_size| bytes. Must be
+  // called before BeginTransfer().
+  void set_parallel_limits(size_t segment_size, size_t max_buffered_bytes) {
+    CHECK_GT(segment_size, static_cast<size_t>(0));
+    CHECK_GT(max_buffered_bytes, static_cast<size_t>(0));
+    segment_size_ = segment_size;
+    max_buffered_bytes_ = max_buffered_bytes;
+  }
+
   // HttpFetcher overrides.
   void SetOffset(off_t offset) override {}  // for now, doesn't support this
 
@@ -83,39 +137,66 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   void SetHeader(const std::string& header_name,
                  const std::string& header_value) override {
     base_fetcher_->SetHeader(header_name, header_value);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->SetHeader(header_name, header_value);
   }
 
-  void Pause() override { base_fetcher_->Pause(); }
+  void Pause() override;
 
-  void Unpause() override { base_fetcher_->Unpause(); }
+  void Unpause() override;
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
   void set_idle_seconds(int seconds) override {
     base_fetcher_->set_idle_seconds(seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_idle_seconds(seconds);
   }
   void set_retry_seconds(int seconds) override {
     base_fetcher_->set_retry_seconds(seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_retry_seconds(seconds);
   }
   // TODO(deymo): Determine if this method should be virtual in HttpFetcher so
   // this call is sent to the base_fetcher_.
   virtual void SetProxies(const std::deque<std::string>& proxies) {
     base_fetcher_->SetProxies(proxies);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->SetProxies(proxies);
   }
 
   inline size_t GetBytesDownloaded() override {
-    return base_fetcher_->GetBytesDownloaded();
+    size_t bytes_downloaded = base_fetcher_->GetBytesDownloaded();
+    for (auto& fetcher : parallel_fetchers_)
+      bytes_downloaded += fetcher->GetBytesDownloaded();
+    return bytes_downloaded;
   }
 
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
   }
 
   void set_connect_timeout(int connect_timeout_seconds) override {
     base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_connect_timeout(connect_timeout_seconds);
   }
 
   void set_max_retry_count(int max_retry_count) override {
     base_fetcher_->set_max_retry_count(max_retry_count);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_max_retry_count(max_retry_count);
+  }
+
+  // The limit is shared evenly between the connections.
+  void set_max_receive_speed(int max_speed_bps) override {
+    int num_fetchers = 1 + parallel_fetchers_.size();
+    int fetcher_speed_bps =
+        max_speed_bps > 0 ? std::max(max_speed_bps / num_fetchers, 1) : 0;
+    base_fetcher_->set_max_receive_speed(fetcher_speed_bps);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_max_receive_speed(fetcher_speed_bps);
   }
 
  private:
@@ -141,6 +222,50 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   typedef std::vector<Range> RangesVect;
 
+  // A piece of a range fetched over a single connection when fetching in
+  // parallel.
+  struct Segment {
+    off_t offset;
+    size_t length;
+    // The offset of the segment in the data passed to the delegate.
+    uint64_t stream_offset;
+    // Whether the segment starts a range, so the delegate is told to seek.
+    bool starts_range;
+    // The number of bytes of the segment received so far, over any
+    // connection.
+    size_t bytes_received;
+    // Whether all the bytes of the segment were received.
+    bool done;
+    // The index in |connections_| of the connection fetching the rest of the
+    // segment, or kNoConnection.
+    size_t connection;
+  };
+
+  // The state of one of the fetchers when fetching in parallel.
+  struct Connection {
+    HttpFetcher* fetcher;
+    // The URL fetched, or empty for the one passed to BeginTransfer().
+    std::string url;
+    // Whether a transfer was started and its end wasn't received yet.
+    bool active;
+    // Whether TerminateTransfer() was called for the current transfer.
+    bool ending;
+    // Whether the connection failed and isn't used for this transfer anymore.
+    bool dropped;
+    // The index in |segments_| of the segment being fetched.
+    size_t segment;
+    // The bytes received by this transfer, and |total_bytes_received_| when it
+    // started, to compare its speed with the other connections.
+    size_t bytes_received;
+    uint64_t total_bytes_received_at_start;
+  };
+
+  static const size_t kNoConnection = static_cast<size_t>(-1);
+
+  // The default parallel limits, see set_parallel_limits().
+  static const size_t kDefaultSegmentSize = 4 * 1024 * 1024;        // 4 MiB
+  static const size_t kDefaultMaxBufferedBytes = 32 * 1024 * 1024;  // 32 MiB
+
   // State change: Stopped or Downloading -> Downloading
   void StartTransfer();
 
@@ -158,7 +283,59 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void Reset();
 
+  // Splits the ranges in |segments_| and starts fetching them over all the
+  // fetchers. Returns false, doing nothing, if a range has no length.
+  bool BeginParallelTransfer();
+
+  // Starts fetching segments on the idle connections: first the rest of the
+  // segments left by a dropped connection, then the next segments as long as
+  // they start less than |max_buffered_bytes_| after the data delivered, and
+  // finally the rest of the segment next to deliver if its connection is slow.
+  void StartSegments();
+
+  // Returns the index of the segment the idle connection |connection_index|
+  // should fetch, or kNoConnection if there is none. A slow connection
+  // fetching the segment returned is terminated.
+  size_t PickSegment(size_t connection_index);
+
+  // Whether |connection| received less than half of its share of the data
+  // received over all the connections since its transfer started.
+  bool IsSlow(const Connection& connection) const;
+
+  // Whether a connection other than |connection| and not dropped fetches from
+  // a different URL.
+  bool HasAlternateUrl(const Connection& connection) const;
+
+  // Returns the URL fetched by |connection|.
+  const std::string& ConnectionUrl(const Connection& connection) const;
+
+  // Handlers for the callbacks of the fetchers when fetching in parallel.
+  void ParallelReceivedBytes(Connection* connection,
+                             const void* bytes,
+                             size_t length);
+  void ParallelTransferEnded(Connection* connection);
+
+  // Passes the buffered data of the segments following the delivered data to
+  // the delegate, in order.
+  void DeliverBufferedSegments();
+
+  // Charges the memory held by the |buffered_segments_| to |buffered_memory_|.
+  void UpdateBufferedMemory();
+
+  // Terminates the transfers of all the active connections not ending yet.
+  void TerminateConnections();
+
+  // Notifies the delegate of the end of the parallel transfer once it
+  // completed, failed or was terminated and no connection is active anymore.
+  void MaybeEndParallelTransfer();
+
+  Connection* FindConnection(HttpFetcher* fetcher);
+
   std::unique_ptr<HttpFetcher> base_fetcher_;
+  std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers_;
+  // The URL of each of the |parallel_fetchers_|, empty for the one passed to
+  // BeginTransfer().
+  std::vector<std::string> parallel_urls_;
 
   // If true, do not send any more data or TransferComplete to the delegate.
   bool base_fetcher_active_;
@@ -176,6 +353,36 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   RangesVect::size_type current_index_;  // index into ranges_
   size_t bytes_received_this_range_;
 
+  // The parallel limits, see set_parallel_limits().
+  size_t segment_size_;
+  size_t max_buffered_bytes_;
+
+  // Whether the current transfer is fetched over all the fetchers.
+  bool parallel_mode_;
+
+  // Whether a segment of the parallel transfer failed, so the transfer fails
+  // once all the connections ended.
+  bool parallel_failed_;
+
+  bool paused_;
+
+  // Whether the connections are being terminated, so their synchronous
+  // callbacks don't notify the delegate yet.
+  bool ending_connections_;
+
+  std::vector<Segment> segments_;
+  std::vector<Connection> connections_;
+  size_t next_segment_to_start_;
+  size_t next_segment_to_deliver_;
+  // The number of bytes passed to the delegate so far.
+  uint64_t bytes_delivered_;
+  // The number of bytes of the segments received over all the connections.
+  uint64_t total_bytes_received_;
+  // The data received for the segments after |next_segment_to_deliver_|, or
+  // for that one before it became the next to deliver, by segment index.
+  std::map<size_t, brillo::Blob> buffered_segments_;
+  TrackedMemory buffered_memory_{"MultiRangeHttpFetcher.Buffers"};
+
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
 
@@ -0,0 +1,267 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/payload_staging_cache.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+PayloadStagingCache::PayloadStagingCache(const string& dir, uint64_t max_bytes)
+    : dir_(dir),
+      data_path_(dir + "/payload"),
+      index_path_(dir + "/index"),
+      max_bytes_(max_bytes) {}
+
+PayloadStagingCache::~PayloadStagingCache() {
+  if (data_fd_ >= 0)
+    IGNORE_EINTR(close(data_fd_));
+}
+
+bool PayloadStagingCache::Open(const string& payload_id) {
+  if (data_fd_ >= 0) {
+    IGNORE_EINTR(close(data_fd_));
+    data_fd_ = -1;
+  }
+  payload_id_ = payload_id;
+  blocks_.clear();
+  staged_bytes_ = 0;
+  pending_.clear();
+  if (!base::CreateDirectory(base::FilePath(dir_))) {
+    PLOG(ERROR) << "Unable to create the staging directory " << dir_;
+    return false;
+  }
+  if (!LoadIndex()) {
+    // The data of another payload or of an unreadable index is dropped.
+    blocks_.clear();
+    staged_bytes_ = 0;
+    unlink(data_path_.c_str());
+    TEST_AND_RETURN_FALSE(SaveIndex());
+  }
+  data_fd_ = HANDLE_EINTR(
+      open(data_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  TEST_AND_RETURN_FALSE_ERRNO(data_fd_ >= 0);
+  LOG(INFO) << "Staging the payload in " << dir_ << ", " << staged_bytes_
+            << " bytes staged in " << blocks_.size() << " blocks.";
+  return true;
+}
+
+uint64_t PayloadStagingCache::StagedBytesAt(uint64_t offset,
+                                            uint64_t max_length) const {
+  uint64_t staged = 0;
+  while (staged < max_length) {
+    const uint64_t pos = offset + staged;
+    auto it = blocks_.find(pos / kStagingBlockSize);
+    const uint64_t block_offset = pos % kStagingBlockSize;
+    if (it == blocks_.end() || block_offset >= it->second.length)
+      break;
+    staged += it->second.length - block_offset;
+    // The data after a partial block isn't contiguous with it.
+    if (it->second.length < kStagingBlockSize)
+      break;
+  }
+  return std::min(staged, max_length);
+}
+
+uint64_t PayloadStagingCache::MissingBytesAt(uint64_t offset,
+                                             uint64_t max_length) const {
+  if (StagedBytesAt(offset, 1) > 0)
+    return 0;
+  auto next = blocks_.upper_bound(offset / kStagingBlockSize);
+  if (next == blocks_.end())
+    return max_length;
+  return std::min(next->first * kStagingBlockSize - offset, max_length);
+}
+
+bool PayloadStagingCache::Read(uint64_t offset, void* buf, size_t count) {
+  TEST_AND_RETURN_FALSE(data_fd_ >= 0);
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  brillo::Blob block_data;
+  while (count > 0) {
+    const uint64_t block = offset / kStagingBlockSize;
+    const uint64_t block_offset = offset % kStagingBlockSize;
+    auto it = blocks_.find(block);
+    TEST_AND_RETURN_FALSE(it != blocks_.end() &&
+                          block_offset < it->second.length);
+    // The whole block is read to verify its hash.
+    block_data.resize(it->second.length);
+    ssize_t bytes_read = 0;
+    brillo::Blob hash;
+    if (!utils::PReadAll(data_fd_, block_data.data(), block_data.size(),
+                         block * kStagingBlockSize, &bytes_read) ||
+        bytes_read != static_cast<ssize_t>(block_data.size()) ||
+        !HashCalculator::RawHashOfData(block_data, &hash) ||
+        hash != it->second.hash) {
+      LOG(WARNING) << "The staged block " << block << " is corrupted, "
+                   << "dropping it.";
+      staged_bytes_ -= it->second.length;
+      blocks_.erase(it);
+      SaveIndex();
+      return false;
+    }
+    const size_t length = std::min(static_cast<uint64_t>(count),
+                                   it->second.length - block_offset);
+    memcpy(out, block_data.data() + block_offset, length);
+    out += length;
+    offset += length;
+    count -= length;
+  }
+  return true;
+}
+
+void PayloadStagingCache::Write(uint64_t offset,
+                                const void* data,
+                                size_t count) {
+  if (data_fd_ < 0)
+    return;
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (count > 0) {
+    if (offset != pending_offset_ + pending_.size()) {
+      // The data isn't in order anymore, so the staging restarts at the next
+      // block boundary.
+      pending_.clear();
+      const uint64_t skip =
+          (kStagingBlockSize - offset % kStagingBlockSize) % kStagingBlockSize;
+      if (skip >= count)
+        return;
+      offset += skip;
+      bytes += skip;
+      count -= skip;
+      pending_offset_ = offset;
+    }
+    const size_t length = std::min(
+        static_cast<uint64_t>(count), kStagingBlockSize - pending_.size());
+    pending_.insert(pending_.end(), bytes, bytes + length);
+    offset += length;
+    bytes += length;
+    count -= length;
+    if (pending_.size() == kStagingBlockSize)
+      StagePending();
+  }
+}
+
+void PayloadStagingCache::Flush() {
+  if (!pending_.empty())
+    StagePending();
+}
+
+void PayloadStagingCache::Clear() {
+  LOG(INFO) << "Deleting the " << staged_bytes_ << " staged payload bytes.";
+  blocks_.clear();
+  staged_bytes_ = 0;
+  pending_.clear();
+  if (data_fd_ >= 0)
+    PLOG_IF(WARNING, ftruncate(data_fd_, 0) != 0)
+        << "Unable to truncate " << data_path_;
+  SaveIndex();
+}
+
+void PayloadStagingCache::StagePending() {
+  const uint64_t block = pending_offset_ / kStagingBlockSize;
+  const uint64_t length = pending_.size();
+  const bool fits = staged_bytes_ + length <= max_bytes_;
+  if (fits && blocks_.find(block) == blocks_.end()) {
+    Block staged_block{length, {}};
+    if (HashCalculator::RawHashOfData(pending_, &staged_block.hash) &&
+        utils::PWriteAll(data_fd_, pending_.data(), length, pending_offset_)) {
+      // The block is only recorded once its data is written.
+      const string entry = base::StringPrintf(
+          "%" PRIu64 " %" PRIu64 " %s\n", block, length,
+          base::HexEncode(staged_block.hash.data(),
+                          staged_block.hash.size()).c_str());
+      int index_fd = HANDLE_EINTR(
+          open(index_path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+      if (index_fd >= 0 && utils::WriteAll(index_fd, entry.data(),
+                                           entry.size())) {
+        blocks_[block] = staged_block;
+        staged_bytes_ += length;
+      }
+      if (index_fd >= 0)
+        IGNORE_EINTR(close(index_fd));
+    }
+  }
+  pending_offset_ += length;
+  pending_.clear();
+}
+
+bool PayloadStagingCache::SaveIndex() {
+  string index = payload_id_ + "\n";
+  for (const auto& block : blocks_) {
+    base::StringAppendF(
+        &index, "%" PRIu64 " %" PRIu64 " %s\n", block.first,
+        block.second.length,
+        base::HexEncode(block.second.hash.data(),
+                        block.second.hash.size()).c_str());
+  }
+  const string tmp_path = index_path_ + ".new";
+  TEST_AND_RETURN_FALSE(utils::WriteFile(tmp_path.c_str(), index.data(),
+                                         index.size()));
+  TEST_AND_RETURN_FALSE_ERRNO(rename(tmp_path.c_str(),
+                                     index_path_.c_str()) == 0);
+  return true;
+}
+
+bool PayloadStagingCache::LoadIndex() {
+  string index;
+  if (!base::ReadFileToString(base::FilePath(index_path_), &index))
+    return false;
+  vector<string> lines = base::SplitString(
+      index, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (lines.empty() || lines[0] != payload_id_)
+    return false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    vector<string> fields = base::SplitString(
+        lines[i], " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    uint64_t block, length;
+    Block staged_block;
+    if (fields.size() != 3 || !base::StringToUint64(fields[0], &block) ||
+        !base::StringToUint64(fields[1], &length) || length == 0 ||
+        length > kStagingBlockSize ||
+        !base::HexStringToBytes(fields[2], &staged_block.hash)) {
+      LOG(WARNING) << "Invalid staging index entry: " << lines[i];
+      return false;
+    }
+    staged_block.length = length;
+    auto it = blocks_.find(block);
+    if (it != blocks_.end())
+      staged_bytes_ -= it->second.length;
+    blocks_[block] = staged_block;
+    staged_bytes_ += length;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PAYLOAD_STAGING_CACHE_H_
+#define UPDATE_ENGINE_COMMON_PAYLOAD_STAGING_CACHE_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// The size of the blocks the payload data is staged in.
+const uint64_t kStagingBlockSize = 1024 * 1024;
+
+// A PayloadStagingCache keeps the payload data downloaded by an update attempt
+// on local storage, so a retry of the same payload after a failure past the
+// download, such as the target verification or the postinstall, reads it from
+// there instead of the network. The data is staged in blocks of
+// kStagingBlockSize bytes at their offset in the downloaded file, each one
+// recorded in an index with its hash, which is verified when it's read back.
+class PayloadStagingCache {
+ public:
+  // Stages up to |max_bytes| of data in files in |dir|, created if needed.
+  PayloadStagingCache(const std::string& dir, uint64_t max_bytes);
+  ~PayloadStagingCache();
+
+  // Selects the payload identified by |payload_id|, which must identify the
+  // downloaded file and the offset of the payload in it. The blocks staged for
+  // it by a previous attempt are kept, and the data of any other payload is
+  // deleted. Returns whether the cache files could be created.
+  bool Open(const std::string& payload_id);
+
+  // Returns the number of staged bytes from |offset|, up to |max_length|.
+  uint64_t StagedBytesAt(uint64_t offset, uint64_t max_length) const;
+
+  // Returns the number of bytes from |offset| before the next staged byte, up
+  // to |max_length|.
+  uint64_t MissingBytesAt(uint64_t offset, uint64_t max_length) const;
+
+  // Reads the |count| staged bytes at |offset| into |buf|, verifying the hash
+  // of their blocks. Returns false if any of them isn't staged, dropping the
+  // blocks not matching their hash.
+  bool Read(uint64_t offset, void* buf, size_t count);
+
+  // Stages the |count| bytes of |data| downloaded at |offset|. The blocks are
+  // staged when they are received whole and in order, the other bytes are
+  // ignored.
+  void Write(uint64_t offset, const void* data, size_t count);
+
+  // Stages the beginning of the block received last, as the transfer ended
+  // before its end, which is usually the end of the payload.
+  void Flush();
+
+  // Deletes all the staged data, once the payload was applied or found to be
+  // corrupted.
+  void Clear();
+
+  uint64_t staged_bytes() const { return staged_bytes_; }
+
+ private:
+  struct Block {
+    uint64_t length;
+    brillo::Blob hash;
+  };
+
+  // Stages the |pending_| data as the block at |pending_offset_|.
+  void StagePending();
+
+  // Writes the index of the |blocks_|, replacing the current one.
+  bool SaveIndex();
+
+  // Loads the index of the blocks staged for |payload_id_|. Returns false if
+  // there is none or it's for another payload.
+  bool LoadIndex();
+
+  const std::string dir_;
+  const std::string data_path_;
+  const std::string index_path_;
+  const uint64_t max_bytes_;
+
+  std::string payload_id_;
+  int data_fd_{-1};
+
+  // The staged blocks, by index.
+  std::map<uint64_t, Block> blocks_;
+  uint64_t staged_bytes_{0};
+
+  // The data received in order since the last block boundary.
+  uint64_t pending_offset_{0};
+  brillo::Blob pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadStagingCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PAYLOAD_STAGING_CACHE_H_
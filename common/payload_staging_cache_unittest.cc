@@ -0,0 +1,153 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/payload_staging_cache.h"
+
+#include <string>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PayloadStagingCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    dir_ = temp_dir_.path().Append("staging").value();
+    // Two and a half blocks, each byte different from the ones of the next
+    // block.
+    for (size_t i = 0; i < 5 * kStagingBlockSize / 2; i++)
+      data_.push_back(i / kStagingBlockSize + i % 251);
+  }
+
+  // Writes the |data_| from |offset| to the |cache| in pieces of |piece|
+  // bytes, like they are received.
+  void WriteData(PayloadStagingCache* cache, uint64_t offset, size_t piece) {
+    for (uint64_t pos = offset; pos < data_.size(); pos += piece) {
+      const size_t count =
+          std::min(static_cast<uint64_t>(piece), data_.size() - pos);
+      cache->Write(pos, data_.data() + pos, count);
+    }
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string dir_;
+  brillo::Blob data_;
+};
+
+TEST_F(PayloadStagingCacheTest, StageAndReadTest) {
+  PayloadStagingCache cache(dir_, data_.size());
+  ASSERT_TRUE(cache.Open("payload"));
+  EXPECT_EQ(0U, cache.staged_bytes());
+  WriteData(&cache, 0, 12345);
+  // The last partial block is only staged once flushed.
+  EXPECT_EQ(2 * kStagingBlockSize, cache.staged_bytes());
+  cache.Flush();
+  EXPECT_EQ(data_.size(), cache.staged_bytes());
+  EXPECT_EQ(data_.size(), cache.StagedBytesAt(0, data_.size() + 10));
+  EXPECT_EQ(0U, cache.MissingBytesAt(100, 10));
+
+  brillo::Blob read_data(data_.size() - 100);
+  EXPECT_TRUE(cache.Read(100, read_data.data(), read_data.size()));
+  EXPECT_EQ(brillo::Blob(data_.begin() + 100, data_.end()), read_data);
+  EXPECT_FALSE(cache.Read(data_.size() - 10, read_data.data(), 20));
+}
+
+TEST_F(PayloadStagingCacheTest, OutOfOrderDataTest) {
+  PayloadStagingCache cache(dir_, data_.size());
+  ASSERT_TRUE(cache.Open("payload"));
+  // The data resumed in the middle of the first block is only staged from the
+  // second block.
+  WriteData(&cache, 1000, 4096);
+  EXPECT_EQ(kStagingBlockSize, cache.staged_bytes());
+  EXPECT_EQ(0U, cache.StagedBytesAt(0, data_.size()));
+  EXPECT_EQ(kStagingBlockSize, cache.MissingBytesAt(0, data_.size()));
+  EXPECT_EQ(kStagingBlockSize, cache.StagedBytesAt(kStagingBlockSize,
+                                                   data_.size()));
+  EXPECT_EQ(10U, cache.MissingBytesAt(0, 10));
+}
+
+TEST_F(PayloadStagingCacheTest, ReopenTest) {
+  {
+    PayloadStagingCache cache(dir_, data_.size());
+    ASSERT_TRUE(cache.Open("payload"));
+    WriteData(&cache, 0, kStagingBlockSize);
+    cache.Flush();
+  }
+  {
+    // The blocks staged for the same payload are kept.
+    PayloadStagingCache cache(dir_, data_.size());
+    ASSERT_TRUE(cache.Open("payload"));
+    EXPECT_EQ(data_.size(), cache.staged_bytes());
+    brillo::Blob read_data(data_.size());
+    EXPECT_TRUE(cache.Read(0, read_data.data(), read_data.size()));
+    EXPECT_EQ(data_, read_data);
+  }
+  // The ones of another payload are deleted.
+  PayloadStagingCache cache(dir_, data_.size());
+  ASSERT_TRUE(cache.Open("other payload"));
+  EXPECT_EQ(0U, cache.staged_bytes());
+  EXPECT_EQ(data_.size(), cache.MissingBytesAt(0, data_.size()));
+}
+
+TEST_F(PayloadStagingCacheTest, CorruptedBlockTest) {
+  PayloadStagingCache cache(dir_, data_.size());
+  ASSERT_TRUE(cache.Open("payload"));
+  WriteData(&cache, 0, kStagingBlockSize);
+  cache.Flush();
+
+  // Flip a byte of the second block.
+  const string data_path = dir_ + "/payload";
+  brillo::Blob file_data;
+  ASSERT_TRUE(utils::ReadFile(data_path, &file_data));
+  file_data[kStagingBlockSize + 10] ^= 0xff;
+  ASSERT_TRUE(
+      utils::WriteFile(data_path.c_str(), file_data.data(), file_data.size()));
+
+  brillo::Blob read_data(kStagingBlockSize);
+  EXPECT_TRUE(cache.Read(0, read_data.data(), read_data.size()));
+  EXPECT_FALSE(cache.Read(kStagingBlockSize, read_data.data(), 100));
+  // The corrupted block is dropped, also from the index.
+  EXPECT_EQ(0U, cache.StagedBytesAt(kStagingBlockSize, 100));
+  EXPECT_EQ(data_.size() - kStagingBlockSize, cache.staged_bytes());
+  PayloadStagingCache reopened_cache(dir_, data_.size());
+  ASSERT_TRUE(reopened_cache.Open("payload"));
+  EXPECT_EQ(kStagingBlockSize,
+            reopened_cache.MissingBytesAt(kStagingBlockSize, data_.size()));
+}
+
+TEST_F(PayloadStagingCacheTest, MaxBytesAndClearTest) {
+  PayloadStagingCache cache(dir_, kStagingBlockSize + 10);
+  ASSERT_TRUE(cache.Open("payload"));
+  WriteData(&cache, 0, 65536);
+  cache.Flush();
+  EXPECT_EQ(kStagingBlockSize, cache.staged_bytes());
+
+  cache.Clear();
+  EXPECT_EQ(0U, cache.staged_bytes());
+  EXPECT_EQ(data_.size(), cache.MissingBytesAt(0, data_.size()));
+  PayloadStagingCache reopened_cache(dir_, data_.size());
+  ASSERT_TRUE(reopened_cache.Open("payload"));
+  EXPECT_EQ(0U, reopened_cache.staged_bytes());
+}
+
+}  // namespace chromeos_update_engine
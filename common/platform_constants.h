@@ -54,6 +54,10 @@ extern const char kNonVolatileDirectory[];
 // postinstall.
 extern const char kPostinstallMountOptions[];
 
+// The mount point of the root memory cgroup, whose pressure events shrink the
+// caches of the updates. Empty if there is none.
+extern const char kMemoryCgroupPath[];
+
 }  // namespace constants
 }  // namespace chromeos_update_engine
 
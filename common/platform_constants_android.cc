@@ -33,6 +33,7 @@ const char kOmahaResponseDeadlineFile[] = "";
 const char kNonVolatileDirectory[] = "/data/misc/update_engine";
 const char kPostinstallMountOptions[] =
   "context=u:object_r:postinstall_file:s0";
+const char kMemoryCgroupPath[] = "/dev/memcg";
 
 }  // namespace constants
 }  // namespace chromeos_update_engine
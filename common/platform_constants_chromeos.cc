@@ -33,6 +33,7 @@ const char kOmahaResponseDeadlineFile[] =
 // This directory is wiped during powerwash.
 const char kNonVolatileDirectory[] = "/var/lib/update_engine";
 const char kPostinstallMountOptions[] = nullptr;
+const char kMemoryCgroupPath[] = "/sys/fs/cgroup/memory";
 
 }  // namespace constants
 }  // namespace chromeos_update_engine
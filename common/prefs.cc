@@ -16,19 +16,141 @@
 
 #include "update_engine/common/prefs.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Allows only non-empty keys containing [A-Za-z0-9_-].
+bool IsValidKey(const string& key) {
+  if (key.empty())
+    return false;
+  for (char c : key) {
+    if (!base::IsAsciiAlpha(c) && !base::IsAsciiDigit(c) && c != '_' &&
+        c != '-')
+      return false;
+  }
+  return true;
+}
+
+// The name of the LogPrefs log file. The dot keeps it from colliding with any
+// valid key name.
+const char kLogFileName[] = "prefs.log";
+
+// The extensions of the log being written by a compaction, and of the log it
+// replaced, kept as a backup.
+const char kNewLogExtension[] = "new";
+const char kBackupLogExtension[] = "old";
+
+// The log is rewritten when it is at least this large and this many times the
+// size of the current values.
+const int64_t kMinCompactionSize = 64 * 1024;
+const int64_t kCompactionRatio = 4;
+
+// Log record types. A transaction is a sequence of set and delete records
+// followed by a commit record holding the size and the SHA-256 of the records.
+// Sizes are stored as 32-bit little endian integers.
+const char kRecordSet = 'S';
+const char kRecordDelete = 'D';
+const char kRecordCommit = 'C';
+const size_t kHashSize = 32;
+
+void AppendSize(size_t size, string* out) {
+  for (int i = 0; i < 4; i++)
+    out->push_back(static_cast<char>((size >> (8 * i)) & 0xff));
+}
+
+void AppendString(const string& str, string* out) {
+  AppendSize(str.size(), out);
+  out->append(str);
+}
+
+bool ReadSize(const string& data, size_t* pos, size_t* size) {
+  if (data.size() - *pos < 4)
+    return false;
+  *size = 0;
+  for (int i = 0; i < 4; i++)
+    *size |= static_cast<size_t>(static_cast<uint8_t>(data[*pos + i]))
+             << (8 * i);
+  *pos += 4;
+  return true;
+}
+
+bool ReadString(const string& data, size_t* pos, string* out) {
+  size_t size;
+  if (!ReadSize(data, pos, &size) || data.size() - *pos < size)
+    return false;
+  out->assign(data, *pos, size);
+  *pos += size;
+  return true;
+}
+
+// Returns the size of the set record for |key| and |value|.
+int64_t SetRecordSize(const string& key, const string& value) {
+  return 1 + 4 + key.size() + 4 + value.size();
+}
+
+void AppendCommitRecord(const string& records, string* out) {
+  brillo::Blob hash;
+  HashCalculator::RawHashOfBytes(records.data(), records.size(), &hash);
+  out->push_back(kRecordCommit);
+  AppendSize(records.size(), out);
+  out->append(hash.begin(), hash.end());
+}
+
+// Writes |data| to the file at |path| and syncs it to the disk.
+bool WriteSyncedFile(const base::FilePath& path, const string& data) {
+  int fd = HANDLE_EINTR(open(path.value().c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             0600));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to create " << path.value();
+    return false;
+  }
+  bool success = utils::WriteAll(fd, data.data(), data.size());
+  if (!success) {
+    PLOG(ERROR) << "Unable to write " << path.value();
+  } else if (HANDLE_EINTR(fsync(fd)) != 0) {
+    PLOG(ERROR) << "Unable to sync " << path.value();
+    success = false;
+  }
+  IGNORE_EINTR(close(fd));
+  return success;
+}
+
+// Syncs the entries of the directory at |path|, such as a file renamed in it.
+bool SyncDirectory(const base::FilePath& path) {
+  int fd = HANDLE_EINTR(
+      open(path.value().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << path.value();
+    return false;
+  }
+  bool success = HANDLE_EINTR(fsync(fd)) == 0;
+  PLOG_IF(ERROR, !success) << "Unable to sync " << path.value();
+  IGNORE_EINTR(close(fd));
+  return success;
+}
+
+}  // namespace
+
 bool PrefsBase::GetString(const string& key, string* value) const {
   return storage_->GetKey(key, value);
 }
@@ -92,6 +214,14 @@ bool PrefsBase::Delete(const string& key) {
   return true;
 }
 
+void PrefsBase::BeginTransaction() {
+  storage_->BeginTransaction();
+}
+
+bool PrefsBase::CommitTransaction() {
+  return storage_->CommitTransaction();
+}
+
 void PrefsBase::AddObserver(const string& key, ObserverInterface* observer) {
   observers_[key].push_back(observer);
 }
@@ -153,17 +283,272 @@ bool Prefs::FileStorage::DeleteKey(const string& key) {
 
 bool Prefs::FileStorage::GetFileNameForKey(const string& key,
                                            base::FilePath* filename) const {
-  // Allows only non-empty keys containing [A-Za-z0-9_-].
-  TEST_AND_RETURN_FALSE(!key.empty());
-  for (size_t i = 0; i < key.size(); ++i) {
-    char c = key.at(i);
-    TEST_AND_RETURN_FALSE(base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) ||
-                          c == '_' || c == '-');
-  }
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
   *filename = prefs_dir_.Append(key);
   return true;
 }
 
+// LogPrefs
+
+bool LogPrefs::Init(const base::FilePath& prefs_dir) {
+  return log_storage_.Init(prefs_dir);
+}
+
+LogPrefs::LogStorage::~LogStorage() {
+  if (log_fd_ >= 0)
+    IGNORE_EINTR(close(log_fd_));
+}
+
+bool LogPrefs::LogStorage::Init(const base::FilePath& prefs_dir) {
+  prefs_dir_ = prefs_dir;
+  log_path_ = prefs_dir.Append(kLogFileName);
+  if (!base::DirectoryExists(prefs_dir_))
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+
+  vector<base::FilePath> key_files;
+  FindKeyFiles(&key_files);
+  bool complete = false;
+  if (base::PathExists(log_path_)) {
+    // Key files next to an existing log were already imported by a migration
+    // that didn't get to remove them, so they are just deleted.
+    if (LoadLog(log_path_, &complete)) {
+      log_valid_ = true;
+    } else {
+      // The log was emptied or truncated. The backup holds the values from
+      // before the last compaction, and the log is rewritten from them.
+      base::FilePath backup_path =
+          log_path_.AddExtension(kBackupLogExtension);
+      LOG(ERROR) << "Unable to load " << log_path_.value()
+                 << ", falling back to " << backup_path.value()
+                 << ". The changes made since then are lost.";
+      values_.clear();
+      TEST_AND_RETURN_FALSE(base::PathExists(backup_path) &&
+                            LoadLog(backup_path, &complete));
+      complete = false;
+    }
+  } else {
+    LOG(INFO) << "Migrating " << key_files.size() << " prefs from "
+              << prefs_dir_.value() << " to " << log_path_.value();
+    for (const base::FilePath& file : key_files) {
+      string value;
+      if (base::ReadFileToString(file, &value))
+        values_[file.BaseName().value()] = value;
+    }
+  }
+
+  for (const auto& key_value : values_)
+    compacted_size_ += SetRecordSize(key_value.first, key_value.second);
+  // Rewriting the log also drops any torn write at its end, which would
+  // otherwise hide the records appended after it.
+  if (complete) {
+    log_fd_ = HANDLE_EINTR(
+        open(log_path_.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+    if (log_fd_ < 0)
+      PLOG(WARNING) << "Unable to open " << log_path_.value();
+  }
+  if (log_fd_ < 0)
+    TEST_AND_RETURN_FALSE(Compact());
+
+  for (const base::FilePath& file : key_files)
+    base::DeleteFile(file, false);
+  return true;
+}
+
+bool LogPrefs::LogStorage::GetKey(const string& key, string* value) const {
+  auto it = values_.find(key);
+  if (it == values_.end()) {
+    LOG(INFO) << key << " not present in " << log_path_.value();
+    return false;
+  }
+  *value = it->second;
+  return true;
+}
+
+bool LogPrefs::LogStorage::SetKey(const string& key, const string& value) {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
+  auto it = values_.find(key);
+  if (it != values_.end()) {
+    if (it->second == value)
+      return true;
+    compacted_size_ -= SetRecordSize(key, it->second);
+    it->second = value;
+  } else {
+    values_.emplace(key, value);
+  }
+  compacted_size_ += SetRecordSize(key, value);
+
+  pending_.push_back(kRecordSet);
+  AppendString(key, &pending_);
+  AppendString(value, &pending_);
+  return transaction_depth_ > 0 || WritePending();
+}
+
+bool LogPrefs::LogStorage::KeyExists(const string& key) const {
+  return values_.find(key) != values_.end();
+}
+
+bool LogPrefs::LogStorage::DeleteKey(const string& key) {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
+  auto it = values_.find(key);
+  // Deleting a missing key succeeds, like deleting a missing file does.
+  if (it == values_.end())
+    return true;
+  compacted_size_ -= SetRecordSize(key, it->second);
+  values_.erase(it);
+
+  pending_.push_back(kRecordDelete);
+  AppendString(key, &pending_);
+  return transaction_depth_ > 0 || WritePending();
+}
+
+void LogPrefs::LogStorage::BeginTransaction() {
+  transaction_depth_++;
+}
+
+bool LogPrefs::LogStorage::CommitTransaction() {
+  TEST_AND_RETURN_FALSE(transaction_depth_ > 0);
+  if (--transaction_depth_ > 0)
+    return true;
+  return WritePending();
+}
+
+void LogPrefs::LogStorage::FindKeyFiles(vector<base::FilePath>* files) {
+  base::FileEnumerator dir(prefs_dir_, false, base::FileEnumerator::FILES);
+  for (base::FilePath file = dir.Next(); !file.empty(); file = dir.Next()) {
+    if (IsValidKey(file.BaseName().value()))
+      files->push_back(file);
+  }
+}
+
+bool LogPrefs::LogStorage::LoadLog(const base::FilePath& path,
+                                   bool* complete) {
+  string data;
+  TEST_AND_RETURN_FALSE(base::ReadFileToString(path, &data));
+
+  // The records of a transaction are only applied once its commit record is
+  // read and matches them.
+  struct Record {
+    char type;
+    string key;
+    string value;
+  };
+  vector<Record> staged;
+  size_t transaction_start = 0;
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t record_start = pos;
+    Record record{data[pos++], string(), string()};
+    if (record.type == kRecordSet) {
+      if (!ReadString(data, &pos, &record.key) ||
+          !ReadString(data, &pos, &record.value))
+        break;
+      staged.push_back(record);
+    } else if (record.type == kRecordDelete) {
+      if (!ReadString(data, &pos, &record.key))
+        break;
+      staged.push_back(record);
+    } else if (record.type == kRecordCommit) {
+      size_t size;
+      if (!ReadSize(data, &pos, &size) || data.size() - pos < kHashSize ||
+          size != record_start - transaction_start)
+        break;
+      brillo::Blob hash;
+      HashCalculator::RawHashOfBytes(
+          data.data() + transaction_start, size, &hash);
+      if (hash != brillo::Blob(data.begin() + pos,
+                               data.begin() + pos + kHashSize))
+        break;
+      pos += kHashSize;
+      for (const Record& change : staged) {
+        if (change.type == kRecordSet)
+          values_[change.key] = change.value;
+        else
+          values_.erase(change.key);
+      }
+      staged.clear();
+      transaction_start = pos;
+    } else {
+      break;
+    }
+  }
+  // Every log starts with the transaction written by the compaction that
+  // created it, so a log without any was emptied or truncated.
+  if (transaction_start == 0) {
+    LOG(ERROR) << path.value() << " has no committed transaction in its "
+               << data.size() << " bytes.";
+    return false;
+  }
+  *complete = transaction_start == data.size();
+  if (!*complete) {
+    LOG(WARNING) << "Dropping " << data.size() - transaction_start
+                 << " bytes of uncommitted changes from " << path.value();
+  }
+  log_size_ = data.size();
+  return true;
+}
+
+bool LogPrefs::LogStorage::WritePending() {
+  if (pending_.empty())
+    return true;
+  string transaction = pending_;
+  AppendCommitRecord(pending_, &transaction);
+  pending_.clear();
+
+  if (log_fd_ < 0 || (log_size_ >= kMinCompactionSize &&
+                      log_size_ >= kCompactionRatio * compacted_size_)) {
+    return Compact();
+  }
+  if (!utils::WriteAll(log_fd_, transaction.data(), transaction.size())) {
+    // A partial write would hide all the following ones, so start over.
+    PLOG(ERROR) << "Unable to append to " << log_path_.value();
+    return Compact();
+  }
+  // The transaction is only committed once it is on the disk.
+  if (HANDLE_EINTR(fdatasync(log_fd_)) != 0) {
+    PLOG(ERROR) << "Unable to sync " << log_path_.value();
+    return Compact();
+  }
+  log_size_ += transaction.size();
+  return true;
+}
+
+bool LogPrefs::LogStorage::Compact() {
+  string records;
+  for (const auto& key_value : values_) {
+    records.push_back(kRecordSet);
+    AppendString(key_value.first, &records);
+    AppendString(key_value.second, &records);
+  }
+  string log = records;
+  AppendCommitRecord(records, &log);
+
+  // Write and sync the new log next to the current one before moving it in
+  // place, so a crash leaves either of them complete. The current log is kept
+  // as the backup, unless it couldn't be loaded.
+  base::FilePath new_log_path = log_path_.AddExtension(kNewLogExtension);
+  TEST_AND_RETURN_FALSE(WriteSyncedFile(new_log_path, log));
+  if (log_valid_) {
+    base::FilePath backup_path = log_path_.AddExtension(kBackupLogExtension);
+    base::DeleteFile(backup_path, false);
+    if (link(log_path_.value().c_str(), backup_path.value().c_str()) != 0)
+      PLOG(WARNING) << "Unable to back up " << log_path_.value();
+  }
+  TEST_AND_RETURN_FALSE(base::ReplaceFile(new_log_path, log_path_, nullptr));
+  TEST_AND_RETURN_FALSE(SyncDirectory(prefs_dir_));
+  log_valid_ = true;
+
+  if (log_fd_ >= 0)
+    IGNORE_EINTR(close(log_fd_));
+  log_fd_ = HANDLE_EINTR(
+      open(log_path_.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  if (log_fd_ < 0) {
+    PLOG(ERROR) << "Unable to open " << log_path_.value();
+    return false;
+  }
+  log_size_ = log.size();
+  return true;
+}
+
 // MemoryPrefs
 
 bool MemoryPrefs::MemoryStorage::GetKey(const string& key,
@@ -53,6 +53,14 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(const std::string& key) = 0;
 
+    // Groups the following SetKey() and DeleteKey() calls until the matching
+    // CommitTransaction() so they are persisted all together or not at all.
+    // Calls can be nested; only the outermost commit persists the changes.
+    // Storages that persist every change on its own don't need to override
+    // these.
+    virtual void BeginTransaction() {}
+    virtual bool CommitTransaction() { return true; }
+
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
@@ -75,6 +83,9 @@ class PrefsBase : public PrefsInterface {
   void RemoveObserver(const std::string& key,
                       ObserverInterface* observer) override;
 
+  void BeginTransaction() override;
+  bool CommitTransaction() override;
+
  private:
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>> observers_;
@@ -135,6 +146,89 @@ class Prefs : public PrefsBase {
   DISALLOW_COPY_AND_ASSIGN(Prefs);
 };
 
+// Implements a preference store by appending every change to a single log file
+// under the preference store directory, and serving the reads from memory. The
+// log is rewritten with only the current values once it grows too large
+// compared to them. Replaces the per-key file layout used by Prefs, which is
+// imported the first time the log is created.
+
+class LogPrefs : public PrefsBase {
+ public:
+  LogPrefs() : PrefsBase(&log_storage_) {}
+
+  // Initializes the store by loading the log in |prefs_dir|, or by migrating
+  // the per-key files in it if there's no log yet. Returns true on success,
+  // false otherwise.
+  bool Init(const base::FilePath& prefs_dir);
+
+ private:
+  class LogStorage : public PrefsBase::StorageInterface {
+   public:
+    LogStorage() = default;
+    ~LogStorage() override;
+
+    bool Init(const base::FilePath& prefs_dir);
+
+    // PrefsBase::StorageInterface overrides.
+    bool GetKey(const std::string& key, std::string* value) const override;
+    bool SetKey(const std::string& key, const std::string& value) override;
+    bool KeyExists(const std::string& key) const override;
+    bool DeleteKey(const std::string& key) override;
+    void BeginTransaction() override;
+    bool CommitTransaction() override;
+
+   private:
+    // Replays the committed transactions found in the log file at |path| into
+    // |values_|. Sets |complete| to whether the whole file was read, that is,
+    // whether it doesn't end with a torn or uncommitted write, in which case
+    // it needs to be compacted. Returns false if the file can't be read or has
+    // no committed transaction at all, as when it was emptied or truncated.
+    bool LoadLog(const base::FilePath& path, bool* complete);
+
+    // Appends to |files| the per-key files of the Prefs layout found in the
+    // preference store directory.
+    void FindKeyFiles(std::vector<base::FilePath>* files);
+
+    // Writes the pending records as one committed transaction and syncs it to
+    // the disk, or compacts the log instead if it grew too large.
+    bool WritePending();
+
+    // Rewrites the log with only the current values. The new log is synced
+    // before it replaces the current one, which is kept as the backup loaded
+    // by Init() if the log is found emptied or truncated.
+    bool Compact();
+
+    // Preference store directory and log file in it.
+    base::FilePath prefs_dir_;
+    base::FilePath log_path_;
+
+    // File descriptor of the log, opened for appending.
+    int log_fd_{-1};
+
+    // Whether the log file holds committed transactions, and so is kept as
+    // the backup when it is compacted.
+    bool log_valid_{false};
+
+    // Current size of the log file, and the size it would have if compacted.
+    int64_t log_size_{0};
+    int64_t compacted_size_{0};
+
+    // The current values, including the pending ones.
+    std::map<std::string, std::string> values_;
+
+    // The records of the still open transaction and its nesting depth.
+    std::string pending_;
+    int transaction_depth_{0};
+
+    DISALLOW_COPY_AND_ASSIGN(LogStorage);
+  };
+
+  // The concrete log storage implementation.
+  LogStorage log_storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogPrefs);
+};
+
 // Implements a preference store in memory. The stored values are lost when the
 // object is destroyed.
 
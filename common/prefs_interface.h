@@ -21,6 +21,8 @@
 
 #include <string>
 
+#include <base/macros.h>
+
 namespace chromeos_update_engine {
 
 // The prefs interface allows access to a persistent preferences
@@ -90,6 +92,28 @@ class PrefsInterface {
   // anymore for future Set*() and Delete() method calls.
   virtual void RemoveObserver(const std::string& key,
                               ObserverInterface* observer) = 0;
+
+  // Groups the changes done until the matching CommitTransaction() call so
+  // they are persisted together in a single write, on stores that support it.
+  // Transactions can be nested; only the outermost commit persists them.
+  // Returns whether the changes were persisted.
+  virtual void BeginTransaction() = 0;
+  virtual bool CommitTransaction() = 0;
+};
+
+// Groups the changes done to a PrefsInterface during its lifetime in a single
+// transaction.
+class ScopedPrefsTransaction {
+ public:
+  explicit ScopedPrefsTransaction(PrefsInterface* prefs) : prefs_(prefs) {
+    prefs_->BeginTransaction();
+  }
+  ~ScopedPrefsTransaction() { prefs_->CommitTransaction(); }
+
+ private:
+  PrefsInterface* prefs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPrefsTransaction);
 };
 
 }  // namespace chromeos_update_engine
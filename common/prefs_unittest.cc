@@ -19,6 +19,7 @@
 #include <inttypes.h>
 
 #include <limits>
+#include <memory>
 #include <string>
 
 #include <base/files/file_util.h>
@@ -359,4 +360,154 @@ TEST_F(MemoryPrefsTest, BasicTest) {
   EXPECT_FALSE(prefs_.Delete(kKey));
 }
 
+
+class LogPrefsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(base::CreateNewTempDirectory("aulogprefs", &prefs_dir_));
+    log_path_ = prefs_dir_.Append("prefs.log");
+  }
+
+  void TearDown() override {
+    base::DeleteFile(prefs_dir_, true);  // recursive
+  }
+
+  // Simulates a restart of the daemon by loading the log in a new object.
+  void Reload() {
+    prefs_.reset(new LogPrefs());
+    ASSERT_TRUE(prefs_->Init(prefs_dir_));
+  }
+
+  base::FilePath prefs_dir_;
+  base::FilePath log_path_;
+  std::unique_ptr<LogPrefs> prefs_;
+};
+
+TEST_F(LogPrefsTest, PersistsAcrossReloads) {
+  Reload();
+  EXPECT_TRUE(prefs_->SetString(kKey, "value"));
+  EXPECT_TRUE(prefs_->SetInt64("other-key", 5));
+  EXPECT_TRUE(prefs_->Delete("other-key"));
+  EXPECT_FALSE(prefs_->SetString("bad/key", "value"));
+
+  Reload();
+  string value;
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  EXPECT_FALSE(prefs_->Exists("other-key"));
+  // No per-key files are written.
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+}
+
+TEST_F(LogPrefsTest, MigratesKeyFiles) {
+  Prefs file_prefs;
+  ASSERT_TRUE(file_prefs.Init(prefs_dir_));
+  EXPECT_TRUE(file_prefs.SetString(kKey, "value"));
+  EXPECT_TRUE(file_prefs.SetInt64("other-key", 5));
+
+  Reload();
+  string value;
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  int64_t int_value;
+  EXPECT_TRUE(prefs_->GetInt64("other-key", &int_value));
+  EXPECT_EQ(5, int_value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("other-key")));
+  EXPECT_TRUE(base::PathExists(log_path_));
+}
+
+TEST_F(LogPrefsTest, IgnoresIncompleteTransaction) {
+  Reload();
+  EXPECT_TRUE(prefs_->SetString(kKey, "old"));
+  prefs_->BeginTransaction();
+  EXPECT_TRUE(prefs_->SetString(kKey, "new"));
+  EXPECT_TRUE(prefs_->SetString("other-key", "new"));
+  EXPECT_TRUE(prefs_->Exists("other-key"));
+  // Destroying the object before the commit acts as a crash.
+  Reload();
+
+  string value;
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("old", value);
+  EXPECT_FALSE(prefs_->Exists("other-key"));
+
+  prefs_->BeginTransaction();
+  EXPECT_TRUE(prefs_->SetString(kKey, "new"));
+  EXPECT_TRUE(prefs_->SetString("other-key", "new"));
+  EXPECT_TRUE(prefs_->CommitTransaction());
+  Reload();
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("new", value);
+  EXPECT_TRUE(prefs_->Exists("other-key"));
+}
+
+TEST_F(LogPrefsTest, DropsTornWrite) {
+  Reload();
+  EXPECT_TRUE(prefs_->SetString(kKey, "value"));
+  prefs_.reset();
+  const char kGarbage[] = "S\x10garbage";
+  ASSERT_TRUE(base::AppendToFile(log_path_, kGarbage, sizeof(kGarbage) - 1));
+
+  Reload();
+  string value;
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  // Writes after the torn one are still found.
+  EXPECT_TRUE(prefs_->SetString("other-key", "value"));
+  Reload();
+  EXPECT_TRUE(prefs_->Exists("other-key"));
+}
+
+TEST_F(LogPrefsTest, RejectsEmptyLog) {
+  ASSERT_EQ(0, base::WriteFile(log_path_, "", 0));
+  prefs_.reset(new LogPrefs());
+  // Without a backup to fall back to, the lost values aren't silently
+  // replaced with an empty store.
+  EXPECT_FALSE(prefs_->Init(prefs_dir_));
+}
+
+TEST_F(LogPrefsTest, FallsBackToBackupLog) {
+  Reload();
+  EXPECT_TRUE(prefs_->SetString(kKey, "value"));
+  prefs_.reset();
+  // The torn write makes the next Init() compact the log, which keeps the
+  // previous one as the backup.
+  const char kGarbage[] = "S\x10garbage";
+  ASSERT_TRUE(base::AppendToFile(log_path_, kGarbage, sizeof(kGarbage) - 1));
+  Reload();
+  EXPECT_TRUE(base::PathExists(log_path_.AddExtension("old")));
+  EXPECT_TRUE(prefs_->SetString("other-key", "value"));
+  prefs_.reset();
+
+  // A log truncated by a power loss loads the backup instead.
+  ASSERT_EQ(0, base::WriteFile(log_path_, "", 0));
+  Reload();
+  string value;
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  // The changes since the backup are lost.
+  EXPECT_FALSE(prefs_->Exists("other-key"));
+
+  // The log was rewritten from the backup.
+  EXPECT_TRUE(prefs_->SetString("other-key", "value"));
+  Reload();
+  EXPECT_TRUE(prefs_->GetString(kKey, &value));
+  EXPECT_TRUE(prefs_->Exists("other-key"));
+}
+
+TEST_F(LogPrefsTest, CompactsLog) {
+  Reload();
+  for (int i = 0; i < 10000; i++)
+    EXPECT_TRUE(prefs_->SetInt64(kKey, i));
+  int64_t log_size;
+  ASSERT_TRUE(base::GetFileSize(log_path_, &log_size));
+  EXPECT_LT(log_size, 128 * 1024);
+
+  Reload();
+  int64_t value;
+  EXPECT_TRUE(prefs_->GetInt64(kKey, &value));
+  EXPECT_EQ(9999, value);
+}
+
 }  // namespace chromeos_update_engine
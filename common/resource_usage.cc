@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_usage.h"
+
+#include <sys/resource.h>
+
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+base::TimeDelta TimevalToTimeDelta(const struct timeval& tv) {
+  return base::TimeDelta::FromMicroseconds(
+      static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec);
+}
+
+}  // namespace
+
+// static
+ResourceUsage ResourceUsage::Now() {
+  ResourceUsage usage;
+  usage.time = base::TimeTicks::Now();
+
+  struct rusage rusage;
+  if (getrusage(RUSAGE_SELF, &rusage) == 0) {
+    usage.cpu_time = TimevalToTimeDelta(rusage.ru_utime) +
+                     TimevalToTimeDelta(rusage.ru_stime);
+    usage.peak_rss_kb = rusage.ru_maxrss;
+  }
+
+  string io;
+  base::StringPairs pairs;
+  if (base::ReadFileToString(base::FilePath("/proc/self/io"), &io) &&
+      base::SplitStringIntoKeyValuePairs(io, ':', '\n', &pairs)) {
+    for (const auto& pair : pairs) {
+      uint64_t value;
+      string value_str;
+      base::TrimWhitespaceASCII(pair.second, base::TRIM_ALL, &value_str);
+      if (!base::StringToUint64(value_str, &value))
+        continue;
+      if (pair.first == "rchar")
+        usage.read_bytes = value;
+      else if (pair.first == "wchar")
+        usage.write_bytes = value;
+      else if (pair.first == "read_bytes")
+        usage.storage_read_bytes = value;
+      else if (pair.first == "write_bytes")
+        usage.storage_write_bytes = value;
+    }
+  }
+  return usage;
+}
+
+}  // namespace chromeos_update_engine
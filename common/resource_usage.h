@@ -0,0 +1,52 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_RESOURCE_USAGE_H_
+#define UPDATE_ENGINE_COMMON_RESOURCE_USAGE_H_
+
+#include <stdint.h>
+
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// The resources used by the process since it started, as sampled at some point
+// in time. The usage of a task is the difference between the samples taken
+// before and after it, which also counts any other thread running meanwhile.
+struct ResourceUsage {
+  // Returns the current usage of the process.
+  static ResourceUsage Now();
+
+  // When the usage was sampled.
+  base::TimeTicks time;
+
+  // The user and system CPU time of all the threads of the process.
+  base::TimeDelta cpu_time;
+
+  // The bytes read and written by the process, as reported in /proc/self/io.
+  // The "storage" values only count the I/O that reached the block layer.
+  uint64_t read_bytes{0};
+  uint64_t write_bytes{0};
+  uint64_t storage_read_bytes{0};
+  uint64_t storage_write_bytes{0};
+
+  // The peak resident set size, in KiB.
+  int64_t peak_rss_kb{0};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_RESOURCE_USAGE_H_
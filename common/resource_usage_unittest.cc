@@ -0,0 +1,47 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_usage.h"
+
+#include <string>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(ResourceUsageTest, UsageGrowsTest) {
+  const ResourceUsage start = ResourceUsage::Now();
+  EXPECT_LT(0, start.peak_rss_kb);
+
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const std::string data(4096, 'x');
+  ASSERT_EQ(static_cast<int>(data.size()),
+            base::WriteFile(temp_dir.path().Append("file"), data.data(),
+                            data.size()));
+
+  const ResourceUsage end = ResourceUsage::Now();
+  EXPECT_LE(start.time, end.time);
+  EXPECT_LE(start.cpu_time, end.cpu_time);
+  EXPECT_LE(start.peak_rss_kb, end.peak_rss_kb);
+  // /proc/self/io may not be available, such as without task I/O accounting.
+  if (base::PathExists(base::FilePath("/proc/self/io")))
+    EXPECT_LE(start.write_bytes + data.size(), end.write_bytes);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/staging_http_fetcher.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+#include "update_engine/common/http_common.h"
+
+namespace chromeos_update_engine {
+
+StagingHttpFetcher::StagingHttpFetcher(HttpFetcher* base_fetcher,
+                                       PayloadStagingCache* cache)
+    : HttpFetcher(base_fetcher->proxy_resolver()),
+      base_fetcher_(base_fetcher),
+      cache_(cache) {
+  base_fetcher_->set_delegate(this);
+}
+
+StagingHttpFetcher::~StagingHttpFetcher() {
+  if (continue_task_id_ != brillo::MessageLoop::kTaskIdNull)
+    brillo::MessageLoop::current()->CancelTask(continue_task_id_);
+}
+
+void StagingHttpFetcher::BeginTransfer(const std::string& url) {
+  CHECK(!active_) << "BeginTransfer but already active.";
+  url_ = url;
+  active_ = true;
+  position_ = offset_;
+  http_response_code_ = kHttpResponseUndefined;
+  // The staged data is passed from a task, like the FileFetcher does.
+  ScheduleContinue();
+}
+
+void StagingHttpFetcher::TerminateTransfer() {
+  if (!active_) {
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  if (base_fetcher_active_) {
+    if (!pending_missing_end_)
+      base_fetcher_->TerminateTransfer();
+    return;
+  }
+  ScheduleContinue();
+}
+
+void StagingHttpFetcher::Pause() {
+  paused_ = true;
+  if (base_fetcher_active_)
+    base_fetcher_->Pause();
+}
+
+void StagingHttpFetcher::Unpause() {
+  paused_ = false;
+  if (base_fetcher_active_)
+    base_fetcher_->Unpause();
+  else if (active_)
+    ScheduleContinue();
+}
+
+void StagingHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                       const void* bytes,
+                                       size_t length) {
+  if (pending_missing_end_ || terminating_)
+    return;
+  http_response_code_ = fetcher->http_response_code();
+  size_t count = length;
+  if (missing_end_)
+    count = std::min(static_cast<uint64_t>(length), missing_end_ - position_);
+  cache_->Write(position_, bytes, count);
+  position_ += count;
+  if (delegate_ && count > 0)
+    delegate_->ReceivedBytes(this, bytes, count);
+  if (missing_end_ && position_ >= missing_end_ && !terminating_) {
+    // The next bytes are staged, so the transfer continues from the cache once
+    // the base fetcher is done.
+    pending_missing_end_ = true;
+    base_fetcher_->TerminateTransfer();
+  }
+}
+
+void StagingHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                          bool successful) {
+  BaseTransferEnded(successful);
+}
+
+void StagingHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  BaseTransferEnded(false);
+}
+
+void StagingHttpFetcher::BaseTransferEnded(bool successful) {
+  CHECK(base_fetcher_active_) << "Transfer ended unexpectedly.";
+  base_fetcher_active_ = false;
+  pending_missing_end_ = false;
+  if (terminating_) {
+    EndTransfer(false);
+  } else if (missing_end_ && position_ >= missing_end_) {
+    Continue();
+  } else {
+    // Either the transfer to the end of the file ended, or the base fetcher
+    // didn't get all the missing bytes.
+    EndTransfer(successful && !missing_end_);
+  }
+}
+
+void StagingHttpFetcher::Continue() {
+  if (continue_task_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(continue_task_id_);
+    continue_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  const uint64_t end = RangeEnd();
+  if (terminating_ || (end && position_ >= end)) {
+    EndTransfer(!terminating_);
+    return;
+  }
+  if (paused_)
+    return;
+
+  const uint64_t max_length =
+      end ? end - position_ : std::numeric_limits<uint64_t>::max() - position_;
+  const uint64_t staged = cache_->StagedBytesAt(position_, max_length);
+  if (staged > 0) {
+    // The staged bytes are passed one block at a time, so the delegate can
+    // pause the transfer.
+    const size_t count = std::min(
+        staged, kStagingBlockSize - position_ % kStagingBlockSize);
+    buffer_.resize(count);
+    if (cache_->Read(position_, buffer_.data(), count)) {
+      if (http_response_code_ == kHttpResponseUndefined) {
+        http_response_code_ = (offset_ || length_) ? kHttpResponsePartialContent
+                                                   : kHttpResponseOk;
+      }
+      position_ += count;
+      staged_bytes_read_ += count;
+      if (delegate_)
+        delegate_->ReceivedBytes(this, buffer_.data(), count);
+      ScheduleContinue();
+      return;
+    }
+    // The corrupted blocks were dropped, so they are fetched instead.
+  }
+
+  const uint64_t missing = cache_->MissingBytesAt(position_, max_length);
+  if (missing == 0) {
+    LOG(ERROR) << "Unable to read the staged data at " << position_;
+    EndTransfer(false);
+    return;
+  }
+  missing_end_ = (end || missing < max_length) ? position_ + missing : 0;
+  LOG(INFO) << "Fetching " << (missing_end_ ? std::to_string(missing) : "all")
+            << " missing bytes at " << position_;
+  base_fetcher_->SetOffset(position_);
+  if (missing_end_)
+    base_fetcher_->SetLength(missing);
+  else
+    base_fetcher_->UnsetLength();
+  base_fetcher_active_ = true;
+  base_fetcher_->BeginTransfer(url_);
+}
+
+void StagingHttpFetcher::ScheduleContinue() {
+  if (continue_task_id_ != brillo::MessageLoop::kTaskIdNull)
+    return;
+  continue_task_id_ = brillo::MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&StagingHttpFetcher::Continue, base::Unretained(this)));
+}
+
+uint64_t StagingHttpFetcher::RangeEnd() const {
+  return length_ ? offset_ + length_ : 0;
+}
+
+void StagingHttpFetcher::EndTransfer(bool successful) {
+  if (continue_task_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(continue_task_id_);
+    continue_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  const bool terminated = terminating_;
+  active_ = terminating_ = paused_ = false;
+  base_fetcher_active_ = pending_missing_end_ = false;
+  // The last block of the payload is usually shorter than the others.
+  if (successful)
+    cache_->Flush();
+  LOG(INFO) << "Transfer ended, " << staged_bytes_read_
+            << " bytes read from the staging cache so far.";
+  // Note that after the callback returns this object may be destroyed.
+  if (!delegate_)
+    return;
+  if (terminated)
+    delegate_->TransferTerminated(this);
+  else
+    delegate_->TransferComplete(this, successful);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_STAGING_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_STAGING_HTTP_FETCHER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/payload_staging_cache.h"
+
+namespace chromeos_update_engine {
+
+// StagingHttpFetcher is an HttpFetcher wrapping another one, the base fetcher,
+// that reads the requested range from a PayloadStagingCache where the data
+// was staged, and fetches only the missing parts of it with the base fetcher,
+// staging what it receives. Like the MultiRangeHttpFetcher it is used under,
+// the base fetcher must support beginning a transfer after one has stopped.
+class StagingHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // Takes ownership of the passed in fetcher, but not of the |cache|, which
+  // must be opened and outlive this object.
+  StagingHttpFetcher(HttpFetcher* base_fetcher, PayloadStagingCache* cache);
+  ~StagingHttpFetcher() override;
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override {
+    base_fetcher_->SetHeader(header_name, header_value);
+  }
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override {
+    base_fetcher_->set_idle_seconds(seconds);
+  }
+  void set_retry_seconds(int seconds) override {
+    base_fetcher_->set_retry_seconds(seconds);
+  }
+  virtual void SetProxies(const std::deque<std::string>& proxies) {
+    base_fetcher_->SetProxies(proxies);
+  }
+
+  // Only the bytes fetched from the network are counted.
+  size_t GetBytesDownloaded() override {
+    return base_fetcher_->GetBytesDownloaded();
+  }
+
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
+    base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  }
+  void set_connect_timeout(int connect_timeout_seconds) override {
+    base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+  }
+  void set_max_retry_count(int max_retry_count) override {
+    base_fetcher_->set_max_retry_count(max_retry_count);
+  }
+  void set_max_receive_speed(int max_speed_bps) override {
+    base_fetcher_->set_max_receive_speed(max_speed_bps);
+  }
+  bool GetResponseHeader(const std::string& header_name,
+                         std::string* header_value) const override {
+    return base_fetcher_->GetResponseHeader(header_name, header_value);
+  }
+
+  // The number of bytes passed to the delegate from the cache.
+  uint64_t staged_bytes_read() const { return staged_bytes_read_; }
+
+ private:
+  // HttpFetcherDelegate overrides.
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  // Called when the transfer of the base fetcher ended.
+  void BaseTransferEnded(bool successful);
+
+  // Passes the next staged bytes at |position_| to the delegate, or starts
+  // fetching the missing ones, or ends the transfer.
+  void Continue();
+
+  // Posts a task calling Continue(), unless one is already pending.
+  void ScheduleContinue();
+
+  // Returns the end of the range requested, or 0 when it has no length.
+  uint64_t RangeEnd() const;
+
+  // Resets the state and notifies the delegate of the end of the transfer.
+  void EndTransfer(bool successful);
+
+  std::unique_ptr<HttpFetcher> base_fetcher_;
+  PayloadStagingCache* cache_;
+
+  // The range requested, with a |length_| of 0 when it has no end.
+  off_t offset_{0};
+  size_t length_{0};
+
+  // Whether a transfer was begun and not ended yet.
+  bool active_{false};
+  // Whether TerminateTransfer() was called for the current transfer.
+  bool terminating_{false};
+  bool paused_{false};
+
+  // Whether the base fetcher is transferring the missing bytes up to
+  // |missing_end_|, or to the end of the file when 0.
+  bool base_fetcher_active_{false};
+  uint64_t missing_end_{0};
+  // Whether the base fetcher was terminated at |missing_end_|.
+  bool pending_missing_end_{false};
+
+  // The offset of the next byte passed to the delegate.
+  uint64_t position_{0};
+  uint64_t staged_bytes_read_{0};
+
+  brillo::Blob buffer_;
+  brillo::MessageLoop::TaskId continue_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(StagingHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_STAGING_HTTP_FETCHER_H_
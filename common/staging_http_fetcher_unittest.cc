@@ -0,0 +1,117 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/staging_http_fetcher.h"
+
+#include <memory>
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+class StagingHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + length);
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed_ = true;
+    successful_ = successful;
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    ADD_FAILURE();
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+
+  brillo::Blob data_;
+  bool completed_{false};
+  bool successful_{false};
+};
+
+}  // namespace
+
+class StagingHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_.reset(new PayloadStagingCache(temp_dir_.path().value(), 1 << 30));
+    ASSERT_TRUE(cache_->Open("payload"));
+    for (size_t i = 0; i < 3 * kStagingBlockSize + 1000; i++)
+      data_.push_back(i % 253);
+  }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  // Fetches the |data_| from |offset| through a StagingHttpFetcher, checking
+  // the data received. Returns the number of bytes read from the cache.
+  uint64_t Fetch(off_t offset, bool use_network) {
+    MockHttpFetcher* base_fetcher =
+        new MockHttpFetcher(data_.data(), data_.size(), nullptr);
+    base_fetcher->set_never_use(!use_network);
+    StagingHttpFetcher fetcher(base_fetcher, cache_.get());
+    StagingHttpFetcherTestDelegate delegate;
+    fetcher.set_delegate(&delegate);
+    fetcher.SetOffset(offset);
+    fetcher.BeginTransfer("http://fake_url");
+    loop_.Run();
+    EXPECT_TRUE(delegate.completed_);
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_EQ(brillo::Blob(data_.begin() + offset, data_.end()),
+              delegate.data_);
+    return fetcher.staged_bytes_read();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  base::ScopedTempDir temp_dir_;
+  std::unique_ptr<PayloadStagingCache> cache_;
+  brillo::Blob data_;
+};
+
+TEST_F(StagingHttpFetcherTest, StagesFetchedDataTest) {
+  EXPECT_EQ(0U, Fetch(0, true));
+  EXPECT_EQ(data_.size(), cache_->staged_bytes());
+  // The second transfer doesn't use the network at all.
+  EXPECT_EQ(data_.size(), Fetch(0, false));
+  EXPECT_EQ(data_.size() - 100, Fetch(100, false));
+}
+
+TEST_F(StagingHttpFetcherTest, FetchesMissingBlocksTest) {
+  // Only the second block is staged.
+  cache_->Write(kStagingBlockSize, data_.data() + kStagingBlockSize,
+                kStagingBlockSize);
+  EXPECT_EQ(kStagingBlockSize, cache_->staged_bytes());
+  EXPECT_EQ(kStagingBlockSize, Fetch(0, true));
+  // The missing blocks were staged while fetched.
+  EXPECT_EQ(data_.size(), cache_->staged_bytes());
+}
+
+}  // namespace chromeos_update_engine
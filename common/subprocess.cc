@@ -16,11 +16,15 @@
 
 #include "update_engine/common/subprocess.h"
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
@@ -28,9 +32,10 @@
 #include <base/bind.h>
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
-#include <brillo/process.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
@@ -44,57 +49,173 @@ namespace chromeos_update_engine {
 
 namespace {
 
-bool SetupChild(const std::map<string, string>& env, uint32_t flags) {
-  // Setup the environment variables.
-  clearenv();
-  for (const auto& key_value : env) {
-    setenv(key_value.first.c_str(), key_value.second.c_str(), 0);
-  }
-
-  if ((flags & Subprocess::kRedirectStderrToStdout) != 0) {
-    if (HANDLE_EINTR(dup2(STDOUT_FILENO, STDERR_FILENO)) != STDERR_FILENO)
-      return false;
+// The exit status of the child when it couldn't run the command, as returned
+// by brillo::Process for the same failure.
+const int kErrorExitStatus = 127;
+
+// Returns the path of the executable run for |program|, looked up in the PATH
+// if |search_path| and it isn't a path already. The lookup is done before
+// forking, so the child only has to call execve(2).
+string ProgramPath(const string& program, bool search_path) {
+  if (!search_path || program.find('/') != string::npos)
+    return program;
+  const char* path_env = getenv("PATH");
+  for (const string& dir : base::SplitString(path_env ? path_env : "",
+                                             ":",
+                                             base::KEEP_WHITESPACE,
+                                             base::SPLIT_WANT_NONEMPTY)) {
+    const string path = dir + "/" + program;
+    if (access(path.c_str(), X_OK) == 0)
+      return path;
   }
+  return program;
+}
 
-  int fd = HANDLE_EINTR(open("/dev/null", O_RDONLY));
-  if (fd < 0)
+// Moves |*fd| above |min_fd| if needed, so redirecting the file descriptors
+// up to |min_fd| in the child doesn't overwrite it. The moved file descriptor
+// is closed on exec.
+bool MoveAbove(int min_fd, int* fd) {
+  if (*fd > min_fd)
+    return true;
+  int new_fd = HANDLE_EINTR(fcntl(*fd, F_DUPFD_CLOEXEC, min_fd + 1));
+  if (new_fd < 0)
     return false;
-  if (HANDLE_EINTR(dup2(fd, STDIN_FILENO)) != STDIN_FILENO)
-    return false;
-  IGNORE_EINTR(close(fd));
-
+  IGNORE_EINTR(close(*fd));
+  *fd = new_fd;
   return true;
 }
 
 // Helper function to launch a process with the given Subprocess::Flags.
 // This function only sets up and starts the process according to the |flags|.
 // The caller is responsible for watching the termination of the subprocess.
-// Return whether the process was successfully launched and fills in the |proc|
-// Process.
+// Returns whether the process was successfully launched and fills in its
+// |pid| and the parent end of the pipes of its stdout and of the
+// |output_pipes| in |pipe_fds|, by their file descriptor in the child.
+//
+// The child is started with vfork(2), which doesn't copy the page tables of
+// the daemon like fork(2) does. Everything the child needs is prepared here,
+// so it only redirects and closes file descriptors before calling execve(2).
 bool LaunchProcess(const vector<string>& cmd,
                    uint32_t flags,
                    const vector<int>& output_pipes,
-                   brillo::Process* proc) {
+                   pid_t* pid,
+                   std::map<int, int>* pipe_fds) {
+  if (cmd.empty())
+    return false;
+  const string program =
+      ProgramPath(cmd[0], (flags & Subprocess::kSearchPath) != 0);
+  vector<char*> argv;
   for (const string& arg : cmd)
-    proc->AddArg(arg);
-  proc->SetSearchPath((flags & Subprocess::kSearchPath) != 0);
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
 
   // Create an environment for the child process with just the required PATHs.
-  std::map<string, string> env;
+  vector<string> env;
   for (const char* key : {"LD_LIBRARY_PATH", "PATH"}) {
     const char* value = getenv(key);
     if (value)
-      env.emplace(key, value);
+      env.push_back(string(key) + "=" + value);
+  }
+  vector<char*> envp;
+  for (const string& key_value : env)
+    envp.push_back(const_cast<char*>(key_value.c_str()));
+  envp.push_back(nullptr);
+
+  // The file descriptors of the child: stdin reads from /dev/null, and stdout
+  // and the |output_pipes| write to a pipe. All the file descriptors opened
+  // here are closed on exec, except in the child where they are redirected.
+  vector<int> child_fds = output_pipes;
+  child_fds.push_back(STDOUT_FILENO);
+  const int max_child_fd = std::max(
+      *std::max_element(child_fds.begin(), child_fds.end()),
+      static_cast<int>(STDERR_FILENO));
+  vector<int> child_ends;
+  std::map<int, int> parent_ends;
+  int dev_null = HANDLE_EINTR(open("/dev/null", O_RDONLY | O_CLOEXEC));
+  bool success = dev_null >= 0 && MoveAbove(max_child_fd, &dev_null);
+  for (size_t i = 0; success && i < child_fds.size(); i++) {
+    int fds[2];
+    success = pipe2(fds, O_CLOEXEC) == 0;
+    if (!success)
+      break;
+    parent_ends[child_fds[i]] = fds[0];
+    child_ends.push_back(fds[1]);
+    success = MoveAbove(max_child_fd, &child_ends.back());
   }
 
-  for (const int fd : output_pipes) {
-    proc->RedirectUsingPipe(fd, false);
+  // Only stdin, stdout, stderr and the |output_pipes| are left open in the
+  // child. The other file descriptors open now are listed to be closed in
+  // the child, since they may not be closed on exec.
+  vector<int> fds_to_close;
+  DIR* fd_dir = opendir("/proc/self/fd");
+  if (fd_dir) {
+    while (struct dirent* entry = readdir(fd_dir)) {
+      int fd;
+      if (!base::StringToInt(entry->d_name, &fd) || fd <= STDERR_FILENO ||
+          std::find(child_fds.begin(), child_fds.end(), fd) !=
+              child_fds.end()) {
+        continue;
+      }
+      fds_to_close.push_back(fd);
+    }
+    closedir(fd_dir);
+  } else {
+    success = false;
+    PLOG(ERROR) << "Unable to list the open file descriptors";
   }
-  proc->SetCloseUnusedFileDescriptors(true);
-  proc->RedirectUsingPipe(STDOUT_FILENO, false);
-  proc->SetPreExecCallback(base::Bind(&SetupChild, env, flags));
 
-  return proc->Start();
+  if (success) {
+    // The signals are blocked until the child runs the command, since its
+    // handlers would run on the memory of the parent.
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    *pid = vfork();
+    if (*pid == 0) {
+      // The child may only make system calls on the prepared data until it
+      // calls execve(2) or _exit(2).
+      for (int sig = 1; sig < NSIG; sig++) {
+        struct sigaction action;
+        if (sigaction(sig, nullptr, &action) == 0 &&
+            action.sa_handler != SIG_IGN && action.sa_handler != SIG_DFL) {
+          action.sa_handler = SIG_DFL;
+          sigaction(sig, &action, nullptr);
+        }
+      }
+      pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+      if (HANDLE_EINTR(dup2(dev_null, STDIN_FILENO)) != STDIN_FILENO)
+        _exit(kErrorExitStatus);
+      for (size_t i = 0; i < child_fds.size(); i++) {
+        if (HANDLE_EINTR(dup2(child_ends[i], child_fds[i])) != child_fds[i])
+          _exit(kErrorExitStatus);
+      }
+      if ((flags & Subprocess::kRedirectStderrToStdout) != 0 &&
+          HANDLE_EINTR(dup2(STDOUT_FILENO, STDERR_FILENO)) != STDERR_FILENO) {
+        _exit(kErrorExitStatus);
+      }
+      for (int fd : fds_to_close)
+        close(fd);
+      execve(program.c_str(), argv.data(), envp.data());
+      _exit(kErrorExitStatus);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+    if (*pid < 0) {
+      PLOG(ERROR) << "Unable to fork";
+      success = false;
+    }
+  }
+
+  if (dev_null >= 0)
+    IGNORE_EINTR(close(dev_null));
+  for (int fd : child_ends)
+    IGNORE_EINTR(close(fd));
+  if (!success) {
+    for (const auto& child_parent_fds : parent_ends)
+      IGNORE_EINTR(close(child_parent_fds.second));
+    return false;
+  }
+  *pipe_fds = std::move(parent_ends);
+  return true;
 }
 
 }  // namespace
@@ -114,6 +235,17 @@ Subprocess::~Subprocess() {
     subprocess_singleton_ = nullptr;
 }
 
+Subprocess::SubprocessRecord::~SubprocessRecord() {
+  // A child still running when the record goes away, for example when the
+  // Subprocess is destroyed, is killed.
+  if (pid > 0 && kill(pid, SIGKILL) != 0)
+    PLOG(WARNING) << "Error sending SIGKILL to " << pid;
+  if (stdout_task_id != MessageLoop::kTaskIdNull && MessageLoop::current())
+    MessageLoop::current()->CancelTask(stdout_task_id);
+  for (const auto& child_parent_fds : pipe_fds)
+    IGNORE_EINTR(close(child_parent_fds.second));
+}
+
 void Subprocess::OnStdoutReady(SubprocessRecord* record) {
   char buf[1024];
   size_t bytes_read;
@@ -159,12 +291,10 @@ void Subprocess::ChildExitedCallback(const siginfo_t& info) {
     record->callback.Run(info.si_status, record->stdout);
   }
   // Release and close all the pipes after calling the callback so our
-  // redirected pipes are still alive. Releasing the process first makes
-  // Reset(0) not attempt to kill the process, which is already a zombie at this
+  // redirected pipes are still alive. Releasing the process first makes the
+  // record not attempt to kill the process, which was already reaped at this
   // point.
-  record->proc.Release();
-  record->proc.Reset(0);
-
+  record->pid = 0;
   subprocess_records_.erase(pid_record);
 }
 
@@ -179,17 +309,18 @@ pid_t Subprocess::ExecFlags(const vector<string>& cmd,
                             const ExecCallback& callback) {
   unique_ptr<SubprocessRecord> record(new SubprocessRecord(callback));
 
-  if (!LaunchProcess(cmd, flags, output_pipes, &record->proc)) {
+  if (!LaunchProcess(
+          cmd, flags, output_pipes, &record->pid, &record->pipe_fds)) {
     LOG(ERROR) << "Failed to launch subprocess";
     return 0;
   }
 
-  pid_t pid = record->proc.pid();
+  pid_t pid = record->pid;
   CHECK(process_reaper_.WatchForChild(FROM_HERE, pid, base::Bind(
       &Subprocess::ChildExitedCallback,
       base::Unretained(this))));
 
-  record->stdout_fd = record->proc.GetPipe(STDOUT_FILENO);
+  record->stdout_fd = record->pipe_fds[STDOUT_FILENO];
   // Capture the subprocess output. Make our end of the pipe non-blocking.
   int fd_flags = fcntl(record->stdout_fd, F_GETFL, 0) | O_NONBLOCK;
   if (HANDLE_EINTR(fcntl(record->stdout_fd, F_SETFL, fd_flags)) < 0) {
@@ -218,14 +349,16 @@ void Subprocess::KillExec(pid_t pid) {
   }
   // Release the pid now so we don't try to kill it if Subprocess is destroyed
   // before the corresponding ChildExitedCallback() is called.
-  pid_record->second->proc.Release();
+  pid_record->second->pid = 0;
 }
 
 int Subprocess::GetPipeFd(pid_t pid, int fd) const {
   auto pid_record = subprocess_records_.find(pid);
   if (pid_record == subprocess_records_.end())
     return -1;
-  return pid_record->second->proc.GetPipe(fd);
+  const std::map<int, int>& pipe_fds = pid_record->second->pipe_fds;
+  auto pipe_fd = pipe_fds.find(fd);
+  return pipe_fd == pipe_fds.end() ? -1 : pipe_fd->second;
 }
 
 bool Subprocess::SynchronousExec(const vector<string>& cmd,
@@ -244,11 +377,12 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
                                       uint32_t flags,
                                       int* return_code,
                                       string* stdout) {
-  brillo::ProcessImpl proc;
   // It doesn't make sense to redirect some pipes in the synchronous case
   // because we won't be reading on our end, so we don't expose the output_pipes
   // in this case.
-  if (!LaunchProcess(cmd, flags, {}, &proc)) {
+  pid_t pid = 0;
+  std::map<int, int> pipe_fds;
+  if (!LaunchProcess(cmd, flags, {}, &pid, &pipe_fds)) {
     LOG(ERROR) << "Failed to launch subprocess";
     return false;
   }
@@ -257,7 +391,8 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
     stdout->clear();
   }
 
-  int fd = proc.GetPipe(STDOUT_FILENO);
+  int fd = pipe_fds[STDOUT_FILENO];
+  ScopedFdCloser fd_closer(&fd);
   vector<char> buffer(32 * 1024);
   while (true) {
     int rc = HANDLE_EINTR(read(fd, buffer.data(), buffer.size()));
@@ -273,10 +408,20 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
   }
   // At this point, the subprocess already closed the output, so we only need to
   // wait for it to finish.
-  int proc_return_code = proc.Wait();
+  int status = 0;
+  if (HANDLE_EINTR(waitpid(pid, &status, 0)) != pid) {
+    PLOG(ERROR) << "Unable to wait for the subprocess " << pid;
+    return false;
+  }
+  int proc_return_code = -1;
+  if (WIFEXITED(status)) {
+    proc_return_code = WEXITSTATUS(status);
+  } else {
+    LOG(ERROR) << "Subprocess " << pid << " terminated with status " << status;
+  }
   if (return_code)
     *return_code = proc_return_code;
-  return proc_return_code != brillo::Process::kErrorExitStatus;
+  return proc_return_code != kErrorExitStatus;
 }
 
 bool Subprocess::SubprocessInFlight() {
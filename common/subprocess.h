@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_COMMON_SUBPROCESS_H_
 #define UPDATE_ENGINE_COMMON_SUBPROCESS_H_
 
+#include <signal.h>
 #include <unistd.h>
 
 #include <map>
@@ -29,7 +30,6 @@
 #include <base/macros.h>
 #include <brillo/asynchronous_signal_handler_interface.h>
 #include <brillo/message_loops/message_loop.h>
-#include <brillo/process.h>
 #include <brillo/process_reaper.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
@@ -111,12 +111,20 @@ class Subprocess {
     explicit SubprocessRecord(const ExecCallback& callback)
       : callback(callback) {}
 
+    // Kills the child process if it wasn't reaped or released yet, and closes
+    // our end of the pipes we have open.
+    ~SubprocessRecord();
+
     // The callback supplied by the caller.
     ExecCallback callback;
 
-    // The ProcessImpl instance managing the child process. Destroying this
-    // will close our end of the pipes we have open.
-    brillo::ProcessImpl proc;
+    // The process id of the child, or 0 once it was reaped or released, in
+    // which case it isn't killed when the record is destroyed.
+    pid_t pid{0};
+
+    // Our end of the pipes redirected in the child process, by their file
+    // descriptor in the child, including the stdout.
+    std::map<int, int> pipe_fds;
 
     // These are used to monitor the stdout of the running process, including
     // the stderr if it was redirected.
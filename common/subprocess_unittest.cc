@@ -206,6 +206,13 @@ TEST_F(SubprocessTest, SynchronousEchoTest) {
   EXPECT_EQ("stdout-herestderr-there", stdout);
 }
 
+TEST_F(SubprocessTest, SynchronousMissingProgramTest) {
+  int rc = -1;
+  EXPECT_FALSE(Subprocess::SynchronousExecFlags(
+      {"no-such-program-in-path"}, Subprocess::kSearchPath, &rc, nullptr));
+  EXPECT_EQ(127, rc);
+}
+
 TEST_F(SubprocessTest, SynchronousEchoNoOutputTest) {
   int rc = -1;
   ASSERT_TRUE(Subprocess::SynchronousExec(
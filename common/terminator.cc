@@ -16,13 +16,26 @@
 
 #include "update_engine/common/terminator.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cstdlib>
 
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+using brillo::MessageLoop;
+
 namespace chromeos_update_engine {
 
 volatile sig_atomic_t Terminator::exit_status_ = 1;  // default exit status
 volatile sig_atomic_t Terminator::exit_blocked_ = 0;
 volatile sig_atomic_t Terminator::exit_requested_ = 0;
+base::Closure* Terminator::exit_callback_ = nullptr;
+volatile sig_atomic_t Terminator::exit_request_fd_ = -1;
+int Terminator::exit_request_read_fd_ = -1;
+MessageLoop::TaskId Terminator::exit_request_task_ = MessageLoop::kTaskIdNull;
 
 void Terminator::Init() {
   exit_blocked_ = 0;
@@ -36,16 +49,80 @@ void Terminator::Init(int exit_status) {
 }
 
 void Terminator::Exit() {
+  if (exit_callback_)
+    exit_callback_->Run();
   exit(exit_status_);
 }
 
+void Terminator::SetExitCallback(const base::Closure& callback) {
+  CloseExitRequestPipe();
+  delete exit_callback_;
+  exit_callback_ = callback.is_null() ? nullptr : new base::Closure(callback);
+  if (!exit_callback_ || !MessageLoop::current())
+    return;
+
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "Unable to create the exit request pipe";
+    return;
+  }
+  exit_request_task_ = MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE,
+      fds[0],
+      MessageLoop::WatchMode::kWatchRead,
+      true,
+      base::Bind(&Terminator::OnExitRequested));
+  if (exit_request_task_ == MessageLoop::kTaskIdNull) {
+    LOG(ERROR) << "Unable to watch the exit request pipe";
+    IGNORE_EINTR(close(fds[0]));
+    IGNORE_EINTR(close(fds[1]));
+    return;
+  }
+  exit_request_read_fd_ = fds[0];
+  exit_request_fd_ = fds[1];
+}
+
 void Terminator::HandleSignal(int signum) {
+  // Only async-signal-safe calls are allowed here, so the exit callback is
+  // run from the message loop instead.
+  const int exit_request_fd = exit_request_fd_;
+  if (exit_request_fd >= 0) {
+    exit_requested_ = 1;
+    const char request = 0;
+    if (write(exit_request_fd, &request, sizeof(request)) < 0) {
+      // The pipe is full when the exit was already requested.
+    }
+    return;
+  }
   if (exit_blocked_ == 0) {
     Exit();
   }
   exit_requested_ = 1;
 }
 
+void Terminator::OnExitRequested() {
+  char requests[16];
+  while (HANDLE_EINTR(read(exit_request_read_fd_, requests,
+                           sizeof(requests))) > 0) {
+  }
+  if (exit_blocked_ == 0)
+    Exit();
+}
+
+void Terminator::CloseExitRequestPipe() {
+  if (exit_request_read_fd_ < 0)
+    return;
+  // The signal handler stops using the pipe before it's closed.
+  const int exit_request_fd = exit_request_fd_;
+  exit_request_fd_ = -1;
+  if (MessageLoop::current())
+    MessageLoop::current()->CancelTask(exit_request_task_);
+  exit_request_task_ = MessageLoop::kTaskIdNull;
+  IGNORE_EINTR(close(exit_request_fd));
+  IGNORE_EINTR(close(exit_request_read_fd_));
+  exit_request_read_fd_ = -1;
+}
+
 ScopedTerminatorExitUnblocker::~ScopedTerminatorExitUnblocker() {
   Terminator::set_exit_blocked(false);
   if (Terminator::exit_requested()) {
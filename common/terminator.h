@@ -19,6 +19,8 @@
 
 #include <signal.h>
 
+#include <base/callback.h>
+#include <brillo/message_loops/message_loop.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 namespace chromeos_update_engine {
@@ -33,6 +35,12 @@ class Terminator {
   // Terminates the current process.
   static void Exit();
 
+  // Sets a callback run by Exit() right before terminating the process, used
+  // to persist the state kept in memory. A null callback clears it. While it's
+  // set, the termination signals only request the exit, which is then done
+  // from the current message loop since the callback isn't async-signal-safe.
+  static void SetExitCallback(const base::Closure& callback);
+
   // Set to true if the terminator should block termination requests in an
   // attempt to block exiting.
   static void set_exit_blocked(bool block) { exit_blocked_ = block ? 1 : 0; }
@@ -50,9 +58,23 @@ class Terminator {
   // The signal handler.
   static void HandleSignal(int signum);
 
+  // Called from the message loop when the signal handler requested the exit
+  // through the |exit_request_fd_|. Exits unless the exit is blocked, in which
+  // case the ScopedTerminatorExitUnblocker exits once it's unblocked.
+  static void OnExitRequested();
+
+  // Closes the pipe used by the signal handler to request the exit.
+  static void CloseExitRequestPipe();
+
   static volatile sig_atomic_t exit_status_;
   static volatile sig_atomic_t exit_blocked_;
   static volatile sig_atomic_t exit_requested_;
+  static base::Closure* exit_callback_;
+  // The ends of the pipe the signal handler writes to while there's an exit
+  // callback, or -1, and the task watching it.
+  static volatile sig_atomic_t exit_request_fd_;
+  static int exit_request_read_fd_;
+  static brillo::MessageLoop::TaskId exit_request_task_;
 };
 
 class ScopedTerminatorExitUnblocker {
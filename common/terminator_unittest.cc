@@ -16,6 +16,9 @@
 
 #include "update_engine/common/terminator.h"
 
+#include <base/bind.h>
+#include <base/message_loop/message_loop.h>
+#include <brillo/message_loops/base_message_loop.h>
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
 
@@ -47,6 +50,22 @@ void UnblockExitThroughUnblocker() {
 void RaiseSIGTERM() {
   ASSERT_EXIT(raise(SIGTERM), ExitedWithCode(2), "");
 }
+
+void PrintExitMessage() {
+  fprintf(stderr, "exit callback called\n");
+}
+
+void RaiseSIGTERMWithExitCallback() {
+  base::MessageLoopForIO base_loop;
+  brillo::BaseMessageLoop loop(&base_loop);
+  loop.SetAsCurrent();
+  Terminator::SetExitCallback(base::Bind(&PrintExitMessage));
+  raise(SIGTERM);
+  // The exit callback runs from the message loop, not from the handler.
+  ASSERT_TRUE(Terminator::exit_requested());
+  fprintf(stderr, "signal handled\n");
+  loop.Run();
+}
 }  // namespace
 
 TEST_F(TerminatorTest, HandleSignalTest) {
@@ -70,6 +89,17 @@ TEST_F(TerminatorDeathTest, ExitTest) {
   ASSERT_EXIT(Terminator::Exit(), ExitedWithCode(2), "");
 }
 
+TEST_F(TerminatorDeathTest, ExitCallbackTest) {
+  Terminator::SetExitCallback(base::Bind(&PrintExitMessage));
+  ASSERT_EXIT(Terminator::Exit(), ExitedWithCode(2), "exit callback called");
+  Terminator::SetExitCallback(base::Closure());
+}
+
+TEST_F(TerminatorDeathTest, RaiseSignalWithExitCallbackTest) {
+  ASSERT_EXIT(RaiseSIGTERMWithExitCallback(), ExitedWithCode(2),
+              "signal handled.*exit callback called");
+}
+
 TEST_F(TerminatorDeathTest, RaiseSignalTest) {
   RaiseSIGTERM();
   Terminator::set_exit_blocked(true);
@@ -0,0 +1,35 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_COMMON_TEST_ALLOC_COUNTER_H_
+#define UPDATE_ENGINE_COMMON_TEST_ALLOC_COUNTER_H_
+
+#include <stdint.h>
+
+// Linking test_alloc_counter.cc into a test or benchmark binary replaces the
+// global operator new and delete of the whole binary with ones counting the
+// allocations. Never link it into the daemon.
+
+namespace chromeos_update_engine {
+
+// Returns the number of operator new calls made by the binary so far, from
+// any thread.
+uint64_t NumAllocations();
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_TEST_ALLOC_COUNTER_H_
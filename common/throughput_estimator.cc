@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The length of the intervals the rate is sampled over.
+const int64_t kSampleIntervalMs = 1000;
+
+// The weight, in percent, of the last sample in the moving average.
+const int64_t kSampleWeightPercent = 20;
+
+}  // namespace
+
+const int ThroughputEstimator::kStallSeconds;
+
+void ThroughputEstimator::TransferStarted(TimeTicks now) {
+  stats_ = TransferStats();
+  started_ = true;
+  received_data_ = false;
+  start_time_ = now;
+  last_data_time_ = now;
+  sample_start_time_ = now;
+  sample_bytes_ = 0;
+}
+
+void ThroughputEstimator::BytesReceived(TimeTicks now, size_t bytes) {
+  if (!started_)
+    TransferStarted(now);
+  if (!received_data_) {
+    received_data_ = true;
+    stats_.time_to_first_byte = now - start_time_;
+    sample_start_time_ = now;
+  } else if (AccountForGap(now)) {
+    // The rate is only sampled while the data flows.
+    sample_start_time_ = now;
+    sample_bytes_ = 0;
+  }
+  last_data_time_ = now;
+  stats_.transfer_time = now - start_time_;
+  stats_.bytes_received += bytes;
+  sample_bytes_ += bytes;
+
+  int64_t sample_ms = (now - sample_start_time_).InMilliseconds();
+  if (sample_ms >= kSampleIntervalMs) {
+    int64_t rate_bps = sample_bytes_ * 1000 / sample_ms;
+    if (stats_.throughput_bps == 0) {
+      stats_.throughput_bps = rate_bps;
+    } else {
+      stats_.throughput_bps =
+          (stats_.throughput_bps * (100 - kSampleWeightPercent) +
+           rate_bps * kSampleWeightPercent) / 100;
+    }
+    sample_start_time_ = now;
+    sample_bytes_ = 0;
+  }
+}
+
+void ThroughputEstimator::TransferEnded(TimeTicks now) {
+  if (!started_)
+    return;
+  // A transfer without any data is slow to start rather than stalled.
+  if (received_data_)
+    AccountForGap(now);
+  last_data_time_ = now;
+  stats_.transfer_time = now - start_time_;
+}
+
+bool ThroughputEstimator::AccountForGap(TimeTicks now) {
+  TimeDelta gap = now - last_data_time_;
+  if (gap < TimeDelta::FromSeconds(kStallSeconds))
+    return false;
+  stats_.num_stalls++;
+  stats_.stall_time += gap;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
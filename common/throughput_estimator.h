@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+#define UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+
+#include <stdint.h>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// The network statistics of a transfer, which may be made of several
+// requests, such as retries or ranges.
+struct TransferStats {
+  // The time from the start of the transfer to its first byte of data.
+  base::TimeDelta time_to_first_byte;
+  // The rate while data was flowing, as a moving average of the rate over
+  // intervals of about a second, leaving out the stalls.
+  int64_t throughput_bps{0};
+  // The number of times no data was received for
+  // ThroughputEstimator::kStallSeconds or more, and the total time spent so.
+  int num_stalls{0};
+  base::TimeDelta stall_time;
+  // The time from the start of the transfer to its last data or end.
+  base::TimeDelta transfer_time;
+  uint64_t bytes_received{0};
+  // The bytes received but not used, for example because the same data was
+  // fetched again from another connection.
+  uint64_t bytes_wasted{0};
+};
+
+// ThroughputEstimator computes the TransferStats of a transfer from the times
+// its data arrives.
+class ThroughputEstimator {
+ public:
+  // The minimum time without data counted as a stall.
+  static const int kStallSeconds = 5;
+
+  ThroughputEstimator() = default;
+
+  // Clears the stats for a new transfer starting at |now|.
+  void TransferStarted(base::TimeTicks now);
+
+  // Accounts for |bytes| received at |now|.
+  void BytesReceived(base::TimeTicks now, size_t bytes);
+
+  // Accounts for |bytes| received but then discarded.
+  void BytesWasted(size_t bytes) { stats_.bytes_wasted += bytes; }
+
+  // Accounts for the time without data until the transfer ended, possibly
+  // temporarily, at |now|.
+  void TransferEnded(base::TimeTicks now);
+
+  const TransferStats& stats() const { return stats_; }
+
+ private:
+  // Counts the time without data since |last_data_time_| as a stall if it
+  // lasted long enough. Returns whether it did.
+  bool AccountForGap(base::TimeTicks now);
+
+  TransferStats stats_;
+
+  bool started_{false};
+  bool received_data_{false};
+  base::TimeTicks start_time_;
+  // The time of the last data, or of the last end of the transfer when it is
+  // more recent, and the start time and bytes of the current rate sample.
+  base::TimeTicks last_data_time_;
+  base::TimeTicks sample_start_time_;
+  uint64_t sample_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ThroughputEstimator);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
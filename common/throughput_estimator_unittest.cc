@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+class ThroughputEstimatorTest : public ::testing::Test {
+ protected:
+  // Returns the time |ms| milliseconds after the start of the test.
+  TimeTicks At(int64_t ms) {
+    return start_ + TimeDelta::FromMilliseconds(ms);
+  }
+
+  const TimeTicks start_ = TimeTicks::FromInternalValue(1000000);
+  ThroughputEstimator estimator_;
+};
+
+TEST_F(ThroughputEstimatorTest, ThroughputTest) {
+  estimator_.TransferStarted(At(0));
+  // 100 KB every 100 ms, i.e. 1 MB/s, after 300 ms.
+  for (int i = 0; i <= 20; i++)
+    estimator_.BytesReceived(At(300 + i * 100), 100000);
+
+  const TransferStats& stats = estimator_.stats();
+  EXPECT_EQ(TimeDelta::FromMilliseconds(300), stats.time_to_first_byte);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(2300), stats.transfer_time);
+  EXPECT_EQ(2100000U, stats.bytes_received);
+  // The first sample also has the first 100 KB, so it reads 1.1 MB/s, and
+  // the second one only moves the average by 20% towards 1 MB/s.
+  EXPECT_EQ(1080000, stats.throughput_bps);
+  EXPECT_EQ(0, stats.num_stalls);
+}
+
+TEST_F(ThroughputEstimatorTest, StallTest) {
+  estimator_.TransferStarted(At(0));
+  estimator_.BytesReceived(At(0), 1000);
+  estimator_.BytesReceived(At(1000), 1000);
+  // Gaps shorter than kStallSeconds aren't stalls.
+  estimator_.BytesReceived(At(4000), 1000);
+  EXPECT_EQ(0, estimator_.stats().num_stalls);
+
+  estimator_.BytesReceived(At(10000), 1000);
+  EXPECT_EQ(1, estimator_.stats().num_stalls);
+  EXPECT_EQ(TimeDelta::FromSeconds(6), estimator_.stats().stall_time);
+
+  // A stall at the end of the transfer counts as well, but only once.
+  estimator_.TransferEnded(At(20000));
+  estimator_.TransferEnded(At(21000));
+  EXPECT_EQ(2, estimator_.stats().num_stalls);
+  EXPECT_EQ(TimeDelta::FromSeconds(16), estimator_.stats().stall_time);
+  EXPECT_EQ(TimeDelta::FromSeconds(21), estimator_.stats().transfer_time);
+}
+
+TEST_F(ThroughputEstimatorTest, TransferStartedResetsTest) {
+  estimator_.TransferStarted(At(0));
+  estimator_.BytesReceived(At(100), 1000);
+  estimator_.BytesWasted(500);
+  EXPECT_EQ(500U, estimator_.stats().bytes_wasted);
+
+  estimator_.TransferStarted(At(1000));
+  EXPECT_EQ(0U, estimator_.stats().bytes_received);
+  EXPECT_EQ(0U, estimator_.stats().bytes_wasted);
+  // Waiting for the first byte isn't a stall.
+  estimator_.TransferEnded(At(20000));
+  EXPECT_EQ(0, estimator_.stats().num_stalls);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/trace_log.h"
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <base/values.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the "ph" field of the Trace Event Format for the |phase|.
+const char* PhaseToString(TraceLog::Phase phase) {
+  switch (phase) {
+    case TraceLog::Phase::kBegin:
+      return "B";
+    case TraceLog::Phase::kEnd:
+      return "E";
+    case TraceLog::Phase::kAsyncBegin:
+      return "b";
+    case TraceLog::Phase::kAsyncEnd:
+      return "e";
+    case TraceLog::Phase::kCounter:
+      return "C";
+  }
+  return "?";
+}
+
+void AddEventToCurrent(TraceLog::Phase phase,
+                       const char* category,
+                       const string& name,
+                       uint64_t id,
+                       int64_t value) {
+  TraceLog* trace_log = TraceLog::current();
+  if (trace_log)
+    trace_log->AddEvent(phase, category, name, id, value);
+}
+
+}  // namespace
+
+// static
+TraceLog* TraceLog::current_trace_log_ = nullptr;
+
+TraceLog::TraceLog(size_t capacity) : capacity_(capacity) {
+  CHECK_GT(capacity_, 0U);
+  events_.reserve(capacity_);
+}
+
+TraceLog::~TraceLog() {
+  if (current_trace_log_ == this)
+    current_trace_log_ = nullptr;
+}
+
+void TraceLog::Init() {
+  CHECK(current_trace_log_ == nullptr);
+  current_trace_log_ = this;
+}
+
+void TraceLog::AddEvent(Phase phase,
+                        const char* category,
+                        const string& name,
+                        uint64_t id,
+                        int64_t value) {
+  Event event{phase,
+              category,
+              name,
+              id,
+              value,
+              base::TimeTicks::Now(),
+              base::PlatformThread::CurrentId()};
+  base::AutoLock auto_lock(lock_);
+  if (events_.size() < capacity_) {
+    events_.push_back(std::move(event));
+  } else {
+    events_[next_event_] = std::move(event);
+    next_event_ = (next_event_ + 1) % capacity_;
+  }
+}
+
+size_t TraceLog::size() const {
+  base::AutoLock auto_lock(lock_);
+  return events_.size();
+}
+
+string TraceLog::ToJson() const {
+  const int pid = getpid();
+  std::unique_ptr<base::ListValue> events_value(new base::ListValue());
+
+  base::AutoLock auto_lock(lock_);
+  for (size_t i = 0; i < events_.size(); i++) {
+    const Event& event = events_[(next_event_ + i) % events_.size()];
+    std::unique_ptr<base::DictionaryValue> value(new base::DictionaryValue());
+    value->SetString("ph", PhaseToString(event.phase));
+    value->SetString("cat", event.category);
+    value->SetString("name", event.name);
+    value->SetDouble("ts", static_cast<double>(
+        (event.time - base::TimeTicks()).InMicroseconds()));
+    value->SetInteger("pid", pid);
+    value->SetInteger("tid", static_cast<int>(event.thread_id));
+    if (event.phase == Phase::kAsyncBegin || event.phase == Phase::kAsyncEnd) {
+      // The ids are strings as they don't fit in the doubles of JSON.
+      value->SetString("id", base::StringPrintf("0x%" PRIx64, event.id));
+    } else if (event.phase == Phase::kCounter) {
+      std::unique_ptr<base::DictionaryValue> args(new base::DictionaryValue());
+      args->SetDouble("value", static_cast<double>(event.value));
+      value->Set("args", args.release());  // Adopts |args|.
+    }
+    events_value->Append(value.release());
+  }
+
+  base::DictionaryValue value;
+  value.Set("traceEvents", events_value.release());  // Adopts |events_value|.
+  value.SetString("displayTimeUnit", "ms");
+  string json_str;
+  base::JSONWriter::Write(value, &json_str);
+  return json_str;
+}
+
+void TraceBegin(const char* category, const string& name) {
+  AddEventToCurrent(TraceLog::Phase::kBegin, category, name, 0, 0);
+}
+
+void TraceEnd(const char* category, const string& name) {
+  AddEventToCurrent(TraceLog::Phase::kEnd, category, name, 0, 0);
+}
+
+void TraceAsyncBegin(const char* category, const string& name,
+                     const void* id) {
+  AddEventToCurrent(TraceLog::Phase::kAsyncBegin, category, name,
+                    reinterpret_cast<uintptr_t>(id), 0);
+}
+
+void TraceAsyncEnd(const char* category, const string& name, const void* id) {
+  AddEventToCurrent(TraceLog::Phase::kAsyncEnd, category, name,
+                    reinterpret_cast<uintptr_t>(id), 0);
+}
+
+void TraceCounter(const char* category, const string& name, int64_t value) {
+  AddEventToCurrent(TraceLog::Phase::kCounter, category, name, 0, value);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TRACE_LOG_H_
+#define UPDATE_ENGINE_COMMON_TRACE_LOG_H_
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/platform_thread.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// A timeline of the events of an update, such as the start and end of each
+// action or payload operation, kept in a ring buffer of the most recent events
+// and exported in the Trace Event Format read by chrome://tracing. It is
+// thread-safe.
+class TraceLog {
+ public:
+  enum class Phase {
+    // The begin and end of a slice in the current thread. The slices of a
+    // thread must nest.
+    kBegin,
+    kEnd,
+    // The begin and end of a slice identified by an id, which can overlap with
+    // other slices, like the actions running in parallel.
+    kAsyncBegin,
+    kAsyncEnd,
+    // The value of a counter.
+    kCounter,
+  };
+
+  // Keeps up to |capacity| events, dropping the oldest ones.
+  explicit TraceLog(size_t capacity);
+  ~TraceLog();
+
+  // Makes this instance the one returned by current(), where the Trace*()
+  // functions record the events. Only one instance can be initialized at a
+  // time.
+  void Init();
+
+  // Returns the initialized TraceLog, or nullptr if none.
+  static TraceLog* current() { return current_trace_log_; }
+
+  // Records an event of the |phase| named |name| in the |category|, which must
+  // be a string literal. The |id| is only used by the async phases and the
+  // |value| by the counters.
+  void AddEvent(Phase phase,
+                const char* category,
+                const std::string& name,
+                uint64_t id,
+                int64_t value);
+
+  // Returns the number of events recorded in the buffer.
+  size_t size() const;
+
+  // Returns the recorded events in the Trace Event Format, oldest first.
+  std::string ToJson() const;
+
+ private:
+  struct Event {
+    Phase phase;
+    const char* category;
+    std::string name;
+    uint64_t id;
+    int64_t value;
+    base::TimeTicks time;
+    base::PlatformThreadId thread_id;
+  };
+
+  // The current TraceLog instance, if any.
+  static TraceLog* current_trace_log_;
+
+  const size_t capacity_;
+
+  mutable base::Lock lock_;
+  // The ring buffer of events, where the oldest one is at |next_event_| once
+  // the buffer is full, protected by |lock_|.
+  std::vector<Event> events_;
+  size_t next_event_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(TraceLog);
+};
+
+// Helpers recording an event in the current TraceLog, if any.
+void TraceBegin(const char* category, const std::string& name);
+void TraceEnd(const char* category, const std::string& name);
+void TraceAsyncBegin(const char* category, const std::string& name,
+                     const void* id);
+void TraceAsyncEnd(const char* category, const std::string& name,
+                   const void* id);
+void TraceCounter(const char* category, const std::string& name,
+                  int64_t value);
+
+// Records a slice in the current TraceLog, if any, from its construction to
+// its destruction.
+class ScopedTrace {
+ public:
+  ScopedTrace(const char* category, const std::string& name)
+      : category_(category), name_(name) {
+    TraceBegin(category_, name_);
+  }
+  ~ScopedTrace() { TraceEnd(category_, name_); }
+
+ private:
+  const char* const category_;
+  const std::string name_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTrace);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_TRACE_LOG_H_
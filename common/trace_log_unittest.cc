@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/trace_log.h"
+
+#include <memory>
+#include <string>
+
+#include <base/json/json_reader.h>
+#include <base/values.h>
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class TraceLogTest : public ::testing::Test {
+ protected:
+  // Parses the events of the |trace_log_| into |events_|.
+  void ParseEvents() {
+    std::unique_ptr<base::Value> value =
+        base::JSONReader::Read(trace_log_.ToJson());
+    ASSERT_NE(nullptr, value.get());
+    base::DictionaryValue* dict;
+    ASSERT_TRUE(value->GetAsDictionary(&dict));
+    base::ListValue* events;
+    ASSERT_TRUE(dict->GetList("traceEvents", &events));
+    events_.reset(events->DeepCopy());
+  }
+
+  // Returns the field |key| of the event |index| of |events_|.
+  string EventField(size_t index, const string& key) {
+    const base::DictionaryValue* event;
+    string field;
+    if (events_->GetDictionary(index, &event))
+      event->GetString(key, &field);
+    return field;
+  }
+
+  TraceLog trace_log_{3};
+  std::unique_ptr<base::ListValue> events_;
+};
+
+TEST_F(TraceLogTest, NoCurrentTraceLogTest) {
+  EXPECT_EQ(nullptr, TraceLog::current());
+  // Events outside of a traced process are ignored.
+  { ScopedTrace trace("test", "slice"); }
+  TraceCounter("test", "counter", 1);
+  EXPECT_EQ(0U, trace_log_.size());
+}
+
+TEST_F(TraceLogTest, EventsTest) {
+  trace_log_.Init();
+  EXPECT_EQ(&trace_log_, TraceLog::current());
+  { ScopedTrace trace("test", "slice"); }
+  TraceCounter("test", "counter", 42);
+
+  ParseEvents();
+  ASSERT_EQ(3U, events_->GetSize());
+  EXPECT_EQ("B", EventField(0, "ph"));
+  EXPECT_EQ("test", EventField(0, "cat"));
+  EXPECT_EQ("slice", EventField(0, "name"));
+  EXPECT_EQ("E", EventField(1, "ph"));
+  EXPECT_EQ("C", EventField(2, "ph"));
+  double value;
+  const base::DictionaryValue* event;
+  ASSERT_TRUE(events_->GetDictionary(2, &event));
+  EXPECT_TRUE(event->GetDouble("args.value", &value));
+  EXPECT_EQ(42, value);
+}
+
+TEST_F(TraceLogTest, AsyncEventsTest) {
+  trace_log_.Init();
+  int action;
+  TraceAsyncBegin("action", "Action", &action);
+  TraceAsyncEnd("action", "Action", &action);
+
+  ParseEvents();
+  ASSERT_EQ(2U, events_->GetSize());
+  EXPECT_EQ("b", EventField(0, "ph"));
+  EXPECT_EQ("e", EventField(1, "ph"));
+  EXPECT_FALSE(EventField(0, "id").empty());
+  EXPECT_EQ(EventField(0, "id"), EventField(1, "id"));
+}
+
+TEST_F(TraceLogTest, RingBufferTest) {
+  trace_log_.Init();
+  for (const char* name : {"a", "b", "c", "d", "e"})
+    TraceCounter("test", name, 0);
+
+  // Only the last three events are kept, the oldest first.
+  EXPECT_EQ(3U, trace_log_.size());
+  ParseEvents();
+  ASSERT_EQ(3U, events_->GetSize());
+  EXPECT_EQ("c", EventField(0, "name"));
+  EXPECT_EQ("d", EventField(1, "name"));
+  EXPECT_EQ("e", EventField(2, "name"));
+}
+
+}  // namespace chromeos_update_engine
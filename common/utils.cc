@@ -1194,29 +1194,69 @@ bool IsZlibCompatible(const string& fingerprint) {
   return false;
 }
 
+bool IsZeroFilled(const uint8_t* data, size_t size) {
+  // Once the first bytes are zero, comparing the buffer with itself shifted by
+  // them checks the rest with the vectorized memcmp() of the C library.
+  const size_t kPrefixSize = 16;
+  const size_t prefix_size = std::min(size, kPrefixSize);
+  for (size_t i = 0; i < prefix_size; i++) {
+    if (data[i] != 0)
+      return false;
+  }
+  return size <= kPrefixSize ||
+         memcmp(data, data + kPrefixSize, size - kPrefixSize) == 0;
+}
+
 bool ReadExtents(const string& path, const vector<Extent>& extents,
                  brillo::Blob* out_data, ssize_t out_data_size,
                  size_t block_size) {
-  brillo::Blob data(out_data_size);
-  ssize_t bytes_read = 0;
+  uint64_t num_blocks = 0;
+  for (const Extent& extent : extents)
+    num_blocks += extent.num_blocks();
+  TEST_AND_RETURN_FALSE(num_blocks * block_size ==
+                        static_cast<uint64_t>(out_data_size));
+
+  // The extents contiguous in the file are read together, and the kernel is
+  // told up front about all of them, so it reads the later ones ahead while
+  // the first are copied.
+  vector<Extent> runs;
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    if (!runs.empty() &&
+        runs.back().start_block() + runs.back().num_blocks() ==
+            extent.start_block()) {
+      runs.back().set_num_blocks(runs.back().num_blocks() +
+                                 extent.num_blocks());
+    } else {
+      runs.push_back(extent);
+    }
+  }
+
   int fd = open(path.c_str(), O_RDONLY);
   TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
   ScopedFdCloser fd_closer(&fd);
+  if (runs.size() > 1) {
+    for (const Extent& run : runs) {
+      posix_fadvise(fd, run.start_block() * block_size,
+                    run.num_blocks() * block_size, POSIX_FADV_WILLNEED);
+    }
+  }
 
-  for (const Extent& extent : extents) {
+  out_data->resize(out_data_size);
+  ssize_t bytes_read = 0;
+  for (const Extent& run : runs) {
     ssize_t bytes_read_this_iteration = 0;
-    ssize_t bytes = extent.num_blocks() * block_size;
-    TEST_AND_RETURN_FALSE(bytes_read + bytes <= out_data_size);
+    ssize_t bytes = run.num_blocks() * block_size;
     TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &data[bytes_read],
+                                          out_data->data() + bytes_read,
                                           bytes,
-                                          extent.start_block() * block_size,
+                                          run.start_block() * block_size,
                                           &bytes_read_this_iteration));
     TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
     bytes_read += bytes_read_this_iteration;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
-  *out_data = data;
   return true;
 }
 
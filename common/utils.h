@@ -355,10 +355,14 @@ bool GetMinorVersion(const brillo::KeyValueStore& store,
 // Returns whether zlib |fingerprint| is compatible with zlib we are using.
 bool IsZlibCompatible(const std::string& fingerprint);
 
+// Returns whether the |size| bytes at |data| are all zero.
+bool IsZeroFilled(const uint8_t* data, size_t size);
+
 // This function reads the specified data in |extents| into |out_data|. The
 // extents are read from the file at |path|. |out_data_size| is the size of
 // |out_data|. Returns false if the number of bytes to read given in
-// |extents| does not equal |out_data_size|.
+// |extents| does not equal |out_data_size|. The extents contiguous in the file
+// are read with a single pread().
 bool ReadExtents(const std::string& path, const std::vector<Extent>& extents,
                  brillo::Blob* out_data, ssize_t out_data_size,
                  size_t block_size);
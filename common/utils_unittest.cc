@@ -86,6 +86,60 @@ TEST(UtilsTest, ReadFileChunk) {
               in_data);
 }
 
+TEST(UtilsTest, ReadExtentsTest) {
+  base::FilePath file;
+  EXPECT_TRUE(base::CreateTemporaryFile(&file));
+  ScopedPathUnlinker unlinker(file.value());
+  brillo::Blob data;
+  const size_t kBlockSize = 16;
+  for (size_t i = 0; i < 10 * kBlockSize; i++) {
+    data.push_back(i % 255);
+  }
+  EXPECT_TRUE(utils::WriteFile(file.value().c_str(), data.data(), data.size()));
+
+  // The blocks 2 and 3 are contiguous, then 7, then 0.
+  vector<Extent> extents(4);
+  extents[0].set_start_block(2);
+  extents[0].set_num_blocks(1);
+  extents[1].set_start_block(3);
+  extents[1].set_num_blocks(1);
+  extents[2].set_start_block(7);
+  extents[2].set_num_blocks(1);
+  extents[3].set_start_block(0);
+  extents[3].set_num_blocks(1);
+  brillo::Blob expected(data.begin() + 2 * kBlockSize,
+                        data.begin() + 4 * kBlockSize);
+  expected.insert(expected.end(), data.begin() + 7 * kBlockSize,
+                  data.begin() + 8 * kBlockSize);
+  expected.insert(expected.end(), data.begin(), data.begin() + kBlockSize);
+
+  brillo::Blob in_data;
+  EXPECT_TRUE(utils::ReadExtents(file.value(), extents, &in_data,
+                                 4 * kBlockSize, kBlockSize));
+  EXPECT_EQ(expected, in_data);
+
+  // The size must match the extents, and they must be in the file.
+  EXPECT_FALSE(utils::ReadExtents(file.value(), extents, &in_data,
+                                  3 * kBlockSize, kBlockSize));
+  extents[2].set_start_block(10);
+  EXPECT_FALSE(utils::ReadExtents(file.value(), extents, &in_data,
+                                  4 * kBlockSize, kBlockSize));
+}
+
+TEST(UtilsTest, IsZeroFilledTest) {
+  EXPECT_TRUE(utils::IsZeroFilled(nullptr, 0));
+  for (size_t size : {1, 15, 16, 17, 4096}) {
+    brillo::Blob data(size, 0);
+    EXPECT_TRUE(utils::IsZeroFilled(data.data(), data.size()));
+    for (size_t pos : {static_cast<size_t>(0), size / 2, size - 1}) {
+      data[pos] = 1;
+      EXPECT_FALSE(utils::IsZeroFilled(data.data(), data.size()))
+          << "size " << size << " pos " << pos;
+      data[pos] = 0;
+    }
+  }
+}
+
 TEST(UtilsTest, ErrnoNumberAsStringTest) {
   EXPECT_EQ("No such file or directory", utils::ErrnoNumberAsString(ENOENT));
 }
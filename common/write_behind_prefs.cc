@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/common/write_behind_prefs.h"
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/logging.h>
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+void WriteBehindPrefs::AddDeferredKeyPrefix(const string& prefix) {
+  cache_storage_.AddDeferredKeyPrefix(prefix);
+}
+
+bool WriteBehindPrefs::Flush() {
+  return cache_storage_.Flush();
+}
+
+WriteBehindPrefs::CacheStorage::CacheStorage(
+    std::unique_ptr<PrefsBase> backend, base::TimeDelta flush_interval)
+    : backend_(std::move(backend)), flush_interval_(flush_interval) {}
+
+WriteBehindPrefs::CacheStorage::~CacheStorage() {
+  Flush();
+}
+
+void WriteBehindPrefs::CacheStorage::AddDeferredKeyPrefix(
+    const string& prefix) {
+  deferred_prefixes_.push_back(prefix);
+}
+
+bool WriteBehindPrefs::CacheStorage::Flush() {
+  if (flush_task_ != MessageLoop::kTaskIdNull && MessageLoop::current()) {
+    MessageLoop::current()->CancelTask(flush_task_);
+    flush_task_ = MessageLoop::kTaskIdNull;
+  }
+  if (dirty_count_ == 0)
+    return true;
+
+  bool success = true;
+  backend_->BeginTransaction();
+  for (auto& key_entry : entries_) {
+    Entry& entry = key_entry.second;
+    if (!entry.dirty)
+      continue;
+    if (entry.exists)
+      success = backend_->SetString(key_entry.first, entry.value) && success;
+    else
+      success = backend_->Delete(key_entry.first) && success;
+    entry.dirty = false;
+  }
+  success = backend_->CommitTransaction() && success;
+  dirty_count_ = 0;
+  return success;
+}
+
+bool WriteBehindPrefs::CacheStorage::GetKey(const string& key,
+                                            string* value) const {
+  const Entry& entry = GetEntry(key);
+  if (!entry.exists)
+    return false;
+  *value = entry.value;
+  return true;
+}
+
+bool WriteBehindPrefs::CacheStorage::SetKey(const string& key,
+                                            const string& value) {
+  return Update(key, Entry{true, value, false});
+}
+
+bool WriteBehindPrefs::CacheStorage::KeyExists(const string& key) const {
+  return GetEntry(key).exists;
+}
+
+bool WriteBehindPrefs::CacheStorage::DeleteKey(const string& key) {
+  return Update(key, Entry{false, string(), false});
+}
+
+void WriteBehindPrefs::CacheStorage::BeginTransaction() {
+  backend_->BeginTransaction();
+}
+
+bool WriteBehindPrefs::CacheStorage::CommitTransaction() {
+  return backend_->CommitTransaction();
+}
+
+const WriteBehindPrefs::CacheStorage::Entry&
+WriteBehindPrefs::CacheStorage::GetEntry(const string& key) const {
+  auto it = entries_.find(key);
+  if (it != entries_.end())
+    return it->second;
+  Entry& entry = entries_[key];
+  entry.dirty = false;
+  entry.exists = backend_->GetString(key, &entry.value);
+  return entry;
+}
+
+bool WriteBehindPrefs::CacheStorage::IsDeferred(const string& key) const {
+  for (const string& prefix : deferred_prefixes_) {
+    if (key.compare(0, prefix.size(), prefix) == 0)
+      return true;
+  }
+  return false;
+}
+
+bool WriteBehindPrefs::CacheStorage::Update(const string& key,
+                                            const Entry& entry) {
+  Entry& cached = entries_[key];
+  bool was_dirty = cached.dirty;
+  cached = entry;
+  if (IsDeferred(key)) {
+    cached.dirty = true;
+    if (!was_dirty)
+      dirty_count_++;
+    if (flush_task_ == MessageLoop::kTaskIdNull && MessageLoop::current()) {
+      flush_task_ = MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&CacheStorage::OnFlushTimeout, base::Unretained(this)),
+          flush_interval_);
+    }
+    return true;
+  }
+
+  // Persist the deferred changes along with this one, so a crash never loses
+  // them while keeping a later change.
+  if (was_dirty)
+    dirty_count_--;
+  backend_->BeginTransaction();
+  bool success = Flush();
+  if (entry.exists)
+    success = backend_->SetString(key, entry.value) && success;
+  else
+    success = backend_->Delete(key) && success;
+  return backend_->CommitTransaction() && success;
+}
+
+void WriteBehindPrefs::CacheStorage::OnFlushTimeout() {
+  flush_task_ = MessageLoop::kTaskIdNull;
+  Flush();
+}
+
+}  // namespace chromeos_update_engine
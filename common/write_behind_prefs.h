@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_COMMON_WRITE_BEHIND_PREFS_H_
+#define UPDATE_ENGINE_COMMON_WRITE_BEHIND_PREFS_H_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
+#include "update_engine/common/prefs.h"
+
+namespace chromeos_update_engine {
+
+// Implements a preference store caching the values of another one in memory.
+// Writes to the keys registered with AddDeferredKeyPrefix() are only kept in
+// memory and written to the backend store when Flush() is called, after the
+// flush interval elapses, when this object is destroyed or when any other key
+// is written. Writes to other keys are thus durability barriers: every change
+// done before them is persisted first, in a single transaction. The cache
+// assumes it is the only user of the backend store.
+
+class WriteBehindPrefs : public PrefsBase {
+ public:
+  WriteBehindPrefs(std::unique_ptr<PrefsBase> backend,
+                   base::TimeDelta flush_interval)
+      : PrefsBase(&cache_storage_),
+        cache_storage_(std::move(backend), flush_interval) {}
+
+  // Defers the writes to the keys starting with |prefix|.
+  void AddDeferredKeyPrefix(const std::string& prefix);
+
+  // Writes all the deferred changes to the backend store. Returns whether the
+  // write succeeded.
+  bool Flush();
+
+ private:
+  class CacheStorage : public PrefsBase::StorageInterface {
+   public:
+    CacheStorage(std::unique_ptr<PrefsBase> backend,
+                 base::TimeDelta flush_interval);
+    ~CacheStorage() override;
+
+    void AddDeferredKeyPrefix(const std::string& prefix);
+    bool Flush();
+
+    // PrefsBase::StorageInterface overrides.
+    bool GetKey(const std::string& key, std::string* value) const override;
+    bool SetKey(const std::string& key, const std::string& value) override;
+    bool KeyExists(const std::string& key) const override;
+    bool DeleteKey(const std::string& key) override;
+    void BeginTransaction() override;
+    bool CommitTransaction() override;
+
+   private:
+    // The cached state of a key.
+    struct Entry {
+      bool exists;
+      std::string value;
+      // Whether the change wasn't written to the backend yet.
+      bool dirty;
+    };
+
+    // Returns the cache entry for |key|, reading it from the backend if
+    // needed.
+    const Entry& GetEntry(const std::string& key) const;
+
+    // Returns whether the writes to |key| are deferred.
+    bool IsDeferred(const std::string& key) const;
+
+    // Records a change to |key| and either defers it or writes it along with
+    // the other deferred changes.
+    bool Update(const std::string& key, const Entry& entry);
+
+    // Called when the flush interval elapsed after a deferred write.
+    void OnFlushTimeout();
+
+    std::unique_ptr<PrefsBase> backend_;
+    base::TimeDelta flush_interval_;
+    std::vector<std::string> deferred_prefixes_;
+
+    // The cached keys, including the missing ones that were looked up.
+    mutable std::map<std::string, Entry> entries_;
+
+    // Number of deferred changes in |entries_|.
+    size_t dirty_count_{0};
+
+    // The task flushing the deferred changes, if any.
+    brillo::MessageLoop::TaskId flush_task_{brillo::MessageLoop::kTaskIdNull};
+
+    DISALLOW_COPY_AND_ASSIGN(CacheStorage);
+  };
+
+  // The concrete cache storage implementation.
+  CacheStorage cache_storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(WriteBehindPrefs);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_WRITE_BEHIND_PREFS_H_
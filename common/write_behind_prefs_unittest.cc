@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/common/write_behind_prefs.h"
+
+#include <string>
+
+#include <base/test/simple_test_clock.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using std::string;
+
+namespace {
+
+const char kDeferredKey[] = "current-bytes-downloaded-from-HttpsServer";
+const char kKey[] = "update-state-next-operation";
+
+}  // namespace
+
+namespace chromeos_update_engine {
+
+class MockBackendObserver : public PrefsInterface::ObserverInterface {
+ public:
+  MOCK_METHOD1(OnPrefSet, void(const string&));
+  MOCK_METHOD1(OnPrefDeleted, void(const string& key));
+};
+
+class WriteBehindPrefsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    prefs_.reset(new WriteBehindPrefs(std::unique_ptr<PrefsBase>(backend_),
+                                      TimeDelta::FromMinutes(1)));
+    prefs_->AddDeferredKeyPrefix("current-bytes-downloaded");
+  }
+
+  void TearDown() override {
+    prefs_.reset();
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  base::SimpleTestClock test_clock_;
+  brillo::FakeMessageLoop loop_{&test_clock_};
+  // Owned by |prefs_|.
+  MemoryPrefs* backend_{new MemoryPrefs()};
+  std::unique_ptr<WriteBehindPrefs> prefs_;
+};
+
+TEST_F(WriteBehindPrefsTest, ReadsThroughBackend) {
+  EXPECT_TRUE(backend_->SetInt64(kDeferredKey, 5));
+  int64_t value;
+  EXPECT_TRUE(prefs_->GetInt64(kDeferredKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_FALSE(prefs_->Exists(kKey));
+}
+
+TEST_F(WriteBehindPrefsTest, DefersWritesUntilFlush) {
+  EXPECT_TRUE(prefs_->SetInt64(kDeferredKey, 5));
+  int64_t value;
+  EXPECT_TRUE(prefs_->GetInt64(kDeferredKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_FALSE(backend_->Exists(kDeferredKey));
+
+  EXPECT_TRUE(prefs_->Flush());
+  EXPECT_TRUE(backend_->GetInt64(kDeferredKey, &value));
+  EXPECT_EQ(5, value);
+  // Flushing canceled the timeout.
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(WriteBehindPrefsTest, OtherKeysAreBarriers) {
+  EXPECT_TRUE(prefs_->SetInt64(kDeferredKey, 5));
+  EXPECT_TRUE(prefs_->SetInt64(kKey, 7));
+  EXPECT_TRUE(backend_->Exists(kDeferredKey));
+  EXPECT_TRUE(backend_->Exists(kKey));
+
+  EXPECT_TRUE(prefs_->Delete(kDeferredKey));
+  EXPECT_TRUE(backend_->Exists(kDeferredKey));
+  EXPECT_TRUE(prefs_->Delete(kKey));
+  EXPECT_FALSE(backend_->Exists(kDeferredKey));
+  EXPECT_FALSE(backend_->Exists(kKey));
+}
+
+TEST_F(WriteBehindPrefsTest, FlushesAfterInterval) {
+  EXPECT_TRUE(prefs_->SetInt64(kDeferredKey, 5));
+  EXPECT_TRUE(prefs_->SetInt64(kDeferredKey, 6));
+  test_clock_.Advance(TimeDelta::FromSeconds(59));
+  loop_.RunOnce(false);
+  EXPECT_FALSE(backend_->Exists(kDeferredKey));
+
+  test_clock_.Advance(TimeDelta::FromSeconds(1));
+  loop_.RunOnce(false);
+  int64_t value;
+  EXPECT_TRUE(backend_->GetInt64(kDeferredKey, &value));
+  EXPECT_EQ(6, value);
+}
+
+TEST_F(WriteBehindPrefsTest, FlushesOnDestruction) {
+  MockBackendObserver observer;
+  backend_->AddObserver(kDeferredKey, &observer);
+  EXPECT_CALL(observer, OnPrefSet(kDeferredKey)).Times(0);
+  EXPECT_TRUE(prefs_->SetInt64(kDeferredKey, 5));
+  testing::Mock::VerifyAndClearExpectations(&observer);
+
+  EXPECT_CALL(observer, OnPrefSet(kDeferredKey));
+  prefs_.reset();
+}
+
+}  // namespace chromeos_update_engine
@@ -36,6 +36,7 @@
 #include "update_engine/p2p_manager.h"
 #include "update_engine/update_attempter.h"
 #include "update_engine/payload_state_interface.h"
+#include "update_engine/update_manager/update_manager.h"
 
 using base::StringPrintf;
 using brillo::ErrorPtr;
@@ -131,6 +132,23 @@ bool UpdateEngineService::GetStatus(ErrorPtr* error,
   return true;
 }
 
+bool UpdateEngineService::GetDownloadRate(ErrorPtr* error,
+                                          int64_t* out_current_rate_bps,
+                                          int64_t* out_target_rate_bps) {
+  if (!system_state_->update_attempter()->GetDownloadRate(
+          out_current_rate_bps, out_target_rate_bps)) {
+    LogAndSetError(error, FROM_HERE, "GetDownloadRate failed.");
+    return false;
+  }
+  return true;
+}
+
+bool UpdateEngineService::SetFastMode(ErrorPtr* /* error */,
+                                      bool in_fast_mode) {
+  system_state_->update_attempter()->SetFastMode(in_fast_mode);
+  return true;
+}
+
 bool UpdateEngineService::RebootIfNeeded(ErrorPtr* error) {
   if (!system_state_->update_attempter()->RebootIfNeeded()) {
     // TODO(dgarrett): Give a more specific error code/reason.
@@ -325,4 +343,10 @@ bool UpdateEngineService::GetLastAttemptError(ErrorPtr* /* error */,
   *out_last_attempt_error = static_cast<int>(error_code);
   return true;
 }
+
+bool UpdateEngineService::GetPolicyStats(ErrorPtr* /* error */,
+                                         string* out_stats_json) {
+  *out_stats_json = system_state_->update_manager()->policy_stats()->ToJson();
+  return true;
+}
 }  // namespace chromeos_update_engine
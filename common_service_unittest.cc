@@ -117,6 +117,16 @@ TEST_F(UpdateEngineServiceTest, GetChannel) {
   EXPECT_EQ("target", channel);
 }
 
+TEST_F(UpdateEngineServiceTest, SetFastMode) {
+  EXPECT_CALL(*mock_update_attempter_, SetFastMode(true));
+  EXPECT_TRUE(common_service_.SetFastMode(&error_, true));
+  EXPECT_EQ(nullptr, error_);
+
+  EXPECT_CALL(*mock_update_attempter_, SetFastMode(false));
+  EXPECT_TRUE(common_service_.SetFastMode(&error_, false));
+  EXPECT_EQ(nullptr, error_);
+}
+
 TEST_F(UpdateEngineServiceTest, ResetStatusSucceeds) {
   EXPECT_CALL(*mock_update_attempter_, ResetStatus()).WillOnce(Return(true));
   EXPECT_TRUE(common_service_.ResetStatus(&error_));
@@ -19,6 +19,7 @@
 #include <set>
 #include <string>
 
+#include <base/bind.h>
 #include <base/stl_util.h>
 #include <base/strings/string_util.h>
 #include <policy/device_policy.h>
@@ -71,6 +72,18 @@ ConnectionManager::ConnectionManager(ShillProxyInterface* shill_proxy,
                                      SystemState* system_state)
     : shill_proxy_(shill_proxy), system_state_(system_state) {}
 
+bool ConnectionManager::Init() {
+  ManagerProxyInterface* manager_proxy = shill_proxy_->GetManagerProxy();
+  if (!manager_proxy)
+    return false;
+  manager_proxy->RegisterPropertyChangedSignalHandler(
+      base::Bind(&ConnectionManager::OnManagerPropertyChanged,
+                 base::Unretained(this)),
+      base::Bind(&ConnectionManager::OnSignalConnected,
+                 base::Unretained(this)));
+  return true;
+}
+
 bool ConnectionManager::IsUpdateAllowedOver(NetworkConnectionType type,
                                             NetworkTethering tethering) const {
   switch (type) {
@@ -165,17 +178,62 @@ bool ConnectionManager::GetConnectionProperties(
     NetworkConnectionType* out_type,
     NetworkTethering* out_tethering) {
   dbus::ObjectPath default_service_path;
-  TEST_AND_RETURN_FALSE(GetDefaultServicePath(&default_service_path));
+  if (signal_connected_ && default_service_path_known_) {
+    default_service_path = default_service_path_;
+  } else {
+    TEST_AND_RETURN_FALSE(GetDefaultServicePath(&default_service_path));
+    if (signal_connected_) {
+      default_service_path_ = default_service_path;
+      default_service_path_known_ = true;
+      service_properties_known_ = false;
+    }
+  }
   if (!default_service_path.IsValid())
     return false;
   // Shill uses the "/" service path to indicate that it is not connected.
   if (default_service_path.value() == "/")
     return false;
+
+  if (signal_connected_ && service_properties_known_) {
+    *out_type = service_type_;
+    *out_tethering = service_tethering_;
+    return true;
+  }
   TEST_AND_RETURN_FALSE(
       GetServicePathProperties(default_service_path, out_type, out_tethering));
+  if (signal_connected_) {
+    service_type_ = *out_type;
+    service_tethering_ = *out_tethering;
+    service_properties_known_ = true;
+  }
   return true;
 }
 
+void ConnectionManager::OnManagerPropertyChanged(const string& name,
+                                                 const brillo::Any& value) {
+  if (name != shill::kDefaultServiceProperty)
+    return;
+  dbus::ObjectPath service_path = value.TryGet<dbus::ObjectPath>();
+  // We assume that if the service path didn't change, then the connection
+  // type and the tethering status of it also didn't change.
+  if (default_service_path_known_ && default_service_path_ == service_path)
+    return;
+  default_service_path_ = service_path;
+  default_service_path_known_ = true;
+  service_properties_known_ = false;
+}
+
+void ConnectionManager::OnSignalConnected(const string& interface_name,
+                                          const string& signal_name,
+                                          bool successful) {
+  if (!successful) {
+    LOG(ERROR) << "Couldn't connect to the signal " << interface_name << "."
+               << signal_name;
+    return;
+  }
+  signal_connected_ = true;
+}
+
 bool ConnectionManager::GetDefaultServicePath(dbus::ObjectPath* out_path) {
   brillo::VariantDictionary properties;
   brillo::ErrorPtr error;
@@ -20,6 +20,7 @@
 #include <string>
 
 #include <base/macros.h>
+#include <brillo/any.h>
 #include <dbus/object_path.h>
 
 #include "update_engine/connection_manager_interface.h"
@@ -44,6 +45,11 @@ class ConnectionManager : public ConnectionManagerInterface {
                     SystemState* system_state);
   ~ConnectionManager() override = default;
 
+  // Subscribes to the changes of the default service in shill. Once
+  // subscribed, the connection properties are only requested from shill
+  // again when the default service changes. Returns false on failure.
+  bool Init();
+
   // ConnectionManagerInterface overrides.
   bool GetConnectionProperties(NetworkConnectionType* out_type,
                                NetworkTethering* out_tethering) override;
@@ -59,12 +65,32 @@ class ConnectionManager : public ConnectionManagerInterface {
                                 NetworkConnectionType* out_type,
                                 NetworkTethering* out_tethering);
 
+  // Handlers of the shill Manager PropertyChanged signal.
+  void OnManagerPropertyChanged(const std::string& name,
+                                const brillo::Any& value);
+  void OnSignalConnected(const std::string& interface_name,
+                         const std::string& signal_name,
+                         bool successful);
+
   // The mockable interface to access the shill DBus proxies.
   ShillProxyInterface* shill_proxy_;
 
   // The global context for update_engine.
   SystemState* system_state_;
 
+  // Whether shill notifies us of the changes of the default service, in
+  // which case the state below is kept instead of requested every time.
+  bool signal_connected_{false};
+
+  // The default service path, if known.
+  bool default_service_path_known_{false};
+  dbus::ObjectPath default_service_path_;
+
+  // The properties of the |default_service_path_|, if known.
+  bool service_properties_known_{false};
+  NetworkConnectionType service_type_{NetworkConnectionType::kUnknown};
+  NetworkTethering service_tethering_{NetworkTethering::kUnknown};
+
   DISALLOW_COPY_AND_ASSIGN(ConnectionManager);
 };
 
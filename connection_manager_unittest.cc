@@ -31,6 +31,7 @@
 #include <shill/dbus-proxy-mocks.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/dbus_test_utils.h"
 #include "update_engine/fake_shill_proxy.h"
 #include "update_engine/fake_system_state.h"
 
@@ -406,4 +407,46 @@ TEST_F(ConnectionManagerTest, MalformedServiceList) {
   EXPECT_FALSE(cmut_.GetConnectionProperties(&type, &tethering));
 }
 
+// Once subscribed to the shill signals, the properties are only requested
+// again when the default service changes.
+TEST_F(ConnectionManagerTest, CachedPropertiesTest) {
+  dbus_test_utils::MockSignalHandler<void(const string&, const brillo::Any&)>
+      manager_property_changed;
+  MOCK_SIGNAL_HANDLER_EXPECT_SIGNAL_HANDLER(
+      manager_property_changed,
+      *fake_shill_proxy_.GetManagerProxy(),
+      PropertyChanged);
+  EXPECT_TRUE(cmut_.Init());
+  // RunOnce to notify the signal handler was connected properly.
+  EXPECT_TRUE(loop_.RunOnce(false));
+
+  // Each one of these replies can only be used once.
+  SetManagerReply("/service/guest/network", true);
+  SetServiceReply("/service/guest/network", shill::kTypeWifi, nullptr,
+                  shill::kTetheringNotDetectedState);
+  NetworkConnectionType type;
+  NetworkTethering tethering;
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(cmut_.GetConnectionProperties(&type, &tethering));
+    EXPECT_EQ(NetworkConnectionType::kWifi, type);
+    EXPECT_EQ(NetworkTethering::kNotDetected, tethering);
+  }
+
+  SetServiceReply("/service/cellular", shill::kTypeCellular, nullptr,
+                  shill::kTetheringConfirmedState);
+  ASSERT_TRUE(manager_property_changed.IsHandlerRegistered());
+  manager_property_changed.signal_callback().Run(
+      shill::kDefaultServiceProperty, dbus::ObjectPath("/service/cellular"));
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(cmut_.GetConnectionProperties(&type, &tethering));
+    EXPECT_EQ(NetworkConnectionType::kCellular, type);
+    EXPECT_EQ(NetworkTethering::kConfirmed, tethering);
+  }
+
+  // Disconnected.
+  manager_property_changed.signal_callback().Run(
+      shill::kDefaultServiceProperty, dbus::ObjectPath("/"));
+  EXPECT_FALSE(cmut_.GetConnectionProperties(&type, &tethering));
+}
+
 }  // namespace chromeos_update_engine
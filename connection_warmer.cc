@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/connection_warmer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_util.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the lowercase "scheme://host:port" prefix of the |url|, or an empty
+// string if it has no scheme.
+string UrlOrigin(const string& url) {
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == string::npos)
+    return "";
+  const size_t origin_end = url.find_first_of("/?#", scheme_end + 3);
+  return base::ToLowerASCII(url.substr(0, origin_end));
+}
+
+}  // namespace
+
+const size_t ConnectionWarmer::kMaxWarmedHosts = 2;
+
+ConnectionWarmer::~ConnectionWarmer() {
+  Stop();
+}
+
+// static
+vector<string> ConnectionWarmer::UrlsToWarm(
+    const vector<string>& payload_urls) {
+  vector<string> urls;
+  vector<string> origins;
+  for (const string& url : payload_urls) {
+    const string origin = UrlOrigin(url);
+    if (origin.empty() ||
+        std::find(origins.begin(), origins.end(), origin) != origins.end()) {
+      continue;
+    }
+    if (urls.size() == kMaxWarmedHosts)
+      break;
+    origins.push_back(origin);
+    urls.push_back(url);
+  }
+  return urls;
+}
+
+void ConnectionWarmer::Warm(std::unique_ptr<HttpFetcher> fetcher,
+                            const string& url) {
+  LOG(INFO) << "Warming up the connection to " << UrlOrigin(url);
+  fetcher->set_delegate(this);
+  fetcher->set_max_retry_count(0);
+  fetcher->SetOffset(0);
+  fetcher->SetLength(1);
+  pending_fetchers_.insert(fetcher.get());
+  fetchers_.push_back(std::move(fetcher));
+  fetchers_.back()->BeginTransfer(url);
+}
+
+void ConnectionWarmer::Stop() {
+  // The terminated fetchers remove themselves from |pending_fetchers_|.
+  const std::set<HttpFetcher*> pending_fetchers = pending_fetchers_;
+  for (HttpFetcher* fetcher : pending_fetchers)
+    fetcher->TerminateTransfer();
+  pending_fetchers_.clear();
+  fetchers_.clear();
+}
+
+void ConnectionWarmer::TransferComplete(HttpFetcher* fetcher,
+                                        bool successful) {
+  // A failed request doesn't fail the download, which tries the host again.
+  LOG_IF(WARNING, !successful)
+      << "Unable to warm up a payload connection, HTTP response code "
+      << fetcher->http_response_code();
+  pending_fetchers_.erase(fetcher);
+}
+
+void ConnectionWarmer::TransferTerminated(HttpFetcher* fetcher) {
+  pending_fetchers_.erase(fetcher);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_CONNECTION_WARMER_H_
+#define UPDATE_ENGINE_CONNECTION_WARMER_H_
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// Opens the connections to the payload hosts while the Omaha response is
+// handled, before the download starts. Each host is sent a request for the
+// first byte of its payload with a fetcher sharing the LibcurlConnectionCache
+// of the download, so the DNS lookup, the TCP connection and the TLS handshake
+// are done by the time the DownloadAction needs them, and the connection is
+// picked up from the shared cache. libcurl races the IPv4 and IPv6 addresses
+// of each host itself.
+class ConnectionWarmer : public HttpFetcherDelegate {
+ public:
+  // The most hosts warmed for a response. The download only uses the first
+  // ones unless they fail.
+  static const size_t kMaxWarmedHosts;
+
+  ConnectionWarmer() = default;
+  ~ConnectionWarmer() override;
+
+  // Returns the first of the |payload_urls| of each host, up to
+  // kMaxWarmedHosts, in their order.
+  static std::vector<std::string> UrlsToWarm(
+      const std::vector<std::string>& payload_urls);
+
+  // Requests the first byte of the |url| with the |fetcher|, which should
+  // share its connection cache with the download fetcher.
+  void Warm(std::unique_ptr<HttpFetcher> fetcher, const std::string& url);
+
+  // Terminates the requests still in progress and releases the fetchers, once
+  // the download started or the attempt ended. The connections already open
+  // stay in the shared cache.
+  void Stop();
+
+  // The number of requests started that haven't ended yet.
+  size_t pending_requests() const { return pending_fetchers_.size(); }
+
+  // HttpFetcherDelegate overrides.
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {}
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+ private:
+  // The fetchers of the requests, kept until Stop() since they can't be
+  // destroyed from their own callbacks, and the ones still in progress.
+  std::vector<std::unique_ptr<HttpFetcher>> fetchers_;
+  std::set<HttpFetcher*> pending_fetchers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionWarmer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_CONNECTION_WARMER_H_
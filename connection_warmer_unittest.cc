@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/connection_warmer.h"
+
+#include <string>
+#include <vector>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ConnectionWarmerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override {
+    warmer_.Stop();
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  // Returns a fetcher replying with a single byte.
+  std::unique_ptr<HttpFetcher> NewFetcher() {
+    return std::unique_ptr<HttpFetcher>(new MockHttpFetcher("x", 1, nullptr));
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  ConnectionWarmer warmer_;
+};
+
+TEST_F(ConnectionWarmerTest, UrlsToWarmTest) {
+  // The first URL of each host is kept, up to kMaxWarmedHosts of them.
+  EXPECT_EQ((vector<string>{"https://a.example/p1", "http://a.example/p1"}),
+            ConnectionWarmer::UrlsToWarm({"https://a.example/p1",
+                                          "https://A.example/p2",
+                                          "http://a.example/p1",
+                                          "https://b.example/p1"}));
+  // The ports are part of the host, the URLs without a scheme are skipped.
+  EXPECT_EQ((vector<string>{"https://a.example:8080?p", "https://a.example/"}),
+            ConnectionWarmer::UrlsToWarm({"a.example/p",
+                                          "https://a.example:8080?p",
+                                          "https://a.example/"}));
+  EXPECT_TRUE(ConnectionWarmer::UrlsToWarm({}).empty());
+}
+
+TEST_F(ConnectionWarmerTest, RequestsCompleteTest) {
+  warmer_.Warm(NewFetcher(), "https://a.example/p");
+  warmer_.Warm(NewFetcher(), "https://b.example/p");
+  EXPECT_EQ(2U, warmer_.pending_requests());
+  while (loop_.RunOnce(false)) {
+  }
+  EXPECT_EQ(0U, warmer_.pending_requests());
+}
+
+TEST_F(ConnectionWarmerTest, StopTerminatesRequestsTest) {
+  warmer_.Warm(NewFetcher(), "https://a.example/p");
+  EXPECT_EQ(1U, warmer_.pending_requests());
+  warmer_.Stop();
+  EXPECT_EQ(0U, warmer_.pending_requests());
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+}  // namespace chromeos_update_engine
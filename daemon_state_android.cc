@@ -21,6 +21,7 @@
 #include "update_engine/common/boot_control.h"
 #include "update_engine/common/boot_control_stub.h"
 #include "update_engine/common/hardware.h"
+#include "update_engine/common/platform_constants.h"
 #include "update_engine/common/prefs.h"
 #include "update_engine/update_attempter_android.h"
 
@@ -58,6 +59,9 @@ bool DaemonStateAndroid::Initialize() {
     return false;
   }
 
+  memory_pressure_monitor_.Init(constants::kMemoryCgroupPath,
+                                MemoryPressureMonitor::kPsiMemoryPath);
+
   // The CertificateChecker singleton is used by the update attempter.
   certificate_checker_.reset(
       new CertificateChecker(prefs_.get(), &openssl_wrapper_));
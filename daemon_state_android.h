@@ -23,6 +23,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/memory_pressure_monitor.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/daemon_state_interface.h"
 #include "update_engine/service_delegate_android_interface.h"
@@ -62,6 +63,10 @@ class DaemonStateAndroid : public DaemonStateInterface {
   // Interface for persisted store.
   std::unique_ptr<PrefsInterface> prefs_;
 
+  // Shrinks the caches of the updates under memory pressure. Declared before
+  // the update attempter so it outlives the caches registered with it.
+  MemoryPressureMonitor memory_pressure_monitor_;
+
   // The main class handling the updates.
   std::unique_ptr<UpdateAttempterAndroid> update_attempter_;
 
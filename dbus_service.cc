@@ -81,6 +81,18 @@ bool DBusUpdateEngineService::GetStatus(ErrorPtr* error,
                             out_new_size);
 }
 
+bool DBusUpdateEngineService::GetDownloadRate(ErrorPtr* error,
+                                              int64_t* out_current_rate_bps,
+                                              int64_t* out_target_rate_bps) {
+  return common_->GetDownloadRate(
+      error, out_current_rate_bps, out_target_rate_bps);
+}
+
+bool DBusUpdateEngineService::SetFastMode(ErrorPtr* error,
+                                          bool in_fast_mode) {
+  return common_->SetFastMode(error, in_fast_mode);
+}
+
 bool DBusUpdateEngineService::RebootIfNeeded(ErrorPtr* error) {
   return common_->RebootIfNeeded(error);
 }
@@ -137,6 +149,11 @@ bool DBusUpdateEngineService::GetLastAttemptError(
  return common_->GetLastAttemptError(error, out_last_attempt_error);
 }
 
+bool DBusUpdateEngineService::GetPolicyStats(ErrorPtr* error,
+                                             string* out_stats_json) {
+  return common_->GetPolicyStats(error, out_stats_json);
+}
+
 UpdateEngineAdaptor::UpdateEngineAdaptor(SystemState* system_state,
                                          const scoped_refptr<dbus::Bus>& bus)
     : org::chromium::UpdateEngineInterfaceAdaptor(&dbus_service_),
@@ -68,6 +68,16 @@ class DBusUpdateEngineService
                  std::string* out_new_version,
                  int64_t* out_new_size) override;
 
+  // Returns the download rate measured recently and its current limit, 0 if
+  // the download isn't limited, in bytes/sec.
+  bool GetDownloadRate(brillo::ErrorPtr* error,
+                       int64_t* out_current_rate_bps,
+                       int64_t* out_target_rate_bps) override;
+
+  // Turns the fast mode, which lifts the limits of the resources and download
+  // rate of the update, on or off for the update in progress or the next one.
+  bool SetFastMode(brillo::ErrorPtr* error, bool in_fast_mode) override;
+
   // Reboots the device if an update is applied and a reboot is required.
   bool RebootIfNeeded(brillo::ErrorPtr* error) override;
 
@@ -133,6 +143,11 @@ class DBusUpdateEngineService
   // ErrorCode will be returned.
   bool GetLastAttemptError(brillo::ErrorPtr* error,
                            int32_t* out_last_attempt_error) override;
+
+  // Returns a JSON dump of the counters and timings of the policy evaluations,
+  // intended for debugging only.
+  bool GetPolicyStats(brillo::ErrorPtr* error,
+                      std::string* out_stats_json) override;
  private:
   std::unique_ptr<UpdateEngineService> common_;
 };
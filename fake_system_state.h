@@ -67,6 +67,8 @@ class FakeSystemState : public SystemState {
 
   inline HardwareInterface* hardware() override { return hardware_; }
 
+  inline LibcurlConnectionCache* connection_cache() override { return nullptr; }
+
   inline MetricsLibraryInterface* metrics_lib() override {
     return metrics_lib_;
   }
@@ -102,7 +102,7 @@ std::unique_ptr<HardwareInterface> CreateHardware() {
 // See IsOfficialBuild() and IsNormalMode() for the meaning of these options in
 // Android.
 
-bool HardwareAndroid::IsOfficialBuild() const {
+HardwareAndroid::HardwareAndroid() {
   // We run an official build iff ro.secure == 1, because we expect the build to
   // behave like the end user product and check for updates. Note that while
   // developers are able to build "official builds" by just running "make user",
@@ -111,15 +111,21 @@ bool HardwareAndroid::IsOfficialBuild() const {
   //
   // In case of a non-bool value, we take the most restrictive option and
   // assume we are in an official-build.
-  return property_get_bool("ro.secure", 1) != 0;
-}
+  official_build_ = property_get_bool("ro.secure", 1) != 0;
 
-bool HardwareAndroid::IsNormalBootMode() const {
   // We are running in "dev-mode" iff ro.debuggable == 1. In dev-mode the
   // update_engine will allow extra developers options, such as providing a
   // different update URL. In case of error, we assume the build is in
   // normal-mode.
-  return property_get_bool("ro.debuggable", 0) != 1;
+  normal_boot_mode_ = property_get_bool("ro.debuggable", 0) != 1;
+}
+
+bool HardwareAndroid::IsOfficialBuild() const {
+  return official_build_;
+}
+
+bool HardwareAndroid::IsNormalBootMode() const {
+  return normal_boot_mode_;
 }
 
 bool HardwareAndroid::IsOOBEComplete(base::Time* out_time_of_oobe) const {
@@ -173,4 +179,9 @@ bool HardwareAndroid::GetPowerwashSafeDirectory(base::FilePath* path) const {
   return false;
 }
 
+bool HardwareAndroid::IsOnACPower() const {
+  LOG(WARNING) << "STUB: Assuming the device runs on battery.";
+  return false;
+}
+
 }  // namespace chromeos_update_engine
@@ -28,9 +28,10 @@
 namespace chromeos_update_engine {
 
 // Implements the real interface with the hardware in the Android platform.
+// The read-only system properties are read once, when it's created.
 class HardwareAndroid final : public HardwareInterface {
  public:
-  HardwareAndroid() = default;
+  HardwareAndroid();
   ~HardwareAndroid() override = default;
 
   // HardwareInterface methods.
@@ -45,8 +46,13 @@ class HardwareAndroid final : public HardwareInterface {
   bool CancelPowerwash() override;
   bool GetNonVolatileDirectory(base::FilePath* path) const override;
   bool GetPowerwashSafeDirectory(base::FilePath* path) const override;
+  bool IsOnACPower() const override;
 
  private:
+  // The ro.secure and ro.debuggable properties, which can't change.
+  bool official_build_;
+  bool normal_boot_mode_;
+
   DISALLOW_COPY_AND_ASSIGN(HardwareAndroid);
 };
 
@@ -16,6 +16,7 @@
 
 #include "update_engine/hardware_chromeos.h"
 
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -50,6 +51,9 @@ const char kPowerwashSafeDirectory[] =
 // a powerwash is performed.
 const char kPowerwashCountMarker[] = "powerwash_count";
 
+// The sysfs directory listing the power supplies of the device.
+const char kPowerSupplyDirectory[] = "/sys/class/power_supply";
+
 // UpdateManager config path.
 const char* kConfigFilePath = "/etc/update_manager.conf";
 
@@ -182,4 +186,23 @@ bool HardwareChromeOS::GetPowerwashSafeDirectory(base::FilePath* path) const {
   return true;
 }
 
+bool HardwareChromeOS::IsOnACPower() const {
+  base::FileEnumerator power_supplies(base::FilePath(kPowerSupplyDirectory),
+                                      false /* recursive */,
+                                      base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath path = power_supplies.Next(); !path.empty();
+       path = power_supplies.Next()) {
+    string type, online;
+    if (!utils::ReadFile(path.Append("type").value(), &type) ||
+        !utils::ReadFile(path.Append("online").value(), &online)) {
+      continue;
+    }
+    base::TrimWhitespaceASCII(type, base::TRIM_ALL, &type);
+    base::TrimWhitespaceASCII(online, base::TRIM_ALL, &online);
+    if (type == "Mains" && online == "1")
+      return true;
+  }
+  return false;
+}
+
 }  // namespace chromeos_update_engine
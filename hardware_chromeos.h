@@ -46,6 +46,7 @@ class HardwareChromeOS final : public HardwareInterface {
   bool CancelPowerwash() override;
   bool GetNonVolatileDirectory(base::FilePath* path) const override;
   bool GetPowerwashSafeDirectory(base::FilePath* path) const override;
+  bool IsOnACPower() const override;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(HardwareChromeOS);
@@ -16,6 +16,9 @@
 
 #include "update_engine/image_properties.h"
 
+#include <sys/stat.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
@@ -62,17 +65,65 @@ enum class LsbReleaseSource {
   kStateful,
 };
 
-// Loads the lsb-release properties into the key-value |store| reading the file
-// from either the system image or the stateful partition as specified by
-// |source|. The loaded values are added to the store, possibly overriding
-// existing values.
-void LoadLsbRelease(LsbReleaseSource source, brillo::KeyValueStore* store) {
+// The contents of an lsb-release file along with its stat(2) when it was read.
+struct CachedLsbRelease {
+  struct stat file_stat;
+  std::string contents;
+};
+
+// Returns the lsb-release files read so far, by path. They are read again
+// only when they change, since the properties are loaded for every update
+// check.
+std::map<std::string, CachedLsbRelease>* GetLsbReleaseCache() {
+  static auto* cache = new std::map<std::string, CachedLsbRelease>();
+  return cache;
+}
+
+// Returns whether |a| and |b| are the stat(2) of the same unmodified file.
+bool IsSameFile(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+         a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+         a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+         a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+std::string GetLsbReleasePath(LsbReleaseSource source) {
   std::string path;
   if (root_prefix)
     path = root_prefix;
   if (source == LsbReleaseSource::kStateful)
     path += chromeos_update_engine::kStatefulPartition;
-  store->Load(base::FilePath(path + kLsbRelease));
+  return path + kLsbRelease;
+}
+
+// Loads the lsb-release properties into the key-value |store| reading the file
+// from either the system image or the stateful partition as specified by
+// |source|. The loaded values are added to the store, possibly overriding
+// existing values.
+void LoadLsbRelease(LsbReleaseSource source, brillo::KeyValueStore* store) {
+  const std::string path = GetLsbReleasePath(source);
+  std::map<std::string, CachedLsbRelease>* cache = GetLsbReleaseCache();
+  struct stat file_stat;
+  if (stat(path.c_str(), &file_stat) != 0) {
+    cache->erase(path);
+    return;
+  }
+  auto cached = cache->find(path);
+  if (cached == cache->end() ||
+      !IsSameFile(cached->second.file_stat, file_stat)) {
+    std::string contents;
+    if (!base::ReadFileToString(base::FilePath(path), &contents)) {
+      cache->erase(path);
+      return;
+    }
+    CachedLsbRelease& entry = (*cache)[path];
+    entry.file_stat = file_stat;
+    entry.contents.swap(contents);
+    cached = cache->find(path);
+  }
+  store->LoadFromString(cached->second.contents);
 }
 
 }  // namespace
@@ -140,8 +191,8 @@ bool StoreMutableImageProperties(SystemState* system_state,
   lsb_release.SetBoolean(kLsbReleaseIsPowerwashAllowedKey,
                          properties.is_powerwash_allowed);
 
-  std::string root_prefix_str = root_prefix ? root_prefix : "";
-  base::FilePath path(root_prefix_str + kStatefulPartition + kLsbRelease);
+  base::FilePath path(GetLsbReleasePath(LsbReleaseSource::kStateful));
+  GetLsbReleaseCache()->erase(path.value());
   if (!base::DirectoryExists(path.DirName()))
     base::CreateDirectory(path.DirName());
   return lsb_release.Save(path);
@@ -0,0 +1,50 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/libcurl_connection_cache.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+LibcurlConnectionCache::LibcurlConnectionCache() {
+  share_handle_ = curl_share_init();
+  CHECK(share_handle_);
+  CHECK_EQ(curl_share_setopt(share_handle_, CURLSHOPT_SHARE,
+                             CURL_LOCK_DATA_DNS),
+           CURLSHE_OK);
+  CHECK_EQ(curl_share_setopt(share_handle_, CURLSHOPT_SHARE,
+                             CURL_LOCK_DATA_SSL_SESSION),
+           CURLSHE_OK);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  // Sharing the connection cache needs libcurl 7.57.0. With older versions
+  // each fetcher only reuses the connections it opened itself.
+  CHECK_EQ(curl_share_setopt(share_handle_, CURLSHOPT_SHARE,
+                             CURL_LOCK_DATA_CONNECT),
+           CURLSHE_OK);
+#endif  // LIBCURL_VERSION_NUM >= 0x073900
+}
+
+LibcurlConnectionCache::~LibcurlConnectionCache() {
+  // This fails if a curl handle still uses the cache.
+  CURLSHcode rc = curl_share_cleanup(share_handle_);
+  LOG_IF(ERROR, rc != CURLSHE_OK)
+      << "Unable to clean up the libcurl share handle: "
+      << curl_share_strerror(rc);
+}
+
+}  // namespace chromeos_update_engine
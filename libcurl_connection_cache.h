@@ -0,0 +1,49 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_LIBCURL_CONNECTION_CACHE_H_
+#define UPDATE_ENGINE_LIBCURL_CONNECTION_CACHE_H_
+
+#include <curl/curl.h>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// The caches shared between all the LibcurlHttpFetcher instances using it, so
+// the Omaha requests, the event pings and the payload download to the same
+// host reuse the DNS lookups, the TLS sessions and, when libcurl supports it,
+// the open connections of each other. The fetchers run on the same message
+// loop, so no locking is needed. This object must outlive all the fetchers
+// using it.
+class LibcurlConnectionCache {
+ public:
+  LibcurlConnectionCache();
+  ~LibcurlConnectionCache();
+
+  // The handle passed to libcurl as CURLOPT_SHARE.
+  CURLSH* share_handle() const { return share_handle_; }
+
+ private:
+  CURLSH* share_handle_{nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(LibcurlConnectionCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_LIBCURL_CONNECTION_CACHE_H_
@@ -0,0 +1,224 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/libcurl_connection_cache.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The made up host name of the test server, only known from the DNS entries
+// added with CURLOPT_RESOLVE.
+const char kTestHost[] = "connection-cache-test.invalid";
+
+// An HTTP server on the loopback interface answering every request with a
+// short keep-alive response, which counts the connections it accepted.
+class KeepAliveServer {
+ public:
+  KeepAliveServer() {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (listen_fd_ < 0 ||
+        bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0 ||
+        listen(listen_fd_, 8) != 0 ||
+        getsockname(
+            listen_fd_, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0 ||
+        pipe2(stop_pipe_, O_CLOEXEC) != 0) {
+      ADD_FAILURE() << "Unable to start the test server.";
+      return;
+    }
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread(&KeepAliveServer::Serve, this);
+  }
+
+  ~KeepAliveServer() {
+    if (thread_.joinable()) {
+      EXPECT_EQ(1, HANDLE_EINTR(write(stop_pipe_[1], "x", 1)));
+      thread_.join();
+    }
+    for (int fd : {listen_fd_, stop_pipe_[0], stop_pipe_[1]}) {
+      if (fd >= 0)
+        IGNORE_EINTR(close(fd));
+    }
+  }
+
+  int port() const { return port_; }
+
+  // Only read once the transfers are done, since the connections are only
+  // accepted while they run.
+  int num_connections() const { return num_connections_; }
+
+ private:
+  void Serve() {
+    vector<int> client_fds;
+    vector<string> requests;
+    for (;;) {
+      vector<pollfd> fds{{stop_pipe_[0], POLLIN, 0}, {listen_fd_, POLLIN, 0}};
+      for (int fd : client_fds)
+        fds.push_back({fd, POLLIN, 0});
+      if (HANDLE_EINTR(poll(fds.data(), fds.size(), -1)) < 0 ||
+          fds[0].revents) {
+        break;
+      }
+      if (fds[1].revents) {
+        int fd = HANDLE_EINTR(accept4(listen_fd_, nullptr, nullptr,
+                                      SOCK_CLOEXEC));
+        if (fd >= 0) {
+          num_connections_++;
+          client_fds.push_back(fd);
+          requests.emplace_back();
+        }
+      }
+      for (size_t i = 2; i < fds.size(); i++) {
+        if (!fds[i].revents)
+          continue;
+        size_t client = i - 2;
+        char buffer[1024];
+        ssize_t size = HANDLE_EINTR(read(fds[i].fd, buffer, sizeof(buffer)));
+        if (size <= 0) {
+          IGNORE_EINTR(close(fds[i].fd));
+          client_fds[client] = -1;
+          continue;
+        }
+        requests[client].append(buffer, size);
+        // Answer each complete request, the test requests have no body.
+        size_t end;
+        while ((end = requests[client].find("\r\n\r\n")) != string::npos) {
+          requests[client].erase(0, end + 4);
+          const char kResponse[] =
+              "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+          if (HANDLE_EINTR(write(fds[i].fd, kResponse,
+                                 sizeof(kResponse) - 1)) < 0) {
+            break;
+          }
+        }
+      }
+      for (size_t client = 0; client < client_fds.size();) {
+        if (client_fds[client] < 0) {
+          client_fds.erase(client_fds.begin() + client);
+          requests.erase(requests.begin() + client);
+        } else {
+          client++;
+        }
+      }
+    }
+    for (int fd : client_fds)
+      IGNORE_EINTR(close(fd));
+  }
+
+  int listen_fd_{-1};
+  int stop_pipe_[2]{-1, -1};
+  int port_{0};
+  std::atomic<int> num_connections_{0};
+  std::thread thread_;
+};
+
+size_t DiscardData(char* /* ptr */, size_t size, size_t nmemb, void*) {
+  return size * nmemb;
+}
+
+}  // namespace
+
+class LibcurlConnectionCacheTest : public ::testing::Test {
+ protected:
+  // Fetches the test server from a new curl handle using the |cache|, if any.
+  // The |resolve| list, if any, adds the DNS entries of the test server.
+  CURLcode Fetch(LibcurlConnectionCache* cache, curl_slist* resolve) {
+    CURL* curl = curl_easy_init();
+    if (!curl)
+      return CURLE_FAILED_INIT;
+    string url =
+        base::StringPrintf("http://%s:%d/", kTestHost, server_.port());
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, DiscardData);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    if (cache)
+      curl_easy_setopt(curl, CURLOPT_SHARE, cache->share_handle());
+    if (resolve)
+      curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+    CURLcode rc = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    return rc;
+  }
+
+  void SetUp() override {
+    string entry = base::StringPrintf(
+        "%s:%d:127.0.0.1", kTestHost, server_.port());
+    resolve_ = curl_slist_append(nullptr, entry.c_str());
+  }
+
+  void TearDown() override { curl_slist_free_all(resolve_); }
+
+  KeepAliveServer server_;
+  curl_slist* resolve_{nullptr};
+};
+
+TEST_F(LibcurlConnectionCacheTest, SharesDnsEntriesTest) {
+  LibcurlConnectionCache cache;
+  EXPECT_EQ(CURLE_OK, Fetch(&cache, resolve_));
+  // The next handles find the host in the shared DNS cache.
+  EXPECT_EQ(CURLE_OK, Fetch(&cache, nullptr));
+  EXPECT_EQ(CURLE_OK, Fetch(&cache, nullptr));
+
+  // The handles without the cache don't.
+  EXPECT_EQ(CURLE_COULDNT_RESOLVE_HOST, Fetch(nullptr, nullptr));
+  LibcurlConnectionCache other_cache;
+  EXPECT_EQ(CURLE_COULDNT_RESOLVE_HOST, Fetch(&other_cache, nullptr));
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+TEST_F(LibcurlConnectionCacheTest, ReusesConnectionsTest) {
+  {
+    LibcurlConnectionCache cache;
+    for (int i = 0; i < 3; i++)
+      EXPECT_EQ(CURLE_OK, Fetch(&cache, resolve_));
+  }
+  // The handles reused the connection the first one left in the cache, which
+  // is closed with it.
+  EXPECT_EQ(1, server_.num_connections());
+}
+#endif  // LIBCURL_VERSION_NUM >= 0x073900
+
+TEST_F(LibcurlConnectionCacheTest, SeparateHandlesConnectTest) {
+  for (int i = 0; i < 3; i++)
+    EXPECT_EQ(CURLE_OK, Fetch(nullptr, resolve_));
+  // Each handle without the cache closes its connection with it.
+  EXPECT_EQ(3, server_.num_connections());
+}
+
+}  // namespace chromeos_update_engine
@@ -59,6 +59,11 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  if (curl_multi_handle_) {
+    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
+    curl_multi_handle_ = nullptr;
+  }
+  MessageLoop::current()->CancelTask(curl_timer_id_);
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -94,13 +99,46 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   LOG(INFO) << "Starting/Resuming transfer";
   CHECK(!transfer_in_progress_);
   url_ = url;
-  curl_multi_handle_ = curl_multi_init();
-  CHECK(curl_multi_handle_);
+  // The multi handle is reused across transfers, keeping the connections it
+  // opened alive for the next ones.
+  if (!curl_multi_handle_) {
+    curl_multi_handle_ = curl_multi_init();
+    CHECK(curl_multi_handle_);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    if (http2_enabled_) {
+      CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                                 CURLMOPT_PIPELINING,
+                                 CURLPIPE_MULTIPLEX),
+               CURLM_OK);
+    }
+#endif  // LIBCURL_VERSION_NUM >= 0x072b00
+    if (socket_callbacks_enabled_) {
+      CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                                 CURLMOPT_SOCKETFUNCTION,
+                                 StaticCurlSocketCallback),
+               CURLM_OK);
+      CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETDATA, this),
+               CURLM_OK);
+      CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                                 CURLMOPT_TIMERFUNCTION,
+                                 StaticCurlTimerCallback),
+               CURLM_OK);
+      CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERDATA, this),
+               CURLM_OK);
+    }
+  }
 
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
   ignore_failure_ = false;
 
+  if (connection_cache_) {
+    CHECK_EQ(curl_easy_setopt(curl_handle_,
+                              CURLOPT_SHARE,
+                              connection_cache_->share_handle()),
+             CURLE_OK);
+  }
+
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
   LOG(INFO) << "Using proxy: " << (is_direct ? "no" : "yes");
@@ -181,6 +219,11 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEDATA, this), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEFUNCTION,
                             StaticLibcurlWrite), CURLE_OK);
+  response_headers_.clear();
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERDATA, this),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERFUNCTION,
+                            StaticLibcurlHeader), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_URL, url_.c_str()),
            CURLE_OK);
 
@@ -196,6 +239,18 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_CONNECTTIMEOUT,
                             connect_timeout_seconds_),
            CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_MAX_RECV_SPEED_LARGE,
+                            static_cast<curl_off_t>(max_receive_speed_bps_)),
+           CURLE_OK);
+
+  if (http2_enabled_)
+    SetCurlOptionsForHttp2();
+  if (receive_buffer_size_) {
+    // libcurl silently clamps the size to the range it supports.
+    long buffer_size = receive_buffer_size_;  // NOLINT(runtime/int) - curl.
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_BUFFERSIZE, buffer_size),
+             CURLE_OK);
+  }
 
   // By default, libcurl doesn't follow redirections. Allow up to
   // |kDownloadMaxRedirects| redirections.
@@ -230,6 +285,10 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  // The idle connections reused by this transfer keep the events libcurl
+  // asked for before.
+  for (const auto& socket_watch : sockets_)
+    UpdateSocketWatches(socket_watch.first);
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -269,6 +328,25 @@ void LibcurlHttpFetcher::SetCurlOptionsForHttps() {
   }
 }
 
+// Negotiates HTTP/2 over TLS, keeping HTTP/1.1 for plain HTTP. libcurl falls
+// back to HTTP/1.1 on its own when the server doesn't offer HTTP/2 with ALPN.
+void LibcurlHttpFetcher::SetCurlOptionsForHttp2() {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  CURLcode rc = curl_easy_setopt(curl_handle_, CURLOPT_HTTP_VERSION,
+                                 CURL_HTTP_VERSION_2TLS);
+  if (rc != CURLE_OK) {
+    LOG(WARNING) << "HTTP/2 not supported by libcurl, using HTTP/1.1: "
+                 << curl_easy_strerror(rc);
+    return;
+  }
+  // Waits for a connection to the same host to multiplex the request on,
+  // instead of opening a new connection right away.
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_PIPEWAIT, 1L), CURLE_OK);
+#else
+  LOG(WARNING) << "HTTP/2 needs libcurl 7.47.0, using HTTP/1.1.";
+#endif  // LIBCURL_VERSION_NUM >= 0x072f00
+}
+
 // Lock down only the protocol in case of a local file.
 void LibcurlHttpFetcher::SetCurlOptionsForFile() {
   LOG(INFO) << "Setting up curl options for FILE";
@@ -279,10 +357,22 @@ void LibcurlHttpFetcher::SetCurlOptionsForFile() {
       CURLE_OK);
 }
 
+void LibcurlHttpFetcher::set_max_receive_speed(int max_speed_bps) {
+  max_receive_speed_bps_ = max_speed_bps;
+  // libcurl checks the limit as the data is received, so changing it also
+  // throttles the transfer in progress.
+  if (curl_handle_) {
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_MAX_RECV_SPEED_LARGE,
+                              static_cast<curl_off_t>(max_receive_speed_bps_)),
+             CURLE_OK);
+  }
+}
+
 // Begins the transfer, which must not have already been started.
 void LibcurlHttpFetcher::BeginTransfer(const string& url) {
   CHECK(!transfer_in_progress_);
   url_ = url;
+  throughput_estimator_.TransferStarted(base::TimeTicks::Now());
   auto closure = base::Bind(&LibcurlHttpFetcher::ProxiesResolved,
                             base::Unretained(this));
   if (!ResolveProxiesForUrl(url_, closure)) {
@@ -339,6 +429,11 @@ void LibcurlHttpFetcher::SetHeader(const string& header_name,
 
 void LibcurlHttpFetcher::CurlPerformOnce() {
   CHECK(transfer_in_progress_);
+  if (socket_callbacks_enabled_) {
+    // libcurl processes whatever is due on any of its sockets.
+    CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
+    return;
+  }
   int running_handles = 0;
   CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
 
@@ -351,7 +446,10 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
       return;
     }
   }
+  CurlPerformed(running_handles);
+}
 
+void LibcurlHttpFetcher::CurlPerformed(int running_handles) {
   // If the transfer completes while paused, we should ignore the failure once
   // the fetcher is unpaused.
   if (running_handles == 0 && transfer_paused_ && !ignore_failure_) {
@@ -362,8 +460,10 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   if (running_handles != 0 || transfer_paused_) {
     // There's either more work to do or we are paused, so we just keep the
     // file descriptors to watch up to date and exit, until we are done with the
-    // work and we are not paused.
-    SetupMessageLoopSources();
+    // work and we are not paused. The socket callbacks keep them up to date
+    // themselves.
+    if (!socket_callbacks_enabled_)
+      SetupMessageLoopSources();
     return;
   }
 
@@ -395,7 +495,10 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
                    base::Unretained(this)),
         TimeDelta::FromSeconds(kNoNetworkRetrySeconds));
     LOG(INFO) << "No HTTP response, retry " << no_network_retry_count_;
-  } else if ((!sent_byte_ && !IsHttpResponseSuccess()) ||
+    // A 304 response to a conditional request has no bytes either, but it
+    // isn't an error worth retrying through the next proxy.
+  } else if ((!sent_byte_ && !IsHttpResponseSuccess() &&
+              http_response_code_ != kHttpResponseNotModified) ||
              IsHttpResponseError()) {
     // The transfer completed w/ error and we didn't get any bytes.
     // If we have another proxy to try, try that.
@@ -481,6 +584,7 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  throughput_estimator_.BytesReceived(base::TimeTicks::Now(), payload_size);
   in_write_callback_ = true;
   if (delegate_)
     delegate_->ReceivedBytes(this, ptr, payload_size);
@@ -488,6 +592,36 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
   return payload_size;
 }
 
+size_t LibcurlHttpFetcher::LibcurlHeader(void *ptr,
+                                         size_t size,
+                                         size_t nmemb) {
+  const size_t header_size = size * nmemb;
+  string line(static_cast<const char*>(ptr), header_size);
+  base::TrimWhitespaceASCII(line, base::TRIM_TRAILING, &line);
+  // Each response, including those of the redirections, starts with its
+  // status line, so only the headers of the last one are kept.
+  if (base::StartsWith(line, "HTTP/", base::CompareCase::SENSITIVE)) {
+    response_headers_.clear();
+    return header_size;
+  }
+  size_t colon = line.find(':');
+  if (colon != string::npos) {
+    string value;
+    base::TrimWhitespaceASCII(line.substr(colon + 1), base::TRIM_ALL, &value);
+    response_headers_[base::ToLowerASCII(line.substr(0, colon))] = value;
+  }
+  return header_size;
+}
+
+bool LibcurlHttpFetcher::GetResponseHeader(const string& header_name,
+                                           string* header_value) const {
+  auto it = response_headers_.find(base::ToLowerASCII(header_name));
+  if (it == response_headers_.end())
+    return false;
+  *header_value = it->second;
+  return true;
+}
+
 void LibcurlHttpFetcher::Pause() {
   if (transfer_paused_) {
     LOG(ERROR) << "Fetcher already paused.";
@@ -614,6 +748,111 @@ void LibcurlHttpFetcher::SetupMessageLoopSources() {
   }
 }
 
+int LibcurlHttpFetcher::StaticCurlSocketCallback(CURL* /* easy */,
+                                                 curl_socket_t socket,
+                                                 int what,
+                                                 void* userp,
+                                                 void* /* socketp */) {
+  reinterpret_cast<LibcurlHttpFetcher*>(userp)->CurlSocketCallback(socket,
+                                                                   what);
+  return 0;
+}
+
+int LibcurlHttpFetcher::StaticCurlTimerCallback(
+    CURLM* /* multi */,
+    long timeout_ms,  // NOLINT(runtime/int) - curl needs long.
+    void* userp) {
+  reinterpret_cast<LibcurlHttpFetcher*>(userp)->CurlTimerCallback(timeout_ms);
+  return 0;
+}
+
+void LibcurlHttpFetcher::CurlSocketCallback(curl_socket_t socket, int what) {
+  if (what != CURL_POLL_REMOVE) {
+    sockets_[socket].what = what;
+    UpdateSocketWatches(socket);
+    return;
+  }
+  auto socket_it = sockets_.find(socket);
+  if (socket_it == sockets_.end())
+    return;
+  for (MessageLoop::TaskId task_id : socket_it->second.task_ids)
+    MessageLoop::current()->CancelTask(task_id);
+  sockets_.erase(socket_it);
+}
+
+void LibcurlHttpFetcher::CurlTimerCallback(
+    long timeout_ms) {  // NOLINT(runtime/int) - curl needs long.
+  MessageLoop::current()->CancelTask(curl_timer_id_);
+  curl_timer_id_ = MessageLoop::kTaskIdNull;
+  // A negative timeout removes the timer. libcurl must not be called back
+  // from within its own callback, even with a zero timeout.
+  if (timeout_ms < 0)
+    return;
+  curl_timer_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&LibcurlHttpFetcher::OnCurlTimer, base::Unretained(this)),
+      TimeDelta::FromMilliseconds(timeout_ms));
+}
+
+void LibcurlHttpFetcher::UpdateSocketWatches(curl_socket_t socket) {
+  auto socket_it = sockets_.find(socket);
+  if (socket_it == sockets_.end())
+    return;
+  SocketWatch* watch = &socket_it->second;
+  const int poll_events[2] = {CURL_POLL_IN, CURL_POLL_OUT};
+  const int select_events[2] = {CURL_CSELECT_IN, CURL_CSELECT_OUT};
+  const MessageLoop::WatchMode watch_modes[2] = {
+      MessageLoop::WatchMode::kWatchRead,
+      MessageLoop::WatchMode::kWatchWrite,
+  };
+  for (size_t t = 0; t < arraysize(watch->task_ids); ++t) {
+    // The idle connections kept between the transfers aren't watched.
+    const bool must_watch = curl_handle_ && (watch->what & poll_events[t]);
+    const bool watched = watch->task_ids[t] != MessageLoop::kTaskIdNull;
+    if (must_watch == watched)
+      continue;
+    if (!must_watch) {
+      MessageLoop::current()->CancelTask(watch->task_ids[t]);
+      watch->task_ids[t] = MessageLoop::kTaskIdNull;
+      continue;
+    }
+    watch->task_ids[t] = MessageLoop::current()->WatchFileDescriptor(
+        FROM_HERE,
+        socket,
+        watch_modes[t],
+        true,  // persistent
+        base::Bind(&LibcurlHttpFetcher::OnSocketReady,
+                   base::Unretained(this),
+                   socket,
+                   select_events[t]));
+  }
+}
+
+void LibcurlHttpFetcher::OnSocketReady(curl_socket_t socket, int event) {
+  if (transfer_in_progress_)
+    CurlSocketAction(socket, event);
+}
+
+void LibcurlHttpFetcher::OnCurlTimer() {
+  curl_timer_id_ = MessageLoop::kTaskIdNull;
+  // The next transfer lets libcurl process its expired timers when it starts.
+  if (transfer_in_progress_)
+    CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
+}
+
+void LibcurlHttpFetcher::CurlSocketAction(curl_socket_t socket, int event) {
+  int running_handles = 0;
+  CURLMcode retcode = curl_multi_socket_action(
+      curl_multi_handle_, socket, event, &running_handles);
+  if (terminate_requested_) {
+    ForceTransferTermination();
+    return;
+  }
+  LOG_IF(WARNING, retcode != CURLM_OK)
+      << "curl_multi_socket_action failed: " << curl_multi_strerror(retcode);
+  CurlPerformed(running_handles);
+}
+
 void LibcurlHttpFetcher::RetryTimeoutCallback() {
   if (transfer_paused_) {
     restart_transfer_on_unpause_ = true;
@@ -639,6 +878,7 @@ void LibcurlHttpFetcher::TimeoutCallback() {
 }
 
 void LibcurlHttpFetcher::CleanUp() {
+  throughput_estimator_.TransferEnded(base::TimeTicks::Now());
   MessageLoop::current()->CancelTask(timeout_id_);
   timeout_id_ = MessageLoop::kTaskIdNull;
 
@@ -666,10 +906,8 @@ void LibcurlHttpFetcher::CleanUp() {
     curl_easy_cleanup(curl_handle_);
     curl_handle_ = nullptr;
   }
-  if (curl_multi_handle_) {
-    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
-    curl_multi_handle_ = nullptr;
-  }
+  for (const auto& socket_watch : sockets_)
+    UpdateSocketWatches(socket_watch.first);
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
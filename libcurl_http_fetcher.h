@@ -31,6 +31,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/libcurl_connection_cache.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -89,6 +90,36 @@ class LibcurlHttpFetcher : public HttpFetcher {
     server_to_check_ = server_to_check;
   }
 
+  // Shares the DNS, TLS session and connection caches of |connection_cache|
+  // with the other fetchers using it. The |connection_cache| must outlive this
+  // object. Must be called before BeginTransfer().
+  void set_connection_cache(LibcurlConnectionCache* connection_cache) {
+    connection_cache_ = connection_cache;
+  }
+
+  // Negotiates HTTP/2 with the server for https:// URLs, falling back to
+  // HTTP/1.1 if the server or libcurl don't support it. The transfers of the
+  // fetchers sharing a connection cache are then multiplexed on one
+  // connection to the same host. Must be called before BeginTransfer().
+  void set_http2_enabled(bool http2_enabled) { http2_enabled_ = http2_enabled; }
+
+  // Sets the size of the buffer libcurl receives the data in, which is also
+  // the maximum size of the chunks passed to the delegate. Larger buffers mean
+  // fewer callbacks on large transfers. Zero keeps the libcurl default.
+  void set_receive_buffer_size(size_t receive_buffer_size) {
+    receive_buffer_size_ = receive_buffer_size;
+  }
+
+  // Drives the transfers from the libcurl socket and timer callbacks instead
+  // of asking libcurl for all its file descriptors after each perform and
+  // every idle_seconds. Each socket is then watched for as long as libcurl
+  // uses it, only the sockets with activity are processed and the timers
+  // are the ones libcurl asks for. Disabled by default. Must be called before
+  // BeginTransfer().
+  void set_socket_callbacks_enabled(bool enabled) {
+    socket_callbacks_enabled_ = enabled;
+  }
+
   size_t GetBytesDownloaded() override {
     return static_cast<size_t>(bytes_downloaded_);
   }
@@ -106,6 +137,11 @@ class LibcurlHttpFetcher : public HttpFetcher {
     max_retry_count_ = max_retry_count;
   }
 
+  void set_max_receive_speed(int max_speed_bps) override;
+
+  bool GetResponseHeader(const std::string& header_name,
+                         std::string* header_value) const override;
+
  private:
   // Callback for when proxy resolution has completed. This begins the
   // transfer.
@@ -141,11 +177,44 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // This method will not block.
   void CurlPerformOnce();
 
+  // Completes the transfer once libcurl has no more work to do on it, as
+  // reported by curl_multi_perform or curl_multi_socket_action in
+  // |running_handles|. Otherwise, sets up the message loop sources for the
+  // future work, unless the socket callbacks do it.
+  void CurlPerformed(int running_handles);
+
   // Sets up message loop sources as needed by libcurl. This is generally
   // the file descriptor of the socket and a timer in case nothing happens
   // on the fds.
   void SetupMessageLoopSources();
 
+  // The libcurl socket and timer callbacks, see set_socket_callbacks_enabled().
+  // libcurl calls them from its API functions to tell which events to watch
+  // on each of its sockets, and when to call it back.
+  static int StaticCurlSocketCallback(CURL* easy,
+                                      curl_socket_t socket,
+                                      int what,
+                                      void* userp,
+                                      void* socketp);
+  static int StaticCurlTimerCallback(CURLM* multi,
+                                     long timeout_ms,  // NOLINT(runtime/int)
+                                     void* userp);
+  void CurlSocketCallback(curl_socket_t socket, int what);
+  void CurlTimerCallback(long timeout_ms);  // NOLINT(runtime/int)
+
+  // Watches the |socket| for the events libcurl asked for while there is a
+  // transfer, and stops watching it otherwise.
+  void UpdateSocketWatches(curl_socket_t socket);
+
+  // Called when the |socket| is ready for the |event|, a CURL_CSELECT_* value,
+  // or when the libcurl timer expires.
+  void OnSocketReady(curl_socket_t socket, int event);
+  void OnCurlTimer();
+
+  // Lets libcurl process the |event| on the |socket|, or the expired timers
+  // for CURL_SOCKET_TIMEOUT, then continues as CurlPerformOnce() does.
+  void CurlSocketAction(curl_socket_t socket, int event);
+
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void *ptr, size_t size, size_t nmemb);
   static size_t StaticLibcurlWrite(void *ptr, size_t size,
@@ -154,8 +223,18 @@ class LibcurlHttpFetcher : public HttpFetcher {
         LibcurlWrite(ptr, size, nmemb);
   }
 
+  // Callback called by libcurl for each header line of the responses.
+  size_t LibcurlHeader(void *ptr, size_t size, size_t nmemb);
+  static size_t StaticLibcurlHeader(void *ptr, size_t size,
+                                    size_t nmemb, void *stream) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(stream)->
+        LibcurlHeader(ptr, size, nmemb);
+  }
+
   // Cleans up the following if they are non-null:
-  // curl(m) handles, fd_task_maps_, timeout_id_.
+  // curl handle, fd_task_maps_, timeout_id_. The curl multi handle is kept
+  // until this object is destroyed so its idle connections to the server are
+  // reused by the next transfers.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -172,6 +251,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Sets the curl options for file URI.
   void SetCurlOptionsForFile();
 
+  // Sets the curl options to negotiate HTTP/2.
+  void SetCurlOptionsForHttp2();
+
   // Convert a proxy URL into a curl proxy type, if applicable. Returns true iff
   // conversion was successful, false otherwise (in which case nothing is
   // written to |out_type|).
@@ -180,6 +262,32 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Hardware interface used to query dev-mode and official build settings.
   HardwareInterface* hardware_;
 
+  // The caches shared with other fetchers, if any.
+  LibcurlConnectionCache* connection_cache_{nullptr};
+
+  // Whether HTTP/2 should be negotiated, see set_http2_enabled().
+  bool http2_enabled_{false};
+
+  // The libcurl receive buffer size, or zero for the default.
+  size_t receive_buffer_size_{0};
+
+  // Whether the socket and timer callbacks are used, see
+  // set_socket_callbacks_enabled().
+  bool socket_callbacks_enabled_{false};
+
+  // The events libcurl asked to watch on one of its sockets, and the read(0)
+  // and write(1) watches set up for them while there is a transfer.
+  struct SocketWatch {
+    int what{CURL_POLL_NONE};
+    brillo::MessageLoop::TaskId task_ids[2] = {
+        brillo::MessageLoop::kTaskIdNull, brillo::MessageLoop::kTaskIdNull};
+  };
+  std::map<curl_socket_t, SocketWatch> sockets_;
+
+  // The TaskId of the timer libcurl asked for with the socket callbacks, if
+  // any.
+  brillo::MessageLoop::TaskId curl_timer_id_{brillo::MessageLoop::kTaskIdNull};
+
   // Handles for the libcurl library
   CURLM* curl_multi_handle_{nullptr};
   CURL* curl_handle_{nullptr};
@@ -188,6 +296,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // The extra headers that will be sent on each request.
   std::map<std::string, std::string> extra_headers_;
 
+  // The headers of the last response, keyed by their lowercase name.
+  std::map<std::string, std::string> response_headers_;
+
   // Lists of all read(0)/write(1) file descriptors that we're waiting on from
   // the message loop. libcurl may open/close descriptors and switch their
   // directions so maintain two separate lists so that watch conditions can be
@@ -259,6 +370,7 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int low_speed_limit_bps_{kDownloadLowSpeedLimitBps};
   int low_speed_time_seconds_{kDownloadLowSpeedTimeSeconds};
   int connect_timeout_seconds_{kDownloadConnectTimeoutSeconds};
+  int max_receive_speed_bps_{0};
   int num_max_retries_;
 
   DISALLOW_COPY_AND_ASSIGN(LibcurlHttpFetcher);
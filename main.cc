@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <xz.h>
 
+#include <memory>
 #include <string>
 
 #include <base/at_exit.h>
@@ -29,6 +30,7 @@
 #include <base/strings/stringprintf.h>
 #include <brillo/flag_helper.h>
 
+#include "update_engine/common/async_log_sink.h"
 #include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/daemon.h"
@@ -76,7 +78,8 @@ string SetupLogFile(const string& kLogsRoot) {
   return kLogSymlink;
 }
 
-void SetupLogging(bool log_to_std_err) {
+// Returns the log file, or an empty string when logging to stderr.
+string SetupLogging(bool log_to_std_err) {
   string log_file;
   logging::LoggingSettings log_settings;
   log_settings.lock_log = logging::DONT_LOCK_LOG_FILE;
@@ -93,6 +96,7 @@ void SetupLogging(bool log_to_std_err) {
   }
 
   logging::InitLogging(log_settings);
+  return log_file;
 }
 
 }  // namespace
@@ -103,13 +107,28 @@ int main(int argc, char** argv) {
               "Write logs to stderr instead of to a file in log_dir.");
   DEFINE_bool(foreground, false,
               "Don't daemon()ize; run in foreground.");
+  DEFINE_bool(async_logging, false,
+              "Write the log messages below ERROR from a writer thread, "
+              "rate limiting the repeated ones.");
 
   chromeos_update_engine::Terminator::Init();
   brillo::FlagHelper::Init(argc, argv, "Chromium OS Update Engine");
-  chromeos_update_engine::SetupLogging(FLAGS_logtostderr);
+  const string log_file =
+      chromeos_update_engine::SetupLogging(FLAGS_logtostderr);
   if (!FLAGS_foreground)
     PLOG_IF(FATAL, daemon(0, 0) == 1) << "daemon() failed";
 
+  // The writer thread must be started after daemon().
+  std::unique_ptr<chromeos_update_engine::AsyncLogSink> async_log_sink;
+  if (FLAGS_async_logging) {
+    async_log_sink.reset(new chromeos_update_engine::AsyncLogSink(
+        log_file,
+        chromeos_update_engine::kAsyncLogSinkCapacity,
+        chromeos_update_engine::kAsyncLogSinkMaxMessagesPerSecond));
+    if (!async_log_sink->Init())
+      async_log_sink.reset();
+  }
+
   LOG(INFO) << "Chrome OS Update Engine starting";
 
   // xz-embedded requires to initialize its CRC-32 table once on startup.
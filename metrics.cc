@@ -16,6 +16,7 @@
 
 #include "update_engine/metrics.h"
 
+#include <map>
 #include <string>
 
 #include <base/logging.h>
@@ -24,8 +25,12 @@
 #include "update_engine/common/clock_interface.h"
 #include "update_engine/common/constants.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/throughput_estimator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/system_state.h"
 
 using std::string;
@@ -75,6 +80,7 @@ const char kMetricAttemptInternalErrorCode[] =
     "UpdateEngine.Attempt.InternalErrorCode";
 const char kMetricAttemptDownloadErrorCode[] =
     "UpdateEngine.Attempt.DownloadErrorCode";
+const char kMetricAttemptPeakMemoryKiB[] = "UpdateEngine.Attempt.PeakMemoryKiB";
 
 // UpdateEngine.SuccessfulUpdate.* metrics.
 const char kMetricSuccessfulUpdateAttemptCount[] =
@@ -107,6 +113,55 @@ const char kMetricCertificateCheckUpdateCheck[] =
 const char kMetricCertificateCheckDownload[] =
     "UpdateEngine.CertificateCheck.Download";
 
+// UpdateEngine.InstallOperation.* metrics.
+const char kMetricInstallOperationWallTimeSeconds[] =
+    "UpdateEngine.InstallOperation.WallTimeSeconds";
+const char kMetricInstallOperationCpuTimeSeconds[] =
+    "UpdateEngine.InstallOperation.CpuTimeSeconds";
+const char kMetricInstallOperationThroughputKBps[] =
+    "UpdateEngine.InstallOperation.ThroughputKBps";
+const char kMetricInstallOperationPartitionReadMiB[] =
+    "UpdateEngine.InstallOperation.PartitionReadMiB";
+const char kMetricInstallOperationWriteMiB[] =
+    "UpdateEngine.InstallOperation.WriteMiB";
+const char kMetricInstallOperationCheckpointCount[] =
+    "UpdateEngine.InstallOperation.CheckpointCount";
+const char kMetricInstallOperationCheckpointTimeSeconds[] =
+    "UpdateEngine.InstallOperation.CheckpointTimeSeconds";
+
+// UpdateEngine.Verification.* metrics.
+const char kMetricVerificationThroughputKBps[] =
+    "UpdateEngine.Verification.ThroughputKBps";
+
+// UpdateEngine.Action.* metrics.
+const char kMetricActionWallTimeMs[] = "UpdateEngine.Action.WallTimeMs";
+const char kMetricActionCpuTimeMs[] = "UpdateEngine.Action.CpuTimeMs";
+const char kMetricActionStorageReadKiB[] =
+    "UpdateEngine.Action.StorageReadKiB";
+const char kMetricActionStorageWriteKiB[] =
+    "UpdateEngine.Action.StorageWriteKiB";
+const char kMetricActionPeakRssGrowthKiB[] =
+    "UpdateEngine.Action.PeakRssGrowthKiB";
+
+// UpdateEngine.Transfer.* metrics.
+const char kMetricTransferTimeToFirstByteMs[] =
+    "UpdateEngine.Transfer.TimeToFirstByteMs";
+const char kMetricTransferThroughputKBps[] =
+    "UpdateEngine.Transfer.ThroughputKBps";
+const char kMetricTransferStallCount[] = "UpdateEngine.Transfer.StallCount";
+const char kMetricTransferStallTimeSeconds[] =
+    "UpdateEngine.Transfer.StallTimeSeconds";
+const char kMetricTransferWastedBytesKiB[] =
+    "UpdateEngine.Transfer.WastedBytesKiB";
+
+// UpdateEngine.Policy.* metrics.
+const char kMetricPolicyEvaluationCount[] =
+    "UpdateEngine.Policy.EvaluationCount";
+const char kMetricPolicySkippedEvaluationCount[] =
+    "UpdateEngine.Policy.SkippedEvaluationCount";
+const char kMetricPolicyEvaluationTimeMs[] =
+    "UpdateEngine.Policy.EvaluationTimeMs";
+
 // UpdateEngine.* metrics.
 const char kMetricFailedUpdateCount[] = "UpdateEngine.FailedUpdateCount";
 const char kMetricInstallDateProvisioningSource[] =
@@ -521,6 +576,301 @@ void ReportCertificateCheckMetrics(SystemState* system_state,
       static_cast<int>(CertificateCheckResult::kNumConstants));
 }
 
+namespace {
+
+// Reports the install operation metrics of the |totals| of the operation type
+// or partition named |suffix|.
+void ReportInstallOperationTotals(SystemState* system_state,
+                                  const string& suffix,
+                                  const OperationStats::Totals& totals) {
+  string metric = string(kMetricInstallOperationWallTimeSeconds) + "." + suffix;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(totals.wall_time)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(totals.wall_time.InSeconds()),
+      0,     // min: 0 seconds
+      3600,  // max: 1 hour
+      50);   // num_buckets
+
+  metric = string(kMetricInstallOperationCpuTimeSeconds) + "." + suffix;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(totals.cpu_time)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(totals.cpu_time.InSeconds()),
+      0,     // min: 0 seconds
+      3600,  // max: 1 hour
+      50);   // num_buckets
+
+  if (totals.wall_time.InMilliseconds() > 0) {
+    int64_t kbps = totals.bytes_written * 1000 /
+                   totals.wall_time.InMilliseconds() / 1024;
+    metric = string(kMetricInstallOperationThroughputKBps) + "." + suffix;
+    LOG(INFO) << "Uploading " << kbps << " KB/s for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(kbps),
+        0,        // min: 0 KB/s
+        1000000,  // max: 1 GB/s
+        50);      // num_buckets
+  }
+
+  // The payload data is accounted by the download metrics, so only the bytes
+  // read from the source or target partitions are reported.
+  const uint64_t partition_read_mib =
+      (totals.bytes_read - totals.payload_bytes_read) / kNumBytesInOneMiB;
+  metric = string(kMetricInstallOperationPartitionReadMiB) + "." + suffix;
+  LOG(INFO) << "Uploading " << partition_read_mib << " MiB for metric "
+            << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(partition_read_mib),
+      0,      // min: 0 MiB
+      16384,  // max: 16 GiB
+      50);    // num_buckets
+
+  const uint64_t write_mib = totals.bytes_written / kNumBytesInOneMiB;
+  metric = string(kMetricInstallOperationWriteMiB) + "." + suffix;
+  LOG(INFO) << "Uploading " << write_mib << " MiB for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(write_mib),
+      0,      // min: 0 MiB
+      16384,  // max: 16 GiB
+      50);    // num_buckets
+}
+
+}  // namespace
+
+void ReportInstallOperationMetrics(SystemState* system_state,
+                                   const OperationStats& stats) {
+  for (const auto& type_totals : stats.totals_by_type()) {
+    ReportInstallOperationTotals(system_state,
+                                 InstallOperationTypeName(type_totals.first),
+                                 type_totals.second);
+  }
+  for (const auto& partition_totals : stats.totals_by_partition()) {
+    ReportInstallOperationTotals(system_state,
+                                 "Partition." + partition_totals.first,
+                                 partition_totals.second);
+  }
+
+  const OperationStats::Totals checkpoints = stats.checkpoint_totals();
+  if (checkpoints.num_operations > 0) {
+    string metric = kMetricInstallOperationCheckpointCount;
+    LOG(INFO) << "Uploading " << checkpoints.num_operations << " for metric "
+              << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(checkpoints.num_operations),
+        0,       // min: 0 checkpoints
+        100000,  // max: 100000 checkpoints
+        50);     // num_buckets
+
+    metric = kMetricInstallOperationCheckpointTimeSeconds;
+    LOG(INFO) << "Uploading " << utils::FormatTimeDelta(checkpoints.wall_time)
+              << " for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(checkpoints.wall_time.InSeconds()),
+        0,    // min: 0 seconds
+        600,  // max: 10 minutes
+        50);  // num_buckets
+  }
+}
+
+void ReportVerificationMetrics(SystemState* system_state,
+                               const FilesystemVerifierAction& action) {
+  const string prefix =
+      string(kMetricVerificationThroughputKBps) +
+      (action.verifier_mode() == VerifierMode::kComputeSourceHash ? ".Source."
+                                                                  : ".Target.");
+  for (const auto& partition_stats : action.partition_stats()) {
+    const FilesystemVerifierAction::PartitionStats& stats =
+        partition_stats.second;
+    const int64_t ms = (stats.end_time - stats.start_time).InMilliseconds();
+    if (ms <= 0)
+      continue;
+    int64_t kbps = stats.bytes * 1000 / ms / 1024;
+    string metric = prefix + partition_stats.first;
+    LOG(INFO) << "Uploading " << kbps << " KB/s for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(kbps),
+        0,        // min: 0 KB/s
+        1000000,  // max: 1 GB/s
+        50);      // num_buckets
+  }
+}
+
+void ReportActionResourceUsageMetrics(SystemState* system_state,
+                                      const string& action_type,
+                                      const ResourceUsage& start,
+                                      const ResourceUsage& end) {
+  const base::TimeDelta wall_time = end.time - start.time;
+  string metric = string(kMetricActionWallTimeMs) + "." + action_type;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(wall_time)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(wall_time.InMilliseconds()),
+      0,        // min: 0 ms
+      3600000,  // max: 1 hour
+      50);      // num_buckets
+
+  const base::TimeDelta cpu_time = end.cpu_time - start.cpu_time;
+  metric = string(kMetricActionCpuTimeMs) + "." + action_type;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(cpu_time)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(cpu_time.InMilliseconds()),
+      0,        // min: 0 ms
+      3600000,  // max: 1 hour
+      50);      // num_buckets
+
+  const uint64_t read_kib =
+      (end.storage_read_bytes - start.storage_read_bytes) / 1024;
+  metric = string(kMetricActionStorageReadKiB) + "." + action_type;
+  LOG(INFO) << "Uploading " << read_kib << " KiB for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(read_kib),
+      0,         // min: 0 KiB
+      16777216,  // max: 16 GiB
+      50);       // num_buckets
+
+  const uint64_t write_kib =
+      (end.storage_write_bytes - start.storage_write_bytes) / 1024;
+  metric = string(kMetricActionStorageWriteKiB) + "." + action_type;
+  LOG(INFO) << "Uploading " << write_kib << " KiB for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(write_kib),
+      0,         // min: 0 KiB
+      16777216,  // max: 16 GiB
+      50);       // num_buckets
+
+  const int64_t rss_growth_kib = end.peak_rss_kb - start.peak_rss_kb;
+  metric = string(kMetricActionPeakRssGrowthKiB) + "." + action_type;
+  LOG(INFO) << "Uploading " << rss_growth_kib << " KiB for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(rss_growth_kib),
+      0,        // min: 0 KiB
+      1048576,  // max: 1 GiB
+      50);      // num_buckets
+}
+
+void ReportAttemptMemoryMetrics(SystemState* system_state,
+                                const std::map<string, uint64_t>& peaks) {
+  for (const auto& consumer_peak : peaks) {
+    const uint64_t kib = consumer_peak.second / 1024;
+    string metric = string(kMetricAttemptPeakMemoryKiB) + "." +
+                    consumer_peak.first;
+    LOG(INFO) << "Uploading " << kib << " KiB for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(kib),
+        0,        // min: 0 KiB
+        1048576,  // max: 1 GiB
+        50);      // num_buckets
+  }
+}
+
+void ReportDownloadTransferMetrics(SystemState* system_state,
+                                   const TransferStats& stats) {
+  if (stats.bytes_received == 0)
+    return;
+
+  string metric = kMetricTransferTimeToFirstByteMs;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(stats.time_to_first_byte)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(stats.time_to_first_byte.InMilliseconds()),
+      0,      // min: 0 ms
+      60000,  // max: 1 minute
+      50);    // num_buckets
+
+  if (stats.throughput_bps > 0) {
+    int64_t kbps = stats.throughput_bps / 1024;
+    metric = kMetricTransferThroughputKBps;
+    LOG(INFO) << "Uploading " << kbps << " KB/s for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(kbps),
+        0,        // min: 0 KB/s
+        1000000,  // max: 1 GB/s
+        50);      // num_buckets
+  }
+
+  metric = kMetricTransferStallCount;
+  LOG(INFO) << "Uploading " << stats.num_stalls << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      stats.num_stalls,
+      0,    // min: 0 stalls
+      100,  // max: 100 stalls
+      50);  // num_buckets
+
+  if (stats.num_stalls > 0) {
+    metric = kMetricTransferStallTimeSeconds;
+    LOG(INFO) << "Uploading " << utils::FormatTimeDelta(stats.stall_time)
+              << " for metric " << metric;
+    system_state->metrics_lib()->SendToUMA(
+        metric,
+        static_cast<int>(stats.stall_time.InSeconds()),
+        0,     // min: 0 seconds
+        3600,  // max: 1 hour
+        50);   // num_buckets
+  }
+
+  metric = kMetricTransferWastedBytesKiB;
+  LOG(INFO) << "Uploading " << stats.bytes_wasted << " bytes wasted for metric "
+            << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(stats.bytes_wasted / 1024),
+      0,        // min: 0 KiB
+      1048576,  // max: 1 GiB
+      50);      // num_buckets
+}
+
+void ReportPolicyEvaluationMetrics(
+    SystemState* system_state,
+    const chromeos_update_manager::PolicyStats::Summary& summary) {
+  string metric = kMetricPolicyEvaluationCount;
+  LOG(INFO) << "Uploading " << summary.evaluations << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      summary.evaluations,
+      0,      // min: 0 evaluations
+      10000,  // max: 10000 evaluations
+      50);    // num_buckets
+
+  metric = kMetricPolicySkippedEvaluationCount;
+  LOG(INFO) << "Uploading " << summary.skipped_evaluations << " for metric "
+            << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      summary.skipped_evaluations,
+      0,      // min: 0 evaluations
+      10000,  // max: 10000 evaluations
+      50);    // num_buckets
+
+  metric = kMetricPolicyEvaluationTimeMs;
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(summary.evaluation_time)
+            << " for metric " << metric;
+  system_state->metrics_lib()->SendToUMA(
+      metric,
+      static_cast<int>(summary.evaluation_time.InMilliseconds()),
+      0,      // min: 0 ms
+      60000,  // max: 1 minute
+      50);    // num_buckets
+}
+
 }  // namespace metrics
 
 }  // namespace chromeos_update_engine
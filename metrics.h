@@ -17,15 +17,23 @@
 #ifndef UPDATE_ENGINE_METRICS_H_
 #define UPDATE_ENGINE_METRICS_H_
 
+#include <map>
+#include <string>
+
 #include <base/time/time.h>
 
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/constants.h"
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/resource_usage.h"
+#include "update_engine/update_manager/policy_stats.h"
 
 namespace chromeos_update_engine {
 
+class FilesystemVerifierAction;
+class OperationStats;
 class SystemState;
+struct TransferStats;
 
 namespace metrics {
 
@@ -54,6 +62,7 @@ extern const char kMetricAttemptDownloadSource[];
 extern const char kMetricAttemptResult[];
 extern const char kMetricAttemptInternalErrorCode[];
 extern const char kMetricAttemptDownloadErrorCode[];
+extern const char kMetricAttemptPeakMemoryKiB[];
 
 // UpdateEngine.SuccessfulUpdate.* metrics.
 extern const char kMetricSuccessfulUpdateAttemptCount[];
@@ -70,6 +79,37 @@ extern const char kMetricSuccessfulUpdateUrlSwitchCount[];
 // UpdateEngine.Rollback.* metric.
 extern const char kMetricRollbackResult[];
 
+// UpdateEngine.InstallOperation.* metrics.
+extern const char kMetricInstallOperationWallTimeSeconds[];
+extern const char kMetricInstallOperationCpuTimeSeconds[];
+extern const char kMetricInstallOperationThroughputKBps[];
+extern const char kMetricInstallOperationPartitionReadMiB[];
+extern const char kMetricInstallOperationWriteMiB[];
+extern const char kMetricInstallOperationCheckpointCount[];
+extern const char kMetricInstallOperationCheckpointTimeSeconds[];
+
+// UpdateEngine.Verification.* metrics.
+extern const char kMetricVerificationThroughputKBps[];
+
+// UpdateEngine.Action.* metrics.
+extern const char kMetricActionWallTimeMs[];
+extern const char kMetricActionCpuTimeMs[];
+extern const char kMetricActionStorageReadKiB[];
+extern const char kMetricActionStorageWriteKiB[];
+extern const char kMetricActionPeakRssGrowthKiB[];
+
+// UpdateEngine.Transfer.* metrics.
+extern const char kMetricTransferTimeToFirstByteMs[];
+extern const char kMetricTransferThroughputKBps[];
+extern const char kMetricTransferStallCount[];
+extern const char kMetricTransferStallTimeSeconds[];
+extern const char kMetricTransferWastedBytesKiB[];
+
+// UpdateEngine.Policy.* metrics.
+extern const char kMetricPolicyEvaluationCount[];
+extern const char kMetricPolicySkippedEvaluationCount[];
+extern const char kMetricPolicyEvaluationTimeMs[];
+
 // UpdateEngine.* metrics.
 extern const char kMetricFailedUpdateCount[];
 extern const char kMetricInstallDateProvisioningSource[];
@@ -314,6 +354,82 @@ void ReportCertificateCheckMetrics(SystemState* system_state,
                                    ServerToCheck server_to_check,
                                    CertificateCheckResult result);
 
+// Helper function to report the time spent applying the install operations of
+// a payload, from the |stats| of the DeltaPerformer that applied it. The
+// following metrics are reported for each operation type, suffixed with the
+// type name, and for each partition, suffixed with "Partition." and the
+// partition name:
+//
+//  |kMetricInstallOperationWallTimeSeconds|
+//  |kMetricInstallOperationCpuTimeSeconds|
+//  |kMetricInstallOperationThroughputKBps|
+//  |kMetricInstallOperationPartitionReadMiB|
+//  |kMetricInstallOperationWriteMiB|
+//
+// The |kMetricInstallOperationCheckpointCount| and
+// |kMetricInstallOperationCheckpointTimeSeconds| metrics are reported once if
+// any checkpoint was saved.
+void ReportInstallOperationMetrics(SystemState* system_state,
+                                   const OperationStats& stats);
+
+// Helper function to report the resources used by the process while the
+// action of type |action_type| ran, from the usage sampled when it |start|ed
+// and at its |end|. The following metrics are reported, suffixed with the
+// action type:
+//
+//  |kMetricActionWallTimeMs|
+//  |kMetricActionCpuTimeMs|
+//  |kMetricActionStorageReadKiB|
+//  |kMetricActionStorageWriteKiB|
+//  |kMetricActionPeakRssGrowthKiB|
+void ReportActionResourceUsageMetrics(SystemState* system_state,
+                                      const std::string& action_type,
+                                      const ResourceUsage& start,
+                                      const ResourceUsage& end);
+
+// Helper function to report the read throughput of the partitions hashed by
+// the |action| that completed successfully. The following metric is reported
+// for each partition hashed, suffixed with "Source." or "Target." and the
+// partition name:
+//
+//  |kMetricVerificationThroughputKBps|
+void ReportVerificationMetrics(SystemState* system_state,
+                               const FilesystemVerifierAction& action);
+
+// Helper function to report the |peaks| of the memory held by each consumer
+// tracked by the MemoryTracker during an update attempt, by consumer name. The
+// following metric is reported for each consumer, suffixed with its name:
+//
+//  |kMetricAttemptPeakMemoryKiB|
+void ReportAttemptMemoryMetrics(SystemState* system_state,
+                                const std::map<std::string, uint64_t>& peaks);
+
+// Helper function to report the network statistics of a payload download,
+// from the |stats| of the HttpFetcher that downloaded it, whether it
+// succeeded or not. The following metrics are reported:
+//
+//  |kMetricTransferTimeToFirstByteMs|
+//  |kMetricTransferThroughputKBps|
+//  |kMetricTransferStallCount|
+//  |kMetricTransferStallTimeSeconds|
+//  |kMetricTransferWastedBytesKiB|
+//
+// Nothing is reported for a download which received no data.
+void ReportDownloadTransferMetrics(SystemState* system_state,
+                                   const TransferStats& stats);
+
+// Helper function to report the cost of the policy evaluations done since the
+// previous report, from the |summary| of the UpdateManager's PolicyStats. This
+// is reported every time an update check is scheduled. The following metrics
+// are reported:
+//
+//  |kMetricPolicyEvaluationCount|
+//  |kMetricPolicySkippedEvaluationCount|
+//  |kMetricPolicyEvaluationTimeMs|
+void ReportPolicyEvaluationMetrics(
+    SystemState* system_state,
+    const chromeos_update_manager::PolicyStats::Summary& summary);
+
 }  // namespace metrics
 
 }  // namespace chromeos_update_engine
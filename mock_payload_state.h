@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_MOCK_PAYLOAD_STATE_H_
 
 #include <string>
+#include <vector>
 
 #include <gmock/gmock.h>
 
@@ -36,6 +37,7 @@ class MockPayloadState: public PayloadStateInterface {
   MOCK_METHOD1(SetResponse, void(const OmahaResponse& response));
   MOCK_METHOD0(DownloadComplete, void());
   MOCK_METHOD1(DownloadProgress, void(size_t count));
+  MOCK_METHOD1(DownloadTransferEnded, void(const TransferStats& stats));
   MOCK_METHOD0(UpdateResumed, void());
   MOCK_METHOD0(UpdateRestarted, void());
   MOCK_METHOD0(UpdateSucceeded, void());
@@ -52,12 +54,14 @@ class MockPayloadState: public PayloadStateInterface {
   MOCK_METHOD1(SetUsingP2PForSharing, void(bool value));
   MOCK_METHOD1(SetScatteringWaitPeriod, void(base::TimeDelta));
   MOCK_METHOD1(SetP2PUrl, void(const std::string&));
+  MOCK_METHOD1(SwitchToUrl, void(uint32_t url_index));
 
   // Getters.
   MOCK_METHOD0(GetResponseSignature, std::string());
   MOCK_METHOD0(GetPayloadAttemptNumber, int());
   MOCK_METHOD0(GetFullPayloadAttemptNumber, int());
   MOCK_METHOD0(GetCurrentUrl, std::string());
+  MOCK_METHOD0(GetCandidateUrls, std::vector<std::string>());
   MOCK_METHOD0(GetUrlFailureCount, uint32_t());
   MOCK_METHOD0(GetUrlSwitchCount, uint32_t());
   MOCK_METHOD0(GetNumResponsesSeen, int());
@@ -42,6 +42,11 @@ class MockUpdateAttempter : public UpdateAttempter {
                                std::string* new_version,
                                int64_t* new_size));
 
+  MOCK_METHOD2(GetDownloadRate, bool(int64_t* current_rate_bps,
+                                     int64_t* target_rate_bps));
+
+  MOCK_METHOD1(SetFastMode, void(bool fast_mode));
+
   MOCK_METHOD1(GetBootTimeAtUpdate, bool(base::Time* out_boot_time));
 
   MOCK_METHOD0(ResetStatus, bool(void));
@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <map>
 #include <sstream>
 #include <string>
@@ -34,7 +35,9 @@
 #include <metrics/metrics_library.h>
 
 #include "update_engine/common/action_pipe.h"
+#include "update_engine/common/clock_interface.h"
 #include "update_engine/common/constants.h"
+#include "update_engine/common/gzip.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/platform_constants.h"
@@ -79,46 +82,122 @@ static const char* kOmahaUpdaterVersion = "0.1.0.0";
 
 namespace {
 
-// Returns an XML ping element attribute assignment with attribute
-// |name| and value |ping_days| if |ping_days| has a value that needs
-// to be sent, or an empty string otherwise.
-string GetPingAttribute(const string& name, int ping_days) {
-  if (ping_days > 0 || ping_days == OmahaRequestAction::kNeverPinged)
-    return base::StringPrintf(" %s=\"%d\"", name.c_str(), ping_days);
-  return "";
+// Initial capacity of the request buffer, enough for a request with a few
+// queued events without reallocating.
+const size_t kRequestXmlReserveSize = 4096;
+
+// Appends the XML-escaped |input| to |output|. Returns false, appending
+// nothing, if |input| isn't a valid ASCII-7 string.
+bool XmlEncodeAppend(const string& input, string* output) {
+  if (std::find_if(input.begin(), input.end(),
+                   [](const char c){return c & 0x80;}) != input.end()) {
+    LOG(WARNING) << "Invalid ASCII-7 string passed to the XML encoder:";
+    utils::HexDumpString(input);
+    return false;
+  }
+  // Copy the runs of characters that don't need escaping at once.
+  size_t run_start = 0;
+  for (size_t i = 0; i < input.size(); i++) {
+    const char* entity;
+    switch (input[i]) {
+      case '\"':
+        entity = "&quot;";
+        break;
+      case '\'':
+        entity = "&apos;";
+        break;
+      case '&':
+        entity = "&amp;";
+        break;
+      case '<':
+        entity = "&lt;";
+        break;
+      case '>':
+        entity = "&gt;";
+        break;
+      default:
+        continue;
+    }
+    output->append(input, run_start, i - run_start);
+    output->append(entity);
+    run_start = i + 1;
+  }
+  output->append(input, run_start, string::npos);
+  return true;
 }
 
-// Returns an XML ping element if any of the elapsed days need to be
-// sent, or an empty string otherwise.
-string GetPingXml(int ping_active_days, int ping_roll_call_days) {
-  string ping_active = GetPingAttribute("a", ping_active_days);
-  string ping_roll_call = GetPingAttribute("r", ping_roll_call_days);
-  if (!ping_active.empty() || !ping_roll_call.empty()) {
-    return base::StringPrintf("        <ping active=\"1\"%s%s></ping>\n",
-                              ping_active.c_str(),
-                              ping_roll_call.c_str());
-  }
-  return "";
+// Appends to |xml| the attribute assignment |name|="|value|" followed by a
+// space, with the |value| XML-escaped or replaced by |default_value| if it
+// can't be.
+void AppendXmlAttribute(const char* name,
+                        const string& value,
+                        const char* default_value,
+                        string* xml) {
+  xml->append(name);
+  xml->append("=\"");
+  if (!XmlEncodeAppend(value, xml))
+    xml->append(default_value);
+  xml->append("\" ");
 }
 
-// Returns an XML that goes into the body of the <app> element of the Omaha
-// request based on the given parameters.
-string GetAppBody(const OmahaEvent* event,
-                  OmahaRequestParams* params,
-                  bool ping_only,
-                  bool include_ping,
-                  int ping_active_days,
-                  int ping_roll_call_days,
-                  PrefsInterface* prefs) {
-  string app_body;
+// Appends to |xml| an XML ping element attribute assignment with attribute
+// |name| and value |ping_days| if |ping_days| has a value that needs to be
+// sent. Returns whether it was appended.
+bool AppendPingAttribute(const char* name, int ping_days, string* xml) {
+  if (ping_days > 0 || ping_days == OmahaRequestAction::kNeverPinged) {
+    base::StringAppendF(xml, " %s=\"%d\"", name, ping_days);
+    return true;
+  }
+  return false;
+}
+
+// Appends to |xml| an XML ping element if any of the elapsed days need to be
+// sent.
+void AppendPingXml(int ping_active_days,
+                   int ping_roll_call_days,
+                   string* xml) {
+  const size_t start = xml->size();
+  xml->append("        <ping active=\"1\"");
+  bool has_ping = AppendPingAttribute("a", ping_active_days, xml);
+  has_ping |= AppendPingAttribute("r", ping_roll_call_days, xml);
+  if (has_ping)
+    xml->append("></ping>\n");
+  else
+    xml->resize(start);
+}
+
+// Appends to |xml| the <event> element of |event|.
+void AppendEventXml(const OmahaEvent& event, string* xml) {
+  base::StringAppendF(xml, "        <event eventtype=\"%d\" eventresult=\"%d\"",
+                      event.type, event.result);
+  // The error code is an optional attribute so append it only if the result
+  // is not success.
+  if (event.result != OmahaEvent::kResultSuccess) {
+    base::StringAppendF(xml, " errorcode=\"%d\"",
+                        static_cast<int>(event.error_code));
+  }
+  xml->append("></event>\n");
+}
+
+// Appends to |xml| the XML that goes into the body of the <app> element of the
+// Omaha request based on the given parameters. The |queued_events| are sent
+// along with the update check or the |event|, before it.
+void AppendAppBody(const OmahaEvent* event,
+                   const vector<OmahaEvent>& queued_events,
+                   OmahaRequestParams* params,
+                   bool ping_only,
+                   bool include_ping,
+                   int ping_active_days,
+                   int ping_roll_call_days,
+                   PrefsInterface* prefs,
+                   string* xml) {
   if (event == nullptr) {
     if (include_ping)
-        app_body = GetPingXml(ping_active_days, ping_roll_call_days);
+      AppendPingXml(ping_active_days, ping_roll_call_days, xml);
     if (!ping_only) {
-      app_body += base::StringPrintf(
-          "        <updatecheck targetversionprefix=\"%s\""
-          "></updatecheck>\n",
-          XmlEncodeWithDefault(params->target_version_prefix(), "").c_str());
+      xml->append("        <updatecheck targetversionprefix=\"");
+      XmlEncodeAppend(params->target_version_prefix(), xml);
+      xml->append("\"></updatecheck>\n");
 
       // If this is the first update check after a reboot following a previous
       // update, generate an event containing the previous version number. If
@@ -136,45 +215,39 @@ string GetAppBody(const OmahaEvent* event,
       // update in the previous boot. After reporting it back to the server,
       // we clear the previous version value so it doesn't get reported again.
       if (!prev_version.empty()) {
-        app_body += base::StringPrintf(
-            "        <event eventtype=\"%d\" eventresult=\"%d\" "
-            "previousversion=\"%s\"></event>\n",
+        base::StringAppendF(
+            xml,
+            "        <event eventtype=\"%d\" eventresult=\"%d\" ",
             OmahaEvent::kTypeRebootedAfterUpdate,
-            OmahaEvent::kResultSuccess,
-            XmlEncodeWithDefault(prev_version, "0.0.0.0").c_str());
+            OmahaEvent::kResultSuccess);
+        AppendXmlAttribute("previousversion", prev_version, "0.0.0.0", xml);
+        // No space before the end of the tag.
+        xml->back() = '>';
+        xml->append("</event>\n");
         LOG_IF(WARNING, !prefs->SetString(kPrefsPreviousVersion, ""))
             << "Unable to reset the previous version.";
       }
     }
-  } else {
-    // The error code is an optional attribute so append it only if the result
-    // is not success.
-    string error_code;
-    if (event->result != OmahaEvent::kResultSuccess) {
-      error_code = base::StringPrintf(" errorcode=\"%d\"",
-                                      static_cast<int>(event->error_code));
-    }
-    app_body = base::StringPrintf(
-        "        <event eventtype=\"%d\" eventresult=\"%d\"%s></event>\n",
-        event->type, event->result, error_code.c_str());
   }
-
-  return app_body;
+  for (const OmahaEvent& queued_event : queued_events)
+    AppendEventXml(queued_event, xml);
+  if (event)
+    AppendEventXml(*event, xml);
 }
 
-// Returns the cohort* argument to include in the <app> tag for the passed
-// |arg_name| and |prefs_key|, if any. The return value is suitable to
-// concatenate to the list of arguments and includes a space at the end.
-string GetCohortArgXml(PrefsInterface* prefs,
-                       const string arg_name,
-                       const string prefs_key) {
+// Appends to |xml| the cohort* argument to include in the <app> tag for the
+// passed |arg_name| and |prefs_key|, if any, followed by a space.
+void AppendCohortArgXml(PrefsInterface* prefs,
+                        const char* arg_name,
+                        const string& prefs_key,
+                        string* xml) {
   // There's nothing wrong with not having a given cohort setting, so we check
   // existance first to avoid the warning log message.
   if (!prefs->Exists(prefs_key))
-    return "";
+    return;
   string cohort_value;
   if (!prefs->GetString(prefs_key, &cohort_value) || cohort_value.empty())
-    return "";
+    return;
   // This is a sanity check to avoid sending a huge XML file back to Ohama due
   // to a compromised stateful partition making the update check fail in low
   // network environments envent after a reboot.
@@ -182,34 +255,40 @@ string GetCohortArgXml(PrefsInterface* prefs,
     LOG(WARNING) << "The omaha cohort setting " << arg_name
                  << " has a too big value, which must be an error or an "
                     "attacker trying to inhibit updates.";
-    return "";
+    return;
   }
 
-  string escaped_xml_value;
-  if (!XmlEncode(cohort_value, &escaped_xml_value)) {
+  const size_t start = xml->size();
+  xml->append(arg_name);
+  xml->append("=\"");
+  if (!XmlEncodeAppend(cohort_value, xml)) {
     LOG(WARNING) << "The omaha cohort setting " << arg_name
                  << " is ASCII-7 invalid, ignoring it.";
-    return "";
+    xml->resize(start);
+    return;
   }
-
-  return base::StringPrintf("%s=\"%s\" ",
-                            arg_name.c_str(), escaped_xml_value.c_str());
+  xml->append("\" ");
 }
 
-// Returns an XML that corresponds to the entire <app> node of the Omaha
-// request based on the given parameters.
-string GetAppXml(const OmahaEvent* event,
-                 OmahaRequestParams* params,
-                 bool ping_only,
-                 bool include_ping,
-                 int ping_active_days,
-                 int ping_roll_call_days,
-                 int install_date_in_days,
-                 SystemState* system_state) {
-  string app_body = GetAppBody(event, params, ping_only, include_ping,
-                               ping_active_days, ping_roll_call_days,
-                               system_state->prefs());
-  string app_versions;
+// Appends to |xml| the XML that corresponds to the entire <app> node of the
+// Omaha request based on the given parameters.
+void AppendAppXml(const OmahaEvent* event,
+                  const vector<OmahaEvent>& queued_events,
+                  OmahaRequestParams* params,
+                  bool ping_only,
+                  bool include_ping,
+                  int ping_active_days,
+                  int ping_roll_call_days,
+                  int install_date_in_days,
+                  SystemState* system_state,
+                  string* xml) {
+  xml->append("    <app ");
+  AppendXmlAttribute("appid", params->GetAppId(), "", xml);
+  AppendCohortArgXml(system_state->prefs(), "cohort", kPrefsOmahaCohort, xml);
+  AppendCohortArgXml(system_state->prefs(), "cohorthint",
+                     kPrefsOmahaCohortHint, xml);
+  AppendCohortArgXml(system_state->prefs(), "cohortname",
+                     kPrefsOmahaCohortName, xml);
 
   // If we are upgrading to a more stable channel and we are allowed to do
   // powerwash, then pass 0.0.0.0 as the version. This is needed to get the
@@ -217,72 +296,53 @@ string GetAppXml(const OmahaEvent* event,
   if (params->to_more_stable_channel() && params->is_powerwash_allowed()) {
     LOG(INFO) << "Passing OS version as 0.0.0.0 as we are set to powerwash "
               << "on downgrading to the version in the more stable channel";
-    app_versions = "version=\"0.0.0.0\" from_version=\"" +
-        XmlEncodeWithDefault(params->app_version(), "0.0.0.0") + "\" ";
+    xml->append("version=\"0.0.0.0\" ");
+    AppendXmlAttribute("from_version", params->app_version(), "0.0.0.0", xml);
   } else {
-    app_versions = "version=\"" +
-        XmlEncodeWithDefault(params->app_version(), "0.0.0.0") + "\" ";
+    AppendXmlAttribute("version", params->app_version(), "0.0.0.0", xml);
   }
 
   string download_channel = params->download_channel();
-  string app_channels =
-      "track=\"" + XmlEncodeWithDefault(download_channel, "") + "\" ";
-  if (params->current_channel() != download_channel) {
-    app_channels += "from_track=\"" + XmlEncodeWithDefault(
-        params->current_channel(), "") + "\" ";
-  }
-
-  string delta_okay_str = params->delta_okay() ? "true" : "false";
+  AppendXmlAttribute("track", download_channel, "", xml);
+  if (params->current_channel() != download_channel)
+    AppendXmlAttribute("from_track", params->current_channel(), "", xml);
+
+  AppendXmlAttribute("lang", params->app_lang(), "en-US", xml);
+  AppendXmlAttribute("board", params->os_board(), "", xml);
+  AppendXmlAttribute("hardware_class", params->hwid(), "", xml);
+  xml->append(params->delta_okay() ? "delta_okay=\"true\" "
+                                   : "delta_okay=\"false\" ");
+  AppendXmlAttribute("fw_version", params->fw_version(), "", xml);
+  AppendXmlAttribute("ec_version", params->ec_version(), "", xml);
 
   // If install_date_days is not set (e.g. its value is -1 ), don't
   // include the attribute.
-  string install_date_in_days_str = "";
-  if (install_date_in_days >= 0) {
-    install_date_in_days_str = base::StringPrintf("installdate=\"%d\" ",
-                                                  install_date_in_days);
-  }
-
-  string app_cohort_args;
-  app_cohort_args += GetCohortArgXml(system_state->prefs(),
-                                     "cohort", kPrefsOmahaCohort);
-  app_cohort_args += GetCohortArgXml(system_state->prefs(),
-                                     "cohorthint", kPrefsOmahaCohortHint);
-  app_cohort_args += GetCohortArgXml(system_state->prefs(),
-                                     "cohortname", kPrefsOmahaCohortName);
-
-  string app_xml = "    <app "
-      "appid=\"" + XmlEncodeWithDefault(params->GetAppId(), "") + "\" " +
-      app_cohort_args +
-      app_versions +
-      app_channels +
-      "lang=\"" + XmlEncodeWithDefault(params->app_lang(), "en-US") + "\" " +
-      "board=\"" + XmlEncodeWithDefault(params->os_board(), "") + "\" " +
-      "hardware_class=\"" + XmlEncodeWithDefault(params->hwid(), "") + "\" " +
-      "delta_okay=\"" + delta_okay_str + "\" "
-      "fw_version=\"" + XmlEncodeWithDefault(params->fw_version(), "") + "\" " +
-      "ec_version=\"" + XmlEncodeWithDefault(params->ec_version(), "") + "\" " +
-      install_date_in_days_str +
-      ">\n" +
-         app_body +
-      "    </app>\n";
-
-  return app_xml;
+  if (install_date_in_days >= 0)
+    base::StringAppendF(xml, "installdate=\"%d\" ", install_date_in_days);
+  xml->append(">\n");
+
+  AppendAppBody(event, queued_events, params, ping_only, include_ping,
+                ping_active_days, ping_roll_call_days, system_state->prefs(),
+                xml);
+  xml->append("    </app>\n");
 }
 
-// Returns an XML that corresponds to the entire <os> node of the Omaha
-// request based on the given parameters.
-string GetOsXml(OmahaRequestParams* params) {
-  string os_xml ="    <os "
-      "version=\"" + XmlEncodeWithDefault(params->os_version(), "") + "\" " +
-      "platform=\"" + XmlEncodeWithDefault(params->os_platform(), "") + "\" " +
-      "sp=\"" + XmlEncodeWithDefault(params->os_sp(), "") + "\">"
-      "</os>\n";
-  return os_xml;
+// Appends to |xml| the XML that corresponds to the entire <os> node of the
+// Omaha request based on the given parameters.
+void AppendOsXml(OmahaRequestParams* params, string* xml) {
+  xml->append("    <os ");
+  AppendXmlAttribute("version", params->os_version(), "", xml);
+  AppendXmlAttribute("platform", params->os_platform(), "", xml);
+  AppendXmlAttribute("sp", params->os_sp(), "", xml);
+  // No space before the end of the tag.
+  xml->back() = '>';
+  xml->append("</os>\n");
 }
 
 // Returns an XML that corresponds to the entire Omaha request based on the
-// given parameters.
+// given parameters. The request is written in place into a single buffer.
 string GetRequestXml(const OmahaEvent* event,
+                     const vector<OmahaEvent>& queued_events,
                      OmahaRequestParams* params,
                      bool ping_only,
                      bool include_ping,
@@ -290,28 +350,25 @@ string GetRequestXml(const OmahaEvent* event,
                      int ping_roll_call_days,
                      int install_date_in_days,
                      SystemState* system_state) {
-  string os_xml = GetOsXml(params);
-  string app_xml = GetAppXml(event, params, ping_only, include_ping,
-                             ping_active_days, ping_roll_call_days,
-                             install_date_in_days, system_state);
-
-  string install_source = base::StringPrintf("installsource=\"%s\" ",
-      (params->interactive() ? "ondemandupdate" : "scheduler"));
-
-  string updater_version = XmlEncodeWithDefault(
-      base::StringPrintf("%s-%s",
-                         constants::kOmahaUpdaterID,
-                         kOmahaUpdaterVersion), "");
-  string request_xml =
-      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-      "<request protocol=\"3.0\" " + (
-          "version=\"" + updater_version + "\" "
-          "updaterversion=\"" + updater_version + "\" " +
-          install_source +
-          "ismachine=\"1\">\n") +
-      os_xml +
-      app_xml +
-      "</request>\n";
+  string request_xml;
+  request_xml.reserve(kRequestXmlReserveSize);
+
+  const string updater_version = base::StringPrintf(
+      "%s-%s", constants::kOmahaUpdaterID, kOmahaUpdaterVersion);
+  request_xml.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                     "<request protocol=\"3.0\" ");
+  AppendXmlAttribute("version", updater_version, "", &request_xml);
+  AppendXmlAttribute("updaterversion", updater_version, "", &request_xml);
+  request_xml.append(params->interactive()
+                         ? "installsource=\"ondemandupdate\" "
+                         : "installsource=\"scheduler\" ");
+  request_xml.append("ismachine=\"1\">\n");
+
+  AppendOsXml(params, &request_xml);
+  AppendAppXml(event, queued_events, params, ping_only, include_ping,
+               ping_active_days, ping_roll_call_days, install_date_in_days,
+               system_state, &request_xml);
+  request_xml.append("</request>\n");
 
   return request_xml;
 }
@@ -321,6 +378,7 @@ string GetRequestXml(const OmahaEvent* event,
 // Struct used for holding data obtained when parsing the XML.
 struct OmahaParserData {
   explicit OmahaParserData(XML_Parser _xml_parser) : xml_parser(_xml_parser) {}
+  ~OmahaParserData() { XML_ParserFree(xml_parser); }
 
   // Pointer to the expat XML_Parser object.
   XML_Parser xml_parser;
@@ -344,6 +402,7 @@ struct OmahaParserData {
   vector<string> url_codebase;
   string package_name;
   string package_size;
+  vector<map<string, string>> chained_package_attrs;
   string manifest_version;
   map<string, string> action_postinstall_attrs;
 };
@@ -393,11 +452,15 @@ void ParserHandlerStart(void* user_data, const XML_Char* element,
   } else if (data->current_path == "/response/app/updatecheck/urls/url") {
     // Look at all <url> elements.
     data->url_codebase.push_back(attrs["codebase"]);
-  } else if (data->package_name.empty() && data->current_path ==
+  } else if (data->current_path ==
              "/response/app/updatecheck/manifest/packages/package") {
-    // Only look at the first <package>.
-    data->package_name = attrs["name"];
-    data->package_size = attrs["size"];
+    // The <package> elements after the first one are chained payloads.
+    if (data->package_name.empty()) {
+      data->package_name = attrs["name"];
+      data->package_size = attrs["size"];
+    } else {
+      data->chained_package_attrs.push_back(attrs);
+    }
   } else if (data->current_path == "/response/app/updatecheck/manifest") {
     // Get the version.
     data->manifest_version = attrs[kTagVersion];
@@ -454,38 +517,11 @@ void ParserHandlerEntityDecl(void *user_data,
 }  // namespace
 
 bool XmlEncode(const string& input, string* output) {
-  if (std::find_if(input.begin(), input.end(),
-                   [](const char c){return c & 0x80;}) != input.end()) {
-    LOG(WARNING) << "Invalid ASCII-7 string passed to the XML encoder:";
-    utils::HexDumpString(input);
-    return false;
-  }
   output->clear();
-  // We need at least input.size() space in the output, but the code below will
+  // We need at least input.size() space in the output, but the encoder will
   // handle it if we need more.
   output->reserve(input.size());
-  for (char c : input) {
-    switch (c) {
-      case '\"':
-        output->append("&quot;");
-        break;
-      case '\'':
-        output->append("&apos;");
-        break;
-      case '&':
-        output->append("&amp;");
-        break;
-      case '<':
-        output->append("&lt;");
-        break;
-      case '>':
-        output->append("&gt;");
-        break;
-      default:
-        output->push_back(c);
-    }
-  }
-  return true;
+  return XmlEncodeAppend(input, output);
 }
 
 string XmlEncodeWithDefault(const string& input, const string& default_value) {
@@ -629,7 +665,26 @@ void OmahaRequestAction::PerformAction() {
     return;
   }
 
+  vector<OmahaEvent> queued_events;
+  if (event_queue_) {
+    if (defer_event_ && IsEvent()) {
+      LOG(INFO) << "Queuing the Omaha event " << event_->type
+                << " to send it with the next request.";
+      // The oldest events go first when the queue is full.
+      if (event_queue_->size() >= kMaxQueuedEvents)
+        event_queue_->erase(event_queue_->begin());
+      event_queue_->push_back(*event_);
+      processor_->ActionComplete(this, ErrorCode::kSuccess);
+      return;
+    }
+    // Like the events, the queued ones are sent on a best effort basis.
+    queued_events.swap(*event_queue_);
+    LOG_IF(INFO, !queued_events.empty())
+        << "Sending " << queued_events.size() << " queued Omaha events.";
+  }
+
   string request_post(GetRequestXml(event_.get(),
+                                    queued_events,
                                     params_,
                                     ping_only_,
                                     ShouldPing(),  // include_ping
@@ -638,10 +693,50 @@ void OmahaRequestAction::PerformAction() {
                                     GetInstallDate(system_state_),
                                     system_state_));
 
-  http_fetcher_->SetPostData(request_post.data(), request_post.size(),
-                             kHttpContentTypeTextXml);
+  // The server must see the pings and the events, and its response to a ping
+  // sets the last ping days, so only the checks without them use the cached
+  // response.
+  use_response_cache_ = !IsEvent() && !ping_only_ && !ShouldPing() &&
+                        queued_events.empty();
+  if (use_response_cache_) {
+    request_hash_ = HashCalculator::HashOfString(request_post);
+    // Interactive checks always ask the server.
+    if (!params_->interactive() && HasCachedNoUpdateResponse(true)) {
+      LOG(INFO) << "Using the cached Omaha noupdate response.";
+      ScopedActionCompleter completer(processor_, this);
+      CompleteWithCachedNoUpdateResponse(&completer);
+      return;
+    }
+    string etag;
+    if (HasCachedNoUpdateResponse(false) &&
+        system_state_->prefs()->GetString(kPrefsOmahaNoUpdateETag, &etag)) {
+      http_fetcher_->SetHeader("If-None-Match", etag);
+    }
+  }
+
+  // The request is only compressed once the server said it accepts it, as
+  // the compressed requests are rejected by the servers that don't.
+  http_fetcher_->SetHeader("Accept-Encoding", "gzip, deflate");
+  string gzip_requests_url;
+  brillo::Blob compressed_post;
+  request_compressed_ =
+      system_state_->prefs()->GetString(kPrefsOmahaGzipRequestsUrl,
+                                        &gzip_requests_url) &&
+      gzip_requests_url == params_->update_url() &&
+      GzipCompress(request_post.data(), request_post.size(), &compressed_post);
+  if (request_compressed_) {
+    http_fetcher_->SetHeader("Content-Encoding", "gzip");
+    http_fetcher_->SetPostData(compressed_post.data(), compressed_post.size(),
+                               kHttpContentTypeTextXml);
+  } else {
+    http_fetcher_->SetPostData(request_post.data(), request_post.size(),
+                               kHttpContentTypeTextXml);
+  }
   LOG(INFO) << "Posting an Omaha request to " << params_->update_url();
   LOG(INFO) << "Request: " << request_post;
+  LOG_IF(INFO, request_compressed_) << "Compressed the request from "
+                                    << request_post.size() << " to "
+                                    << compressed_post.size() << " bytes.";
   http_fetcher_->BeginTransfer(params_->update_url());
 }
 
@@ -649,13 +744,96 @@ void OmahaRequestAction::TerminateProcessing() {
   http_fetcher_->TerminateTransfer();
 }
 
-// We just store the response in the buffer. Once we've received all bytes,
-// we'll look in the buffer and decide what to do.
+// We parse the response as it's received. Once we've received all bytes,
+// we'll look at the parsed data and decide what to do.
 void OmahaRequestAction::ReceivedBytes(HttpFetcher *fetcher,
                                        const void* bytes,
                                        size_t length) {
-  const uint8_t* byte_ptr = reinterpret_cast<const uint8_t*>(bytes);
-  response_buffer_.insert(response_buffer_.end(), byte_ptr, byte_ptr + length);
+  response_size_ += length;
+  // The headers are all received before the first bytes of the body.
+  if (!response_encoding_checked_) {
+    response_encoding_checked_ = true;
+    string encoding;
+    if (fetcher->GetResponseHeader("Content-Encoding", &encoding)) {
+      base::TrimWhitespaceASCII(encoding, base::TRIM_ALL, &encoding);
+      encoding = base::ToLowerASCII(encoding);
+      if (encoding == "gzip" || encoding == "deflate")
+        response_decompressor_.reset(new GzipDecompressor());
+    }
+  }
+  // The decompressed response is parsed as it's received, like a plain one.
+  brillo::Blob decompressed;
+  if (response_decompressor_) {
+    if (!response_decompressor_->Decompress(bytes, length, &decompressed)) {
+      if (parse_error_.empty())
+        parse_error_ = "Invalid compressed response";
+      return;
+    }
+    bytes = decompressed.data();
+    length = decompressed.size();
+  }
+  if (VLOG_IS_ON(1)) {
+    const uint8_t* byte_ptr = reinterpret_cast<const uint8_t*>(bytes);
+    response_buffer_.insert(response_buffer_.end(), byte_ptr,
+                            byte_ptr + length);
+  }
+  // The responses to the events aren't used.
+  if (!IsEvent())
+    ParseResponseBytes(bytes, length, false);
+}
+
+void OmahaRequestAction::ParseResponseBytes(const void* bytes,
+                                            size_t length,
+                                            bool is_final) {
+  if (!parse_error_.empty())
+    return;
+  if (!parser_data_) {
+    XML_Parser parser = XML_ParserCreate(nullptr);
+    parser_data_.reset(new OmahaParserData(parser));
+    XML_SetUserData(parser, parser_data_.get());
+    XML_SetElementHandler(parser, ParserHandlerStart, ParserHandlerEnd);
+    XML_SetEntityDeclHandler(parser, ParserHandlerEntityDecl);
+  }
+  XML_Parser parser = parser_data_->xml_parser;
+  XML_Status res = XML_Parse(parser,
+                             reinterpret_cast<const char*>(bytes),
+                             length,
+                             is_final ? XML_TRUE : XML_FALSE);
+  if (res != XML_STATUS_OK || parser_data_->failed) {
+    parse_error_ = base::StringPrintf(
+        "%s at line %" PRIu64 " col %" PRIu64,
+        XML_ErrorString(XML_GetErrorCode(parser)),
+        static_cast<uint64_t>(XML_GetCurrentLineNumber(parser)),
+        static_cast<uint64_t>(XML_GetCurrentColumnNumber(parser)));
+  }
+}
+
+void OmahaRequestAction::UpdateGzipRequestsSupport() {
+  PrefsInterface* prefs = system_state_->prefs();
+  if (request_compressed_ &&
+      GetHTTPResponseCode() == kHttpResponseUnsupportedMediaType) {
+    LOG(WARNING) << "The Omaha server rejected the compressed request, the "
+                 << "next ones won't be compressed.";
+    prefs->Delete(kPrefsOmahaGzipRequestsUrl);
+    return;
+  }
+  // The servers list the encodings of the requests they accept in the
+  // Accept-Encoding header of their responses, as in RFC 7694, like
+  // "gzip, deflate;q=0.5".
+  string accept_encoding;
+  if (!http_fetcher_->GetResponseHeader("Accept-Encoding", &accept_encoding))
+    return;
+  for (string coding : base::SplitString(accept_encoding,
+                                         ",",
+                                         base::TRIM_WHITESPACE,
+                                         base::SPLIT_WANT_NONEMPTY)) {
+    base::TrimWhitespaceASCII(
+        coding.substr(0, coding.find(';')), base::TRIM_ALL, &coding);
+    if (base::ToLowerASCII(coding) == "gzip") {
+      prefs->SetString(kPrefsOmahaGzipRequestsUrl, params_->update_url());
+      return;
+    }
+  }
 }
 
 namespace {
@@ -678,6 +856,33 @@ bool ParseBool(const string& str) {
   return str == "true";
 }
 
+// The longest time a "noupdate" response is used without asking the server,
+// whatever the server said.
+const int64_t kMaxNoUpdateCacheSeconds = 24 * 60 * 60;
+
+// Parses the max-age directive of the |cache_control| header value into
+// |max_age_seconds|, capped to kMaxNoUpdateCacheSeconds. Returns false if
+// there was none, or if the response must not be cached.
+bool ParseCacheControlMaxAge(const string& cache_control,
+                             int64_t* max_age_seconds) {
+  bool found = false;
+  for (const string& directive :
+       base::SplitString(base::ToLowerASCII(cache_control), ",",
+                         base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (directive == "no-cache" || directive == "no-store")
+      return false;
+    const char kMaxAge[] = "max-age=";
+    if (base::StartsWith(directive, kMaxAge, base::CompareCase::SENSITIVE)) {
+      found = base::StringToInt64(directive.substr(sizeof(kMaxAge) - 1),
+                                  max_age_seconds) &&
+              *max_age_seconds > 0;
+    }
+  }
+  if (found)
+    *max_age_seconds = std::min(*max_age_seconds, kMaxNoUpdateCacheSeconds);
+  return found;
+}
+
 // Update the last ping day preferences based on the server daystart
 // response. Returns true on success, false otherwise.
 bool UpdateLastPingDays(OmahaParserData *parser_data, PrefsInterface* prefs) {
@@ -835,6 +1040,29 @@ bool OmahaRequestAction::ParsePackage(OmahaParserData* parser_data,
 
   LOG(INFO) << "Payload size = " << output_object->size << " bytes";
 
+  // The chained packages have the same URLs, each one with the package name,
+  // and the hash and metadata of their payloads in their attributes, like in
+  // the postinstall action for the first package.
+  output_object->chained_packages.clear();
+  for (map<string, string>& attrs : parser_data->chained_package_attrs) {
+    OmahaResponse::Package package;
+    for (const auto& codebase : parser_data->url_codebase)
+      package.payload_urls.push_back(codebase + attrs["name"]);
+    package.size = ParseInt(attrs["size"]);
+    package.hash = attrs[kTagSha256];
+    package.metadata_size = ParseInt(attrs[kTagMetadataSize]);
+    package.metadata_signature = attrs[kTagMetadataSignatureRsa];
+    if (attrs["name"].empty() || package.size <= 0 || package.hash.empty()) {
+      LOG(ERROR) << "Omaha Response has an invalid chained package "
+                 << attrs["name"];
+      completer->set_code(ErrorCode::kOmahaResponseInvalid);
+      return false;
+    }
+    LOG(INFO) << "Chained payload " << attrs["name"] << " size = "
+              << package.size << " bytes";
+    output_object->chained_packages.push_back(package);
+  }
+
   return true;
 }
 
@@ -896,8 +1124,11 @@ bool OmahaRequestAction::ParseParams(OmahaParserData* parser_data,
 void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
                                           bool successful) {
   ScopedActionCompleter completer(processor_, this);
-  string current_response(response_buffer_.begin(), response_buffer_.end());
-  LOG(INFO) << "Omaha request response: " << current_response;
+  LOG(INFO) << "Omaha request response of " << response_size_ << " bytes"
+            << (response_decompressor_ ? ", compressed." : ".");
+  VLOG(1) << "Omaha request response: "
+          << string(response_buffer_.begin(), response_buffer_.end());
+  UpdateGzipRequestsSupport();
 
   PayloadStateInterface* const payload_state = system_state_->payload_state();
 
@@ -914,8 +1145,26 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
   }
 
   if (!successful) {
-    LOG(ERROR) << "Omaha request network transfer failed.";
     int code = GetHTTPResponseCode();
+    if (code == kHttpResponseNotModified && use_response_cache_ &&
+        HasCachedNoUpdateResponse(false)) {
+      LOG(INFO) << "Omaha response not modified since the cached noupdate "
+                << "response.";
+      // The response may extend the validity window.
+      PrefsInterface* prefs = system_state_->prefs();
+      string cache_control;
+      int64_t max_age_seconds;
+      if (http_fetcher_->GetResponseHeader("Cache-Control", &cache_control) &&
+          ParseCacheControlMaxAge(cache_control, &max_age_seconds)) {
+        prefs->SetInt64(kPrefsOmahaNoUpdateMaxAge, max_age_seconds);
+      }
+      prefs->SetInt64(
+          kPrefsOmahaNoUpdateTime,
+          system_state_->clock()->GetWallclockTime().ToInternalValue());
+      CompleteWithCachedNoUpdateResponse(&completer);
+      return;
+    }
+    LOG(ERROR) << "Omaha request network transfer failed.";
     // Makes sure we send sane error values.
     if (code < 0 || code >= 1000) {
       code = 999;
@@ -925,27 +1174,18 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
     return;
   }
 
-  XML_Parser parser = XML_ParserCreate(nullptr);
-  OmahaParserData parser_data(parser);
-  XML_SetUserData(parser, &parser_data);
-  XML_SetElementHandler(parser, ParserHandlerStart, ParserHandlerEnd);
-  XML_SetEntityDeclHandler(parser, ParserHandlerEntityDecl);
-  XML_Status res = XML_Parse(
-      parser,
-      reinterpret_cast<const char*>(response_buffer_.data()),
-      response_buffer_.size(),
-      XML_TRUE);
-  XML_ParserFree(parser);
-
-  if (res != XML_STATUS_OK || parser_data.failed) {
-    LOG(ERROR) << "Omaha response not valid XML: "
-               << XML_ErrorString(XML_GetErrorCode(parser))
-               << " at line " << XML_GetCurrentLineNumber(parser)
-               << " col " << XML_GetCurrentColumnNumber(parser);
+  if (response_decompressor_ && !response_decompressor_->finished() &&
+      parse_error_.empty()) {
+    parse_error_ = "Truncated compressed response";
+  }
+  ParseResponseBytes(nullptr, 0, true);
+  OmahaParserData* parser_data = parser_data_.get();
+  if (!parse_error_.empty()) {
+    LOG(ERROR) << "Omaha response not valid XML: " << parse_error_;
     ErrorCode error_code = ErrorCode::kOmahaRequestXMLParseError;
-    if (response_buffer_.empty()) {
+    if (response_size_ == 0) {
       error_code = ErrorCode::kOmahaRequestEmptyResponseError;
-    } else if (parser_data.entity_decl) {
+    } else if (parser_data && parser_data->entity_decl) {
       error_code = ErrorCode::kOmahaRequestXMLHasEntityDecl;
     }
     completer.set_code(error_code);
@@ -955,7 +1195,7 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
   // Update the last ping day preferences based on the server daystart response
   // even if we didn't send a ping. Omaha always includes the daystart in the
   // response, but log the error if it didn't.
-  LOG_IF(ERROR, !UpdateLastPingDays(&parser_data, system_state_->prefs()))
+  LOG_IF(ERROR, !UpdateLastPingDays(parser_data, system_state_->prefs()))
       << "Failed to update the last ping day preferences!";
 
   if (!HasOutputPipe()) {
@@ -966,7 +1206,14 @@ void OmahaRequestAction::TransferComplete(HttpFetcher *fetcher,
   }
 
   OmahaResponse output_object;
-  if (!ParseResponse(&parser_data, &output_object, &completer))
+  bool parsed = ParseResponse(parser_data, &output_object, &completer);
+  if (use_response_cache_) {
+    if (parser_data->updatecheck_status == "noupdate")
+      CacheNoUpdateResponse(output_object.poll_interval);
+    else
+      ClearNoUpdateResponseCache();
+  }
+  if (!parsed)
     return;
   output_object.update_exists = true;
   SetOutputObject(output_object);
@@ -1470,6 +1717,84 @@ bool OmahaRequestAction::ShouldIgnoreUpdate(
   return false;
 }
 
+bool OmahaRequestAction::HasCachedNoUpdateResponse(bool fresh) const {
+  PrefsInterface* prefs = system_state_->prefs();
+  string request_hash;
+  if (!prefs->GetString(kPrefsOmahaNoUpdateRequestHash, &request_hash) ||
+      request_hash != request_hash_) {
+    return false;
+  }
+  if (!fresh)
+    return true;
+
+  int64_t cache_time_value, max_age_seconds;
+  if (!prefs->GetInt64(kPrefsOmahaNoUpdateTime, &cache_time_value) ||
+      !prefs->GetInt64(kPrefsOmahaNoUpdateMaxAge, &max_age_seconds)) {
+    return false;
+  }
+  Time cache_time = Time::FromInternalValue(cache_time_value);
+  Time now = system_state_->clock()->GetWallclockTime();
+  // A clock moved backwards doesn't extend the window.
+  return cache_time <= now &&
+         now < cache_time + TimeDelta::FromSeconds(max_age_seconds);
+}
+
+void OmahaRequestAction::CacheNoUpdateResponse(int poll_interval) {
+  string etag, cache_control;
+  int64_t max_age_seconds = 0;
+  bool has_etag = http_fetcher_->GetResponseHeader("ETag", &etag) &&
+                  !etag.empty();
+  bool has_max_age =
+      http_fetcher_->GetResponseHeader("Cache-Control", &cache_control) &&
+      ParseCacheControlMaxAge(cache_control, &max_age_seconds);
+  if (!has_etag && !has_max_age) {
+    ClearNoUpdateResponseCache();
+    return;
+  }
+
+  LOG(INFO) << "Caching the Omaha noupdate response"
+            << (has_etag ? " with ETag " + etag : "") << " for "
+            << max_age_seconds << " seconds.";
+  PrefsInterface* prefs = system_state_->prefs();
+  if (has_etag)
+    prefs->SetString(kPrefsOmahaNoUpdateETag, etag);
+  else
+    prefs->Delete(kPrefsOmahaNoUpdateETag);
+  prefs->SetInt64(kPrefsOmahaNoUpdateMaxAge, max_age_seconds);
+  prefs->SetInt64(kPrefsOmahaNoUpdatePollInterval, poll_interval);
+  prefs->SetInt64(
+      kPrefsOmahaNoUpdateTime,
+      system_state_->clock()->GetWallclockTime().ToInternalValue());
+  // The hash goes last, as it makes the other values valid.
+  prefs->SetString(kPrefsOmahaNoUpdateRequestHash, request_hash_);
+}
+
+void OmahaRequestAction::ClearNoUpdateResponseCache() {
+  PrefsInterface* prefs = system_state_->prefs();
+  if (!prefs->Exists(kPrefsOmahaNoUpdateRequestHash))
+    return;
+  prefs->Delete(kPrefsOmahaNoUpdateRequestHash);
+  prefs->Delete(kPrefsOmahaNoUpdateETag);
+  prefs->Delete(kPrefsOmahaNoUpdateMaxAge);
+  prefs->Delete(kPrefsOmahaNoUpdatePollInterval);
+  prefs->Delete(kPrefsOmahaNoUpdateTime);
+}
+
+void OmahaRequestAction::CompleteWithCachedNoUpdateResponse(
+    ScopedActionCompleter* completer) {
+  if (HasOutputPipe()) {
+    OmahaResponse output_object;
+    int64_t poll_interval = 0;
+    if (system_state_->prefs()->GetInt64(kPrefsOmahaNoUpdatePollInterval,
+                                         &poll_interval)) {
+      output_object.poll_interval = poll_interval;
+    }
+    output_object.update_exists = false;
+    SetOutputObject(output_object);
+  }
+  completer->set_code(ErrorCode::kSuccess);
+}
+
 bool OmahaRequestAction::IsUpdateAllowedOverCurrentConnection() const {
   NetworkConnectionType type;
   NetworkTethering tethering;
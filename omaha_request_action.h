@@ -31,6 +31,7 @@
 #include <curl/curl.h>
 
 #include "update_engine/common/action.h"
+#include "update_engine/common/gzip.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/omaha_response.h"
 #include "update_engine/system_state.h"
@@ -122,6 +123,9 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // fallback ones.
   static const int kDefaultMaxFailureCountPerUrl = 10;
 
+  // The most events held by a queue passed to set_event_queue().
+  static const size_t kMaxQueuedEvents = 16;
+
   // These are the possible outcome upon checking whether we satisfied
   // the wall-clock-based-wait.
   enum WallClockWaitResult {
@@ -170,6 +174,17 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // Returns true if this is an Event request, false if it's an UpdateCheck.
   bool IsEvent() const { return event_.get() != nullptr; }
 
+  // Makes this request also send the events of |event_queue|, which it then
+  // clears. If |defer_event| and this is an Event request, its event is
+  // queued in |event_queue| instead, without sending anything, for the next
+  // request using the queue to send it. |event_queue| must outlive this
+  // action.
+  void set_event_queue(std::vector<OmahaEvent>* event_queue,
+                       bool defer_event) {
+    event_queue_ = event_queue;
+    defer_event_ = defer_event;
+  }
+
  private:
   FRIEND_TEST(OmahaRequestActionTest, GetInstallDateWhenNoPrefsNorOOBE);
   FRIEND_TEST(OmahaRequestActionTest,
@@ -283,6 +298,15 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
                    OmahaResponse* output_object,
                    ScopedActionCompleter* completer);
 
+  // Feeds the |length| bytes of the response at |bytes| to the parser, the
+  // last ones if |is_final|, and records the parsing error, if any.
+  void ParseResponseBytes(const void* bytes, size_t length, bool is_final);
+
+  // Remembers whether the Omaha server accepts gzip-compressed requests, from
+  // the Accept-Encoding header of its response or its rejection of the
+  // compressed request.
+  void UpdateGzipRequestsSupport();
+
   // Called by TransferComplete() to complete processing, either
   // asynchronously after looking up resources via p2p or directly.
   void CompleteProcessing();
@@ -300,6 +324,22 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // False otherwise.
   bool IsUpdateAllowedOverCurrentConnection() const;
 
+  // Returns whether a previous check cached a "noupdate" response to the same
+  // request, of hash |request_hash_|, and if |fresh|, whether it is still
+  // within the validity window given by the server.
+  bool HasCachedNoUpdateResponse(bool fresh) const;
+
+  // Caches the "noupdate" response just received with its ETag and validity
+  // window if the server sent either of them, or clears the cache otherwise.
+  void CacheNoUpdateResponse(int poll_interval);
+
+  // Clears the cached "noupdate" response.
+  void ClearNoUpdateResponseCache();
+
+  // Completes the update check as if the cached "noupdate" response was
+  // received.
+  void CompleteWithCachedNoUpdateResponse(ScopedActionCompleter* completer);
+
   // Global system context.
   SystemState* system_state_;
 
@@ -315,9 +355,38 @@ class OmahaRequestAction : public Action<OmahaRequestAction>,
   // If true, only include the <ping> element in the request.
   bool ping_only_;
 
-  // Stores the response from the omaha server
+  // The events to send along with this request, and whether to queue the
+  // event of this request there instead of sending it.
+  std::vector<OmahaEvent>* event_queue_{nullptr};
+  bool defer_event_{false};
+
+  // The parser fed with the response as it's received, so the response is
+  // never held in memory as a whole, and the data it extracted so far.
+  // Created when the first bytes are parsed.
+  std::unique_ptr<OmahaParserData> parser_data_;
+
+  // The error the parsing of the response failed with, if any, in which case
+  // the rest of the response isn't parsed.
+  std::string parse_error_;
+
+  // The size of the response from the omaha server, and the response itself
+  // only when verbose logging is enabled, to log it.
+  size_t response_size_{0};
   brillo::Blob response_buffer_;
 
+  // Whether the request was sent gzip-compressed, and the decompressor of a
+  // response with a "gzip" or "deflate" Content-Encoding, which is known once
+  // its first bytes are received.
+  bool request_compressed_{false};
+  bool response_encoding_checked_{false};
+  std::unique_ptr<GzipDecompressor> response_decompressor_;
+
+  // Whether this update check can use and update the cached "noupdate"
+  // response, which is the case when it sends no ping, and the hash of its
+  // request.
+  bool use_response_cache_{false};
+  std::string request_hash_;
+
   // Initialized by InitPingDays to values that may be sent to Omaha
   // as part of a ping message. Note that only positive values and -1
   // are sent to Omaha.
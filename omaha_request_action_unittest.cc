@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -37,6 +38,7 @@
 #include "update_engine/common/action_pipe.h"
 #include "update_engine/common/constants.h"
 #include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/gzip.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_http_fetcher.h"
 #include "update_engine/common/platform_constants.h"
@@ -235,6 +237,20 @@ class OmahaRequestActionTest : public ::testing::Test {
       ""};     // target_version_prefix
 
   FakePrefs fake_prefs_;
+
+  // The headers of the HTTP responses of TestUpdateCheck(), and whether it
+  // expects the request to be sent at all.
+  std::map<string, string> http_response_headers_;
+  bool expect_request_ = true;
+
+  // The If-None-Match, Accept-Encoding and Content-Encoding headers of the
+  // last request of TestUpdateCheck().
+  string if_none_match_;
+  string accept_encoding_;
+  string content_encoding_;
+
+  // The event queue of the requests of TestUpdateCheck(), if any.
+  vector<OmahaEvent>* event_queue_ = nullptr;
 };
 
 namespace {
@@ -319,12 +335,17 @@ bool OmahaRequestActionTest::TestUpdateCheck(
   if (fail_http_response_code >= 0) {
     fetcher->FailTransfer(fail_http_response_code);
   }
+  for (const auto& header : http_response_headers_)
+    fetcher->SetResponseHeader(header.first, header.second);
+  fetcher->set_never_use(!expect_request_);
   if (request_params)
     fake_system_state_.set_request_params(request_params);
   OmahaRequestAction action(&fake_system_state_,
                             nullptr,
                             brillo::make_unique_ptr(fetcher),
                             ping_only);
+  if (event_queue_)
+    action.set_event_queue(event_queue_, false);
   OmahaRequestActionTestProcessorDelegate delegate;
   delegate.expected_code_ = expected_code;
 
@@ -363,16 +384,22 @@ bool OmahaRequestActionTest::TestUpdateCheck(
     *out_response = collector_action.omaha_response_;
   if (out_post_data)
     *out_post_data = fetcher->post_data();
+  if_none_match_ = fetcher->GetHeader("If-None-Match");
+  accept_encoding_ = fetcher->GetHeader("Accept-Encoding");
+  content_encoding_ = fetcher->GetHeader("Content-Encoding");
   return collector_action.has_input_object_;
 }
 
 // Tests Event requests -- they should always succeed. |out_post_data|
 // may be null; if non-null, the post-data received by the mock
-// HttpFetcher is returned.
+// HttpFetcher is returned. The |event_queue| and |defer_event| are passed to
+// OmahaRequestAction::set_event_queue(), if |event_queue| isn't null.
 void TestEvent(OmahaRequestParams params,
                OmahaEvent* event,
                const string& http_response,
-               brillo::Blob* out_post_data) {
+               brillo::Blob* out_post_data,
+               vector<OmahaEvent>* event_queue = nullptr,
+               bool defer_event = false) {
   brillo::FakeMessageLoop loop(nullptr);
   loop.SetAsCurrent();
   MockHttpFetcher* fetcher = new MockHttpFetcher(http_response.data(),
@@ -384,6 +411,8 @@ void TestEvent(OmahaRequestParams params,
                             event,
                             brillo::make_unique_ptr(fetcher),
                             false);
+  if (event_queue)
+    action.set_event_queue(event_queue, defer_event);
   OmahaRequestActionTestProcessorDelegate delegate;
   ActionProcessor processor;
   processor.set_delegate(&delegate);
@@ -433,6 +462,224 @@ TEST_F(OmahaRequestActionTest, NoUpdateTest) {
   EXPECT_FALSE(response.update_exists);
 }
 
+TEST_F(OmahaRequestActionTest, NoUpdateResponseCachedTest) {
+  OmahaResponse response;
+  http_response_headers_["Cache-Control"] = "private, max-age=3600";
+  fake_system_state_.fake_clock()->SetWallclockTime(
+      Time::FromInternalValue(12345678901234));
+  // The first check sends a ping, so its response isn't cached.
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(
+        TestUpdateCheck(nullptr,  // request_params
+                        fake_update_response_.GetNoUpdateResponse(),
+                        -1,
+                        false,  // ping_only
+                        ErrorCode::kSuccess,
+                        metrics::CheckResult::kNoUpdateAvailable,
+                        metrics::CheckReaction::kUnset,
+                        metrics::DownloadErrorCode::kUnset,
+                        &response,
+                        nullptr));
+    EXPECT_FALSE(response.update_exists);
+    EXPECT_EQ(i == 1, fake_prefs_.Exists(kPrefsOmahaNoUpdateRequestHash));
+  }
+
+  // Within the validity window, the same check isn't sent.
+  fake_system_state_.fake_clock()->SetWallclockTime(
+      fake_system_state_.fake_clock()->GetWallclockTime() +
+      TimeDelta::FromMinutes(59));
+  expect_request_ = false;
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      fake_update_response_.GetUpdateResponse(),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kNoUpdateAvailable,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_FALSE(response.update_exists);
+
+  // After it, the check is sent again, and an update clears the cache.
+  fake_system_state_.fake_clock()->SetWallclockTime(
+      fake_system_state_.fake_clock()->GetWallclockTime() +
+      TimeDelta::FromMinutes(2));
+  expect_request_ = true;
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      fake_update_response_.GetUpdateResponse(),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kUpdateAvailable,
+                      metrics::CheckReaction::kUpdating,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_TRUE(response.update_exists);
+  EXPECT_FALSE(fake_prefs_.Exists(kPrefsOmahaNoUpdateRequestHash));
+}
+
+TEST_F(OmahaRequestActionTest, NoUpdateResponseNotModifiedTest) {
+  OmahaResponse response;
+  http_response_headers_["ETag"] = "\"noupdate-1\"";
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(
+        TestUpdateCheck(nullptr,  // request_params
+                        fake_update_response_.GetNoUpdateResponse(),
+                        -1,
+                        false,  // ping_only
+                        ErrorCode::kSuccess,
+                        metrics::CheckResult::kNoUpdateAvailable,
+                        metrics::CheckReaction::kUnset,
+                        metrics::DownloadErrorCode::kUnset,
+                        &response,
+                        nullptr));
+    EXPECT_EQ("", if_none_match_);
+  }
+
+  // Without a validity window, the check is sent with the ETag and a 304
+  // response means no update.
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      "",
+                      kHttpResponseNotModified,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kNoUpdateAvailable,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_FALSE(response.update_exists);
+  EXPECT_EQ("\"noupdate-1\"", if_none_match_);
+}
+
+TEST_F(OmahaRequestActionTest, NotModifiedWithoutCacheTest) {
+  OmahaResponse response;
+  const int http_error_code =
+      static_cast<int>(ErrorCode::kOmahaRequestHTTPResponseBase) + 304;
+  ASSERT_FALSE(
+      TestUpdateCheck(nullptr,  // request_params
+                      "",
+                      304,
+                      false,  // ping_only
+                      static_cast<ErrorCode>(http_error_code),
+                      metrics::CheckResult::kDownloadError,
+                      metrics::CheckReaction::kUnset,
+                      static_cast<metrics::DownloadErrorCode>(304),
+                      &response,
+                      nullptr));
+  EXPECT_EQ("", if_none_match_);
+}
+
+TEST_F(OmahaRequestActionTest, CompressedResponseTest) {
+  const string http_response = fake_update_response_.GetUpdateResponse();
+  brillo::Blob compressed;
+  ASSERT_TRUE(
+      GzipCompress(http_response.data(), http_response.size(), &compressed));
+  http_response_headers_["Content-Encoding"] = "gzip";
+  OmahaResponse response;
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      string(compressed.begin(), compressed.end()),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kUpdateAvailable,
+                      metrics::CheckReaction::kUpdating,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_TRUE(response.update_exists);
+  EXPECT_EQ(fake_update_response_.version, response.version);
+  EXPECT_EQ("gzip, deflate", accept_encoding_);
+}
+
+TEST_F(OmahaRequestActionTest, TruncatedCompressedResponseTest) {
+  const string http_response = fake_update_response_.GetUpdateResponse();
+  brillo::Blob compressed;
+  ASSERT_TRUE(
+      GzipCompress(http_response.data(), http_response.size(), &compressed));
+  http_response_headers_["Content-Encoding"] = "gzip";
+  OmahaResponse response;
+  ASSERT_FALSE(
+      TestUpdateCheck(nullptr,  // request_params
+                      string(compressed.begin(), compressed.end() - 8),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kOmahaRequestXMLParseError,
+                      metrics::CheckResult::kParsingError,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_FALSE(response.update_exists);
+}
+
+TEST_F(OmahaRequestActionTest, CompressedRequestTest) {
+  OmahaResponse response;
+  brillo::Blob post_data;
+  // The request isn't compressed until the server accepts it.
+  http_response_headers_["Accept-Encoding"] = "deflate;q=0.5, GZIP";
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      fake_update_response_.GetNoUpdateResponse(),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kNoUpdateAvailable,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      &post_data));
+  EXPECT_EQ("", content_encoding_);
+  EXPECT_TRUE(fake_prefs_.Exists(kPrefsOmahaGzipRequestsUrl));
+  const string request(post_data.begin(), post_data.end());
+  EXPECT_NE(string::npos, request.find("<updatecheck"));
+
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      fake_update_response_.GetNoUpdateResponse(),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kNoUpdateAvailable,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      &post_data));
+  EXPECT_EQ("gzip", content_encoding_);
+  GzipDecompressor decompressor;
+  brillo::Blob decompressed;
+  EXPECT_TRUE(decompressor.Decompress(
+      post_data.data(), post_data.size(), &decompressed));
+  EXPECT_TRUE(decompressor.finished());
+  EXPECT_EQ(request, string(decompressed.begin(), decompressed.end()));
+
+  // The requests aren't compressed anymore once one was rejected.
+  http_response_headers_.clear();
+  const int http_error_code =
+      static_cast<int>(ErrorCode::kOmahaRequestHTTPResponseBase) +
+      kHttpResponseUnsupportedMediaType;
+  ASSERT_FALSE(
+      TestUpdateCheck(nullptr,  // request_params
+                      "",
+                      kHttpResponseUnsupportedMediaType,
+                      false,  // ping_only
+                      static_cast<ErrorCode>(http_error_code),
+                      metrics::CheckResult::kDownloadError,
+                      metrics::CheckReaction::kUnset,
+                      static_cast<metrics::DownloadErrorCode>(
+                          kHttpResponseUnsupportedMediaType),
+                      &response,
+                      nullptr));
+  EXPECT_EQ("gzip", content_encoding_);
+  EXPECT_FALSE(fake_prefs_.Exists(kPrefsOmahaGzipRequestsUrl));
+}
+
 // Test that all the values in the response are parsed in a normal update
 // response.
 TEST_F(OmahaRequestActionTest, ValidUpdateTest) {
@@ -465,6 +712,31 @@ TEST_F(OmahaRequestActionTest, ValidUpdateTest) {
   EXPECT_FALSE(fake_prefs_.Exists(kPrefsOmahaCohortName));
 }
 
+TEST_F(OmahaRequestActionTest, ValidUpdateInSeveralChunksTest) {
+  // A comment makes the response span several chunks of the fetcher, which
+  // are parsed as they are received.
+  string input_response = fake_update_response_.GetUpdateResponse();
+  input_response.insert(input_response.find("?>") + 2,
+                        "<!--" + string(3 * kMockHttpFetcherChunkSize, 'x') +
+                            "-->");
+  OmahaResponse response;
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      input_response,
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kUpdateAvailable,
+                      metrics::CheckReaction::kUpdating,
+                      metrics::DownloadErrorCode::kUnset,
+                      &response,
+                      nullptr));
+  EXPECT_TRUE(response.update_exists);
+  EXPECT_EQ(fake_update_response_.version, response.version);
+  EXPECT_EQ(fake_update_response_.hash, response.hash);
+  EXPECT_EQ(fake_update_response_.size, response.size);
+}
+
 TEST_F(OmahaRequestActionTest, ValidUpdateBlockedByConnection) {
   OmahaResponse response;
   // Set up a connection manager that doesn't allow a valid update over
@@ -997,6 +1269,46 @@ TEST_F(OmahaRequestActionTest, MissingFieldTest) {
   EXPECT_TRUE(response.deadline.empty());
 }
 
+TEST_F(OmahaRequestActionTest, ChainedPackagesTest) {
+  string input_response =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><response protocol=\"3.0\">"
+      "<daystart elapsed_seconds=\"100\"/>"
+      "<app appid=\"xyz\" status=\"ok\">"
+      "<updatecheck status=\"ok\">"
+      "<urls><url codebase=\"http://chained/test/\"/></urls>"
+      "<manifest version=\"10.2.3.4\">"
+      "<packages><package hash=\"not-used\" name=\"f\" size=\"587\"/>"
+      "<package hash=\"not-used\" name=\"g\" size=\"123\" "
+      "sha256=\"HASH2\" MetadataSize=\"45\" "
+      "MetadataSignatureRsa=\"SIG2\"/></packages>"
+      "<actions><action event=\"postinstall\" "
+      "ChromeOSVersion=\"10.2.3.4\" "
+      "sha256=\"HASH1\" "
+      "/></actions></manifest></updatecheck></app></response>";
+
+  OmahaResponse response;
+  ASSERT_TRUE(TestUpdateCheck(nullptr,  // request_params
+                              input_response,
+                              -1,
+                              false,  // ping_only
+                              ErrorCode::kSuccess,
+                              metrics::CheckResult::kUpdateAvailable,
+                              metrics::CheckReaction::kUpdating,
+                              metrics::DownloadErrorCode::kUnset,
+                              &response,
+                              nullptr));
+  EXPECT_EQ("http://chained/test/f", response.payload_urls[0]);
+  EXPECT_EQ("HASH1", response.hash);
+  EXPECT_EQ(587, response.size);
+  ASSERT_EQ(1U, response.chained_packages.size());
+  const OmahaResponse::Package& package = response.chained_packages[0];
+  EXPECT_EQ(vector<string>{"http://chained/test/g"}, package.payload_urls);
+  EXPECT_EQ(123, package.size);
+  EXPECT_EQ("HASH2", package.hash);
+  EXPECT_EQ(45, package.metadata_size);
+  EXPECT_EQ("SIG2", package.metadata_signature);
+}
+
 namespace {
 class TerminateEarlyTestProcessorDelegate : public ActionProcessorDelegate {
  public:
@@ -1224,6 +1536,71 @@ TEST_F(OmahaRequestActionTest, FormatErrorEventOutputTest) {
   EXPECT_EQ(post_str.find("updatecheck"), string::npos);
 }
 
+TEST_F(OmahaRequestActionTest, QueuedEventsTest) {
+  vector<OmahaEvent> event_queue;
+  brillo::Blob post_data;
+  // A deferred event is only queued.
+  TestEvent(request_params_,
+            new OmahaEvent(OmahaEvent::kTypeUpdateDownloadStarted),
+            "invalid xml>",
+            &post_data,
+            &event_queue,
+            true);  // defer_event
+  EXPECT_TRUE(post_data.empty());
+  ASSERT_EQ(1U, event_queue.size());
+  EXPECT_EQ(OmahaEvent::kTypeUpdateDownloadStarted, event_queue[0].type);
+
+  // The next event request sends it first, along with its own event.
+  TestEvent(request_params_,
+            new OmahaEvent(OmahaEvent::kTypeUpdateComplete,
+                           OmahaEvent::kResultError,
+                           ErrorCode::kError),
+            "invalid xml>",
+            &post_data,
+            &event_queue,
+            false);  // defer_event
+  EXPECT_TRUE(event_queue.empty());
+  string post_str(post_data.begin(), post_data.end());
+  size_t started_pos = post_str.find(base::StringPrintf(
+      "        <event eventtype=\"%d\" eventresult=\"%d\"></event>\n",
+      OmahaEvent::kTypeUpdateDownloadStarted,
+      OmahaEvent::kResultSuccess));
+  size_t complete_pos = post_str.find(base::StringPrintf(
+      "        <event eventtype=\"%d\" eventresult=\"%d\" "
+      "errorcode=\"%d\"></event>\n",
+      OmahaEvent::kTypeUpdateComplete,
+      OmahaEvent::kResultError,
+      static_cast<int>(ErrorCode::kError)));
+  ASSERT_NE(string::npos, started_pos);
+  ASSERT_NE(string::npos, complete_pos);
+  EXPECT_LT(started_pos, complete_pos);
+}
+
+TEST_F(OmahaRequestActionTest, QueuedEventsSentWithUpdateCheckTest) {
+  vector<OmahaEvent> event_queue{
+      OmahaEvent(OmahaEvent::kTypeUpdateDownloadFinished)};
+  event_queue_ = &event_queue;
+  brillo::Blob post_data;
+  ASSERT_TRUE(
+      TestUpdateCheck(nullptr,  // request_params
+                      fake_update_response_.GetNoUpdateResponse(),
+                      -1,
+                      false,  // ping_only
+                      ErrorCode::kSuccess,
+                      metrics::CheckResult::kNoUpdateAvailable,
+                      metrics::CheckReaction::kUnset,
+                      metrics::DownloadErrorCode::kUnset,
+                      nullptr,
+                      &post_data));
+  EXPECT_TRUE(event_queue.empty());
+  string post_str(post_data.begin(), post_data.end());
+  EXPECT_NE(string::npos, post_str.find("<updatecheck"));
+  EXPECT_NE(string::npos, post_str.find(base::StringPrintf(
+      "        <event eventtype=\"%d\" eventresult=\"%d\"></event>\n",
+      OmahaEvent::kTypeUpdateDownloadFinished,
+      OmahaEvent::kResultSuccess)));
+}
+
 TEST_F(OmahaRequestActionTest, IsEventTest) {
   string http_response("doesn't matter");
   // Create a copy of the OmahaRequestParams to reuse it later.
@@ -122,6 +122,24 @@ TEST_F(OmahaRequestParamsTest, SimpleTest) {
   EXPECT_EQ("http://www.google.com", out.update_url());
 }
 
+// The lsb-release files are read again when they change.
+TEST_F(OmahaRequestParamsTest, ChangedLsbReleaseTest) {
+  ASSERT_TRUE(WriteFileString(
+      test_dir_ + "/etc/lsb-release",
+      "CHROMEOS_RELEASE_VERSION=0.2.2.3\n"));
+  OmahaRequestParams out(&fake_system_state_);
+  EXPECT_TRUE(DoTest(&out, "", ""));
+  EXPECT_EQ("0.2.2.3", out.app_version());
+  EXPECT_TRUE(DoTest(&out, "", ""));
+  EXPECT_EQ("0.2.2.3", out.app_version());
+
+  ASSERT_TRUE(WriteFileString(
+      test_dir_ + "/etc/lsb-release",
+      "CHROMEOS_RELEASE_VERSION=0.2.2.4\n"));
+  EXPECT_TRUE(DoTest(&out, "", ""));
+  EXPECT_EQ("0.2.2.4", out.app_version());
+}
+
 TEST_F(OmahaRequestParamsTest, AppIDTest) {
   ASSERT_TRUE(WriteFileString(
       test_dir_ + "/etc/lsb-release",
@@ -77,6 +77,20 @@ struct OmahaResponse {
   // PST, according to the Omaha Server's clock and timezone (PST8PDT,
   // aka "Pacific Time".)
   int install_date_days = -1;
+
+  // A package of the manifest after the first one, with the hash and metadata
+  // of its payload in its own attributes.
+  struct Package {
+    // The package URL for each of the |payload_urls|, in the same order.
+    std::vector<std::string> payload_urls;
+    off_t size = 0;
+    std::string hash;
+    off_t metadata_size = 0;
+    std::string metadata_signature;
+  };
+  // The payloads of the packages after the first one, applied in order after
+  // it, each one from the version the previous one installs.
+  std::vector<Package> chained_packages;
 };
 static_assert(sizeof(off_t) == 8, "off_t not 64 bit");
 
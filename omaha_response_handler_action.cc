@@ -16,6 +16,7 @@
 
 #include "update_engine/omaha_response_handler_action.h"
 
+#include <algorithm>
 #include <string>
 
 #include <base/logging.h>
@@ -91,8 +92,30 @@ void OmahaResponseHandlerAction::PerformAction() {
   install_plan_.metadata_signature = response.metadata_signature;
   install_plan_.public_key_rsa = response.public_key_rsa;
   install_plan_.hash_checks_mandatory = AreHashChecksMandatory(response);
+
+  // The chained payloads are downloaded from the same server as the first one,
+  // which is the regular one when using p2p.
+  auto url = std::find(
+      response.payload_urls.begin(), response.payload_urls.end(), current_url);
+  const size_t url_index = url == response.payload_urls.end()
+                               ? 0
+                               : url - response.payload_urls.begin();
+  // The progress is only resumed for the same chain of payloads.
+  string response_hash = response.hash;
+  install_plan_.chained_payloads.clear();
+  for (const OmahaResponse::Package& package : response.chained_packages) {
+    InstallPlan::Payload payload;
+    payload.download_url = package.payload_urls[url_index];
+    payload.size = package.size;
+    payload.hash = package.hash;
+    payload.metadata_size = package.metadata_size;
+    payload.metadata_signature = package.metadata_signature;
+    install_plan_.chained_payloads.push_back(payload);
+    response_hash += package.hash;
+  }
+
   install_plan_.is_resume =
-      DeltaPerformer::CanResumeUpdate(system_state_->prefs(), response.hash);
+      DeltaPerformer::CanResumeUpdate(system_state_->prefs(), response_hash);
   if (install_plan_.is_resume) {
     payload_state->UpdateResumed();
   } else {
@@ -101,7 +124,7 @@ void OmahaResponseHandlerAction::PerformAction() {
         system_state_->prefs(), false))
         << "Unable to reset the update progress.";
     LOG_IF(WARNING, !system_state_->prefs()->SetString(
-        kPrefsUpdateCheckResponseHash, response.hash))
+        kPrefsUpdateCheckResponseHash, response_hash))
         << "Unable to save the update check response hash.";
   }
   install_plan_.payload_type = response.is_delta_payload
@@ -22,6 +22,7 @@
 
 #include "update_engine/p2p_manager.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/falloc.h>
@@ -40,10 +41,10 @@
 #include <vector>
 
 #include <base/bind.h>
-#include <base/files/file_enumerator.h>
 #include <base/files/file_path.h>
 #include <base/format_macros.h>
 #include <base/logging.h>
+#include <base/memory/weak_ptr.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 
@@ -79,6 +80,10 @@ const char kDefaultP2PDir[] = "/var/cache/p2p";
 // p2p ddoc for details.
 const char kCrosP2PFileSizeXAttrName[] = "user.cros-p2p-filesize";
 
+// How long the URL of a file found on the LAN is reused for the following
+// lookups of the same file before looking it up again.
+const int kLookupCacheTimeoutSeconds = 60;
+
 }  // namespace
 
 // The default P2PManager::Configuration implementation.
@@ -159,6 +164,24 @@ class P2PManagerImpl : public P2PManager {
   // Utility function used by EnsureP2PRunning() and EnsureP2PNotRunning().
   bool EnsureP2P(bool should_be_running);
 
+  // Returns whether initctl(8) started or stopped p2p as per
+  // |should_be_running|, given its |return_code| and |output|.
+  static bool IsInitctlSuccess(bool should_be_running,
+                               int return_code,
+                               const string& output);
+
+  // Stops the p2p service without blocking the main loop, for when it's no
+  // longer enabled. The result is handled by OnStopP2PDone().
+  void StopP2PAsync();
+  void OnStopP2PDone(int return_code, const string& output);
+
+  // Lists in |files| the files in the p2p directory owned by the application,
+  // visible or not, with their modification time if |with_mtime| is true.
+  // Only the files owned by the application are stat(2)-ed, and only when
+  // their modification time is needed or the directory entry doesn't tell
+  // their type.
+  void ListSharedFiles(bool with_mtime, vector<pair<FilePath, Time>>* files);
+
   // Utility function to delete a file given by |path| and log the
   // path as well as |reason|. Returns false on failure.
   bool DeleteP2PFile(const FilePath& path, const string& reason);
@@ -169,6 +192,23 @@ class P2PManagerImpl : public P2PManager {
   // An async callback used by the above.
   void OnEnabledStatusChange(EvalStatus status, const bool& result);
 
+  // Called when the lookup of |file_id_with_ext| of at least |minimum_size|
+  // bytes completes with |url|, empty on failure. Caches a found |url| in the
+  // |manager|, unless it's gone already, and always passes it on to
+  // |callback|.
+  static void OnLookupDone(base::WeakPtr<P2PManagerImpl> manager,
+                           const string& file_id_with_ext,
+                           size_t minimum_size,
+                           LookupCallback callback,
+                           const string& url);
+
+  // A URL found by a previous lookup.
+  struct CachedLookup {
+    string url;
+    size_t minimum_size;
+    Time lookup_time;
+  };
+
   // The device policy being used or null if no policy is being used.
   const policy::DevicePolicy* device_policy_ = nullptr;
 
@@ -203,11 +243,22 @@ class P2PManagerImpl : public P2PManager {
   // Whether P2P service may be running; initially, we assume it may be.
   bool may_be_running_ = true;
 
+  // The process id of the initctl(8) stopping p2p started by StopP2PAsync(),
+  // or 0 if none is running.
+  pid_t stop_pid_ = 0;
+
   // The current known enabled status of the P2P feature (initialized lazily),
   // and whether an async status check has been scheduled.
   bool is_enabled_;
   bool waiting_for_enabled_status_change_ = false;
 
+  // The URLs found on the LAN by the recent lookups, keyed by the file id
+  // with the extension. Only the successful lookups are cached so that a
+  // peer showing up is noticed by the next lookup.
+  map<string, CachedLookup> lookup_cache_;
+
+  base::WeakPtrFactory<P2PManagerImpl> weak_ptr_factory_{this};
+
   DISALLOW_COPY_AND_ASSIGN(P2PManagerImpl);
 };
 
@@ -257,27 +308,61 @@ bool P2PManagerImpl::EnsureP2P(bool should_be_running) {
 
   may_be_running_ = true;  // Unless successful, we must be conservative.
 
+  // A stop still running would race with this request.
+  if (stop_pid_ != 0) {
+    Subprocess::Get().KillExec(stop_pid_);
+    stop_pid_ = 0;
+  }
+
   vector<string> args = configuration_->GetInitctlArgs(should_be_running);
   if (!Subprocess::SynchronousExec(args, &return_code, &output)) {
     LOG(ERROR) << "Error spawning " << utils::StringVectorToString(args);
     return false;
   }
 
+  if (!IsInitctlSuccess(should_be_running, return_code, output))
+    return false;
+
+  may_be_running_ = should_be_running;  // Successful after all.
+  return true;
+}
+
+bool P2PManagerImpl::IsInitctlSuccess(bool should_be_running,
+                                      int return_code,
+                                      const string& output) {
   // If initctl(8) does not exit normally (exit status other than zero), ensure
   // that the error message is not benign by scanning stderr; this is a
   // necessity because initctl does not offer actions such as "start if not
   // running" or "stop if running".
   // TODO(zeuthen,chromium:277051): Avoid doing this.
-  if (return_code != 0) {
-    const char *expected_error_message = should_be_running ?
-      "initctl: Job is already running: p2p\n" :
-      "initctl: Unknown instance \n";
-    if (output != expected_error_message)
-      return false;
-  }
+  if (return_code == 0)
+    return true;
+  const char *expected_error_message = should_be_running ?
+    "initctl: Job is already running: p2p\n" :
+    "initctl: Unknown instance \n";
+  return output == expected_error_message;
+}
 
-  may_be_running_ = should_be_running;  // Successful after all.
-  return true;
+void P2PManagerImpl::StopP2PAsync() {
+  if (stop_pid_ != 0)
+    return;
+  vector<string> args = configuration_->GetInitctlArgs(false);
+  stop_pid_ = Subprocess::Get().ExecFlags(
+      args,
+      Subprocess::kRedirectStderrToStdout | Subprocess::kSearchPath,
+      {},
+      Bind(&P2PManagerImpl::OnStopP2PDone, weak_ptr_factory_.GetWeakPtr()));
+  if (stop_pid_ == 0)
+    LOG(WARNING) << "Error spawning " << utils::StringVectorToString(args);
+}
+
+void P2PManagerImpl::OnStopP2PDone(int return_code, const string& output) {
+  stop_pid_ = 0;
+  if (!IsInitctlSuccess(false, return_code, output)) {
+    LOG(WARNING) << "Failed to stop P2P service.";
+    return;
+  }
+  may_be_running_ = false;
 }
 
 bool P2PManagerImpl::EnsureP2PRunning() {
@@ -327,26 +412,52 @@ bool P2PManagerImpl::DeleteP2PFile(const FilePath& path,
 }
 
 
-bool P2PManagerImpl::PerformHousekeeping() {
-  // Open p2p dir.
+void P2PManagerImpl::ListSharedFiles(bool with_mtime,
+                                     vector<pair<FilePath, Time>>* files) {
   FilePath p2p_dir = configuration_->GetP2PDir();
   const string ext_visible = GetExt(kVisible);
   const string ext_non_visible = GetExt(kNonVisible);
 
+  files->clear();
+  DIR* dir = opendir(p2p_dir.value().c_str());
+  if (dir == nullptr) {
+    PLOG(WARNING) << "Error opening p2p dir " << p2p_dir.value();
+    return;
+  }
+  while (const struct dirent* entry = readdir(dir)) {
+    const string name = entry->d_name;
+    if (!(base::EndsWith(name, ext_visible, base::CompareCase::SENSITIVE) ||
+          base::EndsWith(name, ext_non_visible,
+                         base::CompareCase::SENSITIVE)) ||
+        entry->d_type == DT_DIR) {
+      continue;
+    }
+
+    FilePath path = p2p_dir.Append(name);
+    Time mtime;
+    if (with_mtime || entry->d_type == DT_UNKNOWN) {
+      struct stat statbuf;
+      if (stat(path.value().c_str(), &statbuf) != 0 ||
+          S_ISDIR(statbuf.st_mode)) {
+        continue;
+      }
+      mtime = Time::FromTimeT(statbuf.st_mtime);
+    }
+    files->push_back(std::make_pair(path, mtime));
+  }
+  closedir(dir);
+}
+
+bool P2PManagerImpl::PerformHousekeeping() {
   bool deletion_failed = false;
+  vector<pair<FilePath, Time>> files;
   vector<pair<FilePath, Time>> matches;
 
-  base::FileEnumerator dir(p2p_dir, false, base::FileEnumerator::FILES);
   // Go through all files and collect their mtime.
-  for (FilePath name = dir.Next(); !name.empty(); name = dir.Next()) {
-    if (!(base::EndsWith(name.value(), ext_visible,
-                         base::CompareCase::SENSITIVE) ||
-          base::EndsWith(name.value(), ext_non_visible,
-                         base::CompareCase::SENSITIVE))) {
-      continue;
-    }
-
-    Time time = dir.GetInfo().GetLastModifiedTime();
+  ListSharedFiles(true, &files);
+  for (const auto& file : files) {
+    const FilePath& name = file.first;
+    Time time = file.second;
 
     // If instructed to keep only files younger than a given age
     // (|max_file_age_| != 0), delete files satisfying this criteria
@@ -361,10 +472,12 @@ bool P2PManagerImpl::PerformHousekeeping() {
   }
 
   // If instructed to only keep N files (|max_files_to_keep_ != 0),
-  // sort list of matches, newest (biggest time) to oldest (lowest
-  // time). Then delete starting at element |num_files_to_keep_|.
-  if (num_files_to_keep_ > 0) {
-    std::sort(matches.begin(), matches.end(), MatchCompareFunc);
+  // partition the list of matches so the N newest (biggest time) come
+  // first. Then delete starting at element |num_files_to_keep_|.
+  if (num_files_to_keep_ > 0 &&
+      matches.size() > static_cast<size_t>(num_files_to_keep_)) {
+    std::nth_element(matches.begin(), matches.begin() + num_files_to_keep_,
+                     matches.end(), MatchCompareFunc);
     vector<pair<FilePath, Time>>::const_iterator i;
     for (i = matches.begin() + num_files_to_keep_; i < matches.end(); ++i) {
       if (!DeleteP2PFile(i->first, "too many files"))
@@ -491,13 +604,47 @@ void P2PManagerImpl::LookupUrlForFile(const string& file_id,
                                       size_t minimum_size,
                                       TimeDelta max_time_to_wait,
                                       LookupCallback callback) {
-  LookupData *lookup_data = new LookupData(callback);
   string file_id_with_ext = file_id + "." + file_extension_;
+
+  // A peer that had at least the |minimum_size| bytes cached still has at
+  // least as many, so there's no need to spawn p2p-client again.
+  auto cached = lookup_cache_.find(file_id_with_ext);
+  if (cached != lookup_cache_.end() && clock_ != nullptr) {
+    if (clock_->GetMonotonicTime() - cached->second.lookup_time <
+            TimeDelta::FromSeconds(kLookupCacheTimeoutSeconds) &&
+        cached->second.minimum_size >= minimum_size) {
+      LOG(INFO) << "Using the cached p2p URL " << cached->second.url
+                << " for " << file_id_with_ext;
+      // The callback is always called from the message loop.
+      MessageLoop::current()->PostTask(
+          FROM_HERE, Bind(callback, cached->second.url));
+      return;
+    }
+    lookup_cache_.erase(cached);
+  }
+
+  LookupData *lookup_data = new LookupData(
+      Bind(&P2PManagerImpl::OnLookupDone, weak_ptr_factory_.GetWeakPtr(),
+           file_id_with_ext, minimum_size, callback));
   vector<string> args = configuration_->GetP2PClientArgs(file_id_with_ext,
                                                          minimum_size);
   lookup_data->InitiateLookup(args, max_time_to_wait);
 }
 
+// static
+void P2PManagerImpl::OnLookupDone(base::WeakPtr<P2PManagerImpl> manager,
+                                  const string& file_id_with_ext,
+                                  size_t minimum_size,
+                                  LookupCallback callback,
+                                  const string& url) {
+  if (manager && !url.empty() && manager->clock_ != nullptr) {
+    manager->lookup_cache_[file_id_with_ext] = {
+        url, minimum_size, manager->clock_->GetMonotonicTime()};
+  }
+  if (!callback.is_null())
+    callback.Run(url);
+}
+
 bool P2PManagerImpl::FileShare(const string& file_id,
                                size_t expected_size) {
   // Check if file already exist.
@@ -668,23 +815,9 @@ ssize_t P2PManagerImpl::FileGetExpectedSize(const string& file_id) {
 }
 
 int P2PManagerImpl::CountSharedFiles() {
-  int num_files = 0;
-
-  FilePath p2p_dir = configuration_->GetP2PDir();
-  const string ext_visible = GetExt(kVisible);
-  const string ext_non_visible = GetExt(kNonVisible);
-
-  base::FileEnumerator dir(p2p_dir, false, base::FileEnumerator::FILES);
-  for (FilePath name = dir.Next(); !name.empty(); name = dir.Next()) {
-    if (base::EndsWith(name.value(), ext_visible,
-                       base::CompareCase::SENSITIVE) ||
-        base::EndsWith(name.value(), ext_non_visible,
-                       base::CompareCase::SENSITIVE)) {
-      num_files += 1;
-    }
-  }
-
-  return num_files;
+  vector<pair<FilePath, Time>> files;
+  ListSharedFiles(false, &files);
+  return files.size();
 }
 
 void P2PManagerImpl::ScheduleEnabledStatusChange() {
@@ -712,10 +845,10 @@ void P2PManagerImpl::OnEnabledStatusChange(EvalStatus status,
 
     is_enabled_ = result;
 
-    // If P2P is running but shouldn't be, make sure it isn't.
-    if (may_be_running_ && !is_enabled_ && !EnsureP2PNotRunning()) {
-      LOG(WARNING) << "Failed to stop P2P service.";
-    }
+    // If P2P is running but shouldn't be, make sure it isn't. This runs from
+    // the main loop whenever the policy changes, so don't wait for initctl.
+    if (may_be_running_ && !is_enabled_)
+      StopP2PAsync();
   } else {
     LOG(WARNING)
         << "P2P enabled tracking failed (possibly timed out); retrying.";
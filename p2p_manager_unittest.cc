@@ -512,4 +512,58 @@ TEST_F(P2PManagerTest, LookupURL) {
   loop_.Run();
 }
 
+// Tests that the URLs found are reused by the following lookups until they
+// expire.
+TEST_F(P2PManagerTest, LookupURLCached) {
+  test_conf_->SetP2PClientCommand({
+      "echo", "http://1.2.3.4/{file_id}_{minsize}"});
+  manager_->LookupUrlForFile("fooX", 42, TimeDelta(),
+                             base::Bind(ExpectUrl,
+                                        "http://1.2.3.4/fooX.cros_au_42"));
+  loop_.Run();
+
+  // The p2p-client failing isn't noticed while the URL is cached, for the
+  // same or a smaller minimum size.
+  test_conf_->SetP2PClientCommand({"false"});
+  manager_->LookupUrlForFile("fooX", 42, TimeDelta(),
+                             base::Bind(ExpectUrl,
+                                        "http://1.2.3.4/fooX.cros_au_42"));
+  loop_.Run();
+  manager_->LookupUrlForFile("fooX", 10, TimeDelta(),
+                             base::Bind(ExpectUrl,
+                                        "http://1.2.3.4/fooX.cros_au_42"));
+  loop_.Run();
+
+  // A bigger minimum size needs another lookup.
+  manager_->LookupUrlForFile("fooX", 43, TimeDelta(),
+                             base::Bind(ExpectUrl, ""));
+  loop_.Run();
+
+  // So does an expired URL.
+  test_conf_->SetP2PClientCommand({
+      "echo", "http://1.2.3.4/{file_id}_{minsize}"});
+  manager_->LookupUrlForFile("fooX", 42, TimeDelta(),
+                             base::Bind(ExpectUrl,
+                                        "http://1.2.3.4/fooX.cros_au_42"));
+  loop_.Run();
+  test_conf_->SetP2PClientCommand({"false"});
+  fake_clock_.SetMonotonicTime(fake_clock_.GetMonotonicTime() +
+                               TimeDelta::FromMinutes(2));
+  manager_->LookupUrlForFile("fooX", 42, TimeDelta(),
+                             base::Bind(ExpectUrl, ""));
+  loop_.Run();
+}
+
+// Tests that the lookup callback still runs when the manager is destroyed
+// while the lookup is in progress.
+TEST_F(P2PManagerTest, LookupURLAfterDestroyed) {
+  test_conf_->SetP2PClientCommand({
+      "echo", "http://1.2.3.4/{file_id}_{minsize}"});
+  manager_->LookupUrlForFile("fooX", 42, TimeDelta(),
+                             base::Bind(ExpectUrl,
+                                        "http://1.2.3.4/fooX.cros_au_42"));
+  manager_.reset();
+  loop_.Run();
+}
+
 }  // namespace chromeos_update_engine
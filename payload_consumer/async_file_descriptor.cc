@@ -0,0 +1,205 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_file_descriptor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+AsyncFileDescriptor::AsyncFileDescriptor(size_t num_threads,
+                                         size_t max_in_flight)
+    : num_threads_(num_threads),
+      max_in_flight_(max_in_flight),
+      request_available_(&lock_),
+      request_done_(&lock_) {
+  CHECK_GT(num_threads, 0U);
+  CHECK_GT(max_in_flight, 0U);
+}
+
+AsyncFileDescriptor::~AsyncFileDescriptor() {
+  if (IsOpen())
+    Close();
+}
+
+bool AsyncFileDescriptor::Open(const char* path, int flags) {
+  CHECK(!IsOpen());
+  fd_ = HANDLE_EINTR(open(path, flags));
+  if (fd_ < 0)
+    return false;
+  completion_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (completion_fd_ < 0) {
+    IGNORE_EINTR(close(fd_));
+    fd_ = -1;
+    return false;
+  }
+
+  stopping_ = false;
+  for (size_t i = 0; i < num_threads_; i++) {
+    io_threads_.emplace_back(new IOThread(this));
+    threads_.emplace_back(new base::DelegateSimpleThread(
+        io_threads_.back().get(), "async-file-io"));
+    threads_.back()->Start();
+  }
+  return true;
+}
+
+bool AsyncFileDescriptor::Close() {
+  CHECK(IsOpen());
+  bool success = WaitForAll();
+  StopIOThreads();
+  if (IGNORE_EINTR(close(fd_)) != 0) {
+    PLOG(ERROR) << "Error closing the file";
+    success = false;
+  }
+  IGNORE_EINTR(close(completion_fd_));
+  fd_ = -1;
+  completion_fd_ = -1;
+  return success;
+}
+
+void AsyncFileDescriptor::SubmitRead(void* buf, size_t count, off_t offset) {
+  Submit(false, buf, count, offset);
+}
+
+void AsyncFileDescriptor::SubmitWrite(const void* buf,
+                                      size_t count,
+                                      off_t offset) {
+  Submit(true, const_cast<void*>(buf), count, offset);
+}
+
+bool AsyncFileDescriptor::WaitForNext() {
+  base::AutoLock auto_lock(lock_);
+  CHECK(!requests_.empty());
+  while (!requests_.front()->done)
+    request_done_.Wait();
+  bool succeeded = requests_.front()->succeeded;
+  requests_.pop_front();
+  return succeeded;
+}
+
+bool AsyncFileDescriptor::WaitForAll() {
+  bool success = true;
+  while (num_in_flight() > 0)
+    success = WaitForNext() && success;
+  return success;
+}
+
+bool AsyncFileDescriptor::IsNextDone() {
+  base::AutoLock auto_lock(lock_);
+  CHECK(!requests_.empty());
+  return requests_.front()->done;
+}
+
+void AsyncFileDescriptor::ClearCompletions() {
+  uint64_t num_completions;
+  if (HANDLE_EINTR(read(completion_fd_, &num_completions,
+                        sizeof(num_completions))) < 0 &&
+      errno != EAGAIN) {
+    PLOG(WARNING) << "Unable to read the completion eventfd";
+  }
+}
+
+void AsyncFileDescriptor::Submit(bool is_write,
+                                 void* buf,
+                                 size_t count,
+                                 off_t offset) {
+  CHECK(IsOpen());
+  base::AutoLock auto_lock(lock_);
+  while (NumNotDoneLocked() >= max_in_flight_)
+    request_done_.Wait();
+  requests_.emplace_back(
+      new Request{is_write, buf, count, offset, false, false, false});
+  request_available_.Signal();
+}
+
+size_t AsyncFileDescriptor::NumNotDoneLocked() const {
+  size_t result = 0;
+  for (const auto& request : requests_) {
+    if (!request->done)
+      result++;
+  }
+  return result;
+}
+
+void AsyncFileDescriptor::RunIOThread() {
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    Request* request = nullptr;
+    while (!stopping_) {
+      for (const auto& pending : requests_) {
+        if (!pending->started) {
+          request = pending.get();
+          break;
+        }
+      }
+      if (request)
+        break;
+      request_available_.Wait();
+    }
+    if (stopping_)
+      return;
+
+    request->started = true;
+    bool succeeded;
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      if (request->is_write) {
+        succeeded = utils::PWriteAll(
+            fd_, request->buf, request->count, request->offset);
+      } else {
+        ssize_t bytes_read = 0;
+        succeeded = utils::PReadAll(fd_,
+                                    request->buf,
+                                    request->count,
+                                    request->offset,
+                                    &bytes_read) &&
+                    bytes_read == static_cast<ssize_t>(request->count);
+      }
+      if (throttle_ && succeeded)
+        throttle_->WaitForIO(request->is_write, request->count);
+    }
+    request->succeeded = succeeded;
+    request->done = true;
+    request_done_.Broadcast();
+    const uint64_t one = 1;
+    if (HANDLE_EINTR(write(completion_fd_, &one, sizeof(one))) < 0)
+      PLOG(WARNING) << "Unable to signal the completion eventfd";
+  }
+}
+
+void AsyncFileDescriptor::StopIOThreads() {
+  {
+    base::AutoLock auto_lock(lock_);
+    stopping_ = true;
+    request_available_.Broadcast();
+  }
+  for (const auto& thread : threads_)
+    thread->Join();
+  threads_.clear();
+  io_threads_.clear();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,166 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+namespace chromeos_update_engine {
+
+class StorageThrottle;
+
+// An AsyncFileDescriptor keeps several positional reads and writes on a file
+// in flight at the same time. I/Os are submitted from a single thread and
+// applied in the background by a small pool of I/O threads using pread() and
+// pwrite(), so they don't depend on a shared file offset. Completions are
+// reported to the submitter in submission order.
+//
+// Since all the I/Os are positional on a plain file descriptor, this doesn't
+// support MTD and UBI devices, which must be accessed through their
+// FileDescriptor implementations.
+class AsyncFileDescriptor {
+ public:
+  // Creates a closed descriptor that uses |num_threads| I/O threads and keeps
+  // at most |max_in_flight| submitted I/Os not completed at any time.
+  AsyncFileDescriptor(size_t num_threads, size_t max_in_flight);
+
+  // Waits for the I/Os in flight and closes the file, if open.
+  ~AsyncFileDescriptor();
+
+  // Opens the file at |path| with the open() |flags| and starts the I/O
+  // threads. The descriptor must be closed. Returns whether it was opened,
+  // setting errno otherwise.
+  bool Open(const char* path, int flags);
+
+  // Waits for all the I/Os in flight, stops the I/O threads and closes the
+  // file. Returns whether all the I/Os and the close succeeded.
+  bool Close();
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // Sets the |throttle| delaying the I/Os as slower storage would, see
+  // StorageThrottle. Must be called before Open().
+  void set_throttle(std::shared_ptr<StorageThrottle> throttle) {
+    throttle_ = throttle;
+  }
+
+  // Submits the read of |count| bytes at |offset| into |buf|, or the write of
+  // |count| bytes from |buf| at |offset|. The |buf| must remain valid until
+  // the I/O completes. Blocks while there are |max_in_flight| I/Os not
+  // completed.
+  void SubmitRead(void* buf, size_t count, off_t offset);
+  void SubmitWrite(const void* buf, size_t count, off_t offset);
+
+  // Waits until the oldest submitted I/O not reported yet completes. Returns
+  // whether all its |count| bytes were transferred. There must be I/Os in
+  // flight.
+  bool WaitForNext();
+
+  // Waits until all the submitted I/Os complete. Returns whether all of them
+  // transferred all their bytes.
+  bool WaitForAll();
+
+  // Returns whether the oldest submitted I/O not reported yet completed, so
+  // WaitForNext() returns without blocking. There must be I/Os in flight.
+  bool IsNextDone();
+
+  // An eventfd readable once an I/O completed since the last call to
+  // ClearCompletions(), so a message loop can watch for the completions
+  // instead of blocking in WaitForNext(). Only valid while open.
+  int completion_fd() const { return completion_fd_; }
+
+  // Resets the |completion_fd()| until the next I/O completes. Call it before
+  // checking IsNextDone() so no completion is missed.
+  void ClearCompletions();
+
+  // The number of submitted I/Os not reported by WaitForNext() yet.
+  size_t num_in_flight() const { return requests_.size(); }
+
+ private:
+  struct Request {
+    bool is_write;
+    void* buf;
+    size_t count;
+    off_t offset;
+    bool started;
+    bool done;
+    bool succeeded;
+  };
+
+  class IOThread : public base::DelegateSimpleThread::Delegate {
+   public:
+    explicit IOThread(AsyncFileDescriptor* async_fd) : async_fd_(async_fd) {}
+    ~IOThread() override = default;
+
+    // Overrides DelegateSimpleThread::Delegate.
+    void Run() override { async_fd_->RunIOThread(); }
+
+   private:
+    AsyncFileDescriptor* async_fd_;
+
+    DISALLOW_COPY_AND_ASSIGN(IOThread);
+  };
+
+  // Adds a request to the queue for the I/O threads.
+  void Submit(bool is_write, void* buf, size_t count, off_t offset);
+
+  // Returns the number of submitted requests not done yet. Must be called with
+  // |lock_| held.
+  size_t NumNotDoneLocked() const;
+
+  // The main loop of the I/O threads.
+  void RunIOThread();
+
+  // Stops and joins the I/O threads.
+  void StopIOThreads();
+
+  const size_t num_threads_;
+  const size_t max_in_flight_;
+
+  int fd_{-1};
+  int completion_fd_{-1};
+  std::shared_ptr<StorageThrottle> throttle_;
+
+  std::vector<std::unique_ptr<IOThread>> io_threads_;
+  std::vector<std::unique_ptr<base::DelegateSimpleThread>> threads_;
+
+  // All of the following are protected by |lock_|.
+  base::Lock lock_;
+  // Signaled when there's a new request or the I/O threads should stop.
+  base::ConditionVariable request_available_;
+  // Signaled every time a request completes.
+  base::ConditionVariable request_done_;
+
+  // The submitted requests not reported yet, in submission order.
+  std::deque<std::unique_ptr<Request>> requests_;
+  bool stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_DESCRIPTOR_H_
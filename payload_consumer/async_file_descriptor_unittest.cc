@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_file_descriptor.h"
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <string>
+
+#include <base/posix/eintr_wrapper.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class AsyncFileDescriptorTest : public ::testing::Test {
+ protected:
+  test_utils::ScopedTempFile temp_file_{"AsyncFileDescriptorTest-XXXXXX"};
+};
+
+TEST_F(AsyncFileDescriptorTest, WriteAndReadTest) {
+  const size_t kNumChunks = 16;
+  const size_t kChunkSize = 4096;
+  brillo::Blob data;
+  for (size_t i = 0; i < kNumChunks; i++)
+    data.insert(data.end(), kChunkSize, 'a' + i);
+
+  AsyncFileDescriptor async_fd(3, 4);
+  ASSERT_TRUE(async_fd.Open(temp_file_.path().c_str(), O_RDWR));
+  // Write the chunks in reverse order to their final position.
+  for (size_t i = kNumChunks; i > 0; i--) {
+    async_fd.SubmitWrite(
+        data.data() + (i - 1) * kChunkSize, kChunkSize, (i - 1) * kChunkSize);
+  }
+  EXPECT_TRUE(async_fd.WaitForAll());
+  EXPECT_EQ(0U, async_fd.num_in_flight());
+
+  brillo::Blob read_data(data.size());
+  for (size_t i = 0; i < kNumChunks; i++) {
+    async_fd.SubmitRead(
+        read_data.data() + i * kChunkSize, kChunkSize, i * kChunkSize);
+  }
+  for (size_t i = 0; i < kNumChunks; i++)
+    EXPECT_TRUE(async_fd.WaitForNext());
+  EXPECT_TRUE(async_fd.Close());
+  EXPECT_EQ(data, read_data);
+
+  brillo::Blob file_data;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &file_data));
+  EXPECT_EQ(data, file_data);
+}
+
+TEST_F(AsyncFileDescriptorTest, ShortReadFailsTest) {
+  EXPECT_TRUE(test_utils::WriteFileString(temp_file_.path(), "abcd"));
+  AsyncFileDescriptor async_fd(1, 1);
+  ASSERT_TRUE(async_fd.Open(temp_file_.path().c_str(), O_RDONLY));
+  char buf[8];
+  async_fd.SubmitRead(buf, 2, 0);
+  EXPECT_TRUE(async_fd.WaitForNext());
+  async_fd.SubmitRead(buf, sizeof(buf), 0);
+  EXPECT_FALSE(async_fd.WaitForNext());
+  EXPECT_TRUE(async_fd.Close());
+}
+
+TEST_F(AsyncFileDescriptorTest, CompletionFdTest) {
+  EXPECT_TRUE(test_utils::WriteFileString(temp_file_.path(), "abcd"));
+  AsyncFileDescriptor async_fd(1, 1);
+  ASSERT_TRUE(async_fd.Open(temp_file_.path().c_str(), O_RDONLY));
+  char buf[4];
+  async_fd.SubmitRead(buf, sizeof(buf), 0);
+
+  // The completion fd becomes readable once the read is done.
+  struct pollfd fds = {async_fd.completion_fd(), POLLIN, 0};
+  EXPECT_EQ(1, HANDLE_EINTR(poll(&fds, 1, 10000)));
+  EXPECT_TRUE(async_fd.IsNextDone());
+  async_fd.ClearCompletions();
+  EXPECT_EQ(0, HANDLE_EINTR(poll(&fds, 1, 0)));
+  EXPECT_TRUE(async_fd.WaitForNext());
+  EXPECT_EQ(0U, async_fd.num_in_flight());
+  EXPECT_EQ("abcd", std::string(buf, sizeof(buf)));
+  EXPECT_TRUE(async_fd.Close());
+}
+
+TEST_F(AsyncFileDescriptorTest, OpenErrorTest) {
+  AsyncFileDescriptor async_fd(1, 1);
+  EXPECT_FALSE(async_fd.Open("/non/existent/path", O_RDONLY));
+  EXPECT_FALSE(async_fd.IsOpen());
+}
+
+}  // namespace chromeos_update_engine
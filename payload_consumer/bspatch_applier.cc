@@ -0,0 +1,359 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/bspatch_applier.h"
+
+#include <bzlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::min;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The BSDIFF40 header is the magic followed by three 64-bit integers: the
+// compressed size of the control block, the compressed size of the diff block
+// and the size of the new file.
+const char kBsdiffMagic[] = "BSDIFF40";
+const size_t kBsdiffMagicSize = 8;
+const size_t kBsdiffHeaderSize = 32;
+
+// Size of each control tuple in the uncompressed control block.
+const size_t kControlEntrySize = 24;
+
+// The new data is accumulated in a buffer of this size before handing it to
+// the ExtentWriter, so a patch with many small control entries doesn't result
+// in many small writes.
+const size_t kOutputBufferSize = 1024 * 1024;  // 1 MiB
+
+// Decodes the sign-magnitude little endian 64-bit integer used by bsdiff.
+int64_t ParseBsdiffInt64(const uint8_t* buf) {
+  int64_t result = buf[7] & 0x7F;
+  for (int i = 6; i >= 0; i--) {
+    result <<= 8;
+    result |= buf[i];
+  }
+  if (buf[7] & 0x80)
+    result = -result;
+  return result;
+}
+
+// A sequential reader of a bzip2 stream stored in memory.
+class BzipBlockReader {
+ public:
+  BzipBlockReader() {
+    memset(&stream_, 0, sizeof(stream_));
+  }
+  ~BzipBlockReader() {
+    if (initialized_)
+      BZ2_bzDecompressEnd(&stream_);
+  }
+
+  bool Init(const uint8_t* data, size_t size) {
+    TEST_AND_RETURN_FALSE(!initialized_);
+    TEST_AND_RETURN_FALSE(size <= std::numeric_limits<unsigned int>::max());
+    TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream_, 0, 0) == BZ_OK);
+    initialized_ = true;
+    stream_.next_in = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+    stream_.avail_in = size;
+    return true;
+  }
+
+  // Reads exactly |count| bytes of uncompressed data into |buf|. Returns false
+  // if the stream ends, is corrupted or doesn't have enough data.
+  bool Read(uint8_t* buf, size_t count) {
+    TEST_AND_RETURN_FALSE(initialized_);
+    TEST_AND_RETURN_FALSE(count <= std::numeric_limits<unsigned int>::max());
+    stream_.next_out = reinterpret_cast<char*>(buf);
+    stream_.avail_out = count;
+    while (stream_.avail_out > 0) {
+      const unsigned int avail_in = stream_.avail_in;
+      const unsigned int avail_out = stream_.avail_out;
+      int rc = BZ2_bzDecompress(&stream_);
+      if (rc == BZ_STREAM_END)
+        break;
+      TEST_AND_RETURN_FALSE(rc == BZ_OK);
+      // Bail out if the decompressor made no progress, which means there's
+      // no more input data to consume.
+      TEST_AND_RETURN_FALSE(stream_.avail_in != avail_in ||
+                            stream_.avail_out != avail_out);
+    }
+    TEST_AND_RETURN_FALSE(stream_.avail_out == 0);
+    return true;
+  }
+
+ private:
+  bz_stream stream_;
+  bool initialized_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(BzipBlockReader);
+};
+
+}  // namespace
+
+std::unique_ptr<brillo::Blob> SourceDataPool::Acquire() {
+  base::AutoLock auto_lock(lock_);
+  if (free_buffers_.empty())
+    return std::unique_ptr<brillo::Blob>(new brillo::Blob());
+  std::unique_ptr<brillo::Blob> buffer = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  return buffer;
+}
+
+void SourceDataPool::Release(std::unique_ptr<brillo::Blob> buffer) {
+  if (buffer->capacity() > max_buffer_size_)
+    return;
+  // The data isn't needed anymore, only the memory holding it.
+  buffer->clear();
+  base::AutoLock auto_lock(lock_);
+  if (!shrunk_)
+    free_buffers_.push_back(std::move(buffer));
+}
+
+void SourceDataPool::ShrinkToMinimum() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = true;
+  free_buffers_.clear();
+}
+
+void SourceDataPool::RestoreCapacity() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = false;
+}
+
+bool ReadBsdiffSourceExtents(FileDescriptorPtr fd,
+                             const RepeatedPtrField<Extent>& extents,
+                             uint64_t block_size,
+                             uint64_t length,
+                             brillo::Blob* out_data) {
+  out_data->resize(length);
+  return ReadBsdiffSourceRange(
+      fd, extents, block_size, 0, length, out_data->data());
+}
+
+bool ReadBsdiffSourceRange(FileDescriptorPtr fd,
+                           const RepeatedPtrField<Extent>& extents,
+                           uint64_t block_size,
+                           uint64_t offset,
+                           uint64_t length,
+                           uint8_t* out) {
+  uint64_t bytes_read = 0;
+  // The offset in the source data of the current extent.
+  uint64_t extent_offset = 0;
+  for (const Extent& extent : extents) {
+    if (bytes_read == length)
+      break;
+    const uint64_t extent_size = extent.num_blocks() * block_size;
+    const uint64_t extent_start = extent_offset;
+    extent_offset += extent_size;
+    if (offset + bytes_read >= extent_offset)
+      continue;
+    const uint64_t skip = offset + bytes_read - extent_start;
+    const uint64_t bytes = min(length - bytes_read, extent_size - skip);
+    if (extent.start_block() == kSparseHole) {
+      memset(out + bytes_read, 0, bytes);
+    } else {
+      ssize_t bytes_read_this_iteration = 0;
+      TEST_AND_RETURN_FALSE(
+          utils::PReadAll(fd,
+                          out + bytes_read,
+                          bytes,
+                          extent.start_block() * block_size + skip,
+                          &bytes_read_this_iteration));
+      TEST_AND_RETURN_FALSE(bytes_read_this_iteration ==
+                            static_cast<ssize_t>(bytes));
+    }
+    bytes_read += bytes;
+  }
+  TEST_AND_RETURN_FALSE(bytes_read == length);
+  return true;
+}
+
+const size_t ExtentBsdiffSource::kWindowSize = 2 * 1024 * 1024;  // 2 MiB
+
+ExtentBsdiffSource::ExtentBsdiffSource(FileDescriptorPtr fd,
+                                       const RepeatedPtrField<Extent>& extents,
+                                       uint64_t block_size,
+                                       uint64_t length)
+    : fd_(fd), extents_(extents), block_size_(block_size), length_(length) {}
+
+const uint8_t* ExtentBsdiffSource::Get(uint64_t offset, size_t* length) {
+  if (window_.empty() || offset < window_offset_ ||
+      offset >= window_offset_ + window_.size()) {
+    // The patch mostly reads the source data forward, so the window starts
+    // at the data requested.
+    window_.resize(min(static_cast<uint64_t>(kWindowSize), length_ - offset));
+    window_offset_ = offset;
+    if (!ReadBsdiffSourceRange(fd_,
+                               extents_,
+                               block_size_,
+                               window_offset_,
+                               window_.size(),
+                               window_.data())) {
+      window_.clear();
+      return nullptr;
+    }
+  }
+  const uint64_t available = window_offset_ + window_.size() - offset;
+  *length = min(static_cast<uint64_t>(*length), available);
+  return window_.data() + (offset - window_offset_);
+}
+
+bool GetBsdiffPatchNewSize(const uint8_t* patch,
+                           size_t patch_size,
+                           uint64_t* new_size) {
+  if (patch_size < kBsdiffHeaderSize ||
+      memcmp(patch, kBsdiffMagic, kBsdiffMagicSize) != 0) {
+    LOG(ERROR) << "Invalid bsdiff patch header.";
+    return false;
+  }
+  const int64_t patch_new_size = ParseBsdiffInt64(patch + 24);
+  TEST_AND_RETURN_FALSE(patch_new_size >= 0);
+  *new_size = patch_new_size;
+  return true;
+}
+
+bool ApplyBsdiffPatch(const uint8_t* old_data,
+                      uint64_t old_size,
+                      const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+  MemoryBsdiffSource source(old_data, old_size);
+  return ApplyBsdiffPatch(&source, patch, patch_size, new_size, writer);
+}
+
+bool ApplyBsdiffPatch(BsdiffSource* old_data,
+                      const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t new_size,
+                      ExtentWriter* writer) {
+  if (patch_size < kBsdiffHeaderSize ||
+      memcmp(patch, kBsdiffMagic, kBsdiffMagicSize) != 0) {
+    LOG(ERROR) << "Invalid bsdiff patch header.";
+    return false;
+  }
+  const int64_t ctrl_len = ParseBsdiffInt64(patch + 8);
+  const int64_t diff_len = ParseBsdiffInt64(patch + 16);
+  const int64_t patch_new_size = ParseBsdiffInt64(patch + 24);
+  if (ctrl_len < 0 || diff_len < 0 ||
+      static_cast<uint64_t>(ctrl_len) > patch_size - kBsdiffHeaderSize ||
+      static_cast<uint64_t>(diff_len) >
+          patch_size - kBsdiffHeaderSize - ctrl_len) {
+    LOG(ERROR) << "Corrupt bsdiff patch: invalid block sizes.";
+    return false;
+  }
+  if (patch_new_size < 0 || static_cast<uint64_t>(patch_new_size) != new_size) {
+    LOG(ERROR) << "The bsdiff patch generates " << patch_new_size
+               << " bytes but the operation expects " << new_size << ".";
+    return false;
+  }
+
+  const uint8_t* ctrl_data = patch + kBsdiffHeaderSize;
+  const uint8_t* diff_data = ctrl_data + ctrl_len;
+  const uint8_t* extra_data = diff_data + diff_len;
+  BzipBlockReader ctrl_reader, diff_reader, extra_reader;
+  TEST_AND_RETURN_FALSE(ctrl_reader.Init(ctrl_data, ctrl_len));
+  TEST_AND_RETURN_FALSE(diff_reader.Init(diff_data, diff_len));
+  TEST_AND_RETURN_FALSE(
+      extra_reader.Init(extra_data, patch + patch_size - extra_data));
+
+  brillo::Blob output(min(static_cast<uint64_t>(kOutputBufferSize), new_size));
+  size_t output_used = 0;
+
+  const int64_t old_size = old_data->size();
+  uint64_t new_pos = 0;
+  int64_t old_pos = 0;
+  while (new_pos < new_size) {
+    uint8_t ctrl_entry[kControlEntrySize];
+    TEST_AND_RETURN_FALSE(ctrl_reader.Read(ctrl_entry, kControlEntrySize));
+    const int64_t diff_bytes = ParseBsdiffInt64(ctrl_entry);
+    const int64_t extra_bytes = ParseBsdiffInt64(ctrl_entry + 8);
+    const int64_t seek_bytes = ParseBsdiffInt64(ctrl_entry + 16);
+    if (diff_bytes < 0 || extra_bytes < 0 ||
+        static_cast<uint64_t>(diff_bytes) > new_size - new_pos ||
+        static_cast<uint64_t>(extra_bytes) >
+            new_size - new_pos - diff_bytes) {
+      LOG(ERROR) << "Corrupt bsdiff patch: invalid control entry.";
+      return false;
+    }
+
+    // Add the diff block bytes to the old data. Bytes outside the old data
+    // are taken from the diff block as is.
+    for (int64_t done = 0; done < diff_bytes;) {
+      const size_t chunk = min(static_cast<uint64_t>(diff_bytes - done),
+                               static_cast<uint64_t>(output.size() -
+                                                     output_used));
+      uint8_t* out = output.data() + output_used;
+      TEST_AND_RETURN_FALSE(diff_reader.Read(out, chunk));
+      const int64_t chunk_old_pos = old_pos + done;
+      const int64_t old_end =
+          min(chunk_old_pos + static_cast<int64_t>(chunk), old_size);
+      for (int64_t pos = std::max(chunk_old_pos, static_cast<int64_t>(0));
+           pos < old_end;) {
+        size_t length = old_end - pos;
+        const uint8_t* old = old_data->Get(pos, &length);
+        TEST_AND_RETURN_FALSE(old != nullptr);
+        uint8_t* diff = out + (pos - chunk_old_pos);
+        for (size_t i = 0; i < length; i++)
+          diff[i] += old[i];
+        pos += length;
+      }
+      output_used += chunk;
+      done += chunk;
+      if (output_used == output.size()) {
+        TEST_AND_RETURN_FALSE(writer->Write(output.data(), output_used));
+        output_used = 0;
+      }
+    }
+    new_pos += diff_bytes;
+    old_pos += diff_bytes;
+
+    // Copy the extra block bytes verbatim.
+    for (int64_t done = 0; done < extra_bytes;) {
+      const size_t chunk = min(static_cast<uint64_t>(extra_bytes - done),
+                               static_cast<uint64_t>(output.size() -
+                                                     output_used));
+      TEST_AND_RETURN_FALSE(
+          extra_reader.Read(output.data() + output_used, chunk));
+      output_used += chunk;
+      done += chunk;
+      if (output_used == output.size()) {
+        TEST_AND_RETURN_FALSE(writer->Write(output.data(), output_used));
+        output_used = 0;
+      }
+    }
+    new_pos += extra_bytes;
+    old_pos += seek_bytes;
+  }
+
+  if (output_used)
+    TEST_AND_RETURN_FALSE(writer->Write(output.data(), output_used));
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,203 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BSPATCH_APPLIER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BSPATCH_APPLIER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/common/memory_pressure_monitor.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+// In-process applier for the BSDIFF40 patch format used by the BSDIFF and
+// SOURCE_BSDIFF operations. This replaces running the external bspatch
+// program, which required writing the patch to a temporary file and reopening
+// the partitions on every operation.
+
+namespace chromeos_update_engine {
+
+// SourceDataPool keeps the buffers the source data of the patch operations is
+// read into, so they can be reused across operations instead of being
+// allocated and faulted in for each one. It is thread-safe.
+class SourceDataPool : public ShrinkableCache {
+ public:
+  // Only the buffers of up to |max_buffer_size| bytes are kept, so the memory
+  // of the few large operations isn't held for the rest of the update.
+  explicit SourceDataPool(size_t max_buffer_size)
+      : max_buffer_size_(max_buffer_size) {}
+  ~SourceDataPool() override = default;
+
+  // Returns an empty buffer, which should be passed back to Release() once
+  // done.
+  std::unique_ptr<brillo::Blob> Acquire();
+  void Release(std::unique_ptr<brillo::Blob> buffer);
+
+  // ShrinkableCache overrides. The shrunk pool frees the buffers released
+  // instead of keeping them.
+  void ShrinkToMinimum() override;
+  void RestoreCapacity() override;
+
+ private:
+  const size_t max_buffer_size_;
+
+  base::Lock lock_;
+  // The buffers released and not acquired again, protected by |lock_|.
+  std::vector<std::unique_ptr<brillo::Blob>> free_buffers_;
+  bool shrunk_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceDataPool);
+};
+
+// Holds a buffer of a SourceDataPool for the scope, releasing it on
+// destruction.
+class ScopedSourceData {
+ public:
+  explicit ScopedSourceData(SourceDataPool* pool)
+      : pool_(pool), data_(pool->Acquire()) {}
+  ~ScopedSourceData() { pool_->Release(std::move(data_)); }
+
+  brillo::Blob* get() { return data_.get(); }
+  brillo::Blob& operator*() { return *data_; }
+  brillo::Blob* operator->() { return data_.get(); }
+
+ private:
+  SourceDataPool* const pool_;
+  std::unique_ptr<brillo::Blob> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedSourceData);
+};
+
+// Reads |length| bytes from |fd| following the list of |extents|, in order,
+// and stores them in |out_data|. Extents starting at kSparseHole read as
+// zeros. The last extent may be only partially read. Returns false if the
+// |extents| don't cover |length| bytes or a read fails.
+bool ReadBsdiffSourceExtents(
+    FileDescriptorPtr fd,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t block_size,
+    uint64_t length,
+    brillo::Blob* out_data);
+
+// Reads the |length| bytes at |offset| of the data of the |extents| of |fd|,
+// like ReadBsdiffSourceExtents(), into the buffer at |out|.
+bool ReadBsdiffSourceRange(
+    FileDescriptorPtr fd,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t block_size,
+    uint64_t offset,
+    uint64_t length,
+    uint8_t* out);
+
+// The source data a BSDIFF40 patch is applied to.
+class BsdiffSource {
+ public:
+  virtual ~BsdiffSource() = default;
+
+  // The size of the source data.
+  virtual uint64_t size() const = 0;
+
+  // Returns the source data at |offset|, which must be less than size(), and
+  // lowers |length| to the number of bytes available there if it's less.
+  // Returns nullptr if the data can't be read.
+  virtual const uint8_t* Get(uint64_t offset, size_t* length) = 0;
+};
+
+// MemoryBsdiffSource is the source data of a patch already read in memory.
+class MemoryBsdiffSource : public BsdiffSource {
+ public:
+  MemoryBsdiffSource(const uint8_t* data, uint64_t size)
+      : data_(data), size_(size) {}
+
+  uint64_t size() const override { return size_; }
+  const uint8_t* Get(uint64_t offset, size_t* length) override {
+    return data_ + offset;
+  }
+
+ private:
+  const uint8_t* const data_;
+  const uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBsdiffSource);
+};
+
+// ExtentBsdiffSource reads the source data of a patch from the |extents| of a
+// file as the patch uses it, kWindowSize bytes at a time, for the sources too
+// large to be read in memory at once. The |extents| must outlive it.
+class ExtentBsdiffSource : public BsdiffSource {
+ public:
+  static const size_t kWindowSize;
+
+  ExtentBsdiffSource(FileDescriptorPtr fd,
+                     const google::protobuf::RepeatedPtrField<Extent>& extents,
+                     uint64_t block_size,
+                     uint64_t length);
+
+  uint64_t size() const override { return length_; }
+  const uint8_t* Get(uint64_t offset, size_t* length) override;
+
+ private:
+  FileDescriptorPtr fd_;
+  const google::protobuf::RepeatedPtrField<Extent>& extents_;
+  const uint64_t block_size_;
+  const uint64_t length_;
+
+  // The source data read last, at |window_offset_|.
+  brillo::Blob window_;
+  uint64_t window_offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ExtentBsdiffSource);
+};
+
+// Parses the size of the data generated by the BSDIFF40 |patch| of
+// |patch_size| bytes from its header and stores it in |new_size|. Returns false
+// if the header is invalid.
+bool GetBsdiffPatchNewSize(const uint8_t* patch,
+                           size_t patch_size,
+                           uint64_t* new_size);
+
+// Applies the BSDIFF40 |patch| of |patch_size| bytes to the |old_size| bytes
+// of source data at |old_data|. The resulting data, which must be exactly
+// |new_size| bytes long, is passed in order to |writer|, which needs to be
+// already initialized. The caller is responsible for calling End() on the
+// |writer|. Returns whether the patch was successfully applied.
+bool ApplyBsdiffPatch(const uint8_t* old_data,
+                      uint64_t old_size,
+                      const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t new_size,
+                      ExtentWriter* writer);
+
+// Applies the BSDIFF40 |patch| to the source data of |old_data|, as above.
+bool ApplyBsdiffPatch(BsdiffSource* old_data,
+                      const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t new_size,
+                      ExtentWriter* writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BSPATCH_APPLIER_H_
@@ -0,0 +1,281 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/bspatch_applier.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Encodes |value| in the sign-magnitude format used by bsdiff.
+void AppendBsdiffInt64(int64_t value, brillo::Blob* out) {
+  uint64_t magnitude = value < 0 ? -value : value;
+  for (int i = 0; i < 8; i++) {
+    out->push_back(magnitude & 0xff);
+    magnitude >>= 8;
+  }
+  if (value < 0)
+    out->back() |= 0x80;
+}
+
+struct ControlEntry {
+  int64_t diff_bytes;
+  int64_t extra_bytes;
+  int64_t seek_bytes;
+};
+
+// Builds a BSDIFF40 patch from the given uncompressed blocks.
+brillo::Blob BuildPatch(const vector<ControlEntry>& entries,
+                        const brillo::Blob& diff,
+                        const brillo::Blob& extra,
+                        uint64_t new_size) {
+  brillo::Blob ctrl;
+  for (const ControlEntry& entry : entries) {
+    AppendBsdiffInt64(entry.diff_bytes, &ctrl);
+    AppendBsdiffInt64(entry.extra_bytes, &ctrl);
+    AppendBsdiffInt64(entry.seek_bytes, &ctrl);
+  }
+  brillo::Blob bz_ctrl, bz_diff, bz_extra;
+  EXPECT_TRUE(BzipCompress(ctrl, &bz_ctrl));
+  EXPECT_TRUE(BzipCompress(diff, &bz_diff));
+  EXPECT_TRUE(BzipCompress(extra, &bz_extra));
+
+  brillo::Blob patch = {'B', 'S', 'D', 'I', 'F', 'F', '4', '0'};
+  AppendBsdiffInt64(bz_ctrl.size(), &patch);
+  AppendBsdiffInt64(bz_diff.size(), &patch);
+  AppendBsdiffInt64(new_size, &patch);
+  patch.insert(patch.end(), bz_ctrl.begin(), bz_ctrl.end());
+  patch.insert(patch.end(), bz_diff.begin(), bz_diff.end());
+  patch.insert(patch.end(), bz_extra.begin(), bz_extra.end());
+  return patch;
+}
+
+}  // namespace
+
+class BspatchApplierTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.assign(std::begin(test_utils::kRandomString),
+                     std::end(test_utils::kRandomString));
+  }
+
+  brillo::Blob old_data_;
+  FakeExtentWriter writer_;
+};
+
+TEST_F(BspatchApplierTest, DiffAndExtraTest) {
+  // The new data is the old data from offset 100 with every byte incremented
+  // by one, followed by 50 extra bytes.
+  const size_t kDiffBytes = old_data_.size() - 100;
+  brillo::Blob diff(kDiffBytes, 1);
+  brillo::Blob extra(50, 'x');
+  brillo::Blob expected;
+  for (size_t i = 0; i < kDiffBytes; i++)
+    expected.push_back(old_data_[100 + i] + 1);
+  expected.insert(expected.end(), extra.begin(), extra.end());
+
+  brillo::Blob patch = BuildPatch(
+      {{0, 0, 100}, {static_cast<int64_t>(kDiffBytes), 50, 0}},
+      diff, extra, expected.size());
+
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_TRUE(ApplyBsdiffPatch(old_data_.data(), old_data_.size(),
+                               patch.data(), patch.size(),
+                               expected.size(), &writer_));
+  EXPECT_TRUE(writer_.End());
+  EXPECT_EQ(expected, writer_.WrittenData());
+}
+
+TEST_F(BspatchApplierTest, DiffPastOldDataTest) {
+  // Diff bytes that fall outside the old data are copied as is.
+  brillo::Blob diff(20, 7);
+  brillo::Blob expected(diff);
+  for (size_t i = 0; i < 10; i++)
+    expected[i] += old_data_[old_data_.size() - 10 + i];
+
+  brillo::Blob patch = BuildPatch(
+      {{0, 0, static_cast<int64_t>(old_data_.size()) - 10}, {20, 0, 0}},
+      diff, {}, expected.size());
+
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_TRUE(ApplyBsdiffPatch(old_data_.data(), old_data_.size(),
+                               patch.data(), patch.size(),
+                               expected.size(), &writer_));
+  EXPECT_TRUE(writer_.End());
+  EXPECT_EQ(expected, writer_.WrittenData());
+}
+
+TEST_F(BspatchApplierTest, InvalidMagicTest) {
+  brillo::Blob patch = BuildPatch({{0, 10, 0}}, {}, brillo::Blob(10), 10);
+  patch[0] = 'X';
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_FALSE(ApplyBsdiffPatch(old_data_.data(), old_data_.size(),
+                                patch.data(), patch.size(), 10, &writer_));
+  EXPECT_TRUE(writer_.End());
+}
+
+TEST_F(BspatchApplierTest, NewSizeMismatchTest) {
+  brillo::Blob patch = BuildPatch({{0, 10, 0}}, {}, brillo::Blob(10), 10);
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_FALSE(ApplyBsdiffPatch(old_data_.data(), old_data_.size(),
+                                patch.data(), patch.size(), 11, &writer_));
+  EXPECT_TRUE(writer_.End());
+}
+
+TEST_F(BspatchApplierTest, ControlEntryOverflowTest) {
+  // The control entry claims more extra bytes than the new file size.
+  brillo::Blob patch = BuildPatch({{0, 20, 0}}, {}, brillo::Blob(20), 10);
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_FALSE(ApplyBsdiffPatch(old_data_.data(), old_data_.size(),
+                                patch.data(), patch.size(), 10, &writer_));
+  EXPECT_TRUE(writer_.End());
+}
+
+TEST(ReadBsdiffSourceExtentsTest, SparseAndPartialExtentsTest) {
+  const uint64_t kBlockSize = 4096;
+  test_utils::ScopedTempFile source_file("BspatchApplierTest-source.XXXXXX");
+  brillo::Blob source(kBlockSize * 3);
+  for (size_t i = 0; i < source.size(); i++)
+    source[i] = i / kBlockSize + 1;
+  ASSERT_TRUE(utils::WriteFile(source_file.path().c_str(), source.data(),
+                               source.size()));
+
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
+  ASSERT_TRUE(fd->Open(source_file.path().c_str(), O_RDONLY));
+
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(2, 1);
+  *extents.Add() = ExtentForRange(kSparseHole, 1);
+  *extents.Add() = ExtentForRange(0, 1);
+
+  // Read only part of the last extent.
+  const uint64_t kLength = kBlockSize * 2 + 10;
+  brillo::Blob data;
+  EXPECT_TRUE(
+      ReadBsdiffSourceExtents(fd, extents, kBlockSize, kLength, &data));
+  brillo::Blob expected(kBlockSize, 3);
+  expected.resize(kBlockSize * 2, 0);
+  expected.resize(kLength, 1);
+  EXPECT_EQ(expected, data);
+
+  // The extents don't cover the requested length.
+  EXPECT_FALSE(ReadBsdiffSourceExtents(fd, extents, kBlockSize,
+                                       kBlockSize * 3 + 1, &data));
+
+  // A range across the extents.
+  brillo::Blob range(kBlockSize + 20);
+  EXPECT_TRUE(ReadBsdiffSourceRange(
+      fd, extents, kBlockSize, kBlockSize - 10, range.size(), range.data()));
+  EXPECT_EQ(brillo::Blob(expected.begin() + kBlockSize - 10,
+                         expected.begin() + kBlockSize * 2 + 10),
+            range);
+  EXPECT_FALSE(ReadBsdiffSourceRange(
+      fd, extents, kBlockSize, kBlockSize * 2 + 1, kBlockSize, range.data()));
+  EXPECT_TRUE(fd->Close());
+}
+
+TEST_F(BspatchApplierTest, ExtentBsdiffSourceTest) {
+  const uint64_t kBlockSize = 4096;
+  test_utils::ScopedTempFile source_file("BspatchApplierTest-source.XXXXXX");
+  brillo::Blob source(old_data_);
+  source.resize(kBlockSize * 2);
+  ASSERT_TRUE(utils::WriteFile(source_file.path().c_str(), source.data(),
+                               source.size()));
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
+  ASSERT_TRUE(fd->Open(source_file.path().c_str(), O_RDONLY));
+
+  // The source data is the second block followed by the first one.
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(1, 1);
+  *extents.Add() = ExtentForRange(0, 1);
+  brillo::Blob source_data;
+  ASSERT_TRUE(ReadBsdiffSourceExtents(
+      fd, extents, kBlockSize, source.size(), &source_data));
+  ExtentBsdiffSource extent_source(fd, extents, kBlockSize, source.size());
+  EXPECT_EQ(source.size(), extent_source.size());
+
+  // The data is returned up to the end of the source, also before the data
+  // read last.
+  size_t length = kBlockSize;
+  const uint8_t* data = extent_source.Get(kBlockSize + 10, &length);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ(kBlockSize - 10, length);
+  EXPECT_EQ(0, memcmp(source_data.data() + kBlockSize + 10, data, length));
+  length = 20;
+  data = extent_source.Get(5, &length);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ(20U, length);
+  EXPECT_EQ(0, memcmp(source_data.data() + 5, data, length));
+
+  // The patch applied to the extents generates the same data as when applied
+  // to the source data read in memory.
+  brillo::Blob diff(source.size() - 100, 3);
+  brillo::Blob patch = BuildPatch(
+      {{static_cast<int64_t>(diff.size()) - 100, 0, -1000}, {100, 10, 0}},
+      diff, brillo::Blob(10, 'x'), diff.size() + 10);
+  EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  EXPECT_TRUE(ApplyBsdiffPatch(source_data.data(), source_data.size(),
+                               patch.data(), patch.size(),
+                               diff.size() + 10, &writer_));
+  EXPECT_TRUE(writer_.End());
+  FakeExtentWriter extent_writer;
+  EXPECT_TRUE(extent_writer.Init(nullptr, {}, 4096));
+  EXPECT_TRUE(ApplyBsdiffPatch(&extent_source,
+                               patch.data(), patch.size(),
+                               diff.size() + 10, &extent_writer));
+  EXPECT_TRUE(extent_writer.End());
+  EXPECT_EQ(writer_.WrittenData(), extent_writer.WrittenData());
+  EXPECT_TRUE(fd->Close());
+}
+
+TEST(SourceDataPoolTest, ReusesSmallBuffersTest) {
+  SourceDataPool pool(100);
+  brillo::Blob* small_buffer;
+  {
+    ScopedSourceData data(&pool);
+    data->resize(50);
+    small_buffer = data.get();
+  }
+  {
+    // The buffer is reused, empty but with its memory.
+    ScopedSourceData data(&pool);
+    EXPECT_EQ(small_buffer, data.get());
+    EXPECT_TRUE(data->empty());
+    EXPECT_LE(50U, data->capacity());
+    data->resize(200);
+  }
+  // The buffer grew over the limit, so it wasn't kept.
+  ScopedSourceData data(&pool);
+  EXPECT_EQ(0U, data->capacity());
+}
+
+}  // namespace chromeos_update_engine
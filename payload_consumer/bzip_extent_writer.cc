@@ -21,25 +21,113 @@ using std::vector;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// The size of the output buffer when not using a pool.
+const brillo::Blob::size_type kOutputBufferLength = 1024 * 1024;  // 1 MiB
+
+// The memory used by the libbz2 decompressor in its faster mode, 100 KB plus
+// four times the block size, for the 900 KB blocks of "bzip2 -9".
+const uint64_t kBzipDecompressorMemory = 100000 + 4 * 900000;
+}
+
+BzipDecoderPool::~BzipDecoderPool() {
+  for (const auto& size_buffer : free_buffers_)
+    free(size_buffer.second);
+}
+
+void BzipDecoderPool::SetAllocator(bz_stream* stream) {
+  stream->bzalloc = &BzipDecoderPool::Allocate;
+  stream->bzfree = &BzipDecoderPool::Free;
+  stream->opaque = this;
+}
+
+void* BzipDecoderPool::Allocate(void* opaque, int count, int size) {
+  BzipDecoderPool* pool = static_cast<BzipDecoderPool*>(opaque);
+  const size_t buffer_size = static_cast<size_t>(count) * size;
+  base::AutoLock auto_lock(pool->lock_);
+  void* buffer = nullptr;
+  auto free_it = pool->free_buffers_.find(buffer_size);
+  if (free_it != pool->free_buffers_.end()) {
+    buffer = free_it->second;
+    pool->free_buffers_.erase(free_it);
+    pool->free_bytes_ -= buffer_size;
+    pool->memory_.Set(pool->free_bytes_);
+  } else {
+    buffer = malloc(buffer_size);
+    if (!buffer)
+      return nullptr;
+  }
+  pool->buffer_sizes_[buffer] = buffer_size;
+  return buffer;
+}
+
+void BzipDecoderPool::Free(void* opaque, void* buffer) {
+  BzipDecoderPool* pool = static_cast<BzipDecoderPool*>(opaque);
+  base::AutoLock auto_lock(pool->lock_);
+  auto size_it = pool->buffer_sizes_.find(buffer);
+  CHECK(size_it != pool->buffer_sizes_.end());
+  if (pool->shrunk_) {
+    free(buffer);
+  } else {
+    pool->free_buffers_.emplace(size_it->second, buffer);
+    pool->free_bytes_ += size_it->second;
+  }
+  pool->buffer_sizes_.erase(size_it);
+  pool->memory_.Set(pool->free_bytes_);
+}
+
+void BzipDecoderPool::ShrinkToMinimum() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = true;
+  for (const auto& size_buffer : free_buffers_)
+    free(size_buffer.second);
+  free_buffers_.clear();
+  free_bytes_ = 0;
+  memory_.Set(free_bytes_);
+}
+
+void BzipDecoderPool::RestoreCapacity() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = false;
+}
+
+BzipExtentWriter::~BzipExtentWriter() {
+  // A stream not ended frees its state, also back to the pool if any.
+  if (stream_.state)
+    BZ2_bzDecompressEnd(&stream_);
+  if (output_buffers_ && output_buffer_)
+    output_buffers_->Release(output_buffer_);
 }
 
 bool BzipExtentWriter::Init(FileDescriptorPtr fd,
                             const vector<Extent>& extents,
                             uint32_t block_size) {
   // Init bzip2 stream
+  if (decoders_)
+    decoders_->SetAllocator(&stream_);
   int rc = BZ2_bzDecompressInit(&stream_,
                                 0,   // verbosity. (0 == silent)
                                 0);  // 0 = faster algo, more memory
 
   TEST_AND_RETURN_FALSE(rc == BZ_OK);
 
+  if (!output_buffer_) {
+    if (output_buffers_) {
+      output_buffer_ = static_cast<uint8_t*>(output_buffers_->Acquire());
+      TEST_AND_RETURN_FALSE(output_buffer_);
+      output_buffer_size_ = output_buffers_->buffer_size();
+    } else {
+      owned_output_buffer_.resize(kOutputBufferLength);
+      output_buffer_ = owned_output_buffer_.data();
+      output_buffer_size_ = owned_output_buffer_.size();
+    }
+  }
+  output_used_ = 0;
+  memory_.Set(output_buffer_size_ + kBzipDecompressorMemory);
+
   return next_->Init(fd, extents, block_size);
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
-
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
@@ -54,23 +142,24 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   stream_.avail_in = input_end - input;
 
   for (;;) {
-    stream_.next_out = reinterpret_cast<char*>(output_buffer.data());
-    stream_.avail_out = output_buffer.size();
+    stream_.next_out = reinterpret_cast<char*>(output_buffer_ + output_used_);
+    stream_.avail_out = output_buffer_size_ - output_used_;
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
+    output_used_ = output_buffer_size_ - stream_.avail_out;
 
-    if (stream_.avail_out == output_buffer.size())
-      break;  // got no new bytes
-
-    TEST_AND_RETURN_FALSE(
-        next_->Write(output_buffer.data(),
-                     output_buffer.size() - stream_.avail_out));
-
-    if (rc == BZ_STREAM_END)
+    if (rc == BZ_STREAM_END) {
+      // The stream can end exactly as the output buffer fills, and can't be
+      // decompressed any further. The output left is flushed by End().
       CHECK_EQ(stream_.avail_in, 0u);
-    if (stream_.avail_in == 0)
-      break;  // no more input to process
+      break;
+    }
+    if (stream_.avail_out > 0)
+      break;  // all the input was decompressed
+
+    // The output buffer is full, but there may be more output pending.
+    TEST_AND_RETURN_FALSE(FlushOutputBuffer());
   }
 
   // Store unconsumed data (if any) in |input_buffer_|.
@@ -85,7 +174,25 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
 bool BzipExtentWriter::EndImpl() {
   TEST_AND_RETURN_FALSE(input_buffer_.empty());
   TEST_AND_RETURN_FALSE(BZ2_bzDecompressEnd(&stream_) == BZ_OK);
+  TEST_AND_RETURN_FALSE(FlushOutputBuffer());
+  ReleaseOutputBuffer();
   return next_->End();
 }
 
+bool BzipExtentWriter::FlushOutputBuffer() {
+  if (output_used_ > 0) {
+    TEST_AND_RETURN_FALSE(next_->Write(output_buffer_, output_used_));
+    output_used_ = 0;
+  }
+  return true;
+}
+
+void BzipExtentWriter::ReleaseOutputBuffer() {
+  if (output_buffers_ && output_buffer_) {
+    output_buffers_->Release(output_buffer_);
+    output_buffer_ = nullptr;
+  }
+  memory_.Set(owned_output_buffer_.size());
+}
+
 }  // namespace chromeos_update_engine
@@ -18,27 +18,85 @@
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_BZIP_EXTENT_WRITER_H_
 
 #include <bzlib.h>
+#include <map>
 #include <memory>
 #include <vector>
 
+#include <base/synchronization/lock.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/common/memory_tracker.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 
 // BzipExtentWriter is a concrete ExtentWriter subclass that bzip-decompresses
 // what it's given in Write. It passes the decompressed data to an underlying
 // ExtentWriter.
+//
+// The decompressed data is collected in an output buffer and passed to the
+// underlying ExtentWriter only once the buffer is full or on End(), so it sees
+// a few large writes. When created with an AlignedBufferPool, the output buffer
+// comes from the pool and goes back to it on End(), for the next writer.
+// Likewise, the decompressor state is allocated from the BzipDecoderPool the
+// writer is created with, if any.
 
 namespace chromeos_update_engine {
 
+// The memory of the libbz2 decompressor states freed by the
+// BzipExtentWriters, handed to the next ones. libbz2 can't reset a
+// decompressor, so each stream allocates its state and the multi-megabyte
+// block arrays again, which are the same sizes for the streams compressed
+// with the same block size. It is shared by the writers of all the threads.
+class BzipDecoderPool : public ShrinkableCache {
+ public:
+  BzipDecoderPool() = default;
+  ~BzipDecoderPool() override;
+
+  // Sets the allocator of the |stream| to this pool, before
+  // BZ2_bzDecompressInit().
+  void SetAllocator(bz_stream* stream);
+
+  // ShrinkableCache overrides. The shrunk pool frees the memory freed by the
+  // decompressors instead of keeping it.
+  void ShrinkToMinimum() override;
+  void RestoreCapacity() override;
+
+ private:
+  // The libbz2 allocator callbacks, with this pool as the |opaque| pointer.
+  static void* Allocate(void* opaque, int count, int size);
+  static void Free(void* opaque, void* buffer);
+
+  base::Lock lock_;
+  // The allocations freed and not allocated again, by size, protected by
+  // |lock_|.
+  std::multimap<size_t, void*> free_buffers_;
+  // The sizes of the allocations handed out, protected by |lock_|.
+  std::map<void*, size_t> buffer_sizes_;
+  bool shrunk_{false};
+
+  // The memory held by the |free_buffers_|.
+  uint64_t free_bytes_{0};
+  TrackedMemory memory_{"Decompressor pool"};
+
+  DISALLOW_COPY_AND_ASSIGN(BzipDecoderPool);
+};
+
 class BzipExtentWriter : public ExtentWriter {
  public:
   explicit BzipExtentWriter(std::unique_ptr<ExtentWriter> next)
-      : next_(std::move(next)) {
+      : BzipExtentWriter(std::move(next), nullptr) {}
+  BzipExtentWriter(std::unique_ptr<ExtentWriter> next,
+                   AlignedBufferPool* output_buffers)
+      : BzipExtentWriter(std::move(next), output_buffers, nullptr) {}
+  BzipExtentWriter(std::unique_ptr<ExtentWriter> next,
+                   AlignedBufferPool* output_buffers,
+                   BzipDecoderPool* decoders)
+      : next_(std::move(next)),
+        decoders_(decoders),
+        output_buffers_(output_buffers) {
     memset(&stream_, 0, sizeof(stream_));
   }
-  ~BzipExtentWriter() override = default;
+  ~BzipExtentWriter() override;
 
   bool Init(FileDescriptorPtr fd,
             const std::vector<Extent>& extents,
@@ -49,7 +107,26 @@ class BzipExtentWriter : public ExtentWriter {
  private:
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
   bz_stream stream_;  // the libbz2 stream
+  // The pool the decompressor state is allocated from, if any.
+  BzipDecoderPool* decoders_{nullptr};
   brillo::Blob input_buffer_;
+
+  // Passes the |output_used_| bytes of the output buffer to |next_|.
+  bool FlushOutputBuffer();
+
+  // Passes the output buffer back to its pool, if any, once the stream ended.
+  void ReleaseOutputBuffer();
+
+  // The pool of the |output_buffer_|, if any. Otherwise, the output buffer is
+  // held in |owned_output_buffer_|.
+  AlignedBufferPool* output_buffers_{nullptr};
+  brillo::Blob owned_output_buffer_;
+  uint8_t* output_buffer_{nullptr};
+  size_t output_buffer_size_{0};
+  size_t output_used_{0};
+
+  // The memory held by the output buffer and the decompressor state.
+  TrackedMemory memory_{"Decompressor"};
 };
 
 }  // namespace chromeos_update_engine
@@ -27,6 +27,7 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bzip.h"
 
 using std::min;
 using std::string;
@@ -129,4 +130,103 @@ TEST_F(BzipExtentWriterTest, ChunkedTest) {
   test_utils::ExpectVectorsEq(decompressed_data, output);
 }
 
+TEST_F(BzipExtentWriterTest, PooledOutputBufferTest) {
+  // The 200 KiB of output span several of the pooled output buffers.
+  brillo::Blob decompressed_data(200 * 1024);
+  for (size_t i = 0; i < decompressed_data.size(); ++i)
+    decompressed_data[i] = static_cast<uint8_t>("ABC\n"[i % 4]);
+  brillo::Blob compressed_data;
+  EXPECT_TRUE(BzipCompress(decompressed_data, &compressed_data));
+
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(decompressed_data.size() / kBlockSize);
+  extents.push_back(extent);
+
+  AlignedBufferPool output_buffers(3 * kBlockSize, kBlockSize);
+  void* output_buffer = output_buffers.Acquire();
+  ASSERT_NE(nullptr, output_buffer);
+  output_buffers.Release(output_buffer);
+  {
+    BzipExtentWriter bzip_writer(
+        brillo::make_unique_ptr(new DirectExtentWriter()), &output_buffers);
+    EXPECT_TRUE(bzip_writer.Init(fd_, extents, kBlockSize));
+    EXPECT_TRUE(bzip_writer.Write(compressed_data.data(),
+                                  compressed_data.size()));
+    EXPECT_TRUE(bzip_writer.End());
+  }
+  // The output buffer was returned to the pool for the next writer.
+  EXPECT_EQ(output_buffer, output_buffers.Acquire());
+  output_buffers.Release(output_buffer);
+
+  brillo::Blob output;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &output));
+  test_utils::ExpectVectorsEq(decompressed_data, output);
+}
+
+TEST_F(BzipExtentWriterTest, OutputEndingWithTheBufferTest) {
+  // The stream ends exactly as the 1 MiB output buffer fills, once or twice.
+  for (size_t size : {1024 * 1024, 2 * 1024 * 1024}) {
+    brillo::Blob decompressed_data(size);
+    for (size_t i = 0; i < decompressed_data.size(); ++i)
+      decompressed_data[i] = static_cast<uint8_t>("ABC\n"[i % 4]);
+    brillo::Blob compressed_data;
+    EXPECT_TRUE(BzipCompress(decompressed_data, &compressed_data));
+
+    vector<Extent> extents;
+    Extent extent;
+    extent.set_start_block(0);
+    extent.set_num_blocks(decompressed_data.size() / kBlockSize);
+    extents.push_back(extent);
+
+    BzipExtentWriter bzip_writer(
+        brillo::make_unique_ptr(new DirectExtentWriter()));
+    EXPECT_TRUE(bzip_writer.Init(fd_, extents, kBlockSize));
+    EXPECT_TRUE(bzip_writer.Write(compressed_data.data(),
+                                  compressed_data.size()));
+    EXPECT_TRUE(bzip_writer.End());
+
+    brillo::Blob output;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &output));
+    test_utils::ExpectVectorsEq(decompressed_data, output);
+  }
+}
+
+TEST_F(BzipExtentWriterTest, DecoderPoolTest) {
+  brillo::Blob decompressed_data(20 * kBlockSize);
+  test_utils::FillWithData(&decompressed_data);
+  brillo::Blob compressed_data;
+  EXPECT_TRUE(BzipCompress(decompressed_data, &compressed_data));
+
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(decompressed_data.size() / kBlockSize);
+  extents.push_back(extent);
+
+  BzipDecoderPool decoders;
+  {
+    // A writer destroyed in the middle of its stream frees its state too.
+    BzipExtentWriter bzip_writer(
+        brillo::make_unique_ptr(new DirectExtentWriter()), nullptr, &decoders);
+    EXPECT_TRUE(bzip_writer.Init(fd_, extents, kBlockSize));
+    EXPECT_TRUE(bzip_writer.Write(compressed_data.data(),
+                                  compressed_data.size() / 2));
+  }
+  // The next writers allocate their state from the memory freed in the pool.
+  for (int i = 0; i < 2; i++) {
+    BzipExtentWriter bzip_writer(
+        brillo::make_unique_ptr(new DirectExtentWriter()), nullptr, &decoders);
+    EXPECT_TRUE(bzip_writer.Init(fd_, extents, kBlockSize));
+    EXPECT_TRUE(bzip_writer.Write(compressed_data.data(),
+                                  compressed_data.size()));
+    EXPECT_TRUE(bzip_writer.End());
+
+    brillo::Blob output;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &output));
+    test_utils::ExpectVectorsEq(decompressed_data, output);
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,136 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/comparing_file_descriptor.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The large writes are compared in pieces of this size, so the buffer doesn't
+// grow to the size of the largest write.
+const size_t kCompareBufferSize = 256 * 1024;
+
+}  // namespace
+
+bool ComparingFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool ComparingFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t ComparingFileDescriptor::Read(void* buf, size_t count) {
+  // The wrapped file descriptor may have been sought by a comparison.
+  if (offset_ < 0 || fd_->Seek(offset_, SEEK_SET) != offset_)
+    return -1;
+  ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t ComparingFileDescriptor::Write(const void* buf, size_t count) {
+  if (offset_ < 0)
+    return -1;
+  if (comparing_ && count > 0) {
+    if (WriteChangedBlocks(static_cast<const uint8_t*>(buf), count)) {
+      offset_ += count;
+      return count;
+    }
+    // The whole write is retried without comparing after a failed read.
+    if (comparing_)
+      return -1;
+  }
+  if (fd_->Seek(offset_, SEEK_SET) != offset_)
+    return -1;
+  ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0)
+    offset_ += bytes_written;
+  return bytes_written;
+}
+
+off64_t ComparingFileDescriptor::Seek(off64_t offset, int whence) {
+  // The relative seeks are made from the offset of the wrapped descriptor.
+  if (whence == SEEK_CUR && (offset_ < 0 || fd_->Seek(offset_, SEEK_SET) < 0))
+    return -1;
+  offset_ = fd_->Seek(offset, whence);
+  return offset_;
+}
+
+bool ComparingFileDescriptor::WriteChangedBlocks(const uint8_t* data,
+                                                 size_t count) {
+  compare_buffer_.resize(std::min(count, kCompareBufferSize));
+  for (size_t done = 0; done < count;) {
+    const size_t bytes = std::min(count - done, compare_buffer_.size());
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(fd_,
+                         compare_buffer_.data(),
+                         bytes,
+                         offset_ + done,
+                         &bytes_read)) {
+      LOG(WARNING) << "Unable to read the data before writing it, writing "
+                   << "without comparing from now on.";
+      comparing_ = false;
+      compare_buffer_.clear();
+      return false;
+    }
+    // Each run of changed blocks is written at once. The data past the end of
+    // the file is always written.
+    const uint8_t* piece = data + done;
+    auto write_run = [&](size_t start, size_t end) {
+      return utils::PWriteAll(
+          fd_, piece + start, end - start, offset_ + done + start);
+    };
+    bool in_run = false;
+    size_t run_start = 0;
+    for (size_t block = 0; block < bytes; block += block_size_) {
+      const size_t block_bytes = std::min(block_size_, bytes - block);
+      const bool changed =
+          block + block_bytes > static_cast<size_t>(bytes_read) ||
+          memcmp(compare_buffer_.data() + block, piece + block, block_bytes) !=
+              0;
+      if (changed && !in_run) {
+        in_run = true;
+        run_start = block;
+      } else if (!changed) {
+        if (in_run) {
+          TEST_AND_RETURN_FALSE(write_run(run_start, block));
+          in_run = false;
+        }
+        if (unchanged_bytes_)
+          *unchanged_bytes_ += block_bytes;
+      }
+    }
+    if (in_run)
+      TEST_AND_RETURN_FALSE(write_run(run_start, bytes));
+    done += bytes;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
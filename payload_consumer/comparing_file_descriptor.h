@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_COMPARING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_COMPARING_FILE_DESCRIPTOR_H_
+
+#include <atomic>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A FileDescriptor that reads the data already at the position of each write
+// and only writes the blocks of |block_size| bytes that differ, saving the
+// flash wear and the time of rewriting the target blocks a previous attempt
+// already wrote. It costs a read per write, so it's only worth using when most
+// of the data is expected to be there already. If the wrapped file descriptor
+// can't be read, such as the direct I/O ones reading into unaligned buffers,
+// the writes are passed through without comparing them.
+class ComparingFileDescriptor : public FileDescriptor {
+ public:
+  // The |unchanged_bytes|, if not null, is increased by the number of bytes
+  // not written because they were already there. It may be shared by the file
+  // descriptors of several threads and must outlive this one.
+  ComparingFileDescriptor(FileDescriptorPtr fd,
+                          size_t block_size,
+                          std::atomic<uint64_t>* unchanged_bytes)
+      : fd_(fd), block_size_(block_size), unchanged_bytes_(unchanged_bytes) {}
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool ZeroRange(uint64_t start, uint64_t length) override {
+    return fd_->ZeroRange(start, length);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  void Reset() override { fd_->Reset(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  // Writes the blocks of the |count| bytes of |data| at |offset_| that differ
+  // from the data already there. Returns false if a read or write fails, in
+  // which case no more writes are compared if the read failed.
+  bool WriteChangedBlocks(const uint8_t* data, size_t count);
+
+  FileDescriptorPtr fd_;
+  const size_t block_size_;
+  std::atomic<uint64_t>* unchanged_bytes_;
+
+  // The offset of this file descriptor, or -1 if unknown. The wrapped file
+  // descriptor is sought by the comparisons, so it may be elsewhere.
+  off64_t offset_{0};
+
+  // Whether the writes are still compared, and the buffer the data already
+  // there is read into.
+  bool comparing_{true};
+  brillo::Blob compare_buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(ComparingFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_COMPARING_FILE_DESCRIPTOR_H_
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/comparing_file_descriptor.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 16;
+
+// A FileDescriptor recording the size of the writes passed to it.
+class RecordingFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  ssize_t Write(const void* buf, size_t count) override {
+    writes_.push_back(count);
+    return EintrSafeFileDescriptor::Write(buf, count);
+  }
+
+  std::vector<size_t> writes_;
+};
+
+}  // namespace
+
+class ComparingFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Each block is filled with its number.
+    for (uint8_t block = 0; block < 4; block++)
+      data_.insert(data_.end(), kBlockSize, block);
+    EXPECT_TRUE(utils::MakeTempFile("ComparingFileDescriptor-XXXXXX", &path_,
+                                    nullptr));
+    EXPECT_TRUE(utils::WriteFile(path_.c_str(), data_.data(), data_.size()));
+    recording_fd_ = new RecordingFileDescriptor();
+    fd_.reset(recording_fd_);
+    EXPECT_TRUE(fd_->Open(path_.c_str(), O_RDWR));
+    comparing_fd_.reset(
+        new ComparingFileDescriptor(fd_, kBlockSize, &unchanged_bytes_));
+  }
+
+  void TearDown() override {
+    fd_->Close();
+    unlink(path_.c_str());
+  }
+
+  // Expects the file to hold the |expected| data.
+  void ExpectFileData(const brillo::Blob& expected) {
+    brillo::Blob file_data;
+    EXPECT_TRUE(utils::ReadFile(path_, &file_data));
+    EXPECT_EQ(expected, file_data);
+  }
+
+  brillo::Blob data_;
+  string path_;
+  RecordingFileDescriptor* recording_fd_;  // Owned by |fd_|.
+  FileDescriptorPtr fd_;
+  std::atomic<uint64_t> unchanged_bytes_{0};
+  FileDescriptorPtr comparing_fd_;
+};
+
+TEST_F(ComparingFileDescriptorTest, UnchangedWriteTest) {
+  EXPECT_TRUE(utils::PWriteAll(comparing_fd_, data_.data(), data_.size(), 0));
+  EXPECT_TRUE(recording_fd_->writes_.empty());
+  EXPECT_EQ(data_.size(), unchanged_bytes_);
+  ExpectFileData(data_);
+}
+
+TEST_F(ComparingFileDescriptorTest, ChangedBlocksTest) {
+  // Only the blocks 1 and 2 change, and they are written at once.
+  brillo::Blob new_data = data_;
+  new_data[kBlockSize + 3] = 'x';
+  new_data[2 * kBlockSize] = 'y';
+  EXPECT_TRUE(
+      utils::PWriteAll(comparing_fd_, new_data.data(), new_data.size(), 0));
+  EXPECT_EQ(std::vector<size_t>{2 * kBlockSize}, recording_fd_->writes_);
+  EXPECT_EQ(2 * kBlockSize, unchanged_bytes_);
+  ExpectFileData(new_data);
+
+  // The file descriptor is past the write, even though the wrapped one was
+  // sought by the comparisons.
+  EXPECT_EQ(static_cast<off64_t>(new_data.size()),
+            comparing_fd_->Seek(0, SEEK_CUR));
+}
+
+TEST_F(ComparingFileDescriptorTest, PastEndOfFileTest) {
+  // The data past the end of the file is written, with the changed last block.
+  brillo::Blob new_data(data_.begin() + 2 * kBlockSize, data_.end());
+  new_data.back() = 'z';
+  new_data.insert(new_data.end(), kBlockSize / 2, 'w');
+  EXPECT_TRUE(utils::PWriteAll(
+      comparing_fd_, new_data.data(), new_data.size(), 2 * kBlockSize));
+  EXPECT_EQ(std::vector<size_t>{kBlockSize + kBlockSize / 2},
+            recording_fd_->writes_);
+  EXPECT_EQ(kBlockSize, unchanged_bytes_);
+
+  brillo::Blob expected_data(data_.begin(), data_.begin() + 2 * kBlockSize);
+  expected_data.insert(expected_data.end(), new_data.begin(), new_data.end());
+  ExpectFileData(expected_data);
+}
+
+}  // namespace chromeos_update_engine
@@ -19,15 +19,23 @@
 #include <endian.h>
 #include <errno.h>
 #include <linux/fs.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_util.h>
 #include <base/format_macros.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
@@ -38,20 +46,28 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
-#include "update_engine/common/subprocess.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/common/trace_log.h"
+#include "update_engine/payload_consumer/bspatch_applier.h"
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
+#include "update_engine/payload_consumer/comparing_file_descriptor.h"
 #include "update_engine/payload_consumer/download_action.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/imgpatch_applier.h"
 #if USE_MTD
 #include "update_engine/payload_consumer/mtd_file_descriptor.h"
 #endif
+#include "update_engine/payload_consumer/operation_executor.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/source_block_cache.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
+using std::pair;
 using std::string;
 using std::vector;
 
@@ -65,7 +81,7 @@ const uint64_t DeltaPerformer::kDeltaManifestSizeSize = 8;
 const uint64_t DeltaPerformer::kDeltaMetadataSignatureSizeSize = 4;
 const uint64_t DeltaPerformer::kMaxPayloadHeaderSize = 24;
 const uint64_t DeltaPerformer::kSupportedMajorPayloadVersion = 2;
-const uint32_t DeltaPerformer::kSupportedMinorPayloadVersion = 3;
+const uint32_t DeltaPerformer::kSupportedMinorPayloadVersion = 12;
 
 const unsigned DeltaPerformer::kProgressLogMaxChunks = 10;
 const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
@@ -79,6 +95,42 @@ const int kMaxResumedUpdateFailures = 10;
 const int kUbiVolumeAttachTimeout = 5 * 60;
 #endif
 
+// The minimum blob size of the compressed REPLACE operations applied
+// while their blob is being downloaded.
+const uint64_t kMinStreamedDataLength = 128 * 1024;
+
+// The size of the buffers the compressed REPLACE operations decompress
+// their blob into before writing it.
+const size_t kDecompressionBufferSize = 1024 * 1024;  // 1 MiB
+
+// The SOURCE_BSDIFF operations with more source data than this don't read it
+// all in memory, so the few patches of very large files don't need as much
+// memory as their source.
+const uint64_t kMaxInMemoryBsdiffSourceLength = 64 * 1024 * 1024;  // 64 MiB
+
+// The size of the buffer of zeros written by the ZERO and DISCARD operations
+// when the target can't zero a range by itself.
+const size_t kZeroBufferSize = 4 * 1024 * 1024;  // 4 MiB
+
+// Returns a read-only buffer of kZeroBufferSize zeros shared by all the
+// threads, or nullptr if it couldn't be mapped. It's an anonymous mapping that
+// is never written, so its pages are all the kernel zero page and it takes no
+// memory.
+const uint8_t* MapZeroBuffer() {
+  void* mapping = mmap(nullptr, kZeroBufferSize, PROT_READ,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map the buffer of zeros";
+    return nullptr;
+  }
+  return static_cast<const uint8_t*>(mapping);
+}
+
+const uint8_t* GetZeroBuffer() {
+  static const uint8_t* const zeros = MapZeroBuffer();
+  return zeros;
+}
+
 FileDescriptorPtr CreateFileDescriptor(const char* path) {
   FileDescriptorPtr ret;
 #if USE_MTD
@@ -131,34 +183,319 @@ FileDescriptorPtr OpenFile(const char* path, int mode, int* err) {
   return fd;
 }
 
-// Discard the tail of the block device referenced by |fd|, from the offset
-// |data_size| until the end of the block device. Returns whether the data was
-// discarded.
-bool DiscardPartitionTail(FileDescriptorPtr fd, uint64_t data_size) {
-  uint64_t part_size = fd->BlockDevSize();
-  if (!part_size || part_size <= data_size)
+// Takes |extents| and returns the number of blocks in those extents.
+uint64_t GetBlockCount(const RepeatedPtrField<Extent>& extents) {
+  uint64_t sum = 0;
+  for (const Extent& ext : extents) {
+    sum += ext.num_blocks();
+  }
+  return sum;
+}
+
+// A run of blocks contiguous in both the source and the target extents,
+// copied by a MOVE or SOURCE_COPY operation with a single read and write.
+struct CopyChunk {
+  uint64_t src_block;
+  uint64_t dst_block;
+  uint64_t num_blocks;
+};
+
+// Walks the |src_extents| and |dst_extents| in parallel and splits them into
+// the runs of blocks contiguous in both of them, of at most |max_blocks| each.
+// Returns false if the extents don't have the same number of blocks.
+bool GetCopyChunks(const RepeatedPtrField<Extent>& src_extents,
+                   const RepeatedPtrField<Extent>& dst_extents,
+                   uint64_t max_blocks,
+                   vector<CopyChunk>* chunks) {
+  uint64_t blocks_to_read = GetBlockCount(src_extents);
+  uint64_t blocks_to_write = GetBlockCount(dst_extents);
+  TEST_AND_RETURN_FALSE(blocks_to_write == blocks_to_read);
+
+  int src_index = 0, dst_index = 0;
+  uint64_t src_offset = 0, dst_offset = 0;
+  while (src_index < src_extents.size() && dst_index < dst_extents.size()) {
+    const Extent& src_extent = src_extents.Get(src_index);
+    const Extent& dst_extent = dst_extents.Get(dst_index);
+    const uint64_t blocks = min(
+        min(src_extent.num_blocks() - src_offset,
+            dst_extent.num_blocks() - dst_offset),
+        max_blocks);
+    chunks->push_back(CopyChunk{src_extent.start_block() + src_offset,
+                                dst_extent.start_block() + dst_offset,
+                                blocks});
+
+    src_offset += blocks;
+    if (src_offset == src_extent.num_blocks()) {
+      src_index++;
+      src_offset = 0;
+    }
+    dst_offset += blocks;
+    if (dst_offset == dst_extent.num_blocks()) {
+      dst_index++;
+      dst_offset = 0;
+    }
+  }
+  return true;
+}
+
+// Returns whether any of the |ranges|, disjoint and keyed by their first
+// block, overlaps the blocks from |start_block| up to |end_block|.
+bool RangesOverlap(const std::map<uint64_t, uint64_t>& ranges,
+                   uint64_t start_block,
+                   uint64_t end_block) {
+  auto next = ranges.lower_bound(end_block);
+  if (next == ranges.begin())
     return false;
+  --next;
+  return next->second > start_block;
+}
 
-  const vector<int> requests = {
-      BLKSECDISCARD,
-      BLKDISCARD,
-#ifdef BLKZEROOUT
-      BLKZEROOUT,
-#endif
-  };
-  for (int request : requests) {
-    int error = 0;
-    if (fd->BlkIoctl(request, data_size, part_size - data_size, &error) &&
-        error == 0) {
+// Returns whether copying the |chunks| one after the other, in order, never
+// writes a block that a later chunk still has to read. That's always the case
+// when the source and target blocks don't overlap.
+bool CanCopyChunksInOrder(const vector<CopyChunk>& chunks) {
+  // The blocks read by the chunks after the current one, as a map from the
+  // first block of each range to the block after its last one.
+  std::map<uint64_t, uint64_t> later_src_ranges;
+  for (auto chunk = chunks.rbegin(); chunk != chunks.rend(); ++chunk) {
+    const uint64_t src_end = chunk->src_block + chunk->num_blocks;
+    const uint64_t dst_end = chunk->dst_block + chunk->num_blocks;
+    if (RangesOverlap(later_src_ranges, chunk->dst_block, dst_end))
+      return false;
+    // Blocks read more than once aren't expected; they are handled by copying
+    // the whole operation at once.
+    if (RangesOverlap(later_src_ranges, chunk->src_block, src_end))
+      return false;
+    later_src_ranges[chunk->src_block] = src_end;
+  }
+  return true;
+}
+
+// Walks the src and dst extents of the SOURCE_COPY |operation| in parallel and
+// splits them into the runs of blocks contiguous in both of them, of at most
+// |max_blocks| each. Returns false if the extents don't have the same number
+// of blocks.
+bool GetSourceCopyChunks(const InstallOperation& operation,
+                         uint64_t block_size,
+                         uint64_t max_blocks,
+                         vector<CopyChunk>* chunks) {
+  if (operation.has_src_length())
+    TEST_AND_RETURN_FALSE(operation.src_length() % block_size == 0);
+  if (operation.has_dst_length())
+    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size == 0);
+  return GetCopyChunks(
+      operation.src_extents(), operation.dst_extents(), max_blocks, chunks);
+}
+
+// Returns whether the |operation| of a payload of |minor_version| reads the old
+// contents of the partition, either from the source slot or, for MOVE and
+// BSDIFF, in place. From kBlobDedupMinorPayloadVersion on, a MOVE instead
+// copies the blocks an earlier operation wrote in the target partition.
+bool OperationReadsSourceData(const InstallOperation& operation,
+                              uint32_t minor_version) {
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return false;
+    case InstallOperation::MOVE:
+      return minor_version < kBlobDedupMinorPayloadVersion;
+    default:
+      return true;
+  }
+}
+
+// Adds the blocks of the |extents| to the |ranges|, disjoint and keyed by
+// their first block, merging the ones they overlap.
+void AddExtentsToRanges(const RepeatedPtrField<Extent>& extents,
+                        std::map<uint64_t, uint64_t>* ranges) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    uint64_t start_block = extent.start_block();
+    uint64_t end_block = start_block + extent.num_blocks();
+    auto next = ranges->upper_bound(start_block);
+    if (next != ranges->begin()) {
+      auto previous = std::prev(next);
+      if (previous->second >= start_block) {
+        start_block = previous->first;
+        end_block = std::max(end_block, previous->second);
+        ranges->erase(previous);
+      }
+    }
+    while (next != ranges->end() && next->first <= end_block) {
+      end_block = std::max(end_block, next->second);
+      next = ranges->erase(next);
+    }
+    (*ranges)[start_block] = end_block;
+  }
+}
+
+// Returns whether any of the |extents| overlaps the |ranges|, disjoint and
+// keyed by their first block.
+bool ExtentsOverlapRanges(const RepeatedPtrField<Extent>& extents,
+                          const std::map<uint64_t, uint64_t>& ranges) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() != kSparseHole &&
+        RangesOverlap(ranges,
+                      extent.start_block(),
+                      extent.start_block() + extent.num_blocks())) {
       return true;
     }
-    LOG(WARNING) << "Error discarding the last "
-                 << (part_size - data_size) / 1024 << " KiB using ioctl("
-                 << request << ")";
   }
   return false;
 }
 
+// Returns whether the |operations| of a partition can be applied with its
+// source and target on the same device, as for the chained payloads applied
+// on the target slot: no operation may read a block that it or a previous
+// operation writes, except for a SOURCE_COPY copying blocks onto themselves.
+// Not used for the in-place minor version, generated to be applied this way.
+bool CanApplyOperationsInPlace(
+    const RepeatedPtrField<InstallOperation>& operations,
+    uint32_t minor_version) {
+  // The blocks written so far, as a map from the first block of each range to
+  // the block after its last one.
+  std::map<uint64_t, uint64_t> written_ranges;
+  for (const InstallOperation& operation : operations) {
+    bool copies_onto_itself = false;
+    vector<CopyChunk> chunks;
+    if (operation.type() == InstallOperation::SOURCE_COPY &&
+        GetCopyChunks(operation.src_extents(),
+                      operation.dst_extents(),
+                      std::numeric_limits<uint64_t>::max(),
+                      &chunks)) {
+      copies_onto_itself = std::all_of(
+          chunks.begin(), chunks.end(), [](const CopyChunk& chunk) {
+            return chunk.src_block == chunk.dst_block;
+          });
+    }
+    if (!copies_onto_itself)
+      AddExtentsToRanges(operation.dst_extents(), &written_ranges);
+    if (OperationReadsSourceData(operation, minor_version) &&
+        ExtentsOverlapRanges(operation.src_extents(), written_ranges)) {
+      return false;
+    }
+    AddExtentsToRanges(operation.dst_extents(), &written_ranges);
+  }
+  return true;
+}
+
+// Returns whether all the operations of the |partitions| of a payload of
+// |minor_version| reading from the source partitions validate the hash of the
+// data they read. The operations in segments aren't known until the segments
+// are loaded.
+bool AllSourceOperationsHashed(const vector<PartitionUpdate>& partitions,
+                               uint32_t minor_version) {
+  for (const PartitionUpdate& partition : partitions) {
+    if (partition.has_operations_segment())
+      return false;
+    for (const InstallOperation& operation : partition.operations()) {
+      if (OperationReadsSourceData(operation, minor_version) &&
+          !operation.has_src_sha256_hash()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns the number of operations of the |partition|, also when they are in
+// an operations segment not loaded yet.
+size_t NumPartitionOperations(const PartitionUpdate& partition) {
+  if (partition.has_operations_segment())
+    return partition.operations_segment().num_operations();
+  return partition.operations_size();
+}
+
+// Logs the hit rate of the source block |cache| of the partition |name|.
+void LogSourceCacheStats(const string& name, const SourceBlockCache& cache) {
+  const uint64_t hits = cache.hits();
+  const uint64_t misses = cache.misses();
+  if (hits + misses == 0)
+    return;
+  LOG(INFO) << "Read " << hits + misses << " source blocks of partition "
+            << name << ", " << hits << " of them from the cache ("
+            << hits * 100 / (hits + misses) << "%).";
+}
+
+// Returns whether the data of the |operation| is split in independent xz
+// chunks.
+bool HasXzChunks(const InstallOperation& operation) {
+  return operation.xz_chunk_sizes_size() > 0;
+}
+
+// Returns whether the xz chunks of the |operation|, if any, are valid: only
+// REPLACE_XZ operations can have them and they must cover all its blocks and
+// data.
+bool ValidXzChunks(const InstallOperation& operation) {
+  if (!operation.has_xz_chunk_blocks() && !HasXzChunks(operation))
+    return true;
+  if (operation.type() != InstallOperation::REPLACE_XZ ||
+      operation.xz_chunk_blocks() == 0) {
+    return false;
+  }
+  const uint64_t num_blocks = GetBlockCount(operation.dst_extents());
+  const uint64_t num_chunks =
+      (num_blocks + operation.xz_chunk_blocks() - 1) /
+      operation.xz_chunk_blocks();
+  if (num_chunks != static_cast<uint64_t>(operation.xz_chunk_sizes_size()))
+    return false;
+  uint64_t data_length = 0;
+  for (uint64_t chunk_size : operation.xz_chunk_sizes()) {
+    if (chunk_size == 0)
+      return false;
+    data_length += chunk_size;
+  }
+  return data_length == operation.data_length();
+}
+
+// Returns the REPLACE_XZ operation decompressing the xz chunk number |chunk|
+// of the |operation|, whose data is at |data_offset| of the operation data.
+InstallOperation XzChunkOperation(const InstallOperation& operation,
+                                  int chunk,
+                                  uint64_t data_offset) {
+  InstallOperation chunk_operation;
+  chunk_operation.set_type(InstallOperation::REPLACE_XZ);
+  chunk_operation.set_data_offset(operation.data_offset() + data_offset);
+  chunk_operation.set_data_length(operation.xz_chunk_sizes(chunk));
+  // The blocks [first_block, end_block) of the |operation| dst_extents.
+  const uint64_t first_block =
+      static_cast<uint64_t>(chunk) * operation.xz_chunk_blocks();
+  const uint64_t end_block = first_block + operation.xz_chunk_blocks();
+  uint64_t block = 0;
+  for (const Extent& extent : operation.dst_extents()) {
+    const uint64_t start = std::max(block, first_block);
+    const uint64_t end = std::min(block + extent.num_blocks(), end_block);
+    if (start < end) {
+      Extent* chunk_extent = chunk_operation.add_dst_extents();
+      chunk_extent->set_start_block(extent.start_block() + start - block);
+      chunk_extent->set_num_blocks(end - start);
+    }
+    block += extent.num_blocks();
+  }
+  return chunk_operation;
+}
+
+// Returns the number of the xz chunk of the |operation| holding the byte
+// |data_offset| of its data, setting |chunk_offset| to the offset of the
+// chunk.
+int XzChunkAt(const InstallOperation& operation,
+              uint64_t data_offset,
+              uint64_t* chunk_offset) {
+  *chunk_offset = 0;
+  int chunk = 0;
+  while (chunk + 1 < operation.xz_chunk_sizes_size() &&
+         *chunk_offset + operation.xz_chunk_sizes(chunk) <= data_offset) {
+    *chunk_offset += operation.xz_chunk_sizes(chunk);
+    chunk++;
+  }
+  return chunk;
+}
+
 }  // namespace
 
 
@@ -168,6 +505,12 @@ static uint64_t IntRatio(uint64_t part, uint64_t total, uint64_t norm) {
   return part * norm / total;
 }
 
+void DeltaPerformer::SetMaxActiveWorkers(size_t max_active_workers) {
+  max_active_workers_ = max_active_workers;
+  if (executor_)
+    executor_->SetMaxActiveWorkers(max_active_workers_);
+}
+
 void DeltaPerformer::LogProgress(const char* message_prefix) {
   // Format operations total count and percentage.
   string total_operations_str("?");
@@ -264,15 +607,25 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p, size_t* count_p,
   if (!count)
     return 0;  // Special case shortcut.
   size_t read_len = min(count, max - buffer_.size());
+  if (buffer_.capacity() < max)
+    buffer_.reserve(max);
   const char* bytes_start = *bytes_p;
   const char* bytes_end = bytes_start + read_len;
   buffer_.insert(buffer_.end(), bytes_start, bytes_end);
+  buffer_memory_.Set(buffer_.capacity());
   *bytes_p = bytes_end;
   *count_p = count - read_len;
   return read_len;
 }
 
 
+DeltaPerformer::~DeltaPerformer() {
+  // Stop the worker threads before destroying the members they use, without
+  // waiting for a suspended operation.
+  interrupter_->Cancel();
+  executor_.reset();
+}
+
 bool DeltaPerformer::HandleOpResult(bool op_result, const char* op_type_name,
                                     ErrorCode* error) {
   if (op_result)
@@ -291,7 +644,19 @@ bool DeltaPerformer::HandleOpResult(bool op_result, const char* op_type_name,
 }
 
 int DeltaPerformer::Close() {
+  // The operations applied by the worker threads must finish, or be canceled,
+  // before closing their partition.
+  interrupter_->Resume();
+  ErrorCode error;
+  bool operations_finished = WaitForScheduledOperations(&error);
+  executor_.reset();
+  AbortStreamingOperation();
+  CloseStagingFile();
   int err = -CloseCurrentPartition();
+  if (!operations_finished && err >= 0)
+    err = 1;
+  if (signed_hash_shared_)
+    ForkSignedHash();
   LOG_IF(ERROR, !payload_hash_calculator_.Finalize() ||
                 !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
@@ -300,29 +665,152 @@ int DeltaPerformer::Close() {
     if (err >= 0)
       err = 1;
   }
+  if (err == 0 && manifest_valid_ &&
+      next_operation_num_ == num_total_operations_) {
+    // The hash trees are written first, as the partition hashes cover them.
+    if (BuildHashTrees())
+      VerifyTargetHashesInline();
+    else
+      err = 1;
+  }
+  if (next_operation_num_ > 0)
+    LOG(INFO) << operation_stats_.ToString();
+  if (compare_before_write_) {
+    LOG(INFO) << "Skipped writing " << unchanged_bytes_
+              << " bytes already in the target partitions.";
+  }
   return -err;
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
-  int err = 0;
-  if (source_fd_ && !source_fd_->Close()) {
-    err = errno;
-    PLOG(ERROR) << "Error closing source partition";
+  int err = CloseFileDescriptors(source_fd_, target_fd_, worker_fds_.get());
+  if (direct_target_fd_ &&
+      (!direct_target_fd_->Flush() || !direct_target_fd_->Close())) {
+    err = -errno;
+    PLOG(ERROR) << "Error closing the direct I/O target partition";
     if (!err)
-      err = 1;
+      err = -EIO;
+  }
+  direct_target_fd_.reset();
+  for (AsyncFileDescriptor* async_fd :
+       {async_source_fd_.get(), async_target_fd_.get()}) {
+    if (async_fd && !async_fd->Close()) {
+      PLOG(ERROR) << "Error closing the async file descriptor";
+      if (!err)
+        err = -EIO;
+    }
   }
+  async_source_fd_.reset();
+  async_target_fd_.reset();
+  if (source_cache_) {
+    LogSourceCacheStats(partitions_[current_partition_].partition_name(),
+                        *source_cache_);
+  }
+  CloseSourcePrefetchFd();
+  source_cache_registration_.reset();
+  source_cache_.reset();
   source_fd_.reset();
   source_path_.clear();
+  target_trimmer_.reset();
+  target_fd_.reset();
+  target_path_.clear();
+  worker_fds_.reset();
+  return err;
+}
 
-  if (target_fd_ && !target_fd_->Close()) {
-    err = errno;
-    PLOG(ERROR) << "Error closing target partition";
-    if (!err)
-      err = 1;
+int DeltaPerformer::CloseFileDescriptors(
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    const WorkerFileDescriptors* worker_fds) {
+  vector<FileDescriptorPtr> source_fds = {source_fd};
+  vector<FileDescriptorPtr> target_fds = {target_fd};
+  if (worker_fds) {
+    source_fds.insert(source_fds.end(),
+                      worker_fds->source_fds.begin(),
+                      worker_fds->source_fds.end());
+    target_fds.insert(target_fds.end(),
+                      worker_fds->target_fds.begin(),
+                      worker_fds->target_fds.end());
+  }
+
+  int err = 0;
+  for (const FileDescriptorPtr& fd : source_fds) {
+    if (fd && !fd->Close()) {
+      err = errno;
+      PLOG(ERROR) << "Error closing source partition";
+      if (!err)
+        err = 1;
+    }
+  }
+  for (const FileDescriptorPtr& fd : target_fds) {
+    if (fd && !fd->Close()) {
+      err = errno;
+      PLOG(ERROR) << "Error closing target partition";
+      if (!err)
+        err = 1;
+    }
+  }
+  return -err;
+}
+
+bool DeltaPerformer::FinishCurrentPartition(ErrorCode* error) {
+  // The end of the partition is still discarded once all its operations
+  // started.
+  if (target_trimmer_)
+    target_trimmer_->Flush();
+  if (!executor_ || max_concurrent_partitions_ <= 1) {
+    if (!WaitForScheduledOperations(error))
+      return false;
+    CloseCurrentPartition();
+    ReleaseOperationsSegment(current_partition_);
+    return true;
   }
+
+  // Keep the partition open until its scheduled operations finish, so the
+  // next partition can start in the meantime.
+  finishing_partitions_.push_back(
+      FinishingPartition{current_partition_,
+                         acc_num_operations_[current_partition_],
+                         source_fd_,
+                         target_fd_,
+                         worker_fds_,
+                         source_cache_});
+  source_cache_registration_.reset();
+  source_cache_.reset();
+  CloseSourcePrefetchFd();
+  source_fd_.reset();
+  source_path_.clear();
+  target_trimmer_.reset();
   target_fd_.reset();
   target_path_.clear();
-  return -err;
+  worker_fds_.reset();
+
+  // With the next partition, at most |max_concurrent_partitions_| are open.
+  while (finishing_partitions_.size() >= max_concurrent_partitions_) {
+    if (!executor_->WaitFor(finishing_partitions_.front().end_operation,
+                            error)) {
+      return false;
+    }
+    CloseFinishedPartitions();
+  }
+  return true;
+}
+
+void DeltaPerformer::CloseFinishedPartitions() {
+  while (!finishing_partitions_.empty() &&
+         (!executor_ ||
+          executor_->IsFinished(finishing_partitions_.front().end_operation))) {
+    const FinishingPartition& partition = finishing_partitions_.front();
+    CloseFileDescriptors(partition.source_fd,
+                         partition.target_fd,
+                         partition.worker_fds.get());
+    if (partition.source_cache) {
+      LogSourceCacheStats(partitions_[partition.partition].partition_name(),
+                          *partition.source_cache);
+    }
+    ReleaseOperationsSegment(partition.partition);
+    finishing_partitions_.pop_front();
+  }
 }
 
 bool DeltaPerformer::OpenCurrentPartition() {
@@ -343,6 +831,23 @@ bool DeltaPerformer::OpenCurrentPartition() {
                  << ", file " << source_path_;
       return false;
     }
+    if (source_cache_bytes_ >= block_size_) {
+      source_cache_.reset(
+          new SourceBlockCache(source_cache_bytes_ / block_size_, block_size_));
+      source_cache_registration_.reset(
+          new ShrinkableCacheRegistration(source_cache_.get()));
+    }
+    source_fd_ = WrapSourceFileDescriptor(source_fd_);
+    // The hints only need a file descriptor of the same partition.
+    prefetch_start_operation_ = 0;
+    prefetch_end_operation_ = 0;
+    prefetch_bytes_ = 0;
+    if (prefetch_max_operations_ || prefetch_max_bytes_) {
+      source_prefetch_fd_ =
+          HANDLE_EINTR(open(source_path_.c_str(), O_RDONLY | O_CLOEXEC));
+      PLOG_IF(WARNING, source_prefetch_fd_ < 0)
+          << "Unable to open " << source_path_ << " to prefetch it";
+    }
   }
 
   target_path_ = install_plan_->partitions[current_partition_].target_path;
@@ -355,18 +860,341 @@ bool DeltaPerformer::OpenCurrentPartition() {
                << ", file " << target_path_;
     return false;
   }
+  if (current_partition_ < target_hashers_.size()) {
+    target_hashers_[current_partition_].reset(new InlineTargetHasher(
+        install_plan_->partitions[current_partition_].target_size,
+        inline_max_pending_bytes_));
+    // The hash tree is built from the same writes.
+    if (partition.has_hash_tree_extent()) {
+      std::shared_ptr<HashTreeBuilder> builder = HashTreeBuilder::Create(
+          partition,
+          block_size_,
+          install_plan_->partitions[current_partition_].target_size);
+      TEST_AND_RETURN_FALSE(builder);
+      target_hashers_[current_partition_]->set_hash_tree_builder(builder);
+      hash_tree_builders_[current_partition_] = builder;
+    }
+  }
+  target_fd_ = WrapTargetFileDescriptor(target_fd_);
+
+  // The decompression buffers and decompressors are reused by all the
+  // operations, also the ones applied by the worker threads, so the pools must
+  // be created before any of them is scheduled.
+  if (!decompression_buffers_) {
+    decompression_buffers_.reset(
+        new AlignedBufferPool(kDecompressionBufferSize, block_size_));
+    bzip_decoders_.reset(new BzipDecoderPool());
+    xz_decoders_.reset(new XzDecoderPool());
+    pool_registrations_.emplace_back(
+        new ShrinkableCacheRegistration(decompression_buffers_.get()));
+    pool_registrations_.emplace_back(
+        new ShrinkableCacheRegistration(bzip_decoders_.get()));
+    pool_registrations_.emplace_back(
+        new ShrinkableCacheRegistration(xz_decoders_.get()));
+  }
+  if (manifest_.has_zstd_dictionary() && !zstd_dictionary_) {
+    zstd_dictionary_ =
+        ZstdDecoderDictionary::Create(manifest_.zstd_dictionary());
+    TEST_AND_RETURN_FALSE(zstd_dictionary_);
+  }
+
+  if (executor_ && !OpenWorkerFileDescriptors()) {
+    LOG(ERROR) << "Unable to open the worker file descriptors for partition "
+               << partition.partition_name();
+    return false;
+  }
+
+  if (direct_io_ && !OpenDirectTargetFileDescriptor()) {
+    LOG(ERROR) << "Unable to open the target partition "
+               << partition.partition_name() << " for direct I/O";
+    return false;
+  }
 
-  LOG(INFO) << "Applying " << partition.operations().size()
+  if (!executor_ && !OpenAsyncFileDescriptors()) {
+    LOG(ERROR) << "Unable to open the async file descriptors for partition "
+               << partition.partition_name();
+    return false;
+  }
+
+  LOG(INFO) << "Applying " << NumPartitionOperations(partition)
             << " operations to partition \"" << partition.partition_name()
             << "\"";
 
-  // Discard the end of the partition, but ignore failures.
-  DiscardPartitionTail(
-      target_fd_, install_plan_->partitions[current_partition_].target_size);
+  StartTargetTrimmer();
+  return true;
+}
+
+void DeltaPerformer::StartTargetTrimmer() {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  int err;
+  FileDescriptorPtr fd = OpenFile(target_path_.c_str(), O_RDWR, &err);
+  if (!fd) {
+    LOG(WARNING) << "Unable to open " << target_path_ << " to discard it";
+    return;
+  }
+  target_trimmer_.reset(new TargetTrimmer(
+      fd, install_plan_->partitions[current_partition_].target_size,
+      block_size_));
+  // The operations must write all their blocks, which nothing reads before.
+  const uint64_t first_operation =
+      current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
+  if (pre_trim_ && !install_plan_->is_resume &&
+      next_operation_num_ == first_operation && !compare_before_write_ &&
+      !metadata_only_ && satisfied_operations_.empty() &&
+      GetMinorVersion() != kInPlaceMinorPayloadVersion &&
+      source_path_ != target_path_) {
+    target_trimmer_->AddOperations(partition.operations());
+  }
+  target_trimmer_->Start();
+}
+
+bool DeltaPerformer::OpenWorkerFileDescriptors() {
+#if USE_MTD
+  // The MTD and UBI devices can't be written from several file descriptors at
+  // the same time, so the operations on them are applied inline.
+  if (UbiFileDescriptor::IsUbi(target_path_.c_str()) ||
+      MtdFileDescriptor::IsMtd(target_path_.c_str())) {
+    return true;
+  }
+#endif
+  // utils::PReadAll() and utils::PWriteAll() seek the file descriptor, so each
+  // worker thread needs its own.
+  std::shared_ptr<WorkerFileDescriptors> worker_fds(new WorkerFileDescriptors);
+  for (size_t i = 0; i < executor_->num_workers(); i++) {
+    int err;
+    if (source_fd_) {
+      FileDescriptorPtr fd = OpenFile(source_path_.c_str(), O_RDONLY, &err);
+      if (!fd) {
+        CloseFileDescriptors(nullptr, nullptr, worker_fds.get());
+        return false;
+      }
+      worker_fds->source_fds.push_back(FileDescriptorPtr(
+          new InterruptibleFileDescriptor(WrapSourceFileDescriptor(fd),
+                                          interrupter_)));
+    }
+    FileDescriptorPtr fd = OpenFile(target_path_.c_str(), O_RDWR, &err);
+    if (!fd) {
+      CloseFileDescriptors(nullptr, nullptr, worker_fds.get());
+      return false;
+    }
+    worker_fds->target_fds.push_back(FileDescriptorPtr(
+        new InterruptibleFileDescriptor(WrapTargetFileDescriptor(fd),
+                                        interrupter_)));
+  }
+  worker_fds->replace_writers.resize(executor_->num_workers());
+  worker_fds_ = worker_fds;
+  return true;
+}
 
+bool DeltaPerformer::OpenDirectTargetFileDescriptor() {
+#if USE_MTD
+  if (UbiFileDescriptor::IsUbi(target_path_.c_str()) ||
+      MtdFileDescriptor::IsMtd(target_path_.c_str())) {
+    return true;
+  }
+#endif
+  int err;
+  direct_target_fd_ = OpenFile(target_path_.c_str(), O_RDWR | O_DIRECT, &err);
+  TEST_AND_RETURN_FALSE(direct_target_fd_);
+  direct_target_fd_ = WrapTargetFileDescriptor(direct_target_fd_);
+  if (!direct_io_buffers_) {
+    // Writes from the staging buffers must be aligned to the logical block size
+    // of the device, which is never larger than the filesystem block size.
+    const size_t kDirectIOBufferSize = 1024 * 1024;
+    direct_io_buffers_.reset(
+        new AlignedBufferPool(kDirectIOBufferSize, block_size_));
+    pool_registrations_.emplace_back(
+        new ShrinkableCacheRegistration(direct_io_buffers_.get()));
+  }
+  direct_io_unflushed_bytes_ = 0;
   return true;
 }
 
+bool DeltaPerformer::OpenAsyncFileDescriptors() {
+  // Only SOURCE_COPY operations use them, and their writes can't be compared.
+  // The blocking reads and writes keep the operations applied on the target
+  // slot strictly in order.
+  if (num_async_io_threads_ == 0 || !source_fd_ || compare_before_write_ ||
+      IsAppliedOnTargetSlot()) {
+    return true;
+  }
+#if USE_MTD
+  if (UbiFileDescriptor::IsUbi(target_path_.c_str()) ||
+      MtdFileDescriptor::IsMtd(target_path_.c_str())) {
+    return true;
+  }
+#endif
+  const size_t kMaxAsyncIOsInFlight = 4;
+  async_source_fd_.reset(
+      new AsyncFileDescriptor(num_async_io_threads_, kMaxAsyncIOsInFlight));
+  async_target_fd_.reset(
+      new AsyncFileDescriptor(num_async_io_threads_, kMaxAsyncIOsInFlight));
+  async_source_fd_->set_throttle(storage_throttle_);
+  async_target_fd_->set_throttle(storage_throttle_);
+  if (!async_source_fd_->Open(source_path_.c_str(), O_RDONLY) ||
+      !async_target_fd_->Open(target_path_.c_str(), O_RDWR)) {
+    PLOG(ERROR) << "Unable to open " << source_path_ << " or " << target_path_;
+    async_source_fd_.reset();
+    async_target_fd_.reset();
+    return false;
+  }
+  return true;
+}
+
+void DeltaPerformer::PrefetchSourceData(size_t partition_operation_num) {
+  if (source_prefetch_fd_ < 0)
+    return;
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  const uint32_t minor_version = GetMinorVersion();
+  auto source_bytes = [this, minor_version](
+                          const InstallOperation& operation) -> uint64_t {
+    if (!OperationReadsSourceData(operation, minor_version))
+      return 0;
+    return GetBlockCount(operation.src_extents()) * block_size_;
+  };
+
+  // The operation being applied reads its source data right away, so only
+  // the following ones are prefetched.
+  while (prefetch_start_operation_ <= partition_operation_num &&
+         prefetch_start_operation_ < prefetch_end_operation_) {
+    prefetch_bytes_ -=
+        source_bytes(partition.operations(prefetch_start_operation_));
+    prefetch_start_operation_++;
+  }
+  if (prefetch_end_operation_ <= partition_operation_num) {
+    prefetch_start_operation_ = partition_operation_num + 1;
+    prefetch_end_operation_ = partition_operation_num + 1;
+  }
+
+  while (prefetch_end_operation_ < static_cast<size_t>(
+                                       partition.operations_size()) &&
+         (!prefetch_max_operations_ ||
+          prefetch_end_operation_ <=
+              partition_operation_num + prefetch_max_operations_) &&
+         (!prefetch_max_bytes_ || prefetch_bytes_ < prefetch_max_bytes_)) {
+    const InstallOperation& operation =
+        partition.operations(prefetch_end_operation_);
+    if (OperationReadsSourceData(operation, minor_version)) {
+      for (const Extent& extent : operation.src_extents()) {
+        if (extent.start_block() == kSparseHole)
+          continue;
+        // Only a hint, so the failures are ignored.
+        posix_fadvise(source_prefetch_fd_,
+                      extent.start_block() * block_size_,
+                      extent.num_blocks() * block_size_,
+                      POSIX_FADV_WILLNEED);
+      }
+    }
+    prefetch_bytes_ += source_bytes(operation);
+    prefetch_end_operation_++;
+  }
+}
+
+void DeltaPerformer::CloseSourcePrefetchFd() {
+  if (source_prefetch_fd_ < 0)
+    return;
+  if (IGNORE_EINTR(close(source_prefetch_fd_)) != 0)
+    PLOG(WARNING) << "Error closing the source prefetch file descriptor";
+  source_prefetch_fd_ = -1;
+}
+
+FileDescriptorPtr DeltaPerformer::WrapTargetFileDescriptor(
+    FileDescriptorPtr fd) {
+  if (storage_throttle_)
+    fd.reset(new ThrottledFileDescriptor(fd, storage_throttle_));
+  // The skipped writes are still recorded by the target hasher, so the data
+  // is compared first.
+  if (compare_before_write_)
+    fd.reset(new ComparingFileDescriptor(fd, block_size_, &unchanged_bytes_));
+  if (current_partition_ >= target_hashers_.size())
+    return fd;
+  return FileDescriptorPtr(
+      new HashingFileDescriptor(fd, target_hashers_[current_partition_]));
+}
+
+FileDescriptorPtr DeltaPerformer::WrapSourceFileDescriptor(
+    FileDescriptorPtr fd) {
+  if (storage_throttle_)
+    fd.reset(new ThrottledFileDescriptor(fd, storage_throttle_));
+  if (!source_cache_)
+    return fd;
+  return FileDescriptorPtr(new CachingFileDescriptor(fd, source_cache_));
+}
+
+bool DeltaPerformer::BuildHashTrees() {
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    const PartitionUpdate& partition = partitions_[i];
+    if (!partition.has_hash_tree_extent())
+      continue;
+    const InstallPlan::Partition& install_part = install_plan_->partitions[i];
+    std::shared_ptr<HashTreeBuilder> builder;
+    if (i < hash_tree_builders_.size())
+      builder = hash_tree_builders_[i];
+    if (!builder) {
+      builder = HashTreeBuilder::Create(
+          partition, block_size_, install_part.target_size);
+      TEST_AND_RETURN_FALSE(builder);
+    }
+    int err;
+    FileDescriptorPtr fd =
+        OpenFile(install_part.target_path.c_str(), O_RDWR, &err);
+    TEST_AND_RETURN_FALSE(fd);
+    // The tree is hashed inline like the rest of the partition.
+    if (i < target_hashers_.size() && target_hashers_[i])
+      fd.reset(new HashingFileDescriptor(fd, target_hashers_[i]));
+    const uint64_t hashed_bytes = builder->hashed_bytes();
+    const bool success = builder->Finalize(fd) &&
+                         utils::PWriteAll(fd,
+                                          builder->tree().data(),
+                                          builder->tree().size(),
+                                          builder->tree_offset()) &&
+                         fd->Flush();
+    if (!fd->Close() || !success) {
+      LOG(ERROR) << "Unable to write the hash tree of partition "
+                 << install_part.name << ".";
+      return false;
+    }
+    LOG(INFO) << "Wrote the " << builder->tree().size()
+              << " bytes of the hash tree of partition " << install_part.name
+              << ", " << hashed_bytes << " bytes of its data hashed from the "
+              << "written data.";
+  }
+  hash_tree_builders_.clear();
+  return true;
+}
+
+void DeltaPerformer::VerifyTargetHashesInline() {
+  for (size_t i = 0; i < target_hashers_.size(); i++) {
+    InstallPlan::Partition& install_part = install_plan_->partitions[i];
+    const std::shared_ptr<InlineTargetHasher>& hasher = target_hashers_[i];
+    if (!hasher || !hasher->valid()) {
+      LOG(INFO) << "Partition " << install_part.name
+                << " can't be verified inline.";
+      continue;
+    }
+    int err;
+    FileDescriptorPtr fd =
+        OpenFile(install_part.target_path.c_str(), O_RDONLY, &err);
+    if (!fd)
+      continue;
+    const uint64_t hashed_bytes = hasher->hashed_bytes();
+    brillo::Blob raw_hash;
+    if (hasher->Finalize(fd, &raw_hash) &&
+        raw_hash == install_part.target_hash &&
+        hasher->SpotCheck(fd, inline_num_spot_checks_)) {
+      LOG(INFO) << "Verified partition " << install_part.name << " inline, "
+                << hashed_bytes << " of its " << install_part.target_size
+                << " bytes hashed from the written data.";
+      install_part.target_hash_verified = true;
+    } else {
+      LOG(WARNING) << "Partition " << install_part.name
+                   << " didn't pass the inline verification.";
+    }
+    fd->Close();
+  }
+  target_hashers_.clear();
+}
+
 namespace {
 
 void LogPartitionInfoHash(const PartitionInfo& info, const string& tag) {
@@ -583,6 +1411,7 @@ DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   }
 
   manifest_parsed_ = true;
+  manifest_memory_.Set(manifest_size_);
   return kMetadataParseSuccess;
 }
 
@@ -592,12 +1421,28 @@ DeltaPerformer::MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
 bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
   *error = ErrorCode::kSuccess;
 
+  // Scheduling the operations may wait for the suspended ones.
+  if (interrupter_->is_suspended()) {
+    LOG(WARNING) << "Payload data received while suspended, resuming.";
+    ResumeOperations();
+  }
+
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
 
   // Update the total byte downloaded count and the progress logs.
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
 
+  // The data is applied once the source partitions are verified.
+  if (waiting_for_source_hashes_) {
+    deferred_data_.insert(deferred_data_.end(), c_bytes, c_bytes + count);
+    return true;
+  }
+
+  // Nothing past the metadata is used when only validating it.
+  if (metadata_only_ && manifest_valid_)
+    return true;
+
   while (!manifest_valid_) {
     // Read data up to the needed limit; this is either maximium payload header
     // size, or the full metadata size (once it becomes known).
@@ -630,9 +1475,14 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     if (!ParseManifestPartitions(error))
       return false;
 
+    if (metadata_only_) {
+      LOG(INFO) << "The payload metadata is valid, not applying the payload.";
+      return true;
+    }
+
     num_total_operations_ = 0;
     for (const auto& partition : partitions_) {
-      num_total_operations_ += partition.operations_size();
+      num_total_operations_ += NumPartitionOperations(partition);
       acc_num_operations_.push_back(num_total_operations_);
     }
 
@@ -649,6 +1499,35 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
       return false;
     }
 
+    // The worker threads could overwrite the blocks a previous operation still
+    // reads when the payload is applied on the target slot.
+    if (num_worker_threads_ > 0 && !IsAppliedOnTargetSlot()) {
+      executor_.reset(new OperationExecutor(num_worker_threads_,
+                                            2 * num_worker_threads_));
+      executor_->set_max_pending_bytes(max_scheduled_data_bytes_);
+      executor_->SetMaxActiveWorkers(max_active_workers_);
+      executor_->Start();
+    }
+
+    // Only the blobs of the operations that don't match the target partitions
+    // yet can be downloaded, but only if no data past the metadata was passed
+    // to us already.
+    if (skip_satisfied_operations_ && download_delegate_ && count == 0 &&
+        FindSatisfiedOperations() &&
+        !download_delegate_->FetchOnlyPayloadRanges(
+            GetRequiredPayloadRanges())) {
+      LOG(INFO) << "Unable to skip the satisfied operations, applying them.";
+      satisfied_operations_.clear();
+    }
+
+    // The target partitions can only be hashed from the written data when all
+    // of it is written in this attempt.
+    if (inline_target_hashing_ && next_operation_num_ == 0 &&
+        satisfied_operations_.empty()) {
+      target_hashers_.resize(partitions_.size());
+      hash_tree_builders_.resize(partitions_.size());
+    }
+
     if (!OpenCurrentPartition()) {
       *error = ErrorCode::kInstallDeviceOpenError;
       return false;
@@ -669,7 +1548,8 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
-      CloseCurrentPartition();
+      if (!FinishCurrentPartition(error))
+        return false;
       current_partition_++;
       if (!OpenCurrentPartition()) {
         *error = ErrorCode::kInstallDeviceOpenError;
@@ -679,8 +1559,102 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     const size_t partition_operation_num = next_operation_num_ - (
         current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
 
+    // The operations of a segmented partition arrive right before its data.
+    if (partitions_[current_partition_].operations_size() == 0) {
+      if (!LoadOperationsSegment(&c_bytes, &count, error))
+        return false;
+      // Wait for the rest of the segment.
+      if (partitions_[current_partition_].operations_size() == 0)
+        return true;
+    }
+
     const InstallOperation& op =
         partitions_[current_partition_].operations(partition_operation_num);
+    PrefetchSourceData(partition_operation_num);
+    if (target_trimmer_)
+      target_trimmer_->OperationStarting(partition_operation_num);
+
+    // The aligned blobs are preceded by padding.
+    if (!streaming_hasher_ && op.data_length() > 0 &&
+        buffer_offset_ < op.data_offset()) {
+      if (!SkipBlobPadding(op, &c_bytes, &count)) {
+        *error = ErrorCode::kDownloadOperationExecutionError;
+        return false;
+      }
+      // Wait for the rest of the padding.
+      if (buffer_offset_ < op.data_offset())
+        return true;
+    }
+
+    // The blobs of the satisfied operations aren't downloaded, so the data of
+    // the next operation follows.
+    if (!streaming_hasher_ && !satisfied_operations_.empty() &&
+        satisfied_operations_[next_operation_num_]) {
+      if (!WaitForScheduledOperations(error))
+        return false;
+      if (op.data_length()) {
+        TEST_AND_RETURN_FALSE(buffer_.empty() &&
+                              buffer_offset_ == op.data_offset());
+        buffer_offset_ += op.data_length();
+        skipped_data_bytes_ += op.data_length();
+      }
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Skipped ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
+
+    // The operations reading from the source partitions wait until they are
+    // verified, keeping the rest of the data received meanwhile.
+    if (!streaming_hasher_ && defer_source_verification_ &&
+        !source_hashes_set_ && !source_verified_by_operations_ &&
+        OperationReadsSourceData(op, GetMinorVersion())) {
+      if (!WaitForScheduledOperations(error))
+        return false;
+      LOG(INFO) << "Waiting for the source partitions to be verified.";
+      waiting_for_source_hashes_ = true;
+      deferred_data_.assign(c_bytes, c_bytes + count);
+      return true;
+    }
+
+    // Large compressed blobs are decompressed to the target partition as they
+    // arrive instead of being buffered first, as are the blobs over the memory
+    // budget. They are staged on disk instead for the diff operations and
+    // until their hash is validated when it's enforced.
+    if (streaming_hasher_ || CanStreamOperation(op)) {
+      // These operations are applied inline, after the scheduled ones.
+      if (!streaming_hasher_ && !WaitForScheduledOperations(error))
+        return false;
+      bool op_result;
+      {
+        ScopedTrace trace("operation", InstallOperationTypeName(op.type()));
+        OperationStats::ScopedTimer timer(
+            &operation_stats_,
+            op,
+            partitions_[current_partition_].partition_name(),
+            block_size_);
+        op_result = StreamOperationData(op, &c_bytes, &count, error);
+        timer.set_finished(op_result && !streaming_hasher_);
+      }
+      if (!HandleOpResult(op_result, InstallOperationTypeName(op.type()),
+                          error)) {
+        return false;
+      }
+      // Wait for the rest of the blob.
+      if (streaming_hasher_)
+        return true;
+
+      // Makes sure we unblock exit when this operation completes.
+      ScopedTerminatorExitUnblocker exit_unblocker =
+          ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Completed ");
+      // The saved progress inside a staged operation is always replaced, since
+      // the staging file is reused by the next one.
+      CheckpointUpdateProgress(op.type() == InstallOperation::BSDIFF ||
+                               staged_progress_saved_);
+      continue;
+    }
 
     CopyDataToBuffer(&c_bytes, &count, op.data_length());
 
@@ -694,7 +1668,10 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     // NOTE: If hash checks are mandatory and if metadata_signature is empty,
     // we would have already failed in ParsePayloadMetadata method and thus not
     // even be here. So no need to handle that case again here.
-    if (!install_plan_->metadata_signature.empty()) {
+    // The operation hashes are always validated when skipping operations,
+    // since the payload hash can't be verified then.
+    if (!install_plan_->metadata_signature.empty() ||
+        !satisfied_operations_.empty()) {
       // Note: Validate must be called only if CanPerformInstallOperation is
       // called. Otherwise, we might be failing operations before even if there
       // isn't sufficient data to compute the proper hash.
@@ -715,40 +1692,76 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
+    if (executor_) {
+      if (CanScheduleOperation(op)) {
+        if (!HandleOpResult(ScheduleOperation(op, error),
+                            InstallOperationTypeName(op.type()), error)) {
+          return false;
+        }
+        next_operation_num_++;
+        UpdateOverallProgress(false, "Scheduled ");
+        CheckpointScheduledOperations();
+        continue;
+      }
+      // The rest of the operations are applied inline once all the previous
+      // ones finished.
+      if (!WaitForScheduledOperations(error))
+        return false;
+    }
+
     bool op_result;
-    switch (op.type()) {
-      case InstallOperation::REPLACE:
-      case InstallOperation::REPLACE_BZ:
-      case InstallOperation::REPLACE_XZ:
-        op_result = PerformReplaceOperation(op);
-        break;
-      case InstallOperation::ZERO:
-      case InstallOperation::DISCARD:
-        op_result = PerformZeroOrDiscardOperation(op);
-        break;
-      case InstallOperation::MOVE:
-        op_result = PerformMoveOperation(op);
-        break;
-      case InstallOperation::BSDIFF:
-        op_result = PerformBsdiffOperation(op);
-        break;
-      case InstallOperation::SOURCE_COPY:
-        op_result = PerformSourceCopyOperation(op, error);
-        break;
-      case InstallOperation::SOURCE_BSDIFF:
-        op_result = PerformSourceBsdiffOperation(op, error);
-        break;
-      default:
-       op_result = false;
+    {
+      ScopedTrace trace("operation", InstallOperationTypeName(op.type()));
+      OperationStats::ScopedTimer timer(
+          &operation_stats_,
+          op,
+          partitions_[current_partition_].partition_name(),
+          block_size_);
+      switch (op.type()) {
+        case InstallOperation::REPLACE:
+        case InstallOperation::REPLACE_BZ:
+        case InstallOperation::REPLACE_XZ:
+        case InstallOperation::REPLACE_ZSTD:
+          op_result = PerformReplaceOperation(op);
+          break;
+        case InstallOperation::ZERO:
+        case InstallOperation::DISCARD:
+          op_result = PerformZeroOrDiscardOperation(op);
+          break;
+        case InstallOperation::MOVE:
+          op_result = PerformMoveOperation(op);
+          break;
+        case InstallOperation::BSDIFF:
+          op_result = PerformBsdiffOperation(op);
+          break;
+        case InstallOperation::SOURCE_COPY:
+          op_result = PerformSourceCopyOperation(op, error);
+          break;
+        case InstallOperation::SOURCE_BSDIFF:
+          op_result = PerformSourceBsdiffOperation(op, error);
+          break;
+        case InstallOperation::IMGDIFF:
+          op_result = PerformImgdiffOperation(op, error);
+          break;
+        default:
+         op_result = false;
+      }
+      timer.set_finished(op_result);
     }
     if (!HandleOpResult(op_result, InstallOperationTypeName(op.type()), error))
       return false;
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
-    CheckpointUpdateProgress();
+    // MOVE and BSDIFF operations update the target partition in place, so
+    // they can't be applied again after resuming.
+    CheckpointUpdateProgress(op.type() == InstallOperation::MOVE ||
+                             op.type() == InstallOperation::BSDIFF);
   }
 
+  if (!WaitForScheduledOperations(error))
+    return false;
+
   // In major version 2, we don't add dummy operation to the payload.
   // If we already extracted the signature we should skip this step.
   if (major_payload_version_ == kBrilloMajorPayloadVersion &&
@@ -775,7 +1788,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     // Since we extracted the SignatureMessage we need to advance the
     // checkpoint, otherwise we would reload the signature and try to extract
     // it again.
-    CheckpointUpdateProgress();
+    CheckpointUpdateProgress(true);
   }
 
   return true;
@@ -787,9 +1800,13 @@ bool DeltaPerformer::IsManifestValid() {
 
 bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   if (major_payload_version_ == kBrilloMajorPayloadVersion) {
+    // The operations take most of the manifest of large payloads, so the
+    // partitions are moved out of it with Swap() instead of being copied.
     partitions_.clear();
-    for (const PartitionUpdate& partition : manifest_.partitions()) {
-      partitions_.push_back(partition);
+    partitions_.reserve(manifest_.partitions_size());
+    for (PartitionUpdate& partition : *manifest_.mutable_partitions()) {
+      partitions_.emplace_back();
+      partitions_.back().Swap(&partition);
     }
     manifest_.clear_partitions();
   } else if (major_payload_version_ == kChromeOSMajorPayloadVersion) {
@@ -812,8 +1829,8 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
       *root_part.mutable_new_partition_info() = manifest_.new_rootfs_info();
       manifest_.clear_new_rootfs_info();
     }
-    *root_part.mutable_operations() = manifest_.install_operations();
-    manifest_.clear_install_operations();
+    root_part.mutable_operations()->Swap(
+        manifest_.mutable_install_operations());
     partitions_.push_back(std::move(root_part));
 
     PartitionUpdate kern_part;
@@ -827,16 +1844,86 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
       *kern_part.mutable_new_partition_info() = manifest_.new_kernel_info();
       manifest_.clear_new_kernel_info();
     }
-    *kern_part.mutable_operations() = manifest_.kernel_install_operations();
-    manifest_.clear_kernel_install_operations();
+    kern_part.mutable_operations()->Swap(
+        manifest_.mutable_kernel_install_operations());
     partitions_.push_back(std::move(kern_part));
   }
 
+  if (partition_claims_) {
+    for (const PartitionUpdate& partition : partitions_) {
+      auto claim = partition_claims_->emplace(partition.partition_name(),
+                                              payload_index_);
+      if (claim.first->second != payload_index_) {
+        LOG(ERROR) << "The partition " << partition.partition_name()
+                   << " is already updated by the payload "
+                   << claim.first->second << ".";
+        *error = ErrorCode::kPayloadMismatchedType;
+        return false;
+      }
+    }
+  }
+
+  // The operations use the same in-memory form whether their extents were
+  // packed in the payload or not.
+  const bool packed_extents_allowed =
+      manifest_.minor_version() >= kPackedExtentsMinorPayloadVersion;
+  const bool segments_allowed =
+      manifest_.minor_version() >= kSegmentedManifestMinorPayloadVersion;
+  const bool xz_chunks_allowed =
+      manifest_.minor_version() >= kXzChunksMinorPayloadVersion;
+  operations_segments_.assign(partitions_.size(), nullptr);
+  for (PartitionUpdate& partition : partitions_) {
+    if (partition.has_operations_segment()) {
+      const OperationsSegment& segment = partition.operations_segment();
+      if (!segments_allowed || partition.operations_size() > 0 ||
+          segment.num_operations() == 0 || segment.size() == 0 ||
+          segment.sha256_hash().empty()) {
+        LOG(ERROR) << "Invalid operations segment of partition "
+                   << partition.partition_name() << ".";
+        *error = ErrorCode::kDownloadManifestParseError;
+        return false;
+      }
+    }
+    for (InstallOperation& operation : *partition.mutable_operations()) {
+      if ((operation.has_packed_src_extents() ||
+           operation.has_packed_dst_extents()) &&
+          (!packed_extents_allowed || !UnpackOperationExtents(&operation))) {
+        LOG(ERROR) << "Invalid packed extents in an operation of partition "
+                   << partition.partition_name() << ".";
+        *error = ErrorCode::kDownloadManifestParseError;
+        return false;
+      }
+      if ((HasXzChunks(operation) && !xz_chunks_allowed) ||
+          !ValidXzChunks(operation)) {
+        LOG(ERROR) << "Invalid xz chunks in an operation of partition "
+                   << partition.partition_name() << ".";
+        *error = ErrorCode::kDownloadManifestParseError;
+        return false;
+      }
+    }
+  }
+
   // TODO(deymo): Remove this block of code once we switched to optional
   // source partition verification. This list of partitions in the InstallPlan
   // is initialized with the expected hashes in the payload major version 1,
   // so we need to check those now if already set. See b/23182225.
-  if (!install_plan_->partitions.empty()) {
+  // When the verification is deferred, the source partitions come with their
+  // hashes from SetSourcePartitionHashes() instead. They aren't needed when
+  // every operation validates the source blocks it reads.
+  source_verified_by_operations_ =
+      lazy_source_verification_ &&
+      AllSourceOperationsHashed(partitions_, GetMinorVersion());
+  if (source_verified_by_operations_) {
+    LOG(INFO) << "All the operations reading from the source partitions "
+              << "validate their source hash, not verifying the whole "
+              << "source partitions.";
+  } else if (defer_source_verification_) {
+    if (source_hashes_set_ && !source_partitions_.empty() &&
+        !VerifySourcePartitions(source_partitions_)) {
+      *error = ErrorCode::kDownloadStateInitializationError;
+      return false;
+    }
+  } else if (!install_plan_->partitions.empty()) {
     if (!VerifySourcePartitions()) {
       *error = ErrorCode::kDownloadStateInitializationError;
       return false;
@@ -857,6 +1944,7 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
                                             : kPostinstallDefaultScript);
       install_part.filesystem_type = partition.filesystem_type();
       install_part.postinstall_optional = partition.postinstall_optional();
+      install_part.postinstall_parallel = partition.postinstall_parallel();
     }
 
     if (partition.has_old_partition_info()) {
@@ -874,6 +1962,20 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     const PartitionInfo& info = partition.new_partition_info();
     install_part.target_size = info.size();
     install_part.target_hash.assign(info.hash().begin(), info.hash().end());
+    if (info.hash_chunk_size() > 0) {
+      const uint64_t num_chunks =
+          (info.size() + info.hash_chunk_size() - 1) / info.hash_chunk_size();
+      if (num_chunks == static_cast<uint64_t>(info.chunk_hashes_size())) {
+        install_part.target_hash_chunk_size = info.hash_chunk_size();
+        for (const string& chunk_hash : info.chunk_hashes())
+          install_part.target_chunk_hashes.emplace_back(chunk_hash.begin(),
+                                                        chunk_hash.end());
+      } else {
+        LOG(WARNING) << "Ignoring the " << info.chunk_hashes_size()
+                     << " chunk hashes of partition " << install_part.name
+                     << ", expected " << num_chunks << ".";
+      }
+    }
 
     install_plan_->partitions.push_back(install_part);
   }
@@ -883,10 +1985,164 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     *error = ErrorCode::kInstallDeviceOpenError;
     return false;
   }
+  for (const PartitionUpdate& partition : partitions_) {
+    if (!CanApplyOnTargetSlot(partition)) {
+      *error = ErrorCode::kPayloadMismatchedType;
+      return false;
+    }
+  }
   LogPartitionInfo(partitions_);
   return true;
 }
 
+bool DeltaPerformer::LoadOperationsSegment(const char** bytes_p,
+                                           size_t* count_p,
+                                           ErrorCode* error) {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  const OperationsSegment& segment = partition.operations_segment();
+  if (buffer_offset_ != segment.offset()) {
+    LOG(ERROR) << "The operations segment of partition "
+               << partition.partition_name() << " is at offset "
+               << segment.offset() << " but the data is at offset "
+               << buffer_offset_;
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  CopyDataToBuffer(bytes_p, count_p, segment.size());
+  if (buffer_.size() < segment.size())
+    return true;
+
+  *error = ParseOperationsSegment(
+      current_partition_,
+      std::make_shared<const string>(buffer_.begin(), buffer_.end()));
+  if (*error != ErrorCode::kSuccess)
+    return false;
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
+ErrorCode DeltaPerformer::ParseOperationsSegment(
+    size_t partition_index, std::shared_ptr<const string> data) {
+  PartitionUpdate* partition = &partitions_[partition_index];
+  const OperationsSegment& segment = partition->operations_segment();
+  brillo::Blob hash;
+  if (!HashCalculator::RawHashOfBytes(data->data(), data->size(), &hash) ||
+      hash != brillo::Blob(segment.sha256_hash().begin(),
+                           segment.sha256_hash().end())) {
+    LOG(ERROR) << "The hash of the operations segment of partition "
+               << partition->partition_name() << " doesn't match.";
+    return ErrorCode::kDownloadOperationHashMismatch;
+  }
+
+  PartitionOperations operations;
+  if (!operations.ParseFromString(*data) ||
+      operations.operations_size() !=
+          static_cast<int>(segment.num_operations())) {
+    LOG(ERROR) << "Unable to parse the operations segment of partition "
+               << partition->partition_name() << ".";
+    return ErrorCode::kDownloadManifestParseError;
+  }
+  for (InstallOperation& operation : *operations.mutable_operations()) {
+    if (!UnpackOperationExtents(&operation)) {
+      LOG(ERROR) << "Invalid packed extents in the operations segment of "
+                 << "partition " << partition->partition_name() << ".";
+      return ErrorCode::kDownloadManifestParseError;
+    }
+    if ((HasXzChunks(operation) &&
+         manifest_.minor_version() < kXzChunksMinorPayloadVersion) ||
+        !ValidXzChunks(operation)) {
+      LOG(ERROR) << "Invalid xz chunks in the operations segment of "
+                 << "partition " << partition->partition_name() << ".";
+      return ErrorCode::kDownloadManifestParseError;
+    }
+  }
+  partition->mutable_operations()->Swap(operations.mutable_operations());
+  if (!CanApplyOnTargetSlot(*partition))
+    return ErrorCode::kPayloadMismatchedType;
+  operations_segments_[partition_index] = data;
+  loaded_segments_size_ += data->size();
+  manifest_memory_.Set(manifest_size_ + loaded_segments_size_);
+  LOG(INFO) << "Loaded the " << segment.num_operations()
+            << " operations of partition " << partition->partition_name()
+            << " from a " << data->size() << " bytes segment.";
+  return ErrorCode::kSuccess;
+}
+
+bool DeltaPerformer::IsAppliedOnTargetSlot() const {
+  return install_plan_->source_slot == install_plan_->target_slot &&
+         install_plan_->source_slot != BootControlInterface::kInvalidSlot;
+}
+
+bool DeltaPerformer::CanApplyOnTargetSlot(
+    const PartitionUpdate& partition) const {
+  if (!IsAppliedOnTargetSlot() ||
+      GetMinorVersion() == kInPlaceMinorPayloadVersion ||
+      CanApplyOperationsInPlace(partition.operations(), GetMinorVersion())) {
+    return true;
+  }
+  LOG(ERROR) << "The operations of partition " << partition.partition_name()
+             << " read blocks they overwrite, so they can't be applied on "
+             << "the target slot.";
+  return false;
+}
+
+bool DeltaPerformer::LoadResumedOperationsSegment() {
+  if (next_operation_num_ >= num_total_operations_)
+    return true;
+  size_t partition_index = 0;
+  while (next_operation_num_ >= acc_num_operations_[partition_index])
+    partition_index++;
+  const PartitionUpdate& partition = partitions_[partition_index];
+  if (!partition.has_operations_segment() ||
+      buffer_offset_ <= partition.operations_segment().offset()) {
+    return true;
+  }
+  std::shared_ptr<string> data = std::make_shared<string>();
+  TEST_AND_RETURN_FALSE(
+      prefs_->GetString(kPrefsUpdateStateOperationsSegment, data.get()));
+  TEST_AND_RETURN_FALSE(ParseOperationsSegment(partition_index, data) ==
+                        ErrorCode::kSuccess);
+  saved_operations_segment_ = operations_segments_[partition_index];
+  return true;
+}
+
+void DeltaPerformer::ReleaseOperationsSegment(size_t partition_index) {
+  if (partition_index >= operations_segments_.size() ||
+      !operations_segments_[partition_index]) {
+    return;
+  }
+  loaded_segments_size_ -= operations_segments_[partition_index]->size();
+  manifest_memory_.Set(manifest_size_ + loaded_segments_size_);
+  operations_segments_[partition_index].reset();
+  // Swap with an empty list to ensure that all memory is released.
+  RepeatedPtrField<InstallOperation>().Swap(
+      partitions_[partition_index].mutable_operations());
+}
+
+bool DeltaPerformer::SkipBlobPadding(const InstallOperation& operation,
+                                     const char** bytes_p,
+                                     size_t* count_p) {
+  const uint64_t padding_size = operation.data_offset() - buffer_offset_;
+  if (padding_size >= manifest_.blob_alignment()) {
+    LOG(ERROR) << "The blob of the operation at offset "
+               << operation.data_offset() << " doesn't follow the previous "
+               << "data at offset " << buffer_offset_ << ".";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(buffer_.size() <= padding_size);
+
+  // Only the blobs are fetched when skipping the satisfied operations.
+  if (!satisfied_operations_.empty()) {
+    TEST_AND_RETURN_FALSE(buffer_.empty());
+    buffer_offset_ = operation.data_offset();
+    return true;
+  }
+  CopyDataToBuffer(bytes_p, count_p, padding_size);
+  if (buffer_.size() == padding_size)
+    DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
 bool DeltaPerformer::CanPerformInstallOperation(
     const chromeos_update_engine::InstallOperation& operation) {
   // If we don't have a data blob we can apply it right away.
@@ -907,7 +2163,8 @@ bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
@@ -922,34 +2179,486 @@ bool DeltaPerformer::PerformReplaceOperation(
     return true;
   }
 
-  // Setup the ExtentWriter stack based on the operation type.
-  std::unique_ptr<ExtentWriter> writer =
-    brillo::make_unique_ptr(new ZeroPadExtentWriter(
-      brillo::make_unique_ptr(new DirectExtentWriter())));
+  if (direct_target_fd_) {
+    TEST_AND_RETURN_FALSE(ApplyReplaceOperation(operation,
+                                                buffer_.data(),
+                                                direct_target_fd_,
+                                                direct_io_buffers_.get(),
+                                                &replace_writers_));
+    direct_io_unflushed_bytes_ +=
+        GetBlockCount(operation.dst_extents()) * block_size_;
+  } else {
+    TEST_AND_RETURN_FALSE(ApplyReplaceOperation(
+        operation, buffer_.data(), target_fd_, nullptr, &replace_writers_));
+  }
 
-  if (operation.type() == InstallOperation::REPLACE_BZ) {
-    writer.reset(new BzipExtentWriter(std::move(writer)));
-  } else if (operation.type() == InstallOperation::REPLACE_XZ) {
-    writer.reset(new XzExtentWriter(std::move(writer)));
+  // Update buffer
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
+bool DeltaPerformer::ApplyReplaceOperation(
+    const InstallOperation& operation,
+    const uint8_t* data,
+    FileDescriptorPtr target_fd,
+    AlignedBufferPool* aligned_buffers,
+    ReplaceWriters* writers) {
+  // Each xz chunk is an independent stream decompressed by its own writer.
+  if (HasXzChunks(operation)) {
+    uint64_t data_offset = 0;
+    for (int chunk = 0; chunk < operation.xz_chunk_sizes_size(); chunk++) {
+      TEST_AND_RETURN_FALSE(ApplyReplaceOperation(
+          XzChunkOperation(operation, chunk, data_offset),
+          data + data_offset,
+          target_fd,
+          aligned_buffers,
+          writers));
+      data_offset += operation.xz_chunk_sizes(chunk);
+    }
+    return true;
   }
 
-  // Create a vector of extents to pass to the ExtentWriter.
+  if (!writers) {
+    std::unique_ptr<ExtentWriter> writer =
+        CreateReplaceExtentWriter(operation, target_fd, aligned_buffers);
+    TEST_AND_RETURN_FALSE(writer);
+    TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
+    TEST_AND_RETURN_FALSE(writer->End());
+    return true;
+  }
+
+  std::unique_ptr<ExtentWriter>& writer = writers->writers[std::make_tuple(
+      operation.type(), operation.zstd_dictionary(), aligned_buffers)];
+  if (!writer)
+    writer = NewReplaceExtentWriter(operation, aligned_buffers);
+  if (!writer || !InitReplaceExtentWriter(
+          operation, target_fd, &writers->extents, writer.get()) ||
+      !writer->Write(data, operation.data_length()) || !writer->End()) {
+    LOG(ERROR) << "Unable to write the data of the operation.";
+    // The writer left in the middle of a stream can't be reused.
+    writer.reset();
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<ExtentWriter> DeltaPerformer::CreateReplaceExtentWriter(
+    const InstallOperation& operation,
+    FileDescriptorPtr target_fd,
+    AlignedBufferPool* aligned_buffers) {
+  std::unique_ptr<ExtentWriter> writer =
+      NewReplaceExtentWriter(operation, aligned_buffers);
   vector<Extent> extents;
-  for (int i = 0; i < operation.dst_extents_size(); i++) {
-    extents.push_back(operation.dst_extents(i));
+  if (!writer ||
+      !InitReplaceExtentWriter(operation, target_fd, &extents, writer.get())) {
+    return nullptr;
+  }
+  return writer;
+}
+
+std::unique_ptr<ExtentWriter> DeltaPerformer::NewReplaceExtentWriter(
+    const InstallOperation& operation, AlignedBufferPool* aligned_buffers) {
+  const InstallOperation::Type type = operation.type();
+  const bool zstd_dictionary =
+      type == InstallOperation::REPLACE_ZSTD && operation.zstd_dictionary();
+  if (zstd_dictionary && !zstd_dictionary_) {
+    LOG(ERROR) << "The operation was compressed against a zstd dictionary, "
+               << "but the payload has none.";
+    return nullptr;
+  }
+
+  // Setup the ExtentWriter stack based on the operation type.
+  std::unique_ptr<ExtentWriter> writer = brillo::make_unique_ptr(
+      new ZeroPaddedExtentWriter<DirectExtentWriter>(aligned_buffers));
+
+  if (type == InstallOperation::REPLACE_BZ) {
+    writer.reset(new BzipExtentWriter(std::move(writer),
+                                      decompression_buffers_.get(),
+                                      bzip_decoders_.get()));
+  } else if (type == InstallOperation::REPLACE_XZ) {
+    writer.reset(new XzExtentWriter(std::move(writer),
+                                    decompression_buffers_.get(),
+                                    xz_decoders_.get()));
+  } else if (type == InstallOperation::REPLACE_ZSTD) {
+    writer.reset(new ZstdExtentWriter(
+        std::move(writer),
+        decompression_buffers_.get(),
+        zstd_dictionary ? zstd_dictionary_.get() : nullptr));
+  }
+  return writer;
+}
+
+bool DeltaPerformer::InitReplaceExtentWriter(const InstallOperation& operation,
+                                             FileDescriptorPtr target_fd,
+                                             vector<Extent>* extents,
+                                             ExtentWriter* writer) {
+  extents->assign(operation.dst_extents().begin(),
+                  operation.dst_extents().end());
+  if (!writer->Init(target_fd, *extents, block_size_)) {
+    LOG(ERROR) << "Unable to initialize the extent writer.";
+    writer->End();
+    return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::CanStreamOperation(const InstallOperation& operation) {
+  if (!buffer_.empty() || buffer_offset_ != operation.data_offset())
+    return false;
+
+  if (ExceedsMemoryBudget(operation)) {
+    switch (operation.type()) {
+      case InstallOperation::REPLACE:
+        // The payload signature of major version 1 payloads is in a dummy
+        // REPLACE operation, which needs the whole blob in |buffer_|.
+        return !manifest_.has_signatures_offset() ||
+               manifest_.signatures_offset() != operation.data_offset();
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+      case InstallOperation::BSDIFF:
+      case InstallOperation::SOURCE_BSDIFF:
+      case InstallOperation::IMGDIFF:
+        return true;
+      default:
+        return false;
+    }
   }
 
-  TEST_AND_RETURN_FALSE(writer->Init(target_fd_, extents, block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(buffer_.data(), operation.data_length()));
+  // The operations applied by the worker threads need their whole blob.
+  if (executor_)
+    return false;
+  if (operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ &&
+      operation.type() != InstallOperation::REPLACE_ZSTD) {
+    return false;
+  }
+  return operation.data_length() >= kMinStreamedDataLength;
+}
+
+bool DeltaPerformer::StreamOperationData(const InstallOperation& operation,
+                                         const char** bytes_p,
+                                         size_t* count_p,
+                                         ErrorCode* error) {
+  if (!streaming_hasher_) {
+    // The blob of an operation whose hash is enforced is staged until its
+    // hash is validated, so a corrupt or tampered blob never reaches the
+    // target partition.
+    if ((operation.type() == InstallOperation::REPLACE ||
+         operation.type() == InstallOperation::REPLACE_BZ ||
+         operation.type() == InstallOperation::REPLACE_XZ ||
+         operation.type() == InstallOperation::REPLACE_ZSTD) &&
+        !IsOperationHashEnforced()) {
+      streaming_xz_chunks_ = HasXzChunks(operation);
+      if (!streaming_xz_chunks_) {
+        streaming_writer_ = CreateReplaceExtentWriter(
+            operation,
+            direct_target_fd_ ? direct_target_fd_ : target_fd_,
+            direct_target_fd_ ? direct_io_buffers_.get() : nullptr);
+        TEST_AND_RETURN_FALSE(streaming_writer_);
+      }
+    } else {
+      TEST_AND_RETURN_FALSE(OpenStagingFile());
+    }
+    streaming_hasher_.reset(new HashCalculator());
+    streamed_bytes_ = 0;
+    last_staged_checkpoint_ = 0;
+  }
+
+  // Each xz chunk is written by its own writer, created once its data
+  // arrives, so the progress can be saved between the chunks.
+  uint64_t data_end = operation.data_length();
+  if (streaming_xz_chunks_) {
+    uint64_t chunk_offset;
+    const int chunk = XzChunkAt(operation, streamed_bytes_, &chunk_offset);
+    data_end = chunk_offset + operation.xz_chunk_sizes(chunk);
+    if (!streaming_writer_) {
+      streaming_writer_ = CreateReplaceExtentWriter(
+          XzChunkOperation(operation, chunk, chunk_offset),
+          direct_target_fd_ ? direct_target_fd_ : target_fd_,
+          direct_target_fd_ ? direct_io_buffers_.get() : nullptr);
+      if (!streaming_writer_) {
+        AbortStreamingOperation();
+        return false;
+      }
+    }
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(*bytes_p);
+  size_t length = min(static_cast<uint64_t>(*count_p),
+                      data_end - streamed_bytes_);
+  const uint64_t blob_offset = streamed_bytes_;
+  *bytes_p += length;
+  *count_p -= length;
+  buffer_offset_ += length;
+  streamed_bytes_ += length;
+  vector<HashCalculator*> calculators = {&payload_hash_calculator_,
+                                         streaming_hasher_.get()};
+  if (!signed_hash_shared_)
+    calculators.push_back(&signed_hash_calculator_);
+  HashCalculator::UpdateAll(calculators, data, length);
+  bool written = streaming_writer_ ?
+      streaming_writer_->Write(data, length) :
+      utils::PWriteAll(staging_fd_, data, length, blob_offset);
+  if (!written) {
+    AbortStreamingOperation();
+    return false;
+  }
+  if (streamed_bytes_ < operation.data_length()) {
+    if (!streaming_writer_)
+      CheckpointStagedOperation();
+    if (streaming_xz_chunks_ && streamed_bytes_ == data_end) {
+      // The blocks of the chunk are all written once its writer ends.
+      std::unique_ptr<ExtentWriter> writer = std::move(streaming_writer_);
+      if (!writer->End()) {
+        AbortStreamingOperation();
+        return false;
+      }
+      CheckpointStagedOperation();
+      if (*count_p > 0)
+        return StreamOperationData(operation, bytes_p, count_p, error);
+    }
+    return true;
+  }
+
+  // All the blob was staged or passed to the writer, which is only done when
+  // a hash mismatch doesn't fail the update. The progress is only saved once
+  // the operation finished, so an interrupted operation is applied again from
+  // its first byte after resuming, unless the progress inside its staged blob
+  // was saved.
+  std::unique_ptr<HashCalculator> operation_hasher =
+      std::move(streaming_hasher_);
+  if (!install_plan_->metadata_signature.empty() ||
+      !satisfied_operations_.empty()) {
+    *error = ValidateOperationHash(operation, operation_hasher.get());
+    if (*error != ErrorCode::kSuccess) {
+      if (install_plan_->hash_checks_mandatory) {
+        LOG(ERROR) << "Mandatory operation hash check failed";
+        AbortStreamingOperation();
+        return false;
+      }
+
+      // For non-mandatory cases, just send a UMA stat.
+      LOG(WARNING) << "Ignoring operation validation errors";
+      *error = ErrorCode::kSuccess;
+    }
+  }
+
+  if (!streaming_writer_)
+    return ApplyStagedOperation(operation, error);
+
+  std::unique_ptr<ExtentWriter> writer = std::move(streaming_writer_);
+  streaming_xz_chunks_ = false;
   TEST_AND_RETURN_FALSE(writer->End());
+  if (direct_target_fd_) {
+    direct_io_unflushed_bytes_ +=
+        GetBlockCount(operation.dst_extents()) * block_size_;
+  }
+  return true;
+}
 
-  // Update buffer
-  DiscardBuffer(true, buffer_.size());
+bool DeltaPerformer::IsOperationHashEnforced() const {
+  // The operation hashes are validated when the metadata is signed or when
+  // skipping operations, see Write().
+  return install_plan_->hash_checks_mandatory &&
+         (!install_plan_->metadata_signature.empty() ||
+          !satisfied_operations_.empty());
+}
+
+void DeltaPerformer::AbortStreamingOperation() {
+  if (streaming_writer_) {
+    LOG(WARNING) << "Abandoning the operation after streaming "
+                 << streamed_bytes_ << " bytes of its blob.";
+    // The blocks it already wrote are overwritten when the operation is
+    // applied again.
+    streaming_writer_->End();
+    streaming_writer_.reset();
+  }
+  streaming_hasher_.reset();
+  streamed_bytes_ = 0;
+  streaming_xz_chunks_ = false;
+}
+
+bool DeltaPerformer::OpenStagingFile() {
+  if (staging_fd_ < 0) {
+    string path_template = "DeltaPerformer-staging.XXXXXX";
+    if (!staging_dir_.empty())
+      path_template = staging_dir_ + "/" + path_template;
+    TEST_AND_RETURN_FALSE(
+        utils::MakeTempFile(path_template, &staging_path_, &staging_fd_));
+  }
+  // The saved progress can't point into the staging file once it's reused.
+  TEST_AND_RETURN_FALSE(!staged_progress_saved_);
+  // The file only holds the blob of the current operation.
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(ftruncate(staging_fd_, 0)) == 0);
   return true;
 }
 
+void DeltaPerformer::CloseStagingFile() {
+  if (staging_fd_ < 0)
+    return;
+  if (IGNORE_EINTR(close(staging_fd_)) != 0)
+    PLOG(ERROR) << "Error closing the staging file " << staging_path_;
+  if (staged_progress_saved_ && !streaming_xz_chunks_) {
+    LOG(INFO) << "Keeping the staging file " << staging_path_
+              << " to resume the interrupted operation.";
+  } else if (unlink(staging_path_.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to remove the staging file " << staging_path_;
+  }
+  staging_fd_ = -1;
+  staging_path_.clear();
+}
+
+void DeltaPerformer::CheckpointStagedOperation() {
+  if (!IsStagingResumable() ||
+      streamed_bytes_ - last_staged_checkpoint_ < staged_checkpoint_bytes_) {
+    return;
+  }
+  // The staged data must be on disk before the progress past it is saved.
+  // The xz chunks were already written to the target like the previous
+  // operations.
+  if (!streaming_xz_chunks_ && HANDLE_EINTR(fdatasync(staging_fd_)) != 0) {
+    PLOG(WARNING) << "Unable to sync the staging file " << staging_path_;
+    return;
+  }
+  // Makes sure we unblock exit once the progress is saved, the operation may
+  // take a while longer to finish.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+  if (!SaveCheckpoint(MakeCheckpoint())) {
+    LOG(WARNING) << "Unable to save the progress inside operation "
+                 << next_operation_num_;
+    return;
+  }
+  last_staged_checkpoint_ = streamed_bytes_;
+}
+
+bool DeltaPerformer::ResumeStagedOperation(uint64_t staged_bytes) {
+  TEST_AND_RETURN_FALSE(next_operation_num_ < num_total_operations_);
+  size_t partition_index = 0;
+  while (next_operation_num_ >= acc_num_operations_[partition_index])
+    partition_index++;
+  const size_t partition_operation_num = next_operation_num_ - (
+      partition_index ? acc_num_operations_[partition_index - 1] : 0);
+  const InstallOperation& op =
+      partitions_[partition_index].operations(partition_operation_num);
+  TEST_AND_RETURN_FALSE(op.type() == InstallOperation::BSDIFF ||
+                        op.type() == InstallOperation::SOURCE_BSDIFF ||
+                        op.type() == InstallOperation::IMGDIFF ||
+                        op.type() == InstallOperation::REPLACE ||
+                        op.type() == InstallOperation::REPLACE_BZ ||
+                        op.type() == InstallOperation::REPLACE_XZ ||
+                        op.type() == InstallOperation::REPLACE_ZSTD);
+  TEST_AND_RETURN_FALSE(staged_bytes < op.data_length() &&
+                        buffer_offset_ == op.data_offset() + staged_bytes);
+
+  string staged_path;
+  string staged_hash_context;
+  TEST_AND_RETURN_FALSE(
+      prefs_->GetString(kPrefsUpdateStateStagedPath, &staged_path));
+  TEST_AND_RETURN_FALSE(prefs_->GetString(kPrefsUpdateStateStagedSHA256Context,
+                                          &staged_hash_context));
+  std::unique_ptr<HashCalculator> hasher(new HashCalculator());
+  TEST_AND_RETURN_FALSE(hasher->SetContext(staged_hash_context));
+
+  // The xz chunks before the saved progress were written to the target, so
+  // the operation resumes from the next one. They are staged like the other
+  // blobs when the operation hash is enforced.
+  if (HasXzChunks(op) && staged_path.empty()) {
+    uint64_t chunk_offset;
+    XzChunkAt(op, staged_bytes, &chunk_offset);
+    TEST_AND_RETURN_FALSE(chunk_offset == staged_bytes);
+    streaming_xz_chunks_ = true;
+    streaming_hasher_ = std::move(hasher);
+    streamed_bytes_ = staged_bytes;
+    last_staged_checkpoint_ = staged_bytes;
+    staged_progress_saved_ = true;
+    LOG(INFO) << "Resuming operation " << next_operation_num_ << " after the "
+              << staged_bytes << " bytes of its finished xz chunks.";
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(!staged_path.empty());
+
+  int fd = HANDLE_EINTR(open(staged_path.c_str(), O_RDWR | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open the staging file " << staged_path;
+    return false;
+  }
+  // Drops whatever was staged after the saved progress.
+  if (utils::FileSize(fd) < static_cast<off_t>(staged_bytes) ||
+      HANDLE_EINTR(ftruncate(fd, staged_bytes)) != 0) {
+    LOG(ERROR) << "The staging file " << staged_path << " doesn't hold the "
+               << staged_bytes << " staged bytes of operation "
+               << next_operation_num_;
+    IGNORE_EINTR(close(fd));
+    return false;
+  }
+  staging_fd_ = fd;
+  staging_path_ = staged_path;
+  streaming_hasher_ = std::move(hasher);
+  streamed_bytes_ = staged_bytes;
+  last_staged_checkpoint_ = staged_bytes;
+  staged_progress_saved_ = true;
+  LOG(INFO) << "Resuming operation " << next_operation_num_ << " after the "
+            << staged_bytes << " staged bytes of its blob.";
+  return true;
+}
+
+bool DeltaPerformer::ApplyStagedOperation(const InstallOperation& operation,
+                                          ErrorCode* error) {
+  // The blob is mapped instead of read back into memory, so its pages are
+  // clean page cache that can be reclaimed under memory pressure.
+  void* mapping = mmap(nullptr, operation.data_length(), PROT_READ,
+                       MAP_SHARED, staging_fd_, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(mapping != MAP_FAILED);
+  const uint8_t* patch = static_cast<const uint8_t*>(mapping);
+
+  bool success = false;
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      if (direct_target_fd_) {
+        success = ApplyReplaceOperation(operation,
+                                        patch,
+                                        direct_target_fd_,
+                                        direct_io_buffers_.get(),
+                                        &replace_writers_);
+        if (success) {
+          direct_io_unflushed_bytes_ +=
+              GetBlockCount(operation.dst_extents()) * block_size_;
+        }
+      } else {
+        success = ApplyReplaceOperation(
+            operation, patch, target_fd_, nullptr, &replace_writers_);
+      }
+      break;
+    case InstallOperation::BSDIFF:
+      success = ApplyBsdiffOperation(operation, patch, target_fd_);
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+      success = ApplySourceBsdiffOperation(
+          operation, patch, source_fd_, target_fd_, error);
+      break;
+    case InstallOperation::IMGDIFF:
+      success = ApplyImgdiffOperation(
+          operation, patch, source_fd_, target_fd_, error);
+      break;
+    default:
+      break;
+  }
+  munmap(mapping, operation.data_length());
+  return success;
+}
+
 bool DeltaPerformer::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  return ApplyZeroOrDiscardOperation(operation, target_fd_);
+}
+
+bool DeltaPerformer::ApplyZeroOrDiscardOperation(
+    const InstallOperation& operation, FileDescriptorPtr target_fd) {
   CHECK(operation.type() == InstallOperation::DISCARD ||
         operation.type() == InstallOperation::ZERO);
 
@@ -966,101 +2675,120 @@ bool DeltaPerformer::PerformZeroOrDiscardOperation(
   int request = 0;
 #endif  // !defined(BLKZEROOUT)
 
-  brillo::Blob zeros;
-  for (int i = 0; i < operation.dst_extents_size(); i++) {
-    Extent extent = operation.dst_extents(i);
+  // Adjacent extents are zeroed at once.
+  vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (const Extent& extent : operation.dst_extents()) {
     const uint64_t start = extent.start_block() * block_size_;
     const uint64_t length = extent.num_blocks() * block_size_;
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().second == start) {
+      ranges.back().second += length;
+    } else {
+      ranges.emplace_back(start, length);
+    }
+  }
+
+  // Each method is tried until it fails once, then the next one is used for
+  // the rest of the operation: the block device ioctl, zeroing the range of a
+  // regular file and, in case of failure, writing zeros to it.
+  bool attempt_zero_range = true;
+  const uint8_t* zeros = nullptr;
+  for (const auto& range : ranges) {
+    const uint64_t start = range.first;
+    const uint64_t length = range.second;
     if (attempt_ioctl) {
       int result = 0;
-      if (target_fd_->BlkIoctl(request, start, length, &result) && result == 0)
+      if (target_fd->BlkIoctl(request, start, length, &result) && result == 0)
         continue;
       attempt_ioctl = false;
-      zeros.resize(16 * block_size_);
     }
-    // In case of failure, we fall back to writing 0 to the selected region.
-    for (uint64_t offset = 0; offset < length; offset += zeros.size()) {
+    if (attempt_zero_range) {
+      if (target_fd->ZeroRange(start, length))
+        continue;
+      attempt_zero_range = false;
+    }
+    if (!zeros) {
+      zeros = GetZeroBuffer();
+      TEST_AND_RETURN_FALSE(zeros);
+    }
+    for (uint64_t offset = 0; offset < length; offset += kZeroBufferSize) {
       uint64_t chunk_length = min(length - offset,
-                                  static_cast<uint64_t>(zeros.size()));
+                                  static_cast<uint64_t>(kZeroBufferSize));
       TEST_AND_RETURN_FALSE(
-          utils::PWriteAll(target_fd_, zeros.data(), chunk_length, start + offset));
+          utils::PWriteAll(target_fd, zeros, chunk_length, start + offset));
     }
   }
   return true;
 }
 
 bool DeltaPerformer::PerformMoveOperation(const InstallOperation& operation) {
-  // Calculate buffer size. Note, this function doesn't do a sliding
-  // window to copy in case the source and destination blocks overlap.
-  // If we wanted to do a sliding window, we could program the server
-  // to generate deltas that effectively did a sliding window.
-
-  uint64_t blocks_to_read = 0;
-  for (int i = 0; i < operation.src_extents_size(); i++)
-    blocks_to_read += operation.src_extents(i).num_blocks();
+  for (const Extent& extent : operation.src_extents())
+    TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
+  for (const Extent& extent : operation.dst_extents())
+    TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
 
-  uint64_t blocks_to_write = 0;
-  for (int i = 0; i < operation.dst_extents_size(); i++)
-    blocks_to_write += operation.dst_extents(i).num_blocks();
+  // The blocks are moved through a window of at most kMaxBlocksToMove blocks,
+  // either from the first to the last one or the other way around, as long as
+  // no chunk overwrites the source blocks of a later one. That's always the
+  // case if the source and target blocks don't overlap, and the case of a
+  // range shifted by a few blocks in either direction.
+  const uint64_t kMaxBlocksToMove = 1024;  // 4MB if block size is 4KB
+  vector<CopyChunk> chunks;
+  TEST_AND_RETURN_FALSE(GetCopyChunks(operation.src_extents(),
+                                      operation.dst_extents(),
+                                      kMaxBlocksToMove,
+                                      &chunks));
+  bool can_move_in_chunks = CanCopyChunksInOrder(chunks);
+  if (!can_move_in_chunks) {
+    std::reverse(chunks.begin(), chunks.end());
+    can_move_in_chunks = CanCopyChunksInOrder(chunks);
+  }
 
-  DCHECK_EQ(blocks_to_write, blocks_to_read);
-  brillo::Blob buf(blocks_to_write * block_size_);
+  if (can_move_in_chunks) {
+    brillo::Blob buf(std::min(GetBlockCount(operation.dst_extents()),
+                              kMaxBlocksToMove) * block_size_);
+    for (const CopyChunk& chunk : chunks) {
+      const ssize_t bytes = chunk.num_blocks * block_size_;
+      ssize_t bytes_read_this_iteration = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(target_fd_,
+                                            buf.data(),
+                                            bytes,
+                                            chunk.src_block * block_size_,
+                                            &bytes_read_this_iteration));
+      TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
+      TEST_AND_RETURN_FALSE(utils::PWriteAll(
+          target_fd_, buf.data(), bytes, chunk.dst_block * block_size_));
+    }
+    return true;
+  }
 
-  // Read in bytes.
-  ssize_t bytes_read = 0;
-  for (int i = 0; i < operation.src_extents_size(); i++) {
+  // Otherwise, all the source blocks are read before writing any of the
+  // target blocks.
+  brillo::Blob buf(GetBlockCount(operation.dst_extents()) * block_size_);
+  uint64_t buf_offset = 0;
+  for (const CopyChunk& chunk : chunks) {
+    const ssize_t bytes = chunk.num_blocks * block_size_;
     ssize_t bytes_read_this_iteration = 0;
-    const Extent& extent = operation.src_extents(i);
-    const size_t bytes = extent.num_blocks() * block_size_;
-    TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
     TEST_AND_RETURN_FALSE(utils::PReadAll(target_fd_,
-                                          &buf[bytes_read],
+                                          &buf[buf_offset],
                                           bytes,
-                                          extent.start_block() * block_size_,
+                                          chunk.src_block * block_size_,
                                           &bytes_read_this_iteration));
-    TEST_AND_RETURN_FALSE(
-        bytes_read_this_iteration == static_cast<ssize_t>(bytes));
-    bytes_read += bytes_read_this_iteration;
+    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
+    buf_offset += bytes;
+  }
+  buf_offset = 0;
+  for (const CopyChunk& chunk : chunks) {
+    const ssize_t bytes = chunk.num_blocks * block_size_;
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(
+        target_fd_, &buf[buf_offset], bytes, chunk.dst_block * block_size_));
+    buf_offset += bytes;
   }
-
-  // Write bytes out.
-  ssize_t bytes_written = 0;
-  for (int i = 0; i < operation.dst_extents_size(); i++) {
-    const Extent& extent = operation.dst_extents(i);
-    const size_t bytes = extent.num_blocks() * block_size_;
-    TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
-    TEST_AND_RETURN_FALSE(utils::PWriteAll(target_fd_,
-                                           &buf[bytes_written],
-                                           bytes,
-                                           extent.start_block() * block_size_));
-    bytes_written += bytes;
-  }
-  DCHECK_EQ(bytes_written, bytes_read);
-  DCHECK_EQ(bytes_written, static_cast<ssize_t>(buf.size()));
   return true;
 }
 
 namespace {
 
-// Takes |extents| and fills an empty vector |blocks| with a block index for
-// each block in |extents|. For example, [(3, 2), (8, 1)] would give [3, 4, 8].
-void ExtentsToBlocks(const RepeatedPtrField<Extent>& extents,
-                     vector<uint64_t>* blocks) {
-  for (Extent ext : extents) {
-    for (uint64_t j = 0; j < ext.num_blocks(); j++)
-      blocks->push_back(ext.start_block() + j);
-  }
-}
-
-// Takes |extents| and returns the number of blocks in those extents.
-uint64_t GetBlockCount(const RepeatedPtrField<Extent>& extents) {
-  uint64_t sum = 0;
-  for (Extent ext : extents) {
-    sum += ext.num_blocks();
-  }
-  return sum;
-}
-
 // Compare |calculated_hash| with source hash in |operation|, return false and
 // dump hash and set |error| if don't match.
 bool ValidateSourceHash(const brillo::Blob& calculated_hash,
@@ -1099,53 +2827,46 @@ bool ValidateSourceHash(const brillo::Blob& calculated_hash,
 
 bool DeltaPerformer::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
-  if (operation.has_src_length())
-    TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
-  if (operation.has_dst_length())
-    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
-
-  uint64_t blocks_to_read = GetBlockCount(operation.src_extents());
-  uint64_t blocks_to_write = GetBlockCount(operation.dst_extents());
-  TEST_AND_RETURN_FALSE(blocks_to_write ==  blocks_to_read);
-
-  // Create vectors of all the individual src/dst blocks.
-  vector<uint64_t> src_blocks;
-  vector<uint64_t> dst_blocks;
-  ExtentsToBlocks(operation.src_extents(), &src_blocks);
-  ExtentsToBlocks(operation.dst_extents(), &dst_blocks);
-  DCHECK_EQ(src_blocks.size(), blocks_to_read);
-  DCHECK_EQ(src_blocks.size(), dst_blocks.size());
+  if (async_source_fd_ && async_target_fd_)
+    return ApplySourceCopyOperationAsync(operation, error);
+  return ApplySourceCopyOperation(operation, source_fd_, target_fd_, error);
+}
 
-  brillo::Blob buf(block_size_);
-  ssize_t bytes_read = 0;
+bool DeltaPerformer::ApplySourceCopyOperation(
+    const InstallOperation& operation,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    ErrorCode* error) {
+  // Copy each run of blocks that is contiguous in both the src and dst
+  // extents with as few reads and writes as possible.
+  const uint64_t kMaxBlocksToCopy = 1024;  // 4MB if block size is 4KB
+  vector<CopyChunk> chunks;
+  TEST_AND_RETURN_FALSE(GetSourceCopyChunks(
+      operation, block_size_, kMaxBlocksToCopy, &chunks));
+
+  uint64_t max_chunk_blocks = 0;
+  for (const CopyChunk& chunk : chunks)
+    max_chunk_blocks = std::max(max_chunk_blocks, chunk.num_blocks);
+  brillo::Blob buf(max_chunk_blocks * block_size_);
   HashCalculator source_hasher;
-  // Read/write one block at a time.
-  for (uint64_t i = 0; i < blocks_to_read; i++) {
+  for (const CopyChunk& chunk : chunks) {
+    const ssize_t bytes = chunk.num_blocks * block_size_;
     ssize_t bytes_read_this_iteration = 0;
-    uint64_t src_block = src_blocks[i];
-    uint64_t dst_block = dst_blocks[i];
 
     // Read in bytes.
-    TEST_AND_RETURN_FALSE(
-        utils::PReadAll(source_fd_,
-                        buf.data(),
-                        block_size_,
-                        src_block * block_size_,
-                        &bytes_read_this_iteration));
+    TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd,
+                                          buf.data(),
+                                          bytes,
+                                          chunk.src_block * block_size_,
+                                          &bytes_read_this_iteration));
+    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
 
     // Write bytes out.
-    TEST_AND_RETURN_FALSE(
-        utils::PWriteAll(target_fd_,
-                         buf.data(),
-                         block_size_,
-                         dst_block * block_size_));
-
-    bytes_read += bytes_read_this_iteration;
-    TEST_AND_RETURN_FALSE(bytes_read_this_iteration ==
-                          static_cast<ssize_t>(block_size_));
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(
+        target_fd, buf.data(), bytes, chunk.dst_block * block_size_));
 
     if (operation.has_src_sha256_hash())
-      TEST_AND_RETURN_FALSE(source_hasher.Update(buf.data(), buf.size()));
+      TEST_AND_RETURN_FALSE(source_hasher.Update(buf.data(), bytes));
   }
 
   if (operation.has_src_sha256_hash()) {
@@ -1153,8 +2874,68 @@ bool DeltaPerformer::PerformSourceCopyOperation(
     TEST_AND_RETURN_FALSE(
         ValidateSourceHash(source_hasher.raw_hash(), operation, error));
   }
+  return true;
+}
+
+bool DeltaPerformer::ApplySourceCopyOperationAsync(
+    const InstallOperation& operation, ErrorCode* error) {
+  // Smaller chunks than the synchronous copy, so the reads of the next chunks
+  // overlap with the writes of the previous ones.
+  const uint64_t kMaxBlocksToCopy = 256;  // 1MB if block size is 4KB
+  const size_t kNumCopyBuffers = 4;
+  vector<CopyChunk> chunks;
+  TEST_AND_RETURN_FALSE(GetSourceCopyChunks(
+      operation, block_size_, kMaxBlocksToCopy, &chunks));
+
+  // Each chunk is read into the buffer |index % kNumCopyBuffers|, which is
+  // reused once the chunk was written. The source hash is computed in order
+  // as the reads complete.
+  vector<brillo::Blob> bufs(kNumCopyBuffers);
+  HashCalculator source_hasher;
+  size_t reads_submitted = 0, reads_done = 0, writes_done = 0;
+  bool success = true;
+  while (success && writes_done < chunks.size()) {
+    while (reads_submitted < chunks.size() &&
+           reads_submitted - writes_done < kNumCopyBuffers) {
+      const CopyChunk& chunk = chunks[reads_submitted];
+      brillo::Blob* buf = &bufs[reads_submitted % kNumCopyBuffers];
+      buf->resize(chunk.num_blocks * block_size_);
+      async_source_fd_->SubmitRead(
+          buf->data(), buf->size(), chunk.src_block * block_size_);
+      reads_submitted++;
+    }
+    if (reads_done < reads_submitted) {
+      const CopyChunk& chunk = chunks[reads_done];
+      const brillo::Blob& buf = bufs[reads_done % kNumCopyBuffers];
+      success = async_source_fd_->WaitForNext();
+      if (success && operation.has_src_sha256_hash())
+        success = source_hasher.Update(buf.data(), buf.size());
+      if (success) {
+        async_target_fd_->SubmitWrite(
+            buf.data(), buf.size(), chunk.dst_block * block_size_);
+        // The async writes don't go through a FileDescriptor, so they are
+        // recorded in the hasher here.
+        if (current_partition_ < target_hashers_.size()) {
+          target_hashers_[current_partition_]->Write(
+              buf.data(), buf.size(), chunk.dst_block * block_size_);
+        }
+      }
+      reads_done++;
+    } else {
+      success = async_target_fd_->WaitForNext();
+      writes_done++;
+    }
+  }
+  // The buffers must outlive the I/Os in flight, even after a failure.
+  success = async_source_fd_->WaitForAll() && success;
+  success = async_target_fd_->WaitForAll() && success;
+  TEST_AND_RETURN_FALSE(success);
 
-  DCHECK_EQ(bytes_read, static_cast<ssize_t>(blocks_to_read * block_size_));
+  if (operation.has_src_sha256_hash()) {
+    TEST_AND_RETURN_FALSE(source_hasher.Finalize());
+    TEST_AND_RETURN_FALSE(
+        ValidateSourceHash(source_hasher.raw_hash(), operation, error));
+  }
   return true;
 }
 
@@ -1186,128 +2967,187 @@ bool DeltaPerformer::PerformBsdiffOperation(const InstallOperation& operation) {
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
 
-  string input_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.src_extents(),
-                                                       block_size_,
-                                                       operation.src_length(),
-                                                       &input_positions));
-  string output_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.dst_extents(),
-                                                       block_size_,
-                                                       operation.dst_length(),
-                                                       &output_positions));
-
-  string temp_filename;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile("au_patch.XXXXXX",
-                                            &temp_filename,
-                                            nullptr));
-  ScopedPathUnlinker path_unlinker(temp_filename);
-  {
-    int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    ScopedFdCloser fd_closer(&fd);
-    TEST_AND_RETURN_FALSE(
-        utils::WriteAll(fd, buffer_.data(), operation.data_length()));
-  }
-
-  // Update the buffer to release the patch data memory as soon as the patch
-  // file is written out.
-  DiscardBuffer(true, buffer_.size());
-
-  vector<string> cmd{kBspatchPath, target_path_, target_path_, temp_filename,
-                     input_positions, output_positions};
-
-  int return_code = 0;
   TEST_AND_RETURN_FALSE(
-      Subprocess::SynchronousExecFlags(cmd, Subprocess::kSearchPath,
-                                       &return_code, nullptr));
-  TEST_AND_RETURN_FALSE(return_code == 0);
-
-  if (operation.dst_length() % block_size_) {
-    // Zero out rest of final block.
-    // TODO(adlr): build this into bspatch; it's more efficient that way.
-    const Extent& last_extent =
-        operation.dst_extents(operation.dst_extents_size() - 1);
-    const uint64_t end_byte =
-        (last_extent.start_block() + last_extent.num_blocks()) * block_size_;
-    const uint64_t begin_byte =
-        end_byte - (block_size_ - operation.dst_length() % block_size_);
-    brillo::Blob zeros(end_byte - begin_byte);
-    TEST_AND_RETURN_FALSE(
-        utils::PWriteAll(target_fd_, zeros.data(), end_byte - begin_byte, begin_byte));
-  }
+      ApplyBsdiffOperation(operation, buffer_.data(), target_fd_));
+  DiscardBuffer(true, buffer_.size());
   return true;
 }
 
+bool DeltaPerformer::ApplyBsdiffOperation(const InstallOperation& operation,
+                                          const uint8_t* patch,
+                                          FileDescriptorPtr target_fd) {
+  // The source and destination extents may overlap, so the whole source data
+  // is read before writing any of the destination blocks.
+  ScopedSourceData old_data(&source_data_pool_);
+  TEST_AND_RETURN_FALSE(ReadBsdiffSourceExtents(target_fd,
+                                                operation.src_extents(),
+                                                block_size_,
+                                                operation.src_length(),
+                                                old_data.get()));
+  MemoryBsdiffSource source(old_data->data(), old_data->size());
+  return ApplyBsdiffOperationPatch(operation, &source, patch, target_fd);
+}
+
 bool DeltaPerformer::PerformSourceBsdiffOperation(
     const InstallOperation& operation, ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+
+  TEST_AND_RETURN_FALSE(ApplySourceBsdiffOperation(
+      operation, buffer_.data(), source_fd_, target_fd_, error));
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
+bool DeltaPerformer::ApplySourceBsdiffOperation(
+    const InstallOperation& operation,
+    const uint8_t* patch,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    ErrorCode* error) {
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
+  if (operation.src_length() > kMaxInMemoryBsdiffSourceLength) {
+    return ApplyLargeSourceBsdiffOperation(
+        operation, patch, source_fd, target_fd, error);
+  }
+
+  // Read the source data once, and use the same buffer both to validate the
+  // source hash and to apply the patch.
+  ScopedSourceData old_data(&source_data_pool_);
+  TEST_AND_RETURN_FALSE(ReadBsdiffSourceExtents(source_fd,
+                                                operation.src_extents(),
+                                                block_size_,
+                                                operation.src_length(),
+                                                old_data.get()));
+  if (operation.has_src_sha256_hash()) {
+    brillo::Blob source_hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(*old_data, &source_hash));
+    TEST_AND_RETURN_FALSE(ValidateSourceHash(source_hash, operation, error));
+  }
+
+  MemoryBsdiffSource source(old_data->data(), old_data->size());
+  return ApplyBsdiffOperationPatch(operation, &source, patch, target_fd);
+}
 
+bool DeltaPerformer::ApplyLargeSourceBsdiffOperation(
+    const InstallOperation& operation,
+    const uint8_t* patch,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    ErrorCode* error) {
+  LOG(INFO) << "Reading the " << operation.src_length() << " bytes of source "
+            << "data of the operation as the patch uses them.";
   if (operation.has_src_sha256_hash()) {
+    // The source hash is validated before writing any of the target blocks,
+    // so the source data is read once for the hash and again for the patch.
     HashCalculator source_hasher;
-    const uint64_t kMaxBlocksToRead = 512;  // 2MB if block size is 4KB
-    brillo::Blob buf(kMaxBlocksToRead * block_size_);
-    for (const Extent& extent : operation.src_extents()) {
-      for (uint64_t i = 0; i < extent.num_blocks(); i += kMaxBlocksToRead) {
-        uint64_t blocks_to_read =
-            min(kMaxBlocksToRead, extent.num_blocks() - i);
-        ssize_t bytes_to_read = blocks_to_read * block_size_;
-        ssize_t bytes_read_this_iteration = 0;
-        TEST_AND_RETURN_FALSE(
-            utils::PReadAll(source_fd_, buf.data(), bytes_to_read,
-                            (extent.start_block() + i) * block_size_,
-                            &bytes_read_this_iteration));
-        TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes_to_read);
-        TEST_AND_RETURN_FALSE(source_hasher.Update(buf.data(), bytes_to_read));
-      }
+    ScopedSourceData buffer(&source_data_pool_);
+    for (uint64_t offset = 0; offset < operation.src_length();
+         offset += buffer->size()) {
+      buffer->resize(min(static_cast<uint64_t>(ExtentBsdiffSource::kWindowSize),
+                         operation.src_length() - offset));
+      TEST_AND_RETURN_FALSE(ReadBsdiffSourceRange(source_fd,
+                                                  operation.src_extents(),
+                                                  block_size_,
+                                                  offset,
+                                                  buffer->size(),
+                                                  buffer->data()));
+      TEST_AND_RETURN_FALSE(
+          source_hasher.Update(buffer->data(), buffer->size()));
     }
     TEST_AND_RETURN_FALSE(source_hasher.Finalize());
     TEST_AND_RETURN_FALSE(
         ValidateSourceHash(source_hasher.raw_hash(), operation, error));
   }
 
-  string input_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.src_extents(),
-                                                       block_size_,
-                                                       operation.src_length(),
-                                                       &input_positions));
-  string output_positions;
-  TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.dst_extents(),
-                                                       block_size_,
-                                                       operation.dst_length(),
-                                                       &output_positions));
-
-  string temp_filename;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile("au_patch.XXXXXX",
-                                            &temp_filename,
-                                            nullptr));
-  ScopedPathUnlinker path_unlinker(temp_filename);
-  {
-    int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    ScopedFdCloser fd_closer(&fd);
-    TEST_AND_RETURN_FALSE(
-        utils::WriteAll(fd, buffer_.data(), operation.data_length()));
-  }
+  ExtentBsdiffSource source(
+      source_fd, operation.src_extents(), block_size_, operation.src_length());
+  return ApplyBsdiffOperationPatch(operation, &source, patch, target_fd);
+}
+
+bool DeltaPerformer::PerformImgdiffOperation(
+    const InstallOperation& operation, ErrorCode* error) {
+  // Since we delete data off the beginning of the buffer as we use it,
+  // the data we need should be exactly at the beginning of the buffer.
+  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
 
-  // Update the buffer to release the patch data memory as soon as the patch
-  // file is written out.
+  TEST_AND_RETURN_FALSE(ApplyImgdiffOperation(
+      operation, buffer_.data(), source_fd_, target_fd_, error));
   DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
+bool DeltaPerformer::ApplyImgdiffOperation(
+    const InstallOperation& operation,
+    const uint8_t* patch,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    ErrorCode* error) {
+  // The imgdiff patch applies to the whole source blocks and generates the
+  // whole destination blocks, unlike bsdiff which may end in a partial block.
+  const uint64_t src_length = operation.has_src_length() ?
+      operation.src_length() :
+      GetBlockCount(operation.src_extents()) * block_size_;
+  const uint64_t dst_length = operation.has_dst_length() ?
+      operation.dst_length() :
+      GetBlockCount(operation.dst_extents()) * block_size_;
+
+  ScopedSourceData old_data(&source_data_pool_);
+  TEST_AND_RETURN_FALSE(ReadBsdiffSourceExtents(source_fd,
+                                                operation.src_extents(),
+                                                block_size_,
+                                                src_length,
+                                                old_data.get()));
+  if (operation.has_src_sha256_hash()) {
+    brillo::Blob source_hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(*old_data, &source_hash));
+    TEST_AND_RETURN_FALSE(ValidateSourceHash(source_hash, operation, error));
+  }
 
-  vector<string> cmd{kBspatchPath, source_path_, target_path_, temp_filename,
-                     input_positions, output_positions};
+  vector<Extent> dst_extents(operation.dst_extents().begin(),
+                             operation.dst_extents().end());
+  ZeroPadExtentWriter writer(
+      brillo::make_unique_ptr(new DirectExtentWriter()));
+  TEST_AND_RETURN_FALSE(writer.Init(target_fd, dst_extents, block_size_));
+  bool success = ApplyImgdiffPatch(old_data->data(),
+                                   old_data->size(),
+                                   patch,
+                                   operation.data_length(),
+                                   dst_length,
+                                   &writer);
+  // End() must be called even on failure.
+  success = writer.End() && success;
+  return success;
+}
 
-  int return_code = 0;
-  TEST_AND_RETURN_FALSE(
-      Subprocess::SynchronousExecFlags(cmd, Subprocess::kSearchPath,
-                                       &return_code, nullptr));
-  TEST_AND_RETURN_FALSE(return_code == 0);
-  return true;
+bool DeltaPerformer::ApplyBsdiffOperationPatch(
+    const InstallOperation& operation,
+    BsdiffSource* old_data,
+    const uint8_t* patch,
+    FileDescriptorPtr target_fd) {
+  // The ZeroPadExtentWriter zeroes out the rest of the final block when the
+  // |dst_length| is not a multiple of the block size.
+  vector<Extent> dst_extents(operation.dst_extents().begin(),
+                             operation.dst_extents().end());
+  ZeroPadExtentWriter writer(
+      brillo::make_unique_ptr(new DirectExtentWriter()));
+  TEST_AND_RETURN_FALSE(writer.Init(target_fd, dst_extents, block_size_));
+  bool success = ApplyBsdiffPatch(old_data,
+                                  patch,
+                                  operation.data_length(),
+                                  operation.dst_length(),
+                                  &writer);
+  // End() must be called even on failure.
+  success = writer.End() && success;
+  return success;
 }
 
 bool DeltaPerformer::ExtractSignatureMessageFromOperation(
@@ -1514,6 +3354,46 @@ ErrorCode DeltaPerformer::ValidateManifest() {
     }
   }
 
+  // Like for REPLACE_ZSTD, the full payloads only align their blobs when the
+  // clients are known to support it.
+  if (manifest_.has_blob_alignment() &&
+      manifest_.minor_version() != kFullPayloadMinorVersion &&
+      manifest_.minor_version() < kAlignedBlobsMinorPayloadVersion) {
+    LOG(ERROR) << "The payload has aligned blobs, which aren't supported by "
+               << "its minor version " << manifest_.minor_version() << ".";
+    return ErrorCode::kPayloadMismatchedType;
+  }
+
+  for (const PartitionUpdate& partition : manifest_.partitions()) {
+    if (partition.has_hash_tree_extent() &&
+        manifest_.minor_version() != kFullPayloadMinorVersion &&
+        manifest_.minor_version() < kHashTreeMinorPayloadVersion) {
+      LOG(ERROR) << "The partition " << partition.partition_name()
+                 << " has a hash tree, which isn't supported by the minor "
+                 << "version " << manifest_.minor_version() << ".";
+      return ErrorCode::kPayloadMismatchedType;
+    }
+  }
+
+  if (manifest_.has_zstd_dictionary() &&
+      manifest_.minor_version() != kFullPayloadMinorVersion &&
+      manifest_.minor_version() < kZstdDictionaryMinorPayloadVersion) {
+    LOG(ERROR) << "The payload has a zstd dictionary, which isn't supported by "
+               << "its minor version " << manifest_.minor_version() << ".";
+    return ErrorCode::kPayloadMismatchedType;
+  }
+
+  // Reject the payloads whose xz streams we can't decompress before writing
+  // anything, instead of failing in the middle of the update.
+  if (manifest_.max_xz_dict_size() > XzExtentWriter::kMaxDictSize) {
+    LOG(ERROR) << "The payload needs a xz dictionary of "
+               << manifest_.max_xz_dict_size()
+               << " bytes, but this device only decompresses xz streams with "
+               << "a dictionary of up to " << XzExtentWriter::kMaxDictSize
+               << " bytes.";
+    return ErrorCode::kPayloadMismatchedType;
+  }
+
   // TODO(garnold) we should be adding more and more manifest checks, such as
   // partition boundaries etc (see chromium-os:37661).
 
@@ -1522,6 +3402,14 @@ ErrorCode DeltaPerformer::ValidateManifest() {
 
 ErrorCode DeltaPerformer::ValidateOperationHash(
     const InstallOperation& operation) {
+  HashCalculator operation_hasher;
+  if (operation.data_sha256_hash().size())
+    operation_hasher.Update(buffer_.data(), operation.data_length());
+  return ValidateOperationHash(operation, &operation_hasher);
+}
+
+ErrorCode DeltaPerformer::ValidateOperationHash(
+    const InstallOperation& operation, HashCalculator* operation_hasher) {
   if (!operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation hash
@@ -1562,15 +3450,13 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
                           (operation.data_sha256_hash().data() +
                            operation.data_sha256_hash().size()));
 
-  HashCalculator operation_hasher;
-  operation_hasher.Update(buffer_.data(), operation.data_length());
-  if (!operation_hasher.Finalize()) {
+  if (!operation_hasher->Finalize()) {
     LOG(ERROR) << "Unable to compute actual hash of operation "
                << next_operation_num_;
     return ErrorCode::kDownloadOperationHashVerificationError;
   }
 
-  brillo::Blob calculated_op_hash = operation_hasher.raw_hash();
+  brillo::Blob calculated_op_hash = operation_hasher->raw_hash();
   if (calculated_op_hash != expected_op_hash) {
     LOG(ERROR) << "Hash verification failed for operation "
                << next_operation_num_ << ". Expected hash = ";
@@ -1614,6 +3500,19 @@ ErrorCode DeltaPerformer::VerifyPayload(
                       metadata_size_ + metadata_signature_size_ +
                       buffer_offset_);
 
+  // The payload hash and signature cover the blobs of the skipped operations,
+  // which weren't downloaded. The manifest was authenticated with the
+  // metadata signature, so the blobs of the applied operations were checked
+  // against their hashes, and the target partitions are verified against the
+  // manifest next.
+  if (skipped_data_bytes_ > 0) {
+    LOG(INFO) << "Not verifying the payload hash, the " << skipped_data_bytes_
+              << " bytes of the skipped operations weren't downloaded.";
+    if (download_delegate_)
+      download_delegate_->DownloadComplete();
+    return ErrorCode::kSuccess;
+  }
+
   // Verifies the payload hash.
   const string& payload_hash_data = payload_hash_calculator_.hash();
   TEST_AND_RETURN_VAL(ErrorCode::kDownloadPayloadVerificationError,
@@ -1685,22 +3584,53 @@ string StringForHashBytes(const void* bytes, size_t size) {
 }
 }  // namespace
 
+bool DeltaPerformer::SetSourcePartitionHashes(
+    const vector<InstallPlan::Partition>& source_partitions,
+    ErrorCode* error) {
+  *error = ErrorCode::kSuccess;
+  CHECK(defer_source_verification_);
+  source_partitions_ = source_partitions;
+  source_hashes_set_ = true;
+  // Otherwise they are verified once the manifest is parsed.
+  if (!manifest_valid_ || source_verified_by_operations_)
+    return true;
+  if (!source_partitions_.empty() &&
+      !VerifySourcePartitions(source_partitions_)) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
+  if (!waiting_for_source_hashes_)
+    return true;
+
+  // The data kept was already counted when it was passed to Write().
+  waiting_for_source_hashes_ = false;
+  brillo::Blob data;
+  data.swap(deferred_data_);
+  total_bytes_received_ -= data.size();
+  return Write(data.data(), data.size(), error);
+}
+
 bool DeltaPerformer::VerifySourcePartitions() {
+  return VerifySourcePartitions(install_plan_->partitions);
+}
+
+bool DeltaPerformer::VerifySourcePartitions(
+    const vector<InstallPlan::Partition>& source_partitions) {
   LOG(INFO) << "Verifying source partitions.";
   CHECK(manifest_valid_);
   CHECK(install_plan_);
-  if (install_plan_->partitions.size() != partitions_.size()) {
+  if (source_partitions.size() != partitions_.size()) {
     DLOG(ERROR) << "The list of partitions in the InstallPlan doesn't match the "
                    "list received in the payload. The InstallPlan has "
-                << install_plan_->partitions.size()
+                << source_partitions.size()
                 << " partitions while the payload has " << partitions_.size()
                 << " partitions.";
     return false;
   }
   for (size_t i = 0; i < partitions_.size(); ++i) {
-    if (partitions_[i].partition_name() != install_plan_->partitions[i].name) {
+    if (partitions_[i].partition_name() != source_partitions[i].name) {
       DLOG(ERROR) << "The InstallPlan's partition " << i << " is \""
-                  << install_plan_->partitions[i].name
+                  << source_partitions[i].name
                   << "\" but the payload expects it to be \""
                   << partitions_[i].partition_name()
                   << "\". This is an error in the DeltaPerformer setup.";
@@ -1709,7 +3639,7 @@ bool DeltaPerformer::VerifySourcePartitions() {
     if (!partitions_[i].has_old_partition_info())
       continue;
     const PartitionInfo& info = partitions_[i].old_partition_info();
-    const InstallPlan::Partition& plan_part = install_plan_->partitions[i];
+    const InstallPlan::Partition& plan_part = source_partitions[i];
     bool valid =
         !plan_part.source_hash.empty() &&
         plan_part.source_hash.size() == info.hash().size() &&
@@ -1732,24 +3662,60 @@ bool DeltaPerformer::VerifySourcePartitions() {
 
 void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
                                    size_t signed_hash_buffer_size) {
+  // Swap content with an empty vector to ensure that all memory is released.
+  brillo::Blob discarded_data;
+  TakeBuffer(do_advance_offset, signed_hash_buffer_size, &discarded_data);
+}
+
+void DeltaPerformer::TakeBuffer(bool do_advance_offset,
+                                size_t signed_hash_buffer_size,
+                                brillo::Blob* out_data) {
   // Update the buffer offset.
   if (do_advance_offset)
     buffer_offset_ += buffer_.size();
 
-  // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  // Hash the content. While the signed hash covers the same data as the
+  // payload hash, only the latter is calculated.
+  if (signed_hash_shared_ && signed_hash_buffer_size < buffer_.size()) {
+    payload_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+    ForkSignedHash();
+    payload_hash_calculator_.Update(buffer_.data() + signed_hash_buffer_size,
+                                    buffer_.size() - signed_hash_buffer_size);
+  } else if (signed_hash_shared_) {
+    payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
+  } else if (signed_hash_buffer_size == buffer_.size()) {
+    // Both hashes usually cover the whole buffer, in which case it's only read
+    // from memory once.
+    HashCalculator::UpdateAll(
+        {&payload_hash_calculator_, &signed_hash_calculator_},
+        buffer_.data(),
+        buffer_.size());
+  } else {
+    payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
+    signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  }
 
-  // Swap content with an empty vector to ensure that all memory is released.
-  brillo::Blob().swap(buffer_);
+  brillo::Blob().swap(*out_data);
+  out_data->swap(buffer_);
+  buffer_memory_.Set(buffer_.capacity());
+}
+
+void DeltaPerformer::ForkSignedHash() {
+  LOG_IF(ERROR, !signed_hash_calculator_.SetContext(
+                    payload_hash_calculator_.GetContext()))
+      << "Unable to fork the signed hash.";
+  signed_hash_shared_ = false;
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      string update_check_response_hash) {
+  // The first operation can only be resumed from the staged part of its blob.
   int64_t next_operation = kUpdateStateOperationInvalid;
+  int64_t staged_bytes = 0;
+  prefs->GetInt64(kPrefsUpdateStateStagedDataLength, &staged_bytes);
   if (!(prefs->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) &&
         next_operation != kUpdateStateOperationInvalid &&
-        next_operation > 0))
+        (next_operation > 0 || staged_bytes > 0)))
     return false;
 
   string interrupted_hash;
@@ -1787,6 +3753,15 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
         manifest_signature_size >= 0))
     return false;
 
+  // The staged part of the interrupted operation must still be there, unless
+  // it's resumed after its last xz chunk written to the target.
+  if (staged_bytes > 0) {
+    string staged_path;
+    if (!prefs->GetString(kPrefsUpdateStateStagedPath, &staged_path) ||
+        (!staged_path.empty() && utils::FileSize(staged_path) < staged_bytes))
+      return false;
+  }
+
   return true;
 }
 
@@ -1800,56 +3775,354 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
+    prefs->SetString(kPrefsUpdateStateOperationsSegment, "");
+    // The staged part of the interrupted operation, if any, isn't needed.
+    string staged_path;
+    if (prefs->GetString(kPrefsUpdateStateStagedPath, &staged_path) &&
+        !staged_path.empty() && unlink(staged_path.c_str()) != 0 &&
+        errno != ENOENT) {
+      PLOG(WARNING) << "Unable to remove the staging file " << staged_path;
+    }
+    prefs->SetInt64(kPrefsUpdateStateStagedDataLength, 0);
+    prefs->SetString(kPrefsUpdateStateStagedPath, "");
+    prefs->SetString(kPrefsUpdateStateStagedSHA256Context, "");
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
+    prefs->SetInt64(kPrefsUpdateStateChainedPayload, 0);
   }
   return true;
 }
 
-bool DeltaPerformer::CheckpointUpdateProgress() {
-  Terminator::set_exit_blocked(true);
+bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
+  if (!force && !IsCheckpointDue(buffer_offset_))
+    return true;
+
+  const base::TimeTicks checkpoint_start = base::TimeTicks::Now();
+
+  // The direct I/O writes bypass the page cache but may still sit in the
+  // device's write cache, so flush them every so often before saving the
+  // progress past them.
+  const uint64_t kDirectIOFlushInterval = 64 * 1024 * 1024;
+  if (direct_target_fd_ &&
+      direct_io_unflushed_bytes_ >= kDirectIOFlushInterval) {
+    TEST_AND_RETURN_FALSE_ERRNO(direct_target_fd_->Flush());
+    direct_io_unflushed_bytes_ = 0;
+  }
+  bool saved = SaveCheckpoint(MakeCheckpoint());
+  operation_stats_.RecordCheckpoint(base::TimeTicks::Now() - checkpoint_start);
+  return saved;
+}
+
+bool DeltaPerformer::IsCheckpointDue(uint64_t buffer_offset) const {
+  // The last operation is always saved, so the update doesn't need to be
+  // resumed once all the operations were applied.
+  if (next_operation_num_ >= num_total_operations_)
+    return true;
+  if (checkpoint_min_time_.is_zero() && checkpoint_min_bytes_ == 0)
+    return true;
+  if (!checkpoint_min_time_.is_zero() &&
+      base::Time::Now() - last_checkpoint_time_ >= checkpoint_min_time_) {
+    return true;
+  }
+  return checkpoint_min_bytes_ > 0 &&
+         (last_updated_buffer_offset_ == std::numeric_limits<uint64_t>::max() ||
+          buffer_offset - last_updated_buffer_offset_ >= checkpoint_min_bytes_);
+}
+
+DeltaPerformer::UpdateCheckpoint DeltaPerformer::MakeCheckpoint() {
+  UpdateCheckpoint checkpoint;
+  checkpoint.next_operation = next_operation_num_;
+  checkpoint.buffer_offset = buffer_offset_;
+  // The hash contexts are only stored when the offset changes.
   if (last_updated_buffer_offset_ != buffer_offset_) {
+    checkpoint.payload_hash_context = payload_hash_calculator_.GetContext();
+    // An empty signed hash context means it's the same as the payload one.
+    if (!signed_hash_shared_)
+      checkpoint.signed_hash_context = signed_hash_calculator_.GetContext();
+  }
+  if (streaming_hasher_ && !streaming_writer_ && IsStagingResumable()) {
+    checkpoint.staged_bytes = streamed_bytes_;
+    if (!streaming_xz_chunks_)
+      checkpoint.staged_path = staging_path_;
+    checkpoint.staged_hash_context = streaming_hasher_->GetContext();
+  }
+  // The partition of the next operation may not have its operations segment
+  // yet, which is then the next data needed.
+  if (next_operation_num_ < num_total_operations_) {
+    size_t partition_index = 0;
+    while (next_operation_num_ >= acc_num_operations_[partition_index])
+      partition_index++;
+    const PartitionUpdate& partition = partitions_[partition_index];
+    if (partition.operations_size() == 0) {
+      checkpoint.next_data_length = partition.operations_segment().size();
+    } else {
+      const size_t partition_operation_num = next_operation_num_ - (
+          partition_index ? acc_num_operations_[partition_index - 1] : 0);
+      checkpoint.next_data_length =
+          partition.operations(partition_operation_num).data_length() -
+          checkpoint.staged_bytes;
+      checkpoint.operations_segment = operations_segments_[partition_index];
+    }
+  }
+  return checkpoint;
+}
+
+bool DeltaPerformer::SaveCheckpoint(const UpdateCheckpoint& checkpoint) {
+  Terminator::set_exit_blocked(true);
+  if (last_updated_buffer_offset_ != checkpoint.buffer_offset) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
     TEST_AND_RETURN_FALSE(
         prefs_->SetString(kPrefsUpdateStateSHA256Context,
-                          payload_hash_calculator_.GetContext()));
+                          checkpoint.payload_hash_context));
     TEST_AND_RETURN_FALSE(
         prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
-                          signed_hash_calculator_.GetContext()));
+                          checkpoint.signed_hash_context));
     TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
-                                           buffer_offset_));
-    last_updated_buffer_offset_ = buffer_offset_;
-
-    if (next_operation_num_ < num_total_operations_) {
-      size_t partition_index = current_partition_;
-      while (next_operation_num_ >= acc_num_operations_[partition_index])
-        partition_index++;
-      const size_t partition_operation_num = next_operation_num_ - (
-          partition_index ? acc_num_operations_[partition_index - 1] : 0);
-      const InstallOperation& op =
-          partitions_[partition_index].operations(partition_operation_num);
-      TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
-                                             op.data_length()));
-    } else {
-      TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
-                                             0));
+                                           checkpoint.buffer_offset));
+    last_updated_buffer_offset_ = checkpoint.buffer_offset;
+    if (checkpoint.operations_segment &&
+        checkpoint.operations_segment != saved_operations_segment_) {
+      TEST_AND_RETURN_FALSE(
+          prefs_->SetString(kPrefsUpdateStateOperationsSegment,
+                            *checkpoint.operations_segment));
+      saved_operations_segment_ = checkpoint.operations_segment;
+    }
+    // The staged progress is only stored while there is one.
+    if (checkpoint.staged_bytes > 0 || staged_progress_saved_) {
+      TEST_AND_RETURN_FALSE(prefs_->SetString(
+          kPrefsUpdateStateStagedPath, checkpoint.staged_path));
+      TEST_AND_RETURN_FALSE(
+          prefs_->SetString(kPrefsUpdateStateStagedSHA256Context,
+                            checkpoint.staged_hash_context));
+      TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateStagedDataLength,
+                                             checkpoint.staged_bytes));
+      staged_progress_saved_ = checkpoint.staged_bytes > 0;
     }
+
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
+                                           checkpoint.next_data_length));
   }
   TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
-                                         next_operation_num_));
+                                         checkpoint.next_operation));
+  last_checkpoint_time_ = base::Time::Now();
   return true;
 }
 
+bool DeltaPerformer::CanScheduleOperation(const InstallOperation& operation) {
+  if (!worker_fds_)
+    return false;
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+      // The payload signature of major version 1 payloads is in a dummy
+      // REPLACE operation, which is handled inline.
+      return !manifest_.has_signatures_offset() ||
+             manifest_.signatures_offset() != operation.data_offset();
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return true;
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::IMGDIFF:
+      return !worker_fds_->source_fds.empty();
+    default:
+      // MOVE and BSDIFF read from the target partition, which could be
+      // written by any pending operation.
+      return false;
+  }
+}
+
+bool DeltaPerformer::ScheduleOperation(const InstallOperation& operation,
+                                       ErrorCode* error) {
+  // The data blob is handed over to the worker, so unlike the operations
+  // applied inline the buffer is discarded before applying the operation.
+  std::shared_ptr<brillo::Blob> data(new brillo::Blob());
+  if (operation.has_data_offset()) {
+    // Since we delete data off the beginning of the buffer as we use it,
+    // the data we need should be exactly at the beginning of the buffer.
+    TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+    // The buffer holds exactly the operation data, so it's handed over
+    // without copying it.
+    TEST_AND_RETURN_FALSE(buffer_.size() == operation.data_length());
+    TakeBuffer(true, buffer_.size(), data.get());
+  }
+
+  // With the apply wave hints of the payload the executor doesn't need to
+  // compare the extents with the ones of the pending operations.
+  uint32_t wave = OperationExecutor::kNoWave;
+  if (partitions_[current_partition_].apply_waves())
+    wave = operation.apply_wave();
+
+  // The xz chunks are decompressed in parallel as parts of the operation,
+  // which share its data until the last one finishes.
+  if (HasXzChunks(operation)) {
+    size_t data_offset = 0;
+    for (int chunk = 0; chunk < operation.xz_chunk_sizes_size(); chunk++) {
+      InstallOperation chunk_operation =
+          XzChunkOperation(operation, chunk, data_offset);
+      vector<Extent> dst_extents(chunk_operation.dst_extents().begin(),
+                                 chunk_operation.dst_extents().end());
+      if (!executor_->ScheduleInWave(
+              next_operation_num_,
+              current_partition_,
+              dst_extents,
+              wave,
+              chunk_operation.data_length(),
+              base::Bind(&DeltaPerformer::ApplyScheduledOperation,
+                         base::Unretained(this),
+                         chunk_operation,
+                         current_partition_,
+                         worker_fds_,
+                         data,
+                         data_offset),
+              error)) {
+        return false;
+      }
+      data_offset += chunk_operation.data_length();
+    }
+    return true;
+  }
+
+  vector<Extent> dst_extents(operation.dst_extents().begin(),
+                             operation.dst_extents().end());
+  return executor_->ScheduleInWave(
+      next_operation_num_,
+      current_partition_,
+      dst_extents,
+      wave,
+      data->size(),
+      base::Bind(&DeltaPerformer::ApplyScheduledOperation,
+                 base::Unretained(this),
+                 operation,
+                 current_partition_,
+                 worker_fds_,
+                 data,
+                 size_t{0}),
+      error);
+}
+
+bool DeltaPerformer::ApplyScheduledOperation(
+    const InstallOperation& operation,
+    size_t partition,
+    std::shared_ptr<WorkerFileDescriptors> worker_fds,
+    std::shared_ptr<const brillo::Blob> data,
+    size_t data_start,
+    size_t worker_index,
+    ErrorCode* error) {
+  ScopedTrace trace("operation", InstallOperationTypeName(operation.type()));
+  OperationStats::ScopedTimer timer(&operation_stats_,
+                                    operation,
+                                    partitions_[partition].partition_name(),
+                                    block_size_);
+  FileDescriptorPtr source_fd = worker_fds->source_fds.empty() ?
+      nullptr : worker_fds->source_fds[worker_index];
+  FileDescriptorPtr target_fd = worker_fds->target_fds[worker_index];
+  const uint8_t* operation_data = data->data() + data_start;
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      return ApplyReplaceOperation(operation,
+                                   operation_data,
+                                   target_fd,
+                                   nullptr,
+                                   &worker_fds->replace_writers[worker_index]);
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return ApplyZeroOrDiscardOperation(operation, target_fd);
+    case InstallOperation::SOURCE_COPY:
+      return ApplySourceCopyOperation(operation, source_fd, target_fd, error);
+    case InstallOperation::SOURCE_BSDIFF:
+      return ApplySourceBsdiffOperation(
+          operation, operation_data, source_fd, target_fd, error);
+    case InstallOperation::IMGDIFF:
+      return ApplyImgdiffOperation(
+          operation, operation_data, source_fd, target_fd, error);
+    default:
+      return false;
+  }
+}
+
+void DeltaPerformer::CheckpointScheduledOperations() {
+  pending_checkpoints_.push_back(MakeCheckpoint());
+  SaveFinishedCheckpoints(false);
+  CloseFinishedPartitions();
+}
+
+void DeltaPerformer::SuspendOperations() {
+  interrupter_->Suspend();
+  if (executor_)
+    SaveFinishedCheckpoints(true);
+}
+
+void DeltaPerformer::ResumeOperations() {
+  interrupter_->Resume();
+}
+
+void DeltaPerformer::CancelOperations() {
+  if (executor_)
+    LOG(INFO) << "Canceling the operations applied by the worker threads.";
+  interrupter_->Cancel();
+}
+
+void DeltaPerformer::SaveFinishedCheckpoints(bool force) {
+  // Only the progress up to the first unfinished operation can be saved,
+  // even if later operations already finished.
+  const size_t first_unfinished = executor_->FirstUnfinishedOperation();
+  bool found = false;
+  UpdateCheckpoint checkpoint;
+  while (!pending_checkpoints_.empty() &&
+         pending_checkpoints_.front().next_operation <= first_unfinished) {
+    checkpoint = std::move(pending_checkpoints_.front());
+    pending_checkpoints_.pop_front();
+    found = true;
+  }
+  if (found && (force || IsCheckpointDue(checkpoint.buffer_offset))) {
+    const base::TimeTicks checkpoint_start = base::TimeTicks::Now();
+    SaveCheckpoint(checkpoint);
+    operation_stats_.RecordCheckpoint(base::TimeTicks::Now() -
+                                      checkpoint_start);
+  }
+}
+
+bool DeltaPerformer::WaitForScheduledOperations(ErrorCode* error) {
+  if (!executor_)
+    return true;
+  // Makes sure we unblock exit when the progress is saved.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+  bool success = executor_->WaitForAll(error);
+  SaveFinishedCheckpoints(true);
+  // No scheduled operation is running anymore, even after a failure.
+  for (const FinishingPartition& partition : finishing_partitions_) {
+    CloseFileDescriptors(partition.source_fd,
+                         partition.target_fd,
+                         partition.worker_fds.get());
+    if (partition.source_cache) {
+      LogSourceCacheStats(partitions_[partition.partition].partition_name(),
+                          *partition.source_cache);
+    }
+    ReleaseOperationsSegment(partition.partition);
+  }
+  finishing_partitions_.clear();
+  return success;
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
   block_size_ = manifest_.block_size();
 
   int64_t next_operation = kUpdateStateOperationInvalid;
+  int64_t staged_bytes = 0;
+  prefs_->GetInt64(kPrefsUpdateStateStagedDataLength, &staged_bytes);
   if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
       next_operation == kUpdateStateOperationInvalid ||
-      next_operation <= 0) {
+      (next_operation <= 0 && staged_bytes <= 0)) {
     // Initiating a new update, no more state needs to be initialized.
     return true;
   }
@@ -1862,13 +4135,16 @@ bool DeltaPerformer::PrimeUpdateState() {
                         next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
 
-  // The signed hash context and the signature blob may be empty if the
-  // interrupted update didn't reach the signature.
+  // The signed hash context is empty while it's the same as the payload hash
+  // context. The signature blob may be empty if the interrupted update didn't
+  // reach the signature.
   string signed_hash_context;
   if (prefs_->GetString(kPrefsUpdateStateSignedSHA256Context,
-                        &signed_hash_context)) {
+                        &signed_hash_context) &&
+      !signed_hash_context.empty()) {
     TEST_AND_RETURN_FALSE(
         signed_hash_calculator_.SetContext(signed_hash_context));
+    signed_hash_shared_ = false;
   }
 
   string signature_blob;
@@ -1894,6 +4170,13 @@ bool DeltaPerformer::PrimeUpdateState() {
       manifest_signature_size >= 0);
   metadata_signature_size_ = manifest_signature_size;
 
+  // The operations segment of the interrupted partition was already passed.
+  TEST_AND_RETURN_FALSE(LoadResumedOperationsSegment());
+
+  // The interrupted operation continues after the staged part of its blob.
+  if (staged_bytes > 0)
+    TEST_AND_RETURN_FALSE(ResumeStagedOperation(staged_bytes));
+
   // Advance the download progress to reflect what doesn't need to be
   // re-downloaded.
   total_bytes_received_ += buffer_offset_;
@@ -1909,4 +4192,146 @@ bool DeltaPerformer::PrimeUpdateState() {
   return true;
 }
 
+bool DeltaPerformer::FindSatisfiedOperations() {
+  satisfied_operations_.clear();
+  // Without mandatory hash checks the manifest may not be authenticated, and
+  // then neither are the chunk hashes the operations are skipped on.
+  if (!install_plan_->hash_checks_mandatory) {
+    LOG(INFO) << "Not skipping the satisfied operations without mandatory "
+              << "hash checks.";
+    return false;
+  }
+  // The in place operations read the old contents of the target partition.
+  if (GetMinorVersion() == kInPlaceMinorPayloadVersion)
+    return false;
+  // The operations of the segmented partitions aren't known yet.
+  for (const PartitionUpdate& partition : partitions_) {
+    if (partition.has_operations_segment())
+      return false;
+  }
+
+  // The chunks are only read once an operation writing to them is checked.
+  enum class ChunkState { kUnknown, kMatching, kNotMatching };
+
+  satisfied_operations_.assign(num_total_operations_, false);
+  size_t num_satisfied = 0;
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    const InstallPlan::Partition& install_part = install_plan_->partitions[i];
+    const uint64_t chunk_size = install_part.target_hash_chunk_size;
+    if (chunk_size == 0 || acc_num_operations_[i] <= next_operation_num_)
+      continue;
+
+    int fd = HANDLE_EINTR(open(install_part.target_path.c_str(), O_RDONLY));
+    if (fd < 0) {
+      PLOG(WARNING) << "Unable to open " << install_part.target_path;
+      continue;
+    }
+    ScopedFdCloser fd_closer(&fd);
+    vector<ChunkState> chunk_states(install_part.target_chunk_hashes.size(),
+                                    ChunkState::kUnknown);
+    brillo::Blob chunk;
+    auto chunk_matches = [&](uint64_t chunk_index) {
+      ChunkState* state = &chunk_states[chunk_index];
+      if (*state == ChunkState::kUnknown) {
+        const uint64_t offset = chunk_index * chunk_size;
+        chunk.resize(min(chunk_size, install_part.target_size - offset));
+        ssize_t bytes_read = 0;
+        brillo::Blob hash;
+        *state = ChunkState::kNotMatching;
+        if (utils::PReadAll(fd, chunk.data(), chunk.size(), offset,
+                            &bytes_read) &&
+            bytes_read == static_cast<ssize_t>(chunk.size()) &&
+            HashCalculator::RawHashOfData(chunk, &hash) &&
+            hash == install_part.target_chunk_hashes[chunk_index]) {
+          *state = ChunkState::kMatching;
+        }
+      }
+      return *state == ChunkState::kMatching;
+    };
+
+    // The operation continued from its staged blob isn't skipped.
+    const size_t first_op = i ? acc_num_operations_[i - 1] : 0;
+    for (size_t op_num = std::max(first_op, next_operation_num_ +
+                                                (streaming_hasher_ ? 1 : 0));
+         op_num < acc_num_operations_[i]; op_num++) {
+      const InstallOperation& op = partitions_[i].operations(op_num - first_op);
+      // The signature blob of major version 1 payloads is in a dummy
+      // operation, which is always needed.
+      if (op.dst_extents_size() == 0 ||
+          (op.data_length() && manifest_.has_signatures_offset() &&
+           manifest_.signatures_offset() == op.data_offset())) {
+        continue;
+      }
+      bool matches = true;
+      for (const Extent& extent : op.dst_extents()) {
+        if (extent.num_blocks() == 0)
+          continue;
+        if (extent.start_block() == kSparseHole) {
+          matches = false;
+          break;
+        }
+        const uint64_t start = extent.start_block() * block_size_;
+        const uint64_t end = start + extent.num_blocks() * block_size_;
+        if (end > install_part.target_size) {
+          matches = false;
+          break;
+        }
+        for (uint64_t chunk_index = start / chunk_size;
+             matches && chunk_index <= (end - 1) / chunk_size; chunk_index++) {
+          matches = chunk_matches(chunk_index);
+        }
+        if (!matches)
+          break;
+      }
+      if (matches) {
+        satisfied_operations_[op_num] = true;
+        num_satisfied++;
+      }
+    }
+  }
+
+  if (num_satisfied == 0) {
+    satisfied_operations_.clear();
+    return false;
+  }
+  LOG(INFO) << num_satisfied << " of the remaining operations already match "
+            << "the target partitions.";
+  return true;
+}
+
+vector<pair<uint64_t, uint64_t>> DeltaPerformer::GetRequiredPayloadRanges()
+    const {
+  vector<pair<uint64_t, uint64_t>> ranges;
+  auto add_range = [&ranges](uint64_t offset, uint64_t length) {
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().second == offset) {
+      ranges.back().second += length;
+    } else {
+      ranges.emplace_back(offset, length);
+    }
+  };
+
+  const uint64_t data_offset = metadata_size_ + metadata_signature_size_;
+  size_t op_num = 0;
+  for (const auto& partition : partitions_) {
+    for (const InstallOperation& op : partition.operations()) {
+      // The blob of the next operation may be partly staged already.
+      const uint64_t op_end = op.data_offset() + op.data_length();
+      if (op_num >= next_operation_num_ && op_end > buffer_offset_ &&
+          (satisfied_operations_.empty() || !satisfied_operations_[op_num])) {
+        const uint64_t op_start =
+            std::max(static_cast<uint64_t>(op.data_offset()), buffer_offset_);
+        add_range(data_offset + op_start, op_end - op_start);
+      }
+      op_num++;
+    }
+  }
+  if (major_payload_version_ == kBrilloMajorPayloadVersion &&
+      manifest_.has_signatures_offset() && manifest_.signatures_size()) {
+    add_range(data_offset + manifest_.signatures_offset(),
+              manifest_.signatures_size());
+  }
+  return ranges;
+}
+
 }  // namespace chromeos_update_engine
@@ -19,7 +19,13 @@
 
 #include <inttypes.h>
 
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include <base/time/time.h>
@@ -28,10 +34,26 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_pressure_monitor.h"
+#include "update_engine/common/memory_tracker.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/async_file_descriptor.h"
+#include "update_engine/payload_consumer/bspatch_applier.h"
+#include "update_engine/payload_consumer/bzip_extent_writer.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+#include "update_engine/payload_consumer/inline_target_hasher.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/interruptible_file_descriptor.h"
+#include "update_engine/payload_consumer/operation_executor.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/source_block_cache.h"
+#include "update_engine/payload_consumer/target_trimmer.h"
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -84,6 +106,7 @@ class DeltaPerformer : public FileWriter {
         hardware_(hardware),
         download_delegate_(download_delegate),
         install_plan_(install_plan) {}
+  ~DeltaPerformer() override;
 
   // FileWriter's Write implementation where caller doesn't care about
   // error codes.
@@ -160,6 +183,242 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // Sets the number of worker threads used to apply the operations that don't
+  // read from the target partition. When zero, the default, or when the
+  // payload is applied on the target slot, all the operations are applied
+  // inline from Write(). Must be called before the first Write().
+  void set_num_worker_threads(size_t num_worker_threads) {
+    num_worker_threads_ = num_worker_threads;
+  }
+
+  // Limits the number of worker threads applying operations at the same time,
+  // or lifts the limit when zero, the default. Can be called at any time.
+  void SetMaxActiveWorkers(size_t max_active_workers);
+
+  // Sets the maximum number of bytes of operation data held by the operations
+  // scheduled on the worker threads and not finished yet, which bounds the
+  // memory used when many large operations, such as the REPLACE_XZ chunks of a
+  // full payload, are decompressed at the same time. When zero, the default,
+  // only the number of scheduled operations is limited. Must be called before
+  // the first Write().
+  void set_max_scheduled_data_bytes(uint64_t max_scheduled_data_bytes) {
+    max_scheduled_data_bytes_ = max_scheduled_data_bytes;
+  }
+
+  // Sets the minimum |time| or payload |bytes| between two checkpoints of the
+  // update progress: the progress is saved once any of the non-zero limits is
+  // reached. When both are zero, the default, the progress is saved after
+  // every operation. The operations updating the target partition in place are
+  // always checkpointed right away.
+  void set_checkpoint_interval(base::TimeDelta time, uint64_t bytes) {
+    checkpoint_min_time_ = time;
+    checkpoint_min_bytes_ = bytes;
+  }
+
+  // Sets whether the REPLACE operations of any compression applied inline
+  // write to the target partitions with O_DIRECT, bypassing the page
+  // cache. The written data is flushed periodically while checkpointing the
+  // progress. Disabled by default.
+  void set_direct_io(bool direct_io) { direct_io_ = direct_io; }
+
+  // Sets the number of I/O threads used to keep several reads and writes of a
+  // SOURCE_COPY operation in flight when the operations are applied inline.
+  // When zero, the default, or when the payload is applied on the target slot,
+  // each read and write blocks until it completes.
+  void set_num_async_io_threads(size_t num_async_io_threads) {
+    num_async_io_threads_ = num_async_io_threads;
+  }
+
+  // Sets the maximum number of bytes of the source partition blocks kept in
+  // memory after the operations read them, so the blocks shared by several
+  // SOURCE_COPY, SOURCE_BSDIFF and IMGDIFF operations are read from the disk
+  // once. Each source partition has its own cache, shared by the inline and
+  // worker threads; the SOURCE_COPY operations applied with the async I/O
+  // threads don't use it. When zero, the default, there is no cache. Must be
+  // called before the first Write().
+  void set_source_cache_bytes(uint64_t source_cache_bytes) {
+    source_cache_bytes_ = source_cache_bytes;
+  }
+
+  // Sets how far ahead of the operation being applied the source blocks of the
+  // next operations of the partition are prefetched to the page cache with
+  // posix_fadvise(), so they are read from the disk while the payload is still
+  // being downloaded: up to |max_operations| operations or |max_bytes| of
+  // source data ahead. A zero limit is ignored. When both are zero, the
+  // default, nothing is prefetched. Must be called before the first Write().
+  void set_source_prefetch(size_t max_operations, uint64_t max_bytes) {
+    prefetch_max_operations_ = max_operations;
+    prefetch_max_bytes_ = max_bytes;
+  }
+
+  // Sets whether the data already in the target partitions is read before each
+  // write, and the write skipped when it's the same, as it is in most blocks
+  // when retrying or resuming the same payload. This saves the flash wear and
+  // the time of rewriting them at the cost of a read per write. The SOURCE_COPY
+  // operations don't use the async I/O threads then. Disabled by default. Must
+  // be called before the first Write().
+  void set_compare_before_write(bool compare) {
+    compare_before_write_ = compare;
+  }
+
+  // Returns the number of bytes not written to the target partitions because
+  // they already held them, see set_compare_before_write().
+  uint64_t unchanged_bytes() const { return unchanged_bytes_; }
+
+  // Sets whether only the metadata of the payload is parsed and validated,
+  // filling the partitions of the install plan from the manifest, without
+  // opening the target partitions nor saving any update progress. The rest of
+  // the payload is ignored. Disabled by default. Must be called before the
+  // first Write().
+  void set_metadata_only(bool metadata_only) { metadata_only_ = metadata_only; }
+
+  // Sets the number of partitions whose scheduled operations can be applied
+  // at the same time. With more than one, the operations of the next partition
+  // are scheduled while the previous ones are still being written. Only used
+  // with worker threads; the default is one.
+  void set_max_concurrent_partitions(size_t max_concurrent_partitions) {
+    max_concurrent_partitions_ = max_concurrent_partitions;
+  }
+
+  // Sets the maximum number of bytes of a single operation blob held in memory.
+  // The blob of a larger operation isn't buffered: the REPLACE blobs of any
+  // compression are written to the target partition as they arrive, and
+  // the blobs of the diff operations are staged in a file in |staging_dir|,
+  // which only holds one blob at a time, and applied from a read-only mapping
+  // of it. These operations are always applied inline. When zero, the default,
+  // the blobs are buffered in memory regardless of their size. Must be called
+  // before the first Write().
+  void set_memory_budget(uint64_t max_buffered_bytes,
+                         const std::string& staging_dir) {
+    memory_budget_ = max_buffered_bytes;
+    staging_dir_ = staging_dir;
+  }
+
+  // Sets whether the target partitions are hashed from the data written to
+  // them while the operations are applied, holding at most |max_pending_bytes|
+  // of the writes ahead of the hashed part of each partition. When the hash of
+  // a partition matches the manifest, |num_spot_checks| random chunks of it are
+  // read back and compared to the written data, and the partition is marked as
+  // verified in the install plan so the FilesystemVerifierAction doesn't read
+  // it again. Only used when the payload is applied from the start. Disabled
+  // by default. Must be called before the first Write().
+  void set_inline_target_hashing(bool enabled,
+                                 uint64_t max_pending_bytes,
+                                 size_t num_spot_checks) {
+    inline_target_hashing_ = enabled;
+    inline_max_pending_bytes_ = max_pending_bytes;
+    inline_num_spot_checks_ = num_spot_checks;
+  }
+
+  // Sets whether, when resuming an update, the remaining operations whose
+  // target blocks already match the chunk hashes of their partition are
+  // skipped without downloading their blobs. Once the manifest is parsed, the
+  // download delegate is asked to fetch only the payload data still needed
+  // with FetchOnlyPayloadRanges(), and nothing is skipped if it can't. This
+  // requires mandatory hash checks and a payload that doesn't update the
+  // partitions in place. Disabled by default. Must be called before the first
+  // Write().
+  void set_skip_satisfied_operations(bool skip) {
+    skip_satisfied_operations_ = skip;
+  }
+
+  // Sets the number of bytes of a diff blob staged in the |staging_dir| of
+  // set_memory_budget() after which the progress inside its operation is
+  // saved, so an interrupted update resumes from the staged part of the blob
+  // instead of downloading it again. The staging file is then kept until the
+  // operation finishes, so the |staging_dir| must be in persistent storage.
+  // The progress inside the streamed REPLACE_XZ operations split in xz chunks
+  // is also saved after the chunks once this many bytes were written, without
+  // a staging file. When zero, the default, the progress is only saved
+  // between operations.
+  // Must be called before the first Write().
+  void set_staged_checkpoint_bytes(uint64_t staged_checkpoint_bytes) {
+    staged_checkpoint_bytes_ = staged_checkpoint_bytes;
+  }
+
+  // Sets whether the source partitions are verified once their hashes are
+  // passed to SetSourcePartitionHashes(), instead of from the InstallPlan when
+  // the manifest is parsed. The operations reading from the source data wait
+  // until then, keeping the data passed to Write() meanwhile, while the rest
+  // are applied as they arrive. Disabled by default. Must be called before the
+  // first Write().
+  void set_defer_source_verification(bool defer) {
+    defer_source_verification_ = defer;
+  }
+
+  // Sets whether the whole source partitions are left unverified when every
+  // operation reading from them validates the src_sha256_hash of the blocks
+  // it reads, which only payloads of minor version 3 or later without
+  // operations segments can ensure once the manifest is parsed. The
+  // operations then don't wait for SetSourcePartitionHashes(), whose hashes
+  // are ignored. Disabled by default. Must be called before the first Write().
+  void set_lazy_source_verification(bool lazy) {
+    lazy_source_verification_ = lazy;
+  }
+
+  // Sets the |throttle| delaying the reads and writes of the source and target
+  // partitions as slower storage would, to evaluate the apply pipeline on
+  // such devices. It may be shared with other users of the same storage. Not
+  // set by default. Must be called before the first Write().
+  void set_storage_throttle(std::shared_ptr<StorageThrottle> throttle) {
+    storage_throttle_ = throttle;
+  }
+
+  // Suspends the operations applied by the worker threads at their next I/O,
+  // and saves the progress of the operations already finished. Resumed by
+  // ResumeOperations(), or by the next Write() or Close(), which would
+  // otherwise wait for them.
+  void SuspendOperations();
+  void ResumeOperations();
+
+  // Makes the operations applied by the worker threads fail at their next
+  // I/O, so Close() doesn't wait for them to finish. They are applied again
+  // when the update is resumed. Called before Close() when the update is
+  // canceled; no payload data can be written afterwards.
+  void CancelOperations();
+
+  // Sets the |claims| on the target partitions of the payloads applied at the
+  // same time, as the index of the payload updating each partition by name.
+  // Once the manifest is parsed, the partitions of this payload are claimed
+  // for |payload_index|, and the payload is rejected if another one already
+  // claimed any of them. Not set by default. Must be called before the first
+  // Write().
+  void set_partition_claims(std::map<std::string, size_t>* claims,
+                            size_t payload_index) {
+    partition_claims_ = claims;
+    payload_index_ = payload_index;
+  }
+
+  // Sets whether the blocks the operations of each target partition write are
+  // discarded from a background thread ahead of their application, which
+  // makes the writes faster on the flash storage erasing the blocks before
+  // writing them. The TargetTrimmer also discards the end of the partitions,
+  // with or without this. It's only done for an update started from the
+  // beginning, without set_compare_before_write(), and not in place.
+  // Disabled by default. Must be called before the first Write().
+  void set_pre_trim(bool pre_trim) { pre_trim_ = pre_trim; }
+
+  // Returns whether the source partitions are only verified by the source
+  // hashes of the operations, as decided once the manifest is parsed.
+  bool source_verified_by_operations() const {
+    return source_verified_by_operations_;
+  }
+
+  // Passes the |source_partitions| with their computed source_hash when the
+  // source verification is deferred, verifies them against the manifest if it
+  // was already parsed and applies the data kept while waiting for them.
+  // Returns false on failure, setting |*error|.
+  bool SetSourcePartitionHashes(
+      const std::vector<InstallPlan::Partition>& source_partitions,
+      ErrorCode* error);
+
+  // Returns whether the next operation waits for SetSourcePartitionHashes().
+  bool IsWaitingForSourceHashes() const { return waiting_for_source_hashes_; }
+
+  // Returns the time spent applying the operations so far and the data they
+  // read and wrote, per operation type and per partition.
+  const OperationStats& operation_stats() const { return operation_stats_; }
+
   // Set |*out_offset| to the byte offset where the size of the metadata signature
   // is stored in a payload. Return true on success, if this field is not
   // present in the payload, return false.
@@ -193,17 +452,65 @@ class DeltaPerformer : public FileWriter {
   friend class DeltaPerformerIntegrationTest;
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloVerifyMetadataSignatureTest);
+  FRIEND_TEST(DeltaPerformerTest, CheckpointIntervalTest);
+  FRIEND_TEST(DeltaPerformerTest, DeferredSourceVerificationTest);
+  FRIEND_TEST(DeltaPerformerTest, LazySourceVerificationTest);
+  FRIEND_TEST(DeltaPerformerTest, LazySourceVerificationDedupMoveTest);
+  FRIEND_TEST(DeltaPerformerTest, MemoryBudgetReplaceTest);
+  FRIEND_TEST(DeltaPerformerTest, MemoryBudgetSourceBsdiffTest);
+  FRIEND_TEST(DeltaPerformerTest, SatisfiedOperationsTest);
+  FRIEND_TEST(DeltaPerformerTest, SegmentedManifestPartitionsTest);
+  FRIEND_TEST(DeltaPerformerTest, SegmentedManifestResumeTest);
+  FRIEND_TEST(DeltaPerformerTest, SharedSignedHashTest);
+  FRIEND_TEST(DeltaPerformerTest, StagedOperationResumeTest);
+  FRIEND_TEST(DeltaPerformerTest, StreamedReplaceOperationHashTest);
+  FRIEND_TEST(DeltaPerformerTest, StreamedReplaceOperationTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
+  FRIEND_TEST(DeltaPerformerTest, XzChunksResumeTest);
+  FRIEND_TEST(DeltaPerformerTest, XzChunksWithWorkerThreadsTest);
 
   // Parse and move the update instructions of all partitions into our local
   // |partitions_| variable based on the version of the payload. Requires the
   // manifest to be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error);
 
+  // Reads the operations segment of the current partition from up to
+  // |*count_p| bytes from |*bytes_p|, as CopyDataToBuffer() does, and loads
+  // its operations once it's complete. Returns false on error, setting
+  // |error|.
+  bool LoadOperationsSegment(const char** bytes_p,
+                             size_t* count_p,
+                             ErrorCode* error);
+
+  // Verifies the operations segment |data| of the partition |partition_index|
+  // and loads its operations into |partitions_|.
+  ErrorCode ParseOperationsSegment(size_t partition_index,
+                                   std::shared_ptr<const std::string> data);
+
+  // Returns whether the payload is applied on the target slot, as a chained
+  // payload, reading the blocks the previous operations wrote.
+  bool IsAppliedOnTargetSlot() const;
+
+  // Returns whether the operations of the |partition| can be applied when the
+  // payload is applied on the target slot. They are then applied inline one
+  // after the other, so a later operation never overwrites the blocks an
+  // earlier one is still reading.
+  bool CanApplyOnTargetSlot(const PartitionUpdate& partition) const;
+
+  // Loads the operations of the interrupted partition from the segment saved
+  // with the progress if the resumed data is past it. Returns false if the
+  // saved segment isn't valid.
+  bool LoadResumedOperationsSegment();
+
+  // Frees the operations of the partition |partition_index| loaded from its
+  // operations segment, if any, once they were all applied.
+  void ReleaseOperationsSegment(size_t partition_index);
+
   // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
   // the extent that the size of |buffer_| does not exceed |max|. Advances
   // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
-  // and returns this number.
+  // and returns this number. The |buffer_| is allocated for |max| bytes at
+  // once, so it's not reallocated as the data arrives in small chunks.
   size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
 
   // If |op_result| is false, emits an error message using |op_type_name| and
@@ -218,15 +525,31 @@ class DeltaPerformer : public FileWriter {
   void UpdateOverallProgress(bool force_log, const char* message_prefix);
 
   // Verifies that the expected source partition hashes (if present) match the
-  // hashes for the current partitions. Returns true if there are no expected
-  // hashes in the payload (e.g., if it's a new-style full update) or if the
-  // hashes match; returns false otherwise.
+  // hashes of the |source_partitions|, which default to the ones in the
+  // InstallPlan. Returns true if there are no expected hashes in the payload
+  // (e.g., if it's a new-style full update) or if the hashes match; returns
+  // false otherwise.
   bool VerifySourcePartitions();
+  bool VerifySourcePartitions(
+      const std::vector<InstallPlan::Partition>& source_partitions);
+
+  // Opens one source and target file descriptor per worker thread for the
+  // current partition, unless the partition doesn't support it in which case
+  // its operations are applied inline. Returns whether they were opened.
+  bool OpenWorkerFileDescriptors();
 
   // Returns true if enough of the delta file has been passed via Write()
   // to be able to perform a given install operation.
   bool CanPerformInstallOperation(const InstallOperation& operation);
 
+  // Consumes from the next |*count_p| bytes at |*bytes_p| the padding before
+  // the aligned blob of the |operation|, which must be shorter than the blob
+  // alignment of the payload, and advances |buffer_offset_| past it once it
+  // is all received. Returns whether the padding is valid.
+  bool SkipBlobPadding(const InstallOperation& operation,
+                       const char** bytes_p,
+                       size_t* count_p);
+
   // Checks the integrity of the payload manifest. Returns true upon success,
   // false otherwise.
   ErrorCode ValidateManifest();
@@ -236,6 +559,11 @@ class DeltaPerformer : public FileWriter {
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
   ErrorCode ValidateOperationHash(const InstallOperation& operation);
 
+  // Same as ValidateOperationHash(), but uses the hash of the blob calculated
+  // by |operation_hasher|, which is finalized.
+  ErrorCode ValidateOperationHash(const InstallOperation& operation,
+                                  HashCalculator* operation_hasher);
+
   // Given the |payload|, verifies that the signed hash of its metadata matches
   // what's specified in the install plan from Omaha (if present) or the
   // metadata signature in payload itself (if present). Returns
@@ -260,6 +588,257 @@ class DeltaPerformer : public FileWriter {
                                   ErrorCode* error);
   bool PerformSourceBsdiffOperation(const InstallOperation& operation,
                                     ErrorCode* error);
+  bool PerformImgdiffOperation(const InstallOperation& operation,
+                               ErrorCode* error);
+
+  // The extent writer stacks of the REPLACE operations applied from one
+  // thread, by operation type, use of the zstd dictionary and staging buffer
+  // pool. Each operation initializes the stack of its type again instead of
+  // allocating one, and reuses the storage of the |extents| passed to it.
+  struct ReplaceWriters {
+    std::map<std::tuple<InstallOperation::Type, bool, AlignedBufferPool*>,
+             std::unique_ptr<ExtentWriter>>
+        writers;
+    std::vector<Extent> extents;
+  };
+
+  // These apply a specific type of operation using the passed file descriptors
+  // and operation |data| instead of |buffer_|, so they can be used from the
+  // worker threads. Return true on success.
+  // The ApplyReplaceOperation() writes are staged in |aligned_buffers|, if
+  // set, as required by a |target_fd| opened with O_DIRECT. The writer stack
+  // is taken from the |writers| of the calling thread if not null.
+  bool ApplyReplaceOperation(const InstallOperation& operation,
+                             const uint8_t* data,
+                             FileDescriptorPtr target_fd,
+                             AlignedBufferPool* aligned_buffers,
+                             ReplaceWriters* writers);
+  bool ApplyZeroOrDiscardOperation(const InstallOperation& operation,
+                                   FileDescriptorPtr target_fd);
+
+  // Returns the initialized extent writer stack that writes the decompressed
+  // blob of the REPLACE, REPLACE_BZ, REPLACE_XZ or REPLACE_ZSTD |operation| to
+  // |target_fd|, or nullptr on error.
+  std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+      const InstallOperation& operation,
+      FileDescriptorPtr target_fd,
+      AlignedBufferPool* aligned_buffers);
+
+  // Returns the extent writer stack of the REPLACE operations like
+  // |operation|, staging the writes in |aligned_buffers| if set, before its
+  // Init(). Returns nullptr if the payload has no zstd dictionary for it.
+  std::unique_ptr<ExtentWriter> NewReplaceExtentWriter(
+      const InstallOperation& operation, AlignedBufferPool* aligned_buffers);
+
+  // Initializes the |writer| to write the dst extents of |operation| to
+  // |target_fd|, copying them to |extents|. Returns false on error.
+  bool InitReplaceExtentWriter(const InstallOperation& operation,
+                               FileDescriptorPtr target_fd,
+                               std::vector<Extent>* extents,
+                               ExtentWriter* writer);
+  bool ApplySourceCopyOperation(const InstallOperation& operation,
+                                FileDescriptorPtr source_fd,
+                                FileDescriptorPtr target_fd,
+                                ErrorCode* error);
+  bool ApplySourceBsdiffOperation(const InstallOperation& operation,
+                                  const uint8_t* patch,
+                                  FileDescriptorPtr source_fd,
+                                  FileDescriptorPtr target_fd,
+                                  ErrorCode* error);
+
+  // Applies the SOURCE_BSDIFF |operation| of a source too large to be read in
+  // memory, reading the source data from |source_fd| as the |patch| uses it.
+  bool ApplyLargeSourceBsdiffOperation(const InstallOperation& operation,
+                                       const uint8_t* patch,
+                                       FileDescriptorPtr source_fd,
+                                       FileDescriptorPtr target_fd,
+                                       ErrorCode* error);
+  bool ApplyImgdiffOperation(const InstallOperation& operation,
+                             const uint8_t* patch,
+                             FileDescriptorPtr source_fd,
+                             FileDescriptorPtr target_fd,
+                             ErrorCode* error);
+
+  // Applies the BSDIFF |operation| with its |patch| to the |target_fd|, which
+  // is both its source and target.
+  bool ApplyBsdiffOperation(const InstallOperation& operation,
+                            const uint8_t* patch,
+                            FileDescriptorPtr target_fd);
+
+  // Applies the bsdiff |patch| of the |operation| to the |old_data| and writes
+  // the result to the |operation| dst_extents in |target_fd|. Returns whether
+  // the patch was applied.
+  bool ApplyBsdiffOperationPatch(const InstallOperation& operation,
+                                 BsdiffSource* old_data,
+                                 const uint8_t* patch,
+                                 FileDescriptorPtr target_fd);
+
+  // Applies the SOURCE_COPY |operation| with the |async_source_fd_| and
+  // |async_target_fd_|, keeping several reads and writes in flight.
+  bool ApplySourceCopyOperationAsync(const InstallOperation& operation,
+                                     ErrorCode* error);
+
+  // Opens the |direct_target_fd_| of the current partition, unless it's an
+  // MTD or UBI device. Returns false if it couldn't be opened.
+  bool OpenDirectTargetFileDescriptor();
+
+  // Opens the |async_source_fd_| and |async_target_fd_| of the current
+  // partition, if enabled and supported. Returns false if they couldn't be
+  // opened.
+  bool OpenAsyncFileDescriptors();
+
+  // Prefetches the source blocks of the operations of the current partition
+  // following its |partition_operation_num|, up to the limits of
+  // set_source_prefetch() past the ones already prefetched.
+  void PrefetchSourceData(size_t partition_operation_num);
+
+  // Closes the |source_prefetch_fd_|, if open.
+  void CloseSourcePrefetchFd();
+
+  // Starts the |target_trimmer_| of the current partition, discarding the
+  // blocks of its operations when set_pre_trim() allows it.
+  void StartTargetTrimmer();
+
+  // Returns the |fd| of the current target partition wrapped to compare the
+  // writes to the data already there, see set_compare_before_write(), and to
+  // record the data written to it in the partition's hasher, or |fd| itself
+  // when neither is used. The |fd| is throttled first when there is a
+  // |storage_throttle_|.
+  FileDescriptorPtr WrapTargetFileDescriptor(FileDescriptorPtr fd);
+
+  // Returns the |fd| of the current source partition wrapped to read it
+  // through the |source_cache_|, or |fd| itself when there is no cache, after
+  // throttling it when there is a |storage_throttle_|.
+  FileDescriptorPtr WrapSourceFileDescriptor(FileDescriptorPtr fd);
+
+  // Builds the hash trees of the target partitions that have one in the
+  // manifest, from the data hashed inline if any, and writes them to the
+  // partitions. Returns whether all of them were written.
+  bool BuildHashTrees();
+
+  // Finishes the inline hashes of the target partitions and marks the ones
+  // matching the manifest as verified in the install plan.
+  void VerifyTargetHashesInline();
+
+  // Returns whether the blob of the |operation| is larger than the memory
+  // budget.
+  bool ExceedsMemoryBudget(const InstallOperation& operation) const {
+    return memory_budget_ > 0 && operation.data_length() > memory_budget_;
+  }
+
+  // Returns whether the |operation| blob can be processed while it's being
+  // downloaded, instead of waiting for the whole blob: either written to the
+  // target partition or staged in the |staging_fd_|.
+  bool CanStreamOperation(const InstallOperation& operation);
+
+  // Writes the part of the |operation| blob in the next |*count_p| bytes at
+  // |*bytes_p| to the |streaming_writer_|, or to the |staging_fd_| for the diff
+  // operations and when IsOperationHashEnforced(), advancing both. Once the
+  // whole blob was passed, validates its hash and finishes the operation,
+  // resetting the |streaming_hasher_|. Returns false on error, setting |error|
+  // if the hash check failed.
+  bool StreamOperationData(const InstallOperation& operation,
+                           const char** bytes_p,
+                           size_t* count_p,
+                           ErrorCode* error);
+
+  // Returns whether an operation hash mismatch fails the update, in which case
+  // no blob may reach the target partition before its hash is validated.
+  bool IsOperationHashEnforced() const;
+
+  // Drops the operation being streamed, if any.
+  void AbortStreamingOperation();
+
+  // Opens the |staging_fd_| if needed and empties it. Returns false if it
+  // couldn't be opened.
+  bool OpenStagingFile();
+
+  // Closes and removes the staging file, if any. The file is kept if the
+  // saved progress points into it.
+  void CloseStagingFile();
+
+  // Returns whether the progress inside the staged operations, or inside the
+  // xz chunks being streamed, is saved.
+  bool IsStagingResumable() const {
+    return staged_checkpoint_bytes_ > 0 &&
+           (streaming_xz_chunks_ || !staging_dir_.empty());
+  }
+
+  // Saves the progress inside the operation being staged, or after the xz
+  // chunk just written, if enough of its blob was passed since the last
+  // checkpoint.
+  void CheckpointStagedOperation();
+
+  // Reopens the staging file of the interrupted operation, holding the first
+  // |staged_bytes| of its blob, and restores the hash context of its blob.
+  // The operations with xz chunks resume instead from the chunk starting at
+  // |staged_bytes|, without a staging file.
+  bool ResumeStagedOperation(uint64_t staged_bytes);
+
+  // Applies the diff |operation| whose whole blob is in the |staging_fd_|.
+  bool ApplyStagedOperation(const InstallOperation& operation,
+                            ErrorCode* error);
+
+  // Returns whether the |operation| can be applied by the worker threads.
+  bool CanScheduleOperation(const InstallOperation& operation);
+
+  // Moves the data of the |operation| out of |buffer_| and schedules it on the
+  // |executor_|. Returns false if it couldn't be scheduled, setting |error| if
+  // a previously scheduled operation failed.
+  bool ScheduleOperation(const InstallOperation& operation, ErrorCode* error);
+
+  // The file descriptors of a partition used by each worker thread, indexed
+  // by the worker index.
+  struct WorkerFileDescriptors {
+    std::vector<FileDescriptorPtr> source_fds;
+    std::vector<FileDescriptorPtr> target_fds;
+    // Only used by the worker thread of the same index.
+    mutable std::vector<ReplaceWriters> replace_writers;
+  };
+
+  // A partition whose operations were all scheduled, kept open until they
+  // finish.
+  struct FinishingPartition {
+    // The index of the partition in |partitions_| and one past its last
+    // operation.
+    size_t partition;
+    size_t end_operation;
+    FileDescriptorPtr source_fd;
+    FileDescriptorPtr target_fd;
+    std::shared_ptr<WorkerFileDescriptors> worker_fds;
+    std::shared_ptr<SourceBlockCache> source_cache;
+  };
+
+  // Applies the scheduled |operation| of the |partition| with its blob at
+  // |data_start| of the |data| from the worker thread |worker_index|, using
+  // the |worker_fds| of the partition.
+  bool ApplyScheduledOperation(
+      const InstallOperation& operation,
+      size_t partition,
+      std::shared_ptr<WorkerFileDescriptors> worker_fds,
+      std::shared_ptr<const brillo::Blob> data,
+      size_t data_start,
+      size_t worker_index,
+      ErrorCode* error);
+
+  // Closes all the passed file descriptors, if set. Returns 0 on success, or
+  // -errno of the last failure.
+  static int CloseFileDescriptors(FileDescriptorPtr source_fd,
+                                  FileDescriptorPtr target_fd,
+                                  const WorkerFileDescriptors* worker_fds);
+
+  // Done with the current partition once all its operations were scheduled.
+  // Closes it right away unless several partitions can be applied at the same
+  // time, in which case it's closed once its operations finish. Returns false
+  // if a scheduled operation failed, setting |error|.
+  bool FinishCurrentPartition(ErrorCode* error);
+
+  // Closes the |finishing_partitions_| whose operations all finished.
+  void CloseFinishedPartitions();
+
+  // Waits for all the operations scheduled on the |executor_|, if any, and
+  // saves the progress. Returns false if any of them failed, setting |error|.
+  bool WaitForScheduledOperations(ErrorCode* error);
 
   // Extracts the payload signature message from the blob on the |operation| if
   // the offset matches the one specified by the manifest. Returns whether the
@@ -278,15 +857,72 @@ class DeltaPerformer : public FileWriter {
   // accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Sets the |signed_hash_calculator_| to the current payload hash, once the
+  // data passed to them diverges.
+  void ForkSignedHash();
+
+  // Same as DiscardBuffer(), but moves the content of |buffer_| to |out_data|
+  // instead of deallocating it.
+  void TakeBuffer(bool do_advance_offset,
+                  size_t signed_hash_buffer_size,
+                  brillo::Blob* out_data);
+
+  // The update progress state stored in the persistent storage. The hash
+  // contexts are only set when |buffer_offset| changed since the last saved
+  // checkpoint.
+  struct UpdateCheckpoint {
+    size_t next_operation{0};
+    uint64_t buffer_offset{0};
+    std::string payload_hash_context;
+    std::string signed_hash_context;
+    // The part of the next operation's blob already in the staging file at
+    // |staged_path|, or in the xz chunks written to the target when the path
+    // is empty, if any, and the context of its operation hash.
+    uint64_t staged_bytes{0};
+    std::string staged_path;
+    std::string staged_hash_context;
+    // The length of the data needed next, stored for the p2p lookups.
+    uint64_t next_data_length{0};
+    // The operations segment of the partition of the next operation, if it
+    // has one that was already passed.
+    std::shared_ptr<const std::string> operations_segment;
+  };
+
   // Checkpoints the update progress into persistent storage to allow this
-  // update attempt to be resumed after reboot.
-  bool CheckpointUpdateProgress();
+  // update attempt to be resumed after reboot. Unless |force|, the progress is
+  // only saved once the checkpoint interval elapsed.
+  bool CheckpointUpdateProgress(bool force);
+
+  // Returns whether the progress up to |buffer_offset| should be saved
+  // according to the checkpoint interval.
+  bool IsCheckpointDue(uint64_t buffer_offset) const;
+
+  // Returns the current update progress, and saves the passed |checkpoint|
+  // into persistent storage.
+  UpdateCheckpoint MakeCheckpoint();
+  bool SaveCheckpoint(const UpdateCheckpoint& checkpoint);
+
+  // Records the update progress after scheduling an operation, and saves the
+  // latest recorded progress for which all the operations finished, if due
+  // or |force|.
+  void CheckpointScheduledOperations();
+  void SaveFinishedCheckpoints(bool force);
 
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
   bool PrimeUpdateState();
 
+  // Finds the operations not applied yet whose target blocks already match the
+  // chunk hashes of their partition, setting |satisfied_operations_|. Returns
+  // whether there's any.
+  bool FindSatisfiedOperations();
+
+  // Returns the byte ranges of the payload, as offset and length, with the
+  // data still needed to apply the update: the blobs of the operations that
+  // weren't applied and aren't satisfied, and the signature blob.
+  std::vector<std::pair<uint64_t, uint64_t>> GetRequiredPayloadRanges() const;
+
   // If the Omaha response contains a public RSA key and we're allowed
   // to use it (e.g. if we're in developer mode), extract the key from
   // the response and store it in a temporary file and return true. In
@@ -321,6 +957,178 @@ class DeltaPerformer : public FileWriter {
   std::string source_path_;
   std::string target_path_;
 
+  // The size limit of the source block caches, and the cache of the current
+  // source partition, shared by the |source_fd_| and the worker source file
+  // descriptors. Only set while updating a partition when the cache is
+  // enabled.
+  uint64_t source_cache_bytes_{0};
+  std::shared_ptr<SourceBlockCache> source_cache_;
+  // The registration of the |source_cache_| with the MemoryPressureMonitor,
+  // released before the cache.
+  std::unique_ptr<ShrinkableCacheRegistration> source_cache_registration_;
+
+  // Whether the writes to the target partitions are compared to the data
+  // already there, and the number of bytes they skipped, from all the threads.
+  bool compare_before_write_{false};
+  std::atomic<uint64_t> unchanged_bytes_{0};
+
+  // The emulated storage the partitions are accessed through, if any.
+  std::shared_ptr<StorageThrottle> storage_throttle_;
+
+  // Suspends and cancels the I/Os of the worker threads, see
+  // SuspendOperations() and CancelOperations().
+  std::shared_ptr<OperationInterrupter> interrupter_{
+      std::make_shared<OperationInterrupter>()};
+
+  // Whether the target blocks are discarded ahead of the operations, and the
+  // trimmer of the current partition, if any.
+  bool pre_trim_{false};
+  std::unique_ptr<TargetTrimmer> target_trimmer_;
+
+  // The claims on the target partitions shared with the other payloads, if
+  // any, and the index of this payload in them.
+  std::map<std::string, size_t>* partition_claims_{nullptr};
+  size_t payload_index_{0};
+
+  // Whether only the metadata of the payload is validated.
+  bool metadata_only_{false};
+
+  // The limits of the source prefetching, and the file descriptor of the
+  // current source partition the prefetch hints are given on, only open when
+  // it is enabled. The operations of the current partition from
+  // |prefetch_start_operation_| up to |prefetch_end_operation_| were
+  // prefetched and not applied yet, and they read |prefetch_bytes_| bytes.
+  size_t prefetch_max_operations_{0};
+  uint64_t prefetch_max_bytes_{0};
+  int source_prefetch_fd_{-1};
+  size_t prefetch_start_operation_{0};
+  size_t prefetch_end_operation_{0};
+  uint64_t prefetch_bytes_{0};
+
+  // The number of worker threads and of those running at once, the limit of
+  // the data held by their operations, and the executor running the
+  // operations on them. The executor is only created when there are worker
+  // threads.
+  size_t num_worker_threads_{0};
+  size_t max_active_workers_{0};
+  uint64_t max_scheduled_data_bytes_{0};
+  std::unique_ptr<OperationExecutor> executor_;
+
+  // The worker file descriptors of the current partition, shared with the
+  // operations scheduled on it. Not set when the current partition's
+  // operations are applied inline.
+  std::shared_ptr<WorkerFileDescriptors> worker_fds_;
+
+  // Whether direct I/O is enabled, and the target partition opened with
+  // O_DIRECT when it is, the pool of buffers used to write to it and the number
+  // of bytes written since it was last flushed.
+  bool direct_io_{false};
+  FileDescriptorPtr direct_target_fd_;
+  std::unique_ptr<AlignedBufferPool> direct_io_buffers_;
+  uint64_t direct_io_unflushed_bytes_{0};
+
+  // The pool of the output buffers of the REPLACE_BZ, REPLACE_XZ and
+  // REPLACE_ZSTD operations, created with the first partition.
+  std::unique_ptr<AlignedBufferPool> decompression_buffers_;
+  // The pools of the REPLACE_BZ and REPLACE_XZ decompressors, created along
+  // with the |decompression_buffers_|.
+  std::unique_ptr<BzipDecoderPool> bzip_decoders_;
+  std::unique_ptr<XzDecoderPool> xz_decoders_;
+  // The zstd dictionary of the payload, if any, also loaded with the first
+  // partition.
+  std::unique_ptr<ZstdDecoderDictionary> zstd_dictionary_;
+
+  // The writer stacks of the REPLACE operations applied inline.
+  ReplaceWriters replace_writers_;
+
+  // The pool of the buffers the source data of the BSDIFF, SOURCE_BSDIFF and
+  // IMGDIFF operations is read into, shared by the inline and worker threads.
+  // The buffers of the operations over 4 MiB aren't kept.
+  SourceDataPool source_data_pool_{4 * 1024 * 1024};
+
+  // The registrations of the pools above with the MemoryPressureMonitor, so
+  // they stop keeping their free buffers under memory pressure. They are
+  // destroyed before the pools.
+  ShrinkableCacheRegistration source_data_pool_registration_{
+      &source_data_pool_};
+  std::vector<std::unique_ptr<ShrinkableCacheRegistration>>
+      pool_registrations_;
+
+  // The extent writer and hash calculator of the operation whose blob is being
+  // streamed, and the number of bytes of its blob passed to them so far. Only
+  // set while streaming an operation; the extent writer isn't set for the
+  // operations staged in the |staging_fd_|.
+  std::unique_ptr<ExtentWriter> streaming_writer_;
+  std::unique_ptr<HashCalculator> streaming_hasher_;
+  uint64_t streamed_bytes_{0};
+  // Whether the operation being streamed has xz chunks, each written by its
+  // own |streaming_writer_|, which isn't set between two chunks.
+  bool streaming_xz_chunks_{false};
+
+  // The maximum size of the operation blobs buffered in memory, or zero if
+  // unlimited, and the directory of the file the larger diff blobs are staged
+  // in. The file is open from the first staged blob until Close().
+  uint64_t memory_budget_{0};
+  std::string staging_dir_;
+  std::string staging_path_;
+  int staging_fd_{-1};
+
+  // The interval of the checkpoints inside the staged operations, the number
+  // of bytes of the current blob staged at the last one, and whether the saved
+  // progress points into the staging file.
+  uint64_t staged_checkpoint_bytes_{0};
+  uint64_t last_staged_checkpoint_{0};
+  bool staged_progress_saved_{false};
+
+  // The number of async I/O threads, and the async file descriptors of the
+  // current partition using them. Only set while applying a delta payload
+  // inline.
+  size_t num_async_io_threads_{0};
+  std::unique_ptr<AsyncFileDescriptor> async_source_fd_;
+  std::unique_ptr<AsyncFileDescriptor> async_target_fd_;
+
+  // Whether inline target hashing is enabled and its settings, and the hasher
+  // of each target partition. The hashers are only created when the payload is
+  // applied from the start.
+  bool inline_target_hashing_{false};
+  uint64_t inline_max_pending_bytes_{0};
+  size_t inline_num_spot_checks_{0};
+  std::vector<std::shared_ptr<InlineTargetHasher>> target_hashers_;
+
+  // The builders of the hash trees of the target partitions, fed by their
+  // hashers. The trees of the partitions without one are built from the
+  // partition instead.
+  std::vector<std::shared_ptr<HashTreeBuilder>> hash_tree_builders_;
+
+  // Whether the satisfied operations may be skipped, which operations are
+  // skipped, indexed like |next_operation_num_|, and the size of the skipped
+  // blobs, which weren't downloaded.
+  bool skip_satisfied_operations_{false};
+  std::vector<bool> satisfied_operations_;
+  uint64_t skipped_data_bytes_{0};
+
+  // Whether the source verification is deferred, the source partitions passed
+  // to SetSourcePartitionHashes() and whether they were, and the data passed
+  // to Write() while the next operation waits for them.
+  bool defer_source_verification_{false};
+  std::vector<InstallPlan::Partition> source_partitions_;
+  bool source_hashes_set_{false};
+  bool waiting_for_source_hashes_{false};
+  brillo::Blob deferred_data_;
+
+  // Whether the lazy source verification is enabled, and whether it applies
+  // to the current payload.
+  bool lazy_source_verification_{false};
+  bool source_verified_by_operations_{false};
+
+  // The previous partitions still being applied, in order, and the maximum
+  // number of partitions open at the same time.
+  std::deque<FinishingPartition> finishing_partitions_;
+  size_t max_concurrent_partitions_{1};
+
+  // The progress after each scheduled operation not saved yet, in order.
+  std::deque<UpdateCheckpoint> pending_checkpoints_;
+
   // Parsed manifest. Set after enough bytes to parse the manifest were
   // downloaded.
   DeltaArchiveManifest manifest_;
@@ -330,6 +1138,9 @@ class DeltaPerformer : public FileWriter {
   uint64_t manifest_size_{0};
   uint32_t metadata_signature_size_{0};
   uint64_t major_payload_version_{0};
+  // The memory held by the parsed manifest, approximated by its serialized
+  // size as the lite protobuf runtime doesn't measure it.
+  TrackedMemory manifest_memory_{"DeltaPerformer.Manifest"};
 
   // Accumulated number of operations per partition. The i-th element is the
   // sum of the number of operations for all the partitions from 0 to i
@@ -345,6 +1156,14 @@ class DeltaPerformer : public FileWriter {
   // this format instead.
   std::vector<PartitionUpdate> partitions_;
 
+  // The operations segments of the partitions being applied, as received, and
+  // the last one saved with the progress. The segmented partitions only have
+  // their operations while they are applied. Their size is charged to the
+  // |manifest_memory_|.
+  std::vector<std::shared_ptr<const std::string>> operations_segments_;
+  std::shared_ptr<const std::string> saved_operations_segment_;
+  uint64_t loaded_segments_size_{0};
+
   // Index in the list of partitions (|partitions_| member) of the current
   // partition being processed.
   size_t current_partition_{0};
@@ -357,12 +1176,22 @@ class DeltaPerformer : public FileWriter {
   // payload metadata; once that's downloaded and parsed, it stores data for the
   // next update operation.
   brillo::Blob buffer_;
+  TrackedMemory buffer_memory_{"DeltaPerformer.Buffer"};
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
 
   // Last |buffer_offset_| value updated as part of the progress update.
   uint64_t last_updated_buffer_offset_{std::numeric_limits<uint64_t>::max()};
 
+  // The minimum time and payload bytes between two saved checkpoints, and the
+  // time the last one was saved.
+  base::TimeDelta checkpoint_min_time_;
+  uint64_t checkpoint_min_bytes_{0};
+  base::Time last_checkpoint_time_;
+
+  // The time spent applying the operations and saving the checkpoints.
+  OperationStats operation_stats_;
+
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
 
@@ -374,6 +1203,11 @@ class DeltaPerformer : public FileWriter {
   // the metadata and doesn't include the payload signature itself.
   HashCalculator signed_hash_calculator_;
 
+  // Whether the signed hash didn't diverge from the payload hash yet, in which
+  // case only the |payload_hash_calculator_| is updated and the
+  // |signed_hash_calculator_| is forked from it once they diverge.
+  bool signed_hash_shared_{true};
+
   // Signatures message blob extracted directly from the payload.
   brillo::Blob signatures_message_data_;
 
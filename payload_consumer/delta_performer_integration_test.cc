@@ -538,7 +538,8 @@ static void GenerateDeltaFile(bool full_kernel,
             payload_config,
             state->delta_path,
             private_key,
-            &state->metadata_size));
+            &state->metadata_size,
+            nullptr));  // properties
   }
   // Extend the "partitions" holding the file system a bit.
   EXPECT_EQ(0, HANDLE_EINTR(truncate(state->a_img.c_str(),
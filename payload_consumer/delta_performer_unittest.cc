@@ -19,6 +19,8 @@
 #include <endian.h>
 #include <inttypes.h>
 
+#include <algorithm>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -39,10 +41,13 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/mock_download_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -140,6 +145,8 @@ class DeltaPerformerTest : public ::testing::Test {
     PayloadGenerationConfig config;
     config.version.major = major_version;
     config.version.minor = minor_version;
+    config.version.segmented_manifest = segmented_manifest_;
+    config.version.blob_alignment = blob_alignment_;
 
     PayloadFile payload;
     EXPECT_TRUE(payload.Init(config));
@@ -157,11 +164,12 @@ class DeltaPerformerTest : public ::testing::Test {
 
     payload.AddPartition(old_part, new_part, aops);
 
-    // We include a kernel partition without operations.
+    // We include a kernel partition, without operations unless the test set
+    // some.
     old_part.name = kLegacyPartitionNameKernel;
     new_part.name = kLegacyPartitionNameKernel;
     new_part.size = 0;
-    payload.AddPartition(old_part, new_part, {});
+    payload.AddPartition(old_part, new_part, kernel_aops_);
 
     string payload_path;
     EXPECT_TRUE(utils::MakeTempFile("Payload-XXXXXX", &payload_path, nullptr));
@@ -207,12 +215,21 @@ class DeltaPerformerTest : public ::testing::Test {
     fake_boot_control_.SetPartitionDevice(
         kLegacyPartitionNameRoot, install_plan_.source_slot, source_path);
     fake_boot_control_.SetPartitionDevice(
-        kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+        kLegacyPartitionNameKernel, install_plan_.target_slot, kernel_path_);
     fake_boot_control_.SetPartitionDevice(
         kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
 
-    EXPECT_EQ(expect_success,
-              performer_.Write(payload_data.data(), payload_data.size()));
+    // Pass the payload in |payload_write_size_| chunks, if set.
+    size_t write_size = payload_write_size_ ? payload_write_size_
+                                            : payload_data.size();
+    bool write_result = true;
+    for (size_t offset = 0; write_result && offset < payload_data.size();
+         offset += write_size) {
+      write_result = performer_.Write(
+          payload_data.data() + offset,
+          std::min(write_size, payload_data.size() - offset));
+    }
+    EXPECT_EQ(expect_success, write_result);
     EXPECT_EQ(0, performer_.Close());
 
     brillo::Blob partition_data;
@@ -332,6 +349,18 @@ class DeltaPerformerTest : public ::testing::Test {
   FakeBootControl fake_boot_control_;
   FakeHardware fake_hardware_;
   MockDownloadActionDelegate mock_delegate_;
+  // The size of the chunks ApplyPayloadToData() passes the payload in, or 0 to
+  // pass it all at once.
+  size_t payload_write_size_{0};
+  // Whether GeneratePayload() stores the operations in segments.
+  bool segmented_manifest_{false};
+  // The alignment of the large blobs of GeneratePayload(), if not 0.
+  uint32_t blob_alignment_{0};
+  // The operations of the kernel partition of GeneratePayload(), whose blobs
+  // follow the ones of the rootfs operations in the same blob data.
+  vector<AnnotatedOperation> kernel_aops_;
+  // The target kernel partition ApplyPayloadToData() writes to.
+  string kernel_path_{"/dev/null"};
   DeltaPerformer performer_{
       &prefs_, &fake_boot_control_, &fake_hardware_, &mock_delegate_, &install_plan_};
 };
@@ -397,6 +426,146 @@ TEST_F(DeltaPerformerTest, ReplaceOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, SegmentedManifestTest) {
+  brillo::Blob expected_data(2 * 4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 2; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  segmented_manifest_ = true;
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  // The operations segment arrives in several chunks.
+  payload_write_size_ = 7;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, SegmentedManifestPartitionsTest) {
+  // Two rootfs blocks followed by a kernel block.
+  brillo::Blob blob_data(3 * 4096);
+  test_utils::FillWithData(&blob_data);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 3; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block < 2 ? block : 0, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    if (block < 2)
+      aops.push_back(aop);
+    else
+      kernel_aops_.push_back(aop);
+  }
+
+  string kernel_part;
+  EXPECT_TRUE(utils::MakeTempFile("Kernel-XXXXXX", &kernel_part, nullptr));
+  ScopedPathUnlinker kernel_unlinker(kernel_part);
+  kernel_path_ = kernel_part;
+
+  // The kernel blob follows both segments, so its offset is shifted by the
+  // segment of the rootfs too.
+  segmented_manifest_ = true;
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+  payload_write_size_ = 7;
+  EXPECT_EQ(brillo::Blob(blob_data.begin(), blob_data.begin() + 2 * 4096),
+            ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(3U, performer_.next_operation_num_);
+
+  brillo::Blob kernel_data;
+  EXPECT_TRUE(utils::ReadFile(kernel_part, &kernel_data));
+  EXPECT_EQ(brillo::Blob(blob_data.begin() + 2 * 4096, blob_data.end()),
+            kernel_data);
+}
+
+TEST_F(DeltaPerformerTest, SegmentedManifestResumeTest) {
+  brillo::Blob expected_data(2 * 4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 2; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  segmented_manifest_ = true;
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  const size_t data_offset = install_plan_.metadata_size;
+
+  string new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  EXPECT_TRUE(prefs_.SetString(kPrefsUpdateCheckResponseHash, "hash"));
+
+  // Interrupt the update once the first operation of the segment is applied.
+  size_t offset = 0;
+  while (offset < payload_data.size() && performer_.next_operation_num_ < 1) {
+    size_t count = std::min(static_cast<size_t>(100),
+                            payload_data.size() - offset);
+    EXPECT_TRUE(performer_.Write(payload_data.data() + offset, count));
+    offset += count;
+  }
+  EXPECT_EQ(0, performer_.Close());
+  EXPECT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, "hash"));
+
+  // The segment isn't downloaded again, so it must have been saved.
+  int64_t next_operation = -1, next_data_offset = -1;
+  string segment;
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextOperation,
+                              &next_operation));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextDataOffset,
+                              &next_data_offset));
+  EXPECT_TRUE(prefs_.GetString(kPrefsUpdateStateOperationsSegment, &segment));
+  EXPECT_EQ(1, next_operation);
+  EXPECT_FALSE(segment.empty());
+  EXPECT_EQ(static_cast<int64_t>(segment.size() + 4096), next_data_offset);
+
+  // The resumed update only gets the metadata and the blob of the second
+  // operation, and restores the segment from the prefs.
+  DeltaPerformer resumed_performer(&prefs_, &fake_boot_control_,
+                                   &fake_hardware_, &mock_delegate_,
+                                   &install_plan_);
+  EXPECT_TRUE(resumed_performer.Write(payload_data.data(), data_offset));
+  EXPECT_TRUE(resumed_performer.Write(
+      payload_data.data() + data_offset + next_data_offset,
+      payload_data.size() - data_offset - next_data_offset));
+  EXPECT_EQ(2U, resumed_performer.next_operation_num_);
+  EXPECT_EQ(0, resumed_performer.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, SegmentedManifestHashMismatchTest) {
+  brillo::Blob expected_data(4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  segmented_manifest_ = true;
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  // The segment of the first partition follows the unsigned metadata.
+  payload_data[install_plan_.metadata_size] ^= 1;
+  ApplyPayload(payload_data, "/dev/null", false);
+}
+
 TEST_F(DeltaPerformerTest, ReplaceBzOperationTest) {
   brillo::Blob expected_data = brillo::Blob(std::begin(kRandomString),
                                             std::end(kRandomString));
@@ -437,6 +606,601 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, AlignedBlobsTest) {
+  // The REPLACE blob after the small xz one starts at the next block of the
+  // payload file.
+  brillo::Blob blob_data(std::begin(kXzCompressedData),
+                         std::end(kXzCompressedData));
+  brillo::Blob replace_data(4096);
+  test_utils::FillWithData(&replace_data);
+  blob_data.insert(blob_data.end(), replace_data.begin(), replace_data.end());
+  brillo::Blob expected_data(4096, 0);
+  expected_data[0] = 'a';
+  expected_data.insert(
+      expected_data.end(), replace_data.begin(), replace_data.end());
+
+  vector<AnnotatedOperation> aops(2);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 1);
+  aops[0].op.set_data_offset(0);
+  aops[0].op.set_data_length(sizeof(kXzCompressedData));
+  aops[0].op.set_type(InstallOperation::REPLACE_XZ);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(1, 1);
+  aops[1].op.set_data_offset(sizeof(kXzCompressedData));
+  aops[1].op.set_data_length(replace_data.size());
+  aops[1].op.set_type(InstallOperation::REPLACE);
+
+  blob_alignment_ = 4096;
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+  const uint64_t data_offset = install_plan_.metadata_size;
+  EXPECT_EQ(0U, data_offset % 4096);
+  ASSERT_LE(data_offset + 2 * 4096, payload_data.size());
+  EXPECT_EQ(replace_data,
+            brillo::Blob(payload_data.begin() + data_offset + 4096,
+                         payload_data.begin() + data_offset + 2 * 4096));
+
+  // The padding arrives in several chunks.
+  payload_write_size_ = 1000;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationTest) {
+  // Random data doesn't compress, so the blob is large enough to be applied
+  // while it is being downloaded.
+  brillo::Blob expected_data(512 * 1024);
+  srand(1234);
+  for (uint8_t& byte : expected_data)
+    byte = rand() % 256;
+  brillo::Blob bz_data;
+  EXPECT_TRUE(BzipCompress(expected_data, &bz_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(bz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_BZ);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(bz_data, aops, false);
+
+  payload_write_size_ = 10000;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationHashTest) {
+  brillo::Blob expected_data(512 * 1024);
+  srand(1234);
+  for (uint8_t& byte : expected_data)
+    byte = rand() % 256;
+  brillo::Blob bz_data;
+  EXPECT_TRUE(BzipCompress(expected_data, &bz_data));
+  brillo::Blob op_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(bz_data, &op_hash));
+
+  const brillo::Blob original_data(expected_data.size(), 'x');
+  string target_path;
+  EXPECT_TRUE(utils::MakeTempFile("Target-XXXXXX", &target_path, nullptr));
+  ScopedPathUnlinker target_unlinker(target_path);
+  EXPECT_TRUE(utils::WriteFile(target_path.c_str(), original_data.data(),
+                               original_data.size()));
+  string staging_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("Staging-XXXXXX", &staging_dir));
+  ScopedDirRemover staging_remover(staging_dir);
+
+  InstallOperation op;
+  *(op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  op.set_data_offset(0);
+  op.set_data_length(bz_data.size());
+  op.set_type(InstallOperation::REPLACE_BZ);
+
+  install_plan_.hash_checks_mandatory = true;
+  install_plan_.metadata_signature = "signature";
+  performer_.block_size_ = 4096;
+  performer_.target_fd_.reset(new EintrSafeFileDescriptor);
+  EXPECT_TRUE(performer_.target_fd_->Open(target_path.c_str(), O_RDWR));
+  performer_.set_memory_budget(0, staging_dir);
+
+  // A tampered blob is rejected before any of it reaches the target.
+  brillo::Blob bad_hash = op_hash;
+  bad_hash[0] ^= 0xff;
+  op.set_data_sha256_hash(bad_hash.data(), bad_hash.size());
+  const char* bytes = reinterpret_cast<const char*>(bz_data.data());
+  size_t count = bz_data.size();
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_FALSE(performer_.StreamOperationData(op, &bytes, &count, &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationHashMismatch, error);
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(target_path, &partition_data));
+  EXPECT_EQ(original_data, partition_data);
+
+  // The staged blob is applied once its hash is validated.
+  op.set_data_sha256_hash(op_hash.data(), op_hash.size());
+  bytes = reinterpret_cast<const char*>(bz_data.data());
+  count = bz_data.size();
+  EXPECT_TRUE(performer_.StreamOperationData(op, &bytes, &count, &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(0U, count);
+  EXPECT_TRUE(utils::ReadFile(target_path, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+
+  performer_.CloseStagingFile();
+  EXPECT_TRUE(performer_.target_fd_->Close());
+  performer_.target_fd_.reset();
+}
+
+TEST_F(DeltaPerformerTest, MemoryBudgetReplaceTest) {
+  brillo::Blob expected_data;
+  for (char c = 'a'; c < 'e'; c++)
+    expected_data.insert(expected_data.end(), 4096, c);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 4);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, false);
+
+  // The blob is larger than the budget, so it's written as it arrives.
+  performer_.set_memory_budget(4096, "");
+  payload_write_size_ = 1000;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+}
+
+TEST_F(DeltaPerformerTest, MemoryBudgetSourceBsdiffTest) {
+  brillo::Blob source_data(4 * 4096);
+  srand(4321);
+  for (uint8_t& byte : source_data)
+    byte = rand() % 256;
+  brillo::Blob expected_data = source_data;
+  for (size_t i = 0; i < expected_data.size(); i += 1000)
+    expected_data[i] ^= 0xff;
+
+  string source_path, target_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker source_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  EXPECT_TRUE(utils::MakeTempFile("Target-XXXXXX", &target_path, nullptr));
+  ScopedPathUnlinker target_unlinker(target_path);
+  EXPECT_TRUE(utils::WriteFile(target_path.c_str(), expected_data.data(),
+                               expected_data.size()));
+  brillo::Blob patch;
+  EXPECT_TRUE(
+      diff_utils::DiffFiles("bsdiff", source_path, target_path, &patch));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 4);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 4);
+  aop.op.set_src_length(source_data.size());
+  aop.op.set_dst_length(expected_data.size());
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(patch.size());
+  aop.op.set_type(InstallOperation::SOURCE_BSDIFF);
+  brillo::Blob payload_data = GeneratePayload(patch, {aop}, false);
+
+  // The patch is staged in a file in the |staging_dir|, removed once done.
+  string staging_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("Staging-XXXXXX", &staging_dir));
+  ScopedDirRemover staging_remover(staging_dir);
+  performer_.set_memory_budget(16, staging_dir);
+  payload_write_size_ = 50;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+  EXPECT_TRUE(base::IsDirectoryEmpty(base::FilePath(staging_dir)));
+}
+
+TEST_F(DeltaPerformerTest, StagedOperationResumeTest) {
+  brillo::Blob source_data(4 * 4096);
+  srand(1234);
+  for (uint8_t& byte : source_data)
+    byte = rand() % 256;
+  brillo::Blob expected_data = source_data;
+  for (size_t i = 0; i < expected_data.size(); i += 100)
+    expected_data[i] ^= 0xff;
+
+  string source_path, target_path, new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker source_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  EXPECT_TRUE(utils::MakeTempFile("Target-XXXXXX", &target_path, nullptr));
+  ScopedPathUnlinker target_unlinker(target_path);
+  EXPECT_TRUE(utils::WriteFile(target_path.c_str(), expected_data.data(),
+                               expected_data.size()));
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  brillo::Blob patch;
+  EXPECT_TRUE(
+      diff_utils::DiffFiles("bsdiff", source_path, target_path, &patch));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 4);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 4);
+  aop.op.set_src_length(source_data.size());
+  aop.op.set_dst_length(expected_data.size());
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(patch.size());
+  aop.op.set_type(InstallOperation::SOURCE_BSDIFF);
+  brillo::Blob payload_data = GeneratePayload(patch, {aop}, false);
+  const size_t data_offset = install_plan_.metadata_size;
+
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.source_slot, source_path);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+  EXPECT_TRUE(prefs_.SetString(kPrefsUpdateCheckResponseHash, "hash"));
+
+  // Interrupt the update in the middle of the staged blob.
+  string staging_dir;
+  EXPECT_TRUE(utils::MakeTempDirectory("Staging-XXXXXX", &staging_dir));
+  ScopedDirRemover staging_remover(staging_dir);
+  performer_.set_memory_budget(16, staging_dir);
+  performer_.set_staged_checkpoint_bytes(16);
+  const size_t interrupted_size = data_offset + patch.size() / 2;
+  for (size_t offset = 0; offset < interrupted_size; offset += 50) {
+    EXPECT_TRUE(performer_.Write(payload_data.data() + offset,
+                                 std::min(static_cast<size_t>(50),
+                                          interrupted_size - offset)));
+  }
+  EXPECT_EQ(0, performer_.Close());
+  EXPECT_FALSE(base::IsDirectoryEmpty(base::FilePath(staging_dir)));
+  EXPECT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, "hash"));
+
+  int64_t next_operation = -1, next_data_offset = -1, staged_bytes = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextOperation,
+                              &next_operation));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextDataOffset,
+                              &next_data_offset));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateStagedDataLength,
+                              &staged_bytes));
+  EXPECT_EQ(0, next_operation);
+  EXPECT_GT(staged_bytes, 0);
+  EXPECT_EQ(staged_bytes, next_data_offset);
+
+  // The resumed update only gets the metadata and the rest of the blob.
+  DeltaPerformer resumed_performer(&prefs_, &fake_boot_control_,
+                                   &fake_hardware_, &mock_delegate_,
+                                   &install_plan_);
+  resumed_performer.set_memory_budget(16, staging_dir);
+  resumed_performer.set_staged_checkpoint_bytes(16);
+  EXPECT_TRUE(resumed_performer.Write(payload_data.data(), data_offset));
+  EXPECT_TRUE(resumed_performer.Write(
+      payload_data.data() + data_offset + next_data_offset,
+      payload_data.size() - data_offset - next_data_offset));
+  EXPECT_EQ(1U, resumed_performer.next_operation_num_);
+  EXPECT_EQ(0, resumed_performer.Close());
+  EXPECT_TRUE(base::IsDirectoryEmpty(base::FilePath(staging_dir)));
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, XzChunksOperationTest) {
+  // Each chunk holds a single "a", padded with zeros to its block.
+  brillo::Blob chunk_data(std::begin(kXzCompressedData),
+                          std::end(kXzCompressedData));
+  brillo::Blob xz_data = chunk_data;
+  xz_data.insert(xz_data.end(), chunk_data.begin(), chunk_data.end());
+  brillo::Blob expected_data(3 * 4096, 0);
+  expected_data[0] = 'a';
+  expected_data[2 * 4096] = 'a';
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(2, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  aop.op.set_xz_chunk_blocks(1);
+  aop.op.add_xz_chunk_sizes(chunk_data.size());
+  aop.op.add_xz_chunk_sizes(chunk_data.size());
+  brillo::Blob payload_data = GeneratePayload(xz_data, {aop}, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, "/dev/null",
+                               brillo::Blob(3 * 4096, 0), true));
+}
+
+TEST_F(DeltaPerformerTest, XzChunksWithWorkerThreadsTest) {
+  brillo::Blob chunk_data(std::begin(kXzCompressedData),
+                          std::end(kXzCompressedData));
+  brillo::Blob xz_data;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 4);
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  aop.op.set_xz_chunk_blocks(1);
+  for (int i = 0; i < 4; i++) {
+    xz_data.insert(xz_data.end(), chunk_data.begin(), chunk_data.end());
+    aop.op.add_xz_chunk_sizes(chunk_data.size());
+  }
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  brillo::Blob payload_data = GeneratePayload(xz_data, {aop}, false);
+  brillo::Blob expected_data(4 * 4096, 0);
+  for (int i = 0; i < 4; i++)
+    expected_data[i * 4096] = 'a';
+
+  performer_.set_num_worker_threads(3);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+}
+
+TEST_F(DeltaPerformerTest, InvalidXzChunksTest) {
+  brillo::Blob xz_data(std::begin(kXzCompressedData),
+                       std::end(kXzCompressedData));
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 2);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  // The single chunk only covers one of the two blocks.
+  aop.op.set_xz_chunk_blocks(1);
+  aop.op.add_xz_chunk_sizes(xz_data.size());
+  brillo::Blob payload_data = GeneratePayload(xz_data, {aop}, false);
+
+  ApplyPayload(payload_data, "/dev/null", false);
+}
+
+TEST_F(DeltaPerformerTest, XzChunksResumeTest) {
+  // Random data doesn't compress, so the blob is large enough to be applied
+  // while it is being downloaded.
+  const size_t kChunkBlocks = 16;
+  brillo::Blob expected_data(3 * kChunkBlocks * 4096);
+  srand(1234);
+  for (uint8_t& byte : expected_data)
+    byte = rand() % 256;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 3 * kChunkBlocks);
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  aop.op.set_xz_chunk_blocks(kChunkBlocks);
+  brillo::Blob xz_data;
+  for (size_t offset = 0; offset < expected_data.size();
+       offset += kChunkBlocks * 4096) {
+    brillo::Blob chunk(expected_data.begin() + offset,
+                       expected_data.begin() + offset + kChunkBlocks * 4096);
+    brillo::Blob chunk_xz;
+    EXPECT_TRUE(XzCompress(chunk, &chunk_xz));
+    xz_data.insert(xz_data.end(), chunk_xz.begin(), chunk_xz.end());
+    aop.op.add_xz_chunk_sizes(chunk_xz.size());
+  }
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  brillo::Blob payload_data = GeneratePayload(xz_data, {aop}, false);
+  const size_t data_offset = install_plan_.metadata_size;
+
+  string new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  EXPECT_TRUE(prefs_.SetString(kPrefsUpdateCheckResponseHash, "hash"));
+
+  // Interrupt the update in the middle of the third chunk.
+  const uint64_t finished_chunks_size =
+      aop.op.xz_chunk_sizes(0) + aop.op.xz_chunk_sizes(1);
+  const size_t interrupted_size =
+      data_offset + finished_chunks_size + aop.op.xz_chunk_sizes(2) / 2;
+  performer_.set_staged_checkpoint_bytes(1);
+  for (size_t offset = 0; offset < interrupted_size; offset += 10000) {
+    EXPECT_TRUE(performer_.Write(payload_data.data() + offset,
+                                 std::min(static_cast<size_t>(10000),
+                                          interrupted_size - offset)));
+  }
+  EXPECT_EQ(0, performer_.Close());
+  EXPECT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, "hash"));
+
+  int64_t next_operation = -1, next_data_offset = -1, staged_bytes = 0;
+  string staged_path = "unset";
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextOperation,
+                              &next_operation));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextDataOffset,
+                              &next_data_offset));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateStagedDataLength,
+                              &staged_bytes));
+  EXPECT_TRUE(prefs_.GetString(kPrefsUpdateStateStagedPath, &staged_path));
+  EXPECT_EQ(0, next_operation);
+  EXPECT_EQ(static_cast<int64_t>(finished_chunks_size), staged_bytes);
+  EXPECT_EQ(staged_bytes, next_data_offset);
+  EXPECT_EQ("", staged_path);
+
+  // The resumed update only gets the metadata and the last chunk.
+  DeltaPerformer resumed_performer(&prefs_, &fake_boot_control_,
+                                   &fake_hardware_, &mock_delegate_,
+                                   &install_plan_);
+  resumed_performer.set_staged_checkpoint_bytes(1);
+  EXPECT_TRUE(resumed_performer.Write(payload_data.data(), data_offset));
+  EXPECT_TRUE(resumed_performer.Write(
+      payload_data.data() + data_offset + next_data_offset,
+      payload_data.size() - data_offset - next_data_offset));
+  EXPECT_EQ(1U, resumed_performer.next_operation_num_);
+  EXPECT_EQ(0, resumed_performer.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, ReplaceOperationsWithWorkerThreadsTest) {
+  // Each operation replaces a block with the next block of the blob, and the
+  // last one overwrites the first block again.
+  const size_t kNumBlocks = 8;
+  brillo::Blob blob_data;
+  for (size_t i = 0; i <= kNumBlocks; i++)
+    blob_data.insert(blob_data.end(), 4096, 'a' + i);
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i <= kNumBlocks; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i % kNumBlocks, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob expected_data(blob_data.begin() + kNumBlocks * 4096,
+                             blob_data.end());
+  expected_data.insert(expected_data.end(), blob_data.begin() + 4096,
+                       blob_data.begin() + kNumBlocks * 4096);
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  performer_.set_num_worker_threads(3);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, InlineTargetHashingTest) {
+  // The new rootfs in the generated payload is all zeros.
+  brillo::Blob expected_data(4096, 0);
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  performer_.set_inline_target_hashing(true, 0, 1);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  ASSERT_EQ(2U, install_plan_.partitions.size());
+  EXPECT_TRUE(install_plan_.partitions[0].target_hash_verified);
+  // The kernel partition has no operations, so it's never opened.
+  EXPECT_FALSE(install_plan_.partitions[1].target_hash_verified);
+}
+
+TEST_F(DeltaPerformerTest, InlineTargetHashingRewriteTest) {
+  // The second operation writes the first block again, so the rootfs can't be
+  // hashed inline.
+  brillo::Blob expected_data(4096, 0);
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < 2; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+    aop.op.set_data_offset(0);
+    aop.op.set_data_length(expected_data.size());
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  performer_.set_inline_target_hashing(true, 0, 1);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  ASSERT_EQ(2U, install_plan_.partitions.size());
+  EXPECT_FALSE(install_plan_.partitions[0].target_hash_verified);
+}
+
+TEST_F(DeltaPerformerTest, CheckpointIntervalTest) {
+  performer_.num_total_operations_ = 10;
+  performer_.next_operation_num_ = 1;
+  // By default, the progress is saved after every operation.
+  EXPECT_TRUE(performer_.IsCheckpointDue(0));
+
+  performer_.set_checkpoint_interval(base::TimeDelta::FromHours(1), 1000);
+  performer_.last_checkpoint_time_ = base::Time::Now();
+  performer_.last_updated_buffer_offset_ = 100;
+  EXPECT_FALSE(performer_.IsCheckpointDue(500));
+  EXPECT_TRUE(performer_.IsCheckpointDue(1100));
+
+  // The progress after the last operation is always saved.
+  performer_.next_operation_num_ = 10;
+  EXPECT_TRUE(performer_.IsCheckpointDue(500));
+}
+
+TEST_F(DeltaPerformerTest, SharedSignedHashTest) {
+  const string kSignedData = "signed data";
+  const string kSignature = "signature";
+  performer_.buffer_.assign(kSignedData.begin(), kSignedData.end());
+  performer_.DiscardBuffer(true, performer_.buffer_.size());
+  // The signed hash context isn't saved while it's the same as the payload
+  // hash context.
+  EXPECT_TRUE(performer_.signed_hash_shared_);
+  DeltaPerformer::UpdateCheckpoint checkpoint = performer_.MakeCheckpoint();
+  EXPECT_FALSE(checkpoint.payload_hash_context.empty());
+  EXPECT_TRUE(checkpoint.signed_hash_context.empty());
+
+  performer_.buffer_.assign(kSignature.begin(), kSignature.end());
+  performer_.DiscardBuffer(true, 0);
+  EXPECT_FALSE(performer_.signed_hash_shared_);
+  checkpoint = performer_.MakeCheckpoint();
+  EXPECT_FALSE(checkpoint.signed_hash_context.empty());
+
+  performer_.Close();
+  EXPECT_EQ(HashCalculator::HashOfString(kSignedData + kSignature),
+            performer_.payload_hash_calculator_.hash());
+  EXPECT_EQ(HashCalculator::HashOfString(kSignedData),
+            performer_.signed_hash_calculator_.hash());
+}
+
+TEST_F(DeltaPerformerTest, SatisfiedOperationsTest) {
+  const size_t kBlockSize = 4096;
+  // The target partition already has the first two blocks, but not the last.
+  brillo::Blob expected_data(3 * kBlockSize);
+  test_utils::FillWithData(&expected_data);
+  brillo::Blob target_data(expected_data.begin(),
+                           expected_data.begin() + 2 * kBlockSize);
+  target_data.resize(expected_data.size(), 0);
+  string target_path;
+  EXPECT_TRUE(utils::MakeTempFile("Target-XXXXXX", &target_path, nullptr));
+  ScopedPathUnlinker target_unlinker(target_path);
+  EXPECT_TRUE(utils::WriteFile(target_path.c_str(), target_data.data(),
+                               target_data.size()));
+
+  InstallPlan::Partition install_part;
+  install_part.target_path = target_path;
+  install_part.target_size = expected_data.size();
+  install_part.target_hash_chunk_size = kBlockSize;
+  for (size_t i = 0; i < 3; i++) {
+    brillo::Blob chunk_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        expected_data.data() + i * kBlockSize, kBlockSize, &chunk_hash));
+    install_part.target_chunk_hashes.push_back(chunk_hash);
+  }
+  install_plan_.partitions = {install_part};
+  install_plan_.hash_checks_mandatory = true;
+
+  // One 100 bytes REPLACE operation per block, followed by the signature.
+  PartitionUpdate partition;
+  for (size_t i = 0; i < 3; i++) {
+    InstallOperation* op = partition.add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    op->set_data_offset(i * 100);
+    op->set_data_length(100);
+    *(op->add_dst_extents()) = ExtentForRange(i, 1);
+  }
+  performer_.partitions_ = {partition};
+  performer_.num_total_operations_ = 3;
+  performer_.acc_num_operations_ = {3};
+  performer_.block_size_ = kBlockSize;
+  performer_.major_payload_version_ = kBrilloMajorPayloadVersion;
+  performer_.manifest_.set_minor_version(kSourceMinorPayloadVersion);
+  performer_.manifest_.set_signatures_offset(300);
+  performer_.manifest_.set_signatures_size(50);
+  performer_.metadata_size_ = 20;
+  performer_.metadata_signature_size_ = 10;
+
+  EXPECT_TRUE(performer_.FindSatisfiedOperations());
+  EXPECT_EQ(vector<bool>({true, true, false}),
+            performer_.satisfied_operations_);
+  // Only the blob of the last operation and the signature are needed.
+  EXPECT_EQ((vector<std::pair<uint64_t, uint64_t>>{{230, 150}}),
+            performer_.GetRequiredPayloadRanges());
+
+  // The operations aren't skipped without mandatory hash checks.
+  install_plan_.hash_checks_mandatory = false;
+  EXPECT_FALSE(performer_.FindSatisfiedOperations());
+  EXPECT_EQ((vector<std::pair<uint64_t, uint64_t>>{{30, 350}}),
+            performer_.GetRequiredPayloadRanges());
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -459,6 +1223,40 @@ TEST_F(DeltaPerformerTest, ZeroOperationTest) {
             ApplyPayloadToData(payload_data, "/dev/null", existing_data, true));
 }
 
+TEST_F(DeltaPerformerTest, MoveOperationOverlapTest) {
+  // Block i of the partition is filled with the value i.
+  brillo::Blob existing_data;
+  for (uint8_t i = 0; i < 10; i++)
+    existing_data.insert(existing_data.end(), 4096, i);
+  const vector<uint8_t> expected_blocks = {0, 1, 0, 1, 2, 3, 4, 5, 9, 8};
+  brillo::Blob expected_data;
+  for (uint8_t block : expected_blocks)
+    expected_data.insert(expected_data.end(), 4096, block);
+
+  // Blocks 0 to 5 are shifted by two blocks, in two chunks that need to be
+  // moved from the last one to the first one.
+  AnnotatedOperation shift;
+  *(shift.op.add_src_extents()) = ExtentForRange(0, 3);
+  *(shift.op.add_src_extents()) = ExtentForRange(3, 3);
+  *(shift.op.add_dst_extents()) = ExtentForRange(2, 6);
+  shift.op.set_type(InstallOperation::MOVE);
+
+  // Blocks 8 and 9 are swapped, which can't be done one chunk at a time.
+  AnnotatedOperation swap;
+  *(swap.op.add_src_extents()) = ExtentForRange(8, 1);
+  *(swap.op.add_src_extents()) = ExtentForRange(9, 1);
+  *(swap.op.add_dst_extents()) = ExtentForRange(9, 1);
+  *(swap.op.add_dst_extents()) = ExtentForRange(8, 1);
+  swap.op.set_type(InstallOperation::MOVE);
+
+  brillo::Blob payload_data = GeneratePayload(
+      brillo::Blob(), {shift, swap}, false, kChromeOSMajorPayloadVersion,
+      kInPlaceMinorPayloadVersion);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, "/dev/null", existing_data, true));
+}
+
 TEST_F(DeltaPerformerTest, SourceCopyOperationTest) {
   brillo::Blob expected_data(std::begin(kRandomString),
                              std::end(kRandomString));
@@ -484,6 +1282,523 @@ TEST_F(DeltaPerformerTest, SourceCopyOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
 }
 
+TEST_F(DeltaPerformerTest, SourceCacheTest) {
+  brillo::Blob source_data(std::begin(kRandomString), std::end(kRandomString));
+  source_data.resize(2 * 4096);
+  brillo::Blob expected_data = source_data;
+  expected_data.insert(expected_data.end(), source_data.begin(),
+                       source_data.begin() + 4096);
+
+  // Both operations read the first source block, the second one from the
+  // cache.
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 2);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 2);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(source_data, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  aops.push_back(aop);
+  aop.op.clear_src_extents();
+  aop.op.clear_dst_extents();
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(2, 1);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(
+      brillo::Blob(source_data.begin(), source_data.begin() + 4096),
+      &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), aops, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+
+  performer_.set_source_cache_bytes(4 * 4096);
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, source_path,
+                               brillo::Blob(3 * 4096, 0), true));
+}
+
+TEST_F(DeltaPerformerTest, CompareBeforeWriteTest) {
+  brillo::Blob source_data(std::begin(kRandomString), std::end(kRandomString));
+  source_data.resize(3 * 4096);
+  brillo::Blob replace_data(4096, 'r');
+
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 2);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 2);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  aops.push_back(aop);
+  aop.op.clear_src_extents();
+  aop.op.clear_dst_extents();
+  *(aop.op.add_dst_extents()) = ExtentForRange(2, 1);
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(replace_data.size());
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(replace_data, aops, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+
+  // A previous attempt wrote the first and the last block already.
+  brillo::Blob expected_data(source_data.begin(), source_data.begin() + 8192);
+  expected_data.insert(expected_data.end(), replace_data.begin(),
+                       replace_data.end());
+  brillo::Blob target_data = expected_data;
+  std::fill(target_data.begin() + 4096, target_data.begin() + 8192, 0);
+
+  performer_.set_compare_before_write(true);
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, source_path, target_data, true));
+  EXPECT_EQ(2U * 4096, performer_.unchanged_bytes());
+}
+
+TEST_F(DeltaPerformerTest, SourcePrefetchTest) {
+  brillo::Blob source_data;
+  for (uint8_t i = 0; i < 4; i++)
+    source_data.insert(source_data.end(), 4096, 'a' + i);
+  // The blocks are copied in reverse order, one per operation.
+  brillo::Blob expected_data;
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 4; block++) {
+    expected_data.insert(expected_data.end(), 4096, 'd' - block);
+    AnnotatedOperation aop;
+    *(aop.op.add_src_extents()) = ExtentForRange(3 - block, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), aops, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+
+  performer_.set_source_prefetch(2, 4096);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
+}
+
+TEST_F(DeltaPerformerTest, MetadataOnlyTest) {
+  brillo::Blob expected_data(std::begin(kRandomString),
+                             std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  // The partitions are filled from the manifest, but nothing is written nor
+  // saved in the prefs.
+  performer_.set_metadata_only(true);
+  EXPECT_EQ(brillo::Blob(), ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_TRUE(performer_.IsManifestValid());
+  ASSERT_EQ(2U, install_plan_.partitions.size());
+  EXPECT_EQ(kLegacyPartitionNameRoot, install_plan_.partitions[0].name);
+  EXPECT_EQ(1234U, install_plan_.partitions[0].target_size);
+  EXPECT_FALSE(prefs_.Exists(kPrefsManifestMetadataSize));
+}
+
+TEST_F(DeltaPerformerTest, PartitionClaimsTest) {
+  brillo::Blob expected_data(4096, 'c');
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  // The kernel partition is already updated by another payload.
+  std::map<string, size_t> claims = {{kLegacyPartitionNameKernel, 1}};
+  performer_.set_partition_claims(&claims, 2);
+  performer_.set_metadata_only(true);
+  ApplyPayload(payload_data, "/dev/null", false);
+  EXPECT_EQ(2U, claims[kLegacyPartitionNameRoot]);
+  EXPECT_EQ(1U, claims[kLegacyPartitionNameKernel]);
+}
+
+TEST_F(DeltaPerformerTest, ChainedPayloadOnTargetSlotTest) {
+  brillo::Blob source_data(std::begin(kRandomString), std::end(kRandomString));
+  source_data.resize(3 * 4096);
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  // A chained payload is applied on the partitions it updates.
+  install_plan_.source_slot = install_plan_.target_slot;
+
+  // The second operation reads the block written by the first one.
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  aops.push_back(aop);
+  aop.op.clear_src_extents();
+  aop.op.clear_dst_extents();
+  *(aop.op.add_src_extents()) = ExtentForRange(1, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(2, 1);
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), aops, false);
+  ApplyPayload(payload_data, source_path, false);
+}
+
+TEST_F(DeltaPerformerTest, ChainedPayloadOverwrittenSourceTest) {
+  brillo::Blob source_data(2 * 4096);
+  test_utils::FillWithData(&source_data);
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  install_plan_.source_slot = install_plan_.target_slot;
+
+  // The REPLACE overwrites the block the SOURCE_COPY before it reads, which
+  // only works if the copy is done first.
+  brillo::Blob replace_data(std::begin(kRandomString), std::end(kRandomString));
+  replace_data.resize(4096);
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  aops.push_back(aop);
+  aop.op.Clear();
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(replace_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(replace_data, aops, false);
+
+  // The worker threads and the async I/O would let the REPLACE run first.
+  performer_.set_num_worker_threads(3);
+  performer_.set_num_async_io_threads(2);
+  ApplyPayload(payload_data, source_path, true);
+
+  brillo::Blob expected_data = replace_data;
+  expected_data.insert(expected_data.end(), source_data.begin(),
+                       source_data.begin() + 4096);
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(source_path, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, ChainedPayloadIdentityCopyTest) {
+  brillo::Blob source_data(std::begin(kRandomString), std::end(kRandomString));
+  source_data.resize(2 * 4096);
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  install_plan_.source_slot = install_plan_.target_slot;
+
+  // Copying the blocks over themselves doesn't change what is read later.
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 2);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 2);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), aops, false);
+  ApplyPayload(payload_data, source_path, true);
+}
+
+TEST_F(DeltaPerformerTest, DuplicatedReplaceBlobTest) {
+  brillo::Blob block(std::begin(kRandomString), std::end(kRandomString));
+  block.resize(4096);  // block size
+  brillo::Blob blob_data = block;
+  blob_data.insert(blob_data.end(), block.begin(), block.end());
+
+  // Two operations write the same block, once it is copied from the other.
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(block.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+  aop.op.clear_dst_extents();
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(block.size());
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+  brillo::Blob dup_payload_data = GeneratePayload(
+      blob_data, aops, false, DeltaPerformer::kSupportedMajorPayloadVersion,
+      kImgdiffMinorPayloadVersion);
+  // The second copy of the blob is not in the payload.
+  EXPECT_LE(payload_data.size() + block.size(), dup_payload_data.size());
+
+  EXPECT_EQ(blob_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, DeferredSourceVerificationTest) {
+  brillo::Blob source_data(std::begin(kRandomString),
+                           std::end(kRandomString));
+  source_data.resize(4096);  // block size
+  brillo::Blob replace_data(4096, 'r');
+  AnnotatedOperation replace_aop;
+  *(replace_aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  replace_aop.op.set_data_offset(0);
+  replace_aop.op.set_data_length(replace_data.size());
+  replace_aop.op.set_type(InstallOperation::REPLACE);
+  AnnotatedOperation copy_aop;
+  *(copy_aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(copy_aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  copy_aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(source_data, &src_hash));
+  copy_aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  brillo::Blob payload_data =
+      GeneratePayload(replace_data, {replace_aop, copy_aop}, false);
+
+  string source_path, new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker source_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.source_slot, source_path);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+  // The REPLACE operation is applied, but the SOURCE_COPY one waits for the
+  // source partitions to be verified.
+  performer_.set_defer_source_verification(true);
+  EXPECT_TRUE(performer_.Write(payload_data.data(), payload_data.size()));
+  EXPECT_TRUE(performer_.IsWaitingForSourceHashes());
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+
+  vector<InstallPlan::Partition> source_partitions(2);
+  source_partitions[0].name = kLegacyPartitionNameRoot;
+  source_partitions[1].name = kLegacyPartitionNameKernel;
+  for (InstallPlan::Partition& partition : source_partitions) {
+    EXPECT_TRUE(HashCalculator::RawHashOfData(brillo::Blob(),
+                                              &partition.source_hash));
+  }
+  ErrorCode error;
+  EXPECT_FALSE(performer_.SetSourcePartitionHashes(
+      vector<InstallPlan::Partition>(1, source_partitions[0]), &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  EXPECT_TRUE(performer_.SetSourcePartitionHashes(source_partitions, &error));
+  EXPECT_FALSE(performer_.IsWaitingForSourceHashes());
+  EXPECT_EQ(2U, performer_.next_operation_num_);
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob expected_data = source_data;
+  expected_data.insert(expected_data.end(), replace_data.begin(),
+                       replace_data.end());
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, LazySourceVerificationTest) {
+  brillo::Blob source_data(std::begin(kRandomString),
+                           std::end(kRandomString));
+  source_data.resize(4096);  // block size
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(source_data, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), {aop}, false);
+
+  string source_path, new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker source_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.source_slot, source_path);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+  // The SOURCE_COPY operation validates its source data, so it doesn't wait
+  // for the source partitions to be verified.
+  performer_.set_defer_source_verification(true);
+  performer_.set_lazy_source_verification(true);
+  EXPECT_TRUE(performer_.Write(payload_data.data(), payload_data.size()));
+  EXPECT_TRUE(performer_.source_verified_by_operations());
+  EXPECT_FALSE(performer_.IsWaitingForSourceHashes());
+  EXPECT_EQ(1U, performer_.next_operation_num_);
+  // The hashes passed later are ignored.
+  ErrorCode error;
+  EXPECT_TRUE(performer_.SetSourcePartitionHashes(
+      vector<InstallPlan::Partition>(1), &error));
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(source_data, partition_data);
+
+  // Without the source hash, the operation waits as usual.
+  aop.op.clear_src_sha256_hash();
+  payload_data = GeneratePayload(brillo::Blob(), {aop}, false);
+  DeltaPerformer other_performer(&prefs_, &fake_boot_control_,
+                                 &fake_hardware_, &mock_delegate_,
+                                 &install_plan_);
+  other_performer.set_defer_source_verification(true);
+  other_performer.set_lazy_source_verification(true);
+  EXPECT_TRUE(other_performer.Write(payload_data.data(), payload_data.size()));
+  EXPECT_FALSE(other_performer.source_verified_by_operations());
+  EXPECT_TRUE(other_performer.IsWaitingForSourceHashes());
+  other_performer.Close();
+}
+
+TEST_F(DeltaPerformerTest, LazySourceVerificationDedupMoveTest) {
+  brillo::Blob block(std::begin(kRandomString), std::end(kRandomString));
+  block.resize(4096);  // block size
+  brillo::Blob blob_data = block;
+  blob_data.insert(blob_data.end(), block.begin(), block.end());
+
+  // The second operation becomes a MOVE of the block the first one wrote.
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(block.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+  aop.op.clear_dst_extents();
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(block.size());
+  aops.push_back(aop);
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  string new_part;
+  EXPECT_TRUE(utils::MakeTempFile("Partition-XXXXXX", &new_part, nullptr));
+  ScopedPathUnlinker partition_unlinker(new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.target_slot, new_part);
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan_.source_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+  // The MOVE reads the target partition, so no operation needs the source
+  // partitions to be verified.
+  performer_.set_defer_source_verification(true);
+  performer_.set_lazy_source_verification(true);
+  EXPECT_TRUE(performer_.Write(payload_data.data(), payload_data.size()));
+  EXPECT_TRUE(performer_.source_verified_by_operations());
+  EXPECT_FALSE(performer_.IsWaitingForSourceHashes());
+  EXPECT_EQ(2U, performer_.next_operation_num_);
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part, &partition_data));
+  EXPECT_EQ(blob_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, SourceCopyMismatchedExtentsTest) {
+  // Source blocks 2, 0 and 1 are copied to target blocks 1, 2 and 0, so the
+  // src and dst extent boundaries don't line up.
+  brillo::Blob source_data;
+  for (uint8_t i = 0; i < 3; i++)
+    source_data.insert(source_data.end(), 4096, 'a' + i);
+  brillo::Blob expected_data;
+  expected_data.insert(expected_data.end(), source_data.begin() + 4096,
+                       source_data.begin() + 8192);
+  expected_data.insert(expected_data.end(), source_data.begin() + 8192,
+                       source_data.end());
+  expected_data.insert(expected_data.end(), source_data.begin(),
+                       source_data.begin() + 4096);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(2, 1);
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 2);
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 2);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  brillo::Blob hashed_data(source_data.begin() + 8192, source_data.end());
+  hashed_data.insert(hashed_data.end(), source_data.begin(),
+                     source_data.begin() + 8192);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(hashed_data, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), {aop}, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
+}
+
+TEST_F(DeltaPerformerTest, SourceCopyWithAsyncIOTest) {
+  // Copy the source blocks in reverse order, one block per extent, so there
+  // are more chunks than buffers in flight.
+  const size_t kNumBlocks = 8;
+  brillo::Blob source_data;
+  for (size_t i = 0; i < kNumBlocks; i++)
+    source_data.insert(source_data.end(), 4096, 'a' + i);
+  brillo::Blob expected_data;
+  AnnotatedOperation aop;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    size_t src_block = kNumBlocks - 1 - i;
+    *(aop.op.add_src_extents()) = ExtentForRange(src_block, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    expected_data.insert(expected_data.end(),
+                         source_data.begin() + src_block * 4096,
+                         source_data.begin() + (src_block + 1) * 4096);
+  }
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected_data, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(), {aop}, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(source_path.c_str(), source_data.data(),
+                               source_data.size()));
+
+  performer_.set_num_async_io_threads(2);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
+}
+
 TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   brillo::Blob expected_data = {'f', 'o', 'o'};
   brillo::Blob actual_data = {'b', 'a', 'r'};
@@ -638,6 +1953,39 @@ TEST_F(DeltaPerformerTest, ValidateManifestBadMinorVersion) {
                         ErrorCode::kUnsupportedMinorPayloadVersion);
 }
 
+TEST_F(DeltaPerformerTest, ValidateManifestXzDictSizeTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_max_xz_dict_size(XzExtentWriter::kMaxDictSize);
+  RunManifestValidation(manifest,
+                        DeltaPerformer::kSupportedMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kSuccess);
+
+  // A dictionary larger than the decompressor supports is rejected upfront.
+  manifest.set_max_xz_dict_size(XzExtentWriter::kMaxDictSize + 1);
+  RunManifestValidation(manifest,
+                        DeltaPerformer::kSupportedMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kPayloadMismatchedType);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestBlobAlignmentTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_blob_alignment(4096);
+  RunManifestValidation(manifest,
+                        DeltaPerformer::kSupportedMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kSuccess);
+
+  // The older minor versions of the deltas don't allow the padding.
+  manifest.set_minor_version(kXzChunksMinorPayloadVersion);
+  manifest.add_partitions()->mutable_old_partition_info();
+  RunManifestValidation(manifest,
+                        DeltaPerformer::kSupportedMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kPayloadMismatchedType);
+}
+
 TEST_F(DeltaPerformerTest, BrilloMetadataSignatureSizeTest) {
   EXPECT_TRUE(performer_.Write(kDeltaMagic, sizeof(kDeltaMagic)));
 
@@ -22,22 +22,46 @@
 #include <string>
 #include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/action_pipe.h"
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/constants.h"
+#include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/p2p_manager.h"
 #include "update_engine/payload_state_interface.h"
 
 using base::FilePath;
+using brillo::MessageLoop;
 using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Save the update progress at most once every second, or every 8 MiB of
+// payload, instead of after each of the many small operations.
+const int kCheckpointIntervalSeconds = 1;
+const uint64_t kCheckpointIntervalBytes = 8 * 1024 * 1024;
+
+// The amount of queued payload applied before returning to the message loop,
+// when using a prefetch queue.
+const uint64_t kApplySliceBytes = 256 * 1024;  // 256 KiB
+
+// The default size of the prefetch queue holding the received payload while
+// the source partitions are verified.
+const uint64_t kDeferredSourceQueueBytes = 16 * 1024 * 1024;  // 16 MiB
+
+// The amount of queued data written to the p2p file before returning to the
+// message loop, and the most data queued for it before we give up sharing.
+const uint64_t kP2PWriteSliceBytes = 256 * 1024;  // 256 KiB
+const uint64_t kMaxP2PQueuedBytes = 16 * 1024 * 1024;  // 16 MiB
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -56,9 +80,15 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       p2p_visible_(true) {
 }
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  if (chained_payload_task_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(chained_payload_task_id_);
+  ClearQueue();
+  ClearP2PQueue();
+}
 
 void DownloadAction::CloseP2PSharingFd(bool delete_p2p_file) {
+  ClearP2PQueue();
   if (p2p_sharing_fd_ != -1) {
     if (close(p2p_sharing_fd_) != 0) {
       PLOG(ERROR) << "Error closing p2p sharing fd";
@@ -110,6 +140,13 @@ bool DownloadAction::SetupP2PSharingFd() {
     return false;
   }
 
+  p2p_file_size_ = utils::FileSize(p2p_sharing_fd_);
+  if (p2p_file_size_ < 0) {
+    PLOG(ERROR) << "Error getting file status for p2p file";
+    CloseP2PSharingFd(true);  // Delete p2p file.
+    return false;
+  }
+
   // All good.
   LOG(INFO) << "Writing payload contents to " << path.value();
   p2p_manager->FileGetVisible(p2p_file_id_, &p2p_visible_);
@@ -134,37 +171,80 @@ void DownloadAction::WriteToP2PFile(const void* data,
   //  1. the p2p file didn't get properly synced to stable storage; or
   //  2. the file was deleted at bootup (it's in /var/cache after all); or
   //  3. other reasons
-  off_t p2p_size = utils::FileSize(p2p_sharing_fd_);
-  if (p2p_size < 0) {
-    PLOG(ERROR) << "Error getting file status for p2p file";
-    CloseP2PSharingFd(true);  // Delete p2p file.
-    return;
-  }
-  if (p2p_size < file_offset) {
+  if (p2p_file_size_ < file_offset) {
     LOG(ERROR) << "Wanting to write to file offset " << file_offset
-               << " but existing p2p file is only " << p2p_size
+               << " but existing p2p file is only " << p2p_file_size_
                << " bytes.";
     CloseP2PSharingFd(true);  // Delete p2p file.
     return;
   }
 
-  off_t cur_file_offset = lseek(p2p_sharing_fd_, file_offset, SEEK_SET);
-  if (cur_file_offset != static_cast<off_t>(file_offset)) {
-    PLOG(ERROR) << "Error seeking to position "
+  // A single pwrite(2) per chunk; the file is appended to as the download
+  // goes and the peers read it while it grows.
+  if (!utils::PWriteAll(p2p_sharing_fd_, data, length, file_offset)) {
+    PLOG(ERROR) << "Error writing "
+                << length << " bytes at file offset "
                 << file_offset << " in p2p file";
     CloseP2PSharingFd(true);  // Delete p2p file.
-  } else {
-    // OK, seeking worked, now write the data
-    ssize_t bytes_written = write(p2p_sharing_fd_, data, length);
-    if (bytes_written != static_cast<ssize_t>(length)) {
-      PLOG(ERROR) << "Error writing "
-                  << length << " bytes at file offset "
-                  << file_offset << " in p2p file";
-      CloseP2PSharingFd(true);  // Delete p2p file.
-    }
+    return;
+  }
+  p2p_file_size_ = std::max(p2p_file_size_,
+                            static_cast<off_t>(file_offset + length));
+}
+
+void DownloadAction::QueueP2PData(const PayloadChunk& chunk,
+                                  off_t file_offset) {
+  if (p2p_queued_bytes_ + chunk->size() > kMaxP2PQueuedBytes) {
+    LOG(WARNING) << "Writing the p2p file can't keep up with the download, "
+                 << "no longer sharing it.";
+    CloseP2PSharingFd(true);  // Delete p2p file.
+    return;
+  }
+  p2p_queue_.emplace_back(file_offset, chunk);
+  p2p_queued_bytes_ += chunk->size();
+  if (p2p_write_task_id_ == MessageLoop::kTaskIdNull) {
+    p2p_write_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&DownloadAction::WriteQueuedP2PData,
+                   base::Unretained(this),
+                   false));
+  }
+}
+
+void DownloadAction::WriteQueuedP2PData(bool flush) {
+  if (p2p_write_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(p2p_write_task_id_);
+    p2p_write_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  uint64_t written_bytes = 0;
+  while (!p2p_queue_.empty() &&
+         (flush || written_bytes < kP2PWriteSliceBytes)) {
+    off_t file_offset = p2p_queue_.front().first;
+    PayloadChunk chunk = std::move(p2p_queue_.front().second);
+    p2p_queue_.pop_front();
+    p2p_queued_bytes_ -= chunk->size();
+    written_bytes += chunk->size();
+    // The queue is cleared if sharing stopped due to an error.
+    WriteToP2PFile(chunk->data(), chunk->size(), file_offset);
+  }
+  if (!p2p_queue_.empty()) {
+    p2p_write_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&DownloadAction::WriteQueuedP2PData,
+                   base::Unretained(this),
+                   false));
   }
 }
 
+void DownloadAction::ClearP2PQueue() {
+  if (p2p_write_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(p2p_write_task_id_);
+    p2p_write_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  p2p_queue_.clear();
+  p2p_queued_bytes_ = 0;
+}
+
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
 
@@ -172,26 +252,62 @@ void DownloadAction::PerformAction() {
   CHECK(HasInputObject());
   install_plan_ = GetInputObject();
   bytes_received_ = 0;
+  chained_payload_index_ = 0;
+  chain_bytes_received_ = 0;
+  if (install_plan_.is_resume && !SkipAppliedChainedPayloads()) {
+    processor_->ActionComplete(this,
+                               ErrorCode::kDownloadStateInitializationError);
+    return;
+  }
+  chain_size_ = install_plan_.payload_size;
+  for (const InstallPlan::Payload& payload : install_plan_.chained_payloads)
+    chain_size_ += payload.size;
 
   install_plan_.Dump();
 
-  LOG(INFO) << "Marking new slot as unbootable";
-  if (!boot_control_->MarkSlotUnbootable(install_plan_.target_slot)) {
-    LOG(WARNING) << "Unable to mark new slot "
-                 << BootControlInterface::SlotName(install_plan_.target_slot)
-                 << ". Proceeding with the update anyway.";
+  metadata_validated_ = false;
+  if (metadata_only_) {
+    LOG(INFO) << "Only validating the payload metadata.";
+  } else {
+    LOG(INFO) << "Marking new slot as unbootable";
+    if (!boot_control_->MarkSlotUnbootable(install_plan_.target_slot)) {
+      LOG(WARNING) << "Unable to mark new slot "
+                   << BootControlInterface::SlotName(install_plan_.target_slot)
+                   << ". Proceeding with the update anyway.";
+    }
   }
 
   if (writer_) {
     LOG(INFO) << "Using writer for test.";
   } else {
-    delta_performer_.reset(new DeltaPerformer(
-        prefs_, boot_control_, hardware_, delegate_, &install_plan_));
+    CreateDeltaPerformer();
+    // The source partitions hashed for the first payload aren't the source
+    // of a resumed chained payload, applied on the target slot.
+    if (defer_source_verification_ && chained_payload_index_ > 0) {
+      defer_source_verification_ = false;
+      if (!source_hashes_not_needed_callback_.is_null())
+        source_hashes_not_needed_callback_.Run();
+    }
+    if (defer_source_verification_) {
+      delta_performer_->set_defer_source_verification(true);
+      if (max_queued_bytes_ == 0)
+        max_queued_bytes_ = kDeferredSourceQueueBytes;
+      source_hashes_pending_ = true;
+      // The hashes passed already are kept until the manifest is parsed.
+      if (source_hashes_set_) {
+        source_hashes_pending_ = false;
+        ErrorCode error;
+        delta_performer_->SetSourcePartitionHashes(source_partitions_, &error);
+      }
+    }
     writer_ = delta_performer_.get();
   }
   download_active_ = true;
 
-  if (system_state_ != nullptr) {
+  // Only the first payload of a chain is shared over p2p, and none when only
+  // its metadata is validated.
+  if (system_state_ != nullptr && chained_payload_index_ == 0 &&
+      !metadata_only_) {
     const PayloadStateInterface* payload_state = system_state_->payload_state();
     string file_id = utils::CalculateP2PFileId(install_plan_.payload_hash,
                                                install_plan_.payload_size);
@@ -232,20 +348,124 @@ void DownloadAction::PerformAction() {
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
+void DownloadAction::CreateDeltaPerformer() {
+  delta_performer_.reset(new DeltaPerformer(
+      prefs_, boot_control_, hardware_, delegate_, &install_plan_));
+  delta_performer_->set_checkpoint_interval(
+      base::TimeDelta::FromSeconds(kCheckpointIntervalSeconds),
+      kCheckpointIntervalBytes);
+  delta_performer_->set_memory_budget(memory_budget_, staging_dir_);
+  delta_performer_->set_staged_checkpoint_bytes(staged_checkpoint_bytes_);
+  delta_performer_->set_skip_satisfied_operations(skip_satisfied_operations_);
+  delta_performer_->set_compare_before_write(compare_before_write_);
+  delta_performer_->set_metadata_only(metadata_only_);
+  delta_performer_->set_num_worker_threads(num_worker_threads_);
+  delta_performer_->SetMaxActiveWorkers(max_active_workers_);
+  delta_performer_->set_lazy_source_verification(lazy_source_verification_);
+  delta_performer_->set_partition_claims(partition_claims_, payload_index_);
+  delta_performer_->set_pre_trim(pre_trim_);
+}
+
+bool DownloadAction::SkipAppliedChainedPayloads() {
+  int64_t applied_payloads = 0;
+  if (!prefs_->GetInt64(kPrefsUpdateStateChainedPayload, &applied_payloads) ||
+      applied_payloads <= 0) {
+    return true;
+  }
+  for (int64_t i = 0; i < applied_payloads; i++) {
+    if (!install_plan_.AdvanceChainedPayload()) {
+      LOG(ERROR) << "Unable to resume the chained payload "
+                 << applied_payloads << ", the update only has " << i << ".";
+      return false;
+    }
+  }
+  install_plan_.is_resume = true;
+  chained_payload_index_ = applied_payloads;
+  LOG(INFO) << "Resuming the chained payload " << chained_payload_index_
+            << ", the previous ones were already applied.";
+  if (delegate_)
+    delegate_->ChainedPayloadStarted(install_plan_);
+  return true;
+}
+
+void DownloadAction::StartChainedPayload() {
+  chained_payload_task_id_ = MessageLoop::kTaskIdNull;
+  // The progress of the payload just applied is replaced by the one of the
+  // next payload, so an interruption from now on resumes from there. The
+  // reset also clears the response hash the progress belongs to.
+  string response_hash;
+  prefs_->GetString(kPrefsUpdateCheckResponseHash, &response_hash);
+  if (!DeltaPerformer::ResetUpdateProgress(prefs_, false) ||
+      !prefs_->SetString(kPrefsUpdateCheckResponseHash, response_hash) ||
+      !prefs_->SetInt64(kPrefsUpdateStateChainedPayload,
+                        chained_payload_index_ + 1)) {
+    LOG(ERROR) << "Unable to save the progress of the chained payloads.";
+    processor_->ActionComplete(this,
+                               ErrorCode::kDownloadStateInitializationError);
+    return;
+  }
+  // Sharing stops at the end of the first payload, whose file is complete.
+  CloseP2PSharingFd(false);
+
+  chain_bytes_received_ += install_plan_.payload_size;
+  install_plan_.AdvanceChainedPayload();
+  chained_payload_index_++;
+  bytes_received_ = 0;
+  LOG(INFO) << "Applying the chained payload " << chained_payload_index_
+            << " on top of the previous one.";
+  install_plan_.Dump();
+  if (delegate_)
+    delegate_->ChainedPayloadStarted(install_plan_);
+
+  CreateDeltaPerformer();
+  writer_ = delta_performer_.get();
+  download_active_ = true;
+  http_fetcher_->BeginTransfer(install_plan_.download_url);
+  if (suspended_)
+    http_fetcher_->Pause();
+}
+
+void DownloadAction::SetMaxActiveWorkers(size_t max_active_workers) {
+  max_active_workers_ = max_active_workers;
+  if (delta_performer_)
+    delta_performer_->SetMaxActiveWorkers(max_active_workers_);
+}
+
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  if (!paused_for_queue_)
+    http_fetcher_->Pause();
+  if (delta_performer_)
+    delta_performer_->SuspendOperations();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  if (delta_performer_)
+    delta_performer_->ResumeOperations();
+  ScheduleApplyQueuedPayload();
+  if (!paused_for_queue_)
+    http_fetcher_->Unpause();
 }
 
 void DownloadAction::TerminateProcessing() {
+  if (chained_payload_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(chained_payload_task_id_);
+    chained_payload_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  ClearQueue();
+  source_hashes_pending_ = false;
   if (writer_) {
+    // The operations still running are stopped at their next I/O instead of
+    // being waited for by Close().
+    if (delta_performer_)
+      delta_performer_->CancelOperations();
     writer_->Close();
     writer_ = nullptr;
   }
   download_active_ = false;
+  // Keep what was received in the p2p file, so the download can be resumed.
+  WriteQueuedP2PData(true);
   CloseP2PSharingFd(false);  // Keep p2p file.
   // Terminates the transfer. The action is terminated, if necessary, when the
   // TransferTerminated callback is received.
@@ -259,16 +479,43 @@ void DownloadAction::SeekToOffset(off_t offset) {
 void DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
                                    const void* bytes,
                                    size_t length) {
+  // The received data is only valid during this callback, so it is copied
+  // once to a chunk shared by the p2p and the prefetch queues if either one
+  // needs it afterwards.
+  const bool queue_payload = max_queued_bytes_ != 0 && writer_;
+  PayloadChunk chunk;
+  if (queue_payload || !p2p_file_id_.empty()) {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    chunk = std::make_shared<const brillo::Blob>(data, data + length);
+  }
+
   // Note that bytes_received_ is the current offset.
   if (!p2p_file_id_.empty()) {
-    WriteToP2PFile(bytes, length, bytes_received_);
+    QueueP2PData(chunk, bytes_received_);
   }
 
   bytes_received_ += length;
   if (delegate_ && download_active_) {
+    // The progress of a chain of payloads spans all of them.
     delegate_->BytesReceived(
-        length, bytes_received_, install_plan_.payload_size);
+        length, chain_bytes_received_ + bytes_received_, chain_size_);
+  }
+
+  if (!queue_payload) {
+    WritePayload(bytes, length);
+    return;
+  }
+  queue_.push_back(std::move(chunk));
+  queued_bytes_ += length;
+  ScheduleApplyQueuedPayload();
+  if (queued_bytes_ >= max_queued_bytes_ && !paused_for_queue_) {
+    paused_for_queue_ = true;
+    if (!suspended_)
+      http_fetcher_->Pause();
   }
+}
+
+bool DownloadAction::WritePayload(const void* bytes, size_t length) {
   if (writer_ && !writer_->Write(bytes, length, &code_)) {
     LOG(ERROR) << "Error " << code_ << " in DeltaPerformer's Write method when "
                << "processing the received payload -- Terminating processing";
@@ -279,7 +526,26 @@ void DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
     // objects may get destroyed before all callbacks are complete.
     TerminateProcessing();
-    return;
+    return false;
+  }
+
+  // The source partition hashes aren't waited for once the manifest shows
+  // they aren't needed.
+  if (source_hashes_pending_ && delta_performer_ &&
+      delta_performer_->source_verified_by_operations()) {
+    source_hashes_pending_ = false;
+    if (!source_hashes_not_needed_callback_.is_null())
+      source_hashes_not_needed_callback_.Run();
+  }
+
+  // The rest of the payload isn't needed once the metadata is validated. The
+  // action completes when the transfer is terminated.
+  if (metadata_only_ && delta_performer_ &&
+      delta_performer_->IsManifestValid()) {
+    LOG(INFO) << "The payload metadata is valid, stopping the download.";
+    metadata_validated_ = true;
+    TerminateProcessing();
+    return false;
   }
 
   // Call p2p_manager_->FileMakeVisible() when we've successfully
@@ -290,9 +556,96 @@ void DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     system_state_->p2p_manager()->FileMakeVisible(p2p_file_id_);
     p2p_visible_ = true;
   }
+  return true;
+}
+
+void DownloadAction::SetSourcePartitionHashes(const InstallPlan& source_plan) {
+  source_partitions_ = source_plan.partitions;
+  source_hashes_set_ = true;
+  ScheduleApplyQueuedPayload();
+}
+
+void DownloadAction::ApplyQueuedPayload() {
+  apply_task_id_ = MessageLoop::kTaskIdNull;
+  // The queue is applied again when the action is resumed.
+  if (suspended_)
+    return;
+  if (source_hashes_pending_ && source_hashes_set_) {
+    source_hashes_pending_ = false;
+    if (!delta_performer_->SetSourcePartitionHashes(source_partitions_,
+                                                    &code_)) {
+      LOG(ERROR) << "Error " << code_ << " verifying the source partitions "
+                 << "-- Terminating processing";
+      if (!p2p_file_id_.empty())
+        CloseP2PSharingFd(true);
+      TerminateProcessing();
+      return;
+    }
+  }
+  uint64_t applied_bytes = 0;
+  while (!queue_.empty() && applied_bytes < kApplySliceBytes &&
+         !IsWaitingForSourceHashes()) {
+    PayloadChunk chunk = std::move(queue_.front());
+    queue_.pop_front();
+    queued_bytes_ -= chunk->size();
+    applied_bytes += chunk->size();
+    if (!WritePayload(chunk->data(), chunk->size()))
+      return;
+  }
+
+  if (!queue_.empty()) {
+    ScheduleApplyQueuedPayload();
+  } else if (transfer_complete_pending_ && !source_hashes_pending_) {
+    transfer_complete_pending_ = false;
+    FinishTransfer(true);
+    return;
+  }
+
+  if (paused_for_queue_ && queued_bytes_ <= max_queued_bytes_ / 2) {
+    paused_for_queue_ = false;
+    // Note that the fetcher may pass more data right away.
+    http_fetcher_->Unpause();
+  }
+}
+
+void DownloadAction::ScheduleApplyQueuedPayload() {
+  const bool pass_source_hashes = source_hashes_pending_ && source_hashes_set_;
+  if ((queue_.empty() && !pass_source_hashes) || suspended_ ||
+      apply_task_id_ != MessageLoop::kTaskIdNull) {
+    return;
+  }
+  // The queue is held until the source partition hashes are passed.
+  if (!pass_source_hashes && IsWaitingForSourceHashes())
+    return;
+  apply_task_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::ApplyQueuedPayload, base::Unretained(this)));
+}
+
+void DownloadAction::ClearQueue() {
+  if (apply_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(apply_task_id_);
+    apply_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  queue_.clear();
+  queued_bytes_ = 0;
+  paused_for_queue_ = false;
+  transfer_complete_pending_ = false;
 }
 
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (successful && (!queue_.empty() || source_hashes_pending_)) {
+    // The payload can only be verified once all of it was applied, which
+    // requires the source partitions to be verified.
+    transfer_complete_pending_ = true;
+    return;
+  }
+  ClearQueue();
+  FinishTransfer(successful);
+}
+
+void DownloadAction::FinishTransfer(bool successful) {
+  WriteQueuedP2PData(true);
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
     writer_ = nullptr;
@@ -312,6 +665,17 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
     }
   }
 
+  // The next chained payload starts once the fetcher is back to the message
+  // loop, done with this transfer.
+  if (code == ErrorCode::kSuccess && delta_performer_ &&
+      !install_plan_.chained_payloads.empty()) {
+    chained_payload_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&DownloadAction::StartChainedPayload,
+                   base::Unretained(this)));
+    return;
+  }
+
   // Write the path to the output pipe if we're successful.
   if (code == ErrorCode::kSuccess && HasOutputPipe())
     SetOutputObject(install_plan_);
@@ -319,6 +683,12 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
 }
 
 void DownloadAction::TransferTerminated(HttpFetcher *fetcher) {
+  if (metadata_validated_) {
+    if (HasOutputPipe())
+      SetOutputObject(install_plan_);
+    processor_->ActionComplete(this, ErrorCode::kSuccess);
+    return;
+  }
   if (code_ != ErrorCode::kSuccess) {
     processor_->ActionComplete(this, code_);
   }
@@ -21,8 +21,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include <base/callback.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
@@ -59,6 +67,20 @@ class DownloadActionDelegate {
   // while applying or downloading the partial payload will result in this
   // method not being called.
   virtual void DownloadComplete() = 0;
+
+  // Called once the manifest is parsed, when some of the remaining operations
+  // can be skipped, with the byte ranges of the payload, as offset and length,
+  // still needed to apply the update. Returns whether the data passed from now
+  // on is restricted to these ranges. If not, all the remaining data is
+  // applied as usual.
+  virtual bool FetchOnlyPayloadRanges(
+      const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+    return false;
+  }
+
+  // Called before the download of a chained payload starts, with the
+  // |install_plan| of that payload, so the fetcher can be set up for it.
+  virtual void ChainedPayloadStarted(const InstallPlan& install_plan) {}
 };
 
 class PrefsInterface;
@@ -108,11 +130,120 @@ class DownloadAction : public InstallPlanAction,
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Sets the memory budget of the DeltaPerformer applying the payload, see
+  // DeltaPerformer::set_memory_budget(). Must be called before PerformAction().
+  void set_memory_budget(uint64_t max_buffered_bytes,
+                         const std::string& staging_dir) {
+    memory_budget_ = max_buffered_bytes;
+    staging_dir_ = staging_dir;
+  }
+
+  // Sets how often the progress inside the staged blobs is saved, see
+  // DeltaPerformer::set_staged_checkpoint_bytes(). Must be called before
+  // PerformAction().
+  void set_staged_checkpoint_bytes(uint64_t staged_checkpoint_bytes) {
+    staged_checkpoint_bytes_ = staged_checkpoint_bytes;
+  }
+
+  // Limits the number of worker threads of the DeltaPerformer applying
+  // operations at the same time, see DeltaPerformer::SetMaxActiveWorkers().
+  // Can be called at any time.
+  void SetMaxActiveWorkers(size_t max_active_workers);
+
+  // Sets whether the DeltaPerformer skips the remaining operations whose target
+  // blocks already match, see DeltaPerformer::set_skip_satisfied_operations().
+  // Must be called before PerformAction().
+  void set_skip_satisfied_operations(bool skip) {
+    skip_satisfied_operations_ = skip;
+  }
+
+  // Sets whether the DeltaPerformer skips the writes of the data already in
+  // the target partitions, see DeltaPerformer::set_compare_before_write().
+  // Must be called before PerformAction().
+  void set_compare_before_write(bool compare) {
+    compare_before_write_ = compare;
+  }
+
+  // Sets whether only the metadata of the payload is fetched and validated, see
+  // DeltaPerformer::set_metadata_only(). The transfer is then stopped once the
+  // manifest is parsed, the target slot is left untouched and the InstallPlan
+  // with the partitions of the payload is passed to the next action. Must be
+  // called before PerformAction().
+  void set_metadata_only(bool metadata_only) { metadata_only_ = metadata_only; }
+
+  // Queues up to |max_queued_bytes| of the received payload and applies it
+  // from the message loop in slices, so the fetcher keeps servicing its
+  // connection while a slow operation is applied. The fetcher is paused when
+  // the queue is full and resumed once it drained to half of it. Zero, the
+  // default, applies the data as soon as it is received. Must be called before
+  // PerformAction().
+  void set_prefetch_queue_size(uint64_t max_queued_bytes) {
+    max_queued_bytes_ = max_queued_bytes;
+  }
+
+  // Sets whether the source partitions are verified while the payload is
+  // downloaded, once their hashes are passed to SetSourcePartitionHashes(),
+  // instead of being already in the InstallPlan passed in. The operations
+  // reading from them wait until then, and meanwhile the received payload is
+  // held in the prefetch queue, whose size defaults to 16 MiB in this case.
+  // Must be called before PerformAction().
+  void set_defer_source_verification(bool defer) {
+    defer_source_verification_ = defer;
+  }
+
+  // Sets whether the deferred source verification is skipped when all the
+  // operations validate the source data they read, as described in
+  // DeltaPerformer::set_lazy_source_verification(). The |callback|, if set, is
+  // called once the manifest is parsed if the source partition hashes aren't
+  // needed anymore, so their computation can be stopped. Must be called before
+  // PerformAction().
+  void set_lazy_source_verification(bool lazy, const base::Closure& callback) {
+    lazy_source_verification_ = lazy;
+    source_hashes_not_needed_callback_ = callback;
+  }
+
+  // Sets the |claims| on the target partitions shared with the other payloads
+  // applied at the same time, see DeltaPerformer::set_partition_claims(). The
+  // chained payloads are applied with the same |payload_index|. Must be called
+  // before PerformAction().
+  void set_partition_claims(std::map<std::string, size_t>* claims,
+                            size_t payload_index) {
+    partition_claims_ = claims;
+    payload_index_ = payload_index;
+  }
+
+  // Sets whether the target blocks are discarded ahead of the operations, see
+  // DeltaPerformer::set_pre_trim(). Must be called before PerformAction().
+  void set_pre_trim(bool pre_trim) { pre_trim_ = pre_trim; }
+
+  // Sets the number of worker threads applying the operations, see
+  // DeltaPerformer::set_num_worker_threads(). Must be called before
+  // PerformAction().
+  void set_num_worker_threads(size_t num_worker_threads) {
+    num_worker_threads_ = num_worker_threads;
+  }
+
+  // Passes the source partitions in the |source_plan|, with their computed
+  // source_hash, when the source verification is deferred. They are verified
+  // and the held payload applied from the message loop. May be called before
+  // PerformAction().
+  void SetSourcePartitionHashes(const InstallPlan& source_plan);
+
+  // Returns the stats of the install operations applied so far, or nullptr if
+  // no payload was applied.
+  const OperationStats* operation_stats() const {
+    return delta_performer_ ? &delta_performer_->operation_stats() : nullptr;
+  }
+
   // Returns the p2p file id for the file being written or the empty
   // string if we're not writing to a p2p file.
   std::string p2p_file_id() { return p2p_file_id_; }
 
  private:
+  // A piece of the received payload, shared by the p2p and prefetch queues so
+  // it is only copied once out of the fetcher's buffer.
+  using PayloadChunk = std::shared_ptr<const brillo::Blob>;
+
   // Closes the file descriptor for the p2p file being written and
   // clears |p2p_file_id_| to indicate that we're no longer sharing
   // the file. If |delete_p2p_file| is True, also deletes the file.
@@ -131,6 +262,61 @@ class DownloadAction : public InstallPlanAction,
   // called or if CloseP2PSharingFd() has been called.
   void WriteToP2PFile(const void* data, size_t length, off_t file_offset);
 
+  // Queues the |chunk| to be written to the p2p file at |file_offset| from
+  // the message loop, so the disk I/O doesn't delay the download. The queue
+  // is bounded; if it overflows we stop sharing the payload instead of
+  // stalling the update.
+  void QueueP2PData(const PayloadChunk& chunk, off_t file_offset);
+
+  // Writes a slice of the queued p2p data in order, or all of it if |flush|
+  // is true. Since the data is written in order, the p2p file only ever grows
+  // with the contiguous data received so far.
+  void WriteQueuedP2PData(bool flush);
+
+  // Drops the queued p2p data and cancels the pending WriteQueuedP2PData().
+  void ClearP2PQueue();
+
+  // Passes the |length| bytes of payload at |bytes| to the |writer_|. On
+  // failure, terminates the processing and returns false.
+  bool WritePayload(const void* bytes, size_t length);
+
+  // Passes the source partition hashes to the |delta_performer_| if they are
+  // waited for, then applies a slice of the queued payload, resuming the
+  // fetcher if the queue drained enough and completing the transfer once
+  // everything was applied.
+  void ApplyQueuedPayload();
+
+  // Posts an ApplyQueuedPayload() task if there is queued payload or source
+  // partition hashes to pass to the |delta_performer_|, the action isn't
+  // suspended and no such task is pending yet.
+  void ScheduleApplyQueuedPayload();
+
+  // Returns whether the |delta_performer_| holds the payload until it gets the
+  // source partition hashes.
+  bool IsWaitingForSourceHashes() const {
+    return delta_performer_ && delta_performer_->IsWaitingForSourceHashes();
+  }
+
+  // Drops the queued payload and cancels the pending ApplyQueuedPayload().
+  void ClearQueue();
+
+  // Closes the writer, verifies the payload and completes the action after
+  // the transfer completed and all its data was applied, or starts the next
+  // chained payload, if any.
+  void FinishTransfer(bool successful);
+
+  // Creates the |delta_performer_| applying the payload of the
+  // |install_plan_|.
+  void CreateDeltaPerformer();
+
+  // Skips the chained payloads applied before the interrupted one when the
+  // update is resumed. Returns false if their progress isn't valid.
+  bool SkipAppliedChainedPayloads();
+
+  // Saves the progress past the payload just applied, then downloads and
+  // applies the next chained payload on the target slot.
+  void StartChainedPayload();
+
   // The InstallPlan passed in
   InstallPlan install_plan_;
 
@@ -151,10 +337,76 @@ class DownloadAction : public InstallPlanAction,
 
   std::unique_ptr<DeltaPerformer> delta_performer_;
 
+  // The memory budget passed to the |delta_performer_|, the directory where
+  // it stages the blobs over the budget and the interval of the checkpoints
+  // inside them.
+  uint64_t memory_budget_{0};
+  std::string staging_dir_;
+  uint64_t staged_checkpoint_bytes_{0};
+
+  bool skip_satisfied_operations_{false};
+  bool compare_before_write_{false};
+
+  // Whether only the metadata is validated, and whether it was already, in
+  // which case the transfer is being terminated.
+  bool metadata_only_{false};
+  bool metadata_validated_{false};
+
+  // The number of worker threads of the |delta_performer_|, and the limit of
+  // the active ones, 0 for none.
+  size_t num_worker_threads_{0};
+  size_t max_active_workers_{0};
+
+  // The prefetch queue, see set_prefetch_queue_size(). |queued_bytes_| is the
+  // size of all the blobs in |queue_|.
+  uint64_t max_queued_bytes_{0};
+  std::deque<PayloadChunk> queue_;
+  uint64_t queued_bytes_{0};
+  brillo::MessageLoop::TaskId apply_task_id_{brillo::MessageLoop::kTaskIdNull};
+
+  // Whether the source verification is deferred, whether the
+  // |delta_performer_| still needs the source partition hashes, and the
+  // source partitions passed to SetSourcePartitionHashes(), if they were.
+  bool defer_source_verification_{false};
+  bool source_hashes_pending_{false};
+  std::vector<InstallPlan::Partition> source_partitions_;
+  bool source_hashes_set_{false};
+
+  // Whether the lazy source verification is enabled, and the callback called
+  // when it makes the source partition hashes unneeded.
+  bool lazy_source_verification_{false};
+  base::Closure source_hashes_not_needed_callback_;
+
+  // The claims on the target partitions passed to the DeltaPerformer.
+  std::map<std::string, size_t>* partition_claims_{nullptr};
+  size_t payload_index_{0};
+
+  // Whether the DeltaPerformer discards the target blocks ahead of the
+  // operations.
+  bool pre_trim_{false};
+
+  // Whether the fetcher is paused because the queue is full, because the
+  // action was suspended, or both.
+  bool paused_for_queue_{false};
+  bool suspended_{false};
+
+  // Whether the transfer completed successfully but the queue wasn't applied
+  // yet.
+  bool transfer_complete_pending_{false};
+
   // Used by TransferTerminated to figure if this action terminated itself or
   // was terminated by the action processor.
   ErrorCode code_;
 
+  // The number of chained payloads applied before the current one, the sum
+  // of their sizes, the size of all the payloads and the pending
+  // StartChainedPayload() task.
+  int64_t chained_payload_index_{0};
+  uint64_t chain_bytes_received_{0};
+  uint64_t chain_size_{0};
+  brillo::MessageLoop::TaskId chained_payload_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // For reporting status to outsiders
   DownloadActionDelegate* delegate_;
   uint64_t bytes_received_;
@@ -168,9 +420,20 @@ class DownloadAction : public InstallPlanAction,
   // if we're not using p2p to share.
   int p2p_sharing_fd_;
 
+  // The size of the p2p file, checked when opening it and kept up to date
+  // with the writes since nobody else writes to it.
+  off_t p2p_file_size_{0};
+
   // Set to |false| if p2p file is not visible.
   bool p2p_visible_;
 
+  // The data not yet written to the p2p file, along with its file offset.
+  // |p2p_queued_bytes_| is the size of all the data in |p2p_queue_|.
+  std::deque<std::pair<off_t, PayloadChunk>> p2p_queue_;
+  uint64_t p2p_queued_bytes_{0};
+  brillo::MessageLoop::TaskId p2p_write_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
@@ -127,7 +127,8 @@ void StartProcessorInRunLoop(ActionProcessor* processor,
 
 void TestWithData(const brillo::Blob& data,
                   int fail_write,
-                  bool use_download_delegate) {
+                  bool use_download_delegate,
+                  uint64_t prefetch_queue_size) {
   brillo::FakeMessageLoop loop(nullptr);
   loop.SetAsCurrent();
   FakeSystemState fake_system_state;
@@ -167,6 +168,7 @@ void TestWithData(const brillo::Blob& data,
                                  &fake_system_state,
                                  http_fetcher);
   download_action.SetTestFileWriter(&writer);
+  download_action.set_prefetch_queue_size(prefetch_queue_size);
   BondActions(&feeder_action, &download_action);
   MockDownloadActionDelegate download_delegate;
   if (use_download_delegate) {
@@ -206,7 +208,8 @@ TEST(DownloadActionTest, SimpleTest) {
   small.insert(small.end(), foo, foo + strlen(foo));
   TestWithData(small,
                0,  // fail_write
-               true);  // use_download_delegate
+               true,  // use_download_delegate
+               0);  // prefetch_queue_size
 }
 
 TEST(DownloadActionTest, LargeTest) {
@@ -218,7 +221,8 @@ TEST(DownloadActionTest, LargeTest) {
   }
   TestWithData(big,
                0,  // fail_write
-               true);  // use_download_delegate
+               true,  // use_download_delegate
+               0);  // prefetch_queue_size
 }
 
 TEST(DownloadActionTest, FailWriteTest) {
@@ -230,7 +234,8 @@ TEST(DownloadActionTest, FailWriteTest) {
   }
   TestWithData(big,
                2,  // fail_write
-               true);  // use_download_delegate
+               true,  // use_download_delegate
+               0);  // prefetch_queue_size
 }
 
 TEST(DownloadActionTest, NoDownloadDelegateTest) {
@@ -239,7 +244,35 @@ TEST(DownloadActionTest, NoDownloadDelegateTest) {
   small.insert(small.end(), foo, foo + strlen(foo));
   TestWithData(small,
                0,  // fail_write
-               false);  // use_download_delegate
+               false,  // use_download_delegate
+               0);  // prefetch_queue_size
+}
+
+TEST(DownloadActionTest, PrefetchQueueTest) {
+  brillo::Blob big(5 * kMockHttpFetcherChunkSize);
+  char c = '0';
+  for (unsigned int i = 0; i < big.size(); i++) {
+    big[i] = c;
+    c = ('9' == c) ? '0' : c + 1;
+  }
+  // The queue fills up after two chunks, pausing the fetcher.
+  TestWithData(big,
+               0,  // fail_write
+               true,  // use_download_delegate
+               2 * kMockHttpFetcherChunkSize);  // prefetch_queue_size
+}
+
+TEST(DownloadActionTest, PrefetchQueueFailWriteTest) {
+  brillo::Blob big(5 * kMockHttpFetcherChunkSize);
+  char c = '0';
+  for (unsigned int i = 0; i < big.size(); i++) {
+    big[i] = c;
+    c = ('9' == c) ? '0' : c + 1;
+  }
+  TestWithData(big,
+               2,  // fail_write
+               true,  // use_download_delegate
+               2 * kMockHttpFetcherChunkSize);  // prefetch_queue_size
 }
 
 namespace {
@@ -17,6 +17,8 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -26,9 +28,150 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 
 using std::min;
+using std::vector;
 
 namespace chromeos_update_engine {
 
+AlignedBufferPool::~AlignedBufferPool() {
+  for (void* buffer : free_buffers_)
+    free(buffer);
+}
+
+void* AlignedBufferPool::Acquire() {
+  {
+    base::AutoLock auto_lock(lock_);
+    if (!free_buffers_.empty()) {
+      void* buffer = free_buffers_.back();
+      free_buffers_.pop_back();
+      return buffer;
+    }
+  }
+  void* buffer = nullptr;
+  if (posix_memalign(&buffer, alignment_, buffer_size_) != 0) {
+    LOG(ERROR) << "Unable to allocate an aligned buffer of " << buffer_size_
+               << " bytes.";
+    return nullptr;
+  }
+  return buffer;
+}
+
+void AlignedBufferPool::Release(void* buffer) {
+  base::AutoLock auto_lock(lock_);
+  if (shrunk_)
+    free(buffer);
+  else
+    free_buffers_.push_back(buffer);
+}
+
+void AlignedBufferPool::ShrinkToMinimum() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = true;
+  for (void* buffer : free_buffers_)
+    free(buffer);
+  free_buffers_.clear();
+}
+
+void AlignedBufferPool::RestoreCapacity() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = false;
+}
+
+DirectExtentWriter::~DirectExtentWriter() {
+  if (staging_buffer_)
+    aligned_buffers_->Release(staging_buffer_);
+}
+
+bool DirectExtentWriter::Init(FileDescriptorPtr fd,
+                              const vector<Extent>& extents,
+                              uint32_t block_size) {
+  fd_ = fd;
+  block_size_ = block_size;
+  extent_bytes_written_ = 0;
+  next_extent_index_ = 0;
+  staged_bytes_ = 0;
+  // Adjacent extents are merged, so the data spanning them is written at once
+  // instead of by one write per extent. Fragmented operations often have many
+  // extents next to each other.
+  extents_.clear();
+  for (const Extent& extent : extents) {
+    if (!extents_.empty()) {
+      Extent* last = &extents_.back();
+      const bool both_sparse = last->start_block() == kSparseHole &&
+                               extent.start_block() == kSparseHole;
+      const bool contiguous = last->start_block() != kSparseHole &&
+                              extent.start_block() != kSparseHole &&
+                              last->start_block() + last->num_blocks() ==
+                                  extent.start_block();
+      if (both_sparse || contiguous) {
+        last->set_num_blocks(last->num_blocks() + extent.num_blocks());
+        continue;
+      }
+    }
+    extents_.push_back(extent);
+  }
+  if (aligned_buffers_ && !staging_buffer_) {
+    TEST_AND_RETURN_FALSE(aligned_buffers_->buffer_size() % block_size_ == 0);
+    staging_buffer_ = static_cast<char*>(aligned_buffers_->Acquire());
+    TEST_AND_RETURN_FALSE(staging_buffer_);
+  }
+  return true;
+}
+
+bool DirectExtentWriter::EndImpl() {
+  TEST_AND_RETURN_FALSE(FlushStagingBuffer());
+  if (staging_buffer_) {
+    aligned_buffers_->Release(staging_buffer_);
+    staging_buffer_ = nullptr;
+  }
+  return true;
+}
+
+bool DirectExtentWriter::WriteAt(const char* bytes,
+                                 size_t count,
+                                 off64_t offset) {
+  if (!staging_buffer_) {
+    TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(offset, SEEK_SET) !=
+                                static_cast<off64_t>(-1));
+    return utils::WriteAll(fd_, bytes, count);
+  }
+
+  while (count > 0) {
+    // The staged bytes must be contiguous on disk.
+    if (staged_bytes_ > 0 &&
+        staged_offset_ + static_cast<off64_t>(staged_bytes_) != offset) {
+      TEST_AND_RETURN_FALSE(FlushStagingBuffer());
+    }
+    if (staged_bytes_ == 0)
+      staged_offset_ = offset;
+    size_t bytes_to_stage =
+        min(count, aligned_buffers_->buffer_size() - staged_bytes_);
+    memcpy(staging_buffer_ + staged_bytes_, bytes, bytes_to_stage);
+    staged_bytes_ += bytes_to_stage;
+    bytes += bytes_to_stage;
+    count -= bytes_to_stage;
+    offset += bytes_to_stage;
+    if (staged_bytes_ == aligned_buffers_->buffer_size())
+      TEST_AND_RETURN_FALSE(FlushStagingBuffer());
+  }
+  return true;
+}
+
+bool DirectExtentWriter::FlushStagingBuffer() {
+  if (staged_bytes_ == 0)
+    return true;
+  // Staged writes always start at a block boundary, so they can be completed
+  // to a whole number of blocks.
+  size_t bytes_to_write =
+      (staged_bytes_ + block_size_ - 1) / block_size_ * block_size_;
+  memset(staging_buffer_ + staged_bytes_, 0, bytes_to_write - staged_bytes_);
+  TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(staged_offset_, SEEK_SET) !=
+                              static_cast<off64_t>(-1));
+  TEST_AND_RETURN_FALSE(
+      utils::WriteAll(fd_, staging_buffer_, bytes_to_write));
+  staged_bytes_ = 0;
+  return true;
+}
+
 bool DirectExtentWriter::Write(const void* bytes, size_t count) {
   if (count == 0)
     return true;
@@ -49,10 +192,8 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       const off64_t offset =
           extents_[next_extent_index_].start_block() * block_size_ +
           extent_bytes_written_;
-      TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(offset, SEEK_SET) !=
-                                  static_cast<off64_t>(-1));
       TEST_AND_RETURN_FALSE(
-          utils::WriteAll(fd_, c_bytes + bytes_written, bytes_to_write));
+          WriteAt(c_bytes + bytes_written, bytes_to_write, offset));
     }
     bytes_written += bytes_to_write;
     extent_bytes_written_ += bytes_to_write;
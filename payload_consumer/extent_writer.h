@@ -17,11 +17,16 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_WRITER_H_
 
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include <base/logging.h>
+#include <base/synchronization/lock.h>
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/memory_pressure_monitor.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
@@ -38,7 +43,8 @@ class ExtentWriter {
     LOG_IF(ERROR, !end_called_) << "End() not called on ExtentWriter.";
   }
 
-  // Returns true on success.
+  // Returns true on success. A writer may be initialized again once End()
+  // returned true, to write other extents, reusing its buffers.
   virtual bool Init(FileDescriptorPtr fd,
                     const std::vector<Extent>& extents,
                     uint32_t block_size) = 0;
@@ -57,26 +63,71 @@ class ExtentWriter {
   bool end_called_{false};
 };
 
+// AlignedBufferPool keeps memory buffers aligned for direct I/O, so they can be
+// reused across operations instead of being allocated for each one. It is
+// thread-safe.
+
+class AlignedBufferPool : public ShrinkableCache {
+ public:
+  // The buffers are |buffer_size| bytes long and aligned to |alignment|, which
+  // must be a power of two.
+  AlignedBufferPool(size_t buffer_size, size_t alignment)
+      : buffer_size_(buffer_size), alignment_(alignment) {}
+  ~AlignedBufferPool() override;
+
+  // Returns a buffer of buffer_size() bytes, or nullptr if it couldn't be
+  // allocated. The buffer must be passed back to Release() once done.
+  void* Acquire();
+  void Release(void* buffer);
+
+  size_t buffer_size() const { return buffer_size_; }
+  size_t alignment() const { return alignment_; }
+
+  // ShrinkableCache overrides. The shrunk pool frees the buffers released
+  // instead of keeping them.
+  void ShrinkToMinimum() override;
+  void RestoreCapacity() override;
+
+ private:
+  const size_t buffer_size_;
+  const size_t alignment_;
+
+  base::Lock lock_;
+  // The buffers released and not acquired again, protected by |lock_|.
+  std::vector<void*> free_buffers_;
+  bool shrunk_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(AlignedBufferPool);
+};
+
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
 // It writes the data directly into the extents.
+//
+// When created with an AlignedBufferPool, the data is staged in a buffer from
+// the pool and only written in whole blocks from it, as required by file
+// descriptors opened with O_DIRECT. A final partial block is padded with zeros.
+// The buffer goes back to the pool on End().
 
 class DirectExtentWriter : public ExtentWriter {
  public:
   DirectExtentWriter() = default;
-  ~DirectExtentWriter() override = default;
+  explicit DirectExtentWriter(AlignedBufferPool* aligned_buffers)
+      : aligned_buffers_(aligned_buffers) {}
+  ~DirectExtentWriter() override;
 
   bool Init(FileDescriptorPtr fd,
             const std::vector<Extent>& extents,
-            uint32_t block_size) override {
-    fd_ = fd;
-    block_size_ = block_size;
-    extents_ = extents;
-    return true;
-  }
+            uint32_t block_size) override;
   bool Write(const void* bytes, size_t count) override;
-  bool EndImpl() override { return true; }
+  bool EndImpl() override;
 
  private:
+  // Writes |count| bytes at |offset|, or stages them in |staging_buffer_|.
+  bool WriteAt(const char* bytes, size_t count, off64_t offset);
+
+  // Writes the staged bytes, padded to a whole number of blocks.
+  bool FlushStagingBuffer();
+
   FileDescriptorPtr fd_{nullptr};
 
   size_t block_size_{0};
@@ -85,6 +136,13 @@ class DirectExtentWriter : public ExtentWriter {
   std::vector<Extent> extents_;
   // The next call to write should correspond to extents_[next_extent_index_]
   std::vector<Extent>::size_type next_extent_index_{0};
+
+  // The pool of the |staging_buffer_|, if any. The staging buffer holds
+  // |staged_bytes_| to be written at |staged_offset_|.
+  AlignedBufferPool* aligned_buffers_{nullptr};
+  char* staging_buffer_{nullptr};
+  size_t staged_bytes_{0};
+  off64_t staged_offset_{0};
 };
 
 // Takes an underlying ExtentWriter to which all operations are delegated.
@@ -103,6 +161,7 @@ class ZeroPadExtentWriter : public ExtentWriter {
             const std::vector<Extent>& extents,
             uint32_t block_size) override {
     block_size_ = block_size;
+    bytes_written_mod_block_size_ = 0;
     return underlying_extent_writer_->Init(fd, extents, block_size);
   }
   bool Write(const void* bytes, size_t count) override {
@@ -129,6 +188,56 @@ class ZeroPadExtentWriter : public ExtentWriter {
   size_t bytes_written_mod_block_size_{0};
 };
 
+// ZeroPaddedExtentWriter pads the data to a whole number of blocks like the
+// ZeroPadExtentWriter, but holds its UnderlyingWriter, constructed from the
+// passed arguments, instead of any ExtentWriter. The calls to the underlying
+// writer are then bound at compile time and can be inlined, as used by the
+// fixed writer stacks of the payload operations. The padding is written from
+// a static block of zeros.
+
+template <typename UnderlyingWriter>
+class ZeroPaddedExtentWriter : public ExtentWriter {
+ public:
+  template <typename... Args>
+  explicit ZeroPaddedExtentWriter(Args&&... args)
+      : underlying_writer_(std::forward<Args>(args)...) {}
+  ~ZeroPaddedExtentWriter() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const std::vector<Extent>& extents,
+            uint32_t block_size) override {
+    block_size_ = block_size;
+    bytes_written_mod_block_size_ = 0;
+    return underlying_writer_.Init(fd, extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(underlying_writer_.Write(bytes, count));
+    bytes_written_mod_block_size_ =
+        (bytes_written_mod_block_size_ + count) % block_size_;
+    return true;
+  }
+  bool EndImpl() override {
+    static const uint8_t kZeros[4096] = {};
+    if (bytes_written_mod_block_size_) {
+      size_t padding = block_size_ - bytes_written_mod_block_size_;
+      while (padding > 0) {
+        const size_t count = std::min(padding, sizeof(kZeros));
+        TEST_AND_RETURN_FALSE(underlying_writer_.Write(kZeros, count));
+        padding -= count;
+      }
+      bytes_written_mod_block_size_ = 0;
+    }
+    return underlying_writer_.End();
+  }
+
+ private:
+  UnderlyingWriter underlying_writer_;
+  size_t block_size_{0};
+  size_t bytes_written_mod_block_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ZeroPaddedExtentWriter);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_WRITER_H_
@@ -29,6 +29,7 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 using chromeos_update_engine::test_utils::ExpectVectorsEq;
 using std::min;
@@ -43,6 +44,17 @@ namespace {
 const size_t kBlockSize = 4096;
 }
 
+// An EintrSafeFileDescriptor that counts the calls to Write().
+class CountingFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  ssize_t Write(const void* buf, size_t count) override {
+    num_writes_++;
+    return EintrSafeFileDescriptor::Write(buf, count);
+  }
+
+  int num_writes_{0};
+};
+
 class ExtentWriterTest : public ::testing::Test {
  protected:
   void SetUp() override {
@@ -58,7 +70,7 @@ class ExtentWriterTest : public ::testing::Test {
   // resultant file should look like and ensure that the extent writer
   // wrote the file correctly.
   void WriteAlignedExtents(size_t chunk_size, size_t first_chunk_size);
-  void TestZeroPad(bool aligned_size);
+  void TestZeroPad(ExtentWriter* zero_pad_writer, bool aligned_size);
 
   FileDescriptorPtr fd_;
   test_utils::ScopedTempFile temp_file_{"ExtentWriterTest-file.XXXXXX"};
@@ -90,6 +102,35 @@ TEST_F(ExtentWriterTest, SimpleTest) {
   ExpectVectorsEq(expected_file, result_file);
 }
 
+TEST_F(ExtentWriterTest, AdjacentExtentsTest) {
+  // The first three extents are next to each other, so the data only needs
+  // two writes.
+  vector<Extent> extents = {ExtentForRange(0, 1),
+                            ExtentForRange(1, 2),
+                            ExtentForRange(3, 1),
+                            ExtentForRange(5, 1)};
+  brillo::Blob data(5 * kBlockSize);
+  test_utils::FillWithData(&data);
+
+  CountingFileDescriptor* counting_fd = new CountingFileDescriptor();
+  FileDescriptorPtr fd(counting_fd);
+  ASSERT_TRUE(fd->Open(temp_file_.path().c_str(), O_RDWR, 0600));
+  DirectExtentWriter direct_writer;
+  EXPECT_TRUE(direct_writer.Init(fd, extents, kBlockSize));
+  EXPECT_TRUE(direct_writer.Write(data.data(), data.size()));
+  EXPECT_TRUE(direct_writer.End());
+  EXPECT_EQ(2, counting_fd->num_writes_);
+  fd->Close();
+
+  brillo::Blob result_file;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &result_file));
+  brillo::Blob expected_file(data.begin(), data.begin() + 4 * kBlockSize);
+  expected_file.resize(5 * kBlockSize);
+  expected_file.insert(expected_file.end(),
+                       data.begin() + 4 * kBlockSize, data.end());
+  ExpectVectorsEq(expected_file, result_file);
+}
+
 TEST_F(ExtentWriterTest, ZeroLengthTest) {
   vector<Extent> extents;
   Extent extent;
@@ -163,15 +204,95 @@ void ExtentWriterTest::WriteAlignedExtents(size_t chunk_size,
   ExpectVectorsEq(expected_file, result_file);
 }
 
+TEST_F(ExtentWriterTest, AlignedBuffersTest) {
+  // The staging buffer is smaller than the first extent, and the data ends in
+  // the middle of the last block.
+  vector<Extent> extents = {ExtentForRange(2, 5), ExtentForRange(0, 2)};
+  brillo::Blob data(kBlockSize * 7 - 100);
+  test_utils::FillWithData(&data);
+
+  AlignedBufferPool aligned_buffers(kBlockSize * 2, kBlockSize);
+  DirectExtentWriter direct_writer(&aligned_buffers);
+  EXPECT_TRUE(direct_writer.Init(fd_, extents, kBlockSize));
+  for (size_t offset = 0; offset < data.size(); offset += 1000) {
+    EXPECT_TRUE(direct_writer.Write(
+        data.data() + offset, min(data.size() - offset, size_t{1000})));
+  }
+  EXPECT_TRUE(direct_writer.End());
+
+  brillo::Blob result_file;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &result_file));
+
+  // The end of the last block is padded with zeros.
+  brillo::Blob expected_file(data.begin() + kBlockSize * 5, data.end());
+  expected_file.resize(kBlockSize * 2);
+  expected_file.insert(expected_file.end(),
+                       data.begin(), data.begin() + kBlockSize * 5);
+  ExpectVectorsEq(expected_file, result_file);
+}
+
+TEST_F(ExtentWriterTest, ReinitTest) {
+  // A writer is initialized again for the next extents once it ended.
+  brillo::Blob data(kBlockSize * 2);
+  test_utils::FillWithData(&data);
+  AlignedBufferPool aligned_buffers(kBlockSize, kBlockSize);
+  ZeroPadExtentWriter writer(brillo::make_unique_ptr(
+      new DirectExtentWriter(&aligned_buffers)));
+  EXPECT_TRUE(writer.Init(fd_, {ExtentForRange(1, 1)}, kBlockSize));
+  EXPECT_TRUE(writer.Write(data.data() + kBlockSize, kBlockSize - 10));
+  EXPECT_TRUE(writer.End());
+  EXPECT_TRUE(writer.Init(fd_, {ExtentForRange(0, 1)}, kBlockSize));
+  EXPECT_TRUE(writer.Write(data.data(), kBlockSize));
+  EXPECT_TRUE(writer.End());
+
+  brillo::Blob result_file;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &result_file));
+  brillo::Blob expected_file(data.begin(), data.end() - 10);
+  expected_file.resize(kBlockSize * 2);
+  ExpectVectorsEq(expected_file, result_file);
+}
+
+TEST_F(ExtentWriterTest, AlignedBufferPoolTest) {
+  AlignedBufferPool aligned_buffers(kBlockSize, kBlockSize);
+  void* buffer = aligned_buffers.Acquire();
+  ASSERT_NE(nullptr, buffer);
+  EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(buffer) % kBlockSize);
+  aligned_buffers.Release(buffer);
+  // Released buffers are reused.
+  EXPECT_EQ(buffer, aligned_buffers.Acquire());
+  aligned_buffers.Release(buffer);
+}
+
 TEST_F(ExtentWriterTest, ZeroPadNullTest) {
-  TestZeroPad(true);
+  ZeroPadExtentWriter zero_pad_writer(
+      brillo::make_unique_ptr(new DirectExtentWriter()));
+  TestZeroPad(&zero_pad_writer, true);
 }
 
 TEST_F(ExtentWriterTest, ZeroPadFillTest) {
-  TestZeroPad(false);
+  ZeroPadExtentWriter zero_pad_writer(
+      brillo::make_unique_ptr(new DirectExtentWriter()));
+  TestZeroPad(&zero_pad_writer, false);
+}
+
+TEST_F(ExtentWriterTest, ZeroPaddedNullTest) {
+  ZeroPaddedExtentWriter<DirectExtentWriter> zero_pad_writer;
+  TestZeroPad(&zero_pad_writer, true);
+}
+
+TEST_F(ExtentWriterTest, ZeroPaddedFillTest) {
+  ZeroPaddedExtentWriter<DirectExtentWriter> zero_pad_writer;
+  TestZeroPad(&zero_pad_writer, false);
+}
+
+TEST_F(ExtentWriterTest, ZeroPaddedAlignedBuffersTest) {
+  AlignedBufferPool aligned_buffers(kBlockSize, kBlockSize);
+  ZeroPaddedExtentWriter<DirectExtentWriter> zero_pad_writer(&aligned_buffers);
+  TestZeroPad(&zero_pad_writer, false);
 }
 
-void ExtentWriterTest::TestZeroPad(bool aligned_size) {
+void ExtentWriterTest::TestZeroPad(ExtentWriter* zero_pad_writer,
+                                   bool aligned_size) {
   vector<Extent> extents;
   Extent extent;
   extent.set_start_block(1);
@@ -184,17 +305,14 @@ void ExtentWriterTest::TestZeroPad(bool aligned_size) {
   brillo::Blob data(kBlockSize * 2);
   test_utils::FillWithData(&data);
 
-  ZeroPadExtentWriter zero_pad_writer(
-      brillo::make_unique_ptr(new DirectExtentWriter()));
-
-  EXPECT_TRUE(zero_pad_writer.Init(fd_, extents, kBlockSize));
+  EXPECT_TRUE(zero_pad_writer->Init(fd_, extents, kBlockSize));
   size_t bytes_to_write = data.size();
   const size_t missing_bytes = (aligned_size ? 0 : 9);
   bytes_to_write -= missing_bytes;
   fd_->Seek(kBlockSize - missing_bytes, SEEK_SET);
   EXPECT_EQ(3, fd_->Write("xxx", 3));
-  ASSERT_TRUE(zero_pad_writer.Write(data.data(), bytes_to_write));
-  EXPECT_TRUE(zero_pad_writer.End());
+  ASSERT_TRUE(zero_pad_writer->Write(data.data(), bytes_to_write));
+  EXPECT_TRUE(zero_pad_writer->End());
 
   EXPECT_EQ(static_cast<off_t>(data.size()),
             utils::FileSize(temp_file_.path()));
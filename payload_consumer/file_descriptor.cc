@@ -17,10 +17,12 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <base/posix/eintr_wrapper.h>
 
@@ -123,6 +125,20 @@ bool EintrSafeFileDescriptor::BlkIoctl(int request,
 #endif  // defined(BLKZEROOUT)
 }
 
+bool EintrSafeFileDescriptor::ZeroRange(uint64_t start, uint64_t length) {
+#ifndef FALLOC_FL_ZERO_RANGE
+  return false;
+#else  // defined(FALLOC_FL_ZERO_RANGE)
+  CHECK_GE(fd_, 0);
+  return HANDLE_EINTR(fallocate(fd_, FALLOC_FL_ZERO_RANGE, start, length)) == 0;
+#endif  // defined(FALLOC_FL_ZERO_RANGE)
+}
+
+bool EintrSafeFileDescriptor::Flush() {
+  CHECK_GE(fd_, 0);
+  return fsync(fd_) == 0;
+}
+
 bool EintrSafeFileDescriptor::Close() {
   CHECK_GE(fd_, 0);
   if (IGNORE_EINTR(close(fd_)))
@@ -93,6 +93,17 @@ class FileDescriptor {
                         uint64_t length,
                         int* result) = 0;
 
+  // Makes the |length| bytes at |start| of a regular file read back as zeros
+  // without writing them, using fallocate() with FALLOC_FL_ZERO_RANGE. Like
+  // writing zeros, it extends the file if needed. Returns whether the range
+  // was zeroed; it fails if the file or its filesystem doesn't support it.
+  virtual bool ZeroRange(uint64_t start, uint64_t length) = 0;
+
+  // Flushes the data written to the file descriptor to the underlying storage.
+  // The descriptor must be open prior to this call. Returns true on success,
+  // false otherwise. Specific implementations may set errno accordingly.
+  virtual bool Flush() = 0;
+
   // Closes a file descriptor. The descriptor must be open prior to this call.
   // Returns true on success, false otherwise. Specific implementations may set
   // errno accordingly.
@@ -128,6 +139,8 @@ class EintrSafeFileDescriptor : public FileDescriptor {
                 uint64_t start,
                 uint64_t length,
                 int* result) override;
+  bool ZeroRange(uint64_t start, uint64_t length) override;
+  bool Flush() override;
   bool Close() override;
   void Reset() override;
   bool IsSettingErrno() override {
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -26,13 +27,19 @@
 #include <string>
 
 #include <base/bind.h>
+#include <base/location.h>
+#include <base/strings/stringprintf.h>
+#include <brillo/data_encoding.h>
 #include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/source_hash_precomputer.h"
 
+using brillo::MessageLoop;
 using std::string;
 
 namespace chromeos_update_engine {
@@ -41,11 +48,17 @@ namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
 }  // namespace
 
+FilesystemVerifierAction::PartitionHashing::~PartitionHashing() {
+  if (hash_task != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(hash_task);
+}
+
 FilesystemVerifierAction::FilesystemVerifierAction(
     const BootControlInterface* boot_control,
     VerifierMode verifier_mode)
     : verifier_mode_(verifier_mode),
-      boot_control_(boot_control) {}
+      boot_control_(boot_control),
+      read_buffer_size_(kReadFileBufferSize) {}
 
 void FilesystemVerifierAction::PerformAction() {
   // Will tell the ActionProcessor we've failed if we return.
@@ -57,6 +70,14 @@ void FilesystemVerifierAction::PerformAction() {
   }
   install_plan_ = GetInputObject();
 
+  if (source_hashes_not_needed_) {
+    LOG(INFO) << "The source partition hashes aren't needed.";
+    if (HasOutputPipe())
+      SetOutputObject(install_plan_);
+    abort_action_completer.set_code(ErrorCode::kSuccess);
+    return;
+  }
+
   // For delta updates (major version 1) we need to populate the source
   // partition hash if not pre-populated.
   if (install_plan_.payload_type == InstallPayloadType::kDelta &&
@@ -97,48 +118,222 @@ void FilesystemVerifierAction::PerformAction() {
     LOG(INFO) << "No partitions to verify.";
     if (HasOutputPipe())
       SetOutputObject(install_plan_);
+    if (verifier_mode_ == VerifierMode::kComputeSourceHash &&
+        !source_hashes_callback_.is_null()) {
+      source_hashes_callback_.Run(install_plan_);
+    }
     abort_action_completer.set_code(ErrorCode::kSuccess);
     return;
   }
 
+  hashing_started_ = true;
   StartPartitionHashing();
   abort_action_completer.set_should_complete(false);
 }
 
+void FilesystemVerifierAction::StopComputingSourceHashes() {
+  if (verifier_mode_ != VerifierMode::kComputeSourceHash || finished_)
+    return;
+  source_hashes_not_needed_ = true;
+  // Otherwise PerformAction() completes the action.
+  if (!hashing_started_)
+    return;
+  LOG(INFO) << "The source partition hashes aren't needed anymore, stopping "
+            << "their computation.";
+  // Destroying the streams cancels their pending reads.
+  hashings_.clear();
+  finished_ = true;
+  if (HasOutputPipe())
+    SetOutputObject(install_plan_);
+  processor_->ActionComplete(this, ErrorCode::kSuccess);
+}
+
 void FilesystemVerifierAction::TerminateProcessing() {
   cancelled_ = true;
   Cleanup(ErrorCode::kSuccess);  // error code is ignored if canceled_ is true.
 }
 
 bool FilesystemVerifierAction::IsCleanupPending() const {
-  return src_stream_ != nullptr;
+  return !hashings_.empty();
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
-  src_stream_.reset();
-  // This memory is not used anymore.
-  buffer_.clear();
+  // Destroying the streams cancels their pending reads, and the buffer memory
+  // is not used anymore.
+  hashings_.clear();
+  finished_ = true;
 
   if (cancelled_)
     return;
   if (code == ErrorCode::kSuccess && HasOutputPipe())
     SetOutputObject(install_plan_);
+  if (code == ErrorCode::kSuccess &&
+      verifier_mode_ == VerifierMode::kComputeSourceHash &&
+      !source_hashes_callback_.is_null()) {
+    source_hashes_callback_.Run(install_plan_);
+  }
   processor_->ActionComplete(this, code);
 }
 
 void FilesystemVerifierAction::StartPartitionHashing() {
-  if (partition_index_ == install_plan_.partitions.size()) {
-    // We never called this action with kVerifySourceHash directly, if we are in
-    // this mode, it means the target partition verification has failed, so we
-    // should set the error code to reflect the error in target.
-    if (verifier_mode_ == VerifierMode::kVerifySourceHash)
-      Cleanup(ErrorCode::kNewRootfsVerificationError);
+  // A partition may finish hashing while it's being started, in which case
+  // the loop below already starts the next ones.
+  if (starting_partitions_)
+    return;
+  const size_t max_hashings =
+      (hash_partitions_in_parallel_ ? install_plan_.partitions.size() : 1) *
+      stripes_per_partition_;
+  starting_partitions_ = true;
+  while (!finished_ && partition_index_ < install_plan_.partitions.size() &&
+         hashings_.size() < max_hashings) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    if (next_stripe_ > 0) {
+      StartHashing(partition_index_, next_stripe_);
+      if (++next_stripe_ == NumStripes(partition)) {
+        next_stripe_ = 0;
+        partition_index_++;
+      }
+      continue;
+    }
+    if (verifier_mode_ == VerifierMode::kVerifyTargetHash &&
+        partition.target_hash_verified) {
+      LOG(INFO) << "Skipping partition " << partition_index_ << " ("
+                << partition.name << "), already verified while applying "
+                << "the payload.";
+      partition_index_++;
+      continue;
+    }
+    if (verifier_mode_ == VerifierMode::kComputeSourceHash &&
+        LoadCachedSourceHash(&install_plan_.partitions[partition_index_])) {
+      partition_index_++;
+      continue;
+    }
+    // The payload doesn't read from the partitions without a source hash.
+    if (verifier_mode_ == VerifierMode::kVerifySourceHash &&
+        partition.source_hash.empty()) {
+      partition_index_++;
+      continue;
+    }
+    StartHashing(partition_index_, 0);
+    if (NumStripes(partition) > 1)
+      next_stripe_ = 1;
     else
-      Cleanup(ErrorCode::kSuccess);
+      partition_index_++;
+  }
+  starting_partitions_ = false;
+  if (finished_ || !hashings_.empty())
+    return;
+
+  // When the source partitions are verified after the target partition
+  // verification failed, the error code reflects the error in target.
+  if (target_verification_failed_)
+    Cleanup(ErrorCode::kNewRootfsVerificationError);
+  else
+    Cleanup(ErrorCode::kSuccess);
+}
+
+string FilesystemVerifierAction::SourceHashCacheKey(
+    const InstallPlan::Partition& partition) {
+  string part_path, boot_id;
+  if (!boot_control_->GetPartitionDevice(
+          partition.name, install_plan_.source_slot, &part_path) ||
+      !utils::GetBootId(&boot_id)) {
+    return "";
+  }
+  return base::StringPrintf("%s\n%" PRIu64 "\n%s\n%s",
+                            part_path.c_str(),
+                            partition.source_size,
+                            boot_id.c_str(),
+                            std::to_string(install_plan_.source_slot).c_str());
+}
+
+bool FilesystemVerifierAction::LoadCachedSourceHash(
+    InstallPlan::Partition* partition) {
+  if (!source_hash_cache_)
+    return false;
+  string value;
+  if (!source_hash_cache_->GetString(
+          kPrefsSourceHashOfPartitionPrefix + partition->name, &value)) {
+    return false;
+  }
+  // The value is the key followed by the base64-encoded hash on its own line.
+  const string key = SourceHashCacheKey(*partition);
+  const size_t separator = value.rfind('\n');
+  brillo::Blob hash;
+  if (key.empty() || separator == string::npos ||
+      value.compare(0, separator, key) != 0 ||
+      !brillo::data_encoding::Base64Decode(value.substr(separator + 1),
+                                           &hash) ||
+      hash.empty()) {
+    return false;
+  }
+  LOG(INFO) << "Using the cached hash of partition " << partition->name
+            << ": " << value.substr(separator + 1);
+  partition->source_hash = hash;
+  return true;
+}
+
+void FilesystemVerifierAction::StoreCachedSourceHash(
+    const InstallPlan::Partition& partition) {
+  if (!source_hash_cache_)
+    return;
+  const string key = SourceHashCacheKey(partition);
+  if (key.empty())
+    return;
+  LOG_IF(WARNING,
+         !source_hash_cache_->SetString(
+             kPrefsSourceHashOfPartitionPrefix + partition.name,
+             key + "\n" +
+                 brillo::data_encoding::Base64Encode(partition.source_hash)))
+      << "Unable to cache the hash of partition " << partition.name;
+}
+
+void FilesystemVerifierAction::ResumeFromPrecomputedHashes(
+    const InstallPlan::Partition& partition, PartitionHashing* hashing) {
+  SourceHashPrecomputer::PrecomputedHashes hashes;
+  if (!source_hash_cache_ ||
+      !SourceHashPrecomputer::LoadHashes(boot_control_,
+                                         source_hash_cache_,
+                                         partition.name,
+                                         install_plan_.source_slot,
+                                         &hashes)) {
     return;
   }
+  const uint64_t num_chunks =
+      std::min(static_cast<uint64_t>(hashes.contexts.size()),
+               partition.source_size / hashes.chunk_size);
+  if (num_chunks == 0 ||
+      !hashing->hasher.SetContext(hashes.contexts[num_chunks - 1])) {
+    return;
+  }
+  hashing->offset = num_chunks * hashes.chunk_size;
+  hashing->remaining_size -= hashing->offset;
+  LOG(INFO) << "Using the precomputed hash of the first " << hashing->offset
+            << " bytes of partition " << partition.name << ".";
+}
+
+bool FilesystemVerifierAction::VerifiesChunks(
+    const InstallPlan::Partition& partition) const {
+  return verifier_mode_ == VerifierMode::kVerifyTargetHash &&
+         !partition.target_chunk_hashes.empty();
+}
+
+size_t FilesystemVerifierAction::NumStripes(
+    const InstallPlan::Partition& partition) const {
+  if (!VerifiesChunks(partition))
+    return 1;
+  return std::max(static_cast<size_t>(1),
+                  std::min(stripes_per_partition_,
+                           partition.target_chunk_hashes.size()));
+}
+
+void FilesystemVerifierAction::StartHashing(size_t partition_index,
+                                            size_t stripe) {
   InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
+      install_plan_.partitions[partition_index];
+  std::unique_ptr<PartitionHashing> hashing(new PartitionHashing());
+  hashing->partition_index = partition_index;
 
   string part_path;
   switch (verifier_mode_) {
@@ -146,54 +341,119 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     case VerifierMode::kVerifySourceHash:
       boot_control_->GetPartitionDevice(
           partition.name, install_plan_.source_slot, &part_path);
-      remaining_size_ = partition.source_size;
+      hashing->remaining_size = partition.source_size;
+      ResumeFromPrecomputedHashes(partition, hashing.get());
       break;
     case VerifierMode::kVerifyTargetHash:
       boot_control_->GetPartitionDevice(
           partition.name, install_plan_.target_slot, &part_path);
-      remaining_size_ = partition.target_size;
+      hashing->remaining_size = partition.target_size;
       break;
   }
-  LOG(INFO) << "Hashing partition " << partition_index_ << " ("
+  LOG(INFO) << "Hashing partition " << partition_index << " ("
             << partition.name << ") on device " << part_path;
   if (part_path.empty())
     return Cleanup(ErrorCode::kFilesystemVerifierError);
 
+  if (VerifiesChunks(partition)) {
+    // Each stripe covers a range of whole chunks.
+    const size_t num_chunks = partition.target_chunk_hashes.size();
+    const size_t num_stripes = NumStripes(partition);
+    const size_t first_chunk = num_chunks * stripe / num_stripes;
+    const size_t end_chunk = num_chunks * (stripe + 1) / num_stripes;
+    const int64_t end = std::min(
+        static_cast<int64_t>(end_chunk * partition.target_hash_chunk_size),
+        hashing->remaining_size);
+    hashing->verify_chunks = true;
+    hashing->chunk_hasher.reset(new HashCalculator());
+    hashing->next_chunk = first_chunk;
+    hashing->offset = first_chunk * partition.target_hash_chunk_size;
+    hashing->remaining_size = end - hashing->offset;
+    if (stripe == 0)
+      partition.target_corrupted_ranges.clear();
+    if (num_stripes > 1) {
+      LOG(INFO) << "Verifying the chunks " << first_chunk << " to "
+                << end_chunk - 1 << " of " << partition.name << ", stripe "
+                << stripe + 1 << " of " << num_stripes << ".";
+    }
+  }
+  hashing->size = hashing->remaining_size;
+  hashing->next_read_offset = hashing->offset;
+  hashing->start_time = base::TimeTicks::Now();
+
+  if (num_read_buffers_ > 1) {
+    hashing->buffers.resize(num_read_buffers_,
+                            brillo::Blob(read_buffer_size_));
+    hashing->buffers_memory.Set(num_read_buffers_ * read_buffer_size_);
+    hashing->async_fd.reset(
+        new AsyncFileDescriptor(num_read_buffers_, num_read_buffers_));
+    hashing->async_fd->set_throttle(storage_throttle_);
+    if (!hashing->async_fd->Open(part_path.c_str(), O_RDONLY)) {
+      PLOG(ERROR) << "Unable to open " << part_path << " for reading";
+      return Cleanup(ErrorCode::kFilesystemVerifierError);
+    }
+    PartitionHashing* started = hashing.get();
+    hashings_.push_back(std::move(hashing));
+    // The completed reads are hashed from the main loop, so other partitions
+    // and events are handled while the I/O threads read.
+    started->hash_task = MessageLoop::current()->WatchFileDescriptor(
+        FROM_HERE,
+        started->async_fd->completion_fd(),
+        MessageLoop::WatchMode::kWatchRead,
+        true,
+        base::Bind(&FilesystemVerifierAction::HashCompletedReads,
+                   base::Unretained(this),
+                   base::Unretained(started)));
+    if (started->hash_task == MessageLoop::kTaskIdNull) {
+      LOG(ERROR) << "Unable to watch the reads from " << part_path;
+      return Cleanup(ErrorCode::kError);
+    }
+    SubmitReads(started);
+    if (started->reads_in_flight.empty())
+      FinishPartitionHashing(started);
+    return;
+  }
+
   brillo::ErrorPtr error;
-  src_stream_ = brillo::FileStream::Open(
+  hashing->src_stream = brillo::FileStream::Open(
       base::FilePath(part_path),
       brillo::Stream::AccessMode::READ,
       brillo::FileStream::Disposition::OPEN_EXISTING,
       &error);
 
-  if (!src_stream_) {
+  if (!hashing->src_stream ||
+      (hashing->offset &&
+       !hashing->src_stream->SetPosition(hashing->offset, &error))) {
     LOG(ERROR) << "Unable to open " << part_path << " for reading";
     return Cleanup(ErrorCode::kFilesystemVerifierError);
   }
 
-  buffer_.resize(kReadFileBufferSize);
-  read_done_ = false;
-  hasher_.reset(new HashCalculator());
+  hashing->buffer.resize(read_buffer_size_);
+  hashing->buffers_memory.Set(read_buffer_size_);
+  PartitionHashing* started = hashing.get();
+  hashings_.push_back(std::move(hashing));
 
   // Start the first read.
-  ScheduleRead();
+  ScheduleRead(started);
 }
 
-void FilesystemVerifierAction::ScheduleRead() {
-  size_t bytes_to_read = std::min(static_cast<int64_t>(buffer_.size()),
-                                  remaining_size_);
+void FilesystemVerifierAction::ScheduleRead(PartitionHashing* hashing) {
+  size_t bytes_to_read = std::min(static_cast<int64_t>(hashing->buffer.size()),
+                                  hashing->remaining_size);
   if (!bytes_to_read) {
-    OnReadDoneCallback(0);
+    OnReadDoneCallback(hashing, 0);
     return;
   }
 
-  bool read_async_ok = src_stream_->ReadAsync(
-    buffer_.data(),
+  bool read_async_ok = hashing->src_stream->ReadAsync(
+    hashing->buffer.data(),
     bytes_to_read,
     base::Bind(&FilesystemVerifierAction::OnReadDoneCallback,
-               base::Unretained(this)),
+               base::Unretained(this),
+               base::Unretained(hashing)),
     base::Bind(&FilesystemVerifierAction::OnReadErrorCallback,
-               base::Unretained(this)),
+               base::Unretained(this),
+               base::Unretained(hashing)),
     nullptr);
 
   if (!read_async_ok) {
@@ -202,13 +462,62 @@ void FilesystemVerifierAction::ScheduleRead() {
   }
 }
 
-void FilesystemVerifierAction::OnReadDoneCallback(size_t bytes_read) {
+void FilesystemVerifierAction::SubmitReads(PartitionHashing* hashing) {
+  const int64_t end = hashing->offset + hashing->size;
+  while (hashing->reads_in_flight.size() < hashing->buffers.size() &&
+         hashing->next_read_offset < end) {
+    brillo::Blob* buffer = &hashing->buffers[hashing->next_buffer];
+    size_t bytes_to_read = std::min(
+        static_cast<int64_t>(buffer->size()),
+        end - hashing->next_read_offset);
+    hashing->async_fd->SubmitRead(
+        buffer->data(), bytes_to_read, hashing->next_read_offset);
+    hashing->reads_in_flight.emplace_back(hashing->next_buffer, bytes_to_read);
+    hashing->next_read_offset += bytes_to_read;
+    hashing->next_buffer = (hashing->next_buffer + 1) % hashing->buffers.size();
+  }
+}
+
+void FilesystemVerifierAction::HashCompletedReads(PartitionHashing* hashing) {
+  if (cancelled_)
+    return Cleanup(ErrorCode::kError);
+
+  // The completions are cleared first, so a read completing meanwhile wakes
+  // up the watch again.
+  hashing->async_fd->ClearCompletions();
+  while (!hashing->reads_in_flight.empty() &&
+         hashing->async_fd->IsNextDone()) {
+    const size_t buffer_index = hashing->reads_in_flight.front().first;
+    const size_t bytes_read = hashing->reads_in_flight.front().second;
+    hashing->reads_in_flight.pop_front();
+    if (!hashing->async_fd->WaitForNext()) {
+      LOG(ERROR) << "Failed to read " << bytes_read << " bytes from partition "
+                 << install_plan_.partitions[hashing->partition_index].name;
+      return Cleanup(ErrorCode::kFilesystemVerifierError);
+    }
+    // The buffer is hashed before it's read into again.
+    if (!UpdateHash(hashing, hashing->buffers[buffer_index].data(),
+                    bytes_read)) {
+      LOG(ERROR) << "Unable to update the hash.";
+      return Cleanup(ErrorCode::kError);
+    }
+    hashing->remaining_size -= bytes_read;
+  }
+  SubmitReads(hashing);
+  if (hashing->reads_in_flight.empty())
+    FinishPartitionHashing(hashing);
+}
+
+void FilesystemVerifierAction::OnReadDoneCallback(PartitionHashing* hashing,
+                                                  size_t bytes_read) {
   if (bytes_read == 0) {
-    read_done_ = true;
+    hashing->read_done = true;
   } else {
-    remaining_size_ -= bytes_read;
-    CHECK(!read_done_);
-    if (!hasher_->Update(buffer_.data(), bytes_read)) {
+    if (storage_throttle_)
+      storage_throttle_->WaitForIO(false, bytes_read);
+    hashing->remaining_size -= bytes_read;
+    CHECK(!hashing->read_done);
+    if (!UpdateHash(hashing, hashing->buffer.data(), bytes_read)) {
       LOG(ERROR) << "Unable to update the hash.";
       Cleanup(ErrorCode::kError);
       return;
@@ -219,41 +528,156 @@ void FilesystemVerifierAction::OnReadDoneCallback(size_t bytes_read) {
   if (cancelled_)
     return Cleanup(ErrorCode::kError);
 
-  if (read_done_ || remaining_size_ == 0) {
-    if (remaining_size_ != 0) {
-      LOG(ERROR) << "Failed to read the remaining " << remaining_size_
+  if (hashing->read_done || hashing->remaining_size == 0) {
+    if (hashing->remaining_size != 0) {
+      LOG(ERROR) << "Failed to read the remaining " << hashing->remaining_size
                  << " bytes from partition "
-                 << install_plan_.partitions[partition_index_].name;
+                 << install_plan_.partitions[hashing->partition_index].name;
       return Cleanup(ErrorCode::kFilesystemVerifierError);
     }
-    return FinishPartitionHashing();
+    return FinishPartitionHashing(hashing);
+  }
+  ScheduleRead(hashing);
+}
+
+bool FilesystemVerifierAction::UpdateHash(PartitionHashing* hashing,
+                                          const uint8_t* data,
+                                          size_t count) {
+  if (!hashing->verify_chunks)
+    return hashing->hasher.Update(data, count);
+  const int64_t chunk_size =
+      install_plan_.partitions[hashing->partition_index].target_hash_chunk_size;
+  while (count > 0) {
+    const size_t bytes = std::min(static_cast<int64_t>(count),
+                                  chunk_size - hashing->chunk_bytes);
+    TEST_AND_RETURN_FALSE(hashing->chunk_hasher->Update(data, bytes));
+    hashing->chunk_bytes += bytes;
+    data += bytes;
+    count -= bytes;
+    if (hashing->chunk_bytes == chunk_size)
+      TEST_AND_RETURN_FALSE(FinishChunk(hashing));
+  }
+  return true;
+}
+
+bool FilesystemVerifierAction::FinishChunk(PartitionHashing* hashing) {
+  InstallPlan::Partition& partition =
+      install_plan_.partitions[hashing->partition_index];
+  TEST_AND_RETURN_FALSE(hashing->chunk_hasher->Finalize());
+  TEST_AND_RETURN_FALSE(hashing->next_chunk <
+                        partition.target_chunk_hashes.size());
+  if (hashing->chunk_hasher->raw_hash() !=
+      partition.target_chunk_hashes[hashing->next_chunk]) {
+    // Consecutive chunks of the same stripe are reported as a single range.
+    const uint64_t offset =
+        hashing->next_chunk * partition.target_hash_chunk_size;
+    auto* ranges = &partition.target_corrupted_ranges;
+    if (!ranges->empty() &&
+        ranges->back().first + ranges->back().second == offset) {
+      ranges->back().second += hashing->chunk_bytes;
+    } else {
+      ranges->emplace_back(offset, hashing->chunk_bytes);
+    }
   }
-  ScheduleRead();
+  hashing->next_chunk++;
+  hashing->chunk_bytes = 0;
+  hashing->chunk_hasher.reset(new HashCalculator());
+  return true;
 }
 
 void FilesystemVerifierAction::OnReadErrorCallback(
+      PartitionHashing* hashing,
       const brillo::Error* error) {
   // TODO(deymo): Transform the read-error into an specific ErrorCode.
   LOG(ERROR) << "Asynchronous read failed.";
   Cleanup(ErrorCode::kError);
 }
 
-void FilesystemVerifierAction::FinishPartitionHashing() {
-  if (!hasher_->Finalize()) {
-    LOG(ERROR) << "Unable to finalize the hash.";
-    return Cleanup(ErrorCode::kError);
+void FilesystemVerifierAction::FinishPartitionHashing(
+    PartitionHashing* hashing) {
+  const size_t partition_index = hashing->partition_index;
+  InstallPlan::Partition& partition = install_plan_.partitions[partition_index];
+  brillo::Blob raw_hash;
+  if (hashing->verify_chunks) {
+    // The last chunk of the partition may be shorter.
+    if (hashing->chunk_bytes > 0 && !FinishChunk(hashing)) {
+      LOG(ERROR) << "Unable to finalize the chunk hash.";
+      return Cleanup(ErrorCode::kError);
+    }
+  } else {
+    if (!hashing->hasher.Finalize()) {
+      LOG(ERROR) << "Unable to finalize the hash.";
+      return Cleanup(ErrorCode::kError);
+    }
+    raw_hash = hashing->hasher.raw_hash();
+    LOG(INFO) << "Hash of " << partition.name << ": "
+              << hashing->hasher.hash();
+  }
+  const base::TimeTicks end_time = base::TimeTicks::Now();
+  const double seconds = (end_time - hashing->start_time).InSecondsF();
+  LOG(INFO) << "Hashed " << hashing->size << " bytes of " << partition.name
+            << " in " << base::StringPrintf("%.3f", seconds) << "s ("
+            << base::StringPrintf(
+                   "%.1f",
+                   seconds > 0 ? hashing->size / seconds / (1024 * 1024) : 0.0)
+            << " MiB/s).";
+  PartitionStats& stats = partition_stats_[partition.name];
+  if (stats.start_time.is_null() || hashing->start_time < stats.start_time)
+    stats.start_time = hashing->start_time;
+  stats.end_time = std::max(stats.end_time, end_time);
+  stats.bytes += hashing->size;
+
+  const bool verify_chunks = hashing->verify_chunks;
+  if (hashing->src_stream)
+    hashing->src_stream->CloseBlocking(nullptr);
+  hashings_.erase(std::find_if(
+      hashings_.begin(),
+      hashings_.end(),
+      [hashing](const std::unique_ptr<PartitionHashing>& other) {
+        return other.get() == hashing;
+      }));
+
+  bool matches = true;
+  if (verify_chunks) {
+    // The partition is verified once all its stripes are.
+    if (partition_index_ <= partition_index ||
+        std::any_of(hashings_.begin(),
+                    hashings_.end(),
+                    [partition_index](
+                        const std::unique_ptr<PartitionHashing>& other) {
+                      return other->partition_index == partition_index;
+                    })) {
+      return StartPartitionHashing();
+    }
+    auto* ranges = &partition.target_corrupted_ranges;
+    std::sort(ranges->begin(), ranges->end());
+    for (size_t i = 1; i < ranges->size();) {
+      if ((*ranges)[i - 1].first + (*ranges)[i - 1].second ==
+          (*ranges)[i].first) {
+        (*ranges)[i - 1].second += (*ranges)[i].second;
+        ranges->erase(ranges->begin() + i);
+      } else {
+        i++;
+      }
+    }
+    for (const auto& range : *ranges) {
+      LOG(ERROR) << "The " << range.second << " bytes at offset "
+                 << range.first << " of " << partition.name
+                 << " don't match their chunk hashes.";
+    }
+    matches = ranges->empty();
+  } else if (verifier_mode_ == VerifierMode::kVerifyTargetHash) {
+    matches = partition.target_hash == raw_hash;
   }
-  InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
-  LOG(INFO) << "Hash of " << partition.name << ": " << hasher_->hash();
 
+  bool restart = false;
   switch (verifier_mode_) {
     case VerifierMode::kComputeSourceHash:
-      partition.source_hash = hasher_->raw_hash();
-      partition_index_++;
+      partition.source_hash = raw_hash;
+      StoreCachedSourceHash(partition);
       break;
     case VerifierMode::kVerifyTargetHash:
-      if (partition.target_hash != hasher_->raw_hash()) {
+      if (!matches) {
         LOG(ERROR) << "New '" << partition.name
                    << "' partition verification failed.";
         if (DeltaPerformer::kSupportedMinorPayloadVersion <
@@ -264,24 +688,27 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         // match, we need to switch to kVerifySourceHash mode to check if it's
         // because the source partition does not match either.
         verifier_mode_ = VerifierMode::kVerifySourceHash;
-        partition_index_ = 0;
-      } else {
-        partition_index_++;
+        target_verification_failed_ = true;
+        restart = true;
       }
       break;
     case VerifierMode::kVerifySourceHash:
-      if (partition.source_hash != hasher_->raw_hash()) {
+      if (partition.source_hash != raw_hash) {
         LOG(ERROR) << "Old '" << partition.name
                    << "' partition verification failed.";
         return Cleanup(ErrorCode::kDownloadStateInitializationError);
       }
-      partition_index_++;
       break;
   }
+
+  if (restart) {
+    // The target partitions still being hashed are abandoned, and all the
+    // source partitions are hashed from the first one.
+    hashings_.clear();
+    partition_index_ = 0;
+    next_stripe_ = 0;
+  }
   // Start hashing the next partition, if any.
-  hasher_.reset();
-  buffer_.clear();
-  src_stream_->CloseBlocking(nullptr);
   StartPartitionHashing();
 }
 
@@ -20,15 +20,26 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <base/callback.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_tracker.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/payload_consumer/async_file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
 
 // This action will hash all the partitions of a single slot involved in the
 // update (either source or target slot). The hashes are then either stored in
@@ -41,7 +52,9 @@ namespace chromeos_update_engine {
 // it computes the source_hash of all the partitions in the InstallPlan, based
 // on the already populated source_size values. On kVerifyTargetHash it computes
 // the hash on the target partitions based on the already populated size and
-// verifies it matches the one in the target_hash in the InstallPlan.
+// verifies it matches the one in the target_hash in the InstallPlan. On
+// kVerifySourceHash it verifies the source partitions with a source_hash in the
+// InstallPlan match it, skipping the other ones.
 enum class VerifierMode {
   kComputeSourceHash,
   kVerifyTargetHash,
@@ -56,6 +69,84 @@ class FilesystemVerifierAction : public InstallPlanAction {
   void PerformAction() override;
   void TerminateProcessing() override;
 
+  // Sets whether all the partitions are hashed at the same time, each one
+  // reading from its own stream, instead of one after the other. This helps on
+  // devices where the partitions are on independent storage, but only makes
+  // the reads of partitions on the same disk compete with each other, so the
+  // attempters leave it off. Must be called before PerformAction().
+  void set_hash_partitions_in_parallel(bool parallel) {
+    hash_partitions_in_parallel_ = parallel;
+  }
+
+  // Sets the number of buffers of |buffer_size| bytes each partition is read
+  // into. With a single buffer, the default, the partition is read from the
+  // main loop one buffer at a time. With more buffers, they are read by as
+  // many I/O threads, so reading the next buffers overlaps hashing the current
+  // one. Devices with fast storage benefit from more and larger buffers. Must
+  // be called before PerformAction().
+  void set_read_buffers(size_t num_buffers, size_t buffer_size) {
+    num_read_buffers_ = num_buffers;
+    read_buffer_size_ = buffer_size;
+  }
+
+  // Sets the number of stripes the target partitions with chunk hashes are
+  // split in, each one a range of whole chunks read from its own stream. The
+  // stripes are verified at the same time, without computing the hash of the
+  // whole partition, and the chunks not matching their hash are reported. The
+  // default is one stripe. Must be called before PerformAction().
+  void set_stripes_per_partition(size_t num_stripes) {
+    stripes_per_partition_ = num_stripes;
+  }
+
+  // Sets the |throttle| delaying the reads of the partitions as slower storage
+  // would, see StorageThrottle. With a single read buffer, the delay blocks
+  // the main loop after each read. Not set by default. Must be called before
+  // PerformAction().
+  void set_storage_throttle(std::shared_ptr<StorageThrottle> throttle) {
+    storage_throttle_ = throttle;
+  }
+
+  // Sets the |prefs| where the source partition hashes computed in
+  // kComputeSourceHash mode are saved, so the next attempts during the same
+  // boot reuse them instead of reading the partitions again. The hashes
+  // precomputed there by the SourceHashPrecomputer are used as well. The
+  // source slot isn't modified while booted from it. Not set by default.
+  void set_source_hash_cache(PrefsInterface* prefs) {
+    source_hash_cache_ = prefs;
+  }
+
+  // Sets the |callback| called with the InstallPlan, including the computed
+  // source_hash of its partitions, when the kComputeSourceHash mode succeeds,
+  // right before the action completes. This passes the hashes to an action
+  // running at the same time, which can't receive them through an ActionPipe.
+  using SourceHashesCallback = base::Callback<void(const InstallPlan&)>;
+  void set_source_hashes_callback(const SourceHashesCallback& callback) {
+    source_hashes_callback_ = callback;
+  }
+
+  // Stops computing the source partition hashes in kComputeSourceHash mode,
+  // when the action applying the payload found it doesn't need them. The
+  // action then completes successfully, right away if it was running, without
+  // calling the source hashes callback. Does nothing in the other modes or
+  // once the action finished.
+  void StopComputingSourceHashes();
+
+  // The bytes hashed from a partition, from the start of its first stripe to
+  // the end of its last one.
+  struct PartitionStats {
+    int64_t bytes{0};
+    base::TimeTicks start_time;
+    base::TimeTicks end_time;
+  };
+
+  // Returns the stats of the partitions hashed, by partition name. The
+  // partitions whose hash was cached aren't included.
+  const std::map<std::string, PartitionStats>& partition_stats() const {
+    return partition_stats_;
+  }
+
+  VerifierMode verifier_mode() const { return verifier_mode_; }
+
   // Used for testing. Return true if Cleanup() has not yet been called due
   // to a callback upon the completion or cancellation of the verifier action.
   // A test should wait until IsCleanupPending() returns false before
@@ -71,21 +162,125 @@ class FilesystemVerifierAction : public InstallPlanAction {
   FRIEND_TEST(FilesystemVerifierActionTest,
               RunAsRootDetermineFilesystemSizeTest);
 
-  // Starts the hashing of the current partition. If there aren't any partitions
-  // remaining to be hashed, if finishes the action.
+  // The state of the hashing of a single partition.
+  struct PartitionHashing {
+    // Cancels the |hash_task|, if any.
+    ~PartitionHashing();
+
+    // The index in the install_plan_.partitions vector of the partition.
+    size_t partition_index;
+
+    // The offset of the range of the partition hashed.
+    int64_t offset{0};
+
+    // If not null, the FileStream used to read from the device. Only used with
+    // a single read buffer.
+    brillo::StreamPtr src_stream;
+
+    // Buffer for storing data we read.
+    brillo::Blob buffer;
+
+    // With several read buffers, the buffers, the file read into them by the
+    // I/O threads, and the reads in flight in submission order, as the index
+    // of their buffer and their size. The buffers must outlive the reads.
+    std::vector<brillo::Blob> buffers;
+    std::unique_ptr<AsyncFileDescriptor> async_fd;
+    std::deque<std::pair<size_t, size_t>> reads_in_flight;
+    // The offset of the next read to submit and the buffer it goes into.
+    int64_t next_read_offset{0};
+    size_t next_buffer{0};
+    // The task watching the completions of the reads in flight.
+    brillo::MessageLoop::TaskId hash_task{brillo::MessageLoop::kTaskIdNull};
+    // The memory held by the read buffers.
+    TrackedMemory buffers_memory{"FilesystemVerifierAction.Buffers"};
+
+    // The number of bytes to hash and the time the hashing started.
+    int64_t size{0};
+    base::TimeTicks start_time;
+
+    bool read_done{false};  // true if reached EOF on the input stream.
+
+    // Calculates the hash of the data.
+    HashCalculator hasher;
+
+    // Whether the chunk hashes of the partition are verified instead of the
+    // hash of the whole partition, and in that case the hash of the current
+    // chunk, the number of bytes in it and its index in the partition.
+    bool verify_chunks{false};
+    std::unique_ptr<HashCalculator> chunk_hasher;
+    int64_t chunk_bytes{0};
+    size_t next_chunk{0};
+
+    // Reads and hashes this many bytes from the head of the input stream. This
+    // field is initialized from the corresponding InstallPlan::Partition size,
+    // when the partition starts to be hashed.
+    int64_t remaining_size{0};
+  };
+
+  // Starts the hashing of the next partitions, as many as can be hashed at the
+  // same time. If there aren't any partitions remaining to be hashed and none
+  // is being hashed, it finishes the action.
   void StartPartitionHashing();
 
-  // Schedules the asynchronous read of the filesystem.
-  void ScheduleRead();
+  // Returns whether the target |partition| is verified from its chunk hashes,
+  // and the number of stripes it's split in, one if not.
+  bool VerifiesChunks(const InstallPlan::Partition& partition) const;
+  size_t NumStripes(const InstallPlan::Partition& partition) const;
 
-  // Called from the main loop when a single read from |src_stream_| succeeds or
-  // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
-  void OnReadDoneCallback(size_t bytes_read);
-  void OnReadErrorCallback(const brillo::Error* error);
+  // Opens the partition number |partition_index| and starts hashing its
+  // |stripe|. It finishes the action if the partition couldn't be opened.
+  void StartHashing(size_t partition_index, size_t stripe);
 
-  // When the read is done, finalize the hash checking of the current partition
-  // and continue checking the next one.
-  void FinishPartitionHashing();
+  // Hashes the |count| bytes at |data| read from the |hashing| partition.
+  // Returns false on error.
+  bool UpdateHash(PartitionHashing* hashing, const uint8_t* data, size_t count);
+
+  // Compares the hash of the current chunk of the |hashing| partition to the
+  // expected one, recording the chunk if it doesn't match, and starts the next
+  // chunk. Returns false on error.
+  bool FinishChunk(PartitionHashing* hashing);
+
+  // Returns the key identifying the contents of the source |partition| in the
+  // source hash cache: its device, size and slot and the current boot id.
+  // Returns an empty string if it can't be determined.
+  std::string SourceHashCacheKey(const InstallPlan::Partition& partition);
+
+  // Sets the source_hash of the |partition| from the source hash cache, if it
+  // has one for its current key. Returns whether it did.
+  bool LoadCachedSourceHash(InstallPlan::Partition* partition);
+
+  // Saves the source_hash of the |partition| in the source hash cache.
+  void StoreCachedSourceHash(const InstallPlan::Partition& partition);
+
+  // Resumes the |hashing| of the source |partition| from the hashes the
+  // SourceHashPrecomputer saved in the source hash cache, if any, so only its
+  // bytes after the last precomputed full chunk are read.
+  void ResumeFromPrecomputedHashes(const InstallPlan::Partition& partition,
+                                   PartitionHashing* hashing);
+
+  // Schedules the asynchronous read of the filesystem of the |hashing|
+  // partition.
+  void ScheduleRead(PartitionHashing* hashing);
+
+  // With several read buffers, submits the reads of the |hashing| partition
+  // for all the free buffers.
+  void SubmitReads(PartitionHashing* hashing);
+
+  // Called from the main loop when reads of the |hashing| partition complete.
+  // Hashes the buffers of the completed reads, in order, without waiting for
+  // the ones still in flight, and submits the next reads.
+  void HashCompletedReads(PartitionHashing* hashing);
+
+  // Called from the main loop when a single read from the |hashing| stream
+  // succeeds or fails, calling OnReadDoneCallback() and OnReadErrorCallback()
+  // respectively.
+  void OnReadDoneCallback(PartitionHashing* hashing, size_t bytes_read);
+  void OnReadErrorCallback(PartitionHashing* hashing,
+                           const brillo::Error* error);
+
+  // When the read is done, finalize the hash checking of the |hashing|
+  // partition and continue checking the next one.
+  void FinishPartitionHashing(PartitionHashing* hashing);
 
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
@@ -95,32 +290,57 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The type of the partition that we are verifying.
   VerifierMode verifier_mode_;
 
+  // Whether the source partitions are verified because the target ones failed
+  // the kVerifyTargetHash verification, in which case the action fails anyway.
+  bool target_verification_failed_{false};
+
   // The BootControlInterface used to get the partitions based on the slots.
   const BootControlInterface* const boot_control_;
 
-  // The index in the install_plan_.partitions vector of the partition currently
-  // being hashed.
+  // Whether all the partitions are hashed at the same time.
+  bool hash_partitions_in_parallel_{false};
+
+  // The number and size of the buffers each partition is read into.
+  size_t num_read_buffers_{1};
+  size_t read_buffer_size_;
+
+  // The emulated storage the partitions are read from, if any.
+  std::shared_ptr<StorageThrottle> storage_throttle_;
+
+  // The prefs the source partition hashes are cached in, or null.
+  PrefsInterface* source_hash_cache_{nullptr};
+
+  // Called with the install plan once the source hashes are computed, if set.
+  SourceHashesCallback source_hashes_callback_;
+
+  // The number of stripes the partitions verified from their chunk hashes are
+  // split in.
+  size_t stripes_per_partition_{1};
+
+  // The index in the install_plan_.partitions vector of the next partition to
+  // start hashing, and its next stripe.
   size_t partition_index_{0};
+  size_t next_stripe_{0};
 
-  // If not null, the FileStream used to read from the device.
-  brillo::StreamPtr src_stream_;
+  // The partitions being hashed, in the order they started.
+  std::vector<std::unique_ptr<PartitionHashing>> hashings_;
 
-  // Buffer for storing data we read.
-  brillo::Blob buffer_;
+  // The stats of the partitions hashed so far.
+  std::map<std::string, PartitionStats> partition_stats_;
 
-  bool read_done_{false};  // true if reached EOF on the input stream.
   bool cancelled_{false};  // true if the action has been cancelled.
+  bool finished_{false};  // true once Cleanup() was called.
 
-  // The install plan we're passed in via the input pipe.
-  InstallPlan install_plan_;
+  // Whether StartPartitionHashing() is starting partitions.
+  bool starting_partitions_{false};
 
-  // Calculates the hash of the data.
-  std::unique_ptr<HashCalculator> hasher_;
+  // Whether the partitions started being hashed, and whether the source
+  // partition hashes aren't needed anymore.
+  bool hashing_started_{false};
+  bool source_hashes_not_needed_{false};
 
-  // Reads and hashes this many bytes from the head of the input stream. This
-  // field is initialized from the corresponding InstallPlan::Partition size,
-  // when the partition starts to be hashed.
-  int64_t remaining_size_{0};
+  // The install plan we're passed in via the input pipe.
+  InstallPlan install_plan_;
 
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
@@ -23,20 +23,23 @@
 #include <vector>
 
 #include <base/bind.h>
+#include <base/message_loop/message_loop.h>
 #include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/bind_lambda.h>
-#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/base_message_loop.h>
 #include <brillo/message_loops/message_loop_utils.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/source_hash_precomputer.h"
 
 using brillo::MessageLoop;
 using std::set;
@@ -60,8 +63,19 @@ class FilesystemVerifierActionTest : public ::testing::Test {
               bool hash_fail,
               VerifierMode verifier_mode);
 
-  brillo::FakeMessageLoop loop_{nullptr};
+  // Runs the |action| on the |install_plan|, which is replaced by the output
+  // of the action when it succeeds. Returns the result of the action.
+  ErrorCode RunAction(FilesystemVerifierAction* action,
+                      InstallPlan* install_plan);
+
+  // The reads of the I/O threads are watched from a real message loop.
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
   FakeBootControl fake_boot_control_;
+  // Whether DoTest() hashes the partitions in parallel, and the number of
+  // read buffers it uses.
+  bool hash_partitions_in_parallel_{false};
+  size_t num_read_buffers_{1};
 };
 
 class FilesystemVerifierActionTestDelegate : public ActionProcessorDelegate {
@@ -194,6 +208,9 @@ bool FilesystemVerifierActionTest::DoTest(bool terminate_early,
 
   ObjectFeederAction<InstallPlan> feeder_action;
   FilesystemVerifierAction copier_action(&fake_boot_control_, verifier_mode);
+  copier_action.set_hash_partitions_in_parallel(hash_partitions_in_parallel_);
+  if (num_read_buffers_ > 1)
+    copier_action.set_read_buffers(num_read_buffers_, 64 * 1024);
   ObjectCollectorAction<InstallPlan> collector_action;
 
   BondActions(&feeder_action, &copier_action);
@@ -245,6 +262,29 @@ bool FilesystemVerifierActionTest::DoTest(bool terminate_early,
   return success;
 }
 
+ErrorCode FilesystemVerifierActionTest::RunAction(
+    FilesystemVerifierAction* action,
+    InstallPlan* install_plan) {
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(*install_plan);
+  ObjectCollectorAction<InstallPlan> collector_action;
+  BondActions(&feeder_action, action);
+  BondActions(action, &collector_action);
+  ActionProcessor processor;
+  FilesystemVerifierActionTestDelegate delegate(action);
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(action);
+  processor.EnqueueAction(&collector_action);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind([&processor]{ processor.StartProcessing(); }));
+  loop_.Run();
+  EXPECT_TRUE(delegate.ran());
+  if (delegate.code() == ErrorCode::kSuccess)
+    *install_plan = collector_action.object();
+  return delegate.code();
+}
+
 class FilesystemVerifierActionTest2Delegate : public ActionProcessorDelegate {
  public:
   void ActionCompleted(ActionProcessor* processor,
@@ -320,6 +360,24 @@ TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashFailTest) {
   EXPECT_TRUE(DoTest(false, true, VerifierMode::kVerifyTargetHash));
 }
 
+TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashInParallelTest) {
+  ASSERT_EQ(0U, getuid());
+  hash_partitions_in_parallel_ = true;
+  EXPECT_TRUE(DoTest(false, false, VerifierMode::kVerifyTargetHash));
+  EXPECT_TRUE(DoTest(false, false, VerifierMode::kComputeSourceHash));
+  EXPECT_TRUE(DoTest(false, true, VerifierMode::kVerifyTargetHash));
+}
+
+TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashReadBuffersTest) {
+  ASSERT_EQ(0U, getuid());
+  num_read_buffers_ = 4;
+  EXPECT_TRUE(DoTest(false, false, VerifierMode::kVerifyTargetHash));
+  EXPECT_TRUE(DoTest(false, false, VerifierMode::kComputeSourceHash));
+  EXPECT_TRUE(DoTest(false, true, VerifierMode::kVerifyTargetHash));
+  EXPECT_TRUE(DoTest(true, false, VerifierMode::kVerifyTargetHash));
+  while (loop_.RunOnce(false)) {}
+}
+
 TEST_F(FilesystemVerifierActionTest, RunAsRootTerminateEarlyTest) {
   ASSERT_EQ(0U, getuid());
   EXPECT_TRUE(DoTest(true, false, VerifierMode::kVerifyTargetHash));
@@ -377,4 +435,212 @@ TEST_F(FilesystemVerifierActionTest,
   EXPECT_EQ(kLegacyPartitionNameKernel, install_plan.partitions[1].name);
 }
 
+TEST_F(FilesystemVerifierActionTest, SourceHashCacheTest) {
+  test_utils::ScopedTempFile part_file("FilesystemVerifierAction-XXXXXX");
+  brillo::Blob part_data(4096, 'a');
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &expected_hash));
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.source_size = part_data.size();
+  install_plan.partitions = {part};
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.source_slot, part_file.path());
+  FakePrefs fake_prefs;
+  int64_t hashed_bytes = 0;
+
+  // Computes the source hash of the partition, using the cache, and sets
+  // |hashed_bytes| to the bytes read from it.
+  auto compute_source_hash = [&]() {
+    FilesystemVerifierAction action(&fake_boot_control_,
+                                    VerifierMode::kComputeSourceHash);
+    action.set_source_hash_cache(&fake_prefs);
+    InstallPlan output_plan = install_plan;
+    EXPECT_EQ(ErrorCode::kSuccess, RunAction(&action, &output_plan));
+    EXPECT_EQ(1U, output_plan.partitions.size());
+    auto stats = action.partition_stats().find(part.name);
+    hashed_bytes =
+        stats == action.partition_stats().end() ? 0 : stats->second.bytes;
+    return output_plan.partitions[0].source_hash;
+  };
+
+  EXPECT_EQ(expected_hash, compute_source_hash());
+  EXPECT_EQ(4096, hashed_bytes);
+
+  // The partition isn't read again while the cached hash is valid.
+  part_data.assign(part_data.size(), 'b');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+  EXPECT_EQ(expected_hash, compute_source_hash());
+  EXPECT_EQ(0, hashed_bytes);
+
+  // A different size invalidates the cached hash.
+  install_plan.partitions[0].source_size = part_data.size() / 2;
+  brillo::Blob expected_half_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(
+      brillo::Blob(part_data.size() / 2, 'b'), &expected_half_hash));
+  EXPECT_EQ(expected_half_hash, compute_source_hash());
+  EXPECT_EQ(2048, hashed_bytes);
+}
+
+TEST_F(FilesystemVerifierActionTest, PrecomputedSourceHashesTest) {
+  test_utils::ScopedTempFile part_file("FilesystemVerifierAction-XXXXXX");
+  brillo::Blob part_data(4096 + 100, 'a');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  InstallPlan install_plan;
+  install_plan.source_slot = fake_boot_control_.GetCurrentSlot();
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.source_size = 4096 + 50;
+  install_plan.partitions = {part};
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.source_slot, part_file.path());
+
+  // Precomputes the hashes of the partition in chunks of 1 KiB.
+  FakePrefs fake_prefs;
+  SourceHashPrecomputer precomputer(&fake_boot_control_, &fake_prefs);
+  precomputer.set_chunk_size(1024);
+  precomputer.Start({part.name});
+  brillo::MessageLoopRunUntil(
+      &loop_,
+      base::TimeDelta::FromSeconds(10),
+      base::Bind([&precomputer]() { return !precomputer.running(); }));
+
+  FilesystemVerifierAction action(&fake_boot_control_,
+                                  VerifierMode::kComputeSourceHash);
+  action.set_source_hash_cache(&fake_prefs);
+  EXPECT_EQ(ErrorCode::kSuccess, RunAction(&action, &install_plan));
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      part_data.data(), part.source_size, &expected_hash));
+  ASSERT_EQ(1U, install_plan.partitions.size());
+  EXPECT_EQ(expected_hash, install_plan.partitions[0].source_hash);
+  // Only the bytes after the last full chunk were read.
+  EXPECT_EQ(50, action.partition_stats().at(part.name).bytes);
+}
+
+TEST_F(FilesystemVerifierActionTest, StopComputingSourceHashesTest) {
+  test_utils::ScopedTempFile part_file("FilesystemVerifierAction-XXXXXX");
+  brillo::Blob part_data(4096, 'a');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.source_size = part_data.size();
+  install_plan.partitions = {part};
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.source_slot, part_file.path());
+
+  FilesystemVerifierAction action(&fake_boot_control_,
+                                  VerifierMode::kComputeSourceHash);
+  bool callback_called = false;
+  action.set_source_hashes_callback(base::Bind(
+      [&callback_called](const InstallPlan& plan) { callback_called = true; }));
+  // The action completes without reading the partition.
+  action.StopComputingSourceHashes();
+  EXPECT_EQ(ErrorCode::kSuccess, RunAction(&action, &install_plan));
+  EXPECT_FALSE(callback_called);
+  EXPECT_TRUE(action.partition_stats().empty());
+  ASSERT_EQ(1U, install_plan.partitions.size());
+  EXPECT_TRUE(install_plan.partitions[0].source_hash.empty());
+}
+
+TEST_F(FilesystemVerifierActionTest, VerifySourceHashTest) {
+  test_utils::ScopedTempFile part_file("FilesystemVerifierAction-XXXXXX");
+  brillo::Blob part_data(4096, 'a');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.source_size = part_data.size();
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      part_data.data(), part_data.size(), &part.source_hash));
+  // The partitions without a source hash aren't read.
+  InstallPlan::Partition other_part;
+  other_part.name = "other";
+  install_plan.partitions = {part, other_part};
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.source_slot, part_file.path());
+
+  {
+    FilesystemVerifierAction action(&fake_boot_control_,
+                                    VerifierMode::kVerifySourceHash);
+    InstallPlan output_plan = install_plan;
+    EXPECT_EQ(ErrorCode::kSuccess, RunAction(&action, &output_plan));
+    EXPECT_EQ(1U, action.partition_stats().size());
+  }
+
+  install_plan.partitions[0].source_hash[0] ^= 1;
+  FilesystemVerifierAction action(&fake_boot_control_,
+                                  VerifierMode::kVerifySourceHash);
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError,
+            RunAction(&action, &install_plan));
+}
+
+TEST_F(FilesystemVerifierActionTest, ChunkHashesTest) {
+  // Five and a half chunks, verified in three stripes.
+  const size_t kChunkSize = 4096;
+  test_utils::ScopedTempFile part_file("FilesystemVerifierAction-XXXXXX");
+  brillo::Blob part_data;
+  for (size_t i = 0; i < 5 * kChunkSize + kChunkSize / 2; i++)
+    part_data.push_back(i % 253);
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.source_size = part_data.size();
+  part.target_size = part_data.size();
+  part.target_hash_chunk_size = kChunkSize;
+  for (size_t offset = 0; offset < part_data.size(); offset += kChunkSize) {
+    brillo::Blob chunk(
+        part_data.begin() + offset,
+        part_data.begin() + std::min(offset + kChunkSize, part_data.size()));
+    part.target_chunk_hashes.emplace_back();
+    ASSERT_TRUE(HashCalculator::RawHashOfData(
+        chunk, &part.target_chunk_hashes.back()));
+  }
+  // The whole partition hash isn't used.
+  part.target_hash = {1, 2, 3};
+  ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.source_hash));
+  install_plan.partitions = {part};
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.source_slot, part_file.path());
+  fake_boot_control_.SetPartitionDevice(
+      part.name, install_plan.target_slot, part_file.path());
+
+  {
+    FilesystemVerifierAction action(&fake_boot_control_,
+                                    VerifierMode::kVerifyTargetHash);
+    action.set_stripes_per_partition(3);
+    InstallPlan output_plan = install_plan;
+    EXPECT_EQ(ErrorCode::kSuccess, RunAction(&action, &output_plan));
+    EXPECT_TRUE(output_plan.partitions[0].target_corrupted_ranges.empty());
+  }
+
+  // A mismatch in the last chunk fails the verification.
+  install_plan.partitions[0].target_chunk_hashes.back()[0] ^= 1;
+  FilesystemVerifierAction action(&fake_boot_control_,
+                                  VerifierMode::kVerifyTargetHash);
+  action.set_stripes_per_partition(3);
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError,
+            RunAction(&action, &install_plan));
+}
+
 }  // namespace chromeos_update_engine
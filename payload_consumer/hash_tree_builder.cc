@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the SHA-256 hashes stored in the tree.
+const size_t kHashSize = 32;
+
+// The size of the buffer the data not hashed yet is read back into.
+const size_t kReadBufferSize = 1024 * 1024;  // 1 MiB
+
+// Returns whether |extent| of blocks of |block_size| bytes is within the
+// |partition_size| bytes of the partition.
+bool ExtentInPartition(const Extent& extent,
+                       size_t block_size,
+                       uint64_t partition_size) {
+  const uint64_t partition_blocks = partition_size / block_size;
+  return extent.start_block() <= partition_blocks &&
+         extent.num_blocks() <= partition_blocks - extent.start_block();
+}
+
+}  // namespace
+
+const char HashTreeBuilder::kAlgorithm[] = "sha256";
+
+uint64_t HashTreeBuilder::TreeSize(uint64_t data_size, size_t block_size) {
+  const uint64_t hashes_per_block = block_size / kHashSize;
+  uint64_t num_hashes = (data_size + block_size - 1) / block_size;
+  uint64_t tree_size = 0;
+  do {
+    num_hashes = (num_hashes + hashes_per_block - 1) / hashes_per_block;
+    tree_size += num_hashes * block_size;
+  } while (num_hashes > 1);
+  return tree_size;
+}
+
+std::unique_ptr<HashTreeBuilder> HashTreeBuilder::Create(
+    const PartitionUpdate& partition,
+    size_t block_size,
+    uint64_t partition_size) {
+  if (!partition.has_hash_tree_extent())
+    return nullptr;
+  const Extent& data_extent = partition.hash_tree_data_extent();
+  const Extent& tree_extent = partition.hash_tree_extent();
+  if (partition.hash_tree_algorithm() != kAlgorithm ||
+      data_extent.num_blocks() == 0 ||
+      !ExtentInPartition(data_extent, block_size, partition_size) ||
+      !ExtentInPartition(tree_extent, block_size, partition_size) ||
+      tree_extent.num_blocks() * block_size !=
+          TreeSize(data_extent.num_blocks() * block_size, block_size) ||
+      (tree_extent.start_block() <
+           data_extent.start_block() + data_extent.num_blocks() &&
+       data_extent.start_block() <
+           tree_extent.start_block() + tree_extent.num_blocks())) {
+    LOG(ERROR) << "Invalid hash tree of the partition "
+               << partition.partition_name() << ".";
+    return nullptr;
+  }
+  const string& salt = partition.hash_tree_salt();
+  return std::unique_ptr<HashTreeBuilder>(
+      new HashTreeBuilder(data_extent.start_block() * block_size,
+                          data_extent.num_blocks() * block_size,
+                          tree_extent.start_block() * block_size,
+                          block_size,
+                          brillo::Blob(salt.begin(), salt.end())));
+}
+
+HashTreeBuilder::HashTreeBuilder(uint64_t data_offset,
+                                 uint64_t data_size,
+                                 uint64_t tree_offset,
+                                 size_t block_size,
+                                 const brillo::Blob& salt)
+    : data_offset_(data_offset),
+      data_size_(data_size),
+      tree_offset_(tree_offset),
+      block_size_(block_size),
+      salt_(salt) {
+  const brillo::Blob zeros(block_size_);
+  failed_ = !HashBlock(zeros.data(), &zero_block_hash_);
+}
+
+void HashTreeBuilder::Update(const uint8_t* data,
+                             uint64_t count,
+                             uint64_t offset) {
+  const uint64_t next_offset = data_offset_ + hashed_bytes_;
+  if (finalized_ || failed_ || hashed_bytes_ == data_size_ ||
+      offset > next_offset || offset + count <= next_offset) {
+    return;
+  }
+  const uint64_t skipped = next_offset - offset;
+  if (data)
+    data += skipped;
+  count = min(count - skipped, data_size_ - hashed_bytes_);
+  hashed_bytes_ += count;
+
+  while (count > 0 && !failed_) {
+    // The whole blocks are hashed in place.
+    if (block_.empty() && count >= block_size_) {
+      if (data) {
+        failed_ = !HashBlock(data, &data_hashes_);
+        data += block_size_;
+      } else {
+        data_hashes_.insert(data_hashes_.end(),
+                            zero_block_hash_.begin(),
+                            zero_block_hash_.end());
+      }
+      count -= block_size_;
+      continue;
+    }
+    const size_t length = min(count, block_size_ - block_.size());
+    if (data) {
+      block_.insert(block_.end(), data, data + length);
+      data += length;
+    } else {
+      block_.insert(block_.end(), length, 0);
+    }
+    count -= length;
+    if (block_.size() == block_size_) {
+      failed_ = !HashBlock(block_.data(), &data_hashes_);
+      block_.clear();
+    }
+  }
+}
+
+void HashTreeBuilder::Reset() {
+  if (finalized_)
+    return;
+  hashed_bytes_ = 0;
+  block_.clear();
+  data_hashes_.clear();
+}
+
+bool HashTreeBuilder::Finalize(FileDescriptorPtr fd) {
+  TEST_AND_RETURN_FALSE(!finalized_ && data_size_ > 0);
+  if (hashed_bytes_ < data_size_) {
+    TEST_AND_RETURN_FALSE(fd);
+    LOG(INFO) << "Reading back " << data_size_ - hashed_bytes_
+              << " bytes of the data of the hash tree.";
+    brillo::Blob buffer(min(static_cast<uint64_t>(kReadBufferSize),
+                            data_size_ - hashed_bytes_));
+    while (hashed_bytes_ < data_size_ && !failed_) {
+      const uint64_t offset = data_offset_ + hashed_bytes_;
+      const size_t count = min(static_cast<uint64_t>(buffer.size()),
+                               data_size_ - hashed_bytes_);
+      ssize_t bytes_read;
+      TEST_AND_RETURN_FALSE(
+          utils::PReadAll(fd, buffer.data(), count, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+      Update(buffer.data(), count, offset);
+    }
+  }
+  finalized_ = true;
+  TEST_AND_RETURN_FALSE(!failed_ && block_.empty());
+
+  // The levels are built from the hashes of the data up, until one fits in a
+  // block, and stored from that one down.
+  vector<brillo::Blob> levels;
+  levels.push_back(std::move(data_hashes_));
+  while (true) {
+    brillo::Blob& level = levels.back();
+    level.resize((level.size() + block_size_ - 1) / block_size_ * block_size_);
+    if (level.size() <= block_size_)
+      break;
+    brillo::Blob next_level;
+    for (size_t offset = 0; offset < level.size(); offset += block_size_)
+      TEST_AND_RETURN_FALSE(HashBlock(level.data() + offset, &next_level));
+    levels.push_back(std::move(next_level));
+  }
+  TEST_AND_RETURN_FALSE(HashBlock(levels.back().data(), &root_hash_));
+  tree_.clear();
+  for (auto it = levels.rbegin(); it != levels.rend(); ++it)
+    tree_.insert(tree_.end(), it->begin(), it->end());
+  return true;
+}
+
+bool HashTreeBuilder::HashBlock(const uint8_t* data,
+                                brillo::Blob* hashes) const {
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(hasher.Update(salt_.data(), salt_.size()));
+  TEST_AND_RETURN_FALSE(hasher.Update(data, block_size_));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  hashes->insert(
+      hashes->end(), hasher.raw_hash().begin(), hasher.raw_hash().end());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
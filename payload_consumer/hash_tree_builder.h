@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_HASH_TREE_BUILDER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_HASH_TREE_BUILDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// HashTreeBuilder builds the dm-verity hash tree of the data of a partition.
+// Each block of the data is hashed with SHA-256 after the salt, and the hashes
+// are stored in blocks, padded with zeros, which are hashed the same way until
+// a level fits in a single block. The tree stores the levels from that one
+// down to the hashes of the data, and its root hash is the hash of the first
+// block.
+//
+// The data is passed in order as it is written to the partition, so it doesn't
+// need to be read back, and whatever wasn't passed is read back when finishing
+// the tree.
+class HashTreeBuilder {
+ public:
+  // The hash algorithm of the trees, as named in the manifest.
+  static const char kAlgorithm[];
+
+  // Returns the size in bytes of the hash tree of |data_size| bytes in blocks
+  // of |block_size| bytes.
+  static uint64_t TreeSize(uint64_t data_size, size_t block_size);
+
+  // Creates the builder of the hash tree of the |partition|, or returns nullptr
+  // if it has none or its tree isn't valid within |partition_size| bytes.
+  static std::unique_ptr<HashTreeBuilder> Create(
+      const PartitionUpdate& partition,
+      size_t block_size,
+      uint64_t partition_size);
+
+  // Creates the builder of the hash tree of the |data_size| bytes at
+  // |data_offset| of the partition, written at its |tree_offset|. The offsets
+  // and the size must be multiples of |block_size|.
+  HashTreeBuilder(uint64_t data_offset,
+                  uint64_t data_size,
+                  uint64_t tree_offset,
+                  size_t block_size,
+                  const brillo::Blob& salt);
+
+  // Hashes the |count| bytes at |data|, or zeros if null, written at |offset|
+  // of the partition. Only the bytes of the data that continue the ones
+  // already hashed are used, the rest are read back by Finalize().
+  void Update(const uint8_t* data, uint64_t count, uint64_t offset);
+
+  // Drops the data hashed so far because some of it changed. It is read back
+  // by Finalize() instead.
+  void Reset();
+
+  // Reads from |fd| the data not hashed yet and builds the tree. |fd| may be
+  // null if all the data was hashed. Returns false on error. Must be called
+  // once, after all the data was written.
+  bool Finalize(FileDescriptorPtr fd);
+
+  // The number of bytes of the data hashed so far.
+  uint64_t hashed_bytes() const { return hashed_bytes_; }
+
+  // The offset in the partition the tree is written to.
+  uint64_t tree_offset() const { return tree_offset_; }
+
+  // The tree and its root hash, once finalized.
+  const brillo::Blob& tree() const { return tree_; }
+  const brillo::Blob& root_hash() const { return root_hash_; }
+
+ private:
+  // Appends to |hashes| the hash of the |block_size_| bytes at |data|, or of
+  // zeros if null. Returns false on error.
+  bool HashBlock(const uint8_t* data, brillo::Blob* hashes) const;
+
+  const uint64_t data_offset_;
+  const uint64_t data_size_;
+  const uint64_t tree_offset_;
+  const size_t block_size_;
+  const brillo::Blob salt_;
+
+  // The bytes of the data hashed so far, and the part of them in |block_|,
+  // the block not complete yet.
+  uint64_t hashed_bytes_{0};
+  brillo::Blob block_;
+
+  // The hashes of the data blocks hashed so far, and of a block of zeros.
+  brillo::Blob data_hashes_;
+  brillo::Blob zero_block_hash_;
+
+  bool failed_{false};
+  bool finalized_{false};
+  brillo::Blob tree_;
+  brillo::Blob root_hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashTreeBuilder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_HASH_TREE_BUILDER_H_
@@ -0,0 +1,184 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+
+#include <fcntl.h>
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Two hashes per block.
+const size_t kBlockSize = 64;
+
+}  // namespace
+
+class HashTreeBuilderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    salt_ = {'s', 'a', 'l', 't'};
+    // Three blocks of data.
+    for (char c : {'a', 'b', 'c'})
+      data_.insert(data_.end(), kBlockSize, c);
+  }
+
+  // Returns the hash of the |kBlockSize| bytes of |data| at |offset| after
+  // the salt.
+  brillo::Blob BlockHash(const brillo::Blob& data, size_t offset) {
+    HashCalculator hasher;
+    EXPECT_TRUE(hasher.Update(salt_.data(), salt_.size()));
+    EXPECT_TRUE(hasher.Update(data.data() + offset, kBlockSize));
+    EXPECT_TRUE(hasher.Finalize());
+    return hasher.raw_hash();
+  }
+
+  brillo::Blob salt_;
+  brillo::Blob data_;
+};
+
+TEST_F(HashTreeBuilderTest, TreeSizeTest) {
+  EXPECT_EQ(4096U, HashTreeBuilder::TreeSize(4096, 4096));
+  EXPECT_EQ(4096U, HashTreeBuilder::TreeSize(128 * 4096, 4096));
+  EXPECT_EQ(3U * 4096, HashTreeBuilder::TreeSize(129 * 4096, 4096));
+  EXPECT_EQ(129U * 4096, HashTreeBuilder::TreeSize(128 * 128 * 4096, 4096));
+  EXPECT_EQ(3 * kBlockSize, HashTreeBuilder::TreeSize(3 * kBlockSize,
+                                                      kBlockSize));
+}
+
+TEST_F(HashTreeBuilderTest, SingleLevelTest) {
+  data_.resize(2 * kBlockSize);
+  HashTreeBuilder builder(0, data_.size(), data_.size(), kBlockSize, salt_);
+  builder.Update(data_.data(), data_.size(), 0);
+  EXPECT_EQ(data_.size(), builder.hashed_bytes());
+  EXPECT_TRUE(builder.Finalize(nullptr));
+
+  brillo::Blob expected_tree = BlockHash(data_, 0);
+  brillo::Blob hash = BlockHash(data_, kBlockSize);
+  expected_tree.insert(expected_tree.end(), hash.begin(), hash.end());
+  EXPECT_EQ(expected_tree, builder.tree());
+  EXPECT_EQ(BlockHash(expected_tree, 0), builder.root_hash());
+}
+
+TEST_F(HashTreeBuilderTest, TwoLevelsTest) {
+  HashTreeBuilder builder(0, data_.size(), data_.size(), kBlockSize, salt_);
+  // The data may be passed in pieces not aligned to the blocks.
+  builder.Update(data_.data(), 10, 0);
+  builder.Update(data_.data() + 10, data_.size() - 10, 10);
+  EXPECT_TRUE(builder.Finalize(nullptr));
+
+  // The hashes of the data take two blocks, the second one padded with zeros.
+  brillo::Blob level0;
+  for (size_t offset = 0; offset < data_.size(); offset += kBlockSize) {
+    brillo::Blob hash = BlockHash(data_, offset);
+    level0.insert(level0.end(), hash.begin(), hash.end());
+  }
+  level0.resize(2 * kBlockSize);
+  brillo::Blob expected_tree = BlockHash(level0, 0);
+  brillo::Blob hash = BlockHash(level0, kBlockSize);
+  expected_tree.insert(expected_tree.end(), hash.begin(), hash.end());
+  EXPECT_EQ(BlockHash(expected_tree, 0), builder.root_hash());
+  expected_tree.insert(expected_tree.end(), level0.begin(), level0.end());
+  EXPECT_EQ(expected_tree, builder.tree());
+}
+
+TEST_F(HashTreeBuilderTest, ReadBackTest) {
+  // The data starts at the second block of the partition.
+  brillo::Blob partition(kBlockSize, 'p');
+  partition.insert(partition.end(), data_.begin(), data_.end());
+  test_utils::ScopedTempFile temp_file("HashTreeBuilderTest-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(temp_file.path(), partition));
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  ASSERT_TRUE(fd->Open(temp_file.path().c_str(), O_RDONLY));
+
+  HashTreeBuilder expected(
+      kBlockSize, data_.size(), partition.size(), kBlockSize, salt_);
+  expected.Update(partition.data(), partition.size(), 0);
+  EXPECT_EQ(data_.size(), expected.hashed_bytes());
+  EXPECT_TRUE(expected.Finalize(nullptr));
+
+  // The writes past the data hashed so far are skipped and read back.
+  HashTreeBuilder builder(
+      kBlockSize, data_.size(), partition.size(), kBlockSize, salt_);
+  builder.Update(partition.data(), kBlockSize + 100, 0);
+  builder.Update(partition.data() + 3 * kBlockSize, kBlockSize, 3 * kBlockSize);
+  EXPECT_EQ(100U, builder.hashed_bytes());
+  EXPECT_TRUE(builder.Finalize(fd));
+  EXPECT_EQ(expected.tree(), builder.tree());
+  EXPECT_EQ(expected.root_hash(), builder.root_hash());
+
+  // The data hashed before a reset is read back too.
+  HashTreeBuilder reset_builder(
+      kBlockSize, data_.size(), partition.size(), kBlockSize, salt_);
+  reset_builder.Update(partition.data(), partition.size(), 0);
+  reset_builder.Reset();
+  EXPECT_EQ(0U, reset_builder.hashed_bytes());
+  EXPECT_TRUE(reset_builder.Finalize(fd));
+  EXPECT_EQ(expected.tree(), reset_builder.tree());
+  EXPECT_TRUE(fd->Close());
+}
+
+TEST_F(HashTreeBuilderTest, ZerosTest) {
+  const brillo::Blob zeros(data_.size(), 0);
+  HashTreeBuilder expected(0, zeros.size(), zeros.size(), kBlockSize, salt_);
+  expected.Update(zeros.data(), zeros.size(), 0);
+  EXPECT_TRUE(expected.Finalize(nullptr));
+
+  HashTreeBuilder builder(0, zeros.size(), zeros.size(), kBlockSize, salt_);
+  builder.Update(nullptr, 10, 0);
+  builder.Update(nullptr, zeros.size() - 10, 10);
+  EXPECT_TRUE(builder.Finalize(nullptr));
+  EXPECT_EQ(expected.tree(), builder.tree());
+}
+
+TEST_F(HashTreeBuilderTest, CreateTest) {
+  PartitionUpdate partition;
+  partition.set_partition_name("system");
+  EXPECT_EQ(nullptr, HashTreeBuilder::Create(partition, 4096, 8 * 4096));
+
+  *partition.mutable_hash_tree_data_extent() = ExtentForRange(0, 6);
+  *partition.mutable_hash_tree_extent() = ExtentForRange(6, 1);
+  partition.set_hash_tree_algorithm(HashTreeBuilder::kAlgorithm);
+  partition.set_hash_tree_salt("salt");
+  std::unique_ptr<HashTreeBuilder> builder =
+      HashTreeBuilder::Create(partition, 4096, 8 * 4096);
+  ASSERT_NE(nullptr, builder);
+  EXPECT_EQ(6U * 4096, builder->tree_offset());
+
+  // The tree must have the size of the tree of the data, within the partition
+  // and not overlapping the data.
+  EXPECT_EQ(nullptr, HashTreeBuilder::Create(partition, 4096, 6 * 4096));
+  *partition.mutable_hash_tree_extent() = ExtentForRange(5, 1);
+  EXPECT_EQ(nullptr, HashTreeBuilder::Create(partition, 4096, 8 * 4096));
+  *partition.mutable_hash_tree_extent() = ExtentForRange(6, 2);
+  EXPECT_EQ(nullptr, HashTreeBuilder::Create(partition, 4096, 8 * 4096));
+  *partition.mutable_hash_tree_extent() = ExtentForRange(6, 1);
+  partition.set_hash_tree_algorithm("sha1");
+  EXPECT_EQ(nullptr, HashTreeBuilder::Create(partition, 4096, 8 * 4096));
+}
+
+}  // namespace chromeos_update_engine
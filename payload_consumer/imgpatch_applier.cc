@@ -0,0 +1,276 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/imgpatch_applier.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <limits>
+#include <vector>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/bspatch_applier.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The IMGDIFF2 header is the magic followed by the 32-bit number of chunks.
+// All the integers in the patch are little endian.
+const char kImgdiffMagic[] = "IMGDIFF2";
+const size_t kImgdiffMagicSize = 8;
+const size_t kImgdiffHeaderSize = 12;
+
+// The chunk types. CHUNK_GZIP is only used by the older IMGDIFF1 format.
+const uint32_t kChunkNormal = 0;
+const uint32_t kChunkDeflate = 2;
+const uint32_t kChunkRaw = 3;
+
+// The size of the chunk headers after the 32-bit chunk type. Normal chunks
+// have the source start, source length and patch offset as 64-bit integers.
+// Deflate chunks add the 64-bit source and target inflated lengths, and the
+// 32-bit zlib level, method, window bits, memory level and strategy.
+const size_t kNormalChunkHeaderSize = 24;
+const size_t kDeflateChunkHeaderSize = 60;
+
+// The size of the buffer the deflated data is written from.
+const size_t kDeflateBufferSize = 256 * 1024;  // 256 KiB
+
+uint32_t ReadLE32(const uint8_t* buf) {
+  return static_cast<uint32_t>(buf[0]) |
+         static_cast<uint32_t>(buf[1]) << 8 |
+         static_cast<uint32_t>(buf[2]) << 16 |
+         static_cast<uint32_t>(buf[3]) << 24;
+}
+
+uint64_t ReadLE64(const uint8_t* buf) {
+  return static_cast<uint64_t>(ReadLE32(buf)) |
+         static_cast<uint64_t>(ReadLE32(buf + 4)) << 32;
+}
+
+// Returns whether the |length| bytes at |start| are within the |size| bytes of
+// data.
+bool IsValidRange(uint64_t start, uint64_t length, uint64_t size) {
+  return start <= size && length <= size - start;
+}
+
+// An ExtentWriter that appends the data to a buffer in memory, used to hold
+// the inflated new data of a deflate chunk before deflating it.
+class BlobExtentWriter : public ExtentWriter {
+ public:
+  explicit BlobExtentWriter(brillo::Blob* data) : data_(data) {}
+  ~BlobExtentWriter() override = default;
+
+  // ExtentWriter overrides.
+  bool Init(FileDescriptorPtr /* fd */,
+            const vector<Extent>& /* extents */,
+            uint32_t /* block_size */) override {
+    return true;
+  }
+  bool Write(const void* bytes, size_t count) override {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes);
+    data_->insert(data_->end(), data, data + count);
+    return true;
+  }
+  bool EndImpl() override { return true; }
+
+ private:
+  brillo::Blob* data_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlobExtentWriter);
+};
+
+// Inflates the raw deflate stream of |size| bytes at |data| into |out_data|,
+// which must be exactly as long as the inflated data.
+bool InflateChunk(const uint8_t* data, size_t size, brillo::Blob* out_data) {
+  TEST_AND_RETURN_FALSE(size <= std::numeric_limits<uInt>::max());
+  TEST_AND_RETURN_FALSE(out_data->size() <= std::numeric_limits<uInt>::max());
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(inflateInit2(&stream, -MAX_WBITS) == Z_OK);
+  stream.next_in = const_cast<Bytef*>(data);
+  stream.avail_in = size;
+  stream.next_out = out_data->data();
+  stream.avail_out = out_data->size();
+  int rc = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  if (rc != Z_STREAM_END || stream.avail_out != 0) {
+    LOG(ERROR) << "Unable to inflate the imgdiff source chunk, error " << rc
+               << ", " << stream.avail_out << " bytes left.";
+    return false;
+  }
+  return true;
+}
+
+// Deflates the |data| with the passed zlib settings, passing the deflated data
+// to |writer| and storing its size in |out_size|.
+bool DeflateChunk(const brillo::Blob& data,
+                  int level,
+                  int method,
+                  int window_bits,
+                  int mem_level,
+                  int strategy,
+                  ExtentWriter* writer,
+                  uint64_t* out_size) {
+  TEST_AND_RETURN_FALSE(data.size() <= std::numeric_limits<uInt>::max());
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(deflateInit2(&stream, level, method, window_bits,
+                                     mem_level, strategy) == Z_OK);
+  stream.next_in = const_cast<Bytef*>(data.data());
+  stream.avail_in = data.size();
+
+  brillo::Blob buffer(kDeflateBufferSize);
+  bool success = true;
+  int rc;
+  do {
+    stream.next_out = buffer.data();
+    stream.avail_out = buffer.size();
+    rc = deflate(&stream, Z_FINISH);
+    if (rc != Z_OK && rc != Z_STREAM_END) {
+      LOG(ERROR) << "Unable to deflate the imgdiff target chunk, error " << rc;
+      success = false;
+      break;
+    }
+    const size_t deflated = buffer.size() - stream.avail_out;
+    if (deflated && !writer->Write(buffer.data(), deflated)) {
+      success = false;
+      break;
+    }
+  } while (rc != Z_STREAM_END);
+  *out_size = stream.total_out;
+  deflateEnd(&stream);
+  return success;
+}
+
+}  // namespace
+
+bool ApplyImgdiffPatch(const uint8_t* old_data,
+                       uint64_t old_size,
+                       const uint8_t* patch,
+                       size_t patch_size,
+                       uint64_t new_size,
+                       ExtentWriter* writer) {
+  if (patch_size < kImgdiffHeaderSize ||
+      memcmp(patch, kImgdiffMagic, kImgdiffMagicSize) != 0) {
+    LOG(ERROR) << "Invalid imgdiff patch header.";
+    return false;
+  }
+  const uint32_t num_chunks = ReadLE32(patch + kImgdiffMagicSize);
+
+  size_t pos = kImgdiffHeaderSize;
+  uint64_t written = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    TEST_AND_RETURN_FALSE(patch_size - pos >= 4);
+    const uint32_t type = ReadLE32(patch + pos);
+    pos += 4;
+
+    uint64_t chunk_size = 0;
+    if (type == kChunkNormal || type == kChunkDeflate) {
+      const size_t header_size = type == kChunkNormal ?
+          kNormalChunkHeaderSize : kDeflateChunkHeaderSize;
+      TEST_AND_RETURN_FALSE(patch_size - pos >= header_size);
+      const uint8_t* header = patch + pos;
+      pos += header_size;
+
+      const uint64_t src_start = ReadLE64(header);
+      const uint64_t src_len = ReadLE64(header + 8);
+      const uint64_t patch_offset = ReadLE64(header + 16);
+      TEST_AND_RETURN_FALSE(IsValidRange(src_start, src_len, old_size));
+      TEST_AND_RETURN_FALSE(patch_offset < patch_size);
+      const uint8_t* chunk_patch = patch + patch_offset;
+      const size_t chunk_patch_size = patch_size - patch_offset;
+
+      if (type == kChunkNormal) {
+        TEST_AND_RETURN_FALSE(GetBsdiffPatchNewSize(
+            chunk_patch, chunk_patch_size, &chunk_size));
+        TEST_AND_RETURN_FALSE(chunk_size <= new_size - written);
+        TEST_AND_RETURN_FALSE(ApplyBsdiffPatch(old_data + src_start,
+                                               src_len,
+                                               chunk_patch,
+                                               chunk_patch_size,
+                                               chunk_size,
+                                               writer));
+      } else {
+        const uint64_t src_expanded_len = ReadLE64(header + 24);
+        const uint64_t tgt_expanded_len = ReadLE64(header + 32);
+        const int level = static_cast<int32_t>(ReadLE32(header + 40));
+        const int method = static_cast<int32_t>(ReadLE32(header + 44));
+        const int window_bits = static_cast<int32_t>(ReadLE32(header + 48));
+        const int mem_level = static_cast<int32_t>(ReadLE32(header + 52));
+        const int strategy = static_cast<int32_t>(ReadLE32(header + 56));
+        TEST_AND_RETURN_FALSE(
+            src_expanded_len <= std::numeric_limits<uInt>::max() &&
+            tgt_expanded_len <= std::numeric_limits<uInt>::max());
+
+        brillo::Blob src_expanded(src_expanded_len);
+        TEST_AND_RETURN_FALSE(
+            InflateChunk(old_data + src_start, src_len, &src_expanded));
+
+        brillo::Blob tgt_expanded;
+        tgt_expanded.reserve(tgt_expanded_len);
+        BlobExtentWriter tgt_writer(&tgt_expanded);
+        TEST_AND_RETURN_FALSE(ApplyBsdiffPatch(src_expanded.data(),
+                                               src_expanded.size(),
+                                               chunk_patch,
+                                               chunk_patch_size,
+                                               tgt_expanded_len,
+                                               &tgt_writer));
+        TEST_AND_RETURN_FALSE(tgt_writer.End());
+        TEST_AND_RETURN_FALSE(DeflateChunk(tgt_expanded,
+                                           level,
+                                           method,
+                                           window_bits,
+                                           mem_level,
+                                           strategy,
+                                           writer,
+                                           &chunk_size));
+      }
+    } else if (type == kChunkRaw) {
+      TEST_AND_RETURN_FALSE(patch_size - pos >= 4);
+      chunk_size = ReadLE32(patch + pos);
+      pos += 4;
+      TEST_AND_RETURN_FALSE(chunk_size <= patch_size - pos);
+      TEST_AND_RETURN_FALSE(writer->Write(patch + pos, chunk_size));
+      pos += chunk_size;
+    } else {
+      LOG(ERROR) << "Unsupported imgdiff chunk type " << type << ".";
+      return false;
+    }
+
+    written += chunk_size;
+    if (written > new_size) {
+      LOG(ERROR) << "The imgdiff patch generates more than the " << new_size
+                 << " bytes the operation expects.";
+      return false;
+    }
+  }
+
+  if (written != new_size) {
+    LOG(ERROR) << "The imgdiff patch generates " << written
+               << " bytes but the operation expects " << new_size << ".";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
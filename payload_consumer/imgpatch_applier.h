@@ -0,0 +1,47 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IMGPATCH_APPLIER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IMGPATCH_APPLIER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// In-process applier for the IMGDIFF2 patch format generated by the imgdiff
+// tool and used by the IMGDIFF operation. An IMGDIFF2 patch splits the data in
+// chunks: plain chunks patched with bsdiff, raw chunks stored in the patch and
+// deflate chunks that are inflated, patched with bsdiff and deflated again
+// with the same zlib settings that produced the new data.
+
+namespace chromeos_update_engine {
+
+// Applies the IMGDIFF2 |patch| of |patch_size| bytes to the |old_size| bytes
+// of source data at |old_data|. The resulting data, which must be exactly
+// |new_size| bytes long, is passed in order to |writer|, which needs to be
+// already initialized. The caller is responsible for calling End() on the
+// |writer|. Returns whether the patch was successfully applied.
+bool ApplyImgdiffPatch(const uint8_t* old_data,
+                       uint64_t old_size,
+                       const uint8_t* patch,
+                       size_t patch_size,
+                       uint64_t new_size,
+                       ExtentWriter* writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IMGPATCH_APPLIER_H_
@@ -0,0 +1,206 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/imgpatch_applier.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/bzip.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(value & 0xff);
+    value >>= 8;
+  }
+}
+
+void AppendLE64(uint64_t value, brillo::Blob* out) {
+  AppendLE32(value & 0xffffffff, out);
+  AppendLE32(value >> 32, out);
+}
+
+// Builds a BSDIFF40 patch that generates |new_data| from the extra block only.
+brillo::Blob BuildBsdiffPatch(const brillo::Blob& new_data) {
+  // A single control entry with no diff bytes. The sign-magnitude encoding of
+  // positive values is the same as the little endian one.
+  brillo::Blob ctrl;
+  AppendLE64(0, &ctrl);
+  AppendLE64(new_data.size(), &ctrl);
+  AppendLE64(0, &ctrl);
+  brillo::Blob bz_ctrl, bz_diff, bz_extra;
+  EXPECT_TRUE(BzipCompress(ctrl, &bz_ctrl));
+  EXPECT_TRUE(BzipCompress(brillo::Blob(), &bz_diff));
+  EXPECT_TRUE(BzipCompress(new_data, &bz_extra));
+
+  brillo::Blob patch = {'B', 'S', 'D', 'I', 'F', 'F', '4', '0'};
+  AppendLE64(bz_ctrl.size(), &patch);
+  AppendLE64(bz_diff.size(), &patch);
+  AppendLE64(new_data.size(), &patch);
+  patch.insert(patch.end(), bz_ctrl.begin(), bz_ctrl.end());
+  patch.insert(patch.end(), bz_diff.begin(), bz_diff.end());
+  patch.insert(patch.end(), bz_extra.begin(), bz_extra.end());
+  return patch;
+}
+
+// Deflates the |data| as a raw deflate stream with the default settings.
+brillo::Blob Deflate(const brillo::Blob& data) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                               -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+  brillo::Blob out(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<Bytef*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+}  // namespace
+
+class ImgpatchApplierTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.assign(std::begin(test_utils::kRandomString),
+                     std::end(test_utils::kRandomString));
+    patch_ = {'I', 'M', 'G', 'D', 'I', 'F', 'F', '2'};
+    EXPECT_TRUE(writer_.Init(nullptr, {}, 4096));
+  }
+
+  // Appends a raw chunk with the |data| to the |patch_|.
+  void AppendRawChunk(const brillo::Blob& data) {
+    AppendLE32(3, &patch_);
+    AppendLE32(data.size(), &patch_);
+    patch_.insert(patch_.end(), data.begin(), data.end());
+  }
+
+  bool ApplyPatch(uint32_t num_chunks, uint64_t new_size) {
+    // The number of chunks goes right after the magic.
+    brillo::Blob num_chunks_data;
+    AppendLE32(num_chunks, &num_chunks_data);
+    patch_.insert(patch_.begin() + 8,
+                  num_chunks_data.begin(),
+                  num_chunks_data.end());
+    bool result = ApplyImgdiffPatch(old_data_.data(), old_data_.size(),
+                                    patch_.data(), patch_.size(),
+                                    new_size, &writer_);
+    EXPECT_TRUE(writer_.End());
+    return result;
+  }
+
+  brillo::Blob old_data_;
+  brillo::Blob patch_;
+  FakeExtentWriter writer_;
+};
+
+TEST_F(ImgpatchApplierTest, RawChunkTest) {
+  brillo::Blob raw_data(100, 'r');
+  AppendRawChunk(raw_data);
+  EXPECT_TRUE(ApplyPatch(1, raw_data.size()));
+  EXPECT_EQ(raw_data, writer_.WrittenData());
+}
+
+TEST_F(ImgpatchApplierTest, NormalChunkTest) {
+  brillo::Blob expected(old_data_.begin() + 10, old_data_.begin() + 60);
+  brillo::Blob bsdiff_patch = BuildBsdiffPatch(expected);
+
+  // Normal chunk header, patching the old data at offset 10.
+  const size_t kPatchOffset = 12 + 4 + 24;
+  AppendLE32(0, &patch_);
+  AppendLE64(10, &patch_);
+  AppendLE64(50, &patch_);
+  AppendLE64(kPatchOffset, &patch_);
+  patch_.insert(patch_.end(), bsdiff_patch.begin(), bsdiff_patch.end());
+
+  EXPECT_TRUE(ApplyPatch(1, expected.size()));
+  EXPECT_EQ(expected, writer_.WrittenData());
+}
+
+TEST_F(ImgpatchApplierTest, DeflateChunkTest) {
+  // The old data is a raw piece of data followed by a deflate stream.
+  brillo::Blob old_prefix(old_data_.begin(), old_data_.begin() + 20);
+  brillo::Blob src_expanded(4096, 'a');
+  brillo::Blob tgt_expanded(old_data_);
+  tgt_expanded.insert(tgt_expanded.end(), 1000, 'b');
+  brillo::Blob src_deflated = Deflate(src_expanded);
+  old_data_ = old_prefix;
+  old_data_.insert(old_data_.end(), src_deflated.begin(), src_deflated.end());
+
+  brillo::Blob bsdiff_patch = BuildBsdiffPatch(tgt_expanded);
+  brillo::Blob raw_data(7, 'r');
+  const size_t kPatchOffset = 12 + 4 + 60 + 4 + 4 + raw_data.size();
+  AppendLE32(2, &patch_);
+  AppendLE64(old_prefix.size(), &patch_);
+  AppendLE64(src_deflated.size(), &patch_);
+  AppendLE64(kPatchOffset, &patch_);
+  AppendLE64(src_expanded.size(), &patch_);
+  AppendLE64(tgt_expanded.size(), &patch_);
+  AppendLE32(Z_DEFAULT_COMPRESSION, &patch_);
+  AppendLE32(Z_DEFLATED, &patch_);
+  AppendLE32(-MAX_WBITS, &patch_);
+  AppendLE32(8, &patch_);
+  AppendLE32(Z_DEFAULT_STRATEGY, &patch_);
+  AppendRawChunk(raw_data);
+  EXPECT_EQ(kPatchOffset, patch_.size() + 4);
+  patch_.insert(patch_.end(), bsdiff_patch.begin(), bsdiff_patch.end());
+
+  // The new data is the target deflated again, followed by the raw chunk.
+  brillo::Blob expected = Deflate(tgt_expanded);
+  expected.insert(expected.end(), raw_data.begin(), raw_data.end());
+  EXPECT_TRUE(ApplyPatch(2, expected.size()));
+  EXPECT_EQ(expected, writer_.WrittenData());
+}
+
+TEST_F(ImgpatchApplierTest, InvalidMagicTest) {
+  patch_[7] = '1';
+  AppendRawChunk(brillo::Blob(10, 'r'));
+  EXPECT_FALSE(ApplyPatch(1, 10));
+}
+
+TEST_F(ImgpatchApplierTest, NewSizeMismatchTest) {
+  AppendRawChunk(brillo::Blob(10, 'r'));
+  EXPECT_FALSE(ApplyPatch(1, 11));
+}
+
+TEST_F(ImgpatchApplierTest, TruncatedPatchTest) {
+  AppendRawChunk(brillo::Blob(10, 'r'));
+  patch_.resize(patch_.size() - 1);
+  EXPECT_FALSE(ApplyPatch(1, 10));
+}
+
+TEST_F(ImgpatchApplierTest, SourceRangeOutOfBoundsTest) {
+  AppendLE32(0, &patch_);
+  AppendLE64(old_data_.size() - 10, &patch_);
+  AppendLE64(20, &patch_);
+  AppendLE64(12 + 4 + 24, &patch_);
+  brillo::Blob bsdiff_patch = BuildBsdiffPatch(brillo::Blob(20, 'x'));
+  patch_.insert(patch_.end(), bsdiff_patch.begin(), bsdiff_patch.end());
+  EXPECT_FALSE(ApplyPatch(1, 20));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,277 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/inline_target_hasher.h"
+
+#include <linux/fs.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include <base/logging.h>
+#include <base/rand_util.h>
+
+#include "update_engine/common/utils.h"
+
+using std::min;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the buffer the partition is read back into.
+const size_t kReadBufferSize = 1024 * 1024;  // 1 MiB
+
+}  // namespace
+
+const uint64_t InlineTargetHasher::kChunkSize = 1024 * 1024;  // 1 MiB
+
+InlineTargetHasher::InlineTargetHasher(uint64_t size,
+                                       uint64_t max_pending_bytes)
+    : size_(size),
+      max_pending_bytes_(max_pending_bytes),
+      chunk_hasher_(new HashCalculator()) {}
+
+void InlineTargetHasher::Write(const void* data,
+                               uint64_t count,
+                               uint64_t offset) {
+  if (offset >= size_)
+    return;
+  count = min(count, size_ - offset);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+  base::AutoLock auto_lock(lock_);
+  if (!valid_ || finalized_)
+    return;
+  if (offset < hashed_bytes_) {
+    LOG(INFO) << "Offset " << offset << " of the partition was written again, "
+              << "it can't be hashed inline.";
+    InvalidateLocked();
+    return;
+  }
+  DropPendingLocked(offset, offset + count);
+
+  if (offset > hashed_bytes_) {
+    // Zeros aren't held, they are read back if the prefix doesn't reach them.
+    if (!bytes || pending_bytes_ + count > max_pending_bytes_)
+      return;
+    pending_[offset].assign(bytes, bytes + count);
+    pending_bytes_ += count;
+    return;
+  }
+
+  HashLocked(bytes, count);
+  // Fold in the pending writes the prefix reached.
+  while (!pending_.empty() && pending_.begin()->first == hashed_bytes_) {
+    brillo::Blob data = std::move(pending_.begin()->second);
+    pending_.erase(pending_.begin());
+    pending_bytes_ -= data.size();
+    HashLocked(data.data(), data.size());
+  }
+}
+
+void InlineTargetHasher::Invalidate(uint64_t offset, uint64_t length) {
+  if (offset >= size_)
+    return;
+  length = min(length, size_ - offset);
+
+  base::AutoLock auto_lock(lock_);
+  if (offset < hashed_bytes_) {
+    InvalidateLocked();
+    return;
+  }
+  DropPendingLocked(offset, offset + length);
+}
+
+void InlineTargetHasher::set_hash_tree_builder(
+    std::shared_ptr<HashTreeBuilder> builder) {
+  base::AutoLock auto_lock(lock_);
+  hash_tree_builder_ = builder;
+}
+
+bool InlineTargetHasher::valid() const {
+  base::AutoLock auto_lock(lock_);
+  return valid_;
+}
+
+uint64_t InlineTargetHasher::hashed_bytes() const {
+  base::AutoLock auto_lock(lock_);
+  return hashed_bytes_;
+}
+
+bool InlineTargetHasher::Finalize(FileDescriptorPtr fd,
+                                  brillo::Blob* raw_hash) {
+  base::AutoLock auto_lock(lock_);
+  TEST_AND_RETURN_FALSE(valid_ && !finalized_);
+  finalized_ = true;
+  pending_.clear();
+  pending_bytes_ = 0;
+
+  // The rest of the partition is hashed from the device.
+  if (hashed_bytes_ < size_) {
+    LOG(INFO) << "Reading back the last " << size_ - hashed_bytes_
+              << " bytes of the partition to hash them.";
+  }
+  brillo::Blob buffer(min(static_cast<uint64_t>(kReadBufferSize),
+                          size_ - hashed_bytes_));
+  for (uint64_t offset = hashed_bytes_; offset < size_;) {
+    const size_t count = min(static_cast<uint64_t>(buffer.size()),
+                             size_ - offset);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd, buffer.data(), count, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+    TEST_AND_RETURN_FALSE(hasher_.Update(buffer.data(), count));
+    offset += count;
+  }
+  TEST_AND_RETURN_FALSE(hasher_.Finalize());
+  *raw_hash = hasher_.raw_hash();
+  return true;
+}
+
+bool InlineTargetHasher::SpotCheck(FileDescriptorPtr fd,
+                                   size_t num_chunks) const {
+  base::AutoLock auto_lock(lock_);
+  if (chunk_hashes_.empty())
+    return true;
+  brillo::Blob buffer(kChunkSize);
+  for (size_t i = 0; i < num_chunks; i++) {
+    const size_t chunk = base::RandInt(0, chunk_hashes_.size() - 1);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd, buffer.data(), kChunkSize, chunk * kChunkSize, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(bytes_read) == kChunkSize);
+    brillo::Blob chunk_hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(buffer, &chunk_hash));
+    if (chunk_hash != chunk_hashes_[chunk]) {
+      LOG(ERROR) << "Chunk " << chunk << " of the partition doesn't match the "
+                 << "data written to it.";
+      return false;
+    }
+  }
+  return true;
+}
+
+void InlineTargetHasher::HashLocked(const uint8_t* data, uint64_t count) {
+  static const brillo::Blob* zeros = new brillo::Blob(kChunkSize);
+  while (count > 0) {
+    const uint64_t chunk_offset = hashed_bytes_ % kChunkSize;
+    const size_t length = min(count, kChunkSize - chunk_offset);
+    const uint8_t* chunk_data = data ? data : zeros->data();
+    if (!hasher_.Update(chunk_data, length) ||
+        !chunk_hasher_->Update(chunk_data, length)) {
+      InvalidateLocked();
+      return;
+    }
+    if (hash_tree_builder_)
+      hash_tree_builder_->Update(data, length, hashed_bytes_);
+    hashed_bytes_ += length;
+    count -= length;
+    if (data)
+      data += length;
+    if (chunk_offset + length == kChunkSize) {
+      if (!chunk_hasher_->Finalize()) {
+        InvalidateLocked();
+        return;
+      }
+      chunk_hashes_.push_back(chunk_hasher_->raw_hash());
+      chunk_hasher_.reset(new HashCalculator());
+    }
+  }
+}
+
+void InlineTargetHasher::DropPendingLocked(uint64_t start, uint64_t end) {
+  auto it = pending_.lower_bound(start);
+  if (it != pending_.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + prev->second.size() > start)
+      it = prev;
+  }
+  while (it != pending_.end() && it->first < end) {
+    pending_bytes_ -= it->second.size();
+    it = pending_.erase(it);
+  }
+}
+
+void InlineTargetHasher::InvalidateLocked() {
+  valid_ = false;
+  pending_.clear();
+  pending_bytes_ = 0;
+  // The data passed to the hash tree may have changed too.
+  if (hash_tree_builder_)
+    hash_tree_builder_->Reset();
+}
+
+bool HashingFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool HashingFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t HashingFileDescriptor::Read(void* buf, size_t count) {
+  ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0 && offset_ >= 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t HashingFileDescriptor::Write(const void* buf, size_t count) {
+  ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0) {
+    if (offset_ >= 0) {
+      hasher_->Write(buf, bytes_written, offset_);
+      offset_ += bytes_written;
+    } else {
+      // Without knowing where the data went the partition can't be hashed.
+      hasher_->Invalidate(0, bytes_written);
+    }
+  }
+  return bytes_written;
+}
+
+off64_t HashingFileDescriptor::Seek(off64_t offset, int whence) {
+  offset_ = fd_->Seek(offset, whence);
+  return offset_;
+}
+
+bool HashingFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  if (!fd_->BlkIoctl(request, start, length, result))
+    return false;
+  if (*result == 0) {
+    if (request == BLKZEROOUT)
+      hasher_->Write(nullptr, length, start);
+    else
+      hasher_->Invalidate(start, length);
+  }
+  return true;
+}
+
+bool HashingFileDescriptor::ZeroRange(uint64_t start, uint64_t length) {
+  if (!fd_->ZeroRange(start, length))
+    return false;
+  hasher_->Write(nullptr, length, start);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INLINE_TARGET_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INLINE_TARGET_HASHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+
+namespace chromeos_update_engine {
+
+// InlineTargetHasher computes the hash of a target partition from the data
+// written to it while the payload is applied, so the partition doesn't need to
+// be read back in full to verify it. The data is hashed in partition order:
+// a write at the end of the hashed prefix of the partition extends it, and
+// writes further ahead are held in memory, up to a limit, until the prefix
+// reaches them. Whatever the prefix didn't reach is read back when finishing
+// the hash. The writes can be recorded from several threads.
+class InlineTargetHasher {
+ public:
+  // The hashed data is also hashed in chunks of this size, used to read back
+  // and compare random parts of the partition.
+  static const uint64_t kChunkSize;
+
+  // Creates a hasher of the first |size| bytes of the partition that holds at
+  // most |max_pending_bytes| bytes of the writes ahead of the hashed prefix.
+  InlineTargetHasher(uint64_t size, uint64_t max_pending_bytes);
+
+  // Records the |count| bytes at |data| written at |offset| of the partition.
+  // If |data| is null, the bytes were zeroed.
+  void Write(const void* data, uint64_t count, uint64_t offset);
+
+  // Records that the |length| bytes at |offset| changed in an unknown way, for
+  // example because they were discarded.
+  void Invalidate(uint64_t offset, uint64_t length);
+
+  // Passes the data hashed from the writes to the |builder| of the hash tree
+  // of the partition too, and resets it when the hash can't be finished
+  // inline anymore. Must be called before the first write.
+  void set_hash_tree_builder(std::shared_ptr<HashTreeBuilder> builder);
+
+  // Returns false once a byte already hashed was written again, which happens
+  // with operations updating the partition in place. The hash can't be
+  // finished inline anymore in that case.
+  bool valid() const;
+
+  // Returns the number of bytes of the partition hashed from the writes.
+  uint64_t hashed_bytes() const;
+
+  // Finishes the hash, reading from |fd| the part of the partition the hashed
+  // prefix didn't reach, and stores it in |raw_hash|. Returns false if the
+  // hasher isn't valid or the partition couldn't be read. Must be called once,
+  // after all the writes.
+  bool Finalize(FileDescriptorPtr fd, brillo::Blob* raw_hash);
+
+  // Reads back from |fd| up to |num_chunks| random chunks of the partition
+  // hashed from the writes and compares them to the data hashed. Returns
+  // whether all of them match.
+  bool SpotCheck(FileDescriptorPtr fd, size_t num_chunks) const;
+
+ private:
+  // Hashes the |count| bytes at |data|, or zeros if null, at the end of the
+  // hashed prefix.
+  void HashLocked(const uint8_t* data, uint64_t count);
+
+  // Drops the pending writes overlapping the bytes from |start| to |end|.
+  void DropPendingLocked(uint64_t start, uint64_t end);
+
+  // Marks the hash as not computable inline and drops what was hashed.
+  void InvalidateLocked();
+
+  const uint64_t size_;
+  const uint64_t max_pending_bytes_;
+
+  // All of the following are protected by |lock_|.
+  mutable base::Lock lock_;
+  bool valid_{true};
+  bool finalized_{false};
+
+  // The hash of the prefix of the partition and the number of bytes in it.
+  HashCalculator hasher_;
+  uint64_t hashed_bytes_{0};
+
+  // The hashes of the chunks of the prefix, and the hash of the current one.
+  std::vector<brillo::Blob> chunk_hashes_;
+  std::unique_ptr<HashCalculator> chunk_hasher_;
+
+  // The writes ahead of the hashed prefix, by offset. They don't overlap.
+  std::map<uint64_t, brillo::Blob> pending_;
+  uint64_t pending_bytes_{0};
+
+  std::shared_ptr<HashTreeBuilder> hash_tree_builder_;
+
+  DISALLOW_COPY_AND_ASSIGN(InlineTargetHasher);
+};
+
+// A FileDescriptor that records all the data written through it, which must
+// be a target partition, in an InlineTargetHasher before passing it to the
+// wrapped file descriptor.
+class HashingFileDescriptor : public FileDescriptor {
+ public:
+  HashingFileDescriptor(FileDescriptorPtr fd,
+                        std::shared_ptr<InlineTargetHasher> hasher)
+      : fd_(fd), hasher_(hasher) {}
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool ZeroRange(uint64_t start, uint64_t length) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  void Reset() override { fd_->Reset(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  std::shared_ptr<InlineTargetHasher> hasher_;
+
+  // The offset of the wrapped file descriptor, or -1 if unknown.
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INLINE_TARGET_HASHER_H_
@@ -0,0 +1,175 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/inline_target_hasher.h"
+
+#include <fcntl.h>
+
+#include <memory>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::shared_ptr;
+
+namespace chromeos_update_engine {
+
+class InlineTargetHasherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Two and a half chunks of data.
+    for (uint64_t i = 0; i < InlineTargetHasher::kChunkSize * 5 / 2; i++)
+      data_.push_back(i * 7 % 251);
+    EXPECT_TRUE(HashCalculator::RawHashOfData(data_, &expected_hash_));
+    fd_.reset(new EintrSafeFileDescriptor());
+    EXPECT_TRUE(fd_->Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  void TearDown() override { EXPECT_TRUE(fd_->Close()); }
+
+  // Writes the |count| bytes of |data_| at |offset| through |hashing_fd|.
+  void WriteData(FileDescriptorPtr hashing_fd, uint64_t offset, size_t count) {
+    EXPECT_EQ(static_cast<off64_t>(offset),
+              hashing_fd->Seek(offset, SEEK_SET));
+    EXPECT_TRUE(utils::WriteAll(hashing_fd, data_.data() + offset, count));
+  }
+
+  test_utils::ScopedTempFile temp_file_{"InlineTargetHasherTest-XXXXXX"};
+  FileDescriptorPtr fd_;
+  brillo::Blob data_;
+  brillo::Blob expected_hash_;
+};
+
+TEST_F(InlineTargetHasherTest, InOrderWritesTest) {
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), 0));
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, 0, 1000);
+  WriteData(hashing_fd, 1000, data_.size() - 1000);
+  EXPECT_EQ(data_.size(), hasher->hashed_bytes());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher->Finalize(fd_, &hash));
+  EXPECT_EQ(expected_hash_, hash);
+  EXPECT_TRUE(hasher->SpotCheck(fd_, 4));
+}
+
+TEST_F(InlineTargetHasherTest, OutOfOrderWritesTest) {
+  const size_t kHalf = data_.size() / 2;
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), data_.size()));
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, kHalf, data_.size() - kHalf);
+  EXPECT_EQ(0U, hasher->hashed_bytes());
+  WriteData(hashing_fd, 0, kHalf);
+  EXPECT_EQ(data_.size(), hasher->hashed_bytes());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher->Finalize(fd_, &hash));
+  EXPECT_EQ(expected_hash_, hash);
+}
+
+TEST_F(InlineTargetHasherTest, ReadBackTailTest) {
+  // Without room for pending writes the second half is read back.
+  const size_t kHalf = data_.size() / 2;
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), 0));
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, kHalf, data_.size() - kHalf);
+  WriteData(hashing_fd, 0, kHalf);
+  EXPECT_EQ(kHalf, hasher->hashed_bytes());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher->Finalize(fd_, &hash));
+  EXPECT_EQ(expected_hash_, hash);
+}
+
+TEST_F(InlineTargetHasherTest, ZeroRangeTest) {
+  std::fill(data_.begin(), data_.begin() + 4096, 0);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(data_, &expected_hash_));
+  EXPECT_TRUE(utils::WriteAll(fd_, data_.data(), data_.size()));
+
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), 0));
+  HashingFileDescriptor hashing_fd(fd_, hasher);
+  EXPECT_TRUE(hashing_fd.ZeroRange(0, 4096));
+  EXPECT_EQ(4096U, hasher->hashed_bytes());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher->Finalize(fd_, &hash));
+  EXPECT_EQ(expected_hash_, hash);
+}
+
+TEST_F(InlineTargetHasherTest, RewriteInvalidatesTest) {
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), data_.size()));
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, 0, 8192);
+  EXPECT_TRUE(hasher->valid());
+  WriteData(hashing_fd, 4096, 4096);
+  EXPECT_FALSE(hasher->valid());
+
+  brillo::Blob hash;
+  EXPECT_FALSE(hasher->Finalize(fd_, &hash));
+}
+
+TEST_F(InlineTargetHasherTest, HashTreeBuilderTest) {
+  const uint64_t kDataSize = 2 * InlineTargetHasher::kChunkSize;
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), data_.size()));
+  shared_ptr<HashTreeBuilder> builder(
+      new HashTreeBuilder(0, kDataSize, kDataSize, 4096, {}));
+  hasher->set_hash_tree_builder(builder);
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, 8192, data_.size() - 8192);
+  WriteData(hashing_fd, 0, 8192);
+  EXPECT_EQ(kDataSize, builder->hashed_bytes());
+  EXPECT_TRUE(builder->Finalize(nullptr));
+
+  HashTreeBuilder expected(0, kDataSize, kDataSize, 4096, {});
+  expected.Update(data_.data(), kDataSize, 0);
+  EXPECT_TRUE(expected.Finalize(nullptr));
+  EXPECT_EQ(expected.tree(), builder->tree());
+
+  // The data passed to the builder is dropped when it's written again.
+  builder.reset(new HashTreeBuilder(0, kDataSize, kDataSize, 4096, {}));
+  hasher.reset(new InlineTargetHasher(data_.size(), data_.size()));
+  hasher->set_hash_tree_builder(builder);
+  hashing_fd.reset(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, 0, 8192);
+  WriteData(hashing_fd, 4096, 4096);
+  EXPECT_EQ(0U, builder->hashed_bytes());
+}
+
+TEST_F(InlineTargetHasherTest, SpotCheckMismatchTest) {
+  shared_ptr<InlineTargetHasher> hasher(
+      new InlineTargetHasher(data_.size(), 0));
+  FileDescriptorPtr hashing_fd(new HashingFileDescriptor(fd_, hasher));
+  WriteData(hashing_fd, 0, data_.size());
+
+  // Change the data behind the hasher's back, in every chunk.
+  for (uint64_t offset = 0; offset < data_.size();
+       offset += InlineTargetHasher::kChunkSize) {
+    EXPECT_TRUE(utils::PWriteAll(fd_, "x", 1, offset));
+  }
+  EXPECT_FALSE(hasher->SpotCheck(fd_, 1));
+}
+
+}  // namespace chromeos_update_engine
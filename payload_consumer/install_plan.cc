@@ -47,6 +47,7 @@ bool InstallPlan::operator==(const InstallPlan& that) const {
           (payload_hash == that.payload_hash) &&
           (metadata_size == that.metadata_size) &&
           (metadata_signature == that.metadata_signature) &&
+          (chained_payloads == that.chained_payloads) &&
           (source_slot == that.source_slot) &&
           (target_slot == that.target_slot) &&
           (partitions == that.partitions));
@@ -67,6 +68,16 @@ void InstallPlan::Dump() const {
                            partition.target_size,
                            utils::ToString(partition.run_postinstall).c_str());
   }
+  string chained_payloads_str;
+  for (const auto& payload : chained_payloads) {
+    chained_payloads_str +=
+        base::StringPrintf(", chained payload: %s (size: %" PRIu64
+                           ", hash: %s, metadata size: %" PRIu64 ")",
+                           payload.download_url.c_str(),
+                           payload.size,
+                           payload.hash.c_str(),
+                           payload.metadata_size);
+  }
 
   LOG(INFO) << "InstallPlan: "
             << (is_resume ? "resume" : "new_update")
@@ -78,6 +89,7 @@ void InstallPlan::Dump() const {
             << ", payload hash: " << payload_hash
             << ", metadata size: " << metadata_size
             << ", metadata signature: " << metadata_signature
+            << chained_payloads_str
             << partitions_str
             << ", hash_checks_mandatory: " << utils::ToString(
                 hash_checks_mandatory)
@@ -104,6 +116,32 @@ bool InstallPlan::LoadPartitionsFromSlots(BootControlInterface* boot_control) {
   return result;
 }
 
+bool InstallPlan::AdvanceChainedPayload() {
+  if (chained_payloads.empty())
+    return false;
+  const Payload payload = chained_payloads.front();
+  chained_payloads.erase(chained_payloads.begin());
+  download_url = payload.download_url;
+  payload_size = payload.size;
+  payload_hash = payload.hash;
+  metadata_size = payload.metadata_size;
+  metadata_signature = payload.metadata_signature;
+  // The type is found again from the new payload.
+  payload_type = InstallPayloadType::kUnknown;
+  is_resume = false;
+  source_slot = target_slot;
+  partitions.clear();
+  return true;
+}
+
+bool InstallPlan::Payload::operator==(const InstallPlan::Payload& that) const {
+  return (download_url == that.download_url &&
+          size == that.size &&
+          hash == that.hash &&
+          metadata_size == that.metadata_size &&
+          metadata_signature == that.metadata_signature);
+}
+
 bool InstallPlan::Partition::operator==(
     const InstallPlan::Partition& that) const {
   return (name == that.name &&
@@ -113,10 +151,15 @@ bool InstallPlan::Partition::operator==(
           target_path == that.target_path &&
           target_size == that.target_size &&
           target_hash == that.target_hash &&
+          target_hash_verified == that.target_hash_verified &&
+          target_hash_chunk_size == that.target_hash_chunk_size &&
+          target_chunk_hashes == that.target_chunk_hashes &&
+          target_corrupted_ranges == that.target_corrupted_ranges &&
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
-          postinstall_optional == that.postinstall_optional);
+          postinstall_optional == that.postinstall_optional &&
+          postinstall_parallel == that.postinstall_parallel);
 }
 
 }  // namespace chromeos_update_engine
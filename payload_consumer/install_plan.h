@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/macros.h>
@@ -51,6 +52,12 @@ struct InstallPlan {
   // to load all the partitions for the valid slots.
   bool LoadPartitionsFromSlots(BootControlInterface* boot_control);
 
+  // Replaces the payload with the first of the |chained_payloads|, applied on
+  // the target slot on top of what the previous payload wrote there. The
+  // |partitions| are cleared, since they are loaded again from the new
+  // payload. Returns false if there is no chained payload left.
+  bool AdvanceChainedPayload();
+
   bool is_resume{false};
   InstallPayloadType payload_type{InstallPayloadType::kUnknown};
   std::string download_url;  // url to download from
@@ -61,6 +68,24 @@ struct InstallPlan {
   uint64_t metadata_size{0};             // size of the metadata
   std::string metadata_signature;        // signature of the  metadata
 
+  // A payload applied after the one above, see |chained_payloads|.
+  struct Payload {
+    bool operator==(const Payload& that) const;
+
+    std::string download_url;
+    uint64_t size{0};
+    std::string hash;
+    uint64_t metadata_size{0};
+    std::string metadata_signature;
+  };
+  // The payloads applied one after the other once the one above is, each one
+  // from the version the previous one installed, so a device that missed
+  // several releases applies their deltas in a single update. Only the
+  // partitions written by the last one are verified and run postinstall; the
+  // intermediate versions are checked by the operations validating the source
+  // data they read.
+  std::vector<Payload> chained_payloads;
+
   // The partition slots used for the update.
   BootControlInterface::Slot source_slot{BootControlInterface::kInvalidSlot};
   BootControlInterface::Slot target_slot{BootControlInterface::kInvalidSlot};
@@ -89,6 +114,16 @@ struct InstallPlan {
     std::string target_path;
     uint64_t target_size{0};
     brillo::Blob target_hash;
+    // Whether the |target_hash| was already verified while writing the target
+    // partition, so it doesn't need to be read back to verify it.
+    bool target_hash_verified{false};
+    // The size of the chunks of the target partition hashed separately and
+    // their hashes, if the payload has them.
+    uint64_t target_hash_chunk_size{0};
+    std::vector<brillo::Blob> target_chunk_hashes;
+    // The byte ranges of the target partition, as offset and length, whose
+    // chunk hashes didn't match when verifying it.
+    std::vector<std::pair<uint64_t, uint64_t>> target_corrupted_ranges;
 
     // Whether we should run the postinstall script from this partition and the
     // postinstall parameters.
@@ -96,6 +131,7 @@ struct InstallPlan {
     std::string postinstall_path;
     std::string filesystem_type;
     bool postinstall_optional{false};
+    bool postinstall_parallel{false};
   };
   std::vector<Partition> partitions;
 
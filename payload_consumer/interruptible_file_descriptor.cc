@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_consumer/interruptible_file_descriptor.h"
+
+#include <errno.h>
+
+namespace chromeos_update_engine {
+
+OperationInterrupter::OperationInterrupter() : runnable_(&lock_) {}
+
+void OperationInterrupter::Suspend() {
+  base::AutoLock auto_lock(lock_);
+  suspended_ = true;
+}
+
+void OperationInterrupter::Resume() {
+  base::AutoLock auto_lock(lock_);
+  suspended_ = false;
+  runnable_.Broadcast();
+}
+
+void OperationInterrupter::Cancel() {
+  base::AutoLock auto_lock(lock_);
+  canceled_ = true;
+  runnable_.Broadcast();
+}
+
+bool OperationInterrupter::is_suspended() const {
+  base::AutoLock auto_lock(lock_);
+  return suspended_;
+}
+
+bool OperationInterrupter::is_canceled() const {
+  base::AutoLock auto_lock(lock_);
+  return canceled_;
+}
+
+bool OperationInterrupter::WaitUntilRunnable() {
+  base::AutoLock auto_lock(lock_);
+  while (suspended_ && !canceled_)
+    runnable_.Wait();
+  return !canceled_;
+}
+
+bool InterruptibleFileDescriptor::WaitUntilRunnable() {
+  if (interrupter_->WaitUntilRunnable())
+    return true;
+  errno = ECANCELED;
+  return false;
+}
+
+ssize_t InterruptibleFileDescriptor::Read(void* buf, size_t count) {
+  if (!WaitUntilRunnable())
+    return -1;
+  return fd_->Read(buf, count);
+}
+
+ssize_t InterruptibleFileDescriptor::Write(const void* buf, size_t count) {
+  if (!WaitUntilRunnable())
+    return -1;
+  return fd_->Write(buf, count);
+}
+
+bool InterruptibleFileDescriptor::BlkIoctl(int request,
+                                           uint64_t start,
+                                           uint64_t length,
+                                           int* result) {
+  if (!WaitUntilRunnable())
+    return false;
+  return fd_->BlkIoctl(request, start, length, result);
+}
+
+bool InterruptibleFileDescriptor::ZeroRange(uint64_t start, uint64_t length) {
+  if (!WaitUntilRunnable())
+    return false;
+  return fd_->ZeroRange(start, length);
+}
+
+}  // namespace chromeos_update_engine
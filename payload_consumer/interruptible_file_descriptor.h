@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INTERRUPTIBLE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INTERRUPTIBLE_FILE_DESCRIPTOR_H_
+
+#include <memory>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// An OperationInterrupter lets the thread driving an update suspend or cancel
+// the operations applied by other threads between two of their I/Os, instead
+// of waiting for whole operations, which can read and write hundreds of
+// megabytes, to finish.
+class OperationInterrupter {
+ public:
+  OperationInterrupter();
+
+  // Blocks the threads calling WaitUntilRunnable() until Resume() or
+  // Cancel() is called.
+  void Suspend();
+  void Resume();
+
+  // Makes the pending and all future calls to WaitUntilRunnable() return
+  // false. It can't be undone.
+  void Cancel();
+
+  bool is_suspended() const;
+  bool is_canceled() const;
+
+  // Returns true right away unless suspended or canceled. While suspended,
+  // blocks the calling thread until resumed. Returns false once canceled.
+  bool WaitUntilRunnable();
+
+ private:
+  // All of the following are protected by |lock_|.
+  mutable base::Lock lock_;
+  // Signaled when resumed or canceled.
+  base::ConditionVariable runnable_;
+  bool suspended_{false};
+  bool canceled_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(OperationInterrupter);
+};
+
+// A FileDescriptor that waits on an OperationInterrupter before each read,
+// write, zeroing and ioctl of the wrapped file descriptor, and fails them with
+// ECANCELED once canceled. The operations stop at their next I/O, so the
+// latency of a suspend or a cancel is bounded by the time of one I/O rather
+// than of one operation. Flush() and Close() are never interrupted, so the
+// data already written is kept.
+class InterruptibleFileDescriptor : public FileDescriptor {
+ public:
+  InterruptibleFileDescriptor(FileDescriptorPtr fd,
+                              std::shared_ptr<OperationInterrupter> interrupter)
+      : fd_(fd), interrupter_(interrupter) {}
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool ZeroRange(uint64_t start, uint64_t length) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  void Reset() override { fd_->Reset(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  // Waits until the |interrupter_| lets the I/Os run. Returns false and sets
+  // errno to ECANCELED when they are canceled.
+  bool WaitUntilRunnable();
+
+  FileDescriptorPtr fd_;
+  std::shared_ptr<OperationInterrupter> interrupter_;
+
+  DISALLOW_COPY_AND_ASSIGN(InterruptibleFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INTERRUPTIBLE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,120 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_consumer/interruptible_file_descriptor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include <base/threading/platform_thread.h>
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class InterruptibleFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    interrupter_ = std::make_shared<OperationInterrupter>();
+    fd_.reset(new InterruptibleFileDescriptor(
+        FileDescriptorPtr(new EintrSafeFileDescriptor()), interrupter_));
+    ASSERT_TRUE(fd_->Open(file_.path().c_str(), O_RDWR));
+  }
+
+  void TearDown() override {
+    if (fd_->IsOpen())
+      fd_->Close();
+  }
+
+  test_utils::ScopedTempFile file_{"InterruptibleFileDescriptor-XXXXXX"};
+  std::shared_ptr<OperationInterrupter> interrupter_;
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(InterruptibleFileDescriptorTest, ReadWriteTest) {
+  brillo::Blob data(4096, 'x');
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Write(data.data(), data.size()));
+  EXPECT_EQ(0, fd_->Seek(0, SEEK_SET));
+  brillo::Blob read_data(data.size());
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Read(read_data.data(), read_data.size()));
+  EXPECT_EQ(data, read_data);
+  EXPECT_TRUE(fd_->Flush());
+}
+
+TEST_F(InterruptibleFileDescriptorTest, SuspendTest) {
+  brillo::Blob data(4096, 'x');
+  interrupter_->Suspend();
+  EXPECT_TRUE(interrupter_->is_suspended());
+  std::atomic<bool> written{false};
+  std::thread writer([this, &data, &written] {
+    EXPECT_EQ(static_cast<ssize_t>(data.size()),
+              fd_->Write(data.data(), data.size()));
+    written = true;
+  });
+  // The write waits for the resume.
+  base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(50));
+  EXPECT_FALSE(written);
+  interrupter_->Resume();
+  writer.join();
+  EXPECT_TRUE(written);
+  EXPECT_EQ(static_cast<off_t>(data.size()), utils::FileSize(file_.path()));
+}
+
+TEST_F(InterruptibleFileDescriptorTest, CancelWhileSuspendedTest) {
+  brillo::Blob data(4096, 'x');
+  interrupter_->Suspend();
+  ssize_t result = 0;
+  int write_errno = 0;
+  std::thread writer([this, &data, &result, &write_errno] {
+    result = fd_->Write(data.data(), data.size());
+    write_errno = errno;
+  });
+  base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(10));
+  interrupter_->Cancel();
+  writer.join();
+  EXPECT_EQ(-1, result);
+  EXPECT_EQ(ECANCELED, write_errno);
+  EXPECT_EQ(0, utils::FileSize(file_.path()));
+}
+
+TEST_F(InterruptibleFileDescriptorTest, CancelTest) {
+  interrupter_->Cancel();
+  EXPECT_TRUE(interrupter_->is_canceled());
+  // A resume doesn't undo the cancel.
+  interrupter_->Resume();
+  brillo::Blob data(4096, 'x');
+  errno = 0;
+  EXPECT_EQ(-1, fd_->Write(data.data(), data.size()));
+  EXPECT_EQ(ECANCELED, errno);
+  EXPECT_EQ(-1, fd_->Read(data.data(), data.size()));
+  EXPECT_FALSE(fd_->ZeroRange(0, data.size()));
+  // The data already written can still be flushed.
+  EXPECT_TRUE(fd_->Flush());
+  EXPECT_TRUE(fd_->Close());
+}
+
+}  // namespace chromeos_update_engine
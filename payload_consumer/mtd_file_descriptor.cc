@@ -22,6 +22,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
 #include <vector>
 
 #include <base/files/file_path.h>
@@ -201,6 +202,8 @@ bool UbiFileDescriptor::Open(const char* path, int flags, mode_t mode) {
     }
     mode_ = kWriteOnly;
     nr_written_ = 0;
+    write_buffer_.clear();
+    write_buffer_.reserve(eraseblock_size_);
   } else {
     mode_ = kReadOnly;
   }
@@ -221,11 +224,51 @@ ssize_t UbiFileDescriptor::Read(void* buf, size_t count) {
 
 ssize_t UbiFileDescriptor::Write(const void* buf, size_t count) {
   CHECK(mode_ == kWriteOnly);
-  ssize_t nr_chunk = EintrSafeFileDescriptor::Write(buf, count);
-  if (nr_chunk >= 0) {
-    nr_written_ += nr_chunk;
+  const uint8_t* data = static_cast<const uint8_t*>(buf);
+  size_t remaining = count;
+  // Complete the eraseblock buffered first.
+  if (!write_buffer_.empty()) {
+    size_t nr_copy = std::min<uint64_t>(
+        remaining, eraseblock_size_ - write_buffer_.size());
+    write_buffer_.insert(write_buffer_.end(), data, data + nr_copy);
+    data += nr_copy;
+    remaining -= nr_copy;
+    if (write_buffer_.size() == eraseblock_size_ && !FlushWriteBuffer())
+      return -1;
   }
-  return nr_chunk;
+  // The whole eraseblocks left are written without copying them, and the
+  // rest is buffered.
+  size_t nr_direct = remaining - remaining % eraseblock_size_;
+  if (nr_direct > 0) {
+    if (!WriteAll(data, nr_direct))
+      return -1;
+    data += nr_direct;
+    remaining -= nr_direct;
+  }
+  write_buffer_.insert(write_buffer_.end(), data, data + remaining);
+  nr_written_ += count;
+  return count;
+}
+
+bool UbiFileDescriptor::WriteAll(const void* buf, size_t count) {
+  const char* data = static_cast<const char*>(buf);
+  while (count > 0) {
+    ssize_t nr_chunk = EintrSafeFileDescriptor::Write(data, count);
+    if (nr_chunk < 0)
+      return false;
+    data += nr_chunk;
+    count -= nr_chunk;
+  }
+  return true;
+}
+
+bool UbiFileDescriptor::FlushWriteBuffer() {
+  if (write_buffer_.empty())
+    return true;
+  TEST_AND_RETURN_FALSE_ERRNO(
+      WriteAll(write_buffer_.data(), write_buffer_.size()));
+  write_buffer_.clear();
+  return true;
 }
 
 off64_t UbiFileDescriptor::Seek(off64_t offset, int whence) {
@@ -236,6 +279,12 @@ off64_t UbiFileDescriptor::Seek(off64_t offset, int whence) {
   return EintrSafeFileDescriptor::Seek(offset, whence);
 }
 
+bool UbiFileDescriptor::Flush() {
+  if (mode_ == kWriteOnly)
+    TEST_AND_RETURN_FALSE(FlushWriteBuffer());
+  return EintrSafeFileDescriptor::Flush();
+}
+
 bool UbiFileDescriptor::Close() {
   bool pad_ok = true;
   if (IsOpen() && mode_ == kWriteOnly) {
@@ -244,20 +293,24 @@ bool UbiFileDescriptor::Close() {
     while (nr_written_ < volume_size_) {
       // We have written less than the whole volume. In order for us to clear
       // the update marker, we need to fill the rest. It is recommended to fill
-      // UBI writes with 0xFF.
+      // UBI writes with 0xFF. The padding is buffered like the data, so it's
+      // written in whole eraseblocks too.
       uint64_t to_write = volume_size_ - nr_written_;
       if (to_write > sizeof(buf)) {
         to_write = sizeof(buf);
       }
-      ssize_t nr_chunk = EintrSafeFileDescriptor::Write(buf, to_write);
-      if (nr_chunk < 0) {
+      if (Write(buf, to_write) < 0) {
         LOG(ERROR) << "Cannot 0xFF-pad before closing.";
         // There is an error, but we can't really do any meaningful thing here.
         pad_ok = false;
         break;
       }
-      nr_written_ += nr_chunk;
     }
+    if (pad_ok && !FlushWriteBuffer()) {
+      LOG(ERROR) << "Cannot write the last eraseblock before closing.";
+      pad_ok = false;
+    }
+    write_buffer_.clear();
   }
   return EintrSafeFileDescriptor::Close() && pad_ok;
 }
@@ -22,6 +22,8 @@
 
 #include <mtdutils.h>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
@@ -47,6 +49,7 @@ class MtdFileDescriptor : public EintrSafeFileDescriptor {
                 int* result) override {
     return false;
   }
+  bool ZeroRange(uint64_t start, uint64_t length) override { return false; }
   bool Close() override;
 
  private:
@@ -65,7 +68,9 @@ struct UbiVolumeInfo {
 // A file descriptor to update a UBI volume, similar to MtdFileDescriptor.
 // Once the file descriptor is opened for write, the volume is marked as being
 // updated. The volume will not be usable until an update is completed. See
-// UBI_IOCVOLUP ioctl operation.
+// UBI_IOCVOLUP ioctl operation. Like the MTD write context, the writes are
+// combined into whole eraseblocks before passing them to the volume, so the
+// many small extents of a payload don't result in a system call each.
 class UbiFileDescriptor : public EintrSafeFileDescriptor {
  public:
   // Perform some queries about |path| to see if it is a UBI volume.
@@ -83,6 +88,8 @@ class UbiFileDescriptor : public EintrSafeFileDescriptor {
                 int* result) override {
     return false;
   }
+  bool ZeroRange(uint64_t start, uint64_t length) override { return false; }
+  bool Flush() override;
   bool Close() override;
 
  private:
@@ -91,11 +98,23 @@ class UbiFileDescriptor : public EintrSafeFileDescriptor {
     kWriteOnly
   };
 
+  // Writes the whole |count| bytes at |buf| to the volume. Returns false on
+  // error, with errno set.
+  bool WriteAll(const void* buf, size_t count);
+
+  // Writes the data buffered in |write_buffer_| to the volume.
+  bool FlushWriteBuffer();
+
   uint64_t usable_eb_blocks_;
   uint64_t eraseblock_size_;
   uint64_t volume_size_;
+  // The bytes written, including those still in |write_buffer_|.
   uint64_t nr_written_;
 
+  // The data written since the last whole eraseblock, not passed to the
+  // volume yet.
+  brillo::Blob write_buffer_;
+
   Mode mode_;
 };
 
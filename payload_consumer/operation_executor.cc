@@ -0,0 +1,266 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_executor.h"
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns whether any of the blocks in |extents1| is also in |extents2|.
+// Sparse holes are not written, so they never overlap.
+bool ExtentsOverlap(const vector<Extent>& extents1,
+                    const vector<Extent>& extents2) {
+  for (const Extent& ext1 : extents1) {
+    if (ext1.start_block() == kSparseHole)
+      continue;
+    for (const Extent& ext2 : extents2) {
+      if (ext2.start_block() == kSparseHole)
+        continue;
+      if (ext1.start_block() < ext2.start_block() + ext2.num_blocks() &&
+          ext2.start_block() < ext1.start_block() + ext1.num_blocks()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+const uint32_t OperationExecutor::kNoWave = UINT32_MAX;
+
+OperationExecutor::OperationExecutor(size_t num_workers, size_t max_pending)
+    : max_pending_(max_pending),
+      work_available_(&lock_),
+      work_done_(&lock_) {
+  CHECK_GT(num_workers, 0U);
+  CHECK_GT(max_pending, 0U);
+  for (size_t i = 0; i < num_workers; i++)
+    workers_.emplace_back(new Worker(this, i));
+}
+
+OperationExecutor::~OperationExecutor() {
+  {
+    base::AutoLock auto_lock(lock_);
+    stopping_ = true;
+    work_available_.Broadcast();
+  }
+  for (const auto& thread : threads_)
+    thread->Join();
+}
+
+void OperationExecutor::Start() {
+  CHECK(threads_.empty());
+  for (const auto& worker : workers_) {
+    threads_.emplace_back(
+        new base::DelegateSimpleThread(worker.get(), "operation-executor"));
+    threads_.back()->Start();
+  }
+}
+
+void OperationExecutor::SetMaxActiveWorkers(size_t max_active_workers) {
+  base::AutoLock auto_lock(lock_);
+  if (max_active_workers == max_active_workers_)
+    return;
+  LOG(INFO) << "Limiting the active workers to " << max_active_workers
+            << " (0 for none) of " << workers_.size() << ".";
+  max_active_workers_ = max_active_workers;
+  // The workers allowed to run again may have operations waiting.
+  work_available_.Broadcast();
+}
+
+bool OperationExecutor::Schedule(size_t op_num,
+                                 size_t partition,
+                                 const vector<Extent>& dst_extents,
+                                 uint64_t data_size,
+                                 const Work& work,
+                                 ErrorCode* error) {
+  return ScheduleInWave(
+      op_num, partition, dst_extents, kNoWave, data_size, work, error);
+}
+
+bool OperationExecutor::ScheduleInWave(size_t op_num,
+                                       size_t partition,
+                                       const vector<Extent>& dst_extents,
+                                       uint32_t wave,
+                                       uint64_t data_size,
+                                       const Work& work,
+                                       ErrorCode* error) {
+  base::AutoLock auto_lock(lock_);
+  while (!failed_ &&
+         (NumUnfinishedLocked() >= max_pending_ ||
+          ExceedsPendingBytesLocked(data_size) ||
+          DependsOnUnfinishedLocked(partition, dst_extents, wave))) {
+    work_done_.Wait();
+  }
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+  CHECK_GE(op_num, first_unfinished_);
+  if (pending_.empty())
+    first_unfinished_ = op_num;
+  pending_.emplace_back(new PendingOperation{
+      op_num, partition, dst_extents, wave, data_size, work, false, false,
+      false});
+  pending_bytes_ += data_size;
+  // A single signal could wake up a worker over the limit, which would ignore
+  // the operation.
+  if (max_active_workers_)
+    work_available_.Broadcast();
+  else
+    work_available_.Signal();
+  return true;
+}
+
+bool OperationExecutor::WaitForAll(ErrorCode* error) {
+  base::AutoLock auto_lock(lock_);
+  while (NumUnfinishedLocked() > 0)
+    work_done_.Wait();
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+  return true;
+}
+
+bool OperationExecutor::WaitFor(size_t num_operations, ErrorCode* error) {
+  base::AutoLock auto_lock(lock_);
+  while (!failed_ && !IsFinishedLocked(num_operations))
+    work_done_.Wait();
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+  return true;
+}
+
+bool OperationExecutor::IsFinished(size_t num_operations) {
+  base::AutoLock auto_lock(lock_);
+  return IsFinishedLocked(num_operations);
+}
+
+size_t OperationExecutor::FirstUnfinishedOperation() {
+  base::AutoLock auto_lock(lock_);
+  return first_unfinished_;
+}
+
+void OperationExecutor::RunWorker(size_t worker_index) {
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    PendingOperation* op = nullptr;
+    while (!stopping_ &&
+           ((max_active_workers_ && worker_index >= max_active_workers_) ||
+            !(op = NextOperationLocked()))) {
+      work_available_.Wait();
+    }
+    if (stopping_)
+      return;
+
+    op->started = true;
+    // Once an operation failed, the remaining ones are dropped without
+    // applying them.
+    if (!failed_) {
+      ErrorCode error = ErrorCode::kSuccess;
+      bool success;
+      {
+        base::AutoUnlock auto_unlock(lock_);
+        success = op->work.Run(worker_index, &error);
+      }
+      op->succeeded = success;
+      if (!success && !failed_) {
+        LOG(ERROR) << "Failed to apply operation " << op->op_num;
+        failed_ = true;
+        error_ = error == ErrorCode::kSuccess ?
+            ErrorCode::kDownloadOperationExecutionError : error;
+      }
+    }
+    // Release the resources bound to the work, such as the operation data.
+    op->work.Reset();
+    pending_bytes_ -= op->data_size;
+    op->done = true;
+    RetireFinishedLocked();
+    work_done_.Broadcast();
+  }
+}
+
+OperationExecutor::PendingOperation* OperationExecutor::NextOperationLocked() {
+  for (const auto& op : pending_) {
+    if (!op->started)
+      return op.get();
+  }
+  return nullptr;
+}
+
+size_t OperationExecutor::NumUnfinishedLocked() const {
+  size_t result = 0;
+  for (const auto& op : pending_) {
+    if (!op->done)
+      result++;
+  }
+  return result;
+}
+
+bool OperationExecutor::DependsOnUnfinishedLocked(
+    size_t partition, const vector<Extent>& extents, uint32_t wave) const {
+  for (const auto& op : pending_) {
+    if (op->done || op->partition != partition)
+      continue;
+    // The waves already account for the blocks read and written, so the
+    // extents are only compared when either operation has no wave.
+    if (wave != kNoWave && op->wave != kNoWave) {
+      if (op->wave < wave)
+        return true;
+    } else if (ExtentsOverlap(op->dst_extents, extents)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool OperationExecutor::ExceedsPendingBytesLocked(uint64_t data_size) const {
+  // An operation larger than the limit is scheduled once it's the only one.
+  if (!max_pending_bytes_ || NumUnfinishedLocked() == 0)
+    return false;
+  return pending_bytes_ + data_size > max_pending_bytes_;
+}
+
+bool OperationExecutor::IsFinishedLocked(size_t num_operations) const {
+  if (failed_)
+    return false;
+  // Once all the scheduled operations finished, |first_unfinished_| is only
+  // one past the last scheduled operation.
+  return pending_.empty() || first_unfinished_ >= num_operations;
+}
+
+void OperationExecutor::RetireFinishedLocked() {
+  while (!pending_.empty() && pending_.front()->done &&
+         pending_.front()->succeeded) {
+    first_unfinished_ = pending_.front()->op_num + 1;
+    pending_.pop_front();
+  }
+  if (!pending_.empty())
+    first_unfinished_ = pending_.front()->op_num;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_EXECUTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_EXECUTOR_H_
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The OperationExecutor applies install operations on a bounded pool of worker
+// threads. Operations are scheduled in order from a single thread and may
+// finish out of order, except that an operation writing to blocks written by a
+// previous unfinished operation is only scheduled once the previous one
+// finished. The executor keeps track of the prefix of operations that finished
+// successfully, which is the progress that can be checkpointed.
+class OperationExecutor {
+ public:
+  // The work to apply an operation. |worker_index| identifies the worker
+  // thread running it, in the range [0, num_workers), so the work can use
+  // per-thread resources such as file descriptors. Returns whether the work
+  // succeeded, setting |error| otherwise.
+  using Work = base::Callback<bool(size_t worker_index, ErrorCode* error)>;
+
+  // The wave of the operations scheduled without an apply wave hint.
+  static const uint32_t kNoWave;
+
+  // Creates an executor with |num_workers| threads that keeps at most
+  // |max_pending| scheduled operations not finished at any time.
+  OperationExecutor(size_t num_workers, size_t max_pending);
+
+  // Stops the worker threads. Operations not started yet are dropped, so
+  // WaitForAll() should be called first to apply all of them.
+  ~OperationExecutor();
+
+  // Sets the maximum number of bytes of operation data held by the unfinished
+  // operations. An operation whose data doesn't fit is only scheduled once
+  // enough of the previous ones finished, or right away when there is no
+  // unfinished operation. When zero, the default, only the number of
+  // unfinished operations is limited. Must be called before Start().
+  void set_max_pending_bytes(uint64_t max_pending_bytes) {
+    max_pending_bytes_ = max_pending_bytes;
+  }
+
+  // Starts the worker threads.
+  void Start();
+
+  // Limits the number of workers applying operations at the same time to
+  // |max_active_workers|, or lifts the limit when zero, the default. The
+  // workers over the limit finish the operation they're applying first. Can be
+  // called at any time.
+  void SetMaxActiveWorkers(size_t max_active_workers);
+
+  // Schedules the |work| to apply the operation number |op_num|, which writes
+  // to the |dst_extents| of the |partition| and holds |data_size| bytes of
+  // operation data until it finishes. Operation numbers must be scheduled in
+  // increasing order, except that the independent parts of an operation can
+  // be scheduled with the same number, finishing the operation once all of
+  // them finished. Blocks while there are |max_pending| unfinished
+  // operations, the |data_size| doesn't fit in the |max_pending_bytes| or an
+  // unfinished operation writes to any of the |dst_extents| of the same
+  // |partition|. Returns false without scheduling the work if a previous
+  // operation failed, setting |error| to the error of the first failure.
+  bool Schedule(size_t op_num,
+                size_t partition,
+                const std::vector<Extent>& dst_extents,
+                uint64_t data_size,
+                const Work& work,
+                ErrorCode* error);
+
+  // Same as Schedule(), but relies on the apply |wave| the payload assigned to
+  // the operation instead of comparing its |dst_extents|: the operation only
+  // waits for the unfinished operations of the same |partition| in an earlier
+  // wave. The operations of a wave don't access the blocks written by each
+  // other, so they can be applied in any order. The |dst_extents| are only
+  // compared with the operations scheduled without a wave.
+  bool ScheduleInWave(size_t op_num,
+                      size_t partition,
+                      const std::vector<Extent>& dst_extents,
+                      uint32_t wave,
+                      uint64_t data_size,
+                      const Work& work,
+                      ErrorCode* error);
+
+  // Waits until all the scheduled operations finish. Returns false if any of
+  // them failed, setting |error| to the error of the first failure.
+  bool WaitForAll(ErrorCode* error);
+
+  // Waits until all the scheduled operations with a number lower than
+  // |num_operations| finish. Returns false if any operation failed, setting
+  // |error| to the error of the first failure.
+  bool WaitFor(size_t num_operations, ErrorCode* error);
+
+  // Returns whether all the scheduled operations with a number lower than
+  // |num_operations| finished successfully.
+  bool IsFinished(size_t num_operations);
+
+  // Returns the number of the first scheduled operation that didn't finish
+  // yet, or one past the last finished operation if all of them finished. All
+  // the operations before this number finished successfully.
+  size_t FirstUnfinishedOperation();
+
+  size_t num_workers() const { return workers_.size(); }
+
+ private:
+  struct PendingOperation {
+    size_t op_num;
+    size_t partition;
+    std::vector<Extent> dst_extents;
+    uint32_t wave;
+    uint64_t data_size;
+    Work work;
+    bool started;
+    bool done;
+    bool succeeded;
+  };
+
+  class Worker : public base::DelegateSimpleThread::Delegate {
+   public:
+    Worker(OperationExecutor* executor, size_t index)
+        : executor_(executor), index_(index) {}
+    ~Worker() override = default;
+
+    // Overrides DelegateSimpleThread::Delegate.
+    void Run() override { executor_->RunWorker(index_); }
+
+   private:
+    OperationExecutor* executor_;
+    size_t index_;
+
+    DISALLOW_COPY_AND_ASSIGN(Worker);
+  };
+
+  // The main loop of the worker thread |worker_index|.
+  void RunWorker(size_t worker_index);
+
+  // Returns the first scheduled operation not started yet, or nullptr if there
+  // is none. Must be called with |lock_| held.
+  PendingOperation* NextOperationLocked();
+
+  // Returns the number of scheduled operations not finished yet and whether an
+  // operation writing to the |extents| of the |partition| in the |wave| must
+  // wait for any of them. Must be called with |lock_| held.
+  size_t NumUnfinishedLocked() const;
+  bool DependsOnUnfinishedLocked(size_t partition,
+                                 const std::vector<Extent>& extents,
+                                 uint32_t wave) const;
+
+  // Returns whether an operation with |data_size| bytes of data would exceed
+  // the |max_pending_bytes_|. Must be called with |lock_| held.
+  bool ExceedsPendingBytesLocked(uint64_t data_size) const;
+
+  // Returns whether all the operations before |num_operations| finished
+  // successfully. Must be called with |lock_| held.
+  bool IsFinishedLocked(size_t num_operations) const;
+
+  // Removes the finished operations from the front of |pending_|, advancing
+  // |first_unfinished_|. Must be called with |lock_| held.
+  void RetireFinishedLocked();
+
+  const size_t max_pending_;
+  uint64_t max_pending_bytes_{0};
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::unique_ptr<base::DelegateSimpleThread>> threads_;
+
+  // All of the following are protected by |lock_|.
+  base::Lock lock_;
+  // Signaled when there's new work for the workers or they should stop.
+  base::ConditionVariable work_available_;
+  // Signaled every time an operation finishes.
+  base::ConditionVariable work_done_;
+
+  // The scheduled operations from the first unfinished one, in order.
+  std::deque<std::unique_ptr<PendingOperation>> pending_;
+  size_t first_unfinished_{0};
+  // The operation data bytes held by the unfinished operations.
+  uint64_t pending_bytes_{0};
+  // The workers with an index past this limit don't start new operations,
+  // unless it's zero.
+  size_t max_active_workers_{0};
+
+  bool stopping_{false};
+  bool failed_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+
+  DISALLOW_COPY_AND_ASSIGN(OperationExecutor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_EXECUTOR_H_
@@ -0,0 +1,296 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_executor.h"
+
+#include <vector>
+
+#include <base/bind.h>
+#include <base/synchronization/waitable_event.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Records the |op_num| in |order| and returns |result|.
+bool RecordOperation(base::Lock* lock,
+                     vector<size_t>* order,
+                     size_t op_num,
+                     bool result,
+                     size_t worker_index,
+                     ErrorCode* error) {
+  base::AutoLock auto_lock(*lock);
+  order->push_back(op_num);
+  if (!result)
+    *error = ErrorCode::kDownloadStateInitializationError;
+  return result;
+}
+
+// Records the |worker_index| running the operation in |workers|.
+bool RecordWorker(base::Lock* lock,
+                  vector<size_t>* workers,
+                  size_t worker_index,
+                  ErrorCode* error) {
+  base::AutoLock auto_lock(*lock);
+  workers->push_back(worker_index);
+  return true;
+}
+
+// Waits for the |event| before returning true.
+bool WaitForEvent(base::WaitableEvent* event,
+                  size_t worker_index,
+                  ErrorCode* error) {
+  event->Wait();
+  return true;
+}
+
+}  // namespace
+
+class OperationExecutorTest : public ::testing::Test {
+ protected:
+  OperationExecutor::Work RecordWork(size_t op_num, bool result) {
+    return base::Bind(&RecordOperation, &lock_, &order_, op_num, result);
+  }
+
+  base::Lock lock_;
+  vector<size_t> order_;
+};
+
+TEST_F(OperationExecutorTest, AllOperationsRunTest) {
+  OperationExecutor executor(4, 8);
+  executor.Start();
+  ErrorCode error = ErrorCode::kSuccess;
+  for (size_t i = 0; i < 20; i++) {
+    EXPECT_TRUE(executor.Schedule(
+        i, 0, {ExtentForRange(i, 1)}, 0, RecordWork(i, true), &error));
+  }
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(20U, order_.size());
+  EXPECT_EQ(20U, executor.FirstUnfinishedOperation());
+}
+
+TEST_F(OperationExecutorTest, PrefixStopsAtUnfinishedOperationTest) {
+  OperationExecutor executor(2, 4);
+  executor.Start();
+  base::WaitableEvent event(true, false);
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(executor.Schedule(5,
+                                0,
+                                {ExtentForRange(0, 1)},
+                                0,
+                                base::Bind(&WaitForEvent, &event),
+                                &error));
+  EXPECT_TRUE(executor.Schedule(
+      6, 0, {ExtentForRange(1, 1)}, 0, RecordWork(6, true), &error));
+
+  // Wait until the operation 6 finished by scheduling an operation writing to
+  // the same block.
+  EXPECT_TRUE(executor.Schedule(
+      7, 0, {ExtentForRange(1, 1)}, 0, RecordWork(7, true), &error));
+  EXPECT_EQ(5U, executor.FirstUnfinishedOperation());
+  EXPECT_TRUE(executor.IsFinished(5));
+  EXPECT_FALSE(executor.IsFinished(6));
+
+  event.Signal();
+  EXPECT_TRUE(executor.WaitFor(6, &error));
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  EXPECT_EQ(8U, executor.FirstUnfinishedOperation());
+  EXPECT_TRUE(executor.IsFinished(100));
+}
+
+TEST_F(OperationExecutorTest, OperationPartsTest) {
+  OperationExecutor executor(2, 4);
+  executor.Start();
+  base::WaitableEvent event(true, false);
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(executor.Schedule(3,
+                                0,
+                                {ExtentForRange(0, 1)},
+                                0,
+                                base::Bind(&WaitForEvent, &event),
+                                &error));
+  EXPECT_TRUE(executor.Schedule(
+      3, 0, {ExtentForRange(1, 1)}, 0, RecordWork(3, true), &error));
+  // Wait until the second part finished.
+  EXPECT_TRUE(executor.Schedule(
+      4, 0, {ExtentForRange(1, 1)}, 0, RecordWork(4, true), &error));
+  // The operation isn't finished until its first part is.
+  EXPECT_EQ(3U, executor.FirstUnfinishedOperation());
+  EXPECT_FALSE(executor.IsFinished(4));
+
+  event.Signal();
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  EXPECT_EQ(5U, executor.FirstUnfinishedOperation());
+}
+
+TEST_F(OperationExecutorTest, SameExtentsOnOtherPartitionTest) {
+  OperationExecutor executor(2, 4);
+  executor.Start();
+  base::WaitableEvent event(true, false);
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(executor.Schedule(0,
+                                0,
+                                {ExtentForRange(0, 1)},
+                                0,
+                                base::Bind(&WaitForEvent, &event),
+                                &error));
+  // The same blocks on another partition don't wait for the first operation.
+  EXPECT_TRUE(executor.Schedule(
+      1, 1, {ExtentForRange(0, 1)}, 0, RecordWork(1, true), &error));
+  EXPECT_TRUE(executor.Schedule(
+      2, 1, {ExtentForRange(0, 1)}, 0, RecordWork(2, true), &error));
+  EXPECT_FALSE(executor.IsFinished(1));
+
+  event.Signal();
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  vector<size_t> expected = {1, 2};
+  EXPECT_EQ(expected, order_);
+}
+
+TEST_F(OperationExecutorTest, OverlappingOperationsRunInOrderTest) {
+  OperationExecutor executor(4, 8);
+  executor.Start();
+  ErrorCode error = ErrorCode::kSuccess;
+  for (size_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(executor.Schedule(
+        i, 0, {ExtentForRange(10 - i, 2 + i)}, 0, RecordWork(i, true),
+        &error));
+  }
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  vector<size_t> expected = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  EXPECT_EQ(expected, order_);
+}
+
+TEST_F(OperationExecutorTest, ApplyWavesTest) {
+  OperationExecutor executor(2, 8);
+  executor.Start();
+  base::WaitableEvent event(true, false);
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(executor.ScheduleInWave(0,
+                                      0,
+                                      {ExtentForRange(0, 1)},
+                                      0,
+                                      0,
+                                      base::Bind(&WaitForEvent, &event),
+                                      &error));
+  // The operations of the same wave don't wait for each other, even when the
+  // extents overlap, since the wave already accounts for them.
+  EXPECT_TRUE(executor.ScheduleInWave(
+      1, 0, {ExtentForRange(0, 1)}, 0, 0, RecordWork(1, true), &error));
+  // Wait until the operations 1 and 2, applied in order by the second worker,
+  // finished by scheduling an operation in the next wave of the partition 1.
+  EXPECT_TRUE(executor.ScheduleInWave(
+      2, 1, {ExtentForRange(5, 1)}, 0, 0, RecordWork(2, true), &error));
+  EXPECT_TRUE(executor.ScheduleInWave(
+      3, 1, {ExtentForRange(6, 1)}, 1, 0, RecordWork(3, true), &error));
+  EXPECT_FALSE(executor.IsFinished(1));
+  {
+    base::AutoLock auto_lock(lock_);
+    vector<size_t> expected = {1, 2};
+    EXPECT_EQ(expected, vector<size_t>(order_.begin(), order_.begin() + 2));
+  }
+
+  event.Signal();
+  // The next wave of the partition 0 waits for the operation 0.
+  EXPECT_TRUE(executor.ScheduleInWave(
+      4, 0, {ExtentForRange(7, 1)}, 1, 0, RecordWork(4, true), &error));
+  EXPECT_TRUE(executor.IsFinished(1));
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  EXPECT_EQ(4U, order_.size());
+}
+
+TEST_F(OperationExecutorTest, PendingBytesLimitTest) {
+  OperationExecutor executor(2, 8);
+  executor.set_max_pending_bytes(100);
+  executor.Start();
+  ErrorCode error = ErrorCode::kSuccess;
+  // An operation larger than the limit is scheduled when it's the only one.
+  EXPECT_TRUE(executor.Schedule(
+      0, 0, {ExtentForRange(0, 1)}, 200, RecordWork(0, true), &error));
+  // The next operation has to wait until the previous one finished.
+  EXPECT_TRUE(executor.Schedule(
+      1, 0, {ExtentForRange(1, 1)}, 10, RecordWork(1, true), &error));
+  EXPECT_TRUE(executor.IsFinished(1));
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  vector<size_t> expected = {0, 1};
+  EXPECT_EQ(expected, order_);
+}
+
+TEST_F(OperationExecutorTest, MaxActiveWorkersTest) {
+  OperationExecutor executor(4, 8);
+  executor.SetMaxActiveWorkers(1);
+  executor.Start();
+  ErrorCode error = ErrorCode::kSuccess;
+  vector<size_t> workers;
+  for (size_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(executor.Schedule(i,
+                                  0,
+                                  {ExtentForRange(i, 1)},
+                                  0,
+                                  base::Bind(&RecordWorker, &lock_, &workers),
+                                  &error));
+  }
+  EXPECT_TRUE(executor.WaitForAll(&error));
+  vector<size_t> expected(10, 0);
+  EXPECT_EQ(expected, workers);
+
+  // Once the limit is lifted, an operation runs while another one blocks.
+  executor.SetMaxActiveWorkers(0);
+  base::WaitableEvent event(true, false);
+  EXPECT_TRUE(executor.Schedule(10,
+                                0,
+                                {ExtentForRange(0, 1)},
+                                0,
+                                base::Bind(&WaitForEvent, &event),
+                                &error));
+  EXPECT_TRUE(executor.Schedule(
+      11, 0, {ExtentForRange(1, 1)}, 0, RecordWork(11, true), &error));
+  // Wait until the operation 11 finished by scheduling an operation writing to
+  // the same block.
+  EXPECT_TRUE(executor.Schedule(
+      12, 0, {ExtentForRange(1, 1)}, 0, RecordWork(12, true), &error));
+  EXPECT_EQ(10U, executor.FirstUnfinishedOperation());
+  event.Signal();
+  EXPECT_TRUE(executor.WaitForAll(&error));
+}
+
+TEST_F(OperationExecutorTest, FailedOperationTest) {
+  OperationExecutor executor(1, 1);
+  executor.Start();
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(executor.Schedule(
+      0, 0, {ExtentForRange(0, 1)}, 0, RecordWork(0, true), &error));
+  EXPECT_TRUE(executor.Schedule(
+      1, 0, {ExtentForRange(1, 1)}, 0, RecordWork(1, false), &error));
+  EXPECT_FALSE(executor.WaitForAll(&error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  EXPECT_EQ(1U, executor.FirstUnfinishedOperation());
+
+  // No more operations are scheduled after a failure.
+  error = ErrorCode::kSuccess;
+  EXPECT_FALSE(executor.Schedule(
+      2, 0, {ExtentForRange(2, 1)}, 0, RecordWork(2, true), &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  EXPECT_EQ(2U, order_.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,172 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::map;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+uint64_t ExtentsBlockCount(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  uint64_t num_blocks = 0;
+  for (const Extent& extent : extents)
+    num_blocks += extent.num_blocks();
+  return num_blocks;
+}
+
+// Appends the summary line of the |totals| named |name| to |out|.
+void AppendTotals(const string& name,
+                  const OperationStats::Totals& totals,
+                  string* out) {
+  const double wall_seconds = totals.wall_time.InSecondsF();
+  const double written_mib = totals.bytes_written / (1024.0 * 1024.0);
+  base::StringAppendF(
+      out,
+      "  %s: %" PRIu64 " ops, %.3fs wall, %.3fs CPU, %" PRIu64
+      " bytes read, %" PRIu64 " bytes written, %.1f MiB/s\n",
+      name.c_str(),
+      totals.num_operations,
+      wall_seconds,
+      totals.cpu_time.InSecondsF(),
+      totals.bytes_read,
+      totals.bytes_written,
+      wall_seconds > 0 ? written_mib / wall_seconds : 0.0);
+}
+
+}  // namespace
+
+void OperationStats::Totals::Add(const Totals& other) {
+  num_operations += other.num_operations;
+  wall_time += other.wall_time;
+  cpu_time += other.cpu_time;
+  bytes_read += other.bytes_read;
+  bytes_written += other.bytes_written;
+  payload_bytes_read += other.payload_bytes_read;
+}
+
+OperationStats::ScopedTimer::ScopedTimer(OperationStats* stats,
+                                         const InstallOperation& operation,
+                                         const string& partition,
+                                         uint32_t block_size)
+    : stats_(stats),
+      operation_(operation),
+      partition_(partition),
+      block_size_(block_size) {
+  if (!stats_)
+    return;
+  wall_start_ = base::TimeTicks::Now();
+  cpu_start_ = ThreadCPUTime();
+}
+
+OperationStats::ScopedTimer::~ScopedTimer() {
+  if (!stats_)
+    return;
+  Totals totals;
+  totals.wall_time = base::TimeTicks::Now() - wall_start_;
+  totals.cpu_time = ThreadCPUTime() - cpu_start_;
+  if (finished_) {
+    totals.num_operations = 1;
+    totals.bytes_read = BytesRead(operation_, block_size_);
+    totals.bytes_written = BytesWritten(operation_, block_size_);
+    totals.payload_bytes_read = operation_.data_length();
+  }
+  stats_->Record(operation_.type(), partition_, totals);
+}
+
+void OperationStats::Record(InstallOperation::Type type,
+                            const string& partition,
+                            const Totals& totals) {
+  base::AutoLock auto_lock(lock_);
+  by_type_[type].Add(totals);
+  by_partition_[partition].Add(totals);
+}
+
+void OperationStats::RecordCheckpoint(base::TimeDelta wall_time) {
+  base::AutoLock auto_lock(lock_);
+  checkpoints_.num_operations++;
+  checkpoints_.wall_time += wall_time;
+}
+
+map<InstallOperation::Type, OperationStats::Totals>
+OperationStats::totals_by_type() const {
+  base::AutoLock auto_lock(lock_);
+  return by_type_;
+}
+
+map<string, OperationStats::Totals>
+OperationStats::totals_by_partition() const {
+  base::AutoLock auto_lock(lock_);
+  return by_partition_;
+}
+
+OperationStats::Totals OperationStats::checkpoint_totals() const {
+  base::AutoLock auto_lock(lock_);
+  return checkpoints_;
+}
+
+string OperationStats::ToString() const {
+  base::AutoLock auto_lock(lock_);
+  string out = "Install operations by type:\n";
+  for (const auto& type_totals : by_type_) {
+    AppendTotals(InstallOperationTypeName(type_totals.first),
+                 type_totals.second,
+                 &out);
+  }
+  out += "Install operations by partition:\n";
+  for (const auto& partition_totals : by_partition_)
+    AppendTotals(partition_totals.first, partition_totals.second, &out);
+  base::StringAppendF(&out,
+                      "Checkpoints: %" PRIu64 " saved in %.3fs\n",
+                      checkpoints_.num_operations,
+                      checkpoints_.wall_time.InSecondsF());
+  return out;
+}
+
+base::TimeDelta OperationStats::ThreadCPUTime() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return base::TimeDelta();
+  return base::TimeDelta::FromMicroseconds(
+      static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+uint64_t OperationStats::BytesRead(const InstallOperation& operation,
+                                   uint32_t block_size) {
+  uint64_t source_bytes = operation.has_src_length() ?
+      operation.src_length() :
+      ExtentsBlockCount(operation.src_extents()) * block_size;
+  return operation.data_length() + source_bytes;
+}
+
+uint64_t OperationStats::BytesWritten(const InstallOperation& operation,
+                                      uint32_t block_size) {
+  return operation.has_dst_length() ?
+      operation.dst_length() :
+      ExtentsBlockCount(operation.dst_extents()) * block_size;
+}
+
+}  // namespace chromeos_update_engine
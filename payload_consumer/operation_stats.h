@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// OperationStats accumulates the time spent applying the install operations
+// and the amount of data they read and wrote, both per operation type and per
+// partition, so slow updates can be attributed to the operations causing them.
+// Operations may be recorded from several threads at the same time.
+class OperationStats {
+ public:
+  struct Totals {
+    // The number of operations recorded.
+    uint64_t num_operations{0};
+    // The wall time and the CPU time of the thread applying the operations.
+    base::TimeDelta wall_time;
+    base::TimeDelta cpu_time;
+    // The bytes of payload data and source or target partition data read by
+    // the operations, and the bytes of target partition written by them.
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+    // The part of |bytes_read| that is payload data, the rest being read from
+    // the partitions.
+    uint64_t payload_bytes_read{0};
+
+    void Add(const Totals& other);
+  };
+
+  // Measures the wall and CPU time of the calling thread from its creation to
+  // its destruction, and records them in |stats| together with the bytes the
+  // |operation| of the |partition| reads and writes in blocks of |block_size|
+  // bytes. Nothing is recorded if |stats| is null.
+  class ScopedTimer {
+   public:
+    ScopedTimer(OperationStats* stats,
+                const InstallOperation& operation,
+                const std::string& partition,
+                uint32_t block_size);
+    ~ScopedTimer();
+
+    // Sets whether the |operation| finished by the time this timer is
+    // destroyed. Operations applied in several steps, such as the ones
+    // streamed as their data arrives, only count the operation and its bytes
+    // on the last step. Defaults to true.
+    void set_finished(bool finished) { finished_ = finished; }
+
+   private:
+    OperationStats* stats_;
+    const InstallOperation& operation_;
+    const std::string& partition_;
+    const uint32_t block_size_;
+    bool finished_{true};
+    base::TimeTicks wall_start_;
+    base::TimeDelta cpu_start_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedTimer);
+  };
+
+  OperationStats() = default;
+
+  // Adds the |totals| of an operation of |type| in the |partition|.
+  void Record(InstallOperation::Type type,
+              const std::string& partition,
+              const Totals& totals);
+
+  // Adds the |wall_time| spent saving the progress to disk.
+  void RecordCheckpoint(base::TimeDelta wall_time);
+
+  // Returns a copy of the totals per operation type, per partition and of the
+  // checkpoints. The checkpoint totals only have the number of checkpoints
+  // saved, as |num_operations|, and their wall time.
+  std::map<InstallOperation::Type, Totals> totals_by_type() const;
+  std::map<std::string, Totals> totals_by_partition() const;
+  Totals checkpoint_totals() const;
+
+  // Returns a multi-line human readable summary of all the totals.
+  std::string ToString() const;
+
+  // Returns the CPU time consumed by the calling thread so far.
+  static base::TimeDelta ThreadCPUTime();
+
+  // Returns the bytes read and written by the |operation| in blocks of
+  // |block_size| bytes.
+  static uint64_t BytesRead(const InstallOperation& operation,
+                            uint32_t block_size);
+  static uint64_t BytesWritten(const InstallOperation& operation,
+                               uint32_t block_size);
+
+ private:
+  mutable base::Lock lock_;
+  std::map<InstallOperation::Type, Totals> by_type_;
+  std::map<std::string, Totals> by_partition_;
+  Totals checkpoints_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationStats);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class OperationStatsTest : public ::testing::Test {
+ protected:
+  const uint32_t kBlockSize = 4096;
+  OperationStats stats_;
+};
+
+TEST_F(OperationStatsTest, BytesReadAndWrittenTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_BSDIFF);
+  op.set_data_length(100);
+  *(op.add_src_extents()) = ExtentForRange(0, 2);
+  *(op.add_src_extents()) = ExtentForRange(10, 1);
+  *(op.add_dst_extents()) = ExtentForRange(5, 4);
+  EXPECT_EQ(100 + 3 * kBlockSize, OperationStats::BytesRead(op, kBlockSize));
+  EXPECT_EQ(4 * kBlockSize, OperationStats::BytesWritten(op, kBlockSize));
+
+  // The src_length and dst_length take precedence over the extents.
+  op.set_src_length(3 * kBlockSize - 10);
+  op.set_dst_length(4 * kBlockSize - 20);
+  EXPECT_EQ(100 + 3 * kBlockSize - 10,
+            OperationStats::BytesRead(op, kBlockSize));
+  EXPECT_EQ(4 * kBlockSize - 20, OperationStats::BytesWritten(op, kBlockSize));
+}
+
+TEST_F(OperationStatsTest, RecordTest) {
+  OperationStats::Totals totals;
+  totals.num_operations = 1;
+  totals.wall_time = base::TimeDelta::FromMilliseconds(200);
+  totals.cpu_time = base::TimeDelta::FromMilliseconds(100);
+  totals.bytes_read = 10;
+  totals.bytes_written = 20;
+  totals.payload_bytes_read = 4;
+  stats_.Record(InstallOperation::REPLACE, "root", totals);
+  stats_.Record(InstallOperation::REPLACE, "kernel", totals);
+  stats_.Record(InstallOperation::ZERO, "root", totals);
+
+  auto by_type = stats_.totals_by_type();
+  ASSERT_EQ(2U, by_type.size());
+  EXPECT_EQ(2U, by_type[InstallOperation::REPLACE].num_operations);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(400),
+            by_type[InstallOperation::REPLACE].wall_time);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(200),
+            by_type[InstallOperation::REPLACE].cpu_time);
+  EXPECT_EQ(20U, by_type[InstallOperation::REPLACE].bytes_read);
+  EXPECT_EQ(40U, by_type[InstallOperation::REPLACE].bytes_written);
+  EXPECT_EQ(8U, by_type[InstallOperation::REPLACE].payload_bytes_read);
+  EXPECT_EQ(1U, by_type[InstallOperation::ZERO].num_operations);
+
+  auto by_partition = stats_.totals_by_partition();
+  ASSERT_EQ(2U, by_partition.size());
+  EXPECT_EQ(2U, by_partition["root"].num_operations);
+  EXPECT_EQ(1U, by_partition["kernel"].num_operations);
+
+  stats_.RecordCheckpoint(base::TimeDelta::FromMilliseconds(5));
+  stats_.RecordCheckpoint(base::TimeDelta::FromMilliseconds(7));
+  EXPECT_EQ(2U, stats_.checkpoint_totals().num_operations);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(12),
+            stats_.checkpoint_totals().wall_time);
+
+  string summary = stats_.ToString();
+  EXPECT_NE(string::npos, summary.find("REPLACE: 2 ops"));
+  EXPECT_NE(string::npos, summary.find("ZERO: 1 ops"));
+  EXPECT_NE(string::npos, summary.find("kernel: 1 ops"));
+  EXPECT_NE(string::npos, summary.find("Checkpoints: 2 saved"));
+}
+
+TEST_F(OperationStatsTest, ScopedTimerTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE_BZ);
+  op.set_data_length(50);
+  *(op.add_dst_extents()) = ExtentForRange(0, 2);
+  const string partition = "root";
+  {
+    OperationStats::ScopedTimer timer(&stats_, op, partition, kBlockSize);
+    timer.set_finished(false);
+  }
+  auto by_type = stats_.totals_by_type();
+  EXPECT_EQ(0U, by_type[InstallOperation::REPLACE_BZ].num_operations);
+  EXPECT_EQ(0U, by_type[InstallOperation::REPLACE_BZ].bytes_written);
+
+  {
+    OperationStats::ScopedTimer timer(&stats_, op, partition, kBlockSize);
+  }
+  by_type = stats_.totals_by_type();
+  EXPECT_EQ(1U, by_type[InstallOperation::REPLACE_BZ].num_operations);
+  EXPECT_EQ(50U, by_type[InstallOperation::REPLACE_BZ].bytes_read);
+  EXPECT_EQ(50U, by_type[InstallOperation::REPLACE_BZ].payload_bytes_read);
+  EXPECT_EQ(2 * kBlockSize, by_type[InstallOperation::REPLACE_BZ].bytes_written);
+  EXPECT_EQ(1U, stats_.totals_by_partition()[partition].num_operations);
+
+  // A timer without stats doesn't record anything.
+  { OperationStats::ScopedTimer timer(nullptr, op, partition, kBlockSize); }
+}
+
+}  // namespace chromeos_update_engine
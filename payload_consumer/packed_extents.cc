@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The most bytes a varint encoding a 64-bit value takes.
+const size_t kMaxVarintSize = 10;
+
+void AppendVarint(uint64_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Reads the varint at |*pos| of |data| into |value|, advancing |*pos| past
+// it. Returns false if it's truncated or longer than a 64-bit value.
+bool ReadVarint(const string& data, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < kMaxVarintSize && *pos < data.size(); i++) {
+    uint8_t byte = static_cast<uint8_t>(data[(*pos)++]);
+    *value |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// The differences between the blocks wrap around, so they work for the
+// kSparseHole extents too.
+uint64_t ZigzagEncode(uint64_t delta) {
+  return (delta << 1) ^
+         static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+}
+
+uint64_t ZigzagDecode(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+}  // namespace
+
+string PackExtents(const RepeatedPtrField<Extent>& extents) {
+  string packed;
+  packed.reserve(extents.size() * 3);
+  uint64_t last_end = 0;
+  for (const Extent& extent : extents) {
+    AppendVarint(ZigzagEncode(extent.start_block() - last_end), &packed);
+    AppendVarint(extent.num_blocks(), &packed);
+    last_end = extent.start_block() + extent.num_blocks();
+  }
+  return packed;
+}
+
+bool UnpackExtents(const string& packed, RepeatedPtrField<Extent>* extents) {
+  uint64_t last_end = 0;
+  size_t pos = 0;
+  while (pos < packed.size()) {
+    uint64_t delta, num_blocks;
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &pos, &delta));
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &pos, &num_blocks));
+    Extent* extent = extents->Add();
+    extent->set_start_block(last_end + ZigzagDecode(delta));
+    extent->set_num_blocks(num_blocks);
+    last_end = extent->start_block() + num_blocks;
+  }
+  return true;
+}
+
+void PackOperationExtents(InstallOperation* operation) {
+  if (operation->src_extents_size() > 0) {
+    operation->set_packed_src_extents(PackExtents(operation->src_extents()));
+    operation->clear_src_extents();
+  }
+  if (operation->dst_extents_size() > 0) {
+    operation->set_packed_dst_extents(PackExtents(operation->dst_extents()));
+    operation->clear_dst_extents();
+  }
+}
+
+bool UnpackOperationExtents(InstallOperation* operation) {
+  if (operation->has_packed_src_extents()) {
+    TEST_AND_RETURN_FALSE(operation->src_extents_size() == 0);
+    TEST_AND_RETURN_FALSE(UnpackExtents(operation->packed_src_extents(),
+                                        operation->mutable_src_extents()));
+    operation->clear_packed_src_extents();
+  }
+  if (operation->has_packed_dst_extents()) {
+    TEST_AND_RETURN_FALSE(operation->dst_extents_size() == 0);
+    TEST_AND_RETURN_FALSE(UnpackExtents(operation->packed_dst_extents(),
+                                        operation->mutable_dst_extents()));
+    operation->clear_packed_dst_extents();
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,67 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+
+#include <string>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// The packed extents store the extent lists of the operations of the payloads
+// of minor version 7 or newer in a fraction of the size of the repeated Extent
+// messages. Each extent is two varints: the zigzag encoded difference between
+// its start block and the end of the previous extent, or zero for the first
+// one, followed by its number of blocks. The fragmented files of large images
+// have many small extents close to each other, which take two or three bytes
+// each instead of about ten.
+
+namespace chromeos_update_engine {
+
+// Returns the |extents| in the packed format: for each extent, the LEB128
+// varint of the zigzag encoded start block delta followed by the varint of
+// its num_blocks, with no header or count. The deltas wrap around modulo 2^64,
+// so the kSparseHole extents and the extents going backwards pack too. An
+// empty |extents| list packs to an empty string. Never fails.
+std::string PackExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+// Decodes the |packed| extents written by PackExtents() and appends them to
+// |extents|, which is owned by the caller and isn't cleared first. Returns
+// false if a varint is truncated or longer than ten bytes; the extents
+// decoded before the malformed one are left appended to |extents| in that
+// case, so callers should discard the whole list on failure.
+bool UnpackExtents(const std::string& packed,
+                   google::protobuf::RepeatedPtrField<Extent>* extents);
+
+// Replaces the src_extents and dst_extents of the |operation| in place by
+// their packed_src_extents and packed_dst_extents. An empty list is left
+// as is, without setting its packed field. Never fails.
+void PackOperationExtents(InstallOperation* operation);
+
+// Replaces the packed_src_extents and packed_dst_extents of the |operation|
+// in place by the src_extents and dst_extents they encode, leaving the
+// operations without packed fields untouched. Returns false if a packed list
+// is malformed or the |operation| also has the unpacked form of the same
+// list. The |operation| may then be left half unpacked and should be
+// rejected as a whole.
+bool UnpackOperationExtents(InstallOperation* operation);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
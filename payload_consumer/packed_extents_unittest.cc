@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PackedExtentsTest : public ::testing::Test {
+ protected:
+  // Expects the |extents_| to be the same after packing and unpacking them.
+  void ExpectRoundTrip() {
+    RepeatedPtrField<Extent> unpacked;
+    EXPECT_TRUE(UnpackExtents(PackExtents(extents_), &unpacked));
+    ASSERT_EQ(extents_.size(), unpacked.size());
+    for (int i = 0; i < extents_.size(); i++)
+      EXPECT_EQ(extents_.Get(i), unpacked.Get(i));
+  }
+
+  RepeatedPtrField<Extent> extents_;
+};
+
+TEST_F(PackedExtentsTest, EmptyTest) {
+  EXPECT_EQ("", PackExtents(extents_));
+  ExpectRoundTrip();
+}
+
+TEST_F(PackedExtentsTest, RoundTripTest) {
+  *extents_.Add() = ExtentForRange(100, 8);
+  *extents_.Add() = ExtentForRange(110, 1);
+  // Backwards from the end of the previous extent.
+  *extents_.Add() = ExtentForRange(3, 2);
+  *extents_.Add() = ExtentForRange(kSparseHole, 16);
+  *extents_.Add() = ExtentForRange(0xFFFFFFFFULL, 1);
+  *extents_.Add() = ExtentForRange(0, 0);
+  ExpectRoundTrip();
+}
+
+TEST_F(PackedExtentsTest, PackedSizeTest) {
+  // Many small extents close to each other, as in a fragmented file.
+  for (uint64_t block = 50000; block < 60000; block += 10)
+    *extents_.Add() = ExtentForRange(block, 3);
+  string packed = PackExtents(extents_);
+  EXPECT_EQ(2U * extents_.size() + 2, packed.size());
+
+  InstallOperation op;
+  *op.mutable_dst_extents() = extents_;
+  EXPECT_LT(packed.size() * 3, static_cast<size_t>(op.ByteSize()));
+  ExpectRoundTrip();
+}
+
+TEST_F(PackedExtentsTest, MalformedTest) {
+  RepeatedPtrField<Extent> unpacked;
+  // The number of blocks is missing.
+  EXPECT_FALSE(UnpackExtents(string("\x02", 1), &unpacked));
+  // A truncated varint.
+  EXPECT_FALSE(UnpackExtents(string("\x02\x81", 2), &unpacked));
+  // A varint longer than 64 bits.
+  EXPECT_FALSE(UnpackExtents(string(11, '\xFF'), &unpacked));
+}
+
+TEST_F(PackedExtentsTest, OperationTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  *op.add_src_extents() = ExtentForRange(10, 2);
+  *op.add_dst_extents() = ExtentForRange(20, 2);
+  *op.add_dst_extents() = ExtentForRange(30, 1);
+  InstallOperation original_op = op;
+
+  PackOperationExtents(&op);
+  EXPECT_EQ(0, op.src_extents_size());
+  EXPECT_EQ(0, op.dst_extents_size());
+  EXPECT_TRUE(op.has_packed_src_extents());
+  EXPECT_TRUE(op.has_packed_dst_extents());
+
+  EXPECT_TRUE(UnpackOperationExtents(&op));
+  EXPECT_EQ(original_op.SerializeAsString(), op.SerializeAsString());
+
+  // The operations without packed extents are left as they are.
+  EXPECT_TRUE(UnpackOperationExtents(&op));
+  EXPECT_EQ(original_op.SerializeAsString(), op.SerializeAsString());
+}
+
+TEST_F(PackedExtentsTest, OperationWithBothFormsTest) {
+  InstallOperation op;
+  *op.add_dst_extents() = ExtentForRange(20, 2);
+  op.set_packed_dst_extents(PackExtents(op.dst_extents()));
+  EXPECT_FALSE(UnpackOperationExtents(&op));
+}
+
+}  // namespace chromeos_update_engine
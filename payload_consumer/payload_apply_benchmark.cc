@@ -0,0 +1,508 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// End-to-end benchmark of the payload application. It generates a payload of
+// the given size and operation mix, applies it with the DeltaPerformer and
+// verifies the result with the FilesystemVerifierAction, either on files or on
+// the given block devices, such as loop devices. The time of each phase, the
+// peak RSS and the I/O bytes are printed as one JSON object per run.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <xz.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/action_processor.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/resource_usage.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/download_action.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/bsdiff_generator.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/xz.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kBlockSize = 4096;
+
+// The size of the chunks of payload passed to the DeltaPerformer, like the
+// download buffers.
+const size_t kPayloadChunkSize = 128 * 1024;
+
+// The operation types that can be requested in the --op_mix flag.
+const struct {
+  const char* name;
+  InstallOperation::Type type;
+} kOperationTypes[] = {
+  {"replace", InstallOperation::REPLACE},
+  {"replace_bz", InstallOperation::REPLACE_BZ},
+  {"replace_xz", InstallOperation::REPLACE_XZ},
+  {"zero", InstallOperation::ZERO},
+  {"source_copy", InstallOperation::SOURCE_COPY},
+  {"source_bsdiff", InstallOperation::SOURCE_BSDIFF},
+};
+
+// A DownloadActionDelegate that never cancels.
+class BenchmarkDownloadActionDelegate : public DownloadActionDelegate {
+ public:
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {}
+  bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+  void DownloadComplete() override {}
+};
+
+// Breaks the message loop once the FilesystemVerifierAction is done, saving its
+// result.
+class VerifierProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  explicit VerifierProcessorDelegate(FilesystemVerifierAction* action)
+      : action_(action) {}
+
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    ExitMainLoop();
+  }
+  void ProcessingStopped(const ActionProcessor* processor) override {
+    ExitMainLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    if (action == action_)
+      code_ = code;
+  }
+
+  ErrorCode code() const { return code_; }
+
+ private:
+  void ExitMainLoop() {
+    // The action may still have to clean up its pending reads.
+    if (action_->IsCleanupPending()) {
+      brillo::MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&VerifierProcessorDelegate::ExitMainLoop,
+                     base::Unretained(this)),
+          base::TimeDelta::FromMilliseconds(10));
+    } else {
+      brillo::MessageLoop::current()->BreakLoop();
+    }
+  }
+
+  FilesystemVerifierAction* action_;
+  ErrorCode code_{ErrorCode::kError};
+};
+
+// Prints the usage between |start| and |end| of the phase |name| as JSON
+// members, followed by a comma.
+void PrintPhase(const char* name,
+                const ResourceUsage& start,
+                const ResourceUsage& end) {
+  printf("\"%s_ms\": %.1f, "
+         "\"%s_read_bytes\": %" PRIu64 ", \"%s_write_bytes\": %" PRIu64 ", "
+         "\"%s_storage_read_bytes\": %" PRIu64 ", "
+         "\"%s_storage_write_bytes\": %" PRIu64 ", ",
+         name, (end.time - start.time).InMillisecondsF(),
+         name, end.read_bytes - start.read_bytes,
+         name, end.write_bytes - start.write_bytes,
+         name, end.storage_read_bytes - start.storage_read_bytes,
+         name, end.storage_write_bytes - start.storage_write_bytes);
+}
+
+// Returns |size| bytes of data compressible like a filesystem image, from the
+// random |seed|.
+brillo::Blob SyntheticData(size_t size, uint32_t seed) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (i / kBlockSize) % 4 == 3 ? 0 : 'a' + (seed >> 24) % 16;
+  }
+  return data;
+}
+
+// Parses the |op_mix| flag, a comma separated list of "type:weight" pairs, into
+// the sequence of |types| assigned in turn to the operations of the payload.
+bool ParseOperationMix(const string& op_mix,
+                       vector<InstallOperation::Type>* types) {
+  base::StringPairs pairs;
+  TEST_AND_RETURN_FALSE(
+      base::SplitStringIntoKeyValuePairs(op_mix, ':', ',', &pairs));
+  types->clear();
+  for (const auto& pair : pairs) {
+    unsigned weight;
+    TEST_AND_RETURN_FALSE(base::StringToUint(pair.second, &weight));
+    bool found = false;
+    for (const auto& op_type : kOperationTypes) {
+      if (pair.first == op_type.name) {
+        types->insert(types->end(), weight, op_type.type);
+        found = true;
+      }
+    }
+    if (!found) {
+      LOG(ERROR) << "Unknown operation type " << pair.first;
+      return false;
+    }
+  }
+  TEST_AND_RETURN_FALSE(!types->empty());
+  return true;
+}
+
+// The payload and the images used in the benchmark runs.
+struct GeneratedPayload {
+  brillo::Blob payload;
+  uint64_t metadata_size{0};
+  bool is_delta{false};
+};
+
+// Generates the |old_image|, if the payload has source operations, and the
+// |new_image| files of |image_size| bytes and the payload from one to the
+// other with operations of |op_blocks| blocks and the given |op_types|.
+bool GeneratePayload(const string& old_image,
+                     const string& new_image,
+                     size_t image_size,
+                     size_t op_blocks,
+                     const vector<InstallOperation::Type>& op_types,
+                     GeneratedPayload* out) {
+  const brillo::Blob old_data = SyntheticData(image_size, 1);
+  brillo::Blob new_data(image_size);
+  brillo::Blob blobs;
+  vector<AnnotatedOperation> aops;
+
+  const size_t op_size = op_blocks * kBlockSize;
+  for (size_t offset = 0; offset < image_size; offset += op_size) {
+    const size_t size = std::min(op_size, image_size - offset);
+    const InstallOperation::Type type = op_types[aops.size() % op_types.size()];
+    const brillo::Blob old_chunk(old_data.begin() + offset,
+                                 old_data.begin() + offset + size);
+    brillo::Blob new_chunk;
+    if (type == InstallOperation::SOURCE_COPY) {
+      new_chunk = old_chunk;
+    } else if (type != InstallOperation::ZERO) {
+      // Modify the old data a bit, as a new version of the same files would.
+      new_chunk = old_chunk;
+      for (size_t i = 0; i < size; i += 61)
+        new_chunk[i] ^= 0x20;
+    } else {
+      new_chunk.resize(size, 0);
+    }
+    std::copy(new_chunk.begin(), new_chunk.end(), new_data.begin() + offset);
+
+    AnnotatedOperation aop;
+    aop.name = "op-" + std::to_string(aops.size());
+    aop.op.set_type(type);
+    *aop.op.add_dst_extents() =
+        ExtentForRange(offset / kBlockSize, size / kBlockSize);
+    brillo::Blob blob;
+    switch (type) {
+      case InstallOperation::REPLACE:
+        blob = new_chunk;
+        break;
+      case InstallOperation::REPLACE_BZ:
+        TEST_AND_RETURN_FALSE(BzipCompress(new_chunk, &blob));
+        break;
+      case InstallOperation::REPLACE_XZ:
+        TEST_AND_RETURN_FALSE(XzCompress(new_chunk, &blob));
+        break;
+      case InstallOperation::SOURCE_BSDIFF:
+        TEST_AND_RETURN_FALSE(GenerateBsdiffPatch(old_chunk, new_chunk, &blob));
+        aop.op.set_src_length(size);
+        aop.op.set_dst_length(size);
+        // Fall through.
+      case InstallOperation::SOURCE_COPY:
+        *aop.op.add_src_extents() = *aop.op.mutable_dst_extents(0);
+        out->is_delta = true;
+        break;
+      default:
+        break;
+    }
+    if (!blob.empty()) {
+      aop.op.set_data_offset(blobs.size());
+      aop.op.set_data_length(blob.size());
+      blobs.insert(blobs.end(), blob.begin(), blob.end());
+    }
+    aops.push_back(aop);
+  }
+
+  TEST_AND_RETURN_FALSE(utils::WriteFile(
+      new_image.c_str(), new_data.data(), new_data.size()));
+  if (out->is_delta) {
+    TEST_AND_RETURN_FALSE(utils::WriteFile(
+        old_image.c_str(), old_data.data(), old_data.size()));
+  }
+
+  string blob_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("BenchmarkBlob-XXXXXX", &blob_path, nullptr));
+  ScopedPathUnlinker blob_unlinker(blob_path);
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(blob_path.c_str(), blobs.data(), blobs.size()));
+
+  PayloadGenerationConfig config;
+  config.version.major = kChromeOSMajorPayloadVersion;
+  config.version.minor = out->is_delta
+      ? DeltaPerformer::kSupportedMinorPayloadVersion
+      : kFullPayloadMinorVersion;
+  PayloadFile payload;
+  TEST_AND_RETURN_FALSE(payload.Init(config));
+
+  PartitionConfig old_part(kLegacyPartitionNameRoot);
+  if (out->is_delta) {
+    old_part.path = old_image;
+    old_part.size = image_size;
+  }
+  PartitionConfig new_part(kLegacyPartitionNameRoot);
+  new_part.path = new_image;
+  new_part.size = image_size;
+  TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, aops));
+
+  // The Chrome OS payloads always include the kernel partition.
+  if (out->is_delta)
+    old_part.path = "/dev/null";
+  old_part.size = 0;
+  old_part.name = kLegacyPartitionNameKernel;
+  new_part.name = kLegacyPartitionNameKernel;
+  new_part.path = "/dev/null";
+  new_part.size = 0;
+  TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, {}));
+
+  string payload_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("BenchmarkPayload-XXXXXX", &payload_path, nullptr));
+  ScopedPathUnlinker payload_unlinker(payload_path);
+  TEST_AND_RETURN_FALSE(payload.WritePayload(
+      payload_path, blob_path, "", &out->metadata_size));
+  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &out->payload));
+  return true;
+}
+
+// Applies the |payload| from |source_path| to |target_path| and verifies the
+// result, printing the measurements of the run. The partitions are accessed
+// through the storage emulated by the |throttle|, if not null. The target
+// blocks are discarded ahead of the operations if |pre_trim|.
+bool RunApply(const GeneratedPayload& payload,
+              const string& source_path,
+              const string& target_path,
+              std::shared_ptr<StorageThrottle> throttle,
+              bool pre_trim,
+              int run) {
+  MemoryPrefs prefs;
+  FakeBootControl boot_control;
+  FakeHardware hardware;
+  BenchmarkDownloadActionDelegate download_delegate;
+  boot_control.SetPartitionDevice(kLegacyPartitionNameRoot, 0, source_path);
+  boot_control.SetPartitionDevice(kLegacyPartitionNameRoot, 1, target_path);
+  boot_control.SetPartitionDevice(kLegacyPartitionNameKernel, 0, "/dev/null");
+  boot_control.SetPartitionDevice(kLegacyPartitionNameKernel, 1, "/dev/null");
+
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  install_plan.payload_type =
+      payload.is_delta ? InstallPayloadType::kDelta : InstallPayloadType::kFull;
+  install_plan.metadata_size = payload.metadata_size;
+  install_plan.payload_size = payload.payload.size();
+
+  const ResourceUsage start = ResourceUsage::Now();
+  {
+    DeltaPerformer performer(&prefs, &boot_control, &hardware,
+                             &download_delegate, &install_plan);
+    performer.set_storage_throttle(throttle);
+    performer.set_pre_trim(pre_trim);
+    bool success = true;
+    const brillo::Blob& data = payload.payload;
+    for (size_t offset = 0; success && offset < data.size();
+         offset += kPayloadChunkSize) {
+      success = performer.Write(
+          data.data() + offset,
+          std::min(kPayloadChunkSize, data.size() - offset));
+    }
+    TEST_AND_RETURN_FALSE(performer.Close() == 0 && success);
+  }
+  const ResourceUsage applied = ResourceUsage::Now();
+
+  ActionProcessor processor;
+  InstallPlanAction install_plan_action(install_plan);
+  FilesystemVerifierAction verifier_action(&boot_control,
+                                           VerifierMode::kVerifyTargetHash);
+  verifier_action.set_storage_throttle(throttle);
+  BondActions(&install_plan_action, &verifier_action);
+  VerifierProcessorDelegate delegate(&verifier_action);
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&install_plan_action);
+  processor.EnqueueAction(&verifier_action);
+  brillo::MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&ActionProcessor::StartProcessing,
+                 base::Unretained(&processor)));
+  brillo::MessageLoop::current()->Run();
+  const ResourceUsage verified = ResourceUsage::Now();
+  if (delegate.code() != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Failed to verify the target partition: "
+               << static_cast<int>(delegate.code());
+    return false;
+  }
+
+  printf("{\"run\": %d, \"payload_bytes\": %zu, ", run, payload.payload.size());
+  PrintPhase("apply", start, applied);
+  PrintPhase("verify", applied, verified);
+  if (throttle) {
+    printf("\"storage_delay_ms\": %.1f, ",
+           throttle->total_delay().InMillisecondsF());
+  }
+  printf("\"total_ms\": %.1f, \"peak_rss_kb\": %" PRId64 "}\n",
+         (verified.time - start.time).InMillisecondsF(), verified.peak_rss_kb);
+  fflush(stdout);
+  return true;
+}
+
+int Main(int argc, char** argv) {
+  DEFINE_int32(size_mb, 64, "The size of the generated partition, in MiB.");
+  DEFINE_int32(op_blocks, 256, "The size of each operation, in blocks.");
+  DEFINE_string(op_mix,
+                "replace_bz:2,replace_xz:1,zero:1,source_copy:4,"
+                "source_bsdiff:2",
+                "The weights of the operation types in the payload, as a "
+                "comma separated list of type:weight pairs. The types are "
+                "replace, replace_bz, replace_xz, zero, source_copy and "
+                "source_bsdiff.");
+  DEFINE_int32(runs, 3, "The number of times the payload is applied.");
+  DEFINE_string(source_path, "",
+                "The file or block device holding the source partition, "
+                "overwritten with the generated old image. A temporary file is "
+                "used if empty.");
+  DEFINE_string(target_path, "",
+                "The file or block device where the payload is applied. A "
+                "temporary file is used if empty.");
+  DEFINE_int32(storage_latency_us, 0,
+               "The latency added to each read and write of the partitions, "
+               "in microseconds, to emulate slower storage.");
+  DEFINE_int32(storage_read_kbps, 0,
+               "The read throughput of the emulated storage, in KiB/s. "
+               "Unlimited if 0.");
+  DEFINE_int32(storage_write_kbps, 0,
+               "The write throughput of the emulated storage, in KiB/s. "
+               "Unlimited if 0.");
+  DEFINE_int32(storage_queue_depth, 0,
+               "The maximum number of I/Os in flight on the emulated storage. "
+               "Unlimited if 0.");
+  DEFINE_bool(pre_trim, false,
+              "Whether the blocks of the target partition are discarded ahead "
+              "of the operations. Only a --target_path block device can be "
+              "discarded.");
+  brillo::FlagHelper::Init(argc, argv,
+      "Generates a payload and measures its application with the "
+      "DeltaPerformer and the FilesystemVerifierAction.\nThe results are "
+      "printed as one JSON object per run.");
+  logging::SetMinLogLevel(logging::LOG_WARNING);
+
+  // Both xz implementations need their one-time initialization.
+  xz_crc32_init();
+  XzCompressInit();
+
+  vector<InstallOperation::Type> op_types;
+  if (FLAGS_size_mb <= 0 || FLAGS_op_blocks <= 0 ||
+      !ParseOperationMix(FLAGS_op_mix, &op_types)) {
+    LOG(ERROR) << "Invalid payload settings.";
+    return 1;
+  }
+
+  // The new image is only needed to generate the payload.
+  std::unique_ptr<ScopedPathUnlinker> source_unlinker, target_unlinker;
+  string source_path = FLAGS_source_path;
+  string target_path = FLAGS_target_path;
+  string new_image;
+  if ((source_path.empty() &&
+       !utils::MakeTempFile("BenchmarkSource-XXXXXX", &source_path, nullptr)) ||
+      (target_path.empty() &&
+       !utils::MakeTempFile("BenchmarkTarget-XXXXXX", &target_path, nullptr)) ||
+      !utils::MakeTempFile("BenchmarkNewImage-XXXXXX", &new_image, nullptr)) {
+    LOG(ERROR) << "Failed to create the temporary files.";
+    return 1;
+  }
+  if (FLAGS_source_path.empty())
+    source_unlinker.reset(new ScopedPathUnlinker(source_path));
+  if (FLAGS_target_path.empty())
+    target_unlinker.reset(new ScopedPathUnlinker(target_path));
+  ScopedPathUnlinker new_image_unlinker(new_image);
+
+  GeneratedPayload payload;
+  if (!GeneratePayload(source_path, new_image,
+                       static_cast<size_t>(FLAGS_size_mb) * 1024 * 1024,
+                       FLAGS_op_blocks, op_types, &payload)) {
+    LOG(ERROR) << "Failed to generate the payload.";
+    return 1;
+  }
+
+  base::MessageLoopForIO base_loop;
+  brillo::BaseMessageLoop loop(&base_loop);
+  loop.SetAsCurrent();
+  StorageThrottle::Limits limits;
+  limits.latency = base::TimeDelta::FromMicroseconds(
+      std::max(FLAGS_storage_latency_us, 0));
+  limits.read_bytes_per_sec =
+      static_cast<uint64_t>(std::max(FLAGS_storage_read_kbps, 0)) * 1024;
+  limits.write_bytes_per_sec =
+      static_cast<uint64_t>(std::max(FLAGS_storage_write_kbps, 0)) * 1024;
+  limits.queue_depth = std::max(FLAGS_storage_queue_depth, 0);
+  const bool throttled = limits.latency > base::TimeDelta() ||
+                         limits.read_bytes_per_sec ||
+                         limits.write_bytes_per_sec || limits.queue_depth;
+  for (int run = 0; run < FLAGS_runs; run++) {
+    std::shared_ptr<StorageThrottle> throttle;
+    if (throttled)
+      throttle.reset(new StorageThrottle(limits));
+    if (!RunApply(
+            payload, source_path, target_path, throttle, FLAGS_pre_trim, run))
+      return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
@@ -26,12 +26,19 @@ const uint32_t kInPlaceMinorPayloadVersion = 1;
 const uint32_t kSourceMinorPayloadVersion = 2;
 const uint32_t kOpSrcHashMinorPayloadVersion = 3;
 const uint32_t kImgdiffMinorPayloadVersion = 4;
+const uint32_t kBlobDedupMinorPayloadVersion = 5;
+const uint32_t kZstdMinorPayloadVersion = 6;
+const uint32_t kPackedExtentsMinorPayloadVersion = 7;
+const uint32_t kSegmentedManifestMinorPayloadVersion = 8;
+const uint32_t kXzChunksMinorPayloadVersion = 9;
+const uint32_t kAlignedBlobsMinorPayloadVersion = 10;
+const uint32_t kZstdDictionaryMinorPayloadVersion = 11;
+const uint32_t kHashTreeMinorPayloadVersion = 12;
 
 const char kLegacyPartitionNameKernel[] = "boot";
 const char kLegacyPartitionNameRoot[] = "system";
 
 const char kDeltaMagic[4] = {'C', 'r', 'A', 'U'};
-const char kBspatchPath[] = "bspatch";
 
 // The zlib in Android and Chrome OS are currently compatible with each other,
 // so they are sharing the same array, but if in the future they are no longer
@@ -64,6 +71,8 @@ const char* InstallOperationTypeName(InstallOperation_Type op_type) {
       return "REPLACE_XZ";
     case InstallOperation::IMGDIFF:
       return "IMGDIFF";
+    case InstallOperation::REPLACE_ZSTD:
+      return "REPLACE_ZSTD";
   }
   return "<unknown_op>";
 }
@@ -46,6 +46,33 @@ extern const uint32_t kOpSrcHashMinorPayloadVersion;
 // The minor version that allows IMGDIFF operation.
 extern const uint32_t kImgdiffMinorPayloadVersion;
 
+// The minor version that allows MOVE operations copying blocks already
+// written by a previous operation of the same partition.
+extern const uint32_t kBlobDedupMinorPayloadVersion;
+
+// The minor version that allows REPLACE_ZSTD operation.
+extern const uint32_t kZstdMinorPayloadVersion;
+
+// The minor version that allows the packed extents of the operations.
+extern const uint32_t kPackedExtentsMinorPayloadVersion;
+
+// The minor version that allows the operations of the partitions in segments
+// outside of the manifest.
+extern const uint32_t kSegmentedManifestMinorPayloadVersion;
+
+// The minor version that allows the REPLACE_XZ data in independent xz chunks.
+extern const uint32_t kXzChunksMinorPayloadVersion;
+
+// The minor version that allows the padding before the aligned data blobs.
+extern const uint32_t kAlignedBlobsMinorPayloadVersion;
+
+// The minor version that allows the REPLACE_ZSTD operations compressed against
+// the zstd dictionary of the payload.
+extern const uint32_t kZstdDictionaryMinorPayloadVersion;
+
+// The minor version that allows the hash trees built by the client.
+extern const uint32_t kHashTreeMinorPayloadVersion;
+
 
 // The kernel and rootfs partition names used by the BootControlInterface when
 // handling update payloads with a major version 1. The names of the updated
@@ -53,7 +80,6 @@ extern const uint32_t kImgdiffMinorPayloadVersion;
 extern const char kLegacyPartitionNameKernel[];
 extern const char kLegacyPartitionNameRoot[];
 
-extern const char kBspatchPath[];
 extern const char kDeltaMagic[4];
 
 // The list of compatible SHA256 hashes of zlib source code.
@@ -0,0 +1,450 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Microbenchmarks of the payload consumer hot paths, and of the generator
+// operation pipeline. Each benchmark runs its
+// operation repeatedly for at least --min_time_ms and prints one JSON object
+// per line on stdout with the throughput and the number of operator new
+// allocations per operation, so the results can be compared between builds.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <xz.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/callback.h>
+#include <base/logging.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/test_alloc_counter.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/bzip_extent_writer.h"
+#include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/download_action.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/xz.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kBlockSize = 4096;
+
+// The size of the data processed by each operation.
+const size_t kDataSize = 4 * 1024 * 1024;
+
+// The size of the chunks passed to the writers, like the download buffers.
+const size_t kChunkSize = 128 * 1024;
+
+// The number of operations in the synthetic payload.
+const size_t kPayloadOperations = 16;
+
+// The number of SOURCE_COPY operations of two blocks passed through the
+// generator pipeline.
+const size_t kGeneratorOperations = 4096;
+
+// A DownloadActionDelegate that never cancels.
+class BenchmarkDownloadActionDelegate : public DownloadActionDelegate {
+ public:
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {}
+  bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+  void DownloadComplete() override {}
+};
+
+// Returns |size| bytes of data compressible like a filesystem image: random
+// bytes from a small alphabet, with every other block zeroed.
+brillo::Blob SyntheticData(size_t size) {
+  brillo::Blob data(size);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (i / kBlockSize) % 2 ? 0 : 'a' + (seed >> 24) % 16;
+  }
+  return data;
+}
+
+class Benchmarks {
+ public:
+  Benchmarks(const string& filter, int min_time_ms)
+      : filter_(filter),
+        min_time_(base::TimeDelta::FromMilliseconds(min_time_ms)) {}
+
+  bool Init(const string& private_key_path, const string& public_key_path);
+
+  // Runs all the benchmarks matching the filter. Returns false if any of them
+  // failed.
+  bool RunAll();
+
+ private:
+  // Runs |op|, processing |bytes_per_op| each time, until |min_time_| elapses
+  // and prints the result, unless |name| doesn't match |filter_|. Returns
+  // whether all the runs of |op| succeeded.
+  bool Run(const string& name,
+           size_t bytes_per_op,
+           const base::Callback<bool()>& op);
+
+  // Writes |data| through |writer| in |kChunkSize| chunks to the target file.
+  bool WriteThrough(ExtentWriter* writer, const brillo::Blob& data);
+
+  bool WriteDirect();
+  bool WriteZeroPad();
+  bool WriteZeroPadded();
+  bool WriteBzip();
+  bool WriteXz();
+  bool HashData();
+  bool ApplyPayload();
+  bool VerifySignature();
+  bool ProcessOperations();
+
+  // Generates in |payload_| a full payload of |kPayloadOperations| REPLACE_BZ
+  // operations writing |data_|.
+  bool GeneratePayload();
+
+  const string filter_;
+  const base::TimeDelta min_time_;
+
+  string public_key_path_;
+
+  brillo::Blob data_;
+  brillo::Blob bzip_data_;
+  brillo::Blob xz_data_;
+
+  brillo::Blob payload_;
+  uint64_t payload_metadata_size_{0};
+
+  brillo::Blob signature_blob_;
+  brillo::Blob signed_hash_;
+
+  // The SOURCE_COPY operations of two scattered blocks processed by the
+  // generator pipeline.
+  vector<AnnotatedOperation> generator_aops_;
+
+  // The file written by the benchmarks and its full extent.
+  string target_path_;
+  FileDescriptorPtr target_fd_;
+  vector<Extent> target_extents_;
+
+  DISALLOW_COPY_AND_ASSIGN(Benchmarks);
+};
+
+bool Benchmarks::Init(const string& private_key_path,
+                      const string& public_key_path) {
+  public_key_path_ = public_key_path;
+  data_ = SyntheticData(kDataSize);
+  TEST_AND_RETURN_FALSE(BzipCompress(data_, &bzip_data_));
+  TEST_AND_RETURN_FALSE(XzCompress(data_, &xz_data_));
+
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("Benchmark-XXXXXX", &target_path_, nullptr));
+  target_fd_.reset(new EintrSafeFileDescriptor());
+  TEST_AND_RETURN_FALSE(target_fd_->Open(target_path_.c_str(), O_RDWR, 0600));
+  target_extents_ = {ExtentForRange(0, kDataSize / kBlockSize)};
+
+  TEST_AND_RETURN_FALSE(GeneratePayload());
+
+  // The operations copy the blocks in place, in a shuffled order, so they are
+  // split, sorted and merged again by the generator.
+  generator_aops_.resize(kGeneratorOperations);
+  for (size_t i = 0; i < kGeneratorOperations; i++) {
+    const uint64_t block = (i * 7919 % kGeneratorOperations) * 2;
+    AnnotatedOperation& aop = generator_aops_[i];
+    aop.name = "copy-" + std::to_string(i);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    for (uint64_t offset : {0, 1}) {
+      *aop.op.add_src_extents() = ExtentForRange(block + offset, 1);
+      *aop.op.add_dst_extents() = ExtentForRange(block + offset, 1);
+    }
+  }
+
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(payload_, &hash));
+  TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+      hash, {private_key_path}, &signature_blob_));
+  signed_hash_ = hash;
+  TEST_AND_RETURN_FALSE(PayloadVerifier::PadRSA2048SHA256Hash(&signed_hash_));
+  return true;
+}
+
+bool Benchmarks::GeneratePayload() {
+  const size_t op_size = kDataSize / kPayloadOperations;
+  brillo::Blob blobs;
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kPayloadOperations; i++) {
+    brillo::Blob chunk(data_.begin() + i * op_size,
+                       data_.begin() + (i + 1) * op_size);
+    brillo::Blob compressed;
+    TEST_AND_RETURN_FALSE(BzipCompress(chunk, &compressed));
+
+    AnnotatedOperation aop;
+    aop.name = "chunk-" + std::to_string(i);
+    *aop.op.add_dst_extents() =
+        ExtentForRange(i * op_size / kBlockSize, op_size / kBlockSize);
+    aop.op.set_data_offset(blobs.size());
+    aop.op.set_data_length(compressed.size());
+    aop.op.set_type(InstallOperation::REPLACE_BZ);
+    aops.push_back(aop);
+    blobs.insert(blobs.end(), compressed.begin(), compressed.end());
+  }
+
+  string blob_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("BenchmarkBlob-XXXXXX", &blob_path, nullptr));
+  ScopedPathUnlinker blob_unlinker(blob_path);
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(blob_path.c_str(), blobs.data(), blobs.size()));
+
+  PayloadGenerationConfig config;
+  config.version.major = kChromeOSMajorPayloadVersion;
+  config.version.minor = kFullPayloadMinorVersion;
+  PayloadFile payload;
+  TEST_AND_RETURN_FALSE(payload.Init(config));
+
+  PartitionConfig old_part(kLegacyPartitionNameRoot);
+  PartitionConfig new_part(kLegacyPartitionNameRoot);
+  new_part.path = "/dev/zero";
+  new_part.size = kDataSize;
+  TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, aops));
+  old_part.name = kLegacyPartitionNameKernel;
+  new_part.name = kLegacyPartitionNameKernel;
+  new_part.size = 0;
+  TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, {}));
+
+  string payload_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("BenchmarkPayload-XXXXXX", &payload_path, nullptr));
+  ScopedPathUnlinker payload_unlinker(payload_path);
+  TEST_AND_RETURN_FALSE(payload.WritePayload(
+      payload_path, blob_path, "", &payload_metadata_size_));
+  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload_));
+  return true;
+}
+
+bool Benchmarks::RunAll() {
+  bool success = true;
+  success &= Run("DirectExtentWriter", kDataSize,
+                 base::Bind(&Benchmarks::WriteDirect, base::Unretained(this)));
+  success &= Run("ZeroPadExtentWriter", kDataSize,
+                 base::Bind(&Benchmarks::WriteZeroPad, base::Unretained(this)));
+  success &= Run("ZeroPaddedExtentWriter", kDataSize,
+                 base::Bind(&Benchmarks::WriteZeroPadded,
+                            base::Unretained(this)));
+  success &= Run("BzipExtentWriter", kDataSize,
+                 base::Bind(&Benchmarks::WriteBzip, base::Unretained(this)));
+  success &= Run("XzExtentWriter", kDataSize,
+                 base::Bind(&Benchmarks::WriteXz, base::Unretained(this)));
+  success &= Run("HashCalculator", kDataSize,
+                 base::Bind(&Benchmarks::HashData, base::Unretained(this)));
+  success &= Run("DeltaPerformer::Write", payload_.size(),
+                 base::Bind(&Benchmarks::ApplyPayload, base::Unretained(this)));
+  success &= Run("PayloadVerifier", payload_.size(),
+                 base::Bind(&Benchmarks::VerifySignature,
+                            base::Unretained(this)));
+  success &= Run("ABGenerator::MergeOperations",
+                 kGeneratorOperations * 2 * kBlockSize,
+                 base::Bind(&Benchmarks::ProcessOperations,
+                            base::Unretained(this)));
+
+  target_fd_->Close();
+  unlink(target_path_.c_str());
+  return success;
+}
+
+bool Benchmarks::Run(const string& name,
+                     size_t bytes_per_op,
+                     const base::Callback<bool()>& op) {
+  if (!filter_.empty() && name.find(filter_) == string::npos)
+    return true;
+
+  // Warm up the caches and the lazily initialized state once.
+  TEST_AND_RETURN_FALSE(op.Run());
+
+  uint64_t iterations = 0;
+  const uint64_t start_allocations = NumAllocations();
+  const base::TimeTicks start = base::TimeTicks::Now();
+  base::TimeDelta elapsed;
+  do {
+    TEST_AND_RETURN_FALSE(op.Run());
+    iterations++;
+    elapsed = base::TimeTicks::Now() - start;
+  } while (elapsed < min_time_);
+  const uint64_t allocations = NumAllocations() - start_allocations;
+
+  const double seconds = elapsed.InSecondsF();
+  printf("{\"name\": \"%s\", \"iterations\": %" PRIu64 ", "
+         "\"ns_per_op\": %.0f, \"mb_per_s\": %.2f, "
+         "\"allocs_per_op\": %.2f}\n",
+         name.c_str(), iterations, seconds * 1e9 / iterations,
+         bytes_per_op * iterations / seconds / (1024 * 1024),
+         static_cast<double>(allocations) / iterations);
+  fflush(stdout);
+  return true;
+}
+
+bool Benchmarks::WriteThrough(ExtentWriter* writer, const brillo::Blob& data) {
+  TEST_AND_RETURN_FALSE(writer->Init(target_fd_, target_extents_, kBlockSize));
+  for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+    TEST_AND_RETURN_FALSE(writer->Write(
+        data.data() + offset, std::min(kChunkSize, data.size() - offset)));
+  }
+  return writer->End();
+}
+
+bool Benchmarks::WriteDirect() {
+  DirectExtentWriter writer;
+  return WriteThrough(&writer, data_);
+}
+
+bool Benchmarks::WriteZeroPad() {
+  ZeroPadExtentWriter writer(
+      std::unique_ptr<ExtentWriter>(new DirectExtentWriter()));
+  return WriteThrough(&writer, data_);
+}
+
+bool Benchmarks::WriteZeroPadded() {
+  ZeroPaddedExtentWriter<DirectExtentWriter> writer;
+  return WriteThrough(&writer, data_);
+}
+
+bool Benchmarks::WriteBzip() {
+  BzipExtentWriter writer(
+      std::unique_ptr<ExtentWriter>(new DirectExtentWriter()));
+  return WriteThrough(&writer, bzip_data_);
+}
+
+bool Benchmarks::WriteXz() {
+  XzExtentWriter writer(
+      std::unique_ptr<ExtentWriter>(new DirectExtentWriter()));
+  return WriteThrough(&writer, xz_data_);
+}
+
+bool Benchmarks::HashData() {
+  HashCalculator hasher;
+  for (size_t offset = 0; offset < data_.size(); offset += kChunkSize) {
+    TEST_AND_RETURN_FALSE(hasher.Update(
+        data_.data() + offset, std::min(kChunkSize, data_.size() - offset)));
+  }
+  return hasher.Finalize();
+}
+
+bool Benchmarks::ApplyPayload() {
+  MemoryPrefs prefs;
+  FakeBootControl boot_control;
+  FakeHardware hardware;
+  BenchmarkDownloadActionDelegate delegate;
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  install_plan.payload_type = InstallPayloadType::kFull;
+  install_plan.metadata_size = payload_metadata_size_;
+  boot_control.SetPartitionDevice(kLegacyPartitionNameRoot, 0, "/dev/null");
+  boot_control.SetPartitionDevice(kLegacyPartitionNameRoot, 1, target_path_);
+  boot_control.SetPartitionDevice(kLegacyPartitionNameKernel, 0, "/dev/null");
+  boot_control.SetPartitionDevice(kLegacyPartitionNameKernel, 1, "/dev/null");
+
+  DeltaPerformer performer(&prefs, &boot_control, &hardware, &delegate,
+                           &install_plan);
+  bool success = true;
+  for (size_t offset = 0; success && offset < payload_.size();
+       offset += kChunkSize) {
+    success = performer.Write(payload_.data() + offset,
+                              std::min(kChunkSize, payload_.size() - offset));
+  }
+  return performer.Close() == 0 && success;
+}
+
+bool Benchmarks::VerifySignature() {
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(payload_, &hash));
+  TEST_AND_RETURN_FALSE(PayloadVerifier::PadRSA2048SHA256Hash(&hash));
+  TEST_AND_RETURN_FALSE(hash == signed_hash_);
+  return PayloadVerifier::VerifySignature(signature_blob_, public_key_path_,
+                                          hash);
+}
+
+bool Benchmarks::ProcessOperations() {
+  vector<AnnotatedOperation> aops = generator_aops_;
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(
+      ABGenerator::FragmentOperations(version, &aops, "", nullptr));
+  ABGenerator::SortOperationsByDestination(&aops);
+  TEST_AND_RETURN_FALSE(
+      ABGenerator::MergeOperations(&aops, version, 1024, "", nullptr));
+  return aops.size() == kGeneratorOperations * 2 / 1024;
+}
+
+int Main(int argc, char** argv) {
+  DEFINE_string(filter, "",
+                "Only run the benchmarks whose name contains this string.");
+  DEFINE_int32(min_time_ms, 1000,
+               "The minimum time to run each benchmark for, in milliseconds.");
+  DEFINE_string(private_key, "unittest_key.pem",
+                "Path to the private key used to sign the synthetic payload.");
+  DEFINE_string(public_key, "unittest_key.pub.pem",
+                "Path to the public key used to verify the payload signature.");
+  brillo::FlagHelper::Init(argc, argv,
+      "Measures the throughput and the allocations of the payload consumer "
+      "hot paths.\nThe results are printed as one JSON object per line.");
+  logging::SetMinLogLevel(logging::LOG_WARNING);
+
+  // Both xz implementations need their one-time initialization.
+  xz_crc32_init();
+  XzCompressInit();
+
+  Benchmarks benchmarks(FLAGS_filter, FLAGS_min_time_ms);
+  if (!benchmarks.Init(FLAGS_private_key, FLAGS_public_key)) {
+    LOG(ERROR) << "Failed to set up the benchmarks.";
+    return 1;
+  }
+  return benchmarks.RunAll() ? 0 : 1;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
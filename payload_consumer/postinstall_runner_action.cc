@@ -74,29 +74,67 @@ void PostinstallRunnerAction::PerformAction() {
     total_weight_ += partition_weight_[i];
   }
   accumulated_weight_ = 0;
-  ReportProgress(0);
+  ReportProgress();
 
-  PerformPartitionPostinstall();
-}
-
-void PostinstallRunnerAction::PerformPartitionPostinstall() {
   if (install_plan_.download_url.empty()) {
     LOG(INFO) << "Skipping post-install during rollback";
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
-  while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
-    VLOG(1) << "Skipping post-install on partition "
-            << install_plan_.partitions[current_partition_].name;
-    current_partition_++;
+  StartPartitionPostinstalls();
+}
+
+void PostinstallRunnerAction::StartPartitionPostinstalls() {
+  // A partition may fail while it's being started, in which case the loop
+  // below already starts the next ones.
+  if (starting_partitions_)
+    return;
+  starting_partitions_ = true;
+  while (!completed_ && current_partition_ < install_plan_.partitions.size()) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[current_partition_];
+    // Skip all the partitions that don't have a post-install step.
+    if (!partition.run_postinstall) {
+      VLOG(1) << "Skipping post-install on partition " << partition.name;
+      current_partition_++;
+      continue;
+    }
+    // Only the partitions allowing it run at the same time as others.
+    const bool parallel = CanRunInParallel(partition);
+    if (!running_.empty() && (!parallel || !running_in_parallel_))
+      break;
+    running_in_parallel_ = parallel;
+    running_.emplace_back(new PartitionPostinstall());
+    running_.back()->partition_index = current_partition_++;
+    PerformPartitionPostinstall(running_.back().get());
   }
-  if (current_partition_ == install_plan_.partitions.size())
-    return CompletePostinstall(ErrorCode::kSuccess);
+  starting_partitions_ = false;
+  if (!completed_ && running_.empty() &&
+      current_partition_ == install_plan_.partitions.size()) {
+    CompletePostinstall(ErrorCode::kSuccess);
+  }
+}
+
+bool PostinstallRunnerAction::CanRunInParallel(
+    const InstallPlan::Partition& partition) const {
+  if (!parallel_postinstall_ || !partition.postinstall_parallel)
+    return false;
+#ifdef __ANDROID__
+  // The partitions can't share the /postinstall mountpoint.
+  if (!base::DirectoryExists(
+          base::FilePath("/postinstall").Append(partition.name))) {
+    LOG(WARNING) << "No mountpoint to run the post-install of "
+                 << partition.name << " in parallel.";
+    return false;
+  }
+#endif  // __ANDROID__
+  return true;
+}
 
+void PostinstallRunnerAction::PerformPartitionPostinstall(
+    PartitionPostinstall* run) {
   const InstallPlan::Partition& partition =
-      install_plan_.partitions[current_partition_];
+      install_plan_.partitions[run->partition_index];
 
   const string mountable_device =
       utils::MakePartitionNameForMount(partition.target_path);
@@ -105,14 +143,15 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
   }
 
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
+  // Perform post-install for the |run| partition. At this point we need to
+  // call CompletePartitionPostinstall to complete the operation and cleanup.
 #ifdef __ANDROID__
-  fs_mount_dir_ = "/postinstall";
+  run->fs_mount_dir = "/postinstall";
+  if (running_in_parallel_)
+    run->fs_mount_dir += "/" + partition.name;
 #else   // __ANDROID__
   TEST_AND_RETURN(
-      utils::MakeTempDirectory("au_postint_mount.XXXXXX", &fs_mount_dir_));
+      utils::MakeTempDirectory("au_postint_mount.XXXXXX", &run->fs_mount_dir));
 #endif  // __ANDROID__
 
   base::FilePath postinstall_path(partition.postinstall_path);
@@ -124,9 +163,9 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   }
 
   string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
+      base::FilePath(run->fs_mount_dir).Append(postinstall_path).value();
   if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+          abs_path, run->fs_mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
     return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
@@ -140,17 +179,17 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   // Mark the block device as read-only before mounting for post-install.
   if (!utils::SetBlockDeviceReadOnly(mountable_device, true)) {
     return CompletePartitionPostinstall(
-        1, "Error marking the device " + mountable_device + " read only.");
+        run, 1, "Error marking the device " + mountable_device + " read only.");
   }
 #endif  // __ANDROID__
 
   if (!utils::MountFilesystem(mountable_device,
-                              fs_mount_dir_,
+                              run->fs_mount_dir,
                               MS_RDONLY,
                               partition.filesystem_type,
                               constants::kPostinstallMountOptions)) {
     return CompletePartitionPostinstall(
-        1, "Error mounting the device " + mountable_device);
+        run, 1, "Error mounting the device " + mountable_device);
   }
 
   LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
@@ -175,114 +214,142 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   command.push_back(partition.target_path);
 #endif  // __ANDROID__
 
-  current_command_ = Subprocess::Get().ExecFlags(
+  run->command = Subprocess::Get().ExecFlags(
       command,
       Subprocess::kRedirectStderrToStdout,
       {kPostinstallStatusFd},
       base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
+                 base::Unretained(this),
+                 base::Unretained(run)));
   // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
+  CHECK_GE(run->command, 0);
 
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
+  if (!run->command) {
+    CompletePartitionPostinstall(run, 1, "Postinstall didn't launch");
     return;
   }
 
   // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  run->progress_fd =
+      Subprocess::Get().GetPipeFd(run->command, kPostinstallStatusFd);
+  int fd_flags = fcntl(run->progress_fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(run->progress_fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
+                << run->progress_fd;
   }
 
-  progress_task_ = MessageLoop::current()->WatchFileDescriptor(
+  run->progress_task = MessageLoop::current()->WatchFileDescriptor(
       FROM_HERE,
-      progress_fd_,
+      run->progress_fd,
       MessageLoop::WatchMode::kWatchRead,
       true,
       base::Bind(&PostinstallRunnerAction::OnProgressFdReady,
-                 base::Unretained(this)));
+                 base::Unretained(this),
+                 base::Unretained(run)));
 }
 
-void PostinstallRunnerAction::OnProgressFdReady() {
+void PostinstallRunnerAction::OnProgressFdReady(PartitionPostinstall* run) {
   char buf[1024];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, arraysize(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
+    bool ok = utils::ReadAll(
+        run->progress_fd, buf, arraysize(buf), &bytes_read, &eof);
+    run->progress_buffer.append(buf, bytes_read);
     // Process every line.
     vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+        run->progress_buffer, "\n", base::KEEP_WHITESPACE,
+        base::SPLIT_WANT_ALL);
     if (!lines.empty()) {
-      progress_buffer_ = lines.back();
+      run->progress_buffer = lines.back();
       lines.pop_back();
       for (const auto& line : lines) {
-        ProcessProgressLine(line);
+        ProcessProgressLine(run, line);
       }
     }
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      MessageLoop::current()->CancelTask(progress_task_);
-      progress_task_ = MessageLoop::kTaskIdNull;
+      MessageLoop::current()->CancelTask(run->progress_task);
+      run->progress_task = MessageLoop::kTaskIdNull;
       return;
     }
   } while (bytes_read);
 }
 
-bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
+bool PostinstallRunnerAction::ProcessProgressLine(PartitionPostinstall* run,
+                                                  const string& line) {
   double frac = 0;
   if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1) {
-    ReportProgress(frac);
+    if (!isfinite(frac) || frac < 0)
+      frac = 0;
+    if (frac > 1)
+      frac = 1;
+    run->progress = frac;
+    ReportProgress();
     return true;
   }
 
   return false;
 }
 
-void PostinstallRunnerAction::ReportProgress(double frac) {
+void PostinstallRunnerAction::ReportProgress() {
   if (!delegate_)
     return;
-  if (current_partition_ >= partition_weight_.size()) {
+  if (running_.empty() && current_partition_ >= partition_weight_.size()) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double progress_weight = accumulated_weight_;
+  for (const auto& run : running_)
+    progress_weight += partition_weight_[run->partition_index] * run->progress;
+  delegate_->ProgressUpdate(progress_weight / total_weight_);
 }
 
-void PostinstallRunnerAction::Cleanup() {
-  utils::UnmountFilesystem(fs_mount_dir_);
+void PostinstallRunnerAction::Cleanup(PartitionPostinstall* run) {
+  if (!run->fs_mount_dir.empty()) {
+    utils::UnmountFilesystem(run->fs_mount_dir);
 #ifndef __ANDROID__
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_), false)) {
-    PLOG(WARNING) << "Not removing temporary mountpoint " << fs_mount_dir_;
-  }
+    if (!base::DeleteFile(base::FilePath(run->fs_mount_dir), false)) {
+      PLOG(WARNING) << "Not removing temporary mountpoint "
+                    << run->fs_mount_dir;
+    }
 #endif  // !__ANDROID__
-  fs_mount_dir_.clear();
+    run->fs_mount_dir.clear();
+  }
 
-  progress_fd_ = -1;
-  if (progress_task_ != MessageLoop::kTaskIdNull) {
-    MessageLoop::current()->CancelTask(progress_task_);
-    progress_task_ = MessageLoop::kTaskIdNull;
+  run->progress_fd = -1;
+  if (run->progress_task != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(run->progress_task);
+    run->progress_task = MessageLoop::kTaskIdNull;
   }
-  progress_buffer_.clear();
+  run->progress_buffer.clear();
+}
+
+void PostinstallRunnerAction::StopPartitionPostinstalls() {
+  for (const auto& run : running_) {
+    // Calling KillExec() will discard the callback we registered and therefore
+    // the unretained reference to this object.
+    if (run->command)
+      Subprocess::Get().KillExec(run->command);
+    run->command = 0;
+    Cleanup(run.get());
+  }
+  running_.clear();
 }
 
 void PostinstallRunnerAction::CompletePartitionPostinstall(
-    int return_code, const string& output) {
-  current_command_ = 0;
-  Cleanup();
+    PartitionPostinstall* run, int return_code, const string& output) {
+  run->command = 0;
+  Cleanup(run);
+  const size_t partition_index = run->partition_index;
+  for (auto it = running_.begin(); it != running_.end(); ++it) {
+    if (it->get() == run) {
+      running_.erase(it);
+      break;
+    }
+  }
 
   if (return_code != 0) {
     LOG(ERROR) << "Postinst command failed with code: " << return_code;
@@ -304,23 +371,26 @@ void PostinstallRunnerAction::CompletePartitionPostinstall(
 
     // If postinstall script for this partition is optional we can ignore the
     // result.
-    if (install_plan_.partitions[current_partition_].postinstall_optional) {
+    if (install_plan_.partitions[partition_index].postinstall_optional) {
       LOG(INFO) << "Ignoring postinstall failure since it is optional";
     } else {
       return CompletePostinstall(error_code);
     }
   }
-  accumulated_weight_ += partition_weight_[current_partition_];
-  current_partition_++;
-  ReportProgress(0);
+  accumulated_weight_ += partition_weight_[partition_index];
+  ReportProgress();
 
-  PerformPartitionPostinstall();
+  StartPartitionPostinstalls();
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
+  // The postinstall of the other partitions is stopped on failure.
+  StopPartitionPostinstalls();
+  completed_ = true;
+
   // We only attempt to mark the new slot as active if all the postinstall
   // steps succeeded.
-  if (error_code == ErrorCode::kSuccess &&
+  if (error_code == ErrorCode::kSuccess && mark_slot_active_ &&
       !boot_control_->SetActiveBootSlot(install_plan_.target_slot)) {
     error_code = ErrorCode::kPostinstallRunnerError;
   }
@@ -345,29 +415,28 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
 }
 
 void PostinstallRunnerAction::SuspendAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGSTOP) != 0) {
-    PLOG(ERROR) << "Couldn't pause child process " << current_command_;
+  for (const auto& run : running_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << run->command;
+    }
   }
 }
 
 void PostinstallRunnerAction::ResumeAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGCONT) != 0) {
-    PLOG(ERROR) << "Couldn't resume child process " << current_command_;
+  for (const auto& run : running_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << run->command;
+    }
   }
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
-  if (!current_command_)
-    return;
-  // Calling KillExec() will discard the callback we registered and therefore
-  // the unretained reference to this object.
-  Subprocess::Get().KillExec(current_command_);
-  current_command_ = 0;
-  Cleanup();
+  StopPartitionPostinstalls();
+  completed_ = true;
 }
 
 }  // namespace chromeos_update_engine
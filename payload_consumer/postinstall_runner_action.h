@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_RUNNER_ACTION_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_RUNNER_ACTION_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -58,6 +59,21 @@ class PostinstallRunnerAction : public InstallPlanAction {
 
   void set_delegate(DelegateInterface* delegate) { delegate_ = delegate; }
 
+  // Sets whether the postinstall programs of the partitions marked with
+  // postinstall_parallel in the payload run at the same time, instead of one
+  // after the other. The other partitions still run alone, in order. On
+  // Android, each such partition must have its own mountpoint directory under
+  // /postinstall. Disabled by default. Must be called before PerformAction().
+  void set_parallel_postinstall(bool enabled) {
+    parallel_postinstall_ = enabled;
+  }
+
+  // Sets whether the target slot is marked active once all the postinstall
+  // steps succeed. The postinstall of a payload applied along with others
+  // leaves it to the last one. Enabled by default. Must be called before
+  // PerformAction().
+  void set_mark_slot_active(bool enabled) { mark_slot_active_ = enabled; }
+
   // Debugging/logging
   static std::string StaticType() { return "PostinstallRunnerAction"; }
   std::string Type() const override { return StaticType(); }
@@ -66,30 +82,66 @@ class PostinstallRunnerAction : public InstallPlanAction {
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
 
-  void PerformPartitionPostinstall();
+  // The state of the postinstall program of a single partition.
+  struct PartitionPostinstall {
+    // The index in the install_plan_.partitions vector of the partition.
+    size_t partition_index;
+
+    // The path where the filesystem is mounted during post-install.
+    std::string fs_mount_dir;
+
+    // Postinstall command running, or 0 if no program running.
+    pid_t command{0};
+
+    // The parent progress file descriptor used to watch for progress reports
+    // from the postinstall program and the task watching for them.
+    int progress_fd{-1};
+    brillo::MessageLoop::TaskId progress_task{
+        brillo::MessageLoop::kTaskIdNull};
+
+    // A buffer of a partial read line from the progress file descriptor.
+    std::string progress_buffer;
+
+    // The last progress reported by the program, between 0 and 1.
+    double progress{0};
+  };
+
+  // Starts the postinstall of the next partitions, as many as can run at the
+  // same time. Once all of them finished, it completes the action.
+  void StartPartitionPostinstalls();
+
+  // Returns whether the postinstall of the |partition| may run at the same
+  // time as the one of other such partitions.
+  bool CanRunInParallel(const InstallPlan::Partition& partition) const;
 
-  // Called whenever the |progress_fd_| has data available to read.
-  void OnProgressFdReady();
+  // Mounts the partition of |run| and launches its postinstall program.
+  void PerformPartitionPostinstall(PartitionPostinstall* run);
+
+  // Called whenever the progress fd of |run| has data available to read.
+  void OnProgressFdReady(PartitionPostinstall* run);
 
   // Updates the action progress according to the |line| passed from the
-  // postinstall program. Valid lines are:
+  // postinstall program of |run|. Valid lines are:
   //     global_progress <frac>
   //         <frac> should be between 0.0 and 1.0; sets the progress to the
   //         <frac> value.
-  bool ProcessProgressLine(const std::string& line);
+  bool ProcessProgressLine(PartitionPostinstall* run, const std::string& line);
+
+  // Report the progress to the delegate given the weight of the partitions
+  // already finished and the current progress of the running ones.
+  void ReportProgress();
 
-  // Report the progress to the delegate given that the postinstall operation
-  // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
-  void ReportProgress(double frac);
+  // Cleanup the setup made when running postinstall for the partition of
+  // |run|. Unmount and remove the mountpoint directory if needed and cleanup
+  // the status file descriptor and message loop task watching for it.
+  void Cleanup(PartitionPostinstall* run);
 
-  // Cleanup the setup made when running postinstall for a given partition.
-  // Unmount and remove the mountpoint directory if needed and cleanup the
-  // status file descriptor and message loop task watching for it.
-  void Cleanup();
+  // Kills the running postinstall programs and cleans up after them.
+  void StopPartitionPostinstalls();
 
-  // Subprocess::Exec callback.
-  void CompletePartitionPostinstall(int return_code,
+  // Subprocess::Exec callback of the program of |run|.
+  void CompletePartitionPostinstall(PartitionPostinstall* run,
+                                    int return_code,
                                     const std::string& output);
 
   // Complete the Action with the passed |error_code| and mark the new slot as
@@ -98,13 +150,26 @@ class PostinstallRunnerAction : public InstallPlanAction {
 
   InstallPlan install_plan_;
 
-  // The path where the filesystem will be mounted during post-install.
-  std::string fs_mount_dir_;
+  // Whether the partitions allowing it run their postinstall in parallel.
+  bool parallel_postinstall_{false};
 
-  // The partition being processed on the list of partitions specified in the
+  // Whether the target slot is marked active on success.
+  bool mark_slot_active_{true};
+
+  // The next partition to process on the list of partitions specified in the
   // InstallPlan.
   size_t current_partition_{0};
 
+  // The postinstall programs running, in the order they started, and whether
+  // they are of partitions running in parallel.
+  std::vector<std::unique_ptr<PartitionPostinstall>> running_;
+  bool running_in_parallel_{false};
+
+  // Whether StartPartitionPostinstalls() is starting partitions, and whether
+  // the action completed.
+  bool starting_partitions_{false};
+  bool completed_{false};
+
   // A non-negative value representing the estimated weight of each partition
   // passed in the install plan. The weight is used to predict the overall
   // progress from the individual progress of each partition and should
@@ -114,8 +179,8 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The sum of all the weights in |partition_weight_|.
   double total_weight_{0};
 
-  // The sum of all the weights in |partition_weight_| up to but not including
-  // the |current_partition_|.
+  // The sum of all the weights in |partition_weight_| of the partitions
+  // already finished.
   double accumulated_weight_{0};
 
   // The delegate used to notify of progress updates, if any.
@@ -131,17 +196,6 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // Used for cleaning up if post-install fails.
   bool powerwash_scheduled_{false};
 
-  // Postinstall command currently running, or 0 if no program running.
-  pid_t current_command_{0};
-
-  // The parent progress file descriptor used to watch for progress reports from
-  // the postinstall program and the task watching for them.
-  int progress_fd_{-1};
-  brillo::MessageLoop::TaskId progress_task_{brillo::MessageLoop::kTaskIdNull};
-
-  // A buffer of a partial read line from the progress file descriptor.
-  std::string progress_buffer_;
-
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
@@ -108,17 +108,30 @@ class PostinstallRunnerActionTest : public ::testing::Test {
                            const string& postinstall_program,
                            bool powerwash_required);
 
+  // Same as RunPosinstallAction() but with all the |partitions| passed, whose
+  // postinstall may run in parallel if |parallel_postinstall|.
+  void RunPosinstallActionWithPartitions(
+      const vector<InstallPlan::Partition>& partitions,
+      bool powerwash_required,
+      bool parallel_postinstall);
+
  public:
+  // Returns the pid of the first postinstall command running, or 0 if none.
+  pid_t RunningCommand() const {
+    if (!postinstall_action_ || postinstall_action_->running_.empty())
+      return 0;
+    return postinstall_action_->running_.front()->command;
+  }
+
   void ResumeRunningAction() {
     ASSERT_NE(nullptr, postinstall_action_);
     postinstall_action_->ResumeAction();
   }
 
   void SuspendRunningAction() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_ ||
+    if (!RunningCommand() ||
         test_utils::Readlink(base::StringPrintf(
-            "/proc/%d/fd/0", postinstall_action_->current_command_)) !=
-            "/dev/zero") {
+            "/proc/%d/fd/0", RunningCommand())) != "/dev/zero") {
       // We need to wait for the postinstall command to start and flag that it
       // is ready by redirecting its input to /dev/zero.
       loop_.PostDelayedTask(
@@ -138,7 +151,7 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void CancelWhenStarted() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_) {
+    if (!RunningCommand()) {
       // Wait for the postinstall command to run.
       loop_.PostDelayedTask(
           FROM_HERE,
@@ -176,22 +189,30 @@ void PostinstallRunnerActionTest::RunPosinstallAction(
     const string& device_path,
     const string& postinstall_program,
     bool powerwash_required) {
-  ActionProcessor processor;
-  processor_ = &processor;
-  ObjectFeederAction<InstallPlan> feeder_action;
   InstallPlan::Partition part;
   part.name = "part";
   part.target_path = device_path;
   part.run_postinstall = true;
   part.postinstall_path = postinstall_program;
+  RunPosinstallActionWithPartitions({part}, powerwash_required, false);
+}
+
+void PostinstallRunnerActionTest::RunPosinstallActionWithPartitions(
+    const vector<InstallPlan::Partition>& partitions,
+    bool powerwash_required,
+    bool parallel_postinstall) {
+  ActionProcessor processor;
+  processor_ = &processor;
+  ObjectFeederAction<InstallPlan> feeder_action;
   InstallPlan install_plan;
-  install_plan.partitions = {part};
+  install_plan.partitions = partitions;
   install_plan.download_url = "http://127.0.0.1:8080/update";
   install_plan.powerwash_required = powerwash_required;
   feeder_action.set_obj(install_plan);
   PostinstallRunnerAction runner_action(&fake_boot_control_, &fake_hardware_);
   postinstall_action_ = &runner_action;
   runner_action.set_delegate(setup_action_delegate_);
+  runner_action.set_parallel_postinstall(parallel_postinstall);
   BondActions(&feeder_action, &runner_action);
   ObjectCollectorAction<InstallPlan> collector_action;
   BondActions(&runner_action, &collector_action);
@@ -219,20 +240,35 @@ TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
   testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
   action.set_delegate(&mock_delegate_);
 
-  action.current_partition_ = 1;
+  action.current_partition_ = 3;
   action.partition_weight_ = {1, 2, 5};
   action.accumulated_weight_ = 1;
   action.total_weight_ = 8;
+  action.running_.emplace_back(
+      new PostinstallRunnerAction::PartitionPostinstall());
+  action.running_.back()->partition_index = 1;
+  action.running_.emplace_back(
+      new PostinstallRunnerAction::PartitionPostinstall());
+  action.running_.back()->partition_index = 2;
+  auto second = action.running_[0].get();
+  auto third = action.running_[1].get();
 
   // 50% of the second actions is 2/8 = 0.25 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.25));
-  action.ProcessProgressLine("global_progress 0.5");
+  action.ProcessProgressLine(second, "global_progress 0.5");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // The progress of the partitions running in parallel is added up: 20% of
+  // the third one is another 1/8 of the total.
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.375));
+  action.ProcessProgressLine(third, "global_progress 0.2");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // None of these should trigger a progress update.
-  action.ProcessProgressLine("foo_bar");
-  action.ProcessProgressLine("global_progress");
-  action.ProcessProgressLine("global_progress ");
+  action.ProcessProgressLine(second, "foo_bar");
+  action.ProcessProgressLine(second, "global_progress");
+  action.ProcessProgressLine(second, "global_progress ");
+  action.running_.clear();
 }
 
 // Test that postinstall succeeds in the simple case of running the default
@@ -298,6 +334,28 @@ TEST_F(PostinstallRunnerActionTest, RunAsRootAbsolutePathNotAllowedTest) {
   EXPECT_EQ(ErrorCode::kPostinstallRunnerError, processor_delegate_.code_);
 }
 
+// Check that the partitions allowing it run their postinstall in parallel,
+// and that the failure of an optional one is ignored.
+TEST_F(PostinstallRunnerActionTest, RunAsRootParallelPostinstallTest) {
+  ScopedLoopbackDeviceBinder loop1(postinstall_image_, false, nullptr);
+  ScopedLoopbackDeviceBinder loop2(postinstall_image_, false, nullptr);
+  InstallPlan::Partition part;
+  part.name = "part1";
+  part.target_path = loop1.dev();
+  part.run_postinstall = true;
+  part.postinstall_path = kPostinstallDefaultScript;
+  part.postinstall_parallel = true;
+  vector<InstallPlan::Partition> partitions = {part};
+  part.name = "part2";
+  part.target_path = loop2.dev();
+  part.postinstall_path = "bin/postinst_fail1";
+  part.postinstall_optional = true;
+  partitions.push_back(part);
+  RunPosinstallActionWithPartitions(partitions, false, true);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+  EXPECT_TRUE(processor_delegate_.processing_done_called_);
+}
+
 #ifdef __ANDROID__
 // Check that the postinstall file is relabeled to the postinstall label.
 // SElinux labels are only set on Android.
@@ -0,0 +1,219 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache.h"
+
+#include <string.h>
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+SourceBlockCache::SourceBlockCache(size_t max_blocks, size_t block_size)
+    : max_blocks_(max_blocks), block_size_(block_size) {
+  CHECK_GT(max_blocks_, 0U);
+  CHECK_GT(block_size_, 0U);
+}
+
+ssize_t SourceBlockCache::Read(FileDescriptorPtr fd,
+                               uint64_t start_block,
+                               uint64_t num_blocks,
+                               uint8_t* data) {
+  uint64_t block = 0;
+  while (block < num_blocks) {
+    // Copy the cached blocks up to the next run of missing ones.
+    uint64_t run_blocks = 0;
+    {
+      base::AutoLock auto_lock(lock_);
+      while (block < num_blocks &&
+             LookupLocked(start_block + block, data + block * block_size_)) {
+        block++;
+      }
+      while (block + run_blocks < num_blocks &&
+             blocks_.count(start_block + block + run_blocks) == 0) {
+        run_blocks++;
+      }
+    }
+    if (run_blocks == 0)
+      break;
+
+    // The lock isn't held while reading, so the other threads can use the
+    // cache in the meantime.
+    uint8_t* run_data = data + block * block_size_;
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(fd,
+                         run_data,
+                         run_blocks * block_size_,
+                         (start_block + block) * block_size_,
+                         &bytes_read)) {
+      return -1;
+    }
+    const uint64_t blocks_read = bytes_read / block_size_;
+    {
+      base::AutoLock auto_lock(lock_);
+      misses_ += blocks_read;
+      for (uint64_t i = 0; i < blocks_read; i++)
+        InsertLocked(start_block + block + i, run_data + i * block_size_);
+    }
+    // The partial block at the end of the file isn't cached.
+    if (blocks_read < run_blocks)
+      return block * block_size_ + bytes_read;
+    block += blocks_read;
+  }
+  return num_blocks * block_size_;
+}
+
+void SourceBlockCache::Invalidate(uint64_t offset, uint64_t length) {
+  if (length == 0)
+    return;
+  const uint64_t first_block = offset / block_size_;
+  const uint64_t end_block = (offset + length + block_size_ - 1) / block_size_;
+  base::AutoLock auto_lock(lock_);
+  for (uint64_t block = first_block; block < end_block; block++) {
+    auto it = blocks_.find(block);
+    if (it == blocks_.end())
+      continue;
+    lru_.erase(it->second.lru_position);
+    blocks_.erase(it);
+  }
+}
+
+uint64_t SourceBlockCache::hits() const {
+  base::AutoLock auto_lock(lock_);
+  return hits_;
+}
+
+uint64_t SourceBlockCache::misses() const {
+  base::AutoLock auto_lock(lock_);
+  return misses_;
+}
+
+void SourceBlockCache::ShrinkToMinimum() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = true;
+  blocks_.clear();
+  lru_.clear();
+}
+
+void SourceBlockCache::RestoreCapacity() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = false;
+}
+
+bool SourceBlockCache::LookupLocked(uint64_t block, uint8_t* data) {
+  auto it = blocks_.find(block);
+  if (it == blocks_.end())
+    return false;
+  memcpy(data, it->second.data.data(), block_size_);
+  lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  hits_++;
+  return true;
+}
+
+void SourceBlockCache::InsertLocked(uint64_t block, const uint8_t* data) {
+  if (shrunk_)
+    return;
+  auto it = blocks_.find(block);
+  if (it == blocks_.end()) {
+    // The buffer of the dropped block is reused for the new one.
+    brillo::Blob buffer;
+    if (blocks_.size() >= max_blocks_) {
+      auto oldest = blocks_.find(lru_.back());
+      buffer = std::move(oldest->second.data);
+      blocks_.erase(oldest);
+      lru_.pop_back();
+    }
+    lru_.push_front(block);
+    it = blocks_.emplace(block, CachedBlock{std::move(buffer), lru_.begin()})
+             .first;
+  } else {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  }
+  it->second.data.assign(data, data + block_size_);
+}
+
+bool CachingFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool CachingFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t CachingFileDescriptor::Read(void* buf, size_t count) {
+  const size_t block_size = cache_->block_size();
+  if (offset_ >= 0 && offset_ % block_size == 0 && count >= block_size) {
+    const uint64_t num_blocks = count / block_size;
+    ssize_t bytes_read = cache_->Read(
+        fd_, offset_ / block_size, num_blocks, static_cast<uint8_t*>(buf));
+    if (bytes_read > 0)
+      offset_ += bytes_read;
+    return bytes_read;
+  }
+
+  // The wrapped file descriptor may have been sought by the cache.
+  if (offset_ < 0 || fd_->Seek(offset_, SEEK_SET) != offset_)
+    return -1;
+  ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t CachingFileDescriptor::Write(const void* buf, size_t count) {
+  if (offset_ < 0 || fd_->Seek(offset_, SEEK_SET) != offset_)
+    return -1;
+  ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0) {
+    cache_->Invalidate(offset_, bytes_written);
+    offset_ += bytes_written;
+  }
+  return bytes_written;
+}
+
+off64_t CachingFileDescriptor::Seek(off64_t offset, int whence) {
+  // The relative seeks are made from the offset of the wrapped descriptor.
+  if (whence == SEEK_CUR && (offset_ < 0 || fd_->Seek(offset_, SEEK_SET) < 0))
+    return -1;
+  offset_ = fd_->Seek(offset, whence);
+  return offset_;
+}
+
+bool CachingFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  if (!fd_->BlkIoctl(request, start, length, result))
+    return false;
+  if (*result == 0)
+    cache_->Invalidate(start, length);
+  return true;
+}
+
+bool CachingFileDescriptor::ZeroRange(uint64_t start, uint64_t length) {
+  if (!fd_->ZeroRange(start, length))
+    return false;
+  cache_->Invalidate(start, length);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
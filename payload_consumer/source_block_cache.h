@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_pressure_monitor.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// SourceBlockCache keeps the most recently read blocks of a source partition,
+// so the source blocks shared by several operations are only read from the
+// disk once. The least recently used blocks are dropped once it holds
+// |max_blocks| blocks. It is thread-safe, so it can be shared by the file
+// descriptors of all the worker threads.
+class SourceBlockCache : public ShrinkableCache {
+ public:
+  SourceBlockCache(size_t max_blocks, size_t block_size);
+  ~SourceBlockCache() override = default;
+
+  // Reads the |num_blocks| blocks from |start_block| into |data|, copying the
+  // cached ones and reading the others from |fd|, where they are read at once
+  // when contiguous. Returns the number of bytes read, which is only less than
+  // requested at the end of the file, or -1 if a read fails.
+  ssize_t Read(FileDescriptorPtr fd,
+               uint64_t start_block,
+               uint64_t num_blocks,
+               uint8_t* data);
+
+  // Drops the cached blocks overlapping the |length| bytes at |offset|.
+  void Invalidate(uint64_t offset, uint64_t length);
+
+  size_t block_size() const { return block_size_; }
+
+  // The number of blocks read from the cache and from the disk.
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+  // ShrinkableCache overrides. The shrunk cache drops all its blocks and
+  // doesn't cache the blocks read anymore.
+  void ShrinkToMinimum() override;
+  void RestoreCapacity() override;
+
+ private:
+  struct CachedBlock {
+    brillo::Blob data;
+    std::list<uint64_t>::iterator lru_position;
+  };
+
+  // Copies the |block| to |data| and marks it as the most recently used if it
+  // is cached. Returns whether it is.
+  bool LookupLocked(uint64_t block, uint8_t* data);
+
+  // Adds or replaces the |block| with its |data|, dropping the least recently
+  // used block if the cache is full. Does nothing while shrunk.
+  void InsertLocked(uint64_t block, const uint8_t* data);
+
+  const size_t max_blocks_;
+  const size_t block_size_;
+
+  mutable base::Lock lock_;
+  // The cached blocks by block number, and their numbers from the most to the
+  // least recently used, protected by |lock_|.
+  std::unordered_map<uint64_t, CachedBlock> blocks_;
+  std::list<uint64_t> lru_;
+  bool shrunk_{false};
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceBlockCache);
+};
+
+// A FileDescriptor that reads the whole blocks of a source partition through a
+// SourceBlockCache, which can be shared by several of them. The other reads
+// are passed to the wrapped file descriptor.
+class CachingFileDescriptor : public FileDescriptor {
+ public:
+  CachingFileDescriptor(FileDescriptorPtr fd,
+                        std::shared_ptr<SourceBlockCache> cache)
+      : fd_(fd), cache_(cache) {}
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool ZeroRange(uint64_t start, uint64_t length) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  void Reset() override { fd_->Reset(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  std::shared_ptr<SourceBlockCache> cache_;
+
+  // The offset of this file descriptor, or -1 if unknown. The wrapped file
+  // descriptor is sought by the cache reads, so it may be elsewhere.
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CachingFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 16;
+
+}  // namespace
+
+class SourceBlockCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Each block is filled with its number, and the last one is partial.
+    for (uint8_t block = 0; block < 8; block++)
+      data_.insert(data_.end(), kBlockSize, block);
+    data_.resize(data_.size() - kBlockSize / 2);
+    EXPECT_TRUE(utils::MakeTempFile("SourceBlockCache-XXXXXX", &path_,
+                                    nullptr));
+    EXPECT_TRUE(utils::WriteFile(path_.c_str(), data_.data(), data_.size()));
+    fd_.reset(new EintrSafeFileDescriptor());
+    EXPECT_TRUE(fd_->Open(path_.c_str(), O_RDONLY));
+  }
+
+  void TearDown() override {
+    fd_->Close();
+    unlink(path_.c_str());
+  }
+
+  // Expects the |num_blocks| blocks from |start_block| to be read from the
+  // |cache_|.
+  void ExpectRead(uint64_t start_block, uint64_t num_blocks) {
+    brillo::Blob read_data(num_blocks * kBlockSize);
+    EXPECT_EQ(static_cast<ssize_t>(read_data.size()),
+              cache_.Read(fd_, start_block, num_blocks, read_data.data()));
+    EXPECT_EQ(brillo::Blob(data_.begin() + start_block * kBlockSize,
+                           data_.begin() + (start_block + num_blocks) *
+                                               kBlockSize),
+              read_data);
+  }
+
+  brillo::Blob data_;
+  string path_;
+  FileDescriptorPtr fd_;
+  SourceBlockCache cache_{4, kBlockSize};
+};
+
+TEST_F(SourceBlockCacheTest, HitsAndMissesTest) {
+  ExpectRead(1, 2);
+  EXPECT_EQ(0U, cache_.hits());
+  EXPECT_EQ(2U, cache_.misses());
+
+  // Only the blocks 0 and 3 are read from the file.
+  ExpectRead(0, 4);
+  EXPECT_EQ(2U, cache_.hits());
+  EXPECT_EQ(4U, cache_.misses());
+}
+
+TEST_F(SourceBlockCacheTest, LeastRecentlyUsedTest) {
+  ExpectRead(0, 4);
+  // The block 0 is now the most recently used, so the block 1 is dropped.
+  ExpectRead(0, 1);
+  ExpectRead(4, 1);
+  EXPECT_EQ(5U, cache_.misses());
+
+  ExpectRead(0, 1);
+  ExpectRead(2, 3);
+  EXPECT_EQ(5U, cache_.misses());
+  ExpectRead(1, 1);
+  EXPECT_EQ(6U, cache_.misses());
+}
+
+TEST_F(SourceBlockCacheTest, EndOfFileTest) {
+  brillo::Blob read_data(2 * kBlockSize);
+  EXPECT_EQ(static_cast<ssize_t>(kBlockSize + kBlockSize / 2),
+            cache_.Read(fd_, 6, 2, read_data.data()));
+  // The partial block isn't cached.
+  EXPECT_EQ(1U, cache_.misses());
+  EXPECT_EQ(static_cast<ssize_t>(kBlockSize / 2),
+            cache_.Read(fd_, 7, 1, read_data.data()));
+  EXPECT_EQ(1U, cache_.misses());
+}
+
+TEST_F(SourceBlockCacheTest, InvalidateTest) {
+  ExpectRead(0, 4);
+  // Drops the blocks 1 and 2, which the range partially covers.
+  cache_.Invalidate(kBlockSize + 1, kBlockSize);
+  ExpectRead(0, 4);
+  EXPECT_EQ(2U, cache_.hits());
+  EXPECT_EQ(6U, cache_.misses());
+}
+
+TEST_F(SourceBlockCacheTest, ShrinkToMinimumTest) {
+  ExpectRead(0, 2);
+  // The shrunk cache drops its blocks and doesn't cache the ones read.
+  cache_.ShrinkToMinimum();
+  ExpectRead(0, 2);
+  ExpectRead(0, 2);
+  EXPECT_EQ(0U, cache_.hits());
+  EXPECT_EQ(6U, cache_.misses());
+
+  cache_.RestoreCapacity();
+  ExpectRead(0, 2);
+  ExpectRead(0, 2);
+  EXPECT_EQ(2U, cache_.hits());
+  EXPECT_EQ(8U, cache_.misses());
+}
+
+TEST_F(SourceBlockCacheTest, CachingFileDescriptorTest) {
+  std::shared_ptr<SourceBlockCache> cache(
+      new SourceBlockCache(4, kBlockSize));
+  FileDescriptorPtr caching_fd(new CachingFileDescriptor(fd_, cache));
+  FileDescriptorPtr other_fd(new CachingFileDescriptor(fd_, cache));
+
+  brillo::Blob read_data(2 * kBlockSize);
+  ssize_t bytes_read;
+  EXPECT_TRUE(utils::PReadAll(caching_fd, read_data.data(), read_data.size(),
+                              2 * kBlockSize, &bytes_read));
+  EXPECT_EQ(static_cast<ssize_t>(read_data.size()), bytes_read);
+  EXPECT_EQ(brillo::Blob(data_.begin() + 2 * kBlockSize,
+                         data_.begin() + 4 * kBlockSize),
+            read_data);
+  // The blocks read by a file descriptor are shared with the other one.
+  EXPECT_TRUE(utils::PReadAll(other_fd, read_data.data(), read_data.size(),
+                              2 * kBlockSize, &bytes_read));
+  EXPECT_EQ(2U, cache->hits());
+  EXPECT_EQ(2U, cache->misses());
+
+  // The unaligned reads aren't cached, but read from the right offset even
+  // after the wrapped file descriptor was sought by the cache.
+  EXPECT_EQ(kBlockSize + 1, caching_fd->Seek(kBlockSize + 1, SEEK_SET));
+  EXPECT_EQ(2 * kBlockSize, other_fd->Seek(2 * kBlockSize, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(kBlockSize),
+            other_fd->Read(read_data.data(), kBlockSize));
+  EXPECT_EQ(3, caching_fd->Read(read_data.data(), 3));
+  EXPECT_EQ(brillo::Blob(data_.begin() + kBlockSize + 1,
+                         data_.begin() + kBlockSize + 4),
+            brillo::Blob(read_data.begin(), read_data.begin() + 3));
+  EXPECT_EQ(3U, cache->hits());
+  EXPECT_EQ(2U, cache->misses());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,288 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_precomputer.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+#include <brillo/data_encoding.h>
+#include <brillo/streams/file_stream.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The default size of the chunks the partitions are hashed in. The hash of a
+// partition prefix is finished by reading at most this many bytes.
+const uint64_t kDefaultChunkSize = 4 * 1024 * 1024;
+
+// The size of each read from the partition.
+const size_t kReadBufferSize = 128 * 1024;
+
+// The number of lines of the cache key at the start of the prefs value.
+const size_t kCacheKeyLines = 4;
+
+}  // namespace
+
+SourceHashPrecomputer::SourceHashPrecomputer(
+    const BootControlInterface* boot_control, PrefsInterface* prefs)
+    : boot_control_(boot_control),
+      prefs_(prefs),
+      chunk_size_(kDefaultChunkSize) {}
+
+SourceHashPrecomputer::~SourceHashPrecomputer() {
+  Stop();
+}
+
+void SourceHashPrecomputer::Start(const vector<string>& partition_names) {
+  if (running())
+    return;
+  partition_names_ = partition_names;
+  next_partition_ = 0;
+  cpu_limiter_.SetCpuShares(CpuShares::kLow);
+  cpu_limiter_.SetIoPriority(IoPriority::kIdle);
+  HashNextPartition();
+}
+
+void SourceHashPrecomputer::Stop() {
+  if (running()) {
+    LOG(INFO) << "Stopping the precomputation of the hash of "
+              << partition_name_ << ".";
+    ClosePartition();
+  }
+  partition_names_.clear();
+  next_partition_ = 0;
+  cpu_limiter_.SetCpuShares(CpuShares::kNormal);
+  cpu_limiter_.SetIoPriority(IoPriority::kNormal);
+}
+
+bool SourceHashPrecomputer::LoadHashes(
+    const BootControlInterface* boot_control,
+    const PrefsInterface* prefs,
+    const string& name,
+    BootControlInterface::Slot slot,
+    PrecomputedHashes* hashes) {
+  string value;
+  if (!prefs->GetString(kPrefsPrecomputedSourceHashesPrefix + name, &value))
+    return false;
+  vector<string> lines = base::SplitString(
+      value, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+  uint64_t chunk_size = 0;
+  if (lines.size() <= kCacheKeyLines ||
+      !base::StringToUint64(lines[1], &chunk_size) || chunk_size == 0) {
+    return false;
+  }
+  const string key = CacheKey(boot_control, name, slot, chunk_size);
+  if (key.empty() || value.size() <= key.size() ||
+      value.compare(0, key.size(), key) != 0 || value[key.size()] != '\n') {
+    return false;
+  }
+
+  // Each following line has the hash of a chunk, followed by the context at
+  // its end for the full chunks.
+  PrecomputedHashes loaded;
+  loaded.chunk_size = chunk_size;
+  for (size_t i = kCacheKeyLines; i < lines.size(); i++) {
+    vector<string> fields = base::SplitString(
+        lines[i], " ", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    brillo::Blob chunk_hash, context;
+    if (fields.empty() || fields.size() > 2 ||
+        !brillo::data_encoding::Base64Decode(fields[0], &chunk_hash) ||
+        chunk_hash.empty()) {
+      return false;
+    }
+    loaded.chunk_hashes.push_back(chunk_hash);
+    if (fields.size() == 1)
+      continue;
+    // Only the last chunk may be partial.
+    if (loaded.contexts.size() + 1 != loaded.chunk_hashes.size() ||
+        !brillo::data_encoding::Base64Decode(fields[1], &context)) {
+      return false;
+    }
+    loaded.contexts.emplace_back(context.begin(), context.end());
+  }
+  *hashes = std::move(loaded);
+  return true;
+}
+
+string SourceHashPrecomputer::CacheKey(
+    const BootControlInterface* boot_control,
+    const string& name,
+    BootControlInterface::Slot slot,
+    uint64_t chunk_size) {
+  string part_path, boot_id;
+  if (!boot_control->GetPartitionDevice(name, slot, &part_path) ||
+      !utils::GetBootId(&boot_id)) {
+    return "";
+  }
+  return base::StringPrintf("%s\n%" PRIu64 "\n%s\n%s",
+                            part_path.c_str(),
+                            chunk_size,
+                            boot_id.c_str(),
+                            std::to_string(slot).c_str());
+}
+
+void SourceHashPrecomputer::HashNextPartition() {
+  const BootControlInterface::Slot slot = boot_control_->GetCurrentSlot();
+  while (next_partition_ < partition_names_.size()) {
+    const string name = partition_names_[next_partition_++];
+    PrecomputedHashes hashes;
+    if (LoadHashes(boot_control_, prefs_, name, slot, &hashes) &&
+        hashes.chunk_size == chunk_size_) {
+      continue;
+    }
+    const string key = CacheKey(boot_control_, name, slot, chunk_size_);
+    string part_path;
+    if (key.empty() ||
+        !boot_control_->GetPartitionDevice(name, slot, &part_path)) {
+      LOG(WARNING) << "Unable to find the device of partition " << name
+                   << ", not precomputing its hash.";
+      continue;
+    }
+    brillo::ErrorPtr error;
+    stream_ = brillo::FileStream::Open(
+        base::FilePath(part_path),
+        brillo::Stream::AccessMode::READ,
+        brillo::FileStream::Disposition::OPEN_EXISTING,
+        &error);
+    if (!stream_) {
+      LOG(WARNING) << "Unable to open " << part_path
+                   << ", not precomputing its hash.";
+      continue;
+    }
+    LOG(INFO) << "Precomputing the hash of partition " << name
+              << " on device " << part_path << ".";
+    partition_name_ = name;
+    partition_key_ = key;
+    buffer_.resize(kReadBufferSize);
+    hasher_.reset(new HashCalculator());
+    chunk_hasher_.reset(new HashCalculator());
+    chunk_bytes_ = 0;
+    hashes_ = PrecomputedHashes();
+    hashes_.chunk_size = chunk_size_;
+    ScheduleRead();
+    return;
+  }
+  Stop();
+}
+
+void SourceHashPrecomputer::ScheduleRead() {
+  // The reads don't cross the end of the current chunk.
+  const size_t bytes_to_read = std::min(
+      static_cast<uint64_t>(buffer_.size()), chunk_size_ - chunk_bytes_);
+  if (!stream_->ReadAsync(
+          buffer_.data(),
+          bytes_to_read,
+          base::Bind(&SourceHashPrecomputer::OnReadDone,
+                     base::Unretained(this)),
+          base::Bind(&SourceHashPrecomputer::OnReadError,
+                     base::Unretained(this)),
+          nullptr)) {
+    LOG(ERROR) << "Unable to schedule an asynchronous read of partition "
+               << partition_name_ << ".";
+    ClosePartition();
+    HashNextPartition();
+  }
+}
+
+void SourceHashPrecomputer::OnReadDone(size_t bytes_read) {
+  if (bytes_read == 0)
+    return FinishPartition();
+  if (!hasher_->Update(buffer_.data(), bytes_read) ||
+      !chunk_hasher_->Update(buffer_.data(), bytes_read)) {
+    LOG(ERROR) << "Unable to update the hash of partition " << partition_name_;
+    ClosePartition();
+    return HashNextPartition();
+  }
+  chunk_bytes_ += bytes_read;
+  if (chunk_bytes_ == chunk_size_ && !FinishChunk()) {
+    ClosePartition();
+    return HashNextPartition();
+  }
+  ScheduleRead();
+}
+
+void SourceHashPrecomputer::OnReadError(const brillo::Error* error) {
+  LOG(ERROR) << "Failed to read partition " << partition_name_
+             << ", not precomputing its hash.";
+  ClosePartition();
+  HashNextPartition();
+}
+
+bool SourceHashPrecomputer::FinishChunk() {
+  // The context of a partial chunk is never used, since the hash of a prefix
+  // ending there is finished by reading the chunk again.
+  if (chunk_bytes_ == chunk_size_)
+    hashes_.contexts.push_back(hasher_->GetContext());
+  TEST_AND_RETURN_FALSE(chunk_hasher_->Finalize());
+  hashes_.chunk_hashes.push_back(chunk_hasher_->raw_hash());
+  chunk_hasher_.reset(new HashCalculator());
+  chunk_bytes_ = 0;
+  return true;
+}
+
+void SourceHashPrecomputer::FinishPartition() {
+  if (chunk_bytes_ > 0 && !FinishChunk()) {
+    ClosePartition();
+    return HashNextPartition();
+  }
+  string value = partition_key_;
+  for (size_t i = 0; i < hashes_.chunk_hashes.size(); i++) {
+    value += "\n";
+    value += brillo::data_encoding::Base64Encode(hashes_.chunk_hashes[i]);
+    if (i < hashes_.contexts.size()) {
+      const string& context = hashes_.contexts[i];
+      value += " ";
+      value += brillo::data_encoding::Base64Encode(context.data(),
+                                                   context.size());
+    }
+  }
+  LOG(INFO) << "Precomputed the hashes of the " << hashes_.chunk_hashes.size()
+            << " chunks of partition " << partition_name_ << ".";
+  LOG_IF(WARNING,
+         !prefs_->SetString(kPrefsPrecomputedSourceHashesPrefix +
+                                partition_name_,
+                            value))
+      << "Unable to save the hashes of partition " << partition_name_;
+  ClosePartition();
+  HashNextPartition();
+}
+
+void SourceHashPrecomputer::ClosePartition() {
+  // Destroying the stream cancels its pending read.
+  if (stream_)
+    stream_->CloseBlocking(nullptr);
+  stream_.reset();
+  hasher_.reset();
+  chunk_hasher_.reset();
+  hashes_ = PrecomputedHashes();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PRECOMPUTER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PRECOMPUTER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/errors/error.h>
+#include <brillo/secure_blob.h>
+#include <brillo/streams/stream.h>
+
+#include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/cpu_limiter.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// SourceHashPrecomputer hashes the partitions of the running slot while the
+// device is idle, at the lowest CPU and I/O priority, so the next delta update
+// doesn't read them again on its critical path. For each partition it saves in
+// the prefs the hash of every chunk and the context of the hash of the whole
+// partition at the end of every full chunk, from which the hash of any prefix
+// of the partition can be finished by only reading its last partial chunk.
+// The running slot isn't modified while booted from it, so the hashes are
+// valid until the next boot.
+class SourceHashPrecomputer {
+ public:
+  // The hashes precomputed for a partition.
+  struct PrecomputedHashes {
+    uint64_t chunk_size{0};
+    // The hash of each chunk, the last one possibly partial.
+    std::vector<brillo::Blob> chunk_hashes;
+    // The HashCalculator context of the hash of the partition at the end of
+    // each full chunk.
+    std::vector<std::string> contexts;
+  };
+
+  SourceHashPrecomputer(const BootControlInterface* boot_control,
+                        PrefsInterface* prefs);
+  ~SourceHashPrecomputer();
+
+  // Sets the size of the chunks the partitions are hashed in. Must be called
+  // before Start().
+  void set_chunk_size(uint64_t chunk_size) { chunk_size_ = chunk_size; }
+
+  // Starts hashing the |partition_names| of the current slot one after the
+  // other from the main loop, skipping the ones already hashed during this
+  // boot. Does nothing if it's already running.
+  void Start(const std::vector<std::string>& partition_names);
+
+  // Cancels the hashing in progress, if any, and restores the normal CPU and
+  // I/O priorities. The partitions already hashed keep their hashes.
+  void Stop();
+
+  bool running() const { return stream_ != nullptr; }
+
+  // Loads the hashes precomputed during this boot for the partition |name| of
+  // the |slot|. Returns whether there are valid ones.
+  static bool LoadHashes(const BootControlInterface* boot_control,
+                         const PrefsInterface* prefs,
+                         const std::string& name,
+                         BootControlInterface::Slot slot,
+                         PrecomputedHashes* hashes);
+
+ private:
+  // Returns the first lines of the prefs value of the partition |name| of the
+  // |slot| hashed in chunks of |chunk_size| bytes, identifying its contents:
+  // its device, the chunk size, the current boot id and the slot. Returns an
+  // empty string if it can't be determined.
+  static std::string CacheKey(const BootControlInterface* boot_control,
+                              const std::string& name,
+                              BootControlInterface::Slot slot,
+                              uint64_t chunk_size);
+
+  // Opens the next partition not hashed yet and reads it, or stops once all
+  // of them are hashed.
+  void HashNextPartition();
+
+  // Schedules the next read of the partition being hashed.
+  void ScheduleRead();
+
+  // Called from the main loop when a read of the partition succeeds or fails.
+  void OnReadDone(size_t bytes_read);
+  void OnReadError(const brillo::Error* error);
+
+  // Finishes the current chunk, saving its hash and the context of the hash
+  // of the partition. Returns false on error.
+  bool FinishChunk();
+
+  // Closes the partition being hashed and saves its hashes, then continues
+  // with the next one.
+  void FinishPartition();
+
+  // Closes the partition being hashed, without saving its hashes.
+  void ClosePartition();
+
+  const BootControlInterface* const boot_control_;
+  PrefsInterface* const prefs_;
+
+  uint64_t chunk_size_;
+
+  // The partitions left to hash.
+  std::vector<std::string> partition_names_;
+  size_t next_partition_{0};
+
+  // The partition being hashed, its prefs key and the stream it's read from,
+  // or null when not running.
+  std::string partition_name_;
+  std::string partition_key_;
+  brillo::StreamPtr stream_;
+  brillo::Blob buffer_;
+
+  // The hash of the whole partition and of the current chunk, the bytes in
+  // the current chunk, and the hashes computed so far.
+  std::unique_ptr<HashCalculator> hasher_;
+  std::unique_ptr<HashCalculator> chunk_hasher_;
+  uint64_t chunk_bytes_{0};
+  PrecomputedHashes hashes_;
+
+  // Lowers the CPU shares and I/O priority of the process while hashing.
+  CPULimiter cpu_limiter_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashPrecomputer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_PRECOMPUTER_H_
@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_precomputer.h"
+
+#include <algorithm>
+#include <string>
+
+#include <base/bind.h>
+#include <base/time/time.h>
+#include <brillo/bind_lambda.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint64_t kChunkSize = 4096;
+
+}  // namespace
+
+class SourceHashPrecomputerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    // Two full chunks and a partial one, each with different data.
+    for (char c : {'a', 'b', 'c'})
+      part_data_.insert(part_data_.end(), kChunkSize, c);
+    part_data_.resize(part_data_.size() - kChunkSize / 2);
+    ASSERT_TRUE(utils::WriteFile(
+        part_file_.path().c_str(), part_data_.data(), part_data_.size()));
+    fake_boot_control_.SetPartitionDevice(
+        "part", fake_boot_control_.GetCurrentSlot(), part_file_.path());
+    precomputer_.set_chunk_size(kChunkSize);
+  }
+
+  void TearDown() override {
+    EXPECT_EQ(0, brillo::MessageLoopRunMaxIterations(&loop_, 1));
+  }
+
+  // Runs the main loop until the |precomputer_| stops.
+  void RunUntilStopped() {
+    brillo::MessageLoopRunUntil(
+        &loop_,
+        base::TimeDelta::FromSeconds(10),
+        base::Bind([this]() { return !precomputer_.running(); }));
+    EXPECT_FALSE(precomputer_.running());
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  test_utils::ScopedTempFile part_file_{"SourceHashPrecomputer-XXXXXX"};
+  brillo::Blob part_data_;
+  FakeBootControl fake_boot_control_;
+  FakePrefs fake_prefs_;
+  SourceHashPrecomputer precomputer_{&fake_boot_control_, &fake_prefs_};
+};
+
+TEST_F(SourceHashPrecomputerTest, PrecomputeTest) {
+  precomputer_.Start({"part", "missing"});
+  EXPECT_TRUE(precomputer_.running());
+  RunUntilStopped();
+
+  SourceHashPrecomputer::PrecomputedHashes hashes;
+  ASSERT_TRUE(SourceHashPrecomputer::LoadHashes(
+      &fake_boot_control_,
+      &fake_prefs_,
+      "part",
+      fake_boot_control_.GetCurrentSlot(),
+      &hashes));
+  EXPECT_EQ(kChunkSize, hashes.chunk_size);
+  ASSERT_EQ(3U, hashes.chunk_hashes.size());
+  for (size_t i = 0; i < hashes.chunk_hashes.size(); i++) {
+    brillo::Blob chunk_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        part_data_.data() + i * kChunkSize,
+        std::min(static_cast<size_t>(kChunkSize),
+                 part_data_.size() - i * kChunkSize),
+        &chunk_hash));
+    EXPECT_EQ(chunk_hash, hashes.chunk_hashes[i]);
+  }
+
+  // The hash of a prefix is finished from the context of its full chunks.
+  ASSERT_EQ(2U, hashes.contexts.size());
+  HashCalculator hasher;
+  EXPECT_TRUE(hasher.SetContext(hashes.contexts[1]));
+  EXPECT_TRUE(hasher.Update(part_data_.data() + 2 * kChunkSize, 10));
+  EXPECT_TRUE(hasher.Finalize());
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      part_data_.data(), 2 * kChunkSize + 10, &expected_hash));
+  EXPECT_EQ(expected_hash, hasher.raw_hash());
+
+  // The hashes of another slot aren't valid.
+  fake_boot_control_.SetPartitionDevice("part", 1, part_file_.path());
+  EXPECT_FALSE(SourceHashPrecomputer::LoadHashes(
+      &fake_boot_control_, &fake_prefs_, "part", 1, &hashes));
+  EXPECT_FALSE(fake_prefs_.Exists(kPrefsPrecomputedSourceHashesPrefix +
+                                  string("missing")));
+}
+
+TEST_F(SourceHashPrecomputerTest, StopTest) {
+  precomputer_.Start({"part"});
+  EXPECT_TRUE(precomputer_.running());
+  precomputer_.Stop();
+  EXPECT_FALSE(precomputer_.running());
+  // Runs the cancelled read, if any.
+  brillo::MessageLoopRunMaxIterations(&loop_, 10);
+
+  SourceHashPrecomputer::PrecomputedHashes hashes;
+  EXPECT_FALSE(SourceHashPrecomputer::LoadHashes(
+      &fake_boot_control_,
+      &fake_prefs_,
+      "part",
+      fake_boot_control_.GetCurrentSlot(),
+      &hashes));
+}
+
+TEST_F(SourceHashPrecomputerTest, SkipsHashedPartitionsTest) {
+  precomputer_.Start({"part"});
+  RunUntilStopped();
+  const string key = kPrefsPrecomputedSourceHashesPrefix + string("part");
+  string value;
+  EXPECT_TRUE(fake_prefs_.GetString(key, &value));
+
+  // The partition isn't read again during the same boot.
+  part_data_.assign(part_data_.size(), 'z');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file_.path().c_str(), part_data_.data(), part_data_.size()));
+  precomputer_.Start({"part"});
+  EXPECT_FALSE(precomputer_.running());
+  string new_value;
+  EXPECT_TRUE(fake_prefs_.GetString(key, &new_value));
+  EXPECT_EQ(value, new_value);
+}
+
+}  // namespace chromeos_update_engine
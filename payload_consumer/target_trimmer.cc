@@ -0,0 +1,191 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/target_trimmer.h"
+
+#include <linux/fs.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the blocks discarded at once. The operation reaching a batch
+// being discarded waits for it, so they are kept small.
+const uint64_t kMaxBatchBytes = 16 * 1024 * 1024;
+
+}  // namespace
+
+bool DiscardPartitionTail(FileDescriptorPtr fd, uint64_t data_size) {
+  uint64_t part_size = fd->BlockDevSize();
+  if (!part_size || part_size <= data_size)
+    return false;
+
+  const vector<int> requests = {
+      BLKSECDISCARD,
+      BLKDISCARD,
+#ifdef BLKZEROOUT
+      BLKZEROOUT,
+#endif
+  };
+  for (int request : requests) {
+    int error = 0;
+    if (fd->BlkIoctl(request, data_size, part_size - data_size, &error) &&
+        error == 0) {
+      return true;
+    }
+    LOG(WARNING) << "Error discarding the last "
+                 << (part_size - data_size) / 1024 << " KiB using ioctl("
+                 << request << ")";
+  }
+  return false;
+}
+
+TargetTrimmer::TargetTrimmer(FileDescriptorPtr fd,
+                             uint64_t data_size,
+                             size_t block_size)
+    : fd_(fd), data_size_(data_size), block_size_(block_size) {}
+
+TargetTrimmer::~TargetTrimmer() {
+  if (!thread_)
+    return;
+  {
+    base::AutoLock auto_lock(lock_);
+    stopping_ = true;
+  }
+  thread_->Join();
+}
+
+void TargetTrimmer::AddOperations(
+    const RepeatedPtrField<InstallOperation>& operations) {
+  for (const InstallOperation& operation : operations) {
+    for (const Extent& extent : operation.dst_extents()) {
+      if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+        continue;
+      extents_.emplace_back(extent.start_block() * block_size_,
+                            extent.num_blocks() * block_size_);
+    }
+    operation_ends_.push_back(extents_.size());
+  }
+}
+
+void TargetTrimmer::Start() {
+  // Only the block devices can be discarded.
+  const uint64_t part_size = fd_->BlockDevSize();
+  if (!part_size || (extents_.empty() && part_size <= data_size_))
+    return;
+  thread_.reset(new base::DelegateSimpleThread(this, "target-trimmer"));
+  thread_->Start();
+}
+
+void TargetTrimmer::OperationStarting(size_t operation) {
+  base::AutoLock auto_lock(lock_);
+  while (operation >= batch_start_ && operation < batch_end_)
+    batch_done_.Wait();
+  next_operation_ = std::max(next_operation_, operation + 1);
+}
+
+void TargetTrimmer::Flush() {
+  base::AutoLock auto_lock(lock_);
+  while (thread_ && !done_)
+    batch_done_.Wait();
+}
+
+uint64_t TargetTrimmer::discarded_bytes() const {
+  base::AutoLock auto_lock(lock_);
+  return discarded_bytes_;
+}
+
+void TargetTrimmer::Run() {
+  bool discarding = !extents_.empty();
+  while (discarding) {
+    size_t start, end;
+    {
+      base::AutoLock auto_lock(lock_);
+      if (stopping_ || next_operation_ >= operation_ends_.size())
+        break;
+      start = next_operation_;
+      end = start;
+      uint64_t batch_bytes = 0;
+      while (end < operation_ends_.size() && batch_bytes < kMaxBatchBytes) {
+        for (size_t i = end ? operation_ends_[end - 1] : 0;
+             i < operation_ends_[end];
+             i++) {
+          batch_bytes += extents_[i].second;
+        }
+        end++;
+      }
+      batch_start_ = start;
+      batch_end_ = end;
+    }
+    uint64_t batch_discarded = 0;
+    discarding = DiscardOperations(start, end, &batch_discarded);
+    base::AutoLock auto_lock(lock_);
+    discarded_bytes_ += batch_discarded;
+    next_operation_ = std::max(next_operation_, end);
+    batch_start_ = batch_end_ = 0;
+    batch_done_.Broadcast();
+  }
+
+  bool stopping;
+  {
+    base::AutoLock auto_lock(lock_);
+    stopping = stopping_;
+  }
+  // Discard the end of the partition, but ignore failures.
+  if (!stopping)
+    DiscardPartitionTail(fd_, data_size_);
+
+  base::AutoLock auto_lock(lock_);
+  done_ = true;
+  batch_done_.Broadcast();
+}
+
+bool TargetTrimmer::DiscardOperations(size_t start,
+                                      size_t end,
+                                      uint64_t* discarded_bytes) {
+  vector<std::pair<uint64_t, uint64_t>> extents(
+      extents_.begin() + (start ? operation_ends_[start - 1] : 0),
+      extents_.begin() + operation_ends_[end - 1]);
+  std::sort(extents.begin(), extents.end());
+  size_t i = 0;
+  while (i < extents.size()) {
+    uint64_t offset = extents[i].first;
+    uint64_t extent_end = offset + extents[i].second;
+    for (i++; i < extents.size() && extents[i].first <= extent_end; i++)
+      extent_end = std::max(extent_end, extents[i].first + extents[i].second);
+    int error = 0;
+    if (!fd_->BlkIoctl(BLKDISCARD, offset, extent_end - offset, &error) ||
+        error != 0) {
+      LOG(WARNING) << "Error discarding " << (extent_end - offset) / 1024
+                   << " KiB at offset " << offset
+                   << ", not discarding the next operations.";
+      return false;
+    }
+    *discarded_bytes += extent_end - offset;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_TARGET_TRIMMER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_TARGET_TRIMMER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Discards the tail of the block device referenced by |fd|, from the offset
+// |data_size| until the end of the block device. Returns whether the data was
+// discarded.
+bool DiscardPartitionTail(FileDescriptorPtr fd, uint64_t data_size);
+
+// A TargetTrimmer discards the blocks of a target partition from a background
+// thread, so the flash storage doesn't wait for the erase of the blocks when
+// they are written. It discards the blocks the operations passed to
+// AddOperations() write, in order, ahead of their application, and then the
+// tail of the partition past its |data_size|. The operation about to be
+// applied is reported with OperationStarting(), so its blocks and the ones of
+// the operations before it aren't discarded anymore. The first failure to
+// discard stops the discards of the operations, but the tail is still
+// discarded.
+//
+// The blocks of an operation must not be read before it writes them, and all
+// the operations must write all their blocks, so the operations of in place
+// payloads, or skipped because their data is already there, can't be added.
+class TargetTrimmer : public base::DelegateSimpleThread::Delegate {
+ public:
+  // The |fd| of the target partition is only used by the trimming thread.
+  TargetTrimmer(FileDescriptorPtr fd, uint64_t data_size, size_t block_size);
+
+  // Stops the trimming thread, waiting for the discard in progress.
+  ~TargetTrimmer() override;
+
+  // Adds the blocks the |operations| write, in the order they are applied.
+  // Must be called before Start().
+  void AddOperations(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations);
+
+  // Starts the trimming thread, unless there is nothing to discard.
+  void Start();
+
+  // Called before the operation |operation| is applied, in the order they
+  // were added. Waits for the discard of its blocks if it is in progress.
+  void OperationStarting(size_t operation);
+
+  // Blocks until the discards of the operations not started yet, and of the
+  // tail, are done.
+  void Flush();
+
+  // The number of bytes of the operations discarded so far.
+  uint64_t discarded_bytes() const;
+
+  // The loop of the trimming thread, from base::DelegateSimpleThread::Delegate.
+  void Run() override;
+
+ private:
+  // Discards the blocks of the operations from |start| to |end|, excluded,
+  // merging the adjacent extents, and adds their size to |discarded_bytes|.
+  // Returns whether they were all discarded.
+  bool DiscardOperations(size_t start, size_t end, uint64_t* discarded_bytes);
+
+  FileDescriptorPtr fd_;
+  const uint64_t data_size_;
+  const size_t block_size_;
+
+  // The extents in bytes written by the operations, as (offset, length) and
+  // the end of the extents of each operation in |extents_|.
+  std::vector<std::pair<uint64_t, uint64_t>> extents_;
+  std::vector<size_t> operation_ends_;
+
+  std::unique_ptr<base::DelegateSimpleThread> thread_;
+
+  mutable base::Lock lock_;
+  // Signaled when a batch of operations is discarded or the thread is done.
+  base::ConditionVariable batch_done_{&lock_};
+  // The next operation to discard and the operations of the batch being
+  // discarded, from |batch_start_| to |batch_end_| excluded.
+  size_t next_operation_{0};
+  size_t batch_start_{0};
+  size_t batch_end_{0};
+  uint64_t discarded_bytes_{0};
+  bool stopping_{false};
+  bool done_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(TargetTrimmer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_TARGET_TRIMMER_H_
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/target_trimmer.h"
+
+#include <linux/fs.h>
+
+#include <memory>
+#include <vector>
+
+#include <base/synchronization/lock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 4096;
+
+// A file descriptor pretending to be a block device of |dev_size| bytes,
+// which records the ranges discarded.
+class RecordingFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  struct Discard {
+    int request;
+    uint64_t start;
+    uint64_t length;
+  };
+
+  explicit RecordingFileDescriptor(uint64_t dev_size) : dev_size_(dev_size) {}
+
+  uint64_t BlockDevSize() override { return dev_size_; }
+
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    base::AutoLock auto_lock(lock_);
+    discards_.push_back({request, start, length});
+    *result = fail_ ? -1 : 0;
+    return !fail_;
+  }
+
+  vector<Discard> discards() {
+    base::AutoLock auto_lock(lock_);
+    return discards_;
+  }
+
+  void set_fail(bool fail) {
+    base::AutoLock auto_lock(lock_);
+    fail_ = fail;
+  }
+
+ private:
+  const uint64_t dev_size_;
+  base::Lock lock_;
+  vector<Discard> discards_;
+  bool fail_{false};
+};
+
+}  // namespace
+
+class TargetTrimmerTest : public ::testing::Test {
+ protected:
+  // Adds an operation writing the |extents| to the partition.
+  void AddOperation(const vector<Extent>& extents) {
+    InstallOperation* op = operations_.Add();
+    op->set_type(InstallOperation::REPLACE);
+    for (const Extent& extent : extents)
+      *op->add_dst_extents() = extent;
+  }
+
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+  std::shared_ptr<RecordingFileDescriptor> fd_{
+      new RecordingFileDescriptor(100 * kBlockSize)};
+};
+
+TEST_F(TargetTrimmerTest, DiscardOperationsAndTailTest) {
+  AddOperation({ExtentForRange(10, 5)});
+  AddOperation({ExtentForRange(0, 10), ExtentForRange(kSparseHole, 3)});
+  AddOperation({ExtentForRange(40, 2)});
+  TargetTrimmer trimmer(fd_, 80 * kBlockSize, kBlockSize);
+  trimmer.AddOperations(operations_);
+  trimmer.Start();
+  trimmer.Flush();
+
+  // The adjacent extents are merged and the holes skipped.
+  vector<RecordingFileDescriptor::Discard> discards = fd_->discards();
+  ASSERT_EQ(3U, discards.size());
+  EXPECT_EQ(BLKDISCARD, discards[0].request);
+  EXPECT_EQ(0U, discards[0].start);
+  EXPECT_EQ(15 * kBlockSize, discards[0].length);
+  EXPECT_EQ(40 * kBlockSize, discards[1].start);
+  EXPECT_EQ(2 * kBlockSize, discards[1].length);
+  // The tail is discarded last.
+  EXPECT_EQ(BLKSECDISCARD, discards[2].request);
+  EXPECT_EQ(80 * kBlockSize, discards[2].start);
+  EXPECT_EQ(20 * kBlockSize, discards[2].length);
+  EXPECT_EQ(17 * kBlockSize, trimmer.discarded_bytes());
+}
+
+TEST_F(TargetTrimmerTest, StartedOperationsNotDiscardedTest) {
+  AddOperation({ExtentForRange(0, 2)});
+  AddOperation({ExtentForRange(2, 2)});
+  AddOperation({ExtentForRange(8, 2)});
+  TargetTrimmer trimmer(fd_, 100 * kBlockSize, kBlockSize);
+  trimmer.AddOperations(operations_);
+  // The first two operations start before the thread.
+  trimmer.OperationStarting(1);
+  trimmer.Start();
+  trimmer.Flush();
+
+  vector<RecordingFileDescriptor::Discard> discards = fd_->discards();
+  ASSERT_EQ(1U, discards.size());
+  EXPECT_EQ(8 * kBlockSize, discards[0].start);
+  EXPECT_EQ(2 * kBlockSize, discards[0].length);
+}
+
+TEST_F(TargetTrimmerTest, FailureStopsDiscardsTest) {
+  AddOperation({ExtentForRange(0, 2)});
+  fd_->set_fail(true);
+  TargetTrimmer trimmer(fd_, 90 * kBlockSize, kBlockSize);
+  trimmer.AddOperations(operations_);
+  trimmer.Start();
+  trimmer.Flush();
+  EXPECT_EQ(0U, trimmer.discarded_bytes());
+  // The tail is still attempted with each ioctl.
+  vector<RecordingFileDescriptor::Discard> discards = fd_->discards();
+  EXPECT_LE(3U, discards.size());
+  EXPECT_EQ(BLKDISCARD, discards[0].request);
+  EXPECT_EQ(BLKSECDISCARD, discards[1].request);
+}
+
+TEST_F(TargetTrimmerTest, NotBlockDeviceTest) {
+  AddOperation({ExtentForRange(0, 2)});
+  fd_.reset(new RecordingFileDescriptor(0));
+  TargetTrimmer trimmer(fd_, 0, kBlockSize);
+  trimmer.AddOperations(operations_);
+  trimmer.Start();
+  trimmer.OperationStarting(0);
+  trimmer.Flush();
+  EXPECT_TRUE(fd_->discards().empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
+
+#include <algorithm>
+
+#include <base/threading/platform_thread.h>
+
+namespace chromeos_update_engine {
+
+StorageThrottle::StorageThrottle(const Limits& limits)
+    : limits_(limits), slot_available_(&lock_) {}
+
+void StorageThrottle::WaitForIO(bool is_write, uint64_t count) {
+  const uint64_t bytes_per_sec =
+      is_write ? limits_.write_bytes_per_sec : limits_.read_bytes_per_sec;
+  base::TimeTicks start;
+  base::TimeTicks done;
+  {
+    base::AutoLock auto_lock(lock_);
+    start = base::TimeTicks::Now();
+    while (limits_.queue_depth && num_in_flight_ >= limits_.queue_depth)
+      slot_available_.Wait();
+    num_in_flight_++;
+    done = base::TimeTicks::Now();
+    if (bytes_per_sec) {
+      // The transfers share the throughput, so they're scheduled one after
+      // the other.
+      busy_until_ = std::max(busy_until_, done) +
+                    base::TimeDelta::FromMicroseconds(
+                        count * base::Time::kMicrosecondsPerSecond /
+                        bytes_per_sec);
+      done = busy_until_;
+    }
+    done += limits_.latency;
+  }
+
+  const base::TimeDelta remaining = done - base::TimeTicks::Now();
+  if (remaining > base::TimeDelta())
+    base::PlatformThread::Sleep(remaining);
+
+  base::AutoLock auto_lock(lock_);
+  num_in_flight_--;
+  slot_available_.Signal();
+  const base::TimeDelta delay = base::TimeTicks::Now() - start;
+  total_delay_ += delay;
+  max_delay_ = std::max(max_delay_, delay);
+}
+
+base::TimeDelta StorageThrottle::total_delay() const {
+  base::AutoLock auto_lock(lock_);
+  return total_delay_;
+}
+
+base::TimeDelta StorageThrottle::max_delay() const {
+  base::AutoLock auto_lock(lock_);
+  return max_delay_;
+}
+
+ssize_t ThrottledFileDescriptor::Read(void* buf, size_t count) {
+  ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0)
+    throttle_->WaitForIO(false, bytes_read);
+  return bytes_read;
+}
+
+ssize_t ThrottledFileDescriptor::Write(const void* buf, size_t count) {
+  ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0)
+    throttle_->WaitForIO(true, bytes_written);
+  return bytes_written;
+}
+
+bool ThrottledFileDescriptor::Flush() {
+  // The written data is already accounted for, only the latency is added.
+  bool success = fd_->Flush();
+  throttle_->WaitForIO(true, 0);
+  return success;
+}
+
+}  // namespace chromeos_update_engine
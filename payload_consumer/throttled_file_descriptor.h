@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_THROTTLED_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_THROTTLED_FILE_DESCRIPTOR_H_
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A StorageThrottle emulates slower storage, such as eMMC or SD cards, for the
+// I/Os of all the file descriptors and threads sharing it. Each I/O holds one
+// of the |queue_depth| slots of the device until the transfer of its bytes at
+// the read or write throughput, one I/O after the other, and its |latency| are
+// over. The zero limits are ignored.
+class StorageThrottle {
+ public:
+  struct Limits {
+    base::TimeDelta latency;
+    uint64_t read_bytes_per_sec{0};
+    uint64_t write_bytes_per_sec{0};
+    size_t queue_depth{0};
+  };
+
+  explicit StorageThrottle(const Limits& limits);
+
+  // Blocks the calling thread until the emulated read or write of |count|
+  // bytes completes. It's called after the actual I/O, which is supposed to
+  // be much faster.
+  void WaitForIO(bool is_write, uint64_t count);
+
+  // The total time the I/Os were delayed, and the longest delay of one I/O.
+  base::TimeDelta total_delay() const;
+  base::TimeDelta max_delay() const;
+
+ private:
+  const Limits limits_;
+
+  // All of the following are protected by |lock_|.
+  mutable base::Lock lock_;
+  // Signaled when an I/O releases its slot of the queue.
+  base::ConditionVariable slot_available_;
+  size_t num_in_flight_{0};
+  // The time at which the transfers already scheduled are over.
+  base::TimeTicks busy_until_;
+  base::TimeDelta total_delay_;
+  base::TimeDelta max_delay_;
+
+  DISALLOW_COPY_AND_ASSIGN(StorageThrottle);
+};
+
+// A FileDescriptor that delays the reads, writes and flushes of the wrapped
+// file descriptor as the storage emulated by a StorageThrottle, so the apply
+// and verification pipelines can be evaluated on slow storage from a fast
+// device.
+class ThrottledFileDescriptor : public FileDescriptor {
+ public:
+  ThrottledFileDescriptor(FileDescriptorPtr fd,
+                          std::shared_ptr<StorageThrottle> throttle)
+      : fd_(fd), throttle_(throttle) {}
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool ZeroRange(uint64_t start, uint64_t length) override {
+    return fd_->ZeroRange(start, length);
+  }
+  bool Flush() override;
+  bool Close() override { return fd_->Close(); }
+  void Reset() override { fd_->Reset(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  std::shared_ptr<StorageThrottle> throttle_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThrottledFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_THROTTLED_FILE_DESCRIPTOR_H_
@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/throttled_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class ThrottledFileDescriptorTest : public ::testing::Test {
+ protected:
+  // Opens the temporary file through a ThrottledFileDescriptor with the
+  // |limits|.
+  void OpenThrottled(const StorageThrottle::Limits& limits) {
+    throttle_.reset(new StorageThrottle(limits));
+    fd_.reset(new ThrottledFileDescriptor(
+        FileDescriptorPtr(new EintrSafeFileDescriptor()), throttle_));
+    ASSERT_TRUE(fd_->Open(file_.path().c_str(), O_RDWR));
+  }
+
+  void TearDown() override {
+    if (fd_ && fd_->IsOpen())
+      fd_->Close();
+  }
+
+  test_utils::ScopedTempFile file_{"ThrottledFileDescriptor-XXXXXX"};
+  std::shared_ptr<StorageThrottle> throttle_;
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(ThrottledFileDescriptorTest, ReadWriteTest) {
+  StorageThrottle::Limits limits;
+  limits.latency = base::TimeDelta::FromMilliseconds(5);
+  OpenThrottled(limits);
+  brillo::Blob data(4096, 'x');
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Write(data.data(), data.size()));
+  EXPECT_EQ(0, fd_->Seek(0, SEEK_SET));
+  brillo::Blob read_data(data.size());
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            fd_->Read(read_data.data(), read_data.size()));
+  EXPECT_EQ(data, read_data);
+  EXPECT_TRUE(fd_->Flush());
+
+  // The write, the read and the flush got the latency.
+  EXPECT_GE(throttle_->total_delay(), limits.latency * 3);
+  EXPECT_GE(throttle_->max_delay(), limits.latency);
+}
+
+TEST_F(ThrottledFileDescriptorTest, ThroughputTest) {
+  StorageThrottle::Limits limits;
+  limits.write_bytes_per_sec = 1024 * 1024;
+  OpenThrottled(limits);
+  // Writing 128 KiB at 1 MiB/s takes at least 125 ms, whatever the size of the
+  // writes.
+  brillo::Blob data(32 * 1024, 'x');
+  const base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(static_cast<ssize_t>(data.size()),
+              fd_->Write(data.data(), data.size()));
+  }
+  EXPECT_GE(base::TimeTicks::Now() - start,
+            base::TimeDelta::FromMilliseconds(125));
+}
+
+TEST_F(ThrottledFileDescriptorTest, QueueDepthTest) {
+  // With a single slot, the I/Os of the threads wait for each other.
+  StorageThrottle::Limits limits;
+  limits.latency = base::TimeDelta::FromMilliseconds(20);
+  limits.queue_depth = 1;
+  StorageThrottle throttle(limits);
+  const base::TimeTicks start = base::TimeTicks::Now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back([&throttle] { throttle.WaitForIO(false, 0); });
+  for (std::thread& thread : threads)
+    thread.join();
+  EXPECT_GE(base::TimeTicks::Now() - start, limits.latency * 4);
+  EXPECT_GE(throttle.max_delay(), limits.latency * 2);
+}
+
+}  // namespace chromeos_update_engine
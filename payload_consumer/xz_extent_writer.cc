@@ -21,15 +21,8 @@ using std::vector;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
-
-// xz uses a variable dictionary size which impacts on the compression ratio
-// and is required to be reconstructed in RAM during decompression. While we
-// control the required memory from the compressor side, the decompressor allows
-// to set a limit on this dictionary size, rejecting compressed streams that
-// require more than that. "xz -9" requires up to 64 MiB, so a 64 MiB limit
-// will allow compressed streams up to -9, the maximum compression setting.
-const uint32_t kXzMaxDictSize = 64 * 1024 * 1024;
+// The size of the output buffer when not using a pool.
+const brillo::Blob::size_type kOutputBufferLength = 1024 * 1024;  // 1 MiB
 
 const char* XzErrorString(enum xz_ret error) {
   #define __XZ_ERROR_STRING_CASE(code) case code: return #code;
@@ -50,15 +43,87 @@ const char* XzErrorString(enum xz_ret error) {
 };
 }  // namespace
 
+// xz uses a variable dictionary size which impacts on the compression ratio
+// and is required to be reconstructed in RAM during decompression. While we
+// control the required memory from the compressor side, the decompressor allows
+// to set a limit on this dictionary size, rejecting compressed streams that
+// require more than that. "xz -9" requires up to 64 MiB, so a 64 MiB limit
+// will allow compressed streams up to -9, the maximum compression setting.
+const uint32_t XzExtentWriter::kMaxDictSize = 64 * 1024 * 1024;
+
+XzDecoderPool::~XzDecoderPool() {
+  for (xz_dec* decoder : free_decoders_)
+    xz_dec_end(decoder);
+}
+
+xz_dec* XzDecoderPool::Acquire() {
+  {
+    base::AutoLock auto_lock(lock_);
+    if (!free_decoders_.empty()) {
+      xz_dec* decoder = free_decoders_.back();
+      free_decoders_.pop_back();
+      xz_dec_reset(decoder);
+      return decoder;
+    }
+  }
+  return xz_dec_init(XZ_DYNALLOC, XzExtentWriter::kMaxDictSize);
+}
+
+void XzDecoderPool::Release(xz_dec* decoder) {
+  base::AutoLock auto_lock(lock_);
+  if (shrunk_)
+    xz_dec_end(decoder);
+  else
+    free_decoders_.push_back(decoder);
+}
+
+void XzDecoderPool::ShrinkToMinimum() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = true;
+  for (xz_dec* decoder : free_decoders_)
+    xz_dec_end(decoder);
+  free_decoders_.clear();
+}
+
+void XzDecoderPool::RestoreCapacity() {
+  base::AutoLock auto_lock(lock_);
+  shrunk_ = false;
+}
+
 XzExtentWriter::~XzExtentWriter() {
-  xz_dec_end(stream_);
+  if (decoders_ && stream_)
+    decoders_->Release(stream_);
+  else
+    xz_dec_end(stream_);
+  if (output_buffers_ && output_buffer_)
+    output_buffers_->Release(output_buffer_);
 }
 
 bool XzExtentWriter::Init(FileDescriptorPtr fd,
                           const vector<Extent>& extents,
                           uint32_t block_size) {
-  stream_ = xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize);
-  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  // A reused writer keeps the dictionary of its previous stream.
+  if (stream_) {
+    xz_dec_reset(stream_);
+  } else {
+    stream_ = decoders_ ? decoders_->Acquire()
+                        : xz_dec_init(XZ_DYNALLOC, kMaxDictSize);
+    TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  }
+  if (!output_buffer_) {
+    if (output_buffers_) {
+      output_buffer_ = static_cast<uint8_t*>(output_buffers_->Acquire());
+      TEST_AND_RETURN_FALSE(output_buffer_);
+      output_buffer_size_ = output_buffers_->buffer_size();
+    } else {
+      owned_output_buffer_.resize(kOutputBufferLength);
+      output_buffer_ = owned_output_buffer_.data();
+      output_buffer_size_ = owned_output_buffer_.size();
+    }
+  }
+  output_used_ = 0;
+  // The dictionary, allocated as the stream needs it, isn't accounted.
+  memory_.Set(output_buffer_size_);
   return underlying_writer_->Init(fd, extents, block_size);
 }
 
@@ -78,29 +143,33 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
+  request.out = output_buffer_;
+  request.out_size = output_buffer_size_;
   for (;;) {
-    request.out_pos = 0;
+    request.out_pos = output_used_;
 
     xz_ret ret = xz_dec_run(stream_, &request);
     if (ret != XZ_OK && ret != XZ_STREAM_END) {
       LOG(ERROR) << "xz_dec_run returned " << XzErrorString(ret);
+      LOG_IF(ERROR, ret == XZ_MEMLIMIT_ERROR)
+          << "The xz stream needs a dictionary larger than the "
+          << kMaxDictSize << " bytes supported.";
       return false;
     }
+    output_used_ = request.out_pos;
 
-    if (request.out_pos == 0)
+    if (ret == XZ_STREAM_END) {
+      // The stream can end exactly as the output buffer fills, and can't be
+      // decompressed any further. The output left is flushed by End().
+      CHECK_EQ(request.in_size, request.in_pos);
       break;
+    }
+    if (request.out_pos < request.out_size)
+      break;  // All the input was decompressed.
 
-    TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
-    if (ret == XZ_STREAM_END)
-      CHECK_EQ(request.in_size, request.in_pos);
-    if (request.in_size == request.in_pos)
-      break;  // No more input to process.
+    // The output buffer is full, but there may be more output pending.
+    TEST_AND_RETURN_FALSE(FlushOutputBuffer());
   }
-  output_buffer.clear();
 
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
@@ -112,7 +181,31 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
 
 bool XzExtentWriter::EndImpl() {
   TEST_AND_RETURN_FALSE(input_buffer_.empty());
+  TEST_AND_RETURN_FALSE(FlushOutputBuffer());
+  ReleaseOutputBuffer();
+  // The next writer taking the decompressor from the pool resets it.
+  if (decoders_) {
+    decoders_->Release(stream_);
+    stream_ = nullptr;
+  }
   return underlying_writer_->End();
 }
 
+bool XzExtentWriter::FlushOutputBuffer() {
+  if (output_used_ > 0) {
+    TEST_AND_RETURN_FALSE(
+        underlying_writer_->Write(output_buffer_, output_used_));
+    output_used_ = 0;
+  }
+  return true;
+}
+
+void XzExtentWriter::ReleaseOutputBuffer() {
+  if (output_buffers_ && output_buffer_) {
+    output_buffers_->Release(output_buffer_);
+    output_buffer_ = nullptr;
+  }
+  memory_.Set(owned_output_buffer_.size());
+}
+
 }  // namespace chromeos_update_engine
@@ -22,23 +22,74 @@
 #include <memory>
 #include <vector>
 
+#include <base/synchronization/lock.h>
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/memory_tracker.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 
 // XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
 // what it's given in Write using xz-embedded. Note that xz-embedded only
 // supports files with either no CRC or CRC-32. It passes the decompressed data
 // to an underlying ExtentWriter.
+//
+// The decompressed data is collected in an output buffer and passed to the
+// underlying ExtentWriter only once the buffer is full or on End(), so it sees
+// a few large writes. When created with an AlignedBufferPool, the output buffer
+// comes from the pool and goes back to it on End(), for the next writer.
+// Likewise, the decompressor comes from the XzDecoderPool the writer is created
+// with, if any.
 
 namespace chromeos_update_engine {
 
+// The xz decompressors released by the XzExtentWriters, reset and handed to
+// the next ones, so the dictionary allocated by a stream is reused by the
+// following streams instead of growing again from scratch. It is shared by
+// the writers of all the threads.
+class XzDecoderPool : public ShrinkableCache {
+ public:
+  XzDecoderPool() = default;
+  ~XzDecoderPool() override;
+
+  // Returns a decompressor reset for a new stream, or nullptr if it couldn't
+  // be allocated. The decompressor must be passed back to Release() once
+  // done.
+  xz_dec* Acquire();
+  void Release(xz_dec* decoder);
+
+  // ShrinkableCache overrides. The shrunk pool frees the decompressors
+  // released instead of keeping them.
+  void ShrinkToMinimum() override;
+  void RestoreCapacity() override;
+
+ private:
+  base::Lock lock_;
+  // The decompressors released and not acquired again, protected by |lock_|.
+  std::vector<xz_dec*> free_decoders_;
+  bool shrunk_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(XzDecoderPool);
+};
+
 class XzExtentWriter : public ExtentWriter {
  public:
   explicit XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
-      : underlying_writer_(std::move(underlying_writer)) {}
+      : XzExtentWriter(std::move(underlying_writer), nullptr) {}
+  XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                 AlignedBufferPool* output_buffers)
+      : XzExtentWriter(std::move(underlying_writer), output_buffers, nullptr) {}
+  XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                 AlignedBufferPool* output_buffers,
+                 XzDecoderPool* decoders)
+      : underlying_writer_(std::move(underlying_writer)),
+        decoders_(decoders),
+        output_buffers_(output_buffers) {}
   ~XzExtentWriter() override;
 
+  // The largest xz dictionary size this writer decompresses. Streams needing
+  // a larger dictionary are rejected.
+  static const uint32_t kMaxDictSize;
+
   bool Init(FileDescriptorPtr fd,
             const std::vector<Extent>& extents,
             uint32_t block_size) override;
@@ -48,10 +99,29 @@ class XzExtentWriter : public ExtentWriter {
  private:
   // The underlying ExtentWriter.
   std::unique_ptr<ExtentWriter> underlying_writer_;
-  // The opaque xz decompressor struct.
+  // The opaque xz decompressor struct, and the pool it came from if any.
   xz_dec* stream_{nullptr};
+  XzDecoderPool* decoders_{nullptr};
   brillo::Blob input_buffer_;
 
+  // Passes the |output_used_| bytes of the output buffer to the
+  // |underlying_writer_|.
+  bool FlushOutputBuffer();
+
+  // Passes the output buffer back to its pool, if any, once the stream ended.
+  void ReleaseOutputBuffer();
+
+  // The pool of the |output_buffer_|, if any. Otherwise, the output buffer is
+  // held in |owned_output_buffer_|.
+  AlignedBufferPool* output_buffers_{nullptr};
+  brillo::Blob owned_output_buffer_;
+  uint8_t* output_buffer_{nullptr};
+  size_t output_buffer_size_{0};
+  size_t output_used_{0};
+
+  // The memory held by the output buffer and the decompressor state.
+  TrackedMemory memory_{"Decompressor"};
+
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
 
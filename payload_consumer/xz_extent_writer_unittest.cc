@@ -139,6 +139,52 @@ TEST_F(XzExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, PooledOutputBufferTest) {
+  // The 30 KiB of output span several of the pooled output buffers.
+  AlignedBufferPool output_buffers(4096, 4096);
+  fake_extent_writer_ = new FakeExtentWriter();
+  xz_writer_.reset(new XzExtentWriter(
+      brillo::make_unique_ptr(fake_extent_writer_), &output_buffers));
+  WriteAll(brillo::Blob(std::begin(kCompressed30KiBofA),
+                        std::end(kCompressed30KiBofA)));
+  brillo::Blob expected_data(30 * 1024, 'a');
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+  // Destroy the writer before the pool to return the buffer to it.
+  xz_writer_.reset();
+}
+
+TEST_F(XzExtentWriterTest, OutputEndingWithTheBufferTest) {
+  // The stream ends exactly as the fifth 6 KiB output buffer fills.
+  AlignedBufferPool output_buffers(6 * 1024, 1024);
+  fake_extent_writer_ = new FakeExtentWriter();
+  xz_writer_.reset(new XzExtentWriter(
+      brillo::make_unique_ptr(fake_extent_writer_), &output_buffers));
+  WriteAll(brillo::Blob(std::begin(kCompressed30KiBofA),
+                        std::end(kCompressed30KiBofA)));
+  EXPECT_EQ(brillo::Blob(30 * 1024, 'a'), fake_extent_writer_->WrittenData());
+  xz_writer_.reset();
+}
+
+TEST_F(XzExtentWriterTest, DecoderPoolTest) {
+  XzDecoderPool decoders;
+  xz_dec* decoder = decoders.Acquire();
+  ASSERT_NE(nullptr, decoder);
+  decoders.Release(decoder);
+  // The writers decode their streams with the decompressor of the pool, reset
+  // for each of them.
+  for (int i = 0; i < 2; i++) {
+    fake_extent_writer_ = new FakeExtentWriter();
+    xz_writer_.reset(new XzExtentWriter(
+        brillo::make_unique_ptr(fake_extent_writer_), nullptr, &decoders));
+    WriteAll(brillo::Blob(std::begin(kCompressed30KiBofA),
+                          std::end(kCompressed30KiBofA)));
+    EXPECT_EQ(brillo::Blob(30 * 1024, 'a'), fake_extent_writer_->WrittenData());
+    EXPECT_EQ(decoder, decoders.Acquire());
+    decoders.Release(decoder);
+  }
+  xz_writer_.reset();
+}
+
 TEST_F(XzExtentWriterTest, GarbageDataRejected) {
   EXPECT_TRUE(xz_writer_->Init(fd_, {}, 1024));
   // The sample_data_ is an uncompressed string.
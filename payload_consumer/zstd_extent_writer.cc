@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The size of the output buffer when not using a pool.
+const brillo::Blob::size_type kOutputBufferLength = 1024 * 1024;  // 1 MiB
+}  // namespace
+
+ZstdDecoderDictionary::ZstdDecoderDictionary(ZSTD_DDict* ddict)
+    : ddict_(ddict) {
+  memory_.Set(ZSTD_sizeof_DDict(ddict_));
+}
+
+ZstdDecoderDictionary::~ZstdDecoderDictionary() {
+  ZSTD_freeDDict(ddict_);
+}
+
+std::unique_ptr<ZstdDecoderDictionary> ZstdDecoderDictionary::Create(
+    const std::string& dictionary) {
+  ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+  if (!ddict) {
+    LOG(ERROR) << "Unable to load the zstd dictionary of "
+               << dictionary.size() << " bytes.";
+    return nullptr;
+  }
+  return std::unique_ptr<ZstdDecoderDictionary>(
+      new ZstdDecoderDictionary(ddict));
+}
+
+ZstdExtentWriter::~ZstdExtentWriter() {
+  ZSTD_freeDStream(stream_);
+  if (output_buffers_ && output_buffer_)
+    output_buffers_->Release(output_buffer_);
+}
+
+bool ZstdExtentWriter::Init(FileDescriptorPtr fd,
+                            const vector<Extent>& extents,
+                            uint32_t block_size) {
+  if (!stream_) {
+    stream_ = ZSTD_createDStream();
+    TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  }
+  size_t rc = ZSTD_initDStream(stream_);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "ZSTD_initDStream failed: " << ZSTD_getErrorName(rc);
+    return false;
+  }
+  // Initializing the stream drops the dictionary of the previous operation.
+  if (dictionary_) {
+    rc = ZSTD_DCtx_refDDict(stream_, dictionary_->ddict());
+    if (ZSTD_isError(rc)) {
+      LOG(ERROR) << "ZSTD_DCtx_refDDict failed: " << ZSTD_getErrorName(rc);
+      return false;
+    }
+  }
+  frame_pending_ = false;
+  if (!output_buffer_) {
+    if (output_buffers_) {
+      output_buffer_ = static_cast<uint8_t*>(output_buffers_->Acquire());
+      TEST_AND_RETURN_FALSE(output_buffer_);
+      output_buffer_size_ = output_buffers_->buffer_size();
+    } else {
+      owned_output_buffer_.resize(kOutputBufferLength);
+      output_buffer_ = owned_output_buffer_.data();
+      output_buffer_size_ = owned_output_buffer_.size();
+    }
+  }
+  output_used_ = 0;
+  // The window, allocated as the frames need it, isn't accounted.
+  memory_.Set(output_buffer_size_);
+  return underlying_writer_->Init(fd, extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  ZSTD_inBuffer input = {bytes, count, 0};
+  while (count > 0) {
+    ZSTD_outBuffer output = {output_buffer_, output_buffer_size_, output_used_};
+    size_t rc = ZSTD_decompressStream(stream_, &output, &input);
+    if (ZSTD_isError(rc)) {
+      LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(rc);
+      return false;
+    }
+    output_used_ = output.pos;
+    // Zero means that a frame was decompressed and flushed completely. A blob
+    // can have several frames one after the other.
+    frame_pending_ = rc != 0;
+
+    if (input.pos == input.size &&
+        (!frame_pending_ || output.pos < output.size)) {
+      break;  // All the input was decompressed.
+    }
+
+    // The output buffer is full, but there may be more output pending.
+    if (output.pos == output.size)
+      TEST_AND_RETURN_FALSE(FlushOutputBuffer());
+  }
+  return true;
+}
+
+bool ZstdExtentWriter::EndImpl() {
+  TEST_AND_RETURN_FALSE(!frame_pending_);
+  TEST_AND_RETURN_FALSE(FlushOutputBuffer());
+  ReleaseOutputBuffer();
+  return underlying_writer_->End();
+}
+
+bool ZstdExtentWriter::FlushOutputBuffer() {
+  if (output_used_ > 0) {
+    TEST_AND_RETURN_FALSE(
+        underlying_writer_->Write(output_buffer_, output_used_));
+    output_used_ = 0;
+  }
+  return true;
+}
+
+void ZstdExtentWriter::ReleaseOutputBuffer() {
+  if (output_buffers_ && output_buffer_) {
+    output_buffers_->Release(output_buffer_);
+    output_buffer_ = nullptr;
+  }
+  memory_.Set(owned_output_buffer_.size());
+}
+
+}  // namespace chromeos_update_engine
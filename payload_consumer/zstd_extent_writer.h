@@ -0,0 +1,117 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_tracker.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that zstd-decompresses
+// what it's given in Write. It passes the decompressed data to an underlying
+// ExtentWriter.
+//
+// As in the XzExtentWriter, the decompressed data is collected in an output
+// buffer, which can come from an AlignedBufferPool, and passed to the
+// underlying ExtentWriter only once the buffer is full or on End().
+
+namespace chromeos_update_engine {
+
+// The zstd dictionary of a payload, loaded once and shared by the writers of
+// all the REPLACE_ZSTD operations compressed against it, also from the worker
+// threads.
+class ZstdDecoderDictionary {
+ public:
+  ~ZstdDecoderDictionary();
+
+  // Loads the |dictionary|. Returns nullptr if it isn't valid.
+  static std::unique_ptr<ZstdDecoderDictionary> Create(
+      const std::string& dictionary);
+
+  const ZSTD_DDict* ddict() const { return ddict_; }
+
+ private:
+  explicit ZstdDecoderDictionary(ZSTD_DDict* ddict);
+
+  ZSTD_DDict* ddict_;
+
+  // The memory held by the loaded dictionary.
+  TrackedMemory memory_{"Decompressor"};
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdDecoderDictionary);
+};
+
+class ZstdExtentWriter : public ExtentWriter {
+ public:
+  explicit ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
+      : ZstdExtentWriter(std::move(underlying_writer), nullptr, nullptr) {}
+  // The frames are decompressed with the |dictionary|, if not null.
+  ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                   AlignedBufferPool* output_buffers,
+                   const ZstdDecoderDictionary* dictionary)
+      : underlying_writer_(std::move(underlying_writer)),
+        dictionary_(dictionary),
+        output_buffers_(output_buffers) {}
+  ~ZstdExtentWriter() override;
+
+  bool Init(FileDescriptorPtr fd,
+            const std::vector<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+  bool EndImpl() override;
+
+ private:
+  // The underlying ExtentWriter.
+  std::unique_ptr<ExtentWriter> underlying_writer_;
+  // The dictionary of the frames, if any.
+  const ZstdDecoderDictionary* dictionary_;
+  // The zstd decompression stream, which buffers the partial input itself.
+  ZSTD_DStream* stream_{nullptr};
+  // Whether the last frame passed to Write() isn't complete yet.
+  bool frame_pending_{false};
+
+  // Passes the |output_used_| bytes of the output buffer to the
+  // |underlying_writer_|.
+  bool FlushOutputBuffer();
+
+  // Passes the output buffer back to its pool, if any, once the stream ended.
+  void ReleaseOutputBuffer();
+
+  // The pool of the |output_buffer_|, if any. Otherwise, the output buffer is
+  // held in |owned_output_buffer_|.
+  AlignedBufferPool* output_buffers_{nullptr};
+  brillo::Blob owned_output_buffer_;
+  uint8_t* output_buffer_{nullptr};
+  size_t output_buffer_size_{0};
+  size_t output_used_{0};
+
+  // The memory held by the output buffer and the decompressor state.
+  TrackedMemory memory_{"Decompressor"};
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
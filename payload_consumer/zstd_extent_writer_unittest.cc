@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+#include <brillo/make_unique_ptr.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/zstd.h"
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_extent_writer_ = new FakeExtentWriter();
+    zstd_writer_.reset(
+        new ZstdExtentWriter(brillo::make_unique_ptr(fake_extent_writer_)));
+  }
+
+  // Writes the |compressed| data in chunks of |chunk_size| bytes.
+  bool WriteAll(const brillo::Blob& compressed, size_t chunk_size) {
+    EXPECT_TRUE(zstd_writer_->Init(fd_, {}, 1024));
+    for (size_t pos = 0; pos < compressed.size(); pos += chunk_size) {
+      size_t size = std::min(chunk_size, compressed.size() - pos);
+      if (!zstd_writer_->Write(compressed.data() + pos, size))
+        return false;
+    }
+    return zstd_writer_->End();
+  }
+
+  // Owned by |zstd_writer_|. This object is invalidated after |zstd_writer_|
+  // is deleted.
+  FakeExtentWriter* fake_extent_writer_{nullptr};
+  std::unique_ptr<ZstdExtentWriter> zstd_writer_;
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(ZstdExtentWriterTest, CreateAndDestroy) {
+  // Test that no Init() or End() called doesn't crash the program.
+  EXPECT_FALSE(fake_extent_writer_->InitCalled());
+  EXPECT_FALSE(fake_extent_writer_->EndCalled());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
+  // Test that even if the output data is bigger than the internal buffer, all
+  // the data is written, regardless of how the input is split.
+  brillo::Blob data(3 * 1024 * 1024, 'a');
+  std::copy(std::begin(test_utils::kRandomString),
+            std::end(test_utils::kRandomString),
+            data.begin() + 1024 * 1024);
+  brillo::Blob compressed;
+  EXPECT_TRUE(ZstdCompress(data, &compressed));
+  for (size_t chunk_size : {compressed.size(), static_cast<size_t>(7)}) {
+    SetUp();
+    EXPECT_TRUE(WriteAll(compressed, chunk_size));
+    EXPECT_TRUE(fake_extent_writer_->EndCalled());
+    EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+  }
+}
+
+TEST_F(ZstdExtentWriterTest, ConcatenatedFramesTest) {
+  brillo::Blob data(std::begin(test_utils::kRandomString),
+                    std::end(test_utils::kRandomString));
+  brillo::Blob compressed;
+  EXPECT_TRUE(ZstdCompress(data, &compressed));
+  brillo::Blob two_frames = compressed;
+  two_frames.insert(two_frames.end(), compressed.begin(), compressed.end());
+  EXPECT_TRUE(WriteAll(two_frames, two_frames.size()));
+
+  brillo::Blob expected = data;
+  expected.insert(expected.end(), data.begin(), data.end());
+  EXPECT_EQ(expected, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, TruncatedFrameFailsTest) {
+  brillo::Blob data(100 * 1024, 'b');
+  brillo::Blob compressed;
+  EXPECT_TRUE(ZstdCompress(data, &compressed));
+  compressed.resize(compressed.size() - 1);
+  EXPECT_FALSE(WriteAll(compressed, compressed.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, DictionaryTest) {
+  // Small files sharing most of their contents, like the configuration files
+  // of a partition.
+  std::vector<brillo::Blob> samples;
+  for (int i = 0; i < 200; i++) {
+    std::string text;
+    for (int line = 0; line < 20; line++)
+      text += base::StringPrintf("ro.property.%d.value=%d\n", line, i * line);
+    samples.emplace_back(text.begin(), text.end());
+  }
+  std::unique_ptr<ZstdDictionary> dictionary =
+      ZstdDictionary::Train(samples, 4096);
+  ASSERT_NE(nullptr, dictionary);
+  brillo::Blob compressed;
+  EXPECT_TRUE(dictionary->Compress(samples[7], &compressed));
+  EXPECT_EQ(dictionary->id(), ZstdFrameDictionaryId(compressed));
+
+  // The frame can't be decompressed without the dictionary.
+  EXPECT_FALSE(WriteAll(compressed, compressed.size()));
+
+  std::unique_ptr<ZstdDecoderDictionary> decoder_dictionary =
+      ZstdDecoderDictionary::Create(
+          std::string(dictionary->data().begin(), dictionary->data().end()));
+  ASSERT_NE(nullptr, decoder_dictionary);
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(
+      new ZstdExtentWriter(brillo::make_unique_ptr(fake_extent_writer_),
+                           nullptr,
+                           decoder_dictionary.get()));
+  EXPECT_TRUE(WriteAll(compressed, 7));
+  EXPECT_EQ(samples[7], fake_extent_writer_->WrittenData());
+}
+
+}  // namespace chromeos_update_engine
@@ -16,9 +16,15 @@
 
 #include "update_engine/payload_generator/ab_generator.h"
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
 
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
@@ -27,6 +33,9 @@
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/image_index_cache.h"
+#include "update_engine/payload_generator/mapped_image.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -46,20 +55,6 @@ bool ABGenerator::GenerateOperations(
                                config.hard_chunk_size / config.block_size);
   size_t soft_chunk_blocks = config.soft_chunk_size / config.block_size;
 
-  aops->clear();
-  TEST_AND_RETURN_FALSE(diff_utils::DeltaReadPartition(aops,
-                                                       old_part,
-                                                       new_part,
-                                                       hard_chunk_blocks,
-                                                       soft_chunk_blocks,
-                                                       config.version,
-                                                       blob_file));
-  LOG(INFO) << "done reading " << new_part.name;
-
-  TEST_AND_RETURN_FALSE(
-      FragmentOperations(config.version, aops, new_part.path, blob_file));
-  SortOperationsByDestination(aops);
-
   // Use the soft_chunk_size when merging operations to prevent merging all
   // the operations into a huge one if there's no hard limit.
   size_t merge_chunk_blocks = soft_chunk_blocks;
@@ -68,8 +63,42 @@ bool ABGenerator::GenerateOperations(
     merge_chunk_blocks = hard_chunk_blocks;
   }
 
-  TEST_AND_RETURN_FALSE(MergeOperations(
-      aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
+  // The partitions that didn't change, like most vendor and firmware ones,
+  // are copied without mapping their blocks nor diffing their files.
+  bool unchanged = false;
+  if (config.version.OperationAllowed(InstallOperation::SOURCE_COPY)) {
+    std::unique_ptr<ImageIndexCache> image_index_cache;
+    if (!config.diff_cache_dir.empty())
+      image_index_cache.reset(new ImageIndexCache(config.diff_cache_dir));
+    TEST_AND_RETURN_FALSE(diff_utils::IsPartitionUnchanged(
+        old_part, new_part, image_index_cache.get(), &unchanged));
+  }
+
+  aops->clear();
+  if (unchanged) {
+    diff_utils::DeltaUnchangedPartition(aops, new_part, merge_chunk_blocks);
+  } else {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::DeltaReadPartition(aops,
+                                       old_part,
+                                       new_part,
+                                       hard_chunk_blocks,
+                                       soft_chunk_blocks,
+                                       config.diff_memory_limit,
+                                       config.diff_cache_dir,
+                                       config.version,
+                                       blob_file));
+    LOG(INFO) << "done reading " << new_part.name;
+
+    TEST_AND_RETURN_FALSE(
+        FragmentOperations(config.version, aops, new_part.path, blob_file));
+    SortOperationsByDestination(aops);
+    TEST_AND_RETURN_FALSE(MergeOperations(
+        aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
+  }
+
+  if (config.apply_order.enabled)
+    OrderOperationsForApply(config.apply_order, aops);
 
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
     TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
@@ -82,21 +111,200 @@ void ABGenerator::SortOperationsByDestination(
   sort(aops->begin(), aops->end(), diff_utils::CompareAopsByDestination);
 }
 
+namespace {
+
+// The number of operations following the last source read and the last
+// destination write considered for the next operation.
+const size_t kOrderCandidates = 8;
+
+// The first and last blocks of the extents of an operation, skipping the
+// sparse holes, if any.
+struct BlockSpan {
+  bool empty = true;
+  uint64_t start = 0;
+  uint64_t end = 0;
+};
+
+BlockSpan GetBlockSpan(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  BlockSpan span;
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+      continue;
+    if (span.empty)
+      span.start = extent.start_block();
+    span.empty = false;
+    span.end = extent.start_block() + extent.num_blocks();
+  }
+  return span;
+}
+
+}  // namespace
+
+void ABGenerator::OrderOperationsForApply(const ApplyOrderCostModel& model,
+                                          vector<AnnotatedOperation>* aops) {
+  vector<BlockSpan> src_spans, dst_spans;
+  // The operations not ordered yet, by the first block they read or write.
+  std::multimap<uint64_t, size_t> by_src, by_dst;
+  for (size_t i = 0; i < aops->size(); i++) {
+    src_spans.push_back(GetBlockSpan((*aops)[i].op.src_extents()));
+    dst_spans.push_back(GetBlockSpan((*aops)[i].op.dst_extents()));
+    if (!src_spans[i].empty)
+      by_src.emplace(src_spans[i].start, i);
+    if (!dst_spans[i].empty)
+      by_dst.emplace(dst_spans[i].start, i);
+  }
+
+  vector<AnnotatedOperation> ordered_aops;
+  ordered_aops.reserve(aops->size());
+  uint64_t last_src_end = 0, last_dst_end = 0;
+  double total_cost = 0;
+  while (!by_dst.empty()) {
+    vector<size_t> candidates = {by_dst.begin()->second};
+    for (auto it = by_dst.lower_bound(last_dst_end);
+         it != by_dst.end() && candidates.size() <= kOrderCandidates; ++it) {
+      candidates.push_back(it->second);
+    }
+    size_t num_dst_candidates = candidates.size();
+    for (auto it = by_src.lower_bound(last_src_end);
+         it != by_src.end() &&
+         candidates.size() <= num_dst_candidates + kOrderCandidates;
+         ++it) {
+      candidates.push_back(it->second);
+    }
+
+    // Ties are broken in destination order.
+    size_t best = candidates[0];
+    double best_cost = std::numeric_limits<double>::max();
+    for (size_t i : candidates) {
+      double cost = model.JumpCost(
+          last_dst_end, dst_spans[i].start, model.dst_seek_cost);
+      if (!src_spans[i].empty) {
+        cost += model.JumpCost(
+            last_src_end, src_spans[i].start, model.src_seek_cost);
+      }
+      if (cost < best_cost ||
+          (cost == best_cost && dst_spans[i].start < dst_spans[best].start)) {
+        best = i;
+        best_cost = cost;
+      }
+    }
+    total_cost += best_cost;
+
+    // Remove the operation from the maps.
+    auto range = by_dst.equal_range(dst_spans[best].start);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == best) {
+        by_dst.erase(it);
+        break;
+      }
+    }
+    if (!src_spans[best].empty) {
+      range = by_src.equal_range(src_spans[best].start);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == best) {
+          by_src.erase(it);
+          break;
+        }
+      }
+      last_src_end = src_spans[best].end;
+    }
+    last_dst_end = dst_spans[best].end;
+    ordered_aops.push_back(std::move((*aops)[best]));
+  }
+  // The operations without destination extents stay at the end.
+  for (size_t i = 0; i < aops->size(); i++) {
+    if (dst_spans[i].empty)
+      ordered_aops.push_back(std::move((*aops)[i]));
+  }
+  LOG(INFO) << "Ordered " << ordered_aops.size() << " operations for an "
+            << "estimated apply cost of " << total_cost << " seeks.";
+  *aops = std::move(ordered_aops);
+}
+
+namespace {
+
+// The number of operations per thread whose data is generated before storing
+// their blobs, which bounds the memory held by the blobs generated.
+const size_t kReplaceOperationsPerThread = 4;
+
+// Generates the best full operation for the target data of a REPLACE_*
+// operation from a worker thread. The blob is stored afterwards, in the order
+// of the operations, so the payload doesn't depend on the thread scheduling.
+class ReplaceDataGenerator : public base::DelegateSimpleThread::Delegate {
+ public:
+  ReplaceDataGenerator(const PayloadVersion& version,
+                       const string& target_part_path,
+                       const AnnotatedOperation* aop)
+      : version_(version), target_part_path_(target_part_path), aop_(aop) {}
+  ReplaceDataGenerator(ReplaceDataGenerator&&) = default;
+  ~ReplaceDataGenerator() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    brillo::Blob data(aop_->op.dst_length());
+    vector<Extent> dst_extents;
+    ExtentsToVector(aop_->op.dst_extents(), &dst_extents);
+    if (!ReadImageExtents(target_part_path_,
+                          dst_extents,
+                          &data,
+                          data.size(),
+                          kBlockSize)) {
+      LOG(ERROR) << "Failed to read the data of " << aop_->name;
+      return;
+    }
+    success_ = diff_utils::GenerateBestFullOperation(
+        data, version_, &blob_, &type_);
+    LOG_IF(ERROR, !success_) << "Failed to compress the data of "
+                             << aop_->name;
+  }
+
+  const brillo::Blob& blob() const { return blob_; }
+  InstallOperation_Type type() const { return type_; }
+  bool success() const { return success_; }
+
+ private:
+  const PayloadVersion& version_;
+  const string& target_part_path_;
+  const AnnotatedOperation* aop_;
+
+  brillo::Blob blob_;
+  InstallOperation_Type type_{InstallOperation::REPLACE};
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaceDataGenerator);
+};
+
+}  // namespace
+
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
                                      const string& target_part_path,
                                      BlobFileWriter* blob_file) {
+  ScopedProfilePhase profile_phase("ABGenerator::FragmentOperations");
   vector<AnnotatedOperation> fragmented_aops;
-  for (const AnnotatedOperation& aop : *aops) {
+  fragmented_aops.reserve(aops->size());
+  // The REPLACE_* operations split, whose data is added once all of them are
+  // known.
+  vector<size_t> replace_indexes;
+  for (AnnotatedOperation& aop : *aops) {
     if (aop.op.type() == InstallOperation::SOURCE_COPY) {
       TEST_AND_RETURN_FALSE(SplitSourceCopy(aop, &fragmented_aops));
     } else if (IsAReplaceOperation(aop.op.type())) {
-      TEST_AND_RETURN_FALSE(SplitAReplaceOp(
-          version, aop, target_part_path, &fragmented_aops, blob_file));
+      size_t first_index = fragmented_aops.size();
+      TEST_AND_RETURN_FALSE(SplitAReplaceOpExtents(aop, &fragmented_aops));
+      for (size_t i = first_index; i < fragmented_aops.size(); i++)
+        replace_indexes.push_back(i);
     } else {
-      fragmented_aops.push_back(aop);
+      fragmented_aops.push_back(std::move(aop));
     }
   }
+  vector<AnnotatedOperation*> replace_aops;
+  replace_aops.reserve(replace_indexes.size());
+  for (size_t i : replace_indexes)
+    replace_aops.push_back(&fragmented_aops[i]);
+  TEST_AND_RETURN_FALSE(
+      AddDataAndSetTypes(replace_aops, version, target_part_path, blob_file));
   *aops = std::move(fragmented_aops);
   return true;
 }
@@ -104,15 +312,17 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
 bool ABGenerator::SplitSourceCopy(
     const AnnotatedOperation& original_aop,
     vector<AnnotatedOperation>* result_aops) {
-  InstallOperation original_op = original_aop.op;
+  const InstallOperation& original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(original_op.type() == InstallOperation::SOURCE_COPY);
   // Keeps track of the index of curr_src_ext.
   int curr_src_ext_index = 0;
   Extent curr_src_ext = original_op.src_extents(curr_src_ext_index);
   for (int i = 0; i < original_op.dst_extents_size(); i++) {
-    Extent dst_ext = original_op.dst_extents(i);
-    // The new operation which will have only one dst extent.
-    InstallOperation new_op;
+    const Extent& dst_ext = original_op.dst_extents(i);
+    // The new operation which will have only one dst extent, built in place.
+    result_aops->emplace_back();
+    AnnotatedOperation& new_aop = result_aops->back();
+    InstallOperation& new_op = new_aop.op;
     uint64_t blocks_left = dst_ext.num_blocks();
     while (blocks_left > 0) {
       if (curr_src_ext.num_blocks() <= blocks_left) {
@@ -136,16 +346,17 @@ bool ABGenerator::SplitSourceCopy(
         blocks_left -= first_ext.num_blocks();
       }
     }
-    // Fix up our new operation and add it to the results.
+    // Fix up our new operation and add it to the results. The source hash is
+    // still valid if the operation wasn't split.
     new_op.set_type(InstallOperation::SOURCE_COPY);
+    if (original_op.dst_extents_size() == 1 &&
+        original_op.has_src_sha256_hash()) {
+      new_op.set_src_sha256_hash(original_op.src_sha256_hash());
+    }
     *(new_op.add_dst_extents()) = dst_ext;
     new_op.set_src_length(dst_ext.num_blocks() * kBlockSize);
     new_op.set_dst_length(dst_ext.num_blocks() * kBlockSize);
-
-    AnnotatedOperation new_aop;
-    new_aop.op = new_op;
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    result_aops->push_back(new_aop);
   }
   if (curr_src_ext_index != original_op.src_extents().size() - 1) {
     LOG(FATAL) << "Incorrectly split SOURCE_COPY operation. Did not use all "
@@ -159,15 +370,28 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
                                   const string& target_part_path,
                                   vector<AnnotatedOperation>* result_aops,
                                   BlobFileWriter* blob_file) {
-  InstallOperation original_op = original_aop.op;
+  size_t first_index = result_aops->size();
+  TEST_AND_RETURN_FALSE(SplitAReplaceOpExtents(original_aop, result_aops));
+  vector<AnnotatedOperation*> new_aops;
+  for (size_t i = first_index; i < result_aops->size(); i++)
+    new_aops.push_back(&(*result_aops)[i]);
+  return AddDataAndSetTypes(new_aops, version, target_part_path, blob_file);
+}
+
+bool ABGenerator::SplitAReplaceOpExtents(
+    const AnnotatedOperation& original_aop,
+    vector<AnnotatedOperation>* result_aops) {
+  const InstallOperation& original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_op.type()));
   const bool is_replace = original_op.type() == InstallOperation::REPLACE;
 
   uint32_t data_offset = original_op.data_offset();
   for (int i = 0; i < original_op.dst_extents_size(); i++) {
-    Extent dst_ext = original_op.dst_extents(i);
-    // Make a new operation with only one dst extent.
-    InstallOperation new_op;
+    const Extent& dst_ext = original_op.dst_extents(i);
+    // Make a new operation with only one dst extent, built in place.
+    result_aops->emplace_back();
+    AnnotatedOperation& new_aop = result_aops->back();
+    InstallOperation& new_op = new_aop.op;
     *(new_op.add_dst_extents()) = dst_ext;
     uint32_t data_size = dst_ext.num_blocks() * kBlockSize;
     new_op.set_dst_length(data_size);
@@ -178,14 +402,7 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
       new_op.set_data_offset(data_offset);
       data_offset += data_size;
     }
-
-    AnnotatedOperation new_aop;
-    new_aop.op = new_op;
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    TEST_AND_RETURN_FALSE(
-        AddDataAndSetType(&new_aop, version, target_part_path, blob_file));
-
-    result_aops->push_back(new_aop);
   }
   return true;
 }
@@ -195,10 +412,12 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   size_t chunk_blocks,
                                   const string& target_part_path,
                                   BlobFileWriter* blob_file) {
+  ScopedProfilePhase profile_phase("ABGenerator::MergeOperations");
   vector<AnnotatedOperation> new_aops;
-  for (const AnnotatedOperation& curr_aop : *aops) {
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     AnnotatedOperation& last_aop = new_aops.back();
@@ -206,7 +425,7 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
 
     if (last_aop.op.dst_extents_size() <= 0 ||
         curr_aop.op.dst_extents_size() <= 0) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     uint32_t last_dst_idx = last_aop.op.dst_extents_size() - 1;
@@ -235,6 +454,8 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
       if (is_delta_op) {
         ExtendExtents(last_aop.op.mutable_src_extents(),
                       curr_aop.op.src_extents());
+        // The source hash is added later for the merged source extents.
+        last_aop.op.clear_src_sha256_hash();
         if (curr_aop.op.src_length() > 0)
           last_aop.op.set_src_length(last_aop.op.src_length() +
                                      curr_aop.op.src_length());
@@ -245,62 +466,81 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
         last_aop.op.set_dst_length(last_aop.op.dst_length() +
                                    curr_aop.op.dst_length());
       // Set the data length to zero so we know to add the blob later.
-      if (is_a_replace)
+      if (is_a_replace) {
         last_aop.op.set_data_length(0);
+        last_aop.op.clear_data_sha256_hash();
+      }
     } else {
       // Otherwise just include the extent as is.
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
     }
   }
 
-  // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ operations that have been
-  // merged.
+  // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ/REPLACE_ZSTD operations
+  // that have been merged.
+  vector<AnnotatedOperation*> merged_aops;
   for (AnnotatedOperation& curr_aop : new_aops) {
     if (curr_aop.op.data_length() == 0 &&
         IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+      merged_aops.push_back(&curr_aop);
     }
   }
+  TEST_AND_RETURN_FALSE(
+      AddDataAndSetTypes(merged_aops, version, target_part_path, blob_file));
 
-  *aops = new_aops;
+  *aops = std::move(new_aops);
   return true;
 }
 
-bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
-                                    const PayloadVersion& version,
-                                    const string& target_part_path,
-                                    BlobFileWriter* blob_file) {
-  TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop->op.type()));
-
-  brillo::Blob data(aop->op.dst_length());
-  vector<Extent> dst_extents;
-  ExtentsToVector(aop->op.dst_extents(), &dst_extents);
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(target_part_path,
-                                           dst_extents,
-                                           &data,
-                                           data.size(),
-                                           kBlockSize));
-
-  brillo::Blob blob;
-  InstallOperation_Type op_type;
-  TEST_AND_RETURN_FALSE(
-      diff_utils::GenerateBestFullOperation(data, version, &blob, &op_type));
+bool ABGenerator::AddDataAndSetTypes(const vector<AnnotatedOperation*>& aops,
+                                     const PayloadVersion& version,
+                                     const string& target_part_path,
+                                     BlobFileWriter* blob_file) {
+  const size_t max_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  const size_t batch_size = max_threads * kReplaceOperationsPerThread;
+  for (size_t first = 0; first < aops.size(); first += batch_size) {
+    const size_t end = std::min(first + batch_size, aops.size());
+    vector<ReplaceDataGenerator> generators;
+    generators.reserve(end - first);
+    for (size_t i = first; i < end; i++) {
+      TEST_AND_RETURN_FALSE(IsAReplaceOperation(aops[i]->op.type()));
+      generators.emplace_back(version, target_part_path, aops[i]);
+    }
 
-  // If the operation doesn't point to a data blob or points to a data blob of
-  // a different type then we add it.
-  if (aop->op.type() != op_type || aop->op.data_length() != blob.size()) {
-    aop->op.set_type(op_type);
-    aop->SetOperationBlob(blob, blob_file);
-  }
+    if (generators.size() == 1) {
+      generators[0].Run();
+    } else {
+      base::DelegateSimpleThreadPool thread_pool(
+          "replace-data", std::min(max_threads, generators.size()));
+      thread_pool.Start();
+      for (ReplaceDataGenerator& generator : generators)
+        thread_pool.AddWork(&generator);
+      thread_pool.JoinAll();
+    }
 
+    for (size_t i = first; i < end; i++) {
+      const ReplaceDataGenerator& generator = generators[i - first];
+      TEST_AND_RETURN_FALSE(generator.success());
+      // If the operation doesn't point to a data blob or points to a data blob
+      // of a different type then we add it.
+      AnnotatedOperation* aop = aops[i];
+      if (aop->op.type() != generator.type() ||
+          aop->op.data_length() != generator.blob().size()) {
+        aop->op.set_type(generator.type());
+        TEST_AND_RETURN_FALSE(aop->SetOperationBlob(generator.blob(),
+                                                    blob_file));
+      }
+    }
+  }
   return true;
 }
 
 bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
                                 const string& source_part_path) {
+  // The source blocks of a mapped image are hashed without copying them.
+  const MappedImage* image = MappedImage::Find(source_part_path);
   for (AnnotatedOperation& aop : *aops) {
-    if (aop.op.src_extents_size() == 0)
+    if (aop.op.src_extents_size() == 0 || aop.op.has_src_sha256_hash())
       continue;
 
     vector<Extent> src_extents;
@@ -310,9 +550,25 @@ bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
         aop.op.has_src_length()
             ? aop.op.src_length()
             : BlocksInExtents(aop.op.src_extents()) * kBlockSize;
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(
-        source_part_path, src_extents, &src_data, src_length, kBlockSize));
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
+    if (image) {
+      TEST_AND_RETURN_FALSE(
+          src_length == BlocksInExtents(aop.op.src_extents()) * kBlockSize);
+      HashCalculator hasher;
+      for (const Extent& extent : src_extents) {
+        const uint8_t* blocks = image->Blocks(
+            extent.start_block(), extent.num_blocks(), kBlockSize);
+        TEST_AND_RETURN_FALSE(blocks != nullptr);
+        TEST_AND_RETURN_FALSE(
+            hasher.Update(blocks, extent.num_blocks() * kBlockSize));
+      }
+      TEST_AND_RETURN_FALSE(hasher.Finalize());
+      src_hash = hasher.raw_hash();
+    } else {
+      TEST_AND_RETURN_FALSE(utils::ReadExtents(
+          source_part_path, src_extents, &src_data, src_length, kBlockSize));
+      TEST_AND_RETURN_FALSE(
+          HashCalculator::RawHashOfData(src_data, &src_hash));
+    }
     aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
   }
   return true;
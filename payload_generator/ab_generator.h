@@ -73,6 +73,14 @@ class ABGenerator : public OperationsGenerator {
   static void SortOperationsByDestination(
       std::vector<AnnotatedOperation>* aops);
 
+  // Reorders the vector of AnnotatedOperations |aops|, sorted by destination,
+  // to lower the seeks of the device applying them according to the cost
+  // |model|. The next operation is picked greedily, among the ones following
+  // the last source read and destination write, as the one with the cheapest
+  // jumps from them.
+  static void OrderOperationsForApply(const ApplyOrderCostModel& model,
+                                      std::vector<AnnotatedOperation>* aops);
+
   // Takes an SOURCE_COPY install operation, |aop|, and adds one operation for
   // each dst extent in |aop| to |ops|. The new operations added to |ops| will
   // have only one dst extent. The src extents are split so the number of blocks
@@ -111,22 +119,32 @@ class ABGenerator : public OperationsGenerator {
                               BlobFileWriter* blob_file);
 
   // Takes a vector of AnnotatedOperations |aops|, adds source hash to all
-  // operations that have src_extents.
+  // operations that have src_extents and don't have one yet. The diffed
+  // operations already got it when they were generated, so only the moved
+  // and merged blocks are read again.
   static bool AddSourceHash(std::vector<AnnotatedOperation>* aops,
                             const std::string& source_part_path);
 
  private:
-  // Adds the data payload for a REPLACE/REPLACE_BZ/REPLACE_XZ operation |aop|
-  // by reading its output extents from |target_part_path| and appending a
-  // corresponding data blob to |blob_file|. The blob will be compressed if this
-  // is smaller than the uncompressed form, and the operation type will be set
-  // accordingly. |*blob_file| will be updated as well. If the operation happens
-  // to have the right type and already points to a data blob, nothing is
-  // written. Caller should only set type and data blob if it's valid.
-  static bool AddDataAndSetType(AnnotatedOperation* aop,
-                                const PayloadVersion& version,
-                                const std::string& target_part_path,
-                                BlobFileWriter* blob_file);
+  // Adds the operations of SplitAReplaceOp() to |result_aops|, without their
+  // data.
+  static bool SplitAReplaceOpExtents(
+      const AnnotatedOperation& original_aop,
+      std::vector<AnnotatedOperation>* result_aops);
+
+  // Adds the data payload for each REPLACE/REPLACE_BZ/REPLACE_XZ operation of
+  // |aops| by reading its output extents from |target_part_path| and appending
+  // a corresponding data blob to |blob_file|. The blob will be compressed if
+  // this is smaller than the uncompressed form, and the operation type will be
+  // set accordingly. |*blob_file| will be updated as well. If the operation
+  // happens to have the right type and already points to a data blob, nothing
+  // is written. Caller should only set type and data blob if it's valid. The
+  // data of the operations is compressed in parallel, but their blobs are
+  // stored in the order of |aops|.
+  static bool AddDataAndSetTypes(const std::vector<AnnotatedOperation*>& aops,
+                                 const PayloadVersion& version,
+                                 const std::string& target_part_path,
+                                 BlobFileWriter* blob_file);
 
   DISALLOW_COPY_AND_ASSIGN(ABGenerator);
 };
@@ -24,6 +24,7 @@
 #include <string>
 #include <vector>
 
+#include <base/strings/stringprintf.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/hash_calculator.h"
@@ -408,6 +409,60 @@ TEST_F(ABGeneratorTest, SplitReplaceBzIntoReplaceTest) {
   TestSplitReplaceOrReplaceBzOperation(InstallOperation::REPLACE_BZ, false);
 }
 
+TEST_F(ABGeneratorTest, FragmentManyReplaceOperationsTest) {
+  // A REPLACE_BZ operation writing every other block of the partition.
+  const size_t kNumExtents = 40;
+  test_utils::ScopedTempFile part_file("FragmentManyReplaceTest_part.XXXXXX");
+  brillo::Blob part_data(2 * kNumExtents * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), part_data.data(), part_data.size()));
+
+  AnnotatedOperation aop;
+  aop.name = "ManyExtents";
+  aop.op.set_type(InstallOperation::REPLACE_BZ);
+  for (size_t i = 0; i < kNumExtents; i++)
+    *(aop.op.add_dst_extents()) = ExtentForRange(2 * i, 1);
+  aop.op.set_dst_length(kNumExtents * kBlockSize);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(1);
+
+  test_utils::ScopedTempFile data_file("FragmentManyReplaceTest_data.XXXXXX");
+  int data_fd = open(data_file.path().c_str(), O_RDWR, 000);
+  ASSERT_GE(data_fd, 0);
+  ScopedFdCloser data_fd_closer(&data_fd);
+  off_t data_file_size = 0;
+  BlobFileWriter blob_file(data_fd, &data_file_size);
+
+  vector<AnnotatedOperation> aops = {aop};
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  ASSERT_TRUE(ABGenerator::FragmentOperations(
+      version, &aops, part_file.path(), &blob_file));
+  ASSERT_EQ(kNumExtents, aops.size());
+
+  // The blobs compressed in parallel are stored in the order of the
+  // operations.
+  uint64_t expected_offset = 0;
+  for (size_t i = 0; i < kNumExtents; i++) {
+    EXPECT_EQ(base::StringPrintf("ManyExtents:%zu", i), aops[i].name);
+    EXPECT_EQ(InstallOperation::REPLACE_BZ, aops[i].op.type());
+    EXPECT_EQ(expected_offset, aops[i].op.data_offset());
+    expected_offset += aops[i].op.data_length();
+
+    brillo::Blob blob(aops[i].op.data_length()), expected_blob;
+    ssize_t bytes_read;
+    ASSERT_TRUE(utils::PReadAll(data_fd, blob.data(), blob.size(),
+                                aops[i].op.data_offset(), &bytes_read));
+    ASSERT_TRUE(BzipCompress(
+        brillo::Blob(part_data.begin() + 2 * i * kBlockSize,
+                     part_data.begin() + (2 * i + 1) * kBlockSize),
+        &expected_blob));
+    EXPECT_EQ(expected_blob, blob);
+  }
+  EXPECT_EQ(static_cast<off_t>(expected_offset), data_file_size);
+}
+
 TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   vector<AnnotatedOperation> aops;
   // One operation with multiple destination extents.
@@ -441,6 +496,53 @@ TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   EXPECT_EQ(second_aop.name, aops[2].name);
 }
 
+TEST_F(ABGeneratorTest, OrderOperationsForApplyTest) {
+  vector<AnnotatedOperation> aops;
+  // Sorted by destination, the source reads jump back and forth.
+  const vector<std::pair<uint64_t, uint64_t>> kDstAndSrcBlocks = {
+      {0, 100}, {10, 0}, {20, 101}};
+  for (const auto& blocks : kDstAndSrcBlocks) {
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *(aop.op.add_dst_extents()) = ExtentForRange(blocks.first, 1);
+    *(aop.op.add_src_extents()) = ExtentForRange(blocks.second, 1);
+    aop.name = std::to_string(blocks.first);
+    aops.push_back(aop);
+  }
+  // One with no destination extent, which stays at the end.
+  AnnotatedOperation empty_aop;
+  empty_aop.name = "empty";
+  aops.push_back(empty_aop);
+
+  ApplyOrderCostModel model;
+  model.src_seek_cost = 1.0;
+  model.dst_seek_cost = 0.5;
+  model.readahead_blocks = 0;
+
+  // The source blocks 100 and 101 are read one after the other.
+  ABGenerator::OrderOperationsForApply(model, &aops);
+  ASSERT_EQ(4U, aops.size());
+  EXPECT_EQ("10", aops[0].name);
+  EXPECT_EQ("0", aops[1].name);
+  EXPECT_EQ("20", aops[2].name);
+  EXPECT_EQ("empty", aops[3].name);
+}
+
+TEST_F(ABGeneratorTest, ApplyOrderStorageClassTest) {
+  ApplyOrderCostModel model;
+  EXPECT_FALSE(model.enabled);
+  EXPECT_FALSE(model.SetStorageClass("floppy"));
+  EXPECT_FALSE(model.enabled);
+  EXPECT_TRUE(model.SetStorageClass("emmc"));
+  EXPECT_TRUE(model.enabled);
+
+  // Short jumps forward are covered by the readahead.
+  EXPECT_EQ(0, model.JumpCost(10, 10, 1.0));
+  EXPECT_EQ(0, model.JumpCost(10, 10 + model.readahead_blocks, 1.0));
+  EXPECT_EQ(1.0, model.JumpCost(10, 11 + model.readahead_blocks, 1.0));
+  EXPECT_EQ(1.0, model.JumpCost(10, 9, 1.0));
+}
+
 TEST_F(ABGeneratorTest, MergeSourceCopyOperationsTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
@@ -478,7 +580,8 @@ TEST_F(ABGeneratorTest, MergeSourceCopyOperationsTest) {
   third_aop.name = "3";
   aops.push_back(third_aop);
 
-  BlobFileWriter blob_file(0, nullptr);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file(0, &blob_file_size);
   PayloadVersion version(kChromeOSMajorPayloadVersion,
                          kSourceMinorPayloadVersion);
   EXPECT_TRUE(ABGenerator::MergeOperations(&aops, version, 5, "", &blob_file));
@@ -551,7 +654,8 @@ TEST_F(ABGeneratorTest, NoMergeOperationsTest) {
   fourth_aop.op = fourth_op;
   aops.push_back(fourth_aop);
 
-  BlobFileWriter blob_file(0, nullptr);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file(0, &blob_file_size);
   PayloadVersion version(kChromeOSMajorPayloadVersion,
                          kSourceMinorPayloadVersion);
   EXPECT_TRUE(ABGenerator::MergeOperations(&aops, version, 4, "", &blob_file));
@@ -576,6 +680,13 @@ TEST_F(ABGeneratorTest, AddSourceHashTest) {
   second_aop.op = second_op;
   aops.push_back(second_aop);
 
+  // The source hash computed when the operation was generated is kept.
+  InstallOperation third_op = first_op;
+  third_op.set_src_sha256_hash("precomputed");
+  AnnotatedOperation third_aop;
+  third_aop.op = third_op;
+  aops.push_back(third_aop);
+
   string src_part_path;
   EXPECT_TRUE(utils::MakeTempFile("AddSourceHashTest_src_part.XXXXXX",
                                   &src_part_path, nullptr));
@@ -594,6 +705,7 @@ TEST_F(ABGeneratorTest, AddSourceHashTest) {
   brillo::Blob result_hash(aops[0].op.src_sha256_hash().begin(),
                            aops[0].op.src_sha256_hash().end());
   EXPECT_EQ(expected_hash, result_hash);
+  EXPECT_EQ("precomputed", aops[2].op.src_sha256_hash());
 }
 
 }  // namespace chromeos_update_engine
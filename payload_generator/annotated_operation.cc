@@ -20,8 +20,10 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/stringprintf.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/zstd.h"
 
 namespace chromeos_update_engine {
 
@@ -41,12 +43,24 @@ bool AnnotatedOperation::SetOperationBlob(const brillo::Blob& blob,
   if (blob.empty()) {
     op.clear_data_offset();
     op.clear_data_length();
+    op.clear_data_sha256_hash();
     return true;
   }
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(blob, &hash));
   off_t data_offset = blob_file->StoreBlob(blob);
   TEST_AND_RETURN_FALSE(data_offset != -1);
   op.set_data_offset(data_offset);
   op.set_data_length(blob.size());
+  op.set_data_sha256_hash(hash.data(), hash.size());
+  // The zstd frames compressed against the dictionary of the payload record
+  // its id, the client needs to know it before decompressing them.
+  if (op.type() == InstallOperation::REPLACE_ZSTD &&
+      ZstdFrameDictionaryId(blob) != 0) {
+    op.set_zstd_dictionary(true);
+  } else {
+    op.clear_zstd_dictionary();
+  }
   return true;
 }
 
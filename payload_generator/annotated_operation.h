@@ -28,6 +28,22 @@
 namespace chromeos_update_engine {
 
 struct AnnotatedOperation {
+  AnnotatedOperation() = default;
+  AnnotatedOperation(const AnnotatedOperation&) = default;
+  AnnotatedOperation& operator=(const AnnotatedOperation&) = default;
+
+  // The protobuf messages can't be moved, so the moves swap the operation
+  // instead of copying it with all its extents.
+  AnnotatedOperation(AnnotatedOperation&& other) noexcept {
+    name.swap(other.name);
+    op.Swap(&other.op);
+  }
+  AnnotatedOperation& operator=(AnnotatedOperation&& other) noexcept {
+    name.swap(other.name);
+    op.Swap(&other.op);
+    return *this;
+  }
+
   // The name given to the operation, for logging and debugging purposes only.
   // This normally includes the path to the file and the chunk used, if any.
   std::string name;
@@ -37,7 +53,8 @@ struct AnnotatedOperation {
 
   // Writes |blob| to the end of |blob_file|. It sets the data_offset and
   // data_length in AnnotatedOperation to match the offset and size of |blob|
-  // in |blob_file|.
+  // in |blob_file|, and the data_sha256_hash to the hash of |blob|, so the
+  // blob doesn't need to be read back to hash it.
   bool SetOperationBlob(const brillo::Blob& blob, BlobFileWriter* blob_file);
 };
 
@@ -0,0 +1,276 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/apply_report.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the buffers the compressed REPLACE operations decompress into,
+// the same used by DeltaPerformer.
+const uint64_t kDecompressionBufferSize = 1024 * 1024;
+
+// The least target data an operation type must have written in the stats to
+// calibrate its coefficients.
+const uint64_t kMinCalibrationBytes = 1024 * 1024;
+
+const double kMiB = 1024 * 1024;
+
+// Returns the estimate of applying the single |op|. The bytes are counted as
+// OperationStats counts them, so the calibrated coefficients apply.
+ApplyEstimate EstimateOperation(const InstallOperation& op,
+                                uint32_t block_size,
+                                const OperationCostModel& model) {
+  ApplyEstimate estimate;
+  estimate.num_operations = 1;
+  estimate.blob_bytes = op.data_length();
+  estimate.read_bytes =
+      OperationStats::BytesRead(op, block_size) - op.data_length();
+  estimate.written_bytes = OperationStats::BytesWritten(op, block_size);
+  estimate.seconds = model.ApplySeconds(
+      op.type(), estimate.read_bytes, estimate.written_bytes);
+  estimate.peak_memory_bytes = op.data_length();
+  switch (op.type()) {
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      estimate.peak_memory_bytes += kDecompressionBufferSize;
+      break;
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::IMGDIFF:
+      estimate.peak_memory_bytes +=
+          estimate.read_bytes + estimate.written_bytes;
+      break;
+    default:
+      break;
+  }
+  return estimate;
+}
+
+void AddOperations(
+    const string& partition,
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    uint32_t block_size,
+    const OperationCostModel& model,
+    ApplyReport* report) {
+  for (InstallOperation op : operations) {
+    // The estimates need the extents, which the newer payloads pack.
+    if (!UnpackOperationExtents(&op))
+      LOG(WARNING) << "Invalid packed extents in partition " << partition;
+    ApplyEstimate estimate = EstimateOperation(op, block_size, model);
+    report->by_partition[partition].Add(estimate);
+    report->by_type[op.type()].Add(estimate);
+    report->total.Add(estimate);
+  }
+}
+
+// Appends the line of the |estimate| named |name| to |out|.
+void AppendEstimate(const string& name,
+                    const ApplyEstimate& estimate,
+                    string* out) {
+  base::StringAppendF(
+      out,
+      "  %s: %" PRIu64 " ops, %.3fs, %" PRIu64 " blob bytes, %" PRIu64
+      " bytes read, %" PRIu64 " bytes written, %" PRIu64 " bytes peak\n",
+      name.c_str(),
+      estimate.num_operations,
+      estimate.seconds,
+      estimate.blob_bytes,
+      estimate.read_bytes,
+      estimate.written_bytes,
+      estimate.peak_memory_bytes);
+}
+
+// Returns the CPU coefficient of the |type| in the |model|, or null if the
+// type has no CPU cost.
+double* CpuCoefficient(InstallOperation_Type type, OperationCostModel* model) {
+  switch (type) {
+    case InstallOperation::REPLACE:
+      return &model->replace_seconds_per_mib;
+    case InstallOperation::REPLACE_BZ:
+      return &model->replace_bz_seconds_per_mib;
+    case InstallOperation::REPLACE_XZ:
+      return &model->replace_xz_seconds_per_mib;
+    case InstallOperation::REPLACE_ZSTD:
+      return &model->replace_zstd_seconds_per_mib;
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+      return &model->bsdiff_seconds_per_mib;
+    case InstallOperation::IMGDIFF:
+      return &model->imgdiff_seconds_per_mib;
+    default:
+      return nullptr;
+  }
+}
+
+// The totals of an operation type parsed from the OperationStats report.
+struct MeasuredTotals {
+  double wall_seconds{0};
+  double cpu_seconds{0};
+  uint64_t bytes_read{0};
+  uint64_t bytes_written{0};
+};
+
+}  // namespace
+
+void ApplyEstimate::Add(const ApplyEstimate& other) {
+  num_operations += other.num_operations;
+  blob_bytes += other.blob_bytes;
+  read_bytes += other.read_bytes;
+  written_bytes += other.written_bytes;
+  seconds += other.seconds;
+  peak_memory_bytes = std::max(peak_memory_bytes, other.peak_memory_bytes);
+}
+
+string ApplyReport::ToString() const {
+  string out = "Estimated apply time by type:\n";
+  for (const auto& type_estimate : by_type) {
+    AppendEstimate(InstallOperationTypeName(type_estimate.first),
+                   type_estimate.second,
+                   &out);
+  }
+  out += "Estimated apply time by partition:\n";
+  for (const auto& partition_estimate : by_partition)
+    AppendEstimate(partition_estimate.first, partition_estimate.second, &out);
+  out += "Estimated apply time of the payload:\n";
+  AppendEstimate("total", total, &out);
+  return out;
+}
+
+bool EstimatePayloadApply(const DeltaArchiveManifest& manifest,
+                          uint64_t major_version,
+                          const OperationCostModel& model,
+                          ApplyReport* report) {
+  TEST_AND_RETURN_FALSE(manifest.block_size() > 0);
+  *report = ApplyReport();
+  if (major_version == kChromeOSMajorPayloadVersion) {
+    AddOperations(kLegacyPartitionNameRoot,
+                  manifest.install_operations(),
+                  manifest.block_size(),
+                  model,
+                  report);
+    AddOperations(kLegacyPartitionNameKernel,
+                  manifest.kernel_install_operations(),
+                  manifest.block_size(),
+                  model,
+                  report);
+  } else {
+    for (const PartitionUpdate& partition : manifest.partitions()) {
+      AddOperations(partition.partition_name(),
+                    partition.operations(),
+                    manifest.block_size(),
+                    model,
+                    report);
+    }
+  }
+  return true;
+}
+
+bool CalibrateCostModel(const string& stats_report,
+                        OperationCostModel* model) {
+  // Only the lines of the section by type are parsed.
+  std::map<InstallOperation_Type, MeasuredTotals> measured;
+  bool in_types = false;
+  for (const string& line : base::SplitString(
+           stats_report, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    if (line.empty() || line[0] != ' ') {
+      in_types = line == "Install operations by type:";
+      continue;
+    }
+    if (!in_types)
+      continue;
+    char name[64];
+    uint64_t num_operations;
+    MeasuredTotals totals;
+    if (sscanf(line.c_str(),
+               " %63[^:]: %" SCNu64 " ops, %lfs wall, %lfs CPU, %" SCNu64
+               " bytes read, %" SCNu64 " bytes written",
+               name,
+               &num_operations,
+               &totals.wall_seconds,
+               &totals.cpu_seconds,
+               &totals.bytes_read,
+               &totals.bytes_written) != 6) {
+      LOG(WARNING) << "Ignoring the operation stats line: " << line;
+      continue;
+    }
+    for (int type = InstallOperation_Type_Type_MIN;
+         type <= InstallOperation_Type_Type_MAX;
+         type++) {
+      if (InstallOperation_Type_IsValid(type) &&
+          strcmp(name,
+                 InstallOperationTypeName(
+                     static_cast<InstallOperation_Type>(type))) == 0) {
+        measured[static_cast<InstallOperation_Type>(type)] = totals;
+      }
+    }
+  }
+
+  bool calibrated = false;
+  // The time a REPLACE doesn't spend in the CPU is spent writing, and the
+  // time a SOURCE_COPY doesn't spend writing is spent reading.
+  auto replace = measured.find(InstallOperation::REPLACE);
+  if (replace != measured.end() &&
+      replace->second.bytes_written >= kMinCalibrationBytes) {
+    const MeasuredTotals& totals = replace->second;
+    model->write_seconds_per_mib =
+        std::max(totals.wall_seconds - totals.cpu_seconds, 0.0) /
+        (totals.bytes_written / kMiB);
+    calibrated = true;
+  }
+  auto copy = measured.find(InstallOperation::SOURCE_COPY);
+  if (copy != measured.end() &&
+      copy->second.bytes_read >= kMinCalibrationBytes) {
+    const MeasuredTotals& totals = copy->second;
+    const double write_seconds =
+        model->write_seconds_per_mib * totals.bytes_written / kMiB;
+    model->read_seconds_per_mib =
+        std::max(totals.wall_seconds - write_seconds, 0.0) /
+        (totals.bytes_read / kMiB);
+    calibrated = true;
+  }
+  for (const auto& type_totals : measured) {
+    const MeasuredTotals& totals = type_totals.second;
+    double* coefficient = CpuCoefficient(type_totals.first, model);
+    if (!coefficient || totals.bytes_written < kMinCalibrationBytes)
+      continue;
+    *coefficient = totals.cpu_seconds / (totals.bytes_written / kMiB);
+    calibrated = true;
+  }
+  return calibrated;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_REPORT_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_REPORT_H_
+
+#include <map>
+#include <string>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+// Estimates the time and memory the devices need to apply a payload from its
+// manifest alone, with the OperationCostModel of the target device class,
+// optionally calibrated with the OperationStats measured by DeltaPerformer.
+
+namespace chromeos_update_engine {
+
+// The estimated cost of applying a group of operations.
+struct ApplyEstimate {
+  void Add(const ApplyEstimate& other);
+
+  uint64_t num_operations{0};
+  // The bytes of payload data, of source partition read and of target
+  // partition written by the operations.
+  uint64_t blob_bytes{0};
+  uint64_t read_bytes{0};
+  uint64_t written_bytes{0};
+  // The estimated seconds spent applying them.
+  double seconds{0};
+  // The largest memory estimated to be used to apply one of them: its blob,
+  // the decompression buffer and, for the diff operations, the source and
+  // target data they patch in memory.
+  uint64_t peak_memory_bytes{0};
+};
+
+// The estimates of a whole payload.
+struct ApplyReport {
+  std::map<std::string, ApplyEstimate> by_partition;
+  std::map<InstallOperation_Type, ApplyEstimate> by_type;
+  ApplyEstimate total;
+
+  // Returns a multi-line human readable report of the estimates.
+  std::string ToString() const;
+};
+
+// Estimates in |report| the cost of applying the operations in |manifest|, of
+// a payload with |major_version|, with the |model|. Returns false on failure.
+bool EstimatePayloadApply(const DeltaArchiveManifest& manifest,
+                          uint64_t major_version,
+                          const OperationCostModel& model,
+                          ApplyReport* report);
+
+// Sets the coefficients of the |model| from the |stats_report| printed by
+// OperationStats::ToString() on a device applying a payload, for the
+// operation types with enough data measured. Returns whether any coefficient
+// was calibrated.
+bool CalibrateCostModel(const std::string& stats_report,
+                        OperationCostModel* model);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_REPORT_H_
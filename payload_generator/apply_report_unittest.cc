@@ -0,0 +1,145 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/apply_report.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kBlockSize = 4096;
+
+void AddOperation(PartitionUpdate* partition,
+                  InstallOperation_Type type,
+                  uint64_t src_blocks,
+                  uint64_t dst_blocks,
+                  uint64_t data_length) {
+  InstallOperation* op = partition->add_operations();
+  op->set_type(type);
+  op->set_data_length(data_length);
+  if (src_blocks) {
+    Extent* extent = op->add_src_extents();
+    extent->set_start_block(0);
+    extent->set_num_blocks(src_blocks);
+  }
+  Extent* extent = op->add_dst_extents();
+  extent->set_start_block(0);
+  extent->set_num_blocks(dst_blocks);
+}
+
+}  // namespace
+
+class ApplyReportTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    manifest_.set_block_size(kBlockSize);
+    PartitionUpdate* system = manifest_.add_partitions();
+    system->set_partition_name("system");
+    AddOperation(system, InstallOperation::REPLACE_XZ, 0, 256, 100000);
+    AddOperation(system, InstallOperation::SOURCE_COPY, 512, 512, 0);
+    PartitionUpdate* boot = manifest_.add_partitions();
+    boot->set_partition_name("boot");
+    AddOperation(boot, InstallOperation::SOURCE_BSDIFF, 256, 256, 5000);
+  }
+
+  DeltaArchiveManifest manifest_;
+  OperationCostModel model_;
+};
+
+TEST_F(ApplyReportTest, EstimatePayloadApplyTest) {
+  ApplyReport report;
+  EXPECT_TRUE(EstimatePayloadApply(
+      manifest_, kBrilloMajorPayloadVersion, model_, &report));
+
+  EXPECT_EQ(3U, report.total.num_operations);
+  EXPECT_EQ(105000U, report.total.blob_bytes);
+  EXPECT_EQ(768U * kBlockSize, report.total.read_bytes);
+  EXPECT_EQ(1024U * kBlockSize, report.total.written_bytes);
+  // The bsdiff of 1 MiB into 1 MiB needs the most memory.
+  EXPECT_EQ(2U * 1024 * 1024 + 5000, report.total.peak_memory_bytes);
+
+  ASSERT_EQ(2U, report.by_partition.size());
+  EXPECT_EQ(2U, report.by_partition["system"].num_operations);
+  EXPECT_EQ(1024U * 1024 + 100000,
+            report.by_partition["system"].peak_memory_bytes);
+  EXPECT_EQ(1U, report.by_partition["boot"].num_operations);
+
+  const ApplyEstimate& xz = report.by_type[InstallOperation::REPLACE_XZ];
+  EXPECT_DOUBLE_EQ(
+      model_.ApplySeconds(InstallOperation::REPLACE_XZ, 0, 256 * kBlockSize),
+      xz.seconds);
+  EXPECT_DOUBLE_EQ(report.by_partition["system"].seconds +
+                       report.by_partition["boot"].seconds,
+                   report.total.seconds);
+
+  std::string text = report.ToString();
+  EXPECT_NE(std::string::npos, text.find("  REPLACE_XZ: 1 ops"));
+  EXPECT_NE(std::string::npos, text.find("  boot: 1 ops"));
+}
+
+TEST_F(ApplyReportTest, EstimateLegacyPayloadTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  InstallOperation* op = manifest.add_install_operations();
+  op->set_type(InstallOperation::REPLACE);
+  op->set_data_length(kBlockSize);
+  op->add_dst_extents()->set_num_blocks(1);
+  *manifest.add_kernel_install_operations() = *op;
+
+  ApplyReport report;
+  EXPECT_TRUE(EstimatePayloadApply(
+      manifest, kChromeOSMajorPayloadVersion, model_, &report));
+  EXPECT_EQ(2U, report.total.num_operations);
+  EXPECT_EQ(1U, report.by_partition[kLegacyPartitionNameRoot].num_operations);
+  EXPECT_EQ(1U,
+            report.by_partition[kLegacyPartitionNameKernel].num_operations);
+}
+
+TEST_F(ApplyReportTest, CalibrateCostModelTest) {
+  // 4 MiB written by each type.
+  const char kStats[] =
+      "Install operations by type:\n"
+      "  REPLACE: 4 ops, 0.500s wall, 0.100s CPU, 4194304 bytes read, "
+      "4194304 bytes written, 8.0 MiB/s\n"
+      "  SOURCE_COPY: 4 ops, 1.000s wall, 0.050s CPU, 4194304 bytes read, "
+      "4194304 bytes written, 4.0 MiB/s\n"
+      "  REPLACE_XZ: 4 ops, 2.000s wall, 1.600s CPU, 1000000 bytes read, "
+      "4194304 bytes written, 2.0 MiB/s\n"
+      "  BSDIFF: 1 ops, 0.010s wall, 0.010s CPU, 8192 bytes read, "
+      "4096 bytes written, 0.4 MiB/s\n"
+      "Install operations by partition:\n"
+      "  system: 13 ops, 3.510s wall, 1.760s CPU, 9396800 bytes read, "
+      "12587008 bytes written, 3.4 MiB/s\n"
+      "Checkpoints: 3 saved in 0.020s\n";
+  const double kDefaultBsdiff = model_.bsdiff_seconds_per_mib;
+
+  EXPECT_TRUE(CalibrateCostModel(kStats, &model_));
+  EXPECT_DOUBLE_EQ(0.1, model_.write_seconds_per_mib);
+  EXPECT_DOUBLE_EQ(0.15, model_.read_seconds_per_mib);
+  EXPECT_DOUBLE_EQ(0.025, model_.replace_seconds_per_mib);
+  EXPECT_DOUBLE_EQ(0.4, model_.replace_xz_seconds_per_mib);
+  // Too little data was measured for the bsdiff.
+  EXPECT_DOUBLE_EQ(kDefaultBsdiff, model_.bsdiff_seconds_per_mib);
+
+  EXPECT_FALSE(CalibrateCostModel("Install operations by type:\n", &model_));
+}
+
+}  // namespace chromeos_update_engine
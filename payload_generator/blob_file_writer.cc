@@ -16,17 +16,32 @@
 
 #include "update_engine/payload_generator/blob_file_writer.h"
 
+#include <algorithm>
+
+#include <base/logging.h>
+
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+BlobFileWriter::BlobFileWriter(int blob_fd, off_t* blob_file_size)
+    : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {
+  CHECK(blob_file_size_);
+  next_offset_ = *blob_file_size_;
+}
+
 off_t BlobFileWriter::StoreBlob(const brillo::Blob& blob) {
-  base::AutoLock auto_lock(blob_mutex_);
-  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), *blob_file_size_))
+  off_t result = next_offset_.fetch_add(blob.size());
+  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), result)) {
+    // The range stays reserved, leaving a hole in the blob file.
+    PLOG(ERROR) << "Unable to store the blob of " << blob.size()
+                << " bytes at offset " << result;
     return -1;
+  }
 
-  off_t result = *blob_file_size_;
-  *blob_file_size_ += blob.size();
+  base::AutoLock auto_lock(blob_mutex_);
+  *blob_file_size_ = std::max(*blob_file_size_,
+                              static_cast<off_t>(result + blob.size()));
 
   stored_blobs_++;
   if (total_blobs_ > 0 &&
@@ -17,8 +17,9 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 
-#include <base/macros.h>
+#include <atomic>
 
+#include <base/macros.h>
 #include <base/synchronization/lock.h>
 #include <brillo/secure_blob.h>
 
@@ -27,13 +28,15 @@ namespace chromeos_update_engine {
 class BlobFileWriter {
  public:
   // Create the BlobFileWriter object that will manage the blobs stored to
-  // |blob_fd| in a thread safe way.
-  BlobFileWriter(int blob_fd, off_t* blob_file_size)
-    : blob_fd_(blob_fd),
-      blob_file_size_(blob_file_size) {}
+  // |blob_fd| in a thread safe way. The blobs are appended after the
+  // |blob_file_size| bytes already in the file, which is updated as the blobs
+  // are stored.
+  BlobFileWriter(int blob_fd, off_t* blob_file_size);
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. The offset is reserved atomically
+  // and the blob is written without holding any lock, so several threads can
+  // store their blobs at the same time.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // The number of |total_blobs| is the number of blobs that will be stored but
@@ -45,10 +48,15 @@ class BlobFileWriter {
   size_t total_blobs_{0};
   size_t stored_blobs_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
+  // The size of the file is protected with the |blob_mutex_|. It ends with the
+  // last blob completely written, but while blobs are being stored, the blobs
+  // reserved before it may still be being written by other threads.
   int blob_fd_;
   off_t* blob_file_size_;
 
+  // The offset where the next blob will be stored.
+  std::atomic<off_t> next_offset_;
+
   base::Lock blob_mutex_;
 
   DISALLOW_COPY_AND_ASSIGN(BlobFileWriter);
@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -25,6 +27,7 @@
 
 using chromeos_update_engine::test_utils::FillWithData;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -56,4 +59,58 @@ TEST(BlobFileWriterTest, SimpleTest) {
   EXPECT_EQ(blob, stored_blob);
 }
 
+TEST(BlobFileWriterTest, StoreFailureTest) {
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file(-1, &blob_file_size);
+
+  brillo::Blob blob(1024);
+  EXPECT_EQ(-1, blob_file.StoreBlob(blob));
+  // The blobs that failed to be stored don't count in the size.
+  EXPECT_EQ(0, blob_file_size);
+}
+
+TEST(BlobFileWriterTest, ConcurrentStoresTest) {
+  string blob_path;
+  int blob_fd;
+  EXPECT_TRUE(utils::MakeTempFile("BlobFileWriterTest.XXXXXX",
+                                  &blob_path,
+                                  &blob_fd));
+  ScopedPathUnlinker blob_path_unlinker(blob_path);
+  ScopedFdCloser blob_fd_closer(&blob_fd);
+  // The blobs are appended after the data already in the file.
+  off_t blob_file_size = 10;
+  BlobFileWriter blob_file(blob_fd, &blob_file_size);
+
+  // Every thread stores blobs of a different size, filled with its index.
+  const size_t kNumThreads = 8;
+  const size_t kBlobsPerThread = 16;
+  vector<vector<off_t>> offsets(kNumThreads);
+  vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&blob_file, &offsets, i]() {
+      const brillo::Blob blob(100 + i, i);
+      for (size_t j = 0; j < kBlobsPerThread; j++)
+        offsets[i].push_back(blob_file.StoreBlob(blob));
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  off_t expected_size = 10;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    expected_size += kBlobsPerThread * (100 + i);
+    for (off_t offset : offsets[i]) {
+      brillo::Blob stored_blob(100 + i);
+      ssize_t bytes_read;
+      ASSERT_TRUE(utils::PReadAll(blob_fd,
+                                  stored_blob.data(),
+                                  stored_blob.size(),
+                                  offset,
+                                  &bytes_read));
+      EXPECT_EQ(brillo::Blob(100 + i, i), stored_blob);
+    }
+  }
+  EXPECT_EQ(expected_size, blob_file_size);
+}
+
 }  // namespace chromeos_update_engine
@@ -17,31 +17,136 @@
 #include "update_engine/payload_generator/block_mapping.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-#include <functional>
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include <base/threading/simple_thread.h>
+
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
 
 using std::string;
 using std::vector;
 
 namespace {
 
-size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+// The initial number of entries of the table, a power of two.
+const size_t kInitialTableSize = 1024;
+
+// The number of bytes read from disk at once when adding many disk blocks.
+const size_t kDiskReadSize = 1024 * 1024;  // 1 MiB
+
+// The minimum number of bytes hashed by each thread when adding many disk
+// blocks.
+const size_t kMinHashRangeSize = 16 * 1024 * 1024;  // 16 MiB
+
+// Returns the position in a table of |table_size| entries, a power of two,
+// where the lookup of |hash| starts. The SHA-256 is already uniformly
+// distributed so its first bytes are used.
+size_t TableIndex(const uint8_t* hash, size_t table_size) {
+  size_t index;
+  memcpy(&index, hash, sizeof(index));
+  return index & (table_size - 1);
 }
 
 }  // namespace
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// This class reads |num_blocks| blocks of |block_size| bytes from |fd| at
+// |byte_offset| and stores their SHA-256 hashes contiguously in |hashes|, from
+// a worker thread. When the image is mapped at |mapped_data|, the blocks are
+// hashed from there instead of read from |fd|.
+class BlockHasher : public base::DelegateSimpleThread::Delegate {
+ public:
+  BlockHasher(int fd,
+              const uint8_t* mapped_data,
+              off_t byte_offset,
+              size_t num_blocks,
+              size_t block_size,
+              uint8_t* hashes)
+      : fd_(fd),
+        mapped_data_(mapped_data),
+        byte_offset_(byte_offset),
+        num_blocks_(num_blocks),
+        block_size_(block_size),
+        hashes_(hashes) {}
+  BlockHasher(BlockHasher&&) = default;
+  ~BlockHasher() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override { success_ = HashBlocks(); }
+
+  bool success() const { return success_; }
+
+ private:
+  bool HashBlocks() {
+    // Read several blocks at once, instead of one read per block.
+    const size_t blocks_per_read =
+        std::max(kDiskReadSize / block_size_, static_cast<size_t>(1));
+    brillo::Blob buffer;
+    if (!mapped_data_)
+      buffer.resize(std::min(blocks_per_read, num_blocks_) * block_size_);
+    // The free space of the images is mostly zero blocks, whose hash is much
+    // slower to compute than to copy.
+    uint8_t zero_hash[SHA256_DIGEST_LENGTH];
+    brillo::Blob zero_block(block_size_, 0);
+    SHA256(zero_block.data(), block_size_, zero_hash);
+    for (size_t block = 0; block < num_blocks_; block += blocks_per_read) {
+      const size_t read_blocks = std::min(blocks_per_read, num_blocks_ - block);
+      const uint8_t* read_data;
+      if (mapped_data_) {
+        read_data = mapped_data_ + byte_offset_ + block * block_size_;
+      } else {
+        ssize_t bytes_read = 0;
+        TEST_AND_RETURN_FALSE(
+            utils::PReadAll(fd_,
+                            buffer.data(),
+                            read_blocks * block_size_,
+                            byte_offset_ + block * block_size_,
+                            &bytes_read));
+        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
+                              read_blocks * block_size_);
+        read_data = buffer.data();
+      }
+      for (size_t i = 0; i < read_blocks; i++) {
+        const uint8_t* block_data = read_data + i * block_size_;
+        uint8_t* hash = hashes_ + (block + i) * SHA256_DIGEST_LENGTH;
+        if (utils::IsZeroFilled(block_data, block_size_))
+          memcpy(hash, zero_hash, SHA256_DIGEST_LENGTH);
+        else
+          SHA256(block_data, block_size_, hash);
+      }
+    }
+    return true;
+  }
+
+  int fd_;
+  const uint8_t* mapped_data_;
+  off_t byte_offset_;
+  size_t num_blocks_;
+  size_t block_size_;
+  uint8_t* hashes_;
+
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(BlockHasher);
+};
+
+}  // namespace
+
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  if (block_data.size() != block_size_)
+    return -1;
+  return AddBlock(block_data.data());
 }
 
 BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
@@ -51,89 +156,132 @@ BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
     return -1;
   if (static_cast<size_t>(bytes_read) != block_size_)
     return -1;
-  return AddBlock(fd, byte_offset, blob);
+  return AddBlock(blob.data());
 }
 
 bool BlockMapping::AddManyDiskBlocks(int fd,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
-  bool ret = true;
+  return AddManyBlocks(fd, nullptr, initial_byte_offset, num_blocks, block_ids);
+}
+
+bool BlockMapping::AddManyImageBlocks(const MappedImage& image,
+                                      size_t num_blocks,
+                                      vector<BlockId>* block_ids) {
+  TEST_AND_RETURN_FALSE(image.Blocks(0, num_blocks, block_size_) != nullptr);
+  image.AdviseSequential(0, num_blocks * block_size_);
+  return AddManyBlocks(-1, image.data(), 0, num_blocks, block_ids);
+}
+
+bool BlockMapping::HashImageBlocks(const string& path,
+                                   size_t num_blocks,
+                                   vector<uint8_t>* hashes) const {
+  const MappedImage* image = MappedImage::Find(path);
+  if (image) {
+    TEST_AND_RETURN_FALSE(image->Blocks(0, num_blocks, block_size_) != nullptr);
+    image->AdviseSequential(0, num_blocks * block_size_);
+    return HashManyBlocks(-1, image->data(), 0, num_blocks, hashes);
+  }
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  ScopedFdCloser fd_closer(&fd);
+  return HashManyBlocks(fd, nullptr, 0, num_blocks, hashes);
+}
+
+bool BlockMapping::AddManyBlockHashes(const vector<uint8_t>& hashes,
+                                      vector<BlockId>* block_ids) {
+  TEST_AND_RETURN_FALSE(hashes.size() % SHA256_DIGEST_LENGTH == 0);
+  const size_t num_blocks = hashes.size() / SHA256_DIGEST_LENGTH;
   block_ids->resize(num_blocks);
   for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] = AddDiskBlock(
-        fd, initial_byte_offset + block * block_size_);
-    ret = ret && (*block_ids)[block] != -1;
+    (*block_ids)[block] =
+        AddBlockHash(hashes.data() + block * SHA256_DIGEST_LENGTH);
   }
-  return ret;
+  return true;
 }
 
-BlockMapping::BlockId BlockMapping::AddBlock(int fd,
-                                             off_t byte_offset,
-                                             const brillo::Blob& block_data) {
-  if (block_data.size() != block_size_)
-    return -1;
-  size_t h = HashValue(block_data);
-
-  // We either reuse a UniqueBlock or create a new one. If we need a new
-  // UniqueBlock it could also be part of a new or existing bucket (if there is
-  // a hash collision).
-  vector<UniqueBlock> *bucket = nullptr;
-
-  auto mapping_it = mapping_.find(h);
-  if (mapping_it == mapping_.end()) {
-    bucket = &mapping_[h];
-  } else {
-    for (UniqueBlock& existing_block : mapping_it->second) {
-      bool equals = false;
-      if (!existing_block.CompareData(block_data, &equals))
-        return -1;
-      if (equals)
-        return existing_block.block_id;
-    }
-    bucket = &mapping_it->second;
+bool BlockMapping::HashManyBlocks(int fd,
+                                  const uint8_t* mapped_data,
+                                  off_t initial_byte_offset,
+                                  size_t num_blocks,
+                                  vector<uint8_t>* hashes) const {
+  // Hash the blocks in parallel in contiguous ranges, one per thread. The
+  // hashes are added in order afterwards so the block ids don't depend on the
+  // threads.
+  const size_t max_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  const size_t min_range_blocks =
+      std::max(kMinHashRangeSize / block_size_, static_cast<size_t>(1));
+  const size_t range_blocks = std::max(
+      (num_blocks + max_threads - 1) / max_threads, min_range_blocks);
+  hashes->resize(num_blocks * SHA256_DIGEST_LENGTH);
+  vector<BlockHasher> hashers;
+  for (size_t block = 0; block < num_blocks; block += range_blocks) {
+    hashers.emplace_back(fd,
+                         mapped_data,
+                         initial_byte_offset + block * block_size_,
+                         std::min(range_blocks, num_blocks - block),
+                         block_size_,
+                         hashes->data() + block * SHA256_DIGEST_LENGTH);
   }
 
-  // No existing block was found at this point, so we create and fill in a new
-  // one.
-  bucket->emplace_back();
-  UniqueBlock *new_ublock = &bucket->back();
+  base::DelegateSimpleThreadPool thread_pool("block-hasher", max_threads);
+  thread_pool.Start();
+  for (BlockHasher& hasher : hashers)
+    thread_pool.AddWork(&hasher);
+  thread_pool.JoinAll();
 
-  new_ublock->times_read = 1;
-  new_ublock->fd = fd;
-  new_ublock->byte_offset = byte_offset;
-  new_ublock->block_id = used_block_ids++;
-  // We need to cache blocks that are not referencing any disk location.
-  if (fd == -1)
-    new_ublock->block_data = block_data;
+  for (const BlockHasher& hasher : hashers)
+    TEST_AND_RETURN_FALSE(hasher.success());
+  return true;
+}
 
-  return new_ublock->block_id;
+bool BlockMapping::AddManyBlocks(int fd,
+                                 const uint8_t* mapped_data,
+                                 off_t initial_byte_offset,
+                                 size_t num_blocks,
+                                 vector<BlockId>* block_ids) {
+  vector<uint8_t> hashes;
+  TEST_AND_RETURN_FALSE(HashManyBlocks(
+      fd, mapped_data, initial_byte_offset, num_blocks, &hashes));
+  return AddManyBlockHashes(hashes, block_ids);
 }
 
-bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
-                                            bool* equals) {
-  if (!block_data.empty()) {
-    *equals = block_data == other_block;
-    return true;
+BlockMapping::BlockId BlockMapping::AddBlock(const uint8_t* block_data) {
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(block_data, block_size_, hash);
+  return AddBlockHash(hash);
+}
+
+BlockMapping::BlockId BlockMapping::AddBlockHash(const uint8_t* hash) {
+  // Keep at most half of the entries in use, so the probe sequences are short.
+  if (2 * (used_block_ids + 1) > static_cast<BlockId>(table_.size()))
+    GrowTable();
+
+  size_t index = TableIndex(hash, table_.size());
+  while (table_[index].block_id != -1) {
+    if (memcmp(table_[index].hash, hash, SHA256_DIGEST_LENGTH) == 0)
+      return table_[index].block_id;
+    index = (index + 1) & (table_.size() - 1);
+  }
+
+  // No existing block was found at this point, so we fill in a new entry.
+  memcpy(table_[index].hash, hash, SHA256_DIGEST_LENGTH);
+  table_[index].block_id = used_block_ids++;
+  return table_[index].block_id;
+}
+
+void BlockMapping::GrowTable() {
+  vector<Entry> old_table;
+  old_table.swap(table_);
+  table_.resize(std::max(2 * old_table.size(), kInitialTableSize));
+  for (const Entry& entry : old_table) {
+    if (entry.block_id == -1)
+      continue;
+    size_t index = TableIndex(entry.hash, table_.size());
+    while (table_[index].block_id != -1)
+      index = (index + 1) & (table_.size() - 1);
+    table_[index] = entry;
   }
-  const size_t block_size = other_block.size();
-  brillo::Blob blob(block_size);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
-    return false;
-  if (static_cast<size_t>(bytes_read) != block_size)
-    return false;
-  *equals = blob == other_block;
-
-  // We increase the number of times we had to read this block from disk and
-  // we cache this block based on that. This caching method is optimized for
-  // the common use case of having two partitions that share blocks between them
-  // but have few repeated blocks inside each partition, such as the block
-  // with all zeros or duplicated files.
-  times_read++;
-  if (times_read > 3)
-    block_data = std::move(blob);
-  return true;
 }
 
 bool MapPartitionBlocks(const string& old_part,
@@ -141,20 +289,28 @@ bool MapPartitionBlocks(const string& old_part,
                         size_t old_size,
                         size_t new_size,
                         size_t block_size,
+                        ImageIndexCache* image_index_cache,
                         vector<BlockMapping::BlockId>* old_block_ids,
                         vector<BlockMapping::BlockId>* new_block_ids) {
+  ScopedProfilePhase profile_phase("MapPartitionBlocks", old_size + new_size);
   BlockMapping mapping(block_size);
   if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
     return false;
-  int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
-  int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
-  ScopedFdCloser new_fd_closer(&new_fd);
-
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+  // The images already hashed by a previous payload aren't read again.
+  auto add_part_blocks = [&mapping, block_size, image_index_cache](
+      const string& part, size_t size, vector<BlockMapping::BlockId>* ids) {
+    const size_t num_blocks = size / block_size;
+    vector<uint8_t> hashes;
+    if (!image_index_cache || !image_index_cache->LookupBlockHashes(
+                                  part, block_size, num_blocks, &hashes)) {
+      TEST_AND_RETURN_FALSE(mapping.HashImageBlocks(part, num_blocks, &hashes));
+      if (image_index_cache)
+        image_index_cache->StoreBlockHashes(part, block_size, hashes);
+    }
+    return mapping.AddManyBlockHashes(hashes, ids);
+  };
+  TEST_AND_RETURN_FALSE(add_part_blocks(old_part, old_size, old_block_ids));
+  TEST_AND_RETURN_FALSE(add_part_blocks(new_part, new_size, new_block_ids));
   return true;
 }
 
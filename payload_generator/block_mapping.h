@@ -17,13 +17,16 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 
-#include <map>
+#include <openssl/sha.h>
+
 #include <string>
 #include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/payload_generator/image_index_cache.h"
+#include "update_engine/payload_generator/mapped_image.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
@@ -33,6 +36,9 @@ namespace chromeos_update_engine {
 // hash function in that two blocks with the same data will have the same id but
 // also two blocks with the same id will have the same data. This is only valid
 // in the context of the same BlockMapping instance.
+// The blocks are identified by their SHA-256 hash, kept in a flat open
+// addressing table, so neither the block data nor its location on disk is
+// kept.
 class BlockMapping {
  public:
   using BlockId = int64_t;
@@ -44,53 +50,80 @@ class BlockMapping {
   BlockId AddBlock(const brillo::Blob& block_data);
 
   // Add a block from disk reading it from the file descriptor |fd| from the
-  // offset in bytes |byte_offset|. The data block may or may not be cached, so
-  // the file descriptor must be available until the BlockMapping is destroyed.
-  // Returns the unique block id of the added block or -1 in case of error.
+  // offset in bytes |byte_offset|. Returns the unique block id of the added
+  // block or -1 in case of error.
   BlockId AddDiskBlock(int fd, off_t byte_offset);
 
   // This is a helper method to add |num_blocks| contiguous blocks reading them
   // from the file descriptor |fd| starting at offset |initial_byte_offset|.
+  // The blocks are read and hashed from several threads, but the block ids are
+  // assigned in order, the same as adding the blocks one by one.
   // Returns whether it succeeded to add all the disk blocks and stores in
   // |block_ids| the block id for each one of the added blocks.
   bool AddManyDiskBlocks(int fd, off_t initial_byte_offset, size_t num_blocks,
                          std::vector<BlockId>* block_ids);
 
- private:
-  FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
+  // Same as AddManyDiskBlocks() for the first |num_blocks| blocks of the
+  // mapped |image|, hashed without copying them.
+  bool AddManyImageBlocks(const MappedImage& image,
+                          size_t num_blocks,
+                          std::vector<BlockId>* block_ids);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  // Stores in |hashes| the SHA-256 hashes of the first |num_blocks| blocks of
+  // the image at |path|, contiguously. The blocks are hashed from the mapping
+  // of the image if it is mapped, or read from the file otherwise.
+  bool HashImageBlocks(const std::string& path,
+                       size_t num_blocks,
+                       std::vector<uint8_t>* hashes) const;
 
-  size_t block_size_;
+  // Adds the blocks with the contiguous SHA-256 |hashes|, in order, and
+  // stores in |block_ids| the block id for each one of them.
+  bool AddManyBlockHashes(const std::vector<uint8_t>& hashes,
+                          std::vector<BlockId>* block_ids);
 
-  BlockId used_block_ids{0};
+ private:
+  // Stores in |hashes| the hashes of the |num_blocks| blocks starting at
+  // |initial_byte_offset|, read from |fd| or from the |mapped_data| of the
+  // image when not null.
+  bool HashManyBlocks(int fd,
+                      const uint8_t* mapped_data,
+                      off_t initial_byte_offset,
+                      size_t num_blocks,
+                      std::vector<uint8_t>* hashes) const;
+
+  // Adds the |num_blocks| blocks starting at |initial_byte_offset|, read from
+  // |fd| or from the |mapped_data| of the image when not null.
+  bool AddManyBlocks(int fd,
+                     const uint8_t* mapped_data,
+                     off_t initial_byte_offset,
+                     size_t num_blocks,
+                     std::vector<BlockId>* block_ids);
 
-  // The UniqueBlock represents the data of a block associated to a unique
-  // block id.
-  struct UniqueBlock {
-    brillo::Blob block_data;
+  FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
 
-    // The block id assigned to this unique block.
-    BlockId block_id;
+  // An entry of the table: the hash of a unique block and its block id, or -1
+  // if the entry is empty.
+  struct Entry {
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    BlockId block_id{-1};
+  };
 
-    // The location on this unique block on disk (if not cached in block_data).
-    int fd{-1};
-    off_t byte_offset{0};
+  // Add the block of |block_size_| bytes at |block_data|.
+  BlockId AddBlock(const uint8_t* block_data);
 
-    // Number of times we have seen this data block. Used for caching.
-    uint32_t times_read{0};
+  // Add the block with the SHA-256 |hash|.
+  BlockId AddBlockHash(const uint8_t* hash);
 
-    // Compares the UniqueBlock data with the other_block data and stores if
-    // they are equal in |equals|. Returns whether there was an error reading
-    // the block from disk while comparing it.
-    bool CompareData(const brillo::Blob& other_block, bool* equals);
-  };
+  // Doubles the size of |table_|, moving all the entries to the new table.
+  void GrowTable();
+
+  size_t block_size_;
+
+  BlockId used_block_ids{0};
 
-  // A mapping from hash values to possible block ids.
-  std::map<size_t, std::vector<UniqueBlock>> mapping_;
+  // The table of unique blocks, with linear probing. Its size is a power of two
+  // and at most half of its entries are used.
+  std::vector<Entry> table_;
 };
 
 // Maps the blocks of the old and new partitions |old_part| and |new_part| whose
@@ -99,11 +132,14 @@ class BlockMapping {
 // the partition they are on.
 // The block ids number 0 corresponds to the block with all zeros, but any
 // other block id number is assigned randomly.
+// The hashes of the blocks are looked up in the |image_index_cache| and stored
+// there after hashing the images, when it isn't null.
 bool MapPartitionBlocks(const std::string& old_part,
                         const std::string& new_part,
                         size_t old_size,
                         size_t new_size,
                         size_t block_size,
+                        ImageIndexCache* image_index_cache,
                         std::vector<BlockMapping::BlockId>* old_block_ids,
                         std::vector<BlockMapping::BlockId>* new_block_ids);
 
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -77,28 +78,34 @@ TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
   ScopedFdCloser old_fd_closer(&old_fd);
 
   EXPECT_EQ(0, bm_.AddDiskBlock(old_fd, 0));
-
-  // Check that the block_data is not stored on memory if we just used the block
-  // once.
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_TRUE(ublock.block_data.empty());
-    }
-  }
+  // Only the hash of the block is kept, so the file isn't needed anymore.
+  EXPECT_EQ(0, IGNORE_EINTR(close(old_fd)));
+  old_fd = -1;
 
   brillo::Blob block(block_size_, 'a');
   for (int i = 0; i < 5; ++i) {
     // Re-add the same block 5 times.
     EXPECT_EQ(0, bm_.AddBlock(block));
   }
+  EXPECT_EQ(1, bm_.used_block_ids);
+  EXPECT_EQ(1U, std::count_if(bm_.table_.begin(),
+                              bm_.table_.end(),
+                              [](const BlockMapping::Entry& entry) {
+                                return entry.block_id != -1;
+                              }));
+}
 
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_FALSE(ublock.block_data.empty());
-      // The block was loaded from disk only 4 times, and after that the counter
-      // is not updated anymore.
-      EXPECT_EQ(4U, ublock.times_read);
-    }
+TEST_F(BlockMappingTest, ManyUniqueBlocks) {
+  // Add enough different blocks to grow the table several times.
+  const int kNumBlocks = 10000;
+  brillo::Blob block(block_size_, 0);
+  for (int i = 0; i < kNumBlocks; ++i) {
+    memcpy(block.data(), &i, sizeof(i));
+    EXPECT_EQ(i, bm_.AddBlock(block));
+  }
+  for (int i = kNumBlocks - 1; i >= 0; --i) {
+    memcpy(block.data(), &i, sizeof(i));
+    EXPECT_EQ(i, bm_.AddBlock(block));
   }
 }
 
@@ -122,6 +129,7 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
                                  old_contents.size(),
                                  new_contents.size(),
                                  block_size_,
+                                 nullptr,  // image_index_cache
                                  &old_ids,
                                  &new_ids));
 
@@ -0,0 +1,416 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/bsdiff_generator.h"
+
+#include <bzlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bzip.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+// This is the algorithm of the bsdiff program by Colin Percival: the suffixes
+// of the old data are sorted with qsufsort (Larsson and Sadakane) and each
+// approximate match of the new data is emitted as a control tuple, with the
+// byte-wise difference in the diff block and the unmatched bytes in the extra
+// block.
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kBsdiffMagic[] = "BSDIFF40";
+const size_t kBsdiffMagicSize = 8;
+
+// Encodes |value| in the sign-magnitude little endian format used by bsdiff.
+void AppendBsdiffInt64(int64_t value, brillo::Blob* out) {
+  uint64_t magnitude = value < 0 ? -value : value;
+  for (int i = 0; i < 8; i++) {
+    out->push_back(magnitude & 0xff);
+    magnitude >>= 8;
+  }
+  if (value < 0)
+    out->back() |= 0x80;
+}
+
+// Compresses one of the patch blocks. Unlike BzipCompress(), an empty |in|
+// results in an empty bzip2 stream, which the bspatch program expects.
+bool CompressBsdiffBlock(const brillo::Blob& in, brillo::Blob* out) {
+  if (!in.empty())
+    return BzipCompress(in, out);
+  // An empty stream is only the stream header and footer.
+  char buf[64];
+  unsigned int buf_size = sizeof(buf);
+  char empty = 0;
+  TEST_AND_RETURN_FALSE(
+      BZ2_bzBuffToBuffCompress(buf, &buf_size, &empty, 0, 9, 0, 0) == BZ_OK);
+  out->assign(buf, buf + buf_size);
+  return true;
+}
+
+// Sorts the groups of |len| suffixes starting at |start| in |I| with the same
+// |h| first bytes by the rank of the next |h| bytes in |V|.
+void Split(int64_t* I, int64_t* V, int64_t start, int64_t len, int64_t h) {
+  int64_t i, j, k, x;
+
+  if (len < 16) {
+    for (k = start; k < start + len; k += j) {
+      j = 1;
+      x = V[I[k] + h];
+      for (i = 1; k + i < start + len; i++) {
+        if (V[I[k + i] + h] < x) {
+          x = V[I[k + i] + h];
+          j = 0;
+        }
+        if (V[I[k + i] + h] == x) {
+          std::swap(I[k + j], I[k + i]);
+          j++;
+        }
+      }
+      for (i = 0; i < j; i++)
+        V[I[k + i]] = k + j - 1;
+      if (j == 1)
+        I[k] = -1;
+    }
+    return;
+  }
+
+  x = V[I[start + len / 2] + h];
+  int64_t jj = 0, kk = 0;
+  for (i = start; i < start + len; i++) {
+    if (V[I[i] + h] < x)
+      jj++;
+    if (V[I[i] + h] == x)
+      kk++;
+  }
+  jj += start;
+  kk += jj;
+
+  i = start;
+  j = 0;
+  k = 0;
+  while (i < jj) {
+    if (V[I[i] + h] < x) {
+      i++;
+    } else if (V[I[i] + h] == x) {
+      std::swap(I[i], I[jj + j]);
+      j++;
+    } else {
+      std::swap(I[i], I[kk + k]);
+      k++;
+    }
+  }
+  while (jj + j < kk) {
+    if (V[I[jj + j] + h] == x) {
+      j++;
+    } else {
+      std::swap(I[jj + j], I[kk + k]);
+      k++;
+    }
+  }
+
+  if (jj > start)
+    Split(I, V, start, jj - start, h);
+
+  for (i = 0; i < kk - jj; i++)
+    V[I[jj + i]] = kk - 1;
+  if (jj == kk - 1)
+    I[jj] = -1;
+
+  if (start + len > kk)
+    Split(I, V, kk, start + len - kk, h);
+}
+
+// Stores in |I| the suffix array of the |old_size| bytes of |old_data|,
+// including the empty suffix. |V| is used as scratch space. Both must have
+// room for |old_size| + 1 elements.
+void SortSuffixes(int64_t* I,
+                  int64_t* V,
+                  const uint8_t* old_data,
+                  int64_t old_size) {
+  int64_t buckets[256] = {};
+  int64_t i, h, len;
+
+  for (i = 0; i < old_size; i++)
+    buckets[old_data[i]]++;
+  for (i = 1; i < 256; i++)
+    buckets[i] += buckets[i - 1];
+  for (i = 255; i > 0; i--)
+    buckets[i] = buckets[i - 1];
+  buckets[0] = 0;
+
+  for (i = 0; i < old_size; i++)
+    I[++buckets[old_data[i]]] = i;
+  I[0] = old_size;
+  for (i = 0; i < old_size; i++)
+    V[i] = buckets[old_data[i]];
+  V[old_size] = 0;
+  for (i = 1; i < 256; i++) {
+    if (buckets[i] == buckets[i - 1] + 1)
+      I[buckets[i]] = -1;
+  }
+  I[0] = -1;
+
+  for (h = 1; I[0] != -(old_size + 1); h += h) {
+    len = 0;
+    for (i = 0; i < old_size + 1;) {
+      if (I[i] < 0) {
+        len -= I[i];
+        i -= I[i];
+      } else {
+        if (len)
+          I[i - len] = -len;
+        len = V[I[i]] + 1 - i;
+        Split(I, V, i, len, h);
+        i += len;
+        len = 0;
+      }
+    }
+    if (len)
+      I[i - len] = -len;
+  }
+
+  for (i = 0; i < old_size + 1; i++)
+    I[V[i]] = i;
+}
+
+// Returns the length of the common prefix of |a| and |b|.
+int64_t MatchLength(const uint8_t* a,
+                    int64_t a_size,
+                    const uint8_t* b,
+                    int64_t b_size) {
+  int64_t i;
+  for (i = 0; i < a_size && i < b_size; i++) {
+    if (a[i] != b[i])
+      break;
+  }
+  return i;
+}
+
+// Searches the suffixes |I|[|st|..|en|] of |old_data| for the longest prefix
+// of |new_data|. Stores its position in the old data in |pos| and returns its
+// length.
+int64_t Search(const int64_t* I,
+               const uint8_t* old_data,
+               int64_t old_size,
+               const uint8_t* new_data,
+               int64_t new_size,
+               int64_t st,
+               int64_t en,
+               int64_t* pos) {
+  while (en - st >= 2) {
+    int64_t x = st + (en - st) / 2;
+    if (memcmp(old_data + I[x], new_data, min(old_size - I[x], new_size)) < 0)
+      st = x;
+    else
+      en = x;
+  }
+  int64_t x = MatchLength(old_data + I[st], old_size - I[st],
+                          new_data, new_size);
+  int64_t y = MatchLength(old_data + I[en], old_size - I[en],
+                          new_data, new_size);
+  if (x > y) {
+    *pos = I[st];
+    return x;
+  }
+  *pos = I[en];
+  return y;
+}
+
+}  // namespace
+
+BsdiffIndex::BsdiffIndex(const brillo::Blob& old_data)
+    : old_data_(old_data), suffix_array_(old_data.size() + 1) {
+  vector<int64_t> V(old_data_.size() + 1);
+  SortSuffixes(
+      suffix_array_.data(), V.data(), old_data_.data(), old_data_.size());
+}
+
+uint64_t BsdiffIndex::MemorySize() const {
+  return old_data_.size() + suffix_array_.size() * sizeof(int64_t);
+}
+
+bool BsdiffIndexCache::GetIndex(const brillo::Blob& old_data,
+                                std::shared_ptr<const BsdiffIndex>* index) {
+  brillo::Blob raw_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(old_data, &raw_hash));
+  const string key(raw_hash.begin(), raw_hash.end());
+  {
+    base::AutoLock auto_lock(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      hits_++;
+      *index = it->second->second;
+      return true;
+    }
+  }
+
+  // Sorting the suffixes is the slow part, so it's done without the lock. If
+  // another thread indexes the same data meanwhile, only one is kept.
+  index->reset(new BsdiffIndex(old_data));
+  const uint64_t index_size = (*index)->MemorySize();
+  if (index_size > max_bytes_)
+    return true;
+
+  base::AutoLock auto_lock(lock_);
+  if (entries_.find(key) != entries_.end())
+    return true;
+  lru_.emplace_front(key, *index);
+  entries_[key] = lru_.begin();
+  used_bytes_ += index_size;
+  while (used_bytes_ > max_bytes_) {
+    used_bytes_ -= lru_.back().second->MemorySize();
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  return true;
+}
+
+uint64_t BsdiffIndexCache::hits() const {
+  base::AutoLock auto_lock(lock_);
+  return hits_;
+}
+
+bool GenerateBsdiffPatch(const brillo::Blob& old_data,
+                         const brillo::Blob& new_data,
+                         brillo::Blob* patch) {
+  BsdiffIndex index(old_data);
+  return GenerateBsdiffPatch(index, new_data, patch);
+}
+
+bool GenerateBsdiffPatch(const BsdiffIndex& index,
+                         const brillo::Blob& new_data,
+                         brillo::Blob* patch) {
+  const uint8_t* old_buf = index.old_data().data();
+  const uint8_t* new_buf = new_data.data();
+  const int64_t old_size = index.old_data().size();
+  const int64_t new_size = new_data.size();
+  const int64_t* I = index.suffix_array().data();
+
+  brillo::Blob ctrl, diff, extra;
+  diff.reserve(new_size);
+  int64_t scan = 0, len = 0, pos = 0;
+  int64_t last_scan = 0, last_pos = 0, last_offset = 0;
+  while (scan < new_size) {
+    int64_t old_score = 0;
+    int64_t scsc;
+    for (scsc = scan += len; scan < new_size; scan++) {
+      len = Search(I, old_buf, old_size, new_buf + scan,
+                   new_size - scan, 0, old_size, &pos);
+      for (; scsc < scan + len; scsc++) {
+        if (scsc + last_offset < old_size &&
+            old_buf[scsc + last_offset] == new_buf[scsc])
+          old_score++;
+      }
+      if ((len == old_score && len != 0) || len > old_score + 8)
+        break;
+      if (scan + last_offset < old_size &&
+          old_buf[scan + last_offset] == new_buf[scan])
+        old_score--;
+    }
+
+    if (len == old_score && scan != new_size)
+      continue;
+
+    // Extend the previous match forwards and the current one backwards, as
+    // long as at least half of the bytes match.
+    int64_t s = 0, sf = 0, lenf = 0;
+    for (int64_t i = 0; last_scan + i < scan && last_pos + i < old_size;) {
+      if (old_buf[last_pos + i] == new_buf[last_scan + i])
+        s++;
+      i++;
+      if (s * 2 - i > sf * 2 - lenf) {
+        sf = s;
+        lenf = i;
+      }
+    }
+
+    int64_t lenb = 0;
+    if (scan < new_size) {
+      int64_t sb = 0;
+      s = 0;
+      for (int64_t i = 1; scan >= last_scan + i && pos >= i; i++) {
+        if (old_buf[pos - i] == new_buf[scan - i])
+          s++;
+        if (s * 2 - i > sb * 2 - lenb) {
+          sb = s;
+          lenb = i;
+        }
+      }
+    }
+
+    // Split the overlap of both extensions at the best point.
+    if (last_scan + lenf > scan - lenb) {
+      int64_t overlap = (last_scan + lenf) - (scan - lenb);
+      int64_t ss = 0, lens = 0;
+      s = 0;
+      for (int64_t i = 0; i < overlap; i++) {
+        if (new_buf[last_scan + lenf - overlap + i] ==
+            old_buf[last_pos + lenf - overlap + i])
+          s++;
+        if (new_buf[scan - lenb + i] == old_buf[pos - lenb + i])
+          s--;
+        if (s > ss) {
+          ss = s;
+          lens = i + 1;
+        }
+      }
+      lenf += lens - overlap;
+      lenb -= lens;
+    }
+
+    for (int64_t i = 0; i < lenf; i++)
+      diff.push_back(new_buf[last_scan + i] - old_buf[last_pos + i]);
+    const int64_t extra_len = (scan - lenb) - (last_scan + lenf);
+    extra.insert(extra.end(),
+                 new_buf + last_scan + lenf,
+                 new_buf + last_scan + lenf + extra_len);
+
+    AppendBsdiffInt64(lenf, &ctrl);
+    AppendBsdiffInt64(extra_len, &ctrl);
+    AppendBsdiffInt64((pos - lenb) - (last_pos + lenf), &ctrl);
+
+    last_scan = scan - lenb;
+    last_pos = pos - lenb;
+    last_offset = pos - scan;
+  }
+
+  brillo::Blob bz_ctrl, bz_diff, bz_extra;
+  TEST_AND_RETURN_FALSE(CompressBsdiffBlock(ctrl, &bz_ctrl));
+  TEST_AND_RETURN_FALSE(CompressBsdiffBlock(diff, &bz_diff));
+  TEST_AND_RETURN_FALSE(CompressBsdiffBlock(extra, &bz_extra));
+
+  patch->assign(kBsdiffMagic, kBsdiffMagic + kBsdiffMagicSize);
+  AppendBsdiffInt64(bz_ctrl.size(), patch);
+  AppendBsdiffInt64(bz_diff.size(), patch);
+  AppendBsdiffInt64(new_size, patch);
+  patch->insert(patch->end(), bz_ctrl.begin(), bz_ctrl.end());
+  patch->insert(patch->end(), bz_diff.begin(), bz_diff.end());
+  patch->insert(patch->end(), bz_extra.begin(), bz_extra.end());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BSDIFF_GENERATOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BSDIFF_GENERATOR_H_
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// The sorted suffixes of some old data, which is most of the work of
+// generating a bsdiff patch. An index can be used to generate the patches
+// from the same old data to several new data.
+class BsdiffIndex {
+ public:
+  explicit BsdiffIndex(const brillo::Blob& old_data);
+
+  const brillo::Blob& old_data() const { return old_data_; }
+  const std::vector<int64_t>& suffix_array() const { return suffix_array_; }
+
+  // The memory used by the index, in bytes.
+  uint64_t MemorySize() const;
+
+ private:
+  const brillo::Blob old_data_;
+
+  // The positions of the suffixes of |old_data_| in lexicographic order,
+  // including the empty suffix.
+  std::vector<int64_t> suffix_array_;
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffIndex);
+};
+
+// A thread safe cache of the BsdiffIndex of the old data diffed recently,
+// keyed by the hash of the data, so the same old data (for example, a file
+// present several times in the old partition) is only indexed once. The least
+// recently used indexes are dropped when the cache holds more than
+// |max_bytes|.
+class BsdiffIndexCache {
+ public:
+  explicit BsdiffIndexCache(uint64_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // Stores in |index| the index of |old_data|, building it if it isn't in the
+  // cache. Returns false if the data couldn't be hashed.
+  bool GetIndex(const brillo::Blob& old_data,
+                std::shared_ptr<const BsdiffIndex>* index);
+
+  // The number of GetIndex() calls that found the index in the cache.
+  uint64_t hits() const;
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const BsdiffIndex>>;
+
+  const uint64_t max_bytes_;
+
+  // Protects all the members below.
+  mutable base::Lock lock_;
+
+  // The cached indexes, most recently used first, and their position in
+  // |lru_| by hash.
+  std::list<Entry> lru_;
+  std::map<std::string, std::list<Entry>::iterator> entries_;
+  uint64_t used_bytes_{0};
+  uint64_t hits_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffIndexCache);
+};
+
+// Generates in |patch| a BSDIFF40 patch that produces |new_data| from
+// |old_data|, the same patch the bsdiff program generates from files with
+// that contents. Returns false if the patch couldn't be compressed.
+bool GenerateBsdiffPatch(const brillo::Blob& old_data,
+                         const brillo::Blob& new_data,
+                         brillo::Blob* patch);
+
+// Same as above, using the already built |index| of the old data.
+bool GenerateBsdiffPatch(const BsdiffIndex& index,
+                         const brillo::Blob& new_data,
+                         brillo::Blob* patch);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BSDIFF_GENERATOR_H_
@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/bsdiff_generator.h"
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/bspatch_applier.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class BsdiffGeneratorTest : public ::testing::Test {
+ protected:
+  // Generates the patch from |old_data| to |new_data| and checks that applying
+  // it results in |new_data|.
+  void TestRoundTrip(const brillo::Blob& old_data,
+                     const brillo::Blob& new_data) {
+    brillo::Blob patch;
+    EXPECT_TRUE(GenerateBsdiffPatch(old_data, new_data, &patch));
+
+    uint64_t new_size = 0;
+    EXPECT_TRUE(GetBsdiffPatchNewSize(patch.data(), patch.size(), &new_size));
+    EXPECT_EQ(new_data.size(), new_size);
+
+    FakeExtentWriter writer;
+    EXPECT_TRUE(writer.Init(nullptr, {}, 4096));
+    EXPECT_TRUE(ApplyBsdiffPatch(old_data.data(), old_data.size(),
+                                 patch.data(), patch.size(),
+                                 new_data.size(), &writer));
+    EXPECT_TRUE(writer.End());
+    EXPECT_EQ(new_data, writer.WrittenData());
+  }
+};
+
+TEST_F(BsdiffGeneratorTest, EmptyDataTest) {
+  TestRoundTrip({}, {});
+  TestRoundTrip({}, {'a', 'b', 'c'});
+  TestRoundTrip({'a', 'b', 'c'}, {});
+}
+
+TEST_F(BsdiffGeneratorTest, IdenticalDataTest) {
+  brillo::Blob data(10000);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 7) % 251;
+  TestRoundTrip(data, data);
+}
+
+TEST_F(BsdiffGeneratorTest, ModifiedDataTest) {
+  brillo::Blob old_data(50000);
+  for (size_t i = 0; i < old_data.size(); i++)
+    old_data[i] = (i * i + i / 3) & 0xff;
+  // Change some bytes, move a range and insert new data in the middle.
+  brillo::Blob new_data = old_data;
+  for (size_t i = 0; i < new_data.size(); i += 997)
+    new_data[i] ^= 0x5a;
+  new_data.insert(new_data.begin() + 20000, old_data.begin() + 40000,
+                  old_data.end());
+  string text = "new data not present in the old data";
+  new_data.insert(new_data.begin() + 100, text.begin(), text.end());
+  TestRoundTrip(old_data, new_data);
+}
+
+TEST_F(BsdiffGeneratorTest, SmallPatchForSimilarDataTest) {
+  brillo::Blob old_data(100000);
+  for (size_t i = 0; i < old_data.size(); i++)
+    old_data[i] = (i * 2654435761u) >> 24;
+  brillo::Blob new_data = old_data;
+  new_data[50000]++;
+  brillo::Blob patch;
+  EXPECT_TRUE(GenerateBsdiffPatch(old_data, new_data, &patch));
+  EXPECT_LT(patch.size(), 1000U);
+}
+
+TEST_F(BsdiffGeneratorTest, IndexCacheReusesIndexTest) {
+  brillo::Blob old_data(1000, 'a');
+  brillo::Blob other_data(1000, 'b');
+  BsdiffIndexCache cache(1024 * 1024);
+  std::shared_ptr<const BsdiffIndex> index, same_index, other_index;
+  EXPECT_TRUE(cache.GetIndex(old_data, &index));
+  EXPECT_TRUE(cache.GetIndex(other_data, &other_index));
+  EXPECT_TRUE(cache.GetIndex(brillo::Blob(old_data), &same_index));
+  EXPECT_EQ(index, same_index);
+  EXPECT_NE(index, other_index);
+  EXPECT_EQ(1U, cache.hits());
+
+  // The patch from the cached index is the same as without the index.
+  brillo::Blob new_data(1200, 'a');
+  brillo::Blob patch, index_patch;
+  EXPECT_TRUE(GenerateBsdiffPatch(old_data, new_data, &patch));
+  EXPECT_TRUE(GenerateBsdiffPatch(*index, new_data, &index_patch));
+  EXPECT_EQ(patch, index_patch);
+}
+
+TEST_F(BsdiffGeneratorTest, IndexCacheEvictsLeastRecentlyUsedTest) {
+  brillo::Blob data1(100, 1), data2(100, 2), data3(100, 3);
+  // Only two indexes fit in the cache.
+  BsdiffIndexCache cache(2 * BsdiffIndex(data1).MemorySize());
+  std::shared_ptr<const BsdiffIndex> index;
+  EXPECT_TRUE(cache.GetIndex(data1, &index));
+  EXPECT_TRUE(cache.GetIndex(data2, &index));
+  EXPECT_TRUE(cache.GetIndex(data1, &index));
+  EXPECT_EQ(1U, cache.hits());
+  // Adding a third index drops |data2|, the least recently used one.
+  EXPECT_TRUE(cache.GetIndex(data3, &index));
+  EXPECT_TRUE(cache.GetIndex(data1, &index));
+  EXPECT_EQ(2U, cache.hits());
+  EXPECT_TRUE(cache.GetIndex(data2, &index));
+  EXPECT_EQ(2U, cache.hits());
+}
+
+}  // namespace chromeos_update_engine
@@ -23,10 +23,12 @@
 #include <limits>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
 
 namespace chromeos_update_engine {
 
 bool BzipCompress(const brillo::Blob& in, brillo::Blob* out) {
+  ScopedProfilePhase profile_phase("BzipCompress", in.size());
   TEST_AND_RETURN_FALSE(out);
   out->clear();
   if (in.size() == 0)
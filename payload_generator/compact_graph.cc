@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compact_graph.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "update_engine/payload_generator/graph_utils.h"
+
+namespace chromeos_update_engine {
+
+const size_t CompactGraph::kInvalidEdge = static_cast<size_t>(-1);
+
+CompactGraph::CompactGraph(const Graph& graph) {
+  size_t num_edges = 0, num_extents = 0;
+  for (const Vertex& vertex : graph) {
+    num_edges += vertex.out_edges.size();
+    for (const auto& edge_it : vertex.out_edges)
+      num_extents += edge_it.second.extents.size();
+  }
+  first_edge_.reserve(graph.size() + 1);
+  targets_.reserve(num_edges);
+  weights_.reserve(num_edges);
+  first_extent_.reserve(num_edges + 1);
+  extents_.reserve(num_extents);
+
+  for (Vertex::Index src = 0; src < graph.size(); src++) {
+    first_edge_.push_back(targets_.size());
+    for (const auto& edge_it : graph[src].out_edges) {
+      targets_.push_back(edge_it.first);
+      weights_.push_back(
+          graph_utils::EdgeWeight(graph, std::make_pair(src, edge_it.first)));
+      first_extent_.push_back(extents_.size());
+      extents_.insert(extents_.end(),
+                      edge_it.second.extents.begin(),
+                      edge_it.second.extents.end());
+    }
+  }
+  first_edge_.push_back(targets_.size());
+  first_extent_.push_back(extents_.size());
+}
+
+size_t CompactGraph::FindEdge(Vertex::Index src, Vertex::Index dst) const {
+  auto begin = targets_.begin() + edges_begin(src);
+  auto end = targets_.begin() + edges_end(src);
+  auto it = std::lower_bound(begin, end, dst);
+  if (it == end || *it != dst)
+    return kInvalidEdge;
+  return it - targets_.begin();
+}
+
+}  // namespace chromeos_update_engine
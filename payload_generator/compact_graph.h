@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPACT_GRAPH_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPACT_GRAPH_H_
+
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/graph_types.h"
+
+namespace chromeos_update_engine {
+
+// A read-only copy of the edges of a Graph in compressed sparse row form. The
+// out-edges of all the vertices are stored in flat arrays, sorted by source and
+// then by target vertex like the EdgeMap, and so are the read-before extents
+// of every edge. The graph algorithms walk the edges of large graphs much
+// faster this way than through the maps of every Vertex.
+class CompactGraph {
+ public:
+  explicit CompactGraph(const Graph& graph);
+
+  // The number of vertices and of edges in the graph.
+  size_t size() const { return first_edge_.size() - 1; }
+  size_t num_edges() const { return targets_.size(); }
+
+  // The out-edges of the |vertex| are the edge indexes from edges_begin() to
+  // edges_end(), not included.
+  size_t edges_begin(Vertex::Index vertex) const { return first_edge_[vertex]; }
+  size_t edges_end(Vertex::Index vertex) const {
+    return first_edge_[vertex + 1];
+  }
+
+  // The vertex pointed to by the |edge|.
+  Vertex::Index target(size_t edge) const { return targets_[edge]; }
+
+  // The number of blocks in the read-before extents of the |edge|, the same
+  // as graph_utils::EdgeWeight().
+  uint64_t weight(size_t edge) const { return weights_[edge]; }
+
+  // The read-before extents of the |edge|, from extents_begin() to
+  // extents_end(), not included.
+  const Extent* extents_begin(size_t edge) const {
+    return extents_.data() + first_extent_[edge];
+  }
+  const Extent* extents_end(size_t edge) const {
+    return extents_.data() + first_extent_[edge + 1];
+  }
+
+  // Returns the index of the edge from |src| to |dst|, or kInvalidEdge if
+  // there's none.
+  size_t FindEdge(Vertex::Index src, Vertex::Index dst) const;
+
+  static const size_t kInvalidEdge;
+
+ private:
+  // The index of the first out-edge of every vertex, plus the number of edges.
+  std::vector<size_t> first_edge_;
+  std::vector<Vertex::Index> targets_;
+  std::vector<uint64_t> weights_;
+
+  // The index in |extents_| of the first extent of every edge, plus the
+  // number of extents.
+  std::vector<size_t> first_extent_;
+  std::vector<Extent> extents_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompactGraph);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPACT_GRAPH_H_
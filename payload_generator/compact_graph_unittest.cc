@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compact_graph.h"
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::make_pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class CompactGraphTest : public ::testing::Test {};
+
+TEST(CompactGraphTest, SimpleTest) {
+  Graph graph(4);
+  EdgeProperties props;
+  props.extents = {ExtentForRange(10, 2), ExtentForRange(kSparseHole, 3),
+                   ExtentForRange(20, 1)};
+  graph[0].out_edges.insert(make_pair(3, props));
+  graph[0].out_edges.insert(make_pair(1, EdgeProperties()));
+  props.extents = {ExtentForRange(30, 5)};
+  graph[2].out_edges.insert(make_pair(0, props));
+
+  CompactGraph compact_graph(graph);
+  EXPECT_EQ(4U, compact_graph.size());
+  EXPECT_EQ(3U, compact_graph.num_edges());
+
+  // The edges are sorted by target vertex.
+  ASSERT_EQ(2U, compact_graph.edges_end(0) - compact_graph.edges_begin(0));
+  size_t edge = compact_graph.edges_begin(0);
+  EXPECT_EQ(1U, compact_graph.target(edge));
+  EXPECT_EQ(0U, compact_graph.weight(edge));
+  EXPECT_EQ(compact_graph.extents_begin(edge), compact_graph.extents_end(edge));
+  edge++;
+  EXPECT_EQ(3U, compact_graph.target(edge));
+  EXPECT_EQ(3U, compact_graph.weight(edge));
+  EXPECT_EQ((vector<Extent>{ExtentForRange(10, 2),
+                            ExtentForRange(kSparseHole, 3),
+                            ExtentForRange(20, 1)}),
+            vector<Extent>(compact_graph.extents_begin(edge),
+                           compact_graph.extents_end(edge)));
+
+  EXPECT_EQ(compact_graph.edges_begin(1), compact_graph.edges_end(1));
+  EXPECT_EQ(compact_graph.edges_begin(3), compact_graph.edges_end(3));
+
+  edge = compact_graph.FindEdge(2, 0);
+  ASSERT_NE(CompactGraph::kInvalidEdge, edge);
+  EXPECT_EQ(5U, compact_graph.weight(edge));
+  EXPECT_EQ(CompactGraph::kInvalidEdge, compact_graph.FindEdge(0, 2));
+  EXPECT_EQ(CompactGraph::kInvalidEdge, compact_graph.FindEdge(3, 0));
+}
+
+}  // namespace chromeos_update_engine
@@ -26,7 +26,6 @@
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/utils.h"
-#include "update_engine/payload_generator/graph_utils.h"
 #include "update_engine/payload_generator/tarjan.h"
 
 using std::make_pair;
@@ -35,14 +34,41 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The graphs with more edges than this go straight to the greedy heuristic.
+const size_t kMaxCircuitGraphEdges = 200000;
+
+// The default maximum number of calls to Circuit(), which take a few minutes
+// in total on a typical workload.
+const uint64_t kDefaultMaxCircuitSteps = 50000000;
+
+}  // namespace
+
+CycleBreaker::CycleBreaker()
+    : max_circuit_steps_(kDefaultMaxCircuitSteps), skipped_ops_(0) {}
+
 // This is the outer function from the original paper.
 void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
   cut_edges_.clear();
+  circuit_steps_ = 0;
+  used_greedy_ = false;
+
+  // The edges are walked in a compact copy of the graph. This variable was
+  // "A_K" in the original paper, which removes the vertices before s from it
+  // instead of skipping them.
+  const CompactGraph compact_graph(graph);
+  graph_ = &compact_graph;
 
-  // Make a copy, which we will modify by removing edges. Thus, in each
-  // iteration subgraph_ is the current subgraph or the original with
-  // vertices we desire. This variable was "A_K" in the original paper.
-  subgraph_ = graph;
+  if (compact_graph.num_edges() > kMaxCircuitGraphEdges) {
+    LOG(INFO) << "The graph has " << compact_graph.num_edges() << " edges, "
+              << "breaking the cycles with the greedy heuristic.";
+    skipped_ops_ = 0;
+    BreakRemainingCycles();
+    out_cut_edges->swap(cut_edges_);
+    graph_ = nullptr;
+    return;
+  }
 
   // The paper calls for the "adjacency structure (i.e., graph) of
   // strong (-ly connected) component K with least vertex in subgraph
@@ -53,8 +79,19 @@ void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
 
   TarjanAlgorithm tarjan;
   skipped_ops_ = 0;
+  in_component_.assign(graph.size(), false);
+  blocked_.assign(graph.size(), false);
+  blocked_graph_.assign(graph.size(), vector<Vertex::Index>());
+  vector<Vertex::Index> component_indexes;
 
-  for (Graph::size_type i = 0; i < subgraph_.size(); i++) {
+  for (Graph::size_type i = 0; i < graph.size(); i++) {
+    if (circuit_steps_ >= max_circuit_steps_) {
+      LOG(INFO) << "The circuit enumeration stopped after " << circuit_steps_
+                << " steps, breaking the rest of the cycles with the greedy "
+                << "heuristic.";
+      BreakRemainingCycles();
+      break;
+    }
     InstallOperation_Type op_type = graph[i].aop.op.type();
     if (op_type == InstallOperation::REPLACE ||
         op_type == InstallOperation::REPLACE_BZ) {
@@ -62,45 +99,134 @@ void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
       continue;
     }
 
-    if (i > 0) {
-      // Erase node (i - 1) from subgraph_. First, erase what it points to
-      subgraph_[i - 1].out_edges.clear();
-      // Now, erase any pointers to node (i - 1)
-      for (Graph::size_type j = i; j < subgraph_.size(); j++) {
-        subgraph_[j].out_edges.erase(i - 1);
-      }
+    // Only the vertices of the previous component were touched.
+    for (Vertex::Index vertex : component_indexes) {
+      in_component_[vertex] = false;
+      blocked_[vertex] = false;
+      blocked_graph_[vertex].clear();
     }
+    component_indexes.clear();
 
-    // Calculate SCC (strongly connected component) with vertex i.
-    vector<Vertex::Index> component_indexes;
-    tarjan.Execute(i, &subgraph_, &component_indexes);
-
-    // Set subgraph edges for the components in the SCC.
-    for (vector<Vertex::Index>::iterator it = component_indexes.begin();
-         it != component_indexes.end(); ++it) {
-      subgraph_[*it].subgraph_edges.clear();
-      for (vector<Vertex::Index>::iterator jt = component_indexes.begin();
-           jt != component_indexes.end(); ++jt) {
-        // If there's a link from *it -> *jt in the graph,
-        // add a subgraph_ edge
-        if (utils::MapContainsKey(subgraph_[*it].out_edges, *jt))
-          subgraph_[*it].subgraph_edges.insert(*jt);
-      }
-    }
+    // Calculate SCC (strongly connected component) with vertex i, in the
+    // subgraph of the vertices from i on.
+    tarjan.Execute(i, compact_graph, i, &component_indexes);
+    for (Vertex::Index vertex : component_indexes)
+      in_component_[vertex] = true;
 
     current_vertex_ = i;
-    blocked_.clear();
-    blocked_.resize(subgraph_.size());
-    blocked_graph_.clear();
-    blocked_graph_.resize(subgraph_.size());
     Circuit(current_vertex_, 0);
   }
 
   out_cut_edges->swap(cut_edges_);
+  graph_ = nullptr;
   LOG(INFO) << "Cycle breaker skipped " << skipped_ops_ << " ops.";
   DCHECK(stack_.empty());
 }
 
+// This is the weighted variant of the Eades, Lin and Smyth heuristic from
+// "A fast and effective heuristic for the feedback arc set problem". Sinks are
+// moved to the end of the order and sources to the start; when there are
+// none, the vertex with the most outgoing weight over incoming weight goes to
+// the start.
+void CycleBreaker::BreakRemainingCycles() {
+  used_greedy_ = true;
+  const CompactGraph& graph = *graph_;
+  const size_t num_vertices = graph.size();
+
+  // The edges left, which are neither cut yet nor self loops, always cut.
+  vector<bool> edge_left(graph.num_edges(), false);
+  // The source vertex and the index of the incoming edges left of every vertex.
+  vector<vector<std::pair<Vertex::Index, size_t>>> in_edges(num_vertices);
+  vector<size_t> in_degree(num_vertices), out_degree(num_vertices);
+  vector<int64_t> delta(num_vertices);  // Outgoing minus incoming weight.
+  for (Vertex::Index u = 0; u < num_vertices; u++) {
+    for (size_t edge = graph.edges_begin(u); edge < graph.edges_end(u);
+         edge++) {
+      Vertex::Index v = graph.target(edge);
+      if (v == u || utils::SetContainsKey(cut_edges_, make_pair(u, v)))
+        continue;
+      edge_left[edge] = true;
+      in_edges[v].emplace_back(u, edge);
+      out_degree[u]++;
+      in_degree[v]++;
+      delta[u] += graph.weight(edge);
+      delta[v] -= graph.weight(edge);
+    }
+  }
+
+  set<std::pair<int64_t, Vertex::Index>> by_delta;
+  vector<Vertex::Index> sinks, sources;
+  for (Vertex::Index u = 0; u < num_vertices; u++) {
+    by_delta.emplace(delta[u], u);
+    if (out_degree[u] == 0)
+      sinks.push_back(u);
+    else if (in_degree[u] == 0)
+      sources.push_back(u);
+  }
+
+  // The position of every vertex in the order; the first ones from the start
+  // and the last ones from the end.
+  vector<size_t> position(num_vertices);
+  vector<bool> placed(num_vertices, false);
+  size_t next_first = 0, next_last = num_vertices;
+  auto update_delta = [&](Vertex::Index u, int64_t change) {
+    by_delta.erase(make_pair(delta[u], u));
+    delta[u] += change;
+    by_delta.emplace(delta[u], u);
+  };
+  auto place = [&](Vertex::Index u, bool at_end) {
+    placed[u] = true;
+    by_delta.erase(make_pair(delta[u], u));
+    position[u] = at_end ? --next_last : next_first++;
+    for (size_t edge = graph.edges_begin(u); edge < graph.edges_end(u);
+         edge++) {
+      Vertex::Index v = graph.target(edge);
+      if (!edge_left[edge] || placed[v])
+        continue;
+      update_delta(v, graph.weight(edge));
+      if (--in_degree[v] == 0)
+        sources.push_back(v);
+    }
+    for (const auto& in_edge : in_edges[u]) {
+      Vertex::Index t = in_edge.first;
+      if (placed[t])
+        continue;
+      update_delta(t, -static_cast<int64_t>(graph.weight(in_edge.second)));
+      if (--out_degree[t] == 0)
+        sinks.push_back(t);
+    }
+  };
+
+  while (next_first < next_last) {
+    if (!sinks.empty()) {
+      Vertex::Index u = sinks.back();
+      sinks.pop_back();
+      if (!placed[u])
+        place(u, true);
+    } else if (!sources.empty()) {
+      Vertex::Index u = sources.back();
+      sources.pop_back();
+      if (!placed[u])
+        place(u, false);
+    } else {
+      place(by_delta.rbegin()->second, false);
+    }
+  }
+
+  size_t num_cut = 0;
+  for (Vertex::Index u = 0; u < num_vertices; u++) {
+    for (size_t edge = graph.edges_begin(u); edge < graph.edges_end(u);
+         edge++) {
+      Vertex::Index v = graph.target(edge);
+      if (position[v] <= position[u] &&
+          cut_edges_.insert(make_pair(u, v)).second) {
+        num_cut++;
+      }
+    }
+  }
+  LOG(INFO) << "The greedy heuristic cut " << num_cut << " edges.";
+}
+
 static const size_t kMaxEdgesToConsider = 2;
 
 void CycleBreaker::HandleCircuit() {
@@ -117,7 +243,8 @@ void CycleBreaker::HandleCircuit() {
       stack_.pop_back();
       return;
     }
-    uint64_t edge_weight = graph_utils::EdgeWeight(subgraph_, edge);
+    uint64_t edge_weight =
+        graph_->weight(graph_->FindEdge(edge.first, edge.second));
     if (edge_weight < min_edge_weight) {
       min_edge_weight = edge_weight;
       min_edge = edge;
@@ -133,10 +260,9 @@ void CycleBreaker::HandleCircuit() {
 void CycleBreaker::Unblock(Vertex::Index u) {
   blocked_[u] = false;
 
-  for (Vertex::EdgeMap::iterator it = blocked_graph_[u].out_edges.begin();
-       it != blocked_graph_[u].out_edges.end(); ) {
-    Vertex::Index w = it->first;
-    blocked_graph_[u].out_edges.erase(it++);
+  vector<Vertex::Index> blocked_by_u;
+  blocked_by_u.swap(blocked_graph_[u]);
+  for (Vertex::Index w : blocked_by_u) {
     if (blocked_[w])
       Unblock(w);
   }
@@ -156,6 +282,7 @@ bool CycleBreaker::StackContainsCutEdge() const {
 bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth) {
   // "vertex" was "v" in the original paper.
   bool found = false;  // Was "f" in the original paper.
+  circuit_steps_++;
   stack_.push_back(vertex);
   blocked_[vertex] = true;
   {
@@ -172,17 +299,22 @@ bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth) {
     }
   }
 
-  for (Vertex::SubgraphEdgeMap::iterator w =
-           subgraph_[vertex].subgraph_edges.begin();
-       w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-    if (*w == current_vertex_) {
+  for (size_t edge = graph_->edges_begin(vertex);
+       edge < graph_->edges_end(vertex); edge++) {
+    // Out of work, the rest of the cycles are left to BreakRemainingCycles().
+    if (circuit_steps_ >= max_circuit_steps_)
+      break;
+    Vertex::Index w = graph_->target(edge);
+    if (!in_component_[w])
+      continue;
+    if (w == current_vertex_) {
       // The original paper called for printing stack_ followed by
       // current_vertex_ here, which is a cycle. Instead, we call
       // HandleCircuit() to break it.
       HandleCircuit();
       found = true;
-    } else if (!blocked_[*w]) {
-      if (Circuit(*w, depth + 1)) {
+    } else if (!blocked_[w]) {
+      if (Circuit(w, depth + 1)) {
         found = true;
         if ((depth > kMaxEdgesToConsider) || StackContainsCutEdge())
           break;
@@ -193,13 +325,12 @@ bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth) {
   if (found) {
     Unblock(vertex);
   } else {
-    for (Vertex::SubgraphEdgeMap::iterator w =
-             subgraph_[vertex].subgraph_edges.begin();
-         w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-      if (blocked_graph_[*w].out_edges.find(vertex) ==
-          blocked_graph_[*w].out_edges.end()) {
-        blocked_graph_[*w].out_edges.insert(make_pair(vertex,
-                                                      EdgeProperties()));
+    for (size_t edge = graph_->edges_begin(vertex);
+         edge < graph_->edges_end(vertex); edge++) {
+      Vertex::Index w = graph_->target(edge);
+      if (in_component_[w] &&
+          !utils::VectorContainsValue(blocked_graph_[w], vertex)) {
+        blocked_graph_[w].push_back(vertex);
       }
     }
   }
@@ -32,22 +32,42 @@
 // In a sample graph representative of a typical workload, I found over
 // 5 * 10^15 cycles.
 
+// Since the enumeration can take hours on dense graphs, it is bounded: graphs
+// with too many edges, and the cycles left when the enumeration runs out of
+// work, are broken with a greedy feedback arc set heuristic instead. It orders
+// the vertices so that the heaviest edges go forward and cuts the edges going
+// backward.
+
 #include <set>
 #include <vector>
 
+#include "update_engine/payload_generator/compact_graph.h"
 #include "update_engine/payload_generator/graph_types.h"
 
 namespace chromeos_update_engine {
 
 class CycleBreaker {
  public:
-  CycleBreaker() : skipped_ops_(0) {}
+  CycleBreaker();
   // out_cut_edges is replaced with the cut edges.
   void BreakCycles(const Graph& graph, std::set<Edge>* out_cut_edges);
 
   size_t skipped_ops() const { return skipped_ops_; }
 
+  // Sets the maximum number of steps of the circuit enumeration, after which
+  // the rest of the cycles are broken with the greedy heuristic.
+  void set_max_circuit_steps(uint64_t max_steps) {
+    max_circuit_steps_ = max_steps;
+  }
+
+  // Whether the last BreakCycles() call used the greedy heuristic.
+  bool used_greedy() const { return used_greedy_; }
+
  private:
+  // Cuts the edges of |graph_| not in |cut_edges_| yet that go backward in a
+  // greedy ordering of its vertices, leaving it without cycles.
+  void BreakRemainingCycles();
+
   void HandleCircuit();
   void Unblock(Vertex::Index u);
   bool Circuit(Vertex::Index vertex, Vertex::Index depth);
@@ -56,11 +76,17 @@ class CycleBreaker {
   std::vector<bool> blocked_;  // "blocked" in the paper
   Vertex::Index current_vertex_;  // "s" in the paper
   std::vector<Vertex::Index> stack_;  // the stack variable in the paper
-  Graph subgraph_;  // "A_K" in the paper
-  Graph blocked_graph_;  // "B" in the paper
+  const CompactGraph* graph_{nullptr};  // "A_K" in the paper
+  std::vector<bool> in_component_;  // The vertices of "A_K"
+  std::vector<std::vector<Vertex::Index>> blocked_graph_;  // "B" in the paper
 
   std::set<Edge> cut_edges_;
 
+  // The steps taken and the maximum allowed in the circuit enumeration.
+  uint64_t circuit_steps_{0};
+  uint64_t max_circuit_steps_;
+  bool used_greedy_{false};
+
   // Number of operations skipped b/c we know they don't have any
   // incoming edges.
   size_t skipped_ops_;
@@ -102,6 +102,34 @@ uint64_t weight) {
   props.extents[0].set_num_blocks(weight);
   return make_pair(dest, props);
 }
+
+// Returns whether |graph| has no cycles once the |cut_edges| are removed.
+bool IsAcyclicWithoutEdges(const Graph& graph, const set<Edge>& cut_edges) {
+  vector<size_t> in_degree(graph.size());
+  for (Vertex::Index u = 0; u < graph.size(); u++) {
+    for (const auto& edge : graph[u].out_edges) {
+      if (!utils::SetContainsKey(cut_edges, make_pair(u, edge.first)))
+        in_degree[edge.first]++;
+    }
+  }
+  vector<Vertex::Index> ready;
+  for (Vertex::Index u = 0; u < graph.size(); u++) {
+    if (in_degree[u] == 0)
+      ready.push_back(u);
+  }
+  size_t num_sorted = 0;
+  while (!ready.empty()) {
+    Vertex::Index u = ready.back();
+    ready.pop_back();
+    num_sorted++;
+    for (const auto& edge : graph[u].out_edges) {
+      if (!utils::SetContainsKey(cut_edges, make_pair(u, edge.first)) &&
+          --in_degree[edge.first] == 0)
+        ready.push_back(edge.first);
+    }
+  }
+  return num_sorted == graph.size();
+}
 }  // namespace
 
 
@@ -275,4 +303,59 @@ TEST(CycleBreakerTest, SkipOpsTest) {
   EXPECT_EQ(2U, breaker.skipped_ops());
 }
 
+TEST(CycleBreakerTest, GreedyWeightTest) {
+  Graph graph(3);
+  SetOpForNodes(&graph);
+  graph[0].out_edges.insert(EdgeWithWeight(1, 10));
+  graph[1].out_edges.insert(EdgeWithWeight(0, 1));
+  graph[1].out_edges.insert(EdgeWithWeight(2, 5));
+  graph[2].out_edges.insert(EdgeWithWeight(2, 1));
+
+  CycleBreaker breaker;
+  breaker.set_max_circuit_steps(0);
+
+  set<Edge> broken_edges;
+  breaker.BreakCycles(graph, &broken_edges);
+
+  // The lightest edge of the cycle and the self loop are cut.
+  EXPECT_TRUE(breaker.used_greedy());
+  EXPECT_EQ((set<Edge>{make_pair(1, 0), make_pair(2, 2)}), broken_edges);
+}
+
+TEST(CycleBreakerTest, GreedyAfterCircuitsTest) {
+  // Dense chains of hubs, with many cycles through the first hub.
+  const size_t kNodesPerHub = 8;
+  const size_t kNumHubs = 6;
+  Graph graph(1 + kNumHubs * (kNodesPerHub + 1));
+  SetOpForNodes(&graph);
+  Vertex::Index last_hub = 0;
+  for (size_t hub = 0; hub < kNumHubs; hub++) {
+    Vertex::Index next_hub = last_hub + kNodesPerHub + 1;
+    for (size_t i = 1; i <= kNodesPerHub; i++) {
+      graph[last_hub].out_edges.insert(EdgeWithWeight(last_hub + i, i));
+      graph[last_hub + i].out_edges.insert(EdgeWithWeight(next_hub, i));
+      graph[last_hub + i].out_edges.insert(EdgeWithWeight(0, 1));
+    }
+    last_hub = next_hub;
+  }
+  graph[last_hub].out_edges.insert(EdgeWithWeight(0, 1));
+
+  for (uint64_t max_steps : {0, 10}) {
+    CycleBreaker breaker;
+    breaker.set_max_circuit_steps(max_steps);
+
+    set<Edge> broken_edges;
+    breaker.BreakCycles(graph, &broken_edges);
+    EXPECT_TRUE(breaker.used_greedy());
+    EXPECT_TRUE(IsAcyclicWithoutEdges(graph, broken_edges));
+  }
+
+  // Without limits the circuit enumeration breaks all the cycles on its own.
+  CycleBreaker breaker;
+  set<Edge> broken_edges;
+  breaker.BreakCycles(graph, &broken_edges);
+  EXPECT_FALSE(breaker.used_greedy());
+  EXPECT_TRUE(IsAcyclicWithoutEdges(graph, broken_edges));
+}
+
 }  // namespace chromeos_update_engine
@@ -29,16 +29,25 @@
 #include <vector>
 
 #include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/hash_tree_builder.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
 #include "update_engine/payload_generator/inplace_generator.h"
+#include "update_engine/payload_generator/mapped_image.h"
+#include "update_engine/payload_generator/partition_shard.h"
 #include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::string;
 using std::unique_ptr;
@@ -50,21 +59,364 @@ namespace chromeos_update_engine {
 const size_t kRootFSPartitionSize = static_cast<size_t>(2) * 1024 * 1024 * 1024;
 const size_t kBlockSize = 4096;  // bytes
 
+namespace {
+
+// The number of blocks of the data of a hash tree read at once.
+const uint64_t kHashTreeReadBlocks = 256;
+
+// Returns whether the hash tree in the image of |part| is the one the clients
+// build from its data, which is how they get it.
+bool CheckHashTree(const PayloadGenerationConfig& config,
+                   const PartitionConfig& part) {
+  const uint64_t data_blocks = part.hash_tree_data_size / config.block_size;
+  HashTreeBuilder builder(0,
+                          part.hash_tree_data_size,
+                          part.hash_tree_data_size,
+                          config.block_size,
+                          part.hash_tree_salt);
+  brillo::Blob data;
+  for (uint64_t block = 0; block < data_blocks; block += kHashTreeReadBlocks) {
+    const uint64_t num_blocks =
+        std::min(kHashTreeReadBlocks, data_blocks - block);
+    TEST_AND_RETURN_FALSE(ReadImageExtents(part.path,
+                                           {ExtentForRange(block, num_blocks)},
+                                           &data,
+                                           num_blocks * config.block_size,
+                                           config.block_size));
+    builder.Update(data.data(), data.size(), block * config.block_size);
+  }
+  TEST_AND_RETURN_FALSE(builder.Finalize(nullptr));
+
+  brillo::Blob tree;
+  const vector<Extent> tree_extents = part.HashTreeExtents(config.block_size);
+  TEST_AND_RETURN_FALSE(ReadImageExtents(part.path,
+                                         tree_extents,
+                                         &tree,
+                                         builder.tree().size(),
+                                         config.block_size));
+  if (tree != builder.tree()) {
+    LOG(ERROR) << "The hash tree of partition " << part.name << " doesn't "
+               << "match its data and salt.";
+    return false;
+  }
+  LOG(INFO) << "The " << tree.size() << " bytes of the hash tree of partition "
+            << part.name << " are built by the clients, root hash "
+            << base::HexEncode(builder.root_hash().data(),
+                               builder.root_hash().size());
+  return true;
+}
+
+// Generates in |aops| the operations of the partition |new_part|, from
+// |old_part| if it has a path, storing their blobs in |blob_file|.
+bool GeneratePartitionOperations(const PayloadGenerationConfig& config,
+                                 const PartitionConfig& old_part,
+                                 const PartitionConfig& new_part,
+                                 BlobFileWriter* blob_file,
+                                 vector<AnnotatedOperation>* aops) {
+  LOG(INFO) << "Partition name: " << new_part.name;
+  LOG(INFO) << "Partition size: " << new_part.size;
+  LOG(INFO) << "Block count: " << new_part.size / config.block_size;
+  if (new_part.hash_tree_data_size > 0)
+    TEST_AND_RETURN_FALSE(CheckHashTree(config, new_part));
+
+  // Select payload generation strategy based on the config.
+  unique_ptr<OperationsGenerator> strategy;
+  if (!old_part.path.empty()) {
+    // Delta update.
+    if (config.version.minor == kInPlaceMinorPayloadVersion) {
+      LOG(INFO) << "Using generator InplaceGenerator().";
+      strategy.reset(new InplaceGenerator());
+    } else {
+      LOG(INFO) << "Using generator ABGenerator().";
+      strategy.reset(new ABGenerator());
+    }
+  } else {
+    LOG(INFO) << "Using generator FullUpdateGenerator().";
+    strategy.reset(new FullUpdateGenerator());
+  }
+
+  // Generate the operations using the strategy we selected above.
+  TEST_AND_RETURN_FALSE(strategy->GenerateOperations(
+      config, old_part, new_part, blob_file, aops));
+
+  // Filter the no-operations. OperationsGenerators should not output this
+  // kind of operations normally, but this is an extra step to fix that if
+  // happened.
+  diff_utils::FilterNoopOperations(aops);
+
+  // The large xz blobs are split last, once the operations are final.
+  if (config.version.xz_chunk_blocks > 0) {
+    TEST_AND_RETURN_FALSE(diff_utils::SplitXzChunks(
+        new_part.path, config.version.xz_chunk_blocks, blob_file, aops));
+  }
+  return true;
+}
+
+// Computes the PartitionInfo of the old and new partitions from a thread of its
+// own, so the images are hashed while the operations are generated instead of
+// read once more afterwards. The images are read from their mappings, if any,
+// shared with the generation.
+class PartitionInfoHasher : public base::DelegateSimpleThread::Delegate {
+ public:
+  PartitionInfoHasher(const PartitionConfig& old_part,
+                      const PartitionConfig& new_part,
+                      uint64_t hash_chunk_size)
+      : old_part_(old_part),
+        new_part_(new_part),
+        hash_chunk_size_(hash_chunk_size) {}
+  ~PartitionInfoHasher() override { Join(); }
+
+  void Start() {
+    thread_.reset(new base::DelegateSimpleThread(this, "partition-hasher"));
+    thread_->Start();
+  }
+
+  // Waits for the hashes. Returns false if they couldn't be computed.
+  bool Join() {
+    if (thread_) {
+      thread_->Join();
+      thread_.reset();
+    }
+    return !failed_;
+  }
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    if (!old_part_.path.empty()) {
+      failed_ = !diff_utils::InitializePartitionInfo(
+          old_part_, hash_chunk_size_, &old_info_);
+    }
+    failed_ = failed_ || !diff_utils::InitializePartitionInfo(
+                             new_part_, hash_chunk_size_, &new_info_);
+  }
+
+  // The PartitionInfo of the partitions, once joined. The |old_info| is empty
+  // if the old partition has no path.
+  const PartitionInfo& old_info() const { return old_info_; }
+  const PartitionInfo& new_info() const { return new_info_; }
+
+ private:
+  const PartitionConfig& old_part_;
+  const PartitionConfig& new_part_;
+  const uint64_t hash_chunk_size_;
+
+  std::unique_ptr<base::DelegateSimpleThread> thread_;
+  PartitionInfo old_info_;
+  PartitionInfo new_info_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionInfoHasher);
+};
+
+// Generates the operations of a partition from a worker thread, when the
+// partitions are generated at the same time.
+class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  PartitionProcessor(const PayloadGenerationConfig& config,
+                     const PartitionConfig& old_part,
+                     const PartitionConfig& new_part,
+                     BlobFileWriter* blob_file)
+      : config_(config),
+        old_part_(old_part),
+        new_part_(new_part),
+        blob_file_(blob_file) {}
+  PartitionProcessor(PartitionProcessor&&) = default;
+  ~PartitionProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    ScopedImageMappings image_mappings({old_part_.path, new_part_.path});
+    PartitionInfoHasher hasher(
+        old_part_, new_part_, config_.partition_hash_chunk_size);
+    hasher.Start();
+    failed_ = !GeneratePartitionOperations(
+        config_, old_part_, new_part_, blob_file_, &aops_);
+    failed_ = !hasher.Join() || failed_;
+    old_info_ = hasher.old_info();
+    new_info_ = hasher.new_info();
+  }
+
+  const PartitionConfig& new_part() const { return new_part_; }
+  const PartitionInfo& old_info() const { return old_info_; }
+  const PartitionInfo& new_info() const { return new_info_; }
+  bool failed() const { return failed_; }
+  const vector<AnnotatedOperation>& aops() const { return aops_; }
+  void ClearOperations() { vector<AnnotatedOperation>().swap(aops_); }
+
+ private:
+  const PayloadGenerationConfig& config_;
+  const PartitionConfig& old_part_;
+  const PartitionConfig& new_part_;
+  BlobFileWriter* blob_file_;
+
+  vector<AnnotatedOperation> aops_;
+  PartitionInfo old_info_;
+  PartitionInfo new_info_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionProcessor);
+};
+
+// Generates the operations of all the partitions from up to
+// |config.partition_threads| threads, the biggest partitions first, and adds
+// them to the |payload| in the order of the |config|. The payload doesn't
+// depend on the order the partitions finished in, as the blobs are sorted by
+// operation when writing it.
+bool GeneratePartitionsConcurrently(const PayloadGenerationConfig& config,
+                                    BlobFileWriter* blob_file,
+                                    PayloadFile* payload) {
+  const PartitionConfig empty_part("");
+  vector<PartitionProcessor> processors;
+  processors.reserve(config.target.partitions.size());
+  for (size_t i = 0; i < config.target.partitions.size(); i++) {
+    processors.emplace_back(
+        config,
+        config.is_delta ? config.source.partitions[i] : empty_part,
+        config.target.partitions[i],
+        blob_file);
+  }
+  vector<PartitionProcessor*> processors_by_size;
+  for (PartitionProcessor& processor : processors)
+    processors_by_size.push_back(&processor);
+  std::stable_sort(processors_by_size.begin(),
+                   processors_by_size.end(),
+                   [](const PartitionProcessor* a,
+                      const PartitionProcessor* b) {
+                     return a->new_part().size > b->new_part().size;
+                   });
+
+  const size_t num_threads =
+      std::min(config.partition_threads, processors.size());
+  LOG(INFO) << "Generating " << processors.size() << " partitions using "
+            << num_threads << " threads";
+  base::DelegateSimpleThreadPool thread_pool("partition-generator",
+                                             num_threads);
+  thread_pool.Start();
+  for (PartitionProcessor* processor : processors_by_size)
+    thread_pool.AddWork(processor);
+  thread_pool.JoinAll();
+
+  for (PartitionProcessor& processor : processors) {
+    TEST_AND_RETURN_FALSE(!processor.failed());
+    TEST_AND_RETURN_FALSE(
+        payload->AddPartition(processor.new_part().name,
+                              processor.old_info(),
+                              processor.new_info(),
+                              processor.new_part().postinstall,
+                              processor.aops()));
+    processor.ClearOperations();
+  }
+  return true;
+}
+
+// The bytes of samples the zstd dictionary is trained from, as a multiple of
+// its size.
+const size_t kZstdDictionarySamplesRatio = 100;
+
+// Trains the zstd dictionary of the payload from the files of the new
+// partitions small enough to be compressed against it, sampled evenly across
+// the partitions. Returns nullptr if there aren't enough of them.
+unique_ptr<ZstdDictionary> TrainZstdDictionary(
+    const PayloadGenerationConfig& config) {
+  struct SmallFile {
+    const PartitionConfig* part;
+    vector<Extent> extents;
+  };
+  vector<SmallFile> small_files;
+  uint64_t small_files_size = 0;
+  for (const PartitionConfig& part : config.target.partitions) {
+    if (!part.fs_interface)
+      continue;
+    vector<FilesystemInterface::File> files;
+    part.fs_interface->GetFiles(&files);
+    for (FilesystemInterface::File& file : files) {
+      const uint64_t size = BlocksInExtents(file.extents) * config.block_size;
+      if (file.name.empty() || file.name[0] != '/' || size == 0 ||
+          size > ZstdDictionary::kMaxDataSize) {
+        continue;
+      }
+      small_files.push_back({&part, std::move(file.extents)});
+      small_files_size += size;
+    }
+  }
+
+  const uint64_t max_samples_size = static_cast<uint64_t>(
+      config.version.zstd_dictionary_size) * kZstdDictionarySamplesRatio;
+  const size_t step = std::max(small_files_size / max_samples_size,
+                               static_cast<uint64_t>(1));
+  vector<brillo::Blob> samples;
+  brillo::Blob data;
+  for (size_t i = 0; i < small_files.size(); i += step) {
+    const SmallFile& file = small_files[i];
+    if (!ReadImageExtents(file.part->path,
+                          file.extents,
+                          &data,
+                          BlocksInExtents(file.extents) * config.block_size,
+                          config.block_size)) {
+      LOG(ERROR) << "Unable to read the samples of the zstd dictionary.";
+      return nullptr;
+    }
+    if (!utils::IsZeroFilled(data.data(), data.size()))
+      samples.push_back(data);
+  }
+  LOG(INFO) << "Training the zstd dictionary from " << samples.size()
+            << " of the " << small_files.size() << " small files.";
+  return ZstdDictionary::Train(samples, config.version.zstd_dictionary_size);
+}
+
+// Sets the zstd dictionary the operations are compressed against while in
+// scope.
+class ScopedZstdDictionary {
+ public:
+  explicit ScopedZstdDictionary(const ZstdDictionary* dictionary) {
+    ZstdCompressSetDictionary(dictionary);
+  }
+  ~ScopedZstdDictionary() { ZstdCompressSetDictionary(nullptr); }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ScopedZstdDictionary);
+};
+
+}  // namespace
+
 bool GenerateUpdatePayloadFile(
     const PayloadGenerationConfig& config,
     const string& output_path,
     const string& private_key_path,
-    uint64_t* metadata_size) {
+    uint64_t* metadata_size,
+    brillo::KeyValueStore* properties) {
   if (!config.version.Validate()) {
     LOG(ERROR) << "Unsupported major.minor version: " << config.version.major
                << "." << config.version.minor;
     return false;
   }
 
+  XzCompressSetThreads(config.xz_threads);
+  XzCompressSetLevel(config.version.memory_profile.xz_level,
+                     config.version.memory_profile.xz_dict_size);
+
   // Create empty payload file object.
   PayloadFile payload;
   TEST_AND_RETURN_FALSE(payload.Init(config));
 
+  // The dictionary is trained before generating any operation, so all of
+  // them can be compressed against it. The partition shards are generated
+  // without it, so they can't be merged into a payload that has one.
+  if (config.version.zstd_dictionary_size > 0 &&
+      !config.partition_shards.empty()) {
+    LOG(ERROR) << "The partition shards can't be merged with a zstd "
+               << "dictionary.";
+    return false;
+  }
+  unique_ptr<ZstdDictionary> zstd_dictionary;
+  if (config.version.zstd_dictionary_size > 0 &&
+      config.version.OperationAllowed(InstallOperation::REPLACE_ZSTD)) {
+    zstd_dictionary = TrainZstdDictionary(config);
+    if (zstd_dictionary)
+      payload.SetZstdDictionary(zstd_dictionary->data());
+  }
+  ScopedZstdDictionary scoped_zstd_dictionary(zstd_dictionary.get());
+
   const string kTempFileTemplate("CrAU_temp_data.XXXXXX");
   string temp_file_path;
   int data_file_fd;
@@ -81,56 +433,122 @@ bool GenerateUpdatePayloadFile(
       TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
                             config.target.partitions.size());
     }
-    PartitionConfig empty_part("");
-    for (size_t i = 0; i < config.target.partitions.size(); i++) {
-      const PartitionConfig& old_part =
-          config.is_delta ? config.source.partitions[i] : empty_part;
-      const PartitionConfig& new_part = config.target.partitions[i];
-      LOG(INFO) << "Partition name: " << new_part.name;
-      LOG(INFO) << "Partition size: " << new_part.size;
-      LOG(INFO) << "Block count: " << new_part.size / config.block_size;
-
-      // Select payload generation strategy based on the config.
-      unique_ptr<OperationsGenerator> strategy;
-      if (!old_part.path.empty()) {
-        // Delta update.
-        if (config.version.minor == kInPlaceMinorPayloadVersion) {
-          LOG(INFO) << "Using generator InplaceGenerator().";
-          strategy.reset(new InplaceGenerator());
+    if (!config.partition_shards.empty()) {
+      TEST_AND_RETURN_FALSE(config.partition_shards.size() ==
+                            config.target.partitions.size());
+    }
+    if (config.partition_shards.empty() && config.partition_threads > 1) {
+      TEST_AND_RETURN_FALSE(
+          GeneratePartitionsConcurrently(config, &blob_file, &payload));
+    } else {
+      PartitionConfig empty_part("");
+      for (size_t i = 0; i < config.target.partitions.size(); i++) {
+        const PartitionConfig& old_part =
+            config.is_delta ? config.source.partitions[i] : empty_part;
+        const PartitionConfig& new_part = config.target.partitions[i];
+        // The images are read by several phases, from the same mapping.
+        ScopedImageMappings image_mappings({old_part.path, new_part.path});
+        PartitionInfoHasher hasher(
+            old_part, new_part, config.partition_hash_chunk_size);
+        hasher.Start();
+
+        vector<AnnotatedOperation> aops;
+        if (config.partition_shards.empty()) {
+          TEST_AND_RETURN_FALSE(GeneratePartitionOperations(
+              config, old_part, new_part, &blob_file, &aops));
         } else {
-          LOG(INFO) << "Using generator ABGenerator().";
-          strategy.reset(new ABGenerator());
+          LOG(INFO) << "Reading the operations of " << new_part.name << " from "
+                    << config.partition_shards[i];
+          TEST_AND_RETURN_FALSE(ReadPartitionShard(
+              config.partition_shards[i], new_part.name, &blob_file, &aops));
         }
-      } else {
-        LOG(INFO) << "Using generator FullUpdateGenerator().";
-        strategy.reset(new FullUpdateGenerator());
-      }
-
-      vector<AnnotatedOperation> aops;
-      // Generate the operations using the strategy we selected above.
-      TEST_AND_RETURN_FALSE(strategy->GenerateOperations(config,
-                                                         old_part,
-                                                         new_part,
-                                                         &blob_file,
-                                                         &aops));
 
-      // Filter the no-operations. OperationsGenerators should not output this
-      // kind of operations normally, but this is an extra step to fix that if
-      // happened.
-      diff_utils::FilterNoopOperations(&aops);
-
-      TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, aops));
+        TEST_AND_RETURN_FALSE(hasher.Join());
+        TEST_AND_RETURN_FALSE(payload.AddPartition(new_part.name,
+                                                   hasher.old_info(),
+                                                   hasher.new_info(),
+                                                   new_part.postinstall,
+                                                   aops));
+      }
     }
+    for (const PartitionConfig& new_part : config.target.partitions)
+      TEST_AND_RETURN_FALSE(payload.SetHashTree(new_part, config.block_size));
   }
 
+  diff_utils::LogFullOperationStats();
+
   LOG(INFO) << "Writing payload file...";
   // Write payload file to disk.
   TEST_AND_RETURN_FALSE(payload.WritePayload(output_path, temp_file_path,
                                              private_key_path, metadata_size));
+  if (properties)
+    *properties = payload.properties();
 
   LOG(INFO) << "All done. Successfully created delta file with "
             << "metadata size = " << *metadata_size;
   return true;
 }
 
+bool GeneratePartitionShard(const PayloadGenerationConfig& config,
+                            const string& partition_name,
+                            const string& shard_path) {
+  if (!config.version.Validate()) {
+    LOG(ERROR) << "Unsupported major.minor version: " << config.version.major
+               << "." << config.version.minor;
+    return false;
+  }
+  if (config.is_delta) {
+    TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
+                          config.target.partitions.size());
+  }
+  size_t index = 0;
+  while (index < config.target.partitions.size() &&
+         config.target.partitions[index].name != partition_name) {
+    index++;
+  }
+  if (index == config.target.partitions.size()) {
+    LOG(ERROR) << "No partition " << partition_name << " in the target image.";
+    return false;
+  }
+  if (config.version.zstd_dictionary_size > 0) {
+    LOG(ERROR) << "The partition shards can't be generated with a zstd "
+               << "dictionary, which is trained from all the partitions.";
+    return false;
+  }
+  PartitionConfig empty_part("");
+  const PartitionConfig& old_part =
+      config.is_delta ? config.source.partitions[index] : empty_part;
+  const PartitionConfig& new_part = config.target.partitions[index];
+
+  XzCompressSetThreads(config.xz_threads);
+  XzCompressSetLevel(config.version.memory_profile.xz_level,
+                     config.version.memory_profile.xz_dict_size);
+
+  const string kTempFileTemplate("CrAU_temp_data.XXXXXX");
+  string temp_file_path;
+  int data_file_fd;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(kTempFileTemplate, &temp_file_path, &data_file_fd));
+  ScopedPathUnlinker temp_file_unlinker(temp_file_path);
+  TEST_AND_RETURN_FALSE(data_file_fd >= 0);
+
+  vector<AnnotatedOperation> aops;
+  {
+    off_t data_file_size = 0;
+    ScopedFdCloser data_file_fd_closer(&data_file_fd);
+    BlobFileWriter blob_file(data_file_fd, &data_file_size);
+    ScopedImageMappings image_mappings({old_part.path, new_part.path});
+    TEST_AND_RETURN_FALSE(GeneratePartitionOperations(
+        config, old_part, new_part, &blob_file, &aops));
+  }
+
+  diff_utils::LogFullOperationStats();
+
+  TEST_AND_RETURN_FALSE(
+      WritePartitionShard(shard_path, partition_name, aops, temp_file_path));
+  LOG(INFO) << "Wrote the " << aops.size() << " operations of "
+            << partition_name << " to " << shard_path;
+  return true;
+}
+
 };  // namespace chromeos_update_engine
@@ -19,6 +19,8 @@
 
 #include <string>
 
+#include <brillo/key_value_store.h>
+
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
@@ -35,11 +37,24 @@ extern const size_t kRootFSPartitionSize;
 // Pass empty string to not sign the update.
 // |output_path| is the filename where the delta update should be written.
 // Returns true on success. Also writes the size of the metadata into
-// |metadata_size|.
+// |metadata_size| and, if not null, the payload properties computed while
+// writing the payload into |properties|.
 bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                const std::string& output_path,
                                const std::string& private_key_path,
-                               uint64_t* metadata_size);
+                               uint64_t* metadata_size,
+                               brillo::KeyValueStore* properties);
+
+// Generates the operations of the single target partition |partition_name| of
+// the payload described by |config|, and writes them with their data blobs to
+// the partition shard file |shard_path|. The shards of all the partitions,
+// maybe generated on different machines, are merged by passing them in the
+// PayloadGenerationConfig |partition_shards| to GenerateUpdatePayloadFile(),
+// which then writes the same payload as when generating every partition
+// itself. Returns true on success.
+bool GeneratePartitionShard(const PayloadGenerationConfig& config,
+                            const std::string& partition_name,
+                            const std::string& shard_path);
 
 
 };  // namespace chromeos_update_engine
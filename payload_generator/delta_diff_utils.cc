@@ -16,22 +16,44 @@
 
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
 
 #include <base/files/file_util.h>
 #include <base/format_macros.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/stringprintf.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+#include <base/time/time.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/bsdiff_generator.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/image_index_cache.h"
+#include "update_engine/payload_generator/imgdiff_generator.h"
+#include "update_engine/payload_generator/mapped_image.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::map;
 using std::string;
@@ -41,20 +63,20 @@ namespace chromeos_update_engine {
 namespace {
 
 const char* const kBsdiffPath = "bsdiff";
-const char* const kImgdiffPath = "imgdiff";
-
-// The maximum destination size allowed for bsdiff. In general, bsdiff should
-// work for arbitrary big files, but the payload generation and payload
-// application requires a significant amount of RAM. We put a hard-limit of
-// 200 MiB that should not affect any released board, but will limit the
-// Chrome binary in ASan builders.
-const uint64_t kMaxBsdiffDestinationSize = 200 * 1024 * 1024;  // bytes
 
 // The maximum destination size allowed for imgdiff. In general, imgdiff should
 // work for arbitrary big files, but the payload application is quite memory
 // intensive, so we limit these operations to 50 MiB.
 const uint64_t kMaxImgdiffDestinationSize = 50 * 1024 * 1024;  // bytes
 
+// The fraction of the physical memory used by the files diffed at the same
+// time, as estimated by EstimateDiffMemory().
+const uint64_t kDiffMemoryBudgetDivisor = 2;
+
+// The fraction of the physical memory used to keep the bsdiff indexes of the
+// old data diffed, in case the same data is diffed again.
+const uint64_t kIndexCacheDivisor = 8;
+
 // Process a range of blocks from |range_start| to |range_end| in the extent at
 // position |*idx_p| of |extents|. If |do_remove| is true, this range will be
 // removed, which may cause the extent to be trimmed, split or removed entirely.
@@ -153,13 +175,259 @@ size_t RemoveIdenticalBlockRanges(vector<Extent>* src_extents,
   return removed_bytes;
 }
 
-// Returns true if the given blob |data| contains gzip header magic.
-bool ContainsGZip(const brillo::Blob& data) {
-  const uint8_t kGZipMagic[] = {0x1f, 0x8b, 0x08, 0x00};
-  return std::search(data.begin(),
-                     data.end(),
-                     std::begin(kGZipMagic),
-                     std::end(kGZipMagic)) != data.end();
+// The number of evenly spread slices sampled from the data to compress.
+const size_t kCompressionSampleSlices = 16;
+
+// The number of times GenerateBestFullOperation() skipped the compressors, to
+// tune the CompressionHeuristics against the payload size.
+std::atomic<uint64_t> full_operations_count{0};
+std::atomic<uint64_t> full_operations_entropy_skips{0};
+std::atomic<uint64_t> full_operations_bzip_skips{0};
+
+// Returns up to |sample_size| bytes of |data|, taken from evenly spread slices
+// of it. The whole |data| is returned if it's not larger than |sample_size|.
+brillo::Blob SampleData(const brillo::Blob& data, size_t sample_size) {
+  if (data.size() <= sample_size)
+    return data;
+  const size_t slice_size =
+      std::max(sample_size / kCompressionSampleSlices, static_cast<size_t>(1));
+  const size_t num_slices = sample_size / slice_size;
+  const size_t stride = data.size() / num_slices;
+  brillo::Blob sample;
+  sample.reserve(num_slices * slice_size);
+  for (size_t i = 0; i < num_slices; i++) {
+    auto slice_begin = data.begin() + i * stride;
+    sample.insert(sample.end(), slice_begin, slice_begin + slice_size);
+  }
+  return sample;
+}
+
+// Returns an estimate of the memory needed to diff the chunks of up to
+// |chunk_blocks| blocks of a file with the |old_extents| and |new_extents|.
+// bsdiff keeps the suffix array of the old data and its scratch space, 16 bytes
+// per byte, besides both the old and the new data.
+uint64_t EstimateDiffMemory(const vector<Extent>& old_extents,
+                            const vector<Extent>& new_extents,
+                            ssize_t chunk_blocks) {
+  uint64_t old_blocks = BlocksInExtents(old_extents);
+  uint64_t new_blocks = BlocksInExtents(new_extents);
+  if (chunk_blocks != -1) {
+    old_blocks = std::min(old_blocks, static_cast<uint64_t>(chunk_blocks));
+    new_blocks = std::min(new_blocks, static_cast<uint64_t>(chunk_blocks));
+  }
+  return (old_blocks * 17 + new_blocks * 2) * kBlockSize;
+}
+
+// Limits the estimated memory used by the files diffed at the same time to a
+// budget. A file over the budget is diffed alone.
+class DiffMemoryBudget {
+ public:
+  explicit DiffMemoryBudget(uint64_t budget)
+      : budget_(budget), released_cv_(&lock_) {}
+
+  // Waits until |bytes| fit in the budget along with the files being diffed,
+  // and takes them.
+  void Acquire(uint64_t bytes) {
+    base::AutoLock auto_lock(lock_);
+    while (used_ > 0 && used_ + bytes > budget_)
+      released_cv_.Wait();
+    used_ += bytes;
+  }
+
+  // Returns the |bytes| taken with Acquire() to the budget.
+  void Release(uint64_t bytes) {
+    base::AutoLock auto_lock(lock_);
+    used_ -= bytes;
+    released_cv_.Broadcast();
+  }
+
+ private:
+  const uint64_t budget_;
+  uint64_t used_{0};
+
+  base::Lock lock_;
+  base::ConditionVariable released_cv_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffMemoryBudget);
+};
+
+// This class encapsulates the generation of the operations of a single file
+// from a worker thread, calling DeltaReadFile() once the file fits in the
+// memory budget. The operations are kept so they are merged in the order of
+// the files.
+class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  FileDeltaProcessor(const string& old_part,
+                     const string& new_part,
+                     const PayloadVersion& version,
+                     const vector<Extent>& old_extents,
+                     const vector<Extent>& new_extents,
+                     const string& name,
+                     ssize_t chunk_blocks,
+                     BlobFileWriter* blob_file,
+                     BsdiffIndexCache* index_cache,
+                     DiffCache* diff_cache,
+                     DiffMemoryBudget* memory_budget)
+      : old_part_(old_part),
+        new_part_(new_part),
+        version_(version),
+        old_extents_(old_extents),
+        new_extents_(new_extents),
+        name_(name),
+        chunk_blocks_(chunk_blocks),
+        blob_file_(blob_file),
+        index_cache_(index_cache),
+        diff_cache_(diff_cache),
+        memory_budget_(memory_budget) {}
+  FileDeltaProcessor(FileDeltaProcessor&&) = default;
+  ~FileDeltaProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override;
+
+  // Appends the operations generated for the file to |aops|. Returns false if
+  // they couldn't be generated.
+  bool MergeOperations(vector<AnnotatedOperation>* aops);
+
+  // The number of blocks of the new file, which the diff time grows with.
+  uint64_t new_blocks() const { return BlocksInExtents(new_extents_); }
+
+ private:
+  const string& old_part_;
+  const string& new_part_;
+  const PayloadVersion& version_;
+
+  // The file's old and new extents, its name and the chunk limit.
+  vector<Extent> old_extents_;
+  vector<Extent> new_extents_;
+  string name_;
+  ssize_t chunk_blocks_;
+
+  BlobFileWriter* blob_file_;
+  BsdiffIndexCache* index_cache_;
+  DiffCache* diff_cache_;
+  DiffMemoryBudget* memory_budget_;
+
+  // The operations generated, and whether the generation failed.
+  vector<AnnotatedOperation> file_aops_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(FileDeltaProcessor);
+};
+
+void FileDeltaProcessor::Run() {
+  const uint64_t memory =
+      EstimateDiffMemory(old_extents_, new_extents_, chunk_blocks_);
+  memory_budget_->Acquire(memory);
+  LOG(INFO) << "Encoding file " << name_ << " ("
+            << BlocksInExtents(new_extents_) << " blocks)";
+  GenerationProfile* profile = GenerationProfile::current();
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  base::ThreadTicks start_cpu_time;
+  if (profile && base::ThreadTicks::IsSupported())
+    start_cpu_time = base::ThreadTicks::Now();
+  failed_ = !diff_utils::DeltaReadFile(&file_aops_,
+                                       old_part_,
+                                       new_part_,
+                                       old_extents_,
+                                       new_extents_,
+                                       name_,
+                                       chunk_blocks_,
+                                       version_,
+                                       blob_file_,
+                                       index_cache_,
+                                       diff_cache_);
+  memory_budget_->Release(memory);
+  if (profile) {
+    base::TimeDelta cpu_time;
+    if (base::ThreadTicks::IsSupported())
+      cpu_time = base::ThreadTicks::Now() - start_cpu_time;
+    profile->AddFile(name_, base::TimeTicks::Now() - start_time, cpu_time,
+                     BlocksInExtents(new_extents_) * kBlockSize);
+  }
+  LOG_IF(ERROR, failed_) << "Failed to generate delta for " << name_ << " ("
+                         << BlocksInExtents(new_extents_) << " blocks)";
+}
+
+bool FileDeltaProcessor::MergeOperations(vector<AnnotatedOperation>* aops) {
+  if (failed_)
+    return false;
+  std::move(file_aops_.begin(), file_aops_.end(), std::back_inserter(*aops));
+  file_aops_.clear();
+  return true;
+}
+
+// Adds to |processors| the processors to diff the file |name| in windows of up
+// to |window_blocks| blocks of the |new_extents|, each one against the blocks
+// at the same offset in the |old_extents|. The windows are named after the file
+// and their index when the file doesn't fit in a single one.
+void AddWindowProcessors(vector<FileDeltaProcessor>* processors,
+                         const string& old_part,
+                         const string& new_part,
+                         const PayloadVersion& version,
+                         const vector<Extent>& old_extents,
+                         const vector<Extent>& new_extents,
+                         const string& name,
+                         uint64_t window_blocks,
+                         BlobFileWriter* blob_file,
+                         BsdiffIndexCache* index_cache,
+                         DiffCache* diff_cache,
+                         DiffMemoryBudget* memory_budget) {
+  const uint64_t total_blocks = BlocksInExtents(new_extents);
+  if (total_blocks <= window_blocks) {
+    processors->emplace_back(old_part,
+                             new_part,
+                             version,
+                             old_extents,
+                             new_extents,
+                             name,
+                             -1,  // chunk_blocks
+                             blob_file,
+                             index_cache,
+                             diff_cache,
+                             memory_budget);
+    return;
+  }
+
+  for (uint64_t block_offset = 0; block_offset < total_blocks;
+       block_offset += window_blocks) {
+    const uint64_t blocks = std::min(window_blocks,
+                                     total_blocks - block_offset);
+    vector<Extent> old_window =
+        ExtentsSublist(old_extents, block_offset, blocks);
+    vector<Extent> new_window =
+        ExtentsSublist(new_extents, block_offset, blocks);
+    NormalizeExtents(&old_window);
+    NormalizeExtents(&new_window);
+    processors->emplace_back(
+        old_part,
+        new_part,
+        version,
+        old_window,
+        new_window,
+        base::StringPrintf("%s:%" PRIu64, name.c_str(),
+                           block_offset / window_blocks),
+        -1,  // chunk_blocks
+        blob_file,
+        index_cache,
+        diff_cache,
+        memory_budget);
+  }
+}
+
+// Stores in |files| the files of the filesystem of |part|, looked up in the
+// |image_index_cache| first when it isn't null.
+void GetPartitionFiles(const PartitionConfig& part,
+                       ImageIndexCache* image_index_cache,
+                       vector<FilesystemInterface::File>* files) {
+  const size_t block_size = part.fs_interface->GetBlockSize();
+  if (image_index_cache &&
+      image_index_cache->LookupFiles(part.path, block_size, files)) {
+    return;
+  }
+  part.fs_interface->GetFiles(files);
+  if (image_index_cache)
+    image_index_cache->StoreFiles(part.path, block_size, *files);
 }
 
 }  // namespace
@@ -171,34 +439,101 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
+                        uint64_t diff_memory_limit,
+                        const string& diff_cache_dir,
                         const PayloadVersion& version,
                         BlobFileWriter* blob_file) {
+  ScopedProfilePhase profile_phase("DeltaReadPartition", new_part.size);
   ExtentRanges old_visited_blocks;
   ExtentRanges new_visited_blocks;
+  // The clients build the hash tree, so no operation writes it.
+  new_visited_blocks.AddExtents(new_part.HashTreeExtents(kBlockSize));
 
-  TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(
-      aops,
-      old_part.path,
-      new_part.path,
-      old_part.size / kBlockSize,
-      new_part.size / kBlockSize,
-      soft_chunk_blocks,
-      version,
-      blob_file,
-      &old_visited_blocks,
-      &new_visited_blocks));
+  // The block hashes and the files of the images are kept next to the cached
+  // diffs, so the images shared by several payloads are only indexed once.
+  std::unique_ptr<ImageIndexCache> image_index_cache;
+  if (!diff_cache_dir.empty())
+    image_index_cache.reset(new ImageIndexCache(diff_cache_dir));
+
+  vector<BlockMapping::BlockId> old_block_ids;
+  vector<BlockMapping::BlockId> new_block_ids;
+  TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part.path,
+                                           new_part.path,
+                                           old_part.size,
+                                           new_part.size,
+                                           kBlockSize,
+                                           image_index_cache.get(),
+                                           &old_block_ids,
+                                           &new_block_ids));
 
   map<string, vector<Extent>> old_files_map;
+  vector<FilesystemInterface::File> old_files;
   if (old_part.fs_interface) {
-    vector<FilesystemInterface::File> old_files;
-    old_part.fs_interface->GetFiles(&old_files);
+    GetPartitionFiles(old_part, image_index_cache.get(), &old_files);
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file.extents;
   }
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  new_part.fs_interface->GetFiles(&new_files);
+  GetPartitionFiles(new_part, image_index_cache.get(), &new_files);
+
+  // The renamed and moved files are diffed against their old version, and the
+  // unchanged ones are copied.
+  MatchRenamedFiles(
+      old_files, new_files, old_block_ids, new_block_ids, &old_files_map);
+
+  // The unchanged files are copied from their own old blocks before looking
+  // for the identical blocks anywhere in the old partition. The in-place
+  // updates already keep the blocks that didn't move.
+  if (version.OperationAllowed(InstallOperation::SOURCE_COPY)) {
+    DeltaUnchangedFiles(aops,
+                        old_files_map,
+                        new_files,
+                        old_block_ids,
+                        new_block_ids,
+                        soft_chunk_blocks,
+                        &old_visited_blocks,
+                        &new_visited_blocks);
+  }
+
+  TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
+                                                new_part.path,
+                                                old_block_ids,
+                                                new_block_ids,
+                                                soft_chunk_blocks,
+                                                version,
+                                                blob_file,
+                                                &old_visited_blocks,
+                                                &new_visited_blocks));
+
+  // The files are diffed from a thread pool once their blocks are assigned,
+  // within a memory budget since bsdiff needs several times the size of the
+  // file. The operations are merged in the order of the files afterwards.
+  // The budget is shared by the partitions generated at the same time.
+  const uint64_t physical_memory =
+      static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+  const uint64_t memory_budget_size =
+      physical_memory / kDiffMemoryBudgetDivisor;
+  static DiffMemoryBudget* const memory_budget =
+      new DiffMemoryBudget(memory_budget_size);
+  BsdiffIndexCache index_cache(physical_memory / kIndexCacheDivisor);
+  std::unique_ptr<DiffCache> diff_cache;
+  if (!diff_cache_dir.empty())
+    diff_cache.reset(new DiffCache(diff_cache_dir));
+  vector<FileDeltaProcessor> file_delta_processors;
+
+  // Files bigger than a window are diffed as independent files, each window
+  // against the old data at the same offset in the old file.
+  uint64_t file_window_blocks = DiffWindowBlocks(
+      diff_memory_limit ? diff_memory_limit : memory_budget_size,
+      version.memory_profile.max_bsdiff_destination_size);
+  if (hard_chunk_blocks != -1) {
+    file_window_blocks = std::min(file_window_blocks,
+                                  static_cast<uint64_t>(hard_chunk_blocks));
+  }
+  LOG(INFO) << "Diffing files in windows of up to " << file_window_blocks
+            << " blocks.";
 
   // The processing is very straightforward here, we generate operations for
   // every file (and pseudo-file such as the metadata) in the new filesystem
@@ -219,8 +554,6 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     if (new_file_extents.empty())
       continue;
 
-    LOG(INFO) << "Encoding file " << new_file.name << " ("
-              << BlocksInExtents(new_file_extents) << " blocks)";
 
     // We can't visit each dst image inode more than once, as that would
     // duplicate work. Here, we avoid visiting each source image inode
@@ -234,49 +567,97 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
         old_files_map[new_file.name], old_visited_blocks);
     old_visited_blocks.AddExtents(old_file_extents);
 
-    TEST_AND_RETURN_FALSE(DeltaReadFile(aops,
-                                        old_part.path,
-                                        new_part.path,
-                                        old_file_extents,
-                                        new_file_extents,
-                                        new_file.name,  // operation name
-                                        hard_chunk_blocks,
-                                        version,
-                                        blob_file));
+    AddWindowProcessors(&file_delta_processors,
+                        old_part.path,
+                        new_part.path,
+                        version,
+                        old_file_extents,
+                        new_file_extents,
+                        new_file.name,  // operation name
+                        file_window_blocks,
+                        blob_file,
+                        &index_cache,
+                        diff_cache.get(),
+                        memory_budget);
   }
   // Process all the blocks not included in any file. We provided all the unused
   // blocks in the old partition as available data.
   vector<Extent> new_unvisited = {
       ExtentForRange(0, new_part.size / kBlockSize)};
   new_unvisited = FilterExtentRanges(new_unvisited, new_visited_blocks);
-  if (new_unvisited.empty())
-    return true;
+  if (!new_unvisited.empty()) {
+    vector<Extent> old_unvisited;
+    if (old_part.fs_interface) {
+      old_unvisited.push_back(ExtentForRange(0, old_part.size / kBlockSize));
+      old_unvisited = FilterExtentRanges(old_unvisited, old_visited_blocks);
+    }
 
-  vector<Extent> old_unvisited;
-  if (old_part.fs_interface) {
-    old_unvisited.push_back(ExtentForRange(0, old_part.size / kBlockSize));
-    old_unvisited = FilterExtentRanges(old_unvisited, old_visited_blocks);
-  }
-
-  LOG(INFO) << "Scanning " << BlocksInExtents(new_unvisited)
-            << " unwritten blocks using chunk size of "
-            << soft_chunk_blocks << " blocks.";
-  // We use the soft_chunk_blocks limit for the <non-file-data> as we don't
-  // really know the structure of this data and we should not expect it to have
-  // redundancy between partitions.
-  TEST_AND_RETURN_FALSE(DeltaReadFile(aops,
-                                      old_part.path,
-                                      new_part.path,
-                                      old_unvisited,
-                                      new_unvisited,
-                                      "<non-file-data>",  // operation name
-                                      soft_chunk_blocks,
-                                      version,
-                                      blob_file));
+    LOG(INFO) << "Scanning " << BlocksInExtents(new_unvisited)
+              << " unwritten blocks using chunk size of "
+              << soft_chunk_blocks << " blocks.";
+    // We use the soft_chunk_blocks limit for the <non-file-data> as we don't
+    // really know the structure of this data and we should not expect it to
+    // have redundancy between partitions.
+    AddWindowProcessors(&file_delta_processors,
+                        old_part.path,
+                        new_part.path,
+                        version,
+                        old_unvisited,
+                        new_unvisited,
+                        "<non-file-data>",  // operation name
+                        soft_chunk_blocks,
+                        blob_file,
+                        &index_cache,
+                        diff_cache.get(),
+                        memory_budget);
+  }
+
+  size_t max_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  LOG(INFO) << "Diffing " << file_delta_processors.size() << " windows using "
+            << max_threads << " threads";
+  base::DelegateSimpleThreadPool thread_pool("delta-read-partition",
+                                             max_threads);
+  thread_pool.Start();
+  // The biggest files are started first, so the last ones to finish are small.
+  vector<FileDeltaProcessor*> processors_by_size;
+  processors_by_size.reserve(file_delta_processors.size());
+  for (FileDeltaProcessor& processor : file_delta_processors)
+    processors_by_size.push_back(&processor);
+  std::stable_sort(processors_by_size.begin(),
+                   processors_by_size.end(),
+                   [](const FileDeltaProcessor* a,
+                      const FileDeltaProcessor* b) {
+                     return a->new_blocks() > b->new_blocks();
+                   });
+  for (FileDeltaProcessor* processor : processors_by_size)
+    thread_pool.AddWork(processor);
+  thread_pool.JoinAll();
+  if (diff_cache) {
+    LOG(INFO) << "Diff cache: " << diff_cache->hits() << " hits, "
+              << diff_cache->misses() << " misses.";
+  }
+  if (image_index_cache) {
+    LOG(INFO) << "Image index cache: " << image_index_cache->hits()
+              << " hits, " << image_index_cache->misses() << " misses.";
+  }
+
+  // The blobs are stored in the order the files finished, but the payload
+  // stores them in the order of the operations.
+  for (FileDeltaProcessor& processor : file_delta_processors)
+    TEST_AND_RETURN_FALSE(processor.MergeOperations(aops));
 
   return true;
 }
 
+uint64_t DiffWindowBlocks(uint64_t memory_limit,
+                          uint64_t max_bsdiff_destination_size) {
+  // EstimateDiffMemory() of a window of the same size in the old and new data.
+  uint64_t window_blocks = memory_limit / (19 * kBlockSize);
+  window_blocks = std::min(window_blocks,
+                           max_bsdiff_destination_size / kBlockSize);
+  return std::max(window_blocks, static_cast<uint64_t>(1));
+}
+
 bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              const string& old_part,
                              const string& new_part,
@@ -294,8 +675,31 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                                            old_num_blocks * kBlockSize,
                                            new_num_blocks * kBlockSize,
                                            kBlockSize,
+                                           nullptr,  // image_index_cache
                                            &old_block_ids,
                                            &new_block_ids));
+  return DeltaMovedAndZeroBlocks(aops,
+                                 new_part,
+                                 old_block_ids,
+                                 new_block_ids,
+                                 chunk_blocks,
+                                 version,
+                                 blob_file,
+                                 old_visited_blocks,
+                                 new_visited_blocks);
+}
+
+bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
+                             const string& new_part,
+                             const vector<BlockMapping::BlockId>& old_block_ids,
+                             const vector<BlockMapping::BlockId>& new_block_ids,
+                             ssize_t chunk_blocks,
+                             const PayloadVersion& version,
+                             BlobFileWriter* blob_file,
+                             ExtentRanges* old_visited_blocks,
+                             ExtentRanges* new_visited_blocks) {
+  const uint64_t old_num_blocks = old_block_ids.size();
+  const uint64_t new_num_blocks = new_block_ids.size();
 
   // If the update is inplace, we map all the blocks that didn't move,
   // regardless of the contents since they are already copied and no operation
@@ -376,7 +780,9 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                                         "<zeros>",
                                         chunk_blocks,
                                         version,
-                                        blob_file));
+                                        blob_file,
+                                        nullptr,    // index_cache
+                                        nullptr));  // diff_cache
   }
   LOG(INFO) << "Produced " << (aops->size() - num_ops) << " operations for "
             << BlocksInExtents(new_zeros) << " zeroed blocks";
@@ -428,6 +834,304 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   return true;
 }
 
+void DeltaUnchangedFiles(vector<AnnotatedOperation>* aops,
+                         const map<string, vector<Extent>>& old_files_map,
+                         const vector<FilesystemInterface::File>& new_files,
+                         const vector<BlockMapping::BlockId>& old_block_ids,
+                         const vector<BlockMapping::BlockId>& new_block_ids,
+                         ssize_t chunk_blocks,
+                         ExtentRanges* old_visited_blocks,
+                         ExtentRanges* new_visited_blocks) {
+  size_t num_ops = aops->size();
+  uint64_t num_files = 0, num_blocks = 0;
+  for (const FilesystemInterface::File& new_file : new_files) {
+    auto old_file_it = old_files_map.find(new_file.name);
+    if (old_file_it == old_files_map.end())
+      continue;
+    const vector<Extent>& old_extents = old_file_it->second;
+    const vector<Extent>& new_extents = new_file.extents;
+    uint64_t file_blocks = BlocksInExtents(new_extents);
+    if (file_blocks == 0 || file_blocks != BlocksInExtents(old_extents))
+      continue;
+    // Hardlinks and files sharing blocks with others are left to the diff.
+    if (BlocksInExtents(FilterExtentRanges(old_extents, *old_visited_blocks)) !=
+            file_blocks ||
+        BlocksInExtents(FilterExtentRanges(new_extents, *new_visited_blocks)) !=
+            file_blocks) {
+      continue;
+    }
+
+    vector<uint64_t> old_blocks = ExpandExtents(old_extents);
+    vector<uint64_t> new_blocks = ExpandExtents(new_extents);
+    bool unchanged = true;
+    for (size_t i = 0; i < new_blocks.size() && unchanged; i++) {
+      // The zeroed blocks are never read from the source partition.
+      unchanged = old_blocks[i] < old_block_ids.size() &&
+                  new_blocks[i] < new_block_ids.size() &&
+                  new_block_ids[new_blocks[i]] != 0 &&
+                  old_block_ids[old_blocks[i]] == new_block_ids[new_blocks[i]];
+    }
+    if (!unchanged)
+      continue;
+
+    uint64_t op_blocks = chunk_blocks == -1 ? file_blocks : chunk_blocks;
+    for (uint64_t block_offset = 0; block_offset < file_blocks;
+         block_offset += op_blocks) {
+      uint64_t chunk_num_blocks = std::min(file_blocks - block_offset,
+                                           op_blocks);
+      aops->emplace_back();
+      AnnotatedOperation* aop = &aops->back();
+      aop->name = new_file.name;
+      aop->op.set_type(InstallOperation::SOURCE_COPY);
+      StoreExtents(ExtentsSublist(old_extents, block_offset, chunk_num_blocks),
+                   aop->op.mutable_src_extents());
+      StoreExtents(ExtentsSublist(new_extents, block_offset, chunk_num_blocks),
+                   aop->op.mutable_dst_extents());
+    }
+    old_visited_blocks->AddExtents(old_extents);
+    new_visited_blocks->AddExtents(new_extents);
+    num_files++;
+    num_blocks += file_blocks;
+  }
+  LOG(INFO) << "Produced " << (aops->size() - num_ops) << " operations for "
+            << num_files << " unchanged files with " << num_blocks
+            << " blocks";
+}
+
+bool IsPartitionUnchanged(const PartitionConfig& old_part,
+                          const PartitionConfig& new_part,
+                          ImageIndexCache* image_index_cache,
+                          bool* unchanged) {
+  *unchanged = false;
+  if (old_part.path.empty() || old_part.size != new_part.size ||
+      new_part.size % kBlockSize != 0) {
+    return true;
+  }
+  const size_t num_blocks = new_part.size / kBlockSize;
+  vector<uint8_t> old_hashes;
+  vector<uint8_t> new_hashes;
+  if (image_index_cache &&
+      image_index_cache->LookupBlockHashes(
+          old_part.path, kBlockSize, num_blocks, &old_hashes) &&
+      image_index_cache->LookupBlockHashes(
+          new_part.path, kBlockSize, num_blocks, &new_hashes)) {
+    *unchanged = old_hashes == new_hashes;
+    return true;
+  }
+
+  const MappedImage* old_image = MappedImage::Find(old_part.path);
+  const MappedImage* new_image = MappedImage::Find(new_part.path);
+  if (old_image && new_image && old_image->size() >= new_part.size &&
+      new_image->size() >= new_part.size) {
+    *unchanged = memcmp(old_image->data(), new_image->data(), new_part.size) ==
+                 0;
+    return true;
+  }
+
+  int old_fd = HANDLE_EINTR(open(old_part.path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(old_fd >= 0);
+  ScopedFdCloser old_fd_closer(&old_fd);
+  int new_fd = HANDLE_EINTR(open(new_part.path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  ScopedFdCloser new_fd_closer(&new_fd);
+  const uint64_t kCompareChunkSize = 1024 * 1024;
+  brillo::Blob old_data(kCompareChunkSize);
+  brillo::Blob new_data(kCompareChunkSize);
+  for (uint64_t offset = 0; offset < new_part.size;
+       offset += kCompareChunkSize) {
+    const size_t size = std::min(kCompareChunkSize, new_part.size - offset);
+    ssize_t old_bytes_read = -1;
+    ssize_t new_bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        old_fd, old_data.data(), size, offset, &old_bytes_read));
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        new_fd, new_data.data(), size, offset, &new_bytes_read));
+    if (old_bytes_read != static_cast<ssize_t>(size) ||
+        new_bytes_read != static_cast<ssize_t>(size) ||
+        memcmp(old_data.data(), new_data.data(), size) != 0) {
+      return true;
+    }
+  }
+  *unchanged = true;
+  return true;
+}
+
+void DeltaUnchangedPartition(vector<AnnotatedOperation>* aops,
+                             const PartitionConfig& new_part,
+                             ssize_t chunk_blocks) {
+  ExtentRanges blocks;
+  blocks.AddExtent(ExtentForRange(0, new_part.size / kBlockSize));
+  // The clients build the hash tree, so no operation writes it.
+  blocks.SubtractExtents(new_part.HashTreeExtents(kBlockSize));
+  const size_t num_ops = aops->size();
+  for (const Extent& extent : blocks.extent_set()) {
+    const uint64_t op_blocks =
+        chunk_blocks == -1 ? extent.num_blocks() : chunk_blocks;
+    for (uint64_t block_offset = 0; block_offset < extent.num_blocks();
+         block_offset += op_blocks) {
+      const Extent chunk = ExtentForRange(
+          extent.start_block() + block_offset,
+          std::min(extent.num_blocks() - block_offset, op_blocks));
+      aops->emplace_back();
+      AnnotatedOperation* aop = &aops->back();
+      aop->name = "<unchanged-partition>";
+      aop->op.set_type(InstallOperation::SOURCE_COPY);
+      *aop->op.add_src_extents() = chunk;
+      *aop->op.add_dst_extents() = chunk;
+    }
+  }
+  LOG(INFO) << "Partition " << new_part.name << " is unchanged, copying its "
+            << blocks.blocks() << " blocks in " << (aops->size() - num_ops)
+            << " operations.";
+}
+
+size_t MatchRenamedFiles(const vector<FilesystemInterface::File>& old_files,
+                         const vector<FilesystemInterface::File>& new_files,
+                         const vector<BlockMapping::BlockId>& old_block_ids,
+                         const vector<BlockMapping::BlockId>& new_block_ids,
+                         map<string, vector<Extent>>* old_files_map) {
+  // Only the regular paths are matched, not the pseudo-files like the
+  // metadata or the free space.
+  auto is_path = [](const string& name) {
+    return !name.empty() && name[0] == '/';
+  };
+  std::set<string> new_names;
+  for (const FilesystemInterface::File& new_file : new_files)
+    new_names.insert(new_file.name);
+
+  // The old files removed from the new filesystem, and the new files without
+  // an old file of the same name.
+  vector<const FilesystemInterface::File*> removed_files;
+  for (const FilesystemInterface::File& old_file : old_files) {
+    if (is_path(old_file.name) && !old_file.extents.empty() &&
+        new_names.count(old_file.name) == 0) {
+      removed_files.push_back(&old_file);
+    }
+  }
+  vector<const FilesystemInterface::File*> added_files;
+  for (const FilesystemInterface::File& new_file : new_files) {
+    if (is_path(new_file.name) && !new_file.extents.empty() &&
+        old_files_map->count(new_file.name) == 0) {
+      added_files.push_back(&new_file);
+    }
+  }
+  if (removed_files.empty() || added_files.empty())
+    return 0;
+
+  // The removed file holding each block id, or -1. The ids held by several
+  // files are kept by the first one, and the zero blocks are ignored.
+  vector<int64_t> id_files;
+  for (size_t i = 0; i < removed_files.size(); i++) {
+    for (const Extent& extent : removed_files[i]->extents) {
+      for (uint64_t block = extent.start_block();
+           block < extent.start_block() + extent.num_blocks() &&
+           block < old_block_ids.size();
+           block++) {
+        const BlockMapping::BlockId id = old_block_ids[block];
+        if (id == 0)
+          continue;
+        if (static_cast<size_t>(id) >= id_files.size())
+          id_files.resize(id + 1, -1);
+        if (id_files[id] == -1)
+          id_files[id] = i;
+      }
+    }
+  }
+
+  // The removed file sharing the most blocks with each added file.
+  struct Match {
+    uint64_t shared_blocks;
+    size_t added_index;
+    size_t removed_index;
+  };
+  vector<Match> matches;
+  for (size_t i = 0; i < added_files.size(); i++) {
+    std::unordered_map<size_t, uint64_t> shared_blocks;
+    for (const Extent& extent : added_files[i]->extents) {
+      for (uint64_t block = extent.start_block();
+           block < extent.start_block() + extent.num_blocks() &&
+           block < new_block_ids.size();
+           block++) {
+        const BlockMapping::BlockId id = new_block_ids[block];
+        if (id != 0 && static_cast<size_t>(id) < id_files.size() &&
+            id_files[id] != -1) {
+          shared_blocks[id_files[id]]++;
+        }
+      }
+    }
+    Match best = {0, i, 0};
+    for (const auto& file_blocks : shared_blocks) {
+      if (file_blocks.second > best.shared_blocks ||
+          (file_blocks.second == best.shared_blocks &&
+           file_blocks.first < best.removed_index)) {
+        best.shared_blocks = file_blocks.second;
+        best.removed_index = file_blocks.first;
+      }
+    }
+    if (best.shared_blocks > 0)
+      matches.push_back(best);
+  }
+
+  // The files sharing the most blocks are matched first.
+  std::stable_sort(matches.begin(),
+                   matches.end(),
+                   [](const Match& a, const Match& b) {
+                     return a.shared_blocks > b.shared_blocks;
+                   });
+  vector<bool> added_matched(added_files.size(), false);
+  vector<bool> removed_matched(removed_files.size(), false);
+  size_t num_matched = 0;
+  auto add_match = [&](size_t added_index, size_t removed_index) {
+    added_matched[added_index] = true;
+    removed_matched[removed_index] = true;
+    (*old_files_map)[added_files[added_index]->name] =
+        removed_files[removed_index]->extents;
+    num_matched++;
+  };
+  for (const Match& match : matches) {
+    if (!removed_matched[match.removed_index])
+      add_match(match.added_index, match.removed_index);
+  }
+
+  // The remaining files, for example recompressed ones, are matched by their
+  // base name to the removed file of the closest size.
+  auto base_name = [](const string& name) {
+    return name.substr(name.rfind('/') + 1);
+  };
+  map<string, vector<size_t>> removed_by_name;
+  for (size_t i = 0; i < removed_files.size(); i++) {
+    if (!removed_matched[i])
+      removed_by_name[base_name(removed_files[i]->name)].push_back(i);
+  }
+  for (size_t i = 0; i < added_files.size(); i++) {
+    auto it = removed_by_name.find(base_name(added_files[i]->name));
+    if (added_matched[i] || it == removed_by_name.end())
+      continue;
+    const uint64_t added_blocks = BlocksInExtents(added_files[i]->extents);
+    int64_t best_index = -1;
+    uint64_t best_distance = 0;
+    for (size_t removed_index : it->second) {
+      if (removed_matched[removed_index])
+        continue;
+      const uint64_t removed_blocks =
+          BlocksInExtents(removed_files[removed_index]->extents);
+      const uint64_t distance = removed_blocks > added_blocks
+                                    ? removed_blocks - added_blocks
+                                    : added_blocks - removed_blocks;
+      if (best_index == -1 || distance < best_distance) {
+        best_index = removed_index;
+        best_distance = distance;
+      }
+    }
+    if (best_index != -1)
+      add_match(i, best_index);
+  }
+  LOG(INFO) << "Matched " << num_matched << " of the " << added_files.size()
+            << " new files to one of the " << removed_files.size()
+            << " removed files.";
+  return num_matched;
+}
+
 bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                    const string& old_part,
                    const string& new_part,
@@ -436,7 +1140,9 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                    const string& name,
                    ssize_t chunk_blocks,
                    const PayloadVersion& version,
-                   BlobFileWriter* blob_file) {
+                   BlobFileWriter* blob_file,
+                   BsdiffIndexCache* index_cache,
+                   DiffCache* diff_cache) {
   brillo::Blob data;
   InstallOperation operation;
 
@@ -462,6 +1168,8 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                                             old_extents_chunk,
                                             new_extents_chunk,
                                             version,
+                                            index_cache,
+                                            diff_cache,
                                             &data,
                                             &operation));
 
@@ -484,15 +1192,34 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
       aop.name = base::StringPrintf("%s:%" PRIu64,
                                     name.c_str(), block_offset / chunk_blocks);
     }
-    aop.op = operation;
+    aop.op.Swap(&operation);
 
     // Write the data
     TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
-    aops->emplace_back(aop);
+    aops->push_back(std::move(aop));
   }
   return true;
 }
 
+double ByteEntropy(const brillo::Blob& data) {
+  if (data.empty())
+    return 0;
+  uint64_t counts[256] = {};
+  for (uint8_t byte : data)
+    counts[byte]++;
+  double entropy = 0;
+  int used_values = 0;
+  for (uint64_t count : counts) {
+    if (count == 0)
+      continue;
+    const double p = static_cast<double>(count) / data.size();
+    entropy -= p * log2(p);
+    used_values++;
+  }
+  return std::min(entropy + (used_values - 1) / (2 * data.size() * M_LN2),
+                  8.0);
+}
+
 bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
@@ -501,8 +1228,7 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return false;
 
   if (version.OperationAllowed(InstallOperation::ZERO) &&
-      std::all_of(
-          new_data.begin(), new_data.end(), [](uint8_t x) { return x == 0; })) {
+      utils::IsZeroFilled(new_data.data(), new_data.size())) {
     // The read buffer is all zeros, so produce a ZERO operation. No need to
     // check other types of operations in this case.
     *out_blob = brillo::Blob();
@@ -511,9 +1237,46 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
   }
 
   bool out_blob_set = false;
+  full_operations_count++;
+
+  const CompressionHeuristics& heuristics = version.compression;
+  // The cost of writing |new_data| with a full operation of |type| and a blob
+  // of |blob_size| bytes.
+  const OperationCostModel& cost_model = version.cost_model;
+  auto full_cost = [&cost_model, &new_data](InstallOperation_Type type,
+                                            size_t blob_size) {
+    return cost_model.Cost(type, 0, new_data.size(), blob_size);
+  };
+  const bool xz_allowed =
+      version.OperationAllowed(InstallOperation::REPLACE_XZ);
+  bool bzip_allowed = version.OperationAllowed(InstallOperation::REPLACE_BZ);
+  const bool zstd_allowed =
+      version.OperationAllowed(InstallOperation::REPLACE_ZSTD);
+  // Data that looks random, like already compressed files, is stored as is.
+  brillo::Blob sample = SampleData(new_data, heuristics.sample_size);
+  if ((xz_allowed || bzip_allowed || zstd_allowed) &&
+      ByteEntropy(sample) > heuristics.max_entropy) {
+    full_operations_entropy_skips++;
+    *out_type = InstallOperation::REPLACE;
+    *out_blob = new_data;
+    return true;
+  }
+
+  // If xz compresses a sample of the data clearly better than bzip2, bzip2 is
+  // not tried on the whole data.
+  if (xz_allowed && bzip_allowed && heuristics.bzip_trial_margin >= 0 &&
+      new_data.size() > 2 * sample.size()) {
+    brillo::Blob sample_xz, sample_bz;
+    if (XzCompress(sample, &sample_xz) && BzipCompress(sample, &sample_bz) &&
+        sample_bz.size() >
+            sample_xz.size() * (1 + heuristics.bzip_trial_margin)) {
+      full_operations_bzip_skips++;
+      bzip_allowed = false;
+    }
+  }
 
   // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
+  if (xz_allowed) {
     brillo::Blob new_data_xz;
     if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
       *out_type = InstallOperation::REPLACE_XZ;
@@ -523,12 +1286,12 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
   }
 
   // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
+  if (bzip_allowed) {
     brillo::Blob new_data_bz;
-    // TODO(deymo): Implement some heuristic to determine if it is worth trying
-    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
     if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
-        (!out_blob_set || out_blob->size() > new_data_bz.size())) {
+        (!out_blob_set ||
+         full_cost(*out_type, out_blob->size()) >
+             full_cost(InstallOperation::REPLACE_BZ, new_data_bz.size()))) {
       // A REPLACE_BZ is better or nothing else was set.
       *out_type = InstallOperation::REPLACE_BZ;
       *out_blob = std::move(new_data_bz);
@@ -536,8 +1299,36 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     }
   }
 
+  // zstd decompresses several times faster than xz and bzip2 on the device,
+  // so it is preferred unless they are clearly smaller, or cost more in the
+  // apply time model.
+  if (zstd_allowed) {
+    // The small inputs are compressed against the dictionary of the payload,
+    // if any.
+    const ZstdDictionary* dictionary = ZstdCompressDictionary();
+    brillo::Blob new_data_zstd;
+    const bool compressed =
+        dictionary && new_data.size() <= ZstdDictionary::kMaxDataSize
+            ? dictionary->Compress(new_data, &new_data_zstd)
+            : ZstdCompress(new_data, &new_data_zstd);
+    if (compressed && !new_data_zstd.empty() &&
+        (!out_blob_set ||
+         (cost_model.enabled()
+              ? full_cost(InstallOperation::REPLACE_ZSTD,
+                          new_data_zstd.size()) <
+                    full_cost(*out_type, out_blob->size())
+              : new_data_zstd.size() <=
+                    out_blob->size() * (1 + heuristics.zstd_size_margin)))) {
+      *out_type = InstallOperation::REPLACE_ZSTD;
+      *out_blob = std::move(new_data_zstd);
+      out_blob_set = true;
+    }
+  }
+
   // If nothing else worked or it was badly compressed we try a REPLACE.
-  if (!out_blob_set || out_blob->size() >= new_data.size()) {
+  if (!out_blob_set ||
+      full_cost(*out_type, out_blob->size()) >=
+          full_cost(InstallOperation::REPLACE, new_data.size())) {
     *out_type = InstallOperation::REPLACE;
     // This needs to make a copy of the data in the case bzip or xz didn't
     // compress well, which is not the common case so the performance hit is
@@ -547,11 +1338,25 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
   return true;
 }
 
+void LogFullOperationStats() {
+  const uint64_t count = full_operations_count;
+  if (count == 0)
+    return;
+  const uint64_t entropy_skips = full_operations_entropy_skips;
+  const uint64_t bzip_skips = full_operations_bzip_skips;
+  LOG(INFO) << "Generated " << count << " full operations: "
+            << entropy_skips << " (" << entropy_skips * 100 / count
+            << "%) stored without compressing and " << bzip_skips << " ("
+            << bzip_skips * 100 / count << "%) without trying bzip2.";
+}
+
 bool ReadExtentsToDiff(const string& old_part,
                        const string& new_part,
                        const vector<Extent>& old_extents,
                        const vector<Extent>& new_extents,
                        const PayloadVersion& version,
+                       BsdiffIndexCache* index_cache,
+                       DiffCache* diff_cache,
                        brillo::Blob* out_data,
                        InstallOperation* out_op) {
   InstallOperation operation;
@@ -559,13 +1364,16 @@ bool ReadExtentsToDiff(const string& old_part,
   // We read blocks from old_extents and write blocks to new_extents.
   uint64_t blocks_to_read = BlocksInExtents(old_extents);
   uint64_t blocks_to_write = BlocksInExtents(new_extents);
+  ScopedProfilePhase profile_phase("ReadExtentsToDiff",
+                                   blocks_to_write * kBlockSize);
 
   // Disable bsdiff and imgdiff when the data is too big.
   bool bsdiff_allowed =
       version.OperationAllowed(InstallOperation::SOURCE_BSDIFF) ||
       version.OperationAllowed(InstallOperation::BSDIFF);
   if (bsdiff_allowed &&
-      blocks_to_read * kBlockSize > kMaxBsdiffDestinationSize) {
+      blocks_to_read * kBlockSize >
+          version.memory_profile.max_bsdiff_destination_size) {
     LOG(INFO) << "bsdiff blacklisted, data too big: "
               << blocks_to_read * kBlockSize << " bytes";
     bsdiff_allowed = false;
@@ -585,83 +1393,111 @@ bool ReadExtentsToDiff(const string& old_part,
 
   // Read in bytes from new data.
   brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           new_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  TEST_AND_RETURN_FALSE(ReadImageExtents(new_part,
+                                         new_extents,
+                                         &new_data,
+                                         kBlockSize * blocks_to_write,
+                                         kBlockSize));
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
   // Data blob that will be written to delta file.
   brillo::Blob data_blob;
 
-  // Try generating a full operation for the given new data, regardless of the
-  // old_data.
-  InstallOperation_Type op_type;
-  TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
-  operation.set_type(op_type);
-
   brillo::Blob old_data;
   if (blocks_to_read > 0) {
     // Read old data.
     TEST_AND_RETURN_FALSE(
-        utils::ReadExtents(old_part, src_extents, &old_data,
-                           kBlockSize * blocks_to_read, kBlockSize));
-    if (old_data == new_data) {
-      // No change in data.
-      operation.set_type(version.OperationAllowed(InstallOperation::SOURCE_COPY)
-                             ? InstallOperation::SOURCE_COPY
-                             : InstallOperation::MOVE);
-      data_blob = brillo::Blob();
-    } else if (bsdiff_allowed || imgdiff_allowed) {
-      // If the source file is considered bsdiff safe (no bsdiff bugs
-      // triggered), see if BSDIFF encoding is smaller.
-      base::FilePath old_chunk;
-      TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&old_chunk));
-      ScopedPathUnlinker old_unlinker(old_chunk.value());
-      TEST_AND_RETURN_FALSE(utils::WriteFile(
-          old_chunk.value().c_str(), old_data.data(), old_data.size()));
-      base::FilePath new_chunk;
-      TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&new_chunk));
-      ScopedPathUnlinker new_unlinker(new_chunk.value());
-      TEST_AND_RETURN_FALSE(utils::WriteFile(
-          new_chunk.value().c_str(), new_data.data(), new_data.size()));
-
-      if (bsdiff_allowed) {
-        brillo::Blob bsdiff_delta;
-        TEST_AND_RETURN_FALSE(DiffFiles(
-            kBsdiffPath, old_chunk.value(), new_chunk.value(), &bsdiff_delta));
-        CHECK_GT(bsdiff_delta.size(), static_cast<brillo::Blob::size_type>(0));
-        if (bsdiff_delta.size() < data_blob.size()) {
-          operation.set_type(
-              version.OperationAllowed(InstallOperation::SOURCE_BSDIFF)
-                  ? InstallOperation::SOURCE_BSDIFF
-                  : InstallOperation::BSDIFF);
-          data_blob = std::move(bsdiff_delta);
-        }
+        ReadImageExtents(old_part, src_extents, &old_data,
+                         kBlockSize * blocks_to_read, kBlockSize));
+  }
+
+  InstallOperation_Type op_type;
+  if (blocks_to_read > 0 && old_data == new_data) {
+    // No change in data.
+    operation.set_type(version.OperationAllowed(InstallOperation::SOURCE_COPY)
+                           ? InstallOperation::SOURCE_COPY
+                           : InstallOperation::MOVE);
+  } else if (diff_cache &&
+             diff_cache->Lookup(old_data, new_data, version, &op_type,
+                                &data_blob)) {
+    // The same data was already diffed, maybe for another payload.
+    operation.set_type(op_type);
+  } else {
+    // Try generating a full operation for the given new data, regardless of
+    // the old_data.
+    TEST_AND_RETURN_FALSE(
+        GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
+    operation.set_type(op_type);
+    // The diff operations replace the full one when they lower the size, or
+    // the size plus the weighted apply time with a cost model.
+    const OperationCostModel& cost_model = version.cost_model;
+    double best_cost =
+        cost_model.Cost(op_type, 0, new_data.size(), data_blob.size());
+
+    // If the source file is considered bsdiff safe (no bsdiff bugs
+    // triggered), see if BSDIFF encoding is smaller.
+    InstallOperation_Type bsdiff_type =
+        version.OperationAllowed(InstallOperation::SOURCE_BSDIFF)
+            ? InstallOperation::SOURCE_BSDIFF
+            : InstallOperation::BSDIFF;
+    // A diff whose apply time alone costs more than the full operation isn't
+    // generated.
+    if (blocks_to_read > 0 && bsdiff_allowed &&
+        cost_model.Cost(bsdiff_type, old_data.size(), new_data.size(), 0) <
+            best_cost) {
+      brillo::Blob bsdiff_delta;
+      // The patch is generated in memory; the bsdiff program is only run if
+      // that fails.
+      bool generated;
+      if (index_cache) {
+        std::shared_ptr<const BsdiffIndex> index;
+        generated = index_cache->GetIndex(old_data, &index) &&
+                    GenerateBsdiffPatch(*index, new_data, &bsdiff_delta);
+      } else {
+        generated = GenerateBsdiffPatch(old_data, new_data, &bsdiff_delta);
       }
-      if (imgdiff_allowed && ContainsGZip(old_data) && ContainsGZip(new_data)) {
-        brillo::Blob imgdiff_delta;
-        // Imgdiff might fail in some cases, only use the result if it succeed,
-        // otherwise print the extents to analyze.
-        if (DiffFiles(kImgdiffPath,
-                      old_chunk.value(),
-                      new_chunk.value(),
-                      &imgdiff_delta) &&
-            imgdiff_delta.size() > 0) {
-          if (imgdiff_delta.size() < data_blob.size()) {
-            operation.set_type(InstallOperation::IMGDIFF);
-            data_blob = std::move(imgdiff_delta);
-          }
-        } else {
-          LOG(ERROR) << "Imgdiff failed with source extents: "
-                     << ExtentsToString(src_extents)
-                     << ", destination extents: "
-                     << ExtentsToString(dst_extents);
+      if (!generated) {
+        LOG(WARNING) << "Failed to generate the bsdiff patch in memory, "
+                     << "running " << kBsdiffPath << ".";
+        TEST_AND_RETURN_FALSE(
+            DiffBlobs(kBsdiffPath, old_data, new_data, &bsdiff_delta));
+      }
+      CHECK_GT(bsdiff_delta.size(), static_cast<brillo::Blob::size_type>(0));
+      double bsdiff_cost = cost_model.Cost(
+          bsdiff_type, old_data.size(), new_data.size(), bsdiff_delta.size());
+      if (bsdiff_cost < best_cost) {
+        operation.set_type(bsdiff_type);
+        data_blob = std::move(bsdiff_delta);
+        best_cost = bsdiff_cost;
+      }
+    }
+    if (blocks_to_read > 0 && imgdiff_allowed &&
+        cost_model.Cost(InstallOperation::IMGDIFF, old_data.size(),
+                        new_data.size(), 0) < best_cost) {
+      brillo::Blob imgdiff_delta;
+      // The patch is empty when there are no deflate streams to diff.
+      if (GenerateImgdiffPatch(old_data, new_data, &imgdiff_delta)) {
+        if (!imgdiff_delta.empty() &&
+            cost_model.Cost(InstallOperation::IMGDIFF, old_data.size(),
+                            new_data.size(), imgdiff_delta.size()) <
+                best_cost) {
+          operation.set_type(InstallOperation::IMGDIFF);
+          data_blob = std::move(imgdiff_delta);
         }
+      } else {
+        LOG(ERROR) << "Imgdiff failed with source extents: "
+                   << ExtentsToString(src_extents)
+                   << ", destination extents: "
+                   << ExtentsToString(dst_extents);
       }
     }
+
+    // A failure to store the operation only means it will be diffed again.
+    if (diff_cache &&
+        !diff_cache->Store(
+            old_data, new_data, version, operation.type(), data_blob)) {
+      LOG(WARNING) << "Failed to store the operation in the diff cache.";
+    }
   }
 
   size_t removed_bytes = 0;
@@ -684,8 +1520,18 @@ bool ReadExtentsToDiff(const string& old_part,
     operation.clear_src_length();
   }
 
+  // The hash of the source data is computed while it's in memory, instead of
+  // reading it again from the old partition once all the operations are
+  // generated.
+  if (version.minor >= kOpSrcHashMinorPayloadVersion &&
+      operation.src_extents_size() > 0 && removed_bytes == 0) {
+    brillo::Blob src_hash;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(old_data, &src_hash));
+    operation.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  }
+
   *out_data = std::move(data_blob);
-  *out_op = operation;
+  out_op->Swap(&operation);
 
   return true;
 }
@@ -721,10 +1567,30 @@ bool DiffFiles(const string& diff_path,
   return true;
 }
 
+bool DiffBlobs(const string& diff_path,
+               const brillo::Blob& old_data,
+               const brillo::Blob& new_data,
+               brillo::Blob* out) {
+  string old_file;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("delta.oldXXXXXX", &old_file, nullptr));
+  ScopedPathUnlinker old_unlinker(old_file);
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(old_file.c_str(), old_data.data(), old_data.size()));
+  string new_file;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("delta.newXXXXXX", &new_file, nullptr));
+  ScopedPathUnlinker new_unlinker(new_file);
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(new_file.c_str(), new_data.data(), new_data.size()));
+  return DiffFiles(diff_path, old_file, new_file, out);
+}
+
 bool IsAReplaceOperation(InstallOperation_Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 // Returns true if |op| is a no-op operation that doesn't do any useful work
@@ -742,11 +1608,81 @@ void FilterNoopOperations(vector<AnnotatedOperation>* ops) {
       ops->end());
 }
 
-bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
+bool SplitXzChunks(const string& new_part,
+                   uint32_t chunk_blocks,
+                   BlobFileWriter* blob_file,
+                   vector<AnnotatedOperation>* aops) {
+  ScopedProfilePhase profile_phase("SplitXzChunks");
+  for (AnnotatedOperation& aop : *aops) {
+    const uint64_t num_blocks = BlocksInExtents(aop.op.dst_extents());
+    if (aop.op.type() != InstallOperation::REPLACE_XZ ||
+        num_blocks <= chunk_blocks) {
+      continue;
+    }
+    vector<Extent> dst_extents;
+    ExtentsToVector(aop.op.dst_extents(), &dst_extents);
+    brillo::Blob blob;
+    aop.op.clear_xz_chunk_sizes();
+    for (uint64_t block = 0; block < num_blocks; block += chunk_blocks) {
+      vector<Extent> chunk_extents =
+          ExtentsSublist(dst_extents, block, chunk_blocks);
+      brillo::Blob data, chunk_blob;
+      TEST_AND_RETURN_FALSE(
+          ReadImageExtents(new_part,
+                           chunk_extents,
+                           &data,
+                           kBlockSize * BlocksInExtents(chunk_extents),
+                           kBlockSize));
+      TEST_AND_RETURN_FALSE(XzCompress(data, &chunk_blob));
+      blob.insert(blob.end(), chunk_blob.begin(), chunk_blob.end());
+      aop.op.add_xz_chunk_sizes(chunk_blob.size());
+    }
+    aop.op.set_xz_chunk_blocks(chunk_blocks);
+    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+  }
+  return true;
+}
+
+bool InitializePartitionInfo(const PartitionConfig& part,
+                             uint64_t hash_chunk_size,
+                             PartitionInfo* info) {
   info->set_size(part.size);
   HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
-                        static_cast<off_t>(part.size));
+  const MappedImage* image = MappedImage::Find(part.path);
+  if (image && image->size() >= part.size) {
+    // The mapped image is hashed without copying it.
+    image->AdviseSequential(0, part.size);
+    if (hash_chunk_size > 0)
+      info->set_hash_chunk_size(hash_chunk_size);
+    const uint64_t chunk_size = hash_chunk_size ? hash_chunk_size : part.size;
+    for (uint64_t offset = 0; offset < part.size; offset += chunk_size) {
+      const uint8_t* chunk = image->data() + offset;
+      const uint64_t size = std::min(chunk_size, part.size - offset);
+      TEST_AND_RETURN_FALSE(hasher.Update(chunk, size));
+      if (hash_chunk_size == 0)
+        continue;
+      brillo::Blob chunk_hash;
+      TEST_AND_RETURN_FALSE(
+          HashCalculator::RawHashOfBytes(chunk, size, &chunk_hash));
+      info->add_chunk_hashes(chunk_hash.data(), chunk_hash.size());
+    }
+  } else if (hash_chunk_size == 0) {
+    TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
+                          static_cast<off_t>(part.size));
+  } else {
+    info->set_hash_chunk_size(hash_chunk_size);
+    for (uint64_t offset = 0; offset < part.size; offset += hash_chunk_size) {
+      brillo::Blob chunk, chunk_hash;
+      const uint64_t chunk_size =
+          std::min(hash_chunk_size, part.size - offset);
+      TEST_AND_RETURN_FALSE(
+          utils::ReadFileChunk(part.path, offset, chunk_size, &chunk));
+      TEST_AND_RETURN_FALSE(chunk.size() == chunk_size);
+      TEST_AND_RETURN_FALSE(hasher.Update(chunk.data(), chunk.size()));
+      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(chunk, &chunk_hash));
+      info->add_chunk_hashes(chunk_hash.data(), chunk_hash.size());
+    }
+  }
   TEST_AND_RETURN_FALSE(hasher.Finalize());
   const brillo::Blob& hash = hasher.raw_hash();
   info->set_hash(hash.data(), hash.size());
@@ -754,8 +1690,8 @@ bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   return true;
 }
 
-bool CompareAopsByDestination(AnnotatedOperation first_aop,
-                              AnnotatedOperation second_aop) {
+bool CompareAopsByDestination(const AnnotatedOperation& first_aop,
+                              const AnnotatedOperation& second_aop) {
   // We want empty operations to be at the end of the payload.
   if (!first_aop.op.dst_extents().size() || !second_aop.op.dst_extents().size())
     return ((!first_aop.op.dst_extents().size()) <
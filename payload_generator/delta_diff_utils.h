@@ -17,13 +17,18 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_UTILS_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_UTILS_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/bsdiff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/image_index_cache.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -40,15 +45,30 @@ namespace diff_utils {
 // and soft chunk limits in number of blocks respectively. The soft chunk limit
 // is used to split MOVE and SOURCE_COPY operations and REPLACE_BZ of zeroed
 // blocks, while the hard limit is used to split a file when generating other
-// operations. A value of -1 in |hard_chunk_blocks| means whole files.
+// operations. A value of -1 in |hard_chunk_blocks| means whole files. Files are
+// also split in windows of DiffWindowBlocks(|diff_memory_limit|) blocks, diffed
+// independently and in parallel; zero means half of the physical memory. If
+// |diff_cache_dir| is not empty, the operations generated by the diffs are
+// cached in that directory and reused when the same data is diffed again. The
+// files whose blocks didn't change are copied without reading their data.
 bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
+                        uint64_t diff_memory_limit,
+                        const std::string& diff_cache_dir,
                         const PayloadVersion& version,
                         BlobFileWriter* blob_file);
 
+// Returns the size in blocks of the largest window of a file that can be diffed
+// within |memory_limit| bytes, as a window of the old data of the same size is
+// diffed against it. The windows are also limited to the biggest bsdiff
+// destination of |max_bsdiff_destination_size| bytes, so big files are diffed
+// in windows instead of replaced.
+uint64_t DiffWindowBlocks(uint64_t memory_limit,
+                          uint64_t max_bsdiff_destination_size);
+
 // Create operations in |aops| for identical blocks that moved around in the old
 // and new partition and also handle zeroed blocks. The old and new partition
 // are stored in the |old_part| and |new_part| files and have |old_num_blocks|
@@ -70,13 +90,78 @@ bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
                              ExtentRanges* old_visited_blocks,
                              ExtentRanges* new_visited_blocks);
 
+// Same as the above, but using the block ids |old_block_ids| and
+// |new_block_ids| already computed with MapPartitionBlocks() for the old and
+// new partitions.
+bool DeltaMovedAndZeroBlocks(
+    std::vector<AnnotatedOperation>* aops,
+    const std::string& new_part,
+    const std::vector<BlockMapping::BlockId>& old_block_ids,
+    const std::vector<BlockMapping::BlockId>& new_block_ids,
+    ssize_t chunk_blocks,
+    const PayloadVersion& version,
+    BlobFileWriter* blob_file,
+    ExtentRanges* old_visited_blocks,
+    ExtentRanges* new_visited_blocks);
+
+// Create SOURCE_COPY operations in |aops| for the files in |new_files| whose
+// blocks have the same block ids, and therefore the same data, as the blocks
+// of the file with the same name in |old_files_map|. The block ids of the old
+// and new partitions are |old_block_ids| and |new_block_ids|, so no data is
+// read. The operations are split in chunks of |chunk_blocks| blocks, or
+// unlimited if |chunk_blocks| is -1. Files with zeroed or already visited
+// blocks are skipped, and the blocks used are added to |old_visited_blocks|
+// and |new_visited_blocks|.
+void DeltaUnchangedFiles(
+    std::vector<AnnotatedOperation>* aops,
+    const std::map<std::string, std::vector<Extent>>& old_files_map,
+    const std::vector<FilesystemInterface::File>& new_files,
+    const std::vector<BlockMapping::BlockId>& old_block_ids,
+    const std::vector<BlockMapping::BlockId>& new_block_ids,
+    ssize_t chunk_blocks,
+    ExtentRanges* old_visited_blocks,
+    ExtentRanges* new_visited_blocks);
+
+// Sets |unchanged| to whether the data of |new_part| is the same as the data
+// of |old_part|, in which case the whole partition can be copied. The block
+// hashes of both images are compared when |image_index_cache| has them, so
+// nothing is read. Otherwise the images are compared, stopping at the first
+// difference. Returns false on error.
+bool IsPartitionUnchanged(const PartitionConfig& old_part,
+                          const PartitionConfig& new_part,
+                          ImageIndexCache* image_index_cache,
+                          bool* unchanged);
+
+// Creates SOURCE_COPY operations in |aops| copying all the blocks of
+// |new_part| from the same blocks of the old partition, except its hash tree,
+// in chunks of |chunk_blocks| blocks, or unlimited if |chunk_blocks| is -1.
+void DeltaUnchangedPartition(std::vector<AnnotatedOperation>* aops,
+                             const PartitionConfig& new_part,
+                             ssize_t chunk_blocks);
+
+// Adds to |old_files_map| the extents of the old file each renamed or moved
+// file of |new_files| is diffed against, keyed by the name of the new file.
+// The files of the new filesystem without an old file of the same name are
+// matched to the removed files of |old_files| they share the most block ids
+// with, according to |old_block_ids| and |new_block_ids|, and otherwise to the
+// removed file with the same base name and the closest size. Each old file is
+// matched to at most one new file. Returns the number of files matched.
+size_t MatchRenamedFiles(
+    const std::vector<FilesystemInterface::File>& old_files,
+    const std::vector<FilesystemInterface::File>& new_files,
+    const std::vector<BlockMapping::BlockId>& old_block_ids,
+    const std::vector<BlockMapping::BlockId>& new_block_ids,
+    std::map<std::string, std::vector<Extent>>* old_files_map);
+
 // For a given file |name| append operations to |aops| to produce it in the
 // |new_part|. The file will be split in chunks of |chunk_blocks| blocks each
 // or treated as a single chunk if |chunk_blocks| is -1. The file data is
 // stored in |new_part| in the blocks described by |new_extents| and, if it
 // exists, the old version exists in |old_part| in the blocks described by
 // |old_extents|. The operations added to |aops| reference the data blob
-// in the |blob_file|. Returns true on success.
+// in the |blob_file|. The bsdiff indexes of the old data are taken from
+// |index_cache| and the operations already generated from |diff_cache|, if not
+// null. Returns true on success.
 bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const std::string& old_part,
                    const std::string& new_part,
@@ -85,7 +170,9 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const std::string& name,
                    ssize_t chunk_blocks,
                    const PayloadVersion& version,
-                   BlobFileWriter* blob_file);
+                   BlobFileWriter* blob_file,
+                   BsdiffIndexCache* index_cache,
+                   DiffCache* diff_cache);
 
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
@@ -93,13 +180,18 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
 // fills in |out_op|. If there's no change in old and new files, it creates a
 // MOVE or SOURCE_COPY operation. If there is a change, the smallest of the
 // operations allowed in the given |version| (REPLACE, REPLACE_BZ, BSDIFF,
-// SOURCE_BSDIFF or IMGDIFF) wins.
-// |new_extents| must not be empty. Returns true on success.
+// SOURCE_BSDIFF or IMGDIFF) wins. The bsdiff index of the old data is taken
+// from |index_cache| if not null, and built for this call otherwise. If
+// |diff_cache| is not null, the operation is taken from it when the same data
+// was already diffed, and stored in it otherwise. |new_extents| must not be
+// empty. Returns true on success.
 bool ReadExtentsToDiff(const std::string& old_part,
                        const std::string& new_part,
                        const std::vector<Extent>& old_extents,
                        const std::vector<Extent>& new_extents,
                        const PayloadVersion& version,
+                       BsdiffIndexCache* index_cache,
+                       DiffCache* diff_cache,
                        brillo::Blob* out_data,
                        InstallOperation* out_op);
 
@@ -110,15 +202,34 @@ bool DiffFiles(const std::string& diff_path,
                const std::string& new_file,
                brillo::Blob* out);
 
+// Writes |old_data| and |new_data| to temporary files and runs the bsdiff or
+// imgdiff tool in |diff_path| on them with DiffFiles(). Returns true on success.
+bool DiffBlobs(const std::string& diff_path,
+               const brillo::Blob& old_data,
+               const brillo::Blob& new_data,
+               brillo::Blob* out);
+
+// Returns the Shannon entropy of the bytes of |data|, in bits per byte, up to
+// 8. The Miller-Madow correction is applied so small samples of random data
+// are not underestimated.
+double ByteEntropy(const brillo::Blob& data);
+
 // Generates the best allowed full operation to produce |new_data|. The allowed
 // operations are based on |payload_version|. The operation blob will be stored
-// in |out_blob| and the resulting operation type in |out_type|. Returns whether
-// a valid full operation was generated.
+// in |out_blob| and the resulting operation type in |out_type|. The compressors
+// unlikely to produce the smallest blob are skipped according to the
+// |payload_version| CompressionHeuristics. Returns whether a valid full
+// operation was generated.
 bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
                                InstallOperation_Type* out_type);
 
+// Logs how many times GenerateBestFullOperation() skipped the compressors due
+// to the CompressionHeuristics in the PayloadVersion, since the program
+// started.
+void LogFullOperationStats();
+
 // Returns whether op_type is one of the REPLACE full operations.
 bool IsAReplaceOperation(InstallOperation_Type op_type);
 
@@ -130,13 +241,26 @@ bool IsNoopOperation(const InstallOperation& op);
 // of the rest of the operations.
 void FilterNoopOperations(std::vector<AnnotatedOperation>* ops);
 
+// Splits the data of the REPLACE_XZ operations in |aops| writing more than
+// |chunk_blocks| blocks of the |new_part| in independent xz streams of
+// |chunk_blocks| blocks each, stored in |blob_file|. Returns whether all the
+// operations were split.
+bool SplitXzChunks(const std::string& new_part,
+                   uint32_t chunk_blocks,
+                   BlobFileWriter* blob_file,
+                   std::vector<AnnotatedOperation>* aops);
+
+// Sets the size and hash of the |partition| in the |info|. If |hash_chunk_size|
+// isn't zero, the hashes of the chunks of that size of the partition are also
+// set.
 bool InitializePartitionInfo(const PartitionConfig& partition,
+                             uint64_t hash_chunk_size,
                              PartitionInfo* info);
 
 // Compare two AnnotatedOperations by the start block of the first Extent in
 // their destination extents.
-bool CompareAopsByDestination(AnnotatedOperation first_aop,
-                              AnnotatedOperation second_aop);
+bool CompareAopsByDestination(const AnnotatedOperation& first_aop,
+                              const AnnotatedOperation& second_aop);
 
 }  // namespace diff_utils
 
@@ -17,22 +17,27 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <algorithm>
+#include <map>
 #include <random>
 #include <string>
 #include <vector>
 
 #include <base/files/scoped_file.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/strings/stringprintf.h>
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/image_index_cache.h"
 
+using std::map;
 using std::string;
 using std::vector;
 
@@ -180,6 +185,8 @@ TEST_F(DeltaDiffUtilsTest, MoveSmallTest) {
       old_extents,
       new_extents,
       PayloadVersion(kChromeOSMajorPayloadVersion, kInPlaceMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
       &data,
       &op));
   EXPECT_TRUE(data.empty());
@@ -239,6 +246,8 @@ TEST_F(DeltaDiffUtilsTest, MoveWithSameBlock) {
       old_extents,
       new_extents,
       PayloadVersion(kChromeOSMajorPayloadVersion, kInPlaceMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
       &data,
       &op));
 
@@ -302,6 +311,8 @@ TEST_F(DeltaDiffUtilsTest, BsdiffSmallTest) {
       old_extents,
       new_extents,
       PayloadVersion(kChromeOSMajorPayloadVersion, kInPlaceMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
       &data,
       &op));
 
@@ -351,6 +362,8 @@ TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
         new_extents,
         PayloadVersion(kChromeOSMajorPayloadVersion,
                        kInPlaceMinorPayloadVersion),
+        nullptr,  // index_cache
+        nullptr,  // diff_cache
         &data,
         &op));
     EXPECT_FALSE(data.empty());
@@ -391,6 +404,8 @@ TEST_F(DeltaDiffUtilsTest, SourceCopyTest) {
       old_extents,
       new_extents,
       PayloadVersion(kChromeOSMajorPayloadVersion, kSourceMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
       &data,
       &op));
   EXPECT_TRUE(data.empty());
@@ -423,12 +438,126 @@ TEST_F(DeltaDiffUtilsTest, SourceBsdiffTest) {
       old_extents,
       new_extents,
       PayloadVersion(kChromeOSMajorPayloadVersion, kSourceMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
       &data,
       &op));
 
   EXPECT_FALSE(data.empty());
   EXPECT_TRUE(op.has_type());
   EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, op.type());
+  // The source hash is only added from minor version 3.
+  EXPECT_FALSE(op.has_src_sha256_hash());
+}
+
+TEST_F(DeltaDiffUtilsTest, SourceHashTest) {
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+  vector<Extent> old_extents = { ExtentForRange(1, 1) };
+  vector<Extent> new_extents = { ExtentForRange(2, 1) };
+  EXPECT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  EXPECT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(data_blob, &expected_hash));
+
+  // The hash of the old data read to diff it is added to the operation.
+  brillo::Blob data;
+  InstallOperation op;
+  EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
+      old_part_.path,
+      new_part_.path,
+      old_extents,
+      new_extents,
+      PayloadVersion(kChromeOSMajorPayloadVersion,
+                     kOpSrcHashMinorPayloadVersion),
+      nullptr,  // index_cache
+      nullptr,  // diff_cache
+      &data,
+      &op));
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, op.type());
+  EXPECT_EQ(string(expected_hash.begin(), expected_hash.end()),
+            op.src_sha256_hash());
+}
+
+TEST_F(DeltaDiffUtilsTest, BestFullOperationSkipsRandomDataTest) {
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kInPlaceMinorPayloadVersion);
+  // Every byte value appears the same number of times, so the entropy is 8
+  // bits per byte even if the data compresses very well.
+  brillo::Blob periodic_data;
+  for (uint32_t i = 0; i < 64 * kBlockSize; i++)
+    periodic_data.push_back(i & 0xff);
+
+  brillo::Blob blob;
+  InstallOperation_Type type;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      periodic_data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE, type);
+  EXPECT_EQ(periodic_data, blob);
+
+  // Raising the entropy threshold always tries the compressors.
+  version.compression.max_entropy = 8;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      periodic_data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, type);
+  EXPECT_LT(blob.size(), periodic_data.size());
+}
+
+TEST_F(DeltaDiffUtilsTest, BestFullOperationCompressesLowEntropyDataTest) {
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kInPlaceMinorPayloadVersion);
+  brillo::Blob text_data;
+  const string kText = "The quick brown fox jumps over the lazy dog. ";
+  while (text_data.size() < 64 * kBlockSize)
+    text_data.insert(text_data.end(), kText.begin(), kText.end());
+
+  brillo::Blob blob;
+  InstallOperation_Type type;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      text_data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, type);
+  EXPECT_LT(blob.size(), text_data.size());
+}
+
+TEST_F(DeltaDiffUtilsTest, BestFullOperationUsesZstdWhenAllowedTest) {
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kFullPayloadMinorVersion);
+  brillo::Blob text_data;
+  const string kText = "The quick brown fox jumps over the lazy dog. ";
+  while (text_data.size() < 64 * kBlockSize)
+    text_data.insert(text_data.end(), kText.begin(), kText.end());
+
+  // Full payloads only use zstd when explicitly allowed.
+  brillo::Blob blob;
+  InstallOperation_Type type;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      text_data, version, &blob, &type));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, type);
+
+  version.zstd_allowed = true;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      text_data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+  EXPECT_LT(blob.size(), text_data.size());
+}
+
+TEST_F(DeltaDiffUtilsTest, BestFullOperationWeightsApplyTimeTest) {
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kInPlaceMinorPayloadVersion);
+  brillo::Blob text_data;
+  const string kText = "The quick brown fox jumps over the lazy dog. ";
+  while (text_data.size() < 64 * kBlockSize)
+    text_data.insert(text_data.end(), kText.begin(), kText.end());
+
+  // When a second of apply time is worth much more than the blob, the data
+  // is stored uncompressed to skip the bzip2 decompression.
+  version.cost_model.bytes_per_second = 1e9;
+  brillo::Blob blob;
+  InstallOperation_Type type;
+  EXPECT_TRUE(diff_utils::GenerateBestFullOperation(
+      text_data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE, type);
+  EXPECT_EQ(text_data, blob);
 }
 
 TEST_F(DeltaDiffUtilsTest, IsNoopOperationTest) {
@@ -474,6 +603,40 @@ TEST_F(DeltaDiffUtilsTest, FilterNoopOperations) {
   EXPECT_EQ("aop2", ops[1].name);
 }
 
+TEST_F(DeltaDiffUtilsTest, SplitXzChunksTest) {
+  InitializePartitionWithUniqueBlocks(new_part_, block_size_, 42);
+  AnnotatedOperation large_aop;
+  large_aop.op.set_type(InstallOperation::REPLACE_XZ);
+  *large_aop.op.add_dst_extents() = ExtentForRange(10, 3);
+  *large_aop.op.add_dst_extents() = ExtentForRange(20, 2);
+  AnnotatedOperation small_aop;
+  small_aop.op.set_type(InstallOperation::REPLACE_XZ);
+  *small_aop.op.add_dst_extents() = ExtentForRange(30, 2);
+  AnnotatedOperation bz_aop;
+  bz_aop.op.set_type(InstallOperation::REPLACE_BZ);
+  *bz_aop.op.add_dst_extents() = ExtentForRange(40, 5);
+  aops_ = {large_aop, small_aop, bz_aop};
+
+  BlobFileWriter blob_file(blob_fd_, &blob_size_);
+  EXPECT_TRUE(diff_utils::SplitXzChunks(new_part_.path, 2, &blob_file, &aops_));
+
+  // The 5 blocks are split in chunks of 2, 2 and 1 blocks.
+  const InstallOperation& op = aops_[0].op;
+  EXPECT_EQ(2U, op.xz_chunk_blocks());
+  ASSERT_EQ(3, op.xz_chunk_sizes_size());
+  uint64_t chunks_size = 0;
+  for (uint64_t chunk_size : op.xz_chunk_sizes()) {
+    EXPECT_GT(chunk_size, 0U);
+    chunks_size += chunk_size;
+  }
+  EXPECT_EQ(op.data_length(), chunks_size);
+  EXPECT_EQ(static_cast<uint64_t>(blob_size_), op.data_length());
+
+  // The operations that fit in a chunk and the other types are kept.
+  EXPECT_FALSE(aops_[1].op.has_xz_chunk_blocks());
+  EXPECT_FALSE(aops_[2].op.has_xz_chunk_blocks());
+}
+
 // Test the simple case where all the blocks are different and no new blocks are
 // zeroed.
 TEST_F(DeltaDiffUtilsTest, NoZeroedOrUniqueBlocksDetected) {
@@ -703,4 +866,203 @@ TEST_F(DeltaDiffUtilsTest, ShuffledBlocksAreTracked) {
   EXPECT_EQ(0, blob_size_);
 }
 
+// Test that the files whose blocks have the same ids are copied from their own
+// old blocks, and the rest are left for the diff.
+TEST_F(DeltaDiffUtilsTest, UnchangedFilesAreCopiedFromTheirBlocks) {
+  // The old block 7 has the same data as the old block 2.
+  vector<BlockMapping::BlockId> old_block_ids = {1, 2, 3, 4, 5, 6, 7, 3, 0};
+  vector<BlockMapping::BlockId> new_block_ids = {4, 5, 3, 1, 2, 9, 7, 0, 3};
+
+  map<string, vector<Extent>> old_files_map = {
+      {"moved", {ExtentForRange(0, 2), ExtentForRange(7, 1)}},
+      {"changed", {ExtentForRange(3, 3)}},
+      {"zeros", {ExtentForRange(8, 1)}},
+      {"same", {ExtentForRange(6, 1)}},
+  };
+  vector<FilesystemInterface::File> new_files(5);
+  new_files[0].name = "moved";
+  new_files[0].extents = {ExtentForRange(3, 2), ExtentForRange(8, 1)};
+  new_files[1].name = "changed";
+  new_files[1].extents = {ExtentForRange(0, 2), ExtentForRange(5, 1)};
+  new_files[2].name = "zeros";
+  new_files[2].extents = {ExtentForRange(7, 1)};
+  new_files[3].name = "same";
+  new_files[3].extents = {ExtentForRange(6, 1)};
+  // A hardlink to "same", whose blocks are already visited.
+  new_files[4].name = "same";
+  new_files[4].extents = {ExtentForRange(6, 1)};
+
+  diff_utils::DeltaUnchangedFiles(&aops_,
+                                  old_files_map,
+                                  new_files,
+                                  old_block_ids,
+                                  new_block_ids,
+                                  2,  // chunk_blocks
+                                  &old_visited_blocks_,
+                                  &new_visited_blocks_);
+
+  ASSERT_EQ(3U, aops_.size());
+  EXPECT_EQ("moved", aops_[0].name);
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, aops_[0].op.type());
+  EXPECT_EQ(ExtentForRange(0, 2), aops_[0].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(3, 2), aops_[0].op.dst_extents(0));
+  EXPECT_EQ("moved", aops_[1].name);
+  EXPECT_EQ(ExtentForRange(7, 1), aops_[1].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(8, 1), aops_[1].op.dst_extents(0));
+  EXPECT_EQ("same", aops_[2].name);
+  EXPECT_EQ(ExtentForRange(6, 1), aops_[2].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(6, 1), aops_[2].op.dst_extents(0));
+
+  EXPECT_EQ(4U, old_visited_blocks_.blocks());
+  EXPECT_EQ(4U, new_visited_blocks_.blocks());
+}
+
+TEST_F(DeltaDiffUtilsTest, UnchangedPartitionIsCopiedTest) {
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 42));
+  bool unchanged = false;
+  EXPECT_TRUE(diff_utils::IsPartitionUnchanged(
+      old_part_, new_part_, nullptr, &unchanged));
+  EXPECT_TRUE(unchanged);
+
+  // The hash tree, in the block 100, isn't copied.
+  new_part_.hash_tree_data_size = 100 * block_size_;
+  diff_utils::DeltaUnchangedPartition(&aops_, new_part_, 50);
+  ASSERT_EQ(3U, aops_.size());
+  EXPECT_EQ(ExtentForRange(0, 50), aops_[0].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(50, 50), aops_[1].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(101, 27), aops_[2].op.src_extents(0));
+  for (const AnnotatedOperation& aop : aops_) {
+    EXPECT_EQ(InstallOperation::SOURCE_COPY, aop.op.type());
+    ASSERT_EQ(1, aop.op.dst_extents_size());
+    EXPECT_EQ(aop.op.src_extents(0), aop.op.dst_extents(0));
+  }
+
+  // A single changed byte in the last block is found.
+  ASSERT_TRUE(WriteExtents(new_part_.path,
+                           {ExtentForRange(kDefaultBlockCount - 1, 1)},
+                           block_size_,
+                           brillo::Blob(1, 'x')));
+  EXPECT_TRUE(diff_utils::IsPartitionUnchanged(
+      old_part_, new_part_, nullptr, &unchanged));
+  EXPECT_FALSE(unchanged);
+
+  // Partitions of different sizes always changed.
+  new_part_.size -= block_size_;
+  EXPECT_TRUE(diff_utils::IsPartitionUnchanged(
+      old_part_, new_part_, nullptr, &unchanged));
+  EXPECT_FALSE(unchanged);
+}
+
+TEST_F(DeltaDiffUtilsTest, UnchangedPartitionUsesTheCachedHashesTest) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  ImageIndexCache image_index_cache(cache_dir.path().value());
+  // The images aren't read when their block hashes are cached, even if their
+  // data differs.
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 1));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 2));
+  vector<uint8_t> hashes(kDefaultBlockCount * 32, 'h');
+  ASSERT_TRUE(
+      image_index_cache.StoreBlockHashes(old_part_.path, block_size_, hashes));
+  ASSERT_TRUE(
+      image_index_cache.StoreBlockHashes(new_part_.path, block_size_, hashes));
+  bool unchanged = false;
+  EXPECT_TRUE(diff_utils::IsPartitionUnchanged(
+      old_part_, new_part_, &image_index_cache, &unchanged));
+  EXPECT_TRUE(unchanged);
+
+  hashes[0] = 'x';
+  ASSERT_TRUE(
+      image_index_cache.StoreBlockHashes(new_part_.path, block_size_, hashes));
+  EXPECT_TRUE(diff_utils::IsPartitionUnchanged(
+      old_part_, new_part_, &image_index_cache, &unchanged));
+  EXPECT_FALSE(unchanged);
+}
+
+// Test that the new files without an old file of the same name are matched to
+// the removed file they share the most blocks with, or with the same base name.
+TEST_F(DeltaDiffUtilsTest, RenamedFilesAreMatchedTest) {
+  vector<BlockMapping::BlockId> old_block_ids = {1, 2, 3, 4, 5, 6, 7, 0};
+  vector<BlockMapping::BlockId> new_block_ids = {2, 3, 9, 5, 10, 11, 0, 12};
+
+  vector<FilesystemInterface::File> old_files(5);
+  old_files[0].name = "/system/lib/libfoo.so";
+  old_files[0].extents = {ExtentForRange(0, 3)};
+  old_files[1].name = "/system/app/Old.apk";
+  old_files[1].extents = {ExtentForRange(3, 2)};
+  old_files[2].name = "/system/bin/tool";
+  old_files[2].extents = {ExtentForRange(5, 1)};
+  old_files[3].name = "/system/bin/kept";
+  old_files[3].extents = {ExtentForRange(6, 1)};
+  old_files[4].name = "<free-space>";
+  old_files[4].extents = {ExtentForRange(7, 1)};
+  map<string, vector<Extent>> old_files_map;
+  for (const FilesystemInterface::File& file : old_files)
+    old_files_map[file.name] = file.extents;
+
+  vector<FilesystemInterface::File> new_files(5);
+  // Shares two blocks with the old library and one with the old apk.
+  new_files[0].name = "/system/lib64/libfoo.so";
+  new_files[0].extents = {ExtentForRange(0, 3), ExtentForRange(3, 1)};
+  // Shares no block with any old file, but has the name of a removed file.
+  new_files[1].name = "/vendor/bin/tool";
+  new_files[1].extents = {ExtentForRange(4, 2)};
+  new_files[2].name = "/system/bin/kept";
+  new_files[2].extents = {ExtentForRange(6, 1)};
+  new_files[3].name = "/system/app/New.apk";
+  new_files[3].extents = {ExtentForRange(7, 1)};
+  new_files[4].name = "<free-space>";
+
+  EXPECT_EQ(2U,
+            diff_utils::MatchRenamedFiles(old_files,
+                                          new_files,
+                                          old_block_ids,
+                                          new_block_ids,
+                                          &old_files_map));
+  EXPECT_EQ(old_files[0].extents, old_files_map["/system/lib64/libfoo.so"]);
+  EXPECT_EQ(old_files[2].extents, old_files_map["/vendor/bin/tool"]);
+  EXPECT_EQ(old_files[3].extents, old_files_map["/system/bin/kept"]);
+  EXPECT_EQ(0U, old_files_map.count("/system/app/New.apk"));
+}
+
+TEST_F(DeltaDiffUtilsTest, InitializePartitionInfoChunkHashesTest) {
+  brillo::Blob part_data;
+  EXPECT_TRUE(utils::ReadFile(new_part_.path, &part_data));
+  PartitionInfo info;
+  EXPECT_TRUE(diff_utils::InitializePartitionInfo(new_part_, 0, &info));
+  EXPECT_EQ(0, info.chunk_hashes_size());
+
+  // The last of the three chunks is shorter.
+  const uint64_t kChunkSize = 48 * block_size_;
+  PartitionInfo chunked_info;
+  EXPECT_TRUE(
+      diff_utils::InitializePartitionInfo(new_part_, kChunkSize, &chunked_info));
+  EXPECT_EQ(info.hash(), chunked_info.hash());
+  EXPECT_EQ(kChunkSize, chunked_info.hash_chunk_size());
+  ASSERT_EQ(3, chunked_info.chunk_hashes_size());
+  brillo::Blob last_chunk(part_data.begin() + 2 * kChunkSize, part_data.end());
+  brillo::Blob last_chunk_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(last_chunk, &last_chunk_hash));
+  EXPECT_EQ(string(last_chunk_hash.begin(), last_chunk_hash.end()),
+            chunked_info.chunk_hashes(2));
+}
+
+TEST_F(DeltaDiffUtilsTest, DiffWindowBlocksTest) {
+  const uint64_t kMaxDestinationSize = 200 * 1024 * 1024;
+  // A window of old and new data needs 19 bytes per byte of the new data.
+  EXPECT_EQ(10, diff_utils::DiffWindowBlocks(10 * 19 * kBlockSize,
+                                             kMaxDestinationSize));
+  EXPECT_EQ(10, diff_utils::DiffWindowBlocks(11 * 19 * kBlockSize - 1,
+                                             kMaxDestinationSize));
+  // Even a tiny limit allows to diff one block at a time.
+  EXPECT_EQ(1, diff_utils::DiffWindowBlocks(0, kMaxDestinationSize));
+  // The windows never exceed the bsdiff destination limit.
+  EXPECT_EQ(kMaxDestinationSize / kBlockSize,
+            diff_utils::DiffWindowBlocks(1024 * 1024 * 1024 * 1024ULL,
+                                         kMaxDestinationSize));
+  EXPECT_EQ(16, diff_utils::DiffWindowBlocks(1024 * 1024 * 1024 * 1024ULL,
+                                             16 * kBlockSize));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,174 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/zstd.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The magic at the start of every entry. The last byte is the version of the
+// cache, which must be changed when the operations generated for the same data
+// change, so old entries are ignored.
+const char kEntryMagic[] = {'U', 'E', 'D', '1'};
+
+// The size of the entry header: the magic followed by the operation type.
+const size_t kEntryHeaderSize = sizeof(kEntryMagic) + sizeof(uint32_t);
+
+}  // namespace
+
+DiffCache::DiffCache(const string& cache_dir) : cache_dir_(cache_dir) {}
+
+bool DiffCache::EntryPath(const brillo::Blob& old_data,
+                          const brillo::Blob& new_data,
+                          const PayloadVersion& version,
+                          string* path) const {
+  brillo::Blob old_hash, new_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(old_data, &old_hash));
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(new_data, &new_hash));
+
+  // Everything in the PayloadVersion used to choose the operation is part of
+  // the key, in a fixed layout.
+  const uint64_t major = version.major;
+  const uint32_t minor = version.minor;
+  const uint8_t imgdiff_allowed = version.imgdiff_allowed;
+  const double max_entropy = version.compression.max_entropy;
+  const uint64_t sample_size = version.compression.sample_size;
+  const double bzip_trial_margin = version.compression.bzip_trial_margin;
+  const uint8_t zstd_allowed = version.zstd_allowed;
+  const double zstd_size_margin = version.compression.zstd_size_margin;
+  const OperationCostModel& cost_model = version.cost_model;
+  // The memory profile limits the xz blobs and the bsdiff operations.
+  const int32_t xz_level = version.memory_profile.xz_level;
+  const uint32_t xz_dict_size = version.memory_profile.xz_dict_size;
+  const uint64_t max_bsdiff_destination_size =
+      version.memory_profile.max_bsdiff_destination_size;
+  // The id of the dictionary is derived from its contents.
+  const uint32_t zstd_dictionary_id =
+      ZstdCompressDictionary() ? ZstdCompressDictionary()->id() : 0;
+
+  HashCalculator key_hasher;
+  TEST_AND_RETURN_FALSE(key_hasher.Update(kEntryMagic, sizeof(kEntryMagic)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(old_hash.data(), old_hash.size()));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(new_hash.data(), new_hash.size()));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&major, sizeof(major)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&minor, sizeof(minor)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&imgdiff_allowed, sizeof(imgdiff_allowed)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&max_entropy, sizeof(max_entropy)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&sample_size, sizeof(sample_size)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&bzip_trial_margin, sizeof(bzip_trial_margin)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&zstd_allowed, sizeof(zstd_allowed)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&zstd_size_margin, sizeof(zstd_size_margin)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&zstd_dictionary_id, sizeof(zstd_dictionary_id)));
+  // The model only has doubles, so it has no padding.
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&cost_model, sizeof(cost_model)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&xz_level, sizeof(xz_level)));
+  TEST_AND_RETURN_FALSE(
+      key_hasher.Update(&xz_dict_size, sizeof(xz_dict_size)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&max_bsdiff_destination_size,
+                                          sizeof(max_bsdiff_destination_size)));
+  TEST_AND_RETURN_FALSE(key_hasher.Finalize());
+
+  const brillo::Blob& key = key_hasher.raw_hash();
+  *path = cache_dir_ + "/" + base::HexEncode(key.data(), key.size());
+  return true;
+}
+
+bool DiffCache::Lookup(const brillo::Blob& old_data,
+                       const brillo::Blob& new_data,
+                       const PayloadVersion& version,
+                       InstallOperation_Type* op_type,
+                       brillo::Blob* blob) {
+  string path;
+  brillo::Blob entry;
+  if (!EntryPath(old_data, new_data, version, &path) ||
+      !utils::FileExists(path.c_str()) || !utils::ReadFile(path, &entry) ||
+      entry.size() < kEntryHeaderSize ||
+      memcmp(entry.data(), kEntryMagic, sizeof(kEntryMagic)) != 0) {
+    misses_++;
+    return false;
+  }
+
+  uint32_t type;
+  memcpy(&type, entry.data() + sizeof(kEntryMagic), sizeof(type));
+  if (!InstallOperation_Type_IsValid(type)) {
+    LOG(WARNING) << "Ignoring the diff cache entry " << path
+                 << " with an invalid operation type " << type;
+    misses_++;
+    return false;
+  }
+  *op_type = static_cast<InstallOperation_Type>(type);
+  blob->assign(entry.begin() + kEntryHeaderSize, entry.end());
+  hits_++;
+  return true;
+}
+
+bool DiffCache::Store(const brillo::Blob& old_data,
+                      const brillo::Blob& new_data,
+                      const PayloadVersion& version,
+                      InstallOperation_Type op_type,
+                      const brillo::Blob& blob) {
+  string path;
+  TEST_AND_RETURN_FALSE(EntryPath(old_data, new_data, version, &path));
+
+  brillo::Blob entry(kEntryMagic, kEntryMagic + sizeof(kEntryMagic));
+  const uint32_t type = op_type;
+  const uint8_t* type_bytes = reinterpret_cast<const uint8_t*>(&type);
+  entry.insert(entry.end(), type_bytes, type_bytes + sizeof(type));
+  entry.insert(entry.end(), blob.begin(), blob.end());
+
+  // The entry is written to a temporary file in the same directory and renamed
+  // once complete, so other threads or processes never see a partial entry.
+  string temp_path = path + ".XXXXXX";
+  std::vector<char> temp_path_buf(temp_path.begin(), temp_path.end());
+  temp_path_buf.push_back('\0');
+  int fd = mkstemp(temp_path_buf.data());
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  temp_path = temp_path_buf.data();
+  bool written = utils::WriteAll(fd, entry.data(), entry.size());
+  written = IGNORE_EINTR(close(fd)) == 0 && written;
+  if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to store the diff cache entry " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <atomic>
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// An on-disk cache of the operations generated to produce some new data from
+// some old data, so the same pair of files diffed for several payloads (for
+// example, from many old builds to the same new build) is only diffed once.
+// Each entry stores the type of the operation chosen and its blob in a file
+// named after the hash of the old data, the new data and the PayloadVersion
+// fields that affect the choice. The cache can be shared by several threads
+// and processes.
+class DiffCache {
+ public:
+  // Creates a cache in the existing directory |cache_dir|.
+  explicit DiffCache(const std::string& cache_dir);
+
+  // Looks for the operation generated from |old_data| to |new_data| with
+  // |version|. Returns whether it was found, setting |op_type| and |blob|.
+  bool Lookup(const brillo::Blob& old_data,
+              const brillo::Blob& new_data,
+              const PayloadVersion& version,
+              InstallOperation_Type* op_type,
+              brillo::Blob* blob);
+
+  // Stores the operation of type |op_type| with the |blob| generated from
+  // |old_data| to |new_data| with |version|. Returns false on error.
+  bool Store(const brillo::Blob& old_data,
+             const brillo::Blob& new_data,
+             const PayloadVersion& version,
+             InstallOperation_Type op_type,
+             const brillo::Blob& blob);
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  // Returns the path of the entry for |old_data|, |new_data| and |version| in
+  // |path|.
+  bool EntryPath(const brillo::Blob& old_data,
+                 const brillo::Blob& new_data,
+                 const PayloadVersion& version,
+                 std::string* path) const;
+
+  const std::string cache_dir_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(cache_dir_.CreateUniqueTempDir());
+    version_ = PayloadVersion(kChromeOSMajorPayloadVersion,
+                              kSourceMinorPayloadVersion);
+  }
+
+  base::ScopedTempDir cache_dir_;
+  PayloadVersion version_;
+
+  const brillo::Blob old_data_ = brillo::Blob(4096, 'a');
+  const brillo::Blob new_data_ = brillo::Blob(4096, 'b');
+  const brillo::Blob blob_ = {'p', 'a', 't', 'c', 'h'};
+};
+
+TEST_F(DiffCacheTest, StoredOperationIsFoundTest) {
+  DiffCache cache(cache_dir_.path().value());
+  InstallOperation_Type op_type;
+  brillo::Blob blob;
+  EXPECT_FALSE(cache.Lookup(old_data_, new_data_, version_, &op_type, &blob));
+  EXPECT_TRUE(cache.Store(old_data_, new_data_, version_,
+                          InstallOperation::SOURCE_BSDIFF, blob_));
+
+  // The entry is found by a new cache in the same directory, as a later
+  // payload would.
+  DiffCache other_cache(cache_dir_.path().value());
+  EXPECT_TRUE(
+      other_cache.Lookup(old_data_, new_data_, version_, &op_type, &blob));
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, op_type);
+  EXPECT_EQ(blob_, blob);
+  EXPECT_EQ(1U, other_cache.hits());
+  EXPECT_EQ(0U, other_cache.misses());
+}
+
+TEST_F(DiffCacheTest, KeyIncludesDataAndVersionTest) {
+  DiffCache cache(cache_dir_.path().value());
+  EXPECT_TRUE(cache.Store(old_data_, new_data_, version_,
+                          InstallOperation::SOURCE_BSDIFF, blob_));
+
+  InstallOperation_Type op_type;
+  brillo::Blob blob;
+  EXPECT_FALSE(cache.Lookup(new_data_, old_data_, version_, &op_type, &blob));
+  EXPECT_FALSE(cache.Lookup({}, new_data_, version_, &op_type, &blob));
+
+  PayloadVersion other_version = version_;
+  other_version.imgdiff_allowed = true;
+  EXPECT_FALSE(
+      cache.Lookup(old_data_, new_data_, other_version, &op_type, &blob));
+  other_version = version_;
+  other_version.compression.max_entropy = 8.0;
+  EXPECT_FALSE(
+      cache.Lookup(old_data_, new_data_, other_version, &op_type, &blob));
+  EXPECT_EQ(4U, cache.misses());
+}
+
+TEST_F(DiffCacheTest, KeyIncludesMemoryProfileTest) {
+  PayloadVersion low_ram_version = version_;
+  ASSERT_TRUE(low_ram_version.memory_profile.SetMemoryClass("low-ram"));
+  const brillo::Blob low_ram_blob = {'l', 'o', 'w'};
+
+  DiffCache cache(cache_dir_.path().value());
+  EXPECT_TRUE(cache.Store(old_data_, new_data_, version_,
+                          InstallOperation::SOURCE_BSDIFF, blob_));
+  InstallOperation_Type op_type;
+  brillo::Blob blob;
+  EXPECT_FALSE(
+      cache.Lookup(old_data_, new_data_, low_ram_version, &op_type, &blob));
+  EXPECT_TRUE(cache.Store(old_data_, new_data_, low_ram_version,
+                          InstallOperation::REPLACE_XZ, low_ram_blob));
+
+  // Each profile only finds its own entry.
+  EXPECT_TRUE(cache.Lookup(old_data_, new_data_, version_, &op_type, &blob));
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, op_type);
+  EXPECT_EQ(blob_, blob);
+  EXPECT_TRUE(
+      cache.Lookup(old_data_, new_data_, low_ram_version, &op_type, &blob));
+  EXPECT_EQ(InstallOperation::REPLACE_XZ, op_type);
+  EXPECT_EQ(low_ram_blob, blob);
+
+  // Any of the limits is enough to tell them apart.
+  PayloadVersion other_version = version_;
+  other_version.memory_profile.xz_level = 9;
+  EXPECT_FALSE(
+      cache.Lookup(old_data_, new_data_, other_version, &op_type, &blob));
+  other_version = version_;
+  other_version.memory_profile.max_bsdiff_destination_size = 1024;
+  EXPECT_FALSE(
+      cache.Lookup(old_data_, new_data_, other_version, &op_type, &blob));
+  EXPECT_EQ(3U, cache.misses());
+}
+
+TEST_F(DiffCacheTest, EmptyBlobTest) {
+  DiffCache cache(cache_dir_.path().value());
+  EXPECT_TRUE(cache.Store({}, new_data_, version_, InstallOperation::REPLACE_BZ,
+                          {}));
+  InstallOperation_Type op_type;
+  brillo::Blob blob = blob_;
+  EXPECT_TRUE(cache.Lookup({}, new_data_, version_, &op_type, &blob));
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, op_type);
+  EXPECT_TRUE(blob.empty());
+}
+
+TEST_F(DiffCacheTest, MissingDirectoryFailsToStoreTest) {
+  DiffCache cache(cache_dir_.path().Append("missing").value());
+  EXPECT_FALSE(cache.Store(old_data_, new_data_, version_,
+                           InstallOperation::SOURCE_BSDIFF, blob_));
+  InstallOperation_Type op_type;
+  brillo::Blob blob;
+  EXPECT_FALSE(cache.Lookup(old_data_, new_data_, version_, &op_type, &blob));
+}
+
+}  // namespace chromeos_update_engine
@@ -20,11 +20,15 @@
 #include <ext2fs/ext2_io.h>
 #include <ext2fs/ext2fs.h>
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <map>
 #include <set>
 
 #include <base/logging.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -116,75 +120,63 @@ int UpdateFileAndAppend(ext2_ino_t dir,
   return 0;
 }
 
-}  // namespace
-
-unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
-    const string& filename) {
-  if (filename.empty())
-    return nullptr;
-  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
-  result->filename_ = filename;
-
-  errcode_t err = ext2fs_open(filename.c_str(),
-                              0,  // flags (read only)
-                              0,  // superblock block number
-                              0,  // block_size (autodetect)
-                              unix_io_manager,
-                              &result->filsys_);
-  if (err) {
-    LOG(ERROR) << "Opening ext2fs " << filename;
-    return nullptr;
-  }
-  return result;
-}
-
-Ext2Filesystem::~Ext2Filesystem() {
-  ext2fs_free(filsys_);
-}
-
-size_t Ext2Filesystem::GetBlockSize() const {
-  return filsys_->blocksize;
-}
+// The minimum number of block groups whose inodes are scanned by each thread.
+const dgrp_t kMinScanGroups = 16;
 
-size_t Ext2Filesystem::GetBlockCount() const {
-  return ext2fs_blocks_count(filsys_->super);
-}
-
-bool Ext2Filesystem::GetFiles(vector<File>* files) const {
-  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys_));
-
-  ext2_inode_scan iscan;
-  TEST_AND_RETURN_FALSE_ERRCODE(
-      ext2fs_open_inode_scan(filsys_, 0 /* buffer_blocks */, &iscan));
-
-  std::map<ext2_ino_t, File> inodes;
+// The inodes in use found in a range of block groups.
+struct InodeScanResult {
+  std::map<ext2_ino_t, FilesystemInterface::File> inodes;
 
   // List of directories. We need to first parse all the files in a directory
   // to later fix the absolute paths.
   vector<ext2_ino_t> directories;
 
+  // The indirect blocks of the files.
   set<uint64_t> inode_blocks;
+};
+
+// Scans the inodes of the block groups [|first_group|, |end_group|) of
+// |filsys| into |result|.
+bool ScanInodes(ext2_filsys filsys,
+                dgrp_t first_group,
+                dgrp_t end_group,
+                InodeScanResult* result) {
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys));
+
+  ext2_inode_scan iscan;
+  TEST_AND_RETURN_FALSE_ERRCODE(
+      ext2fs_open_inode_scan(filsys, 0 /* buffer_blocks */, &iscan));
+  // The inodes are numbered from 1, in order of their block group.
+  const ext2_ino_t end_ino = end_group * EXT2_INODES_PER_GROUP(filsys->super);
 
   // Iterator
   ext2_ino_t it_ino;
   ext2_inode it_inode;
 
   bool ok = true;
-  while (true) {
+  if (first_group > 0) {
+    errcode_t error = ext2fs_inode_scan_goto_blockgroup(iscan, first_group);
+    if (error) {
+      LOG(ERROR) << "Failed to go to the block group " << first_group << " ("
+                 << error << ")";
+      ok = false;
+    }
+  }
+  while (ok) {
     errcode_t error = ext2fs_get_next_inode(iscan, &it_ino, &it_inode);
     if (error) {
       LOG(ERROR) << "Failed to retrieve next inode (" << error << ")";
       ok = false;
       break;
     }
-    if (it_ino == 0)
+    if (it_ino == 0 || it_ino > end_ino)
       break;
 
     // Skip inodes that are not in use.
-    if (!ext2fs_test_inode_bitmap(filsys_->inode_map, it_ino))
+    if (!ext2fs_test_inode_bitmap(filsys->inode_map, it_ino))
       continue;
 
-    File& file = inodes[it_ino];
+    FilesystemInterface::File& file = result->inodes[it_ino];
     if (it_ino == EXT2_RESIZE_INO) {
       file.name = "<group-descriptors>";
     } else {
@@ -198,15 +190,15 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     file.file_stat.st_uid = it_inode.i_uid;
     file.file_stat.st_gid = it_inode.i_gid;
     file.file_stat.st_size = it_inode.i_size;
-    file.file_stat.st_blksize = filsys_->blocksize;
+    file.file_stat.st_blksize = filsys->blocksize;
     file.file_stat.st_blocks = it_inode.i_blocks;
     file.file_stat.st_atime = it_inode.i_atime;
     file.file_stat.st_mtime = it_inode.i_mtime;
     file.file_stat.st_ctime = it_inode.i_ctime;
 
-    bool is_dir = (ext2fs_check_directory(filsys_, it_ino) == 0);
+    bool is_dir = (ext2fs_check_directory(filsys, it_ino) == 0);
     if (is_dir)
-      directories.push_back(it_ino);
+      result->directories.push_back(it_ino);
 
     if (!ext2fs_inode_has_valid_blocks(&it_inode))
       continue;
@@ -216,7 +208,7 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     // and triple indirect blocks (no data blocks). For directories and
     // the journal, all blocks are considered metadata blocks.
     int flags = it_ino < EXT2_GOOD_OLD_FIRST_INO ? 0 : BLOCK_FLAG_DATA_ONLY;
-    error = ext2fs_block_iterate2(filsys_, it_ino, flags,
+    error = ext2fs_block_iterate2(filsys, it_ino, flags,
                                   nullptr,  // block_buf
                                   ProcessInodeAllBlocks,
                                   &file.extents);
@@ -227,14 +219,128 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
       continue;
     }
     if (it_ino >= EXT2_GOOD_OLD_FIRST_INO) {
-      ext2fs_block_iterate2(filsys_, it_ino, 0, nullptr,
+      ext2fs_block_iterate2(filsys, it_ino, 0, nullptr,
                             AddMetadataBlocks,
-                            &inode_blocks);
+                            &result->inode_blocks);
     }
   }
   ext2fs_close_inode_scan(iscan);
-  if (!ok)
-    return false;
+  return ok;
+}
+
+// This class scans the inodes of the block groups [|first_group|, |end_group|)
+// of the ext2 filesystem in |filename|, from a worker thread. The libext2fs
+// handles can't be shared between threads, so each scanner opens its own.
+class InodeScanner : public base::DelegateSimpleThread::Delegate {
+ public:
+  InodeScanner(const string& filename, dgrp_t first_group, dgrp_t end_group)
+      : filename_(filename), first_group_(first_group), end_group_(end_group) {}
+  InodeScanner(InodeScanner&&) = default;
+  ~InodeScanner() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    ext2_filsys filsys = nullptr;
+    errcode_t err = ext2fs_open(filename_.c_str(),
+                                0,  // flags (read only)
+                                0,  // superblock block number
+                                0,  // block_size (autodetect)
+                                unix_io_manager,
+                                &filsys);
+    if (err) {
+      LOG(ERROR) << "Opening ext2fs " << filename_;
+      return;
+    }
+    success_ = ScanInodes(filsys, first_group_, end_group_, &result_);
+    ext2fs_free(filsys);
+  }
+
+  bool success() const { return success_; }
+  InodeScanResult* result() { return &result_; }
+
+ private:
+  string filename_;
+  dgrp_t first_group_;
+  dgrp_t end_group_;
+
+  InodeScanResult result_;
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(InodeScanner);
+};
+
+}  // namespace
+
+unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
+    const string& filename) {
+  if (filename.empty())
+    return nullptr;
+  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
+  result->filename_ = filename;
+
+  errcode_t err = ext2fs_open(filename.c_str(),
+                              0,  // flags (read only)
+                              0,  // superblock block number
+                              0,  // block_size (autodetect)
+                              unix_io_manager,
+                              &result->filsys_);
+  if (err) {
+    LOG(ERROR) << "Opening ext2fs " << filename;
+    return nullptr;
+  }
+  return result;
+}
+
+Ext2Filesystem::~Ext2Filesystem() {
+  ext2fs_free(filsys_);
+}
+
+size_t Ext2Filesystem::GetBlockSize() const {
+  return filsys_->blocksize;
+}
+
+size_t Ext2Filesystem::GetBlockCount() const {
+  return ext2fs_blocks_count(filsys_->super);
+}
+
+bool Ext2Filesystem::GetFiles(vector<File>* files) const {
+  // Scan the inodes in contiguous ranges of block groups, one per thread, and
+  // then merge them in order so the result doesn't depend on the threads.
+  const dgrp_t num_groups = filsys_->group_desc_count;
+  const dgrp_t max_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  const dgrp_t range_groups =
+      std::max((num_groups + max_threads - 1) / max_threads, kMinScanGroups);
+  vector<InodeScanner> scanners;
+  for (dgrp_t group = 0; group < num_groups; group += range_groups) {
+    scanners.emplace_back(
+        filename_, group, std::min(group + range_groups, num_groups));
+  }
+
+  InodeScanResult scan;
+  if (scanners.size() <= 1) {
+    TEST_AND_RETURN_FALSE(ScanInodes(filsys_, 0, num_groups, &scan));
+  } else {
+    base::DelegateSimpleThreadPool thread_pool("inode-scanner",
+                                               scanners.size());
+    thread_pool.Start();
+    for (InodeScanner& scanner : scanners)
+      thread_pool.AddWork(&scanner);
+    thread_pool.JoinAll();
+
+    for (InodeScanner& scanner : scanners) {
+      TEST_AND_RETURN_FALSE(scanner.success());
+      InodeScanResult* result = scanner.result();
+      scan.inodes.insert(result->inodes.begin(), result->inodes.end());
+      scan.directories.insert(scan.directories.end(),
+                              result->directories.begin(),
+                              result->directories.end());
+      scan.inode_blocks.insert(result->inode_blocks.begin(),
+                               result->inode_blocks.end());
+    }
+  }
+  std::map<ext2_ino_t, File>& inodes = scan.inodes;
+  const vector<ext2_ino_t>& directories = scan.directories;
+  const set<uint64_t>& inode_blocks = scan.inode_blocks;
 
   // The set of inodes already added to the output. There can be less elements
   // here than in files since the later can contain repeated inodes due to
@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 
 #include <algorithm>
+#include <iterator>
 #include <set>
 #include <utility>
 #include <vector>
@@ -79,23 +80,24 @@ void ExtentRanges::AddExtent(Extent extent) {
   if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
     return;
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
+  // The extents in |extent_set_| don't overlap or touch each other, so only
+  // the extent before the first one starting at or after |extent| and the ones
+  // starting up to its end can be merged with it.
+  ExtentSet::iterator begin_del = extent_set_.lower_bound(extent);
+  if (begin_del != extent_set_.begin()) {
+    ExtentSet::iterator prev = std::prev(begin_del);
+    if (ExtentsOverlapOrTouch(*prev, extent))
+      begin_del = prev;
+  }
+  ExtentSet::iterator end_del = begin_del;
   uint64_t del_blocks = 0;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e; ++it) {
-    if (ExtentsOverlapOrTouch(*it, extent)) {
-      end_del = it;
-      ++end_del;
-      del_blocks += it->num_blocks();
-      if (begin_del == extent_set_.end())
-        begin_del = it;
-
-      extent = UnionOverlappingExtents(extent, *it);
-    }
+  while (end_del != extent_set_.end() &&
+         ExtentsOverlapOrTouch(*end_del, extent)) {
+    del_blocks += end_del->num_blocks();
+    extent = UnionOverlappingExtents(extent, *end_del);
+    ++end_del;
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(extent);
+  extent_set_.insert(extent_set_.erase(begin_del, end_del), extent);
   blocks_ -= del_blocks;
   blocks_ += extent.num_blocks();
 }
@@ -122,28 +124,27 @@ void ExtentRanges::SubtractExtent(const Extent& extent) {
   if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
     return;
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
+  // Only the extent before the first one starting at or after |extent| and the
+  // ones starting before its end can overlap it.
+  ExtentSet::iterator begin_del = extent_set_.lower_bound(extent);
+  if (begin_del != extent_set_.begin()) {
+    ExtentSet::iterator prev = std::prev(begin_del);
+    if (ExtentsOverlap(*prev, extent))
+      begin_del = prev;
+  }
+  ExtentSet::iterator end_del = begin_del;
   uint64_t del_blocks = 0;
   ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e; ++it) {
-    if (!ExtentsOverlap(*it, extent))
-      continue;
-
-    if (begin_del == extent_set_.end())
-      begin_del = it;
-    end_del = it;
-    ++end_del;
-
-    del_blocks += it->num_blocks();
+  while (end_del != extent_set_.end() && ExtentsOverlap(*end_del, extent)) {
+    del_blocks += end_del->num_blocks();
 
-    ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
+    ExtentSet subtraction = SubtractOverlappingExtents(*end_del, extent);
     for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
          jt != je; ++jt) {
       new_extents.insert(*jt);
       del_blocks -= jt->num_blocks();
     }
+    ++end_del;
   }
   extent_set_.erase(begin_del, end_del);
   extent_set_.insert(new_extents.begin(), new_extents.end());
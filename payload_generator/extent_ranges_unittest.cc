@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_generator/extent_ranges.h"
 
+#include <random>
+#include <set>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -287,6 +289,45 @@ TEST(ExtentRangesTest, ContainsBlockTest) {
   EXPECT_FALSE(ranges.ContainsBlock(101));
 }
 
+TEST(ExtentRangesTest, RandomOperationsMatchBlockSetTest) {
+  // Compare the result of many random additions and subtractions with a set of
+  // all the blocks.
+  ExtentRanges ranges;
+  std::set<uint64_t> blocks;
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<uint64_t> start_dis(0, 2000);
+  std::uniform_int_distribution<uint64_t> size_dis(1, 20);
+  for (int i = 0; i < 5000; i++) {
+    const Extent extent = ExtentForRange(start_dis(gen), size_dis(gen));
+    const bool add = i % 3 != 0;
+    if (add)
+      ranges.AddExtent(extent);
+    else
+      ranges.SubtractExtent(extent);
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks(); block++) {
+      if (add)
+        blocks.insert(block);
+      else
+        blocks.erase(block);
+    }
+  }
+
+  EXPECT_EQ(blocks.size(), ranges.blocks());
+  uint64_t prev_end = 0;
+  std::set<uint64_t> range_blocks;
+  for (const Extent& extent : ranges.extent_set()) {
+    // The extents are never empty, and don't overlap or touch each other.
+    EXPECT_GT(extent.num_blocks(), 0U);
+    if (prev_end > 0)
+      EXPECT_LT(prev_end, extent.start_block());
+    prev_end = extent.start_block() + extent.num_blocks();
+    for (uint64_t block = extent.start_block(); block < prev_end; block++)
+      range_blocks.insert(block);
+  }
+  EXPECT_EQ(blocks, range_blocks);
+}
+
 TEST(ExtentRangesTest, FilterExtentRangesEmptyRanges) {
   ExtentRanges ranges;
   EXPECT_EQ(vector<Extent>(),
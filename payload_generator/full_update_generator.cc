@@ -18,6 +18,7 @@
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <algorithm>
 #include <deque>
@@ -32,6 +33,8 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/mapped_image.h"
 
 using std::vector;
 
@@ -41,22 +44,237 @@ namespace {
 
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 
+// The largest chunk size picked for the compressible partitions. Larger
+// chunks compress slightly better but are decompressed by fewer workers.
+const size_t kMaxAutoFullChunkSize = 4 * 1024 * 1024;  // 4 MiB
+
+// The minimum number of chunks of a partition for every operation the target
+// devices decompress in parallel, so their workers stay balanced.
+const size_t kMinChunksPerApplyThread = 8;
+
+// The number and size of the slices of a partition sampled to estimate its
+// compressibility.
+const size_t kPartitionSampleSlices = 16;
+const size_t kPartitionSampleSliceSize = 64 * 1024;
+
+// The memory estimated to compress a chunk, as a multiple of its size: the
+// input, the blobs of every compressor tried and the match finder of xz.
+const uint64_t kChunkMemoryFactor = 16;
+
+// The fraction of the physical memory used by the compressing threads when
+// no limit is configured.
+const uint64_t kFullMemoryBudgetDivisor = 2;
+
+// The number of blocks read at once to find the content-defined chunks of a
+// partition that isn't mapped.
+const size_t kChunkingReadBlocks = 256;
+
+// The gear hash of the content-defined chunks is shifted this many bits for
+// every block, so its top bits only depend on the last 64 / 8 = 8 blocks.
+const size_t kChunkingWindowShift = 8;
+
+// Reads up to |size| bytes at |offset| of the partition into |buffer| like
+// utils::PReadAll(), from its |image| if it's mapped or from |fd| otherwise.
+// The sparse images are only read from their mapping.
+bool ReadPartitionData(int fd,
+                       const MappedImage* image,
+                       void* buffer,
+                       size_t size,
+                       uint64_t offset,
+                       ssize_t* bytes_read) {
+  if (!image)
+    return utils::PReadAll(fd, buffer, size, offset, bytes_read);
+  const uint64_t available =
+      offset < image->size() ? image->size() - offset : 0;
+  *bytes_read = std::min(static_cast<uint64_t>(size), available);
+  memcpy(buffer, image->data() + offset, *bytes_read);
+  return true;
+}
+
+// Returns a fingerprint of the |size| bytes of a block at |data|: their 64-bit
+// FNV-1a hash, taken a word at a time. It only needs to be the same in every
+// build of the generator.
+uint64_t BlockFingerprint(const uint8_t* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Splits the |partition_blocks| blocks of |block_size| bytes of the partition
+// read from |fd|, or from its |image| if mapped, in content-defined |chunks|.
+// A chunk ends after at least half of |chunk_blocks| blocks when the gear hash
+// of the fingerprints of the last blocks has its top bits clear, which is
+// true every |chunk_blocks| / 2 blocks on average, or when it reaches
+// |max_blocks| blocks. Only the blocks near an inserted or removed one move
+// the boundaries, so the chunks resynchronize right after it.
+bool ContentDefinedChunks(int fd,
+                          const MappedImage* image,
+                          size_t block_size,
+                          size_t partition_blocks,
+                          size_t chunk_blocks,
+                          size_t max_blocks,
+                          vector<Extent>* chunks) {
+  const size_t min_blocks = std::max(chunk_blocks / 2, static_cast<size_t>(1));
+  max_blocks = std::max(max_blocks, min_blocks);
+  size_t boundary_bits = 0;
+  while ((static_cast<size_t>(2) << boundary_bits) <= chunk_blocks - min_blocks)
+    boundary_bits++;
+
+  chunks->clear();
+  brillo::Blob buffer;
+  uint64_t gear_hash = 0;
+  size_t chunk_start = 0;
+  for (size_t block = 0; block < partition_blocks; block++) {
+    const uint8_t* data;
+    if (image) {
+      data = image->Blocks(block, 1, block_size);
+      TEST_AND_RETURN_FALSE(data);
+    } else {
+      const size_t buffer_block = block % kChunkingReadBlocks;
+      if (buffer_block == 0) {
+        const size_t num_blocks =
+            std::min(kChunkingReadBlocks, partition_blocks - block);
+        buffer.resize(num_blocks * block_size);
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                              buffer.data(),
+                                              buffer.size(),
+                                              block * block_size,
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read ==
+                              static_cast<ssize_t>(buffer.size()));
+      }
+      data = buffer.data() + buffer_block * block_size;
+    }
+    gear_hash = (gear_hash << kChunkingWindowShift) +
+                BlockFingerprint(data, block_size);
+
+    const size_t num_blocks = block + 1 - chunk_start;
+    if (num_blocks >= max_blocks ||
+        (num_blocks >= min_blocks &&
+         (boundary_bits == 0 || gear_hash >> (64 - boundary_bits) == 0))) {
+      chunks->push_back(ExtentForRange(chunk_start, num_blocks));
+      chunk_start = block + 1;
+    }
+  }
+  if (chunk_start < partition_blocks) {
+    chunks->push_back(
+        ExtentForRange(chunk_start, partition_blocks - chunk_start));
+  }
+  return true;
+}
+
+// Keeps the input buffers of the chunks, so every thread reuses the same one
+// instead of allocating and clearing one per chunk.
+class ChunkBufferPool {
+ public:
+  ChunkBufferPool() = default;
+
+  // Returns a buffer of |size| bytes, reusing a released one if possible.
+  brillo::Blob Acquire(size_t size) {
+    brillo::Blob buffer;
+    {
+      base::AutoLock auto_lock(lock_);
+      if (!buffers_.empty()) {
+        buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+      }
+    }
+    buffer.resize(size);
+    return buffer;
+  }
+
+  // Returns the |buffer| to the pool.
+  void Release(brillo::Blob&& buffer) {
+    base::AutoLock auto_lock(lock_);
+    buffers_.push_back(std::move(buffer));
+  }
+
+ private:
+  base::Lock lock_;
+  vector<brillo::Blob> buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkBufferPool);
+};
+
+// Returns the chunk size of the full operations of the partition of
+// |partition_size| bytes read from |fd| or its |image|. The data that looks
+// random gets the default chunks: the |soft_chunk_size|, or up to 1 MiB
+// without a hard chunk size. The compressible data gets the largest chunks
+// that still leave enough of them for the |apply_parallelism| of the devices,
+// up to the |soft_chunk_size|.
+size_t AutoFullChunkSize(const PayloadGenerationConfig& config,
+                         int fd,
+                         const MappedImage* image,
+                         uint64_t partition_size) {
+  size_t default_chunk_size = config.soft_chunk_size;
+  if (config.hard_chunk_size < 0)
+    default_chunk_size = std::min(kDefaultFullChunkSize, default_chunk_size);
+
+  brillo::Blob sample;
+  if (partition_size > 0) {
+    const uint64_t slice_size =
+        std::min(static_cast<uint64_t>(kPartitionSampleSliceSize),
+                 partition_size);
+    const uint64_t stride = partition_size / kPartitionSampleSlices;
+    for (size_t i = 0; i < kPartitionSampleSlices; i++) {
+      const uint64_t offset =
+          std::min(i * stride, partition_size - slice_size);
+      brillo::Blob slice(slice_size);
+      ssize_t bytes_read = -1;
+      if (!ReadPartitionData(
+              fd, image, slice.data(), slice.size(), offset, &bytes_read)) {
+        break;
+      }
+      slice.resize(std::max(bytes_read, static_cast<ssize_t>(0)));
+      sample.insert(sample.end(), slice.begin(), slice.end());
+    }
+  }
+  const double entropy = diff_utils::ByteEntropy(sample);
+  if (entropy > config.version.compression.max_entropy)
+    return default_chunk_size;
+
+  const uint64_t min_chunks =
+      std::max(config.apply_parallelism, static_cast<size_t>(1)) *
+      kMinChunksPerApplyThread;
+  uint64_t chunk_size = kMaxAutoFullChunkSize;
+  while (chunk_size > default_chunk_size &&
+         partition_size / chunk_size < min_chunks) {
+    chunk_size /= 2;
+  }
+  return std::max(std::min(static_cast<size_t>(chunk_size),
+                           config.soft_chunk_size),
+                  default_chunk_size);
+}
+
 // This class encapsulates a full update chunk processing thread work. The
 // processor reads a chunk of data from the input file descriptor and compresses
 // it. The processor will destroy itself when the work is done.
 class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
+  // Read a chunk of |size| bytes from |fd|, or from its |image| if mapped,
+  // starting at offset |offset|, into a buffer of the |buffers|.
   ChunkProcessor(const PayloadVersion& version,
                  int fd,
+                 const MappedImage* image,
                  off_t offset,
                  size_t size,
+                 ChunkBufferPool* buffers,
                  BlobFileWriter* blob_file,
                  AnnotatedOperation* aop)
       : version_(version),
         fd_(fd),
+        image_(image),
         offset_(offset),
         size_(size),
+        buffers_(buffers),
         blob_file_(blob_file),
         aop_(aop) {}
   // We use a default move constructor since all the data members are POD types.
@@ -76,8 +294,10 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
   // Work parameters.
   const PayloadVersion& version_;
   int fd_;
+  const MappedImage* image_;
   off_t offset_;
   size_t size_;
+  ChunkBufferPool* buffers_;
   BlobFileWriter* blob_file_;
   AnnotatedOperation* aop_;
 
@@ -92,19 +312,22 @@ void ChunkProcessor::Run() {
 }
 
 bool ChunkProcessor::ProcessChunk() {
-  brillo::Blob buffer_in_(size_);
+  brillo::Blob buffer_in_ = buffers_->Acquire(size_);
   brillo::Blob op_blob;
   ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
-                                        buffer_in_.data(),
-                                        buffer_in_.size(),
-                                        offset_,
-                                        &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+  bool success = ReadPartitionData(fd_,
+                                   image_,
+                                   buffer_in_.data(),
+                                   buffer_in_.size(),
+                                   offset_,
+                                   &bytes_read) &&
+                 bytes_read == static_cast<ssize_t>(size_);
 
   InstallOperation_Type op_type;
-  TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
-      buffer_in_, version_, &op_blob, &op_type));
+  success = success && diff_utils::GenerateBestFullOperation(
+                           buffer_in_, version_, &op_blob, &op_type);
+  buffers_->Release(std::move(buffer_in_));
+  TEST_AND_RETURN_FALSE(success);
 
   aop_->op.set_type(op_type);
   TEST_AND_RETURN_FALSE(aop_->SetOperationBlob(op_blob, blob_file_));
@@ -121,63 +344,110 @@ bool FullUpdateGenerator::GenerateOperations(
     vector<AnnotatedOperation>* aops) {
   TEST_AND_RETURN_FALSE(new_part.ValidateExists());
 
+  int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  const MappedImage* image = MappedImage::Find(new_part.path);
+
   // FullUpdateGenerator requires a positive chunk_size, otherwise there will
   // be only one operation with the whole partition which should not be allowed.
-  // For performance reasons, we force a small default hard limit of 1 MiB. This
-  // limit can be changed in the config, and we will use the smaller of the two
-  // soft/hard limits.
-  size_t full_chunk_size;
+  // Unless configured, the chunk size is picked from the partition data, up to
+  // the soft chunk size. It is always limited by the hard chunk size.
+  size_t full_chunk_size = config.full_chunk_size;
+  if (full_chunk_size == 0) {
+    full_chunk_size = AutoFullChunkSize(config, in_fd, image, new_part.size);
+    LOG(INFO) << "Using a chunk_size of " << full_chunk_size << " bytes for "
+              << "the full operations of " << new_part.name;
+  }
   if (config.hard_chunk_size >= 0) {
     full_chunk_size = std::min(static_cast<size_t>(config.hard_chunk_size),
-                               config.soft_chunk_size);
-  } else {
-    full_chunk_size = std::min(kDefaultFullChunkSize, config.soft_chunk_size);
-    LOG(INFO) << "No chunk_size provided, using the default chunk_size for the "
-              << "full operations: " << full_chunk_size << " bytes.";
+                               full_chunk_size);
   }
   TEST_AND_RETURN_FALSE(full_chunk_size > 0);
   TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
 
+  // The threads are limited by the memory needed to compress their chunks.
+  uint64_t memory_limit = config.full_memory_limit;
+  if (memory_limit == 0) {
+    memory_limit = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) *
+                   sysconf(_SC_PAGESIZE) / kFullMemoryBudgetDivisor;
+  }
   size_t chunk_blocks = full_chunk_size / config.block_size;
+  size_t partition_blocks = new_part.size / config.block_size;
+  vector<Extent> chunks;
+  if (config.content_defined_chunks) {
+    // The chunks may be twice as large as the chunk size, within the hard
+    // chunk size.
+    size_t max_blocks = 2 * chunk_blocks;
+    if (config.hard_chunk_size >= 0) {
+      max_blocks = std::min(
+          max_blocks,
+          static_cast<size_t>(config.hard_chunk_size) / config.block_size);
+    }
+    TEST_AND_RETURN_FALSE(ContentDefinedChunks(in_fd,
+                                               image,
+                                               config.block_size,
+                                               partition_blocks,
+                                               chunk_blocks,
+                                               max_blocks,
+                                               &chunks));
+  } else {
+    for (size_t start_block = 0; start_block < partition_blocks;
+         start_block += chunk_blocks) {
+      // The last chunk could be smaller.
+      chunks.push_back(ExtentForRange(
+          start_block, std::min(chunk_blocks, partition_blocks - start_block)));
+    }
+  }
+  // The clients build the hash tree, so no operation writes it.
+  const vector<Extent> hash_tree_extents =
+      new_part.HashTreeExtents(config.block_size);
+  if (!hash_tree_extents.empty()) {
+    ExtentRanges hash_tree_blocks;
+    hash_tree_blocks.AddExtents(hash_tree_extents);
+    chunks = FilterExtentRanges(chunks, hash_tree_blocks);
+  }
+  uint64_t max_chunk_blocks = 1;
+  for (const Extent& chunk : chunks)
+    max_chunk_blocks = std::max(max_chunk_blocks, chunk.num_blocks());
+
   size_t max_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  max_threads = std::max(
+      std::min(static_cast<uint64_t>(max_threads),
+               memory_limit / (max_chunk_blocks * config.block_size *
+                               kChunkMemoryFactor)),
+      static_cast<uint64_t>(1));
   LOG(INFO) << "Compressing partition " << new_part.name
-            << " from " << new_part.path << " splitting in chunks of "
-            << chunk_blocks << " blocks (" << config.block_size
-            << " bytes each) using " << max_threads << " threads";
-
-  int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
+            << " from " << new_part.path << " splitting in "
+            << (config.content_defined_chunks ? "content-defined " : "")
+            << "chunks of " << chunk_blocks << " blocks ("
+            << config.block_size << " bytes each) using " << max_threads
+            << " threads";
 
   // We potentially have all the ChunkProcessors in memory but only
   // |max_threads| will actually hold a block in memory while we process.
-  size_t partition_blocks = new_part.size / config.block_size;
-  size_t num_chunks = (partition_blocks + chunk_blocks - 1) / chunk_blocks;
+  size_t num_chunks = chunks.size();
   aops->resize(num_chunks);
+  ChunkBufferPool buffers;
   vector<ChunkProcessor> chunk_processors;
   chunk_processors.reserve(num_chunks);
   blob_file->SetTotalBlobs(num_chunks);
 
   for (size_t i = 0; i < num_chunks; ++i) {
-    size_t start_block = i * chunk_blocks;
-    // The last chunk could be smaller.
-    size_t num_blocks = std::min(chunk_blocks,
-                                 partition_blocks - i * chunk_blocks);
-
     // Preset all the static information about the operations. The
     // ChunkProcessor will set the rest.
     AnnotatedOperation* aop = aops->data() + i;
     aop->name = base::StringPrintf("<%s-operation-%" PRIuS ">",
                                    new_part.name.c_str(), i);
-    Extent* dst_extent = aop->op.add_dst_extents();
-    dst_extent->set_start_block(start_block);
-    dst_extent->set_num_blocks(num_blocks);
+    *aop->op.add_dst_extents() = chunks[i];
 
     chunk_processors.emplace_back(
         config.version,
         in_fd,
-        static_cast<off_t>(start_block) * config.block_size,
-        num_blocks * config.block_size,
+        image,
+        static_cast<off_t>(chunks[i].start_block()) * config.block_size,
+        chunks[i].num_blocks() * config.block_size,
+        &buffers,
         blob_file,
         aop);
   }
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/full_update_generator.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,7 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 using chromeos_update_engine::test_utils::FillWithData;
@@ -95,6 +97,8 @@ TEST_F(FullUpdateGeneratorTest, RunTest) {
     if (aops[i].op.type() != InstallOperation::REPLACE) {
       EXPECT_EQ(InstallOperation::REPLACE_BZ, aops[i].op.type());
     }
+    // The blobs are hashed when they are stored.
+    EXPECT_EQ(32U, aops[i].op.data_sha256_hash().size());
   }
 }
 
@@ -141,4 +145,148 @@ TEST_F(FullUpdateGeneratorTest, ImageSizeTooSmall) {
             BlocksInExtents(aops[0].op.dst_extents()));
 }
 
+// Test that the hash tree the clients build isn't written by any operation.
+TEST_F(FullUpdateGeneratorTest, HashTreeSkippedTest) {
+  config_.full_chunk_size = 32 * config_.block_size;
+  brillo::Blob new_part(64 * config_.block_size);
+  new_part_conf.size = new_part.size();
+  // The tree of the first 40 blocks is the block 40.
+  new_part_conf.hash_tree_data_size = 40 * config_.block_size;
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  ASSERT_EQ(3U, aops.size());
+  EXPECT_EQ(ExtentForRange(0, 32), aops[0].op.dst_extents(0));
+  EXPECT_EQ(ExtentForRange(32, 8), aops[1].op.dst_extents(0));
+  EXPECT_EQ(ExtentForRange(41, 23), aops[2].op.dst_extents(0));
+}
+
+// Test that without a chunk size, the compressible data gets larger chunks
+// while leaving enough of them for the apply parallelism, and the random data
+// gets the default ones.
+TEST_F(FullUpdateGeneratorTest, AutoChunkSizeTest) {
+  config_.hard_chunk_size = -1;
+  config_.apply_parallelism = 2;
+  brillo::Blob new_part(32 * 1024 * 1024);
+  FillWithData(&new_part);
+  new_part_conf.size = new_part.size();
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  // 16 chunks of 2 MiB for the 2 threads of the device.
+  EXPECT_EQ(16U, aops.size());
+
+  uint32_t seed = 1;
+  for (uint8_t& byte : new_part) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+  aops.clear();
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  EXPECT_EQ(32U, aops.size());
+}
+
+// Test that the picked chunk size is bounded by the soft chunk size, which is
+// also the default one with a hard chunk size.
+TEST_F(FullUpdateGeneratorTest, AutoChunkSizeSoftLimitTest) {
+  config_.hard_chunk_size = 200 * 1024 * 1024;
+  config_.soft_chunk_size = 2 * 1024 * 1024;
+  config_.apply_parallelism = 1;
+  brillo::Blob new_part(64 * 1024 * 1024);
+  uint32_t seed = 1;
+  for (uint8_t& byte : new_part) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  new_part_conf.size = new_part.size();
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  // The random data gets the 2 MiB default chunks.
+  EXPECT_EQ(32U, aops.size());
+
+  // The compressible data would get 4 MiB chunks without the soft limit.
+  FillWithData(&new_part);
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+  aops.clear();
+  config_.soft_chunk_size = 1024 * 1024;
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  EXPECT_EQ(64U, aops.size());
+}
+
+TEST_F(FullUpdateGeneratorTest, ContentDefinedChunksTest) {
+  config_.full_chunk_size = 64 * 1024;
+  config_.content_defined_chunks = true;
+  const size_t kBlockSize = config_.block_size;
+  brillo::Blob new_part(256 * kBlockSize);
+  uint32_t seed = 1;
+  for (uint8_t& byte : new_part) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  new_part_conf.size = new_part.size();
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  // The chunks cover the partition with between half and twice the 16 blocks
+  // of the chunk size, except the last one.
+  uint64_t next_block = 0;
+  vector<string> old_hashes;
+  for (const AnnotatedOperation& aop : aops) {
+    ASSERT_EQ(1, aop.op.dst_extents_size());
+    EXPECT_EQ(next_block, aop.op.dst_extents(0).start_block());
+    EXPECT_LE(aop.op.dst_extents(0).num_blocks(), 32U);
+    if (&aop != &aops.back())
+      EXPECT_GE(aop.op.dst_extents(0).num_blocks(), 8U);
+    next_block += aop.op.dst_extents(0).num_blocks();
+    old_hashes.push_back(aop.op.data_sha256_hash());
+  }
+  EXPECT_EQ(256U, next_block);
+
+  // Inserting a block only changes the chunks around it and the last one.
+  new_part.insert(new_part.begin() + 100 * kBlockSize, kBlockSize, 'x');
+  new_part.resize(256 * kBlockSize);
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+  aops.clear();
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_.get(),
+                                            &aops));
+  size_t unchanged_chunks = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    if (std::find(old_hashes.begin(), old_hashes.end(),
+                  aop.op.data_sha256_hash()) != old_hashes.end()) {
+      unchanged_chunks++;
+    }
+  }
+  EXPECT_GE(unchanged_chunks + 3, aops.size());
+}
+
 }  // namespace chromeos_update_engine
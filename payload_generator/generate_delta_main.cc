@@ -20,23 +20,31 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <brillo/flag_helper.h>
 #include <brillo/key_value_store.h>
 
+#include "update_engine/common/async_log_sink.h"
 #include "update_engine/common/prefs.h"
 #include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/apply_report.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/payload_merger.h"
 #include "update_engine/payload_generator/payload_signer.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
@@ -45,6 +53,7 @@
 // and an output file as arguments and the path to an output file and
 // generates a delta that can be sent to Chrome OS clients.
 
+using std::map;
 using std::string;
 using std::vector;
 
@@ -201,7 +210,7 @@ void ApplyDelta(const string& in_file,
   CHECK(old_image.LoadImageSize());
   for (const auto& old_part : old_image.partitions) {
     PartitionInfo part_info;
-    CHECK(diff_utils::InitializePartitionInfo(old_part, &part_info));
+    CHECK(diff_utils::InitializePartitionInfo(old_part, 0, &part_info));
     InstallPlan::Partition part;
     part.name = old_part.name;
     part.source_hash.assign(part_info.hash().begin(),
@@ -229,19 +238,91 @@ void ApplyDelta(const string& in_file,
   LOG(INFO) << "Done applying delta.";
 }
 
-int ExtractProperties(const string& payload_path, const string& props_file) {
-  brillo::KeyValueStore properties;
-  TEST_AND_RETURN_FALSE(
-      PayloadSigner::ExtractPayloadProperties(payload_path, &properties));
+bool SaveProperties(const brillo::KeyValueStore& properties,
+                    const string& props_file) {
   if (props_file == "-") {
     printf("%s", properties.SaveToString().c_str());
   } else {
-    properties.Save(base::FilePath(props_file));
+    TEST_AND_RETURN_FALSE(properties.Save(base::FilePath(props_file)));
     LOG(INFO) << "Generated properties file at " << props_file;
   }
   return true;
 }
 
+int ExtractProperties(const string& payload_path, const string& props_file) {
+  brillo::KeyValueStore properties;
+  TEST_AND_RETURN_FALSE(
+      PayloadSigner::ExtractPayloadProperties(payload_path, &properties));
+  return SaveProperties(properties, props_file);
+}
+
+// Prints the estimated cost of applying the payload in |payload_path| on the
+// |device_class|, calibrated with the OperationStats report in |stats_file| if
+// not empty.
+bool PrintApplyReport(const string& payload_path,
+                      const string& device_class,
+                      const string& stats_file) {
+  DeltaArchiveManifest manifest;
+  uint64_t major_version, data_offset;
+  TEST_AND_RETURN_FALSE(LoadPayloadManifest(
+      payload_path, &manifest, &major_version, &data_offset));
+
+  OperationCostModel model;
+  TEST_AND_RETURN_FALSE(model.SetDeviceClass(device_class));
+  if (!stats_file.empty()) {
+    string stats_report;
+    TEST_AND_RETURN_FALSE(
+        base::ReadFileToString(base::FilePath(stats_file), &stats_report));
+    LOG_IF(WARNING, !CalibrateCostModel(stats_report, &model))
+        << "Not enough operations measured in " << stats_file
+        << " to calibrate the " << device_class << " model.";
+  }
+
+  ApplyReport report;
+  TEST_AND_RETURN_FALSE(
+      EstimatePayloadApply(manifest, major_version, model, &report));
+  printf("%s", report.ToString().c_str());
+  return true;
+}
+
+// Merges the payloads in the colon separated |payloads|, from N to N+1 and
+// from N+1 to N+2, into the payload from N to N+2 at |out_file|. The
+// |partition_names| and |new_partitions| flags list the N+2 images, if any.
+bool MergeDeltas(const string& payloads,
+                 const string& partition_names,
+                 const string& new_partitions,
+                 const string& out_file,
+                 const string& private_key) {
+  vector<string> paths = base::SplitString(
+      payloads, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  if (paths.size() != 2 || out_file.empty()) {
+    LOG(ERROR) << "--merge_payloads requires two payloads and --out_file.";
+    return false;
+  }
+  map<string, string> new_images;
+  if (!new_partitions.empty()) {
+    vector<string> names = base::SplitString(
+        partition_names, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    vector<string> images = base::SplitString(
+        new_partitions, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    TEST_AND_RETURN_FALSE(names.size() == images.size());
+    for (size_t i = 0; i < names.size(); i++)
+      new_images[names[i]] = images[i];
+  }
+  uint64_t metadata_size;
+  PayloadMergeStats stats;
+  TEST_AND_RETURN_FALSE(MergePayloads(paths[0],
+                                      paths[1],
+                                      new_images,
+                                      out_file,
+                                      private_key,
+                                      &metadata_size,
+                                      &stats));
+  LOG(INFO) << "Merged payload written to " << out_file << ", "
+            << stats.replaced_operations << " operations regenerated.";
+  return true;
+}
+
 int Main(int argc, char** argv) {
   DEFINE_string(old_image, "", "Path to the old rootfs");
   DEFINE_string(new_image, "", "Path to the new rootfs");
@@ -268,6 +349,16 @@ int Main(int argc, char** argv) {
                 "",
                 "Path to the .map files associated with the partition files "
                 "in the new partition, similar to the -old_mapfiles flag.");
+  DEFINE_string(hash_trees,
+                "",
+                "The dm-verity hash trees of the new partitions, which the "
+                "clients build instead of the payload sending them, separated "
+                "by ':' in the order of partition_names. Each one is the size "
+                "of the data hashed from the start of the partition and the "
+                "hex salt, separated by ',', with the tree right after the "
+                "data. An empty entry means the partition has no hash tree. "
+                "Requires minor version 12 or newer, or for full payloads "
+                "target clients that support it.");
   DEFINE_string(partition_names,
                 string(kLegacyPartitionNameRoot) + ":" +
                 kLegacyPartitionNameKernel,
@@ -308,6 +399,81 @@ int Main(int argc, char** argv) {
                 "e.g. /path/to/sig:/path/to/next:/path/to/last_sig .");
   DEFINE_int32(chunk_size, 200 * 1024 * 1024,
                "Payload chunk size (-1 for whole files)");
+  DEFINE_uint64(partition_hash_chunk_size, 0,
+                "If not zero, the size of the chunks of the partitions hashed "
+                "separately in the manifest, a multiple of the block size.");
+  DEFINE_uint64(xz_threads, 0,
+                "The number of threads used to compress each large blob with "
+                "xz (0 for one per processor).");
+  DEFINE_uint64(partition_threads, 1,
+                "The number of partitions generated at the same time.");
+  DEFINE_uint64(diff_memory_limit, 0,
+                "The maximum memory used to diff a window of a file, bigger "
+                "files are split in windows (0 for half the physical memory).");
+  DEFINE_uint64(full_chunk_size, 0,
+                "The size of the chunks of the full operations, up to "
+                "--chunk_size (0 to pick it from the data of every "
+                "partition).");
+  DEFINE_bool(content_defined_chunks, false,
+              "Whether the chunks of the full operations end where the data "
+              "of the partition says instead of at fixed offsets, so the "
+              "unchanged data gets the same blobs as in the previous builds. "
+              "The chunks have the chunk size on average.");
+  DEFINE_uint64(apply_parallelism, PayloadGenerationConfig().apply_parallelism,
+                "The number of operations the target devices decompress in "
+                "parallel, used to pick the chunk size of full payloads.");
+  DEFINE_uint64(full_memory_limit, 0,
+                "The maximum memory used by the threads compressing the full "
+                "operations (0 for half the physical memory).");
+  DEFINE_string(shard_partition, "",
+                "If passed, only the operations of this target partition are "
+                "generated and written with their blobs to the shard file "
+                "--out_file, to merge it later with --partition_shards.");
+  DEFINE_string(partition_shards, "",
+                "The shard files generated with --shard_partition for every "
+                "partition of --partition_names, in the same order and "
+                "separated by ':'. The payload is written from them without "
+                "generating any operation.");
+  DEFINE_string(temp_dir, "",
+                "The directory of the scratch files of the generation, like "
+                "the data blobs file and the inputs of the external diff "
+                "tools. A tmpfs such as /dev/shm keeps them in memory, which "
+                "is faster than slow or overlay storage as long as the host "
+                "has the memory for the data blobs of the payload. By "
+                "default the system temp directory is used.");
+  DEFINE_string(diff_cache_dir, "",
+                "An existing directory used to cache the diffs generated, so "
+                "they are reused by later payloads diffing the same data.");
+  DEFINE_string(apply_order, "",
+                "The storage class of the target devices, 'emmc', 'ufs' or "
+                "'hdd', used to order the operations of A/B payloads to "
+                "lower the seeks when applying them. By default they are "
+                "sorted by destination.");
+  DEFINE_string(device_class, "arm-emmc",
+                "The class of the target devices, 'arm-emmc', 'arm-ufs' or "
+                "'x86', whose apply time model is used with "
+                "--apply_time_weight and --apply_report.");
+  DEFINE_string(memory_class, "default",
+                "The memory class of the target devices, 'default' or "
+                "'low-ram', which limits the xz dictionary size and the "
+                "bsdiff operations to what their update_engine allocates.");
+  DEFINE_double(apply_time_weight, 0,
+                "The payload bytes one second of apply time on the target "
+                "devices is worth when choosing the operations. By default "
+                "the smallest operations are chosen.");
+  DEFINE_bool(apply_report, false,
+              "Print the estimated time and memory needed to apply the "
+              "payload --in_file on --device_class, by partition and by "
+              "operation type.");
+  DEFINE_string(apply_stats_file, "",
+                "The operation stats logged by the update_engine of a "
+                "device, used to calibrate the model of --apply_report.");
+  DEFINE_string(merge_payloads, "",
+                "The colon separated paths of two A/B delta payloads, from "
+                "N to N+1 and from N+1 to N+2, merged into the payload from "
+                "N to N+2 written to --out_file. The operations that can't "
+                "be composed are regenerated from the N+2 images passed in "
+                "--new_partitions, for the --partition_names.");
   DEFINE_uint64(rootfs_partition_size,
                chromeos_update_engine::kRootFSPartitionSize,
                "RootFS partition size for the image once installed");
@@ -318,10 +484,50 @@ int Main(int argc, char** argv) {
                "(-1 means autodetect).");
   DEFINE_string(properties_file, "",
                 "If passed, dumps the payload properties of the payload passed "
-                "in --in_file and exits.");
+                "in --in_file and exits. Without --in_file, dumps the "
+                "properties of the payload generated.");
   DEFINE_string(zlib_fingerprint, "",
                 "The fingerprint of zlib in the source image in hash string "
                 "format, used to check imgdiff compatibility.");
+  DEFINE_double(compression_max_entropy, CompressionHeuristics().max_entropy,
+                "Data with a byte entropy above this number of bits per byte "
+                "is stored uncompressed in full operations (8 disables it).");
+  DEFINE_uint64(compression_sample_size, CompressionHeuristics().sample_size,
+                "The number of bytes sampled to estimate the entropy and to "
+                "run the trial compressions of the full operations.");
+  DEFINE_double(bzip_trial_margin, CompressionHeuristics().bzip_trial_margin,
+                "bzip2 is skipped when its trial compression of the sample is "
+                "larger than the xz one by more than this fraction (a negative "
+                "value always tries bzip2).");
+  DEFINE_bool(enable_zstd, false,
+              "Whether the full payloads may use REPLACE_ZSTD operations. Only "
+              "pass it when all the target clients support minor version 6.");
+  DEFINE_double(zstd_size_margin, CompressionHeuristics().zstd_size_margin,
+                "zstd is used unless the xz or bzip2 data is smaller than the "
+                "zstd one by more than this fraction.");
+  DEFINE_bool(segmented_manifest, false,
+              "Whether the operations of each partition are stored right "
+              "before their data instead of in the manifest, so the clients "
+              "start applying the first partitions earlier. Requires minor "
+              "version 8 or newer.");
+  DEFINE_uint64(xz_chunk_size, 0,
+                "The REPLACE_XZ data decompressing to more than this number of "
+                "bytes is split in independent xz chunks of this size, so the "
+                "clients can decompress them in parallel and resume inside the "
+                "operation. Requires minor version 9 or newer. 0 disables it.");
+  DEFINE_uint64(blob_alignment, 0,
+                "The data blobs of at least this many bytes start at a "
+                "multiple of it in the payload file, so the clients can read "
+                "them from a local payload with direct I/O. Must be a power of "
+                "two. Requires minor version 10 or newer, or for full payloads "
+                "target clients that support it. 0 disables it.");
+  DEFINE_uint64(zstd_dictionary_size, 0,
+                "The size of the zstd dictionary trained from the small files "
+                "of the target partitions, which their REPLACE_ZSTD data is "
+                "compressed against. Requires --enable_zstd and minor version "
+                "11 or newer, or for full payloads target clients that "
+                "support it. Can't be used with --shard_partition or "
+                "--partition_shards. 0 disables it.");
 
   DEFINE_string(old_channel, "",
                 "The channel for the old image. 'dev-channel', 'npo-channel', "
@@ -362,6 +568,17 @@ int Main(int argc, char** argv) {
                 "A config file specifying postinstall related metadata. "
                 "Only allowed in major version 2 or newer.");
 
+  DEFINE_string(profile_report, "",
+                "If set, the path where a JSON report of the time and the "
+                "bytes processed by each phase of the payload generation is "
+                "written.");
+  DEFINE_int32(profile_slowest_files, 20,
+               "The number of slowest files to diff listed in the "
+               "--profile_report.");
+  DEFINE_bool(async_logging, false,
+              "Write the log messages below ERROR from a writer thread, "
+              "rate limiting the repeated ones.");
+
   brillo::FlagHelper::Init(argc, argv,
       "Generates a payload to provide to ChromeOS' update_engine.\n\n"
       "This tool can create full payloads and also delta payloads if the src\n"
@@ -377,6 +594,17 @@ int Main(int argc, char** argv) {
 
   logging::InitLogging(log_settings);
 
+  std::unique_ptr<AsyncLogSink> async_log_sink;
+  if (FLAGS_async_logging) {
+    async_log_sink.reset(new AsyncLogSink(
+        "", kAsyncLogSinkCapacity, kAsyncLogSinkMaxMessagesPerSecond));
+    if (!async_log_sink->Init())
+      async_log_sink.reset();
+  }
+
+  if (!FLAGS_temp_dir.empty())
+    utils::SetRootTempDir(FLAGS_temp_dir.c_str());
+
   // Initialize the Xz compressor.
   XzCompressInit();
 
@@ -400,9 +628,25 @@ int Main(int argc, char** argv) {
     VerifySignedPayload(FLAGS_in_file, FLAGS_public_key);
     return 0;
   }
-  if (!FLAGS_properties_file.empty()) {
+  if (!FLAGS_properties_file.empty() && !FLAGS_in_file.empty()) {
     return ExtractProperties(FLAGS_in_file, FLAGS_properties_file) ? 0 : 1;
   }
+  if (FLAGS_apply_report) {
+    CHECK(!FLAGS_in_file.empty()) << "--apply_report requires --in_file.";
+    return PrintApplyReport(
+               FLAGS_in_file, FLAGS_device_class, FLAGS_apply_stats_file)
+               ? 0
+               : 1;
+  }
+  if (!FLAGS_merge_payloads.empty()) {
+    return MergeDeltas(FLAGS_merge_payloads,
+                       FLAGS_partition_names,
+                       FLAGS_new_partitions,
+                       FLAGS_out_file,
+                       FLAGS_private_key)
+               ? 0
+               : 1;
+  }
   if (!FLAGS_in_file.empty()) {
     ApplyDelta(FLAGS_in_file, FLAGS_old_kernel, FLAGS_old_image,
                FLAGS_prefs_dir);
@@ -470,6 +714,25 @@ int Main(int argc, char** argv) {
     if (i < new_mapfiles.size())
       payload_config.target.partitions.back().mapfile_path = new_mapfiles[i];
   }
+  if (!FLAGS_hash_trees.empty()) {
+    vector<string> hash_trees = base::SplitString(
+        FLAGS_hash_trees, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    LOG_IF(FATAL, hash_trees.size() != partition_names.size())
+        << "--hash_trees must have an entry for each of the --partition_names.";
+    for (size_t i = 0; i < hash_trees.size(); i++) {
+      if (hash_trees[i].empty())
+        continue;
+      PartitionConfig& part = payload_config.target.partitions[i];
+      vector<string> fields = base::SplitString(
+          hash_trees[i], ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+      LOG_IF(FATAL,
+             fields.size() != 2 ||
+                 !base::StringToUint64(fields[0], &part.hash_tree_data_size) ||
+                 (!fields[1].empty() &&
+                  !base::HexStringToBytes(fields[1], &part.hash_tree_salt)))
+          << "Invalid hash tree " << hash_trees[i] << ", see --hash_trees.";
+    }
+  }
 
   if (payload_config.is_delta) {
     if (!FLAGS_old_partitions.empty()) {
@@ -500,7 +763,26 @@ int Main(int argc, char** argv) {
 
   // Use the default soft_chunk_size defined in the config.
   payload_config.hard_chunk_size = FLAGS_chunk_size;
+  payload_config.xz_threads = FLAGS_xz_threads;
+  payload_config.partition_threads = FLAGS_partition_threads;
+  payload_config.diff_memory_limit = FLAGS_diff_memory_limit;
+  if (!FLAGS_partition_shards.empty()) {
+    payload_config.partition_shards =
+        base::SplitString(FLAGS_partition_shards, ":", base::TRIM_WHITESPACE,
+                          base::SPLIT_WANT_ALL);
+  }
+  payload_config.full_chunk_size = FLAGS_full_chunk_size;
+  payload_config.content_defined_chunks = FLAGS_content_defined_chunks;
+  payload_config.apply_parallelism = FLAGS_apply_parallelism;
+  payload_config.full_memory_limit = FLAGS_full_memory_limit;
+  payload_config.diff_cache_dir = FLAGS_diff_cache_dir;
+  if (!FLAGS_apply_order.empty()) {
+    LOG_IF(FATAL, !payload_config.apply_order.SetStorageClass(
+                      FLAGS_apply_order))
+        << "Unknown storage class " << FLAGS_apply_order;
+  }
   payload_config.block_size = kBlockSize;
+  payload_config.partition_hash_chunk_size = FLAGS_partition_hash_chunk_size;
 
   // The partition size is never passed to the delta_generator, so we
   // need to detect those from the provided files.
@@ -565,6 +847,28 @@ int Main(int argc, char** argv) {
     LOG(INFO) << "Using provided minor_version=" << FLAGS_minor_version;
   }
 
+  payload_config.version.compression.max_entropy =
+      FLAGS_compression_max_entropy;
+  payload_config.version.compression.sample_size =
+      FLAGS_compression_sample_size;
+  payload_config.version.compression.bzip_trial_margin =
+      FLAGS_bzip_trial_margin;
+  payload_config.version.compression.zstd_size_margin =
+      FLAGS_zstd_size_margin;
+  payload_config.version.zstd_allowed = FLAGS_enable_zstd;
+  payload_config.version.segmented_manifest = FLAGS_segmented_manifest;
+  payload_config.version.xz_chunk_blocks =
+      (FLAGS_xz_chunk_size + kBlockSize - 1) / kBlockSize;
+  payload_config.version.blob_alignment = FLAGS_blob_alignment;
+  payload_config.version.zstd_dictionary_size = FLAGS_zstd_dictionary_size;
+  LOG_IF(FATAL, !payload_config.version.cost_model.SetDeviceClass(
+                    FLAGS_device_class))
+      << "Unknown device class " << FLAGS_device_class;
+  payload_config.version.cost_model.bytes_per_second = FLAGS_apply_time_weight;
+  LOG_IF(FATAL, !payload_config.version.memory_profile.SetMemoryClass(
+                    FLAGS_memory_class))
+      << "Unknown memory class " << FLAGS_memory_class;
+
   if (!FLAGS_zlib_fingerprint.empty()) {
     if (utils::IsZlibCompatible(FLAGS_zlib_fingerprint)) {
       payload_config.version.imgdiff_allowed = true;
@@ -585,11 +889,40 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  if (!FLAGS_shard_partition.empty()) {
+    return GeneratePartitionShard(
+               payload_config, FLAGS_shard_partition, FLAGS_out_file)
+               ? 0
+               : 1;
+  }
+
+  std::unique_ptr<GenerationProfile> profile;
+  if (!FLAGS_profile_report.empty()) {
+    profile.reset(
+        new GenerationProfile(std::max(FLAGS_profile_slowest_files, 0)));
+    profile->Init();
+  }
+
   uint64_t metadata_size;
+  brillo::KeyValueStore properties;
   if (!GenerateUpdatePayloadFile(payload_config,
                                  FLAGS_out_file,
                                  FLAGS_private_key,
-                                 &metadata_size)) {
+                                 &metadata_size,
+                                 &properties)) {
+    return 1;
+  }
+  if (profile) {
+    string report = profile->ToJson() + "\n";
+    if (!utils::WriteFile(FLAGS_profile_report.c_str(), report.data(),
+                          report.size())) {
+      LOG(ERROR) << "Failed to write the profile report to "
+                 << FLAGS_profile_report;
+      return 1;
+    }
+  }
+  if (!FLAGS_properties_file.empty() &&
+      !SaveProperties(properties, FLAGS_properties_file)) {
     return 1;
   }
   if (!FLAGS_out_metadata_size_file.empty()) {
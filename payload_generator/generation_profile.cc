@@ -0,0 +1,153 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <algorithm>
+#include <memory>
+
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/strings/string_util.h>
+#include <base/values.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the |wall_time|, |cpu_time| and |bytes| as a new JSON dictionary.
+std::unique_ptr<base::DictionaryValue> TimesToValue(base::TimeDelta wall_time,
+                                                    base::TimeDelta cpu_time,
+                                                    uint64_t bytes) {
+  std::unique_ptr<base::DictionaryValue> value(new base::DictionaryValue());
+  value->SetDouble("wall_ms", wall_time.InMillisecondsF());
+  value->SetDouble("cpu_ms", cpu_time.InMillisecondsF());
+  // JSON numbers are doubles, which hold any size of payload exactly.
+  value->SetDouble("bytes", static_cast<double>(bytes));
+  return value;
+}
+
+}  // namespace
+
+// static
+GenerationProfile* GenerationProfile::current_profile_ = nullptr;
+
+// static
+bool GenerationProfile::SlowerFile(const FileStats& a, const FileStats& b) {
+  return a.wall_time > b.wall_time;
+}
+
+GenerationProfile::GenerationProfile(size_t num_slowest_files)
+    : num_slowest_files_(num_slowest_files),
+      start_time_(base::TimeTicks::Now()) {}
+
+GenerationProfile::~GenerationProfile() {
+  if (current_profile_ == this)
+    current_profile_ = nullptr;
+}
+
+void GenerationProfile::Init() {
+  CHECK(current_profile_ == nullptr);
+  current_profile_ = this;
+}
+
+void GenerationProfile::AddPhase(const string& phase,
+                                 base::TimeDelta wall_time,
+                                 base::TimeDelta cpu_time,
+                                 uint64_t bytes) {
+  base::AutoLock auto_lock(lock_);
+  Stats& stats = phases_[phase];
+  stats.count++;
+  stats.wall_time += wall_time;
+  stats.cpu_time += cpu_time;
+  stats.bytes += bytes;
+}
+
+void GenerationProfile::AddFile(const string& name,
+                                base::TimeDelta wall_time,
+                                base::TimeDelta cpu_time,
+                                uint64_t bytes) {
+  if (num_slowest_files_ == 0)
+    return;
+  base::AutoLock auto_lock(lock_);
+  if (slowest_files_.size() == num_slowest_files_) {
+    if (wall_time <= slowest_files_.front().wall_time)
+      return;
+    std::pop_heap(slowest_files_.begin(), slowest_files_.end(),
+                  SlowerFile);
+    slowest_files_.pop_back();
+  }
+  slowest_files_.push_back({name, wall_time, cpu_time, bytes});
+  std::push_heap(slowest_files_.begin(), slowest_files_.end(),
+                 SlowerFile);
+}
+
+string GenerationProfile::ToJson() const {
+  base::DictionaryValue value;
+  value.SetDouble("total_wall_ms",
+                  (base::TimeTicks::Now() - start_time_).InMillisecondsF());
+
+  base::AutoLock auto_lock(lock_);
+  std::unique_ptr<base::DictionaryValue> phases(new base::DictionaryValue());
+  for (const auto& phase : phases_) {
+    std::unique_ptr<base::DictionaryValue> stats = TimesToValue(
+        phase.second.wall_time, phase.second.cpu_time, phase.second.bytes);
+    stats->SetDouble("count", static_cast<double>(phase.second.count));
+    // Don't expand the dots in the phase names as paths.
+    phases->SetWithoutPathExpansion(phase.first, stats.release());
+  }
+  value.Set("phases", phases.release());  // Adopts |phases|.
+
+  std::vector<FileStats> files = slowest_files_;
+  std::sort(files.begin(), files.end(), SlowerFile);
+  std::unique_ptr<base::ListValue> files_value(new base::ListValue());
+  for (const FileStats& file : files) {
+    std::unique_ptr<base::DictionaryValue> stats =
+        TimesToValue(file.wall_time, file.cpu_time, file.bytes);
+    stats->SetString("name", file.name);
+    files_value->Append(stats.release());
+  }
+  value.Set("slowest_files", files_value.release());  // Adopts |files_value|.
+
+  string json_str;
+  base::JSONWriter::WriteWithOptions(
+      value, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json_str);
+  base::TrimWhitespaceASCII(json_str, base::TRIM_TRAILING, &json_str);
+  return json_str;
+}
+
+ScopedProfilePhase::ScopedProfilePhase(const char* phase, uint64_t bytes)
+    : profile_(GenerationProfile::current()), phase_(phase), bytes_(bytes) {
+  if (!profile_)
+    return;
+  start_time_ = base::TimeTicks::Now();
+  if (base::ThreadTicks::IsSupported())
+    start_cpu_time_ = base::ThreadTicks::Now();
+}
+
+ScopedProfilePhase::~ScopedProfilePhase() {
+  if (!profile_)
+    return;
+  base::TimeDelta cpu_time;
+  if (base::ThreadTicks::IsSupported())
+    cpu_time = base::ThreadTicks::Now() - start_cpu_time_;
+  profile_->AddPhase(phase_, base::TimeTicks::Now() - start_time_, cpu_time,
+                     bytes_);
+}
+
+}  // namespace chromeos_update_engine
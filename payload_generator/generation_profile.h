@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Records the cost of the phases of the payload generation: the number of
+// times each phase ran, the wall and CPU time spent in it and the bytes it
+// processed, as well as the files that took the longest to diff. The phases
+// can nest and run in several threads at once, so their times add up to more
+// than the total wall time. It is thread-safe.
+class GenerationProfile {
+ public:
+  // Keeps the |num_slowest_files| slowest files in the report.
+  explicit GenerationProfile(size_t num_slowest_files);
+  ~GenerationProfile();
+
+  // Makes this instance the one returned by current(), where the phases are
+  // recorded. Only one instance can be initialized at a time.
+  void Init();
+
+  // Returns the initialized GenerationProfile, or nullptr if the generation
+  // isn't being profiled.
+  static GenerationProfile* current() { return current_profile_; }
+
+  // Records a run of the |phase| that took the given |wall_time| and
+  // |cpu_time| and processed |bytes|.
+  void AddPhase(const std::string& phase,
+                base::TimeDelta wall_time,
+                base::TimeDelta cpu_time,
+                uint64_t bytes);
+
+  // Records the diff of the file |name|, of |bytes| bytes.
+  void AddFile(const std::string& name,
+               base::TimeDelta wall_time,
+               base::TimeDelta cpu_time,
+               uint64_t bytes);
+
+  // Returns the report of the phases recorded thus far as JSON.
+  std::string ToJson() const;
+
+ private:
+  struct Stats {
+    uint64_t count{0};
+    base::TimeDelta wall_time;
+    base::TimeDelta cpu_time;
+    uint64_t bytes{0};
+  };
+
+  struct FileStats {
+    std::string name;
+    base::TimeDelta wall_time;
+    base::TimeDelta cpu_time;
+    uint64_t bytes;
+  };
+
+  // Orders the files by descending wall time, so the heap of the slowest files
+  // keeps the fastest of them at its front.
+  static bool SlowerFile(const FileStats& a, const FileStats& b);
+
+  // The current GenerationProfile instance, if any.
+  static GenerationProfile* current_profile_;
+
+  const size_t num_slowest_files_;
+  const base::TimeTicks start_time_;
+
+  mutable base::Lock lock_;
+  // The stats of each phase and the slowest files, as a min-heap on the wall
+  // time, protected by |lock_|.
+  std::map<std::string, Stats> phases_;
+  std::vector<FileStats> slowest_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenerationProfile);
+};
+
+// Records the time spent in the scope as a run of a phase in the current
+// GenerationProfile, if any.
+class ScopedProfilePhase {
+ public:
+  explicit ScopedProfilePhase(const char* phase, uint64_t bytes = 0);
+  ~ScopedProfilePhase();
+
+  // Sets the bytes processed in the phase, when only known at the end.
+  void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+
+ private:
+  // The profile where the phase is recorded, or nullptr if none.
+  GenerationProfile* const profile_;
+
+  const char* const phase_;
+  uint64_t bytes_;
+  base::TimeTicks start_time_;
+  base::ThreadTicks start_cpu_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedProfilePhase);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <memory>
+#include <string>
+
+#include <base/json/json_reader.h>
+#include <base/values.h>
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class GenerationProfileTest : public ::testing::Test {
+ protected:
+  // Parses the report of the |profile_| into |report_|.
+  void ParseReport() {
+    std::unique_ptr<base::Value> value =
+        base::JSONReader::Read(profile_.ToJson());
+    ASSERT_NE(nullptr, value.get());
+    base::DictionaryValue* dict;
+    ASSERT_TRUE(value->GetAsDictionary(&dict));
+    report_.reset(dict->DeepCopy());
+  }
+
+  GenerationProfile profile_{2};
+  std::unique_ptr<base::DictionaryValue> report_;
+};
+
+TEST_F(GenerationProfileTest, NoCurrentProfileTest) {
+  EXPECT_EQ(nullptr, GenerationProfile::current());
+  // Phases outside of a profiled generation are ignored.
+  { ScopedProfilePhase phase("phase", 100); }
+
+  ParseReport();
+  const base::DictionaryValue* phases;
+  ASSERT_TRUE(report_->GetDictionary("phases", &phases));
+  EXPECT_TRUE(phases->empty());
+}
+
+TEST_F(GenerationProfileTest, PhasesAddUpTest) {
+  profile_.Init();
+  EXPECT_EQ(&profile_, GenerationProfile::current());
+  { ScopedProfilePhase phase("BzipCompress", 100); }
+  {
+    ScopedProfilePhase phase("BzipCompress");
+    phase.set_bytes(50);
+  }
+  { ScopedProfilePhase phase("Other.Phase", 1); }
+
+  ParseReport();
+  double value;
+  EXPECT_TRUE(report_->GetDouble("phases.BzipCompress.count", &value));
+  EXPECT_EQ(2, value);
+  EXPECT_TRUE(report_->GetDouble("phases.BzipCompress.bytes", &value));
+  EXPECT_EQ(150, value);
+  EXPECT_TRUE(report_->GetDouble("phases.BzipCompress.wall_ms", &value));
+  EXPECT_LE(0, value);
+
+  // The dots in the phase names aren't nested dictionaries.
+  const base::DictionaryValue* phases;
+  ASSERT_TRUE(report_->GetDictionary("phases", &phases));
+  const base::DictionaryValue* other_phase;
+  EXPECT_TRUE(phases->GetDictionaryWithoutPathExpansion("Other.Phase",
+                                                        &other_phase));
+}
+
+TEST_F(GenerationProfileTest, SlowestFilesTest) {
+  const base::TimeDelta kCpuTime = base::TimeDelta::FromMilliseconds(1);
+  profile_.AddFile("/b", base::TimeDelta::FromSeconds(2), kCpuTime, 20);
+  profile_.AddFile("/a", base::TimeDelta::FromSeconds(1), kCpuTime, 10);
+  profile_.AddFile("/d", base::TimeDelta::FromSeconds(4), kCpuTime, 40);
+  profile_.AddFile("/c", base::TimeDelta::FromSeconds(3), kCpuTime, 30);
+
+  ParseReport();
+  const base::ListValue* files;
+  ASSERT_TRUE(report_->GetList("slowest_files", &files));
+  // Only the two slowest files are kept, the slowest first.
+  ASSERT_EQ(2U, files->GetSize());
+  const base::DictionaryValue* file;
+  string name;
+  ASSERT_TRUE(files->GetDictionary(0, &file));
+  EXPECT_TRUE(file->GetString("name", &name));
+  EXPECT_EQ("/d", name);
+  ASSERT_TRUE(files->GetDictionary(1, &file));
+  EXPECT_TRUE(file->GetString("name", &name));
+  EXPECT_EQ("/c", name);
+  double bytes;
+  EXPECT_TRUE(file->GetDouble("bytes", &bytes));
+  EXPECT_EQ(30, bytes);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,237 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/image_index_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The magic at the start of the entries with the block hashes and with the
+// files. The last byte is the version of their format.
+const char kBlockHashesMagic[] = {'U', 'E', 'B', '1'};
+const char kFilesMagic[] = {'U', 'E', 'F', '1'};
+const size_t kMagicSize = sizeof(kBlockHashesMagic);
+
+const size_t kHashSize = 32;  // SHA-256
+
+void AppendValue(brillo::Blob* entry, const void* value, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(value);
+  entry->insert(entry->end(), bytes, bytes + size);
+}
+
+// Reads |size| bytes at |*offset| of |entry| in |value|, advancing the offset.
+bool ReadValue(const brillo::Blob& entry,
+               size_t* offset,
+               void* value,
+               size_t size) {
+  TEST_AND_RETURN_FALSE(size <= entry.size() - *offset);
+  memcpy(value, entry.data() + *offset, size);
+  *offset += size;
+  return true;
+}
+
+}  // namespace
+
+ImageIndexCache::ImageIndexCache(const string& cache_dir)
+    : cache_dir_(cache_dir) {}
+
+bool ImageIndexCache::EntryPath(const char* magic,
+                                const string& image_path,
+                                size_t block_size,
+                                uint64_t count,
+                                string* path) const {
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(stat(image_path.c_str(), &stbuf) == 0);
+  const uint64_t device = stbuf.st_dev;
+  const uint64_t inode = stbuf.st_ino;
+  const uint64_t size = stbuf.st_size;
+  const int64_t mtime_sec = stbuf.st_mtim.tv_sec;
+  const int64_t mtime_nsec = stbuf.st_mtim.tv_nsec;
+  const uint64_t block_size64 = block_size;
+
+  HashCalculator key_hasher;
+  TEST_AND_RETURN_FALSE(key_hasher.Update(magic, kMagicSize));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&device, sizeof(device)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&inode, sizeof(inode)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&size, sizeof(size)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&mtime_sec, sizeof(mtime_sec)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&mtime_nsec, sizeof(mtime_nsec)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&block_size64, sizeof(block_size64)));
+  TEST_AND_RETURN_FALSE(key_hasher.Update(&count, sizeof(count)));
+  TEST_AND_RETURN_FALSE(key_hasher.Finalize());
+
+  const brillo::Blob& key = key_hasher.raw_hash();
+  *path = cache_dir_ + "/" + base::HexEncode(key.data(), key.size());
+  return true;
+}
+
+bool ImageIndexCache::ReadEntry(const string& path,
+                                const char* magic,
+                                brillo::Blob* entry) {
+  if (!utils::FileExists(path.c_str()) || !utils::ReadFile(path, entry) ||
+      entry->size() < kMagicSize ||
+      memcmp(entry->data(), magic, kMagicSize) != 0) {
+    misses_++;
+    return false;
+  }
+  return true;
+}
+
+bool ImageIndexCache::WriteEntry(const string& path,
+                                 const brillo::Blob& entry) {
+  // The entry is written to a temporary file in the same directory and renamed
+  // once complete, so other threads or processes never see a partial entry.
+  string temp_path = path + ".XXXXXX";
+  vector<char> temp_path_buf(temp_path.begin(), temp_path.end());
+  temp_path_buf.push_back('\0');
+  int fd = mkstemp(temp_path_buf.data());
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  temp_path = temp_path_buf.data();
+  bool written = utils::WriteAll(fd, entry.data(), entry.size());
+  written = IGNORE_EINTR(close(fd)) == 0 && written;
+  if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to store the image index entry " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ImageIndexCache::LookupBlockHashes(const string& path,
+                                        size_t block_size,
+                                        size_t num_blocks,
+                                        vector<uint8_t>* hashes) {
+  string entry_path;
+  brillo::Blob entry;
+  if (!EntryPath(kBlockHashesMagic, path, block_size, num_blocks,
+                 &entry_path) ||
+      !ReadEntry(entry_path, kBlockHashesMagic, &entry)) {
+    return false;
+  }
+  if (entry.size() != kMagicSize + num_blocks * kHashSize) {
+    LOG(WARNING) << "Ignoring the truncated image index entry " << entry_path;
+    misses_++;
+    return false;
+  }
+  hashes->assign(entry.begin() + kMagicSize, entry.end());
+  hits_++;
+  return true;
+}
+
+bool ImageIndexCache::StoreBlockHashes(const string& path,
+                                       size_t block_size,
+                                       const vector<uint8_t>& hashes) {
+  TEST_AND_RETURN_FALSE(hashes.size() % kHashSize == 0);
+  string entry_path;
+  TEST_AND_RETURN_FALSE(EntryPath(kBlockHashesMagic, path, block_size,
+                                  hashes.size() / kHashSize, &entry_path));
+  brillo::Blob entry(kBlockHashesMagic, kBlockHashesMagic + kMagicSize);
+  entry.insert(entry.end(), hashes.begin(), hashes.end());
+  return WriteEntry(entry_path, entry);
+}
+
+bool ImageIndexCache::LookupFiles(const string& path,
+                                  size_t block_size,
+                                  vector<FilesystemInterface::File>* files) {
+  string entry_path;
+  brillo::Blob entry;
+  if (!EntryPath(kFilesMagic, path, block_size, 0, &entry_path) ||
+      !ReadEntry(entry_path, kFilesMagic, &entry)) {
+    return false;
+  }
+
+  // The entry holds the number of files, then the length and bytes of the
+  // name of each file followed by its number of extents and their blocks.
+  vector<FilesystemInterface::File> entry_files;
+  size_t offset = kMagicSize;
+  uint32_t num_files = 0;
+  bool valid = ReadValue(entry, &offset, &num_files, sizeof(num_files));
+  for (uint32_t i = 0; valid && i < num_files; i++) {
+    FilesystemInterface::File file;
+    uint32_t name_size = 0, num_extents = 0;
+    valid = ReadValue(entry, &offset, &name_size, sizeof(name_size)) &&
+            name_size <= entry.size() - offset;
+    if (!valid)
+      break;
+    file.name.assign(reinterpret_cast<const char*>(entry.data()) + offset,
+                     name_size);
+    offset += name_size;
+    valid = ReadValue(entry, &offset, &num_extents, sizeof(num_extents));
+    for (uint32_t j = 0; valid && j < num_extents; j++) {
+      uint64_t start_block = 0, num_blocks = 0;
+      valid = ReadValue(entry, &offset, &start_block, sizeof(start_block)) &&
+              ReadValue(entry, &offset, &num_blocks, sizeof(num_blocks));
+      Extent extent;
+      extent.set_start_block(start_block);
+      extent.set_num_blocks(num_blocks);
+      file.extents.push_back(extent);
+    }
+    entry_files.push_back(std::move(file));
+  }
+  if (!valid || offset != entry.size()) {
+    LOG(WARNING) << "Ignoring the invalid image index entry " << entry_path;
+    misses_++;
+    return false;
+  }
+  files->swap(entry_files);
+  hits_++;
+  return true;
+}
+
+bool ImageIndexCache::StoreFiles(
+    const string& path,
+    size_t block_size,
+    const vector<FilesystemInterface::File>& files) {
+  string entry_path;
+  TEST_AND_RETURN_FALSE(
+      EntryPath(kFilesMagic, path, block_size, 0, &entry_path));
+  brillo::Blob entry(kFilesMagic, kFilesMagic + kMagicSize);
+  const uint32_t num_files = files.size();
+  AppendValue(&entry, &num_files, sizeof(num_files));
+  for (const FilesystemInterface::File& file : files) {
+    const uint32_t name_size = file.name.size();
+    AppendValue(&entry, &name_size, sizeof(name_size));
+    AppendValue(&entry, file.name.data(), name_size);
+    const uint32_t num_extents = file.extents.size();
+    AppendValue(&entry, &num_extents, sizeof(num_extents));
+    for (const Extent& extent : file.extents) {
+      const uint64_t start_block = extent.start_block();
+      const uint64_t num_blocks = extent.num_blocks();
+      AppendValue(&entry, &start_block, sizeof(start_block));
+      AppendValue(&entry, &num_blocks, sizeof(num_blocks));
+    }
+  }
+  return WriteEntry(entry_path, entry);
+}
+
+}  // namespace chromeos_update_engine
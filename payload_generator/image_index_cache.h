@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_INDEX_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_INDEX_CACHE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+namespace chromeos_update_engine {
+
+// An on-disk cache of what the generator computes for a whole partition image:
+// the SHA-256 hashes of its blocks and its files, so an image used by several
+// payloads (for example, the new build of the payloads from many old builds)
+// is only scanned once. The entries are named after the identity of the image
+// file, its device, inode, size and modification time, so an image rewritten
+// afterwards is scanned again. Hashing the contents to key the entries would
+// read the whole image, as scanning it does. The cache can be shared by
+// several threads and processes.
+class ImageIndexCache {
+ public:
+  // Creates a cache in the existing directory |cache_dir|.
+  explicit ImageIndexCache(const std::string& cache_dir);
+
+  // Looks for the hashes of the |num_blocks| first blocks of |block_size|
+  // bytes of the image at |path|. Returns whether they were found, setting
+  // the SHA-256 of each block contiguously in |hashes|.
+  bool LookupBlockHashes(const std::string& path,
+                         size_t block_size,
+                         size_t num_blocks,
+                         std::vector<uint8_t>* hashes);
+
+  // Stores the |hashes| of the blocks of the image at |path|, as found by
+  // LookupBlockHashes(). Returns false on error.
+  bool StoreBlockHashes(const std::string& path,
+                        size_t block_size,
+                        const std::vector<uint8_t>& hashes);
+
+  // Looks for the |files| of the filesystem in the image at |path|, as
+  // returned by FilesystemInterface::GetFiles() with blocks of |block_size|
+  // bytes. Only their name and extents are stored, their file_stat is zeroed.
+  bool LookupFiles(const std::string& path,
+                   size_t block_size,
+                   std::vector<FilesystemInterface::File>* files);
+
+  // Stores the name and extents of the |files| of the image at |path|. Returns
+  // false on error.
+  bool StoreFiles(const std::string& path,
+                  size_t block_size,
+                  const std::vector<FilesystemInterface::File>& files);
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  // Returns in |path| the path of the entry of the image at |image_path|
+  // with the |magic| of the entry type, for blocks of |block_size| bytes and
+  // |count| blocks, if known.
+  bool EntryPath(const char* magic,
+                 const std::string& image_path,
+                 size_t block_size,
+                 uint64_t count,
+                 std::string* path) const;
+
+  // Reads the entry at |path| in |entry|, checking its |magic|.
+  bool ReadEntry(const std::string& path,
+                 const char* magic,
+                 std::vector<uint8_t>* entry);
+
+  // Writes the |entry| at |path|, atomically.
+  bool WriteEntry(const std::string& path, const std::vector<uint8_t>& entry);
+
+  const std::string cache_dir_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ImageIndexCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_INDEX_CACHE_H_
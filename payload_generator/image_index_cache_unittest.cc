@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/image_index_cache.h"
+
+#include <utime.h>
+
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ImageIndexCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(cache_dir_.CreateUniqueTempDir());
+    ASSERT_TRUE(test_utils::WriteFileString(image_file_.path(),
+                                            string(4 * kBlockSize, 'i')));
+  }
+
+  const size_t kBlockSize = 4096;
+
+  base::ScopedTempDir cache_dir_;
+  test_utils::ScopedTempFile image_file_{"ImageIndexCache-XXXXXX"};
+  const vector<uint8_t> hashes_ = vector<uint8_t>(4 * 32, 'h');
+};
+
+TEST_F(ImageIndexCacheTest, StoredBlockHashesAreFoundTest) {
+  ImageIndexCache cache(cache_dir_.path().value());
+  vector<uint8_t> hashes;
+  EXPECT_FALSE(
+      cache.LookupBlockHashes(image_file_.path(), kBlockSize, 4, &hashes));
+  EXPECT_TRUE(cache.StoreBlockHashes(image_file_.path(), kBlockSize, hashes_));
+
+  // The entry is found by a new cache in the same directory, as a later
+  // payload would.
+  ImageIndexCache other_cache(cache_dir_.path().value());
+  EXPECT_TRUE(other_cache.LookupBlockHashes(
+      image_file_.path(), kBlockSize, 4, &hashes));
+  EXPECT_EQ(hashes_, hashes);
+  EXPECT_EQ(1U, other_cache.hits());
+  EXPECT_EQ(0U, other_cache.misses());
+
+  // The entries are specific to the number and the size of the blocks.
+  EXPECT_FALSE(other_cache.LookupBlockHashes(
+      image_file_.path(), kBlockSize, 3, &hashes));
+  EXPECT_FALSE(other_cache.LookupBlockHashes(
+      image_file_.path(), kBlockSize / 2, 4, &hashes));
+  EXPECT_EQ(2U, other_cache.misses());
+}
+
+TEST_F(ImageIndexCacheTest, StoredFilesAreFoundTest) {
+  vector<FilesystemInterface::File> files(2);
+  files[0].name = "/etc/hosts";
+  files[0].extents = {ExtentForRange(1, 2), ExtentForRange(0, 1)};
+  files[1].name = "<free-space>";
+
+  ImageIndexCache cache(cache_dir_.path().value());
+  vector<FilesystemInterface::File> found_files;
+  EXPECT_FALSE(
+      cache.LookupFiles(image_file_.path(), kBlockSize, &found_files));
+  EXPECT_TRUE(cache.StoreFiles(image_file_.path(), kBlockSize, files));
+  EXPECT_TRUE(cache.LookupFiles(image_file_.path(), kBlockSize, &found_files));
+  ASSERT_EQ(2U, found_files.size());
+  EXPECT_EQ(files[0].name, found_files[0].name);
+  EXPECT_EQ(files[0].extents, found_files[0].extents);
+  EXPECT_EQ(files[1].name, found_files[1].name);
+  EXPECT_TRUE(found_files[1].extents.empty());
+}
+
+TEST_F(ImageIndexCacheTest, ModifiedImageIsNotFoundTest) {
+  ImageIndexCache cache(cache_dir_.path().value());
+  EXPECT_TRUE(cache.StoreBlockHashes(image_file_.path(), kBlockSize, hashes_));
+
+  // Rewriting the image changes its modification time.
+  struct utimbuf times = {1, 1};
+  ASSERT_EQ(0, utime(image_file_.path().c_str(), &times));
+  vector<uint8_t> hashes;
+  EXPECT_FALSE(
+      cache.LookupBlockHashes(image_file_.path(), kBlockSize, 4, &hashes));
+  EXPECT_EQ(1U, cache.misses());
+}
+
+}  // namespace chromeos_update_engine
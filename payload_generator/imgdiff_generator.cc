@@ -0,0 +1,449 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/imgdiff_generator.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bsdiff_generator.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The IMGDIFF2 format, as read by ApplyImgdiffPatch(): the magic and the
+// 32-bit number of chunks, then the header of every chunk and then the bsdiff
+// patches they point to. All the integers are little endian.
+const char kImgdiffMagic[] = "IMGDIFF2";
+const size_t kImgdiffMagicSize = 8;
+const size_t kImgdiffHeaderSize = 12;
+
+const uint32_t kChunkNormal = 0;
+const uint32_t kChunkDeflate = 2;
+const uint32_t kChunkRaw = 3;
+
+// The size of the chunk headers, including the 32-bit chunk type. Raw chunks
+// also include their data.
+const size_t kNormalChunkHeaderSize = 28;
+const size_t kDeflateChunkHeaderSize = 64;
+const size_t kRawChunkHeaderSize = 8;
+
+// The normal chunks of up to this size are stored raw, since a bsdiff patch
+// with its three bzip2 streams is always bigger.
+const uint64_t kMaxRawChunkSize = 256;
+
+// The biggest inflated stream diffed. Both the generator and the applier hold
+// the old and new inflated streams in memory.
+const uint64_t kMaxInflatedSize = 64 * 1024 * 1024;  // bytes
+
+// The zlib settings tried to deflate a stream back, the most common first. The
+// window size and the strategy are always the zlib defaults.
+const int kDeflateLevels[] = {6, 9, 1, 2, 3, 4, 5, 7, 8};
+const int kDeflateMemLevels[] = {8, 9};
+
+const size_t kZlibBufferSize = 64 * 1024;  // 64 KiB
+
+// A raw deflate stream found in the data.
+struct DeflateStream {
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  // The name of the zip entry, or empty for gzip members.
+  string name;
+  brillo::Blob inflated;
+  // The zlib settings that deflate |inflated| back into the stream, if found.
+  int level = 0;
+  int mem_level = 0;
+};
+
+struct Chunk {
+  uint32_t type = kChunkNormal;
+  // The new data produced by the chunk.
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  // The old and new streams of the deflate chunks.
+  const DeflateStream* src = nullptr;
+  const DeflateStream* tgt = nullptr;
+  // The bsdiff patch, or the data of the raw chunks.
+  brillo::Blob data;
+};
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(value & 0xff);
+    value >>= 8;
+  }
+}
+
+void AppendLE64(uint64_t value, brillo::Blob* out) {
+  AppendLE32(value & 0xffffffff, out);
+  AppendLE32(value >> 32, out);
+}
+
+uint16_t ReadLE16(const uint8_t* buf) {
+  return static_cast<uint16_t>(buf[0]) | static_cast<uint16_t>(buf[1]) << 8;
+}
+
+// Returns whether there is a gzip member header at |pos| in |data|, storing in
+// |start| the offset of its deflate stream.
+bool ParseGzipHeader(const brillo::Blob& data, uint64_t pos, uint64_t* start) {
+  const uint8_t kGzipFlagHcrc = 0x02;
+  const uint8_t kGzipFlagExtra = 0x04;
+  const uint8_t kGzipFlagName = 0x08;
+  const uint8_t kGzipFlagComment = 0x10;
+  const uint8_t kGzipFlagsReserved = 0xe0;
+
+  if (data.size() - pos < 10 || data[pos] != 0x1f || data[pos + 1] != 0x8b ||
+      data[pos + 2] != Z_DEFLATED) {
+    return false;
+  }
+  const uint8_t flags = data[pos + 3];
+  if (flags & kGzipFlagsReserved)
+    return false;
+  uint64_t offset = pos + 10;
+  if (flags & kGzipFlagExtra) {
+    if (data.size() - offset < 2)
+      return false;
+    offset += 2 + ReadLE16(data.data() + offset);
+  }
+  for (uint8_t flag : {kGzipFlagName, kGzipFlagComment}) {
+    if (!(flags & flag))
+      continue;
+    auto end = std::find(data.begin() + std::min<uint64_t>(offset, data.size()),
+                         data.end(),
+                         0);
+    if (end == data.end())
+      return false;
+    offset = end - data.begin() + 1;
+  }
+  if (flags & kGzipFlagHcrc)
+    offset += 2;
+  if (offset >= data.size())
+    return false;
+  *start = offset;
+  return true;
+}
+
+// Returns whether there is a zip local file header of a deflated entry at
+// |pos| in |data|, storing in |start| the offset of its deflate stream and in
+// |name| the name of the entry.
+bool ParseZipHeader(const brillo::Blob& data,
+                    uint64_t pos,
+                    uint64_t* start,
+                    string* name) {
+  const uint8_t kZipMagic[] = {'P', 'K', 0x03, 0x04};
+  const uint64_t kZipHeaderSize = 30;
+  const uint16_t kZipFlagEncrypted = 0x01;
+
+  if (data.size() - pos < kZipHeaderSize ||
+      memcmp(data.data() + pos, kZipMagic, sizeof(kZipMagic)) != 0) {
+    return false;
+  }
+  const uint8_t* header = data.data() + pos;
+  if ((ReadLE16(header + 6) & kZipFlagEncrypted) ||
+      ReadLE16(header + 8) != Z_DEFLATED) {
+    return false;
+  }
+  const uint64_t name_size = ReadLE16(header + 26);
+  const uint64_t extra_size = ReadLE16(header + 28);
+  const uint64_t offset = pos + kZipHeaderSize + name_size + extra_size;
+  if (offset >= data.size())
+    return false;
+  name->assign(header + kZipHeaderSize, header + kZipHeaderSize + name_size);
+  *start = offset;
+  return true;
+}
+
+// Inflates the raw deflate stream at the beginning of the |size| bytes at
+// |data| into |out|, storing the length of the stream in |length|. Returns
+// false if there is no complete deflate stream or it's too big.
+bool InflateStream(const uint8_t* data,
+                   uint64_t size,
+                   brillo::Blob* out,
+                   uint64_t* length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    return false;
+  stream.next_in = const_cast<Bytef*>(data);
+  stream.avail_in =
+      std::min<uint64_t>(size, std::numeric_limits<uInt>::max());
+
+  out->clear();
+  brillo::Blob buffer(kZlibBufferSize);
+  int rc;
+  do {
+    stream.next_out = buffer.data();
+    stream.avail_out = buffer.size();
+    rc = inflate(&stream, Z_NO_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END)
+      break;
+    out->insert(out->end(),
+                buffer.data(),
+                buffer.data() + buffer.size() - stream.avail_out);
+    // A truncated stream or one too big to diff.
+    if ((rc == Z_OK && stream.avail_in == 0 && stream.avail_out != 0) ||
+        out->size() > kMaxInflatedSize) {
+      rc = Z_DATA_ERROR;
+      break;
+    }
+  } while (rc != Z_STREAM_END);
+  *length = stream.total_in;
+  inflateEnd(&stream);
+  return rc == Z_STREAM_END;
+}
+
+// Returns whether deflating the |inflated| data with the passed zlib settings,
+// the same way ApplyImgdiffPatch() does, produces exactly the |length| bytes
+// at |deflated|.
+bool DeflatesTo(const brillo::Blob& inflated,
+                int level,
+                int mem_level,
+                const uint8_t* deflated,
+                uint64_t length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, mem_level,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  stream.next_in = const_cast<Bytef*>(inflated.data());
+  stream.avail_in = inflated.size();
+
+  // Stop at the first difference, which is usually in the first block.
+  brillo::Blob buffer(kZlibBufferSize);
+  uint64_t pos = 0;
+  bool matches = true;
+  int rc;
+  do {
+    stream.next_out = buffer.data();
+    stream.avail_out = buffer.size();
+    rc = deflate(&stream, Z_FINISH);
+    const uint64_t out_size = buffer.size() - stream.avail_out;
+    if ((rc != Z_OK && rc != Z_STREAM_END) || out_size > length - pos ||
+        memcmp(buffer.data(), deflated + pos, out_size) != 0) {
+      matches = false;
+      break;
+    }
+    pos += out_size;
+  } while (rc != Z_STREAM_END);
+  deflateEnd(&stream);
+  return matches && pos == length;
+}
+
+// Finds the zlib settings that deflate the |stream| of |data| back to the same
+// bytes and stores them in the |stream|. Returns whether they were found.
+bool FindDeflateSettings(const brillo::Blob& data, DeflateStream* stream) {
+  for (int mem_level : kDeflateMemLevels) {
+    for (int level : kDeflateLevels) {
+      if (DeflatesTo(stream->inflated, level, mem_level,
+                     data.data() + stream->offset, stream->length)) {
+        stream->level = level;
+        stream->mem_level = mem_level;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Stores in |streams| the deflate streams of the gzip members and zip entries
+// in |data|, in order.
+void FindDeflateStreams(const brillo::Blob& data,
+                        vector<DeflateStream>* streams) {
+  // Only the positions with the first byte of a gzip or zip magic are parsed,
+  // found with the vectorized memchr() of the C library.
+  const uint8_t* begin = data.data();
+  auto next_byte = [begin, &data](uint8_t byte, uint64_t from) -> uint64_t {
+    const void* found = memchr(begin + from, byte, data.size() - from);
+    return found ? static_cast<const uint8_t*>(found) - begin : data.size();
+  };
+  uint64_t next_gzip = next_byte(0x1f, 0);
+  uint64_t next_zip = next_byte('P', 0);
+  uint64_t pos = 0;
+  while (pos < data.size()) {
+    if (next_gzip < pos)
+      next_gzip = next_byte(0x1f, pos);
+    if (next_zip < pos)
+      next_zip = next_byte('P', pos);
+    pos = std::min(next_gzip, next_zip);
+    if (pos >= data.size())
+      break;
+    uint64_t start;
+    string name;
+    if (ParseGzipHeader(data, pos, &start) ||
+        ParseZipHeader(data, pos, &start, &name)) {
+      DeflateStream stream;
+      if (InflateStream(data.data() + start, data.size() - start,
+                        &stream.inflated, &stream.length) &&
+          stream.length > 0) {
+        stream.offset = start;
+        stream.name = std::move(name);
+        pos = start + stream.length;
+        streams->push_back(std::move(stream));
+        continue;
+      }
+    }
+    pos++;
+  }
+}
+
+}  // namespace
+
+bool GenerateImgdiffPatch(const brillo::Blob& old_data,
+                          const brillo::Blob& new_data,
+                          brillo::Blob* patch) {
+  patch->clear();
+  vector<DeflateStream> old_streams;
+  FindDeflateStreams(old_data, &old_streams);
+  if (old_streams.empty())
+    return true;
+  vector<DeflateStream> new_streams;
+  FindDeflateStreams(new_data, &new_streams);
+
+  std::map<string, const DeflateStream*> old_streams_by_name;
+  for (const DeflateStream& stream : old_streams) {
+    if (!stream.name.empty())
+      old_streams_by_name.emplace(stream.name, &stream);
+  }
+
+  // The zip entries are diffed against the old entry with the same name, and
+  // the gzip members against the old stream in the same position.
+  vector<Chunk> chunks;
+  uint64_t pos = 0;
+  for (size_t i = 0; i < new_streams.size(); i++) {
+    DeflateStream* stream = &new_streams[i];
+    const DeflateStream* src = nullptr;
+    if (!stream->name.empty()) {
+      auto it = old_streams_by_name.find(stream->name);
+      if (it != old_streams_by_name.end())
+        src = it->second;
+    } else if (i < old_streams.size()) {
+      src = &old_streams[i];
+    }
+    if (!src || !FindDeflateSettings(new_data, stream))
+      continue;
+
+    if (stream->offset > pos) {
+      chunks.emplace_back();
+      chunks.back().offset = pos;
+      chunks.back().length = stream->offset - pos;
+    }
+    chunks.emplace_back();
+    chunks.back().type = kChunkDeflate;
+    chunks.back().offset = stream->offset;
+    chunks.back().length = stream->length;
+    chunks.back().src = src;
+    chunks.back().tgt = stream;
+    pos = stream->offset + stream->length;
+  }
+  if (chunks.empty())
+    return true;
+  if (pos < new_data.size()) {
+    chunks.emplace_back();
+    chunks.back().offset = pos;
+    chunks.back().length = new_data.size() - pos;
+  }
+
+  // The normal chunks are diffed against the whole old data, so its index is
+  // only built once.
+  std::unique_ptr<BsdiffIndex> old_index;
+  for (Chunk& chunk : chunks) {
+    if (chunk.type == kChunkDeflate) {
+      TEST_AND_RETURN_FALSE(GenerateBsdiffPatch(
+          chunk.src->inflated, chunk.tgt->inflated, &chunk.data));
+    } else if (chunk.length > kMaxRawChunkSize) {
+      if (!old_index)
+        old_index.reset(new BsdiffIndex(old_data));
+      brillo::Blob new_chunk(new_data.begin() + chunk.offset,
+                             new_data.begin() + chunk.offset + chunk.length);
+      TEST_AND_RETURN_FALSE(
+          GenerateBsdiffPatch(*old_index, new_chunk, &chunk.data));
+    }
+    // Store the data as is when the patch doesn't save anything.
+    if ((chunk.data.empty() || chunk.data.size() >= chunk.length) &&
+        chunk.length <= std::numeric_limits<uint32_t>::max()) {
+      chunk.type = kChunkRaw;
+      chunk.data.assign(new_data.begin() + chunk.offset,
+                        new_data.begin() + chunk.offset + chunk.length);
+    }
+  }
+  if (std::none_of(chunks.begin(), chunks.end(), [](const Chunk& chunk) {
+        return chunk.type == kChunkDeflate;
+      })) {
+    return true;
+  }
+
+  uint64_t headers_size = kImgdiffHeaderSize;
+  for (const Chunk& chunk : chunks) {
+    if (chunk.type == kChunkNormal)
+      headers_size += kNormalChunkHeaderSize;
+    else if (chunk.type == kChunkDeflate)
+      headers_size += kDeflateChunkHeaderSize;
+    else
+      headers_size += kRawChunkHeaderSize + chunk.data.size();
+  }
+
+  patch->assign(kImgdiffMagic, kImgdiffMagic + kImgdiffMagicSize);
+  AppendLE32(chunks.size(), patch);
+  uint64_t patch_offset = headers_size;
+  for (const Chunk& chunk : chunks) {
+    AppendLE32(chunk.type, patch);
+    if (chunk.type == kChunkRaw) {
+      AppendLE32(chunk.data.size(), patch);
+      patch->insert(patch->end(), chunk.data.begin(), chunk.data.end());
+      continue;
+    }
+    if (chunk.type == kChunkNormal) {
+      AppendLE64(0, patch);
+      AppendLE64(old_data.size(), patch);
+      AppendLE64(patch_offset, patch);
+    } else {
+      AppendLE64(chunk.src->offset, patch);
+      AppendLE64(chunk.src->length, patch);
+      AppendLE64(patch_offset, patch);
+      AppendLE64(chunk.src->inflated.size(), patch);
+      AppendLE64(chunk.tgt->inflated.size(), patch);
+      AppendLE32(chunk.tgt->level, patch);
+      AppendLE32(Z_DEFLATED, patch);
+      AppendLE32(static_cast<uint32_t>(-MAX_WBITS), patch);
+      AppendLE32(chunk.tgt->mem_level, patch);
+      AppendLE32(Z_DEFAULT_STRATEGY, patch);
+    }
+    patch_offset += chunk.data.size();
+  }
+  CHECK_EQ(headers_size, patch->size());
+  for (const Chunk& chunk : chunks) {
+    if (chunk.type != kChunkRaw)
+      patch->insert(patch->end(), chunk.data.begin(), chunk.data.end());
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,40 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_IMGDIFF_GENERATOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_IMGDIFF_GENERATOR_H_
+
+#include <brillo/secure_blob.h>
+
+// In-process generator of the IMGDIFF2 patches applied by ApplyImgdiffPatch().
+// The deflate streams of the gzip members and zip entries in the new data are
+// diffed inflated, against the inflated stream at the same position in the old
+// data, when zlib deflates them back to the very same bytes. The rest of the
+// new data is diffed against the whole old data.
+
+namespace chromeos_update_engine {
+
+// Generates in |patch| an IMGDIFF2 patch that produces |new_data| from
+// |old_data|. The |patch| is left empty when no deflate stream of |new_data|
+// can be diffed inflated, since a bsdiff patch is at least as good then.
+// Returns false on failure.
+bool GenerateImgdiffPatch(const brillo::Blob& old_data,
+                          const brillo::Blob& new_data,
+                          brillo::Blob* patch);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_IMGDIFF_GENERATOR_H_
@@ -0,0 +1,194 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/imgdiff_generator.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <string>
+
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/imgpatch_applier.h"
+#include "update_engine/payload_generator/bsdiff_generator.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AppendLE16(uint16_t value, brillo::Blob* out) {
+  out->push_back(value & 0xff);
+  out->push_back(value >> 8);
+}
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  AppendLE16(value & 0xffff, out);
+  AppendLE16(value >> 16, out);
+}
+
+// Deflates the |data| as a raw deflate stream.
+brillo::Blob Deflate(const brillo::Blob& data, int level, int strategy) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                               strategy));
+  brillo::Blob out(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<Bytef*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Appends to |out| a gzip member with the |data| deflated at |level|.
+void AppendGzip(const brillo::Blob& data,
+                int level,
+                int strategy,
+                brillo::Blob* out) {
+  const uint8_t kGzipHeader[] = {0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0x03};
+  out->insert(out->end(), std::begin(kGzipHeader), std::end(kGzipHeader));
+  brillo::Blob deflated = Deflate(data, level, strategy);
+  out->insert(out->end(), deflated.begin(), deflated.end());
+  AppendLE32(crc32(0, data.data(), data.size()), out);
+  AppendLE32(data.size(), out);
+}
+
+// Appends to |out| a zip local file header of the entry |name| followed by
+// the |data| deflated with the default settings.
+void AppendZipEntry(const string& name,
+                    const brillo::Blob& data,
+                    brillo::Blob* out) {
+  brillo::Blob deflated = Deflate(data, Z_DEFAULT_COMPRESSION,
+                                  Z_DEFAULT_STRATEGY);
+  const uint8_t kZipMagic[] = {'P', 'K', 0x03, 0x04};
+  out->insert(out->end(), std::begin(kZipMagic), std::end(kZipMagic));
+  AppendLE16(20, out);  // Version needed to extract.
+  AppendLE16(0, out);   // Flags.
+  AppendLE16(Z_DEFLATED, out);
+  AppendLE32(0, out);   // Modification time and date.
+  AppendLE32(crc32(0, data.data(), data.size()), out);
+  AppendLE32(deflated.size(), out);
+  AppendLE32(data.size(), out);
+  AppendLE16(name.size(), out);
+  AppendLE16(0, out);   // Extra field size.
+  out->insert(out->end(), name.begin(), name.end());
+  out->insert(out->end(), deflated.begin(), deflated.end());
+}
+
+// Returns some compressible text with a |version| on every line.
+brillo::Blob TextData(int version, int num_lines) {
+  string text;
+  for (int i = 0; i < num_lines; i++) {
+    text += base::StringPrintf("This is the line %d of the text version %d.\n",
+                               i, version + (i % 7 == 0));
+  }
+  return brillo::Blob(text.begin(), text.end());
+}
+
+// Returns some incompressible data.
+brillo::Blob RandomData(size_t size, uint32_t seed) {
+  brillo::Blob data(size);
+  for (uint8_t& byte : data) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  return data;
+}
+
+}  // namespace
+
+class ImgdiffGeneratorTest : public ::testing::Test {
+ protected:
+  // Generates the patch from |old_data| to |new_data|, checks that applying it
+  // results in |new_data| and returns it.
+  brillo::Blob TestRoundTrip(const brillo::Blob& old_data,
+                             const brillo::Blob& new_data) {
+    brillo::Blob patch;
+    EXPECT_TRUE(GenerateImgdiffPatch(old_data, new_data, &patch));
+    EXPECT_FALSE(patch.empty());
+
+    FakeExtentWriter writer;
+    EXPECT_TRUE(writer.Init(nullptr, {}, 4096));
+    EXPECT_TRUE(ApplyImgdiffPatch(old_data.data(), old_data.size(),
+                                  patch.data(), patch.size(),
+                                  new_data.size(), &writer));
+    EXPECT_TRUE(writer.End());
+    EXPECT_EQ(new_data, writer.WrittenData());
+    return patch;
+  }
+};
+
+TEST_F(ImgdiffGeneratorTest, GzipRoundTripTest) {
+  brillo::Blob old_data = RandomData(1000, 1);
+  AppendGzip(TextData(1, 2000), Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY,
+             &old_data);
+  brillo::Blob suffix = RandomData(5000, 2);
+  old_data.insert(old_data.end(), suffix.begin(), suffix.end());
+
+  // The new data changes the text, compresses it at another level and moves
+  // the stream.
+  brillo::Blob new_data = RandomData(1100, 1);
+  AppendGzip(TextData(2, 2000), Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY,
+             &new_data);
+  new_data.insert(new_data.end(), suffix.begin(), suffix.end());
+
+  brillo::Blob patch = TestRoundTrip(old_data, new_data);
+  brillo::Blob bsdiff_patch;
+  EXPECT_TRUE(GenerateBsdiffPatch(old_data, new_data, &bsdiff_patch));
+  EXPECT_LT(patch.size(), bsdiff_patch.size());
+}
+
+TEST_F(ImgdiffGeneratorTest, ZipEntriesMatchedByNameTest) {
+  brillo::Blob old_data;
+  AppendZipEntry("a.txt", TextData(1, 500), &old_data);
+  AppendZipEntry("b.txt", TextData(10, 800), &old_data);
+
+  // The entries are reordered, modified and a new one added between them.
+  brillo::Blob new_data;
+  AppendZipEntry("b.txt", TextData(11, 800), &new_data);
+  AppendZipEntry("new.txt", TextData(20, 300), &new_data);
+  AppendZipEntry("a.txt", TextData(2, 500), &new_data);
+  brillo::Blob trailer = RandomData(100, 3);
+  new_data.insert(new_data.end(), trailer.begin(), trailer.end());
+
+  TestRoundTrip(old_data, new_data);
+}
+
+TEST_F(ImgdiffGeneratorTest, NoDeflateStreamsTest) {
+  brillo::Blob patch;
+  EXPECT_TRUE(GenerateImgdiffPatch(RandomData(10000, 4), RandomData(10000, 5),
+                                   &patch));
+  EXPECT_TRUE(patch.empty());
+
+  // The streams deflated with other settings can't be reproduced.
+  brillo::Blob old_data, new_data;
+  AppendGzip(TextData(1, 1000), Z_DEFAULT_COMPRESSION, Z_HUFFMAN_ONLY,
+             &old_data);
+  AppendGzip(TextData(2, 1000), Z_DEFAULT_COMPRESSION, Z_HUFFMAN_ONLY,
+             &new_data);
+  EXPECT_TRUE(GenerateImgdiffPatch(old_data, new_data, &patch));
+  EXPECT_TRUE(patch.empty());
+}
+
+}  // namespace chromeos_update_engine
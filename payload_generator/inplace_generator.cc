@@ -576,7 +576,9 @@ bool InplaceGenerator::ConvertCutToFullOp(Graph* graph,
         (*graph)[cut.old_dst].aop.name,
         -1,  // chunk_blocks, forces to have a single operation.
         kInPlacePayloadVersion,
-        blob_file));
+        blob_file,
+        nullptr,    // index_cache
+        nullptr));  // diff_cache
     TEST_AND_RETURN_FALSE(new_aop.size() == 1);
     TEST_AND_RETURN_FALSE(AddInstallOpToGraph(
       graph, cut.old_dst, nullptr, new_aop.front().op, new_aop.front().name));
@@ -808,6 +810,8 @@ bool InplaceGenerator::GenerateOperations(
                                                        new_part,
                                                        hard_chunk_blocks,
                                                        soft_chunk_blocks,
+                                                       config.diff_memory_limit,
+                                                       config.diff_cache_dir,
                                                        config.version,
                                                        blob_file));
   LOG(INFO) << "Done reading " << new_part.name;
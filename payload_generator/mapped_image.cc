@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/synchronization/lock.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/sparse_image.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The images mapped by the ScopedImageMappings, by path. They are added and
+// removed by the partitions generated at the same time, and looked up from
+// their worker threads.
+base::Lock* MappedImagesLock() {
+  static base::Lock* lock = new base::Lock();
+  return lock;
+}
+
+std::map<string, std::unique_ptr<MappedImage>>* MappedImages() {
+  static auto* images = new std::map<string, std::unique_ptr<MappedImage>>();
+  return images;
+}
+
+}  // namespace
+
+MappedImage::~MappedImage() {
+  if (munmap(const_cast<uint8_t*>(data_), size_) != 0)
+    PLOG(ERROR) << "Unable to unmap the image";
+}
+
+std::unique_ptr<MappedImage> MappedImage::Open(const string& path) {
+  if (SparseImage::IsSparseImage(path))
+    return OpenSparse(path);
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(WARNING) << "Unable to open " << path;
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0 || !S_ISREG(stbuf.st_mode) ||
+      stbuf.st_size <= 0) {
+    return nullptr;
+  }
+  void* data = mmap(nullptr, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to map " << path;
+    return nullptr;
+  }
+  return std::unique_ptr<MappedImage>(
+      new MappedImage(static_cast<const uint8_t*>(data), stbuf.st_size));
+}
+
+std::unique_ptr<MappedImage> MappedImage::OpenSparse(const string& path) {
+  std::unique_ptr<SparseImage> sparse_image = SparseImage::Open(path);
+  if (!sparse_image || sparse_image->size() == 0)
+    return nullptr;
+  // The anonymous mapping reads as zeros without using any memory, so only
+  // the pages of the raw and the non-zero fill chunks are allocated.
+  void* data = mmap(nullptr,
+                    sparse_image->size(),
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1,
+                    0);
+  if (data == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to map the expanded image of " << path;
+    return nullptr;
+  }
+  std::unique_ptr<MappedImage> image(
+      new MappedImage(static_cast<const uint8_t*>(data), sparse_image->size()));
+  if (!sparse_image->Expand(static_cast<uint8_t*>(data)) ||
+      mprotect(data, sparse_image->size(), PROT_READ) != 0) {
+    LOG(ERROR) << "Unable to expand the sparse image " << path;
+    return nullptr;
+  }
+  LOG(INFO) << "Expanded the " << sparse_image->chunks().size()
+            << " chunks of the sparse image " << path;
+  return image;
+}
+
+const MappedImage* MappedImage::Find(const string& path) {
+  base::AutoLock auto_lock(*MappedImagesLock());
+  auto it = MappedImages()->find(path);
+  return it == MappedImages()->end() ? nullptr : it->second.get();
+}
+
+const uint8_t* MappedImage::Blocks(uint64_t start_block,
+                                   uint64_t num_blocks,
+                                   size_t block_size) const {
+  if (start_block > size_ / block_size ||
+      num_blocks > size_ / block_size - start_block) {
+    return nullptr;
+  }
+  return data_ + start_block * block_size;
+}
+
+bool MappedImage::ReadExtents(const vector<Extent>& extents,
+                              brillo::Blob* out_data,
+                              uint64_t out_data_size,
+                              size_t block_size) const {
+  uint64_t num_blocks = 0;
+  for (const Extent& extent : extents)
+    num_blocks += extent.num_blocks();
+  TEST_AND_RETURN_FALSE(num_blocks * block_size == out_data_size);
+  if (extents.size() > 1)
+    WillNeed(extents, block_size);
+
+  out_data->resize(out_data_size);
+  uint8_t* out = out_data->data();
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    const uint8_t* blocks =
+        Blocks(extent.start_block(), extent.num_blocks(), block_size);
+    TEST_AND_RETURN_FALSE(blocks != nullptr);
+    memcpy(out, blocks, extent.num_blocks() * block_size);
+    out += extent.num_blocks() * block_size;
+  }
+  return true;
+}
+
+void MappedImage::WillNeed(const vector<Extent>& extents,
+                           size_t block_size) const {
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  for (const Extent& extent : extents) {
+    const uint8_t* blocks =
+        Blocks(extent.start_block(), extent.num_blocks(), block_size);
+    if (!blocks || extent.num_blocks() == 0)
+      continue;
+    // madvise() needs a page aligned address.
+    const uint64_t offset = blocks - data_;
+    const uint64_t aligned_offset = offset - offset % page_size;
+    madvise(const_cast<uint8_t*>(data_ + aligned_offset),
+            offset - aligned_offset + extent.num_blocks() * block_size,
+            MADV_WILLNEED);
+  }
+}
+
+void MappedImage::AdviseSequential(uint64_t offset, uint64_t size) const {
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  if (offset >= size_)
+    return;
+  const uint64_t aligned_offset = offset - offset % page_size;
+  size = std::min(size, size_ - offset);
+  madvise(const_cast<uint8_t*>(data_ + aligned_offset),
+          offset - aligned_offset + size,
+          MADV_SEQUENTIAL);
+}
+
+ScopedImageMappings::ScopedImageMappings(const vector<string>& paths) {
+  for (const string& path : paths) {
+    if (path.empty() || MappedImage::Find(path))
+      continue;
+    std::unique_ptr<MappedImage> image = MappedImage::Open(path);
+    if (!image)
+      continue;
+    LOG(INFO) << "Mapped the " << image->size() << " bytes of " << path;
+    base::AutoLock auto_lock(*MappedImagesLock());
+    // Another partition may have mapped the same image in the meantime.
+    if (MappedImages()->emplace(path, std::move(image)).second)
+      paths_.push_back(path);
+  }
+}
+
+ScopedImageMappings::~ScopedImageMappings() {
+  base::AutoLock auto_lock(*MappedImagesLock());
+  for (const string& path : paths_)
+    MappedImages()->erase(path);
+}
+
+bool ReadImageExtents(const string& path,
+                      const vector<Extent>& extents,
+                      brillo::Blob* out_data,
+                      ssize_t out_data_size,
+                      size_t block_size) {
+  const MappedImage* image = MappedImage::Find(path);
+  if (!image) {
+    return utils::ReadExtents(
+        path, extents, out_data, out_data_size, block_size);
+  }
+  return image->ReadExtents(extents, out_data, out_data_size, block_size);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// MappedImage maps a partition image read-only in memory, so all the phases of
+// the generation reading it share the same pages of the page cache instead of
+// each reading the image again with its own file descriptor. The blocks of the
+// image are handed out as pointers into the mapping, so hashing them doesn't
+// copy them.
+//
+// The images are mapped for the duration of a ScopedImageMappings, and found
+// by their path with MappedImage::Find(). The functions reading the images,
+// like ReadImageExtents(), fall back to reading the file when it isn't mapped.
+// The Android sparse images are only readable through their mapping.
+class MappedImage {
+ public:
+  ~MappedImage();
+
+  // Maps the whole image file at |path|. Returns nullptr if it can't be mapped,
+  // for example when it's empty. A sparse image is expanded in an anonymous
+  // mapping instead, see OpenSparse().
+  static std::unique_ptr<MappedImage> Open(const std::string& path);
+
+  // Returns the image mapped from |path| by a ScopedImageMappings, or nullptr
+  // if none is. The image stays valid while the ScopedImageMappings exists.
+  static const MappedImage* Find(const std::string& path);
+
+  const uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+  // Returns a pointer to the |num_blocks| blocks of |block_size| bytes starting
+  // at |start_block|, or nullptr if they aren't all in the image.
+  const uint8_t* Blocks(uint64_t start_block,
+                        uint64_t num_blocks,
+                        size_t block_size) const;
+
+  // Copies the data of the |extents| to |out_data|, which is resized to
+  // |out_data_size| bytes, like utils::ReadExtents() does from the file.
+  bool ReadExtents(const std::vector<Extent>& extents,
+                   brillo::Blob* out_data,
+                   uint64_t out_data_size,
+                   size_t block_size) const;
+
+  // Tells the kernel the |extents| will be read soon, so it reads them ahead.
+  void WillNeed(const std::vector<Extent>& extents, size_t block_size) const;
+
+  // Tells the kernel the |size| bytes at |offset| are read sequentially.
+  void AdviseSequential(uint64_t offset, uint64_t size) const;
+
+ private:
+  MappedImage(const uint8_t* data, uint64_t size) : data_(data), size_(size) {}
+
+  // Expands the Android sparse image at |path| in memory. Its blocks that
+  // aren't written, the "don't care" and the zero fill chunks, keep reading
+  // as the zero pages of the mapping, so they are never allocated.
+  static std::unique_ptr<MappedImage> OpenSparse(const std::string& path);
+
+  const uint8_t* const data_;
+  const uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedImage);
+};
+
+// Maps the images at |paths| while in scope, so the generator reads them
+// through MappedImage::Find(). The empty paths, the images already mapped and
+// the ones that can't be mapped are skipped.
+class ScopedImageMappings {
+ public:
+  explicit ScopedImageMappings(const std::vector<std::string>& paths);
+  ~ScopedImageMappings();
+
+ private:
+  // The paths of the images mapped by this object.
+  std::vector<std::string> paths_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedImageMappings);
+};
+
+// Reads the |extents| of the image at |path| into |out_data| like
+// utils::ReadExtents(), from its mapping if it's mapped.
+bool ReadImageExtents(const std::string& path,
+                      const std::vector<Extent>& extents,
+                      brillo::Blob* out_data,
+                      ssize_t out_data_size,
+                      size_t block_size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 16;
+
+}  // namespace
+
+class MappedImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Each block is filled with its number.
+    for (uint8_t block = 0; block < 8; block++)
+      data_.insert(data_.end(), kBlockSize, block);
+    ASSERT_TRUE(utils::WriteFile(
+        image_file_.path().c_str(), data_.data(), data_.size()));
+  }
+
+  brillo::Blob data_;
+  test_utils::ScopedTempFile image_file_{"MappedImage-XXXXXX"};
+};
+
+TEST_F(MappedImageTest, BlocksTest) {
+  std::unique_ptr<MappedImage> image = MappedImage::Open(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(data_.size(), image->size());
+  const uint8_t* blocks = image->Blocks(2, 3, kBlockSize);
+  ASSERT_NE(nullptr, blocks);
+  EXPECT_EQ(0, memcmp(data_.data() + 2 * kBlockSize, blocks, 3 * kBlockSize));
+  EXPECT_NE(nullptr, image->Blocks(7, 1, kBlockSize));
+  // The blocks past the end of the image aren't available.
+  EXPECT_EQ(nullptr, image->Blocks(7, 2, kBlockSize));
+  EXPECT_EQ(nullptr, image->Blocks(9, 0, kBlockSize));
+}
+
+TEST_F(MappedImageTest, ReadExtentsTest) {
+  std::unique_ptr<MappedImage> image = MappedImage::Open(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  vector<Extent> extents = {ExtentForRange(5, 2), ExtentForRange(1, 1)};
+  brillo::Blob read_data;
+  EXPECT_TRUE(
+      image->ReadExtents(extents, &read_data, 3 * kBlockSize, kBlockSize));
+  brillo::Blob expected_data(data_.begin() + 5 * kBlockSize,
+                             data_.begin() + 7 * kBlockSize);
+  expected_data.insert(expected_data.end(),
+                       data_.begin() + kBlockSize,
+                       data_.begin() + 2 * kBlockSize);
+  EXPECT_EQ(expected_data, read_data);
+
+  // The size must match the extents, which must be in the image.
+  EXPECT_FALSE(
+      image->ReadExtents(extents, &read_data, 2 * kBlockSize, kBlockSize));
+  EXPECT_FALSE(image->ReadExtents(
+      {ExtentForRange(6, 4)}, &read_data, 4 * kBlockSize, kBlockSize));
+}
+
+TEST_F(MappedImageTest, EmptyImageTest) {
+  test_utils::ScopedTempFile empty_file("MappedImage-empty-XXXXXX");
+  EXPECT_EQ(nullptr, MappedImage::Open(empty_file.path()));
+  EXPECT_EQ(nullptr, MappedImage::Open("/non/existent/image"));
+}
+
+TEST_F(MappedImageTest, ScopedImageMappingsTest) {
+  vector<Extent> extents = {ExtentForRange(3, 2)};
+  brillo::Blob expected_data(data_.begin() + 3 * kBlockSize,
+                             data_.begin() + 5 * kBlockSize);
+  brillo::Blob read_data;
+  EXPECT_EQ(nullptr, MappedImage::Find(image_file_.path()));
+  {
+    ScopedImageMappings mappings({"", image_file_.path()});
+    const MappedImage* image = MappedImage::Find(image_file_.path());
+    ASSERT_NE(nullptr, image);
+    EXPECT_EQ(data_.size(), image->size());
+    EXPECT_TRUE(ReadImageExtents(image_file_.path(), extents, &read_data,
+                                 2 * kBlockSize, kBlockSize));
+    EXPECT_EQ(expected_data, read_data);
+
+    // A nested mapping of the same image doesn't unmap it.
+    { ScopedImageMappings nested_mappings({image_file_.path()}); }
+    EXPECT_EQ(image, MappedImage::Find(image_file_.path()));
+  }
+  EXPECT_EQ(nullptr, MappedImage::Find(image_file_.path()));
+
+  // The images not mapped are read from the file.
+  read_data.clear();
+  EXPECT_TRUE(ReadImageExtents(image_file_.path(), extents, &read_data,
+                               2 * kBlockSize, kBlockSize));
+  EXPECT_EQ(expected_data, read_data);
+}
+
+}  // namespace chromeos_update_engine
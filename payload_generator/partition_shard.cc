@@ -0,0 +1,206 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/partition_shard.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_writer.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kShardMagic[] = {'U', 'E', 'S', 'H', 'A', 'R', 'D', '1'};
+
+// The largest name or serialized operation accepted in a shard, to fail early
+// on a corrupted file.
+const uint32_t kMaxShardFieldSize = 64 * 1024 * 1024;
+
+bool WriteUint32(FileWriter* writer, uint32_t value) {
+  uint32_t value_be = htobe32(value);
+  return writer->Write(&value_be, sizeof(value_be));
+}
+
+bool WriteUint64(FileWriter* writer, uint64_t value) {
+  uint64_t value_be = htobe64(value);
+  return writer->Write(&value_be, sizeof(value_be));
+}
+
+// Writes |data| prefixed by its size to |writer|.
+bool WriteField(FileWriter* writer, const string& data) {
+  TEST_AND_RETURN_FALSE(data.size() <= kMaxShardFieldSize);
+  TEST_AND_RETURN_FALSE(WriteUint32(writer, data.size()));
+  return writer->Write(data.data(), data.size());
+}
+
+// Reads the shard file sequentially from the start.
+class ShardReader {
+ public:
+  explicit ShardReader(int fd) : fd_(fd) {}
+
+  bool Read(void* buffer, size_t size) {
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd_, buffer, size, offset_, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+    offset_ += size;
+    return true;
+  }
+
+  bool ReadUint32(uint32_t* value) {
+    uint32_t value_be;
+    TEST_AND_RETURN_FALSE(Read(&value_be, sizeof(value_be)));
+    *value = be32toh(value_be);
+    return true;
+  }
+
+  bool ReadUint64(uint64_t* value) {
+    uint64_t value_be;
+    TEST_AND_RETURN_FALSE(Read(&value_be, sizeof(value_be)));
+    *value = be64toh(value_be);
+    return true;
+  }
+
+  bool ReadField(string* data) {
+    uint32_t size;
+    TEST_AND_RETURN_FALSE(ReadUint32(&size));
+    TEST_AND_RETURN_FALSE(size <= kMaxShardFieldSize);
+    data->resize(size);
+    return size == 0 || Read(&(*data)[0], size);
+  }
+
+  off_t offset() const { return offset_; }
+
+ private:
+  int fd_;
+  off_t offset_{0};
+};
+
+}  // namespace
+
+bool WritePartitionShard(const string& shard_path,
+                         const string& partition_name,
+                         const vector<AnnotatedOperation>& aops,
+                         const string& data_blobs_path) {
+  int blobs_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(
+      writer.Open(shard_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) ==
+      0);
+  ScopedFileWriterCloser writer_closer(&writer);
+
+  TEST_AND_RETURN_FALSE(writer.Write(kShardMagic, sizeof(kShardMagic)));
+  TEST_AND_RETURN_FALSE(WriteField(&writer, partition_name));
+  TEST_AND_RETURN_FALSE(WriteUint64(&writer, aops.size()));
+
+  // The blobs are stored in the order of the operations.
+  uint64_t next_blob_offset = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    InstallOperation op = aop.op;
+    if (op.data_length() > 0) {
+      op.set_data_offset(next_blob_offset);
+      next_blob_offset += op.data_length();
+    }
+    string serialized_op;
+    TEST_AND_RETURN_FALSE(op.AppendToString(&serialized_op));
+    TEST_AND_RETURN_FALSE(WriteField(&writer, aop.name));
+    TEST_AND_RETURN_FALSE(WriteField(&writer, serialized_op));
+  }
+
+  brillo::Blob blob;
+  for (const AnnotatedOperation& aop : aops) {
+    if (aop.op.data_length() == 0)
+      continue;
+    blob.resize(aop.op.data_length());
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(blobs_fd,
+                                          blob.data(),
+                                          blob.size(),
+                                          aop.op.data_offset(),
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(blob.size()));
+    TEST_AND_RETURN_FALSE(writer.Write(blob.data(), blob.size()));
+  }
+  return true;
+}
+
+bool ReadPartitionShard(const string& shard_path,
+                        const string& partition_name,
+                        BlobFileWriter* blob_file,
+                        vector<AnnotatedOperation>* aops) {
+  int fd = open(shard_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  ShardReader reader(fd);
+
+  char magic[sizeof(kShardMagic)];
+  TEST_AND_RETURN_FALSE(reader.Read(magic, sizeof(magic)));
+  TEST_AND_RETURN_FALSE(memcmp(magic, kShardMagic, sizeof(magic)) == 0);
+  string shard_partition_name;
+  TEST_AND_RETURN_FALSE(reader.ReadField(&shard_partition_name));
+  if (shard_partition_name != partition_name) {
+    LOG(ERROR) << "The shard " << shard_path << " has the operations of the "
+               << "partition " << shard_partition_name << " instead of "
+               << partition_name;
+    return false;
+  }
+  uint64_t num_ops;
+  TEST_AND_RETURN_FALSE(reader.ReadUint64(&num_ops));
+
+  vector<AnnotatedOperation> shard_aops;
+  for (uint64_t i = 0; i < num_ops; i++) {
+    AnnotatedOperation aop;
+    string serialized_op;
+    TEST_AND_RETURN_FALSE(reader.ReadField(&aop.name));
+    TEST_AND_RETURN_FALSE(reader.ReadField(&serialized_op));
+    TEST_AND_RETURN_FALSE(aop.op.ParseFromString(serialized_op));
+    shard_aops.push_back(std::move(aop));
+  }
+
+  // The blobs are stored again in |blob_file|, updating the offsets.
+  const off_t blobs_offset = reader.offset();
+  brillo::Blob blob;
+  for (AnnotatedOperation& aop : shard_aops) {
+    if (aop.op.data_length() == 0)
+      continue;
+    blob.resize(aop.op.data_length());
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                          blob.data(),
+                                          blob.size(),
+                                          blobs_offset + aop.op.data_offset(),
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(blob.size()));
+    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+  }
+  *aops = std::move(shard_aops);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
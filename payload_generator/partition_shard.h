@@ -0,0 +1,55 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_SHARD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_SHARD_H_
+
+#include <string>
+#include <vector>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+
+// A partition shard file holds the operations generated for a single
+// partition, with their data blobs, so the partitions of a payload can be
+// generated on different machines and merged into the payload afterwards. The
+// file starts with the magic "UESHARD1", then the big-endian size prefixed
+// name of the partition and the number of operations. Every operation follows
+// as its size prefixed name and serialized InstallOperation, whose data_offset
+// is relative to the data blobs stored after the last operation.
+
+namespace chromeos_update_engine {
+
+// Writes to |shard_path| the operations |aops| of the partition
+// |partition_name|, reading their data blobs from |data_blobs_path|. Returns
+// false on failure.
+bool WritePartitionShard(const std::string& shard_path,
+                         const std::string& partition_name,
+                         const std::vector<AnnotatedOperation>& aops,
+                         const std::string& data_blobs_path);
+
+// Reads from |shard_path| the operations of the partition |partition_name|
+// into |aops|, storing their data blobs in |blob_file|. Returns false on
+// failure or if the shard holds another partition.
+bool ReadPartitionShard(const std::string& shard_path,
+                        const std::string& partition_name,
+                        BlobFileWriter* blob_file,
+                        std::vector<AnnotatedOperation>* aops);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_SHARD_H_
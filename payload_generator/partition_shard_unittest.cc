@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/partition_shard.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PartitionShardTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    EXPECT_TRUE(utils::MakeTempFile("PartitionShardTest-blobs.XXXXXX",
+                                    &blobs_path_,
+                                    &blobs_fd_));
+    EXPECT_TRUE(utils::MakeTempFile("PartitionShardTest-shard.XXXXXX",
+                                    &shard_path_,
+                                    nullptr));
+    blobs_unlinker_.reset(new ScopedPathUnlinker(blobs_path_));
+    shard_unlinker_.reset(new ScopedPathUnlinker(shard_path_));
+  }
+
+  // Returns the blob of |aop| stored in the file |fd|.
+  brillo::Blob ReadBlob(int fd, const AnnotatedOperation& aop) {
+    brillo::Blob blob(aop.op.data_length());
+    ssize_t bytes_read = -1;
+    EXPECT_TRUE(utils::PReadAll(
+        fd, blob.data(), blob.size(), aop.op.data_offset(), &bytes_read));
+    EXPECT_EQ(static_cast<ssize_t>(blob.size()), bytes_read);
+    return blob;
+  }
+
+  string blobs_path_;
+  int blobs_fd_{-1};
+  ScopedFdCloser blobs_fd_closer_{&blobs_fd_};
+  string shard_path_;
+  std::unique_ptr<ScopedPathUnlinker> blobs_unlinker_;
+  std::unique_ptr<ScopedPathUnlinker> shard_unlinker_;
+};
+
+TEST_F(PartitionShardTest, RoundTripTest) {
+  // The blobs are stored out of the order of the operations, like the
+  // generators do from their threads.
+  off_t blobs_size = 0;
+  BlobFileWriter blob_file(blobs_fd_, &blobs_size);
+  vector<AnnotatedOperation> aops(3);
+  aops[0].name = "<root-operation-0>";
+  aops[0].op.set_type(InstallOperation::REPLACE_BZ);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(10, 2);
+  aops[1].name = "/bin/sh";
+  aops[1].op.set_type(InstallOperation::SOURCE_COPY);
+  *(aops[1].op.add_src_extents()) = ExtentForRange(1, 1);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(2, 1);
+  aops[2].name = "/lib/libc.so";
+  aops[2].op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *(aops[2].op.add_src_extents()) = ExtentForRange(3, 4);
+  *(aops[2].op.add_dst_extents()) = ExtentForRange(5, 4);
+  brillo::Blob blob0(1000, 'a'), blob2(3000, 'c');
+  EXPECT_TRUE(aops[2].SetOperationBlob(blob2, &blob_file));
+  EXPECT_TRUE(aops[0].SetOperationBlob(blob0, &blob_file));
+
+  EXPECT_TRUE(WritePartitionShard(shard_path_, "root", aops, blobs_path_));
+
+  // The operations read are stored after the data already in the blob file.
+  string merged_path;
+  int merged_fd;
+  EXPECT_TRUE(utils::MakeTempFile("PartitionShardTest-merged.XXXXXX",
+                                  &merged_path,
+                                  &merged_fd));
+  ScopedPathUnlinker merged_unlinker(merged_path);
+  ScopedFdCloser merged_fd_closer(&merged_fd);
+  off_t merged_size = 0;
+  BlobFileWriter merged_file(merged_fd, &merged_size);
+  EXPECT_EQ(0, merged_file.StoreBlob(brillo::Blob(10, 'x')));
+
+  vector<AnnotatedOperation> read_aops;
+  EXPECT_TRUE(
+      ReadPartitionShard(shard_path_, "root", &merged_file, &read_aops));
+  ASSERT_EQ(aops.size(), read_aops.size());
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(aops[i].name, read_aops[i].name);
+    EXPECT_EQ(aops[i].op.type(), read_aops[i].op.type());
+    EXPECT_EQ(aops[i].op.data_length(), read_aops[i].op.data_length());
+    EXPECT_EQ(aops[i].op.src_extents_size(),
+              read_aops[i].op.src_extents_size());
+    EXPECT_EQ(aops[i].op.dst_extents(0), read_aops[i].op.dst_extents(0));
+  }
+  EXPECT_FALSE(read_aops[1].op.has_data_offset());
+  EXPECT_LE(10U, read_aops[0].op.data_offset());
+  EXPECT_EQ(blob0, ReadBlob(merged_fd, read_aops[0]));
+  EXPECT_EQ(blob2, ReadBlob(merged_fd, read_aops[2]));
+}
+
+TEST_F(PartitionShardTest, OtherPartitionFailsTest) {
+  EXPECT_TRUE(WritePartitionShard(shard_path_, "root", {}, blobs_path_));
+
+  off_t blobs_size = 0;
+  BlobFileWriter blob_file(blobs_fd_, &blobs_size);
+  vector<AnnotatedOperation> aops;
+  EXPECT_TRUE(ReadPartitionShard(shard_path_, "root", &blob_file, &aops));
+  EXPECT_TRUE(aops.empty());
+  EXPECT_FALSE(ReadPartitionShard(shard_path_, "kernel", &blob_file, &aops));
+
+  // A truncated shard isn't accepted either.
+  EXPECT_TRUE(utils::WriteFile(shard_path_.c_str(), "UESHARD1", 8));
+  EXPECT_FALSE(ReadPartitionShard(shard_path_, "root", &blob_file, &aops));
+}
+
+}  // namespace chromeos_update_engine
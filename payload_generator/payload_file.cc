@@ -19,13 +19,23 @@
 #include <endian.h>
 
 #include <algorithm>
+#include <map>
 
+#include <brillo/data_encoding.h>
+
+#include "update_engine/common/constants.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
 #include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
@@ -48,6 +58,15 @@ struct DeltaObject {
   off_t size;
 };
 
+// Returns whether the |op| writes the data blob, optionally compressed, to the
+// target partition.
+bool IsFullOperation(const InstallOperation& op) {
+  return op.type() == InstallOperation::REPLACE ||
+         op.type() == InstallOperation::REPLACE_BZ ||
+         op.type() == InstallOperation::REPLACE_XZ ||
+         op.type() == InstallOperation::REPLACE_ZSTD;
+}
+
 // Writes the uint64_t passed in in host-endian to the file as big-endian.
 // Returns true on success.
 bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
@@ -56,12 +75,124 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
   return true;
 }
 
+// The size of the reads from the data blobs file. The blobs stored next to
+// each other are served by the same read, so the small blobs of a partition
+// don't cost a system call each and the big ones don't need to fit in memory.
+const size_t kBlobReadSize = 1024 * 1024;  // bytes
+
+// Reads ranges of a file through a buffer of kBlobReadSize bytes, passing the
+// data to a set of hashers and optionally to a FileWriter.
+class BufferedBlobReader {
+ public:
+  explicit BufferedBlobReader(int fd, FileWriter* writer = nullptr)
+      : fd_(fd), writer_(writer) {}
+
+  // Reads the |length| bytes at |offset| of the file, passing them to the
+  // |hashers| and to the writer, if any. Returns whether it succeeded.
+  bool ReadRange(uint64_t offset,
+                 uint64_t length,
+                 const vector<HashCalculator*>& hashers) {
+    while (length > 0) {
+      if (offset < buffer_offset_ || offset >= buffer_offset_ + buffer_size_)
+        TEST_AND_RETURN_FALSE(FillBuffer(offset));
+      size_t skip = offset - buffer_offset_;
+      size_t count = std::min<uint64_t>(length, buffer_size_ - skip);
+      const uint8_t* data = buffer_.data() + skip;
+      TEST_AND_RETURN_FALSE(HashCalculator::UpdateAll(hashers, data, count));
+      if (writer_)
+        TEST_AND_RETURN_FALSE(writer_->Write(data, count));
+      offset += count;
+      length -= count;
+    }
+    return true;
+  }
+
+  // The number of reads issued to the file.
+  size_t num_reads() const { return num_reads_; }
+
+ private:
+  // Reads the kBlobReadSize bytes of the file starting at |offset|, or up to
+  // the end of the file, in the buffer. Fails if |offset| is past the end.
+  bool FillBuffer(uint64_t offset) {
+    buffer_.resize(kBlobReadSize);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd_, buffer_.data(), buffer_.size(), offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read > 0);
+    buffer_offset_ = offset;
+    buffer_size_ = bytes_read;
+    num_reads_++;
+    return true;
+  }
+
+  int fd_;
+  FileWriter* writer_;
+
+  brillo::Blob buffer_;
+  uint64_t buffer_offset_{0};
+  size_t buffer_size_{0};
+
+  size_t num_reads_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedBlobReader);
+};
+
+// A FileWriter that adds the data written to another FileWriter to the
+// |hashers| set, so the hashes of parts of a file are computed while writing
+// it.
+class HashingFileWriter : public FileWriter {
+ public:
+  explicit HashingFileWriter(FileWriter* writer) : writer_(writer) {}
+
+  // FileWriter overrides.
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(HashCalculator::UpdateAll(hashers_, bytes, count));
+    TEST_AND_RETURN_FALSE(writer_->Write(bytes, count));
+    bytes_written_ += count;
+    return true;
+  }
+  int Close() override { return 0; }
+
+  // Sets the |hashers| updated with the data written from now on.
+  void set_hashers(const vector<HashCalculator*>& hashers) {
+    hashers_ = hashers;
+  }
+
+  uint64_t bytes_written() const { return bytes_written_; }
+
+ private:
+  FileWriter* writer_;
+  vector<HashCalculator*> hashers_;
+  uint64_t bytes_written_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileWriter);
+};
+
+// Appends a copy of the |operation| to the |operations| of the manifest,
+// packing its extents if |pack_extents|. Returns the copy.
+InstallOperation* AddManifestOperation(
+    const InstallOperation& operation,
+    bool pack_extents,
+    google::protobuf::RepeatedPtrField<InstallOperation>* operations) {
+  InstallOperation* added_operation = operations->Add();
+  added_operation->CopyFrom(operation);
+  if (pack_extents)
+    PackOperationExtents(added_operation);
+  return added_operation;
+}
+
 }  // namespace
 
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   TEST_AND_RETURN_FALSE(config.version.Validate());
   major_version_ = config.version.major;
   manifest_.set_minor_version(config.version.minor);
+  dedup_blobs_ = config.version.minor >= kBlobDedupMinorPayloadVersion;
+  pack_extents_ = config.version.minor >= kPackedExtentsMinorPayloadVersion;
+  segmented_manifest_ = config.version.segmented_manifest;
+  blob_alignment_ = config.version.blob_alignment;
+  if (blob_alignment_ > 0)
+    manifest_.set_blob_alignment(blob_alignment_);
 
   if (!config.source.ImageInfoIsEmpty())
     *(manifest_.mutable_old_image_info()) = config.source.image_info;
@@ -70,45 +201,82 @@ bool PayloadFile::Init(const PayloadGenerationConfig& config) {
     *(manifest_.mutable_new_image_info()) = config.target.image_info;
 
   manifest_.set_block_size(config.block_size);
+  if (config.version.memory_profile.xz_dict_size > 0) {
+    manifest_.set_max_xz_dict_size(
+        config.version.memory_profile.xz_dict_size);
+  }
+  partition_hash_chunk_size_ = config.partition_hash_chunk_size;
   return true;
 }
 
+void PayloadFile::SetZstdDictionary(const brillo::Blob& dictionary) {
+  manifest_.set_zstd_dictionary(dictionary.data(), dictionary.size());
+}
+
 bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
                                const PartitionConfig& new_conf,
                                const vector<AnnotatedOperation>& aops) {
+  // Initialize the PartitionInfo objects if present.
+  PartitionInfo old_info, new_info;
+  if (!old_conf.path.empty())
+    TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(
+        old_conf, partition_hash_chunk_size_, &old_info));
+  TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(
+      new_conf, partition_hash_chunk_size_, &new_info));
+  return AddPartition(
+      new_conf.name, old_info, new_info, new_conf.postinstall, aops);
+}
+
+bool PayloadFile::AddPartition(const string& name,
+                               const PartitionInfo& old_info,
+                               const PartitionInfo& new_info,
+                               const PostInstallConfig& postinstall,
+                               const vector<AnnotatedOperation>& aops) {
   // Check partitions order for Chrome OS
   if (major_version_ == kChromeOSMajorPayloadVersion) {
     const vector<const char*> part_order = { kLegacyPartitionNameRoot,
                                              kLegacyPartitionNameKernel };
     TEST_AND_RETURN_FALSE(part_vec_.size() < part_order.size());
-    TEST_AND_RETURN_FALSE(new_conf.name == part_order[part_vec_.size()]);
+    TEST_AND_RETURN_FALSE(name == part_order[part_vec_.size()]);
   }
   Partition part;
-  part.name = new_conf.name;
+  part.name = name;
   part.aops = aops;
-  part.postinstall = new_conf.postinstall;
-  // Initialize the PartitionInfo objects if present.
-  if (!old_conf.path.empty())
-    TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(old_conf,
-                                                              &part.old_info));
-  TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(new_conf,
-                                                            &part.new_info));
+  part.old_info = old_info;
+  part.new_info = new_info;
+  part.postinstall = postinstall;
   part_vec_.push_back(std::move(part));
   return true;
 }
 
+bool PayloadFile::SetHashTree(const PartitionConfig& new_conf,
+                              size_t block_size) {
+  const vector<Extent> hash_tree_extents =
+      new_conf.HashTreeExtents(block_size);
+  if (hash_tree_extents.empty())
+    return true;
+  for (Partition& part : part_vec_) {
+    if (part.name != new_conf.name)
+      continue;
+    part.hash_tree_data_extent =
+        ExtentForRange(0, new_conf.hash_tree_data_size / block_size);
+    part.hash_tree_extent = hash_tree_extents[0];
+    part.hash_tree_salt = new_conf.hash_tree_salt;
+    return true;
+  }
+  LOG(ERROR) << "No partition " << new_conf.name << " in the payload.";
+  return false;
+}
+
 bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  string ordered_blobs_path;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile(
-      "CrAU_temp_data.ordered.XXXXXX",
-      &ordered_blobs_path,
-      nullptr));
-  ScopedPathUnlinker ordered_blobs_unlinker(ordered_blobs_path);
-  TEST_AND_RETURN_FALSE(ReorderDataBlobs(data_blobs_path, ordered_blobs_path));
+  ScopedProfilePhase profile_phase("PayloadFile::WritePayload");
+  // Reorder the data blobs with the manifest_. The blobs are copied from
+  // |data_blobs_path| while writing the payload.
+  vector<uint64_t> blob_offsets;
+  TEST_AND_RETURN_FALSE(HashDataBlobs(data_blobs_path, &blob_offsets));
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -116,11 +284,14 @@ bool PayloadFile::WritePayload(const string& payload_file,
     for (const auto& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
-      if (aop.op.data_offset() != next_blob_offset) {
+      // Only the aligned blobs are preceded by padding.
+      if (aop.op.data_offset() < next_blob_offset ||
+          (aop.op.data_offset() > next_blob_offset &&
+           aop.op.data_offset() - next_blob_offset >= blob_alignment_)) {
         LOG(FATAL) << "bad blob offset! " << aop.op.data_offset() << " != "
                    << next_blob_offset;
       }
-      next_blob_offset += aop.op.data_length();
+      next_blob_offset = aop.op.data_offset() + aop.op.data_length();
     }
   }
 
@@ -139,26 +310,50 @@ bool PayloadFile::WritePayload(const string& payload_file,
         if (!part.postinstall.filesystem_type.empty())
           partition->set_filesystem_type(part.postinstall.filesystem_type);
         partition->set_postinstall_optional(part.postinstall.optional);
+        if (part.postinstall.parallel)
+          partition->set_postinstall_parallel(true);
       }
-      for (const AnnotatedOperation& aop : part.aops) {
-        *partition->add_operations() = aop.op;
+      // The apply waves let the client apply the operations in parallel
+      // without comparing their extents. Older clients ignore them.
+      vector<uint32_t> waves;
+      ComputeApplyWaves(part.aops, &waves);
+      partition->set_apply_waves(true);
+      partition->mutable_operations()->Reserve(part.aops.size());
+      for (size_t i = 0; i < part.aops.size(); i++) {
+        InstallOperation* op = AddManifestOperation(
+            part.aops[i].op, pack_extents_, partition->mutable_operations());
+        if (waves[i])
+          op->set_apply_wave(waves[i]);
       }
       if (part.old_info.has_size() || part.old_info.has_hash())
         *(partition->mutable_old_partition_info()) = part.old_info;
       if (part.new_info.has_size() || part.new_info.has_hash())
         *(partition->mutable_new_partition_info()) = part.new_info;
+      if (part.hash_tree_extent.num_blocks() > 0) {
+        *partition->mutable_hash_tree_data_extent() =
+            part.hash_tree_data_extent;
+        *partition->mutable_hash_tree_extent() = part.hash_tree_extent;
+        partition->set_hash_tree_algorithm(HashTreeBuilder::kAlgorithm);
+        partition->set_hash_tree_salt(part.hash_tree_salt.data(),
+                                      part.hash_tree_salt.size());
+      }
     } else {
       // major_version_ == kChromeOSMajorPayloadVersion
       if (part.name == kLegacyPartitionNameKernel) {
-        for (const AnnotatedOperation& aop : part.aops)
-          *manifest_.add_kernel_install_operations() = aop.op;
+        for (const AnnotatedOperation& aop : part.aops) {
+          AddManifestOperation(aop.op,
+                               pack_extents_,
+                               manifest_.mutable_kernel_install_operations());
+        }
         if (part.old_info.has_size() || part.old_info.has_hash())
           *manifest_.mutable_old_kernel_info() = part.old_info;
         if (part.new_info.has_size() || part.new_info.has_hash())
           *manifest_.mutable_new_kernel_info() = part.new_info;
       } else {
-        for (const AnnotatedOperation& aop : part.aops)
-          *manifest_.add_install_operations() = aop.op;
+        for (const AnnotatedOperation& aop : part.aops) {
+          AddManifestOperation(
+              aop.op, pack_extents_, manifest_.mutable_install_operations());
+        }
         if (part.old_info.has_size() || part.old_info.has_hash())
           *manifest_.mutable_old_rootfs_info() = part.old_info;
         if (part.new_info.has_size() || part.new_info.has_hash())
@@ -167,6 +362,13 @@ bool PayloadFile::WritePayload(const string& payload_file,
     }
   }
 
+  vector<string> segments;
+  if (segmented_manifest_) {
+    uint64_t segments_size;
+    TEST_AND_RETURN_FALSE(BuildOperationsSegments(&segments, &segments_size));
+    next_blob_offset += segments_size;
+  }
+
   // Signatures appear at the end of the blobs. Note the offset in the
   // manifest_.
   uint64_t signature_blob_length = 0;
@@ -179,6 +381,15 @@ bool PayloadFile::WritePayload(const string& payload_file,
         major_version_ == kChromeOSMajorPayloadVersion, &manifest_);
   }
 
+  // The padding of the manifest makes the aligned blobs aligned in the file.
+  const uint64_t header_size =
+      sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) +
+      (major_version_ == kBrilloMajorPayloadVersion ? sizeof(uint32_t) : 0);
+  TEST_AND_RETURN_FALSE(PayloadSigner::PadMetadata(
+      header_size,
+      major_version_ == kBrilloMajorPayloadVersion ? signature_blob_length : 0,
+      &manifest_));
+
   // Serialize protobuf
   string serialized_manifest;
   TEST_AND_RETURN_FALSE(manifest_.AppendToString(&serialized_manifest));
@@ -187,11 +398,17 @@ bool PayloadFile::WritePayload(const string& payload_file,
       sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
 
   LOG(INFO) << "Writing final delta file header...";
-  DirectFileWriter writer;
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
-                                          O_WRONLY | O_CREAT | O_TRUNC,
-                                          0644) == 0);
-  ScopedFileWriterCloser writer_closer(&writer);
+  DirectFileWriter file_writer;
+  TEST_AND_RETURN_FALSE_ERRNO(file_writer.Open(payload_file.c_str(),
+                                               O_WRONLY | O_CREAT | O_TRUNC,
+                                               0644) == 0);
+  ScopedFileWriterCloser writer_closer(&file_writer);
+
+  // The hash of the metadata, the hash signed (everything but the signatures)
+  // and the hash of the whole file are computed while writing.
+  HashingFileWriter writer(&file_writer);
+  HashCalculator metadata_hasher, payload_hasher, file_hasher;
+  writer.set_hashers({&metadata_hasher, &payload_hasher, &file_hasher});
 
   // Write header
   TEST_AND_RETURN_FALSE(writer.Write(kDeltaMagic, sizeof(kDeltaMagic)));
@@ -221,52 +438,53 @@ bool PayloadFile::WritePayload(const string& payload_file,
             << serialized_manifest.size();
   TEST_AND_RETURN_FALSE(writer.Write(serialized_manifest.data(),
                                      serialized_manifest.size()));
+  TEST_AND_RETURN_FALSE(metadata_hasher.Finalize());
 
   // Write metadata signature blob.
   if (major_version_ == kBrilloMajorPayloadVersion &&
       !private_key_path.empty()) {
-    brillo::Blob metadata_hash, metadata_signature;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(payload_file,
-                                                             metadata_size,
-                                                             &metadata_hash));
+    brillo::Blob metadata_signature;
     TEST_AND_RETURN_FALSE(
-        PayloadSigner::SignHashWithKeys(metadata_hash,
+        PayloadSigner::SignHashWithKeys(metadata_hasher.raw_hash(),
                                         vector<string>(1, private_key_path),
                                         &metadata_signature));
+    // The signatures are not part of the signed data.
+    writer.set_hashers({&file_hasher});
     TEST_AND_RETURN_FALSE(writer.Write(metadata_signature.data(),
                                        metadata_signature.size()));
   }
 
   // Append the data blobs
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_path.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
-    }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE(writer.Write(buf.data(), rc));
-  }
+  writer.set_hashers({&payload_hasher, &file_hasher});
+  TEST_AND_RETURN_FALSE(
+      WriteDataBlobs(data_blobs_path, blob_offsets, segments, &writer));
+  TEST_AND_RETURN_FALSE(payload_hasher.Finalize());
 
   // Write payload signature blob.
   if (!private_key_path.empty()) {
     LOG(INFO) << "Signing the update...";
     brillo::Blob signature_blob;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
-        payload_file,
-        vector<string>(1, private_key_path),
-        metadata_size,
-        metadata_signature_size,
-        metadata_size + metadata_signature_size + manifest_.signatures_offset(),
-        &signature_blob));
+    TEST_AND_RETURN_FALSE(
+        PayloadSigner::SignHashWithKeys(payload_hasher.raw_hash(),
+                                        vector<string>(1, private_key_path),
+                                        &signature_blob));
+    writer.set_hashers({&file_hasher});
     TEST_AND_RETURN_FALSE(writer.Write(signature_blob.data(),
                                        signature_blob.size()));
   }
+  TEST_AND_RETURN_FALSE(file_hasher.Finalize());
+
+  properties_.SetString(kPayloadPropertyFileSize,
+                        std::to_string(writer.bytes_written()));
+  properties_.SetString(kPayloadPropertyMetadataSize,
+                        std::to_string(metadata_size));
+  properties_.SetString(
+      kPayloadPropertyFileHash,
+      brillo::data_encoding::Base64Encode(file_hasher.raw_hash()));
+  properties_.SetString(
+      kPayloadPropertyMetadataHash,
+      brillo::data_encoding::Base64Encode(metadata_hasher.raw_hash()));
 
   ReportPayloadUsage(metadata_size);
   *metadata_size_out = metadata_size;
@@ -276,9 +494,8 @@ bool PayloadFile::WritePayload(const string& payload_file,
 bool PayloadFile::ReorderDataBlobs(
     const string& data_blobs_path,
     const string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
+  vector<uint64_t> blob_offsets;
+  TEST_AND_RETURN_FALSE(HashDataBlobs(data_blobs_path, &blob_offsets));
 
   DirectFileWriter writer;
   TEST_AND_RETURN_FALSE(
@@ -286,38 +503,255 @@ bool PayloadFile::ReorderDataBlobs(
                   O_WRONLY | O_TRUNC | O_CREAT,
                   0644) == 0);
   ScopedFileWriterCloser writer_closer(&writer);
-  uint64_t out_file_size = 0;
+  TEST_AND_RETURN_FALSE(
+      WriteDataBlobs(data_blobs_path, blob_offsets, {}, &writer));
+  return true;
+}
 
+bool PayloadFile::HashDataBlobs(const string& data_blobs_path,
+                                vector<uint64_t>* blob_offsets) {
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  BufferedBlobReader reader(in_fd);
+
+  blob_offsets->clear();
+  uint64_t out_file_size = 0;
+  bool in_order = true;
+  size_t num_hashed_blobs = 0;
+  size_t num_dedup_blobs = 0;
+  uint64_t dedup_bytes = 0;
   for (auto& part : part_vec_) {
+    // The first full operation of the partition with every data blob hash.
+    std::map<string, const InstallOperation*> replace_ops;
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
-      ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
-      TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+      if (!aop.op.has_data_sha256_hash()) {
+        HashCalculator hasher;
+        TEST_AND_RETURN_FALSE(reader.ReadRange(aop.op.data_offset(),
+                                               aop.op.data_length(),
+                                               {&hasher}));
+
+        // Add the hash of the data blobs for this operation
+        TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, &hasher));
+        num_hashed_blobs++;
+      }
 
-      // Add the hash of the data blobs for this operation
-      TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      // A full operation with the same blob as a previous one writes the same
+      // data, which is copied from the blocks written by it instead.
+      if (dedup_blobs_ && IsFullOperation(aop.op)) {
+        auto it = replace_ops.emplace(aop.op.data_sha256_hash(), &aop.op).first;
+        const InstallOperation& first_op = *it->second;
+        if (&first_op != &aop.op && first_op.type() == aop.op.type() &&
+            BlocksInExtents(first_op.dst_extents()) ==
+                BlocksInExtents(aop.op.dst_extents())) {
+          num_dedup_blobs++;
+          dedup_bytes += aop.op.data_length();
+          aop.op.set_type(InstallOperation::MOVE);
+          *aop.op.mutable_src_extents() = first_op.dst_extents();
+          aop.op.clear_data_offset();
+          aop.op.clear_data_length();
+          aop.op.clear_data_sha256_hash();
+          continue;
+        }
+      }
 
+      // The large blobs start at a multiple of the alignment.
+      if (blob_alignment_ > 0 && aop.op.data_length() >= blob_alignment_) {
+        out_file_size = (out_file_size + blob_alignment_ - 1) /
+                        blob_alignment_ * blob_alignment_;
+      }
+      in_order = in_order && aop.op.data_offset() == out_file_size;
+      blob_offsets->push_back(aop.op.data_offset());
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE(writer.Write(buf.data(), buf.size()));
-      out_file_size += buf.size();
+      out_file_size += aop.op.data_length();
+    }
+  }
+  LOG(INFO) << "Hashed " << num_hashed_blobs << " of the "
+            << blob_offsets->size() << " data blobs with "
+            << reader.num_reads() << " reads, the blobs are "
+            << (in_order ? "already" : "not") << " in the payload order.";
+  if (num_dedup_blobs) {
+    LOG(INFO) << "Replaced " << num_dedup_blobs << " duplicated data blobs ("
+              << dedup_bytes << " bytes) with MOVE operations.";
+  }
+  return true;
+}
+
+bool PayloadFile::WriteDataBlobs(const string& data_blobs_path,
+                                 const vector<uint64_t>& blob_offsets,
+                                 const vector<string>& segments,
+                                 FileWriter* writer) const {
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  BufferedBlobReader reader(in_fd, writer);
+
+  size_t blob_index = 0;
+  // The end of the blobs written, without the segments, which are never
+  // combined with aligned blobs.
+  uint64_t blobs_size = 0;
+  for (size_t i = 0; i < part_vec_.size(); i++) {
+    if (i < segments.size() && !segments[i].empty())
+      TEST_AND_RETURN_FALSE(writer->Write(segments[i].data(),
+                                          segments[i].size()));
+    for (const AnnotatedOperation& aop : part_vec_[i].aops) {
+      if (!aop.op.has_data_offset())
+        continue;
+      TEST_AND_RETURN_FALSE(aop.op.data_offset() >= blobs_size);
+      if (aop.op.data_offset() > blobs_size) {
+        brillo::Blob padding(aop.op.data_offset() - blobs_size, 0);
+        TEST_AND_RETURN_FALSE(writer->Write(padding.data(), padding.size()));
+      }
+      TEST_AND_RETURN_FALSE(blob_index < blob_offsets.size());
+      TEST_AND_RETURN_FALSE(reader.ReadRange(blob_offsets[blob_index++],
+                                             aop.op.data_length(),
+                                             {}));
+      blobs_size = aop.op.data_offset() + aop.op.data_length();
     }
   }
+  TEST_AND_RETURN_FALSE(blob_index == blob_offsets.size());
+  return true;
+}
+
+bool PayloadFile::BuildOperationsSegments(vector<string>* segments,
+                                          uint64_t* segments_size) {
+  TEST_AND_RETURN_FALSE(major_version_ == kBrilloMajorPayloadVersion);
+  const int num_partitions = manifest_.partitions_size();
+  vector<PartitionOperations> operations(num_partitions);
+  // The offset of the first data blob of each partition before the segments
+  // are added; the blobs of the partitions follow each other.
+  vector<uint64_t> blobs_offsets(num_partitions);
+  uint64_t blobs_offset = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    PartitionUpdate* partition = manifest_.mutable_partitions(i);
+    operations[i].mutable_operations()->Swap(partition->mutable_operations());
+    blobs_offsets[i] = blobs_offset;
+    for (const InstallOperation& op : operations[i].operations())
+      blobs_offset += op.data_length();
+  }
+
+  // The segments shift the data offsets of the blobs after them, which in turn
+  // changes the size of the segments, so they are built again until no size
+  // changes. The sizes only grow, so it takes very few rounds.
+  segments->assign(num_partitions, string());
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    uint64_t shift = 0;
+    for (int i = 0; i < num_partitions; i++) {
+      if (operations[i].operations_size() == 0)
+        continue;
+      shift += (*segments)[i].size();
+      PartitionOperations shifted = operations[i];
+      for (InstallOperation& op : *shifted.mutable_operations()) {
+        if (op.has_data_offset())
+          op.set_data_offset(op.data_offset() + shift);
+      }
+      string segment;
+      TEST_AND_RETURN_FALSE(shifted.SerializeToString(&segment));
+      changed = changed || segment.size() != (*segments)[i].size();
+      (*segments)[i] = std::move(segment);
+    }
+  }
+
+  *segments_size = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    const string& segment = (*segments)[i];
+    if (segment.empty())
+      continue;
+    brillo::Blob hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBytes(segment.data(), segment.size(), &hash));
+    OperationsSegment* descriptor =
+        manifest_.mutable_partitions(i)->mutable_operations_segment();
+    descriptor->set_offset(blobs_offsets[i] + *segments_size);
+    descriptor->set_size(segment.size());
+    descriptor->set_sha256_hash(hash.data(), hash.size());
+    descriptor->set_num_operations(operations[i].operations_size());
+    *segments_size += segment.size();
+  }
+  LOG(INFO) << "Moved the operations of " << num_partitions
+            << " partitions to " << *segments_size << " bytes of segments.";
   return true;
 }
 
 bool PayloadFile::AddOperationHash(InstallOperation* op,
-                                   const brillo::Blob& buf) {
-  HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.Update(buf.data(), buf.size()));
-  TEST_AND_RETURN_FALSE(hasher.Finalize());
-  const brillo::Blob& hash = hasher.raw_hash();
+                                   HashCalculator* hasher) {
+  TEST_AND_RETURN_FALSE(hasher->Finalize());
+  const brillo::Blob& hash = hasher->raw_hash();
   op->set_data_sha256_hash(hash.data(), hash.size());
   return true;
 }
 
+void PayloadFile::ComputeApplyWaves(const vector<AnnotatedOperation>& aops,
+                                    vector<uint32_t>* waves) {
+  uint64_t num_blocks = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    for (const auto* extents : {&aop.op.src_extents(), &aop.op.dst_extents()}) {
+      for (const Extent& extent : *extents) {
+        if (extent.start_block() != kSparseHole) {
+          num_blocks = std::max(num_blocks,
+                                extent.start_block() + extent.num_blocks());
+        }
+      }
+    }
+  }
+  // One past the last wave writing to and reading from each target block, or
+  // zero if none, which is the first wave an operation accessing the block
+  // can be in.
+  vector<uint32_t> written(num_blocks, 0);
+  vector<uint32_t> read(num_blocks, 0);
+
+  waves->clear();
+  for (const AnnotatedOperation& aop : aops) {
+    // Only MOVE and BSDIFF read from the target partition.
+    bool reads_target = aop.op.type() == InstallOperation::MOVE ||
+                        aop.op.type() == InstallOperation::BSDIFF;
+    uint32_t wave = 0;
+    for (const Extent& extent : aop.op.dst_extents()) {
+      if (extent.start_block() == kSparseHole)
+        continue;
+      for (uint64_t block = extent.start_block();
+           block < extent.start_block() + extent.num_blocks(); block++) {
+        wave = std::max({wave, written[block], read[block]});
+      }
+    }
+    if (reads_target) {
+      for (const Extent& extent : aop.op.src_extents()) {
+        if (extent.start_block() == kSparseHole)
+          continue;
+        for (uint64_t block = extent.start_block();
+             block < extent.start_block() + extent.num_blocks(); block++) {
+          wave = std::max(wave, written[block]);
+        }
+      }
+    }
+
+    for (const Extent& extent : aop.op.dst_extents()) {
+      if (extent.start_block() == kSparseHole)
+        continue;
+      for (uint64_t block = extent.start_block();
+           block < extent.start_block() + extent.num_blocks(); block++) {
+        written[block] = wave + 1;
+      }
+    }
+    if (reads_target) {
+      for (const Extent& extent : aop.op.src_extents()) {
+        if (extent.start_block() == kSparseHole)
+          continue;
+        for (uint64_t block = extent.start_block();
+             block < extent.start_block() + extent.num_blocks(); block++) {
+          read[block] = std::max(read[block], wave + 1);
+        }
+      }
+    }
+    waves->push_back(wave);
+  }
+}
+
 void PayloadFile::ReportPayloadUsage(uint64_t metadata_size) const {
   vector<DeltaObject> objects;
   off_t total_size = 0;
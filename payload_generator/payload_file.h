@@ -20,9 +20,12 @@
 #include <string>
 #include <vector>
 
+#include <brillo/key_value_store.h>
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
@@ -38,6 +41,10 @@ class PayloadFile {
   // required hashes of the requested partitions.
   bool Init(const PayloadGenerationConfig& config);
 
+  // Stores the zstd |dictionary| the REPLACE_ZSTD operations flagged with
+  // zstd_dictionary were compressed against in the manifest.
+  void SetZstdDictionary(const brillo::Blob& dictionary);
+
   // Add a partition to the payload manifest. Including partition name, list of
   // operations and partition info. The operations in |aops|
   // reference a blob stored in the file provided to WritePayload().
@@ -45,25 +52,59 @@ class PayloadFile {
                     const PartitionConfig& new_conf,
                     const std::vector<AnnotatedOperation>& aops);
 
+  // Same as above, but with the PartitionInfo of the |name| partition already
+  // known, for example from the payloads the operations were taken from, or
+  // hashed while the operations were generated. The |old_info| is empty for a
+  // full update.
+  bool AddPartition(const std::string& name,
+                    const PartitionInfo& old_info,
+                    const PartitionInfo& new_info,
+                    const PostInstallConfig& postinstall,
+                    const std::vector<AnnotatedOperation>& aops);
+
+  // Sets the hash tree the clients build in the partition of |new_conf|,
+  // already added, from its settings in blocks of |block_size| bytes. Does
+  // nothing if it has no hash tree. Returns false if it wasn't added.
+  bool SetHashTree(const PartitionConfig& new_conf, size_t block_size);
+
   // Write the payload to the |payload_file| file. The operations reference
   // blobs in the |data_blobs_path| file and the blobs will be reordered in the
   // payload file to match the order of the operations. The size of the metadata
-  // section of the payload is stored in |metadata_size_out|.
+  // section of the payload is stored in |metadata_size_out|. The hashes used to
+  // sign the payload and the payload properties are computed while the payload
+  // is written, so the payload file is never read back.
   bool WritePayload(const std::string& payload_file,
                     const std::string& data_blobs_path,
                     const std::string& private_key_path,
                     uint64_t* metadata_size_out);
 
+  // The properties of the payload written by WritePayload(), the same returned
+  // by PayloadSigner::ExtractPayloadProperties() for the payload file.
+  const brillo::KeyValueStore& properties() const { return properties_; }
+
  private:
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
-
-  // Computes a SHA256 hash of the given buf and sets the hash value in the
-  // operation so that update_engine could verify. This hash should be set
-  // for all operations that have a non-zero data blob. One exception is the
-  // dummy operation for signature blob because the contents of the signature
-  // blob will not be available at payload creation time. So, update_engine will
-  // gracefully ignore the dummy signature operation.
-  static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
+  FRIEND_TEST(PayloadFileTest, ReorderBigBlobsTest);
+  FRIEND_TEST(PayloadFileTest, DedupBlobsTest);
+  FRIEND_TEST(PayloadFileTest, HashedBlobsTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadPropertiesTest);
+  FRIEND_TEST(PayloadFileTest, ApplyWavesTest);
+  FRIEND_TEST(PayloadFileTest, AlignedBlobsTest);
+
+  // Finalizes the SHA256 |hasher| of the data blob of the operation and sets
+  // the hash value in the operation so that update_engine could verify. This
+  // hash should be set for all operations that have a non-zero data blob. One
+  // exception is the dummy operation for signature blob because the contents
+  // of the signature blob will not be available at payload creation time. So,
+  // update_engine will gracefully ignore the dummy signature operation.
+  static bool AddOperationHash(InstallOperation* op, HashCalculator* hasher);
+
+  // Returns in |waves| the apply wave of each of the |aops| of a partition:
+  // the lowest wave after the ones of all the previous operations writing to
+  // a block the operation reads or writes, and of all the previous operations
+  // reading from the target partition a block the operation writes.
+  static void ComputeApplyWaves(const std::vector<AnnotatedOperation>& aops,
+                                std::vector<uint32_t>* waves);
 
   // Install operations in the manifest may reference data blobs, which
   // are in data_blobs_path. This function creates a new data blobs file
@@ -75,12 +116,56 @@ class PayloadFile {
   bool ReorderDataBlobs(const std::string& data_blobs_path,
                         const std::string& new_data_blobs_path);
 
+  // Sets the hash of the data blob of every operation without one, read from
+  // |data_blobs_path|, and moves their offsets to the ones of the reordered
+  // data blobs. The blobs stored with AnnotatedOperation::SetOperationBlob()
+  // are already hashed, so they are only read once, to write the payload.
+  // The offsets of the blobs in |data_blobs_path| are stored in
+  // |blob_offsets|, in the order of the operations. If |dedup_blobs_|, the
+  // full operations with the same blob as a previous one of the partition are
+  // turned into MOVE operations copying the blocks it wrote. The blobs of at
+  // least |blob_alignment_| bytes are moved to aligned offsets.
+  bool HashDataBlobs(const std::string& data_blobs_path,
+                     std::vector<uint64_t>* blob_offsets);
+
+  // Writes to |writer| the data blobs of the operations, read from the
+  // |blob_offsets| of |data_blobs_path| returned by HashDataBlobs(). The
+  // |segments|, if any, are written before the blobs of their partition, and
+  // the padding before the aligned blobs is filled with zeros.
+  bool WriteDataBlobs(const std::string& data_blobs_path,
+                      const std::vector<uint64_t>& blob_offsets,
+                      const std::vector<std::string>& segments,
+                      FileWriter* writer) const;
+
+  // Moves the operations of the partitions in the manifest to the serialized
+  // PartitionOperations |segments|, one per partition or empty if it has no
+  // operations, which are stored right before the data blobs of the
+  // partition. Shifts the offsets of the blobs after each segment and returns
+  // the size of all of them in |segments_size|.
+  bool BuildOperationsSegments(std::vector<std::string>* segments,
+                               uint64_t* segments_size);
+
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
 
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // Whether the duplicated data blobs are removed from the payload.
+  bool dedup_blobs_{false};
+
+  // Whether the extents of the operations are packed in the manifest.
+  bool pack_extents_{false};
+
+  // Whether the operations are stored in segments outside of the manifest.
+  bool segmented_manifest_{false};
+
+  // The data blobs of at least this many bytes are aligned to it, if not 0.
+  uint32_t blob_alignment_{0};
+
+  // The size of the chunks hashed separately in the PartitionInfo, if any.
+  uint64_t partition_hash_chunk_size_{0};
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -95,9 +180,17 @@ class PayloadFile {
     PartitionInfo new_info;
 
     PostInstallConfig postinstall;
+
+    // The hash tree the clients build, if |hash_tree_extent| has any block.
+    Extent hash_tree_data_extent;
+    Extent hash_tree_extent;
+    brillo::Blob hash_tree_salt;
   };
 
   std::vector<Partition> part_vec_;
+
+  // The properties of the last payload written.
+  brillo::KeyValueStore properties_;
 };
 
 }  // namespace chromeos_update_engine
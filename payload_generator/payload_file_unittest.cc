@@ -22,14 +22,23 @@
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/constants.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+const char* kUnittestPrivateKeyPath = "unittest_key.pem";
+}  // namespace
+
 class PayloadFileTest : public ::testing::Test {
  protected:
   PayloadFile payload_;
@@ -91,4 +100,226 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, ReorderBigBlobsTest) {
+  string orig_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderBigBlobsTest.orig.XXXXXX",
+                                  &orig_blobs, nullptr));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+
+  // A blob bigger than the read buffer stored after many small blobs, which
+  // are read together.
+  const size_t kNumSmallBlobs = 100;
+  const size_t kBigBlobSize = 3 * 1024 * 1024 + 5;
+  brillo::Blob orig_data;
+  for (size_t i = 0; i < kNumSmallBlobs; i++)
+    orig_data.push_back(i);
+  for (size_t i = 0; i < kBigBlobSize; i++)
+    orig_data.push_back(i * 7 % 251);
+  EXPECT_TRUE(test_utils::WriteFileVector(orig_blobs, orig_data));
+
+  string new_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("ReorderBigBlobsTest.new.XXXXXX",
+                                  &new_blobs, nullptr));
+  ScopedPathUnlinker new_blobs_unlinker(new_blobs);
+
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  aop.op.set_data_offset(kNumSmallBlobs);
+  aop.op.set_data_length(kBigBlobSize);
+  payload_.part_vec_[0].aops.push_back(aop);
+  for (size_t i = 0; i < kNumSmallBlobs; i++) {
+    aop.op.set_data_offset(i);
+    aop.op.set_data_length(1);
+    payload_.part_vec_[0].aops.push_back(aop);
+  }
+
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs, new_blobs));
+
+  brillo::Blob expected_data(orig_data.begin() + kNumSmallBlobs,
+                             orig_data.end());
+  expected_data.insert(expected_data.end(),
+                       orig_data.begin(),
+                       orig_data.begin() + kNumSmallBlobs);
+  brillo::Blob new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs, &new_data));
+  EXPECT_EQ(expected_data, new_data);
+
+  const vector<AnnotatedOperation>& aops = payload_.part_vec_[0].aops;
+  EXPECT_EQ(0U, aops[0].op.data_offset());
+  EXPECT_EQ(kBigBlobSize + kNumSmallBlobs - 1,
+            aops[kNumSmallBlobs].op.data_offset());
+  brillo::Blob small_blob_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(&orig_data[kNumSmallBlobs - 1], 1,
+                                             &small_blob_hash));
+  EXPECT_EQ(brillo::Blob(aops[kNumSmallBlobs].op.data_sha256_hash().begin(),
+                         aops[kNumSmallBlobs].op.data_sha256_hash().end()),
+            small_blob_hash);
+}
+
+TEST_F(PayloadFileTest, DedupBlobsTest) {
+  string orig_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("DedupBlobsTest.orig.XXXXXX", &orig_blobs,
+                                  nullptr));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+  string orig_data = "abcabcxyz";
+  EXPECT_TRUE(
+      utils::WriteFile(orig_blobs.c_str(), orig_data.data(), orig_data.size()));
+
+  payload_.dedup_blobs_ = true;
+  payload_.part_vec_.resize(1);
+  vector<AnnotatedOperation>* aops = &payload_.part_vec_[0].aops;
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  for (uint64_t i = 0; i < 3; i++) {
+    aop.op.clear_dst_extents();
+    *aop.op.add_dst_extents() = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 3);
+    aop.op.set_data_length(3);
+    aops->push_back(aop);
+  }
+
+  vector<uint64_t> blob_offsets;
+  EXPECT_TRUE(payload_.HashDataBlobs(orig_blobs, &blob_offsets));
+  EXPECT_EQ((vector<uint64_t>{0, 6}), blob_offsets);
+
+  // The second operation copies the block written by the first one.
+  EXPECT_EQ(InstallOperation::REPLACE, (*aops)[0].op.type());
+  EXPECT_EQ(InstallOperation::MOVE, (*aops)[1].op.type());
+  EXPECT_FALSE((*aops)[1].op.has_data_offset());
+  EXPECT_FALSE((*aops)[1].op.has_data_sha256_hash());
+  ASSERT_EQ(1, (*aops)[1].op.src_extents_size());
+  EXPECT_EQ(ExtentForRange(0, 1), (*aops)[1].op.src_extents(0));
+  EXPECT_EQ(InstallOperation::REPLACE, (*aops)[2].op.type());
+  EXPECT_EQ(3U, (*aops)[2].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, HashedBlobsTest) {
+  test_utils::ScopedTempFile orig_blobs("HashedBlobsTest.orig.XXXXXX");
+  string orig_data = "abcxyz";
+  EXPECT_TRUE(utils::WriteFile(
+      orig_blobs.path().c_str(), orig_data.data(), orig_data.size()));
+
+  // The blob of the first operation was hashed when it was stored, so only
+  // the second one is read.
+  payload_.part_vec_.resize(1);
+  vector<AnnotatedOperation>* aops = &payload_.part_vec_[0].aops;
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(3);
+  aop.op.set_data_length(3);
+  aop.op.set_data_sha256_hash("stored hash");
+  aops->push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.clear_data_sha256_hash();
+  aops->push_back(aop);
+
+  vector<uint64_t> blob_offsets;
+  EXPECT_TRUE(payload_.HashDataBlobs(orig_blobs.path(), &blob_offsets));
+  EXPECT_EQ((vector<uint64_t>{3, 0}), blob_offsets);
+  EXPECT_EQ("stored hash", (*aops)[0].op.data_sha256_hash());
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes("abc", 3, &expected_hash));
+  EXPECT_EQ(string(expected_hash.begin(), expected_hash.end()),
+            (*aops)[1].op.data_sha256_hash());
+  EXPECT_EQ(3U, (*aops)[1].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, AlignedBlobsTest) {
+  test_utils::ScopedTempFile orig_blobs("AlignedBlobsTest.orig.XXXXXX");
+  test_utils::ScopedTempFile new_blobs("AlignedBlobsTest.new.XXXXXX");
+  string orig_data = "abcdefghijklmnopq";
+  EXPECT_TRUE(utils::WriteFile(
+      orig_blobs.path().c_str(), orig_data.data(), orig_data.size()));
+
+  // Only the blobs of at least 8 bytes are aligned.
+  payload_.blob_alignment_ = 8;
+  payload_.part_vec_.resize(1);
+  vector<AnnotatedOperation>* aops = &payload_.part_vec_[0].aops;
+  AnnotatedOperation aop;
+  for (const auto& range : vector<std::pair<uint64_t, uint64_t>>{
+           {0, 3}, {3, 10}, {13, 2}, {15, 2}}) {
+    aop.op.set_data_offset(range.first);
+    aop.op.set_data_length(range.second);
+    aops->push_back(aop);
+  }
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+
+  EXPECT_EQ(0U, (*aops)[0].op.data_offset());
+  EXPECT_EQ(8U, (*aops)[1].op.data_offset());
+  EXPECT_EQ(18U, (*aops)[2].op.data_offset());
+  EXPECT_EQ(20U, (*aops)[3].op.data_offset());
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
+  EXPECT_EQ(string("abc") + string(5, '\0') + "defghijklmnopq", new_data);
+}
+
+TEST_F(PayloadFileTest, ApplyWavesTest) {
+  vector<AnnotatedOperation> aops(7);
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 2);
+  aops[1].op.set_type(InstallOperation::REPLACE);
+  *aops[1].op.add_dst_extents() = ExtentForRange(2, 2);
+  // The source blocks are read from the source partition.
+  aops[2].op.set_type(InstallOperation::SOURCE_COPY);
+  *aops[2].op.add_src_extents() = ExtentForRange(0, 2);
+  *aops[2].op.add_dst_extents() = ExtentForRange(4, 1);
+  // Writes a block written by the operation 0.
+  aops[3].op.set_type(InstallOperation::REPLACE);
+  *aops[3].op.add_dst_extents() = ExtentForRange(1, 1);
+  // Reads a block written by the operation 2.
+  aops[4].op.set_type(InstallOperation::MOVE);
+  *aops[4].op.add_src_extents() = ExtentForRange(4, 1);
+  *aops[4].op.add_dst_extents() = ExtentForRange(10, 1);
+  // Writes a block read by the operation 4.
+  aops[5].op.set_type(InstallOperation::REPLACE);
+  *aops[5].op.add_dst_extents() = ExtentForRange(4, 1);
+  // The sparse holes aren't written.
+  aops[6].op.set_type(InstallOperation::REPLACE);
+  *aops[6].op.add_dst_extents() = ExtentForRange(kSparseHole, 4);
+
+  vector<uint32_t> waves;
+  PayloadFile::ComputeApplyWaves(aops, &waves);
+  EXPECT_EQ((vector<uint32_t>{0, 0, 0, 1, 1, 2, 0}), waves);
+}
+
+TEST_F(PayloadFileTest, WritePayloadPropertiesTest) {
+  string data_blobs;
+  EXPECT_TRUE(utils::MakeTempFile("WritePayloadPropertiesTest.blobs.XXXXXX",
+                                  &data_blobs,
+                                  nullptr));
+  ScopedPathUnlinker data_blobs_unlinker(data_blobs);
+  string blob_data = "payload data";
+  EXPECT_TRUE(utils::WriteFile(
+      data_blobs.c_str(), blob_data.data(), blob_data.size()));
+  string payload_path;
+  EXPECT_TRUE(utils::MakeTempFile("WritePayloadPropertiesTest.XXXXXX",
+                                  &payload_path,
+                                  nullptr));
+  ScopedPathUnlinker payload_path_unlinker(payload_path);
+
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  EXPECT_TRUE(payload_.Init(config));
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(blob_data.size());
+  payload_.part_vec_[0].aops = {aop};
+
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload_.WritePayload(
+      payload_path, data_blobs, kUnittestPrivateKeyPath, &metadata_size));
+
+  // The properties computed while writing match the ones read from the file.
+  brillo::KeyValueStore properties;
+  EXPECT_TRUE(
+      PayloadSigner::ExtractPayloadProperties(payload_path, &properties));
+  EXPECT_EQ(properties.SaveToString(), payload_.properties().SaveToString());
+  string file_size;
+  EXPECT_TRUE(payload_.properties().GetString(kPayloadPropertyFileSize,
+                                              &file_size));
+  EXPECT_EQ(std::to_string(utils::FileSize(payload_path)), file_size);
+}
+
 }  // namespace chromeos_update_engine
@@ -20,24 +20,29 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/hash_tree_builder.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
+#include "update_engine/payload_generator/sparse_image.h"
+#include "update_engine/payload_generator/squashfs_filesystem.h"
 
 namespace chromeos_update_engine {
 
 bool PostInstallConfig::IsEmpty() const {
-  return !run && path.empty() && filesystem_type.empty() && !optional;
+  return !run && path.empty() && filesystem_type.empty() && !optional &&
+         !parallel;
 }
 
 bool PartitionConfig::ValidateExists() const {
   TEST_AND_RETURN_FALSE(!path.empty());
   TEST_AND_RETURN_FALSE(utils::FileExists(path.c_str()));
   TEST_AND_RETURN_FALSE(size > 0);
-  // The requested size is within the limits of the file.
-  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <=
-                        utils::FileSize(path.c_str()));
+  // The requested size is within the limits of the image.
+  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <= PartitionImageSize(path));
   // TODO(deymo): The delta generator algorithm doesn't support a block size
   // different than 4 KiB. Remove this check once that's fixed. crbug.com/455045
   int block_count, block_size;
@@ -57,6 +62,14 @@ bool PartitionConfig::OpenFilesystem() {
   fs_interface.reset();
   if (utils::IsExtFilesystem(path)) {
     fs_interface = Ext2Filesystem::CreateFromFile(path);
+  } else if (utils::IsSquashfsFilesystem(path)) {
+    fs_interface = SquashfsFilesystem::CreateFromFile(path);
+  }
+  if (fs_interface && mapfile_path.empty()) {
+    // The delta generator algorithm doesn't support a block size different
+    // than 4 KiB.
+    TEST_AND_RETURN_FALSE(fs_interface->GetBlockSize() == kBlockSize);
+    return true;
   }
 
   if (!mapfile_path.empty()) {
@@ -74,6 +87,15 @@ bool PartitionConfig::OpenFilesystem() {
   return true;
 }
 
+std::vector<Extent> PartitionConfig::HashTreeExtents(size_t block_size) const {
+  if (hash_tree_data_size == 0)
+    return {};
+  return {ExtentForRange(
+      hash_tree_data_size / block_size,
+      HashTreeBuilder::TreeSize(hash_tree_data_size, block_size) /
+          block_size)};
+}
+
 bool ImageConfig::ValidateIsEmpty() const {
   TEST_AND_RETURN_FALSE(ImageInfoIsEmpty());
   return partitions.empty();
@@ -83,7 +105,7 @@ bool ImageConfig::LoadImageSize() {
   for (PartitionConfig& part : partitions) {
     if (part.path.empty())
       continue;
-    part.size = utils::FileSize(part.path);
+    part.size = PartitionImageSize(part.path);
   }
   return true;
 }
@@ -102,6 +124,8 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
                     &part.postinstall.filesystem_type);
     store.GetBoolean("POSTINSTALL_OPTIONAL_" + part.name,
                      &part.postinstall.optional);
+    store.GetBoolean("POSTINSTALL_PARALLEL_" + part.name,
+                     &part.postinstall.parallel);
   }
   if (!found_postinstall) {
     LOG(ERROR) << "No valid postinstall config found.";
@@ -119,6 +143,141 @@ bool ImageConfig::ImageInfoIsEmpty() const {
     && image_info.build_version().empty();
 }
 
+bool ApplyOrderCostModel::SetStorageClass(const std::string& storage_class) {
+  if (storage_class == "emmc") {
+    // eMMC random reads cost several times a sequential read, while the
+    // writes are mostly absorbed by the page cache.
+    src_seek_cost = 1.0;
+    dst_seek_cost = 0.5;
+    seek_cost_per_block = 0.0;
+    readahead_blocks = 32;
+  } else if (storage_class == "ufs") {
+    // UFS has command queuing and a much lower random read penalty.
+    src_seek_cost = 0.3;
+    dst_seek_cost = 0.2;
+    seek_cost_per_block = 0.0;
+    readahead_blocks = 64;
+  } else if (storage_class == "hdd") {
+    // Rotational disks pay both for seeking and for the distance sought.
+    src_seek_cost = 1.0;
+    dst_seek_cost = 1.0;
+    seek_cost_per_block = 1e-6;
+    readahead_blocks = 64;
+  } else {
+    return false;
+  }
+  enabled = true;
+  return true;
+}
+
+double ApplyOrderCostModel::JumpCost(uint64_t from,
+                                     uint64_t to,
+                                     double seek_cost) const {
+  if (to >= from && to - from <= readahead_blocks)
+    return 0;
+  uint64_t distance = to > from ? to - from : from - to;
+  return seek_cost + seek_cost_per_block * distance;
+}
+
+bool OperationCostModel::SetDeviceClass(const std::string& device_class) {
+  if (device_class == "arm-emmc" || device_class == "arm-ufs") {
+    // Mobile ARM cores, where xz and bzip2 decompress at a few tens of MiB/s
+    // while zstd runs close to the storage speed.
+    replace_seconds_per_mib = 0.0;
+    replace_bz_seconds_per_mib = 0.05;
+    replace_xz_seconds_per_mib = 0.03;
+    replace_zstd_seconds_per_mib = 0.005;
+    bsdiff_seconds_per_mib = 0.1;
+    imgdiff_seconds_per_mib = 0.15;
+    if (device_class == "arm-emmc") {
+      read_seconds_per_mib = 0.01;
+      write_seconds_per_mib = 0.02;
+    } else {
+      // UFS is about three times faster than eMMC.
+      read_seconds_per_mib = 0.003;
+      write_seconds_per_mib = 0.006;
+    }
+  } else if (device_class == "x86") {
+    // Desktop class cores run the decompressors and patchers about four times
+    // faster, on SSD storage.
+    read_seconds_per_mib = 0.002;
+    write_seconds_per_mib = 0.004;
+    replace_seconds_per_mib = 0.0;
+    replace_bz_seconds_per_mib = 0.012;
+    replace_xz_seconds_per_mib = 0.008;
+    replace_zstd_seconds_per_mib = 0.0015;
+    bsdiff_seconds_per_mib = 0.025;
+    imgdiff_seconds_per_mib = 0.04;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+double OperationCostModel::ApplySeconds(InstallOperation_Type type,
+                                        uint64_t src_bytes,
+                                        uint64_t dst_bytes) const {
+  double cpu_seconds_per_mib = 0;
+  switch (type) {
+    case InstallOperation::REPLACE:
+      cpu_seconds_per_mib = replace_seconds_per_mib;
+      break;
+    case InstallOperation::REPLACE_BZ:
+      cpu_seconds_per_mib = replace_bz_seconds_per_mib;
+      break;
+    case InstallOperation::REPLACE_XZ:
+      cpu_seconds_per_mib = replace_xz_seconds_per_mib;
+      break;
+    case InstallOperation::REPLACE_ZSTD:
+      cpu_seconds_per_mib = replace_zstd_seconds_per_mib;
+      break;
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+      cpu_seconds_per_mib = bsdiff_seconds_per_mib;
+      break;
+    case InstallOperation::IMGDIFF:
+      cpu_seconds_per_mib = imgdiff_seconds_per_mib;
+      break;
+    case InstallOperation::MOVE:
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      break;
+  }
+  const double kMiB = 1024 * 1024;
+  return (src_bytes * read_seconds_per_mib +
+          dst_bytes * (write_seconds_per_mib + cpu_seconds_per_mib)) /
+         kMiB;
+}
+
+double OperationCostModel::Cost(InstallOperation_Type type,
+                                uint64_t src_bytes,
+                                uint64_t dst_bytes,
+                                uint64_t blob_size) const {
+  if (!enabled())
+    return blob_size;
+  return blob_size +
+         bytes_per_second * ApplySeconds(type, src_bytes, dst_bytes);
+}
+
+bool DecoderMemoryProfile::SetMemoryClass(const std::string& memory_class) {
+  if (memory_class == "default") {
+    xz_level = 6;
+    xz_dict_size = 0;
+    max_bsdiff_destination_size = 200 * 1024 * 1024;
+  } else if (memory_class == "low-ram") {
+    // A 4 MiB dictionary costs a few percent of the size of the REPLACE_XZ
+    // blobs, and the smaller bsdiff operations keep bspatch within a few
+    // hundred MiB.
+    xz_level = 6;
+    xz_dict_size = 4 * 1024 * 1024;
+    max_bsdiff_destination_size = 64 * 1024 * 1024;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 PayloadVersion::PayloadVersion(uint64_t major_version, uint32_t minor_version) {
   major = major_version;
   minor = minor_version;
@@ -131,7 +290,33 @@ bool PayloadVersion::Validate() const {
                         minor == kInPlaceMinorPayloadVersion ||
                         minor == kSourceMinorPayloadVersion ||
                         minor == kOpSrcHashMinorPayloadVersion ||
-                        minor == kImgdiffMinorPayloadVersion);
+                        minor == kImgdiffMinorPayloadVersion ||
+                        minor == kBlobDedupMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kPackedExtentsMinorPayloadVersion ||
+                        minor == kSegmentedManifestMinorPayloadVersion ||
+                        minor == kXzChunksMinorPayloadVersion ||
+                        minor == kAlignedBlobsMinorPayloadVersion ||
+                        minor == kZstdDictionaryMinorPayloadVersion ||
+                        minor == kHashTreeMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(!segmented_manifest ||
+                        (major == kBrilloMajorPayloadVersion &&
+                         minor >= kSegmentedManifestMinorPayloadVersion));
+  TEST_AND_RETURN_FALSE(xz_chunk_blocks == 0 ||
+                        minor >= kXzChunksMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(blob_alignment == 0 ||
+                        ((blob_alignment & (blob_alignment - 1)) == 0 &&
+                         !segmented_manifest &&
+                         (minor == kFullPayloadMinorVersion ||
+                          minor >= kAlignedBlobsMinorPayloadVersion)));
+  TEST_AND_RETURN_FALSE(zstd_dictionary_size == 0 ||
+                        minor == kFullPayloadMinorVersion ||
+                        minor >= kZstdDictionaryMinorPayloadVersion);
+  TEST_AND_RETURN_FALSE(memory_profile.xz_level >= 0 &&
+                        memory_profile.xz_level <= 9);
+  TEST_AND_RETURN_FALSE(memory_profile.xz_dict_size <=
+                        XzExtentWriter::kMaxDictSize);
+  TEST_AND_RETURN_FALSE(memory_profile.max_bsdiff_destination_size > 0);
   return true;
 }
 
@@ -149,6 +334,12 @@ bool PayloadVersion::OperationAllowed(InstallOperation_Type operation) const {
       return major == kBrilloMajorPayloadVersion ||
              minor >= kOpSrcHashMinorPayloadVersion;
 
+    case InstallOperation::REPLACE_ZSTD:
+      // Full payloads only use it when the target clients are known to
+      // support it, since their minor version doesn't tell.
+      return minor >= kZstdMinorPayloadVersion ||
+             (minor == kFullPayloadMinorVersion && zstd_allowed);
+
     case InstallOperation::ZERO:
     case InstallOperation::DISCARD:
       // The implementation of these operations had a bug in earlier versions
@@ -212,6 +403,18 @@ bool PayloadGenerationConfig::Validate() const {
       TEST_AND_RETURN_FALSE(rootfs_partition_size >= part.size);
     if (version.major == kChromeOSMajorPayloadVersion)
       TEST_AND_RETURN_FALSE(part.postinstall.IsEmpty());
+    if (part.hash_tree_data_size > 0) {
+      // Like the aligned blobs, the full payloads only build the hash trees
+      // when the clients are known to support it.
+      TEST_AND_RETURN_FALSE(version.major == kBrilloMajorPayloadVersion &&
+                            (version.minor == kFullPayloadMinorVersion ||
+                             version.minor >= kHashTreeMinorPayloadVersion));
+      TEST_AND_RETURN_FALSE(part.hash_tree_data_size % block_size == 0);
+      TEST_AND_RETURN_FALSE(
+          part.hash_tree_data_size +
+              HashTreeBuilder::TreeSize(part.hash_tree_data_size, block_size) <=
+          part.size);
+    }
   }
 
   TEST_AND_RETURN_FALSE(hard_chunk_size == -1 ||
@@ -219,6 +422,12 @@ bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(partition_hash_chunk_size % block_size == 0);
+
+  // The dictionary is trained from all the partitions at once, so the shards
+  // generated one partition at a time can't be compressed against it.
+  TEST_AND_RETURN_FALSE(version.zstd_dictionary_size == 0 ||
+                        partition_shards.empty());
 
   return true;
 }
@@ -24,6 +24,7 @@
 #include <vector>
 
 #include <brillo/key_value_store.h>
+#include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
@@ -49,6 +50,10 @@ struct PostInstallConfig {
 
   // Whether this postinstall script should be ignored if it fails.
   bool optional = false;
+
+  // Whether this postinstall script may run at the same time as the ones of
+  // the other partitions with this flag set.
+  bool parallel = false;
 };
 
 struct PartitionConfig {
@@ -62,6 +67,10 @@ struct PartitionConfig {
   // |fs_interface|. Returns whether opening the filesystem worked.
   bool OpenFilesystem();
 
+  // Returns the blocks of the hash tree of the partition, none if it has no
+  // |hash_tree_data_size|.
+  std::vector<Extent> HashTreeExtents(size_t block_size) const;
+
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
   std::string path;
@@ -86,6 +95,13 @@ struct PartitionConfig {
   std::string name;
 
   PostInstallConfig postinstall;
+
+  // The size of the data at the start of the partition hashed in its
+  // dm-verity hash tree with the |hash_tree_salt|. The tree follows the data,
+  // and the clients build it from the data instead of the payload sending it.
+  // 0 if the partition has no hash tree.
+  uint64_t hash_tree_data_size = 0;
+  brillo::Blob hash_tree_salt;
 };
 
 // The ImageConfig struct describes a pair of binaries kernel and rootfs and the
@@ -115,6 +131,123 @@ struct ImageConfig {
   std::vector<PartitionConfig> partitions;
 };
 
+// The thresholds used to skip the compressors unlikely to produce the smallest
+// full operation in diff_utils::GenerateBestFullOperation().
+struct CompressionHeuristics {
+  // The data is stored uncompressed, without trying any compressor, when the
+  // byte entropy of its sample is above this value, in bits per byte. A value
+  // of 8 or more never skips the compressors.
+  double max_entropy = 7.95;
+
+  // The number of bytes sampled, evenly spread over the data, to estimate its
+  // entropy and to run the trial compressions.
+  size_t sample_size = 64 * 1024;
+
+  // When both xz and bzip2 are allowed and the data is larger than twice the
+  // sample, bzip2 only compresses the whole data if its trial compression of
+  // the sample is at most this fraction larger than the xz one. A negative
+  // value always runs bzip2.
+  double bzip_trial_margin = 0.02;
+
+  // When zstd is allowed, it is used unless the xz or bzip2 data is more than
+  // this fraction smaller than the zstd one.
+  double zstd_size_margin = 0.03;
+};
+
+// The cost model used to order the operations of A/B payloads for the storage
+// of the devices applying them, in units of a seek. Every operation is charged
+// for the jumps from the end of the previous source read and destination
+// write to its own first ones.
+struct ApplyOrderCostModel {
+  // Sets the model tuned for the |storage_class|: "emmc", "ufs" or "hdd".
+  // Returns whether the storage class is known.
+  bool SetStorageClass(const std::string& storage_class);
+
+  // Returns the cost of jumping from the |from| block to the |to| block in a
+  // partition, when a seek there costs |seek_cost|.
+  double JumpCost(uint64_t from, uint64_t to, double seek_cost) const;
+
+  // Whether the operations are ordered by this model. Otherwise, they are
+  // sorted by their destination.
+  bool enabled = false;
+
+  // The cost of a non-sequential read from the source partition and of a
+  // non-sequential write to the target partition.
+  double src_seek_cost = 1.0;
+  double dst_seek_cost = 0.5;
+
+  // The cost added to a jump per block of distance, for storage where the
+  // seek time depends on it.
+  double seek_cost_per_block = 0.0;
+
+  // The jumps of up to this many blocks forward are free, since those blocks
+  // are already read ahead or merged in the same write by the kernel.
+  uint64_t readahead_blocks = 32;
+};
+
+// The model of the time the target devices take to apply each type of
+// operation, used to trade payload size for apply time when choosing the
+// operation of every chunk. The operations minimize their blob size plus their
+// estimated apply time weighted by |bytes_per_second|.
+struct OperationCostModel {
+  // Sets the coefficients measured on the |device_class|: "arm-emmc",
+  // "arm-ufs" or "x86". Returns whether the device class is known.
+  bool SetDeviceClass(const std::string& device_class);
+
+  // Returns the estimated seconds to apply an operation of |type| that reads
+  // |src_bytes| from the source partition and writes |dst_bytes|.
+  double ApplySeconds(InstallOperation_Type type,
+                      uint64_t src_bytes,
+                      uint64_t dst_bytes) const;
+
+  // Returns the objective minimized by the chosen operations: the |blob_size|
+  // plus the weighted apply time.
+  double Cost(InstallOperation_Type type,
+              uint64_t src_bytes,
+              uint64_t dst_bytes,
+              uint64_t blob_size) const;
+
+  // Whether the apply time is taken into account at all.
+  bool enabled() const { return bytes_per_second > 0; }
+
+  // The payload bytes one second of apply time is worth. When zero, the
+  // default, the smallest operation is always chosen.
+  double bytes_per_second = 0;
+
+  // The I/O time of reading the source data and writing the target data.
+  double read_seconds_per_mib = 0.01;
+  double write_seconds_per_mib = 0.02;
+
+  // The CPU time of every MiB of target data written by each operation type.
+  // SOURCE_COPY, MOVE, ZERO and DISCARD have no CPU cost.
+  double replace_seconds_per_mib = 0.0;
+  double replace_bz_seconds_per_mib = 0.05;
+  double replace_xz_seconds_per_mib = 0.03;
+  double replace_zstd_seconds_per_mib = 0.005;
+  double bsdiff_seconds_per_mib = 0.1;
+  double imgdiff_seconds_per_mib = 0.15;
+};
+
+// The memory limits of the target devices when applying the payload, used to
+// trade payload size for the memory its decompressors and patchers need.
+struct DecoderMemoryProfile {
+  // Sets the limits of the |memory_class|: "default", or "low-ram" for the
+  // devices with 1 GiB of RAM or less. Returns whether the class is known.
+  bool SetMemoryClass(const std::string& memory_class);
+
+  // The xz preset level of the REPLACE_XZ blobs and the largest dictionary
+  // size the client allocates to decompress them, or zero to use the one of
+  // the level.
+  int xz_level = 6;
+  uint32_t xz_dict_size = 0;
+
+  // The largest destination of a BSDIFF or SOURCE_BSDIFF operation, whose
+  // source and destination the client holds in memory. The default of 200 MiB
+  // doesn't affect any released board, but limits the Chrome binary in ASan
+  // builders.
+  uint64_t max_bsdiff_destination_size = 200 * 1024 * 1024;
+};
+
 struct PayloadVersion {
   PayloadVersion() : PayloadVersion(0, 0) {}
   PayloadVersion(uint64_t major_version, uint32_t minor_version);
@@ -141,6 +274,48 @@ struct PayloadVersion {
   // Wheter the IMGDIFF operation is allowed based on the available compressor
   // in the delta_generator and the one supported by the target.
   bool imgdiff_allowed = false;
+
+  // Whether the REPLACE_ZSTD operation is allowed in a full payload, whose
+  // minor version doesn't tell if the target supports it.
+  bool zstd_allowed = false;
+
+  // Whether the operations of each partition are stored in a segment of the
+  // blobs right before their data instead of in the manifest, so the client
+  // can start applying a partition before the operations of the next ones
+  // are downloaded. Requires minor version 8 and major version 2.
+  bool segmented_manifest = false;
+
+  // The number of blocks decompressed by each of the independent xz chunks the
+  // larger REPLACE_XZ operations are split in, so the client can decompress
+  // them in parallel and save its progress inside them. Zero, the default,
+  // keeps the data of each operation in a single xz stream. Requires minor
+  // version 9.
+  uint32_t xz_chunk_blocks = 0;
+
+  // The data blobs of at least this many bytes start at a multiple of it in
+  // the payload file, so the clients can read them from a local payload with
+  // direct I/O. Zero, the default, packs the blobs next to each other. It must
+  // be a power of two, and requires minor version 10 or, like zstd_allowed,
+  // target clients known to support it for the full payloads. Not compatible
+  // with the |segmented_manifest|.
+  uint32_t blob_alignment = 0;
+
+  // The largest size of the zstd dictionary trained from the small files of
+  // the new partitions, which the small REPLACE_ZSTD operations are compressed
+  // against. It is stored once in the manifest. Zero, the default, doesn't
+  // train any. Requires minor version 11 or, like zstd_allowed, target
+  // clients known to support it for the full payloads, and can't be used with
+  // the partition shards.
+  uint32_t zstd_dictionary_size = 0;
+
+  // The heuristics used to choose the compressors of the full operations.
+  CompressionHeuristics compression;
+
+  // The apply time model used to choose the operations.
+  OperationCostModel cost_model;
+
+  // The memory limits of the clients applying the payload.
+  DecoderMemoryProfile memory_profile;
 };
 
 // The PayloadGenerationConfig struct encapsulates all the configuration to
@@ -190,6 +365,56 @@ struct PayloadGenerationConfig {
 
   // The block size used for all the operations in the manifest.
   size_t block_size = 4096;
+
+  // The size of the chunks of the partitions hashed separately in their
+  // PartitionInfo, or zero to only include the hash of the whole partitions.
+  uint64_t partition_hash_chunk_size = 0;
+
+  // The number of threads used to compress a single large blob with xz, or
+  // zero to use one per processor.
+  size_t xz_threads = 0;
+
+  // The number of partitions generated at the same time, the biggest ones
+  // first. The files of all of them are diffed within the same memory budget.
+  size_t partition_threads = 1;
+
+  // The maximum memory estimated to diff a single window of a file. Files
+  // needing more are split in windows diffed independently. Zero means half of
+  // the physical memory.
+  uint64_t diff_memory_limit = 0;
+
+  // The directory used to cache the operations generated by the diffs across
+  // payloads, or empty to not cache them.
+  std::string diff_cache_dir;
+
+  // The cost model used to order the operations of the A/B payloads.
+  ApplyOrderCostModel apply_order;
+
+  // The partition shard files with the operations of every target partition,
+  // in the same order, written by GeneratePartitionShard(). When not empty,
+  // the operations are read from them instead of generated.
+  std::vector<std::string> partition_shards;
+
+  // The size of the chunks of the full payloads, up to the |hard_chunk_size|.
+  // Zero, the default, picks it for every partition from its compressibility
+  // and the |apply_parallelism|, up to the |soft_chunk_size|.
+  size_t full_chunk_size = 0;
+
+  // Whether the chunks of the full payloads end where the data of their last
+  // blocks says, instead of at multiples of the chunk size. The chunks then
+  // have the chunk size only on average, but inserting or removing blocks in
+  // the partition only changes the chunks around them, so the rest keep the
+  // same blobs as in the payloads of the previous builds.
+  bool content_defined_chunks = false;
+
+  // The number of operations the target devices decompress in parallel. The
+  // full payloads are split in enough chunks to keep them all busy.
+  size_t apply_parallelism = 4;
+
+  // The maximum memory estimated to be used by the threads compressing the
+  // chunks of a full payload, which limits their number. Zero means half of
+  // the physical memory.
+  uint64_t full_memory_limit = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -16,8 +16,15 @@
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <vector>
+
 #include <gtest/gtest.h>
 
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
 namespace chromeos_update_engine {
 
 class PayloadGenerationConfigTest : public ::testing::Test {};
@@ -30,13 +37,15 @@ TEST_F(PayloadGenerationConfigTest, SimpleLoadPostInstallConfigTest) {
       store.LoadFromString("RUN_POSTINSTALL_root=true\n"
                            "POSTINSTALL_PATH_root=postinstall\n"
                            "FILESYSTEM_TYPE_root=ext4\n"
-                           "POSTINSTALL_OPTIONAL_root=true"));
+                           "POSTINSTALL_OPTIONAL_root=true\n"
+                           "POSTINSTALL_PARALLEL_root=true"));
   EXPECT_TRUE(image_config.LoadPostInstallConfig(store));
   EXPECT_FALSE(image_config.partitions[0].postinstall.IsEmpty());
   EXPECT_EQ(true, image_config.partitions[0].postinstall.run);
   EXPECT_EQ("postinstall", image_config.partitions[0].postinstall.path);
   EXPECT_EQ("ext4", image_config.partitions[0].postinstall.filesystem_type);
   EXPECT_TRUE(image_config.partitions[0].postinstall.optional);
+  EXPECT_TRUE(image_config.partitions[0].postinstall.parallel);
 }
 
 TEST_F(PayloadGenerationConfigTest, LoadPostInstallConfigNameMismatchTest) {
@@ -51,4 +60,93 @@ TEST_F(PayloadGenerationConfigTest, LoadPostInstallConfigNameMismatchTest) {
   EXPECT_TRUE(image_config.partitions[0].postinstall.IsEmpty());
 }
 
+TEST_F(PayloadGenerationConfigTest, DecoderMemoryProfileTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion);
+  EXPECT_FALSE(version.memory_profile.SetMemoryClass("tiny"));
+  EXPECT_TRUE(version.memory_profile.SetMemoryClass("low-ram"));
+  EXPECT_EQ(4U * 1024 * 1024, version.memory_profile.xz_dict_size);
+  EXPECT_EQ(64U * 1024 * 1024,
+            version.memory_profile.max_bsdiff_destination_size);
+  EXPECT_TRUE(version.Validate());
+
+  // The dictionary can't exceed what the client decompresses.
+  version.memory_profile.xz_dict_size = XzExtentWriter::kMaxDictSize + 1;
+  EXPECT_FALSE(version.Validate());
+}
+
+TEST_F(PayloadGenerationConfigTest, BlobAlignmentTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion);
+  version.blob_alignment = 4096;
+  EXPECT_TRUE(version.Validate());
+  version.blob_alignment = 4000;
+  EXPECT_FALSE(version.Validate());
+
+  // The deltas need a minor version that allows the padding.
+  version.blob_alignment = 4096;
+  version.minor = kXzChunksMinorPayloadVersion;
+  EXPECT_FALSE(version.Validate());
+  version.minor = kAlignedBlobsMinorPayloadVersion;
+  EXPECT_TRUE(version.Validate());
+  version.segmented_manifest = true;
+  EXPECT_FALSE(version.Validate());
+}
+
+TEST_F(PayloadGenerationConfigTest, ZstdDictionaryTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion);
+  version.zstd_dictionary_size = 112 * 1024;
+  EXPECT_TRUE(version.Validate());
+
+  // The deltas need a minor version that allows the dictionary.
+  version.minor = kAlignedBlobsMinorPayloadVersion;
+  EXPECT_FALSE(version.Validate());
+  version.minor = kZstdDictionaryMinorPayloadVersion;
+  EXPECT_TRUE(version.Validate());
+}
+
+TEST_F(PayloadGenerationConfigTest, ZstdDictionaryShardsTest) {
+  PayloadGenerationConfig config;
+  config.version =
+      PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion);
+  config.version.zstd_dictionary_size = 112 * 1024;
+  EXPECT_TRUE(config.Validate());
+
+  // The shards are generated without the dictionary.
+  config.partition_shards = {"root.shard"};
+  EXPECT_FALSE(config.Validate());
+  config.version.zstd_dictionary_size = 0;
+  EXPECT_TRUE(config.Validate());
+}
+
+TEST_F(PayloadGenerationConfigTest, HashTreeExtentsTest) {
+  PartitionConfig part("system");
+  EXPECT_TRUE(part.HashTreeExtents(4096).empty());
+
+  // The tree of 129 blocks takes 3 blocks, right after them.
+  part.hash_tree_data_size = 129 * 4096;
+  std::vector<Extent> extents = part.HashTreeExtents(4096);
+  ASSERT_EQ(1U, extents.size());
+  EXPECT_EQ(ExtentForRange(129, 3), extents[0]);
+}
+
+TEST_F(PayloadGenerationConfigTest, OperationCostModelTest) {
+  OperationCostModel model;
+  // Without a weight, the cost is the blob size.
+  EXPECT_FALSE(model.enabled());
+  EXPECT_EQ(100, model.Cost(InstallOperation::SOURCE_BSDIFF, 1 << 20,
+                            1 << 20, 100));
+
+  EXPECT_FALSE(model.SetDeviceClass("vax"));
+  EXPECT_TRUE(model.SetDeviceClass("arm-ufs"));
+  model.bytes_per_second = 1000;
+  EXPECT_TRUE(model.enabled());
+  const uint64_t kMiB = 1 << 20;
+  EXPECT_LT(model.ApplySeconds(InstallOperation::REPLACE_ZSTD, 0, kMiB),
+            model.ApplySeconds(InstallOperation::REPLACE_XZ, 0, kMiB));
+  EXPECT_LT(model.ApplySeconds(InstallOperation::SOURCE_COPY, kMiB, kMiB),
+            model.ApplySeconds(InstallOperation::SOURCE_BSDIFF, kMiB, kMiB));
+  EXPECT_DOUBLE_EQ(
+      100 + 1000 * model.ApplySeconds(InstallOperation::REPLACE_XZ, 0, kMiB),
+      model.Cost(InstallOperation::REPLACE_XZ, 0, kMiB, 100));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,378 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_merger.h"
+
+#include <limits>
+#include <vector>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/payload_signer.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The blocks of the target partition of the first payload whose data isn't
+// copied from a block of its source partition.
+const uint64_t kUnresolvedBlock = std::numeric_limits<uint64_t>::max() - 1;
+
+struct LoadedPayload {
+  string path;
+  DeltaArchiveManifest manifest;
+  uint64_t major_version;
+  uint64_t data_offset;
+};
+
+bool LoadPayload(const string& path, LoadedPayload* payload) {
+  payload->path = path;
+  TEST_AND_RETURN_FALSE(LoadPayloadManifest(path,
+                                            &payload->manifest,
+                                            &payload->major_version,
+                                            &payload->data_offset));
+  if (payload->major_version != kBrilloMajorPayloadVersion ||
+      payload->manifest.minor_version() < kSourceMinorPayloadVersion) {
+    LOG(ERROR) << path << " isn't an A/B delta payload of major version "
+               << kBrilloMajorPayloadVersion << ".";
+    return false;
+  }
+  if (payload->manifest.has_zstd_dictionary()) {
+    // The operations of the two payloads would need different dictionaries.
+    LOG(ERROR) << path << " uses a zstd dictionary, which can't be merged.";
+    return false;
+  }
+  for (const PartitionUpdate& partition : payload->manifest.partitions()) {
+    // No operation of the payload writes the hash tree the clients build.
+    if (partition.has_hash_tree_extent()) {
+      LOG(ERROR) << path << " has the hash tree of the partition "
+                 << partition.partition_name() << ", which can't be merged.";
+      return false;
+    }
+  }
+  for (PartitionUpdate& partition : *payload->manifest.mutable_partitions()) {
+    for (InstallOperation& op : *partition.mutable_operations())
+      TEST_AND_RETURN_FALSE(UnpackOperationExtents(&op));
+  }
+  return true;
+}
+
+const PartitionUpdate* FindPartition(const LoadedPayload& payload,
+                                     const string& name) {
+  for (const PartitionUpdate& partition : payload.manifest.partitions()) {
+    if (partition.partition_name() == name)
+      return &partition;
+  }
+  return nullptr;
+}
+
+bool ReadsSourcePartition(const InstallOperation& op) {
+  return op.type() == InstallOperation::SOURCE_COPY ||
+         op.type() == InstallOperation::SOURCE_BSDIFF ||
+         op.type() == InstallOperation::IMGDIFF;
+}
+
+// Returns in |source_blocks| the block of the source partition of the
+// |partition| of the first payload copied to each block of its target
+// partition, or kUnresolvedBlock. The MOVE operations copy blocks already
+// written in the target partition.
+void MapSourceBlocks(const PartitionUpdate& partition,
+                     uint64_t block_size,
+                     vector<uint64_t>* source_blocks) {
+  source_blocks->assign(partition.new_partition_info().size() / block_size,
+                        kUnresolvedBlock);
+  for (const InstallOperation& op : partition.operations()) {
+    const vector<uint64_t> dst_blocks = ExpandExtents(op.dst_extents());
+    vector<uint64_t> resolved(dst_blocks.size(), kUnresolvedBlock);
+    if (op.type() == InstallOperation::SOURCE_COPY ||
+        op.type() == InstallOperation::MOVE) {
+      const vector<uint64_t> src_blocks = ExpandExtents(op.src_extents());
+      for (size_t i = 0; i < src_blocks.size() && i < resolved.size(); i++) {
+        if (op.type() == InstallOperation::SOURCE_COPY)
+          resolved[i] = src_blocks[i];
+        else if (src_blocks[i] < source_blocks->size())
+          resolved[i] = (*source_blocks)[src_blocks[i]];
+      }
+    }
+    for (size_t i = 0; i < dst_blocks.size(); i++) {
+      if (dst_blocks[i] >= source_blocks->size())
+        source_blocks->resize(dst_blocks[i] + 1, kUnresolvedBlock);
+      (*source_blocks)[dst_blocks[i]] = resolved[i];
+    }
+  }
+}
+
+// Replaces the source extents of |op|, in the target partition of the first
+// payload, by the blocks of its source partition they were copied from.
+// Returns false, leaving |op| untouched, if any of them wasn't copied.
+bool ResolveSourceExtents(const vector<uint64_t>& source_blocks,
+                          InstallOperation* op) {
+  vector<Extent> extents;
+  for (const Extent& extent : op->src_extents()) {
+    // The holes of the patch sources read as zeros in any partition.
+    if (extent.start_block() == kSparseHole) {
+      extents.push_back(extent);
+      continue;
+    }
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++) {
+      if (block >= source_blocks.size() ||
+          source_blocks[block] == kUnresolvedBlock) {
+        return false;
+      }
+      if (!extents.empty() && extents.back().start_block() == kSparseHole)
+        extents.push_back(ExtentForRange(source_blocks[block], 1));
+      else
+        AppendBlockToExtents(&extents, source_blocks[block]);
+    }
+  }
+  StoreExtents(extents, op->mutable_src_extents());
+  return true;
+}
+
+// Appends the |op| of |payload| to |aops|, storing its data blob, if any, in
+// |blob_file|.
+bool CopyOperation(const LoadedPayload& payload,
+                   const InstallOperation& op,
+                   BlobFileWriter* blob_file,
+                   vector<AnnotatedOperation>* aops) {
+  AnnotatedOperation aop;
+  aop.name = payload.path;
+  aop.op = op;
+  aop.op.clear_apply_wave();
+  if (op.has_data_length() && op.data_length() > 0) {
+    brillo::Blob blob;
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload.path,
+                                               payload.data_offset +
+                                                   op.data_offset(),
+                                               op.data_length(),
+                                               &blob));
+    TEST_AND_RETURN_FALSE(blob.size() == op.data_length());
+    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+  }
+  aops->push_back(aop);
+  return true;
+}
+
+// Appends to |aops| the full operation writing the destination blocks of |op|
+// with their data in the |new_part| image.
+bool ReplaceOperation(const string& new_part,
+                      const InstallOperation& op,
+                      const PayloadVersion& version,
+                      uint64_t block_size,
+                      BlobFileWriter* blob_file,
+                      vector<AnnotatedOperation>* aops) {
+  vector<Extent> dst_extents;
+  ExtentsToVector(op.dst_extents(), &dst_extents);
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
+                                           dst_extents,
+                                           &data,
+                                           BlocksInExtents(dst_extents) *
+                                               block_size,
+                                           block_size));
+  AnnotatedOperation aop;
+  aop.name = new_part;
+  brillo::Blob blob;
+  InstallOperation_Type type;
+  TEST_AND_RETURN_FALSE(
+      diff_utils::GenerateBestFullOperation(data, version, &blob, &type));
+  aop.op.set_type(type);
+  *aop.op.mutable_dst_extents() = op.dst_extents();
+  TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+  aops->push_back(aop);
+  return true;
+}
+
+PostInstallConfig PostInstallFromPartition(const PartitionUpdate& partition) {
+  PostInstallConfig postinstall;
+  postinstall.run = partition.run_postinstall();
+  postinstall.path = partition.postinstall_path();
+  postinstall.filesystem_type = partition.filesystem_type();
+  postinstall.optional = partition.postinstall_optional();
+  postinstall.parallel = partition.postinstall_parallel();
+  return postinstall;
+}
+
+}  // namespace
+
+bool LoadPayloadManifest(const string& payload_path,
+                         DeltaArchiveManifest* manifest,
+                         uint64_t* major_version,
+                         uint64_t* data_offset) {
+  uint64_t metadata_size;
+  uint32_t metadata_signature_size;
+  TEST_AND_RETURN_FALSE(
+      PayloadSigner::LoadPayloadMetadata(payload_path,
+                                         nullptr,
+                                         manifest,
+                                         major_version,
+                                         &metadata_size,
+                                         &metadata_signature_size));
+  *data_offset = metadata_size + metadata_signature_size;
+  // The operations of the segmented partitions are read from the blobs.
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    if (!partition.has_operations_segment())
+      continue;
+    const OperationsSegment& segment = partition.operations_segment();
+    brillo::Blob data;
+    PartitionOperations operations;
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+        payload_path, *data_offset + segment.offset(), segment.size(), &data));
+    TEST_AND_RETURN_FALSE(operations.ParseFromArray(data.data(), data.size()));
+    partition.mutable_operations()->Swap(operations.mutable_operations());
+  }
+  return true;
+}
+
+bool MergePayloads(const string& first_payload_path,
+                   const string& second_payload_path,
+                   const map<string, string>& new_partitions,
+                   const string& output_path,
+                   const string& private_key_path,
+                   uint64_t* metadata_size,
+                   PayloadMergeStats* stats) {
+  LoadedPayload first, second;
+  TEST_AND_RETURN_FALSE(LoadPayload(first_payload_path, &first));
+  TEST_AND_RETURN_FALSE(LoadPayload(second_payload_path, &second));
+  const uint64_t block_size = second.manifest.block_size();
+  if (first.manifest.block_size() != block_size) {
+    LOG(ERROR) << "The payloads have different block sizes.";
+    return false;
+  }
+  *stats = PayloadMergeStats();
+
+  // The merged payload has the version and layout of the second payload, as
+  // most of its operations come from it.
+  PayloadGenerationConfig config;
+  config.is_delta = true;
+  config.block_size = block_size;
+  config.version =
+      PayloadVersion(kBrilloMajorPayloadVersion,
+                     second.manifest.minor_version());
+  config.version.blob_alignment = second.manifest.blob_alignment();
+  for (const PartitionUpdate& partition : second.manifest.partitions()) {
+    if (partition.has_operations_segment())
+      config.version.segmented_manifest = true;
+  }
+  if (first.manifest.has_old_image_info() &&
+      second.manifest.has_new_image_info()) {
+    config.source.image_info = first.manifest.old_image_info();
+    config.target.image_info = second.manifest.new_image_info();
+  }
+  PayloadFile payload;
+  TEST_AND_RETURN_FALSE(payload.Init(config));
+
+  string blobs_path;
+  int blobs_fd;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("MergedBlobs-XXXXXX", &blobs_path, &blobs_fd));
+  ScopedPathUnlinker blobs_unlinker(blobs_path);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  off_t blobs_size = 0;
+  BlobFileWriter blob_file(blobs_fd, &blobs_size);
+
+  for (const PartitionUpdate& partition : second.manifest.partitions()) {
+    const string& name = partition.partition_name();
+    const PartitionUpdate* first_partition = FindPartition(first, name);
+    // A partition not updated by the first payload is the same in N+1.
+    vector<uint64_t> source_blocks;
+    if (first_partition)
+      MapSourceBlocks(*first_partition, block_size, &source_blocks);
+    const auto new_part = new_partitions.find(name);
+
+    vector<AnnotatedOperation> aops;
+    for (const InstallOperation& op : partition.operations()) {
+      if (!ReadsSourcePartition(op) || !first_partition) {
+        TEST_AND_RETURN_FALSE(CopyOperation(second, op, &blob_file, &aops));
+        stats->copied_operations++;
+        continue;
+      }
+      // The data copied from N+1 is the same data in N, so neither the patch
+      // nor the source hash change.
+      InstallOperation composed_op = op;
+      if (ResolveSourceExtents(source_blocks, &composed_op)) {
+        TEST_AND_RETURN_FALSE(
+            CopyOperation(second, composed_op, &blob_file, &aops));
+        stats->composed_operations++;
+        continue;
+      }
+      if (new_part == new_partitions.end()) {
+        LOG(ERROR) << "The operation " << InstallOperationTypeName(op.type())
+                   << " of partition " << name << " reads blocks the first "
+                   << "payload doesn't copy, the new image of the partition "
+                   << "is needed to merge the payloads.";
+        return false;
+      }
+      TEST_AND_RETURN_FALSE(ReplaceOperation(new_part->second,
+                                             op,
+                                             config.version,
+                                             block_size,
+                                             &blob_file,
+                                             &aops));
+      stats->replaced_operations++;
+    }
+    const PartitionInfo& old_info = first_partition
+                                        ? first_partition->old_partition_info()
+                                        : partition.old_partition_info();
+    TEST_AND_RETURN_FALSE(payload.AddPartition(name,
+                                               old_info,
+                                               partition.new_partition_info(),
+                                               PostInstallFromPartition(
+                                                   partition),
+                                               aops));
+  }
+
+  // The partitions only updated by the first payload are already in N+2.
+  for (const PartitionUpdate& partition : first.manifest.partitions()) {
+    if (FindPartition(second, partition.partition_name()))
+      continue;
+    vector<AnnotatedOperation> aops;
+    for (const InstallOperation& op : partition.operations()) {
+      TEST_AND_RETURN_FALSE(CopyOperation(first, op, &blob_file, &aops));
+      stats->copied_operations++;
+    }
+    TEST_AND_RETURN_FALSE(
+        payload.AddPartition(partition.partition_name(),
+                             partition.old_partition_info(),
+                             partition.new_partition_info(),
+                             PostInstallFromPartition(partition),
+                             aops));
+  }
+
+  LOG(INFO) << "Merged the payloads: " << stats->composed_operations
+            << " operations composed, " << stats->replaced_operations
+            << " replaced and " << stats->copied_operations << " copied.";
+  return payload.WritePayload(
+      output_path, blobs_path, private_key_path, metadata_size);
+}
+
+}  // namespace chromeos_update_engine
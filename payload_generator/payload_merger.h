@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Loads the manifest of the payload at |payload_path|, with the operations of
+// the partitions stored in segments moved back to the manifest. Stores the
+// major version of the payload in |major_version| and the offset in the file
+// the data_offset of the operations are relative to in |data_offset|.
+bool LoadPayloadManifest(const std::string& payload_path,
+                         DeltaArchiveManifest* manifest,
+                         uint64_t* major_version,
+                         uint64_t* data_offset);
+
+struct PayloadMergeStats {
+  // The operations of the second payload reading the source partition, whose
+  // source blocks were resolved through the first payload.
+  uint64_t composed_operations = 0;
+  // The operations replaced by a full operation generated from the target
+  // image, as their source blocks weren't copied by the first payload.
+  uint64_t replaced_operations = 0;
+  // The operations copied as is from one of the payloads.
+  uint64_t copied_operations = 0;
+};
+
+// Merges the A/B delta payload at |first_payload_path|, from the version N to
+// N+1, with the one at |second_payload_path|, from N+1 to N+2, into the
+// payload updating from N to N+2 written to |output_path|, signed with
+// |private_key_path| if not empty.
+//
+// The operations of the second payload reading blocks of N+1 that the first
+// payload copied from N read them from N instead, with the same data blob.
+// The other blocks of N+1 can only be known by applying the first payload, so
+// the operations reading them are replaced by full operations of the data
+// they write, read from the N+2 image of the partition in |new_partitions|,
+// by partition name. Returns false if such an image is needed but not passed.
+bool MergePayloads(const std::string& first_payload_path,
+                   const std::string& second_payload_path,
+                   const std::map<std::string, std::string>& new_partitions,
+                   const std::string& output_path,
+                   const std::string& private_key_path,
+                   uint64_t* metadata_size,
+                   PayloadMergeStats* stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
@@ -0,0 +1,200 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_merger.h"
+
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint64_t kBlockSize = 4096;
+const uint64_t kPartitionBlocks = 8;
+
+AnnotatedOperation SourceCopy(uint64_t src_block,
+                              uint64_t dst_block,
+                              uint64_t num_blocks) {
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  *aop.op.add_src_extents() = ExtentForRange(src_block, num_blocks);
+  *aop.op.add_dst_extents() = ExtentForRange(dst_block, num_blocks);
+  return aop;
+}
+
+}  // namespace
+
+class PayloadMergerTest : public ::testing::Test {
+ protected:
+  // Writes a payload of the "system" partition with the |aops| to
+  // |payload_path|, storing the |blobs| of the REPLACE operations in order.
+  void WritePayload(const string& payload_path,
+                    vector<AnnotatedOperation> aops,
+                    const vector<brillo::Blob>& blobs) {
+    PayloadGenerationConfig config;
+    config.is_delta = true;
+    config.block_size = kBlockSize;
+    config.version =
+        PayloadVersion(kBrilloMajorPayloadVersion, kSourceMinorPayloadVersion);
+    PayloadFile payload;
+    ASSERT_TRUE(payload.Init(config));
+
+    test_utils::ScopedTempFile blobs_file("PayloadMergerBlobs-XXXXXX");
+    int blobs_fd = open(blobs_file.path().c_str(), O_WRONLY);
+    ASSERT_GE(blobs_fd, 0);
+    ScopedFdCloser blobs_fd_closer(&blobs_fd);
+    off_t blobs_size = 0;
+    BlobFileWriter blob_file(blobs_fd, &blobs_size);
+    size_t next_blob = 0;
+    for (AnnotatedOperation& aop : aops) {
+      if (aop.op.type() == InstallOperation::REPLACE)
+        ASSERT_TRUE(aop.SetOperationBlob(blobs[next_blob++], &blob_file));
+    }
+    PartitionInfo info;
+    info.set_size(kPartitionBlocks * kBlockSize);
+    ASSERT_TRUE(
+        payload.AddPartition("system", info, info, PostInstallConfig(), aops));
+    uint64_t metadata_size;
+    ASSERT_TRUE(payload.WritePayload(
+        payload_path, blobs_file.path(), "", &metadata_size));
+  }
+
+  AnnotatedOperation Replace(uint64_t dst_block, uint64_t num_blocks) {
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::REPLACE);
+    *aop.op.add_dst_extents() = ExtentForRange(dst_block, num_blocks);
+    return aop;
+  }
+
+  test_utils::ScopedTempFile first_payload_{"PayloadMergerFirst-XXXXXX"};
+  test_utils::ScopedTempFile second_payload_{"PayloadMergerSecond-XXXXXX"};
+  test_utils::ScopedTempFile merged_payload_{"PayloadMergerMerged-XXXXXX"};
+};
+
+TEST_F(PayloadMergerTest, ComposeSourceCopyTest) {
+  // N+1: blocks 0-3 are new, blocks 4-7 are the blocks 0-3 of N.
+  brillo::Blob new_data(4 * kBlockSize, 'a');
+  WritePayload(
+      first_payload_.path(), {Replace(0, 4), SourceCopy(0, 4, 4)}, {new_data});
+  // N+2: blocks 0-1 are the blocks 6-7 of N+1, the rest are new.
+  brillo::Blob newer_data(6 * kBlockSize, 'b');
+  WritePayload(second_payload_.path(),
+               {SourceCopy(6, 0, 2), Replace(2, 6)},
+               {newer_data});
+
+  uint64_t metadata_size;
+  PayloadMergeStats stats;
+  ASSERT_TRUE(MergePayloads(first_payload_.path(),
+                            second_payload_.path(),
+                            {},
+                            merged_payload_.path(),
+                            "",
+                            &metadata_size,
+                            &stats));
+  EXPECT_EQ(1U, stats.composed_operations);
+  EXPECT_EQ(0U, stats.replaced_operations);
+  EXPECT_EQ(1U, stats.copied_operations);
+
+  DeltaArchiveManifest manifest;
+  uint64_t major_version, data_offset;
+  ASSERT_TRUE(LoadPayloadManifest(
+      merged_payload_.path(), &manifest, &major_version, &data_offset));
+  ASSERT_EQ(1, manifest.partitions_size());
+  const PartitionUpdate& partition = manifest.partitions(0);
+  ASSERT_EQ(2, partition.operations_size());
+  // The blocks copied twice are copied from N directly.
+  const InstallOperation& copy_op = partition.operations(0);
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, copy_op.type());
+  ASSERT_EQ(1, copy_op.src_extents_size());
+  EXPECT_EQ(ExtentForRange(2, 2), copy_op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(0, 2), copy_op.dst_extents(0));
+
+  const InstallOperation& replace_op = partition.operations(1);
+  EXPECT_EQ(InstallOperation::REPLACE, replace_op.type());
+  brillo::Blob blob;
+  ASSERT_TRUE(utils::ReadFileChunk(merged_payload_.path(),
+                                   data_offset + replace_op.data_offset(),
+                                   replace_op.data_length(),
+                                   &blob));
+  EXPECT_EQ(newer_data, blob);
+}
+
+TEST_F(PayloadMergerTest, ReplaceUnresolvedBlocksTest) {
+  brillo::Blob new_data(4 * kBlockSize, 'a');
+  WritePayload(
+      first_payload_.path(), {Replace(0, 4), SourceCopy(0, 4, 4)}, {new_data});
+  // The blocks 1-2 of N+1 were written by the REPLACE of the first payload.
+  brillo::Blob newer_data(6 * kBlockSize, 'b');
+  WritePayload(second_payload_.path(),
+               {SourceCopy(1, 0, 2), Replace(2, 6)},
+               {newer_data});
+
+  uint64_t metadata_size;
+  PayloadMergeStats stats;
+  EXPECT_FALSE(MergePayloads(first_payload_.path(),
+                             second_payload_.path(),
+                             {},
+                             merged_payload_.path(),
+                             "",
+                             &metadata_size,
+                             &stats));
+
+  // The new image provides the data of the blocks.
+  test_utils::ScopedTempFile new_image("PayloadMergerImage-XXXXXX");
+  brillo::Blob image_data = new_data;
+  image_data.resize(2 * kBlockSize);
+  image_data.insert(image_data.end(), newer_data.begin(), newer_data.end());
+  ASSERT_TRUE(test_utils::WriteFileVector(new_image.path(), image_data));
+  ASSERT_TRUE(MergePayloads(first_payload_.path(),
+                            second_payload_.path(),
+                            {{"system", new_image.path()}},
+                            merged_payload_.path(),
+                            "",
+                            &metadata_size,
+                            &stats));
+  EXPECT_EQ(0U, stats.composed_operations);
+  EXPECT_EQ(1U, stats.replaced_operations);
+
+  DeltaArchiveManifest manifest;
+  uint64_t major_version, data_offset;
+  ASSERT_TRUE(LoadPayloadManifest(
+      merged_payload_.path(), &manifest, &major_version, &data_offset));
+  const InstallOperation& op = manifest.partitions(0).operations(0);
+  EXPECT_TRUE(diff_utils::IsAReplaceOperation(op.type()));
+  EXPECT_EQ(0, op.src_extents_size());
+  EXPECT_EQ(ExtentForRange(0, 2), op.dst_extents(0));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,8 +17,15 @@
 #include "update_engine/payload_generator/payload_signer.h"
 
 #include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
@@ -73,51 +80,67 @@ bool ConvertSignatureToProtobufBlob(const vector<brillo::Blob>& signatures,
   return true;
 }
 
+// The size of the chunks of the payload data read at a time when hashing or
+// copying it, so the memory used doesn't depend on the size of the payload.
+const uint64_t kPayloadChunkSize = 1024 * 1024;  // bytes
+
+// The contents of a signed payload. The payload data is described by its range
+// in the unsigned payload file instead of loaded in memory.
+struct SignedPayload {
+  // The payload header and the manifest, including the signature operation.
+  brillo::Blob metadata;
+
+  // The metadata signature, empty if the payload version doesn't support it.
+  brillo::Blob metadata_signature_blob;
+
+  // The range of the unsigned payload file with the payload data, up to the
+  // payload signature.
+  uint64_t data_offset;
+  uint64_t data_size;
+
+  // The payload signature, written after the data.
+  brillo::Blob signature_blob;
+};
+
 // Given an unsigned payload under |payload_path| and the |signature_blob| and
-// |metadata_signature_blob| generates an updated payload that includes the
-// signatures. It populates |out_metadata_size| with the size of the final
-// manifest after adding the dummy signature operation, and
-// |out_signatures_offset| with the expected offset for the new blob, and
-// |out_metadata_signature_size| which will be size of |metadata_signature_blob|
-// if the payload major version supports metadata signature, 0 otherwise.
+// |metadata_signature_blob| describes in |out_payload| the updated payload that
+// includes the signatures, with the signature operation added to the manifest
+// and the |metadata_signature_blob| included if the payload major version
+// supports metadata signature. Only the metadata of the payload is loaded.
 // Returns true on success, false otherwise.
 bool AddSignatureBlobToPayload(const string& payload_path,
                                const brillo::Blob& signature_blob,
                                const brillo::Blob& metadata_signature_blob,
-                               brillo::Blob* out_payload,
-                               uint64_t* out_metadata_size,
-                               uint32_t* out_metadata_signature_size,
-                               uint64_t* out_signatures_offset) {
+                               SignedPayload* out_payload) {
   uint64_t manifest_offset = 20;
   const int kProtobufSizeOffset = 12;
 
   DeltaArchiveManifest manifest;
+  brillo::Blob metadata;
   uint64_t metadata_size, major_version;
   uint32_t metadata_signature_size;
   TEST_AND_RETURN_FALSE(
       PayloadSigner::LoadPayloadMetadata(payload_path,
-                                         nullptr,
+                                         &metadata,
                                          &manifest,
                                          &major_version,
                                          &metadata_size,
                                          &metadata_signature_size));
+  const off_t payload_size = utils::FileSize(payload_path);
+  const uint64_t data_offset = metadata_size + metadata_signature_size;
+  TEST_AND_RETURN_FALSE(payload_size >= 0 &&
+                        static_cast<uint64_t>(payload_size) >= data_offset);
 
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
-
+  out_payload->metadata_signature_blob.clear();
   if (major_version == kBrilloMajorPayloadVersion) {
     // Write metadata signature size in header.
     uint32_t metadata_signature_size_be =
         htobe32(metadata_signature_blob.size());
-    memcpy(payload.data() + manifest_offset, &metadata_signature_size_be,
+    memcpy(metadata.data() + manifest_offset, &metadata_signature_size_be,
            sizeof(metadata_signature_size_be));
     manifest_offset += sizeof(metadata_signature_size_be);
     // Replace metadata signature.
-    payload.erase(payload.begin() + metadata_size,
-                  payload.begin() + metadata_size + metadata_signature_size);
-    payload.insert(payload.begin() + metadata_size,
-                   metadata_signature_blob.begin(),
-                   metadata_signature_blob.end());
+    out_payload->metadata_signature_blob = metadata_signature_blob;
     metadata_signature_size = metadata_signature_blob.size();
     LOG(INFO) << "Metadata signature size: " << metadata_signature_size;
   }
@@ -139,76 +162,147 @@ bool AddSignatureBlobToPayload(const string& payload_path,
   } else {
     // Updates the manifest to include the signature operation.
     PayloadSigner::AddSignatureToManifest(
-        payload.size() - metadata_size - metadata_signature_size,
+        payload_size - data_offset,
         signature_blob.size(),
         major_version == kChromeOSMajorPayloadVersion,
         &manifest);
+    // The new manifest and metadata signature move the aligned blobs.
+    TEST_AND_RETURN_FALSE(PayloadSigner::PadMetadata(
+        manifest_offset, metadata_signature_size, &manifest));
 
-    // Updates the payload to include the new manifest.
+    // Updates the metadata to include the new manifest.
     string serialized_manifest;
     TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
     LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
-    payload.erase(payload.begin() + manifest_offset,
-                  payload.begin() + metadata_size);
-    payload.insert(payload.begin() + manifest_offset,
-                   serialized_manifest.begin(),
-                   serialized_manifest.end());
+    metadata.resize(manifest_offset);
+    metadata.insert(metadata.end(),
+                    serialized_manifest.begin(),
+                    serialized_manifest.end());
 
     // Updates the protobuf size.
     uint64_t size_be = htobe64(serialized_manifest.size());
-    memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
-    metadata_size = serialized_manifest.size() + manifest_offset;
+    memcpy(&metadata[kProtobufSizeOffset], &size_be, sizeof(size_be));
+    metadata_size = metadata.size();
 
-    LOG(INFO) << "Updated payload size: " << payload.size();
     LOG(INFO) << "Updated metadata size: " << metadata_size;
   }
-  uint64_t signatures_offset = metadata_size + metadata_signature_size +
-                               manifest.signatures_offset();
-  LOG(INFO) << "Signature Blob Offset: " << signatures_offset;
-  payload.resize(signatures_offset);
-  payload.insert(payload.begin() + signatures_offset,
-                 signature_blob.begin(),
-                 signature_blob.end());
-
-  *out_payload = std::move(payload);
-  *out_metadata_size = metadata_size;
-  *out_metadata_signature_size = metadata_signature_size;
-  *out_signatures_offset = signatures_offset;
+  // The data up to the old signatures, if any, is kept.
+  TEST_AND_RETURN_FALSE(data_offset + manifest.signatures_offset() <=
+                        static_cast<uint64_t>(payload_size));
+  LOG(INFO) << "Signature Blob Offset: "
+            << metadata_size + metadata_signature_size +
+                   manifest.signatures_offset();
+
+  out_payload->metadata = std::move(metadata);
+  out_payload->data_offset = data_offset;
+  out_payload->data_size = manifest.signatures_offset();
+  out_payload->signature_blob = signature_blob;
+  return true;
+}
+
+// Updates |calc| with the |length| bytes at |offset| in the file |fd|, reading
+// them in chunks. Returns true on success.
+bool HashFileRange(int fd,
+                   uint64_t offset,
+                   uint64_t length,
+                   HashCalculator* calc) {
+  brillo::Blob buf(std::min(length, kPayloadChunkSize));
+  while (length > 0) {
+    const size_t chunk_size = std::min(length, kPayloadChunkSize);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd, buf.data(), chunk_size, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == chunk_size);
+    TEST_AND_RETURN_FALSE(calc->Update(buf.data(), chunk_size));
+    offset += chunk_size;
+    length -= chunk_size;
+  }
   return true;
 }
 
-// Given a |payload| with correct signature op and metadata signature size in
-// header and |metadata_size|, |metadata_signature_size|, |signatures_offset|,
-// calculate hash for payload and metadata, save it to |out_hash_data| and
-// |out_metadata_hash|.
-bool CalculateHashFromPayload(const brillo::Blob& payload,
-                              const uint64_t metadata_size,
-                              const uint32_t metadata_signature_size,
-                              const uint64_t signatures_offset,
+// Given the |metadata| of a payload with correct signature op and metadata
+// signature size in header, and range of the payload data at |data_offset|
+// with |data_size| bytes in the file |payload_path|, calculate hash for
+// payload and metadata, save it to |out_hash_data| and |out_metadata_hash|.
+// The payload data is read in chunks.
+bool CalculateHashFromPayload(const string& payload_path,
+                              const brillo::Blob& metadata,
+                              const uint64_t data_offset,
+                              const uint64_t data_size,
                               brillo::Blob* out_hash_data,
                               brillo::Blob* out_metadata_hash) {
   if (out_metadata_hash) {
     // Calculates the hash on the manifest.
     TEST_AND_RETURN_FALSE(
-        HashCalculator::RawHashOfBytes(payload.data(), metadata_size,
-                                       out_metadata_hash));
+        HashCalculator::RawHashOfData(metadata, out_metadata_hash));
   }
   if (out_hash_data) {
     // Calculates the hash on the updated payload. Note that we skip metadata
     // signature and payload signature.
+    int fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    ScopedFdCloser fd_closer(&fd);
     HashCalculator calc;
-    TEST_AND_RETURN_FALSE(calc.Update(payload.data(), metadata_size));
-    TEST_AND_RETURN_FALSE(signatures_offset >=
-                          metadata_size + metadata_signature_size);
-    TEST_AND_RETURN_FALSE(calc.Update(
-        payload.data() + metadata_size + metadata_signature_size,
-        signatures_offset - metadata_size - metadata_signature_size));
+    TEST_AND_RETURN_FALSE(calc.Update(metadata.data(), metadata.size()));
+    TEST_AND_RETURN_FALSE(HashFileRange(fd, data_offset, data_size, &calc));
     TEST_AND_RETURN_FALSE(calc.Finalize());
     *out_hash_data = calc.raw_hash();
   }
   return true;
 }
 
+// Writes the signed |payload| to |signed_payload_path|, copying the payload
+// data in chunks from the unsigned payload in |payload_path|. The signed
+// payload is written to a temporary file renamed once complete, so both paths
+// can point to the same file. Returns true on success.
+bool WriteSignedPayload(const string& payload_path,
+                        const SignedPayload& payload,
+                        const string& signed_payload_path) {
+  int fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  string temp_path = signed_payload_path + ".XXXXXX";
+  vector<char> temp_path_buf(temp_path.begin(), temp_path.end());
+  temp_path_buf.push_back('\0');
+  int signed_fd = mkstemp(temp_path_buf.data());
+  TEST_AND_RETURN_FALSE_ERRNO(signed_fd >= 0);
+  temp_path = temp_path_buf.data();
+  ScopedPathUnlinker temp_path_unlinker(temp_path);
+  ScopedFdCloser signed_fd_closer(&signed_fd);
+
+  TEST_AND_RETURN_FALSE(utils::WriteAll(
+      signed_fd, payload.metadata.data(), payload.metadata.size()));
+  TEST_AND_RETURN_FALSE(
+      utils::WriteAll(signed_fd,
+                      payload.metadata_signature_blob.data(),
+                      payload.metadata_signature_blob.size()));
+  brillo::Blob buf(std::min(payload.data_size, kPayloadChunkSize));
+  for (uint64_t copied = 0; copied < payload.data_size;) {
+    const size_t chunk_size =
+        std::min(payload.data_size - copied, kPayloadChunkSize);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                          buf.data(),
+                                          chunk_size,
+                                          payload.data_offset + copied,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == chunk_size);
+    TEST_AND_RETURN_FALSE(utils::WriteAll(signed_fd, buf.data(), chunk_size));
+    copied += chunk_size;
+  }
+  TEST_AND_RETURN_FALSE(utils::WriteAll(signed_fd,
+                                        payload.signature_blob.data(),
+                                        payload.signature_blob.size()));
+  TEST_AND_RETURN_FALSE_ERRNO(IGNORE_EINTR(close(signed_fd)) == 0);
+  signed_fd = -1;
+
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(temp_path.c_str(), signed_payload_path.c_str()) == 0);
+  temp_path_unlinker.set_should_remove(false);
+  return true;
+}
+
 }  // namespace
 
 void PayloadSigner::AddSignatureToManifest(uint64_t signature_blob_offset,
@@ -234,6 +328,36 @@ void PayloadSigner::AddSignatureToManifest(uint64_t signature_blob_offset,
   }
 }
 
+bool PayloadSigner::PadMetadata(uint64_t header_size,
+                                uint64_t metadata_signature_size,
+                                DeltaArchiveManifest* manifest) {
+  manifest->clear_metadata_padding();
+  const uint64_t alignment = manifest->blob_alignment();
+  if (alignment == 0)
+    return true;
+  const uint64_t unpadded_size =
+      header_size + manifest->ByteSize() + metadata_signature_size;
+
+  // The padding field adds its two bytes tag and the varint of its length to
+  // the manifest. The length skips a size when its varint grows, so it may
+  // take more than |alignment| tries.
+  uint64_t padding_size = 0;
+  for (;; padding_size++) {
+    uint64_t field_size = 2 + 1 + padding_size;
+    for (uint64_t value = padding_size; value >= 0x80; value >>= 7)
+      field_size++;
+    if ((unpadded_size + field_size) % alignment == 0)
+      break;
+    TEST_AND_RETURN_FALSE(padding_size < 2 * alignment);
+  }
+  manifest->set_metadata_padding(string(padding_size, '\0'));
+  TEST_AND_RETURN_FALSE(
+      (header_size + manifest->ByteSize() + metadata_signature_size) %
+          alignment ==
+      0);
+  return true;
+}
+
 bool PayloadSigner::LoadPayloadMetadata(const string& payload_path,
                                         brillo::Blob* out_payload_metadata,
                                         DeltaArchiveManifest* out_manifest,
@@ -304,37 +428,43 @@ bool PayloadSigner::LoadPayloadMetadata(const string& payload_path,
 bool PayloadSigner::VerifySignedPayload(const string& payload_path,
                                         const string& public_key_path) {
   DeltaArchiveManifest manifest;
+  brillo::Blob metadata;
   uint64_t metadata_size;
   uint32_t metadata_signature_size;
   TEST_AND_RETURN_FALSE(LoadPayloadMetadata(payload_path,
-                                            nullptr,
+                                            &metadata,
                                             &manifest,
                                             nullptr,
                                             &metadata_size,
                                             &metadata_signature_size));
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
   TEST_AND_RETURN_FALSE(manifest.has_signatures_offset() &&
                         manifest.has_signatures_size());
   uint64_t signatures_offset = metadata_size + metadata_signature_size +
                                manifest.signatures_offset();
-  CHECK_EQ(payload.size(), signatures_offset + manifest.signatures_size());
+  CHECK_EQ(static_cast<uint64_t>(utils::FileSize(payload_path)),
+           signatures_offset + manifest.signatures_size());
   brillo::Blob payload_hash, metadata_hash;
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 &payload_hash,
-                                                 &metadata_hash));
-  brillo::Blob signature_blob(payload.begin() + signatures_offset,
-                              payload.end());
+  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(
+      payload_path,
+      metadata,
+      metadata_size + metadata_signature_size,
+      manifest.signatures_offset(),
+      &payload_hash,
+      &metadata_hash));
+  brillo::Blob signature_blob;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                             signatures_offset,
+                                             manifest.signatures_size(),
+                                             &signature_blob));
   TEST_AND_RETURN_FALSE(PayloadVerifier::PadRSA2048SHA256Hash(&payload_hash));
   TEST_AND_RETURN_FALSE(PayloadVerifier::VerifySignature(
       signature_blob, public_key_path, payload_hash));
   if (metadata_signature_size) {
-    signature_blob.assign(payload.begin() + metadata_size,
-                          payload.begin() + metadata_size +
-                          metadata_signature_size);
+    signature_blob.clear();
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                               metadata_size,
+                                               metadata_signature_size,
+                                               &signature_blob));
     TEST_AND_RETURN_FALSE(
         PayloadVerifier::PadRSA2048SHA256Hash(&metadata_hash));
     TEST_AND_RETURN_FALSE(PayloadVerifier::VerifySignature(
@@ -400,15 +530,20 @@ bool PayloadSigner::SignPayload(const string& unsigned_payload_path,
                                 const uint32_t metadata_signature_size,
                                 const uint64_t signatures_offset,
                                 brillo::Blob* out_signature_blob) {
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(unsigned_payload_path, &payload));
+  brillo::Blob metadata;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      unsigned_payload_path, 0, metadata_size, &metadata));
+  TEST_AND_RETURN_FALSE(metadata.size() == metadata_size);
+  TEST_AND_RETURN_FALSE(signatures_offset >=
+                        metadata_size + metadata_signature_size);
   brillo::Blob hash_data;
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 &hash_data,
-                                                 nullptr));
+  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(
+      unsigned_payload_path,
+      metadata,
+      metadata_size + metadata_signature_size,
+      signatures_offset - metadata_size - metadata_signature_size,
+      &hash_data,
+      nullptr));
   TEST_AND_RETURN_FALSE(SignHashWithKeys(hash_data,
                                          private_key_paths,
                                          out_signature_blob));
@@ -442,21 +577,16 @@ bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
   TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
                                                        &signature_blob));
 
-  brillo::Blob payload;
-  uint64_t metadata_size, signatures_offset;
-  uint32_t metadata_signature_size;
+  SignedPayload payload;
   // Prepare payload for hashing.
   TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
                                                   signature_blob,
                                                   signature_blob,
-                                                  &payload,
-                                                  &metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
+                                                  &payload));
+  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload_path,
+                                                 payload.metadata,
+                                                 payload.data_offset,
+                                                 payload.data_size,
                                                  out_payload_hash_data,
                                                  out_metadata_hash));
   return true;
@@ -468,9 +598,7 @@ bool PayloadSigner::AddSignatureToPayload(
     const vector<brillo::Blob>& metadata_signatures,
     const string& signed_payload_path,
     uint64_t *out_metadata_size) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+  // Loads the payload metadata and adds the signature op to it.
   brillo::Blob signature_blob, metadata_signature_blob;
   TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(payload_signatures,
                                                        &signature_blob));
@@ -479,21 +607,18 @@ bool PayloadSigner::AddSignatureToPayload(
         ConvertSignatureToProtobufBlob(metadata_signatures,
                                        &metadata_signature_blob));
   }
-  brillo::Blob payload;
-  uint64_t signatures_offset;
-  uint32_t metadata_signature_size;
+  SignedPayload payload;
   TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
                                                   signature_blob,
                                                   metadata_signature_blob,
-                                                  &payload,
-                                                  out_metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-
-  LOG(INFO) << "Signed payload size: " << payload.size();
-  TEST_AND_RETURN_FALSE(utils::WriteFile(signed_payload_path.c_str(),
-                                         payload.data(),
-                                         payload.size()));
+                                                  &payload));
+
+  LOG(INFO) << "Signed payload size: "
+            << payload.metadata.size() + payload.metadata_signature_blob.size()
+                   + payload.data_size + payload.signature_blob.size();
+  TEST_AND_RETURN_FALSE(
+      WriteSignedPayload(payload_path, payload, signed_payload_path));
+  *out_metadata_size = payload.metadata.size();
   return true;
 }
 
@@ -61,6 +61,15 @@ class PayloadSigner {
                                      bool add_dummy_op,
                                      DeltaArchiveManifest* manifest);
 
+  // Sets the metadata_padding of the |manifest| of a payload with aligned
+  // blobs, so the data after the |header_size| bytes of payload header, the
+  // manifest and the |metadata_signature_size| bytes of metadata signature
+  // starts at a multiple of its blob_alignment. Clears it if the blobs aren't
+  // aligned.
+  static bool PadMetadata(uint64_t header_size,
+                          uint64_t metadata_signature_size,
+                          DeltaArchiveManifest* manifest);
+
   // Given a raw |hash| and a private key in |private_key_path| calculates the
   // raw signature in |out_signature|. Returns true on success, false otherwise.
   static bool SignHash(const brillo::Blob& hash,
@@ -114,7 +123,8 @@ class PayloadSigner {
   // and the raw |payload_signatures| and |metadata_signatures| updates the
   // payload to include the signature thus turning it into a signed payload. The
   // new payload is stored in |signed_payload_path|. |payload_path| and
-  // |signed_payload_path| can point to the same file. Populates
+  // |signed_payload_path| can point to the same file. Only the metadata is
+  // loaded in memory, the payload data is copied in chunks. Populates
   // |out_metadata_size| with the size of the metadata after adding the
   // signature operation in the manifest. Returns true on success, false
   // otherwise.
@@ -230,6 +230,21 @@ TEST_F(PayloadSignerTest, SkipMetadataSignatureTest) {
   EXPECT_EQ(unsigned_metadata_hash, signed_metadata_hash);
 }
 
+TEST_F(PayloadSignerTest, PadMetadataTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kAlignedBlobsMinorPayloadVersion);
+  EXPECT_TRUE(PayloadSigner::PadMetadata(24, 256, &manifest));
+  EXPECT_FALSE(manifest.has_metadata_padding());
+
+  // The padding grows past the sizes where its length takes another byte.
+  for (uint32_t alignment : {16, 4096, 65536}) {
+    manifest.set_blob_alignment(alignment);
+    EXPECT_TRUE(PayloadSigner::PadMetadata(24, 256, &manifest));
+    EXPECT_EQ(0U, (24 + manifest.ByteSize() + 256) % alignment);
+    EXPECT_LT(manifest.metadata_padding().size(), alignment);
+  }
+}
+
 TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
   string payload_path;
   EXPECT_TRUE(utils::MakeTempFile("payload.XXXXXX", &payload_path, nullptr));
@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The headers of the sparse image format, as written by libsparse. All the
+// fields are little endian.
+const uint32_t kSparseHeaderMagic = 0xed26ff3a;
+const uint16_t kSparseMajorVersion = 1;
+
+const uint16_t kChunkTypeRaw = 0xCAC1;
+const uint16_t kChunkTypeFill = 0xCAC2;
+const uint16_t kChunkTypeDontCare = 0xCAC3;
+const uint16_t kChunkTypeCrc32 = 0xCAC4;
+
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  // The size of this header and of the chunk headers, which may be larger
+  // than the structures.
+  uint16_t file_header_size;
+  uint16_t chunk_header_size;
+  uint32_t block_size;
+  uint32_t total_blocks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+} __attribute__((packed));
+
+struct ChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved;
+  // The size of the chunk in blocks of the expanded image, and in bytes of
+  // the sparse image including this header.
+  uint32_t num_blocks;
+  uint32_t total_size;
+} __attribute__((packed));
+
+}  // namespace
+
+bool SparseImage::IsSparseImage(const string& path) {
+  brillo::Blob data;
+  uint32_t magic;
+  if (!utils::ReadFileChunk(path, 0, sizeof(magic), &data) ||
+      data.size() != sizeof(magic)) {
+    return false;
+  }
+  memcpy(&magic, data.data(), sizeof(magic));
+  return le32toh(magic) == kSparseHeaderMagic;
+}
+
+std::unique_ptr<SparseImage> SparseImage::Open(const string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(WARNING) << "Unable to open " << path;
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  const off_t file_size = utils::FileSize(fd);
+
+  SparseHeader header;
+  ssize_t bytes_read = -1;
+  if (!utils::PReadAll(fd, &header, sizeof(header), 0, &bytes_read) ||
+      bytes_read != sizeof(header) ||
+      le32toh(header.magic) != kSparseHeaderMagic) {
+    return nullptr;
+  }
+  const uint16_t file_header_size = le16toh(header.file_header_size);
+  const uint16_t chunk_header_size = le16toh(header.chunk_header_size);
+  std::unique_ptr<SparseImage> image(new SparseImage());
+  image->path_ = path;
+  image->block_size_ = le32toh(header.block_size);
+  if (le16toh(header.major_version) != kSparseMajorVersion ||
+      file_header_size < sizeof(SparseHeader) ||
+      chunk_header_size < sizeof(ChunkHeader) || image->block_size_ == 0 ||
+      image->block_size_ % sizeof(uint32_t) != 0) {
+    LOG(ERROR) << "Unsupported sparse image header in " << path;
+    return nullptr;
+  }
+
+  uint64_t offset = file_header_size;
+  for (uint32_t i = 0; i < le32toh(header.total_chunks); i++) {
+    ChunkHeader chunk_header;
+    if (!utils::PReadAll(
+            fd, &chunk_header, sizeof(chunk_header), offset, &bytes_read) ||
+        bytes_read != sizeof(chunk_header)) {
+      LOG(ERROR) << "Unable to read the chunk " << i << " of " << path;
+      return nullptr;
+    }
+    Chunk chunk;
+    chunk.start_block = image->num_blocks_;
+    chunk.num_blocks = le32toh(chunk_header.num_blocks);
+    chunk.file_offset = offset + chunk_header_size;
+    chunk.fill_value = 0;
+    const uint64_t total_size = le32toh(chunk_header.total_size);
+    uint64_t data_size = 0;
+    switch (le16toh(chunk_header.chunk_type)) {
+      case kChunkTypeRaw:
+        chunk.type = ChunkType::kRaw;
+        data_size = chunk.num_blocks * image->block_size_;
+        break;
+      case kChunkTypeFill:
+        chunk.type = ChunkType::kFill;
+        data_size = sizeof(uint32_t);
+        if (!utils::PReadAll(fd,
+                             &chunk.fill_value,
+                             sizeof(chunk.fill_value),
+                             chunk.file_offset,
+                             &bytes_read) ||
+            bytes_read != sizeof(chunk.fill_value)) {
+          LOG(ERROR) << "Unable to read the chunk " << i << " of " << path;
+          return nullptr;
+        }
+        break;
+      case kChunkTypeDontCare:
+        chunk.type = ChunkType::kDontCare;
+        break;
+      case kChunkTypeCrc32:
+        // The checksums don't describe any block.
+        offset += total_size;
+        continue;
+      default:
+        LOG(ERROR) << "Unknown type of the chunk " << i << " of " << path;
+        return nullptr;
+    }
+    if (total_size != chunk_header_size + data_size ||
+        offset + total_size > static_cast<uint64_t>(file_size)) {
+      LOG(ERROR) << "Invalid size of the chunk " << i << " of " << path;
+      return nullptr;
+    }
+    offset += total_size;
+    image->num_blocks_ += chunk.num_blocks;
+    // The consecutive chunks of zeros are merged.
+    const bool zeros = chunk.type == ChunkType::kDontCare ||
+                       (chunk.type == ChunkType::kFill && !chunk.fill_value);
+    if (zeros && !image->chunks_.empty() &&
+        image->chunks_.back().type == ChunkType::kDontCare) {
+      image->chunks_.back().num_blocks += chunk.num_blocks;
+      continue;
+    }
+    if (zeros)
+      chunk.type = ChunkType::kDontCare;
+    image->chunks_.push_back(chunk);
+  }
+  if (image->num_blocks_ != le32toh(header.total_blocks)) {
+    LOG(ERROR) << "The chunks of " << path << " have " << image->num_blocks_
+               << " blocks instead of " << le32toh(header.total_blocks);
+    return nullptr;
+  }
+  return image;
+}
+
+bool SparseImage::Expand(uint8_t* out) const {
+  int fd = HANDLE_EINTR(open(path_.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  for (const Chunk& chunk : chunks_) {
+    uint8_t* blocks = out + chunk.start_block * block_size_;
+    const uint64_t size = chunk.num_blocks * block_size_;
+    switch (chunk.type) {
+      case ChunkType::kRaw: {
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(
+            fd, blocks, size, chunk.file_offset, &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+        break;
+      }
+      case ChunkType::kFill:
+        for (uint64_t i = 0; i < size; i += sizeof(chunk.fill_value))
+          memcpy(blocks + i, &chunk.fill_value, sizeof(chunk.fill_value));
+        break;
+      case ChunkType::kDontCare:
+        // The blocks are already zeroed.
+        break;
+    }
+  }
+  return true;
+}
+
+off_t PartitionImageSize(const string& path) {
+  if (!SparseImage::IsSparseImage(path))
+    return utils::FileSize(path);
+  std::unique_ptr<SparseImage> image = SparseImage::Open(path);
+  return image ? image->size() : -1;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// SparseImage reads the chunks of an Android sparse image, the format the
+// build outputs the partition images in. The image holds the data of the
+// blocks that were written, and only describes the blocks filled with a
+// repeated value or that are "don't care", which read as zeros.
+//
+// The generator reads the sparse images through their MappedImage, which only
+// copies the data of the raw and the non-zero fill chunks, so the partitions
+// don't need to be unsparsed to disk first.
+class SparseImage {
+ public:
+  enum class ChunkType {
+    kRaw,
+    kFill,
+    kDontCare,
+  };
+
+  struct Chunk {
+    ChunkType type;
+    uint64_t start_block;
+    uint64_t num_blocks;
+    // The offset in the file of the data of a kRaw chunk.
+    uint64_t file_offset;
+    // The 4 bytes repeated in the blocks of a kFill chunk.
+    uint32_t fill_value;
+  };
+
+  // Returns whether the file at |path| starts with the sparse image magic.
+  static bool IsSparseImage(const std::string& path);
+
+  // Reads the chunks of the sparse image at |path|. The fill chunks of zeros
+  // are returned as kDontCare chunks, merged with the neighbouring ones, and
+  // the checksum chunks are skipped. Returns nullptr if it isn't a valid
+  // sparse image.
+  static std::unique_ptr<SparseImage> Open(const std::string& path);
+
+  // The size of the expanded image.
+  uint64_t size() const { return num_blocks_ * block_size_; }
+  uint32_t block_size() const { return block_size_; }
+  const std::vector<Chunk>& chunks() const { return chunks_; }
+
+  // Writes the raw and the non-zero fill chunks of the image in the size()
+  // bytes at |out|, which must be zeroed.
+  bool Expand(uint8_t* out) const;
+
+ private:
+  SparseImage() = default;
+
+  std::string path_;
+  uint32_t block_size_{0};
+  uint64_t num_blocks_{0};
+  std::vector<Chunk> chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(SparseImage);
+};
+
+// Returns the size of the partition image at |path|: the size of the expanded
+// image for a sparse image, the size of the file otherwise. Returns -1 on
+// error, like utils::FileSize().
+off_t PartitionImageSize(const std::string& path);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
@@ -0,0 +1,173 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/mapped_image.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kBlockSize = 16;
+
+void AppendValue(brillo::Blob* blob, uint32_t value, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    blob->push_back((value >> (8 * i)) & 0xff);
+}
+
+}  // namespace
+
+class SparseImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    num_chunks_ = 0;
+    num_blocks_ = 0;
+  }
+
+  // Appends a chunk of |type| with |num_blocks| and the |data| to the sparse
+  // image.
+  void AppendChunk(uint16_t type, uint32_t num_blocks,
+                   const brillo::Blob& data) {
+    AppendValue(&chunks_, type, 2);
+    AppendValue(&chunks_, 0, 2);
+    AppendValue(&chunks_, num_blocks, 4);
+    AppendValue(&chunks_, 12 + data.size(), 4);
+    chunks_.insert(chunks_.end(), data.begin(), data.end());
+    num_chunks_++;
+    if (type != 0xCAC4)
+      num_blocks_ += num_blocks;
+  }
+
+  // Writes the sparse image with the chunks appended so far.
+  void WriteImage() {
+    brillo::Blob image;
+    AppendValue(&image, 0xed26ff3a, 4);
+    AppendValue(&image, 1, 2);
+    AppendValue(&image, 0, 2);
+    AppendValue(&image, 28, 2);
+    AppendValue(&image, 12, 2);
+    AppendValue(&image, kBlockSize, 4);
+    AppendValue(&image, num_blocks_, 4);
+    AppendValue(&image, num_chunks_, 4);
+    AppendValue(&image, 0, 4);
+    image.insert(image.end(), chunks_.begin(), chunks_.end());
+    ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), image));
+  }
+
+  // Appends the chunks of an image of 8 blocks: 2 raw blocks, 2 filled with
+  // 'f', 1 zero filled, 2 "don't care", a checksum and 1 raw block.
+  void AppendTestChunks() {
+    brillo::Blob raw(2 * kBlockSize, 'a');
+    raw[kBlockSize] = 'b';
+    AppendChunk(0xCAC1, 2, raw);
+    AppendChunk(0xCAC2, 2, brillo::Blob(4, 'f'));
+    AppendChunk(0xCAC2, 1, brillo::Blob(4, 0));
+    AppendChunk(0xCAC3, 2, {});
+    AppendChunk(0xCAC4, 0, brillo::Blob(4, 'c'));
+    AppendChunk(0xCAC1, 1, brillo::Blob(kBlockSize, 'z'));
+
+    expected_data_ = raw;
+    expected_data_.insert(expected_data_.end(), 2 * kBlockSize, 'f');
+    expected_data_.insert(expected_data_.end(), 3 * kBlockSize, 0);
+    expected_data_.insert(expected_data_.end(), kBlockSize, 'z');
+  }
+
+  brillo::Blob chunks_;
+  uint32_t num_chunks_;
+  uint32_t num_blocks_;
+  brillo::Blob expected_data_;
+  test_utils::ScopedTempFile image_file_{"SparseImage-XXXXXX"};
+};
+
+TEST_F(SparseImageTest, ChunksTest) {
+  AppendTestChunks();
+  WriteImage();
+  EXPECT_TRUE(SparseImage::IsSparseImage(image_file_.path()));
+  std::unique_ptr<SparseImage> image = SparseImage::Open(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(kBlockSize, image->block_size());
+  EXPECT_EQ(8 * kBlockSize, image->size());
+  EXPECT_EQ(static_cast<off_t>(8 * kBlockSize),
+            PartitionImageSize(image_file_.path()));
+
+  // The zero fill chunk is merged with the "don't care" one.
+  const vector<SparseImage::Chunk>& chunks = image->chunks();
+  ASSERT_EQ(4U, chunks.size());
+  EXPECT_EQ(SparseImage::ChunkType::kRaw, chunks[0].type);
+  EXPECT_EQ(28U + 12, chunks[0].file_offset);
+  EXPECT_EQ(SparseImage::ChunkType::kFill, chunks[1].type);
+  EXPECT_EQ(2U, chunks[1].start_block);
+  EXPECT_EQ(SparseImage::ChunkType::kDontCare, chunks[2].type);
+  EXPECT_EQ(4U, chunks[2].start_block);
+  EXPECT_EQ(3U, chunks[2].num_blocks);
+  EXPECT_EQ(SparseImage::ChunkType::kRaw, chunks[3].type);
+  EXPECT_EQ(7U, chunks[3].start_block);
+
+  brillo::Blob data(image->size(), 0);
+  EXPECT_TRUE(image->Expand(data.data()));
+  EXPECT_EQ(expected_data_, data);
+}
+
+TEST_F(SparseImageTest, MappedImageTest) {
+  AppendTestChunks();
+  WriteImage();
+  std::unique_ptr<MappedImage> image = MappedImage::Open(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  ASSERT_EQ(expected_data_.size(), image->size());
+  EXPECT_EQ(0, memcmp(expected_data_.data(), image->data(), image->size()));
+}
+
+TEST_F(SparseImageTest, InvalidImageTest) {
+  // The chunks must describe all the blocks of the header.
+  AppendTestChunks();
+  num_blocks_++;
+  WriteImage();
+  EXPECT_TRUE(SparseImage::IsSparseImage(image_file_.path()));
+  EXPECT_EQ(nullptr, SparseImage::Open(image_file_.path()));
+  EXPECT_EQ(nullptr, MappedImage::Open(image_file_.path()));
+  EXPECT_EQ(-1, PartitionImageSize(image_file_.path()));
+
+  // A raw chunk must hold the data of its blocks.
+  chunks_.clear();
+  num_chunks_ = num_blocks_ = 0;
+  AppendChunk(0xCAC1, 2, brillo::Blob(kBlockSize, 'a'));
+  WriteImage();
+  EXPECT_EQ(nullptr, SparseImage::Open(image_file_.path()));
+}
+
+TEST_F(SparseImageTest, RawImageTest) {
+  brillo::Blob data(3 * kBlockSize, 'r');
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), data));
+  EXPECT_FALSE(SparseImage::IsSparseImage(image_file_.path()));
+  EXPECT_EQ(nullptr, SparseImage::Open(image_file_.path()));
+  EXPECT_EQ(static_cast<off_t>(data.size()),
+            PartitionImageSize(image_file_.path()));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,550 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/squashfs_filesystem.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xz.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// See fs/squashfs/squashfs_fs.h in the kernel for the format details.
+const uint32_t kSquashfsMagic = 0x73717368;  // "hsqs"
+const size_t kSuperblockSize = 96;
+
+// The compressors, squashfs_fs.h: ZLIB_COMPRESSION and the like.
+const uint16_t kGzipCompression = 1;
+const uint16_t kXzCompression = 4;
+const uint16_t kZstdCompression = 6;
+
+// Every metadata block starts with a 16 bit header with its stored size and
+// whether it is stored uncompressed, and holds up to 8 KiB of metadata.
+const uint16_t kMetadataUncompressed = 0x8000;
+const size_t kMetadataBlockSize = 8192;
+
+// The stored size of a data or fragment block, and whether it is stored
+// uncompressed. A data block of size 0 is a sparse block.
+const uint32_t kDataUncompressed = 1 << 24;
+const uint32_t kDataSizeMask = kDataUncompressed - 1;
+
+// The fragment of the regular files without one.
+const uint32_t kNoFragment = 0xffffffff;
+
+// The size of an entry of the fragment table, struct squashfs_fragment_entry.
+const size_t kFragmentEntrySize = 16;
+
+// The inode types.
+const uint16_t kDirectoryType = 1;
+const uint16_t kRegularType = 2;
+const uint16_t kLongDirectoryType = 8;
+const uint16_t kLongRegularType = 9;
+
+// The sizes of the common inode header and of the rest of the inodes of each
+// type, before the list of block sizes of the regular files.
+const size_t kInodeHeaderSize = 16;
+const size_t kDirectoryInodeSize = 16;
+const size_t kRegularInodeSize = 16;
+const size_t kLongDirectoryInodeSize = 24;
+const size_t kLongRegularInodeSize = 40;
+
+// The sizes of the header of a run of directory entries and of each entry
+// before its name.
+const size_t kDirectoryHeaderSize = 12;
+const size_t kDirectoryEntrySize = 8;
+
+// The size of a directory is 3 bytes more than its listing, for the "." and
+// ".." entries not stored.
+const uint64_t kDirectoryExtraSize = 3;
+
+uint16_t ReadLE16(const uint8_t* buf) {
+  return static_cast<uint16_t>(buf[0]) | static_cast<uint16_t>(buf[1]) << 8;
+}
+
+uint32_t ReadLE32(const uint8_t* buf) {
+  return static_cast<uint32_t>(ReadLE16(buf)) |
+         static_cast<uint32_t>(ReadLE16(buf + 2)) << 16;
+}
+
+uint64_t ReadLE64(const uint8_t* buf) {
+  return static_cast<uint64_t>(ReadLE32(buf)) |
+         static_cast<uint64_t>(ReadLE32(buf + 4)) << 32;
+}
+
+bool IsDirectory(uint16_t type) {
+  return type == kDirectoryType || type == kLongDirectoryType;
+}
+
+bool IsRegularFile(uint16_t type) {
+  return type == kRegularType || type == kLongRegularType;
+}
+
+}  // namespace
+
+unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
+    const string& filename) {
+  if (filename.empty())
+    return nullptr;
+  unique_ptr<SquashfsFilesystem> result(new SquashfsFilesystem());
+  result->filename_ = filename;
+  result->fd_ = HANDLE_EINTR(open(filename.c_str(), O_RDONLY));
+  if (result->fd_ < 0) {
+    PLOG(ERROR) << "Opening squashfs " << filename;
+    return nullptr;
+  }
+
+  uint8_t superblock[kSuperblockSize];
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          result->fd_, superblock, sizeof(superblock), 0, &bytes_read) ||
+      bytes_read != sizeof(superblock) ||
+      ReadLE32(superblock) != kSquashfsMagic) {
+    return nullptr;
+  }
+  const uint16_t major_version = ReadLE16(superblock + 28);
+  if (major_version != 4) {
+    LOG(ERROR) << "Unsupported squashfs major version " << major_version;
+    return nullptr;
+  }
+  result->block_size_ = ReadLE32(superblock + 12);
+  result->fragments_ = ReadLE32(superblock + 16);
+  result->compression_ = ReadLE16(superblock + 20);
+  const uint16_t block_log = ReadLE16(superblock + 22);
+  result->root_inode_ = ReadLE64(superblock + 32);
+  result->bytes_used_ = ReadLE64(superblock + 40);
+  result->inode_table_start_ = ReadLE64(superblock + 64);
+  result->directory_table_start_ = ReadLE64(superblock + 72);
+  result->fragment_table_start_ = ReadLE64(superblock + 80);
+
+  if (block_log >= 32 || result->block_size_ != 1U << block_log ||
+      result->block_size_ < kBlockSize || result->block_size_ > kDataSizeMask) {
+    LOG(ERROR) << "Invalid squashfs block size " << result->block_size_;
+    return nullptr;
+  }
+  switch (result->compression_) {
+    case kGzipCompression:
+    case kZstdCompression:
+      break;
+    case kXzCompression:
+      xz_crc32_init();
+      break;
+    default:
+      LOG(WARNING) << "Unsupported squashfs compression "
+                   << result->compression_ << " in " << filename;
+      return nullptr;
+  }
+  return result;
+}
+
+SquashfsFilesystem::~SquashfsFilesystem() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+size_t SquashfsFilesystem::GetBlockSize() const {
+  return kBlockSize;
+}
+
+size_t SquashfsFilesystem::GetBlockCount() const {
+  return (bytes_used_ + kBlockSize - 1) / kBlockSize;
+}
+
+bool SquashfsFilesystem::GetFiles(vector<File>* files) const {
+  files->clear();
+  ExtentRanges used_blocks;
+
+  // Walk the directory tree from the root, with the paths of the directories
+  // pending to list.
+  vector<std::pair<string, uint64_t>> pending_dirs = {{"", root_inode_}};
+  while (!pending_dirs.empty()) {
+    const string dir_path = pending_dirs.back().first;
+    Inode dir;
+    TEST_AND_RETURN_FALSE(ReadInode(pending_dirs.back().second, &dir));
+    pending_dirs.pop_back();
+    TEST_AND_RETURN_FALSE(IsDirectory(dir.type));
+    vector<DirectoryEntry> entries;
+    TEST_AND_RETURN_FALSE(ReadDirectory(dir, &entries));
+
+    for (const DirectoryEntry& entry : entries) {
+      const string path = dir_path + "/" + entry.name;
+      Inode inode;
+      TEST_AND_RETURN_FALSE(ReadInode(entry.inode_ref, &inode));
+      if (IsDirectory(inode.type)) {
+        pending_dirs.emplace_back(path, entry.inode_ref);
+        continue;
+      }
+      if (!IsRegularFile(inode.type))
+        continue;
+
+      File file;
+      file.name = path;
+      file.file_stat.st_ino = inode.inode_number;
+      file.file_stat.st_mode = S_IFREG | inode.mode;
+      file.file_stat.st_nlink = inode.nlink;
+      file.file_stat.st_size = inode.file_size;
+      file.file_stat.st_blksize = block_size_;
+      file.file_stat.st_mtime = inode.mtime;
+      uint64_t data_size = 0;
+      for (uint32_t block_size : inode.block_sizes)
+        data_size += block_size & kDataSizeMask;
+      // The block shared with the previous file stays in that one.
+      file.extents = FilterExtentRanges(
+          ByteRangeExtents(inode.start_block, data_size), used_blocks);
+      used_blocks.AddExtents(file.extents);
+      files->push_back(file);
+    }
+  }
+
+  for (uint32_t fragment = 0; fragment < fragments_; fragment++) {
+    uint64_t start;
+    uint32_t size;
+    TEST_AND_RETURN_FALSE(ReadFragment(fragment, &start, &size));
+    File file;
+    file.name = base::StringPrintf("<fragment-%u>", fragment);
+    file.extents = FilterExtentRanges(
+        ByteRangeExtents(start, size & kDataSizeMask), used_blocks);
+    used_blocks.AddExtents(file.extents);
+    files->push_back(file);
+  }
+
+  ExtentRanges metadata_blocks;
+  metadata_blocks.AddExtent(ExtentForRange(0, GetBlockCount()));
+  metadata_blocks.SubtractRanges(used_blocks);
+  if (metadata_blocks.blocks() > 0) {
+    File file;
+    file.name = "<metadata>";
+    file.extents =
+        metadata_blocks.GetExtentsForBlockCount(metadata_blocks.blocks());
+    files->push_back(file);
+  }
+  return true;
+}
+
+bool SquashfsFilesystem::LoadSettings(brillo::KeyValueStore* store) const {
+  uint64_t inode_ref = root_inode_;
+  Inode inode;
+  for (const string& name :
+       base::SplitString("etc/update_engine.conf", "/", base::KEEP_WHITESPACE,
+                         base::SPLIT_WANT_ALL)) {
+    if (!ReadInode(inode_ref, &inode) || !IsDirectory(inode.type))
+      return false;
+    vector<DirectoryEntry> entries;
+    if (!ReadDirectory(inode, &entries))
+      return false;
+    auto entry = std::find_if(
+        entries.begin(), entries.end(), [&name](const DirectoryEntry& entry) {
+          return entry.name == name;
+        });
+    if (entry == entries.end())
+      return false;
+    inode_ref = entry->inode_ref;
+  }
+  if (!ReadInode(inode_ref, &inode) || !IsRegularFile(inode.type))
+    return false;
+
+  brillo::Blob data;
+  if (!ReadFileData(inode, &data))
+    return false;
+  return store->LoadFromString(string(data.begin(), data.end()));
+}
+
+bool SquashfsFilesystem::ReadImage(uint64_t offset,
+                                   size_t size,
+                                   uint8_t* out) const {
+  TEST_AND_RETURN_FALSE(offset <= bytes_used_ && size <= bytes_used_ - offset);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, out, size, offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == size);
+  return true;
+}
+
+bool SquashfsFilesystem::Decompress(const brillo::Blob& in,
+                                    size_t max_size,
+                                    brillo::Blob* out) const {
+  out->resize(max_size);
+  switch (compression_) {
+    case kGzipCompression: {
+      uLongf out_size = out->size();
+      TEST_AND_RETURN_FALSE(
+          uncompress(out->data(), &out_size, in.data(), in.size()) == Z_OK);
+      out->resize(out_size);
+      return true;
+    }
+    case kXzCompression: {
+      xz_dec* stream = xz_dec_init(XZ_SINGLE, 0);
+      TEST_AND_RETURN_FALSE(stream != nullptr);
+      xz_buf request;
+      request.in = in.data();
+      request.in_pos = 0;
+      request.in_size = in.size();
+      request.out = out->data();
+      request.out_pos = 0;
+      request.out_size = out->size();
+      xz_ret ret = xz_dec_run(stream, &request);
+      xz_dec_end(stream);
+      TEST_AND_RETURN_FALSE(ret == XZ_STREAM_END);
+      out->resize(request.out_pos);
+      return true;
+    }
+    case kZstdCompression: {
+      size_t out_size =
+          ZSTD_decompress(out->data(), out->size(), in.data(), in.size());
+      TEST_AND_RETURN_FALSE(!ZSTD_isError(out_size));
+      out->resize(out_size);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SquashfsFilesystem::ReadMetadata(uint64_t* block,
+                                      uint32_t* offset,
+                                      size_t size,
+                                      uint8_t* out) const {
+  while (size > 0) {
+    auto it = metadata_blocks_.find(*block);
+    if (it == metadata_blocks_.end()) {
+      uint8_t header[2];
+      TEST_AND_RETURN_FALSE(ReadImage(*block, sizeof(header), header));
+      const uint16_t stored_size = ReadLE16(header) & ~kMetadataUncompressed;
+      TEST_AND_RETURN_FALSE(stored_size > 0 &&
+                            stored_size <= kMetadataBlockSize);
+      brillo::Blob data(stored_size);
+      TEST_AND_RETURN_FALSE(
+          ReadImage(*block + sizeof(header), stored_size, data.data()));
+      if (!(ReadLE16(header) & kMetadataUncompressed)) {
+        brillo::Blob compressed_data = std::move(data);
+        TEST_AND_RETURN_FALSE(
+            Decompress(compressed_data, kMetadataBlockSize, &data));
+        TEST_AND_RETURN_FALSE(!data.empty());
+      }
+      it = metadata_blocks_
+               .emplace(*block,
+                        std::make_pair(std::move(data),
+                                       *block + sizeof(header) + stored_size))
+               .first;
+    }
+    const brillo::Blob& data = it->second.first;
+    TEST_AND_RETURN_FALSE(*offset < data.size());
+    const size_t read_size = std::min<size_t>(size, data.size() - *offset);
+    memcpy(out, data.data() + *offset, read_size);
+    out += read_size;
+    size -= read_size;
+    *offset += read_size;
+    if (*offset == data.size()) {
+      *block = it->second.second;
+      *offset = 0;
+    }
+  }
+  return true;
+}
+
+bool SquashfsFilesystem::ReadInode(uint64_t inode_ref, Inode* inode) const {
+  uint64_t block = inode_table_start_ + (inode_ref >> 16);
+  uint32_t offset = inode_ref & 0xffff;
+  uint8_t buf[kLongRegularInodeSize];
+  TEST_AND_RETURN_FALSE(ReadMetadata(&block, &offset, kInodeHeaderSize, buf));
+  *inode = Inode();
+  inode->type = ReadLE16(buf);
+  inode->mode = ReadLE16(buf + 2);
+  inode->mtime = ReadLE32(buf + 8);
+  inode->inode_number = ReadLE32(buf + 12);
+
+  switch (inode->type) {
+    case kDirectoryType:
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, kDirectoryInodeSize, buf));
+      inode->dir_start_block = ReadLE32(buf);
+      inode->nlink = ReadLE32(buf + 4);
+      inode->file_size = ReadLE16(buf + 8);
+      inode->dir_offset = ReadLE16(buf + 10);
+      return true;
+    case kLongDirectoryType:
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, kLongDirectoryInodeSize, buf));
+      inode->nlink = ReadLE32(buf);
+      inode->file_size = ReadLE32(buf + 4);
+      inode->dir_start_block = ReadLE32(buf + 8);
+      inode->dir_offset = ReadLE16(buf + 18);
+      return true;
+    case kRegularType:
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, kRegularInodeSize, buf));
+      inode->start_block = ReadLE32(buf);
+      inode->fragment = ReadLE32(buf + 4);
+      inode->fragment_offset = ReadLE32(buf + 8);
+      inode->file_size = ReadLE32(buf + 12);
+      break;
+    case kLongRegularType:
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, kLongRegularInodeSize, buf));
+      inode->start_block = ReadLE64(buf);
+      inode->file_size = ReadLE64(buf + 8);
+      inode->nlink = ReadLE32(buf + 24);
+      inode->fragment = ReadLE32(buf + 28);
+      inode->fragment_offset = ReadLE32(buf + 32);
+      break;
+    default:
+      // The rest of the inodes have no data blocks.
+      return true;
+  }
+
+  // The tail of the file smaller than a block is in the fragment, if any.
+  uint64_t num_blocks = inode->file_size / block_size_;
+  if (inode->fragment == kNoFragment && inode->file_size % block_size_)
+    num_blocks++;
+  TEST_AND_RETURN_FALSE(num_blocks <= bytes_used_);
+  brillo::Blob block_sizes(num_blocks * sizeof(uint32_t));
+  TEST_AND_RETURN_FALSE(ReadMetadata(
+      &block, &offset, block_sizes.size(), block_sizes.data()));
+  inode->block_sizes.resize(num_blocks);
+  for (uint64_t i = 0; i < num_blocks; i++)
+    inode->block_sizes[i] = ReadLE32(block_sizes.data() + i * sizeof(uint32_t));
+  return true;
+}
+
+bool SquashfsFilesystem::ReadDirectory(const Inode& dir,
+                                       vector<DirectoryEntry>* entries) const {
+  entries->clear();
+  if (dir.file_size <= kDirectoryExtraSize)
+    return true;
+  uint64_t block = directory_table_start_ + dir.dir_start_block;
+  uint32_t offset = dir.dir_offset;
+  uint64_t remaining = dir.file_size - kDirectoryExtraSize;
+  while (remaining > 0) {
+    uint8_t header[kDirectoryHeaderSize];
+    TEST_AND_RETURN_FALSE(remaining >= sizeof(header));
+    TEST_AND_RETURN_FALSE(
+        ReadMetadata(&block, &offset, sizeof(header), header));
+    remaining -= sizeof(header);
+    // The entries of a run are in the same inode metadata block.
+    const uint64_t count = static_cast<uint64_t>(ReadLE32(header)) + 1;
+    const uint64_t inode_block = ReadLE32(header + 4);
+    for (uint64_t i = 0; i < count; i++) {
+      uint8_t entry[kDirectoryEntrySize];
+      TEST_AND_RETURN_FALSE(remaining >= sizeof(entry));
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, sizeof(entry), entry));
+      const size_t name_size = ReadLE16(entry + 6) + 1;
+      TEST_AND_RETURN_FALSE(remaining - sizeof(entry) >= name_size);
+      remaining -= sizeof(entry) + name_size;
+      brillo::Blob name(name_size);
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, name.size(), name.data()));
+      DirectoryEntry dir_entry;
+      dir_entry.name.assign(name.begin(), name.end());
+      dir_entry.inode_ref = inode_block << 16 | ReadLE16(entry);
+      entries->push_back(std::move(dir_entry));
+    }
+  }
+  return true;
+}
+
+bool SquashfsFilesystem::ReadFragment(uint32_t fragment,
+                                      uint64_t* start,
+                                      uint32_t* size) const {
+  TEST_AND_RETURN_FALSE(fragment < fragments_);
+  // The fragment table is stored in metadata blocks, indexed by the table of
+  // their positions at |fragment_table_start_|.
+  const size_t kEntriesPerBlock = kMetadataBlockSize / kFragmentEntrySize;
+  uint8_t buf[kFragmentEntrySize];
+  TEST_AND_RETURN_FALSE(ReadImage(
+      fragment_table_start_ + fragment / kEntriesPerBlock * sizeof(uint64_t),
+      sizeof(uint64_t),
+      buf));
+  uint64_t block = ReadLE64(buf);
+  uint32_t offset = fragment % kEntriesPerBlock * kFragmentEntrySize;
+  TEST_AND_RETURN_FALSE(ReadMetadata(&block, &offset, sizeof(buf), buf));
+  *start = ReadLE64(buf);
+  *size = ReadLE32(buf + 8);
+  return true;
+}
+
+bool SquashfsFilesystem::ReadFileData(const Inode& inode,
+                                      brillo::Blob* data) const {
+  data->clear();
+  // Reads the block of |stored_size| at |position| and appends it to |data|.
+  auto append_block = [this, data](uint64_t position, uint32_t stored_size) {
+    brillo::Blob block(stored_size & kDataSizeMask);
+    TEST_AND_RETURN_FALSE(ReadImage(position, block.size(), block.data()));
+    if (!(stored_size & kDataUncompressed)) {
+      brillo::Blob compressed_block = std::move(block);
+      TEST_AND_RETURN_FALSE(
+          Decompress(compressed_block, block_size_, &block));
+    }
+    data->insert(data->end(), block.begin(), block.end());
+    return true;
+  };
+
+  uint64_t position = inode.start_block;
+  for (uint32_t stored_size : inode.block_sizes) {
+    if ((stored_size & kDataSizeMask) == 0) {
+      // A sparse block.
+      data->resize(data->size() + block_size_);
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(append_block(position, stored_size));
+    position += stored_size & kDataSizeMask;
+  }
+  if (inode.fragment != kNoFragment) {
+    const uint64_t size = data->size();
+    uint64_t start;
+    uint32_t stored_size;
+    TEST_AND_RETURN_FALSE(ReadFragment(inode.fragment, &start, &stored_size));
+    TEST_AND_RETURN_FALSE(append_block(start, stored_size));
+    // Only the tail of this file is kept from the fragment.
+    TEST_AND_RETURN_FALSE(
+        data->size() - size >= inode.fragment_offset + inode.file_size - size);
+    data->erase(data->begin() + size,
+                data->begin() + size + inode.fragment_offset);
+  }
+  TEST_AND_RETURN_FALSE(data->size() >= inode.file_size);
+  data->resize(inode.file_size);
+  return true;
+}
+
+vector<Extent> SquashfsFilesystem::ByteRangeExtents(uint64_t offset,
+                                                    uint64_t size) const {
+  if (size == 0)
+    return {};
+  const uint64_t first_block = offset / kBlockSize;
+  const uint64_t end_block = (offset + size + kBlockSize - 1) / kBlockSize;
+  return {ExtentForRange(first_block, end_block - first_block)};
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,155 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+// A filesystem parser of the squashfs 4.0 images, the read-only compressed
+// filesystem of some Chrome OS and Android partitions. The data blocks of the
+// files are stored one after the other, not aligned to the 4 KiB blocks of the
+// payload, and the tails of the small files are packed together in shared
+// fragment blocks. Files are reported with the 4 KiB blocks their data
+// touches, except the block at the boundary with the previous file listed,
+// which is only reported in that one so the extents of the files don't
+// overlap.
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_FILESYSTEM_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_FILESYSTEM_H_
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+class SquashfsFilesystem : public FilesystemInterface {
+ public:
+  // Creates a SquashfsFilesystem from the squashfs image stored in the file
+  // |filename|. Returns null if it isn't a little endian squashfs 4.0 image
+  // compressed with gzip, xz or zstd.
+  static std::unique_ptr<SquashfsFilesystem> CreateFromFile(
+      const std::string& filename);
+  ~SquashfsFilesystem() override;
+
+  // FilesystemInterface overrides.
+  size_t GetBlockSize() const override;
+  size_t GetBlockCount() const override;
+
+  // GetFiles will return one FilesystemInterface::File for every regular file
+  // in the filesystem, with the blocks of its data blocks. Hard-linked files
+  // will appear in the list several times with the same list of blocks.
+  // On addition to actual files, it also returns these pseudo-files:
+  //  <fragment-N>: With the blocks of the fragment number N, which holds the
+  //    tails of several files.
+  //  <metadata>: With the rest of the blocks, such as the superblock and the
+  //    inode, directory and lookup tables.
+  bool GetFiles(std::vector<File>* files) const override;
+
+  bool LoadSettings(brillo::KeyValueStore* store) const override;
+
+ private:
+  // The fields of an inode used to list the files.
+  struct Inode {
+    uint16_t type{0};
+    uint16_t mode{0};
+    uint32_t mtime{0};
+    uint32_t inode_number{0};
+    uint32_t nlink{1};
+    uint64_t file_size{0};
+
+    // For regular files, the position in the image of the first data block,
+    // the sizes of the data blocks as stored in the inode and the fragment
+    // holding the tail of the file, if any.
+    uint64_t start_block{0};
+    std::vector<uint32_t> block_sizes;
+    uint32_t fragment{0};
+    uint32_t fragment_offset{0};
+
+    // For directories, the position of the listing in the directory table.
+    uint32_t dir_start_block{0};
+    uint16_t dir_offset{0};
+  };
+
+  // An entry of a directory listing.
+  struct DirectoryEntry {
+    std::string name;
+    uint64_t inode_ref;
+  };
+
+  SquashfsFilesystem() = default;
+
+  // Reads the |size| bytes of the image at |offset| into |out|.
+  bool ReadImage(uint64_t offset, size_t size, uint8_t* out) const;
+
+  // Decompresses |in| into |out|, which can't be bigger than |max_size|.
+  bool Decompress(const brillo::Blob& in,
+                  size_t max_size,
+                  brillo::Blob* out) const;
+
+  // Reads |size| bytes of metadata into |out| from the offset |*offset| of
+  // the metadata block at the position |*block| of the image, and updates
+  // both to the position right after them.
+  bool ReadMetadata(uint64_t* block,
+                    uint32_t* offset,
+                    size_t size,
+                    uint8_t* out) const;
+
+  // Reads the inode referenced by |inode_ref| into |inode|.
+  bool ReadInode(uint64_t inode_ref, Inode* inode) const;
+
+  // Reads the listing of the directory |dir| into |entries|.
+  bool ReadDirectory(const Inode& dir,
+                     std::vector<DirectoryEntry>* entries) const;
+
+  // Reads the position in the image and the size as stored of the fragment
+  // number |fragment|.
+  bool ReadFragment(uint32_t fragment, uint64_t* start, uint32_t* size) const;
+
+  // Reads and decompresses the data of the regular file |inode| into |data|.
+  bool ReadFileData(const Inode& inode, brillo::Blob* data) const;
+
+  // Returns the 4 KiB blocks of the |size| bytes at |offset| of the image.
+  std::vector<Extent> ByteRangeExtents(uint64_t offset, uint64_t size) const;
+
+  // The file where the filesystem is stored, open for reading.
+  std::string filename_;
+  int fd_{-1};
+
+  // The fields of the superblock.
+  uint32_t block_size_{0};
+  uint16_t compression_{0};
+  uint32_t fragments_{0};
+  uint64_t root_inode_{0};
+  uint64_t bytes_used_{0};
+  uint64_t inode_table_start_{0};
+  uint64_t directory_table_start_{0};
+  uint64_t fragment_table_start_{0};
+
+  // The metadata blocks already read and decompressed, and the position of the
+  // next one in the image, by their position in the image.
+  mutable std::map<uint64_t, std::pair<brillo::Blob, uint64_t>>
+      metadata_blocks_;
+
+  DISALLOW_COPY_AND_ASSIGN(SquashfsFilesystem);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_FILESYSTEM_H_
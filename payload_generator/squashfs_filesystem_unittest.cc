@@ -0,0 +1,356 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/squashfs_filesystem.h"
+
+#include <zlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kSquashfsBlockSize = 4096;
+const uint32_t kDataUncompressed = 1 << 24;
+
+void AppendLE16(uint16_t value, brillo::Blob* out) {
+  out->push_back(value & 0xff);
+  out->push_back(value >> 8);
+}
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  AppendLE16(value & 0xffff, out);
+  AppendLE16(value >> 16, out);
+}
+
+void AppendLE64(uint64_t value, brillo::Blob* out) {
+  AppendLE32(value & 0xffffffff, out);
+  AppendLE32(value >> 32, out);
+}
+
+void Append(const brillo::Blob& data, brillo::Blob* out) {
+  out->insert(out->end(), data.begin(), data.end());
+}
+
+brillo::Blob Gzip(const brillo::Blob& data) {
+  uLongf size = compressBound(data.size());
+  brillo::Blob out(size);
+  EXPECT_EQ(Z_OK, compress2(out.data(), &size, data.data(), data.size(), 9));
+  out.resize(size);
+  return out;
+}
+
+brillo::Blob Slice(const brillo::Blob& data, size_t start, size_t size) {
+  return brillo::Blob(data.begin() + start, data.begin() + start + size);
+}
+
+void AppendInodeHeader(uint16_t type,
+                       uint32_t inode_number,
+                       brillo::Blob* out) {
+  AppendLE16(type, out);
+  AppendLE16(0644, out);  // mode
+  AppendLE16(0, out);     // uid index
+  AppendLE16(0, out);     // gid index
+  AppendLE32(1234, out);  // mtime
+  AppendLE32(inode_number, out);
+}
+
+void AppendRegularInode(uint32_t inode_number,
+                        uint32_t start_block,
+                        uint32_t fragment_offset,
+                        uint32_t file_size,
+                        const vector<uint32_t>& block_sizes,
+                        brillo::Blob* out) {
+  AppendInodeHeader(2, inode_number, out);
+  AppendLE32(start_block, out);
+  AppendLE32(0, out);  // fragment
+  AppendLE32(fragment_offset, out);
+  AppendLE32(file_size, out);
+  for (uint32_t block_size : block_sizes)
+    AppendLE32(block_size, out);
+}
+
+void AppendDirectoryInode(uint32_t inode_number,
+                          uint16_t listing_offset,
+                          uint16_t listing_size,
+                          brillo::Blob* out) {
+  AppendInodeHeader(1, inode_number, out);
+  AppendLE32(0, out);  // start block in the directory table
+  AppendLE32(2, out);  // nlink
+  AppendLE16(listing_size + 3, out);
+  AppendLE16(listing_offset, out);
+  AppendLE32(1, out);  // parent inode
+}
+
+void AppendDirectoryEntry(const string& name,
+                          uint16_t inode_offset,
+                          uint16_t type,
+                          brillo::Blob* out) {
+  AppendLE16(inode_offset, out);
+  AppendLE16(0, out);  // inode number difference
+  AppendLE16(type, out);
+  AppendLE16(name.size() - 1, out);
+  out->insert(out->end(), name.begin(), name.end());
+}
+
+}  // namespace
+
+class SquashfsFilesystemTest : public ::testing::Test {
+ protected:
+  // Writes a gzip squashfs image with the files /big, /small and
+  // /etc/update_engine.conf.
+  void SetUp() override {
+    for (size_t i = 0; i < kSquashfsBlockSize; i++)
+      big_.push_back(i % 7);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < kSquashfsBlockSize + 1000; i++) {
+      seed = seed * 1103515245 + 12345;
+      big_.push_back(seed >> 24);
+    }
+    small_.assign(300, 's');
+    // A comment of more than a block before the setting.
+    while (conf_.size() < kSquashfsBlockSize + 100) {
+      Append(brillo::Blob(20, '#'), &conf_);
+      conf_.push_back('\n');
+    }
+    const string kSetting = "PAYLOAD_MINOR_VERSION=1234\n";
+    conf_.insert(conf_.end(), kSetting.begin(), kSetting.end());
+
+    // The superblock is alone in the first block.
+    brillo::Blob image(kSquashfsBlockSize);
+    // The data blocks of /big, one compressed and one stored, and the first
+    // block of /etc/update_engine.conf.
+    big_start_ = image.size();
+    brillo::Blob big_block = Gzip(Slice(big_, 0, kSquashfsBlockSize));
+    Append(big_block, &image);
+    Append(Slice(big_, kSquashfsBlockSize, kSquashfsBlockSize), &image);
+    big_data_size_ = big_block.size() + kSquashfsBlockSize;
+    const uint32_t conf_start = image.size();
+    brillo::Blob conf_block = Gzip(Slice(conf_, 0, kSquashfsBlockSize));
+    Append(conf_block, &image);
+
+    // The fragment with the tails of the three files.
+    brillo::Blob fragment = Slice(big_, 2 * kSquashfsBlockSize, 1000);
+    Append(small_, &fragment);
+    Append(Slice(conf_, kSquashfsBlockSize, conf_.size() - kSquashfsBlockSize),
+           &fragment);
+    fragment_start_ = image.size();
+    brillo::Blob fragment_block = Gzip(fragment);
+    fragment_size_ = fragment_block.size();
+    Append(fragment_block, &image);
+
+    // The directory listings, of /etc and then /, at known inode offsets.
+    const uint16_t kSmallOffset = 40, kConfOffset = 72, kEtcOffset = 108,
+                   kRootOffset = 140;
+    brillo::Blob etc_listing;
+    AppendLE32(0, &etc_listing);  // one entry
+    AppendLE32(0, &etc_listing);
+    AppendLE32(3, &etc_listing);
+    AppendDirectoryEntry("update_engine.conf", kConfOffset, 2, &etc_listing);
+    brillo::Blob root_listing;
+    AppendLE32(2, &root_listing);  // three entries
+    AppendLE32(0, &root_listing);
+    AppendLE32(1, &root_listing);
+    AppendDirectoryEntry("big", 0, 2, &root_listing);
+    AppendDirectoryEntry("etc", kEtcOffset, 1, &root_listing);
+    AppendDirectoryEntry("small", kSmallOffset, 2, &root_listing);
+
+    // The inode table, in a compressed metadata block.
+    brillo::Blob inodes;
+    AppendRegularInode(1, big_start_, 0, big_.size(),
+                       {static_cast<uint32_t>(big_block.size()),
+                        kSquashfsBlockSize | kDataUncompressed},
+                       &inodes);
+    EXPECT_EQ(kSmallOffset, inodes.size());
+    AppendRegularInode(2, 0, 1000, small_.size(), {}, &inodes);
+    EXPECT_EQ(kConfOffset, inodes.size());
+    AppendRegularInode(3, conf_start, 1300, conf_.size(),
+                       {static_cast<uint32_t>(conf_block.size())}, &inodes);
+    EXPECT_EQ(kEtcOffset, inodes.size());
+    AppendDirectoryInode(4, 0, etc_listing.size(), &inodes);
+    EXPECT_EQ(kRootOffset, inodes.size());
+    AppendDirectoryInode(5, etc_listing.size(), root_listing.size(), &inodes);
+    const uint64_t inode_table_start = image.size();
+    brillo::Blob inodes_block = Gzip(inodes);
+    AppendLE16(inodes_block.size(), &image);
+    Append(inodes_block, &image);
+
+    // The directory table, in a stored metadata block.
+    const uint64_t directory_table_start = image.size();
+    AppendLE16(0x8000 | (etc_listing.size() + root_listing.size()), &image);
+    Append(etc_listing, &image);
+    Append(root_listing, &image);
+
+    // The fragment table and its index.
+    const uint64_t fragment_entries_start = image.size();
+    AppendLE16(0x8000 | 16, &image);
+    AppendLE64(fragment_start_, &image);
+    AppendLE32(fragment_size_, &image);
+    AppendLE32(0, &image);
+    const uint64_t fragment_table_start = image.size();
+    AppendLE64(fragment_entries_start, &image);
+    const uint64_t id_table_start = image.size();
+    AppendLE64(0, &image);
+
+    brillo::Blob superblock;
+    AppendLE32(0x73717368, &superblock);
+    AppendLE32(5, &superblock);  // inodes
+    AppendLE32(0, &superblock);  // mkfs_time
+    AppendLE32(kSquashfsBlockSize, &superblock);
+    AppendLE32(1, &superblock);  // fragments
+    AppendLE16(1, &superblock);  // gzip compression
+    AppendLE16(12, &superblock);  // block_log
+    AppendLE16(0, &superblock);  // flags
+    AppendLE16(1, &superblock);  // no_ids
+    AppendLE16(4, &superblock);  // s_major
+    AppendLE16(0, &superblock);  // s_minor
+    AppendLE64(kRootOffset, &superblock);
+    AppendLE64(image.size(), &superblock);  // bytes_used
+    AppendLE64(id_table_start, &superblock);
+    AppendLE64(~0ULL, &superblock);  // xattr_id_table_start
+    AppendLE64(inode_table_start, &superblock);
+    AppendLE64(directory_table_start, &superblock);
+    AppendLE64(fragment_table_start, &superblock);
+    AppendLE64(~0ULL, &superblock);  // lookup_table_start
+    ASSERT_EQ(96U, superblock.size());
+    std::copy(superblock.begin(), superblock.end(), image.begin());
+    image_size_ = image.size();
+
+    image.resize((image.size() + kSquashfsBlockSize - 1) / kSquashfsBlockSize *
+                 kSquashfsBlockSize);
+    ASSERT_TRUE(utils::WriteFile(
+        image_file_.path().c_str(), image.data(), image.size()));
+  }
+
+  test_utils::ScopedTempFile image_file_{"squashfs.XXXXXX"};
+  brillo::Blob big_, small_, conf_;
+  uint32_t big_start_ = 0;
+  uint64_t big_data_size_ = 0;
+  uint64_t fragment_start_ = 0;
+  uint32_t fragment_size_ = 0;
+  uint64_t image_size_ = 0;
+};
+
+TEST_F(SquashfsFilesystemTest, InvalidFilesystem) {
+  test_utils::ScopedTempFile file;
+  brillo::Blob zeros(4096);
+  ASSERT_TRUE(utils::WriteFile(file.path().c_str(), zeros.data(), 4096));
+  EXPECT_EQ(nullptr, SquashfsFilesystem::CreateFromFile(file.path()));
+  EXPECT_EQ(nullptr, SquashfsFilesystem::CreateFromFile("/non-existent"));
+}
+
+TEST_F(SquashfsFilesystemTest, UnsupportedCompressionTest) {
+  // Change the compression to lzo.
+  brillo::Blob image;
+  ASSERT_TRUE(utils::ReadFile(image_file_.path(), &image));
+  image[20] = 3;
+  ASSERT_TRUE(utils::WriteFile(
+      image_file_.path().c_str(), image.data(), image.size()));
+  EXPECT_EQ(nullptr, SquashfsFilesystem::CreateFromFile(image_file_.path()));
+}
+
+TEST_F(SquashfsFilesystemTest, GetFilesTest) {
+  unique_ptr<SquashfsFilesystem> fs =
+      SquashfsFilesystem::CreateFromFile(image_file_.path());
+  ASSERT_NE(nullptr, fs);
+  EXPECT_EQ(4096U, fs->GetBlockSize());
+  EXPECT_EQ((image_size_ + 4095) / 4096, fs->GetBlockCount());
+
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  map<string, FilesystemInterface::File> map_files;
+  for (const FilesystemInterface::File& file : files) {
+    EXPECT_EQ(map_files.end(), map_files.find(file.name)) << file.name;
+    map_files[file.name] = file;
+  }
+  EXPECT_EQ(5U, map_files.size());
+
+  const FilesystemInterface::File& big = map_files["/big"];
+  EXPECT_EQ(1U, big.file_stat.st_ino);
+  EXPECT_EQ(big_.size(), static_cast<size_t>(big.file_stat.st_size));
+  EXPECT_TRUE(S_ISREG(big.file_stat.st_mode));
+  EXPECT_EQ((vector<Extent>{ExtentForRange(
+                1, (big_start_ + big_data_size_ + 4095) / 4096 - 1)}),
+            big.extents);
+  // The data of /small is all in the fragment.
+  EXPECT_TRUE(map_files["/small"].extents.empty());
+
+  // The first block of /etc/update_engine.conf and of the fragment are shared
+  // with the data before them, listed first, so they only get the rest.
+  ExtentRanges previous_blocks;
+  previous_blocks.AddExtents(big.extents);
+  const uint64_t conf_first_block = (big_start_ + big_data_size_) / 4096;
+  EXPECT_TRUE(previous_blocks.ContainsBlock(conf_first_block));
+  for (const Extent& extent : map_files["/etc/update_engine.conf"].extents)
+    EXPECT_GT(extent.start_block(), conf_first_block);
+  previous_blocks.AddExtents(map_files["/etc/update_engine.conf"].extents);
+  const uint64_t fragment_first_block = fragment_start_ / 4096;
+  EXPECT_EQ(
+      FilterExtentRanges(
+          {ExtentForRange(fragment_first_block,
+                          (fragment_start_ + fragment_size_ + 4095) / 4096 -
+                              fragment_first_block)},
+          previous_blocks),
+      map_files["<fragment-0>"].extents);
+
+  // All the blocks are in some file, and in only one.
+  ExtentRanges data_blocks;
+  uint64_t num_data_blocks = 0;
+  for (const FilesystemInterface::File& file : files) {
+    if (file.name != "<metadata>") {
+      data_blocks.AddExtents(file.extents);
+      num_data_blocks += BlocksInExtents(file.extents);
+    }
+  }
+  EXPECT_EQ(num_data_blocks, data_blocks.blocks());
+  EXPECT_EQ((vector<Extent>{ExtentForRange(0, 1)}),
+            map_files["<metadata>"].extents);
+  ExtentRanges all_blocks = data_blocks;
+  all_blocks.AddExtents(map_files["<metadata>"].extents);
+  EXPECT_EQ(fs->GetBlockCount(), all_blocks.blocks());
+  EXPECT_EQ(data_blocks.blocks() + BlocksInExtents(
+                                       map_files["<metadata>"].extents),
+            all_blocks.blocks());
+}
+
+TEST_F(SquashfsFilesystemTest, LoadSettingsTest) {
+  unique_ptr<SquashfsFilesystem> fs =
+      SquashfsFilesystem::CreateFromFile(image_file_.path());
+  ASSERT_NE(nullptr, fs);
+  brillo::KeyValueStore store;
+  EXPECT_TRUE(fs->LoadSettings(&store));
+  string minor_version;
+  EXPECT_TRUE(store.GetString("PAYLOAD_MINOR_VERSION", &minor_version));
+  EXPECT_EQ("1234", minor_version);
+}
+
+}  // namespace chromeos_update_engine
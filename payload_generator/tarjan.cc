@@ -34,42 +34,60 @@ const vector<Vertex>::size_type kInvalidIndex = -1;
 void TarjanAlgorithm::Execute(Vertex::Index vertex,
                               Graph* graph,
                               vector<Vertex::Index>* out) {
+  Execute(vertex, CompactGraph(*graph), 0, out);
+}
+
+void TarjanAlgorithm::Execute(Vertex::Index vertex,
+                              const CompactGraph& graph,
+                              Vertex::Index min_vertex,
+                              vector<Vertex::Index>* out) {
   stack_.clear();
   components_.clear();
   index_ = 0;
-  for (Graph::iterator it = graph->begin(); it != graph->end(); ++it)
-    it->index = it->lowlink = kInvalidIndex;
+  if (indexes_.size() != graph.size()) {
+    indexes_.assign(graph.size(), kInvalidIndex);
+    lowlinks_.assign(graph.size(), kInvalidIndex);
+    on_stack_.assign(graph.size(), false);
+  } else {
+    for (Vertex::Index visited : visited_)
+      indexes_[visited] = lowlinks_[visited] = kInvalidIndex;
+  }
+  visited_.clear();
   required_vertex_ = vertex;
+  min_vertex_ = min_vertex;
 
   Tarjan(vertex, graph);
   if (!components_.empty())
     out->swap(components_[0]);
 }
 
-void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph* graph) {
-  CHECK_EQ((*graph)[vertex].index, kInvalidIndex);
-  (*graph)[vertex].index = index_;
-  (*graph)[vertex].lowlink = index_;
+void TarjanAlgorithm::Tarjan(Vertex::Index vertex, const CompactGraph& graph) {
+  CHECK_EQ(indexes_[vertex], kInvalidIndex);
+  indexes_[vertex] = index_;
+  lowlinks_[vertex] = index_;
+  visited_.push_back(vertex);
   index_++;
   stack_.push_back(vertex);
-  for (Vertex::EdgeMap::iterator it = (*graph)[vertex].out_edges.begin();
-       it != (*graph)[vertex].out_edges.end(); ++it) {
-    Vertex::Index vertex_next = it->first;
-    if ((*graph)[vertex_next].index == kInvalidIndex) {
+  on_stack_[vertex] = true;
+  for (size_t edge = graph.edges_begin(vertex); edge < graph.edges_end(vertex);
+       edge++) {
+    Vertex::Index vertex_next = graph.target(edge);
+    if (vertex_next < min_vertex_)
+      continue;
+    if (indexes_[vertex_next] == kInvalidIndex) {
       Tarjan(vertex_next, graph);
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].lowlink);
-    } else if (utils::VectorContainsValue(stack_, vertex_next)) {
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].index);
+      lowlinks_[vertex] = min(lowlinks_[vertex], lowlinks_[vertex_next]);
+    } else if (on_stack_[vertex_next]) {
+      lowlinks_[vertex] = min(lowlinks_[vertex], indexes_[vertex_next]);
     }
   }
-  if ((*graph)[vertex].lowlink == (*graph)[vertex].index) {
+  if (lowlinks_[vertex] == indexes_[vertex]) {
     vector<Vertex::Index> component;
     Vertex::Index other_vertex;
     do {
       other_vertex = stack_.back();
       stack_.pop_back();
+      on_stack_[other_vertex] = false;
       component.push_back(other_vertex);
     } while (other_vertex != vertex && !stack_.empty());
 
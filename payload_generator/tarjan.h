@@ -26,25 +26,42 @@
 
 #include <vector>
 
+#include "update_engine/payload_generator/compact_graph.h"
 #include "update_engine/payload_generator/graph_types.h"
 
 namespace chromeos_update_engine {
 
 class TarjanAlgorithm {
  public:
-  TarjanAlgorithm() : index_(0), required_vertex_(0) {}
+  TarjanAlgorithm() : index_(0), required_vertex_(0), min_vertex_(0) {}
 
   // 'out' is set to the result if there is one, otherwise it's untouched.
   void Execute(Vertex::Index vertex,
                Graph* graph,
                std::vector<Vertex::Index>* out);
+
+  // Same as above, in the subgraph of |graph| induced by the vertices from
+  // |min_vertex| on.
+  void Execute(Vertex::Index vertex,
+               const CompactGraph& graph,
+               Vertex::Index min_vertex,
+               std::vector<Vertex::Index>* out);
+
  private:
-  void Tarjan(Vertex::Index vertex, Graph* graph);
+  void Tarjan(Vertex::Index vertex, const CompactGraph& graph);
 
   Vertex::Index index_;
   Vertex::Index required_vertex_;
+  Vertex::Index min_vertex_;
   std::vector<Vertex::Index> stack_;
   std::vector<std::vector<Vertex::Index>> components_;
+
+  // The index and lowlink of every vertex, and whether it is in |stack_|.
+  // Only the |visited_| vertices are reset for the next run.
+  std::vector<Vertex::Index> indexes_;
+  std::vector<Vertex::Index> lowlinks_;
+  std::vector<bool> on_stack_;
+  std::vector<Vertex::Index> visited_;
 };
 
 }  // namespace chromeos_update_engine
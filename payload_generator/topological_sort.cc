@@ -16,40 +16,42 @@
 
 #include "update_engine/payload_generator/topological_sort.h"
 
-#include <set>
+#include <utility>
 #include <vector>
 
-#include <base/logging.h>
+#include "update_engine/payload_generator/compact_graph.h"
 
-using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
 
-namespace {
-void TopologicalSortVisit(const Graph& graph,
-                          set<Vertex::Index>* visited_nodes,
-                          vector<Vertex::Index>* nodes,
-                          Vertex::Index node) {
-  if (visited_nodes->find(node) != visited_nodes->end())
-    return;
-
-  visited_nodes->insert(node);
-  // Visit all children.
-  for (Vertex::EdgeMap::const_iterator it = graph[node].out_edges.begin();
-       it != graph[node].out_edges.end(); ++it) {
-    TopologicalSortVisit(graph, visited_nodes, nodes, it->first);
-  }
-  // Visit this node.
-  nodes->push_back(node);
-}
-}  // namespace
-
 void TopologicalSort(const Graph& graph, vector<Vertex::Index>* out) {
-  set<Vertex::Index> visited_nodes;
+  const CompactGraph compact_graph(graph);
+  vector<bool> visited_nodes(graph.size(), false);
 
+  // The depth first search is done with an explicit stack of the visited
+  // nodes and their next out-edge, to not run out of stack on long paths.
+  vector<std::pair<Vertex::Index, size_t>> stack;
   for (Vertex::Index i = 0; i < graph.size(); i++) {
-    TopologicalSortVisit(graph, &visited_nodes, out, i);
+    if (visited_nodes[i])
+      continue;
+    visited_nodes[i] = true;
+    stack.emplace_back(i, compact_graph.edges_begin(i));
+    while (!stack.empty()) {
+      Vertex::Index node = stack.back().first;
+      size_t* next_edge = &stack.back().second;
+      if (*next_edge == compact_graph.edges_end(node)) {
+        // Visit this node after all its children.
+        out->push_back(node);
+        stack.pop_back();
+        continue;
+      }
+      Vertex::Index child = compact_graph.target((*next_edge)++);
+      if (!visited_nodes[child]) {
+        visited_nodes[child] = true;
+        stack.emplace_back(child, compact_graph.edges_begin(child));
+      }
+    }
   }
 }
 
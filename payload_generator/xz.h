@@ -17,6 +17,9 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <brillo/secure_blob.h>
 
 namespace chromeos_update_engine {
@@ -25,8 +28,20 @@ namespace chromeos_update_engine {
 // XzCompress().
 void XzCompressInit();
 
+// Sets the number of threads used by XzCompress() to compress a large input,
+// or zero to use one per processor. Inputs are compressed in a single thread
+// by default.
+void XzCompressSetThreads(size_t num_threads);
+
+// Sets the xz preset |level| used by XzCompress() and the largest dictionary
+// size of its streams, or zero to use the one of the level. The dictionary is
+// what the decompressor allocates. Level 6 is used by default.
+void XzCompressSetLevel(int level, uint32_t dict_size);
+
 // Compresses the input buffer |in| into |out| with xz. The compressed stream
-// will be the equivalent of running xz -9 --check=none
+// will be the equivalent of running xz -9 --check=none. Large inputs are split
+// in blocks of the same xz stream compressed in parallel, if more than one
+// thread was set with XzCompressSetThreads().
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
 
 }  // namespace chromeos_update_engine
@@ -14,36 +14,84 @@
 // limitations under the License.
 //
 
+
 #include "update_engine/payload_generator/xz.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <7zCrc.h>
+#include <Lzma2Enc.h>
 #include <Xz.h>
 #include <XzEnc.h>
 
 #include <algorithm>
+#include <vector>
 
 #include <base/logging.h>
+#include <base/threading/simple_thread.h>
+
+#include "update_engine/payload_generator/generation_profile.h"
 
 namespace {
 
 bool xz_initialized = false;
 
-// An ISeqInStream implementation that reads all the data from the passed Blob.
+// The number of threads used to compress a single input.
+size_t xz_num_threads = 1;
+
+// LZMA compression "level 6" requires 9 MB of RAM to decompress in the worst
+// case.
+const int kXzLevel = 6;
+
+// The compression level and the largest dictionary size, or zero to use the
+// one of the level.
+int xz_level = kXzLevel;
+uint32_t xz_dict_size = 0;
+
+// The input is split in blocks of at least this size to compress them in
+// parallel, so the compression ratio isn't much worse than with a single
+// block. This is twice the dictionary size of level 6.
+const size_t kMinParallelBlockSize = 16 * 1024 * 1024;  // 16 MiB
+
+// The xz stream magics and the stream flags, with no check.
+const uint8_t kXzHeaderMagic[] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+const uint8_t kXzFooterMagic[] = {'Y', 'Z'};
+const uint8_t kXzStreamFlags[] = {0x00, XZ_CHECK_NO};
+
+// The filter ID of LZMA2 in the xz block headers.
+const uint8_t kXzLzma2FilterId = 0x21;
+
+void* SzAlloc(void* p, size_t size) {
+  return malloc(size);
+}
+
+void SzFree(void* p, void* address) {
+  free(address);
+}
+
+ISzAlloc xz_alloc = {SzAlloc, SzFree};
+
+// An ISeqInStream implementation that reads all the passed data.
 struct BlobReaderStream : public ISeqInStream {
-  explicit BlobReaderStream(const brillo::Blob& data) : data_(data) {
+  explicit BlobReaderStream(const brillo::Blob& data)
+      : BlobReaderStream(data.data(), data.size()) {}
+  BlobReaderStream(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {
     Read = &BlobReaderStream::ReadStatic;
   }
 
   static SRes ReadStatic(void* p, void* buf, size_t* size) {
     auto* self =
         static_cast<BlobReaderStream*>(reinterpret_cast<ISeqInStream*>(p));
-    *size = std::min(*size, self->data_.size() - self->pos_);
-    memcpy(buf, self->data_.data() + self->pos_, *size);
+    *size = std::min(*size, self->size_ - self->pos_);
+    memcpy(buf, self->data_ + self->pos_, *size);
     self->pos_ += *size;
     return SZ_OK;
   }
 
-  const brillo::Blob& data_;
+  const uint8_t* data_;
+  size_t size_;
 
   // The current reader position.
   size_t pos_ = 0;
@@ -67,6 +115,155 @@ struct BlobWriterStream : public ISeqOutStream {
   brillo::Blob* data_;
 };
 
+// Sets the LZMA2 compression properties used for |size| bytes of input.
+void InitLzma2Props(size_t size, CLzma2EncProps* lzma2_props) {
+  Lzma2EncProps_Init(lzma2_props);
+  lzma2_props->lzmaProps.level = xz_level;
+  if (xz_dict_size)
+    lzma2_props->lzmaProps.dictSize = xz_dict_size;
+  lzma2_props->lzmaProps.numThreads = 1;
+  // The input size data is used to reduce the dictionary size if possible.
+  lzma2_props->lzmaProps.reduceSize = size;
+  Lzma2EncProps_Normalize(lzma2_props);
+}
+
+// Appends the little endian |value| to |out|.
+void AppendUint32(uint32_t value, brillo::Blob* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(value & 0xFF);
+    value >>= 8;
+  }
+}
+
+// Appends the CRC32 of the bytes of |out| starting at |offset| to |out|.
+void AppendCrc32(size_t offset, brillo::Blob* out) {
+  AppendUint32(CrcCalc(out->data() + offset, out->size() - offset), out);
+}
+
+// Appends |value| encoded as a xz variable length integer to |out|.
+void AppendVarint(uint64_t value, brillo::Blob* out) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+// Pads |out| with zeros to a multiple of four bytes, counting |size| bytes.
+void AppendPadding(size_t size, brillo::Blob* out) {
+  out->insert(out->end(), (4 - size % 4) % 4, 0);
+}
+
+// This class compresses one block of the input into a raw LZMA2 stream from a
+// worker thread.
+class XzBlockCompressor : public base::DelegateSimpleThread::Delegate {
+ public:
+  XzBlockCompressor(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {}
+  XzBlockCompressor(XzBlockCompressor&&) = default;
+  ~XzBlockCompressor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    CLzma2EncHandle encoder = Lzma2Enc_Create(&xz_alloc, &xz_alloc);
+    if (!encoder)
+      return;
+    CLzma2EncProps lzma2_props;
+    InitLzma2Props(size_, &lzma2_props);
+    BlobReaderStream in_reader(data_, size_);
+    BlobWriterStream out_writer(&compressed_);
+    if (Lzma2Enc_SetProps(encoder, &lzma2_props) == SZ_OK) {
+      dict_props_ = Lzma2Enc_WriteProperties(encoder);
+      success_ = Lzma2Enc_Encode(encoder, &out_writer, &in_reader, nullptr) ==
+                 SZ_OK;
+    }
+    Lzma2Enc_Destroy(encoder);
+  }
+
+  size_t size() const { return size_; }
+  const brillo::Blob& compressed() const { return compressed_; }
+  uint8_t dict_props() const { return dict_props_; }
+  bool success() const { return success_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+
+  brillo::Blob compressed_;
+  uint8_t dict_props_{0};
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(XzBlockCompressor);
+};
+
+// Compresses |in| into |out| as a xz stream of |num_blocks| blocks compressed
+// in parallel. Each block is an independent LZMA2 stream, which any xz decoder
+// supports.
+bool XzCompressBlocks(const brillo::Blob& in,
+                      size_t num_blocks,
+                      brillo::Blob* out) {
+  const size_t block_size = (in.size() + num_blocks - 1) / num_blocks;
+  std::vector<XzBlockCompressor> compressors;
+  compressors.reserve(num_blocks);
+  for (size_t offset = 0; offset < in.size(); offset += block_size) {
+    compressors.emplace_back(in.data() + offset,
+                             std::min(block_size, in.size() - offset));
+  }
+
+  base::DelegateSimpleThreadPool thread_pool("xz-compress", num_blocks);
+  thread_pool.Start();
+  for (XzBlockCompressor& compressor : compressors)
+    thread_pool.AddWork(&compressor);
+  thread_pool.JoinAll();
+
+  out->assign(std::begin(kXzHeaderMagic), std::end(kXzHeaderMagic));
+  out->insert(out->end(), std::begin(kXzStreamFlags), std::end(kXzStreamFlags));
+  AppendCrc32(sizeof(kXzHeaderMagic), out);
+
+  // Each block header only has the LZMA2 filter flags, without the optional
+  // sizes. The index records the unpadded size of each block, which doesn't
+  // include the block padding.
+  brillo::Blob index = {0x00};
+  AppendVarint(compressors.size(), &index);
+  for (const XzBlockCompressor& compressor : compressors) {
+    if (!compressor.success()) {
+      LOG(ERROR) << "Failed to compress a xz block.";
+      return false;
+    }
+    const size_t header_offset = out->size();
+    const uint8_t kHeaderSize = 12;
+    out->insert(out->end(),
+                {kHeaderSize / 4 - 1,  // Encoded header size.
+                 0x00,                 // One filter, no sizes.
+                 kXzLzma2FilterId,
+                 0x01,                 // Size of the filter properties.
+                 compressor.dict_props()});
+    AppendPadding(out->size() - header_offset, out);
+    AppendCrc32(header_offset, out);
+    out->insert(out->end(),
+                compressor.compressed().begin(),
+                compressor.compressed().end());
+    const size_t unpadded_size = kHeaderSize + compressor.compressed().size();
+    AppendPadding(unpadded_size, out);
+
+    AppendVarint(unpadded_size, &index);
+    AppendVarint(compressor.size(), &index);
+  }
+  AppendPadding(index.size(), &index);
+  AppendCrc32(0, &index);
+  out->insert(out->end(), index.begin(), index.end());
+
+  // The stream footer has the CRC32 of the backward size and the flags.
+  brillo::Blob footer;
+  AppendUint32(index.size() / 4 - 1, &footer);
+  footer.insert(
+      footer.end(), std::begin(kXzStreamFlags), std::end(kXzStreamFlags));
+  AppendUint32(CrcCalc(footer.data(), footer.size()), out);
+  out->insert(out->end(), footer.begin(), footer.end());
+  out->insert(out->end(), std::begin(kXzFooterMagic), std::end(kXzFooterMagic));
+  return true;
+}
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -81,12 +278,29 @@ void XzCompressInit() {
   CrcGenerateTable();
 }
 
+void XzCompressSetThreads(size_t num_threads) {
+  if (num_threads == 0)
+    num_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  xz_num_threads = num_threads;
+}
+
+void XzCompressSetLevel(int level, uint32_t dict_size) {
+  xz_level = level;
+  xz_dict_size = dict_size;
+}
+
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  ScopedProfilePhase profile_phase("XzCompress", in.size());
   CHECK(xz_initialized) << "Initialize XzCompress first";
   out->clear();
   if (in.empty())
     return true;
 
+  const size_t num_blocks =
+      std::min(xz_num_threads, in.size() / kMinParallelBlockSize);
+  if (num_blocks > 1)
+    return XzCompressBlocks(in, num_blocks, out);
+
   // Xz compression properties.
   CXzProps props;
   XzProps_Init(&props);
@@ -98,14 +312,7 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   // LZMA2 compression properties.
   CLzma2EncProps lzma2Props;
   props.lzma2Props = &lzma2Props;
-  Lzma2EncProps_Init(&lzma2Props);
-  // LZMA compression "level 6" requires 9 MB of RAM to decompress in the worst
-  // case.
-  lzma2Props.lzmaProps.level = 6;
-  lzma2Props.lzmaProps.numThreads = 1;
-  // The input size data is used to reduce the dictionary size if possible.
-  lzma2Props.lzmaProps.reduceSize = in.size();
-  Lzma2EncProps_Normalize(&lzma2Props);
+  InitLzma2Props(in.size(), &lzma2Props);
 
   BlobWriterStream out_writer(out);
   BlobReaderStream in_reader(in);
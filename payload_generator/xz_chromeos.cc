@@ -20,6 +20,10 @@ namespace chromeos_update_engine {
 
 void XzCompressInit() {}
 
+void XzCompressSetThreads(size_t num_threads) {}
+
+void XzCompressSetLevel(int level, uint32_t dict_size) {}
+
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   // No Xz compressor implementation in Chrome OS delta_generator builds.
   return false;
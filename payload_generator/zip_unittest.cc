@@ -27,8 +27,10 @@
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using chromeos_update_engine::test_utils::kRandomString;
 using std::string;
@@ -113,11 +115,24 @@ class ZipTest<XzTest> : public ::testing::Test {
   }
 };
 
+class ZstdTest {};
+
+template <>
+class ZipTest<ZstdTest> : public ::testing::Test {
+ public:
+  bool ZipCompress(const brillo::Blob& in, brillo::Blob* out) const {
+    return ZstdCompress(in, out);
+  }
+  bool ZipDecompress(const brillo::Blob& in, brillo::Blob* out) const {
+    return DecompressWithWriter<ZstdExtentWriter>(in, out);
+  }
+};
+
 #ifdef __ANDROID__
-typedef ::testing::Types<BzipTest, XzTest> ZipTestTypes;
+typedef ::testing::Types<BzipTest, XzTest, ZstdTest> ZipTestTypes;
 #else
 // Chrome OS implementation of Xz compressor just returns false.
-typedef ::testing::Types<BzipTest> ZipTestTypes;
+typedef ::testing::Types<BzipTest, ZstdTest> ZipTestTypes;
 #endif  // __ANDROID__
 
 TYPED_TEST_CASE(ZipTest, ZipTestTypes);
@@ -168,4 +183,23 @@ TYPED_TEST(ZipTest, EmptyInputsTest) {
   EXPECT_EQ(0U, out.size());
 }
 
+#ifdef __ANDROID__
+TEST(XzTest, MultipleBlocksTest) {
+  // Large inputs are compressed as several xz blocks in parallel, which
+  // XzExtentWriter decodes as a single stream.
+  brillo::Blob in;
+  in.reserve(40 * 1024 * 1024);
+  while (in.size() < 40 * 1024 * 1024)
+    in.insert(in.end(), std::begin(kRandomString), std::end(kRandomString));
+  XzCompressSetThreads(4);
+  brillo::Blob out;
+  EXPECT_TRUE(XzCompress(in, &out));
+  XzCompressSetThreads(1);
+  EXPECT_LT(out.size(), in.size());
+  brillo::Blob decompressed;
+  EXPECT_TRUE(DecompressWithWriter<XzExtentWriter>(out, &decompressed));
+  EXPECT_EQ(in, decompressed);
+}
+#endif  // __ANDROID__
+
 }  // namespace chromeos_update_engine
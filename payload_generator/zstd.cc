@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Level 19 is the highest level before the "ultra" ones, which need windows of
+// up to 128 MiB on the device. It uses a window of 8 MiB, and the level doesn't
+// affect the decompression speed.
+const int kZstdLevel = 19;
+
+// The dictionary set with ZstdCompressSetDictionary(), before the threads
+// compressing the operations start.
+const ZstdDictionary* zstd_dictionary = nullptr;
+
+}  // namespace
+
+const size_t ZstdDictionary::kMaxDataSize;
+
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out) {
+  ScopedProfilePhase profile_phase("ZstdCompress", in.size());
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.size() == 0)
+    return true;
+
+  out->resize(ZSTD_compressBound(in.size()));
+  size_t rc = ZSTD_compress(out->data(), out->size(), in.data(), in.size(),
+                            kZstdLevel);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "ZSTD_compress failed: " << ZSTD_getErrorName(rc);
+    out->clear();
+    return false;
+  }
+  out->resize(rc);
+  return true;
+}
+
+ZstdDictionary::ZstdDictionary(const brillo::Blob& data, uint32_t id)
+    : data_(data), id_(id) {}
+
+ZstdDictionary::~ZstdDictionary() {
+  ZSTD_freeCDict(cdict_);
+}
+
+std::unique_ptr<ZstdDictionary> ZstdDictionary::Train(
+    const vector<brillo::Blob>& samples, size_t max_size) {
+  ScopedProfilePhase profile_phase("ZstdDictionary::Train");
+  brillo::Blob samples_data;
+  vector<size_t> sample_sizes;
+  for (const brillo::Blob& sample : samples) {
+    samples_data.insert(samples_data.end(), sample.begin(), sample.end());
+    sample_sizes.push_back(sample.size());
+  }
+  brillo::Blob data(max_size);
+  size_t rc = ZDICT_trainFromBuffer(data.data(),
+                                    data.size(),
+                                    samples_data.data(),
+                                    sample_sizes.data(),
+                                    sample_sizes.size());
+  if (ZDICT_isError(rc)) {
+    LOG(WARNING) << "Unable to train a zstd dictionary from "
+                 << sample_sizes.size() << " samples: "
+                 << ZDICT_getErrorName(rc);
+    return nullptr;
+  }
+  data.resize(rc);
+
+  std::unique_ptr<ZstdDictionary> dictionary(
+      new ZstdDictionary(data, ZDICT_getDictID(data.data(), data.size())));
+  dictionary->cdict_ = ZSTD_createCDict(data.data(), data.size(), kZstdLevel);
+  if (!dictionary->cdict_) {
+    LOG(ERROR) << "Unable to load the trained zstd dictionary.";
+    return nullptr;
+  }
+  LOG(INFO) << "Trained a zstd dictionary of " << data.size() << " bytes from "
+            << sample_sizes.size() << " samples of " << samples_data.size()
+            << " bytes.";
+  return dictionary;
+}
+
+bool ZstdDictionary::Compress(const brillo::Blob& in, brillo::Blob* out) const {
+  ScopedProfilePhase profile_phase("ZstdDictionary::Compress", in.size());
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.size() == 0)
+    return true;
+
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  TEST_AND_RETURN_FALSE(cctx != nullptr);
+  out->resize(ZSTD_compressBound(in.size()));
+  size_t rc = ZSTD_compress_usingCDict(
+      cctx, out->data(), out->size(), in.data(), in.size(), cdict_);
+  ZSTD_freeCCtx(cctx);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "ZSTD_compress_usingCDict failed: " << ZSTD_getErrorName(rc);
+    out->clear();
+    return false;
+  }
+  out->resize(rc);
+  return true;
+}
+
+void ZstdCompressSetDictionary(const ZstdDictionary* dictionary) {
+  zstd_dictionary = dictionary;
+}
+
+const ZstdDictionary* ZstdCompressDictionary() {
+  return zstd_dictionary;
+}
+
+uint32_t ZstdFrameDictionaryId(const brillo::Blob& frame) {
+  return ZSTD_getDictID_fromFrame(frame.data(), frame.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+struct ZSTD_CDict_s;
+
+namespace chromeos_update_engine {
+
+// Compresses the input buffer |in| into |out| as a single zstd frame. The
+// frame needs a window of at most 8 MiB to be decompressed.
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out);
+
+// A zstd dictionary trained from samples of the data compressed against it,
+// loaded once to compress many small inputs from several threads. The frames
+// compressed against it start with much better statistics than an empty
+// history, which is what the small inputs lack.
+class ZstdDictionary {
+ public:
+  // The largest inputs compressed against the dictionary. The bigger ones
+  // build their own history and barely gain from it.
+  static const size_t kMaxDataSize = 64 * 1024;
+
+  ~ZstdDictionary();
+
+  // Trains a dictionary of up to |max_size| bytes from the |samples|. Returns
+  // nullptr if they aren't enough to train one.
+  static std::unique_ptr<ZstdDictionary> Train(
+      const std::vector<brillo::Blob>& samples, size_t max_size);
+
+  // Compresses |in| into |out| as a single zstd frame compressed against the
+  // dictionary, whose header records the id() of the dictionary.
+  bool Compress(const brillo::Blob& in, brillo::Blob* out) const;
+
+  const brillo::Blob& data() const { return data_; }
+
+  // The id of the dictionary, derived from its contents.
+  uint32_t id() const { return id_; }
+
+ private:
+  ZstdDictionary(const brillo::Blob& data, uint32_t id);
+
+  brillo::Blob data_;
+  uint32_t id_;
+  ZSTD_CDict_s* cdict_{nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdDictionary);
+};
+
+// Sets the dictionary the full operations compress their small inputs against
+// with REPLACE_ZSTD, or nullptr to not use any, the default. The |dictionary|
+// must outlive the generation of the operations.
+void ZstdCompressSetDictionary(const ZstdDictionary* dictionary);
+
+// Returns the dictionary set with ZstdCompressSetDictionary(), if any.
+const ZstdDictionary* ZstdCompressDictionary();
+
+// Returns the id of the dictionary the zstd |frame| was compressed against,
+// or 0 if none.
+uint32_t ZstdFrameDictionaryId(const brillo::Blob& frame);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Decompresses the single zstd |frame| of |size| bytes into |out|, against the
+// |dictionary| if not null.
+bool Decompress(const brillo::Blob& frame,
+                size_t size,
+                const ZstdDictionary* dictionary,
+                brillo::Blob* out) {
+  out->resize(size);
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  if (!dctx)
+    return false;
+  size_t rc = ZSTD_decompress_usingDict(
+      dctx, out->data(), out->size(), frame.data(), frame.size(),
+      dictionary ? dictionary->data().data() : nullptr,
+      dictionary ? dictionary->data().size() : 0);
+  ZSTD_freeDCtx(dctx);
+  if (ZSTD_isError(rc))
+    return false;
+  out->resize(rc);
+  return true;
+}
+
+// Small files sharing most of their contents, like the configuration files
+// of a partition.
+vector<brillo::Blob> PropertySamples() {
+  vector<brillo::Blob> samples;
+  for (int i = 0; i < 200; i++) {
+    string text;
+    for (int line = 0; line < 20; line++)
+      text += base::StringPrintf("ro.property.%d.value=%d\n", line, i * line);
+    samples.emplace_back(text.begin(), text.end());
+  }
+  return samples;
+}
+
+}  // namespace
+
+class ZstdTest : public ::testing::Test {
+ protected:
+  void TearDown() override { ZstdCompressSetDictionary(nullptr); }
+};
+
+TEST_F(ZstdTest, RoundTripTest) {
+  brillo::Blob in(1024 * 1024, 'a');
+  std::copy(std::begin(test_utils::kRandomString),
+            std::end(test_utils::kRandomString),
+            in.begin() + 4096);
+  brillo::Blob compressed;
+  EXPECT_TRUE(ZstdCompress(in, &compressed));
+  EXPECT_LT(compressed.size(), in.size() / 100);
+  EXPECT_EQ(0U, ZstdFrameDictionaryId(compressed));
+
+  brillo::Blob decompressed;
+  EXPECT_TRUE(Decompress(compressed, in.size(), nullptr, &decompressed));
+  EXPECT_EQ(in, decompressed);
+}
+
+TEST_F(ZstdTest, EmptyInputTest) {
+  brillo::Blob compressed(10, 'x');
+  EXPECT_TRUE(ZstdCompress(brillo::Blob(), &compressed));
+  EXPECT_TRUE(compressed.empty());
+
+  std::unique_ptr<ZstdDictionary> dictionary =
+      ZstdDictionary::Train(PropertySamples(), 4096);
+  ASSERT_NE(nullptr, dictionary);
+  compressed.assign(10, 'x');
+  EXPECT_TRUE(dictionary->Compress(brillo::Blob(), &compressed));
+  EXPECT_TRUE(compressed.empty());
+}
+
+TEST_F(ZstdTest, DictionaryRoundTripTest) {
+  vector<brillo::Blob> samples = PropertySamples();
+  std::unique_ptr<ZstdDictionary> dictionary =
+      ZstdDictionary::Train(samples, 4096);
+  ASSERT_NE(nullptr, dictionary);
+  EXPECT_LE(dictionary->data().size(), 4096U);
+  EXPECT_NE(0U, dictionary->id());
+
+  brillo::Blob compressed;
+  EXPECT_TRUE(dictionary->Compress(samples[7], &compressed));
+  EXPECT_EQ(dictionary->id(), ZstdFrameDictionaryId(compressed));
+
+  // The dictionary is what makes the small input compress well.
+  brillo::Blob compressed_alone;
+  EXPECT_TRUE(ZstdCompress(samples[7], &compressed_alone));
+  EXPECT_LT(compressed.size(), compressed_alone.size());
+
+  brillo::Blob decompressed;
+  EXPECT_FALSE(
+      Decompress(compressed, samples[7].size(), nullptr, &decompressed));
+  EXPECT_TRUE(Decompress(
+      compressed, samples[7].size(), dictionary.get(), &decompressed));
+  EXPECT_EQ(samples[7], decompressed);
+}
+
+TEST_F(ZstdTest, TrainWithoutSamplesTest) {
+  EXPECT_EQ(nullptr, ZstdDictionary::Train({}, 4096));
+}
+
+TEST_F(ZstdTest, SetDictionaryTest) {
+  EXPECT_EQ(nullptr, ZstdCompressDictionary());
+  std::unique_ptr<ZstdDictionary> dictionary =
+      ZstdDictionary::Train(PropertySamples(), 4096);
+  ASSERT_NE(nullptr, dictionary);
+  ZstdCompressSetDictionary(dictionary.get());
+  EXPECT_EQ(dictionary.get(), ZstdCompressDictionary());
+  ZstdCompressSetDictionary(nullptr);
+  EXPECT_EQ(nullptr, ZstdCompressDictionary());
+}
+
+}  // namespace chromeos_update_engine
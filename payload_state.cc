@@ -20,6 +20,8 @@
 #include <string>
 
 #include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <metrics/metrics_library.h>
@@ -40,6 +42,7 @@ using base::Time;
 using base::TimeDelta;
 using std::min;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -51,6 +54,11 @@ static const int kMaxBackoffDays = 16;
 // We want to randomize retry attempts after the backoff by +/- 6 hours.
 static const uint32_t kMaxBackoffFuzzMinutes = 12 * 60;
 
+// The download progress is persisted once this many bytes were received or
+// this many seconds passed since it was last persisted.
+static const uint64_t kMaxUnpersistedBytes = 4 * 1024 * 1024;
+static const int kMaxUnpersistedSeconds = 10;
+
 PayloadState::PayloadState()
     : prefs_(nullptr),
       using_p2p_for_downloading_(false),
@@ -61,17 +69,22 @@ PayloadState::PayloadState()
       url_failure_count_(0),
       url_switch_count_(0),
       attempt_num_bytes_downloaded_(0),
+      unpersisted_bytes_downloaded_(0),
       attempt_connection_type_(metrics::ConnectionType::kUnknown),
       attempt_error_code_(ErrorCode::kSuccess),
       attempt_type_(AttemptType::kUpdate) {
-  for (int i = 0; i <= kNumDownloadSources; i++)
+  for (int i = 0; i <= kNumDownloadSources; i++) {
     total_bytes_downloaded_[i] = current_bytes_downloaded_[i] = 0;
+    unpersisted_sources_[i] = false;
+  }
 }
 
 bool PayloadState::Initialize(SystemState* system_state) {
   system_state_ = system_state;
   prefs_ = system_state_->prefs();
   powerwash_safe_prefs_ = system_state_->powerwash_safe_prefs();
+  url_history_.reset(new UrlThroughputHistory(prefs_, system_state_->clock()));
+  url_history_->Load();
   LoadResponseSignature();
   LoadPayloadAttemptNumber();
   LoadFullPayloadAttemptNumber();
@@ -97,6 +110,9 @@ bool PayloadState::Initialize(SystemState* system_state) {
 }
 
 void PayloadState::SetResponse(const OmahaResponse& omaha_response) {
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
+
   // Always store the latest response.
   response_ = omaha_response;
 
@@ -117,10 +133,13 @@ void PayloadState::SetResponse(const OmahaResponse& omaha_response) {
     LOG(INFO) << "Resetting all persisted state as this is a new response";
     SetNumResponsesSeen(num_responses_seen_ + 1);
     SetResponseSignature(new_response_signature);
+    OrderCandidateUrls();
     ResetPersistedState();
     return;
   }
 
+  LoadCandidateUrlOrder();
+
   // This is the earliest point at which we can validate whether the URL index
   // we loaded from the persisted state is a valid value. If the response
   // hasn't changed but the URL index is invalid, it's indicative of some
@@ -138,6 +157,7 @@ void PayloadState::SetResponse(const OmahaResponse& omaha_response) {
 }
 
 void PayloadState::SetUsingP2PForDownloading(bool value) {
+  PersistDownloadProgress();
   using_p2p_for_downloading_ = value;
   // Update the current download source which depends on whether we are
   // using p2p or not.
@@ -146,6 +166,8 @@ void PayloadState::SetUsingP2PForDownloading(bool value) {
 
 void PayloadState::DownloadComplete() {
   LOG(INFO) << "Payload downloaded successfully";
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
   IncrementPayloadAttemptNumber();
   IncrementFullPayloadAttemptNumber();
 }
@@ -154,7 +176,7 @@ void PayloadState::DownloadProgress(size_t count) {
   if (count == 0)
     return;
 
-  CalculateUpdateDurationUptime();
+  ScopedPrefsTransaction transaction(prefs_);
   UpdateBytesDownloaded(count);
 
   // We've received non-zero bytes from a recent download operation.  Since our
@@ -174,7 +196,22 @@ void PayloadState::DownloadProgress(size_t count) {
   SetUrlFailureCount(0);
 }
 
+void PayloadState::DownloadTransferEnded(const TransferStats& stats) {
+  last_transfer_stalled_ = stats.transfer_time > TimeDelta() &&
+                           stats.stall_time * 2 > stats.transfer_time;
+  LOG_IF(INFO, last_transfer_stalled_)
+      << "The download stalled for "
+      << utils::FormatTimeDelta(stats.stall_time) << " out of "
+      << utils::FormatTimeDelta(stats.transfer_time);
+  // The transfers from a local peer don't tell about the payload URLs.
+  if (!using_p2p_for_downloading_)
+    url_history_->AddTransfer(GetCurrentUrl(), stats);
+}
+
 void PayloadState::AttemptStarted(AttemptType attempt_type) {
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
+
   // Flush previous state from abnormal attempt failure, if any.
   ReportAndClearPersistedAttemptMetrics();
 
@@ -205,18 +242,24 @@ void PayloadState::AttemptStarted(AttemptType attempt_type) {
 
 void PayloadState::UpdateResumed() {
   LOG(INFO) << "Resuming an update that was previously started.";
+  ScopedPrefsTransaction transaction(prefs_);
   UpdateNumReboots();
   AttemptStarted(AttemptType::kUpdate);
 }
 
 void PayloadState::UpdateRestarted() {
   LOG(INFO) << "Starting a new update";
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
   ResetDownloadSourcesOnNewUpdate();
   SetNumReboots(0);
   AttemptStarted(AttemptType::kUpdate);
 }
 
 void PayloadState::UpdateSucceeded() {
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
+
   // Send the relevant metrics that are tracked in this class to UMA.
   CalculateUpdateDurationUptime();
   SetUpdateTimestampEnd(system_state_->clock()->GetWallclockTime());
@@ -243,6 +286,9 @@ void PayloadState::UpdateSucceeded() {
 }
 
 void PayloadState::UpdateFailed(ErrorCode error) {
+  ScopedPrefsTransaction transaction(prefs_);
+  PersistDownloadProgress();
+
   ErrorCode base_error = utils::GetBaseErrorCode(error);
   LOG(INFO) << "Updating payload state for error code: " << base_error
             << " (" << utils::ErrorCodeToString(base_error) << ")";
@@ -450,6 +496,8 @@ void PayloadState::IncrementUrlIndex() {
     LOG(INFO) << "Resetting the current URL index (" << GetUrlIndex() << ") to "
               << "0 as we only have " << candidate_urls_.size()
               << " candidate URL(s)";
+    // The hosts may have been measured during this round.
+    OrderCandidateUrls();
     SetUrlIndex(0);
     IncrementPayloadAttemptNumber();
     IncrementFullPayloadAttemptNumber();
@@ -464,7 +512,26 @@ void PayloadState::IncrementUrlIndex() {
   SetUrlFailureCount(0);
 }
 
+void PayloadState::SwitchToUrl(uint32_t url_index) {
+  if (url_index >= candidate_urls_.size() || url_index == GetUrlIndex())
+    return;
+  LOG(INFO) << "Switching from URL index " << GetUrlIndex() << " to "
+            << url_index;
+  SetUrlIndex(url_index);
+  SetUrlSwitchCount(url_switch_count_ + 1);
+  SetUrlFailureCount(0);
+}
+
 void PayloadState::IncrementFailureCount() {
+  bool stalled = last_transfer_stalled_;
+  last_transfer_stalled_ = false;
+  if (stalled && candidate_urls_.size() > 1) {
+    LOG(INFO) << "The download from Url" << GetUrlIndex()
+              << " mostly stalled. Trying next available URL";
+    IncrementUrlIndex();
+    return;
+  }
+
   uint32_t next_url_failure_count = GetUrlFailureCount() + 1;
   if (next_url_failure_count < response_.max_failure_count_per_url) {
     LOG(INFO) << "Incrementing the URL failure count";
@@ -533,16 +600,43 @@ void PayloadState::UpdateCurrentDownloadSource() {
 }
 
 void PayloadState::UpdateBytesDownloaded(size_t count) {
-  SetCurrentBytesDownloaded(
-      current_download_source_,
-      GetCurrentBytesDownloaded(current_download_source_) + count,
-      false);
-  SetTotalBytesDownloaded(
-      current_download_source_,
-      GetTotalBytesDownloaded(current_download_source_) + count,
-      false);
-
+  // This runs for every received chunk, so the counters and the uptime are
+  // only updated in memory here and persisted once enough of them piled up.
+  if (current_download_source_ < kNumDownloadSources) {
+    current_bytes_downloaded_[current_download_source_] += count;
+    total_bytes_downloaded_[current_download_source_] += count;
+    unpersisted_sources_[current_download_source_] = true;
+  }
   attempt_num_bytes_downloaded_ += count;
+  unpersisted_bytes_downloaded_ += count;
+
+  Time now = system_state_->clock()->GetMonotonicTime();
+  update_duration_uptime_ += now - update_duration_uptime_timestamp_;
+  update_duration_uptime_timestamp_ = now;
+
+  if (unpersisted_bytes_downloaded_ >= kMaxUnpersistedBytes ||
+      now - progress_persisted_time_ >=
+          TimeDelta::FromSeconds(kMaxUnpersistedSeconds)) {
+    PersistDownloadProgress();
+  }
+}
+
+void PayloadState::PersistDownloadProgress() {
+  if (unpersisted_bytes_downloaded_ == 0)
+    return;
+  ScopedPrefsTransaction transaction(prefs_);
+  SetUpdateDurationUptimeExtended(
+      update_duration_uptime_, update_duration_uptime_timestamp_, false);
+  for (int i = 0; i < kNumDownloadSources; i++) {
+    if (!unpersisted_sources_[i])
+      continue;
+    DownloadSource source = static_cast<DownloadSource>(i);
+    SetCurrentBytesDownloaded(source, current_bytes_downloaded_[i], false);
+    SetTotalBytesDownloaded(source, total_bytes_downloaded_[i], false);
+    unpersisted_sources_[i] = false;
+  }
+  unpersisted_bytes_downloaded_ = 0;
+  progress_persisted_time_ = update_duration_uptime_timestamp_;
 }
 
 PayloadType PayloadState::CalculatePayloadType() {
@@ -1170,6 +1264,7 @@ void PayloadState::ComputeCandidateUrls() {
   }
 
   candidate_urls_.clear();
+  candidate_url_order_.clear();
   for (size_t i = 0; i < response_.payload_urls.size(); i++) {
     string candidate_url = response_.payload_urls[i];
     if (base::StartsWith(candidate_url, "http://",
@@ -1177,6 +1272,7 @@ void PayloadState::ComputeCandidateUrls() {
         !http_url_ok) {
       continue;
     }
+    candidate_url_order_.push_back(candidate_urls_.size());
     candidate_urls_.push_back(candidate_url);
     LOG(INFO) << "Candidate Url" << (candidate_urls_.size() - 1)
               << ": " << candidate_url;
@@ -1186,6 +1282,65 @@ void PayloadState::ComputeCandidateUrls() {
             << "out of " << response_.payload_urls.size() << " URLs supplied";
 }
 
+void PayloadState::OrderCandidateUrls() {
+  SetCandidateUrlOrder(url_history_->OrderUrls(candidate_urls_));
+}
+
+void PayloadState::LoadCandidateUrlOrder() {
+  CHECK(prefs_);
+  string stored_value;
+  if (!prefs_->Exists(kPrefsCandidateUrlOrder) ||
+      !prefs_->GetString(kPrefsCandidateUrlOrder, &stored_value)) {
+    return;
+  }
+  // The persisted order must be a permutation of the candidate URLs, which
+  // are still in the order of the response.
+  vector<size_t> order;
+  vector<bool> seen(candidate_urls_.size(), false);
+  for (const string& index_str : base::SplitString(
+           stored_value, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    unsigned index;
+    if (!base::StringToUint(index_str, &index) || index >= seen.size() ||
+        seen[index]) {
+      break;
+    }
+    seen[index] = true;
+    order.push_back(index);
+  }
+  if (order.size() != candidate_urls_.size()) {
+    LOG(ERROR) << "Ignoring the invalid candidate URL order " << stored_value;
+    return;
+  }
+  SetCandidateUrlOrder(order);
+}
+
+void PayloadState::SetCandidateUrlOrder(const vector<size_t>& order) {
+  CHECK(prefs_);
+  vector<string> urls;
+  vector<size_t> url_order;
+  for (size_t index : order) {
+    urls.push_back(candidate_urls_[index]);
+    url_order.push_back(candidate_url_order_[index]);
+  }
+  candidate_urls_.swap(urls);
+  candidate_url_order_.swap(url_order);
+
+  bool in_response_order = true;
+  vector<string> order_strs;
+  for (size_t i = 0; i < candidate_url_order_.size(); i++) {
+    in_response_order &= candidate_url_order_[i] == i;
+    order_strs.push_back(base::SizeTToString(candidate_url_order_[i]));
+  }
+  if (in_response_order) {
+    prefs_->Delete(kPrefsCandidateUrlOrder);
+    return;
+  }
+  const string stored_value = base::JoinString(order_strs, ",");
+  LOG(INFO) << "Trying the candidate URLs in the order " << stored_value
+            << " of the response.";
+  prefs_->SetString(kPrefsCandidateUrlOrder, stored_value);
+}
+
 void PayloadState::CreateSystemUpdatedMarkerFile() {
   CHECK(prefs_);
   int64_t value = system_state_->clock()->GetWallclockTime().ToInternalValue();
@@ -1282,6 +1437,7 @@ void PayloadState::ReportFailedBootIfNeeded() {
 }
 
 void PayloadState::ExpectRebootInNewVersion(const string& target_version_uid) {
+  ScopedPrefsTransaction transaction(prefs_);
   // Expect to boot into the new partition in the next reboot setting the
   // TargetVersion* flags in the Prefs.
   string stored_target_version_uid;
@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_STATE_H_
 #define UPDATE_ENGINE_PAYLOAD_STATE_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -26,6 +27,7 @@
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/metrics.h"
 #include "update_engine/payload_state_interface.h"
+#include "update_engine/url_throughput_history.h"
 
 namespace chromeos_update_engine {
 
@@ -52,6 +54,7 @@ class PayloadState : public PayloadStateInterface {
   void SetResponse(const OmahaResponse& response) override;
   void DownloadComplete() override;
   void DownloadProgress(size_t count) override;
+  void DownloadTransferEnded(const TransferStats& stats) override;
   void UpdateResumed() override;
   void UpdateRestarted() override;
   void UpdateSucceeded() override;
@@ -82,6 +85,12 @@ class PayloadState : public PayloadStateInterface {
     return candidate_urls_.size() ? candidate_urls_[url_index_] : "";
   }
 
+  inline std::vector<std::string> GetCandidateUrls() override {
+    return candidate_urls_;
+  }
+
+  void SwitchToUrl(uint32_t url_index) override;
+
   inline uint32_t GetUrlFailureCount() override {
     return url_failure_count_;
   }
@@ -197,9 +206,14 @@ class PayloadState : public PayloadStateInterface {
   void UpdateCurrentDownloadSource();
 
   // Updates the various metrics corresponding with the given number of bytes
-  // that were downloaded recently.
+  // that were downloaded recently. They are only persisted every few seconds
+  // or megabytes.
   void UpdateBytesDownloaded(size_t count);
 
+  // Persists the byte counters and the update uptime left in memory by
+  // UpdateBytesDownloaded(), if any.
+  void PersistDownloadProgress();
+
   // Calculates the PayloadType we're using.
   PayloadType CalculatePayloadType();
 
@@ -375,6 +389,21 @@ class PayloadState : public PayloadStateInterface {
   // the Omaha response.
   void ComputeCandidateUrls();
 
+  // Orders the candidate URLs from the fastest host to the slowest one, as
+  // measured by the downloads of the previous attempts and updates. The order
+  // is persisted so the URL index keeps pointing to the same URL until the
+  // next time it's computed, when the response changes or all the URLs were
+  // tried.
+  void OrderCandidateUrls();
+
+  // Loads the persisted order of the candidate URLs, computed when the
+  // current response was first received.
+  void LoadCandidateUrlOrder();
+
+  // Reorders the |candidate_urls_| so the i-th one is the |order[i]|-th one
+  // of the current list, and persists the new order.
+  void SetCandidateUrlOrder(const std::vector<size_t>& order);
+
   // Sets |num_responses_seen_| and persist it to disk.
   void SetNumResponsesSeen(int num_responses_seen);
 
@@ -545,6 +574,18 @@ class PayloadState : public PayloadStateInterface {
   // allowed as per device policy.
   std::vector<std::string> candidate_urls_;
 
+  // The index in the list of candidate URLs of the response of each one of
+  // the |candidate_urls_|.
+  std::vector<size_t> candidate_url_order_;
+
+  // The throughput history of the hosts of the payload URLs, which the
+  // |candidate_urls_| are ordered by.
+  std::unique_ptr<UrlThroughputHistory> url_history_;
+
+  // Whether the last download transfer spent most of its time stalled, which
+  // is not persisted as it only concerns the next failure of this run.
+  bool last_transfer_stalled_ = false;
+
   // This stores a blacklisted version set as part of rollback. When we rollback
   // we store the version of the os from which we are rolling back from in order
   // to guarantee that we do not re-update to it on the next au attempt after
@@ -554,6 +595,13 @@ class PayloadState : public PayloadStateInterface {
   // The number of bytes downloaded per attempt.
   int64_t attempt_num_bytes_downloaded_;
 
+  // The download progress not persisted yet: the number of bytes, whether
+  // each source counters changed, and the monotonic time the progress was
+  // last persisted.
+  uint64_t unpersisted_bytes_downloaded_;
+  bool unpersisted_sources_[kNumDownloadSources + 1];
+  base::Time progress_persisted_time_;
+
   // The boot time when the attempt was started.
   base::Time attempt_start_time_boot_;
 
@@ -18,9 +18,11 @@
 #define UPDATE_ENGINE_PAYLOAD_STATE_INTERFACE_H_
 
 #include <string>
+#include <vector>
 
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/constants.h"
+#include "update_engine/common/throughput_estimator.h"
 #include "update_engine/omaha_response.h"
 
 namespace chromeos_update_engine {
@@ -54,6 +56,12 @@ class PayloadStateInterface {
   // able to make forward progress with the current URL.
   virtual void DownloadProgress(size_t count) = 0;
 
+  // This method should be called whenever a download of the current payload
+  // ends, successfully or not, with the network |stats| of the transfer. A
+  // transfer which mostly stalled makes the next transient failure switch to
+  // the next URL right away rather than retry the same one.
+  virtual void DownloadTransferEnded(const TransferStats& stats) = 0;
+
   // This method should be called every time we resume an update attempt.
   virtual void UpdateResumed() = 0;
 
@@ -114,6 +122,15 @@ class PayloadStateInterface {
   // Returns the current URL. Returns an empty string if there's no valid URL.
   virtual std::string GetCurrentUrl() = 0;
 
+  // Returns the URLs of the current response that may be used, in the order
+  // they're tried.
+  virtual std::vector<std::string> GetCandidateUrls() = 0;
+
+  // Makes the candidate URL at |url_index| the current one, e.g. when it was
+  // found to be faster than the current one. This counts as a URL switch and
+  // resets the URL failure count.
+  virtual void SwitchToUrl(uint32_t url_index) = 0;
+
   // Returns the current URL's failure count.
   virtual uint32_t GetUrlFailureCount() = 0;
 
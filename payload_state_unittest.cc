@@ -301,6 +301,80 @@ TEST(PayloadStateTest, CanAdvanceUrlIndexCorrectly) {
   EXPECT_EQ(3U, payload_state.GetUrlSwitchCount());
 }
 
+TEST(PayloadStateTest, StalledTransferAdvancesUrlIndex) {
+  OmahaResponse response;
+  FakeSystemState fake_system_state;
+  PayloadState payload_state;
+
+  EXPECT_TRUE(payload_state.Initialize(&fake_system_state));
+  SetupPayloadStateWith2Urls("Hash8225", true, &payload_state, &response);
+  EXPECT_EQ("http://test", payload_state.GetCurrentUrl());
+
+  // A transfer which only stalled for a while is retried on the same URL.
+  TransferStats stats;
+  stats.transfer_time = TimeDelta::FromSeconds(100);
+  stats.num_stalls = 1;
+  stats.stall_time = TimeDelta::FromSeconds(20);
+  payload_state.DownloadTransferEnded(stats);
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("http://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(1U, payload_state.GetUrlFailureCount());
+
+  // A transfer which mostly stalled moves to the next URL right away.
+  stats.stall_time = TimeDelta::FromSeconds(80);
+  payload_state.DownloadTransferEnded(stats);
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(0U, payload_state.GetUrlFailureCount());
+
+  // The stall only counts for the failure that follows it.
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(1U, payload_state.GetUrlFailureCount());
+}
+
+TEST(PayloadStateTest, FastestUrlIsTriedFirst) {
+  OmahaResponse response;
+  FakeSystemState fake_system_state;
+  FakePrefs fake_prefs;
+  fake_system_state.set_prefs(&fake_prefs);
+  PayloadState payload_state;
+
+  EXPECT_TRUE(payload_state.Initialize(&fake_system_state));
+  SetupPayloadStateWith2Urls("Hash6437", true, &payload_state, &response);
+  EXPECT_EQ("http://test", payload_state.GetCurrentUrl());
+
+  // The second URL turns out to be faster than the first one.
+  TransferStats stats;
+  stats.bytes_received = UrlThroughputHistory::kMinSampleBytes;
+  stats.throughput_bps = 100 * 1024;
+  payload_state.DownloadTransferEnded(stats);
+  payload_state.SwitchToUrl(1);
+  stats.throughput_bps = 1024 * 1024;
+  payload_state.DownloadTransferEnded(stats);
+
+  // The URLs of the next response are ordered by their throughput, but its
+  // signature keeps the order of the response.
+  SetupPayloadStateWith2Urls("Hash6438", true, &payload_state, &response);
+  EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ("http://test", payload_state.GetCandidateUrls()[1]);
+  string order;
+  EXPECT_TRUE(fake_prefs.GetString(kPrefsCandidateUrlOrder, &order));
+  EXPECT_EQ("1,0", order);
+
+  // The order is kept with the same response after a restart, even if the
+  // throughput changed since.
+  PayloadState payload_state2;
+  EXPECT_TRUE(payload_state2.Initialize(&fake_system_state));
+  SetupPayloadStateWith2Urls("Hash6438", true, &payload_state2, &response);
+  EXPECT_EQ("https://test", payload_state2.GetCurrentUrl());
+  stats.throughput_bps = 10 * 1024;
+  payload_state2.DownloadTransferEnded(stats);
+  SetupPayloadStateWith2Urls("Hash6438", true, &payload_state2, &response);
+  EXPECT_EQ("https://test", payload_state2.GetCurrentUrl());
+  EXPECT_EQ(0U, payload_state2.GetUrlSwitchCount());
+}
+
 TEST(PayloadStateTest, NewResponseResetsPayloadState) {
   OmahaResponse response;
   FakeSystemState fake_system_state;
@@ -1090,6 +1164,51 @@ TEST(PayloadStateTest, DurationsAreCorrect) {
             16000000);
 }
 
+TEST(PayloadStateTest, DownloadProgressIsPersistedOnThresholds) {
+  OmahaResponse response;
+  PayloadState payload_state;
+  FakeSystemState fake_system_state;
+  FakeClock fake_clock;
+  FakePrefs fake_prefs;
+  fake_clock.SetMonotonicTime(Time::FromInternalValue(1000000));
+  fake_system_state.set_clock(&fake_clock);
+  fake_system_state.set_prefs(&fake_prefs);
+  EXPECT_TRUE(payload_state.Initialize(&fake_system_state));
+  SetupPayloadStateWith2Urls("Hash6437", true, &payload_state, &response);
+
+  // Small chunks are only kept in memory.
+  int64_t value;
+  payload_state.DownloadProgress(1000);
+  fake_clock.SetMonotonicTime(Time::FromInternalValue(2000000));
+  payload_state.DownloadProgress(1000);
+  EXPECT_EQ(2000U,
+            payload_state.GetCurrentBytesDownloaded(kDownloadSourceHttpServer));
+  EXPECT_TRUE(fake_prefs.GetInt64(kCurrentBytesDownloadedFromHttp, &value));
+  EXPECT_EQ(0, value);
+
+  // A large chunk is persisted along with the previous ones.
+  payload_state.DownloadProgress(8 * 1024 * 1024);
+  EXPECT_TRUE(fake_prefs.GetInt64(kCurrentBytesDownloadedFromHttp, &value));
+  EXPECT_EQ(2000 + 8 * 1024 * 1024, value);
+  EXPECT_TRUE(fake_prefs.GetInt64(kTotalBytesDownloadedFromHttp, &value));
+  EXPECT_EQ(2000 + 8 * 1024 * 1024, value);
+
+  // So are small chunks once enough time passed.
+  payload_state.DownloadProgress(1000);
+  fake_clock.SetMonotonicTime(Time::FromInternalValue(12000000));
+  payload_state.DownloadProgress(1000);
+  EXPECT_TRUE(fake_prefs.GetInt64(kCurrentBytesDownloadedFromHttp, &value));
+  EXPECT_EQ(4000 + 8 * 1024 * 1024, value);
+  EXPECT_TRUE(fake_prefs.GetInt64(kPrefsUpdateDurationUptime, &value));
+  EXPECT_EQ(11000000, value);
+
+  // A state transition persists the pending progress.
+  payload_state.DownloadProgress(1000);
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_TRUE(fake_prefs.GetInt64(kCurrentBytesDownloadedFromHttp, &value));
+  EXPECT_EQ(5000 + 8 * 1024 * 1024, value);
+}
+
 TEST(PayloadStateTest, RebootAfterSuccessfulUpdateTest) {
   OmahaResponse response;
   PayloadState payload_state;
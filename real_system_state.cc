@@ -17,6 +17,7 @@
 #include "update_engine/real_system_state.h"
 
 #include <string>
+#include <utility>
 
 #include <base/bind.h>
 #include <base/files/file_util.h>
@@ -29,14 +30,34 @@
 #include "update_engine/common/boot_control_stub.h"
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hardware.h"
+#include "update_engine/common/platform_constants.h"
+#include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/write_behind_prefs.h"
 #include "update_engine/update_manager/state_factory.h"
 #include "update_engine/weave_service_factory.h"
 
+using base::TimeTicks;
 using brillo::MessageLoop;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The file in the non-volatile directory where the policy evaluations are
+// recorded for the update_engine_policy_benchmark. The recording is enabled by
+// creating the file.
+const char kPolicyTraceFileName[] = "policy_trace";
+
+// Logs how long the startup step |name| took since |start|, which traces
+// where the startup time of the daemon goes.
+void LogStartupStep(const char* name, TimeTicks start) {
+  LOG(INFO) << "Startup: " << name << " took "
+            << (TimeTicks::Now() - start).InMilliseconds() << " ms.";
+}
+
+}  // namespace
+
 RealSystemState::RealSystemState(const scoped_refptr<dbus::Bus>& bus)
     : debugd_proxy_(bus),
       power_manager_proxy_(bus),
@@ -50,9 +71,11 @@ RealSystemState::~RealSystemState() {
   // daemon.
   if (update_attempter_)
     update_attempter_->ClearObservers();
+  Terminator::SetExitCallback(base::Closure());
 }
 
 bool RealSystemState::Initialize() {
+  const TimeTicks start_time = TimeTicks::Now();
   metrics_lib_.Init();
 
   boot_control_ = boot_control::CreateBootControl();
@@ -75,8 +98,13 @@ bool RealSystemState::Initialize() {
     LOG(ERROR) << "Failed to initialize shill proxy.";
     return false;
   }
+  if (!connection_manager_.Init()) {
+    LOG(WARNING) << "Failed to subscribe to the shill connection changes; "
+                    "the connection properties will be requested every time.";
+  }
 
   // Initialize standard and powerwash-safe prefs.
+  TimeTicks step_time = TimeTicks::Now();
   base::FilePath non_volatile_path;
   // TODO(deymo): Fall back to in-memory prefs if there's no physical directory
   // available.
@@ -85,11 +113,33 @@ bool RealSystemState::Initialize() {
     return false;
   }
   Prefs* prefs;
-  prefs_.reset(prefs = new Prefs());
+#if USE_PREFS_LOG
+  LogPrefs* log_prefs;
+  std::unique_ptr<PrefsBase> backend_prefs(log_prefs = new LogPrefs());
+  if (!log_prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
+    LOG(ERROR) << "Failed to initialize preferences.";
+    return false;
+  }
+#else
+  std::unique_ptr<PrefsBase> backend_prefs(prefs = new Prefs());
   if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
     LOG(ERROR) << "Failed to initialize preferences.";
     return false;
   }
+#endif  // USE_PREFS_LOG
+  // The download progress is written for every received chunk but only needs
+  // to survive a crash along with the resume checkpoints, which are written
+  // to other keys and thus flush it.
+  WriteBehindPrefs* write_behind_prefs;
+  prefs_.reset(write_behind_prefs =
+                   new WriteBehindPrefs(std::move(backend_prefs),
+                                        base::TimeDelta::FromMinutes(1)));
+  write_behind_prefs->AddDeferredKeyPrefix(kPrefsCurrentBytesDownloaded);
+  write_behind_prefs->AddDeferredKeyPrefix(kPrefsTotalBytesDownloaded);
+  write_behind_prefs->AddDeferredKeyPrefix(kPrefsUpdateDurationUptime);
+  Terminator::SetExitCallback(
+      base::Bind(base::IgnoreResult(&WriteBehindPrefs::Flush),
+                 base::Unretained(write_behind_prefs)));
 
   base::FilePath powerwash_safe_path;
   if (!hardware_->GetPowerwashSafeDirectory(&powerwash_safe_path)) {
@@ -116,6 +166,7 @@ bool RealSystemState::Initialize() {
     LOG(WARNING) << "Couldn't detect the bootid, assuming system was rebooted.";
     system_rebooted_ = true;
   }
+  LogStartupStep("loading the prefs", step_time);
 
   // Initialize the OmahaRequestParams with the default settings. These settings
   // will be re-initialized before every request using the actual request
@@ -126,20 +177,45 @@ bool RealSystemState::Initialize() {
                     "features might not work properly.";
   }
 
+  trace_log_.Init();
+  memory_tracker_.Init();
+  memory_pressure_monitor_.Init(constants::kMemoryCgroupPath,
+                                MemoryPressureMonitor::kPsiMemoryPath);
+
   certificate_checker_.reset(
       new CertificateChecker(prefs_.get(), &openssl_wrapper_));
   certificate_checker_->Init();
 
   // Initialize the UpdateAttempter before the UpdateManager.
+  step_time = TimeTicks::Now();
   update_attempter_.reset(
       new UpdateAttempter(this, certificate_checker_.get(), &libcros_proxy_,
                           &debugd_proxy_));
   update_attempter_->Init();
+  LogStartupStep("initializing the update attempter", step_time);
 
   weave_service_ = ConstructWeaveService(update_attempter_.get());
   if (weave_service_)
     update_attempter_->AddObserver(weave_service_.get());
 
+  // The Update Manager and the P2P Manager are deferred until the first
+  // update check or the first D-Bus call needing them.
+  LOG(INFO) << "Startup: deferring the Update Manager and P2P Manager.";
+
+  step_time = TimeTicks::Now();
+  if (!payload_state_.Initialize(this)) {
+    LOG(ERROR) << "Failed to initialize the payload state object.";
+    return false;
+  }
+  LogStartupStep("initializing the payload state", step_time);
+
+  // All is well. Initialization successful.
+  LogStartupStep("initializing the system state", start_time);
+  return true;
+}
+
+bool RealSystemState::InitializeUpdateManager() {
+  const TimeTicks start_time = TimeTicks::Now();
   // Initialize the Update Manager using the default state factory.
   chromeos_update_manager::State* um_state =
       chromeos_update_manager::DefaultStateFactory(
@@ -152,24 +228,48 @@ bool RealSystemState::Initialize() {
       new chromeos_update_manager::UpdateManager(
           &clock_, base::TimeDelta::FromSeconds(5),
           base::TimeDelta::FromHours(12), um_state));
+  // Let the policy re-evaluations due within the same 30 seconds share a
+  // wakeup.
+  update_manager_->set_timer_slack(base::TimeDelta::FromSeconds(30));
+  base::FilePath non_volatile_path;
+  if (hardware_->GetNonVolatileDirectory(&non_volatile_path)) {
+    base::FilePath trace_path = non_volatile_path.Append(kPolicyTraceFileName);
+    if (base::PathExists(trace_path)) {
+      LOG(INFO) << "Recording the policy evaluations in "
+                << trace_path.value();
+      chromeos_update_manager::PolicyTrace* trace =
+          new chromeos_update_manager::PolicyTrace();
+      trace->set_path(trace_path.value());
+      update_manager_->set_policy_trace(trace);
+    }
+  }
+  LogStartupStep("initializing the deferred Update Manager", start_time);
+  return true;
+}
 
-  // The P2P Manager depends on the Update Manager for its initialization.
-  p2p_manager_.reset(P2PManager::Construct(
-          nullptr, &clock_, update_manager_.get(), "cros_au",
-          kMaxP2PFilesToKeep, base::TimeDelta::FromDays(kMaxP2PFileAgeDays)));
+chromeos_update_manager::UpdateManager* RealSystemState::update_manager() {
+  if (!update_manager_)
+    InitializeUpdateManager();
+  return update_manager_.get();
+}
 
-  if (!payload_state_.Initialize(this)) {
-    LOG(ERROR) << "Failed to initialize the payload state object.";
-    return false;
+P2PManager* RealSystemState::p2p_manager() {
+  // The P2P Manager depends on the Update Manager for its initialization.
+  if (!p2p_manager_ && update_manager()) {
+    p2p_manager_.reset(P2PManager::Construct(
+        nullptr, &clock_, update_manager_.get(), "cros_au",
+        kMaxP2PFilesToKeep, base::TimeDelta::FromDays(kMaxP2PFileAgeDays)));
   }
-
-  // All is well. Initialization successful.
-  return true;
+  return p2p_manager_.get();
 }
 
 bool RealSystemState::StartUpdater() {
-  // Initiate update checks.
-  update_attempter_->ScheduleUpdates();
+  // Initiate update checks. This creates the Update Manager, so it is done
+  // from the message loop to answer the pending D-Bus calls first.
+  MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&UpdateAttempter::ScheduleUpdates,
+                 base::Unretained(update_attempter_.get())));
 
   // Update boot flags after 45 seconds.
   MessageLoop::current()->PostDelayedTask(
@@ -32,9 +32,13 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/clock.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/memory_pressure_monitor.h"
+#include "update_engine/common/memory_tracker.h"
 #include "update_engine/common/prefs.h"
+#include "update_engine/common/trace_log.h"
 #include "update_engine/connection_manager.h"
 #include "update_engine/daemon_state_interface.h"
+#include "update_engine/libcurl_connection_cache.h"
 #include "update_engine/p2p_manager.h"
 #include "update_engine/payload_state.h"
 #include "update_engine/shill_proxy.h"
@@ -91,6 +95,10 @@ class RealSystemState : public SystemState, public DaemonStateInterface {
 
   inline HardwareInterface* hardware() override { return hardware_.get(); }
 
+  inline LibcurlConnectionCache* connection_cache() override {
+    return &connection_cache_;
+  }
+
   inline MetricsLibraryInterface* metrics_lib() override {
     return &metrics_lib_;
   }
@@ -117,11 +125,12 @@ class RealSystemState : public SystemState, public DaemonStateInterface {
     return &request_params_;
   }
 
-  inline P2PManager* p2p_manager() override { return p2p_manager_.get(); }
+  // The P2P Manager and the Update Manager are only created the first time
+  // they are needed, which is after the daemon started answering the D-Bus
+  // calls unless a call needs them first.
+  P2PManager* p2p_manager() override;
 
-  inline chromeos_update_manager::UpdateManager* update_manager() override {
-    return update_manager_.get();
-  }
+  chromeos_update_manager::UpdateManager* update_manager() override;
 
   inline org::chromium::PowerManagerProxyInterface* power_manager_proxy()
       override {
@@ -131,6 +140,9 @@ class RealSystemState : public SystemState, public DaemonStateInterface {
   inline bool system_rebooted() override { return system_rebooted_; }
 
  private:
+  // Creates the |update_manager_| and its providers. Returns false on failure.
+  bool InitializeUpdateManager();
+
   // Real DBus proxies using the DBus connection.
   org::chromium::debugdProxy debugd_proxy_;
   org::chromium::PowerManagerProxy power_manager_proxy_;
@@ -154,6 +166,21 @@ class RealSystemState : public SystemState, public DaemonStateInterface {
   // Interface for the hardware functions.
   std::unique_ptr<HardwareInterface> hardware_;
 
+  // The trace of the last 4096 events of the update actions and operations,
+  // saved when the actions finish.
+  TraceLog trace_log_{4096};
+
+  // The memory held by the biggest consumers during the updates.
+  MemoryTracker memory_tracker_;
+
+  // Shrinks the caches of the updates under memory pressure. Declared before
+  // the update attempter so it outlives the caches registered with it.
+  MemoryPressureMonitor memory_pressure_monitor_;
+
+  // The caches shared by the HTTP fetchers. Declared before the update
+  // attempter so it outlives the fetchers the attempter owns.
+  LibcurlConnectionCache connection_cache_;
+
   // The Metrics Library interface for reporting UMA stats.
   MetricsLibrary metrics_lib_;
 
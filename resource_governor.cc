@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/resource_governor.h"
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+#include "update_engine/common/clock_interface.h"
+#include "update_engine/common/hardware_interface.h"
+
+using base::Time;
+using base::TimeDelta;
+using brillo::MessageLoop;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// How often the conditions are checked and the limits updated.
+const int kUpdateIntervalSeconds = 30;
+
+// How long a background update is limited before it gets the normal resources
+// of a process.
+const int kMaxLimitedHours = 2;
+
+// The limits without an update in progress, or once the update was limited for
+// long enough.
+const ResourceGovernor::Limits kNormalLimits = {
+    CpuShares::kNormal, IoPriority::kNormal, 0};
+
+}  // namespace
+
+ResourceGovernor::ResourceGovernor(SystemState* system_state)
+    : system_state_(system_state), limits_(kNormalLimits) {}
+
+ResourceGovernor::~ResourceGovernor() {
+  Stop();
+}
+
+void ResourceGovernor::Start(DownloadAction* download_action,
+                             bool interactive) {
+  if (update_limits_id_ != MessageLoop::kTaskIdNull) {
+    LOG(ERROR) << "The resource governor is already running.";
+    Stop();
+  }
+  download_action_ = download_action;
+  fast_mode_ = fast_mode_ || interactive;
+  start_time_ = system_state_->clock()->GetMonotonicTime();
+  UpdateLimits();
+}
+
+void ResourceGovernor::Stop() {
+  if (update_limits_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(update_limits_id_);
+    update_limits_id_ = MessageLoop::kTaskIdNull;
+  }
+  // The action may already be gone, and isn't reused anyway.
+  download_action_ = nullptr;
+  fast_mode_ = false;
+  ApplyLimits(kNormalLimits);
+}
+
+void ResourceGovernor::SetFastMode(bool fast_mode) {
+  LOG(INFO) << "Turning the fast mode " << (fast_mode ? "on" : "off") << ".";
+  fast_mode_ = fast_mode;
+  if (update_limits_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(update_limits_id_);
+    update_limits_id_ = MessageLoop::kTaskIdNull;
+    UpdateLimits();
+  }
+}
+
+void ResourceGovernor::UpdateLimits() {
+  update_limits_id_ = MessageLoop::kTaskIdNull;
+  if (!download_action_)
+    return;
+
+  ApplyLimits(ComputeLimits());
+
+  update_limits_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&ResourceGovernor::UpdateLimits, base::Unretained(this)),
+      TimeDelta::FromSeconds(kUpdateIntervalSeconds));
+}
+
+ResourceGovernor::Limits ResourceGovernor::ComputeLimits() const {
+  if (fast_mode_)
+    return {CpuShares::kHigh, IoPriority::kHigh, 0};
+
+  Time now = system_state_->clock()->GetMonotonicTime();
+  if (now - start_time_ >= TimeDelta::FromHours(kMaxLimitedHours))
+    return kNormalLimits;
+
+  if (system_state_->hardware()->IsOnACPower())
+    return {CpuShares::kLow, IoPriority::kLow, 0};
+  return {CpuShares::kLow, IoPriority::kIdle, 1};
+}
+
+void ResourceGovernor::ApplyLimits(const Limits& limits) {
+  if (limits.cpu_shares != limits_.cpu_shares ||
+      limits.io_priority != limits_.io_priority ||
+      limits.max_active_workers != limits_.max_active_workers) {
+    LOG(INFO) << "Changing the resource limits to cpu shares "
+              << static_cast<int>(limits.cpu_shares) << ", I/O priority "
+              << static_cast<int>(limits.io_priority) << " and "
+              << limits.max_active_workers << " active workers (0 for all).";
+  }
+  limits_ = limits;
+  // The limiter only writes the values that changed, and retries those it
+  // failed to set at the next update.
+  cpu_limiter_.SetCpuShares(limits_.cpu_shares);
+  cpu_limiter_.SetIoPriority(limits_.io_priority);
+  if (download_action_)
+    download_action_->SetMaxActiveWorkers(limits_.max_active_workers);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_RESOURCE_GOVERNOR_H_
+#define UPDATE_ENGINE_RESOURCE_GOVERNOR_H_
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
+#include "update_engine/common/cpu_limiter.h"
+#include "update_engine/payload_consumer/download_action.h"
+#include "update_engine/system_state.h"
+
+namespace chromeos_update_engine {
+
+// Manages the CPU and disk resources used by the update. Background updates
+// get the lowest CPU shares and a low I/O priority, and on battery they only
+// get the disk when nobody else uses it and apply their operations on a single
+// worker thread. The limits are lifted after a couple of hours so a background
+// update eventually finishes, and right away in fast mode, which interactive
+// updates use and the user can turn on for the update in progress.
+class ResourceGovernor {
+ public:
+  // The limits of the resources used by the update.
+  struct Limits {
+    CpuShares cpu_shares;
+    IoPriority io_priority;
+    // The maximum number of workers applying operations at once, 0 for none.
+    size_t max_active_workers;
+  };
+
+  explicit ResourceGovernor(SystemState* system_state);
+  ~ResourceGovernor();
+
+  // Starts managing the resources of the update applied by |download_action|,
+  // not owned, which must outlive the call to Stop(). Interactive updates run
+  // in fast mode.
+  void Start(DownloadAction* download_action, bool interactive);
+
+  // Lifts all the limits and turns off the fast mode.
+  void Stop();
+
+  // Turns the fast mode on or off for the update in progress, or for the next
+  // one if none is. The limits are updated right away.
+  void SetFastMode(bool fast_mode);
+  bool fast_mode() const { return fast_mode_; }
+
+ private:
+  FRIEND_TEST(ResourceGovernorTest, BackgroundOnACPowerTest);
+  FRIEND_TEST(ResourceGovernorTest, BackgroundOnBatteryTest);
+  FRIEND_TEST(ResourceGovernorTest, FastModeTest);
+  FRIEND_TEST(ResourceGovernorTest, TimeoutTest);
+
+  // Applies the limits of the current conditions and schedules the next
+  // update.
+  void UpdateLimits();
+
+  // Returns the limits the update should have in the current conditions.
+  Limits ComputeLimits() const;
+
+  // Applies the |limits| to the process and the |download_action_|.
+  void ApplyLimits(const Limits& limits);
+
+  // Interface for the system state, e.g. the clock and hardware.
+  SystemState* system_state_;
+
+  // The action applying the update, or nullptr when stopped.
+  DownloadAction* download_action_{nullptr};
+  bool fast_mode_{false};
+  base::Time start_time_;
+
+  // The limits applied last.
+  Limits limits_;
+
+  CPULimiter cpu_limiter_;
+
+  brillo::MessageLoop::TaskId update_limits_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(ResourceGovernor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_RESOURCE_GOVERNOR_H_
@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/resource_governor.h"
+
+#include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/mock_prefs.h"
+#include "update_engine/fake_system_state.h"
+
+using base::Time;
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+class ResourceGovernorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    fake_system_state_.fake_clock()->SetMonotonicTime(Time::FromInternalValue(
+        1000000));
+  }
+
+  void TearDown() override {
+    resource_governor_.Stop();
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  // Advances the clock by |delta| and runs the next update of the limits.
+  void AdvanceTime(TimeDelta delta) {
+    FakeClock* clock = fake_system_state_.fake_clock();
+    clock->SetMonotonicTime(clock->GetMonotonicTime() + delta);
+    EXPECT_TRUE(loop_.RunOnce(false));
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakeSystemState fake_system_state_;
+  MockPrefs prefs_;
+  // Takes ownership of the fetcher.
+  DownloadAction download_action_{&prefs_,
+                                  fake_system_state_.boot_control(),
+                                  fake_system_state_.hardware(),
+                                  &fake_system_state_,
+                                  new MockHttpFetcher(nullptr, 0, nullptr)};
+  ResourceGovernor resource_governor_{&fake_system_state_};
+};
+
+TEST_F(ResourceGovernorTest, BackgroundOnACPowerTest) {
+  fake_system_state_.fake_hardware()->SetIsOnACPower(true);
+  resource_governor_.Start(&download_action_, false);
+  EXPECT_FALSE(resource_governor_.fast_mode());
+  EXPECT_EQ(CpuShares::kLow, resource_governor_.limits_.cpu_shares);
+  EXPECT_EQ(IoPriority::kLow, resource_governor_.limits_.io_priority);
+  EXPECT_EQ(0U, resource_governor_.limits_.max_active_workers);
+  EXPECT_TRUE(loop_.PendingTasks());
+}
+
+TEST_F(ResourceGovernorTest, BackgroundOnBatteryTest) {
+  fake_system_state_.fake_hardware()->SetIsOnACPower(false);
+  resource_governor_.Start(&download_action_, false);
+  EXPECT_EQ(CpuShares::kLow, resource_governor_.limits_.cpu_shares);
+  EXPECT_EQ(IoPriority::kIdle, resource_governor_.limits_.io_priority);
+  EXPECT_EQ(1U, resource_governor_.limits_.max_active_workers);
+
+  // The limits follow the power source.
+  fake_system_state_.fake_hardware()->SetIsOnACPower(true);
+  AdvanceTime(TimeDelta::FromSeconds(30));
+  EXPECT_EQ(IoPriority::kLow, resource_governor_.limits_.io_priority);
+  EXPECT_EQ(0U, resource_governor_.limits_.max_active_workers);
+
+  resource_governor_.Stop();
+  EXPECT_EQ(CpuShares::kNormal, resource_governor_.limits_.cpu_shares);
+  EXPECT_EQ(IoPriority::kNormal, resource_governor_.limits_.io_priority);
+}
+
+TEST_F(ResourceGovernorTest, FastModeTest) {
+  // Interactive updates run in fast mode.
+  resource_governor_.Start(&download_action_, true);
+  EXPECT_TRUE(resource_governor_.fast_mode());
+  EXPECT_EQ(CpuShares::kHigh, resource_governor_.limits_.cpu_shares);
+  EXPECT_EQ(IoPriority::kHigh, resource_governor_.limits_.io_priority);
+  EXPECT_EQ(0U, resource_governor_.limits_.max_active_workers);
+
+  // Turning it off applies the background limits right away.
+  resource_governor_.SetFastMode(false);
+  EXPECT_EQ(CpuShares::kLow, resource_governor_.limits_.cpu_shares);
+  resource_governor_.SetFastMode(true);
+  EXPECT_EQ(CpuShares::kHigh, resource_governor_.limits_.cpu_shares);
+
+  // The fast mode ends with the update.
+  resource_governor_.Stop();
+  EXPECT_FALSE(resource_governor_.fast_mode());
+}
+
+TEST_F(ResourceGovernorTest, TimeoutTest) {
+  resource_governor_.Start(&download_action_, false);
+  EXPECT_EQ(CpuShares::kLow, resource_governor_.limits_.cpu_shares);
+  AdvanceTime(TimeDelta::FromHours(1));
+  EXPECT_EQ(CpuShares::kLow, resource_governor_.limits_.cpu_shares);
+  // Background updates are only limited for a couple of hours.
+  AdvanceTime(TimeDelta::FromHours(1));
+  EXPECT_EQ(CpuShares::kNormal, resource_governor_.limits_.cpu_shares);
+  EXPECT_EQ(IoPriority::kNormal, resource_governor_.limits_.io_priority);
+  EXPECT_EQ(0U, resource_governor_.limits_.max_active_workers);
+}
+
+}  // namespace chromeos_update_engine
@@ -47,6 +47,20 @@ class ServiceDelegateAndroidInterface {
       const std::vector<std::string>& key_value_pair_headers,
       brillo::ErrorPtr* error) = 0;
 
+  // Start checking whether the payload passed like in ApplyPayload() can be
+  // applied on this device, if no other update is running. Only the header and
+  // metadata of the payload are fetched: their signature and versions are
+  // validated and the source partitions the payload updates are verified
+  // against it, without modifying the device nor the progress of a previous
+  // update. The verdict is notified with SendPayloadPrecheckComplete(). Returns
+  // whether the precheck was started successfully.
+  virtual bool PrecheckPayload(
+      const std::string& payload_url,
+      int64_t payload_offset,
+      int64_t payload_size,
+      const std::vector<std::string>& key_value_pair_headers,
+      brillo::ErrorPtr* error) = 0;
+
   // Suspend an ongoing update. Returns true if there was an update ongoing and
   // it was suspended. In case of failure, it returns false and sets |error|
   // accordingly.
@@ -40,6 +40,11 @@ class ServiceObserverInterface {
   // Called whenever an update attempt is completed.
   virtual void SendPayloadApplicationComplete(ErrorCode error_code) = 0;
 
+  // Called whenever a payload precheck is completed, with the error the
+  // payload would fail with or kSuccess if it can be applied. Only the
+  // services exposing the precheck handle it.
+  virtual void SendPayloadPrecheckComplete(ErrorCode error_code) {}
+
   // Called whenever the channel we are tracking changes.
   virtual void SendChannelChangeUpdate(const std::string& tracking_channel) = 0;
 
@@ -46,6 +46,7 @@ class BootControlInterface;
 class ClockInterface;
 class ConnectionManagerInterface;
 class HardwareInterface;
+class LibcurlConnectionCache;
 class OmahaRequestParams;
 class P2PManager;
 class PayloadStateInterface;
@@ -81,6 +82,9 @@ class SystemState {
   // Gets the hardware interface object.
   virtual HardwareInterface* hardware() = 0;
 
+  // Gets the caches shared by the HTTP fetchers, or nullptr if none.
+  virtual LibcurlConnectionCache* connection_cache() = 0;
+
   // Gets the Metrics Library interface for reporting UMA stats.
   virtual MetricsLibraryInterface* metrics_lib() = 0;
 
@@ -17,7 +17,9 @@
 // This file implements a simple HTTP server. It can exhibit odd behavior
 // that's useful for testing. For example, it's useful to test that
 // the updater can continue a connection if it's dropped, or that it
-// handles very slow data transfers.
+// handles very slow data transfers. The /shaped/ requests emulate slow and
+// unreliable networks, and the -c option handles the connections concurrently
+// for benchmarking parallel downloads.
 
 // To use this, simply make an HTTP connection to localhost:port and
 // GET a url.
@@ -31,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -38,13 +41,16 @@
 
 #include <algorithm>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/rand_util.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 
 #include "update_engine/common/http_common.h"
 
@@ -60,6 +66,12 @@ namespace chromeos_update_engine {
 
 static const char* kListeningMsgPrefix = "listening on port ";
 
+// The maximal size of the payload written at once.
+static const size_t kPayloadBufferSize = 64 * 1024;
+
+// The duration of the payload pieces written by the shaped responses.
+static const int kShapingIntervalMs = 10;
+
 enum {
   RC_OK = 0,
   RC_BAD_ARGS,
@@ -80,6 +92,22 @@ struct HttpRequest {
   HttpResponseCode return_code{kHttpResponseOk};
 };
 
+// The network conditions emulated by a /shaped/ response. The zero values
+// disable the corresponding shaping.
+struct ShapingProfile {
+  // The bandwidth cap of the connection.
+  size_t bytes_per_sec{0};
+  // The delay before the response headers, plus a random delay of up to
+  // |jitter_ms|.
+  int latency_ms{0};
+  int jitter_ms{0};
+  // The offset of the payload at which the connection is reset, if the
+  // requested range crosses it.
+  size_t drop_offset{0};
+  // The time the bandwidth takes to ramp up from an eighth of the cap.
+  int slow_start_ms{0};
+};
+
 bool ParseRequest(int fd, HttpRequest* request) {
   string headers;
   do {
@@ -155,12 +183,11 @@ string Itoa(off_t num) {
   return buf;
 }
 
-// Writes a string into a file. Returns total number of bytes written or -1 if a
-// write error occurred.
-ssize_t WriteString(int fd, const string& str) {
-  const size_t total_size = str.size();
+// Writes |size| bytes of |data| into a file. Returns total number of bytes
+// written or -1 if a write error occurred.
+ssize_t WriteData(int fd, const char* data, size_t size) {
+  const size_t total_size = size;
   size_t remaining_size = total_size;
-  char const *data = str.data();
 
   while (remaining_size) {
     ssize_t written = write(fd, data, remaining_size);
@@ -176,6 +203,12 @@ ssize_t WriteString(int fd, const string& str) {
   return total_size;
 }
 
+// Writes a string into a file. Returns total number of bytes written or -1 if a
+// write error occurred.
+ssize_t WriteString(int fd, const string& str) {
+  return WriteData(fd, str.data(), str.size());
+}
+
 // Writes the headers of an HTTP response into a file.
 ssize_t WriteHeaders(int fd, const off_t start_offset, const off_t end_offset,
                      HttpResponseCode return_code) {
@@ -236,33 +269,27 @@ size_t WritePayload(int fd, const off_t start_offset, const off_t end_offset,
   for (i = 0; i < line_len; i++)
     line += byte++;
 
+  // Repeat it in a buffer of whole lines, up to the size of the payload, which
+  // is written at once from its line boundary offset.
   const size_t total_len = end_offset - start_offset;
-  size_t remaining_len = total_len;
-  bool success = true;
-
-  // If start offset is not aligned with line boundary, output partial line up
-  // to the first line boundary.
-  size_t start_modulo = start_offset % line_len;
-  if (start_modulo) {
-    string partial = line.substr(start_modulo, remaining_len);
-    ssize_t ret = WriteString(fd, partial);
-    if ((success = (ret >= 0 && (size_t) ret == partial.length())))
-      remaining_len -= partial.length();
-  }
-
-  // Output full lines up to the maximal line boundary below the end offset.
-  while (success && remaining_len >= line_len) {
-    ssize_t ret = WriteString(fd, line);
-    if ((success = (ret >= 0 && (size_t) ret == line_len)))
-      remaining_len -= line_len;
-  }
+  const size_t num_lines =
+      std::max(std::min(kPayloadBufferSize, total_len) / line_len,
+               static_cast<size_t>(1)) + 1;
+  string buffer;
+  buffer.reserve(num_lines * line_len);
+  for (i = 0; i < num_lines; i++)
+    buffer += line;
 
-  // Output a partial line up to the end offset.
-  if (success && remaining_len) {
-    string partial = line.substr(0, remaining_len);
-    ssize_t ret = WriteString(fd, partial);
-    if ((success = (ret >= 0 && (size_t) ret == partial.length())))
-      remaining_len -= partial.length();
+  size_t remaining_len = total_len;
+  size_t buffer_offset = start_offset % line_len;
+  while (remaining_len) {
+    const size_t len = std::min(remaining_len,
+                                (num_lines - 1) * line_len);
+    ssize_t ret = WriteData(fd, buffer.data() + buffer_offset, len);
+    if (ret < 0 || static_cast<size_t>(ret) != len)
+      break;
+    remaining_len -= len;
+    buffer_offset = (buffer_offset + len) % line_len;
   }
 
   return (total_len - remaining_len);
@@ -274,6 +301,66 @@ inline size_t WritePayload(int fd, const off_t start_offset,
   return WritePayload(fd, start_offset, end_offset, 'a', 10);
 }
 
+// Resets the connection once it's closed instead of shutting it down, as if it
+// was dropped by the network.
+void ResetConnection(int fd) {
+  struct linger linger = {1, 0};
+  if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) < 0)
+    perror("setsockopt");
+}
+
+// Writes the default payload at the bandwidth of the shaping |profile|, in
+// pieces of kShapingIntervalMs, and resets the connection at its drop offset.
+// Returns the number of successfully written bytes.
+size_t WriteShapedPayload(int fd, const off_t start_offset,
+                          const off_t end_offset,
+                          const ShapingProfile& profile) {
+  off_t write_end_offset = end_offset;
+  const off_t drop_offset = profile.drop_offset;
+  const bool drop = drop_offset > start_offset && drop_offset < end_offset;
+  if (drop)
+    write_end_offset = drop_offset;
+
+  size_t written = 0;
+  if (!profile.bytes_per_sec) {
+    written = WritePayload(fd, start_offset, write_end_offset);
+  } else {
+    const base::TimeTicks start_time = base::TimeTicks::Now();
+    base::TimeTicks next_write_time = start_time;
+    off_t offset = start_offset;
+    while (offset < write_end_offset) {
+      // The bandwidth ramps up linearly during the slow start.
+      const base::TimeTicks now = base::TimeTicks::Now();
+      double bytes_per_sec = profile.bytes_per_sec;
+      const int64_t elapsed_ms = (now - start_time).InMilliseconds();
+      if (elapsed_ms < profile.slow_start_ms) {
+        bytes_per_sec *=
+            (1 + 7.0 * elapsed_ms / profile.slow_start_ms) / 8;
+      }
+      const size_t piece = std::min(
+          std::max(static_cast<size_t>(
+                       bytes_per_sec * kShapingIntervalMs / 1000),
+                   static_cast<size_t>(1)),
+          static_cast<size_t>(write_end_offset - offset));
+      if (next_write_time > now)
+        usleep((next_write_time - now).InMicroseconds());
+      const size_t ret = WritePayload(fd, offset, offset + piece);
+      written += ret;
+      if (ret != piece)
+        return written;
+      offset += piece;
+      next_write_time += base::TimeDelta::FromMicroseconds(
+          piece * base::Time::kMicrosecondsPerSecond / bytes_per_sec);
+    }
+  }
+
+  if (drop && written == static_cast<size_t>(drop_offset - start_offset)) {
+    LOG(INFO) << "dropping the connection at offset " << drop_offset;
+    ResetConnection(fd);
+  }
+  return written;
+}
+
 // Send an empty response, then kill the server.
 void HandleQuit(int fd) {
   WriteHeaders(fd, 0, 0, kHttpResponseOk);
@@ -282,16 +369,12 @@ void HandleQuit(int fd) {
 }
 
 
-// Generates an HTTP response with payload corresponding to requested offsets
-// and length.  Optionally, truncate the payload at a given length and add a
-// pause midway through the transfer.  Returns the total number of bytes
-// delivered or -1 for error.
-ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
-                  const size_t truncate_length, const int sleep_every,
-                  const int sleep_secs) {
-  ssize_t ret;
-  size_t written = 0;
-
+// Computes the range of the response to |request| for a payload of
+// |total_length| bytes. Returns false after writing an error response if the
+// requested range can't be satisfied.
+bool GetResponseRange(int fd, const HttpRequest& request,
+                      const size_t total_length, size_t* start_offset_out,
+                      size_t* end_offset_out) {
   // Obtain start offset, make sure it is within total payload length.
   const size_t start_offset = request.start_offset;
   if (start_offset >= total_length) {
@@ -299,8 +382,8 @@ ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
                  << ") exceeds total length (" << total_length
                  << "), generating error response ("
                  << kHttpResponseReqRangeNotSat << ")";
-    return WriteHeaders(fd, total_length, total_length,
-                        kHttpResponseReqRangeNotSat);
+    WriteHeaders(fd, total_length, total_length, kHttpResponseReqRangeNotSat);
+    return false;
   }
 
   // Obtain end offset, adjust to fit in total payload length and ensure it does
@@ -310,7 +393,8 @@ ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
   if (end_offset < start_offset) {
     LOG(WARNING) << "end offset (" << end_offset << ") precedes start offset ("
                  << start_offset << "), generating error response";
-    return WriteHeaders(fd, 0, 0, kHttpResponseBadRequest);
+    WriteHeaders(fd, 0, 0, kHttpResponseBadRequest);
+    return false;
   }
   if (end_offset > total_length) {
     LOG(INFO) << "requested end offset (" << end_offset
@@ -318,6 +402,33 @@ ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
     end_offset = total_length;
   }
 
+  *start_offset_out = start_offset;
+  *end_offset_out = end_offset;
+  return true;
+}
+
+// Generates an HTTP response with payload corresponding to requested offsets
+// and length.  Optionally, truncate the payload at a given length and add a
+// pause midway through the transfer, or shape the transfer with a |profile|.
+// Returns the total number of bytes delivered or -1 for error.
+ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
+                  const size_t truncate_length, const int sleep_every,
+                  const int sleep_secs,
+                  const ShapingProfile* profile = nullptr) {
+  ssize_t ret;
+  size_t written = 0;
+
+  size_t start_offset, end_offset;
+  if (!GetResponseRange(fd, request, total_length, &start_offset, &end_offset))
+    return -1;
+
+  if (profile && (profile->latency_ms || profile->jitter_ms)) {
+    const int delay_ms =
+        profile->latency_ms + base::RandInt(0, profile->jitter_ms);
+    LOG(INFO) << "delaying the response by " << delay_ms << " ms";
+    usleep(delay_ms * base::Time::kMicrosecondsPerMillisecond);
+  }
+
   // Generate headers
   LOG(INFO) << "generating response header: range=" << start_offset << "-"
             << (end_offset - 1) << "/" << (end_offset - start_offset)
@@ -340,8 +451,12 @@ ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
   LOG(INFO) << "generating response payload: range=" << start_offset << "-"
             << (end_offset - 1) << "/" << (end_offset - start_offset);
 
-  // Decide about optional midway delay.
-  if (truncate_length > 0 && sleep_every > 0 && sleep_secs >= 0 &&
+  // Decide about optional shaping or midway delay.
+  if (profile) {
+    ret = WriteShapedPayload(fd, start_offset, end_offset, *profile);
+    LOG(INFO) << ret << " payload bytes written (shaped)";
+    written += ret;
+  } else if (truncate_length > 0 && sleep_every > 0 && sleep_secs >= 0 &&
       start_offset % (truncate_length * sleep_every) == 0) {
     const off_t midway_offset = start_offset + payload_length / 2;
 
@@ -374,6 +489,51 @@ ssize_t HandleGet(int fd, const HttpRequest& request,
   return HandleGet(fd, request, total_length, 0, 0, 0);
 }
 
+// Handles /shaped/<total_length>/<bytes_per_sec>/<latency_ms>/<jitter_ms>/
+// <drop_offset>/<slow_start_ms> requests, see ShapingProfile.
+ssize_t HandleShapedGet(int fd, const HttpRequest& request,
+                        const size_t total_length,
+                        const ShapingProfile& profile) {
+  LOG(INFO) << "shaping the response: " << profile.bytes_per_sec
+            << " bytes/s, latency " << profile.latency_ms << "+"
+            << profile.jitter_ms << " ms, drop at " << profile.drop_offset
+            << ", slow start " << profile.slow_start_ms << " ms";
+  return HandleGet(fd, request, total_length, 0, 0, 0, &profile);
+}
+
+// Handles /file/<path> requests by sending the requested range of the local
+// file /<path> with sendfile(), which doesn't copy it through the server.
+ssize_t HandleFile(int fd, const HttpRequest& request) {
+  const string path = request.url.substr(strlen("/file"));
+  int file_fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  struct stat stbuf;
+  if (file_fd < 0 || fstat(file_fd, &stbuf) < 0) {
+    PLOG(WARNING) << "Unable to open " << path;
+    if (file_fd >= 0)
+      close(file_fd);
+    return WriteHeaders(fd, 0, 0, kHttpResponseNotFound);
+  }
+
+  ssize_t ret = -1;
+  size_t start_offset, end_offset;
+  if (GetResponseRange(fd, request, stbuf.st_size, &start_offset,
+                       &end_offset) &&
+      WriteHeaders(fd, start_offset, end_offset, request.return_code) >= 0) {
+    off_t offset = start_offset;
+    while (static_cast<size_t>(offset) < end_offset) {
+      ret = HANDLE_EINTR(sendfile(fd, file_fd, &offset, end_offset - offset));
+      if (ret <= 0) {
+        perror("sendfile");
+        break;
+      }
+    }
+    ret = offset - start_offset;
+    LOG(INFO) << ret << " bytes of " << path << " sent";
+  }
+  close(file_fd);
+  return ret;
+}
+
 // Handles /redirect/<code>/<url> requests by returning the specified
 // redirect <code> with a location pointing to /<url>.
 void HandleRedirect(int fd, const HttpRequest& request) {
@@ -527,6 +687,17 @@ void HandleConnection(int fd) {
     const UrlTerms terms(url, 5);
     HandleGet(fd, request, terms.GetSizeT(1), terms.GetSizeT(2),
               terms.GetInt(3), terms.GetInt(4));
+  } else if (base::StartsWith(url, "/shaped/", base::CompareCase::SENSITIVE)) {
+    const UrlTerms terms(url, 7);
+    ShapingProfile profile;
+    profile.bytes_per_sec = terms.GetSizeT(2);
+    profile.latency_ms = terms.GetInt(3);
+    profile.jitter_ms = terms.GetInt(4);
+    profile.drop_offset = terms.GetSizeT(5);
+    profile.slow_start_ms = terms.GetInt(6);
+    HandleShapedGet(fd, request, terms.GetSizeT(1), profile);
+  } else if (base::StartsWith(url, "/file/", base::CompareCase::SENSITIVE)) {
+    HandleFile(fd, request);
   } else if (url.find("/redirect/") == 0) {
     HandleRedirect(fd, request);
   } else if (url == "/error") {
@@ -554,28 +725,33 @@ using namespace chromeos_update_engine;  // NOLINT(build/namespaces)
 void usage(const char *prog_arg) {
   fprintf(
       stderr,
-      "Usage: %s [ FILE ]\n"
+      "Usage: %s [ -c ] [ FILE ]\n"
       "Once accepting connections, the following is written to FILE (or "
       "stdout):\n"
-      "\"%sN\" (where N is an integer port number)\n",
+      "\"%sN\" (where N is an integer port number)\n"
+      "With -c, the connections are handled concurrently.\n",
       basename(prog_arg), kListeningMsgPrefix);
 }
 
 int main(int argc, char** argv) {
-  // Check invocation.
-  if (argc > 2)
-    errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
-
-  // Parse (optional) argument.
+  // Parse (optional) arguments.
   int report_fd = STDOUT_FILENO;
-  if (argc == 2) {
-    if (!strcmp(argv[1], "-h")) {
+  bool concurrent = false;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (!strcmp(argv[arg], "-h")) {
       usage(argv[0]);
       exit(RC_OK);
+    } else if (!strcmp(argv[arg], "-c")) {
+      concurrent = true;
+    } else {
+      errx(RC_BAD_ARGS, "unknown option %s (use -h for usage)", argv[arg]);
     }
-
-    report_fd = open(argv[1], O_WRONLY | O_CREAT, 00644);
   }
+  if (argc - arg > 1)
+    errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
+  if (arg < argc)
+    report_fd = open(argv[arg], O_WRONLY | O_CREAT, 00644);
 
   // Ignore SIGPIPE on write() to sockets.
   signal(SIGPIPE, SIG_IGN);
@@ -605,7 +781,7 @@ int main(int argc, char** argv) {
     perror("bind");
     exit(RC_ERR_BIND);
   }
-  if (listen(listen_fd, 5) < 0) {
+  if (listen(listen_fd, concurrent ? SOMAXCONN : 5) < 0) {
     perror("listen");
     exit(RC_ERR_LISTEN);
   }
@@ -641,7 +817,10 @@ int main(int argc, char** argv) {
     LOG(INFO) << "got past accept";
     if (client_fd < 0)
       LOG(FATAL) << "ERROR on accept";
-    HandleConnection(client_fd);
+    if (concurrent)
+      std::thread(HandleConnection, client_fd).detach();
+    else
+      HandleConnection(client_fd);
   }
   return 0;
 }
@@ -19,6 +19,7 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -46,10 +47,12 @@
 #include "update_engine/common/clock_interface.h"
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/memory_tracker.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/subprocess.h"
+#include "update_engine/common/trace_log.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/dbus_service.h"
 #include "update_engine/libcurl_http_fetcher.h"
@@ -60,12 +63,14 @@
 #include "update_engine/p2p_manager.h"
 #include "update_engine/payload_consumer/download_action.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/system_state.h"
 #include "update_engine/update_manager/policy.h"
 #include "update_engine/update_manager/update_manager.h"
 #include "update_engine/update_status_utils.h"
+#include "update_engine/url_probe_action.h"
 
 using base::Bind;
 using base::Callback;
@@ -97,6 +102,42 @@ const int kBroadcastThresholdSeconds = 10;
 // different params are passed to CheckForUpdate().
 const char kAUTestURLRequest[] = "autest";
 const char kScheduledAUTestURLRequest[] = "autest-scheduled";
+
+// Where the trace of the latest update actions is saved when they finish, to
+// be loaded in chrome://tracing.
+const char kUpdateTracePath[] = "/var/log/update_engine/update_trace.json";
+
+// How long the device must have been idle before the hashes of the running
+// slot are precomputed.
+const int kSourceHashPrecomputationDelayMinutes = 10;
+
+// The read buffers of the partitions hashed by the FilesystemVerifierActions.
+// The SSD and eMMC storage of the devices keeps several reads in flight
+// faster than one, and the few MiB they take are available while updating.
+const size_t kVerifierReadBuffers = 4;
+const size_t kVerifierReadBufferSize = 512 * 1024;  // 512 KiB
+
+// Saves the events of the current TraceLog, if any, to |kUpdateTracePath|.
+void WriteUpdateTrace() {
+  TraceLog* trace_log = TraceLog::current();
+  if (!trace_log || trace_log->size() == 0)
+    return;
+  string json = trace_log->ToJson();
+  if (!utils::WriteFile(kUpdateTracePath, json.data(), json.size()))
+    LOG(WARNING) << "Unable to write the update trace to " << kUpdateTracePath;
+}
+
+// Reports the peaks of the memory tracked by the current MemoryTracker, if
+// any, since the previous report, unless nothing was tracked such as when no
+// update was applied.
+void ReportMemoryPeaks(SystemState* system_state) {
+  MemoryTracker* tracker = MemoryTracker::current();
+  if (!tracker)
+    return;
+  std::map<string, uint64_t> peaks = tracker->FinishAttempt();
+  if (peaks[MemoryTracker::kTotal] > 0)
+    metrics::ReportAttemptMemoryMetrics(system_state, peaks);
+}
 }  // namespace
 
 // Turns a generic ErrorCode::kError to a generic error code specific
@@ -129,6 +170,8 @@ UpdateAttempter::UpdateAttempter(
     : processor_(new ActionProcessor()),
       system_state_(system_state),
       cert_checker_(cert_checker),
+      resource_governor_(system_state),
+      bandwidth_manager_(system_state),
 #if USE_LIBCROS
       chrome_proxy_resolver_(libcros_proxy),
 #endif  // USE_LIBCROS
@@ -142,6 +185,7 @@ UpdateAttempter::~UpdateAttempter() {
   // Release ourselves as the ActionProcessor's delegate to prevent
   // re-scheduling the updates due to the processing stopped.
   processor_->set_delegate(nullptr);
+  StopSourceHashPrecomputation();
 }
 
 void UpdateAttempter::Init() {
@@ -154,6 +198,9 @@ void UpdateAttempter::Init() {
   if (cert_checker_)
     cert_checker_->SetObserver(this);
 
+  source_hash_precomputer_.reset(
+      new SourceHashPrecomputer(system_state_->boot_control(), prefs_));
+
   // In case of update_engine restart without a reboot we need to restore the
   // reboot needed state.
   if (GetBootTimeAtUpdate(nullptr))
@@ -265,6 +312,9 @@ void UpdateAttempter::Update(const string& app_version,
   if (forced_update_pending_callback_.get())
     forced_update_pending_callback_->Run(false, false);
 
+  // The update reads the partitions itself, at its own priority.
+  StopSourceHashPrecomputation();
+
   fake_update_success_ = false;
   if (status_ == UpdateStatus::UPDATED_NEED_REBOOT) {
     // Although we have applied an update, we still want to ping Omaha
@@ -286,6 +336,12 @@ void UpdateAttempter::Update(const string& app_version,
     return;
   }
 
+#if USE_LIBCROS
+  // The network may have changed since the last attempt, so the proxies are
+  // resolved again for this one.
+  chrome_proxy_resolver_.ClearCache();
+#endif  // USE_LIBCROS
+
   if (!CalculateUpdateParams(app_version,
                              omaha_url,
                              target_channel,
@@ -588,18 +644,27 @@ void UpdateAttempter::BuildPostInstallActions(
       new PostinstallRunnerAction(system_state_->boot_control(),
                                   system_state_->hardware()));
   postinstall_runner_action->set_delegate(this);
+  // The payload marks the partitions whose postinstall is independent.
+  postinstall_runner_action->set_parallel_postinstall(true);
   actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
   BondActions(previous_action,
               postinstall_runner_action.get());
 }
 
+LibcurlHttpFetcher* UpdateAttempter::NewLibcurlHttpFetcher() {
+  LibcurlHttpFetcher* fetcher =
+      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
+  fetcher->set_connection_cache(system_state_->connection_cache());
+  return fetcher;
+}
+
 void UpdateAttempter::BuildUpdateActions(bool interactive) {
   CHECK(!processor_->IsRunning());
   processor_->set_delegate(this);
 
   // Actions:
   std::unique_ptr<LibcurlHttpFetcher> update_check_fetcher(
-      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware()));
+      NewLibcurlHttpFetcher());
   update_check_fetcher->set_server_to_check(ServerToCheck::kUpdate);
   // Try harder to connect to the network, esp when not interactive.
   // See comment in libcurl_http_fetcher.cc.
@@ -609,23 +674,33 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                              nullptr,
                              std::move(update_check_fetcher),
                              false));
+  update_check_action->set_event_queue(&omaha_event_queue_, false);
+  // The candidate URLs are probed with the same kind of fetcher used for the
+  // download.
+  shared_ptr<UrlProbeAction> url_probe_action(new UrlProbeAction(
+      system_state_,
+      base::Bind([this]() -> HttpFetcher* {
+        LibcurlHttpFetcher* fetcher = NewLibcurlHttpFetcher();
+        fetcher->set_server_to_check(ServerToCheck::kDownload);
+        return fetcher;
+      })));
   shared_ptr<OmahaResponseHandlerAction> response_handler_action(
       new OmahaResponseHandlerAction(system_state_));
   shared_ptr<FilesystemVerifierAction> src_filesystem_verifier_action(
       new FilesystemVerifierAction(system_state_->boot_control(),
                                    VerifierMode::kComputeSourceHash));
+  src_filesystem_verifier_action->set_source_hash_cache(prefs_);
+  src_filesystem_verifier_action->set_read_buffers(kVerifierReadBuffers,
+                                                   kVerifierReadBufferSize);
 
   shared_ptr<OmahaRequestAction> download_started_action(
       new OmahaRequestAction(system_state_,
                              new OmahaEvent(
                                  OmahaEvent::kTypeUpdateDownloadStarted),
-                             brillo::make_unique_ptr(new LibcurlHttpFetcher(
-                                 GetProxyResolver(),
-                                 system_state_->hardware())),
+                             brillo::make_unique_ptr(NewLibcurlHttpFetcher()),
                              false));
 
-  LibcurlHttpFetcher* download_fetcher =
-      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
+  LibcurlHttpFetcher* download_fetcher = NewLibcurlHttpFetcher();
   download_fetcher->set_server_to_check(ServerToCheck::kDownload);
   shared_ptr<DownloadAction> download_action(new DownloadAction(
       prefs_,
@@ -637,27 +712,50 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
       new OmahaRequestAction(
           system_state_,
           new OmahaEvent(OmahaEvent::kTypeUpdateDownloadFinished),
-          brillo::make_unique_ptr(
-              new LibcurlHttpFetcher(GetProxyResolver(),
-                                     system_state_->hardware())),
+          brillo::make_unique_ptr(NewLibcurlHttpFetcher()),
           false));
   shared_ptr<FilesystemVerifierAction> dst_filesystem_verifier_action(
       new FilesystemVerifierAction(system_state_->boot_control(),
                                    VerifierMode::kVerifyTargetHash));
+  dst_filesystem_verifier_action->set_read_buffers(kVerifierReadBuffers,
+                                                   kVerifierReadBufferSize);
   shared_ptr<OmahaRequestAction> update_complete_action(
       new OmahaRequestAction(
           system_state_,
           new OmahaEvent(OmahaEvent::kTypeUpdateComplete),
-          brillo::make_unique_ptr(
-              new LibcurlHttpFetcher(GetProxyResolver(),
-                                     system_state_->hardware())),
+          brillo::make_unique_ptr(NewLibcurlHttpFetcher()),
           false));
 
+  // The progress events of a background update are only counted by the
+  // server, so they wait to be sent with the next event, usually the update
+  // complete one. Those of an interactive update are sent right away.
+  download_started_action->set_event_queue(&omaha_event_queue_, !interactive);
+  download_finished_action->set_event_queue(&omaha_event_queue_,
+                                            !interactive);
+  update_complete_action->set_event_queue(&omaha_event_queue_, false);
+
   download_action->set_delegate(this);
+  // The source partitions are hashed while the payload starts downloading, and
+  // only the operations reading from them wait for their hashes.
+  download_action->set_defer_source_verification(true);
+  src_filesystem_verifier_action->set_source_hashes_callback(
+      base::Bind(&DownloadAction::SetSourcePartitionHashes,
+                 base::Unretained(download_action.get())));
+  // There is no need to finish hashing the source partitions when all the
+  // operations of the payload check the source data they read.
+  download_action->set_lazy_source_verification(
+      true,
+      base::Bind(&FilesystemVerifierAction::StopComputingSourceHashes,
+                 base::Unretained(src_filesystem_verifier_action.get())));
+  // A payload downloaded before and applied again, because the previous
+  // attempt failed after it, mostly writes the data already written.
+  download_action->set_compare_before_write(
+      system_state_->payload_state()->GetPayloadAttemptNumber() > 0);
   response_handler_action_ = response_handler_action;
   download_action_ = download_action;
 
   actions_.push_back(shared_ptr<AbstractAction>(update_check_action));
+  actions_.push_back(shared_ptr<AbstractAction>(url_probe_action));
   actions_.push_back(shared_ptr<AbstractAction>(response_handler_action));
   actions_.push_back(shared_ptr<AbstractAction>(
       src_filesystem_verifier_action));
@@ -670,10 +768,11 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
   // Bond them together. We have to use the leaf-types when calling
   // BondActions().
   BondActions(update_check_action.get(),
+              url_probe_action.get());
+  BondActions(url_probe_action.get(),
               response_handler_action.get());
   BondActions(response_handler_action.get(),
-              src_filesystem_verifier_action.get());
-  BondActions(src_filesystem_verifier_action.get(),
+              src_filesystem_verifier_action.get(),
               download_action.get());
   BondActions(download_action.get(),
               dst_filesystem_verifier_action.get());
@@ -681,9 +780,16 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
 
   actions_.push_back(shared_ptr<AbstractAction>(update_complete_action));
 
-  // Enqueue the actions
+  // Enqueue the actions. The source verifier and the download, after its
+  // started event, run at the same time once the response is handled.
   for (const shared_ptr<AbstractAction>& action : actions_) {
-    processor_->EnqueueAction(action.get());
+    if (action == src_filesystem_verifier_action ||
+        action == download_started_action) {
+      processor_->EnqueueActionWithDependencies(
+          action.get(), {response_handler_action.get()});
+    } else {
+      processor_->EnqueueAction(action.get());
+    }
   }
 }
 
@@ -870,6 +976,11 @@ void UpdateAttempter::OnUpdateScheduled(EvalStatus status,
                                         const UpdateCheckParams& params) {
   waiting_for_scheduled_check_ = false;
 
+  // Report the cost of the policy evaluations leading to this check.
+  metrics::ReportPolicyEvaluationMetrics(
+      system_state_,
+      system_state_->update_manager()->policy_stats()->TakeSummary());
+
   if (status == EvalStatus::kSucceeded) {
     if (!params.updates_enabled) {
       LOG(WARNING) << "Updates permanently disabled.";
@@ -918,9 +1029,13 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
                                      ErrorCode code) {
   LOG(INFO) << "Processing Done.";
   actions_.clear();
+  WriteUpdateTrace();
+  ReportMemoryPeaks(system_state_);
 
-  // Reset cpu shares back to normal.
-  cpu_limiter_.StopLimiter();
+  // Reset the resource and rate limits back to normal.
+  resource_governor_.Stop();
+  bandwidth_manager_.Stop();
+  connection_warmer_.Stop();
 
   if (status_ == UpdateStatus::REPORTING_ERROR_EVENT) {
     LOG(INFO) << "Error event sent.";
@@ -928,6 +1043,7 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
     // Inform scheduler of new status;
     SetStatusAndNotify(UpdateStatus::IDLE);
     ScheduleUpdates();
+    ScheduleSourceHashPrecomputation();
 
     if (!fake_update_success_) {
       return;
@@ -993,18 +1109,32 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
   LOG(INFO) << "No update.";
   SetStatusAndNotify(UpdateStatus::IDLE);
   ScheduleUpdates();
+  ScheduleSourceHashPrecomputation();
 }
 
 void UpdateAttempter::ProcessingStopped(const ActionProcessor* processor) {
-  // Reset cpu shares back to normal.
-  cpu_limiter_.StopLimiter();
+  WriteUpdateTrace();
+  ReportMemoryPeaks(system_state_);
+  // Reset the resource and rate limits back to normal.
+  resource_governor_.Stop();
+  bandwidth_manager_.Stop();
+  connection_warmer_.Stop();
   download_progress_ = 0.0;
   SetStatusAndNotify(UpdateStatus::IDLE);
   ScheduleUpdates();
+  ScheduleSourceHashPrecomputation();
   actions_.clear();
   error_event_.reset(nullptr);
 }
 
+void UpdateAttempter::ActionResourceUsage(const ActionProcessor* processor,
+                                          const AbstractAction* action,
+                                          const ResourceUsage& start,
+                                          const ResourceUsage& end) {
+  metrics::ReportActionResourceUsageMetrics(
+      system_state_, action->Type(), start, end);
+}
+
 // Called whenever an action has finished processing, either successfully
 // or otherwise.
 void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
@@ -1019,6 +1149,19 @@ void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
     download_progress_ = 0.0;
     DownloadAction* download_action = static_cast<DownloadAction*>(action);
     http_response_code_ = download_action->GetHTTPResponseCode();
+    const TransferStats& transfer_stats =
+        download_action->http_fetcher()->transfer_stats();
+    metrics::ReportDownloadTransferMetrics(system_state_, transfer_stats);
+    system_state_->payload_state()->DownloadTransferEnded(transfer_stats);
+    const OperationStats* operation_stats = download_action->operation_stats();
+    if (code == ErrorCode::kSuccess && operation_stats)
+      metrics::ReportInstallOperationMetrics(system_state_, *operation_stats);
+    connection_warmer_.Stop();
+  } else if (type == FilesystemVerifierAction::StaticType()) {
+    if (code == ErrorCode::kSuccess) {
+      metrics::ReportVerificationMetrics(
+          system_state_, *static_cast<FilesystemVerifierAction*>(action));
+    }
   } else if (type == OmahaRequestAction::StaticType()) {
     OmahaRequestAction* omaha_request_action =
         static_cast<OmahaRequestAction*>(action);
@@ -1037,6 +1180,18 @@ void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
       // Store the server-dictated poll interval, if any.
       server_dictated_poll_interval_ =
           std::max(0, omaha_request_action->GetOutputObject().poll_interval);
+
+      // Connect to the payload hosts while the response is handled. The
+      // download only reuses the connections through the shared cache.
+      const OmahaResponse& response = omaha_request_action->GetOutputObject();
+      if (code == ErrorCode::kSuccess && response.update_exists &&
+          system_state_->connection_cache()) {
+        for (const string& url :
+             ConnectionWarmer::UrlsToWarm(response.payload_urls)) {
+          connection_warmer_.Warm(
+              std::unique_ptr<HttpFetcher>(NewLibcurlHttpFetcher()), url);
+        }
+      }
     }
   }
   if (code != ErrorCode::kSuccess) {
@@ -1062,8 +1217,11 @@ void UpdateAttempter::ActionCompleted(ActionProcessor* processor,
     UpdateLastCheckedTime();
     new_version_ = plan.version;
     new_payload_size_ = plan.payload_size;
-    SetupDownload();
-    cpu_limiter_.StartLimiter();
+    SetupDownload(plan);
+    resource_governor_.Start(download_action_.get(),
+                             omaha_request_params_->interactive());
+    bandwidth_manager_.Start(download_action_->http_fetcher(),
+                             resource_governor_.fast_mode());
     SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
   } else if (type == DownloadAction::StaticType()) {
     SetStatusAndNotify(UpdateStatus::FINALIZING);
@@ -1076,6 +1234,7 @@ void UpdateAttempter::BytesReceived(uint64_t bytes_progressed,
   // The PayloadState keeps track of how many bytes were actually downloaded
   // from a given URL for the URL skipping logic.
   system_state_->payload_state()->DownloadProgress(bytes_progressed);
+  bandwidth_manager_.BytesReceived(bytes_progressed);
 
   double progress = 0;
   if (total)
@@ -1092,6 +1251,12 @@ void UpdateAttempter::DownloadComplete() {
   system_state_->payload_state()->DownloadComplete();
 }
 
+void UpdateAttempter::ChainedPayloadStarted(const InstallPlan& install_plan) {
+  // The chained payloads are fetched over a single connection, the local
+  // peer only shares the first one.
+  SetupDownload(install_plan);
+}
+
 bool UpdateAttempter::OnCheckForUpdates(brillo::ErrorPtr* error) {
   CheckForUpdate(
       "" /* app_version */, "" /* omaha_url */, true /* interactive */);
@@ -1204,6 +1369,19 @@ bool UpdateAttempter::GetStatus(int64_t* last_checked_time,
   return true;
 }
 
+bool UpdateAttempter::GetDownloadRate(int64_t* current_rate_bps,
+                                      int64_t* target_rate_bps) {
+  *current_rate_bps = bandwidth_manager_.current_rate_bps();
+  *target_rate_bps = bandwidth_manager_.target_rate_bps();
+  return true;
+}
+
+void UpdateAttempter::SetFastMode(bool fast_mode) {
+  resource_governor_.SetFastMode(fast_mode);
+  bandwidth_manager_.set_interactive(omaha_request_params_->interactive() ||
+                                     fast_mode);
+}
+
 void UpdateAttempter::UpdateBootFlags() {
   if (update_boot_flags_running_) {
     LOG(INFO) << "Update boot flags running, nothing to do.";
@@ -1292,6 +1470,8 @@ bool UpdateAttempter::ShouldCancel(ErrorCode* cancel_reason) {
 }
 
 void UpdateAttempter::SetStatusAndNotify(UpdateStatus status) {
+  if (status != status_ && MemoryTracker::current())
+    MemoryTracker::current()->StartPhase(UpdateStatusToString(status));
   status_ = status;
   BroadcastStatus();
 }
@@ -1354,10 +1534,9 @@ bool UpdateAttempter::ScheduleErrorEventAction() {
   shared_ptr<OmahaRequestAction> error_event_action(
       new OmahaRequestAction(system_state_,
                              error_event_.release(),  // Pass ownership.
-                             brillo::make_unique_ptr(new LibcurlHttpFetcher(
-                                 GetProxyResolver(),
-                                 system_state_->hardware())),
+                             brillo::make_unique_ptr(NewLibcurlHttpFetcher()),
                              false));
+  error_event_action->set_event_queue(&omaha_event_queue_, false);
   actions_.push_back(shared_ptr<AbstractAction>(error_event_action));
   processor_->EnqueueAction(error_event_action.get());
   SetStatusAndNotify(UpdateStatus::REPORTING_ERROR_EVENT);
@@ -1394,11 +1573,28 @@ void UpdateAttempter::MarkDeltaUpdateFailure() {
   prefs_->SetInt64(kPrefsDeltaUpdateFailures, ++delta_failures);
 }
 
-void UpdateAttempter::SetupDownload() {
+void UpdateAttempter::SetupDownload(const InstallPlan& install_plan) {
   MultiRangeHttpFetcher* fetcher =
       static_cast<MultiRangeHttpFetcher*>(download_action_->http_fetcher());
   fetcher->ClearRanges();
-  if (response_handler_action_->install_plan().is_resume) {
+  PayloadStateInterface* const payload_state = system_state_->payload_state();
+  // When downloading from a local peer, the payload is fetched in segments
+  // from both the peer and the regular URL at the same time. The segments the
+  // peer is slow to serve, or all of them if it goes away, come from the
+  // regular URL. This needs the length of the ranges to be known.
+  uint64_t payload_size = 0;
+  if (payload_state->GetUsingP2PForDownloading() &&
+      install_plan.download_url == payload_state->GetP2PUrl() &&
+      !payload_state->GetCurrentUrl().empty()) {
+    LOG(INFO) << "Also fetching the payload from "
+              << payload_state->GetCurrentUrl() << " while using p2p.";
+    LibcurlHttpFetcher* http_fetcher = NewLibcurlHttpFetcher();
+    http_fetcher->set_server_to_check(ServerToCheck::kDownload);
+    fetcher->AddParallelFetcher(http_fetcher,  // passes ownership
+                                payload_state->GetCurrentUrl());
+    payload_size = install_plan.payload_size;
+  }
+  if (install_plan.is_resume) {
     // Resuming an update so fetch the update manifest metadata first.
     int64_t manifest_metadata_size = 0;
     int64_t manifest_signature_size = 0;
@@ -1412,9 +1608,14 @@ void UpdateAttempter::SetupDownload() {
     prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
     uint64_t resume_offset =
         manifest_metadata_size + manifest_signature_size + next_data_offset;
-    if (resume_offset < response_handler_action_->install_plan().payload_size) {
-      fetcher->AddRange(resume_offset);
+    if (resume_offset < install_plan.payload_size) {
+      if (payload_size > 0)
+        fetcher->AddRange(resume_offset, payload_size - resume_offset);
+      else
+        fetcher->AddRange(resume_offset);
     }
+  } else if (payload_size > 0) {
+    fetcher->AddRange(0, payload_size);
   } else {
     fetcher->AddRange(0);
   }
@@ -1425,9 +1626,7 @@ void UpdateAttempter::PingOmaha() {
     shared_ptr<OmahaRequestAction> ping_action(new OmahaRequestAction(
         system_state_,
         nullptr,
-        brillo::make_unique_ptr(new LibcurlHttpFetcher(
-            GetProxyResolver(),
-            system_state_->hardware())),
+        brillo::make_unique_ptr(NewLibcurlHttpFetcher()),
         true));
     actions_.push_back(shared_ptr<OmahaRequestAction>(ping_action));
     processor_->set_delegate(nullptr);
@@ -1524,6 +1723,7 @@ void UpdateAttempter::UpdateEngineStarted() {
 
   system_state_->payload_state()->UpdateEngineStarted();
   StartP2PAtStartup();
+  ScheduleSourceHashPrecomputation();
 }
 
 bool UpdateAttempter::StartP2PAtStartup() {
@@ -1542,6 +1742,35 @@ bool UpdateAttempter::StartP2PAtStartup() {
   return StartP2PAndPerformHousekeeping();
 }
 
+void UpdateAttempter::ScheduleSourceHashPrecomputation() {
+  if (!source_hash_precomputer_ || status_ != UpdateStatus::IDLE ||
+      source_hash_precomputation_id_ != MessageLoop::kTaskIdNull) {
+    return;
+  }
+  source_hash_precomputation_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      Bind(&UpdateAttempter::StartSourceHashPrecomputation,
+           base::Unretained(this)),
+      TimeDelta::FromMinutes(kSourceHashPrecomputationDelayMinutes));
+}
+
+void UpdateAttempter::StartSourceHashPrecomputation() {
+  source_hash_precomputation_id_ = MessageLoop::kTaskIdNull;
+  if (status_ != UpdateStatus::IDLE || processor_->IsRunning())
+    return;
+  source_hash_precomputer_->Start(
+      {kLegacyPartitionNameKernel, kLegacyPartitionNameRoot});
+}
+
+void UpdateAttempter::StopSourceHashPrecomputation() {
+  if (source_hash_precomputation_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(source_hash_precomputation_id_);
+    source_hash_precomputation_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (source_hash_precomputer_)
+    source_hash_precomputer_->Stop();
+}
+
 bool UpdateAttempter::StartP2PAndPerformHousekeeping() {
   if (system_state_ == nullptr)
     return false;
@@ -31,16 +31,19 @@
 
 #include "debugd/dbus-proxies.h"
 #include "update_engine/chrome_browser_proxy_resolver.h"
+#include "update_engine/bandwidth_manager.h"
 #include "update_engine/certificate_checker.h"
 #include "update_engine/client_library/include/update_engine/update_status.h"
 #include "update_engine/common/action_processor.h"
-#include "update_engine/common/cpu_limiter.h"
+#include "update_engine/connection_warmer.h"
 #include "update_engine/libcros_proxy.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
 #include "update_engine/payload_consumer/download_action.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/payload_consumer/source_hash_precomputer.h"
 #include "update_engine/proxy_resolver.h"
+#include "update_engine/resource_governor.h"
 #include "update_engine/service_observer_interface.h"
 #include "update_engine/system_state.h"
 #include "update_engine/update_manager/policy.h"
@@ -55,6 +58,7 @@ class PolicyProvider;
 
 namespace chromeos_update_engine {
 
+class LibcurlHttpFetcher;
 class UpdateEngineAdaptor;
 
 class UpdateAttempter : public ActionProcessorDelegate,
@@ -99,6 +103,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
   void ActionCompleted(ActionProcessor* processor,
                        AbstractAction* action,
                        ErrorCode code) override;
+  void ActionResourceUsage(const ActionProcessor* processor,
+                           const AbstractAction* action,
+                           const ResourceUsage& start,
+                           const ResourceUsage& end) override;
 
   // WeaveServiceInterface::DelegateInterface overrides.
   bool OnCheckForUpdates(brillo::ErrorPtr* error) override;
@@ -127,6 +135,16 @@ class UpdateAttempter : public ActionProcessorDelegate,
                          std::string* new_version,
                          int64_t* new_size);
 
+  // Returns in the out params the download rate measured recently and its
+  // current limit, 0 if not limited, in bytes/sec. Returns true on success.
+  virtual bool GetDownloadRate(int64_t* current_rate_bps,
+                               int64_t* target_rate_bps);
+
+  // Turns the fast mode, which lifts the limits of the resources and
+  // download rate of the update, on or off for the update in progress or the
+  // next one.
+  virtual void SetFastMode(bool fast_mode);
+
   // Runs chromeos-setgoodkernel, whose responsibility it is to mark the
   // currently booted partition has high priority/permanent/etc. The execution
   // is asynchronous. On completion, the action processor may be started
@@ -177,6 +195,7 @@ class UpdateAttempter : public ActionProcessorDelegate,
   bool ShouldCancel(ErrorCode* cancel_reason) override;
 
   void DownloadComplete() override;
+  void ChainedPayloadStarted(const InstallPlan& install_plan) override;
 
   // Broadcasts the current status to all observers.
   void BroadcastStatus();
@@ -289,8 +308,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Sets the status to the given status and notifies a status update over dbus.
   void SetStatusAndNotify(UpdateStatus status);
 
-  // Sets up the download parameters after receiving the update check response.
-  void SetupDownload();
+  // Sets up the download parameters of the payload of the |install_plan|,
+  // after receiving the update check response or when a chained payload
+  // starts.
+  void SetupDownload(const InstallPlan& install_plan);
 
   // Creates an error event object in |error_event_| to be included in an
   // OmahaRequestAction once the current action processor is done.
@@ -324,6 +345,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
 #endif  // USE_LIBCROS
   }
 
+  // Returns a new LibcurlHttpFetcher using the current proxy resolver and the
+  // connection cache shared by all the fetchers of the system state.
+  LibcurlHttpFetcher* NewLibcurlHttpFetcher();
+
   // Sends a ping to Omaha.
   // This is used after an update has been applied and we're waiting for the
   // user to reboot.  This ping helps keep the number of actives count
@@ -381,6 +406,18 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // started and housekeeping was performed.
   bool StartP2PAtStartup();
 
+  // Schedules the precomputation of the hashes of the running slot, unless an
+  // update is running. It starts after a delay, so it doesn't slow down the
+  // boot and is less likely to be cancelled by an update check.
+  void ScheduleSourceHashPrecomputation();
+
+  // Starts the scheduled precomputation if the device is still idle.
+  void StartSourceHashPrecomputation();
+
+  // Cancels the precomputation, scheduled or in progress, when an update
+  // starts.
+  void StopSourceHashPrecomputation();
+
   // Writes to the processing completed marker. Does nothing if
   // |update_completed_marker_| is empty.
   void WriteUpdateCompletedMarker();
@@ -438,14 +475,32 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Pending error event, if any.
   std::unique_ptr<OmahaEvent> error_event_;
 
+  // The Omaha events of background updates waiting to be sent along with the
+  // next event request or update check, so an update cycle doesn't make a
+  // round trip for each of them.
+  std::vector<OmahaEvent> omaha_event_queue_;
+
   // If we should request a reboot even tho we failed the update
   bool fake_update_success_ = false;
 
   // HTTP server response code from the last HTTP request action.
   int http_response_code_ = 0;
 
-  // CPU limiter during the update.
-  CPULimiter cpu_limiter_;
+  // CPU and I/O limiter during the update.
+  ResourceGovernor resource_governor_;
+
+  // Download rate limiter during the update.
+  BandwidthManager bandwidth_manager_;
+
+  // Opens the connections to the payload hosts while the update check response
+  // is handled.
+  ConnectionWarmer connection_warmer_;
+
+  // Hashes the partitions of the running slot while idle, for the next update,
+  // and the task starting it.
+  std::unique_ptr<SourceHashPrecomputer> source_hash_precomputer_;
+  brillo::MessageLoop::TaskId source_hash_precomputation_id_{
+      brillo::MessageLoop::kTaskIdNull};
 
   // For status:
   UpdateStatus status_{UpdateStatus::IDLE};
@@ -18,16 +18,19 @@
 
 #include <algorithm>
 #include <map>
+#include <string>
 #include <utility>
 
 #include <base/bind.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
 #include <brillo/bind_lambda.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/strings/string_utils.h>
 
 #include "update_engine/common/constants.h"
+#include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/file_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/utils.h"
@@ -41,6 +44,8 @@
 #ifndef _UE_SIDELOAD
 // Do not include support for external HTTP(s) urls when building
 // update_engine_sideload.
+#include "update_engine/common/staging_http_fetcher.h"
+#include "update_engine/libcurl_connection_cache.h"
 #include "update_engine/libcurl_http_fetcher.h"
 #endif
 
@@ -59,6 +64,26 @@ namespace {
 const double kBroadcastThresholdProgress = 0.01;  // 1%
 const int kBroadcastThresholdSeconds = 10;
 
+// The maximum number of HTTP connections the payload can be downloaded over.
+const int kMaxParallelConnections = 8;
+
+// The libcurl receive buffer size of the payload downloads, much larger than
+// the libcurl default so each MB takes fewer callbacks. With HTTP/2, all the
+// connections of the download may also share a single TCP connection.
+const size_t kDownloadReceiveBufferSize = 256 * 1024;  // 256 KiB
+
+// The number of worker threads applying the operations of the payloads. The
+// operations applied on them are interrupted at their next I/O by
+// SuspendUpdate() and CancelUpdate(), while the ones applied inline only stop
+// at the end of the download chunk being applied.
+const size_t kNumApplyWorkerThreads = 2;
+
+// The read buffers of the partitions hashed by the FilesystemVerifierActions.
+// The eMMC and UFS storage of the devices keeps several reads in flight faster
+// than one.
+const size_t kVerifierReadBuffers = 4;
+const size_t kVerifierReadBufferSize = 256 * 1024;  // 256 KiB
+
 const char* const kErrorDomain = "update_engine";
 // TODO(deymo): Convert the different errors to a numeric value to report them
 // back on the service error.
@@ -74,6 +99,28 @@ bool LogAndSetError(brillo::ErrorPtr* error,
   return false;
 }
 
+// Parses the |value| of a chained or component payload property, with the
+// url, offset, size, file hash and metadata size of the payload separated by
+// spaces, into |payload| and |offset|. The payload must be fetched with the
+// same kind of fetcher as the main one at |payload_url|.
+bool ParsePayloadProperty(const string& value,
+                          const string& payload_url,
+                          InstallPlan::Payload* payload,
+                          int64_t* offset) {
+  vector<string> fields = base::SplitString(
+      value, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (fields.size() != 5 || !base::StringToInt64(fields[1], offset) ||
+      *offset < 0 || !base::StringToUint64(fields[2], &payload->size) ||
+      !base::StringToUint64(fields[4], &payload->metadata_size) ||
+      FileFetcher::SupportedUrl(fields[0]) !=
+          FileFetcher::SupportedUrl(payload_url)) {
+    return false;
+  }
+  payload->download_url = fields[0];
+  payload->hash = fields[3];
+  return true;
+}
+
 }  // namespace
 
 UpdateAttempterAndroid::UpdateAttempterAndroid(
@@ -110,6 +157,35 @@ bool UpdateAttempterAndroid::ApplyPayload(
     int64_t payload_size,
     const vector<string>& key_value_pair_headers,
     brillo::ErrorPtr* error) {
+  return StartAttempt(payload_url,
+                      payload_offset,
+                      payload_size,
+                      key_value_pair_headers,
+                      false,  // precheck_only
+                      error);
+}
+
+bool UpdateAttempterAndroid::PrecheckPayload(
+    const string& payload_url,
+    int64_t payload_offset,
+    int64_t payload_size,
+    const vector<string>& key_value_pair_headers,
+    brillo::ErrorPtr* error) {
+  return StartAttempt(payload_url,
+                      payload_offset,
+                      payload_size,
+                      key_value_pair_headers,
+                      true,  // precheck_only
+                      error);
+}
+
+bool UpdateAttempterAndroid::StartAttempt(
+    const string& payload_url,
+    int64_t payload_offset,
+    int64_t payload_size,
+    const vector<string>& key_value_pair_headers,
+    bool precheck_only,
+    brillo::ErrorPtr* error) {
   if (status_ == UpdateStatus::UPDATED_NEED_REBOOT) {
     return LogAndSetError(
         error, FROM_HERE, "An update already applied, waiting for reboot");
@@ -119,6 +195,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
         error, FROM_HERE, "Already processing an update, cancel it first.");
   }
   DCHECK(status_ == UpdateStatus::IDLE);
+  precheck_only_ = precheck_only;
 
   std::map<string, string> headers;
   for (const string& key_value_pair : key_value_pair_headers) {
@@ -157,13 +234,43 @@ bool UpdateAttempterAndroid::ApplyPayload(
     install_plan_.metadata_size = 0;
   }
   install_plan_.metadata_signature = "";
+
+  // The payloads applied after this one, from the version it installs, are
+  // passed in order as CHAINED_PAYLOAD_1, CHAINED_PAYLOAD_2 and so on, each
+  // one with its url, offset, size, file hash and metadata size separated by
+  // spaces. They are fetched with the same kind of fetcher as the first one.
+  chained_payload_offsets_.clear();
+  for (size_t n = 1;; n++) {
+    const auto header =
+        headers.find(kPayloadPropertyChainedPayloadPrefix + std::to_string(n));
+    if (header == headers.end())
+      break;
+    InstallPlan::Payload payload;
+    int64_t offset = 0;
+    if (!ParsePayloadProperty(header->second, payload_url, &payload, &offset)) {
+      return LogAndSetError(
+          error, FROM_HERE, "Invalid chained payload: " + header->second);
+    }
+    install_plan_.chained_payloads.push_back(payload);
+    chained_payload_offsets_.push_back(offset);
+    // The progress is only resumed for the same chain.
+    if (!payload_id.empty())
+      payload_id += payload.hash;
+  }
+  // The chained payloads apply on the target slot, so only the first one can
+  // be checked before applying it.
+  if (precheck_only_) {
+    install_plan_.chained_payloads.clear();
+    chained_payload_offsets_.clear();
+  }
   // The |public_key_rsa| key would override the public key stored on disk.
   install_plan_.public_key_rsa = "";
 
   install_plan_.hash_checks_mandatory = hardware_->IsOfficialBuild();
-  install_plan_.is_resume = !payload_id.empty() &&
+  // The precheck leaves the progress of the previous update untouched.
+  install_plan_.is_resume = !precheck_only_ && !payload_id.empty() &&
                             DeltaPerformer::CanResumeUpdate(prefs_, payload_id);
-  if (!install_plan_.is_resume) {
+  if (!install_plan_.is_resume && !precheck_only_) {
     if (!DeltaPerformer::ResetUpdateProgress(prefs_, false)) {
       LOG(WARNING) << "Unable to reset the update progress.";
     }
@@ -182,6 +289,38 @@ bool UpdateAttempterAndroid::ApplyPayload(
       base::StringToInt(headers[kPayloadPropertyPowerwash], &data_wipe) &&
       data_wipe != 0;
 
+  // The payloads of independent components, updating other partitions of the
+  // target slot, are passed as COMPONENT_PAYLOAD_1, COMPONENT_PAYLOAD_2 and so
+  // on, in the format of the chained payloads. They are applied concurrently
+  // with the main one and with each other, and the update fails if two of them
+  // update the same partition. They are ignored by the precheck.
+  components_.clear();
+  partition_claims_.clear();
+  for (size_t n = 1; !precheck_only_; n++) {
+    const auto header = headers.find(kPayloadPropertyComponentPayloadPrefix +
+                                     std::to_string(n));
+    if (header == headers.end())
+      break;
+    InstallPlan::Payload payload;
+    std::unique_ptr<ComponentPayload> component(new ComponentPayload(this));
+    if (!ParsePayloadProperty(
+            header->second, payload_url, &payload, &component->offset)) {
+      return LogAndSetError(
+          error, FROM_HERE, "Invalid component payload: " + header->second);
+    }
+    InstallPlan& plan = component->install_plan;
+    plan.download_url = payload.download_url;
+    plan.payload_size = payload.size;
+    plan.payload_hash = payload.hash;
+    plan.metadata_size = payload.metadata_size;
+    plan.hash_checks_mandatory = install_plan_.hash_checks_mandatory;
+    plan.payload_type = install_plan_.payload_type;
+    plan.source_slot = install_plan_.source_slot;
+    plan.target_slot = install_plan_.target_slot;
+    component->total_bytes = payload.size;
+    components_.push_back(std::move(component));
+  }
+
   NetworkId network_id = kDefaultNetworkId;
   if (!headers[kPayloadPropertyNetworkId].empty()) {
     if (!base::StringToUint64(headers[kPayloadPropertyNetworkId],
@@ -196,20 +335,75 @@ bool UpdateAttempterAndroid::ApplyPayload(
     }
   }
 
+  int num_connections = 1;
+  if (!headers[kPayloadPropertyParallelConnections].empty() &&
+      (!base::StringToInt(headers[kPayloadPropertyParallelConnections],
+                          &num_connections) ||
+       num_connections < 1 || num_connections > kMaxParallelConnections)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid number of parallel connections: " +
+                              headers[kPayloadPropertyParallelConnections]);
+  }
+
+  int http2 = 0;
+  bool use_http2 =
+      base::StringToInt(headers[kPayloadPropertyUseHttp2], &http2) &&
+      http2 != 0;
+
+  uint64_t staging_cache_size = 0;
+  if (!headers[kPayloadPropertyStagingCacheSize].empty() &&
+      !base::StringToUint64(headers[kPayloadPropertyStagingCacheSize],
+                            &staging_cache_size)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid staging cache size: " +
+                              headers[kPayloadPropertyStagingCacheSize]);
+  }
+#ifndef _UE_SIDELOAD
+  SetupStagingCache(
+      payload_url, payload_id, num_connections, staging_cache_size);
+#endif  // _UE_SIDELOAD
+
+  int max_download_speed = 0;
+  if (!headers[kPayloadPropertyMaxDownloadSpeed].empty() &&
+      (!base::StringToInt(headers[kPayloadPropertyMaxDownloadSpeed],
+                          &max_download_speed) ||
+       max_download_speed < 0)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid maximum download speed: " +
+                              headers[kPayloadPropertyMaxDownloadSpeed]);
+  }
+  download_scheduler_.reset(new DownloadScheduler(max_download_speed));
+
   LOG(INFO) << "Using this install plan:";
   install_plan_.Dump();
+  for (const auto& component : components_) {
+    LOG(INFO) << "Along with the component payload:";
+    component->install_plan.Dump();
+  }
 
-  BuildUpdateActions(payload_url);
+  bytes_received_ = total_bytes_ = 0;
+  BuildUpdateActions(payload_url, num_connections, use_http2);
   SetupDownload();
   // Setup extra headers.
-  HttpFetcher* fetcher = download_action_->http_fetcher();
-  if (!headers[kPayloadPropertyAuthorization].empty())
-    fetcher->SetHeader("Authorization", headers[kPayloadPropertyAuthorization]);
-  if (!headers[kPayloadPropertyUserAgent].empty())
-    fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
-
-  cpu_limiter_.StartLimiter();
-  SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
+  vector<HttpFetcher*> fetchers = {download_action_->http_fetcher()};
+  for (const auto& component : components_)
+    fetchers.push_back(component->download_action->http_fetcher());
+  for (HttpFetcher* fetcher : fetchers) {
+    if (!headers[kPayloadPropertyAuthorization].empty()) {
+      fetcher->SetHeader("Authorization",
+                         headers[kPayloadPropertyAuthorization]);
+    }
+    if (!headers[kPayloadPropertyUserAgent].empty())
+      fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
+  }
+
+  if (!precheck_only_) {
+    cpu_limiter_.StartLimiter();
+    SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
+  }
   ongoing_update_ = true;
 
   // Just in case we didn't update boot flags yet, make sure they're updated
@@ -287,10 +481,20 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
                                             ErrorCode code) {
   LOG(INFO) << "Processing Done.";
 
+  if (precheck_only_) {
+    LOG(INFO) << "Payload precheck done: " << utils::ErrorCodeToString(code);
+    TerminateUpdateAndNotify(code);
+    return;
+  }
+
   switch (code) {
     case ErrorCode::kSuccess:
       // Update succeeded.
       WriteUpdateCompletedMarker();
+#ifndef _UE_SIDELOAD
+      if (staging_cache_)
+        staging_cache_->Clear();
+#endif  // _UE_SIDELOAD
       prefs_->SetInt64(kPrefsDeltaUpdateFailures, 0);
       DeltaPerformer::ResetUpdateProgress(prefs_, false);
 
@@ -308,6 +512,18 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
       LOG(INFO) << "Resetting update progress.";
       break;
 
+#ifndef _UE_SIDELOAD
+    case ErrorCode::kPayloadHashMismatchError:
+    case ErrorCode::kPayloadSizeMismatchError:
+    case ErrorCode::kDownloadPayloadVerificationError:
+    case ErrorCode::kDownloadPayloadPubKeyVerificationError:
+    case ErrorCode::kDownloadOperationHashMismatch:
+      // The staged data may be what doesn't match, so it's downloaded again.
+      if (staging_cache_)
+        staging_cache_->Clear();
+      break;
+#endif  // _UE_SIDELOAD
+
     default:
       // Ignore all other error codes.
       break;
@@ -328,13 +544,20 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   // action succeeded.
   const string type = action->Type();
   if (type == DownloadAction::StaticType()) {
-    download_progress_ = 0;
+    // The other downloads get the bandwidth of a completed one.
+    download_scheduler_->RemoveDownload(
+        static_cast<DownloadAction*>(action)->http_fetcher());
+    if (pending_downloads_ > 0)
+      pending_downloads_--;
+    if (pending_downloads_ == 0)
+      download_progress_ = 0;
   }
   if (code != ErrorCode::kSuccess) {
     // If an action failed, the ActionProcessor will cancel the whole thing.
     return;
   }
-  if (type == DownloadAction::StaticType()) {
+  if (type == DownloadAction::StaticType() && pending_downloads_ == 0 &&
+      !precheck_only_) {
     SetStatusAndNotify(UpdateStatus::FINALIZING);
   }
 }
@@ -342,15 +565,16 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
 void UpdateAttempterAndroid::BytesReceived(uint64_t bytes_progressed,
                                            uint64_t bytes_received,
                                            uint64_t total) {
-  double progress = 0;
-  if (total)
-    progress = static_cast<double>(bytes_received) / static_cast<double>(total);
-  if (status_ != UpdateStatus::DOWNLOADING || bytes_received == total) {
-    download_progress_ = progress;
-    SetStatusAndNotify(UpdateStatus::DOWNLOADING);
-  } else {
-    ProgressUpdate(progress);
-  }
+  bytes_received_ = bytes_received;
+  total_bytes_ = total;
+  ReportDownloadProgress();
+}
+
+void UpdateAttempterAndroid::ComponentPayload::BytesReceived(
+    uint64_t bytes_progressed, uint64_t bytes_received, uint64_t total) {
+  this->bytes_received = bytes_received;
+  total_bytes = total;
+  attempter->ReportDownloadProgress();
 }
 
 bool UpdateAttempterAndroid::ShouldCancel(ErrorCode* cancel_reason) {
@@ -363,6 +587,39 @@ void UpdateAttempterAndroid::DownloadComplete() {
   // Nothing needs to be done when the download completes.
 }
 
+bool UpdateAttempterAndroid::FetchOnlyPayloadRanges(
+    const vector<std::pair<uint64_t, uint64_t>>& ranges) {
+  // When resuming, the first range fetched is the metadata, which was just
+  // parsed, so the ranges after it can be replaced.
+  if (!install_plan_.is_resume)
+    return false;
+  vector<std::pair<off_t, size_t>> fetcher_ranges;
+  uint64_t total_size = 0;
+  for (const auto& range : ranges) {
+    fetcher_ranges.emplace_back(base_offset_ + range.first, range.second);
+    total_size += range.second;
+  }
+  MultiRangeHttpFetcher* fetcher =
+      static_cast<MultiRangeHttpFetcher*>(download_action_->http_fetcher());
+  if (!fetcher->ReplaceRangesAfter(0, fetcher_ranges))
+    return false;
+  LOG(INFO) << "Fetching only " << total_size << " bytes of the payload in "
+            << ranges.size() << " ranges.";
+  return true;
+}
+
+void UpdateAttempterAndroid::ChainedPayloadStarted(
+    const InstallPlan& install_plan) {
+  // The chained payloads left tell which one starts.
+  DCHECK_LT(install_plan.chained_payloads.size(),
+            chained_payload_offsets_.size());
+  const size_t index = chained_payload_offsets_.size() -
+                       install_plan.chained_payloads.size() - 1;
+  base_offset_ = chained_payload_offsets_[index];
+  install_plan_ = install_plan;
+  SetupDownload();
+}
+
 void UpdateAttempterAndroid::ProgressUpdate(double progress) {
   // Self throttle based on progress. Also send notifications if progress is
   // too slow.
@@ -403,6 +660,15 @@ void UpdateAttempterAndroid::ScheduleProcessingStart() {
 }
 
 void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
+  if (precheck_only_) {
+    actions_.clear();
+    download_scheduler_->Clear();
+    ongoing_update_ = false;
+    precheck_only_ = false;
+    for (auto observer : daemon_state_->service_observers())
+      observer->SendPayloadPrecheckComplete(error_code);
+    return;
+  }
   if (status_ == UpdateStatus::IDLE) {
     LOG(ERROR) << "No ongoing update, but TerminatedUpdate() called.";
     return;
@@ -412,6 +678,9 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
   cpu_limiter_.StopLimiter();
   download_progress_ = 0;
   actions_.clear();
+  components_.clear();
+  partition_claims_.clear();
+  download_scheduler_->Clear();
   UpdateStatus new_status =
       (error_code == ErrorCode::kSuccess ? UpdateStatus::UPDATED_NEED_REBOOT
                                          : UpdateStatus::IDLE);
@@ -431,7 +700,30 @@ void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
   last_notify_time_ = TimeTicks::Now();
 }
 
-void UpdateAttempterAndroid::BuildUpdateActions(const string& url) {
+void UpdateAttempterAndroid::ReportDownloadProgress() {
+  // The metadata fetched by a precheck isn't an update progress.
+  if (precheck_only_)
+    return;
+  uint64_t bytes_received = bytes_received_;
+  uint64_t total = total_bytes_;
+  for (const auto& component : components_) {
+    bytes_received += component->bytes_received;
+    total += component->total_bytes;
+  }
+  double progress = 0;
+  if (total)
+    progress = static_cast<double>(bytes_received) / static_cast<double>(total);
+  if (status_ != UpdateStatus::DOWNLOADING || bytes_received == total) {
+    download_progress_ = progress;
+    SetStatusAndNotify(UpdateStatus::DOWNLOADING);
+  } else {
+    ProgressUpdate(progress);
+  }
+}
+
+void UpdateAttempterAndroid::BuildUpdateActions(const string& url,
+                                                int num_connections,
+                                                bool use_http2) {
   CHECK(!processor_->IsRunning());
   processor_->set_delegate(this);
 
@@ -439,55 +731,234 @@ void UpdateAttempterAndroid::BuildUpdateActions(const string& url) {
   shared_ptr<InstallPlanAction> install_plan_action(
       new InstallPlanAction(install_plan_));
 
-  HttpFetcher* download_fetcher = nullptr;
-  if (FileFetcher::SupportedUrl(url)) {
-    DLOG(INFO) << "Using FileFetcher for file URL.";
-    download_fetcher = new FileFetcher();
-  } else {
-#ifdef _UE_SIDELOAD
-    LOG(FATAL) << "Unsupported sideload URI: " << url;
-#else
-    LibcurlHttpFetcher* libcurl_fetcher =
-        new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    download_fetcher = libcurl_fetcher;
-#endif  // _UE_SIDELOAD
-  }
+  MultiRangeHttpFetcher* multi_range_fetcher =
+      NewPayloadFetcher(url, num_connections, use_http2, true);
+  uint64_t download_size = install_plan_.payload_size;
+  for (const InstallPlan::Payload& payload : install_plan_.chained_payloads)
+    download_size += payload.size;
+  download_scheduler_->AddDownload(multi_range_fetcher, download_size);
   shared_ptr<DownloadAction> download_action(new DownloadAction(
       prefs_,
       boot_control_,
       hardware_,
-      nullptr,                                        // system_state, not used.
-      new MultiRangeHttpFetcher(download_fetcher)));  // passes ownership
-  shared_ptr<FilesystemVerifierAction> dst_filesystem_verifier_action(
-      new FilesystemVerifierAction(boot_control_,
-                                   VerifierMode::kVerifyTargetHash));
-
-  shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
-      new PostinstallRunnerAction(boot_control_, hardware_));
-
+      nullptr,                // system_state, not used.
+      multi_range_fetcher));  // passes ownership
   download_action->set_delegate(this);
+  download_action->set_partition_claims(&partition_claims_, 0);
+  // The operations already applied in the interrupted attempt past its last
+  // checkpoint don't need to be downloaded again.
+  download_action->set_skip_satisfied_operations(install_plan_.is_resume);
+  // The operations applied again after the last checkpoint mostly write the
+  // data they already wrote.
+  download_action->set_compare_before_write(install_plan_.is_resume);
+  download_action->set_metadata_only(precheck_only_);
+  download_action->set_num_worker_threads(kNumApplyWorkerThreads);
   download_action_ = download_action;
-  postinstall_runner_action->set_delegate(this);
 
   actions_.push_back(shared_ptr<AbstractAction>(install_plan_action));
   actions_.push_back(shared_ptr<AbstractAction>(download_action));
-  actions_.push_back(
-      shared_ptr<AbstractAction>(dst_filesystem_verifier_action));
-  actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
-
   // Bond them together. We have to use the leaf-types when calling
   // BondActions().
   BondActions(install_plan_action.get(), download_action.get());
-  BondActions(download_action.get(), dst_filesystem_verifier_action.get());
-  BondActions(dst_filesystem_verifier_action.get(),
-              postinstall_runner_action.get());
+
+  if (precheck_only_) {
+    // The precheck verifies the source partitions the payload reads from,
+    // instead of applying it.
+    shared_ptr<FilesystemVerifierAction> src_filesystem_verifier_action(
+        new FilesystemVerifierAction(boot_control_,
+                                     VerifierMode::kVerifySourceHash));
+    src_filesystem_verifier_action->set_read_buffers(kVerifierReadBuffers,
+                                                     kVerifierReadBufferSize);
+    actions_.push_back(
+        shared_ptr<AbstractAction>(src_filesystem_verifier_action));
+    BondActions(download_action.get(), src_filesystem_verifier_action.get());
+  } else {
+    shared_ptr<FilesystemVerifierAction> dst_filesystem_verifier_action(
+        new FilesystemVerifierAction(boot_control_,
+                                     VerifierMode::kVerifyTargetHash));
+    dst_filesystem_verifier_action->set_read_buffers(kVerifierReadBuffers,
+                                                     kVerifierReadBufferSize);
+    shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
+        new PostinstallRunnerAction(boot_control_, hardware_));
+    postinstall_runner_action->set_delegate(this);
+    // The payload marks the partitions whose postinstall is independent.
+    postinstall_runner_action->set_parallel_postinstall(true);
+
+    actions_.push_back(
+        shared_ptr<AbstractAction>(dst_filesystem_verifier_action));
+    actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
+    BondActions(download_action.get(), dst_filesystem_verifier_action.get());
+    BondActions(dst_filesystem_verifier_action.get(),
+                postinstall_runner_action.get());
+  }
 
   // Enqueue the actions.
-  for (const shared_ptr<AbstractAction>& action : actions_)
-    processor_->EnqueueAction(action.get());
+  pending_downloads_ = 1 + components_.size();
+  if (components_.empty()) {
+    for (const shared_ptr<AbstractAction>& action : actions_)
+      processor_->EnqueueAction(action.get());
+    return;
+  }
+  // The component payloads are applied concurrently with the main one, but
+  // their postinstall steps run one at a time, since they may mount their
+  // partitions on the same directory, and before the one of the main payload,
+  // which marks the target slot active once all of them succeeded.
+  const vector<shared_ptr<AbstractAction>> main_actions = actions_;
+  for (size_t i = 0; i + 1 < main_actions.size(); i++)
+    processor_->EnqueueAction(main_actions[i].get());
+  AbstractAction* previous_postinstall = nullptr;
+  for (size_t i = 0; i < components_.size(); i++) {
+    previous_postinstall = BuildComponentActions(
+        components_[i].get(), i + 1, use_http2, previous_postinstall);
+  }
+  processor_->EnqueueActionWithDependencies(
+      main_actions.back().get(),
+      {main_actions[main_actions.size() - 2].get(), previous_postinstall});
+}
+
+AbstractAction* UpdateAttempterAndroid::BuildComponentActions(
+    ComponentPayload* component,
+    size_t payload_index,
+    bool use_http2,
+    AbstractAction* previous_postinstall) {
+  shared_ptr<InstallPlanAction> install_plan_action(
+      new InstallPlanAction(component->install_plan));
+
+  MultiRangeHttpFetcher* fetcher = NewPayloadFetcher(
+      component->install_plan.download_url, 1, use_http2, false);
+  if (component->install_plan.payload_size) {
+    fetcher->AddRange(component->offset, component->install_plan.payload_size);
+  } else {
+    fetcher->AddRange(component->offset);
+  }
+  download_scheduler_->AddDownload(fetcher,
+                                   component->install_plan.payload_size);
+  component->download_action.reset(new DownloadAction(
+      &component->prefs,
+      boot_control_,
+      hardware_,
+      nullptr,    // system_state, not used.
+      fetcher));  // passes ownership
+  component->download_action->set_delegate(component);
+  component->download_action->set_partition_claims(&partition_claims_,
+                                                   payload_index);
+  component->download_action->set_num_worker_threads(kNumApplyWorkerThreads);
+
+  shared_ptr<FilesystemVerifierAction> filesystem_verifier_action(
+      new FilesystemVerifierAction(boot_control_,
+                                   VerifierMode::kVerifyTargetHash));
+  filesystem_verifier_action->set_read_buffers(kVerifierReadBuffers,
+                                               kVerifierReadBufferSize);
+  shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
+      new PostinstallRunnerAction(boot_control_, hardware_));
+  postinstall_runner_action->set_parallel_postinstall(true);
+  postinstall_runner_action->set_mark_slot_active(false);
+
+  BondActions(install_plan_action.get(), component->download_action.get());
+  BondActions(component->download_action.get(),
+              filesystem_verifier_action.get());
+  BondActions(filesystem_verifier_action.get(),
+              postinstall_runner_action.get());
+
+  processor_->EnqueueActionWithDependencies(install_plan_action.get(), {});
+  processor_->EnqueueActionWithDependencies(component->download_action.get(),
+                                            {install_plan_action.get()});
+  processor_->EnqueueActionWithDependencies(
+      filesystem_verifier_action.get(), {component->download_action.get()});
+  vector<AbstractAction*> postinstall_dependencies = {
+      filesystem_verifier_action.get()};
+  if (previous_postinstall)
+    postinstall_dependencies.push_back(previous_postinstall);
+  processor_->EnqueueActionWithDependencies(postinstall_runner_action.get(),
+                                            postinstall_dependencies);
+
+  actions_.push_back(install_plan_action);
+  actions_.push_back(component->download_action);
+  actions_.push_back(filesystem_verifier_action);
+  actions_.push_back(postinstall_runner_action);
+  return postinstall_runner_action.get();
 }
 
+MultiRangeHttpFetcher* UpdateAttempterAndroid::NewPayloadFetcher(
+    const string& url, int num_connections, bool use_http2, bool staged) {
+  HttpFetcher* download_fetcher = nullptr;
+  if (FileFetcher::SupportedUrl(url)) {
+    DLOG(INFO) << "Using FileFetcher for file URL.";
+    FileFetcher* file_fetcher = new FileFetcher();
+#ifdef _UE_SIDELOAD
+    // Sideloaded payloads are on local storage, so they are passed to the
+    // DownloadAction straight from a mapping of the file.
+    file_fetcher->set_use_mmap(true);
+#endif  // _UE_SIDELOAD
+    download_fetcher = file_fetcher;
+  } else {
+#ifdef _UE_SIDELOAD
+    LOG(FATAL) << "Unsupported sideload URI: " << url;
+#else
+    download_fetcher = NewDownloadFetcher(use_http2);
+    // The ranges staged by a previous attempt are read from the cache.
+    if (staged && staging_cache_) {
+      download_fetcher =
+          new StagingHttpFetcher(download_fetcher, staging_cache_.get());
+    }
+#endif  // _UE_SIDELOAD
+  }
+  MultiRangeHttpFetcher* multi_range_fetcher =
+      new MultiRangeHttpFetcher(download_fetcher);  // passes ownership
+#ifndef _UE_SIDELOAD
+  // The payload ranges always have a known length on Android, so the extra
+  // connections fetch disjoint pieces of them.
+  if (!FileFetcher::SupportedUrl(url)) {
+    for (int i = 1; i < num_connections; i++)
+      multi_range_fetcher->AddParallelFetcher(NewDownloadFetcher(use_http2));
+  }
+#endif  // _UE_SIDELOAD
+  return multi_range_fetcher;
+}
+
+#ifndef _UE_SIDELOAD
+void UpdateAttempterAndroid::SetupStagingCache(const string& payload_url,
+                                               const string& payload_id,
+                                               int num_connections,
+                                               uint64_t max_bytes) {
+  staging_cache_.reset();
+  // The data is staged at its offset in the file, in the order it's received,
+  // so the download must be from a single URL over a single connection.
+  if (max_bytes == 0 || payload_id.empty() || precheck_only_ ||
+      num_connections > 1 || !install_plan_.chained_payloads.empty() ||
+      FileFetcher::SupportedUrl(payload_url)) {
+    return;
+  }
+  base::FilePath non_volatile_dir;
+  if (!hardware_->GetNonVolatileDirectory(&non_volatile_dir)) {
+    LOG(WARNING) << "No non-volatile directory, not staging the payload.";
+    return;
+  }
+  staging_cache_.reset(new PayloadStagingCache(
+      non_volatile_dir.Append(kStagingCacheSubDirectory).value(), max_bytes));
+  if (!staging_cache_->Open(payload_id + ":" + std::to_string(base_offset_))) {
+    LOG(WARNING) << "Unable to open the staging cache, not staging the "
+                 << "payload.";
+    staging_cache_.reset();
+  }
+}
+
+LibcurlHttpFetcher* UpdateAttempterAndroid::NewDownloadFetcher(
+    bool use_http2) {
+  if (!connection_cache_)
+    connection_cache_.reset(new LibcurlConnectionCache());
+  LibcurlHttpFetcher* libcurl_fetcher =
+      new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
+  libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+  libcurl_fetcher->set_connection_cache(connection_cache_.get());
+  libcurl_fetcher->set_socket_callbacks_enabled(true);
+  libcurl_fetcher->set_receive_buffer_size(kDownloadReceiveBufferSize);
+  if (use_http2)
+    libcurl_fetcher->set_http2_enabled(true);
+  return libcurl_fetcher;
+}
+#endif  // _UE_SIDELOAD
+
 void UpdateAttempterAndroid::SetupDownload() {
   MultiRangeHttpFetcher* fetcher =
       static_cast<MultiRangeHttpFetcher*>(download_action_->http_fetcher());
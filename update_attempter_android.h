@@ -19,8 +19,10 @@
 
 #include <stdint.h>
 
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/time/time.h>
@@ -29,7 +31,10 @@
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/cpu_limiter.h"
+#include "update_engine/common/download_scheduler.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/payload_staging_cache.h"
+#include "update_engine/common/prefs.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/daemon_state_interface.h"
 #include "update_engine/network_selector_interface.h"
@@ -40,6 +45,10 @@
 
 namespace chromeos_update_engine {
 
+class LibcurlConnectionCache;
+class LibcurlHttpFetcher;
+class MultiRangeHttpFetcher;
+
 class UpdateAttempterAndroid
     : public ServiceDelegateAndroidInterface,
       public ActionProcessorDelegate,
@@ -63,6 +72,11 @@ class UpdateAttempterAndroid
                     int64_t payload_size,
                     const std::vector<std::string>& key_value_pair_headers,
                     brillo::ErrorPtr* error) override;
+  bool PrecheckPayload(const std::string& payload_url,
+                       int64_t payload_offset,
+                       int64_t payload_size,
+                       const std::vector<std::string>& key_value_pair_headers,
+                       brillo::ErrorPtr* error) override;
   bool SuspendUpdate(brillo::ErrorPtr* error) override;
   bool ResumeUpdate(brillo::ErrorPtr* error) override;
   bool CancelUpdate(brillo::ErrorPtr* error) override;
@@ -82,11 +96,48 @@ class UpdateAttempterAndroid
                      uint64_t total) override;
   bool ShouldCancel(ErrorCode* cancel_reason) override;
   void DownloadComplete() override;
+  bool FetchOnlyPayloadRanges(
+      const std::vector<std::pair<uint64_t, uint64_t>>& ranges) override;
+  void ChainedPayloadStarted(const InstallPlan& install_plan) override;
 
   // PostinstallRunnerAction::DelegateInterface
   void ProgressUpdate(double progress) override;
 
  private:
+  // A payload applied at the same time as the main one, to other partitions of
+  // the target slot, through its own actions. Its progress is only kept in
+  // memory, so an interrupted update applies it again from the start.
+  struct ComponentPayload : public DownloadActionDelegate {
+    explicit ComponentPayload(UpdateAttempterAndroid* attempter)
+        : attempter(attempter) {}
+
+    // DownloadActionDelegate overrides.
+    void BytesReceived(uint64_t bytes_progressed,
+                       uint64_t bytes_received,
+                       uint64_t total) override;
+    bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+    void DownloadComplete() override {}
+
+    UpdateAttempterAndroid* attempter;
+    InstallPlan install_plan;
+    // The offset in the payload file where the CrAU part starts.
+    int64_t offset{0};
+    MemoryPrefs prefs;
+    // Declared after the |prefs| it uses.
+    std::shared_ptr<DownloadAction> download_action;
+    uint64_t bytes_received{0};
+    uint64_t total_bytes{0};
+  };
+
+  // Starts applying the payload as requested with ApplyPayload(), or only
+  // checking it can be applied if |precheck_only|.
+  bool StartAttempt(const std::string& payload_url,
+                    int64_t payload_offset,
+                    int64_t payload_size,
+                    const std::vector<std::string>& key_value_pair_headers,
+                    bool precheck_only,
+                    brillo::ErrorPtr* error);
+
   // Asynchronously marks the current slot as successful if needed. If already
   // marked as good, CompleteUpdateBootFlags() is called starting the action
   // processor.
@@ -99,17 +150,57 @@ class UpdateAttempterAndroid
   // scheduled asynchronously to unblock the event loop.
   void ScheduleProcessingStart();
 
-  // Notifies an update request completed with the given error |code| to all
-  // observers.
+  // Notifies an update request, or a precheck, completed with the given error
+  // |code| to all observers.
   void TerminateUpdateAndNotify(ErrorCode error_code);
 
   // Sets the status to the given |status| and notifies a status update to
   // all observers.
   void SetStatusAndNotify(UpdateStatus status);
 
+  // Notifies the progress of the downloads of the main and the component
+  // payloads, as a whole.
+  void ReportDownloadProgress();
+
+#ifndef _UE_SIDELOAD
+  // Opens the |staging_cache_| of at most |max_bytes| for the payload
+  // identified by |payload_id|, or resets it if the download can't be staged.
+  void SetupStagingCache(const std::string& payload_url,
+                         const std::string& payload_id,
+                         int num_connections,
+                         uint64_t max_bytes);
+#endif  // _UE_SIDELOAD
+
   // Helper method to construct the sequence of actions to be performed for
-  // applying an update from the given |url|.
-  void BuildUpdateActions(const std::string& url);
+  // applying an update from the given |url|, downloading the payload over
+  // |num_connections| HTTP connections at the same time, negotiating HTTP/2
+  // if |use_http2|.
+  void BuildUpdateActions(const std::string& url,
+                          int num_connections,
+                          bool use_http2);
+
+  // Enqueues the actions applying the |component| payload, numbered
+  // |payload_index|, downloaded with HTTP/2 if |use_http2|. Its postinstall
+  // runs after the |previous_postinstall|, if any. Returns its postinstall
+  // action.
+  AbstractAction* BuildComponentActions(ComponentPayload* component,
+                                        size_t payload_index,
+                                        bool use_http2,
+                                        AbstractAction* previous_postinstall);
+
+  // Returns a new fetcher for a payload at |url|, downloaded over
+  // |num_connections| and with HTTP/2 if |use_http2|, reading the ranges
+  // already in the |staging_cache_| if |staged|.
+  MultiRangeHttpFetcher* NewPayloadFetcher(const std::string& url,
+                                           int num_connections,
+                                           bool use_http2,
+                                           bool staged);
+
+#ifndef _UE_SIDELOAD
+  // Returns a new fetcher for the payload download sharing the
+  // |connection_cache_|.
+  LibcurlHttpFetcher* NewDownloadFetcher(bool use_http2);
+#endif  // _UE_SIDELOAD
 
   // Sets up the download parameters based on the update requested on the
   // |install_plan_|.
@@ -134,6 +225,28 @@ class UpdateAttempterAndroid
   // set back in the middle of an update.
   base::TimeTicks last_notify_time_;
 
+#ifndef _UE_SIDELOAD
+  // The caches shared by the HTTP fetchers, kept across updates. Declared
+  // before the actions so it outlives the fetchers they own.
+  std::unique_ptr<LibcurlConnectionCache> connection_cache_;
+
+  // The cache the payload downloaded by the ongoing update is staged in, or
+  // nullptr if it isn't staged. Declared before the actions for the same
+  // reason.
+  std::unique_ptr<PayloadStagingCache> staging_cache_;
+#endif  // _UE_SIDELOAD
+
+  // The payloads applied along with the main one, numbered from 1 in the
+  // |partition_claims_| of the target partitions each payload updates.
+  // Declared before the actions so they outlive the actions using them.
+  std::vector<std::unique_ptr<ComponentPayload>> components_;
+  std::map<std::string, size_t> partition_claims_;
+
+  // Shares the download rate limit between the payloads downloaded at the
+  // same time, and the number of downloads not completed yet.
+  std::unique_ptr<DownloadScheduler> download_scheduler_;
+  size_t pending_downloads_{0};
+
   // The list of actions and action processor that runs them asynchronously.
   // Only used when |ongoing_update_| is true.
   std::vector<std::shared_ptr<AbstractAction>> actions_;
@@ -147,16 +260,26 @@ class UpdateAttempterAndroid
   // suspended.
   bool ongoing_update_{false};
 
+  // Whether the ongoing update only checks the payload can be applied. The
+  // status isn't changed by it.
+  bool precheck_only_{false};
+
   // The InstallPlan used during the ongoing update.
   InstallPlan install_plan_;
 
   // For status:
   UpdateStatus status_{UpdateStatus::IDLE};
   double download_progress_{0.0};
+  // The last progress of the download of the main payload.
+  uint64_t bytes_received_{0};
+  uint64_t total_bytes_{0};
 
   // The offset in the payload file where the CrAU part starts.
   int64_t base_offset_{0};
 
+  // The offsets of the chained payloads in their files.
+  std::vector<int64_t> chained_payload_offsets_;
+
   // Only direct proxy supported.
   DirectProxyResolver proxy_resolver_;
 
@@ -53,6 +53,7 @@
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/url_probe_action.h"
 
 using base::Time;
 using base::TimeDelta;
@@ -61,6 +62,7 @@ using org::chromium::UpdateEngineLibcrosProxyResolvedInterfaceProxyMock;
 using std::string;
 using std::unique_ptr;
 using testing::DoAll;
+using testing::ElementsAre;
 using testing::InSequence;
 using testing::Ne;
 using testing::NiceMock;
@@ -376,6 +378,7 @@ namespace {
 // Actions that will be built as part of an update check.
 const string kUpdateActionTypes[] = {  // NOLINT(runtime/string)
   OmahaRequestAction::StaticType(),
+  UrlProbeAction::StaticType(),
   OmahaResponseHandlerAction::StaticType(),
   FilesystemVerifierAction::StaticType(),
   OmahaRequestAction::StaticType(),
@@ -407,6 +410,17 @@ void UpdateAttempterTest::UpdateTestStart() {
   {
     InSequence s;
     for (size_t i = 0; i < arraysize(kUpdateActionTypes); ++i) {
+      // The source verifier and the download started event only wait for the
+      // response handler.
+      if (i == 3 || i == 4) {
+        EXPECT_CALL(*processor_,
+                    EnqueueActionWithDependencies(
+                        Property(&AbstractAction::Type, kUpdateActionTypes[i]),
+                        ElementsAre(Property(
+                            &AbstractAction::Type,
+                            OmahaResponseHandlerAction::StaticType()))));
+        continue;
+      }
       EXPECT_CALL(*processor_,
                   EnqueueAction(Property(&AbstractAction::Type,
                                          kUpdateActionTypes[i])));
@@ -428,11 +442,11 @@ void UpdateAttempterTest::UpdateTestVerify() {
     EXPECT_EQ(kUpdateActionTypes[i], attempter_.actions_[i]->Type());
   }
   EXPECT_EQ(attempter_.response_handler_action_.get(),
-            attempter_.actions_[1].get());
-  AbstractAction* action_4 = attempter_.actions_[4].get();
-  ASSERT_NE(nullptr, action_4);
-  ASSERT_EQ(DownloadAction::StaticType(), action_4->Type());
-  DownloadAction* download_action = static_cast<DownloadAction*>(action_4);
+            attempter_.actions_[2].get());
+  AbstractAction* action_5 = attempter_.actions_[5].get();
+  ASSERT_NE(nullptr, action_5);
+  ASSERT_EQ(DownloadAction::StaticType(), action_5->Type());
+  DownloadAction* download_action = static_cast<DownloadAction*>(action_5);
   EXPECT_EQ(&attempter_, download_action->delegate());
   EXPECT_EQ(UpdateStatus::CHECKING_FOR_UPDATE, attempter_.status());
   loop_.BreakLoop();
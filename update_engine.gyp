@@ -29,6 +29,7 @@
       'USE_libcros%': '1',
       'USE_mtd%': '0',
       'USE_power_management%': '0',
+      'USE_prefs_log%': '0',
       'USE_buffet%': '0',
     },
     'cflags': [
@@ -56,6 +57,7 @@
       'USE_LIBCROS=<(USE_libcros)',
       'USE_MTD=<(USE_mtd)',
       'USE_POWER_MANAGEMENT=<(USE_power_management)',
+      'USE_PREFS_LOG=<(USE_prefs_log)',
       'USE_WEAVE=<(USE_buffet)',
     ],
     'include_dirs': [
@@ -134,7 +136,9 @@
           'libcrypto',
           'libcurl',
           'libssl',
+          'libzstd',
           'xz-embedded',
+          'zlib',
         ],
         'deps': ['<@(exported_deps)'],
       },
@@ -158,35 +162,61 @@
       },
       'sources': [
         'common/action_processor.cc',
+        'common/async_log_sink.cc',
         'common/boot_control_stub.cc',
         'common/certificate_checker.cc',
         'common/clock.cc',
         'common/constants.cc',
         'common/cpu_limiter.cc',
+        'common/download_scheduler.cc',
         'common/error_code_utils.cc',
+        'common/gzip.cc',
         'common/hash_calculator.cc',
         'common/http_common.cc',
         'common/http_fetcher.cc',
         'common/hwid_override.cc',
         'common/libcurl_http_fetcher.cc',
+        'common/memory_pressure_monitor.cc',
+        'common/memory_tracker.cc',
         'common/multi_range_http_fetcher.cc',
+        'common/payload_staging_cache.cc',
         'common/platform_constants_chromeos.cc',
         'common/prefs.cc',
+        'common/resource_usage.cc',
+        'common/staging_http_fetcher.cc',
         'common/subprocess.cc',
         'common/terminator.cc',
+        'common/throughput_estimator.cc',
+        'common/trace_log.cc',
         'common/utils.cc',
+        'common/write_behind_prefs.cc',
+        'payload_consumer/async_file_descriptor.cc',
+        'payload_consumer/bspatch_applier.cc',
         'payload_consumer/bzip_extent_writer.cc',
+        'payload_consumer/comparing_file_descriptor.cc',
         'payload_consumer/delta_performer.cc',
         'payload_consumer/download_action.cc',
         'payload_consumer/extent_writer.cc',
         'payload_consumer/file_descriptor.cc',
         'payload_consumer/file_writer.cc',
         'payload_consumer/filesystem_verifier_action.cc',
+        'payload_consumer/hash_tree_builder.cc',
+        'payload_consumer/imgpatch_applier.cc',
+        'payload_consumer/inline_target_hasher.cc',
         'payload_consumer/install_plan.cc',
+        'payload_consumer/interruptible_file_descriptor.cc',
+        'payload_consumer/operation_executor.cc',
+        'payload_consumer/operation_stats.cc',
+        'payload_consumer/packed_extents.cc',
         'payload_consumer/payload_constants.cc',
         'payload_consumer/payload_verifier.cc',
         'payload_consumer/postinstall_runner_action.cc',
+        'payload_consumer/source_block_cache.cc',
+        'payload_consumer/source_hash_precomputer.cc',
+        'payload_consumer/target_trimmer.cc',
+        'payload_consumer/throttled_file_descriptor.cc',
         'payload_consumer/xz_extent_writer.cc',
+        'payload_consumer/zstd_extent_writer.cc',
       ],
       'conditions': [
         ['USE_mtd == 1', {
@@ -247,14 +277,17 @@
         ],
       },
       'sources': [
+        'bandwidth_manager.cc',
         'boot_control_chromeos.cc',
         'common_service.cc',
         'connection_manager.cc',
+        'connection_warmer.cc',
         'daemon.cc',
         'dbus_service.cc',
         'hardware_chromeos.cc',
         'image_properties_chromeos.cc',
         'libcros_proxy.cc',
+        'libcurl_connection_cache.cc',
         'metrics.cc',
         'metrics_utils.cc',
         'omaha_request_action.cc',
@@ -264,6 +297,7 @@
         'payload_state.cc',
         'proxy_resolver.cc',
         'real_system_state.cc',
+        'resource_governor.cc',
         'shill_proxy.cc',
         'update_attempter.cc',
         'update_manager/boxed_value.cc',
@@ -271,6 +305,8 @@
         'update_manager/default_policy.cc',
         'update_manager/evaluation_context.cc',
         'update_manager/policy.cc',
+        'update_manager/policy_stats.cc',
+        'update_manager/policy_trace.cc',
         'update_manager/real_config_provider.cc',
         'update_manager/real_device_policy_provider.cc',
         'update_manager/real_random_provider.cc',
@@ -279,8 +315,11 @@
         'update_manager/real_time_provider.cc',
         'update_manager/real_updater_provider.cc',
         'update_manager/state_factory.cc',
+        'update_manager/timer_wheel.cc',
         'update_manager/update_manager.cc',
         'update_status_utils.cc',
+        'url_probe_action.cc',
+        'url_throughput_history.cc',
         'weave_service_factory.cc',
       ],
       'conditions': [
@@ -328,6 +367,7 @@
       'sources': [
         'client_library/client.cc',
         'client_library/client_dbus.cc',
+        'client_library/throttled_status_update_handler.cc',
         'update_status_utils.cc',
       ],
       'include_dirs': [
@@ -378,27 +418,40 @@
       'sources': [
         'payload_generator/ab_generator.cc',
         'payload_generator/annotated_operation.cc',
+        'payload_generator/apply_report.cc',
         'payload_generator/blob_file_writer.cc',
         'payload_generator/block_mapping.cc',
+        'payload_generator/bsdiff_generator.cc',
         'payload_generator/bzip.cc',
+        'payload_generator/compact_graph.cc',
         'payload_generator/cycle_breaker.cc',
         'payload_generator/delta_diff_generator.cc',
         'payload_generator/delta_diff_utils.cc',
+        'payload_generator/diff_cache.cc',
         'payload_generator/ext2_filesystem.cc',
         'payload_generator/extent_ranges.cc',
         'payload_generator/extent_utils.cc',
         'payload_generator/full_update_generator.cc',
+        'payload_generator/generation_profile.cc',
         'payload_generator/graph_types.cc',
         'payload_generator/graph_utils.cc',
+        'payload_generator/image_index_cache.cc',
+        'payload_generator/imgdiff_generator.cc',
         'payload_generator/inplace_generator.cc',
         'payload_generator/mapfile_filesystem.cc',
+        'payload_generator/mapped_image.cc',
+        'payload_generator/partition_shard.cc',
         'payload_generator/payload_file.cc',
         'payload_generator/payload_generation_config.cc',
+        'payload_generator/payload_merger.cc',
         'payload_generator/payload_signer.cc',
         'payload_generator/raw_filesystem.cc',
+        'payload_generator/sparse_image.cc',
+        'payload_generator/squashfs_filesystem.cc',
         'payload_generator/tarjan.cc',
         'payload_generator/topological_sort.cc',
         'payload_generator/xz_chromeos.cc',
+        'payload_generator/zstd.cc',
       ],
     },
     # server-side delta generator.
@@ -478,66 +531,113 @@
           ],
           'includes': ['../../../platform2/common-mk/common_test.gypi'],
           'sources': [
+            'bandwidth_manager_unittest.cc',
             'boot_control_chromeos_unittest.cc',
+            'client_library/throttled_status_update_handler.cc',
+            'client_library/throttled_status_update_handler_unittest.cc',
             'common/action_pipe_unittest.cc',
             'common/action_processor_unittest.cc',
             'common/action_unittest.cc',
+            'common/async_log_sink_unittest.cc',
             'common/certificate_checker_unittest.cc',
             'common/cpu_limiter_unittest.cc',
+            'common/download_scheduler_unittest.cc',
             'common/fake_prefs.cc',
             'common/file_fetcher.cc',  # Only required for tests.
+            'common/gzip_unittest.cc',
             'common/hash_calculator_unittest.cc',
             'common/http_fetcher_unittest.cc',
             'common/hwid_override_unittest.cc',
+            'common/memory_pressure_monitor_unittest.cc',
+            'common/memory_tracker_unittest.cc',
             'common/mock_http_fetcher.cc',
+            'common/payload_staging_cache_unittest.cc',
             'common/prefs_unittest.cc',
+            'common/resource_usage_unittest.cc',
+            'common/staging_http_fetcher_unittest.cc',
             'common/subprocess_unittest.cc',
             'common/terminator_unittest.cc',
+            'common/throughput_estimator_unittest.cc',
+            'common/trace_log_unittest.cc',
             'common/test_utils.cc',
             'common/utils_unittest.cc',
+            'common/write_behind_prefs_unittest.cc',
             'common_service_unittest.cc',
             'connection_manager_unittest.cc',
+            'connection_warmer_unittest.cc',
             'fake_shill_proxy.cc',
             'fake_system_state.cc',
+            'libcurl_connection_cache_unittest.cc',
             'metrics_utils_unittest.cc',
             'omaha_request_action_unittest.cc',
             'omaha_request_params_unittest.cc',
             'omaha_response_handler_action_unittest.cc',
             'p2p_manager_unittest.cc',
+            'payload_consumer/async_file_descriptor_unittest.cc',
+            'payload_consumer/bspatch_applier_unittest.cc',
             'payload_consumer/bzip_extent_writer_unittest.cc',
+            'payload_consumer/comparing_file_descriptor_unittest.cc',
             'payload_consumer/delta_performer_integration_test.cc',
             'payload_consumer/delta_performer_unittest.cc',
             'payload_consumer/download_action_unittest.cc',
             'payload_consumer/extent_writer_unittest.cc',
             'payload_consumer/file_writer_unittest.cc',
             'payload_consumer/filesystem_verifier_action_unittest.cc',
+            'payload_consumer/hash_tree_builder_unittest.cc',
+            'payload_consumer/imgpatch_applier_unittest.cc',
+            'payload_consumer/inline_target_hasher_unittest.cc',
+            'payload_consumer/interruptible_file_descriptor_unittest.cc',
+            'payload_consumer/operation_executor_unittest.cc',
+            'payload_consumer/operation_stats_unittest.cc',
+            'payload_consumer/packed_extents_unittest.cc',
             'payload_consumer/postinstall_runner_action_unittest.cc',
+            'payload_consumer/source_block_cache_unittest.cc',
+            'payload_consumer/source_hash_precomputer_unittest.cc',
+            'payload_consumer/target_trimmer_unittest.cc',
+            'payload_consumer/throttled_file_descriptor_unittest.cc',
             'payload_consumer/xz_extent_writer_unittest.cc',
+            'payload_consumer/zstd_extent_writer_unittest.cc',
             'payload_generator/ab_generator_unittest.cc',
+            'payload_generator/apply_report_unittest.cc',
             'payload_generator/blob_file_writer_unittest.cc',
             'payload_generator/block_mapping_unittest.cc',
+            'payload_generator/bsdiff_generator_unittest.cc',
+            'payload_generator/compact_graph_unittest.cc',
             'payload_generator/cycle_breaker_unittest.cc',
             'payload_generator/delta_diff_utils_unittest.cc',
+            'payload_generator/diff_cache_unittest.cc',
             'payload_generator/ext2_filesystem_unittest.cc',
             'payload_generator/extent_ranges_unittest.cc',
             'payload_generator/extent_utils_unittest.cc',
             'payload_generator/fake_filesystem.cc',
             'payload_generator/full_update_generator_unittest.cc',
+            'payload_generator/generation_profile_unittest.cc',
             'payload_generator/graph_utils_unittest.cc',
+            'payload_generator/image_index_cache_unittest.cc',
+            'payload_generator/imgdiff_generator_unittest.cc',
             'payload_generator/inplace_generator_unittest.cc',
             'payload_generator/mapfile_filesystem_unittest.cc',
+            'payload_generator/mapped_image_unittest.cc',
+            'payload_generator/partition_shard_unittest.cc',
             'payload_generator/payload_file_unittest.cc',
             'payload_generator/payload_generation_config_unittest.cc',
+            'payload_generator/payload_merger_unittest.cc',
             'payload_generator/payload_signer_unittest.cc',
+            'payload_generator/sparse_image_unittest.cc',
+            'payload_generator/squashfs_filesystem_unittest.cc',
             'payload_generator/tarjan_unittest.cc',
             'payload_generator/topological_sort_unittest.cc',
             'payload_generator/zip_unittest.cc',
+            'payload_generator/zstd_unittest.cc',
             'payload_state_unittest.cc',
+            'resource_governor_unittest.cc',
             'update_attempter_unittest.cc',
             'update_manager/boxed_value_unittest.cc',
             'update_manager/chromeos_policy_unittest.cc',
             'update_manager/evaluation_context_unittest.cc',
             'update_manager/generic_variables_unittest.cc',
+            'update_manager/policy_stats_unittest.cc',
+            'update_manager/policy_trace_unittest.cc',
             'update_manager/prng_unittest.cc',
             'update_manager/real_config_provider_unittest.cc',
             'update_manager/real_device_policy_provider_unittest.cc',
@@ -546,9 +646,12 @@
             'update_manager/real_system_provider_unittest.cc',
             'update_manager/real_time_provider_unittest.cc',
             'update_manager/real_updater_provider_unittest.cc',
+            'update_manager/timer_wheel_unittest.cc',
             'update_manager/umtest_utils.cc',
             'update_manager/update_manager_unittest.cc',
             'update_manager/variable_unittest.cc',
+            'url_probe_action_unittest.cc',
+            'url_throughput_history_unittest.cc',
             # Main entry point for runnning tests.
             'testrunner.cc',
           ],
@@ -560,6 +663,44 @@
             }],
           ],
         },
+        # Microbenchmarks of the payload consumer.
+        {
+          'target_name': 'update_engine_benchmarks',
+          'type': 'executable',
+          'dependencies': [
+            'libpayload_consumer',
+            'libpayload_generator',
+            'update_engine-testkeys',
+          ],
+          'sources': [
+            'common/test_alloc_counter.cc',
+            'payload_consumer/payload_consumer_benchmark.cc',
+          ],
+        },
+        # End-to-end benchmark of the payload application.
+        {
+          'target_name': 'update_engine_apply_benchmark',
+          'type': 'executable',
+          'dependencies': [
+            'libpayload_consumer',
+            'libpayload_generator',
+          ],
+          'sources': [
+            'payload_consumer/payload_apply_benchmark.cc',
+          ],
+        },
+        # Replay of the recorded policy evaluations of the Update Manager.
+        {
+          'target_name': 'update_engine_policy_benchmark',
+          'type': 'executable',
+          'dependencies': [
+            'libupdate_engine',
+          ],
+          'sources': [
+            'common/test_alloc_counter.cc',
+            'update_manager/policy_replay_benchmark.cc',
+          ],
+        },
       ],
     }],
   ],
@@ -33,6 +33,7 @@
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/client.h"
 #include "update_engine/status_update_handler.h"
+#include "update_engine/throttled_status_update_handler.h"
 #include "update_engine/update_status.h"
 #include "update_engine/update_status_utils.h"
 
@@ -224,6 +225,9 @@ int UpdateEngineClient::ProcessFlags() {
                 "target channel is more stable than the current channel unless "
                 "--nopowerwash is specified.");
   DEFINE_bool(check_for_update, false, "Initiate check for updates.");
+  DEFINE_string(fast_mode, "",
+                "Turns the fast mode, which lifts the resource limits of the "
+                "update, on (\"yes\") or off (\"no\").");
   DEFINE_bool(follow, false,
               "Wait for any update operations to complete."
               "Exit status is 0 if the update succeeded, and 1 otherwise.");
@@ -263,6 +267,12 @@ int UpdateEngineClient::ProcessFlags() {
                 "cellular networks.");
   DEFINE_bool(watch_for_updates, false,
               "Listen for status updates and print them to the screen.");
+  DEFINE_double(watch_min_progress, 0.0,
+                "With --watch_for_updates, print the progress only once it "
+                "moved by at least this fraction.");
+  DEFINE_int64(watch_min_interval_ms, 0,
+               "With --watch_for_updates, print at most one status update of "
+               "the same operation every this many milliseconds.");
   DEFINE_bool(prev_version, false,
               "Show the previous OS version used before the update reboot.");
   DEFINE_bool(last_attempt_error, false, "Show the last attempt error.");
@@ -310,6 +320,20 @@ int UpdateEngineClient::ProcessFlags() {
     }
   }
 
+  // Changes the fast mode of the update.
+  if (!FLAGS_fast_mode.empty()) {
+    bool fast_mode = FLAGS_fast_mode == "yes";
+    if (!fast_mode && FLAGS_fast_mode != "no") {
+      LOG(ERROR) << "Unknown option: \"" << FLAGS_fast_mode
+                 << "\". Please specify \"yes\" or \"no\".";
+    } else {
+      if (!client_->SetFastMode(fast_mode)) {
+        LOG(ERROR) << "Error setting the fast mode.";
+        return 1;
+      }
+    }
+  }
+
   // Show the current update over cellular network setting.
   if (FLAGS_show_update_over_cellular) {
     bool allowed;
@@ -474,7 +498,11 @@ int UpdateEngineClient::ProcessFlags() {
 
   if (FLAGS_watch_for_updates) {
     LOG(INFO) << "Watching for status updates.";
-    auto handler = new WatchingStatusUpdateHandler();
+    auto watching_handler = new WatchingStatusUpdateHandler();
+    handlers_.emplace_back(watching_handler);
+    auto handler = new update_engine::ThrottledStatusUpdateHandler(
+        watching_handler, FLAGS_watch_min_progress,
+        FLAGS_watch_min_interval_ms);
     handlers_.emplace_back(handler);
     client_->RegisterStatusUpdateHandler(handler);
     return kContinueRunning;
@@ -63,6 +63,7 @@ class UpdateEngineClientAndroid : public brillo::Daemon {
     // android::os::BnUpdateEngineCallback overrides.
     Status onStatusUpdate(int status_code, float progress) override;
     Status onPayloadApplicationComplete(int error_code) override;
+    Status onPayloadPrecheckComplete(int error_code) override;
 
    private:
     UpdateEngineClientAndroid* client_;
@@ -101,12 +102,26 @@ Status UpdateEngineClientAndroid::UECallback::onPayloadApplicationComplete(
   return Status::ok();
 }
 
+Status UpdateEngineClientAndroid::UECallback::onPayloadPrecheckComplete(
+    int error_code) {
+  ErrorCode code = static_cast<ErrorCode>(error_code);
+  LOG(INFO) << "onPayloadPrecheckComplete(" << utils::ErrorCodeToString(code)
+            << " (" << error_code << "))";
+  client_->ExitWhenIdle(code == ErrorCode::kSuccess ? EX_OK : 1);
+  return Status::ok();
+}
+
 int UpdateEngineClientAndroid::OnInit() {
   int ret = Daemon::OnInit();
   if (ret != EX_OK)
     return ret;
 
   DEFINE_bool(update, false, "Start a new update, if no update in progress.");
+  DEFINE_bool(precheck,
+              false,
+              "Check whether the payload can be applied, without applying it, "
+              "and exit. Exit status is 0 if it can, and 1 otherwise. Takes "
+              "the same flags as --update.");
   DEFINE_string(payload,
                 "http://127.0.0.1:8080/payload",
                 "The URI to the update payload to use.");
@@ -119,7 +134,7 @@ int UpdateEngineClientAndroid::OnInit() {
   DEFINE_string(headers,
                 "",
                 "A list of key-value pairs, one element of the list per line. "
-                "Used when --update is passed.");
+                "Used when --update or --precheck is passed.");
 
   DEFINE_bool(suspend, false, "Suspend an ongoing update and exit.");
   DEFINE_bool(resume, false, "Resume a suspended update.");
@@ -179,7 +194,7 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->resetStatus());
   }
 
-  if (FLAGS_follow) {
+  if (FLAGS_follow || FLAGS_precheck) {
     // Register a callback object with the service.
     callback_ = new UECallback(this);
     bool bound;
@@ -190,18 +205,21 @@ int UpdateEngineClientAndroid::OnInit() {
     keep_running = true;
   }
 
-  if (FLAGS_update) {
+  if (FLAGS_update || FLAGS_precheck) {
     std::vector<std::string> headers = base::SplitString(
         FLAGS_headers, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
     std::vector<android::String16> and_headers;
     for (const auto& header : headers) {
       and_headers.push_back(android::String16{header.data(), header.size()});
     }
-    Status status = service_->applyPayload(
-        android::String16{FLAGS_payload.data(), FLAGS_payload.size()},
-        FLAGS_offset,
-        FLAGS_size,
-        and_headers);
+    const android::String16 payload{FLAGS_payload.data(),
+                                    FLAGS_payload.size()};
+    Status status =
+        FLAGS_precheck
+            ? service_->precheckPayload(
+                  payload, FLAGS_offset, FLAGS_size, and_headers)
+            : service_->applyPayload(
+                  payload, FLAGS_offset, FLAGS_size, and_headers);
     if (!status.isOk())
       return ExitWhenIdle(status);
   }
@@ -78,6 +78,22 @@ class BoxedValue {
     other.printer_ = nullptr;
   }
 
+  // The move assignment deletes the value held so far and takes ownership of
+  // the pointer of |other|, so the BoxedValues can be stored in a vector.
+  BoxedValue& operator=(BoxedValue&& other) {  // NOLINT(build/c++11)
+    if (this == &other)
+      return *this;
+    if (deleter_)
+      deleter_(value_);
+    value_ = other.value_;
+    deleter_ = other.deleter_;
+    printer_ = other.printer_;
+    other.value_ = nullptr;
+    other.deleter_ = nullptr;
+    other.printer_ = nullptr;
+    return *this;
+  }
+
   // Deletes the |value| passed on construction using the delete for the passed
   // type.
   ~BoxedValue() {
@@ -21,6 +21,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <base/strings/stringprintf.h>
 #include <base/time/time.h>
@@ -35,6 +36,7 @@ using std::list;
 using std::map;
 using std::set;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_manager {
 
@@ -84,6 +86,32 @@ TEST(UmBoxedValueTest, MoveConstructor) {
   EXPECT_TRUE(marker);
 }
 
+TEST(UmBoxedValueTest, MoveAssignment) {
+  bool old_marker = true;
+  bool new_marker = true;
+  BoxedValue box(new const DeleterMarker(&old_marker));
+  BoxedValue new_box(new const DeleterMarker(&new_marker));
+  // The value held by |box| is deleted when it takes the one of |new_box|.
+  box = std::move(new_box);
+  EXPECT_TRUE(old_marker);
+  EXPECT_FALSE(new_marker);
+  EXPECT_EQ(nullptr, new_box.value());
+}
+
+TEST(UmBoxedValueTest, MixedVector) {
+  vector<BoxedValue> vec;
+  bool marker;
+  vec.emplace_back(new const DeleterMarker(&marker));
+  // The value stays valid when the vector grows.
+  const void* value = vec[0].value();
+  for (int i = 0; i < 16; i++)
+    vec.emplace_back(new const int{i});
+  EXPECT_EQ(value, vec[0].value());
+  EXPECT_FALSE(marker);
+  vec.erase(vec.begin());
+  EXPECT_TRUE(marker);
+}
+
 TEST(UmBoxedValueTest, MixedList) {
   list<BoxedValue> lst;
   // This is mostly a compile test.
@@ -17,8 +17,10 @@
 #ifndef UPDATE_ENGINE_UPDATE_MANAGER_EVALUATION_CONTEXT_INL_H_
 #define UPDATE_ENGINE_UPDATE_MANAGER_EVALUATION_CONTEXT_INL_H_
 
+#include <memory>
 #include <string>
 
+#include <base/bind.h>
 #include <base/logging.h>
 
 namespace chromeos_update_manager {
@@ -31,9 +33,9 @@ const T* EvaluationContext::GetValue(Variable<T>* var) {
   }
 
   // Search for the value on the cache first.
-  ValueCacheMap::iterator it = value_cache_.find(var);
-  if (it != value_cache_.end())
-    return reinterpret_cast<const T*>(it->second.value());
+  const BoxedValue* cached_value = FindCachedValue(var);
+  if (cached_value)
+    return reinterpret_cast<const T*>(cached_value->value());
 
   // Get the value from the variable if not found on the cache.
   std::string errmsg;
@@ -43,13 +45,36 @@ const T* EvaluationContext::GetValue(Variable<T>* var) {
     LOG(WARNING) << "Error reading Variable " << var->GetName() << ": \""
         << errmsg << "\"";
   }
-  // Cache the value for the next time. The map of CachedValues keeps the
-  // ownership of the pointer until the map is destroyed.
-  value_cache_.emplace(
-    static_cast<BaseVariable*>(var), BoxedValue(result));
+  if (stats_)
+    stats_->RecordVariableRead(var->GetName());
+  if (trace_)
+    trace_->RecordValue(var->GetName(), result);
+  // Cache the value for the next time. The cache keeps the ownership of the
+  // pointer until the value is removed from it.
+  value_cache_.emplace_back(static_cast<BaseVariable*>(var),
+                            BoxedValue(result));
+
+  // Keep a copy of the value, since the cached one doesn't outlive the
+  // evaluation, to compare it against when replaying the evaluation. The copy
+  // is held by the callback itself.
+  input_checks_.push_back(base::Bind(&EvaluationContext::IsValueUnchanged<T>,
+                                     base::Unretained(this),
+                                     var,
+                                     result != nullptr,
+                                     result ? *result : T()));
   return result;
 }
 
+template<typename T>
+bool EvaluationContext::IsValueUnchanged(Variable<T>* var,
+                                         bool had_value,
+                                         const T& previous_value) {
+  const T* value = GetValue(var);
+  if (value == nullptr || !had_value)
+    return (value != nullptr) == had_value;
+  return *value == previous_value;
+}
+
 }  // namespace chromeos_update_manager
 
 #endif  // UPDATE_ENGINE_UPDATE_MANAGER_EVALUATION_CONTEXT_INL_H_
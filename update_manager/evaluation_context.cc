@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/json/json_writer.h>
@@ -85,12 +86,17 @@ EvaluationContext::~EvaluationContext() {
 }
 
 unique_ptr<Closure> EvaluationContext::RemoveObserversAndTimeout() {
-  for (auto& it : value_cache_) {
-    if (it.first->GetMode() == kVariableModeAsync)
-      it.first->RemoveObserver(this);
+  for (auto& cached_value : value_cache_) {
+    if (cached_value.var->GetMode() == kVariableModeAsync)
+      cached_value.var->RemoveObserver(this);
+  }
+  if (timeout_event_ != MessageLoop::kTaskIdNull) {
+    if (timer_wheel_)
+      timer_wheel_->Cancel(timeout_event_);
+    else
+      MessageLoop::current()->CancelTask(timeout_event_);
+    timeout_event_ = MessageLoop::kTaskIdNull;
   }
-  MessageLoop::current()->CancelTask(timeout_event_);
-  timeout_event_ = MessageLoop::kTaskIdNull;
 
   return unique_ptr<Closure>(callback_.release());
 }
@@ -109,6 +115,9 @@ Time EvaluationContext::MonotonicDeadline(TimeDelta timeout) {
 
 void EvaluationContext::ValueChanged(BaseVariable* var) {
   DLOG(INFO) << "ValueChanged() called for variable " << var->GetName();
+  reevaluation_cause_ = var->GetName();
+  if (stats_)
+    stats_->RecordVariableChange(var->GetName());
   OnValueChangedOrTimeout();
 }
 
@@ -117,6 +126,7 @@ void EvaluationContext::OnTimeout() {
              << (timeout_marks_expiration_ ? "expiration" : "poll interval");
   timeout_event_ = MessageLoop::kTaskIdNull;
   is_expired_ = timeout_marks_expiration_;
+  reevaluation_cause_ = is_expired_ ? "expiration" : "timeout";
   OnValueChangedOrTimeout();
 }
 
@@ -129,13 +139,31 @@ void EvaluationContext::OnValueChangedOrTimeout() {
 }
 
 bool EvaluationContext::IsWallclockTimeGreaterThan(Time timestamp) {
-  return IsTimeGreaterThanHelper(timestamp, evaluation_start_wallclock_,
-                                 &reevaluation_time_wallclock_);
+  bool result = IsTimeGreaterThanHelper(timestamp, evaluation_start_wallclock_,
+                                        &reevaluation_time_wallclock_);
+  input_checks_.push_back(
+      base::Bind(&EvaluationContext::IsWallclockComparisonUnchanged,
+                 base::Unretained(this), timestamp, result));
+  return result;
 }
 
 bool EvaluationContext::IsMonotonicTimeGreaterThan(Time timestamp) {
-  return IsTimeGreaterThanHelper(timestamp, evaluation_start_monotonic_,
-                                 &reevaluation_time_monotonic_);
+  bool result = IsTimeGreaterThanHelper(timestamp, evaluation_start_monotonic_,
+                                        &reevaluation_time_monotonic_);
+  input_checks_.push_back(
+      base::Bind(&EvaluationContext::IsMonotonicComparisonUnchanged,
+                 base::Unretained(this), timestamp, result));
+  return result;
+}
+
+bool EvaluationContext::IsWallclockComparisonUnchanged(Time timestamp,
+                                                       bool previous_result) {
+  return IsWallclockTimeGreaterThan(timestamp) == previous_result;
+}
+
+bool EvaluationContext::IsMonotonicComparisonUnchanged(Time timestamp,
+                                                       bool previous_result) {
+  return IsMonotonicTimeGreaterThan(timestamp) == previous_result;
 }
 
 void EvaluationContext::ResetEvaluation() {
@@ -145,14 +173,43 @@ void EvaluationContext::ResetEvaluation() {
   reevaluation_time_monotonic_ = Time::Max();
   evaluation_monotonic_deadline_ = MonotonicDeadline(evaluation_timeout_);
 
+  input_checks_.clear();
+
   // Remove the cached values of non-const variables
-  for (auto it = value_cache_.begin(); it != value_cache_.end(); ) {
-    if (it->first->GetMode() == kVariableModeConst) {
-      ++it;
-    } else {
-      it = value_cache_.erase(it);
+  value_cache_.erase(
+      std::remove_if(value_cache_.begin(),
+                     value_cache_.end(),
+                     [](const CachedValue& cached_value) {
+                       return cached_value.var->GetMode() !=
+                              kVariableModeConst;
+                     }),
+      value_cache_.end());
+}
+
+const BoxedValue* EvaluationContext::FindCachedValue(BaseVariable* var) const {
+  for (const CachedValue& cached_value : value_cache_) {
+    if (cached_value.var == var)
+      return &cached_value.value;
+  }
+  return nullptr;
+}
+
+bool EvaluationContext::ReplayEvaluation() {
+  std::vector<Callback<bool()>> previous_input_checks;
+  previous_input_checks.swap(input_checks_);
+  ResetEvaluation();
+  if (previous_input_checks.empty())
+    return false;
+
+  // The policy reads its inputs in an order that depends on the values read
+  // so far, so stop at the first one that changed.
+  for (const auto& input_check : previous_input_checks) {
+    if (!input_check.Run()) {
+      ResetEvaluation();
+      return false;
     }
   }
+  return true;
 }
 
 void EvaluationContext::ResetExpiration() {
@@ -182,15 +239,15 @@ bool EvaluationContext::RunOnValueChangeOrTimeout(Closure callback) {
 
   // Handle reevaluation due to async or poll variables.
   bool waiting_for_value_change = false;
-  for (auto& it : value_cache_) {
-    switch (it.first->GetMode()) {
+  for (auto& cached_value : value_cache_) {
+    switch (cached_value.var->GetMode()) {
       case kVariableModeAsync:
-        DLOG(INFO) << "Waiting for value on " << it.first->GetName();
-        it.first->AddObserver(this);
+        DLOG(INFO) << "Waiting for value on " << cached_value.var->GetName();
+        cached_value.var->AddObserver(this);
         waiting_for_value_change = true;
         break;
       case kVariableModePoll:
-        timeout = std::min(timeout, it.first->GetPollInterval());
+        timeout = std::min(timeout, cached_value.var->GetPollInterval());
         break;
       case kVariableModeConst:
         // Ignored.
@@ -216,11 +273,14 @@ bool EvaluationContext::RunOnValueChangeOrTimeout(Closure callback) {
   if (!timeout.is_max()) {
     DLOG(INFO) << "Waiting for timeout in "
                << chromeos_update_engine::utils::FormatTimeDelta(timeout);
-    timeout_event_ = MessageLoop::current()->PostDelayedTask(
-        FROM_HERE,
-        base::Bind(&EvaluationContext::OnTimeout,
-                   weak_ptr_factory_.GetWeakPtr()),
-        timeout);
+    Closure on_timeout = base::Bind(&EvaluationContext::OnTimeout,
+                                    weak_ptr_factory_.GetWeakPtr());
+    if (timer_wheel_) {
+      timeout_event_ = timer_wheel_->Schedule(timeout, on_timeout);
+    } else {
+      timeout_event_ = MessageLoop::current()->PostDelayedTask(
+          FROM_HERE, on_timeout, timeout);
+    }
   }
 
   return true;
@@ -228,8 +288,9 @@ bool EvaluationContext::RunOnValueChangeOrTimeout(Closure callback) {
 
 string EvaluationContext::DumpContext() const {
   base::DictionaryValue* variables = new base::DictionaryValue();
-  for (auto& it : value_cache_) {
-    variables->SetString(it.first->GetName(), it.second.ToString());
+  for (const auto& cached_value : value_cache_) {
+    variables->SetString(cached_value.var->GetName(),
+                         cached_value.value.ToString());
   }
 
   base::DictionaryValue value;
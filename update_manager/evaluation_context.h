@@ -17,9 +17,9 @@
 #ifndef UPDATE_ENGINE_UPDATE_MANAGER_EVALUATION_CONTEXT_H_
 #define UPDATE_ENGINE_UPDATE_MANAGER_EVALUATION_CONTEXT_H_
 
-#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/callback.h>
@@ -30,6 +30,9 @@
 
 #include "update_engine/common/clock_interface.h"
 #include "update_engine/update_manager/boxed_value.h"
+#include "update_engine/update_manager/policy_stats.h"
+#include "update_engine/update_manager/policy_trace.h"
+#include "update_engine/update_manager/timer_wheel.h"
 #include "update_engine/update_manager/variable.h"
 
 namespace chromeos_update_manager {
@@ -95,6 +98,24 @@ class EvaluationContext : public base::RefCounted<EvaluationContext>,
   // Returns whether the evaluation context has expired.
   bool is_expired() const { return is_expired_; }
 
+  // Returns what triggered the last callback scheduled with
+  // RunOnValueChangeOrTimeout(): the name of the variable that changed,
+  // "timeout" or "expiration". Empty if no such callback ran yet.
+  const std::string& reevaluation_cause() const { return reevaluation_cause_; }
+
+  // Sets the PolicyStats where the variable reads and value changes are
+  // recorded, or null to not record them.
+  void set_stats(PolicyStats* stats) { stats_ = stats; }
+
+  // Sets the PolicyTrace where the values read from the variables are
+  // recorded, or null to not record them.
+  void set_trace(PolicyTrace* trace) { trace_ = trace; }
+
+  // Sets the TimerWheel used to schedule the timeouts of
+  // RunOnValueChangeOrTimeout(), shared with other contexts to coalesce their
+  // wakeups. If null, the timeouts are posted directly on the main loop.
+  void set_timer_wheel(TimerWheel* timer_wheel) { timer_wheel_ = timer_wheel; }
+
   // TODO(deymo): Move the following methods to an interface only visible by the
   // UpdateManager class and not the policy implementations.
 
@@ -103,6 +124,15 @@ class EvaluationContext : public base::RefCounted<EvaluationContext>,
   // be called right before any new evaluation starts.
   void ResetEvaluation();
 
+  // Starts a new evaluation, like ResetEvaluation(), and re-reads the inputs
+  // of the previous one: the values of the variables it read and the outcome
+  // of its time comparisons, in the same order. Returns whether all of them
+  // are unchanged, in which case re-running the same deterministic policy
+  // would produce the same result; the re-read inputs are then tracked as the
+  // ones of the new evaluation. Otherwise, or if there was no previous
+  // evaluation, the evaluation is reset again and false is returned.
+  bool ReplayEvaluation();
+
   // Clears the expiration status of the EvaluationContext and resets its
   // expiration timeout based on |expiration_timeout_|. This should be called if
   // expiration occurred, prior to re-evaluating the policy.
@@ -149,11 +179,40 @@ class EvaluationContext : public base::RefCounted<EvaluationContext>,
   // since the current time.
   base::Time MonotonicDeadline(base::TimeDelta timeout);
 
-  // A map to hold the cached values for every variable.
-  typedef std::map<BaseVariable*, BoxedValue> ValueCacheMap;
-
-  // The cached values of the called Variables.
-  ValueCacheMap value_cache_;
+  // Input checks used by ReplayEvaluation(). They read the variable |var| or
+  // redo a time comparison against |timestamp| on the current evaluation,
+  // returning whether the outcome matches the one of the previous evaluation.
+  template<typename T>
+  bool IsValueUnchanged(Variable<T>* var,
+                        bool had_value,
+                        const T& previous_value);
+  bool IsWallclockComparisonUnchanged(base::Time timestamp,
+                                      bool previous_result);
+  bool IsMonotonicComparisonUnchanged(base::Time timestamp,
+                                      bool previous_result);
+
+  // The cached value of a called Variable.
+  struct CachedValue {
+    CachedValue(BaseVariable* var, BoxedValue&& value)  // NOLINT(build/c++11)
+        : var(var), value(std::move(value)) {}
+
+    BaseVariable* var;
+    BoxedValue value;
+  };
+
+  // Returns the cached value of |var|, or null if it wasn't read yet.
+  const BoxedValue* FindCachedValue(BaseVariable* var) const;
+
+  // The cached values of the called Variables, in the order they were first
+  // read. A policy reads a few tens of variables, so they are looked up with a
+  // linear scan, and the vector keeps its capacity across the evaluations
+  // instead of allocating a node for every variable read.
+  std::vector<CachedValue> value_cache_;
+
+  // The inputs of the current evaluation, in the order they were read: a
+  // check for every variable read not served from |value_cache_| and for every
+  // time comparison. Used by ReplayEvaluation().
+  std::vector<base::Callback<bool()>> input_checks_;
 
   // A callback used for triggering re-evaluation upon a value change or poll
   // timeout, or notifying about the evaluation context expiration. It is up to
@@ -161,8 +220,9 @@ class EvaluationContext : public base::RefCounted<EvaluationContext>,
   // is_expired().
   std::unique_ptr<base::Closure> callback_;
 
-  // The TaskId returned by the message loop identifying the timeout callback.
-  // Used for canceling the timeout callback.
+  // The TaskId returned by the message loop, or the TimerId returned by the
+  // |timer_wheel_|, identifying the timeout callback. Used for canceling the
+  // timeout callback.
   brillo::MessageLoop::TaskId timeout_event_ =
       brillo::MessageLoop::kTaskIdNull;
 
@@ -173,6 +233,18 @@ class EvaluationContext : public base::RefCounted<EvaluationContext>,
   // Whether the evaluation context has indeed expired.
   bool is_expired_ = false;
 
+  // See reevaluation_cause().
+  std::string reevaluation_cause_;
+
+  // The stats where the variable accesses are recorded, not owned. May be null.
+  PolicyStats* stats_ = nullptr;
+
+  // The trace where the variable values are recorded, not owned. May be null.
+  PolicyTrace* trace_ = nullptr;
+
+  // The timer wheel used for the timeouts, not owned. May be null.
+  TimerWheel* timer_wheel_ = nullptr;
+
   // Pointer to the mockable clock interface;
   chromeos_update_engine::ClockInterface* const clock_;
 
@@ -18,6 +18,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <base/bind.h>
 #include <brillo/message_loops/fake_message_loop.h>
@@ -459,6 +460,82 @@ TEST_F(UmEvaluationContextTest,
   EXPECT_FALSE(eval_ctx_->RunOnValueChangeOrTimeout(Bind(&DoNothing)));
 }
 
+TEST_F(UmEvaluationContextTest, ReplayEvaluationWithoutPreviousEvaluation) {
+  EXPECT_FALSE(eval_ctx_->ReplayEvaluation());
+}
+
+TEST_F(UmEvaluationContextTest, ReplayEvaluationUnchangedInputs) {
+  fake_int_var_.reset(new int(42));
+  EXPECT_EQ(42, *eval_ctx_->GetValue(&fake_int_var_));
+  EXPECT_EQ(nullptr, eval_ctx_->GetValue(&fail_var_));
+  EXPECT_FALSE(eval_ctx_->IsWallclockTimeGreaterThan(
+      fake_clock_.GetWallclockTime() + TimeDelta::FromSeconds(10)));
+
+  fake_int_var_.reset(new int(42));
+  fake_clock_.SetWallclockTime(
+      fake_clock_.GetWallclockTime() + TimeDelta::FromSeconds(5));
+  EXPECT_TRUE(eval_ctx_->ReplayEvaluation());
+
+  // The replayed inputs are tracked by the new evaluation, so they are
+  // replayed again and waited for.
+  fake_int_var_.reset(new int(42));
+  EXPECT_TRUE(eval_ctx_->ReplayEvaluation());
+  EXPECT_TRUE(eval_ctx_->RunOnValueChangeOrTimeout(Bind(&DoNothing)));
+  eval_ctx_->RemoveObserversAndTimeout();
+}
+
+TEST_F(UmEvaluationContextTest, ReplayEvaluationChangedValue) {
+  fake_int_var_.reset(new int(42));
+  eval_ctx_->GetValue(&fake_int_var_);
+
+  fake_int_var_.reset(new int(5));
+  EXPECT_FALSE(eval_ctx_->ReplayEvaluation());
+  // The evaluation was reset, so the new value is read.
+  EXPECT_EQ(5, *eval_ctx_->GetValue(&fake_int_var_));
+}
+
+TEST_F(UmEvaluationContextTest, ReplayEvaluationChangedValueToNull) {
+  fake_int_var_.reset(new int(42));
+  eval_ctx_->GetValue(&fake_int_var_);
+
+  EXPECT_FALSE(eval_ctx_->ReplayEvaluation());
+}
+
+TEST_F(UmEvaluationContextTest, ReplayEvaluationChangedTimeComparison) {
+  EXPECT_FALSE(eval_ctx_->IsMonotonicTimeGreaterThan(
+      fake_clock_.GetMonotonicTime() + TimeDelta::FromSeconds(10)));
+
+  fake_clock_.SetMonotonicTime(
+      fake_clock_.GetMonotonicTime() + TimeDelta::FromSeconds(20));
+  EXPECT_FALSE(eval_ctx_->ReplayEvaluation());
+}
+
+TEST_F(UmEvaluationContextTest, RecordsTheValuesReadInTheTrace) {
+  PolicyTrace trace;
+  eval_ctx_->set_trace(&trace);
+  fake_int_var_.reset(new int(42));
+  trace.StartEvaluation("Policy::Foo", "", Time(), Time());
+  eval_ctx_->GetValue(&fake_int_var_);
+  // The cached values aren't read again.
+  eval_ctx_->GetValue(&fake_int_var_);
+  eval_ctx_->GetValue(&fail_var_);
+  EXPECT_TRUE(trace.EndEvaluation());
+
+  // The inputs re-read by ReplayEvaluation() aren't part of an evaluation.
+  fake_int_var_.reset(new int(42));
+  EXPECT_FALSE(eval_ctx_->ReplayEvaluation());
+
+  ASSERT_EQ(1U, trace.evaluations().size());
+  const std::vector<PolicyTrace::Value>& values =
+      trace.evaluations()[0].values;
+  ASSERT_EQ(2U, values.size());
+  EXPECT_EQ("fake_int", values[0].name);
+  EXPECT_TRUE(values[0].has_value);
+  EXPECT_EQ("42", values[0].value);
+  EXPECT_EQ("fail_var", values[1].name);
+  EXPECT_FALSE(values[1].has_value);
+}
+
 TEST_F(UmEvaluationContextTest, DumpContext) {
   // |fail_var_| yield "(no value)" since it is unset.
   eval_ctx_->GetValue(&fail_var_);
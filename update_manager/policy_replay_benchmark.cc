@@ -0,0 +1,502 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+// Replays the policy evaluations recorded by the daemon in a PolicyTrace
+// through the ChromeOSPolicy or the DefaultPolicy, with the variables of the
+// FakeState set to the recorded values, and measures the evaluations per
+// second, the allocations per evaluation and how many re-evaluations were
+// skipped because their inputs didn't change, so changes to the policies, the
+// EvaluationContext or BoxedValue can be compared between builds without a
+// device.
+//
+// The trace is recorded by creating the "policy_trace" file in the
+// non-volatile directory of the daemon, usually /var/lib/update_engine.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/callback.h>
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
+
+#include "update_engine/common/fake_clock.h"
+#include "update_engine/common/test_alloc_counter.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/update_manager/chromeos_policy.h"
+#include "update_engine/update_manager/default_policy.h"
+#include "update_engine/update_manager/evaluation_context.h"
+#include "update_engine/update_manager/fake_state.h"
+#include "update_engine/update_manager/policy.h"
+#include "update_engine/update_manager/policy_trace.h"
+
+using base::Time;
+using base::TimeDelta;
+using base::TimeTicks;
+using chromeos_update_engine::FakeClock;
+using chromeos_update_engine::NumAllocations;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_manager {
+
+namespace {
+
+// The evaluation timeout of the UpdateManager in the daemon.
+const int kEvaluationTimeoutSeconds = 5;
+
+// The policy requests that can be replayed.
+enum class PolicyRequest {
+  kUpdateCheckAllowed,
+  kUpdateCanStart,
+  kUpdateDownloadAllowed,
+  kP2PEnabled,
+  kP2PEnabledChanged,
+};
+
+const struct {
+  PolicyRequest request;
+  const char* name;
+} kPolicyRequests[] = {
+    {PolicyRequest::kUpdateCheckAllowed, "UpdateCheckAllowed"},
+    {PolicyRequest::kUpdateCanStart, "UpdateCanStart"},
+    {PolicyRequest::kUpdateDownloadAllowed, "UpdateDownloadAllowed"},
+    {PolicyRequest::kP2PEnabled, "P2PEnabled"},
+    {PolicyRequest::kP2PEnabledChanged, "P2PEnabledChanged"},
+};
+
+// The counters of the replayed evaluations of a policy request.
+struct ReplayCounters {
+  // The number of calls to the policy.
+  uint64_t evaluations = 0;
+  // The number of evaluations of an async request after the first one, and
+  // how many of them were skipped because their inputs didn't change.
+  uint64_t reevaluations = 0;
+  uint64_t skipped = 0;
+  // The number of evaluations of the policy that failed and were done again
+  // by the DefaultPolicy, like the UpdateManager does.
+  uint64_t failed = 0;
+  uint64_t allocations = 0;
+  TimeDelta time;
+};
+
+class PolicyReplay {
+ public:
+  explicit PolicyReplay(const Policy* policy) : policy_(policy) {}
+
+  // Prepares the replay of the recorded |evaluations|, decoding their values.
+  bool Init(const vector<PolicyTrace::Evaluation>& evaluations);
+
+  // Replays all the evaluations once, adding to |counters|.
+  void Run(std::map<PolicyRequest, ReplayCounters>* counters);
+
+  // The number of evaluations that are replayed by Run().
+  size_t num_steps() const { return steps_.size(); }
+
+ private:
+  // A recorded evaluation, ready to be replayed.
+  struct Step {
+    PolicyRequest request;
+    // Whether this is the first evaluation of the policy request.
+    bool new_request;
+    Time wallclock;
+    Time monotonic;
+    // The index of the variables in |setters_| read by this evaluation and
+    // the closures setting them to the recorded values.
+    vector<std::pair<size_t, base::Closure>> values;
+  };
+
+  // Registers the fake variable |var| so its recorded values can be replayed.
+  template<typename T>
+  void AddVariable(FakeVariable<T>* var);
+
+  // Decodes the recorded |value| of |var| into a closure setting it.
+  template<typename T>
+  static bool DecodeSetter(FakeVariable<T>* var,
+                           const PolicyTrace::Value& value,
+                           base::Closure* setter);
+
+  template<typename T>
+  static void SetValue(FakeVariable<T>* var, const T& value) {
+    var->reset(new T(value));
+  }
+
+  template<typename T>
+  static void ClearValue(FakeVariable<T>* var) {
+    var->reset(nullptr);
+  }
+
+  // Sets all the variables to their latest recorded value. The FakeVariables
+  // return their value only once, like the real ones return a new copy every
+  // time, so they are set again before every pass reading them.
+  void SetLatestValues();
+
+  // Calls the policy method of |request| on |ec|, falling back to the
+  // DefaultPolicy if it fails.
+  EvalStatus Evaluate(PolicyRequest request,
+                      EvaluationContext* ec,
+                      ReplayCounters* counters);
+
+  template<typename R, typename... Args>
+  EvalStatus EvaluateMethod(EvalStatus (Policy::*policy_method)(
+                                EvaluationContext*, State*, string*, R*,
+                                Args...) const,
+                            EvaluationContext* ec,
+                            ReplayCounters* counters,
+                            Args... args);
+
+  // Returns the UpdateState passed to UpdateCanStart(), which isn't recorded:
+  // a non-interactive check of a full payload seen for the first time a day
+  // before the evaluation.
+  UpdateState ReplayUpdateState();
+
+  FakeClock clock_;
+  FakeState state_;
+  const std::unique_ptr<const Policy> policy_;
+  const DefaultPolicy default_policy_{&clock_};
+
+  // The decoders of the recorded values of each variable, by name.
+  std::map<string, size_t> variable_index_;
+  vector<base::Callback<bool(const PolicyTrace::Value&, base::Closure*)>>
+      decoders_;
+
+  // The latest value set for each variable during the replay, or a null
+  // closure if it wasn't read yet.
+  vector<base::Closure> setters_;
+
+  vector<Step> steps_;
+
+  DISALLOW_COPY_AND_ASSIGN(PolicyReplay);
+};
+
+bool PolicyReplay::Init(const vector<PolicyTrace::Evaluation>& evaluations) {
+  AddVariable(state_.config_provider()->var_is_oobe_enabled());
+
+  FakeDevicePolicyProvider* device_policy = state_.device_policy_provider();
+  AddVariable(device_policy->var_device_policy_is_loaded());
+  AddVariable(device_policy->var_release_channel());
+  AddVariable(device_policy->var_release_channel_delegated());
+  AddVariable(device_policy->var_update_disabled());
+  AddVariable(device_policy->var_target_version_prefix());
+  AddVariable(device_policy->var_scatter_factor());
+  AddVariable(device_policy->var_allowed_connection_types_for_update());
+  AddVariable(device_policy->var_owner());
+  AddVariable(device_policy->var_http_downloads_enabled());
+  AddVariable(device_policy->var_au_p2p_enabled());
+
+  AddVariable(state_.random_provider()->var_seed());
+
+  AddVariable(state_.shill_provider()->var_is_connected());
+  AddVariable(state_.shill_provider()->var_conn_type());
+  AddVariable(state_.shill_provider()->var_conn_tethering());
+  AddVariable(state_.shill_provider()->var_conn_last_changed());
+
+  AddVariable(state_.system_provider()->var_is_normal_boot_mode());
+  AddVariable(state_.system_provider()->var_is_official_build());
+  AddVariable(state_.system_provider()->var_is_oobe_complete());
+  AddVariable(state_.system_provider()->var_num_slots());
+
+  AddVariable(state_.time_provider()->var_curr_date());
+  AddVariable(state_.time_provider()->var_curr_hour());
+
+  FakeUpdaterProvider* updater = state_.updater_provider();
+  AddVariable(updater->var_updater_started_time());
+  AddVariable(updater->var_last_checked_time());
+  AddVariable(updater->var_update_completed_time());
+  AddVariable(updater->var_progress());
+  AddVariable(updater->var_stage());
+  AddVariable(updater->var_new_version());
+  AddVariable(updater->var_payload_size());
+  AddVariable(updater->var_curr_channel());
+  AddVariable(updater->var_new_channel());
+  AddVariable(updater->var_p2p_enabled());
+  AddVariable(updater->var_cellular_enabled());
+  AddVariable(updater->var_consecutive_failed_update_checks());
+  AddVariable(updater->var_server_dictated_poll_interval());
+  AddVariable(updater->var_forced_update_requested());
+  setters_.resize(decoders_.size());
+
+  set<string> unknown_names;
+  for (const PolicyTrace::Evaluation& evaluation : evaluations) {
+    const string method_name =
+        evaluation.policy_name.substr(evaluation.policy_name.rfind(':') + 1);
+    bool found = false;
+    Step step;
+    for (const auto& policy_request : kPolicyRequests) {
+      if (method_name == policy_request.name) {
+        step.request = policy_request.request;
+        found = true;
+      }
+    }
+    if (!found) {
+      LOG(ERROR) << "Unknown policy request " << evaluation.policy_name;
+      return false;
+    }
+    step.new_request = evaluation.cause.empty();
+    step.wallclock = evaluation.wallclock;
+    step.monotonic = evaluation.monotonic;
+    for (const PolicyTrace::Value& value : evaluation.values) {
+      auto it = variable_index_.find(value.name);
+      if (it == variable_index_.end()) {
+        if (unknown_names.insert(value.name).second)
+          LOG(WARNING) << "Ignoring the unknown variable " << value.name;
+        continue;
+      }
+      base::Closure setter;
+      if (!decoders_[it->second].Run(value, &setter)) {
+        LOG(ERROR) << "Invalid value of " << value.name << ": " << value.value;
+        return false;
+      }
+      step.values.emplace_back(it->second, setter);
+    }
+    steps_.push_back(std::move(step));
+  }
+  return true;
+}
+
+template<typename T>
+void PolicyReplay::AddVariable(FakeVariable<T>* var) {
+  variable_index_[var->GetName()] = decoders_.size();
+  decoders_.push_back(base::Bind(&PolicyReplay::DecodeSetter<T>, var));
+}
+
+template<typename T>
+bool PolicyReplay::DecodeSetter(FakeVariable<T>* var,
+                                const PolicyTrace::Value& value,
+                                base::Closure* setter) {
+  if (!value.has_value) {
+    *setter = base::Bind(&PolicyReplay::ClearValue<T>, var);
+    return true;
+  }
+  T decoded;
+  TEST_AND_RETURN_FALSE(PolicyTrace::DecodeValue<T>(value.value, &decoded));
+  *setter = base::Bind(&PolicyReplay::SetValue<T>, var, decoded);
+  return true;
+}
+
+void PolicyReplay::SetLatestValues() {
+  for (const base::Closure& setter : setters_) {
+    if (!setter.is_null())
+      setter.Run();
+  }
+}
+
+void PolicyReplay::Run(std::map<PolicyRequest, ReplayCounters>* counters) {
+  // Reset the variables, so every pass replays the same evaluations.
+  for (base::Closure& setter : setters_)
+    setter.Reset();
+  std::map<PolicyRequest, scoped_refptr<EvaluationContext>> contexts;
+  for (const Step& step : steps_) {
+    ReplayCounters* request_counters = &(*counters)[step.request];
+    const uint64_t start_allocations = NumAllocations();
+    const TimeTicks start = TimeTicks::Now();
+
+    clock_.SetWallclockTime(step.wallclock);
+    clock_.SetMonotonicTime(step.monotonic);
+    for (const auto& value : step.values)
+      setters_[value.first] = value.second;
+
+    // The re-evaluations of an async request reuse its context, and are
+    // skipped by the UpdateManager if their inputs didn't change.
+    scoped_refptr<EvaluationContext>& ec = contexts[step.request];
+    bool skipped = false;
+    if (step.new_request || !ec) {
+      ec = new EvaluationContext(
+          &clock_, TimeDelta::FromSeconds(kEvaluationTimeoutSeconds));
+    } else {
+      request_counters->reevaluations++;
+      SetLatestValues();
+      skipped = ec->ReplayEvaluation();
+    }
+    if (skipped) {
+      request_counters->skipped++;
+    } else {
+      SetLatestValues();
+      ec->ResetEvaluation();
+      Evaluate(step.request, ec.get(), request_counters);
+    }
+
+    request_counters->time += TimeTicks::Now() - start;
+    request_counters->allocations += NumAllocations() - start_allocations;
+  }
+}
+
+EvalStatus PolicyReplay::Evaluate(PolicyRequest request,
+                                  EvaluationContext* ec,
+                                  ReplayCounters* counters) {
+  switch (request) {
+    case PolicyRequest::kUpdateCheckAllowed:
+      return EvaluateMethod(&Policy::UpdateCheckAllowed, ec, counters);
+    case PolicyRequest::kUpdateCanStart:
+      return EvaluateMethod(
+          &Policy::UpdateCanStart, ec, counters, ReplayUpdateState());
+    case PolicyRequest::kUpdateDownloadAllowed:
+      return EvaluateMethod(&Policy::UpdateDownloadAllowed, ec, counters);
+    case PolicyRequest::kP2PEnabled:
+      return EvaluateMethod(&Policy::P2PEnabled, ec, counters);
+    case PolicyRequest::kP2PEnabledChanged:
+      return EvaluateMethod(&Policy::P2PEnabledChanged, ec, counters, false);
+  }
+  NOTREACHED();
+  return EvalStatus::kFailed;
+}
+
+template<typename R, typename... Args>
+EvalStatus PolicyReplay::EvaluateMethod(EvalStatus (Policy::*policy_method)(
+                                            EvaluationContext*, State*,
+                                            string*, R*, Args...) const,
+                                        EvaluationContext* ec,
+                                        ReplayCounters* counters,
+                                        Args... args) {
+  counters->evaluations++;
+  R result;
+  string error;
+  EvalStatus status =
+      (policy_.get()->*policy_method)(ec, &state_, &error, &result, args...);
+  if (status == EvalStatus::kFailed) {
+    counters->failed++;
+    status = (default_policy_.*policy_method)(ec, &state_, &error, &result,
+                                              args...);
+  }
+  return status;
+}
+
+UpdateState PolicyReplay::ReplayUpdateState() {
+  UpdateState update_state = UpdateState();
+  update_state.is_interactive = false;
+  update_state.is_delta_payload = false;
+  update_state.first_seen = clock_.GetWallclockTime() - TimeDelta::FromDays(1);
+  update_state.num_checks = 1;
+  update_state.num_failures = 0;
+  update_state.download_urls = vector<string>{"http://fake/url/"};
+  update_state.download_errors_max = 10;
+  update_state.last_download_url_idx = -1;
+  update_state.last_download_url_num_errors = 0;
+  update_state.p2p_downloading_disabled = false;
+  update_state.p2p_sharing_disabled = false;
+  update_state.p2p_num_attempts = 0;
+  update_state.is_backoff_disabled = false;
+  update_state.scatter_check_threshold = 0;
+  update_state.scatter_wait_period_max = TimeDelta::FromDays(7);
+  update_state.scatter_check_threshold_min = 0;
+  update_state.scatter_check_threshold_max = 0;
+  return update_state;
+}
+
+// Replays the trace until |min_time| elapses and prints the counters of each
+// policy request, per pass over the trace.
+void RunReplay(const string& policy_name,
+               PolicyReplay* replay,
+               TimeDelta min_time) {
+  // Warm up the caches and the lazily initialized state once.
+  std::map<PolicyRequest, ReplayCounters> counters;
+  replay->Run(&counters);
+  counters.clear();
+
+  uint64_t passes = 0;
+  const TimeTicks start = TimeTicks::Now();
+  do {
+    replay->Run(&counters);
+    passes++;
+  } while (TimeTicks::Now() - start < min_time);
+
+  for (const auto& policy_request : kPolicyRequests) {
+    auto it = counters.find(policy_request.request);
+    if (it == counters.end())
+      continue;
+    const ReplayCounters& request_counters = it->second;
+    const uint64_t requests =
+        request_counters.evaluations + request_counters.skipped;
+    printf("{\"name\": \"%s::%s\", \"passes\": %" PRIu64 ", "
+           "\"evaluations_per_s\": %.0f, \"ns_per_request\": %.0f, "
+           "\"allocs_per_request\": %.2f, \"evaluations\": %" PRIu64 ", "
+           "\"reevaluations\": %" PRIu64 ", \"skipped\": %" PRIu64 ", "
+           "\"failed\": %" PRIu64 "}\n",
+           policy_name.c_str(), policy_request.name, passes,
+           request_counters.evaluations / request_counters.time.InSecondsF(),
+           request_counters.time.InSecondsF() * 1e9 / requests,
+           static_cast<double>(request_counters.allocations) / requests,
+           request_counters.evaluations / passes,
+           request_counters.reevaluations / passes,
+           request_counters.skipped / passes,
+           request_counters.failed / passes);
+  }
+  fflush(stdout);
+}
+
+int Main(int argc, char** argv) {
+  DEFINE_string(trace, "", "Path to the policy trace recorded by the daemon.");
+  DEFINE_string(policy, "chromeos",
+                "The policy to replay the trace through: \"chromeos\" or "
+                "\"default\".");
+  DEFINE_int32(min_time_ms, 1000,
+               "The minimum time to replay the trace for, in milliseconds.");
+  brillo::FlagHelper::Init(argc, argv,
+      "Replays the policy evaluations recorded in a trace and measures their "
+      "cost.\nThe results are printed as one JSON object per policy request "
+      "and line.");
+  logging::SetMinLogLevel(logging::LOG_ERROR);
+
+  vector<PolicyTrace::Evaluation> evaluations;
+  if (FLAGS_trace.empty() || !PolicyTrace::Load(FLAGS_trace, &evaluations)) {
+    LOG(ERROR) << "Failed to load the policy trace \"" << FLAGS_trace << "\".";
+    return 1;
+  }
+
+  const Policy* policy;
+  string policy_name;
+  if (FLAGS_policy == "chromeos") {
+    policy = new ChromeOSPolicy();
+    policy_name = "ChromeOSPolicy";
+  } else if (FLAGS_policy == "default") {
+    policy = new DefaultPolicy();
+    policy_name = "DefaultPolicy";
+  } else {
+    LOG(ERROR) << "Unknown policy \"" << FLAGS_policy << "\".";
+    return 1;
+  }
+  PolicyReplay replay(policy);
+  if (!replay.Init(evaluations)) {
+    LOG(ERROR) << "Failed to prepare the replay of the policy trace.";
+    return 1;
+  }
+  if (replay.num_steps() == 0) {
+    LOG(ERROR) << "The policy trace has no evaluations.";
+    return 1;
+  }
+  RunReplay(policy_name, &replay,
+            TimeDelta::FromMilliseconds(FLAGS_min_time_ms));
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_manager
+
+int main(int argc, char** argv) {
+  return chromeos_update_manager::Main(argc, argv);
+}
@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/policy_stats.h"
+
+#include <algorithm>
+#include <memory>
+
+#include <base/json/json_writer.h>
+#include <base/strings/string_util.h>
+#include <base/values.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/update_manager/policy.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_manager {
+
+const size_t PolicyStats::kMaxTraceEntries = 64;
+
+void PolicyStats::RecordEvaluation(const string& policy_name,
+                                   EvalStatus status,
+                                   TimeDelta duration) {
+  PolicyCounters& counters = policies_[policy_name];
+  counters.evaluations++;
+  switch (status) {
+    case EvalStatus::kSucceeded:
+      counters.succeeded++;
+      break;
+    case EvalStatus::kFailed:
+      counters.failed++;
+      break;
+    case EvalStatus::kAskMeAgainLater:
+      counters.blocked++;
+      break;
+  }
+  counters.total_time += duration;
+  counters.max_time = std::max(counters.max_time, duration);
+
+  summary_.evaluations++;
+  summary_.evaluation_time += duration;
+}
+
+void PolicyStats::RecordReevaluation(const string& policy_name,
+                                     const string& cause,
+                                     bool skipped,
+                                     Time timestamp) {
+  PolicyCounters& counters = policies_[policy_name];
+  counters.reevaluations++;
+  if (skipped) {
+    counters.skipped++;
+    summary_.skipped_evaluations++;
+  }
+
+  trace_.push_back(TraceEntry{timestamp, policy_name, cause, skipped});
+  if (trace_.size() > kMaxTraceEntries)
+    trace_.pop_front();
+}
+
+void PolicyStats::RecordVariableRead(const string& variable_name) {
+  variables_[variable_name].reads++;
+}
+
+void PolicyStats::RecordVariableChange(const string& variable_name) {
+  variables_[variable_name].changes++;
+}
+
+PolicyStats::Summary PolicyStats::TakeSummary() {
+  Summary summary = summary_;
+  summary_ = Summary();
+  return summary;
+}
+
+string PolicyStats::ToJson() const {
+  std::unique_ptr<base::DictionaryValue> policies(new base::DictionaryValue());
+  for (const auto& it : policies_) {
+    const PolicyCounters& counters = it.second;
+    std::unique_ptr<base::DictionaryValue> policy(new base::DictionaryValue());
+    policy->SetInteger("evaluations", counters.evaluations);
+    policy->SetInteger("succeeded", counters.succeeded);
+    policy->SetInteger("failed", counters.failed);
+    policy->SetInteger("blocked", counters.blocked);
+    policy->SetInteger("reevaluations", counters.reevaluations);
+    policy->SetInteger("skipped", counters.skipped);
+    policy->SetString("total_time",
+                      chromeos_update_engine::utils::FormatTimeDelta(
+                          counters.total_time));
+    policy->SetString("max_time",
+                      chromeos_update_engine::utils::FormatTimeDelta(
+                          counters.max_time));
+    policies->SetWithoutPathExpansion(it.first, policy.release());
+  }
+
+  std::unique_ptr<base::DictionaryValue> variables(new base::DictionaryValue());
+  for (const auto& it : variables_) {
+    std::unique_ptr<base::DictionaryValue> variable(
+        new base::DictionaryValue());
+    variable->SetInteger("reads", it.second.reads);
+    variable->SetInteger("changes", it.second.changes);
+    variables->SetWithoutPathExpansion(it.first, variable.release());
+  }
+
+  std::unique_ptr<base::ListValue> trace(new base::ListValue());
+  for (const TraceEntry& entry : trace_) {
+    std::unique_ptr<base::DictionaryValue> event(new base::DictionaryValue());
+    event->SetString("time",
+                     chromeos_update_engine::utils::ToString(entry.timestamp));
+    event->SetString("policy", entry.policy_name);
+    event->SetString("cause", entry.cause);
+    event->SetBoolean("skipped", entry.skipped);
+    trace->Append(event.release());
+  }
+
+  base::DictionaryValue value;
+  value.Set("policies", policies.release());  // Adopts |policies|.
+  value.Set("variables", variables.release());  // Adopts |variables|.
+  value.Set("reevaluations", trace.release());  // Adopts |trace|.
+
+  string json_str;
+  base::JSONWriter::WriteWithOptions(
+      value, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json_str);
+  base::TrimWhitespaceASCII(json_str, base::TRIM_TRAILING, &json_str);
+
+  return json_str;
+}
+
+}  // namespace chromeos_update_manager
@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_UPDATE_MANAGER_POLICY_STATS_H_
+#define UPDATE_ENGINE_UPDATE_MANAGER_POLICY_STATS_H_
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_manager {
+
+// Defined in policy.h, which depends on this file through
+// evaluation_context.h.
+enum class EvalStatus;
+
+// PolicyStats collects counters and timings of the policy evaluations done by
+// the UpdateManager, per policy request and per variable, and keeps a trace of
+// the most recent re-evaluations with their cause. This is intended to help
+// debugging the cost of the policies; the format of ToJson() may change in the
+// future.
+class PolicyStats {
+ public:
+  // The counters accumulated over all the policy requests since the last call
+  // to TakeSummary().
+  struct Summary {
+    // The number of times a policy method was called.
+    int evaluations = 0;
+
+    // The number of re-evaluations skipped because their inputs didn't change.
+    int skipped_evaluations = 0;
+
+    // The time spent in the policy methods.
+    base::TimeDelta evaluation_time;
+  };
+
+  PolicyStats() = default;
+
+  // Records an evaluation of |policy_name| that returned |status| after
+  // running for |duration|.
+  void RecordEvaluation(const std::string& policy_name, EvalStatus status,
+                        base::TimeDelta duration);
+
+  // Records a re-evaluation of |policy_name| at |timestamp| due to |cause|,
+  // which is either the name of the variable that changed or a timeout.
+  // |skipped| tells whether the evaluation was skipped because its inputs
+  // didn't change.
+  void RecordReevaluation(const std::string& policy_name,
+                          const std::string& cause,
+                          bool skipped,
+                          base::Time timestamp);
+
+  // Records that the value of |variable_name| was read from the variable, as
+  // opposed to from the cache of the EvaluationContext.
+  void RecordVariableRead(const std::string& variable_name);
+
+  // Records that |variable_name| notified a value change to an evaluation
+  // waiting on it.
+  void RecordVariableChange(const std::string& variable_name);
+
+  // Returns the Summary of the counters since the last call and resets it.
+  Summary TakeSummary();
+
+  // Returns a JSON representation of all the counters and of the trace.
+  std::string ToJson() const;
+
+ private:
+  // The maximum number of re-evaluations kept in |trace_|.
+  static const size_t kMaxTraceEntries;
+
+  struct PolicyCounters {
+    int evaluations = 0;
+    int succeeded = 0;
+    int failed = 0;
+    int blocked = 0;
+    int reevaluations = 0;
+    int skipped = 0;
+    base::TimeDelta total_time;
+    base::TimeDelta max_time;
+  };
+
+  struct VariableCounters {
+    int reads = 0;
+    int changes = 0;
+  };
+
+  struct TraceEntry {
+    base::Time timestamp;
+    std::string policy_name;
+    std::string cause;
+    bool skipped;
+  };
+
+  std::map<std::string, PolicyCounters> policies_;
+  std::map<std::string, VariableCounters> variables_;
+
+  // The most recent re-evaluations, oldest first.
+  std::deque<TraceEntry> trace_;
+
+  Summary summary_;
+
+  DISALLOW_COPY_AND_ASSIGN(PolicyStats);
+};
+
+}  // namespace chromeos_update_manager
+
+#endif  // UPDATE_ENGINE_UPDATE_MANAGER_POLICY_STATS_H_
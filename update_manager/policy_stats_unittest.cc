@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/policy_stats.h"
+
+#include <string>
+
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/update_manager/policy.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_manager {
+
+class UmPolicyStatsTest : public ::testing::Test {
+ protected:
+  PolicyStats stats_;
+};
+
+TEST_F(UmPolicyStatsTest, EmptySummary) {
+  PolicyStats::Summary summary = stats_.TakeSummary();
+  EXPECT_EQ(0, summary.evaluations);
+  EXPECT_EQ(0, summary.skipped_evaluations);
+  EXPECT_EQ(TimeDelta(), summary.evaluation_time);
+}
+
+TEST_F(UmPolicyStatsTest, SummaryAccumulatesAndResets) {
+  stats_.RecordEvaluation("Policy::Foo", EvalStatus::kAskMeAgainLater,
+                          TimeDelta::FromMilliseconds(3));
+  stats_.RecordReevaluation("Policy::Foo", "var", true, Time());
+  stats_.RecordEvaluation("Policy::Bar", EvalStatus::kSucceeded,
+                          TimeDelta::FromMilliseconds(4));
+
+  PolicyStats::Summary summary = stats_.TakeSummary();
+  EXPECT_EQ(2, summary.evaluations);
+  EXPECT_EQ(1, summary.skipped_evaluations);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(7), summary.evaluation_time);
+
+  summary = stats_.TakeSummary();
+  EXPECT_EQ(0, summary.evaluations);
+  EXPECT_EQ(0, summary.skipped_evaluations);
+}
+
+TEST_F(UmPolicyStatsTest, ToJsonIncludesCounters) {
+  stats_.RecordEvaluation("Policy::Foo", EvalStatus::kAskMeAgainLater,
+                          TimeDelta::FromSeconds(1));
+  stats_.RecordVariableRead("some_var");
+  stats_.RecordVariableRead("some_var");
+  stats_.RecordVariableChange("some_var");
+  stats_.RecordReevaluation("Policy::Foo", "some_var", false, Time());
+
+  string json = stats_.ToJson();
+  EXPECT_NE(string::npos, json.find("\"Policy::Foo\""));
+  EXPECT_NE(string::npos, json.find("\"blocked\": 1"));
+  EXPECT_NE(string::npos, json.find("\"reads\": 2"));
+  EXPECT_NE(string::npos, json.find("\"changes\": 1"));
+  EXPECT_NE(string::npos, json.find("\"cause\": \"some_var\""));
+}
+
+TEST_F(UmPolicyStatsTest, TraceIsBounded) {
+  for (int i = 0; i < 1000; i++)
+    stats_.RecordReevaluation("Policy::Foo", "timeout", false, Time());
+  stats_.RecordReevaluation("Policy::Foo", "expiration", false, Time());
+
+  string json = stats_.ToJson();
+  EXPECT_NE(string::npos, json.find("\"expiration\""));
+  EXPECT_NE(string::npos, json.find("\"reevaluations\": 1001"));
+  // Only the most recent entries are kept in the trace.
+  size_t num_entries = 0;
+  for (size_t pos = json.find("\"cause\""); pos != string::npos;
+       pos = json.find("\"cause\"", pos + 1)) {
+    num_entries++;
+  }
+  EXPECT_EQ(64U, num_entries);
+}
+
+}  // namespace chromeos_update_manager
@@ -0,0 +1,380 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/policy_trace.h"
+
+#include <stdint.h>
+
+#include <set>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/update_manager/shill_provider.h"
+#include "update_engine/update_manager/updater_provider.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_manager {
+
+namespace {
+
+const char kEvaluationRecord[] = "evaluation";
+const char kValueRecord[] = "value";
+const char kNoValueRecord[] = "novalue";
+
+// Escapes the backslashes, tabs and newlines of |field|, so it can be written
+// in a tab separated record.
+string EscapeField(const string& field) {
+  string escaped;
+  escaped.reserve(field.size());
+  for (char c : field) {
+    switch (c) {
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      default:
+        escaped += c;
+    }
+  }
+  return escaped;
+}
+
+bool UnescapeField(const string& field, string* unescaped) {
+  unescaped->clear();
+  for (size_t i = 0; i < field.size(); i++) {
+    if (field[i] != '\\') {
+      *unescaped += field[i];
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(++i < field.size());
+    switch (field[i]) {
+      case '\\':
+        *unescaped += '\\';
+        break;
+      case 't':
+        *unescaped += '\t';
+        break;
+      case 'n':
+        *unescaped += '\n';
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Decodes an enum value recorded as its integer value, up to |max_value|.
+template<typename E>
+bool DecodeEnum(const string& encoded, E max_value, E* value) {
+  int int_value;
+  TEST_AND_RETURN_FALSE(base::StringToInt(encoded, &int_value));
+  TEST_AND_RETURN_FALSE(int_value >= 0 &&
+                        int_value <= static_cast<int>(max_value));
+  *value = static_cast<E>(int_value);
+  return true;
+}
+
+}  // namespace
+
+void PolicyTrace::StartEvaluation(const string& policy_name,
+                                  const string& cause,
+                                  Time wallclock,
+                                  Time monotonic) {
+  current_ = Evaluation();
+  current_.policy_name = policy_name;
+  current_.cause = cause;
+  current_.wallclock = wallclock;
+  current_.monotonic = monotonic;
+  recording_ = true;
+}
+
+bool PolicyTrace::EndEvaluation() {
+  TEST_AND_RETURN_FALSE(recording_);
+  recording_ = false;
+  if (path_.empty()) {
+    evaluations_.push_back(std::move(current_));
+    return true;
+  }
+  // The evaluations are minutes apart, so the file is opened for each of
+  // them instead of keeping it open for the lifetime of the daemon.
+  const string records = Serialize(current_);
+  const base::FilePath path(path_);
+  if (!base::PathExists(path)) {
+    TEST_AND_RETURN_FALSE(base::WriteFile(path, records.data(),
+                                          records.size()) ==
+                          static_cast<int>(records.size()));
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(
+      base::AppendToFile(path, records.data(), records.size()));
+  return true;
+}
+
+string PolicyTrace::Serialize(const Evaluation& evaluation) {
+  string records = string(kEvaluationRecord) + "\t" +
+                   base::Int64ToString(evaluation.wallclock.ToInternalValue()) +
+                   "\t" +
+                   base::Int64ToString(evaluation.monotonic.ToInternalValue()) +
+                   "\t" + EscapeField(evaluation.policy_name) + "\t" +
+                   EscapeField(evaluation.cause) + "\n";
+  for (const Value& value : evaluation.values) {
+    if (value.has_value) {
+      records += string(kValueRecord) + "\t" + EscapeField(value.name) + "\t" +
+                 EscapeField(value.value) + "\n";
+    } else {
+      records += string(kNoValueRecord) + "\t" + EscapeField(value.name) + "\n";
+    }
+  }
+  return records;
+}
+
+bool PolicyTrace::Load(const string& path, vector<Evaluation>* evaluations) {
+  string contents;
+  TEST_AND_RETURN_FALSE(
+      chromeos_update_engine::utils::ReadFile(path, &contents));
+  evaluations->clear();
+  for (const string& line : base::SplitString(
+           contents, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    vector<string> fields = base::SplitString(
+        line, "\t", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    for (string& field : fields) {
+      string unescaped;
+      if (!UnescapeField(field, &unescaped)) {
+        LOG(ERROR) << "Invalid escape sequence in the trace record: " << line;
+        return false;
+      }
+      field = unescaped;
+    }
+    if (fields[0] == kEvaluationRecord && fields.size() == 5) {
+      int64_t wallclock, monotonic;
+      TEST_AND_RETURN_FALSE(base::StringToInt64(fields[1], &wallclock));
+      TEST_AND_RETURN_FALSE(base::StringToInt64(fields[2], &monotonic));
+      Evaluation evaluation;
+      evaluation.wallclock = Time::FromInternalValue(wallclock);
+      evaluation.monotonic = Time::FromInternalValue(monotonic);
+      evaluation.policy_name = fields[3];
+      evaluation.cause = fields[4];
+      evaluations->push_back(std::move(evaluation));
+    } else if (!evaluations->empty() &&
+               ((fields[0] == kValueRecord && fields.size() == 3) ||
+                (fields[0] == kNoValueRecord && fields.size() == 2))) {
+      Value value;
+      value.name = fields[1];
+      value.has_value = fields[0] == kValueRecord;
+      if (value.has_value)
+        value.value = fields[2];
+      evaluations->back().values.push_back(std::move(value));
+    } else {
+      LOG(ERROR) << "Invalid trace record: " << line;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Template instantiations for the types of the State variables. Keep in sync
+// with the ones of BoxedValue::ValuePrinter() in boxed_value.cc.
+
+template<>
+string PolicyTrace::EncodeValue<string>(const string& value) {
+  return value;
+}
+
+template<>
+bool PolicyTrace::DecodeValue<string>(const string& encoded, string* value) {
+  *value = encoded;
+  return true;
+}
+
+template<>
+string PolicyTrace::EncodeValue<int>(const int& value) {
+  return base::IntToString(value);
+}
+
+template<>
+bool PolicyTrace::DecodeValue<int>(const string& encoded, int* value) {
+  return base::StringToInt(encoded, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<unsigned int>(const unsigned int& value) {
+  return base::UintToString(value);
+}
+
+template<>
+bool PolicyTrace::DecodeValue<unsigned int>(const string& encoded,
+                                            unsigned int* value) {
+  return base::StringToUint(encoded, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<int64_t>(const int64_t& value) {
+  return base::Int64ToString(value);
+}
+
+template<>
+bool PolicyTrace::DecodeValue<int64_t>(const string& encoded, int64_t* value) {
+  return base::StringToInt64(encoded, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<uint64_t>(const uint64_t& value) {
+  return base::Uint64ToString(value);
+}
+
+template<>
+bool PolicyTrace::DecodeValue<uint64_t>(const string& encoded,
+                                        uint64_t* value) {
+  return base::StringToUint64(encoded, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<bool>(const bool& value) {
+  return value ? "true" : "false";
+}
+
+template<>
+bool PolicyTrace::DecodeValue<bool>(const string& encoded, bool* value) {
+  TEST_AND_RETURN_FALSE(encoded == "true" || encoded == "false");
+  *value = encoded == "true";
+  return true;
+}
+
+template<>
+string PolicyTrace::EncodeValue<double>(const double& value) {
+  return base::DoubleToString(value);
+}
+
+template<>
+bool PolicyTrace::DecodeValue<double>(const string& encoded, double* value) {
+  return base::StringToDouble(encoded, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<Time>(const Time& value) {
+  return base::Int64ToString(value.ToInternalValue());
+}
+
+template<>
+bool PolicyTrace::DecodeValue<Time>(const string& encoded, Time* value) {
+  int64_t internal_value;
+  TEST_AND_RETURN_FALSE(base::StringToInt64(encoded, &internal_value));
+  *value = Time::FromInternalValue(internal_value);
+  return true;
+}
+
+template<>
+string PolicyTrace::EncodeValue<TimeDelta>(const TimeDelta& value) {
+  return base::Int64ToString(value.ToInternalValue());
+}
+
+template<>
+bool PolicyTrace::DecodeValue<TimeDelta>(const string& encoded,
+                                         TimeDelta* value) {
+  int64_t internal_value;
+  TEST_AND_RETURN_FALSE(base::StringToInt64(encoded, &internal_value));
+  *value = TimeDelta::FromInternalValue(internal_value);
+  return true;
+}
+
+template<>
+string PolicyTrace::EncodeValue<ConnectionType>(const ConnectionType& value) {
+  return base::IntToString(static_cast<int>(value));
+}
+
+template<>
+bool PolicyTrace::DecodeValue<ConnectionType>(const string& encoded,
+                                              ConnectionType* value) {
+  return DecodeEnum(encoded, ConnectionType::kUnknown, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<set<ConnectionType>>(
+    const set<ConnectionType>& value) {
+  string encoded;
+  for (ConnectionType type : value) {
+    if (!encoded.empty())
+      encoded += ",";
+    encoded += EncodeValue<ConnectionType>(type);
+  }
+  return encoded;
+}
+
+template<>
+bool PolicyTrace::DecodeValue<set<ConnectionType>>(
+    const string& encoded, set<ConnectionType>* value) {
+  value->clear();
+  for (const string& type_str : base::SplitString(
+           encoded, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    ConnectionType type;
+    TEST_AND_RETURN_FALSE(DecodeValue<ConnectionType>(type_str, &type));
+    value->insert(type);
+  }
+  return true;
+}
+
+template<>
+string PolicyTrace::EncodeValue<ConnectionTethering>(
+    const ConnectionTethering& value) {
+  return base::IntToString(static_cast<int>(value));
+}
+
+template<>
+bool PolicyTrace::DecodeValue<ConnectionTethering>(
+    const string& encoded, ConnectionTethering* value) {
+  return DecodeEnum(encoded, ConnectionTethering::kUnknown, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<Stage>(const Stage& value) {
+  return base::IntToString(static_cast<int>(value));
+}
+
+template<>
+bool PolicyTrace::DecodeValue<Stage>(const string& encoded, Stage* value) {
+  return DecodeEnum(encoded, Stage::kAttemptingRollback, value);
+}
+
+template<>
+string PolicyTrace::EncodeValue<UpdateRequestStatus>(
+    const UpdateRequestStatus& value) {
+  return base::IntToString(static_cast<int>(value));
+}
+
+template<>
+bool PolicyTrace::DecodeValue<UpdateRequestStatus>(
+    const string& encoded, UpdateRequestStatus* value) {
+  return DecodeEnum(encoded, UpdateRequestStatus::kPeriodic, value);
+}
+
+}  // namespace chromeos_update_manager
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_UPDATE_MANAGER_POLICY_TRACE_H_
+#define UPDATE_ENGINE_UPDATE_MANAGER_POLICY_TRACE_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_manager {
+
+// PolicyTrace records, for every policy evaluation done by the UpdateManager,
+// the values of the variables it read and the times it started at, so the same
+// evaluations can be replayed offline against the fake providers by the
+// update_engine_policy_benchmark. Only the values read from the variables are
+// recorded, the ones served from the cache of the EvaluationContext aren't.
+//
+// The trace is a text file with one record per line and tab separated fields:
+//
+//   evaluation <wallclock> <monotonic> <policy name> <re-evaluation cause>
+//   value <variable name> <encoded value>
+//   novalue <variable name>
+//
+// where the times are base::Time internal values and the "value" and
+// "novalue" records following an "evaluation" belong to it.
+class PolicyTrace {
+ public:
+  // A variable read during an evaluation.
+  struct Value {
+    std::string name;
+    // Whether the variable returned a value; |value| is empty otherwise.
+    bool has_value = false;
+    // The value encoded with EncodeValue().
+    std::string value;
+  };
+
+  // A call to a policy method.
+  struct Evaluation {
+    std::string policy_name;
+    // What triggered this evaluation of an async policy request, as returned
+    // by EvaluationContext::reevaluation_cause(). Empty for the first
+    // evaluation of a request.
+    std::string cause;
+    // The evaluation times on the wallclock and the monotonic scales.
+    base::Time wallclock;
+    base::Time monotonic;
+    std::vector<Value> values;
+  };
+
+  PolicyTrace() = default;
+
+  // Appends the evaluations to the file at |path| as they end, instead of
+  // keeping them in evaluations(). The file is created if it doesn't exist.
+  void set_path(const std::string& path) { path_ = path; }
+
+  // Starts recording a new evaluation of |policy_name|.
+  void StartEvaluation(const std::string& policy_name,
+                       const std::string& cause,
+                       base::Time wallclock,
+                       base::Time monotonic);
+
+  // Records that the variable |name| returned |value|, which may be null, in
+  // the current evaluation. Does nothing outside of an evaluation, such as
+  // while an EvaluationContext checks whether the inputs of the previous one
+  // changed.
+  template<typename T>
+  void RecordValue(const std::string& name, const T* value) {
+    if (!recording_)
+      return;
+    Value entry;
+    entry.name = name;
+    entry.has_value = value != nullptr;
+    if (value)
+      entry.value = EncodeValue<T>(*value);
+    current_.values.push_back(std::move(entry));
+  }
+
+  // Ends the current evaluation, writing it to the file if a path was set.
+  // Returns false if the write failed; the evaluation is dropped then.
+  bool EndEvaluation();
+
+  // The evaluations ended so far when no path was set.
+  const std::vector<Evaluation>& evaluations() const { return evaluations_; }
+
+  // Reads the evaluations recorded in the trace file at |path|.
+  static bool Load(const std::string& path,
+                   std::vector<Evaluation>* evaluations);
+
+  // Converts a value of a variable type from and to the string recorded in
+  // the trace. See policy_trace.cc for the instantiations of the types of the
+  // State variables.
+  template<typename T>
+  static std::string EncodeValue(const T& value);
+  template<typename T>
+  static bool DecodeValue(const std::string& encoded, T* value);
+
+ private:
+  // Returns the trace records of |evaluation|.
+  static std::string Serialize(const Evaluation& evaluation);
+
+  std::string path_;
+
+  // Whether an evaluation is being recorded in |current_|.
+  bool recording_ = false;
+  Evaluation current_;
+
+  std::vector<Evaluation> evaluations_;
+
+  DISALLOW_COPY_AND_ASSIGN(PolicyTrace);
+};
+
+}  // namespace chromeos_update_manager
+
+#endif  // UPDATE_ENGINE_UPDATE_MANAGER_POLICY_TRACE_H_
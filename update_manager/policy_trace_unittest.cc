@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/policy_trace.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/update_manager/shill_provider.h"
+#include "update_engine/update_manager/updater_provider.h"
+
+using base::Time;
+using base::TimeDelta;
+using chromeos_update_engine::test_utils::ScopedTempFile;
+using chromeos_update_engine::test_utils::WriteFileString;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_manager {
+
+namespace {
+
+// Returns whether |value| is decoded back from its encoding.
+template<typename T>
+bool RoundTrips(const T& value) {
+  T decoded;
+  return PolicyTrace::DecodeValue<T>(PolicyTrace::EncodeValue<T>(value),
+                                     &decoded) &&
+         decoded == value;
+}
+
+}  // namespace
+
+class UmPolicyTraceTest : public ::testing::Test {
+ protected:
+  // Records an evaluation of |policy_name| reading a string with tabs and
+  // newlines, an int and a variable without a value.
+  void RecordEvaluation(const string& policy_name, const string& cause) {
+    const string str_value = "a\tb\\n\nc";
+    const int int_value = 5;
+    trace_.StartEvaluation(policy_name, cause, Time::FromTimeT(1141262625),
+                           Time::FromTimeT(1240428300));
+    trace_.RecordValue("str_var", &str_value);
+    trace_.RecordValue("int_var", &int_value);
+    trace_.RecordValue<int>("null_var", nullptr);
+    EXPECT_TRUE(trace_.EndEvaluation());
+  }
+
+  PolicyTrace trace_;
+};
+
+TEST_F(UmPolicyTraceTest, EncodedValuesRoundTrip) {
+  EXPECT_TRUE(RoundTrips<string>("some\tstring"));
+  EXPECT_TRUE(RoundTrips<int>(-3));
+  EXPECT_TRUE(RoundTrips<unsigned int>(4000000000U));
+  EXPECT_TRUE(RoundTrips<int64_t>(-(1LL << 40)));
+  EXPECT_TRUE(RoundTrips<uint64_t>(1ULL << 63));
+  EXPECT_TRUE(RoundTrips<bool>(true));
+  EXPECT_TRUE(RoundTrips<bool>(false));
+  EXPECT_TRUE(RoundTrips<double>(0.25));
+  EXPECT_TRUE(RoundTrips<Time>(Time::FromTimeT(1141262625)));
+  EXPECT_TRUE(RoundTrips<TimeDelta>(TimeDelta::FromMinutes(-7)));
+  EXPECT_TRUE(RoundTrips<ConnectionType>(ConnectionType::kCellular));
+  EXPECT_TRUE(RoundTrips<set<ConnectionType>>({}));
+  EXPECT_TRUE(RoundTrips<set<ConnectionType>>(
+      {ConnectionType::kEthernet, ConnectionType::kWifi}));
+  EXPECT_TRUE(RoundTrips<ConnectionTethering>(ConnectionTethering::kSuspected));
+  EXPECT_TRUE(RoundTrips<Stage>(Stage::kAttemptingRollback));
+  EXPECT_TRUE(RoundTrips<UpdateRequestStatus>(UpdateRequestStatus::kPeriodic));
+}
+
+TEST_F(UmPolicyTraceTest, InvalidValuesAreRejected) {
+  bool bool_value;
+  EXPECT_FALSE(PolicyTrace::DecodeValue<bool>("1", &bool_value));
+  int int_value;
+  EXPECT_FALSE(PolicyTrace::DecodeValue<int>("five", &int_value));
+  Stage stage;
+  EXPECT_FALSE(PolicyTrace::DecodeValue<Stage>("9", &stage));
+  EXPECT_FALSE(PolicyTrace::DecodeValue<Stage>("-1", &stage));
+}
+
+TEST_F(UmPolicyTraceTest, ValuesOutsideOfAnEvaluationAreIgnored) {
+  const int value = 1;
+  trace_.RecordValue("int_var", &value);
+  EXPECT_FALSE(trace_.EndEvaluation());
+  EXPECT_TRUE(trace_.evaluations().empty());
+}
+
+TEST_F(UmPolicyTraceTest, FileRoundTrip) {
+  ScopedTempFile trace_file("PolicyTrace-XXXXXX");
+  trace_.set_path(trace_file.path());
+  RecordEvaluation("Policy::Foo", "");
+  RecordEvaluation("Policy::Bar", "timeout");
+  // The evaluations are written to the file instead of kept in memory.
+  EXPECT_TRUE(trace_.evaluations().empty());
+
+  vector<PolicyTrace::Evaluation> evaluations;
+  ASSERT_TRUE(PolicyTrace::Load(trace_file.path(), &evaluations));
+  ASSERT_EQ(2U, evaluations.size());
+  EXPECT_EQ("Policy::Foo", evaluations[0].policy_name);
+  EXPECT_EQ("", evaluations[0].cause);
+  EXPECT_EQ(Time::FromTimeT(1141262625), evaluations[0].wallclock);
+  EXPECT_EQ(Time::FromTimeT(1240428300), evaluations[0].monotonic);
+  EXPECT_EQ("Policy::Bar", evaluations[1].policy_name);
+  EXPECT_EQ("timeout", evaluations[1].cause);
+
+  const vector<PolicyTrace::Value>& values = evaluations[1].values;
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ("str_var", values[0].name);
+  EXPECT_EQ("a\tb\\n\nc", values[0].value);
+  EXPECT_EQ("int_var", values[1].name);
+  EXPECT_EQ("5", values[1].value);
+  EXPECT_EQ("null_var", values[2].name);
+  EXPECT_FALSE(values[2].has_value);
+}
+
+TEST_F(UmPolicyTraceTest, LoadRejectsInvalidRecords) {
+  ScopedTempFile trace_file("PolicyTrace-XXXXXX");
+  vector<PolicyTrace::Evaluation> evaluations;
+  // A value must follow an evaluation.
+  ASSERT_TRUE(WriteFileString(trace_file.path(), "novalue\tx\n"));
+  EXPECT_FALSE(PolicyTrace::Load(trace_file.path(), &evaluations));
+  ASSERT_TRUE(WriteFileString(trace_file.path(),
+                              "evaluation\t1\t2\tPolicy::Foo\n"));
+  EXPECT_FALSE(PolicyTrace::Load(trace_file.path(), &evaluations));
+  ASSERT_TRUE(WriteFileString(
+      trace_file.path(), "evaluation\t1\t2\tPolicy::Foo\t\\x\n"));
+  EXPECT_FALSE(PolicyTrace::Load(trace_file.path(), &evaluations));
+}
+
+}  // namespace chromeos_update_manager
@@ -25,7 +25,6 @@
 #include <shill/dbus-proxies.h>
 
 using org::chromium::flimflam::ManagerProxyInterface;
-using org::chromium::flimflam::ServiceProxyInterface;
 using std::string;
 
 namespace chromeos_update_manager {
@@ -69,22 +68,31 @@ bool RealShillProvider::Init() {
       base::Bind(&RealShillProvider::OnSignalConnected,
                  base::Unretained(this)));
 
-  // Attempt to read initial connection status. Even if this fails because shill
-  // is not responding (e.g. it is down) we'll be notified via "PropertyChanged"
-  // signal as soon as it comes up, so this is not a critical step.
-  brillo::VariantDictionary properties;
-  brillo::ErrorPtr error;
-  if (!manager_proxy->GetProperties(&properties, &error))
-    return true;
+  // Attempt to read initial connection status, without blocking the daemon
+  // startup on shill. Even if this fails because shill is not responding (e.g.
+  // it is down) we'll be notified via "PropertyChanged" signal as soon as it
+  // comes up, so this is not a critical step.
+  manager_proxy->GetPropertiesAsync(
+      base::Bind(&RealShillProvider::OnManagerProperties,
+                 weak_ptr_factory_.GetWeakPtr()),
+      base::Bind(&RealShillProvider::OnManagerPropertiesError,
+                 weak_ptr_factory_.GetWeakPtr()));
+  return true;
+}
 
+void RealShillProvider::OnManagerProperties(
+    const brillo::VariantDictionary& properties) {
   const auto& prop_default_service =
       properties.find(shill::kDefaultServiceProperty);
   if (prop_default_service != properties.end()) {
     OnManagerPropertyChanged(prop_default_service->first,
                              prop_default_service->second);
   }
+}
 
-  return true;
+void RealShillProvider::OnManagerPropertiesError(brillo::Error* error) {
+  LOG(WARNING) << "Unable to read the initial connection status from shill: "
+               << (error ? error->GetMessage() : "unknown error");
 }
 
 void RealShillProvider::OnManagerPropertyChanged(const string& name,
@@ -111,12 +119,12 @@ void RealShillProvider::OnSignalConnected(const string& interface_name,
   }
 }
 
-bool RealShillProvider::ProcessDefaultService(
+void RealShillProvider::ProcessDefaultService(
     const dbus::ObjectPath& default_service_path) {
   // We assume that if the service path didn't change, then the connection
   // type and the tethering status of it also didn't change.
   if (default_service_path_ == default_service_path)
-    return true;
+    return;
 
   // Update the connection status.
   default_service_path_ = default_service_path;
@@ -125,24 +133,40 @@ bool RealShillProvider::ProcessDefaultService(
   var_is_connected_.SetValue(is_connected);
   var_conn_last_changed_.SetValue(clock_->GetWallclockTime());
 
-  if (!is_connected) {
-    var_conn_type_.UnsetValue();
-    var_conn_tethering_.UnsetValue();
-    return true;
-  }
+  // The type and tethering status of the new connection aren't known until
+  // its properties are received.
+  var_conn_type_.UnsetValue();
+  var_conn_tethering_.UnsetValue();
+  default_service_proxy_.reset();
+  if (!is_connected)
+    return;
 
   // We create and dispose the ServiceProxyInterface on every request.
-  std::unique_ptr<ServiceProxyInterface> service =
+  default_service_proxy_ =
       shill_proxy_->GetServiceForPath(default_service_path_);
+  default_service_proxy_->GetPropertiesAsync(
+      base::Bind(&RealShillProvider::OnServiceProperties,
+                 weak_ptr_factory_.GetWeakPtr(),
+                 default_service_path_),
+      base::Bind(&RealShillProvider::OnServicePropertiesError,
+                 weak_ptr_factory_.GetWeakPtr(),
+                 default_service_path_));
+}
 
-  // Get the connection properties synchronously.
-  brillo::VariantDictionary properties;
-  brillo::ErrorPtr error;
-  if (!service->GetProperties(&properties, &error)) {
-    var_conn_type_.UnsetValue();
-    var_conn_tethering_.UnsetValue();
-    return false;
-  }
+void RealShillProvider::OnServicePropertiesError(
+    const dbus::ObjectPath& service_path, brillo::Error* error) {
+  if (service_path != default_service_path_)
+    return;
+  LOG(ERROR) << "Unable to read the properties of the service "
+             << service_path.value() << ": "
+             << (error ? error->GetMessage() : "unknown error");
+}
+
+void RealShillProvider::OnServiceProperties(
+    const dbus::ObjectPath& service_path,
+    const brillo::VariantDictionary& properties) {
+  if (service_path != default_service_path_)
+    return;
 
   // Get the connection tethering mode.
   const auto& prop_tethering = properties.find(shill::kTetheringProperty);
@@ -184,8 +208,6 @@ bool RealShillProvider::ProcessDefaultService(
       var_conn_type_.SetValue(ParseConnectionType(type_str));
     }
   }
-
-  return true;
 }
 
 }  // namespace chromeos_update_manager
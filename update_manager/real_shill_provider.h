@@ -21,9 +21,13 @@
 // update engine's connection_manager.  We need to make sure to deprecate use of
 // connection manager when the time comes.
 
+#include <memory>
 #include <string>
 
+#include <base/memory/weak_ptr.h>
 #include <base/time/time.h>
+#include <brillo/errors/error.h>
+#include <brillo/variant_dictionary.h>
 #include <dbus/object_path.h>
 
 #include "update_engine/common/clock_interface.h"
@@ -42,7 +46,9 @@ class RealShillProvider : public ShillProvider {
 
   ~RealShillProvider() override = default;
 
-  // Initializes the provider and returns whether it succeeded.
+  // Initializes the provider and returns whether it succeeded. The connection
+  // status is requested from shill without waiting for its reply, so the
+  // variables aren't set until it's received.
   bool Init();
 
   Variable<bool>* var_is_connected() override {
@@ -67,6 +73,11 @@ class RealShillProvider : public ShillProvider {
       const std::string& tethering_str);
 
  private:
+  // Called with the properties of the Manager requested by Init(), or the
+  // error if they couldn't be read.
+  void OnManagerProperties(const brillo::VariantDictionary& properties);
+  void OnManagerPropertiesError(brillo::Error* error);
+
   // A handler for ManagerProxy.PropertyChanged signal.
   void OnManagerPropertyChanged(const std::string& name,
                                 const brillo::Any& value);
@@ -76,9 +87,18 @@ class RealShillProvider : public ShillProvider {
                          const std::string& signal_name,
                          bool successful);
 
-  // Get the connection and populate the type and tethering status of the given
-  // default connection.
-  bool ProcessDefaultService(const dbus::ObjectPath& default_service_path);
+  // Updates the connection status for the given default connection, and
+  // requests its properties to populate the type and tethering status, which
+  // are unset until they're received.
+  void ProcessDefaultService(const dbus::ObjectPath& default_service_path);
+
+  // Called with the properties of the default service at |service_path|, or
+  // the error if they couldn't be read. The replies for a service that is no
+  // longer the default one are ignored.
+  void OnServiceProperties(const dbus::ObjectPath& service_path,
+                           const brillo::VariantDictionary& properties);
+  void OnServicePropertiesError(const dbus::ObjectPath& service_path,
+                                brillo::Error* error);
 
   // The current default service path, if connected. "/" means not connected.
   dbus::ObjectPath default_service_path_{"uninitialized"};
@@ -90,12 +110,19 @@ class RealShillProvider : public ShillProvider {
   // A clock abstraction (mockable).
   chromeos_update_engine::ClockInterface* const clock_;
 
+  // The proxy of the current default service, whose properties were requested
+  // by ProcessDefaultService().
+  std::unique_ptr<org::chromium::flimflam::ServiceProxyInterface>
+      default_service_proxy_;
+
   // The provider's variables.
   AsyncCopyVariable<bool> var_is_connected_{"is_connected"};
   AsyncCopyVariable<ConnectionType> var_conn_type_{"conn_type"};
   AsyncCopyVariable<ConnectionTethering> var_conn_tethering_{"conn_tethering"};
   AsyncCopyVariable<base::Time> var_conn_last_changed_{"conn_last_changed"};
 
+  base::WeakPtrFactory<RealShillProvider> weak_ptr_factory_{this};
+
   DISALLOW_COPY_AND_ASSIGN(RealShillProvider);
 };
 
@@ -40,8 +40,7 @@ using org::chromium::flimflam::ManagerProxyMock;
 using org::chromium::flimflam::ServiceProxyMock;
 using std::unique_ptr;
 using testing::Mock;
-using testing::Return;
-using testing::SetArgPointee;
+using testing::SaveArg;
 using testing::_;
 
 namespace {
@@ -55,6 +54,19 @@ const char* const kFakeCellularServicePath = "/fake/cellular/service";
 const char* const kFakeVpnServicePath = "/fake/vpn/service";
 const char* const kFakeUnknownServicePath = "/fake/unknown/service";
 
+// Replies to a GetPropertiesAsync() call with the |properties|.
+ACTION_P(ReplyWithProperties, properties) {
+  arg0.Run(properties);
+}
+
+// Replies to a GetPropertiesAsync() call with an error.
+ACTION(ReplyWithError) {
+  brillo::ErrorPtr error;
+  brillo::Error::AddTo(
+      &error, FROM_HERE, "dbus", "org.freedesktop.DBus.Error.Failed", "Down");
+  arg1.Run(error.get());
+}
+
 }  // namespace
 
 namespace chromeos_update_manager {
@@ -215,8 +227,8 @@ void UmRealShillProviderTest::SetManagerReply(const char* default_service,
                                               bool reply_succeeds) {
   ManagerProxyMock* manager_proxy_mock = fake_shill_proxy_.GetManagerProxy();
   if (!reply_succeeds) {
-    EXPECT_CALL(*manager_proxy_mock, GetProperties(_, _, _))
-        .WillOnce(Return(false));
+    EXPECT_CALL(*manager_proxy_mock, GetPropertiesAsync(_, _, _))
+        .WillOnce(ReplyWithError());
     return;
   }
 
@@ -229,8 +241,8 @@ void UmRealShillProviderTest::SetManagerReply(const char* default_service,
     reply_dict[shill::kDefaultServiceProperty] =
         dbus::ObjectPath(default_service);
   }
-  EXPECT_CALL(*manager_proxy_mock, GetProperties(_, _, _))
-      .WillOnce(DoAll(SetArgPointee<0>(reply_dict), Return(true)));
+  EXPECT_CALL(*manager_proxy_mock, GetPropertiesAsync(_, _, _))
+      .WillOnce(ReplyWithProperties(reply_dict));
 }
 
 ServiceProxyMock* UmRealShillProviderTest::SetServiceReply(
@@ -255,8 +267,8 @@ ServiceProxyMock* UmRealShillProviderTest::SetServiceReply(
   ServiceProxyMock* service_proxy_mock = new ServiceProxyMock();
 
   // Plumb return value into mock object.
-  EXPECT_CALL(*service_proxy_mock, GetProperties(_, _, _))
-      .WillOnce(DoAll(SetArgPointee<0>(reply_dict), Return(true)));
+  EXPECT_CALL(*service_proxy_mock, GetPropertiesAsync(_, _, _))
+      .WillOnce(ReplyWithProperties(reply_dict));
 
   fake_shill_proxy_.SetServiceForPath(
       dbus::ObjectPath(service_path),
@@ -290,8 +302,8 @@ TEST_F(UmRealShillProviderTest, InvalidServicePathType) {
   ManagerProxyMock* manager_proxy_mock = fake_shill_proxy_.GetManagerProxy();
   brillo::VariantDictionary reply_dict;
   reply_dict[shill::kDefaultServiceProperty] = "/not/an/object/path";
-  EXPECT_CALL(*manager_proxy_mock, GetProperties(_, _, _))
-      .WillOnce(DoAll(SetArgPointee<0>(reply_dict), Return(true)));
+  EXPECT_CALL(*manager_proxy_mock, GetPropertiesAsync(_, _, _))
+      .WillOnce(ReplyWithProperties(reply_dict));
 
   EXPECT_TRUE(provider_->Init());
   EXPECT_TRUE(loop_.RunOnce(false));
@@ -512,6 +524,38 @@ TEST_F(UmRealShillProviderTest, NoInitConnStatusReadBaseValues) {
   UmTestUtils::ExpectVariableNotSet(provider_->var_conn_last_changed());
 }
 
+// Make sure that the variables aren't set until shill replies, and that the
+// type of the connection isn't known until the default service replies.
+TEST_F(UmRealShillProviderTest, VariablesNotSetUntilReplies) {
+  ManagerProxyMock* manager_proxy_mock = fake_shill_proxy_.GetManagerProxy();
+  base::Callback<void(const brillo::VariantDictionary&)> manager_reply;
+  EXPECT_CALL(*manager_proxy_mock, GetPropertiesAsync(_, _, _))
+      .WillOnce(SaveArg<0>(&manager_reply));
+  EXPECT_TRUE(provider_->Init());
+  EXPECT_TRUE(loop_.RunOnce(false));
+  UmTestUtils::ExpectVariableNotSet(provider_->var_is_connected());
+
+  ServiceProxyMock* service_proxy_mock = new ServiceProxyMock();
+  base::Callback<void(const brillo::VariantDictionary&)> service_reply;
+  EXPECT_CALL(*service_proxy_mock, GetPropertiesAsync(_, _, _))
+      .WillOnce(SaveArg<0>(&service_reply));
+  fake_shill_proxy_.SetServiceForPath(
+      dbus::ObjectPath(kFakeWifiServicePath),
+      brillo::make_unique_ptr(service_proxy_mock));
+  brillo::VariantDictionary manager_dict;
+  manager_dict[shill::kDefaultServiceProperty] =
+      dbus::ObjectPath(kFakeWifiServicePath);
+  manager_reply.Run(manager_dict);
+  UmTestUtils::ExpectVariableHasValue(true, provider_->var_is_connected());
+  UmTestUtils::ExpectVariableNotSet(provider_->var_conn_type());
+
+  brillo::VariantDictionary service_dict;
+  service_dict[shill::kTypeProperty] = std::string(shill::kTypeWifi);
+  service_reply.Run(service_dict);
+  UmTestUtils::ExpectVariableHasValue(ConnectionType::kWifi,
+                                      provider_->var_conn_type());
+}
+
 // Test that, once a signal is received, the connection status and other info
 // can be read correctly.
 TEST_F(UmRealShillProviderTest, NoInitConnStatusReadConnTypeEthernet) {
@@ -18,59 +18,143 @@
 
 #include <string>
 
+#include <base/bind.h>
 #include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/clock_interface.h"
 
 using base::Time;
 using base::TimeDelta;
+using brillo::MessageLoop;
 using chromeos_update_engine::ClockInterface;
 using std::string;
 
 namespace chromeos_update_manager {
 
+// A base class for the time variables. Their value only changes at known
+// wallclock boundaries, so instead of being polled they are async variables
+// that notify their observers with a single task scheduled at the next
+// boundary. The task is only scheduled while there are observers.
+template<typename T>
+class TimeBoundaryVariable : public Variable<T> {
+ public:
+  TimeBoundaryVariable(const string& name, ClockInterface* clock)
+      : Variable<T>(name, kVariableModeAsync), clock_(clock) {}
+
+  ~TimeBoundaryVariable() override {
+    CancelTimeout();
+  }
+
+  void AddObserver(BaseVariable::ObserverInterface* observer) override {
+    Variable<T>::AddObserver(observer);
+    if (timeout_id_ == MessageLoop::kTaskIdNull)
+      ScheduleTimeout();
+  }
+
+  void RemoveObserver(BaseVariable::ObserverInterface* observer) override {
+    Variable<T>::RemoveObserver(observer);
+    if (!this->HasObservers())
+      CancelTimeout();
+  }
+
+ protected:
+  // Returns the first point in time after |now| at which the value changes.
+  virtual Time NextBoundary(Time now) = 0;
+
+  ClockInterface* clock() const { return clock_; }
+
+ private:
+  void ScheduleTimeout() {
+    Time now = clock_->GetWallclockTime();
+    timeout_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&TimeBoundaryVariable<T>::OnTimeout,
+                   base::Unretained(this)),
+        NextBoundary(now) - now);
+  }
+
+  void CancelTimeout() {
+    if (timeout_id_ == MessageLoop::kTaskIdNull)
+      return;
+    MessageLoop::current()->CancelTask(timeout_id_);
+    timeout_id_ = MessageLoop::kTaskIdNull;
+  }
+
+  void OnTimeout() {
+    timeout_id_ = MessageLoop::kTaskIdNull;
+    this->NotifyValueChanged();
+    // A wallclock adjustment could fire this timeout before the boundary; the
+    // observers re-read the value, so rescheduling is enough to catch up.
+    if (this->HasObservers())
+      ScheduleTimeout();
+  }
+
+  ClockInterface* const clock_;
+
+  // The task scheduled at the next boundary, if any.
+  MessageLoop::TaskId timeout_id_ = MessageLoop::kTaskIdNull;
+
+  DISALLOW_COPY_AND_ASSIGN(TimeBoundaryVariable);
+};
+
+// Returns the local midnight starting the day of |time|.
+Time LocalDayStart(Time time) {
+  Time::Exploded exp;
+  time.LocalExplode(&exp);
+  exp.hour = exp.minute = exp.second = exp.millisecond = 0;
+  return Time::FromLocalExploded(exp);
+}
+
+// Returns the start of the local hour containing |time|.
+Time LocalHourStart(Time time) {
+  Time::Exploded exp;
+  time.LocalExplode(&exp);
+  exp.minute = exp.second = exp.millisecond = 0;
+  return Time::FromLocalExploded(exp);
+}
+
 // A variable returning the current date.
-class CurrDateVariable : public Variable<Time> {
+class CurrDateVariable : public TimeBoundaryVariable<Time> {
  public:
-  // TODO(garnold) Turn this into an async variable with the needed callback
-  // logic for when it value changes.
   CurrDateVariable(const string& name, ClockInterface* clock)
-      : Variable<Time>(name, TimeDelta::FromHours(1)), clock_(clock) {}
+      : TimeBoundaryVariable<Time>(name, clock) {}
 
  protected:
-  virtual const Time* GetValue(TimeDelta /* timeout */,
-                               string* /* errmsg */) {
-    Time::Exploded now_exp;
-    clock_->GetWallclockTime().LocalExplode(&now_exp);
-    now_exp.hour = now_exp.minute = now_exp.second = now_exp.millisecond = 0;
-    return new Time(Time::FromLocalExploded(now_exp));
+  const Time* GetValue(TimeDelta /* timeout */,
+                       string* /* errmsg */) override {
+    return new Time(LocalDayStart(clock()->GetWallclockTime()));
   }
 
- private:
-  ClockInterface* clock_;
+  Time NextBoundary(Time now) override {
+    // Days with a DST transition are not 24 hours long, so normalize a point
+    // well within the next day instead of adding a day.
+    return LocalDayStart(LocalDayStart(now) + TimeDelta::FromHours(36));
+  }
 
+ private:
   DISALLOW_COPY_AND_ASSIGN(CurrDateVariable);
 };
 
 // A variable returning the current hour in local time.
-class CurrHourVariable : public Variable<int> {
+class CurrHourVariable : public TimeBoundaryVariable<int> {
  public:
-  // TODO(garnold) Turn this into an async variable with the needed callback
-  // logic for when it value changes.
   CurrHourVariable(const string& name, ClockInterface* clock)
-      : Variable<int>(name, TimeDelta::FromMinutes(5)), clock_(clock) {}
+      : TimeBoundaryVariable<int>(name, clock) {}
 
  protected:
-  virtual const int* GetValue(TimeDelta /* timeout */,
-                              string* /* errmsg */) {
+  const int* GetValue(TimeDelta /* timeout */,
+                      string* /* errmsg */) override {
     Time::Exploded exploded;
-    clock_->GetWallclockTime().LocalExplode(&exploded);
+    clock()->GetWallclockTime().LocalExplode(&exploded);
     return new int(exploded.hour);
   }
 
- private:
-  ClockInterface* clock_;
+  Time NextBoundary(Time now) override {
+    return LocalHourStart(now) + TimeDelta::FromHours(1);
+  }
 
+ private:
   DISALLOW_COPY_AND_ASSIGN(CurrHourVariable);
 };
 
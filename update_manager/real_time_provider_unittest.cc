@@ -19,21 +19,43 @@
 #include <memory>
 
 #include <base/logging.h>
+#include <base/test/simple_test_clock.h>
 #include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/fake_clock.h"
 #include "update_engine/update_manager/umtest_utils.h"
 
 using base::Time;
+using base::TimeDelta;
+using brillo::MessageLoop;
+using brillo::MessageLoopRunMaxIterations;
 using chromeos_update_engine::FakeClock;
 using std::unique_ptr;
 
 namespace chromeos_update_manager {
 
+namespace {
+
+// A variable observer counting the number of notifications received.
+class CallCounterObserver : public BaseVariable::ObserverInterface {
+ public:
+  void ValueChanged(BaseVariable* variable) override {
+    calls_count_++;
+  }
+
+  int calls_count_ = 0;
+};
+
+}  // namespace
+
 class UmRealTimeProviderTest : public ::testing::Test {
  protected:
   void SetUp() override {
+    loop_.SetAsCurrent();
     // The provider initializes correctly.
     provider_.reset(new RealTimeProvider(&fake_clock_));
     ASSERT_NE(nullptr, provider_.get());
@@ -54,6 +76,8 @@ class UmRealTimeProviderTest : public ::testing::Test {
     return Time::FromLocalExploded(now_exp);
   }
 
+  base::SimpleTestClock test_clock_;
+  brillo::FakeMessageLoop loop_{&test_clock_};
   FakeClock fake_clock_;
   unique_ptr<RealTimeProvider> provider_;
 };
@@ -81,4 +105,35 @@ TEST_F(UmRealTimeProviderTest, CurrHourValid) {
                                       provider_->var_curr_hour());
 }
 
+TEST_F(UmRealTimeProviderTest, CurrHourNotifiesAtNextHour) {
+  // CurrTime() is 54:26.325 minutes before the next hour.
+  fake_clock_.SetWallclockTime(CurrTime());
+  EXPECT_EQ(kVariableModeAsync, provider_->var_curr_hour()->GetMode());
+
+  CallCounterObserver observer;
+  provider_->var_curr_hour()->AddObserver(&observer);
+  EXPECT_TRUE(loop_.PendingTasks());
+
+  test_clock_.Advance(TimeDelta::FromMinutes(54));
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(0, observer.calls_count_);
+
+  test_clock_.Advance(TimeDelta::FromSeconds(27));
+  fake_clock_.SetWallclockTime(CurrTime() +
+                               TimeDelta::FromSeconds(54 * 60 + 27));
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(1, observer.calls_count_);
+
+  // The next notification remains scheduled only while observed.
+  EXPECT_TRUE(loop_.PendingTasks());
+  provider_->var_curr_hour()->RemoveObserver(&observer);
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(UmRealTimeProviderTest, CurrDateNotObservedSchedulesNothing) {
+  fake_clock_.SetWallclockTime(CurrTime());
+  EXPECT_EQ(kVariableModeAsync, provider_->var_curr_date()->GetMode());
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
 }  // namespace chromeos_update_manager
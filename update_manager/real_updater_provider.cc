@@ -18,7 +18,9 @@
 
 #include <inttypes.h>
 
+#include <memory>
 #include <string>
+#include <utility>
 
 #include <base/bind.h>
 #include <base/strings/stringprintf.h>
@@ -48,14 +50,35 @@ class UpdaterVariableBase : public Variable<T> {
                       SystemState* system_state)
       : Variable<T>(name, mode), system_state_(system_state) {}
 
+  // Re-reads the value of the variable and notifies the observers if it
+  // changed since the last call. Used by the async variables, which are
+  // refreshed whenever the UpdateAttempter broadcasts a status change.
+  void Refresh() {
+    std::unique_ptr<const T> value(this->GetValue(TimeDelta(), nullptr));
+    bool changed = (value == nullptr) != (last_value_ == nullptr) ||
+                   (value && !(*value == *last_value_));
+    last_value_ = std::move(value);
+    if (changed)
+      this->NotifyValueChanged();
+  }
+
  protected:
   // The system state used for pulling information from the updater.
   inline SystemState* system_state() const { return system_state_; }
 
  private:
   SystemState* const system_state_;
+
+  // The value read on the last Refresh() call, or null if it wasn't set.
+  std::unique_ptr<const T> last_value_;
 };
 
+// Refreshes the UpdaterVariableBase |var|, see UpdaterVariableBase::Refresh().
+template<typename T>
+void RefreshUpdaterVariable(Variable<T>* var) {
+  static_cast<UpdaterVariableBase<T>*>(var)->Refresh();
+}
+
 // Helper class for issuing a GetStatus() to the UpdateAttempter.
 class GetStatusHelper {
  public:
@@ -87,7 +110,7 @@ class GetStatusHelper {
 class LastCheckedTimeVariable : public UpdaterVariableBase<Time> {
  public:
   LastCheckedTimeVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<Time>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<Time>(name, kVariableModeAsync, system_state) {}
 
  private:
   const Time* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -106,7 +129,7 @@ class LastCheckedTimeVariable : public UpdaterVariableBase<Time> {
 class ProgressVariable : public UpdaterVariableBase<double> {
  public:
   ProgressVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<double>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<double>(name, kVariableModeAsync, system_state) {}
 
  private:
   const double* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -132,7 +155,7 @@ class ProgressVariable : public UpdaterVariableBase<double> {
 class StageVariable : public UpdaterVariableBase<Stage> {
  public:
   StageVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<Stage>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<Stage>(name, kVariableModeAsync, system_state) {}
 
  private:
   struct CurrOpStrToStage {
@@ -181,7 +204,7 @@ const Stage* StageVariable::GetValue(TimeDelta /* timeout */,
 class NewVersionVariable : public UpdaterVariableBase<string> {
  public:
   NewVersionVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<string>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<string>(name, kVariableModeAsync, system_state) {}
 
  private:
   const string* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -199,7 +222,7 @@ class NewVersionVariable : public UpdaterVariableBase<string> {
 class PayloadSizeVariable : public UpdaterVariableBase<int64_t> {
  public:
   PayloadSizeVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<int64_t>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<int64_t>(name, kVariableModeAsync, system_state) {}
 
  private:
   const int64_t* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -229,7 +252,7 @@ class PayloadSizeVariable : public UpdaterVariableBase<int64_t> {
 class UpdateCompletedTimeVariable : public UpdaterVariableBase<Time> {
  public:
   UpdateCompletedTimeVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<Time>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<Time>(name, kVariableModeAsync, system_state) {}
 
  private:
   const Time* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -259,7 +282,7 @@ class UpdateCompletedTimeVariable : public UpdaterVariableBase<Time> {
 class CurrChannelVariable : public UpdaterVariableBase<string> {
  public:
   CurrChannelVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<string>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<string>(name, kVariableModeAsync, system_state) {}
 
  private:
   const string* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -280,7 +303,7 @@ class CurrChannelVariable : public UpdaterVariableBase<string> {
 class NewChannelVariable : public UpdaterVariableBase<string> {
  public:
   NewChannelVariable(const string& name, SystemState* system_state)
-      : UpdaterVariableBase<string>(name, kVariableModePoll, system_state) {}
+      : UpdaterVariableBase<string>(name, kVariableModeAsync, system_state) {}
 
  private:
   const string* GetValue(TimeDelta /* timeout */, string* errmsg) override {
@@ -347,7 +370,7 @@ class ConsecutiveFailedUpdateChecksVariable
  public:
   ConsecutiveFailedUpdateChecksVariable(const string& name,
                                         SystemState* system_state)
-      : UpdaterVariableBase<unsigned int>(name, kVariableModePoll,
+      : UpdaterVariableBase<unsigned int>(name, kVariableModeAsync,
                                           system_state) {}
 
  private:
@@ -366,7 +389,7 @@ class ServerDictatedPollIntervalVariable
  public:
   ServerDictatedPollIntervalVariable(const string& name,
                                      SystemState* system_state)
-      : UpdaterVariableBase<unsigned int>(name, kVariableModePoll,
+      : UpdaterVariableBase<unsigned int>(name, kVariableModeAsync,
                                           system_state) {}
 
  private:
@@ -450,4 +473,51 @@ RealUpdaterProvider::RealUpdaterProvider(SystemState* system_state)
         new ForcedUpdateRequestedVariable(
             "forced_update_requested", system_state_)) {}
 
+RealUpdaterProvider::~RealUpdaterProvider() {
+  if (observing_update_attempter_)
+    system_state_->update_attempter()->RemoveObserver(this);
+}
+
+bool RealUpdaterProvider::Init() {
+  system_state_->update_attempter()->AddObserver(this);
+  observing_update_attempter_ = true;
+  RefreshStatusVariables();
+  return true;
+}
+
+void RealUpdaterProvider::SendStatusUpdate(
+    int64_t /* last_checked_time */,
+    double /* progress */,
+    update_engine::UpdateStatus /* status */,
+    const string& /* new_version */,
+    int64_t /* new_size */) {
+  // The variables read the values back from the UpdateAttempter, so they
+  // remain consistent with GetStatus() regardless of what changed.
+  RefreshStatusVariables();
+}
+
+void RealUpdaterProvider::SendPayloadApplicationComplete(
+    chromeos_update_engine::ErrorCode /* error_code */) {
+  RefreshStatusVariables();
+}
+
+void RealUpdaterProvider::SendChannelChangeUpdate(
+    const string& /* tracking_channel */) {
+  RefreshUpdaterVariable(var_curr_channel_.get());
+  RefreshUpdaterVariable(var_new_channel_.get());
+}
+
+void RealUpdaterProvider::RefreshStatusVariables() {
+  RefreshUpdaterVariable(var_last_checked_time_.get());
+  RefreshUpdaterVariable(var_update_completed_time_.get());
+  RefreshUpdaterVariable(var_progress_.get());
+  RefreshUpdaterVariable(var_stage_.get());
+  RefreshUpdaterVariable(var_new_version_.get());
+  RefreshUpdaterVariable(var_payload_size_.get());
+  RefreshUpdaterVariable(var_curr_channel_.get());
+  RefreshUpdaterVariable(var_new_channel_.get());
+  RefreshUpdaterVariable(var_consecutive_failed_update_checks_.get());
+  RefreshUpdaterVariable(var_server_dictated_poll_interval_.get());
+}
+
 }  // namespace chromeos_update_manager
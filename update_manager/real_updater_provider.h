@@ -20,6 +20,7 @@
 #include <memory>
 #include <string>
 
+#include "update_engine/service_observer_interface.h"
 #include "update_engine/system_state.h"
 #include "update_engine/update_manager/generic_variables.h"
 #include "update_engine/update_manager/updater_provider.h"
@@ -27,7 +28,12 @@
 namespace chromeos_update_manager {
 
 // A concrete UpdaterProvider implementation using local (in-process) bindings.
-class RealUpdaterProvider : public UpdaterProvider {
+// The variables derived from the updater status are async: the provider
+// observes the UpdateAttempter and notifies them when a status change is
+// broadcast, so policies don't need to poll them.
+class RealUpdaterProvider
+    : public UpdaterProvider,
+      public chromeos_update_engine::ServiceObserverInterface {
  public:
   // We assume that any other object handle we get from the system state is
   // "volatile", and so must be re-acquired whenever access is needed; this
@@ -37,8 +43,10 @@ class RealUpdaterProvider : public UpdaterProvider {
   explicit RealUpdaterProvider(
       chromeos_update_engine::SystemState* system_state);
 
+  ~RealUpdaterProvider() override;
+
   // Initializes the provider and returns whether it succeeded.
-  bool Init() { return true; }
+  bool Init();
 
   Variable<base::Time>* var_updater_started_time() override {
     return &var_updater_started_time_;
@@ -96,7 +104,21 @@ class RealUpdaterProvider : public UpdaterProvider {
     return var_forced_update_requested_.get();
   }
 
+  // ServiceObserverInterface overrides.
+  void SendStatusUpdate(int64_t last_checked_time,
+                        double progress,
+                        update_engine::UpdateStatus status,
+                        const std::string& new_version,
+                        int64_t new_size) override;
+  void SendPayloadApplicationComplete(
+      chromeos_update_engine::ErrorCode error_code) override;
+  void SendChannelChangeUpdate(const std::string& tracking_channel) override;
+
  private:
+  // Re-reads all the variables derived from the updater status, notifying
+  // the observers of those that changed.
+  void RefreshStatusVariables();
+
   // A pointer to the update engine's system state aggregator.
   chromeos_update_engine::SystemState* system_state_;
 
@@ -116,6 +138,9 @@ class RealUpdaterProvider : public UpdaterProvider {
   std::unique_ptr<Variable<unsigned int>> var_server_dictated_poll_interval_;
   std::unique_ptr<Variable<UpdateRequestStatus>> var_forced_update_requested_;
 
+  // Whether Init() registered this provider as an UpdateAttempter observer.
+  bool observing_update_attempter_ = false;
+
   DISALLOW_COPY_AND_ASSIGN(RealUpdaterProvider);
 };
 
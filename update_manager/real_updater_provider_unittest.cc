@@ -20,6 +20,8 @@
 #include <string>
 
 #include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
 #include <gtest/gtest.h>
 #include <update_engine/dbus-constants.h>
 
@@ -32,6 +34,8 @@
 
 using base::Time;
 using base::TimeDelta;
+using brillo::MessageLoop;
+using brillo::MessageLoopRunMaxIterations;
 using chromeos_update_engine::FakeClock;
 using chromeos_update_engine::FakePrefs;
 using chromeos_update_engine::FakeSystemState;
@@ -67,6 +71,17 @@ Time RoundedToSecond(Time time) {
   return Time::FromLocalExploded(exp);
 }
 
+// A variable observer counting the number of notifications received.
+class CallCounterObserver
+    : public chromeos_update_manager::BaseVariable::ObserverInterface {
+ public:
+  void ValueChanged(chromeos_update_manager::BaseVariable* variable) override {
+    calls_count_++;
+  }
+
+  int calls_count_ = 0;
+};
+
 }  // namespace
 
 namespace chromeos_update_manager {
@@ -440,4 +455,52 @@ TEST_F(UmRealUpdaterProviderTest, GetServerDictatedPollInterval) {
       kPollInterval, provider_->var_server_dictated_poll_interval());
 }
 
+TEST_F(UmRealUpdaterProviderTest, StatusUpdateNotifiesChangedVariables) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  EXPECT_EQ(kVariableModeAsync, provider_->var_new_version()->GetMode());
+  EXPECT_EQ(kVariableModeAsync, provider_->var_stage()->GetMode());
+
+  CallCounterObserver version_observer;
+  CallCounterObserver stage_observer;
+  provider_->var_new_version()->AddObserver(&version_observer);
+  provider_->var_stage()->AddObserver(&stage_observer);
+
+  EXPECT_CALL(*fake_sys_state_.mock_update_attempter(),
+              GetStatus(_, _, _, _, _))
+      .WillRepeatedly(DoAll(
+          SetArgPointee<0>(FixedTime().ToTimeT()),
+          SetArgPointee<1>(0.0),
+          SetArgPointee<2>(update_engine::kUpdateStatusIdle),
+          SetArgPointee<3>(string("1.2.0")),
+          SetArgPointee<4>(0),
+          Return(true)));
+  provider_->SendStatusUpdate(FixedTime().ToTimeT(), 0.0,
+                              update_engine::UpdateStatus::IDLE, "1.2.0", 0);
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(1, version_observer.calls_count_);
+  EXPECT_EQ(1, stage_observer.calls_count_);
+
+  // Only the variables whose value changed are notified.
+  EXPECT_CALL(*fake_sys_state_.mock_update_attempter(),
+              GetStatus(_, _, _, _, _))
+      .WillRepeatedly(DoAll(
+          SetArgPointee<0>(FixedTime().ToTimeT()),
+          SetArgPointee<1>(0.0),
+          SetArgPointee<2>(update_engine::kUpdateStatusCheckingForUpdate),
+          SetArgPointee<3>(string("1.2.0")),
+          SetArgPointee<4>(0),
+          Return(true)));
+  provider_->SendStatusUpdate(
+      FixedTime().ToTimeT(), 0.0,
+      update_engine::UpdateStatus::CHECKING_FOR_UPDATE, "1.2.0", 0);
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(1, version_observer.calls_count_);
+  EXPECT_EQ(2, stage_observer.calls_count_);
+
+  provider_->var_new_version()->RemoveObserver(&version_observer);
+  provider_->var_stage()->RemoveObserver(&stage_observer);
+  EXPECT_FALSE(loop.PendingTasks());
+}
+
 }  // namespace chromeos_update_manager
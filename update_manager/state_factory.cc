@@ -54,6 +54,9 @@ State* DefaultStateFactory(
   unique_ptr<RealUpdaterProvider> updater_provider(
       new RealUpdaterProvider(system_state));
 
+  // None of the providers waits for its D-Bus peers here. The variables
+  // depending on them are unset until their replies are received, so a slow
+  // peer only delays the policies reading them, not the daemon startup.
   if (!(config_provider->Init() &&
         device_policy_provider->Init() &&
         random_provider->Init() &&
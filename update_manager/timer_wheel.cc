@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/timer_wheel.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/location.h>
+
+using base::Closure;
+using base::Time;
+using base::TimeDelta;
+using brillo::MessageLoop;
+using chromeos_update_engine::ClockInterface;
+
+namespace chromeos_update_manager {
+
+const TimerWheel::TimerId TimerWheel::kTimerIdNull = MessageLoop::kTaskIdNull;
+
+TimerWheel::TimerWheel(ClockInterface* clock, TimeDelta slack)
+    : clock_(clock), slack_(slack) {}
+
+TimerWheel::~TimerWheel() {
+  if (wakeup_task_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(wakeup_task_);
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(TimeDelta timeout,
+                                         const Closure& callback) {
+  TimerId timer_id = next_timer_id_++;
+  Time fire_time = FireTime(timeout);
+  timers_[timer_id] = Timer{fire_time, callback};
+  queue_.emplace(fire_time, timer_id);
+  ScheduleWakeup();
+  return timer_id;
+}
+
+bool TimerWheel::Cancel(TimerId timer_id) {
+  auto it = timers_.find(timer_id);
+  if (it == timers_.end())
+    return false;
+  queue_.erase(std::make_pair(it->second.fire_time, timer_id));
+  timers_.erase(it);
+  ScheduleWakeup();
+  return true;
+}
+
+Time TimerWheel::FireTime(TimeDelta timeout) const {
+  Time fire_time = clock_->GetMonotonicTime() + timeout;
+  if (slack_ <= TimeDelta())
+    return fire_time;
+  // Round up to the end of the slot.
+  TimeDelta since_epoch = fire_time - Time();
+  int64_t slots =
+      (since_epoch + slack_ - TimeDelta::FromMicroseconds(1)) / slack_;
+  return Time() + slack_ * slots;
+}
+
+void TimerWheel::ScheduleWakeup() {
+  if (wakeup_task_ != MessageLoop::kTaskIdNull) {
+    if (!queue_.empty() && wakeup_time_ == queue_.begin()->first)
+      return;
+    MessageLoop::current()->CancelTask(wakeup_task_);
+    wakeup_task_ = MessageLoop::kTaskIdNull;
+  }
+  if (queue_.empty())
+    return;
+
+  Time earliest = queue_.begin()->first;
+  wakeup_time_ = earliest;
+  wakeup_task_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&TimerWheel::OnWakeup, base::Unretained(this)),
+      std::max(earliest - clock_->GetMonotonicTime(), TimeDelta()));
+}
+
+void TimerWheel::OnWakeup() {
+  wakeup_task_ = MessageLoop::kTaskIdNull;
+
+  // Take the due timers out first, since their callbacks may schedule or
+  // cancel other timers.
+  std::vector<Closure> callbacks;
+  while (!queue_.empty() && queue_.begin()->first <= wakeup_time_) {
+    auto it = timers_.find(queue_.begin()->second);
+    callbacks.push_back(it->second.callback);
+    timers_.erase(it);
+    queue_.erase(queue_.begin());
+  }
+  for (const Closure& callback : callbacks)
+    callback.Run();
+
+  ScheduleWakeup();
+}
+
+}  // namespace chromeos_update_manager
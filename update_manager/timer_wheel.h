@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_UPDATE_MANAGER_TIMER_WHEEL_H_
+#define UPDATE_ENGINE_UPDATE_MANAGER_TIMER_WHEEL_H_
+
+#include <map>
+#include <set>
+#include <utility>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
+#include "update_engine/common/clock_interface.h"
+
+namespace chromeos_update_manager {
+
+// The TimerWheel schedules the timeouts of several EvaluationContexts with a
+// single task on the main loop. The monotonic time is divided in slots of
+// |slack| length and every timeout is delayed to the end of the slot where it
+// falls, so one wakeup serves all the timeouts due within the same slot. A
+// zero |slack| doesn't delay the timeouts, but those due at the same time
+// still share a wakeup.
+class TimerWheel {
+ public:
+  using TimerId = brillo::MessageLoop::TaskId;
+  static const TimerId kTimerIdNull;
+
+  TimerWheel(chromeos_update_engine::ClockInterface* clock,
+             base::TimeDelta slack);
+  ~TimerWheel();
+
+  // Schedules |callback| to run after |timeout|, plus up to |slack|. Returns
+  // the id of the timer, to be used with Cancel().
+  TimerId Schedule(base::TimeDelta timeout, const base::Closure& callback);
+
+  // Cancels the timer |timer_id|. Returns whether it was still pending.
+  bool Cancel(TimerId timer_id);
+
+  // Changes the slack applied to the timers scheduled from now on.
+  void set_slack(base::TimeDelta slack) { slack_ = slack; }
+
+ private:
+  struct Timer {
+    base::Time fire_time;
+    base::Closure callback;
+  };
+
+  // Returns the monotonic time at which a timeout of |timeout| from now
+  // fires: the end of its slot.
+  base::Time FireTime(base::TimeDelta timeout) const;
+
+  // Ensures the main loop task is scheduled for the earliest pending timer, or
+  // not scheduled at all if there are none.
+  void ScheduleWakeup();
+
+  // Called from the main loop, runs all the timers due by |wakeup_time_|.
+  void OnWakeup();
+
+  // Pointer to the mockable clock interface.
+  chromeos_update_engine::ClockInterface* const clock_;
+
+  base::TimeDelta slack_;
+
+  // The pending timers, by id and sorted by fire time.
+  std::map<TimerId, Timer> timers_;
+  std::set<std::pair<base::Time, TimerId>> queue_;
+
+  // The id assigned to the next scheduled timer.
+  TimerId next_timer_id_ = kTimerIdNull + 1;
+
+  // The main loop task and the fire time it was scheduled for.
+  brillo::MessageLoop::TaskId wakeup_task_ = brillo::MessageLoop::kTaskIdNull;
+  base::Time wakeup_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+}  // namespace chromeos_update_manager
+
+#endif  // UPDATE_ENGINE_UPDATE_MANAGER_TIMER_WHEEL_H_
@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/update_manager/timer_wheel.h"
+
+#include <base/bind.h>
+#include <base/test/simple_test_clock.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+
+using base::Bind;
+using base::Time;
+using base::TimeDelta;
+using brillo::MessageLoop;
+using brillo::MessageLoopRunMaxIterations;
+using chromeos_update_engine::FakeClock;
+
+namespace {
+
+void Increment(int* value) {
+  (*value)++;
+}
+
+}  // namespace
+
+namespace chromeos_update_manager {
+
+class UmTimerWheelTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    // A multiple of the slack used in the tests.
+    fake_clock_.SetMonotonicTime(Time() + TimeDelta::FromSeconds(1000));
+  }
+
+  void TearDown() override {
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  // Advances both the loop and the monotonic clocks by |delta| and runs the
+  // tasks due.
+  void Advance(TimeDelta delta) {
+    test_clock_.Advance(delta);
+    fake_clock_.SetMonotonicTime(fake_clock_.GetMonotonicTime() + delta);
+    MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  }
+
+  base::SimpleTestClock test_clock_;
+  brillo::FakeMessageLoop loop_{&test_clock_};
+  FakeClock fake_clock_;
+};
+
+TEST_F(UmTimerWheelTest, TimersWithoutSlackFireOnTime) {
+  TimerWheel wheel(&fake_clock_, TimeDelta());
+  int first = 0, second = 0;
+  wheel.Schedule(TimeDelta::FromSeconds(3), Bind(&Increment, &first));
+  wheel.Schedule(TimeDelta::FromSeconds(7), Bind(&Increment, &second));
+
+  Advance(TimeDelta::FromSeconds(3));
+  EXPECT_EQ(1, first);
+  EXPECT_EQ(0, second);
+  Advance(TimeDelta::FromSeconds(4));
+  EXPECT_EQ(1, first);
+  EXPECT_EQ(1, second);
+}
+
+TEST_F(UmTimerWheelTest, TimersWithinSlackShareWakeup) {
+  TimerWheel wheel(&fake_clock_, TimeDelta::FromSeconds(10));
+  int first = 0, second = 0, third = 0;
+  wheel.Schedule(TimeDelta::FromSeconds(3), Bind(&Increment, &first));
+  wheel.Schedule(TimeDelta::FromSeconds(7), Bind(&Increment, &second));
+  wheel.Schedule(TimeDelta::FromSeconds(12), Bind(&Increment, &third));
+
+  // Nothing fires before the end of the slot.
+  Advance(TimeDelta::FromSeconds(9));
+  EXPECT_EQ(0, first);
+  EXPECT_EQ(0, second);
+
+  Advance(TimeDelta::FromSeconds(1));
+  EXPECT_EQ(1, first);
+  EXPECT_EQ(1, second);
+  EXPECT_EQ(0, third);
+
+  Advance(TimeDelta::FromSeconds(10));
+  EXPECT_EQ(1, third);
+}
+
+TEST_F(UmTimerWheelTest, CancelledTimersDontFire) {
+  TimerWheel wheel(&fake_clock_, TimeDelta::FromSeconds(10));
+  int first = 0, second = 0;
+  TimerWheel::TimerId first_id =
+      wheel.Schedule(TimeDelta::FromSeconds(3), Bind(&Increment, &first));
+  TimerWheel::TimerId second_id =
+      wheel.Schedule(TimeDelta::FromSeconds(15), Bind(&Increment, &second));
+  EXPECT_NE(first_id, second_id);
+
+  EXPECT_TRUE(wheel.Cancel(first_id));
+  EXPECT_FALSE(wheel.Cancel(first_id));
+  Advance(TimeDelta::FromSeconds(10));
+  EXPECT_EQ(0, first);
+  EXPECT_EQ(0, second);
+
+  // Cancelling the last timer removes the wakeup from the main loop.
+  EXPECT_TRUE(loop_.PendingTasks());
+  EXPECT_TRUE(wheel.Cancel(second_id));
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(UmTimerWheelTest, EarlierTimerReschedulesWakeup) {
+  TimerWheel wheel(&fake_clock_, TimeDelta());
+  int first = 0, second = 0;
+  wheel.Schedule(TimeDelta::FromSeconds(20), Bind(&Increment, &first));
+  wheel.Schedule(TimeDelta::FromSeconds(5), Bind(&Increment, &second));
+
+  Advance(TimeDelta::FromSeconds(5));
+  EXPECT_EQ(0, first);
+  EXPECT_EQ(1, second);
+  Advance(TimeDelta::FromSeconds(15));
+  EXPECT_EQ(1, first);
+}
+
+}  // namespace chromeos_update_manager
@@ -22,6 +22,7 @@
 
 #include <base/bind.h>
 #include <base/location.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/update_manager/evaluation_context.h"
@@ -50,8 +51,14 @@ EvalStatus UpdateManager::EvaluatePolicy(
 
   const std::string policy_name = policy_->PolicyRequestName(policy_method);
   LOG(INFO) << policy_name << ": START";
+  if (policy_trace_) {
+    policy_trace_->StartEvaluation(policy_name, ec->reevaluation_cause(),
+                                   clock_->GetWallclockTime(),
+                                   clock_->GetMonotonicTime());
+  }
 
   // First try calling the actual policy.
+  base::Time start_time = clock_->GetMonotonicTime();
   std::string error;
   EvalStatus status = (policy_.get()->*policy_method)(ec, state_.get(), &error,
                                                       result, args...);
@@ -72,6 +79,10 @@ EvalStatus UpdateManager::EvaluatePolicy(
   }
 
   LOG(INFO) << policy_name << ": END";
+  if (policy_trace_ && !policy_trace_->EndEvaluation())
+    LOG(WARNING) << "Failed to record the evaluation in the policy trace.";
+  policy_stats_.RecordEvaluation(policy_name, status,
+                                 clock_->GetMonotonicTime() - start_time);
 
   return status;
 }
@@ -84,9 +95,24 @@ void UpdateManager::OnPolicyReadyToEvaluate(
                                         std::string*, R*,
                                         Args...) const,
     Args... args) {
-  // Evaluate the policy.
+  // Evaluate the policy. A re-evaluation whose inputs didn't change since the
+  // previous one would block again, so the policy isn't called in that case.
+  // An expired context is always evaluated, to report and reset it.
   R result;
-  EvalStatus status = EvaluatePolicy(ec.get(), policy_method, &result, args...);
+  EvalStatus status;
+  bool skipped = !ec->is_expired() && ec->ReplayEvaluation();
+  if (skipped) {
+    DLOG(INFO) << policy_->PolicyRequestName(policy_method)
+               << ": inputs unchanged, skipping evaluation";
+    status = EvalStatus::kAskMeAgainLater;
+  } else {
+    status = EvaluatePolicy(ec.get(), policy_method, &result, args...);
+  }
+  if (!ec->reevaluation_cause().empty()) {
+    policy_stats_.RecordReevaluation(policy_->PolicyRequestName(policy_method),
+                                     ec->reevaluation_cause(), skipped,
+                                     clock_->GetWallclockTime());
+  }
 
   if (status != EvalStatus::kAskMeAgainLater) {
     // AsyncPolicyRequest finished.
@@ -119,6 +145,8 @@ EvalStatus UpdateManager::PolicyRequest(
     R* result, ActualArgs... args) {
   scoped_refptr<EvaluationContext> ec(
       new EvaluationContext(clock_, evaluation_timeout_));
+  ec->set_stats(&policy_stats_);
+  ec->set_trace(policy_trace_.get());
   // A PolicyRequest always consists on a single evaluation on a new
   // EvaluationContext.
   // IMPORTANT: To ensure that ActualArgs can be converted to ExpectedArgs, we
@@ -147,6 +175,9 @@ void UpdateManager::AsyncPolicyRequest(
               new base::Callback<void(EvaluationContext*)>(
                   base::Bind(&UpdateManager::UnregisterEvalContext,
                              weak_ptr_factory_.GetWeakPtr()))));
+  ec->set_stats(&policy_stats_);
+  ec->set_trace(policy_trace_.get());
+  ec->set_timer_wheel(&timer_wheel_);
   if (!ec_repo_.insert(ec.get()).second) {
     LOG(ERROR) << "Failed to register evaluation context; this is a bug.";
   }
@@ -27,6 +27,7 @@ UpdateManager::UpdateManager(chromeos_update_engine::ClockInterface* clock,
       : default_policy_(clock), state_(state), clock_(clock),
         evaluation_timeout_(evaluation_timeout),
         expiration_timeout_(expiration_timeout),
+        timer_wheel_(clock, base::TimeDelta()),
         weak_ptr_factory_(this) {
   // TODO(deymo): Make it possible to replace this policy with a different
   // implementation with a build-time flag.
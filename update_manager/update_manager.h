@@ -29,7 +29,10 @@
 #include "update_engine/update_manager/default_policy.h"
 #include "update_engine/update_manager/evaluation_context.h"
 #include "update_engine/update_manager/policy.h"
+#include "update_engine/update_manager/policy_stats.h"
+#include "update_engine/update_manager/policy_trace.h"
 #include "update_engine/update_manager/state.h"
+#include "update_engine/update_manager/timer_wheel.h"
 
 namespace chromeos_update_manager {
 
@@ -91,6 +94,21 @@ class UpdateManager {
                                           ExpectedArgs...) const,
       ActualArgs... args);
 
+  // Returns the counters and timings of the policy evaluations done so far.
+  PolicyStats* policy_stats() { return &policy_stats_; }
+
+  // Records the variable values read by the policy evaluations in the passed
+  // |trace|, taking its ownership. Used to replay them offline with the
+  // update_engine_policy_benchmark. Disabled by default.
+  void set_policy_trace(PolicyTrace* trace) { policy_trace_.reset(trace); }
+
+  // Sets how much the re-evaluation timeouts of the async policy requests may
+  // be delayed, so that those due at about the same time are served by a
+  // single wakeup. Defaults to no delay.
+  void set_timer_slack(base::TimeDelta slack) {
+    timer_wheel_.set_slack(slack);
+  }
+
  protected:
   // The UpdateManager receives ownership of the passed Policy instance.
   void set_policy(const Policy* policy) {
@@ -151,12 +169,22 @@ class UpdateManager {
   // Pointer to the mockable clock interface;
   chromeos_update_engine::ClockInterface* clock_;
 
+  // The counters and timings of the policy evaluations.
+  PolicyStats policy_stats_;
+
+  // The trace of the policy evaluations, if enabled. May be null.
+  std::unique_ptr<PolicyTrace> policy_trace_;
+
   // Timeout for a policy evaluation.
   const base::TimeDelta evaluation_timeout_;
 
   // Timeout for expiration of the evaluation context, used for async requests.
   const base::TimeDelta expiration_timeout_;
 
+  // The timer wheel shared by the contexts of the async policy requests. It
+  // must outlive the contexts in |ec_repo_|.
+  TimerWheel timer_wheel_;
+
   // Repository of previously created EvaluationContext objects. These are being
   // unregistered (and the reference released) when the context is being
   // destructed; alternatively, when the UpdateManager instance is destroyed, it
@@ -167,6 +167,32 @@ class DelayPolicy : public DefaultPolicy {
   int* num_called_p_;
 };
 
+// A policy that waits until a forced update is requested, returning
+// EvalStatus::kAskMeAgainLater otherwise. Increments a counter every time it is
+// being queried.
+class ForcedUpdatePolicy : public DefaultPolicy {
+ public:
+  explicit ForcedUpdatePolicy(int* num_called_p)
+      : num_called_p_(num_called_p) {}
+  EvalStatus UpdateCheckAllowed(EvaluationContext* ec, State* state,
+                                string* error,
+                                UpdateCheckParams* result) const override {
+    (*num_called_p_)++;
+    const UpdateRequestStatus* forced_update_requested = ec->GetValue(
+        state->updater_provider()->var_forced_update_requested());
+    if (forced_update_requested &&
+        *forced_update_requested != UpdateRequestStatus::kNone)
+      return EvalStatus::kSucceeded;
+    return EvalStatus::kAskMeAgainLater;
+  }
+
+ protected:
+  string PolicyName() const override { return "ForcedUpdatePolicy"; }
+
+ private:
+  int* num_called_p_;
+};
+
 // AccumulateCallsCallback() adds to the passed |acc| accumulator vector pairs
 // of EvalStatus and T instances. This allows to create a callback that keeps
 // track of when it is called and the arguments passed to it, to be used with
@@ -322,4 +348,40 @@ TEST_F(UmUpdateManagerTest, AsyncPolicyRequestTimesOut) {
   EXPECT_EQ(EvalStatus::kSucceeded, calls[0].first);
 }
 
+TEST_F(UmUpdateManagerTest, AsyncPolicyRequestSkipsUnchangedInputs) {
+  // A reevaluation triggered by a variable that didn't change its value
+  // doesn't call the policy, which would block again.
+  int num_called = 0;
+  umut_->set_policy(new ForcedUpdatePolicy(&num_called));
+  FakeVariable<UpdateRequestStatus>* var =
+      fake_state_->updater_provider()->var_forced_update_requested();
+
+  vector<pair<EvalStatus, UpdateCheckParams>> calls;
+  Callback<void(EvalStatus, const UpdateCheckParams&)> callback =
+      Bind(AccumulateCallsCallback<UpdateCheckParams>, &calls);
+
+  var->reset(new UpdateRequestStatus(UpdateRequestStatus::kNone));
+  umut_->AsyncPolicyRequest(callback, &Policy::UpdateCheckAllowed);
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(1, num_called);
+  EXPECT_EQ(0U, calls.size());
+
+  var->reset(new UpdateRequestStatus(UpdateRequestStatus::kNone));
+  var->NotifyValueChanged();
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(1, num_called);
+  EXPECT_EQ(0U, calls.size());
+
+  var->reset(new UpdateRequestStatus(UpdateRequestStatus::kPeriodic));
+  var->NotifyValueChanged();
+  MessageLoopRunMaxIterations(MessageLoop::current(), 100);
+  EXPECT_EQ(2, num_called);
+  ASSERT_EQ(1U, calls.size());
+  EXPECT_EQ(EvalStatus::kSucceeded, calls[0].first);
+
+  PolicyStats::Summary summary = umut_->policy_stats()->TakeSummary();
+  EXPECT_EQ(2, summary.evaluations);
+  EXPECT_EQ(1, summary.skipped_evaluations);
+}
+
 }  // namespace chromeos_update_manager
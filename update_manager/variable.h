@@ -114,6 +114,11 @@ class BaseVariable {
   BaseVariable(const std::string& name, base::TimeDelta poll_interval)
       : BaseVariable(name, kVariableModePoll, poll_interval) {}
 
+  // Returns whether there are observers registered on the variable.
+  bool HasObservers() const {
+    return !observer_list_.empty();
+  }
+
   // Calls ValueChanged on all the observers.
   void NotifyValueChanged() {
     // Fire all the observer methods from the main loop as single call. In order
@@ -0,0 +1,229 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/url_probe_action.h"
+
+#include <algorithm>
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+#include "update_engine/common/clock_interface.h"
+#include "update_engine/payload_state_interface.h"
+
+using base::TimeDelta;
+using brillo::MessageLoop;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Another URL is only switched to if it's at least this much faster than the
+// current one, so the order of the URLs in the response is kept when they're
+// about as fast.
+const double kMinSpeedup = 1.5;
+
+}  // namespace
+
+const size_t UrlProbeAction::kMaxProbedUrls = 3;
+const size_t UrlProbeAction::kProbeLength = 256 * 1024;  // 256 KiB
+const int UrlProbeAction::kProbeTimeoutSeconds = 10;
+
+UrlProbeAction::UrlProbeAction(SystemState* system_state,
+                               const FetcherFactory& fetcher_factory)
+    : system_state_(system_state), fetcher_factory_(fetcher_factory) {}
+
+UrlProbeAction::~UrlProbeAction() {
+  MessageLoop::current()->CancelTask(timeout_id_);
+}
+
+void UrlProbeAction::PerformAction() {
+  CHECK(HasInputObject());
+  const OmahaResponse& response = GetInputObject();
+  if (HasOutputPipe())
+    SetOutputObject(response);
+  if (!ShouldProbe(response)) {
+    processor_->ActionComplete(this, ErrorCode::kSuccess);
+    return;
+  }
+
+  vector<string> urls = system_state_->payload_state()->GetCandidateUrls();
+  probes_.resize(std::min(kMaxProbedUrls, urls.size()));
+  for (size_t i = 0; i < probes_.size(); i++) {
+    Probe* probe = &probes_[i];
+    probe->url_index = i;
+    probe->fetcher.reset(fetcher_factory_.Run());
+    probe->fetcher->set_delegate(this);
+    probe->fetcher->SetOffset(0);
+    probe->fetcher->SetLength(kProbeLength);
+    probe->fetcher->set_max_retry_count(0);
+  }
+  timeout_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&UrlProbeAction::ProbeTimeout, base::Unretained(this)),
+      TimeDelta::FromSeconds(kProbeTimeoutSeconds));
+
+  // The fetchers may fail right away, so the action can only complete once
+  // all of them were started.
+  LOG(INFO) << "Probing the first " << probes_.size() << " of the "
+            << urls.size() << " candidate URLs.";
+  starting_ = true;
+  num_pending_probes_ = probes_.size();
+  for (Probe& probe : probes_) {
+    probe.start_time = system_state_->clock()->GetMonotonicTime();
+    probe.fetcher->BeginTransfer(urls[probe.url_index]);
+  }
+  starting_ = false;
+  MaybeFinish();
+}
+
+void UrlProbeAction::TerminateProcessing() {
+  terminating_ = true;
+  MessageLoop::current()->CancelTask(timeout_id_);
+  timeout_id_ = MessageLoop::kTaskIdNull;
+  for (Probe& probe : probes_) {
+    if (!probe.done)
+      probe.fetcher->TerminateTransfer();
+  }
+}
+
+void UrlProbeAction::ReceivedBytes(HttpFetcher* fetcher,
+                                   const void* bytes,
+                                   size_t length) {
+  Probe* probe = FindProbe(fetcher);
+  if (!probe || probe->done || length == 0)
+    return;
+  const TimeDelta elapsed =
+      system_state_->clock()->GetMonotonicTime() - probe->start_time;
+  if (probe->bytes_received == 0)
+    probe->time_to_first_byte = elapsed;
+  probe->bytes_received += length;
+  probe->duration = elapsed;
+  // Not all the servers honor the range.
+  if (probe->bytes_received >= kProbeLength)
+    fetcher->TerminateTransfer();
+}
+
+void UrlProbeAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  ProbeDone(fetcher, successful);
+}
+
+void UrlProbeAction::TransferTerminated(HttpFetcher* fetcher) {
+  // The probes are only terminated once they received enough data or the time
+  // is up, and the data received so far is still a measure of their speed.
+  ProbeDone(fetcher, true);
+}
+
+bool UrlProbeAction::ShouldProbe(const OmahaResponse& response) {
+  if (!response.update_exists)
+    return false;
+  PayloadStateInterface* const payload_state = system_state_->payload_state();
+  // Only the first attempt with a response is probed, so once the chosen URL
+  // fails too many times the next ones are tried as usual.
+  if (payload_state->GetUrlSwitchCount() > 0 ||
+      payload_state->GetUrlFailureCount() > 0) {
+    return false;
+  }
+  // The local peer is used instead of the candidate URLs.
+  if (payload_state->GetUsingP2PForDownloading() &&
+      !payload_state->GetP2PUrl().empty()) {
+    return false;
+  }
+  return payload_state->GetCandidateUrls().size() > 1;
+}
+
+UrlProbeAction::Probe* UrlProbeAction::FindProbe(HttpFetcher* fetcher) {
+  for (Probe& probe : probes_) {
+    if (probe.fetcher.get() == fetcher)
+      return &probe;
+  }
+  return nullptr;
+}
+
+void UrlProbeAction::ProbeDone(HttpFetcher* fetcher, bool successful) {
+  Probe* probe = FindProbe(fetcher);
+  if (!probe || probe->done)
+    return;
+  probe->done = true;
+  probe->successful = successful && probe->bytes_received > 0;
+  if (probe->duration.is_zero()) {
+    probe->duration =
+        system_state_->clock()->GetMonotonicTime() - probe->start_time;
+  }
+  num_pending_probes_--;
+  MaybeFinish();
+}
+
+void UrlProbeAction::ProbeTimeout() {
+  timeout_id_ = MessageLoop::kTaskIdNull;
+  LOG(INFO) << "Stopping the " << num_pending_probes_
+            << " URL probes still running.";
+  for (Probe& probe : probes_) {
+    if (!probe.done)
+      probe.fetcher->TerminateTransfer();
+  }
+}
+
+void UrlProbeAction::MaybeFinish() {
+  if (starting_ || terminating_ || num_pending_probes_ > 0)
+    return;
+  MessageLoop::current()->CancelTask(timeout_id_);
+  timeout_id_ = MessageLoop::kTaskIdNull;
+
+  int fastest = SelectFastestUrl();
+  if (fastest >= 0) {
+    system_state_->payload_state()->SwitchToUrl(probes_[fastest].url_index);
+  } else {
+    LOG(INFO) << "Keeping the current URL.";
+  }
+  processor_->ActionComplete(this, ErrorCode::kSuccess);
+}
+
+int UrlProbeAction::SelectFastestUrl() const {
+  // The speed of each probe in bytes per second, or zero if it failed. The
+  // time to the first byte is part of the duration.
+  vector<double> speeds;
+  for (const Probe& probe : probes_) {
+    double speed = 0;
+    if (probe.successful) {
+      speed = probe.bytes_received /
+              std::max(probe.duration,
+                       TimeDelta::FromMilliseconds(1)).InSecondsF();
+    }
+    LOG(INFO) << "URL index " << probe.url_index << ": "
+              << (probe.successful ? "" : "failed, ") << probe.bytes_received
+              << " bytes in " << probe.duration.InMilliseconds()
+              << " ms, first byte after "
+              << probe.time_to_first_byte.InMilliseconds() << " ms.";
+    speeds.push_back(speed);
+  }
+  if (speeds.empty())
+    return -1;
+
+  size_t fastest = 0;
+  for (size_t i = 1; i < speeds.size(); i++) {
+    if (speeds[i] > speeds[fastest])
+      fastest = i;
+  }
+  if (fastest == 0 || speeds[fastest] < kMinSpeedup * speeds[0])
+    return -1;
+  return fastest;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,137 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#ifndef UPDATE_ENGINE_URL_PROBE_ACTION_H_
+#define UPDATE_ENGINE_URL_PROBE_ACTION_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
+#include "update_engine/common/action.h"
+#include "update_engine/common/http_fetcher.h"
+#include "update_engine/omaha_response.h"
+#include "update_engine/system_state.h"
+
+// The UrlProbeAction fetches the start of the payload from the first candidate
+// URLs of an Omaha response in parallel, and makes the fastest one the current
+// URL of the PayloadState before the download starts. The response is passed
+// through unchanged.
+
+namespace chromeos_update_engine {
+
+class UrlProbeAction;
+
+template<>
+class ActionTraits<UrlProbeAction> {
+ public:
+  typedef OmahaResponse InputObjectType;
+  typedef OmahaResponse OutputObjectType;
+};
+
+class UrlProbeAction : public Action<UrlProbeAction>,
+                       public HttpFetcherDelegate {
+ public:
+  // Returns a new HttpFetcher for probing a URL, owned by the caller.
+  using FetcherFactory = base::Callback<HttpFetcher*()>;
+
+  // The number of candidate URLs probed, the number of bytes fetched from each
+  // one and the maximum time the probes take.
+  static const size_t kMaxProbedUrls;
+  static const size_t kProbeLength;
+  static const int kProbeTimeoutSeconds;
+
+  UrlProbeAction(SystemState* system_state,
+                 const FetcherFactory& fetcher_factory);
+  ~UrlProbeAction() override;
+
+  typedef ActionTraits<UrlProbeAction>::InputObjectType InputObjectType;
+  typedef ActionTraits<UrlProbeAction>::OutputObjectType OutputObjectType;
+  void PerformAction() override;
+  void TerminateProcessing() override;
+
+  // Debugging/logging
+  static std::string StaticType() { return "UrlProbeAction"; }
+  std::string Type() const override { return StaticType(); }
+
+  // HttpFetcherDelegate methods.
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+ private:
+  FRIEND_TEST(UrlProbeActionTest, SelectFastestUrlTest);
+
+  // The probe of a single candidate URL.
+  struct Probe {
+    uint32_t url_index{0};
+    std::unique_ptr<HttpFetcher> fetcher;
+    base::Time start_time;
+    base::TimeDelta time_to_first_byte;
+    base::TimeDelta duration;
+    uint64_t bytes_received{0};
+    bool done{false};
+    bool successful{false};
+  };
+
+  // Returns whether the probes should run for the |response|.
+  bool ShouldProbe(const OmahaResponse& response);
+
+  // Returns the probe of the |fetcher|.
+  Probe* FindProbe(HttpFetcher* fetcher);
+
+  // Marks the probe of |fetcher| as finished and completes the action once all
+  // of them are.
+  void ProbeDone(HttpFetcher* fetcher, bool successful);
+
+  // Stops the probes still running once the time is up.
+  void ProbeTimeout();
+
+  // Switches to the fastest URL, if it's the fastest by far, and completes
+  // the action once all the probes finished.
+  void MaybeFinish();
+
+  // Returns the index in |probes_| of the URL to switch to, or -1 to keep the
+  // current URL, which is the first probed one.
+  int SelectFastestUrl() const;
+
+  // Global system context.
+  SystemState* system_state_;
+
+  FetcherFactory fetcher_factory_;
+  std::vector<Probe> probes_;
+  size_t num_pending_probes_{0};
+
+  // Whether the probes are being started, or the processing was terminated.
+  bool starting_{false};
+  bool terminating_{false};
+
+  brillo::MessageLoop::TaskId timeout_id_{brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(UrlProbeAction);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_URL_PROBE_ACTION_H_
@@ -0,0 +1,203 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/url_probe_action.h"
+
+#include <string>
+#include <vector>
+
+#include <base/bind.h>
+#include <brillo/bind_lambda.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/action_processor.h"
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/fake_system_state.h"
+#include "update_engine/mock_payload_state.h"
+
+using base::TimeDelta;
+using std::string;
+using std::vector;
+using testing::Return;
+using testing::_;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+class UrlProbeActionTestProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    if (action->Type() == UrlProbeAction::StaticType()) {
+      code_ = code;
+      code_set_ = true;
+    }
+  }
+
+  ErrorCode code_{ErrorCode::kError};
+  bool code_set_{false};
+};
+
+}  // namespace
+
+class UrlProbeActionTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    response_.update_exists = true;
+    response_.payload_urls = {"http://a/", "http://b/", "http://c/"};
+    MockPayloadState* payload_state = fake_system_state_.mock_payload_state();
+    ON_CALL(*payload_state, GetCandidateUrls())
+        .WillByDefault(Return(response_.payload_urls));
+    ON_CALL(*payload_state, GetUrlSwitchCount()).WillByDefault(Return(0));
+    ON_CALL(*payload_state, GetUrlFailureCount()).WillByDefault(Return(0));
+  }
+
+  void TearDown() override {
+    EXPECT_FALSE(loop_.PendingTasks());
+  }
+
+  // Returns a new fetcher for the next probe, which fails if its index is in
+  // |failing_fetchers_|.
+  HttpFetcher* NewFetcher() {
+    MockHttpFetcher* fetcher =
+        new MockHttpFetcher(probe_data_.data(), probe_data_.size(), nullptr);
+    for (size_t index : failing_fetchers_) {
+      if (index == num_fetchers_)
+        fetcher->FailTransfer(404);
+    }
+    num_fetchers_++;
+    return fetcher;
+  }
+
+  // Runs the UrlProbeAction on |response_| and checks it passed it through.
+  void RunAction() {
+    ActionProcessor processor;
+    UrlProbeActionTestProcessorDelegate delegate;
+    processor.set_delegate(&delegate);
+
+    ObjectFeederAction<OmahaResponse> feeder_action;
+    feeder_action.set_obj(response_);
+    UrlProbeAction probe_action(
+        &fake_system_state_,
+        base::Bind([this]() { return NewFetcher(); }));
+    ObjectCollectorAction<OmahaResponse> collector_action;
+    BondActions(&feeder_action, &probe_action);
+    BondActions(&probe_action, &collector_action);
+    processor.EnqueueAction(&feeder_action);
+    processor.EnqueueAction(&probe_action);
+    processor.EnqueueAction(&collector_action);
+
+    loop_.PostTask(base::Bind([&processor] {
+      processor.StartProcessing();
+    }));
+    loop_.Run();
+    EXPECT_TRUE(delegate.code_set_);
+    EXPECT_EQ(ErrorCode::kSuccess, delegate.code_);
+    EXPECT_EQ(response_.payload_urls, collector_action.object().payload_urls);
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakeSystemState fake_system_state_;
+  OmahaResponse response_;
+  brillo::Blob probe_data_ = brillo::Blob(1000, 'x');
+  vector<size_t> failing_fetchers_;
+  size_t num_fetchers_{0};
+};
+
+TEST_F(UrlProbeActionTest, NoUpdateTest) {
+  response_.update_exists = false;
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), SwitchToUrl(_))
+      .Times(0);
+  RunAction();
+  EXPECT_EQ(0U, num_fetchers_);
+}
+
+TEST_F(UrlProbeActionTest, AlreadySwitchedUrlTest) {
+  // The URLs aren't probed again after a URL switch.
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), GetUrlSwitchCount())
+      .WillRepeatedly(Return(1));
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), SwitchToUrl(_))
+      .Times(0);
+  RunAction();
+  EXPECT_EQ(0U, num_fetchers_);
+}
+
+TEST_F(UrlProbeActionTest, SingleUrlTest) {
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), GetCandidateUrls())
+      .WillRepeatedly(Return(vector<string>{"http://a/"}));
+  RunAction();
+  EXPECT_EQ(0U, num_fetchers_);
+}
+
+TEST_F(UrlProbeActionTest, EquallyFastUrlsTest) {
+  // The current URL is kept when the others aren't faster.
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), SwitchToUrl(_))
+      .Times(0);
+  RunAction();
+  EXPECT_EQ(3U, num_fetchers_);
+}
+
+TEST_F(UrlProbeActionTest, FailingCurrentUrlTest) {
+  failing_fetchers_ = {0};
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), SwitchToUrl(1));
+  RunAction();
+  EXPECT_EQ(3U, num_fetchers_);
+}
+
+TEST_F(UrlProbeActionTest, AllUrlsFailingTest) {
+  failing_fetchers_ = {0, 1, 2};
+  EXPECT_CALL(*fake_system_state_.mock_payload_state(), SwitchToUrl(_))
+      .Times(0);
+  RunAction();
+}
+
+TEST_F(UrlProbeActionTest, SelectFastestUrlTest) {
+  UrlProbeAction probe_action(&fake_system_state_,
+                              base::Bind([this]() { return NewFetcher(); }));
+  probe_action.probes_.resize(3);
+  for (size_t i = 0; i < 3; i++) {
+    probe_action.probes_[i].url_index = i;
+    probe_action.probes_[i].successful = true;
+    probe_action.probes_[i].bytes_received = UrlProbeAction::kProbeLength;
+  }
+  probe_action.probes_[0].duration = TimeDelta::FromSeconds(2);
+  probe_action.probes_[1].duration = TimeDelta::FromMilliseconds(1500);
+  probe_action.probes_[2].duration = TimeDelta::FromSeconds(1);
+  EXPECT_EQ(2, probe_action.SelectFastestUrl());
+
+  // Slightly faster URLs aren't switched to.
+  probe_action.probes_[2].duration = TimeDelta::FromMilliseconds(1500);
+  EXPECT_EQ(-1, probe_action.SelectFastestUrl());
+
+  // The partial transfers still count.
+  probe_action.probes_[1].bytes_received = UrlProbeAction::kProbeLength / 2;
+  probe_action.probes_[1].duration = TimeDelta::FromMilliseconds(100);
+  EXPECT_EQ(1, probe_action.SelectFastestUrl());
+}
+
+}  // namespace chromeos_update_engine
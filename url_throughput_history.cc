@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/url_throughput_history.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/constants.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The weight of the history of a host is capped so the new samples always
+// count, and the hosts the weight of which decayed below the minimum are
+// dropped.
+const double kMaxWeight = 8.0;
+const double kMinWeight = 0.1;
+
+// Returns the lowercase "scheme://host:port" prefix of the |url|, or an empty
+// string if it has no scheme.
+string UrlOrigin(const string& url) {
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == string::npos)
+    return "";
+  const size_t origin_end = url.find_first_of("/?#", scheme_end + 3);
+  return base::ToLowerASCII(url.substr(0, origin_end));
+}
+
+}  // namespace
+
+const int UrlThroughputHistory::kHalfLifeDays = 7;
+const size_t UrlThroughputHistory::kMaxHosts = 16;
+const uint64_t UrlThroughputHistory::kMinSampleBytes = 1024 * 1024;
+const uint64_t UrlThroughputHistory::kReferenceBytes = 1024 * 1024;
+
+UrlThroughputHistory::UrlThroughputHistory(PrefsInterface* prefs,
+                                           ClockInterface* clock)
+    : prefs_(prefs), clock_(clock) {}
+
+void UrlThroughputHistory::Load() {
+  hosts_.clear();
+  string value;
+  if (!prefs_->Exists(kPrefsUrlThroughputHistory) ||
+      !prefs_->GetString(kPrefsUrlThroughputHistory, &value)) {
+    return;
+  }
+  // Each line holds the origin, the throughput in bytes per second, the time
+  // to first byte in milliseconds, the weight and the internal value of the
+  // time of the last update of a host.
+  for (const string& line : base::SplitString(
+           value, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    vector<string> fields = base::SplitString(
+        line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    HostHistory history;
+    int64_t last_update = 0;
+    if (fields.size() != 5 ||
+        !base::StringToDouble(fields[1], &history.throughput_bps) ||
+        !base::StringToDouble(fields[2], &history.time_to_first_byte_ms) ||
+        !base::StringToDouble(fields[3], &history.weight) ||
+        !base::StringToInt64(fields[4], &last_update) ||
+        history.throughput_bps <= 0 || history.time_to_first_byte_ms < 0 ||
+        history.weight <= 0) {
+      LOG(WARNING) << "Ignoring the invalid URL throughput history: " << line;
+      continue;
+    }
+    history.last_update = Time::FromInternalValue(last_update);
+    hosts_[fields[0]] = history;
+  }
+  Prune();
+}
+
+void UrlThroughputHistory::AddTransfer(const string& url,
+                                       const TransferStats& stats) {
+  const string origin = UrlOrigin(url);
+  if (origin.empty() || stats.bytes_received < kMinSampleBytes ||
+      stats.throughput_bps <= 0) {
+    return;
+  }
+  const double time_to_first_byte_ms =
+      stats.time_to_first_byte.InMillisecondsF();
+  auto it = hosts_.find(origin);
+  if (it == hosts_.end()) {
+    hosts_[origin] = {static_cast<double>(stats.throughput_bps),
+                      time_to_first_byte_ms,
+                      1.0,
+                      clock_->GetWallclockTime()};
+  } else {
+    // The new sample is averaged with the decayed history.
+    HostHistory* history = &it->second;
+    const double weight = DecayedWeight(*history);
+    history->throughput_bps =
+        (history->throughput_bps * weight + stats.throughput_bps) /
+        (weight + 1);
+    history->time_to_first_byte_ms =
+        (history->time_to_first_byte_ms * weight + time_to_first_byte_ms) /
+        (weight + 1);
+    history->weight = std::min(weight + 1, kMaxWeight);
+    history->last_update = clock_->GetWallclockTime();
+  }
+  LOG(INFO) << "The throughput of " << origin << " is now "
+            << static_cast<int64_t>(hosts_[origin].throughput_bps)
+            << " bytes per second.";
+  Prune();
+  Save();
+}
+
+vector<size_t> UrlThroughputHistory::OrderUrls(
+    const vector<string>& urls) const {
+  vector<TimeDelta> expected_times;
+  vector<size_t> order;
+  for (size_t i = 0; i < urls.size(); i++) {
+    expected_times.push_back(ExpectedTime(urls[i]));
+    order.push_back(i);
+  }
+  std::stable_sort(order.begin(),
+                   order.end(),
+                   [&expected_times](size_t a, size_t b) {
+                     const TimeDelta time_a = expected_times[a];
+                     const TimeDelta time_b = expected_times[b];
+                     if (time_a.is_zero() || time_b.is_zero())
+                       return !time_a.is_zero() && time_b.is_zero();
+                     return time_a < time_b;
+                   });
+  return order;
+}
+
+TimeDelta UrlThroughputHistory::ExpectedTime(const string& url) const {
+  auto it = hosts_.find(UrlOrigin(url));
+  if (it == hosts_.end() || DecayedWeight(it->second) < kMinWeight)
+    return TimeDelta();
+  const HostHistory& history = it->second;
+  const double expected_ms = history.time_to_first_byte_ms +
+                             kReferenceBytes * 1000.0 / history.throughput_bps;
+  return TimeDelta::FromMicroseconds(static_cast<int64_t>(expected_ms * 1000));
+}
+
+double UrlThroughputHistory::DecayedWeight(const HostHistory& history) const {
+  const TimeDelta age = clock_->GetWallclockTime() - history.last_update;
+  // The clock may have been set back.
+  if (age <= TimeDelta())
+    return history.weight;
+  return history.weight *
+         pow(0.5, age.InSecondsF() / TimeDelta::FromDays(kHalfLifeDays)
+                                         .InSecondsF());
+}
+
+void UrlThroughputHistory::Prune() {
+  for (auto it = hosts_.begin(); it != hosts_.end();) {
+    if (DecayedWeight(it->second) < kMinWeight)
+      it = hosts_.erase(it);
+    else
+      ++it;
+  }
+  while (hosts_.size() > kMaxHosts) {
+    auto oldest = std::min_element(
+        hosts_.begin(),
+        hosts_.end(),
+        [](const std::pair<const string, HostHistory>& a,
+           const std::pair<const string, HostHistory>& b) {
+          return a.second.last_update < b.second.last_update;
+        });
+    hosts_.erase(oldest);
+  }
+}
+
+void UrlThroughputHistory::Save() {
+  string value;
+  for (const auto& host : hosts_) {
+    value += base::StringPrintf("%s %.0f %.0f %.3f %" PRId64 "\n",
+                                host.first.c_str(),
+                                host.second.throughput_bps,
+                                host.second.time_to_first_byte_ms,
+                                host.second.weight,
+                                host.second.last_update.ToInternalValue());
+  }
+  prefs_->SetString(kPrefsUrlThroughputHistory, value);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,104 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_URL_THROUGHPUT_HISTORY_H_
+#define UPDATE_ENGINE_URL_THROUGHPUT_HISTORY_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/throughput_estimator.h"
+
+namespace chromeos_update_engine {
+
+// UrlThroughputHistory keeps the throughput and the time to first byte of the
+// payload downloads from each host, persisted across the updates, so the
+// payload URLs of the hosts that were the fastest are tried first. The weight
+// of the old samples halves every kHalfLifeDays, so the history follows the
+// changes of the network the device is on.
+class UrlThroughputHistory {
+ public:
+  // The time after which a sample counts for half as much.
+  static const int kHalfLifeDays;
+  // The maximum number of hosts kept, the least recently used ones are
+  // dropped first.
+  static const size_t kMaxHosts;
+  // The transfers shorter than this don't tell much about the throughput and
+  // are ignored.
+  static const uint64_t kMinSampleBytes;
+  // The size of the download the hosts are compared by, which weighs their
+  // time to first byte against their throughput.
+  static const uint64_t kReferenceBytes;
+
+  UrlThroughputHistory(PrefsInterface* prefs, ClockInterface* clock);
+
+  // Loads the history from the prefs, dropping the hosts not used for too
+  // long.
+  void Load();
+
+  // Adds the |stats| of a download from |url| to the history of its host and
+  // persists it.
+  void AddTransfer(const std::string& url, const TransferStats& stats);
+
+  // Returns the indexes of the |urls| from the fastest host to the slowest.
+  // The URLs of the hosts without history follow, in the order of |urls|.
+  std::vector<size_t> OrderUrls(const std::vector<std::string>& urls) const;
+
+  // Returns the time the download of kReferenceBytes from the host of |url|
+  // is expected to take, or zero if there's no history for it.
+  base::TimeDelta ExpectedTime(const std::string& url) const;
+
+ private:
+  struct HostHistory {
+    double throughput_bps;
+    double time_to_first_byte_ms;
+    // The number of samples the averages are made of, decayed with their
+    // age.
+    double weight;
+    base::Time last_update;
+  };
+
+  // Returns the weight of the |history| decayed to the current time.
+  double DecayedWeight(const HostHistory& history) const;
+
+  // Drops the hosts the weight of which decayed too much, and the least
+  // recently updated ones past kMaxHosts.
+  void Prune();
+
+  // Persists the |hosts_| in the prefs.
+  void Save();
+
+  PrefsInterface* prefs_;
+  ClockInterface* clock_;
+
+  // The history of each host, by the lowercase "scheme://host:port" prefix of
+  // its URLs.
+  std::map<std::string, HostHistory> hosts_;
+
+  DISALLOW_COPY_AND_ASSIGN(UrlThroughputHistory);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_URL_THROUGHPUT_HISTORY_H_
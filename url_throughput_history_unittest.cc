@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/url_throughput_history.h"
+
+#include <string>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_clock.h"
+#include "update_engine/common/fake_prefs.h"
+
+using base::Time;
+using base::TimeDelta;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the stats of a transfer long enough to be a sample.
+TransferStats Transfer(int64_t throughput_bps, int time_to_first_byte_ms) {
+  TransferStats stats;
+  stats.throughput_bps = throughput_bps;
+  stats.time_to_first_byte =
+      TimeDelta::FromMilliseconds(time_to_first_byte_ms);
+  stats.bytes_received = UrlThroughputHistory::kMinSampleBytes;
+  return stats;
+}
+
+}  // namespace
+
+class UrlThroughputHistoryTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_clock_.SetWallclockTime(Time::FromInternalValue(12345678901234));
+  }
+
+  FakePrefs fake_prefs_;
+  FakeClock fake_clock_;
+  UrlThroughputHistory history_{&fake_prefs_, &fake_clock_};
+};
+
+TEST_F(UrlThroughputHistoryTest, AddTransferTest) {
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("https://a.com/payload"));
+  history_.AddTransfer("https://a.com/payload", Transfer(1024 * 1024, 100));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1100),
+            history_.ExpectedTime("https://a.com/payload"));
+  // The history is by host.
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1100),
+            history_.ExpectedTime("HTTPS://A.com/other/payload"));
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("http://a.com/payload"));
+
+  // The samples are averaged.
+  history_.AddTransfer("https://a.com/payload", Transfer(3 * 1024 * 1024, 300));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(700),
+            history_.ExpectedTime("https://a.com/payload"));
+
+  // The short transfers are ignored.
+  TransferStats short_transfer = Transfer(1024, 100);
+  short_transfer.bytes_received = 1024;
+  history_.AddTransfer("https://a.com/payload", short_transfer);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(700),
+            history_.ExpectedTime("https://a.com/payload"));
+
+  // The history is persisted.
+  EXPECT_TRUE(fake_prefs_.Exists(kPrefsUrlThroughputHistory));
+  UrlThroughputHistory loaded_history(&fake_prefs_, &fake_clock_);
+  loaded_history.Load();
+  EXPECT_EQ(TimeDelta::FromMilliseconds(700),
+            loaded_history.ExpectedTime("https://a.com/payload"));
+}
+
+TEST_F(UrlThroughputHistoryTest, DecayTest) {
+  history_.AddTransfer("https://a.com/payload", Transfer(1024 * 1024, 0));
+
+  // The old sample counts for half as much after a half-life.
+  fake_clock_.SetWallclockTime(
+      fake_clock_.GetWallclockTime() +
+      TimeDelta::FromDays(UrlThroughputHistory::kHalfLifeDays));
+  history_.AddTransfer("https://a.com/payload",
+                       Transfer(5 * 1024 * 1024 / 2, 0));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(500),
+            history_.ExpectedTime("https://a.com/payload"));
+
+  // The hosts not used for long are forgotten.
+  fake_clock_.SetWallclockTime(
+      fake_clock_.GetWallclockTime() +
+      TimeDelta::FromDays(10 * UrlThroughputHistory::kHalfLifeDays));
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("https://a.com/payload"));
+  UrlThroughputHistory loaded_history(&fake_prefs_, &fake_clock_);
+  loaded_history.Load();
+  EXPECT_EQ(TimeDelta(), loaded_history.ExpectedTime("https://a.com/payload"));
+}
+
+TEST_F(UrlThroughputHistoryTest, OrderUrlsTest) {
+  history_.AddTransfer("https://slow.com/payload", Transfer(100 * 1024, 100));
+  history_.AddTransfer("https://fast.com/payload", Transfer(1024 * 1024, 900));
+  history_.AddTransfer("https://faster.com/payload", Transfer(1024 * 1024, 0));
+  vector<string> urls = {"http://unknown.com/payload",
+                         "https://slow.com/payload",
+                         "https://other.com/payload",
+                         "https://fast.com/payload",
+                         "https://faster.com/payload"};
+  EXPECT_EQ(vector<size_t>({4, 3, 1, 0, 2}), history_.OrderUrls(urls));
+  EXPECT_EQ(vector<size_t>({}), history_.OrderUrls({}));
+}
+
+TEST_F(UrlThroughputHistoryTest, MaxHostsTest) {
+  for (size_t i = 0; i <= UrlThroughputHistory::kMaxHosts; i++) {
+    history_.AddTransfer(base::StringPrintf("https://host%zu.com/payload", i),
+                         Transfer(1024 * 1024, 0));
+    fake_clock_.SetWallclockTime(fake_clock_.GetWallclockTime() +
+                                 TimeDelta::FromMinutes(1));
+  }
+  // The least recently updated host is dropped.
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("https://host0.com/payload"));
+  EXPECT_NE(TimeDelta(), history_.ExpectedTime("https://host1.com/payload"));
+}
+
+TEST_F(UrlThroughputHistoryTest, InvalidPrefTest) {
+  fake_prefs_.SetString(kPrefsUrlThroughputHistory,
+                        "https://a.com 1048576 0 1.000 12345678901234\n"
+                        "https://b.com invalid 0 1.000 12345678901234\n"
+                        "https://c.com 1048576\n");
+  history_.Load();
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1000),
+            history_.ExpectedTime("https://a.com/payload"));
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("https://b.com/payload"));
+  EXPECT_EQ(TimeDelta(), history_.ExpectedTime("https://c.com/payload"));
+}
+
+}  // namespace chromeos_update_engine